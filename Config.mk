@@ -19,7 +19,8 @@
 # "DYNAMIC".
 
 # Debug message behaviour: Edit `INIT_DBG_MODES` in kernel/util/debug.c to set
-# which messages are shown.
+# which messages are shown, and `DBG_COMPILED_MODES` in
+# kernel/include/util/debug.h to compile the others out altogether.
 
 # Switches for non-required components. If you wish to try implementing
 # some extra features in Weenix, there are some pre-designed features
@@ -35,15 +36,15 @@
 # go breaking it, which we promise you will happen.
 
          SHADOWD=0 # shadow page cleanup
-        MOUNTING=0 # be able to mount multiple file systems
+        MOUNTING=1 # be able to mount multiple file systems
           GETCWD=0 # getcwd(3) syscall-like functionality
-        UPREEMPT=0 # userland preemption
+        UPREEMPT=1 # userland preemption
         KPREEMPT=0 # kernel space preemption
              MTP=0 # multiple kernel threads per process
            PIPES=0 # pipe(2) functionality
              SMP=0 # symmetric multiprocessing support
+        LOCKPROF=0 # lock contention profiling (kshell's "lockprof")
           VGABUF=0 # Use a rudimentary VGA buffers instead of VT support.
-	KPREEMPT=0
         RENAMEDIR=0
 
 # Set the number of terminals that we should be launching.
@@ -63,11 +64,11 @@
 
 # Parameters for the hard disk we build (must be compatible!)
 # If the FS is too big for the disk, BAD things happen!
-        DISK_BLOCKS=2048 # For fsmaker
+        DISK_BLOCKS=4096 # For fsmaker
         DISK_INODES=240  # For fsmaker
 
 # Boolean options specified in this specified in this file that should be
 # included as definitions at compile time
-        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP GETCWD RENAMEDIR UPREEMPT PIPES SMP KPREEMPT"
+        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP GETCWD RENAMEDIR UPREEMPT PIPES SMP LOCKPROF KPREEMPT "
 # As above, but not booleans
         COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE "
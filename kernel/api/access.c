@@ -11,41 +11,86 @@
 #include "api/access.h"
 #include "api/syscall.h"
 
+#include "main/interrupt.h"
+
+#include "vm/pagefault.h"
+
 static inline long userland_address(const void *addr)
 {
     return addr >= (void *)USER_MEM_LOW && addr < (void *)USER_MEM_HIGH;
 }
 
 /*
- * Check for permissions on [uaddr, uaddr + nbytes), then
- * copy nbytes from userland address uaddr to kernel address kaddr.
- * Do not access the userland virtual addresses directly; instead,
- * use vmmap_read.
+ * Whether [uaddr, uaddr + nbytes) lies within userland.
+ */
+static inline long userland_range(const void *uaddr, size_t nbytes)
+{
+    return userland_address(uaddr) &&
+           nbytes <= USER_MEM_HIGH - (uintptr_t)uaddr;
+}
+
+/*
+ * Copies between kernel and user memory are a plain rep movsb, which touches
+ * the user pages directly. If one is not mapped in, or is read-only (or
+ * copy-on-write) and being written to, the instruction faults, and
+ * user_copy_fault() serves the fault as if userland had made it, so the copy
+ * goes on. If the process is not allowed the access, user_copy() returns
+ * -EFAULT instead.
+ */
+long user_copy(void *dst, const void *src, size_t nbytes);
+extern char user_copy_insn[], user_copy_failed[];
+__asm__(".global user_copy\n"
+        "user_copy:\n\t"
+        "movq %rdx, %rcx\n"
+        ".global user_copy_insn\n"
+        "user_copy_insn:\n\t"
+        "rep movsb\n\t"
+        "xorl %eax, %eax\n\t"
+        "ret\n"
+        ".global user_copy_failed\n"
+        "user_copy_failed:\n\t"
+        "movq $-" QUOTE_BY_VALUE(EFAULT) ", %rax\n\t"
+        "ret\n");
+
+long user_copy_fault(regs_t *regs, uintptr_t vaddr, uintptr_t cause)
+{
+    if (regs->r_rip != (uintptr_t)user_copy_insn ||
+        !userland_address((void *)vaddr))
+    {
+        return 0;
+    }
+    if (pagefault_resolve(vaddr, cause | FAULT_USER))
+    {
+        regs->r_rip = (uintptr_t)user_copy_failed;
+    }
+    return 1;
+}
+
+/*
+ * Copy nbytes from userland address uaddr to kernel address kaddr. The
+ * vmarea protections are checked as the pages are faulted in.
  */
 long copy_from_user(void *kaddr, const void *uaddr, size_t nbytes)
 {
-    if (!range_perm(curproc, uaddr, nbytes, PROT_READ))
+    if (!userland_range(uaddr, nbytes))
     {
         return -EFAULT;
     }
-    KASSERT(userland_address(uaddr) && !userland_address(kaddr));
-    return vmmap_read(curproc->p_vmmap, uaddr, kaddr, nbytes);
+    KASSERT(!userland_address(kaddr));
+    return user_copy(kaddr, uaddr, nbytes);
 }
 
 /*
- * Check for permissions on [uaddr, uaddr + nbytes), then
- * copy nbytes from kernel address kaddr to userland address uaddr.
- * Do not access the userland virtual addresses directly; instead,
- * use vmmap_write.
+ * Copy nbytes from kernel address kaddr to userland address uaddr.
  */
 long copy_to_user(void *uaddr, const void *kaddr, size_t nbytes)
 {
-    if (!range_perm(curproc, uaddr, nbytes, PROT_WRITE))
+    if (!userland_range(uaddr, nbytes))
     {
         return -EFAULT;
     }
-    KASSERT(userland_address(uaddr) && !userland_address(kaddr));
-    return vmmap_write(curproc->p_vmmap, uaddr, kaddr, nbytes);
+    KASSERT(!userland_address(kaddr));
+    return user_copy(uaddr, kaddr, nbytes);
 }
 
 /*
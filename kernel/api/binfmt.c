@@ -79,10 +79,79 @@ long binfmt_load(const char *filename, char *const *argv, char *const *envp,
         ret = fmt->bf_load(filename, (int)fd, argv, envp, rip, rsp);
         if (ret != -ENOEXEC)
         {
-            do_close((int)fd);
+            break;
         }
     }
 
+    if (!ret)
+    {
+        file = fget((int)fd);
+        binfmt_cache_hold(file->f_vnode);
+        fput(&file);
+    }
     do_close((int)fd);
     return ret;
 }
+
+/*
+ * The exec cache: references to the vnodes of the last BINFMT_CACHE_SIZE
+ * distinct programs (and interpreters) that were loaded, so that their pages
+ * stay in the page cache after the last process running them exits, and
+ * spawning another copy reads nothing in. The pages can still be reclaimed;
+ * only the vnodes are pinned. When the cache is full, the least recently
+ * loaded vnode is let go.
+ */
+static struct
+{
+    vnode_t *bce_vnode;
+    uint64_t bce_used; /* binfmt_cache_clock when last loaded */
+} binfmt_cache[BINFMT_CACHE_SIZE];
+static uint64_t binfmt_cache_clock;
+static kmutex_t binfmt_cache_mutex = KMUTEX_INITIALIZER(binfmt_cache_mutex);
+
+void binfmt_cache_hold(vnode_t *vn)
+{
+    vnode_t *old = NULL;
+    kmutex_lock(&binfmt_cache_mutex);
+    size_t victim = 0;
+    for (size_t i = 0; i < BINFMT_CACHE_SIZE; i++)
+    {
+        if (binfmt_cache[i].bce_vnode == vn)
+        {
+            victim = i;
+            break;
+        }
+        if (binfmt_cache[i].bce_used < binfmt_cache[victim].bce_used)
+        {
+            victim = i;
+        }
+    }
+    if (binfmt_cache[victim].bce_vnode != vn)
+    {
+        old = binfmt_cache[victim].bce_vnode;
+        vref(vn);
+        binfmt_cache[victim].bce_vnode = vn;
+    }
+    binfmt_cache[victim].bce_used = ++binfmt_cache_clock;
+    kmutex_unlock(&binfmt_cache_mutex);
+
+    /* the last reference may free the vnode, which can block */
+    if (old)
+    {
+        vput(&old);
+    }
+}
+
+void binfmt_cache_purge()
+{
+    kmutex_lock(&binfmt_cache_mutex);
+    for (size_t i = 0; i < BINFMT_CACHE_SIZE; i++)
+    {
+        if (binfmt_cache[i].bce_vnode)
+        {
+            vput(&binfmt_cache[i].bce_vnode);
+        }
+        binfmt_cache[i].bce_used = 0;
+    }
+    kmutex_unlock(&binfmt_cache_mutex);
+}
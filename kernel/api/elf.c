@@ -29,8 +29,12 @@
 #include "mm/mman.h"
 #include "mm/tlb.h"
 
+#include "vm/mmap.h"
+#include "vm/pagefault.h"
+
 #include "api/binfmt.h"
 #include "api/elf.h"
+#include "api/vdso.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -125,8 +129,12 @@ static long _elf64_map_segment(vmmap_t *map, vnode_t *file, int64_t memoff,
             dbg(DBG_ELF, "ERROR: ELF file contains overlapping segments\n");
             return -ENOEXEC;
         }
+        /* Segments that can never be written (text) map the file's own
+         * pframes, so every process running the program shares them; only
+         * writable ones need a private shadow for their copies */
+        int flags = (perms & PROT_WRITE) ? MAP_PRIVATE : MAP_SHARED;
         long ret = vmmap_map(map, file, lopage, npages, perms,
-                             MAP_PRIVATE | MAP_FIXED, fileoff, 0, NULL);
+                             flags | MAP_FIXED, fileoff, 0, NULL);
         if (ret)
             return ret;
         dbg(DBG_ELF,
@@ -448,8 +456,19 @@ static size_t _elf64_calc_argsize(char *const argv[], char *const envp[],
     return size;
 }
 
+/* Copies the string src, terminator and all, to dst, returning how many bytes
+ * that took: one pass over it, rather than a strlen() and then a copy */
+static size_t _elf64_put_string(char *dst, const char *src)
+{
+    char *d = dst;
+    while ((*d++ = *src++))
+        ;
+    return (size_t)(d - dst);
+}
+
 /* Copies the arguments that must be on the stack prior to execution onto the
- * user stack. This should never fail.
+ * user stack. The whole image is built in buf first, and then copied in with
+ * one vmmap_write(). This should never fail.
  * arglow:   low address on the user stack where we should start the copying
  * argsize:  total size of everything to go on the stack
  * buf:      a kernel buffer at least as big as argsize (for convenience)
@@ -510,8 +529,7 @@ static void _elf64_load_args(vmmap_t *map, void *arglow, size_t argsize,
     /* Copy over argv along with every string in it */
     for (i = 0; i < argc; i++)
     {
-        size_t len = strlen(argv[i]) + 1;
-        strcpy(strstart, argv[i]);
+        size_t len = _elf64_put_string(strstart, argv[i]);
         /* Remember that we need to use the virtual address of the string */
         *(char **)vecstart = vstrstart;
         strstart += len;
@@ -525,8 +543,7 @@ static void _elf64_load_args(vmmap_t *map, void *arglow, size_t argsize,
     /* Copy over envp along with every string in it */
     for (i = 0; i < envc; i++)
     {
-        size_t len = strlen(envp[i]) + 1;
-        strcpy(strstart, envp[i]);
+        size_t len = _elf64_put_string(strstart, envp[i]);
         /* Remember that we need to use the virtual address of the string */
         *(char **)vecstart = vstrstart;
         strstart += len;
@@ -784,7 +801,12 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
         auxv->a_type = AT_NULL;
     }
 
-    /* Allocate stack at the top of the address space */
+    /* Map the vDSO page, at the very top of the address space */
+    ret = vdso_map(map);
+    if (ret < 0)
+        goto done;
+
+    /* Allocate stack at the top of the address space (below the vDSO) */
     uint64_t stack_lopage = (uint64_t)vmmap_find_range(
         map, (DEFAULT_STACK_SIZE / PAGE_SIZE) + 1, VMMAP_DIR_HILO);
     if (stack_lopage == ~0UL)
@@ -836,15 +858,32 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
     /* the final threshold / What warm unspoken secrets will we learn? / Beyond
      * the point of no return ... */
 
-    /* Give the process the new mappings. */
+    /* Give the process the new mappings, and start counting its faults
+     * afresh. */
+    pagefault_report(curproc);
+
+    /* Flush the process pagetables and TLB, with one shootdown for the whole
+     * of the old image, before any of its pages are freed; the tables the
+     * old mappings needed are freed along with everything else */
+    page_batch_t reclaim = PAGE_BATCH_INITIALIZER;
+    pt_unmap_range(curproc->p_pml4, USER_MEM_LOW, USER_MEM_HIGH, &reclaim);
+    tlb_shootdown(curproc->p_pml4, USER_MEM_LOW,
+                  (USER_MEM_HIGH - USER_MEM_LOW) >> PAGE_SHIFT);
+
     vmmap_destroy(&curproc->p_vmmap);
     map->vmm_proc = curproc;
     curproc->p_vmmap = map;
     map = NULL; /* So it doesn't get cleaned up at the end */
+    page_batch_flush(&reclaim);
 
-    /* Flush the process pagetables and TLB */
-    pt_unmap_range(curproc->p_pml4, USER_MEM_LOW, USER_MEM_HIGH);
-    tlb_flush_all();
+    /* The arguments were just written to the stack's pages, and they are the
+     * first thing the program touches, along with the stack just below them:
+     * map those pages now, rather than have each fault in on its own */
+    uintptr_t stack_top = (uintptr_t)PN_TO_ADDR(
+        stack_lopage + (DEFAULT_STACK_SIZE / PAGE_SIZE) + 1);
+    void *stack_used = (void *)PAGE_ALIGN_DOWN((uintptr_t)arglow - 8);
+    do_mmap_populate(stack_used, stack_top - (uintptr_t)stack_used,
+                     PROT_READ | PROT_WRITE);
 
     /* Set the process break and starting break (immediately after the mapped-in
      * text/data/bss from the executable) */
@@ -861,6 +900,12 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
     /* Note that the return address will be fixed by the userland entry code,
      * whether in static or dynamic */
 
+    /* The program itself goes into the exec cache in binfmt_load() */
+    if (interpfile)
+    {
+        binfmt_cache_hold(interpfile->f_vnode);
+    }
+
     /* And we're done */
     ret = 0;
 
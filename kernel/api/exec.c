@@ -1,6 +1,7 @@
 #include "util/debug.h"
 #include <util/string.h>
 
+#include "main/fpu.h"
 #include "main/gdt.h"
 
 #include "api/binfmt.h"
@@ -46,6 +47,7 @@ void userland_entry(const regs_t regs)
                               * arguments automatically pushed by the processor
                               * on an interrupt
                               */
+        "swapgs\n\t"          /* userland's GS base (see main/smp.h) */
         "iretq\n"
         /* We're now in userland! */
         :            /* No outputs */
@@ -67,6 +69,8 @@ long do_execve(const char *filename, char *const *argv, char *const *envp,
         (void *)rsp);
     regs->r_rip = rip;
     regs->r_rsp = rsp;
+    /* the new image starts with the FPU in its initial state */
+    fpu_release(curthr);
     return 0;
 }
 
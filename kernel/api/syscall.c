@@ -1,28 +1,49 @@
 #include "errno.h"
 #include "globals.h"
 #include "kernel.h"
+#include "limits.h"
 #include <fs/vfs.h>
 #include <util/time.h>
 
+#include "main/cpuid.h"
+#include "main/gdt.h"
 #include "main/inits.h"
 #include "main/interrupt.h"
 
 #include "mm/kmalloc.h"
+#include "mm/memgroup.h"
+#include "mm/mm.h"
 #include "mm/mman.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
+#include "mm/tlb.h"
 
+#include "fs/poll.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 
+#include "proc/futex.h"
+
 #include "drivers/tty/tty.h"
 #include "test/kshell/kshell.h"
 
+#include "util/profile.h"
+#include "util/string.h"
+#include "util/trace.h"
+
 #include "vm/brk.h"
 #include "vm/mmap.h"
+#include "vm/shadow.h"
+#include "vm/vmmap.h"
 
 #include "api/access.h"
 #include "api/exec.h"
 #include "api/syscall.h"
+#include "api/syscall_stats.h"
 #include "api/utsname.h"
+#include "api/vdso.h"
 
 static long syscall_handler(regs_t *regs);
 
@@ -30,7 +51,7 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs);
 
 extern size_t active_tty;
 
-static const char *syscall_strings[49] = {
+static const char *syscall_strings[86] = {
     "syscall", "exit", "fork", "read", "write", "open",
     "close", "waitpid", "link", "unlink", "execve", "chdir",
     "sleep", "unknown", "lseek", "sync", "nuke", "dup",
@@ -38,10 +59,173 @@ static const char *syscall_strings[49] = {
     "mmap", "mprotect", "munmap", "rename", "uname", "thr_create",
     "thr_cancel", "thr_exit", "thr_yield", "thr_join", "gettid", "getpid",
     "unknown", "unkown", "unknown", "errno", "halt", "get_free_mem",
-    "set_errno", "dup2", "brk", "mount", "umount", "stat", "usleep"};
+    "set_errno", "dup2", "brk", "mount", "umount", "stat", "time",
+    "usleep", "pread", "pwrite", "readv", "writev", "nice",
+    "sched_setscheduler", "sched_getscheduler", "futex", "ring_enter",
+    "splice", "tee", "sendfile", "poll", "epoll_create", "epoll_ctl",
+    "epoll_wait", "fcntl", "profile", "madvise", "msync", "fsync",
+    "fdatasync", "syncfs", "openat", "fstatat", "unlinkat", "mkdirat",
+    "sched_setaffinity", "sched_getaffinity", "times", "clock_gettime",
+    "nanosleep", "memgroup", "ioprio_set", "ioprio_get",
+    "set_tls"};
 
 void syscall_init(void) { intr_register(INTR_SYSCALL, syscall_handler); }
 
+#define NSYSCALLS (sizeof(syscall_strings) / sizeof(syscall_strings[0]))
+
+/* Indexed by core id; each core only updates its own counters */
+static syscall_stats_t syscall_stats[MAX_LAPICS][NSYSCALLS];
+
+static void syscall_stats_record(size_t sysnum, uint64_t cycles)
+{
+    if (sysnum >= NSYSCALLS)
+    {
+        return;
+    }
+    size_t bucket = cycles ? 63 - (size_t)__builtin_clzl(cycles) : 0;
+    bucket = MIN(bucket, (size_t)SYSCALL_HIST_BUCKETS - 1);
+
+    /* stay on this core, and let no other thread on it in, while updating */
+    preemption_disable();
+    syscall_stats_t *stats = &syscall_stats[curcore.kc_id][sysnum];
+    stats->sc_calls++;
+    stats->sc_cycles += cycles;
+    stats->sc_hist[bucket]++;
+    preemption_enable();
+}
+
+size_t syscall_stats_count() { return NSYSCALLS; }
+
+const char *syscall_name(size_t sysnum)
+{
+    KASSERT(sysnum < NSYSCALLS);
+    return syscall_strings[sysnum];
+}
+
+void syscall_stats_get(size_t sysnum, syscall_stats_t *stats)
+{
+    KASSERT(sysnum < NSYSCALLS);
+    memset(stats, 0, sizeof(*stats));
+    for (size_t core = 0; core < MAX_LAPICS; core++)
+    {
+        syscall_stats_t *s = &syscall_stats[core][sysnum];
+        stats->sc_calls += s->sc_calls;
+        stats->sc_cycles += s->sc_cycles;
+        for (size_t i = 0; i < SYSCALL_HIST_BUCKETS; i++)
+        {
+            stats->sc_hist[i] += s->sc_hist[i];
+        }
+    }
+}
+
+void syscall_stats_reset() { memset(syscall_stats, 0, sizeof(syscall_stats)); }
+
+/*
+ * Besides int $INTR_SYSCALL, userland may enter the kernel with the syscall
+ * instruction, which skips the IDT and the interrupt frame: the CPU only
+ * saves rip in rcx and rflags in r11, masks interrupts, and jumps to
+ * syscall_entry, still on the user stack.
+ *
+ * syscall_entry swaps in the kernel's GS base, switches to the thread's
+ * kernel stack, keeping userland's rsp in the core's csd_head_t (see
+ * main/smp.h) meanwhile, and builds the same regs_t an interrupt would have,
+ * so that syscall_handler() and everything it calls (fork copies the frame,
+ * for one) cannot tell the two apart. It returns with sysret, unless the
+ * frame's rip is not a userland address, which sysret would fault on in
+ * kernel mode; iretq copes with anything.
+ */
+#define MSR_EFER 0xc0000080
+#define MSR_STAR 0xc0000081
+#define MSR_LSTAR 0xc0000082
+#define MSR_FMASK 0xc0000084
+#define EFER_SCE 0x1
+#define RFLAGS_IF 0x200
+#define RFLAGS_DF 0x400
+#define RFLAGS_TF 0x100
+
+static __attribute__((used)) void syscall_fast_handler(regs_t *regs)
+{
+    syscall_handler(regs);
+}
+
+extern void syscall_entry(void);
+__asm__(".global syscall_entry\n"
+        "syscall_entry:\n\t"
+        "swapgs\n\t"
+        "movq %rsp, %gs:" QUOTE_BY_VALUE(CSD_HEAD_USER_RSP) "\n\t"
+        "movq %gs:" QUOTE_BY_VALUE(CSD_HEAD_KERNEL_STACK) ", %rsp\n\t"
+        "pushq $(" QUOTE_BY_VALUE(GDT_USER_DATA) " | 3)\n\t" /* ss */
+        "pushq %gs:" QUOTE_BY_VALUE(CSD_HEAD_USER_RSP) "\n\t"  /* rsp */
+        "pushq %r11\n\t"                                    /* rflags */
+        "pushq $(" QUOTE_BY_VALUE(GDT_USER_TEXT) " | 3)\n\t" /* cs */
+        "pushq %rcx\n\t"                                    /* rip */
+        "pushq $0x0\n\t"                                    /* err */
+        "pushq $" QUOTE_BY_VALUE(INTR_SYSCALL) "\n\t"       /* intr */
+        "pushq %rdi\n\t"
+        "pushq %rsi\n\t"
+        "pushq %rdx\n\t"
+        "pushq %rcx\n\t"
+        "pushq %rax\n\t"
+        "pushq %r8\n\t"
+        "pushq %r9\n\t"
+        "pushq %r10\n\t"
+        "pushq %r11\n\t"
+        "pushq %rbx\n\t"
+        "pushq %rbp\n\t"
+        "pushq %r12\n\t"
+        "pushq %r13\n\t"
+        "pushq %r14\n\t"
+        "pushq %r15\n\t"
+        "movq %rsp, %rdi\n\t"
+        "sti\n\t" /* as int $INTR_SYSCALL goes through a trap gate */
+        "call syscall_fast_handler\n\t"
+        "cli\n\t"
+        "popq %r15\n\t"
+        "popq %r14\n\t"
+        "popq %r13\n\t"
+        "popq %r12\n\t"
+        "popq %rbp\n\t"
+        "popq %rbx\n\t"
+        "popq %r11\n\t"
+        "popq %r10\n\t"
+        "popq %r9\n\t"
+        "popq %r8\n\t"
+        "popq %rax\n\t"
+        "popq %rcx\n\t"
+        "popq %rdx\n\t"
+        "popq %rsi\n\t"
+        "popq %rdi\n\t"
+        "add $16, %rsp\n\t"
+        "swapgs\n\t"
+        "movq (%rsp), %rcx\n\t"
+        "shrq $47, %rcx\n\t"
+        "jnz 1f\n\t"
+        "popq %rcx\n\t"
+        "add $8, %rsp\n\t"
+        "popq %r11\n\t"
+        "popq %rsp\n\t"
+        "sysretq\n"
+        "1:\n\t"
+        "iretq\n");
+
+/*
+ * Sets up the syscall instruction on the current core.
+ */
+void syscall_core_init()
+{
+    uint32_t lo, hi;
+    cpuid_get_msr(MSR_EFER, &lo, &hi);
+    cpuid_set_msr(MSR_EFER, lo | EFER_SCE, hi);
+
+    /* syscall loads the kernel segments from STAR[47:32], sysret the user
+     * ones relative to STAR[63:48] */
+    cpuid_set_msr(MSR_STAR, 0,
+                  GDT_KERNEL_TEXT | ((GDT_USER_DATA - 8) | 3) << 16);
+    uintptr_t entry = (uintptr_t)syscall_entry;
+    cpuid_set_msr(MSR_LSTAR, (uint32_t)entry, (uint32_t)(entry >> 32));
+    cpuid_set_msr(MSR_FMASK, RFLAGS_IF | RFLAGS_DF | RFLAGS_TF, 0);
+}
+
 // if condition, set errno to err and return -1
 #define ERROR_OUT(condition, err) \
     if (condition)                \
@@ -54,275 +238,744 @@ void syscall_init(void) { intr_register(INTR_SYSCALL, syscall_handler); }
 #define ERROR_OUT_RET(ret) ERROR_OUT(ret < 0, -ret)
 
 /*
- * Be sure to look at other examples of implemented system calls to see how
- * this should be done - the general outline is as follows.
- * 
- * - Initialize a read_args_t struct locally in kernel space and copy from 
- *   userland args. 
- * - Allocate a temporary buffer (a page-aligned block of n pages that are 
- *   enough space to store the number of bytes to read)
- * - Call do_read() with the buffer and then copy the buffer to the userland 
- *   args after the system call 
- * - Make sure to free the temporary buffer allocated
- * - Return the number of bytes read, or return -1 and set the current thread's
- *   errno appropriately using ERROR_OUT_RET. 
+ * Allocate a temporary buffer of len bytes, for the system calls that do not
+ * transfer straight to and from user pages (see user_pages_pin()).
+ * *npagesp is set to its size in pages, which is 0 (and the buffer NULL) if
+ * len is 0.
  */
-static long sys_read(read_args_t *args)
+static long syscall_buf_alloc(size_t len, void **bufp, size_t *npagesp)
 {
-    NOT_YET_IMPLEMENTED("VM: sys_read");
-    return -1;
+    *npagesp = ADDR_TO_PN(PAGE_ALIGN_UP(len));
+    *bufp = NULL;
+    if (*npagesp && !(*bufp = page_alloc_n(*npagesp)))
+    {
+        return -ENOMEM;
+    }
+    return 0;
 }
 
-/*
- * Be sure to look at other examples of implemented system calls to see how
- * this should be done - the general outline is as follows.
- *
- * This function is very similar to sys_read - see above comments. You'll need
- * to use the functions copy_from_user() and do_write(). Make sure to
- * allocate a new temporary buffer for the data that is being written. This
- * is to ensure that pagefaults within kernel mode do not happen. 
- */
-static long sys_write(write_args_t *args)
+static void syscall_buf_free(void *buf, size_t npages)
 {
-    NOT_YET_IMPLEMENTED("VM: sys_write");
-    return -1;
+    if (npages)
+    {
+        page_free_n(buf, npages);
+    }
 }
 
 /*
- * This similar to the other system calls that you have implemented above. 
- * 
- * The general steps are as follows: 
- *  - Copy the arguments from user memory 
- *  - Check that the count field is at least the size of a dirent_t
- *  - Use a while loop to read count / sizeof(dirent_t) directory entries into 
- *    the provided dirp and call do_getdent
- *  - Return the number of bytes read
+ * The user pages that one chunk of a read or write goes straight into or out
+ * of: the pframe behind each, held locked so that it can be neither reclaimed
+ * nor freed while the file system copies, and the part of it in the buffer.
  */
-static long sys_getdents(getdents_args_t *args)
+typedef struct user_pages
 {
-    NOT_YET_IMPLEMENTED("VM: sys_getdents");
-    return -1;
-}
+    int up_npages;
+    pframe_t *up_pframes[IOV_MAX];
+    struct iovec up_iov[IOV_MAX];
+} user_pages_t;
 
-#ifdef __MOUNTING__
-static long sys_mount(mount_args_t *arg)
+static void user_pages_unpin(user_pages_t *up)
 {
-    mount_args_t kern_args;
-    char *source;
-    char *target;
-    char *type;
-    long ret;
-
-    if (copy_from_user(&kern_args, arg, sizeof(kern_args)) < 0)
+    for (int i = 0; i < up->up_npages; i++)
     {
-        curthr->kt_errno = EFAULT;
-        return -1;
+        pframe_release(&up->up_pframes[i]);
     }
+    up->up_npages = 0;
+}
 
-    /* null is okay only for the source */
-    source = user_strdup(&kern_args.spec);
-    if (NULL == (target = user_strdup(&kern_args.dir)))
+/*
+ * Pin the pages under the len bytes at ubuf, which must lie within IOV_MAX
+ * pages, and point up->up_iov at them. forwrite is set if the pages are to
+ * be written into.
+ *
+ * Return 0, or:
+ *  - EFAULT: part of the buffer is not mapped with the access needed
+ *  - EAGAIN: part of the buffer maps a file, whose pframes the file system
+ *    may need to lock itself; the caller has to use a kernel buffer
+ *  - Propagate errors from mobj_get_pframe()
+ */
+static long user_pages_pin(void *ubuf, size_t len, long forwrite,
+                           user_pages_t *up)
+{
+    vmmap_t *map = curproc->p_vmmap;
+    uintptr_t addr = (uintptr_t)ubuf;
+    uintptr_t end = addr + len;
+    long ret = 0;
+    up->up_npages = 0;
+    if (end < addr)
     {
-        kfree(source);
-        curthr->kt_errno = EINVAL;
-        return -1;
+        return -EFAULT;
     }
-    if (NULL == (type = user_strdup(&kern_args.fstype)))
+
+    rwlock_read_lock(&map->vmm_lock);
+    while (addr < end)
     {
-        kfree(source);
-        kfree(target);
-        curthr->kt_errno = EINVAL;
-        return -1;
-    }
+        KASSERT(up->up_npages < IOV_MAX);
+        vmarea_t *vma = vmmap_lookup(map, ADDR_TO_PN(addr));
+        if (!vma || !(vma->vma_prot & (forwrite ? PROT_WRITE : PROT_READ)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+        if (shadow_bottom(vma->vma_obj)->mo_type == MOBJ_VNODE)
+        {
+            ret = -EAGAIN;
+            break;
+        }
 
-    ret = do_mount(source, target, type);
-    kfree(source);
-    kfree(target);
-    kfree(type);
+        pframe_t *pf;
+        mobj_lock(vma->vma_obj);
+        ret = mobj_get_pframe(vma->vma_obj,
+                              vma->vma_off + (ADDR_TO_PN(addr) - vma->vma_start),
+                              forwrite, &pf);
+        mobj_unlock(vma->vma_obj);
+        if (ret)
+        {
+            break;
+        }
+        if (forwrite && vma->vma_obj->mo_type == MOBJ_SHADOW)
+        {
+            /* the write may have made a private copy of the page, so that
+             * what the page table maps is stale; have userland refault */
+            uintptr_t page = (uintptr_t)PAGE_ALIGN_DOWN(addr);
+            pt_unmap(curproc->p_pml4, page);
+            tlb_flush(page);
+        }
+
+        size_t n = MIN(end - addr, PAGE_SIZE - PAGE_OFFSET(addr));
+        up->up_pframes[up->up_npages] = pf;
+        up->up_iov[up->up_npages].iov_base =
+            (char *)pf->pf_addr + PAGE_OFFSET(addr);
+        up->up_iov[up->up_npages].iov_len = n;
+        up->up_npages++;
+        addr += n;
+    }
+    rwlock_read_unlock(&map->vmm_lock);
 
     if (ret)
     {
-        curthr->kt_errno = -ret;
-        return -1;
+        user_pages_unpin(up);
     }
-
-    return 0;
+    return ret;
 }
 
-static long sys_umount(argstr_t *input)
+/*
+ * Transfer one chunk of a read or write through a kernel buffer, for user
+ * buffers that user_pages_pin() will not pin.
+ */
+static long syscall_rw_bounce(int fd, void *ubuf, size_t len, long write)
 {
-    argstr_t kstr;
-    char *target;
-    long ret;
-
-    if (copy_from_user(&kstr, input, sizeof(kstr)) < 0)
+    void *buf;
+    size_t npages;
+    long ret = syscall_buf_alloc(len, &buf, &npages);
+    if (ret)
     {
-        curthr->kt_errno = EFAULT;
-        return -1;
+        return ret;
     }
-
-    if (NULL == (target = user_strdup(&kstr)))
+    if (write)
     {
-        curthr->kt_errno = EINVAL;
-        return -1;
+        ret = copy_from_user(buf, ubuf, len);
+        if (!ret)
+        {
+            ret = do_write(fd, buf, len);
+        }
     }
-
-    ret = do_umount(target);
-    kfree(target);
-
-    if (ret)
+    else
     {
-        curthr->kt_errno = -ret;
-        return -1;
+        ret = do_read(fd, buf, len);
+        if (ret > 0)
+        {
+            long err = copy_to_user(ubuf, buf, (size_t)ret);
+            ret = err ? err : ret;
+        }
     }
-
-    return 0;
+    syscall_buf_free(buf, npages);
+    return ret;
 }
-#endif
 
-static long sys_close(int fd)
+/*
+ * read and write. The user pages are pinned and handed to the file system as
+ * a vector, so that it copies straight into or out of them, without a kernel
+ * buffer in between. Requests of more than IOV_MAX pages go chunk by chunk,
+ * stopping at the first short transfer; each chunk is transferred atomically
+ * (see do_readv()), but a whole request of several chunks is not. Writes to
+ * /dev/null are done without pinning anything (see do_write_discards()).
+ */
+static long syscall_rw(int fd, void *ubuf, size_t nbytes, long write)
 {
-    long ret = do_close(fd);
-    ERROR_OUT_RET(ret);
-    return ret;
+    ERROR_OUT(nbytes > (size_t)LONG_MAX, EINVAL);
+    if (write && do_write_discards(fd))
+    {
+        return (long)nbytes;
+    }
+    long total = 0;
+    do
+    {
+        size_t len =
+            MIN(nbytes, (size_t)IOV_MAX * PAGE_SIZE - PAGE_OFFSET(ubuf));
+        user_pages_t up;
+        long ret = user_pages_pin(ubuf, len, !write, &up);
+        if (!ret)
+        {
+            ret = write ? do_writev(fd, up.up_iov, up.up_npages)
+                        : do_readv(fd, up.up_iov, up.up_npages);
+            user_pages_unpin(&up);
+        }
+        else if (ret == -EAGAIN)
+        {
+            ret = syscall_rw_bounce(fd, ubuf, len, write);
+        }
+
+        if (ret < 0)
+        {
+            if (total)
+            {
+                break;
+            }
+            ERROR_OUT_RET(ret);
+        }
+        total += ret;
+        ubuf = (char *)ubuf + ret;
+        nbytes -= (size_t)ret;
+        if ((size_t)ret < len)
+        {
+            break;
+        }
+    } while (nbytes);
+    return total;
 }
 
-static long sys_dup(int fd)
+static long sys_read(read_args_t *args)
 {
-    long ret = do_dup(fd);
+    read_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
-    return ret;
+    return syscall_rw(kargs.fd, kargs.buf, kargs.nbytes, 0);
 }
 
-static long sys_dup2(const dup2_args_t *args)
+static long sys_write(write_args_t *args)
 {
-    dup2_args_t kargs;
+    write_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
-    ret = do_dup2(kargs.ofd, kargs.nfd);
-    ERROR_OUT_RET(ret);
-    return ret;
+    return syscall_rw(kargs.fd, kargs.buf, kargs.nbytes, 1);
 }
 
-static long sys_mkdir(mkdir_args_t *args)
+/*
+ * Like sys_read, but with do_pread() at the offset given instead of the file
+ * position.
+ */
+static long sys_pread(pread_args_t *args)
 {
-    mkdir_args_t kargs;
+    pread_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
 
-    char *path;
-    ret = user_strdup(&kargs.path, &path);
+    void *buf;
+    size_t npages;
+    ret = syscall_buf_alloc(kargs.nbytes, &buf, &npages);
     ERROR_OUT_RET(ret);
 
-    ret = do_mkdir(path);
-    kfree(path);
+    ret = do_pread(kargs.fd, buf, kargs.nbytes, kargs.offset);
+    if (ret > 0)
+    {
+        long err = copy_to_user(kargs.buf, buf, (size_t)ret);
+        ret = err ? err : ret;
+    }
+    syscall_buf_free(buf, npages);
 
     ERROR_OUT_RET(ret);
     return ret;
 }
 
-static long sys_rmdir(argstr_t *args)
+/*
+ * Like sys_write, but with do_pwrite() at the offset given instead of the
+ * file position.
+ */
+static long sys_pwrite(pwrite_args_t *args)
 {
-    argstr_t kargs;
+    pwrite_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
 
-    char *path;
-    ret = user_strdup(&kargs, &path);
+    void *buf;
+    size_t npages;
+    ret = syscall_buf_alloc(kargs.nbytes, &buf, &npages);
     ERROR_OUT_RET(ret);
 
-    ret = do_rmdir(path);
-    kfree(path);
+    ret = copy_from_user(buf, kargs.buf, kargs.nbytes);
+    if (!ret)
+    {
+        ret = do_pwrite(kargs.fd, buf, kargs.nbytes, kargs.offset);
+    }
+    syscall_buf_free(buf, npages);
 
     ERROR_OUT_RET(ret);
     return ret;
 }
 
-static long sys_unlink(argstr_t *args)
+/*
+ * Copy the iovec array of a readv/writev in from userland, into kiov (of
+ * IOV_MAX entries), and add up the lengths of its buffers.
+ */
+static long syscall_iov_copy_in(rwv_args_t *kargs, struct iovec *kiov,
+                                size_t *totalp)
 {
-    argstr_t kargs;
+    if (kargs->iovcnt < 0 || kargs->iovcnt > IOV_MAX)
+    {
+        return -EINVAL;
+    }
+    long ret = copy_from_user(kiov, kargs->iov,
+                              (size_t)kargs->iovcnt * sizeof(struct iovec));
+    if (ret)
+    {
+        return ret;
+    }
+    size_t total = 0;
+    for (int i = 0; i < kargs->iovcnt; i++)
+    {
+        if (kiov[i].iov_len > (size_t)LONG_MAX - total)
+        {
+            return -EINVAL;
+        }
+        total += kiov[i].iov_len;
+    }
+    *totalp = total;
+    return 0;
+}
+
+/*
+ * readv and writev. The user buffers are gathered into (or scattered from)
+ * one temporary buffer, which do_readv()/do_writev() are given as a vector
+ * of pieces of the same lengths.
+ */
+static long sys_rwv(rwv_args_t *args, long write)
+{
+    rwv_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
 
-    char *path;
-    ret = user_strdup(&kargs, &path);
-    ERROR_OUT_RET(ret);
+    struct iovec *uiov = kmalloc(IOV_MAX * 2 * sizeof(struct iovec));
+    ERROR_OUT(!uiov, ENOMEM);
+    struct iovec *kiov = uiov + IOV_MAX;
+    size_t total;
+    void *buf = NULL;
+    size_t npages = 0;
+    ret = syscall_iov_copy_in(&kargs, uiov, &total);
+    if (!ret)
+    {
+        ret = syscall_buf_alloc(total, &buf, &npages);
+    }
 
-    ret = do_unlink(path);
-    kfree(path);
+    char *p = buf;
+    for (int i = 0; !ret && i < kargs.iovcnt; i++)
+    {
+        kiov[i].iov_base = p;
+        kiov[i].iov_len = uiov[i].iov_len;
+        if (write)
+        {
+            ret = copy_from_user(p, uiov[i].iov_base, uiov[i].iov_len);
+        }
+        p += uiov[i].iov_len;
+    }
+    if (!ret)
+    {
+        ret = write ? do_writev(kargs.fd, kiov, kargs.iovcnt)
+                    : do_readv(kargs.fd, kiov, kargs.iovcnt);
+    }
+    if (!write && ret > 0)
+    {
+        size_t left = (size_t)ret;
+        p = buf;
+        for (int i = 0; left && i < kargs.iovcnt; i++)
+        {
+            size_t n = MIN(left, uiov[i].iov_len);
+            long err = copy_to_user(uiov[i].iov_base, p, n);
+            if (err)
+            {
+                ret = err;
+                break;
+            }
+            p += n;
+            left -= n;
+        }
+    }
+    syscall_buf_free(buf, npages);
+    kfree(uiov);
 
     ERROR_OUT_RET(ret);
     return ret;
 }
 
-static long sys_link(link_args_t *args)
+/*
+ * Read as many directory entries as fit in count bytes with do_getdents(),
+ * which fills in the whole batch with one call into the file system, and
+ * copy them out to dirp.
+ */
+static long sys_getdents(getdents_args_t *args)
 {
-    link_args_t kargs;
+    getdents_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
 
-    char *to, *from;
-    ret = user_strdup(&kargs.to, &to);
+    size_t count = kargs.count - kargs.count % sizeof(dirent_t);
+    void *buf;
+    size_t npages;
+    ret = syscall_buf_alloc(count, &buf, &npages);
     ERROR_OUT_RET(ret);
 
-    ret = user_strdup(&kargs.from, &from);
-    if (ret)
+    ret = do_getdents(kargs.fd, buf, count);
+    if (ret > 0)
     {
-        kfree(to);
-        ERROR_OUT_RET(ret);
+        long err = copy_to_user(kargs.dirp, buf, (size_t)ret);
+        ret = err ? err : ret;
     }
-
-    ret = do_link(from, to);
-    kfree(to);
-    kfree(from);
+    syscall_buf_free(buf, npages);
 
     ERROR_OUT_RET(ret);
     return ret;
 }
 
-static long sys_rename(rename_args_t *args)
+#ifdef __MOUNTING__
+static long sys_mount(mount_args_t *args)
 {
-    rename_args_t kargs;
+    mount_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
 
-    char *oldpath, *newpath;
-    ret = user_strdup(&kargs.oldpath, &oldpath);
-    ERROR_OUT_RET(ret);
-
-    ret = user_strdup(&kargs.newpath, &newpath);
+    /* null is okay only for the source */
+    char *source = NULL, *target, *type;
+    if (kargs.spec.as_str)
+    {
+        ret = user_strdup(&kargs.spec, &source);
+        ERROR_OUT_RET(ret);
+    }
+    ret = user_strdup(&kargs.dir, &target);
     if (ret)
     {
-        kfree(oldpath);
+        if (source)
+        {
+            kfree(source);
+        }
+        ERROR_OUT_RET(ret);
+    }
+    ret = user_strdup(&kargs.fstype, &type);
+    if (ret)
+    {
+        if (source)
+        {
+            kfree(source);
+        }
+        kfree(target);
         ERROR_OUT_RET(ret);
     }
 
-    ret = do_rename(oldpath, newpath);
-    kfree(oldpath);
-    kfree(newpath);
+    ret = do_mount(source, target, type);
+    if (source)
+    {
+        kfree(source);
+    }
+    kfree(target);
+    kfree(type);
 
     ERROR_OUT_RET(ret);
     return ret;
 }
 
-static long sys_chdir(argstr_t *args)
+static long sys_umount(argstr_t *input)
 {
-    argstr_t kargs;
-    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    argstr_t kstr;
+    long ret = copy_from_user(&kstr, input, sizeof(kstr));
     ERROR_OUT_RET(ret);
 
-    char *path;
-    ret = user_strdup(&kargs, &path);
+    char *target;
+    ret = user_strdup(&kstr, &target);
     ERROR_OUT_RET(ret);
 
-    ret = do_chdir(path);
-    kfree(path);
+    ret = do_umount(target);
+    kfree(target);
 
     ERROR_OUT_RET(ret);
     return ret;
 }
+#endif
 
-static long sys_lseek(lseek_args_t *args)
+static long sys_close(int fd)
+{
+    long ret = do_close(fd);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_fsync(int fd, long datasync)
+{
+    long ret = do_fsync(fd, datasync);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_syncfs(int fd)
+{
+    long ret = do_syncfs(fd);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_dup(int fd)
+{
+    long ret = do_dup(fd);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_dup2(const dup2_args_t *args)
+{
+    dup2_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_dup2(kargs.ofd, kargs.nfd);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_fcntl(const fcntl_args_t *args)
+{
+    fcntl_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_fcntl(kargs.fd, kargs.cmd, kargs.arg);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+/*
+ * Starts or stops the sampling profiler, or reads whole samples out of it
+ * into the user's buffer, returning how many bytes were read.
+ */
+static long sys_profile(const profile_args_t *args)
+{
+    profile_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    if (kargs.op == PROFILE_START)
+    {
+        ret = profile_start(kargs.interval);
+        ERROR_OUT_RET(ret);
+        return 0;
+    }
+    else if (kargs.op == PROFILE_STOP)
+    {
+        profile_stop();
+        return 0;
+    }
+    ERROR_OUT(kargs.op != PROFILE_READ, EINVAL);
+
+    /* at most a ring's worth at a time */
+    size_t count =
+        MIN(kargs.nbytes / sizeof(profile_sample_t), (size_t)PROFILE_SAMPLES);
+    void *buf;
+    size_t npages;
+    ret = syscall_buf_alloc(count * sizeof(profile_sample_t), &buf, &npages);
+    ERROR_OUT_RET(ret);
+    size_t len = profile_read(buf, count) * sizeof(profile_sample_t);
+    ret = copy_to_user(kargs.buf, buf, len);
+    syscall_buf_free(buf, npages);
+    ERROR_OUT_RET(ret);
+    return (long)len;
+}
+
+/*
+ * Only the tty requests, whose argument is a struct termios, and the
+ * framebuffer's, whose argument is a struct fb_info, are known; the argument
+ * is copied in for requests that set something and out for those that get
+ * something.
+ */
+static long sys_ioctl(const ioctl_args_t *args)
+{
+    ioctl_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    ERROR_OUT(kargs.request != TCGETS && kargs.request != TCSETS &&
+                  kargs.request != FBIOGET_INFO,
+              ENOTTY);
+
+    union {
+        struct termios t;
+        struct fb_info fb;
+    } arg;
+    size_t size =
+        kargs.request == FBIOGET_INFO ? sizeof(arg.fb) : sizeof(arg.t);
+    long in = kargs.request == TCSETS;
+
+    if (in)
+    {
+        ret = copy_from_user(&arg, kargs.arg, size);
+        ERROR_OUT_RET(ret);
+    }
+    ret = do_ioctl(kargs.fd, kargs.request, &arg);
+    ERROR_OUT_RET(ret);
+    if (!in)
+    {
+        ret = copy_to_user(kargs.arg, &arg, size);
+        ERROR_OUT_RET(ret);
+    }
+    return ret;
+}
+
+static long sys_mkdir(mkdir_args_t *args)
+{
+    mkdir_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *path;
+    ret = user_strdup(&kargs.path, &path);
+    ERROR_OUT_RET(ret);
+
+    ret = do_mkdir(path);
+    kfree(path);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_mkdirat(mkdirat_args_t *args)
+{
+    mkdirat_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *path;
+    ret = user_strdup(&kargs.path, &path);
+    ERROR_OUT_RET(ret);
+
+    ret = do_mkdirat(kargs.dirfd, path);
+    kfree(path);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_rmdir(argstr_t *args)
+{
+    argstr_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *path;
+    ret = user_strdup(&kargs, &path);
+    ERROR_OUT_RET(ret);
+
+    ret = do_rmdir(path);
+    kfree(path);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_unlink(argstr_t *args)
+{
+    argstr_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *path;
+    ret = user_strdup(&kargs, &path);
+    ERROR_OUT_RET(ret);
+
+    ret = do_unlink(path);
+    kfree(path);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_unlinkat(unlinkat_args_t *args)
+{
+    unlinkat_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *path;
+    ret = user_strdup(&kargs.path, &path);
+    ERROR_OUT_RET(ret);
+
+    ret = do_unlinkat(kargs.dirfd, path, kargs.flags);
+    kfree(path);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_link(link_args_t *args)
+{
+    link_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *to, *from;
+    ret = user_strdup(&kargs.to, &to);
+    ERROR_OUT_RET(ret);
+
+    ret = user_strdup(&kargs.from, &from);
+    if (ret)
+    {
+        kfree(to);
+        ERROR_OUT_RET(ret);
+    }
+
+    ret = do_link(from, to);
+    kfree(to);
+    kfree(from);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_rename(rename_args_t *args)
+{
+    rename_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *oldpath, *newpath;
+    ret = user_strdup(&kargs.oldpath, &oldpath);
+    ERROR_OUT_RET(ret);
+
+    ret = user_strdup(&kargs.newpath, &newpath);
+    if (ret)
+    {
+        kfree(oldpath);
+        ERROR_OUT_RET(ret);
+    }
+
+    ret = do_rename(oldpath, newpath);
+    kfree(oldpath);
+    kfree(newpath);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_chdir(argstr_t *args)
+{
+    argstr_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *path;
+    ret = user_strdup(&kargs, &path);
+    ERROR_OUT_RET(ret);
+
+    ret = do_chdir(path);
+    kfree(path);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_lseek(lseek_args_t *args)
 {
     lseek_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
@@ -351,6 +1004,23 @@ static long sys_open(open_args_t *args)
     return ret;
 }
 
+static long sys_openat(openat_args_t *args)
+{
+    openat_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *path;
+    ret = user_strdup(&kargs.filename, &path);
+    ERROR_OUT_RET(ret);
+
+    ret = do_openat(kargs.dirfd, path, kargs.flags);
+    kfree(path);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
 static long sys_munmap(munmap_args_t *args)
 {
     munmap_args_t kargs;
@@ -363,6 +1033,16 @@ static long sys_munmap(munmap_args_t *args)
     return ret;
 }
 
+static long sys_mprotect(const mprotect_args_t *args)
+{
+    mprotect_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_mprotect(kargs.addr, kargs.len, kargs.prot);
+    ERROR_OUT_RET(ret);
+    return 0;
+}
+
 static void *sys_mmap(mmap_args_t *arg)
 {
     mmap_args_t kargs;
@@ -381,192 +1061,736 @@ static void *sys_mmap(mmap_args_t *arg)
         curthr->kt_errno = -err;
         return MAP_FAILED;
     }
+    if (kargs.mma_flags & MAP_POPULATE)
+    {
+        do_mmap_populate(ret, kargs.mma_len, kargs.mma_prot);
+    }
     return ret;
 }
 
-static pid_t sys_waitpid(waitpid_args_t *args)
+static long sys_madvise(const madvise_args_t *args)
+{
+    madvise_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_madvise(kargs.addr, kargs.len, kargs.advice);
+    ERROR_OUT_RET(ret);
+    return 0;
+}
+
+static long sys_msync(const msync_args_t *args)
+{
+    msync_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_msync(kargs.addr, kargs.len, kargs.flags);
+    ERROR_OUT_RET(ret);
+    return 0;
+}
+
+static pid_t sys_waitpid(waitpid_args_t *args)
+{
+    waitpid_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    int status;
+    pid_t pid = do_waitpid(kargs.wpa_pid, &status, kargs.wpa_options);
+    ERROR_OUT_RET(pid);
+
+    if (kargs.wpa_status)
+    {
+        ret = copy_to_user(kargs.wpa_status, &status, sizeof(int));
+        ERROR_OUT_RET(ret);
+    }
+
+    return pid;
+}
+
+static void *sys_brk(void *addr)
+{
+    void *new_brk;
+    long ret = do_brk(addr, &new_brk);
+    if (ret)
+    {
+        curthr->kt_errno = -ret;
+        return (void *)-1;
+    }
+    return new_brk;
+}
+
+static void sys_halt(void) { proc_kill_all(); }
+
+static long sys_stat(stat_args_t *args)
+{
+    stat_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *path;
+    ret = user_strdup(&kargs.path, &path);
+    ERROR_OUT_RET(ret);
+
+    stat_t stat_buf;
+    ret = do_stat(path, &stat_buf);
+    kfree(path);
+    ERROR_OUT_RET(ret);
+
+    ret = copy_to_user(kargs.buf, &stat_buf, sizeof(stat_buf));
+    ERROR_OUT_RET(ret);
+
+    return ret;
+}
+
+static long sys_fstatat(fstatat_args_t *args)
+{
+    fstatat_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *path;
+    ret = user_strdup(&kargs.path, &path);
+    ERROR_OUT_RET(ret);
+
+    stat_t stat_buf;
+    ret = do_fstatat(kargs.dirfd, path, &stat_buf, kargs.flags);
+    kfree(path);
+    ERROR_OUT_RET(ret);
+
+    ret = copy_to_user(kargs.buf, &stat_buf, sizeof(stat_buf));
+    ERROR_OUT_RET(ret);
+
+    return ret;
+}
+
+static long sys_pipe(int args[2])
+{
+    int kargs[2];
+    long ret = do_pipe(kargs);
+    ERROR_OUT_RET(ret);
+
+    ret = copy_to_user(args, kargs, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    return ret;
+}
+
+/*
+ * uname and time answer from the vDSO page (see api/vdso.h), as libc does
+ * without a system call.
+ */
+static long sys_uname(struct utsname *arg)
+{
+    long ret = copy_to_user(arg, &vdso_data->vd_uname, sizeof(*arg));
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_time(time_t *utloc)
+{
+    time_t time = vdso_data->vd_time;
+    if (utloc)
+    {
+        long ret = copy_to_user(utloc, &time, sizeof(time_t));
+        ERROR_OUT_RET(ret);
+    }
+    return time;
+}
+
+/*
+ * Reports the CPU time curproc and its waited-for children have used, in
+ * ticks, and returns the ticks since boot.
+ */
+static long sys_times(struct tms *buf)
+{
+    uint64_t utime, stime;
+    proc_cpu_times(curproc, &utime, &stime);
+    struct tms tms = {.tms_utime = utime,
+                      .tms_stime = stime,
+                      .tms_cutime = curproc->p_cutime,
+                      .tms_cstime = curproc->p_cstime};
+    long ret = copy_to_user(buf, &tms, sizeof(tms));
+    ERROR_OUT_RET(ret);
+    return (long)jiffies;
+}
+
+/*
+ * Like time(), normally answered from the vDSO page by libc.
+ */
+static long sys_clock_gettime(clock_gettime_args_t *args)
+{
+    clock_gettime_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ERROR_OUT(kargs.cga_clock != CLOCK_REALTIME &&
+                  kargs.cga_clock != CLOCK_MONOTONIC,
+              EINVAL);
+
+    uint64_t ns = time_ns();
+    struct timespec ts = {.tv_sec = ns / NS_PER_SEC,
+                          .tv_nsec = (long)(ns % NS_PER_SEC)};
+    if (kargs.cga_clock == CLOCK_REALTIME)
+    {
+        ts.tv_sec += time_boot_epoch;
+    }
+    ret = copy_to_user(kargs.cga_tp, &ts, sizeof(ts));
+    ERROR_OUT_RET(ret);
+    return 0;
+}
+
+static long sys_fork(regs_t *regs)
+{
+    long ret = do_fork(regs);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static void free_vector(char **vect)
+{
+    char **temp;
+    for (temp = vect; *temp; temp++)
+    {
+        kfree(*temp);
+    }
+    kfree(vect);
+}
+
+static long sys_execve(execve_args_t *args, regs_t *regs)
+{
+    execve_args_t kargs;
+    char *filename = NULL;
+    char **argv = NULL;
+    char **envp = NULL;
+
+    long ret;
+    if ((ret = copy_from_user(&kargs, args, sizeof(kargs))))
+        goto cleanup;
+
+    if ((ret = user_strdup(&kargs.filename, &filename)))
+        goto cleanup;
+
+    if (kargs.argv.av_vec && (ret = user_vecdup(&kargs.argv, &argv)))
+        goto cleanup;
+
+    if (kargs.envp.av_vec && (ret = user_vecdup(&kargs.envp, &envp)))
+        goto cleanup;
+
+    ret = do_execve(filename, argv, envp, regs);
+
+cleanup:
+    if (filename)
+        kfree(filename);
+    if (argv)
+        free_vector(argv);
+    if (envp)
+        free_vector(envp);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_debug(argstr_t *args)
+{
+    argstr_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *str;
+    ret = user_strdup(&kargs, &str);
+    ERROR_OUT_RET(ret);
+    dbg(DBG_USER, "%s\n", str);
+    kfree(str);
+    return ret;
+}
+
+static long sys_kshell(int ttyid)
+{
+    // ignoring the ttyid passed in as it always defaults to 0,
+    // instead using the active_tty value
+    kshell_t *ksh = kshell_create(active_tty);
+    ERROR_OUT(!ksh, ENODEV);
+
+    long ret;
+    while ((ret = kshell_execute_next(ksh)) > 0)
+        ;
+    kshell_destroy(ksh);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_usleep(usleep_args_t *args)
+{
+    return do_usleep(args->usec);
+}
+
+static long sys_nanosleep(nanosleep_args_t *args)
+{
+    nanosleep_args_t kargs;
+    struct timespec req;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = copy_from_user(&req, kargs.nsa_req, sizeof(req));
+    ERROR_OUT_RET(ret);
+    ERROR_OUT(req.tv_nsec < 0 || req.tv_nsec >= (long)NS_PER_SEC, EINVAL);
+
+    /* a sleep too long to count in nanoseconds never ends anyway */
+    uint64_t ns = req.tv_sec < (uint64_t)-1 / NS_PER_SEC / 2
+                      ? req.tv_sec * NS_PER_SEC + (uint64_t)req.tv_nsec
+                      : (uint64_t)-1 / 2;
+    uint64_t rem;
+    long sleep_ret = do_nanosleep(ns, &rem);
+    if (sleep_ret && kargs.nsa_rem)
+    {
+        struct timespec ts = {.tv_sec = rem / NS_PER_SEC,
+                              .tv_nsec = (long)(rem % NS_PER_SEC)};
+        ret = copy_to_user(kargs.nsa_rem, &ts, sizeof(ts));
+        ERROR_OUT_RET(ret);
+    }
+    ERROR_OUT_RET(sleep_ret);
+    return 0;
+}
+
+/*
+ * Applies a scheduling class and priority to every thread of a process.
+ */
+static long set_proc_sched_class(proc_t *proc, sched_class_t cls,
+                                 long priority)
+{
+    list_iterate(&proc->p_threads, thr, kthread_t, kt_plink)
+    {
+        long ret = sched_set_class(thr, cls, priority);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Adds inc to the calling process's nice value, clamped to the valid range,
+ * and returns the new nice value plus NICE_BIAS, so that it cannot be taken
+ * for an error. Realtime processes have no nice value.
+ */
+static long sys_nice(int inc)
+{
+    ERROR_OUT(curthr->kt_base_class != SCHED_CLASS_FAIR, EINVAL);
+    long nice = curthr->kt_base_priority + inc;
+    nice = MAX(SCHED_NICE_MIN, MIN(SCHED_NICE_MAX, nice));
+    long ret = set_proc_sched_class(curproc, SCHED_CLASS_FAIR, nice);
+    ERROR_OUT_RET(ret);
+    return nice + NICE_BIAS;
+}
+
+static proc_t *sched_lookup_proc(pid_t pid)
+{
+    return pid ? proc_lookup(pid) : curproc;
+}
+
+static long sys_sched_setscheduler(sched_setscheduler_args_t *args)
+{
+    sched_setscheduler_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    sched_class_t cls;
+    switch (kargs.ssa_policy)
+    {
+    case SCHED_OTHER:
+        cls = SCHED_CLASS_FAIR;
+        break;
+    case SCHED_FIFO:
+        cls = SCHED_CLASS_REALTIME;
+        break;
+    default:
+        ERROR_OUT(1, EINVAL);
+    }
+
+    proc_t *proc = sched_lookup_proc(kargs.ssa_pid);
+    ERROR_OUT(!proc, ESRCH);
+    ret = set_proc_sched_class(proc, cls, kargs.ssa_priority);
+    ERROR_OUT_RET(ret);
+    return 0;
+}
+
+static long sys_sched_getscheduler(pid_t pid)
+{
+    proc_t *proc = sched_lookup_proc(pid);
+    ERROR_OUT(!proc || list_empty(&proc->p_threads), ESRCH);
+    kthread_t *thr = list_head(&proc->p_threads, kthread_t, kt_plink);
+    return thr->kt_base_class == SCHED_CLASS_REALTIME ? SCHED_FIFO
+                                                      : SCHED_OTHER;
+}
+
+/*
+ * Restricts every thread of a process to the cores in a mask; threads it
+ * creates later inherit it.
+ */
+static long sys_sched_setaffinity(sched_setaffinity_args_t *args)
+{
+    sched_setaffinity_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    proc_t *proc = sched_lookup_proc(kargs.saa_pid);
+    ERROR_OUT(!proc, ESRCH);
+    list_iterate(&proc->p_threads, thr, kthread_t, kt_plink)
+    {
+        ret = sched_set_affinity(thr, kargs.saa_mask);
+        ERROR_OUT_RET(ret);
+    }
+    return 0;
+}
+
+/*
+ * Returns the mask of cores a process's threads may run on, limited to those
+ * there can be, so that it cannot be taken for an error.
+ */
+static long sys_sched_getaffinity(pid_t pid)
+{
+    proc_t *proc = sched_lookup_proc(pid);
+    ERROR_OUT(!proc || list_empty(&proc->p_threads), ESRCH);
+    kthread_t *thr = list_head(&proc->p_threads, kthread_t, kt_plink);
+    return (long)(thr->kt_affinity & ((1UL << MAX_LAPICS) - 1));
+}
+
+static long sys_memgroup(memgroup_args_t *args)
+{
+    memgroup_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    size_t limit =
+        kargs.mga_limit / PAGE_SIZE + !!(kargs.mga_limit % PAGE_SIZE);
+    switch (kargs.mga_op)
+    {
+    case MEMGROUP_CREATE:
+        ret = memgroup_create(limit);
+        break;
+    case MEMGROUP_DESTROY:
+        ret = memgroup_destroy(kargs.mga_group);
+        break;
+    case MEMGROUP_SET_LIMIT:
+        ret = memgroup_set_limit(kargs.mga_group, limit);
+        break;
+    case MEMGROUP_JOIN:
+    {
+        proc_t *proc = sched_lookup_proc(kargs.mga_pid);
+        ERROR_OUT(!proc, ESRCH);
+        ret = memgroup_move(proc, kargs.mga_group);
+        break;
+    }
+    case MEMGROUP_SET_IO:
+        ret = memgroup_set_io(kargs.mga_group, kargs.mga_io_weight,
+                              kargs.mga_io_latency_ms);
+        break;
+    default:
+        ERROR_OUT(1, EINVAL);
+    }
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+/*
+ * Sets the I/O priority a process's block requests are queued with; see
+ * drivers/iosched.h.
+ */
+static long sys_ioprio_set(ioprio_set_args_t *args)
+{
+    ioprio_set_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    int cls = IOPRIO_CLASS(kargs.isa_prio);
+    int level = IOPRIO_LEVEL(kargs.isa_prio);
+    ERROR_OUT(kargs.isa_prio < 0 || cls > IOPRIO_CLASS_IDLE ||
+                  level >= IOPRIO_LEVELS,
+              EINVAL);
+    proc_t *proc = sched_lookup_proc(kargs.isa_pid);
+    ERROR_OUT(!proc, ESRCH);
+    proc->p_ioprio = kargs.isa_prio;
+    return 0;
+}
+
+static long sys_ioprio_get(pid_t pid)
+{
+    proc_t *proc = sched_lookup_proc(pid);
+    ERROR_OUT(!proc, ESRCH);
+    return proc->p_ioprio;
+}
+
+#ifdef __MTP__
+static long sys_thr_create(regs_t *regs, thr_create_args_t *args)
 {
-    waitpid_args_t kargs;
+    thr_create_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
+    ERROR_OUT(!addr_perm(curproc, kargs.tca_entry, PROT_EXEC) ||
+                  !addr_perm(curproc, (char *)kargs.tca_stack - 1, PROT_WRITE),
+              EFAULT);
+    ERROR_OUT((uintptr_t)kargs.tca_tls >= USER_MEM_HIGH, EINVAL);
+    ret = do_thr_create(regs, kargs.tca_entry, kargs.tca_arg, kargs.tca_stack,
+                        kargs.tca_tls, kargs.tca_exit_word);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
 
-    int status;
-    pid_t pid = do_waitpid(kargs.wpa_pid, &status, kargs.wpa_options);
-    ERROR_OUT_RET(pid);
-
-    if (kargs.wpa_status)
-    {
-        ret = copy_to_user(kargs.wpa_status, &status, sizeof(int));
-        ERROR_OUT_RET(ret);
-    }
-
-    return pid;
+/* Sets the calling thread's FS base, for thread-local storage */
+static long sys_set_tls(void *base)
+{
+    ERROR_OUT((uintptr_t)base >= USER_MEM_HIGH, EINVAL);
+    sched_set_fsbase((uintptr_t)base);
+    return 0;
 }
+#endif
 
-static void *sys_brk(void *addr)
+/*
+ * Clears and wakes the thread's exit word, if it has one, before it exits;
+ * its stack can then be freed by whoever was waiting.
+ */
+static void sys_thr_exit(long status)
 {
-    void *new_brk;
-    long ret = do_brk(addr, &new_brk);
-    if (ret)
+    int *word = curthr->kt_exit_word;
+    if (word)
     {
-        curthr->kt_errno = -ret;
-        return (void *)-1;
+        int zero = 0;
+        if (!copy_to_user(word, &zero, sizeof(zero)))
+        {
+            futex_wake(word, INT_MAX);
+        }
     }
-    return new_brk;
+    kthread_exit((void *)status);
 }
 
-static void sys_halt(void) { proc_kill_all(); }
-
-static long sys_stat(stat_args_t *args)
+/*
+ * FUTEX_WAIT returns 0 once woken, FUTEX_WAKE the number of threads woken.
+ */
+static long sys_futex(futex_args_t *args)
 {
-    stat_args_t kargs;
+    futex_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
 
-    char *path;
-    ret = user_strdup(&kargs.path, &path);
-    ERROR_OUT_RET(ret);
-
-    stat_t stat_buf;
-    ret = do_stat(path, &stat_buf);
-    kfree(path);
-    ERROR_OUT_RET(ret);
-
-    ret = copy_to_user(kargs.buf, &stat_buf, sizeof(stat_buf));
+    switch (kargs.fa_op)
+    {
+    case FUTEX_WAIT:
+        ret = futex_wait(kargs.fa_uaddr, kargs.fa_val);
+        break;
+    case FUTEX_WAKE:
+        ERROR_OUT(kargs.fa_val < 0, EINVAL);
+        ret = futex_wake(kargs.fa_uaddr, kargs.fa_val);
+        break;
+    default:
+        ERROR_OUT(1, EINVAL);
+    }
     ERROR_OUT_RET(ret);
-
     return ret;
 }
 
-static long sys_pipe(int args[2])
+/*
+ * splice and tee move data between pipes and files inside the kernel; see
+ * do_splice() and do_tee().
+ */
+static long sys_splice(splice_args_t *args, long tee)
 {
-    int kargs[2];
-    long ret = do_pipe(kargs);
+    splice_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
 
-    ret = copy_to_user(args, kargs, sizeof(kargs));
+    ret = tee ? do_tee(kargs.fd_in, kargs.fd_out, kargs.len)
+              : do_splice(kargs.fd_in, kargs.fd_out, kargs.len);
     ERROR_OUT_RET(ret);
-
     return ret;
 }
 
-static long sys_uname(struct utsname *arg)
+/*
+ * Copies a file to another fd inside the kernel; see do_sendfile().
+ */
+static long sys_sendfile(sendfile_args_t *args)
 {
-    static const char sysname[] = "Weenix";
-    static const char release[] = "1.2";
-    /* Version = last compilation time */
-    static const char version[] = "#1 " __DATE__ " " __TIME__;
-    static const char nodename[] = "";
-    static const char machine[] = "";
-    long ret = 0;
-
-    ret = copy_to_user(arg->sysname, sysname, sizeof(sysname));
-    ERROR_OUT_RET(ret);
-    ret = copy_to_user(arg->release, release, sizeof(release));
-    ERROR_OUT_RET(ret);
-    ret = copy_to_user(arg->version, version, sizeof(version));
-    ERROR_OUT_RET(ret);
-    ret = copy_to_user(arg->nodename, nodename, sizeof(nodename));
-    ERROR_OUT_RET(ret);
-    ret = copy_to_user(arg->machine, machine, sizeof(machine));
+    sendfile_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
-    return ret;
-}
 
-static long sys_time(time_t *utloc)
-{
-    time_t time = do_time();
-    if (utloc)
+    off_t offset;
+    if (kargs.offset)
     {
-        long ret = copy_to_user(utloc, &time, sizeof(time_t));
+        ret = copy_from_user(&offset, kargs.offset, sizeof(offset));
         ERROR_OUT_RET(ret);
     }
-    return time;
-}
 
-static long sys_fork(regs_t *regs)
-{
-    long ret = do_fork(regs);
+    ret = do_sendfile(kargs.out_fd, kargs.in_fd,
+                      kargs.offset ? &offset : NULL, kargs.count);
+    if (ret >= 0 && kargs.offset)
+    {
+        long err = copy_to_user(kargs.offset, &offset, sizeof(offset));
+        ret = err ? err : ret;
+    }
     ERROR_OUT_RET(ret);
     return ret;
 }
 
-static void free_vector(char **vect)
+/*
+ * poll() works on a kernel copy of the pollfd array; see do_poll().
+ */
+static long sys_poll(poll_args_t *args)
 {
-    char **temp;
-    for (temp = vect; *temp; temp++)
+    poll_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ERROR_OUT(kargs.nfds > NFILES, EINVAL);
+
+    struct pollfd *fds = NULL;
+    size_t size = kargs.nfds * sizeof(*fds);
+    if (size)
     {
-        kfree(*temp);
+        ERROR_OUT(!(fds = kmalloc(size)), ENOMEM);
+        ret = copy_from_user(fds, kargs.fds, size);
     }
-    kfree(vect);
+    if (!ret)
+    {
+        ret = do_poll(fds, kargs.nfds, kargs.timeout);
+    }
+    if (ret >= 0 && size)
+    {
+        long err = copy_to_user(kargs.fds, fds, size);
+        ret = err ? err : ret;
+    }
+    if (fds)
+    {
+        kfree(fds);
+    }
+    ERROR_OUT_RET(ret);
+    return ret;
 }
 
-static long sys_execve(execve_args_t *args, regs_t *regs)
+static long sys_epoll_ctl(epoll_ctl_args_t *args)
 {
-    execve_args_t kargs;
-    char *filename = NULL;
-    char **argv = NULL;
-    char **envp = NULL;
-
-    long ret;
-    if ((ret = copy_from_user(&kargs, args, sizeof(kargs))))
-        goto cleanup;
-
-    if ((ret = user_strdup(&kargs.filename, &filename)))
-        goto cleanup;
-
-    if (kargs.argv.av_vec && (ret = user_vecdup(&kargs.argv, &argv)))
-        goto cleanup;
-
-    if (kargs.envp.av_vec && (ret = user_vecdup(&kargs.envp, &envp)))
-        goto cleanup;
-
-    ret = do_execve(filename, argv, envp, regs);
+    epoll_ctl_args_t kargs;
+    struct epoll_event event;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    if (kargs.op != EPOLL_CTL_DEL)
+    {
+        ret = copy_from_user(&event, kargs.event, sizeof(event));
+        ERROR_OUT_RET(ret);
+    }
 
-cleanup:
-    if (filename)
-        kfree(filename);
-    if (argv)
-        free_vector(argv);
-    if (envp)
-        free_vector(envp);
+    ret = do_epoll_ctl(kargs.epfd, kargs.op, kargs.fd, &event);
     ERROR_OUT_RET(ret);
     return ret;
 }
 
-static long sys_debug(argstr_t *args)
+/*
+ * Events are collected in a kernel buffer of at most NFILES of them, then
+ * copied out.
+ */
+static long sys_epoll_wait(epoll_wait_args_t *args)
 {
-    argstr_t kargs;
+    epoll_wait_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
+    ERROR_OUT(kargs.maxevents <= 0, EINVAL);
 
-    char *str;
-    ret = user_strdup(&kargs, &str);
+    int maxevents = MIN(kargs.maxevents, NFILES);
+    struct epoll_event *events = kmalloc(maxevents * sizeof(*events));
+    ERROR_OUT(!events, ENOMEM);
+    ret = do_epoll_wait(kargs.epfd, events, maxevents, kargs.timeout);
+    if (ret > 0)
+    {
+        long err = copy_to_user(kargs.events, events, ret * sizeof(*events));
+        ret = err ? err : ret;
+    }
+    kfree(events);
     ERROR_OUT_RET(ret);
-    dbg(DBG_USER, "%s\n", str);
-    kfree(str);
     return ret;
 }
 
-static long sys_kshell(int ttyid)
+/*
+ * Run one system call taken from a ring, and return its result in-band, as
+ * syscall_handler() would.
+ */
+static long syscall_ring_op(ring_sqe_t *sqe, regs_t *regs)
 {
-    // ignoring the ttyid passed in as it always defaults to 0,
-    // instead using the active_tty value
-    kshell_t *ksh = kshell_create(active_tty);
-    ERROR_OUT(!ksh, ENODEV);
-
-    long ret;
-    while ((ret = kshell_execute_next(ksh)) > 0)
-        ;
-    kshell_destroy(ksh);
-
-    ERROR_OUT_RET(ret);
+    switch (sqe->sqe_sysnum)
+    {
+    case SYS_read:
+    case SYS_write:
+    case SYS_open:
+    case SYS_openat:
+    case SYS_close:
+    case SYS_stat:
+    case SYS_fstatat:
+    case SYS_lseek:
+    case SYS_pread:
+    case SYS_pwrite:
+        break;
+    default:
+        return -EINVAL;
+    }
+    curthr->kt_errno = 0;
+    long ret =
+        syscall_dispatch((size_t)sqe->sqe_sysnum, (uintptr_t)sqe->sqe_args, regs);
+    if (ret == -1 && curthr->kt_errno)
+    {
+        ret = -curthr->kt_errno;
+        curthr->kt_errno = 0;
+    }
     return ret;
 }
 
-static long sys_usleep(usleep_args_t *args)
+/*
+ * Run the system calls submitted to a ring (see syscall_ring_t) until it is
+ * empty, its completions are full, or the thread is cancelled, and return
+ * how many were run.
+ */
+static long sys_ring_enter(syscall_ring_t *uring, regs_t *regs)
 {
-    return do_usleep(args->usec);
+    syscall_ring_t ring;
+    long ret = copy_from_user(&ring, uring, sizeof(ring));
+    ERROR_OUT_RET(ret);
+    ERROR_OUT(!ring.sr_entries || (ring.sr_entries & (ring.sr_entries - 1)),
+              EINVAL);
+
+    uint32_t mask = ring.sr_entries - 1;
+    uint32_t sq_head = ring.sr_sq_head;
+    uint32_t cq_tail = ring.sr_cq_tail;
+    long done = 0;
+    while (sq_head != ring.sr_sq_tail &&
+           cq_tail - ring.sr_cq_head < ring.sr_entries && !curthr->kt_cancelled)
+    {
+        ring_sqe_t sqe;
+        ret = copy_from_user(&sqe, &ring.sr_sq[sq_head & mask], sizeof(sqe));
+        if (ret)
+        {
+            break;
+        }
+        ring_cqe_t cqe = {.cqe_data = sqe.sqe_data,
+                          .cqe_ret = syscall_ring_op(&sqe, regs)};
+        ret = copy_to_user(&ring.sr_cq[cq_tail & mask], &cqe, sizeof(cqe));
+        if (ret)
+        {
+            break;
+        }
+        sq_head++;
+        cq_tail++;
+        done++;
+    }
+
+    /* an entry that could not be copied only fails the call if it was the
+     * first */
+    if (done)
+    {
+        ret = copy_to_user((void *)&uring->sr_sq_head, &sq_head,
+                           sizeof(sq_head));
+        if (!ret)
+        {
+            ret = copy_to_user((void *)&uring->sr_cq_tail, &cq_tail,
+                               sizeof(cq_tail));
+        }
+    }
+    ERROR_OUT_RET(ret);
+    return done;
 }
 
 static inline void check_curthr_cancelled()
@@ -585,43 +1809,56 @@ static inline void check_curthr_cancelled()
     }
 }
 
-static long syscall_handler(regs_t *regs)
+/* Only looked up for dbg(), so that it goes when DBG_SYSCALL is compiled out */
+static const char *syscall_dbg_name(size_t sysnum)
 {
-    size_t sysnum = (size_t)regs->r_rax;
-    uintptr_t args = (uintptr_t)regs->r_rdx;
-
-    const char *syscall_string;
-    if (sysnum <= 47)
+    if (sysnum < sizeof(syscall_strings) / sizeof(syscall_strings[0]))
+    {
+        return syscall_strings[sysnum];
+    }
+    else if (sysnum == 9001)
+    {
+        return "debug";
+    }
+    else if (sysnum == 9002)
     {
-        syscall_string = syscall_strings[sysnum];
+        return "kshell";
     }
     else
     {
-        if (sysnum == 9001)
-        {
-            syscall_string = "debug";
-        }
-        else if (sysnum == 9002)
-        {
-            syscall_string = "kshell";
-        }
-        else
-        {
-            syscall_string = "unknown";
-        }
+        return "unknown";
     }
+}
 
-    if (sysnum != SYS_errno)
-        dbg(DBG_SYSCALL, ">> pid %d, sysnum: %lu (%s), arg: %lu (0x%p)\n",
-            curproc->p_pid, sysnum, syscall_string, args, (void *)args);
+static long syscall_handler(regs_t *regs)
+{
+    size_t sysnum = (size_t)regs->r_rax;
+    uintptr_t args = (uintptr_t)regs->r_rdx;
+
+    dbg(DBG_SYSCALL, ">> pid %d, sysnum: %lu (%s), arg: %lu (0x%p)\n",
+        curproc->p_pid, sysnum, syscall_dbg_name(sysnum), args, (void *)args);
 
+    /* Syscalls fail by setting kt_errno and returning -1; hand the error
+     * back in-band, as -errno, so that userland needs no SYS_errno to learn
+     * it. kt_errno is still kept for SYS_errno. */
+    if (sysnum != SYS_errno)
+    {
+        curthr->kt_errno = 0;
+    }
     check_curthr_cancelled();
+    uint64_t start = cpuid_rdtsc();
     long ret = syscall_dispatch(sysnum, args, regs);
+    uint64_t cycles = cpuid_rdtsc() - start;
+    syscall_stats_record(sysnum, cycles);
+    trace(TRACE_SYSCALL, sysnum, ret, cycles);
     check_curthr_cancelled();
+    if (ret == -1 && curthr->kt_errno)
+    {
+        ret = -curthr->kt_errno;
+    }
 
-    if (sysnum != SYS_errno)
-        dbg(DBG_SYSCALL, "<< pid %d, sysnum: %lu (%s), returned: %lu (%#lx)\n",
-            curproc->p_pid, sysnum, syscall_string, ret, ret);
+    dbg(DBG_SYSCALL, "<< pid %d, sysnum: %lu (%s), returned: %ld (%#lx)\n",
+        curproc->p_pid, sysnum, syscall_dbg_name(sysnum), ret, ret);
 
     regs->r_rax = (uint64_t)ret;
     return 0;
@@ -639,7 +1876,7 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
         panic("exit failed!\n");
 
     case SYS_thr_exit:
-        kthread_exit((void *)args);
+        sys_thr_exit((long)args);
         panic("thr_exit failed!\n");
 
     case SYS_sched_yield:
@@ -652,10 +1889,30 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_getpid:
         return curproc->p_pid;
 
+    case SYS_gettid:
+        return curthr->kt_tid;
+
+#ifdef __MTP__
+    case SYS_thr_create:
+        return sys_thr_create(regs, (thr_create_args_t *)args);
+
+    case SYS_set_tls:
+        return sys_set_tls((void *)args);
+#endif
+
     case SYS_sync:
         do_sync();
         return 0;
 
+    case SYS_fsync:
+        return sys_fsync((int)args, 0);
+
+    case SYS_fdatasync:
+        return sys_fsync((int)args, 1);
+
+    case SYS_syncfs:
+        return sys_syncfs((int)args);
+
 #ifdef __MOUNTING__
     case SYS_mount:
         return sys_mount((mount_args_t *)args);
@@ -670,9 +1927,15 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_munmap:
         return sys_munmap((munmap_args_t *)args);
 
+    case SYS_mprotect:
+        return sys_mprotect((mprotect_args_t *)args);
+
     case SYS_open:
         return sys_open((open_args_t *)args);
 
+    case SYS_openat:
+        return sys_openat((openat_args_t *)args);
+
     case SYS_close:
         return sys_close((int)args);
 
@@ -682,21 +1945,54 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_write:
         return sys_write((write_args_t *)args);
 
+    case SYS_pread:
+        return sys_pread((pread_args_t *)args);
+
+    case SYS_pwrite:
+        return sys_pwrite((pwrite_args_t *)args);
+
+    case SYS_readv:
+        return sys_rwv((rwv_args_t *)args, 0);
+
+    case SYS_writev:
+        return sys_rwv((rwv_args_t *)args, 1);
+
     case SYS_dup:
         return sys_dup((int)args);
 
     case SYS_dup2:
         return sys_dup2((dup2_args_t *)args);
 
+    case SYS_fcntl:
+        return sys_fcntl((fcntl_args_t *)args);
+
+    case SYS_profile:
+        return sys_profile((profile_args_t *)args);
+
+    case SYS_madvise:
+        return sys_madvise((madvise_args_t *)args);
+
+    case SYS_msync:
+        return sys_msync((msync_args_t *)args);
+
+    case SYS_ioctl:
+        return sys_ioctl((ioctl_args_t *)args);
+
     case SYS_mkdir:
         return sys_mkdir((mkdir_args_t *)args);
 
+    case SYS_mkdirat:
+        return sys_mkdirat((mkdirat_args_t *)args);
+
     case SYS_rmdir:
         return sys_rmdir((argstr_t *)args);
 
     case SYS_unlink:
         return sys_unlink((argstr_t *)args);
 
+    case SYS_unlinkat:
+        return sys_unlinkat((unlinkat_args_t *)args);
+
     case SYS_link:
         return sys_link((link_args_t *)args);
 
@@ -732,6 +2028,9 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_stat:
         return sys_stat((stat_args_t *)args);
 
+    case SYS_fstatat:
+        return sys_fstatat((fstatat_args_t *)args);
+
     case SYS_pipe:
         return sys_pipe((int *)args);
 
@@ -741,6 +2040,12 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_time:
         return sys_time((time_t *)args);
 
+    case SYS_times:
+        return sys_times((struct tms *)args);
+
+    case SYS_clock_gettime:
+        return sys_clock_gettime((clock_gettime_args_t *)args);
+
     case SYS_debug:
         return sys_debug((argstr_t *)args);
 
@@ -750,6 +2055,64 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_usleep:
         return sys_usleep((usleep_args_t *)args);
 
+    case SYS_nanosleep:
+        return sys_nanosleep((nanosleep_args_t *)args);
+
+    case SYS_nice:
+        return sys_nice((int)args);
+
+    case SYS_sched_setscheduler:
+        return sys_sched_setscheduler((sched_setscheduler_args_t *)args);
+
+    case SYS_sched_getscheduler:
+        return sys_sched_getscheduler((pid_t)args);
+
+    case SYS_sched_setaffinity:
+        return sys_sched_setaffinity((sched_setaffinity_args_t *)args);
+
+    case SYS_sched_getaffinity:
+        return sys_sched_getaffinity((pid_t)args);
+
+    case SYS_futex:
+        return sys_futex((futex_args_t *)args);
+
+    case SYS_memgroup:
+        return sys_memgroup((memgroup_args_t *)args);
+
+    case SYS_ioprio_set:
+        return sys_ioprio_set((ioprio_set_args_t *)args);
+
+    case SYS_ioprio_get:
+        return sys_ioprio_get((pid_t)args);
+
+    case SYS_ring_enter:
+        return sys_ring_enter((syscall_ring_t *)args, regs);
+
+    case SYS_splice:
+        return sys_splice((splice_args_t *)args, 0);
+
+    case SYS_tee:
+        return sys_splice((splice_args_t *)args, 1);
+
+    case SYS_sendfile:
+        return sys_sendfile((sendfile_args_t *)args);
+
+    case SYS_poll:
+        return sys_poll((poll_args_t *)args);
+
+    case SYS_epoll_create:
+    {
+        long ret = do_epoll_create();
+        ERROR_OUT_RET(ret);
+        return ret;
+    }
+
+    case SYS_epoll_ctl:
+        return sys_epoll_ctl((epoll_ctl_args_t *)args);
+
+    case SYS_epoll_wait:
+        return sys_epoll_wait((epoll_wait_args_t *)args);
+
     default:
         dbg(DBG_ERROR, "ERROR: unknown system call: %lu (args: 0x%p)\n",
             sysnum, (void *)args);
@@ -0,0 +1,109 @@
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/inits.h"
+
+#include "mm/mman.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#include "vm/vmmap.h"
+
+#include "api/vdso.h"
+
+/*
+ * The page is the only page of a memory object of its own, which every
+ * process maps shared. The object and its pframe are never freed, and the
+ * pframe is not on the reclaim lists, so the page stays put.
+ *
+ * vd_time is refreshed from the RTC (see do_time()) by core 0's tick every
+ * VDSO_TIME_REFRESH_MS. Since it is a single aligned word, userland can read
+ * it without any further synchronization. The clock_gettime() fields are set
+ * once and for all here.
+ */
+
+vdso_data_t *vdso_data;
+
+static mobj_t vdso_mobj;
+static pframe_t vdso_pframe;
+static uint64_t vdso_refreshed; /* jiffies at the last refresh */
+
+static long vdso_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
+                            pframe_t **pfp)
+{
+    if (pagenum || forwrite)
+    {
+        return -EFAULT;
+    }
+    pframe_lock(&vdso_pframe);
+    *pfp = &vdso_pframe;
+    return 0;
+}
+
+static void vdso_destructor(mobj_t *o) { panic("vDSO object freed\n"); }
+
+static mobj_ops_t vdso_mobj_ops = {.get_pframe = vdso_get_pframe,
+                                   .fill_pframe = NULL,
+                                   .flush_pframe = NULL,
+                                   .destructor = vdso_destructor};
+
+void vdso_init()
+{
+    vdso_data_t *data = page_alloc();
+    KASSERT(data && "failed to allocate the vDSO page");
+    memset(data, 0, PAGE_SIZE);
+    strcpy(data->vd_uname.sysname, "Weenix");
+    strcpy(data->vd_uname.release, "1.2");
+    /* Version = last compilation time */
+    strcpy(data->vd_uname.version, "#1 " __DATE__ " " __TIME__);
+    data->vd_time = do_time();
+    data->vd_tsc_boot = time_tsc_boot;
+    data->vd_tsc_mult = time_tsc_mult;
+    data->vd_boot_time = time_boot_epoch;
+
+    mobj_init(&vdso_mobj, MOBJ_VDSO, &vdso_mobj_ops);
+    list_link_init(&vdso_pframe.pf_link);
+    list_link_init(&vdso_pframe.pf_dirty_link);
+    list_link_init(&vdso_pframe.pf_lru_link);
+    vdso_pframe.pf_addr = data;
+    vdso_pframe.pf_obj = &vdso_mobj;
+
+    vdso_refreshed = jiffies;
+    __sync_synchronize();
+    vdso_data = data;
+}
+
+void vdso_tick()
+{
+    if (vdso_data &&
+        jiffies - vdso_refreshed >= time_ms_to_jiffies(VDSO_TIME_REFRESH_MS))
+    {
+        vdso_refreshed = jiffies;
+        vdso_data->vd_time = do_time();
+    }
+}
+
+long vdso_map(vmmap_t *map)
+{
+    vmarea_t *vma = vmarea_alloc();
+    if (!vma)
+    {
+        return -ENOMEM;
+    }
+    vma->vma_start = ADDR_TO_PN(VDSO_ADDR);
+    vma->vma_end = vma->vma_start + 1;
+    vma->vma_off = 0;
+    vma->vma_prot = PROT_READ;
+    vma->vma_flags = MAP_SHARED | MAP_FIXED;
+    vma->vma_obj = &vdso_mobj;
+    mobj_ref(&vdso_mobj);
+    vmmap_insert(map, vma);
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "api/syscall.h"
+
+#include "drivers/bio.h"
+#include "drivers/blockdev.h"
+#include "drivers/bootra.h"
+#include "drivers/iosched.h"
+
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+
+#include "mm/memgroup.h"
+#include "mm/slab.h"
+
+#include "proc/proc.h"
+
+#include "util/debug.h"
+
+static slab_allocator_t *bio_allocator;
+
+void bio_init()
+{
+    bio_allocator = slab_allocator_create("bio", sizeof(bio_t));
+    KASSERT(bio_allocator);
+}
+
+bio_t *bio_alloc() { return slab_obj_alloc(bio_allocator); }
+
+void bio_free(bio_t *bio)
+{
+    KASSERT(!list_link_is_linked(&bio->bio_link));
+    slab_obj_free(bio_allocator, bio);
+}
+
+static void bio_reset(bio_t *bio, blockdev_t *bd, blocknum_t block,
+                      size_t count, long write)
+{
+    KASSERT(count);
+    bio->bio_bdev = bd;
+    bio->bio_block = block;
+    bio->bio_count = count;
+    bio->bio_write = write;
+    bio->bio_fua = 0;
+    bio->bio_end = NULL;
+    bio->bio_private = NULL;
+    bio->bio_ioprio = IOPRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+    bio->bio_group = MEMGROUP_ROOT;
+    bio->bio_done = 0;
+    bio->bio_error = 0;
+    spinlock_init(&bio->bio_lock);
+    sched_queue_init(&bio->bio_waitq);
+    list_link_init(&bio->bio_link);
+}
+
+void bio_prepare(bio_t *bio, blockdev_t *bd, blocknum_t block, size_t count,
+                 char *buf, long write)
+{
+    KASSERT(buf && PAGE_ALIGNED(buf));
+    bio_reset(bio, bd, block, count, write);
+    bio->bio_buf = buf;
+    bio->bio_vecs = NULL;
+    bio->bio_nvecs = 0;
+}
+
+void bio_prepare_vec(bio_t *bio, blockdev_t *bd, blocknum_t block,
+                     bio_vec_t *vecs, size_t nvecs, long write)
+{
+    KASSERT(vecs && nvecs);
+    size_t len = 0;
+    for (size_t i = 0; i < nvecs; i++)
+    {
+        KASSERT(vecs[i].bv_len && vecs[i].bv_len % BLOCK_SIZE == 0);
+        len += vecs[i].bv_len;
+    }
+    bio_reset(bio, bd, block, len / BLOCK_SIZE, write);
+    bio->bio_buf = NULL;
+    bio->bio_vecs = vecs;
+    bio->bio_nvecs = nvecs;
+}
+
+/*
+ * Carry out a bio with the driver's synchronous operations, one segment at a
+ * time.
+ */
+static long bio_do_sync(blockdev_t *bd, bio_t *bio)
+{
+    if (!bio->bio_nvecs)
+    {
+        return bio->bio_write
+                   ? bd->bd_ops->write_block(bd, bio->bio_buf, bio->bio_block,
+                                             bio->bio_count)
+                   : bd->bd_ops->read_block(bd, bio->bio_buf, bio->bio_block,
+                                            bio->bio_count);
+    }
+
+    blocknum_t block = bio->bio_block;
+    for (size_t i = 0; i < bio->bio_nvecs; i++)
+    {
+        char *buf = (char *)(bio->bio_vecs[i].bv_phys + PHYS_OFFSET);
+        size_t count = bio->bio_vecs[i].bv_len / BLOCK_SIZE;
+        long ret = bio->bio_write
+                       ? bd->bd_ops->write_block(bd, buf, block, count)
+                       : bd->bd_ops->read_block(bd, buf, block, count);
+        if (ret)
+        {
+            return ret;
+        }
+        block += (blocknum_t)count;
+    }
+    return 0;
+}
+
+long bio_submit(bio_t *bio)
+{
+    blockdev_t *bd = bio->bio_bdev;
+    KASSERT(bd && !bio->bio_done);
+    dbg(DBG_DISK, "submitting %s of blocks [%u, %lu) on device %u\n",
+        bio->bio_write ? "write" : "read", bio->bio_block,
+        bio->bio_block + bio->bio_count, bd->bd_id);
+
+    bio->bio_start = cpuid_rdtsc();
+    if (IOPRIO_CLASS(bio->bio_ioprio) == IOPRIO_CLASS_NONE)
+    {
+        bio->bio_ioprio = curproc->p_ioprio;
+    }
+    bio->bio_group = curproc->p_memgroup;
+    if (bio->bio_write)
+    {
+        bootra_forget(bd, bio->bio_block, bio->bio_count);
+    }
+
+    if (bd->bd_ops->submit_bio)
+    {
+        return bd->bd_ops->submit_bio(bd, bio);
+    }
+    if (bd->bd_ops->submit)
+    {
+        return iosched_submit(bio);
+    }
+
+    /* drivers without asynchronous support complete the request right away,
+     * flushing their cache after a forced write */
+    long ret = bio_do_sync(bd, bio);
+    if (!ret && bio->bio_write && bio->bio_fua && bd->bd_ops->flush)
+    {
+        ret = bd->bd_ops->flush(bd);
+    }
+    bio_complete(bio, ret);
+    return 0;
+}
+
+void bio_complete(bio_t *bio, long error)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&bio->bio_lock);
+    KASSERT(!bio->bio_done);
+    bio->bio_error = error;
+    bio->bio_done = 1;
+
+    /* The callback may free the bio, so nothing touches it afterwards. Without
+     * one, the bio is the waiter's, often on its stack, and the waiter may
+     * return as soon as it sees bio_done; so the broadcast is made under
+     * bio_lock, which bio_wait() takes before returning. */
+    if (bio->bio_end)
+    {
+        spinlock_unlock(&bio->bio_lock);
+        bio->bio_end(bio);
+    }
+    else
+    {
+        sched_broadcast_on(&bio->bio_waitq);
+        spinlock_unlock(&bio->bio_lock);
+    }
+    intr_setipl(ipl);
+}
+
+/*
+ * Poll a device for a bio's completion for a while before bio_wait() sleeps,
+ * which saves the interrupt and the context switches when the device is fast.
+ * The window, from the bio's submission, is twice the device's average
+ * completion time, so that bios completing about as fast as usual are caught;
+ * there is none once the average passes BLOCKDEV_POLL_MAX_CYCLES, since
+ * spinning that long would waste more than sleeping costs. Until there is an
+ * average, the window is the longest.
+ */
+static void bio_poll(blockdev_t *bd, bio_t *bio)
+{
+    uint64_t avg = bd->bd_poll_avg;
+    if (avg > BLOCKDEV_POLL_MAX_CYCLES)
+    {
+        return;
+    }
+    uint64_t window = avg ? MIN(2 * avg, (uint64_t)BLOCKDEV_POLL_MAX_CYCLES)
+                          : BLOCKDEV_POLL_MAX_CYCLES;
+    uint64_t deadline = bio->bio_start + window;
+    while (!bio->bio_done && cpuid_rdtsc() < deadline)
+    {
+        if (!bd->bd_ops->poll(bd))
+        {
+            __asm__("pause;");
+        }
+    }
+}
+
+long bio_wait(bio_t *bio)
+{
+    KASSERT(!bio->bio_end && "bio_wait() on a bio with a completion callback");
+    blockdev_t *bd = bio->bio_bdev;
+    long polled = bd && bd->bd_ops->poll;
+    if (polled)
+    {
+        bio_poll(bd, bio);
+    }
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&bio->bio_lock);
+    while (!bio->bio_done)
+    {
+        sched_sleep_on(&bio->bio_waitq, &bio->bio_lock);
+        spinlock_lock(&bio->bio_lock);
+    }
+    spinlock_unlock(&bio->bio_lock);
+    intr_setipl(ipl);
+
+    if (polled)
+    {
+        uint64_t cycles = cpuid_rdtsc() - bio->bio_start;
+        bd->bd_poll_avg =
+            bd->bd_poll_avg ? (bd->bd_poll_avg * 7 + cycles) / 8 : cycles;
+    }
+    return bio->bio_error;
+}
@@ -1,23 +1,67 @@
+#include "errno.h"
 #include "kernel.h"
 #include "util/debug.h"
+#include <drivers/disk/ramdisk.h>
 #include <drivers/disk/sata.h>
+#include <drivers/disk/stripe.h>
 
 #include "drivers/blockdev.h"
+#include "drivers/bootra.h"
 
+#include "main/interrupt.h"
+
+#include "mm/pagetable.h"
 #include "mm/pframe.h"
+#include "mm/slab.h"
+
+static long blockdev_get_pframe(mobj_t *mobj, uint64_t pagenum, long forwrite,
+                               pframe_t **pfp);
 
 static long blockdev_fill_pframe(mobj_t *mobj, pframe_t *pf);
 
 static long blockdev_flush_pframe(mobj_t *mobj, pframe_t *pf);
 
-static mobj_ops_t blockdev_mobj_ops = {.get_pframe = NULL,
+static long blockdev_rw_sync(blockdev_t *bd, blocknum_t block, void *buf,
+                             long write);
+
+static mobj_ops_t blockdev_mobj_ops = {.get_pframe = blockdev_get_pframe,
                                        .fill_pframe = blockdev_fill_pframe,
                                        .flush_pframe = blockdev_flush_pframe,
                                        .destructor = NULL};
 
 static list_t blockdevs = LIST_INITIALIZER(blockdevs);
 
-void blockdev_init() { sata_init(); }
+/*
+ * A bio transferring a run of consecutive blocks to or from separate pframes.
+ */
+typedef struct blockdev_cluster
+{
+    bio_t cl_bio;
+    bio_vec_t cl_vecs[BLOCKDEV_CLUSTER_BLOCKS];
+    pframe_t *cl_pframes[BLOCKDEV_CLUSTER_BLOCKS];
+    size_t cl_npframes;
+    blocknum_t cl_block; /* the first block */
+    list_link_t cl_link; /* link on blockdev_ra_done, for readahead */
+} blockdev_cluster_t;
+
+static slab_allocator_t *blockdev_cluster_allocator;
+
+/* Finished readahead bios. Completion happens in interrupt context, where the
+ * slab allocator can't be used, so they are freed by the next readahead. */
+static list_t blockdev_ra_done = LIST_INITIALIZER(blockdev_ra_done);
+static spinlock_t blockdev_ra_lock = SPINLOCK_INITIALIZER(blockdev_ra_lock);
+
+void blockdev_init()
+{
+    blockdev_cluster_allocator =
+        slab_allocator_create("blockdev_cluster", sizeof(blockdev_cluster_t));
+    KASSERT(blockdev_cluster_allocator);
+    bio_init();
+    iosched_init();
+    sata_init();
+    stripe_init();
+    ramdisk_init();
+}
 
 long blockdev_register(blockdev_t *dev)
 {
@@ -34,12 +78,605 @@ long blockdev_register(blockdev_t *dev)
         }
     }
 
-    mobj_init(&dev->bd_mobj, MOBJ_BLOCKDEV, &blockdev_mobj_ops);
+    if (dev->bd_ops->submit)
+    {
+        iosched_queue_init(&dev->bd_queue);
+    }
+    else if (!dev->bd_ops->submit_bio)
+    {
+        dev->bd_fua = 1;
+    }
+    dev->bd_poll_avg = 0;
+    for (size_t i = 0; i < BLOCKDEV_NSHARDS; i++)
+    {
+        mobj_init(&dev->bd_shards[i].bs_mobj, MOBJ_BLOCKDEV,
+                  &blockdev_mobj_ops);
+        dev->bd_shards[i].bs_bdev = dev;
+    }
 
     list_insert_tail(&blockdevs, &dev->bd_link);
     return 0;
 }
 
+void blockdev_plug(blockdev_t *bd)
+{
+    if (!bd->bd_ops->submit)
+    {
+        return;
+    }
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&bd->bd_queue.iq_lock);
+    bd->bd_queue.iq_plugged++;
+    spinlock_unlock(&bd->bd_queue.iq_lock);
+    intr_setipl(ipl);
+}
+
+void blockdev_unplug(blockdev_t *bd)
+{
+    if (!bd->bd_ops->submit)
+    {
+        return;
+    }
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&bd->bd_queue.iq_lock);
+    KASSERT(bd->bd_queue.iq_plugged);
+    bd->bd_queue.iq_plugged--;
+    spinlock_unlock(&bd->bd_queue.iq_lock);
+    intr_setipl(ipl);
+    iosched_run(bd);
+}
+
+static void blockdev_cluster_add(blockdev_cluster_t *cl, pframe_t *pf)
+{
+    KASSERT(cl->cl_npframes < BLOCKDEV_CLUSTER_BLOCKS);
+    cl->cl_vecs[cl->cl_npframes].bv_phys =
+        pt_virt_to_phys((uintptr_t)pf->pf_addr);
+    cl->cl_vecs[cl->cl_npframes].bv_len = BLOCK_SIZE;
+    cl->cl_pframes[cl->cl_npframes++] = pf;
+}
+
+static void blockdev_readahead_end(bio_t *bio)
+{
+    blockdev_cluster_t *ra = bio->bio_private;
+    for (size_t i = 0; i < ra->cl_npframes; i++)
+    {
+        pframe_fill_done(ra->cl_pframes[i], bio->bio_error);
+    }
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&blockdev_ra_lock);
+    list_insert_tail(&blockdev_ra_done, &ra->cl_link);
+    spinlock_unlock(&blockdev_ra_lock);
+    intr_setipl(ipl);
+}
+
+static void blockdev_readahead_reap()
+{
+    list_t done;
+    list_init(&done);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&blockdev_ra_lock);
+    list_iterate(&blockdev_ra_done, ra, blockdev_cluster_t, cl_link)
+    {
+        list_remove(&ra->cl_link);
+        list_insert_tail(&done, &ra->cl_link);
+    }
+    spinlock_unlock(&blockdev_ra_lock);
+    intr_setipl(ipl);
+
+    list_iterate(&done, ra, blockdev_cluster_t, cl_link)
+    {
+        list_remove(&ra->cl_link);
+        slab_obj_free(blockdev_cluster_allocator, ra);
+    }
+}
+
+static void blockdev_readahead_submit(blockdev_t *bd, blockdev_cluster_t *ra)
+{
+    bio_t *bio = &ra->cl_bio;
+    bio_prepare_vec(bio, bd, ra->cl_block, ra->cl_vecs, ra->cl_npframes, 0);
+    bio->bio_end = blockdev_readahead_end;
+    bio->bio_private = ra;
+    long ret = bio_submit(bio);
+    if (ret)
+    {
+        /* fail the fills; whoever wants the blocks will read them again */
+        bio_complete(bio, ret);
+    }
+}
+
+void blockdev_readahead(blockdev_t *bd, const blocknum_t *blocks,
+                        size_t nblocks)
+{
+    blockdev_readahead_reap();
+
+    mobj_t *o = NULL;
+    blockdev_plug(bd);
+    blockdev_cluster_t *ra = NULL;
+    for (size_t i = 0; i < nblocks; i++)
+    {
+        if (blockdev_mobj(bd, blocks[i]) != o)
+        {
+            if (o)
+            {
+                mobj_unlock(o);
+            }
+            o = blockdev_mobj(bd, blocks[i]);
+            mobj_lock(o);
+        }
+        if (ra && (ra->cl_npframes == BLOCKDEV_CLUSTER_BLOCKS ||
+                   ra->cl_block + ra->cl_npframes != blocks[i]))
+        {
+            blockdev_readahead_submit(bd, ra);
+            ra = NULL;
+        }
+
+        pframe_t *pf;
+        if (mobj_start_fill_pframe(o, blocks[i], &pf))
+        {
+            /* resident already, or out of memory */
+            continue;
+        }
+        if (!ra)
+        {
+            if (!(ra = slab_obj_alloc(blockdev_cluster_allocator)))
+            {
+                pframe_fill_done(pf, -ENOMEM);
+                pframe_release(&pf);
+                break;
+            }
+            ra->cl_npframes = 0;
+            ra->cl_block = blocks[i];
+        }
+        blockdev_cluster_add(ra, pf);
+        pframe_release(&pf);
+    }
+    if (ra)
+    {
+        blockdev_readahead_submit(bd, ra);
+    }
+    blockdev_unplug(bd);
+    if (o)
+    {
+        mobj_unlock(o);
+    }
+}
+
+void blockdev_readahead_pages(blockdev_t *bd, blocknum_t block, mobj_t *o,
+                              uint64_t pagenum, size_t n)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    blockdev_readahead_reap();
+
+    blockdev_plug(bd);
+    blockdev_cluster_t *ra = NULL;
+    for (size_t i = 0; i < n; i++)
+    {
+        pframe_t *pf;
+        long ret = mobj_start_fill_pframe(o, pagenum + i, &pf);
+        if (!ret)
+        {
+            bootra_record(bd, block + (blocknum_t)i);
+            if (bootra_take(bd, block + (blocknum_t)i, pf->pf_addr))
+            {
+                pframe_fill_done(pf, 0);
+                pframe_release(&pf);
+                ret = -EEXIST;
+            }
+        }
+        if (ret)
+        {
+            /* resident already, read ahead at boot, or out of memory: the
+             * run is broken */
+            if (ra)
+            {
+                blockdev_readahead_submit(bd, ra);
+                ra = NULL;
+            }
+            continue;
+        }
+        if (ra && ra->cl_npframes == BLOCKDEV_CLUSTER_BLOCKS)
+        {
+            blockdev_readahead_submit(bd, ra);
+            ra = NULL;
+        }
+        if (!ra)
+        {
+            if (!(ra = slab_obj_alloc(blockdev_cluster_allocator)))
+            {
+                pframe_fill_done(pf, -ENOMEM);
+                pframe_release(&pf);
+                break;
+            }
+            ra->cl_npframes = 0;
+            ra->cl_block = block + (blocknum_t)i;
+        }
+        blockdev_cluster_add(ra, pf);
+        pframe_release(&pf);
+    }
+    if (ra)
+    {
+        blockdev_readahead_submit(bd, ra);
+    }
+    blockdev_unplug(bd);
+}
+
+long blockdev_rw_pframes(blockdev_t *bd, blocknum_t block, pframe_t **pfs,
+                         size_t n, long write)
+{
+    KASSERT(n && n <= BLOCKDEV_CLUSTER_BLOCKS);
+    if (!write)
+    {
+        size_t taken = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            bootra_record(bd, block + (blocknum_t)i);
+            taken += bootra_take(bd, block + (blocknum_t)i, pfs[i]->pf_addr);
+        }
+        if (taken == n)
+        {
+            return 0;
+        }
+    }
+    blockdev_cluster_t *cl = slab_obj_alloc(blockdev_cluster_allocator);
+    long ret = 0;
+    if (!cl)
+    {
+        for (size_t i = 0; i < n && !ret; i++)
+        {
+            ret = blockdev_rw_sync(bd, block + (blocknum_t)i, pfs[i]->pf_addr,
+                                   write);
+        }
+        return ret;
+    }
+    cl->cl_npframes = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        blockdev_cluster_add(cl, pfs[i]);
+    }
+    bio_prepare_vec(&cl->cl_bio, bd, block, cl->cl_vecs, n, write);
+    ret = bio_submit(&cl->cl_bio);
+    if (!ret)
+    {
+        ret = bio_wait(&cl->cl_bio);
+    }
+    slab_obj_free(blockdev_cluster_allocator, cl);
+    return ret;
+}
+
+/*
+ * Start writing a run of locked dirty pframes with one bio. Returns NULL if no
+ * cluster could be allocated, in which case blockdev_writeback_finish() writes
+ * them one at a time instead.
+ */
+static blockdev_cluster_t *blockdev_writeback_start(blockdev_t *bd,
+                                                    pframe_t **pfs, size_t n)
+{
+    blockdev_cluster_t *cl = slab_obj_alloc(blockdev_cluster_allocator);
+    if (!cl)
+    {
+        return NULL;
+    }
+    cl->cl_npframes = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        blockdev_cluster_add(cl, pfs[i]);
+    }
+    bio_prepare_vec(&cl->cl_bio, bd, (blocknum_t)pfs[0]->pf_pagenum,
+                    cl->cl_vecs, n, 1);
+    long ret = bio_submit(&cl->cl_bio);
+    if (ret)
+    {
+        bio_complete(&cl->cl_bio, ret);
+    }
+    return cl;
+}
+
+/*
+ * Wait for a run started with blockdev_writeback_start(), mark its pframes
+ * clean if it succeeded, and release them.
+ */
+static long blockdev_writeback_finish(blockdev_t *bd, blockdev_cluster_t *cl,
+                                      pframe_t **pfs, size_t n)
+{
+    long ret = 0;
+    if (cl)
+    {
+        ret = bio_wait(&cl->cl_bio);
+        slab_obj_free(blockdev_cluster_allocator, cl);
+    }
+    else
+    {
+        for (size_t i = 0; i < n && !ret; i++)
+        {
+            ret = blockdev_rw_sync(bd, (blocknum_t)pfs[i]->pf_pagenum,
+                                   pfs[i]->pf_addr, 1);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!ret)
+        {
+            mobj_clean_pframe(pfs[i]->pf_obj, pfs[i]);
+        }
+        pframe_release(&pfs[i]);
+    }
+    return ret;
+}
+
+/*
+ * Write a batch of locked pframes of the device, and release them. Those that
+ * have been cleaned since they were collected are dropped, the rest sorted by
+ * block number and split into runs of consecutive blocks, and a bio started
+ * for each with the queue plugged, so that they reach the disk together and
+ * in order. Returns 0 or the first error, with the number of pframes written
+ * and cleaned in *writtenp.
+ */
+static long blockdev_write_pframes(blockdev_t *bd, pframe_t **pfs, size_t n,
+                                   size_t *writtenp)
+{
+    blockdev_cluster_t *cls[BLOCKDEV_WRITEBACK_BATCH];
+    size_t runs[BLOCKDEV_WRITEBACK_BATCH + 1];
+    KASSERT(n <= BLOCKDEV_WRITEBACK_BATCH);
+
+    /* insertion sort; n is small */
+    size_t ndirty = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        pframe_t *pf = pfs[i];
+        if (!pf->pf_dirty)
+        {
+            mobj_clean_pframe(pf->pf_obj, pf);
+            pframe_release(&pf);
+            continue;
+        }
+        size_t j = ndirty++;
+        for (; j > 0 && pfs[j - 1]->pf_pagenum > pf->pf_pagenum; j--)
+        {
+            pfs[j] = pfs[j - 1];
+        }
+        pfs[j] = pf;
+    }
+
+    size_t nruns = 0;
+    runs[0] = 0;
+    for (size_t i = 1; i <= ndirty; i++)
+    {
+        if (i == ndirty || i - runs[nruns] == BLOCKDEV_CLUSTER_BLOCKS ||
+            pfs[i]->pf_pagenum != pfs[i - 1]->pf_pagenum + 1)
+        {
+            runs[++nruns] = i;
+        }
+    }
+    blockdev_plug(bd);
+    for (size_t r = 0; r < nruns; r++)
+    {
+        cls[r] =
+            blockdev_writeback_start(bd, pfs + runs[r], runs[r + 1] - runs[r]);
+    }
+    blockdev_unplug(bd);
+
+    long ret = 0;
+    *writtenp = 0;
+    for (size_t r = 0; r < nruns; r++)
+    {
+        long err = blockdev_writeback_finish(bd, cls[r], pfs + runs[r],
+                                             runs[r + 1] - runs[r]);
+        if (!err)
+        {
+            *writtenp += runs[r + 1] - runs[r];
+        }
+        ret = ret ? ret : err;
+    }
+    return ret;
+}
+
+/* blockdev_writeback() for one shard; returns -1 if a write failed. */
+static long blockdev_writeback_shard(blockdev_t *bd, mobj_t *o,
+                                     uint64_t dirtied_before, size_t max,
+                                     size_t *writtenp)
+{
+    pframe_t *pfs[BLOCKDEV_WRITEBACK_BATCH];
+    size_t written = *writtenp;
+    long ret = 0;
+    while (written < max)
+    {
+        mobj_lock(o);
+        size_t n = mobj_collect_dirty(o, dirtied_before, pfs,
+                                      MIN(max - written,
+                                          (size_t)BLOCKDEV_WRITEBACK_BATCH));
+        /* A thread holding one of these pframes may be waiting for the mobj
+         * (e.g. to get the next block of a file), so waiting for it here could
+         * deadlock; busy pframes are left for the next pass instead. Nothing
+         * else runs between the check and the lock, which cannot block. Pinned
+         * pframes are written by their journal commit. */
+        size_t nlocked = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!pframe_locked(pfs[i]))
+            {
+                pframe_lock(pfs[i]);
+                if (pfs[i]->pf_pinned)
+                {
+                    pframe_release(&pfs[i]);
+                    continue;
+                }
+                pfs[nlocked++] = pfs[i];
+            }
+        }
+        mobj_unlock(o);
+        if (!nlocked)
+        {
+            break;
+        }
+        n = nlocked;
+
+        size_t nwritten;
+        ret = blockdev_write_pframes(bd, pfs, n, &nwritten);
+        written += nwritten;
+        if (ret)
+        {
+            /* leave the failed pages for the next attempt rather than
+             * retrying them right away */
+            dbg(DBG_DISK, "writeback to device %u failed: %ld\n", bd->bd_id,
+                ret);
+            break;
+        }
+    }
+    *writtenp = written;
+    return ret ? -1 : 0;
+}
+
+size_t blockdev_writeback(blockdev_t *bd, uint64_t dirtied_before, size_t max)
+{
+    size_t written = 0;
+    for (size_t i = 0; i < BLOCKDEV_NSHARDS && written < max; i++)
+    {
+        if (blockdev_writeback_shard(bd, &bd->bd_shards[i].bs_mobj,
+                                     dirtied_before, max, &written))
+        {
+            break;
+        }
+    }
+    return written;
+}
+
+long blockdev_flush(blockdev_t *bd)
+{
+    long ret = 0;
+    for (size_t i = 0; i < BLOCKDEV_NSHARDS; i++)
+    {
+        mobj_t *o = &bd->bd_shards[i].bs_mobj;
+        mobj_lock(o);
+        ret |= mobj_flush(o);
+        mobj_unlock(o);
+    }
+    return ret;
+}
+
+/*
+ * Like blockdev_writeback(), but for the given blocks only, and pframes busy
+ * in another thread are waited for (one at a time, as in msync()) rather than
+ * skipped, since the caller needs them on disk. Pinned pframes are still
+ * skipped: their journal commit writes them.
+ */
+long blockdev_sync_blocks(blockdev_t *bd, blocknum_t *blocks, size_t nblocks)
+{
+    pframe_t *pfs[BLOCKDEV_WRITEBACK_BATCH];
+    blocknum_t busy[BLOCKDEV_WRITEBACK_BATCH];
+
+    /* shell sort, since callers pass whole files' worth of blocks */
+    size_t gap = 1;
+    while (gap < nblocks / 3)
+    {
+        gap = gap * 3 + 1;
+    }
+    for (; gap; gap /= 3)
+    {
+        for (size_t i = gap; i < nblocks; i++)
+        {
+            blocknum_t b = blocks[i];
+            size_t j = i;
+            for (; j >= gap && blocks[j - gap] > b; j -= gap)
+            {
+                blocks[j] = blocks[j - gap];
+            }
+            blocks[j] = b;
+        }
+    }
+
+    long ret = 0;
+    size_t i = 0;
+    while (i < nblocks && !ret)
+    {
+        size_t n = 0;
+        size_t nbusy = 0;
+        mobj_t *o = NULL;
+        for (; i < nblocks && n < BLOCKDEV_WRITEBACK_BATCH &&
+               nbusy < BLOCKDEV_WRITEBACK_BATCH;
+             i++)
+        {
+            if (i && blocks[i] == blocks[i - 1])
+            {
+                continue;
+            }
+            if (blockdev_mobj(bd, blocks[i]) != o)
+            {
+                if (o)
+                {
+                    mobj_unlock(o);
+                }
+                o = blockdev_mobj(bd, blocks[i]);
+                mobj_lock(o);
+            }
+            pframe_t *pf = radix_tree_lookup(&o->mo_pframe_idx, blocks[i]);
+            if (!pf || !pf->pf_dirty)
+            {
+                continue;
+            }
+            if (pframe_locked(pf))
+            {
+                busy[nbusy++] = blocks[i];
+                continue;
+            }
+            pframe_lock(pf);
+            if (pf->pf_pinned)
+            {
+                pframe_release(&pf);
+                continue;
+            }
+            pfs[n++] = pf;
+        }
+        if (o)
+        {
+            mobj_unlock(o);
+        }
+
+        size_t nwritten;
+        ret = blockdev_write_pframes(bd, pfs, n, &nwritten);
+        for (size_t b = 0; b < nbusy && !ret; b++)
+        {
+            pframe_t *pf;
+            o = blockdev_mobj(bd, busy[b]);
+            mobj_lock(o);
+            mobj_find_pframe(o, busy[b], &pf);
+            if (pf)
+            {
+                ret = pf->pf_pinned ? 0 : mobj_flush_pframe(o, pf);
+                pframe_release(&pf);
+            }
+            mobj_unlock(o);
+        }
+    }
+    return ret;
+}
+
+long blockdev_flush_cache(blockdev_t *bd)
+{
+    return bd->bd_ops->flush ? bd->bd_ops->flush(bd) : 0;
+}
+
+long blockdev_discard(blockdev_t *bd, const blockdev_range_t *ranges,
+                      size_t nranges)
+{
+    if (!bd->bd_ops->discard)
+    {
+        return -ENOTSUP;
+    }
+    return nranges ? bd->bd_ops->discard(bd, ranges, nranges) : 0;
+}
+
+size_t blockdev_writeback_all(uint64_t dirtied_before)
+{
+    size_t written = 0;
+    list_iterate(&blockdevs, bd, blockdev_t, bd_link)
+    {
+        written += blockdev_writeback(bd, dirtied_before, (size_t)-1);
+    }
+    return written;
+}
+
 blockdev_t *blockdev_lookup(devid_t id)
 {
     list_iterate(&blockdevs, bd, blockdev_t, bd_link)
@@ -52,13 +689,55 @@ blockdev_t *blockdev_lookup(devid_t id)
     return NULL;
 }
 
+/*
+ * Transfer one block through the bio layer and wait for it.
+ */
+static long blockdev_rw_sync(blockdev_t *bd, blocknum_t block, void *buf,
+                             long write)
+{
+    bio_t bio;
+    bio_prepare(&bio, bd, block, 1, buf, write);
+    long ret = bio_submit(&bio);
+    if (!ret)
+    {
+        ret = bio_wait(&bio);
+    }
+    return ret;
+}
+
+/*
+ * A block that is not resident is read with only its pframe marked as
+ * filling, and the shard unlocked, so that gets of other blocks of the shard
+ * (most of which are cached) are not held up behind the read; anyone getting
+ * the block meanwhile waits for the fill (see mobj_default_get_pframe()).
+ */
+static long blockdev_get_pframe(mobj_t *mobj, uint64_t pagenum, long forwrite,
+                               pframe_t **pfp)
+{
+    pframe_t *pf;
+    bootra_record(CONTAINER_OF(mobj, blockdev_shard_t, bs_mobj)->bs_bdev,
+                  (blocknum_t)pagenum);
+    if (!mobj_start_fill_pframe(mobj, pagenum, &pf))
+    {
+        blockdev_t *bd = CONTAINER_OF(mobj, blockdev_shard_t, bs_mobj)->bs_bdev;
+        pframe_t *filling = pf;
+        pframe_release(&pf);
+        mobj_unlock(mobj);
+        /* a filling pframe is neither evicted nor freed */
+        pframe_fill_done(filling,
+                         blockdev_rw_sync(bd, (blocknum_t)pagenum,
+                                          filling->pf_addr, 0));
+        mobj_lock(mobj);
+    }
+    return mobj_default_get_pframe(mobj, pagenum, forwrite, pfp);
+}
+
 static long blockdev_fill_pframe(mobj_t *mobj, pframe_t *pf)
 {
     KASSERT(mobj && pf);
     KASSERT(pf->pf_pagenum <= (1UL << (8 * sizeof(blocknum_t))));
-    blockdev_t *bd = CONTAINER_OF(mobj, blockdev_t, bd_mobj);
-    return bd->bd_ops->read_block(bd, pf->pf_addr, (blocknum_t)pf->pf_pagenum,
-                                  1);
+    blockdev_t *bd = CONTAINER_OF(mobj, blockdev_shard_t, bs_mobj)->bs_bdev;
+    return blockdev_rw_sync(bd, (blocknum_t)pf->pf_pagenum, pf->pf_addr, 0);
 }
 
 static long blockdev_flush_pframe(mobj_t *mobj, pframe_t *pf)
@@ -66,7 +745,6 @@ static long blockdev_flush_pframe(mobj_t *mobj, pframe_t *pf)
     KASSERT(mobj && pf);
     KASSERT(pf->pf_pagenum <= (1UL << (8 * sizeof(blocknum_t))));
     dbg(DBG_S5FS, "writing disk block %lu\n", pf->pf_pagenum);
-    blockdev_t *bd = CONTAINER_OF(mobj, blockdev_t, bd_mobj);
-    return bd->bd_ops->write_block(bd, pf->pf_addr, (blocknum_t)pf->pf_pagenum,
-                                   1);
+    blockdev_t *bd = CONTAINER_OF(mobj, blockdev_shard_t, bs_mobj)->bs_bdev;
+    return blockdev_rw_sync(bd, (blocknum_t)pf->pf_pagenum, pf->pf_addr, 1);
 }
@@ -0,0 +1,331 @@
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/bootra.h"
+
+#include "fs/fcntl.h"
+#include "fs/vfs_syscall.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#define BOOTRA_MAGIC 0x61727462 /* "btra" */
+
+/* BOOTRA_FILE: the header, then bh_count keys (see bootra_key()) in
+ * increasing order */
+typedef struct bootra_header
+{
+    uint32_t bh_magic;
+    uint32_t bh_count;
+} bootra_header_t;
+
+/*
+ * The blocks recorded, as an open addressing hash table of keys, 0 for an
+ * empty slot. It is filled without a lock, slots being claimed with a
+ * compare-and-swap, and never more than half full, so that probes are short
+ * and always end at an empty slot.
+ */
+#define BOOTRA_TABLE_SIZE (2 * BOOTRA_MAX_BLOCKS)
+
+static long bootra_recording = 1;
+static size_t bootra_nrecorded;
+static uint64_t bootra_table[BOOTRA_TABLE_SIZE];
+
+/*
+ * The blocks read ahead at boot, in increasing order, and a bit for each that
+ * is set while bootra_take() may still hand it out. They are set before
+ * bootra_offering is, and not changed afterwards.
+ */
+static uint64_t bootra_keys[BOOTRA_MAX_BLOCKS];
+static uint64_t bootra_pending[BOOTRA_MAX_BLOCKS / 64];
+static size_t bootra_nkeys;
+static long bootra_offering;
+
+static uint64_t bootra_key(devid_t dev, blocknum_t block)
+{
+    /* never 0, as no device is NULL_DEVID */
+    return ((uint64_t)dev << 32) | block;
+}
+
+void bootra_record(blockdev_t *bd, blocknum_t block)
+{
+    if (!__atomic_load_n(&bootra_recording, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    uint64_t key = bootra_key(bd->bd_id, block);
+    size_t i = (size_t)((key * 0x9e3779b97f4a7c15UL) >> 32) &
+               (BOOTRA_TABLE_SIZE - 1);
+    while (1)
+    {
+        uint64_t cur = __atomic_load_n(&bootra_table[i], __ATOMIC_RELAXED);
+        if (cur == key)
+        {
+            return;
+        }
+        if (!cur)
+        {
+            /* count the key first, so that the table never fills up */
+            if (__atomic_fetch_add(&bootra_nrecorded, 1, __ATOMIC_RELAXED) >=
+                BOOTRA_MAX_BLOCKS)
+            {
+                /* what has been recorded will have to do */
+                __atomic_store_n(&bootra_recording, 0, __ATOMIC_RELAXED);
+                return;
+            }
+            if (__atomic_compare_exchange_n(&bootra_table[i], &cur, key, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                return;
+            }
+            __atomic_sub_fetch(&bootra_nrecorded, 1, __ATOMIC_RELAXED);
+            if (cur == key)
+            {
+                return;
+            }
+        }
+        i = (i + 1) & (BOOTRA_TABLE_SIZE - 1);
+    }
+}
+
+/* Returns the index of key in bootra_keys, or -1 */
+static ssize_t bootra_find(uint64_t key)
+{
+    size_t lo = 0;
+    size_t hi = bootra_nkeys;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (bootra_keys[mid] < key)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo < bootra_nkeys && bootra_keys[lo] == key ? (ssize_t)lo : -1;
+}
+
+/* Clears the pending bit of bootra_keys[i]; returns whether it was set */
+static long bootra_claim(size_t i)
+{
+    uint64_t bit = 1UL << (i % 64);
+    return !!(__atomic_fetch_and(&bootra_pending[i / 64], ~bit,
+                                 __ATOMIC_RELAXED) &
+              bit);
+}
+
+long bootra_take(blockdev_t *bd, blocknum_t block, void *dst)
+{
+    if (!__atomic_load_n(&bootra_offering, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    ssize_t i = bootra_find(bootra_key(bd->bd_id, block));
+    if (i < 0 || !bootra_claim((size_t)i))
+    {
+        return 0;
+    }
+
+    mobj_t *o = blockdev_mobj(bd, block);
+    mobj_lock(o);
+    pframe_t *pf;
+    mobj_find_pframe(o, block, &pf);
+    long ret = 0;
+    /* a read still in flight is not waited for: the caller may have the
+     * device plugged (see blockdev_plug()), and then it would never end */
+    if (pf && pf->pf_addr && !pf->pf_filling && !pf->pf_fill_error &&
+        !pf->pf_dirty)
+    {
+        page_copy(dst, pf->pf_addr);
+        ret = 1;
+        /* the copy in the file's pages is the one that is kept */
+        mobj_free_pframe(o, &pf);
+    }
+    if (pf)
+    {
+        pframe_release(&pf);
+    }
+    mobj_unlock(o);
+    return ret;
+}
+
+void bootra_forget(blockdev_t *bd, blocknum_t block, size_t n)
+{
+    if (!__atomic_load_n(&bootra_offering, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    for (size_t j = 0; j < n; j++)
+    {
+        ssize_t i = bootra_find(bootra_key(bd->bd_id, block + (blocknum_t)j));
+        if (i >= 0)
+        {
+            bootra_claim((size_t)i);
+        }
+    }
+}
+
+/*
+ * Read BOOTRA_FILE, saved by the last boot, and start reading ahead the
+ * blocks it lists, a device at a time.
+ */
+static void bootra_replay()
+{
+    long fd = do_open(BOOTRA_FILE, O_RDONLY);
+    if (fd < 0)
+    {
+        dbg(DBG_DISK, "bootra: no %s, nothing to read ahead\n", BOOTRA_FILE);
+        return;
+    }
+    bootra_header_t header;
+    size_t n = 0;
+    if (do_read((int)fd, &header, sizeof(header)) == sizeof(header) &&
+        header.bh_magic == BOOTRA_MAGIC &&
+        header.bh_count <= BOOTRA_MAX_BLOCKS)
+    {
+        ssize_t size = header.bh_count * sizeof(uint64_t);
+        if (do_read((int)fd, bootra_keys, (size_t)size) == size)
+        {
+            n = header.bh_count;
+        }
+    }
+    do_close((int)fd);
+    /* each key once and in order, or bootra_find() goes astray */
+    for (size_t i = 1; i < n; i++)
+    {
+        if (bootra_keys[i - 1] >= bootra_keys[i])
+        {
+            n = 0;
+        }
+    }
+    if (!n)
+    {
+        return;
+    }
+
+    bootra_nkeys = n;
+    memset(bootra_pending, 0xff, sizeof(bootra_pending));
+    __atomic_store_n(&bootra_offering, 1, __ATOMIC_RELEASE);
+
+    blocknum_t *blocks = kmalloc(n * sizeof(blocknum_t));
+    if (!blocks)
+    {
+        return;
+    }
+    for (size_t i = 0; i < n;)
+    {
+        devid_t dev = (devid_t)(bootra_keys[i] >> 32);
+        size_t nblocks = 0;
+        for (; i < n && (devid_t)(bootra_keys[i] >> 32) == dev; i++)
+        {
+            blocks[nblocks++] = (blocknum_t)bootra_keys[i];
+        }
+        blockdev_t *bd = blockdev_lookup(dev);
+        if (bd)
+        {
+            blockdev_readahead(bd, blocks, nblocks);
+        }
+    }
+    kfree(blocks);
+    dbg(DBG_DISK, "bootra: reading ahead %lu blocks\n", n);
+}
+
+/*
+ * Save the blocks recorded, sorted, in BOOTRA_FILE, for the next boot.
+ */
+static void bootra_save()
+{
+    uint64_t *keys = kmalloc(BOOTRA_MAX_BLOCKS * sizeof(uint64_t));
+    if (!keys)
+    {
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < BOOTRA_TABLE_SIZE && n < BOOTRA_MAX_BLOCKS; i++)
+    {
+        uint64_t key = __atomic_load_n(&bootra_table[i], __ATOMIC_RELAXED);
+        if (key)
+        {
+            keys[n++] = key;
+        }
+    }
+
+    /* shell sort, as in blockdev_sync_blocks() */
+    size_t gap = 1;
+    while (gap < n / 3)
+    {
+        gap = gap * 3 + 1;
+    }
+    for (; gap; gap /= 3)
+    {
+        for (size_t i = gap; i < n; i++)
+        {
+            uint64_t k = keys[i];
+            size_t j = i;
+            for (; j >= gap && keys[j - gap] > k; j -= gap)
+            {
+                keys[j] = keys[j - gap];
+            }
+            keys[j] = k;
+        }
+    }
+
+    long fd = do_open(BOOTRA_FILE, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd >= 0)
+    {
+        bootra_header_t header = {.bh_magic = BOOTRA_MAGIC,
+                                  .bh_count = (uint32_t)n};
+        do_write((int)fd, &header, sizeof(header));
+        do_write((int)fd, keys, n * sizeof(uint64_t));
+        do_close((int)fd);
+    }
+    dbg(DBG_DISK, "bootra: recorded %lu blocks (%ld)\n", n,
+        fd < 0 ? fd : 0);
+    kfree(keys);
+}
+
+static void *bootra_run(long arg1, void *arg2)
+{
+    bootra_replay();
+
+    time_t now = core_uptime();
+    long ret = 0;
+    if (now < BOOTRA_RECORD_MS)
+    {
+        ret = do_nanosleep((uint64_t)(BOOTRA_RECORD_MS - now) * 1000000, NULL);
+    }
+    __atomic_store_n(&bootra_recording, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bootra_offering, 0, __ATOMIC_RELAXED);
+    if (!ret)
+    {
+        /* not if cancelled, as the system is going down */
+        bootra_save();
+    }
+    return NULL;
+}
+
+void bootra_start()
+{
+    proc_t *proc = proc_create("bootra");
+    KASSERT(proc);
+    kthread_t *thr = kthread_create(proc, bootra_run, 0, NULL);
+    KASSERT(thr);
+    sched_make_runnable(thr);
+}
@@ -1,4 +1,5 @@
 #include "drivers/chardev.h"
+#include "drivers/fbdev.h"
 #include "drivers/memdevs.h"
 #include "drivers/tty/tty.h"
 #include "kernel.h"
@@ -10,6 +11,9 @@ void chardev_init()
 {
     tty_init();
     memdevs_init();
+#ifdef __VGABUF___
+    fbdev_init();
+#endif
 }
 
 long chardev_register(chardev_t *dev)
@@ -0,0 +1,153 @@
+#include <boot/config.h>
+#include <boot/multiboot_macros.h>
+#include <config.h>
+#include <drivers/blockdev.h>
+#include <drivers/dev.h>
+#include <drivers/disk/ramdisk.h>
+#include <errno.h>
+#include <kernel.h>
+#include <mm/page.h>
+#include <mm/vmalloc.h>
+#include <multiboot.h>
+#include <util/debug.h>
+#include <util/string.h>
+
+#define bdev_to_ramdisk(bd) (CONTAINER_OF((bd), ramdisk_t, rd_bdev))
+
+/* ramdisk_t - The RAM disk; see ramdisk.h. */
+typedef struct ramdisk
+{
+    blockdev_t rd_bdev;
+    char **rd_blocks; /* the page holding each block */
+    size_t rd_nblocks;
+} ramdisk_t;
+
+long ramdisk_read_block(blockdev_t *bdev, char *buf, blocknum_t loc,
+                        size_t block_count);
+long ramdisk_write_block(blockdev_t *bdev, const char *buf, blocknum_t loc,
+                         size_t block_count);
+
+/* ramdisk_ops - Block device operations for the RAM disk. It has no cache to
+ * flush, and with no submit operation its bios are copied as they are
+ * submitted. */
+static blockdev_ops_t ramdisk_ops = {
+    .read_block = ramdisk_read_block,
+    .write_block = ramdisk_write_block,
+    .submit = NULL,
+    .submit_bio = NULL,
+    .discard = NULL,
+    .flush = NULL,
+    .poll = NULL,
+};
+
+static ramdisk_t ramdisk;
+
+/**
+ * Copies blocks out of the RAM disk.
+ *
+ * @param  bdev        the RAM disk
+ * @param  buf         where to copy the blocks
+ * @param  loc         the first block
+ * @param  block_count the number of blocks
+ * @return             0 on success, or -EINVAL if a block is past the end
+ */
+long ramdisk_read_block(blockdev_t *bdev, char *buf, blocknum_t loc,
+                        size_t block_count)
+{
+    ramdisk_t *rd = bdev_to_ramdisk(bdev);
+    if (loc + block_count > rd->rd_nblocks)
+    {
+        return -EINVAL;
+    }
+    for (size_t i = 0; i < block_count; i++)
+    {
+        memcpy(buf + i * BLOCK_SIZE, rd->rd_blocks[loc + i], BLOCK_SIZE);
+    }
+    return 0;
+}
+
+/**
+ * Copies blocks into the RAM disk.
+ *
+ * @param  bdev        the RAM disk
+ * @param  buf         the blocks' new contents
+ * @param  loc         the first block
+ * @param  block_count the number of blocks
+ * @return             0 on success, or -EINVAL if a block is past the end
+ */
+long ramdisk_write_block(blockdev_t *bdev, const char *buf, blocknum_t loc,
+                         size_t block_count)
+{
+    ramdisk_t *rd = bdev_to_ramdisk(bdev);
+    if (loc + block_count > rd->rd_nblocks)
+    {
+        return -EINVAL;
+    }
+    for (size_t i = 0; i < block_count; i++)
+    {
+        memcpy(rd->rd_blocks[loc + i], buf + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    return 0;
+}
+
+/* ramdisk_module - Returns the first multiboot module, or NULL. */
+static struct multiboot_tag_module *ramdisk_module()
+{
+    for (struct multiboot_tag *tag =
+             (struct multiboot_tag *)((uintptr_t)(mb_tag + 1) + PHYS_OFFSET);
+         tag->type != MULTIBOOT_TAG_TYPE_END; tag += TAG_SIZE(tag->size))
+    {
+        if (tag->type == MULTIBOOT_TAG_TYPE_MODULE)
+        {
+            return (struct multiboot_tag_module *)tag;
+        }
+    }
+    return NULL;
+}
+
+void ramdisk_init()
+{
+    ramdisk_t *rd = &ramdisk;
+    struct multiboot_tag_module *module = ramdisk_module();
+    if (module)
+    {
+        /* the module is page-aligned (see boot.S), but its end need not be;
+         * the rest of its last page is reserved along with it */
+        KASSERT(PAGE_ALIGNED(module->mod_start));
+        rd->rd_nblocks =
+            (module->mod_end - module->mod_start + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+    else
+    {
+        rd->rd_nblocks = RAMDISK_BLOCKS;
+    }
+    if (!rd->rd_nblocks)
+    {
+        return;
+    }
+
+    rd->rd_blocks = kvmalloc(rd->rd_nblocks * sizeof(char *));
+    KASSERT(rd->rd_blocks);
+    for (size_t i = 0; i < rd->rd_nblocks; i++)
+    {
+        if (module)
+        {
+            rd->rd_blocks[i] =
+                (char *)(PHYS_OFFSET + module->mod_start + i * BLOCK_SIZE);
+        }
+        else
+        {
+            rd->rd_blocks[i] = page_alloc();
+            KASSERT(rd->rd_blocks[i]);
+            memset(rd->rd_blocks[i], 0, BLOCK_SIZE);
+        }
+    }
+
+    rd->rd_bdev.bd_id = MKDEVID(RAMDISK_MAJOR, 0);
+    rd->rd_bdev.bd_ops = &ramdisk_ops;
+    list_link_init(&rd->rd_bdev.bd_link);
+    long ret = blockdev_register(&rd->rd_bdev);
+    KASSERT(!ret);
+    dbg(DBG_DISK, "ramdisk: %lu blocks%s\n", rd->rd_nblocks,
+        module ? " from the boot module" : "");
+}
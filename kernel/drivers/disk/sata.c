@@ -1,3 +1,4 @@
+#include <drivers/bio.h>
 #include <drivers/blockdev.h>
 #include <drivers/disk/ahci.h>
 #include <drivers/disk/sata.h>
@@ -5,8 +6,10 @@
 #include <errno.h>
 #include <mm/kmalloc.h>
 #include <mm/page.h>
+#include <proc/workq.h>
 #include <util/debug.h>
 #include <util/string.h>
+#include <util/trace.h>
 
 #define ENABLE_NATIVE_COMMAND_QUEUING 1
 
@@ -17,16 +20,41 @@
 #define SATA_PCI_SUBCLASS 0x6   /* 0x6 = sata */
 #define SATA_AHCI_INTERFACE 0x1 /* 0x1 = ahci */
 
+/* PCI subsystem vendor ID that QEMU gives its emulated devices. */
+#define QEMU_PCI_SUBSYSTEM_VENDOR_ID 0x1af4
+
+/* Most polls of PxCI to wait for IDENTIFY DEVICE, which is issued before the
+ * port's interrupts are enabled. */
+#define AHCI_IDENTIFY_SPINS 100000000
+
+/* Per-port quirks, decided when the port is initialized. */
+#define AHCI_QUIRK_SERIALIZE 0x1 /* allow only one outstanding command; QEMU
+                                  * does not emulate NCQ with several queued
+                                  * commands correctly */
+
 static hba_t *hba; /* host bus adapter */
 
 /* If NCQ, this is an outstanding tag bitmap.
  * If standard, this is an outstanding command slot bitmap. */
 static uint32_t outstanding_requests[AHCI_MAX_NUM_PORTS] = {0};
 
-/* Each command slot on each port has a waitqueue for a thread waiting on a
- * command to finish execution. */
-static ktqueue_t outstanding_request_queues[AHCI_MAX_NUM_PORTS]
-                                           [AHCI_COMMAND_HEADERS_PER_LIST];
+/* Those of the outstanding requests that are NCQ commands. A non-queued command
+ * (e.g. DATA SET MANAGEMENT) can't be issued while any NCQ command is, nor the
+ * other way round. */
+static uint32_t queued_requests[AHCI_MAX_NUM_PORTS] = {0};
+
+/* Non-queued commands waiting for a port's NCQ commands to drain; no new NCQ
+ * command is issued meanwhile, so that they do get to run. */
+static uint32_t nonqueued_waiting[AHCI_MAX_NUM_PORTS] = {0};
+
+/* The request being serviced by each command slot on each port, completed
+ * by the interrupt handler. */
+static io_request_t *outstanding_reqs[AHCI_MAX_NUM_PORTS]
+                                     [AHCI_COMMAND_HEADERS_PER_LIST];
+
+/* The disk attached to each port, if any, whose queue is run when a command
+ * slot frees up. */
+static ata_disk_t *port_disks[AHCI_MAX_NUM_PORTS];
 
 /* Each port has a waitqueue for a thread waiting on a new command slot to open
  * up. */
@@ -35,28 +63,102 @@ static ktqueue_t command_slot_queues[AHCI_MAX_NUM_PORTS];
 /* SMP: Protect access to ports. */
 static spinlock_t port_locks[AHCI_MAX_NUM_PORTS];
 
+static uint32_t port_quirks[AHCI_MAX_NUM_PORTS];
+
+/* Set when a port reports a task file error, until its commands have been
+ * failed and it has been restarted (see ahci_service_port()). */
+static long port_failed[AHCI_MAX_NUM_PORTS];
+
+/* The HBA has a single MSI message, whose address picks the core its
+ * interrupts go to. Whenever no command is in flight on any port, it is
+ * pointed at the core issuing the next one, so that the completion is
+ * handled, and the waiting thread woken, where the I/O was submitted. Lock
+ * order: a port's lock, then ahci_msi_lock. */
+static msi_capability_t *ahci_msi;
+static long ahci_msi_core;      /* core the MSI address currently targets */
+static uint32_t ahci_inflight;  /* commands in flight on all ports */
+static spinlock_t ahci_msi_lock = SPINLOCK_INITIALIZER(ahci_msi_lock);
+
+/* Ports whose interrupts have been acknowledged, but whose finished commands
+ * have yet to be completed by ahci_work */
+static uint32_t ahci_ports_pending;
+static void ahci_interrupt_work(work_t *work);
+static work_t ahci_work = WORK_INITIALIZER(ahci_work, ahci_interrupt_work);
+
 long sata_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
                      size_t block_count);
 long sata_write_block(blockdev_t *bdev, const char *buf, blocknum_t block,
                       size_t block_count);
+long sata_submit(blockdev_t *bdev, io_request_t *req);
+long sata_discard(blockdev_t *bdev, const blockdev_range_t *ranges,
+                  size_t nranges);
+long sata_flush_cache(blockdev_t *bdev);
+long sata_poll(blockdev_t *bdev);
 
 /* sata_disk_ops - Block device operations for SATA devices. */
 static blockdev_ops_t sata_disk_ops = {
     .read_block = sata_read_block,
     .write_block = sata_write_block,
+    .submit = sata_submit,
+    .discard = sata_discard,
+    .flush = sata_flush_cache,
+    .poll = sata_poll,
 };
 
+/* ata_command_t - A non-queued command other than a read or write, for
+ * ahci_do_command(), which waits for it here. */
+typedef struct ata_command
+{
+    uint8_t ac_command;
+    uint16_t ac_features;
+    uint64_t ac_lba;
+    uint16_t ac_count;
+
+    spinlock_t ac_lock; /* protects ac_done and ac_error */
+    ktqueue_t ac_waitq;
+    long ac_done;
+    long ac_error;
+} ata_command_t;
+
 /* find_cmdslot - Checks various bitmaps to find the lowest index command slot
- * that is free for a given port. */
-inline long find_cmdslot(hba_port_t *port)
+ * that is free for a given port, for an NCQ command if queued is set. */
+inline long find_cmdslot(hba_port_t *port, int queued)
 {
     /* From 1.3.1: Free command slot will have corresponding bit clear in both
      * px_sact and px_ci. To be safe, also check against our local copy of
      * outstanding requests, in case a recently completed command is clear in
      * the port's actual descriptor, but has not been processed by Weenix yet.
      */
-    return __builtin_ctz(~(port->px_sact | port->px_ci |
-                           outstanding_requests[PORT_INDEX(hba, port)]));
+    size_t port_index = PORT_INDEX(hba, port);
+    uint32_t busy = port->px_sact | port->px_ci |
+                    outstanding_requests[port_index];
+    if (!~busy || (busy && (port_quirks[port_index] & AHCI_QUIRK_SERIALIZE)))
+    {
+        return -1;
+    }
+    uint32_t ncq = queued_requests[port_index];
+    if (queued ? (outstanding_requests[port_index] & ~ncq) ||
+                     nonqueued_waiting[port_index]
+               : ncq)
+    {
+        return -1;
+    }
+    return __builtin_ctz(~busy);
+}
+
+/* ahci_msi_target - Sends the HBA's interrupts to the given core. Logical
+ * destination mode is in use, each core's logical id being its bit. */
+static void ahci_msi_target(long core)
+{
+    if (ahci_msi->control.c64)
+    {
+        ahci_msi->address_data.ad64.addr = MSI_ADDRESS_FOR(1 << core);
+    }
+    else
+    {
+        ahci_msi->address_data.ad32.addr = MSI_ADDRESS_FOR(1 << core);
+    }
+    ahci_msi_core = core;
 }
 
 /* ensure_mapped - Wrapper for pt_map_range(). */
@@ -68,35 +170,83 @@ void ensure_mapped(void *addr, size_t size)
                  PT_WRITE | PT_PRESENT, PT_WRITE | PT_PRESENT);
 }
 
-kmutex_t because_qemu_doesnt_emulate_ahci_ncq_correctly;
+/* ahci_fill_prdt - Describes len bytes of physically contiguous memory at phys
+ * with PRDs starting at prdt, and returns the PRD after the last one used. */
+static prd_t *ahci_fill_prdt(command_table_t *command_table, prd_t *prdt,
+                             uint64_t phys, size_t len)
+{
+    while (len)
+    {
+        size_t chunk = MIN(len, (size_t)AHCI_MAX_PRDT_SIZE);
+        KASSERT(prdt < command_table->prdt + ACHI_NUM_PRDTS_PER_COMMAND_TABLE);
+        prdt->dbc = (uint32_t)(chunk - 1);
+        prdt->dba = phys;
+        phys += chunk;
+        len -= chunk;
+        prdt++;
+    }
+    return prdt;
+}
 
-/* ahci_do_operation - Sends a command to the HBA to initiate a disk operation.
- */
-long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
-                       int write)
+/* ahci_issue_operation - Sends a command to the HBA to initiate a disk
+ * operation, without waiting for it to finish. The interrupt handler calls
+ * req->ir_end once the command is done. If no command slot is free, returns
+ * -EBUSY if nonblock is set, and sleeps otherwise; unless the port has
+ * AHCI_QUIRK_SERIALIZE set, a port can service one command per command slot at
+ * once. Each segment of the request's bios gets its own PRD, so they need not
+ * be contiguous with each other.
+ *
+ * The command is a read or write of the request's blocks, or if cmd is given,
+ * that non-queued command, with the request's bios as its data. */
+static long ahci_issue_operation(hba_port_t *port, io_request_t *req,
+                                 int nonblock, const ata_command_t *cmd)
 {
-    kmutex_lock(&because_qemu_doesnt_emulate_ahci_ncq_correctly);
-    KASSERT(count && buf);
-    KASSERT(lba >= 0 && lba < 1L << 23);
+    uint64_t lba = cmd ? cmd->ac_lba
+                       : (uint64_t)req->ir_block * SATA_SECTORS_PER_BLOCK;
+    size_t count = cmd ? cmd->ac_count : req->ir_count * SATA_SECTORS_PER_BLOCK;
+    int write = (int)req->ir_write;
+    KASSERT(cmd || (count && count <= AHCI_MAX_SECTORS_PER_COMMAND));
+    KASSERT(lba + count <= ATA_MAX_LBA);
+#if ENABLE_NATIVE_COMMAND_QUEUING
+    int queued = !cmd && hba->ghc.cap.sncq;
+#else
+    int queued = 0;
+#endif
 
-    /* Obtain the port and the physical system memory in question. */
+    /* Obtain the port in question. */
     size_t port_index = PORT_INDEX(hba, port);
 
     uint8_t ipl = intr_setipl(IPL_HIGH);
     spinlock_lock(port_locks + port_index);
 
-    uint64_t physbuf = pt_virt_to_phys((uintptr_t)buf);
-
     /* Get an available command slot. */
     long command_slot;
-    while ((command_slot = find_cmdslot(port)) == -1)
+    long waiting = 0;
+    while ((command_slot = find_cmdslot(port, queued)) == -1)
     {
+        if (nonblock)
+        {
+            spinlock_unlock(port_locks + port_index);
+            intr_setipl(ipl);
+            return -EBUSY;
+        }
+        if (!queued && !waiting)
+        {
+            nonqueued_waiting[port_index]++;
+            waiting = 1;
+        }
+        /* freed slots wake every waiter, as find_cmdslot() may turn any one
+         * of them away; see ahci_service_port() */
         sched_sleep_on(command_slot_queues + port_index,
                        port_locks + port_index);
         /* Spinlock is important: find_cmdslot() does not actually reserve the
          * command slot. */
         spinlock_lock(port_locks + port_index);
     }
+    if (waiting)
+    {
+        nonqueued_waiting[port_index]--;
+    }
 
     /* Get corresponding command_header in the port's command_list. */
     command_list_t *command_list =
@@ -108,43 +258,56 @@ long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
     /* Command setup: Header. */
     command_header->cfl = sizeof(h2d_register_fis_t) / sizeof(uint32_t);
     command_header->write = (uint8_t)write;
-    command_header->prdtl = (uint16_t)(
-        ALIGN_UP_POW_2(count, AHCI_SECTORS_PER_PRDT) / AHCI_SECTORS_PER_PRDT);
-    KASSERT(command_header->prdtl);
 
     /* Command setup: Table. */
     command_table_t *command_table =
         (command_table_t *)(command_header->ctba + PHYS_OFFSET);
     memset(command_table, 0, sizeof(command_table_t));
 
-    /* Command setup: Physical region descriptor table. */
+    /* Command setup: Physical region descriptor table, with a PRD for every
+     * AHCI_MAX_PRDT_SIZE bytes of each segment of each bio. */
     prd_t *prdt = command_table->prdt;
-    /* Note that this loop is only called when the size of the data transfer is
-     * REALLY big. */
-    for (unsigned i = 0; i < command_header->prdtl - 1U; i++)
-    {
-        prdt->dbc = AHCI_MAX_PRDT_SIZE - 1;
-        prdt->dba = physbuf; /* Data from physical buffer. */
-        prdt->i = 1;         /* Set interrupt on completion. */
-        physbuf +=
-            AHCI_MAX_PRDT_SIZE; /* Advance physical buffer for next prd. */
-        prdt++;
+    list_iterate(&req->ir_bios, bio, bio_t, bio_link)
+    {
+        if (!bio->bio_nvecs)
+        {
+            prdt = ahci_fill_prdt(command_table, prdt,
+                                  pt_virt_to_phys((uintptr_t)bio->bio_buf),
+                                  bio->bio_count * SATA_BLOCK_SIZE);
+            continue;
+        }
+        for (size_t i = 0; i < bio->bio_nvecs; i++)
+        {
+            prdt = ahci_fill_prdt(command_table, prdt,
+                                  bio->bio_vecs[i].bv_phys,
+                                  bio->bio_vecs[i].bv_len);
+        }
     }
-    prdt->dbc = (uint32_t)(count % AHCI_SECTORS_PER_PRDT) * ATA_SECTOR_SIZE - 1;
-    prdt->dba = (uint64_t)physbuf;
+    command_header->prdtl = (uint16_t)(prdt - command_table->prdt);
+    KASSERT(command_header->prdtl || cmd);
 
     /* Set up the particular h2d_register_fis command (the only one we use). */
     h2d_register_fis_t *command_fis = &command_table->cfis.h2d_register_fis;
     command_fis->fis_type = fis_type_h2d_register;
     command_fis->c = 1;
     command_fis->device = ATA_DEVICE_LBA_MODE;
-    command_fis->lba = (uint32_t)lba;
-    command_fis->lba_exp = (uint32_t)(lba >> 24);
+    command_fis->lba = (uint32_t)(lba & 0xffffff);
+    command_fis->lba_exp = (uint32_t)((lba >> 24) & 0xffffff);
+
+    /* The sector count is truncated to 16 bits below; a count of exactly
+     * AHCI_MAX_SECTORS_PER_COMMAND becomes 0, which ATA takes to mean 65536. */
 
     /* NCQ: Allows the hardware to queue commands in its *own* order,
      * independent of software delivery. */
+    if (cmd)
+    {
+        command_fis->command = cmd->ac_command;
+        command_fis->features = (uint8_t)cmd->ac_features;
+        command_fis->features_exp = (uint8_t)(cmd->ac_features >> 8);
+        command_fis->sector_count = cmd->ac_count;
+    }
 #if ENABLE_NATIVE_COMMAND_QUEUING
-    if (hba->ghc.cap.sncq)
+    else if (queued)
     {
         /* For NCQ, sector count is stored in features. */
         command_fis->features = (uint8_t)count;
@@ -156,21 +319,25 @@ long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
         /* Choose the appropriate NCQ read/write command. */
         command_fis->command = (uint8_t)(write ? ATA_WRITE_FPDMA_QUEUED_COMMAND
                                                : ATA_READ_FPDMA_QUEUED_COMMAND);
+        if (write && req->ir_fua)
+        {
+            command_fis->device |= ATA_DEVICE_FUA;
+        }
     }
+#endif
+    /* For regular commands, simply set the command type and the sector count.
+     */
     else
     {
-        command_fis->sector_count = count;
-
+        command_fis->sector_count = (uint16_t)count;
         command_fis->command = (uint8_t)(write ? ATA_WRITE_DMA_EXT_COMMAND
                                                : ATA_READ_DMA_EXT_COMMAND);
+        if (write && req->ir_fua && port_disks[port_index] &&
+            port_disks[port_index]->bdev.bd_fua)
+        {
+            command_fis->command = ATA_WRITE_DMA_FUA_EXT_COMMAND;
+        }
     }
-#else
-    /* For regular commands, simply set the command type and the sector count.
-     */
-    command_fis->sector_count = count;
-    command_fis->command =
-        (uint8_t)(write ? ATA_WRITE_DMA_EXT_COMMAND : ATA_READ_DMA_EXT_COMMAND);
-#endif
 
     dbg(DBG_DISK, "initiating request on slot %ld to %s sectors [%lu, %lu)\n",
         command_slot, write ? "write" : "read", lba, lba + count);
@@ -178,29 +345,94 @@ long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
     /* Locally mark that we sent out a command on the given command slot of the
      * given port. */
     outstanding_requests[port_index] |= (1 << command_slot);
+    if (queued)
+    {
+        queued_requests[port_index] |= (1 << command_slot);
+    }
+    outstanding_reqs[port_index][command_slot] = req;
 
-    /* Explicitly notify the port that a command is available for execution. */
-    port->px_sact |= (1 << command_slot);
+    /* With nothing in flight, no completion can be on its way to the old
+     * core, so the interrupt may be retargeted. */
+    spinlock_lock(&ahci_msi_lock);
+    if (!ahci_inflight++ && ahci_msi_core != curcore.kc_id)
+    {
+        ahci_msi_target(curcore.kc_id);
+    }
+    spinlock_unlock(&ahci_msi_lock);
+    trace(TRACE_DISK_SUBMIT, req->ir_block, req->ir_count, write);
+
+    /* Explicitly notify the port that a command is available for execution.
+     * SACT must only be set for NCQ commands. */
+    if (queued)
+    {
+        port->px_sact |= (1 << command_slot);
+    }
     port->px_ci |= (1 << command_slot);
 
-    /* Sleep until the command has been serviced. */
-    spinlock_lock(&curthr->kt_lock);
-    KASSERT(!curthr->kt_retval);
+    spinlock_unlock(port_locks + port_index);
+    intr_setipl(ipl);
+    return 0;
+}
 
-    dbg(DBG_DISK,
-        "initiating request on slot %ld to %s sectors [%lu, %lu)...sleeping\n",
-        command_slot, write ? "write" : "read", lba, lba + count);
-    sched_sleep_on(outstanding_request_queues[port_index] + command_slot,
-                   port_locks + port_index);
+/* ahci_do_operation - Performs a disk operation and sleeps until it has
+ * completed, bypassing the I/O scheduler. */
+long ahci_do_operation(hba_port_t *port, uint64_t lba, size_t count, void *buf,
+                       int write)
+{
+    KASSERT(count % SATA_SECTORS_PER_BLOCK == 0);
+    bio_t bio;
+    bio_prepare(&bio, NULL, (blocknum_t)(lba / SATA_SECTORS_PER_BLOCK),
+                count / SATA_SECTORS_PER_BLOCK, buf, write);
+    io_request_t req;
+    io_request_init_single(&req, &bio, io_request_complete_bios);
+    ahci_issue_operation(port, &req, 0, NULL);
+    return bio_wait(&bio);
+}
+
+/* ahci_command_end - Completes a request issued by ahci_do_command(). Its bio,
+ * if any, is only there to describe the data, and is left alone. */
+static void ahci_command_end(io_request_t *req, long error)
+{
+    ata_command_t *cmd = req->ir_private;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&cmd->ac_lock);
+    cmd->ac_error = error;
+    cmd->ac_done = 1;
+    spinlock_unlock(&cmd->ac_lock);
+    sched_broadcast_on(&cmd->ac_waitq);
     intr_setipl(ipl);
-    dbg(DBG_DISK, "completed request on slot %ld to %s sectors [%lu, %lu)\n",
-        command_slot, write ? "write" : "read", lba, lba + count);
-    kmutex_unlock(&because_qemu_doesnt_emulate_ahci_ncq_correctly);
+}
 
-    long ret = (long)curthr->kt_retval;
-    spinlock_unlock(&curthr->kt_lock);
+/* ahci_do_command - Performs a non-queued command whose data, if any, is the
+ * page buf (NULL for none), and sleeps until it has completed, bypassing the
+ * I/O scheduler. */
+static long ahci_do_command(hba_port_t *port, ata_command_t *cmd, void *buf,
+                            int write)
+{
+    bio_t bio;
+    if (buf)
+    {
+        bio_prepare(&bio, NULL, 0, 1, buf, write);
+    }
+    io_request_t req;
+    io_request_init_single(&req, buf ? &bio : NULL, ahci_command_end);
+    req.ir_write = write;
+    req.ir_private = cmd;
+    spinlock_init(&cmd->ac_lock);
+    sched_queue_init(&cmd->ac_waitq);
+    cmd->ac_done = 0;
+    ahci_issue_operation(port, &req, 0, cmd);
 
-    return ret;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&cmd->ac_lock);
+    while (!cmd->ac_done)
+    {
+        sched_sleep_on(&cmd->ac_waitq, &cmd->ac_lock);
+        spinlock_lock(&cmd->ac_lock);
+    }
+    spinlock_unlock(&cmd->ac_lock);
+    intr_setipl(ipl);
+    return cmd->ac_error;
 }
 
 /* start_cmd - Start a port's DMA engines. See 10.3 of 1.3.1. */
@@ -223,9 +455,82 @@ static inline void stop_cmd(hba_port_t *port)
         ; /* Wait for FIS receive DMA to stop running. */
 }
 
+/* ahci_identify - Issues IDENTIFY DEVICE on command slot 0 of a port that has
+ * just been started, before interrupts are enabled, and polls for its
+ * completion. Fills in the 256 words of buf, and returns 0, or -EIO if the
+ * device failed the command or didn't answer. */
+static long ahci_identify(hba_port_t *port, uint16_t *buf)
+{
+    command_list_t *command_list =
+        (command_list_t *)(port->px_clb + PHYS_OFFSET);
+    command_header_t *command_header = command_list->command_headers;
+    memset(command_header, 0, sizeof(command_header_t));
+    command_header->cfl = sizeof(h2d_register_fis_t) / sizeof(uint32_t);
+
+    command_table_t *command_table =
+        (command_table_t *)(command_header->ctba + PHYS_OFFSET);
+    memset(command_table, 0, sizeof(command_table_t));
+    prd_t *prdt =
+        ahci_fill_prdt(command_table, command_table->prdt,
+                       pt_virt_to_phys((uintptr_t)buf), ATA_SECTOR_SIZE);
+    command_header->prdtl = (uint16_t)(prdt - command_table->prdt);
+
+    h2d_register_fis_t *command_fis = &command_table->cfis.h2d_register_fis;
+    command_fis->fis_type = fis_type_h2d_register;
+    command_fis->c = 1;
+    command_fis->device = ATA_DEVICE_LBA_MODE;
+    command_fis->command = ATA_IDENTIFY_DEVICE_COMMAND;
+
+    port->px_ci = 1;
+    for (size_t spins = 0; port->px_ci & 1; spins++)
+    {
+        if (spins == AHCI_IDENTIFY_SPINS)
+        {
+            /* clearing ST takes the command back */
+            stop_cmd(port);
+            start_cmd(port);
+            port->px_is = px_interrupt_status_clear;
+            return -EIO;
+        }
+    }
+    port->px_is = px_interrupt_status_clear;
+    return (port->px_tfd & ATA_STATUS_ERR) ? -EIO : 0;
+}
+
+/* ahci_probe_features - Asks a newly started disk whether it supports TRIM,
+ * and how many blocks of ranges a DATA SET MANAGEMENT command may carry, and
+ * whether its writes can bypass its cache. NCQ writes always can. */
+static void ahci_probe_features(ata_disk_t *disk)
+{
+    disk->trim_sectors = 0;
+#if ENABLE_NATIVE_COMMAND_QUEUING
+    disk->bdev.bd_fua = hba->ghc.cap.sncq;
+#else
+    disk->bdev.bd_fua = 0;
+#endif
+    uint16_t *identify = page_alloc();
+    if (!identify)
+    {
+        return;
+    }
+    if (!ahci_identify(disk->port, identify))
+    {
+        if (identify[ATA_IDENTIFY_DSM_SUPPORT] & ATA_DSM_TRIM)
+        {
+            uint16_t max = identify[ATA_IDENTIFY_DSM_MAX_BLOCKS];
+            disk->trim_sectors = max ? max : 1;
+        }
+        if (identify[ATA_IDENTIFY_FUA_SUPPORT] & ATA_IDENTIFY_FUA)
+        {
+            disk->bdev.bd_fua = 1;
+        }
+    }
+    page_free(identify);
+}
+
 /* ahci_initialize_port */
 static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
-                                 uintptr_t ahci_base)
+                                 uintptr_t ahci_base, uint32_t quirks)
 {
     dbg(DBG_DISK, "Initializing AHCI Port %d\n", port_number);
 
@@ -266,7 +571,7 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
     {
         command_list->command_headers[i].ctba =
             (uint64_t)(port_command_table_array_base + i) - PHYS_OFFSET;
-        sched_queue_init(outstanding_request_queues[port_number] + i);
+        outstanding_reqs[port_number][i] = NULL;
     }
 
     /* Start the queue to wait for an open command slot. */
@@ -274,6 +579,10 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
 
     spinlock_init(port_locks + port_number);
 
+    port_quirks[port_number] = quirks;
+    dbg(DBG_DISK, "\tcommands on port %d are %s\n", port_number,
+        (quirks & AHCI_QUIRK_SERIALIZE) ? "serialized" : "queued");
+
     /* For SATA disks, allocate, setup, and register the disk / block device. */
     if (port->px_sig == SATA_SIG_ATA)
     {
@@ -282,7 +591,12 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
         disk->port = port;
         disk->bdev.bd_id = MKDEVID(DISK_MAJOR, port_number);
         disk->bdev.bd_ops = &sata_disk_ops;
+        /* Keeping every request within one PRD's worth of data means each
+         * segment takes a single PRD. */
+        disk->bdev.bd_queue.iq_max_blocks = AHCI_MAX_PRDT_SIZE / SATA_BLOCK_SIZE;
+        disk->bdev.bd_queue.iq_max_segments = ACHI_NUM_PRDTS_PER_COMMAND_TABLE;
         list_link_init(&disk->bdev.bd_link);
+        port_disks[port_number] = disk;
         long ret = blockdev_register(&disk->bdev);
         KASSERT(!ret);
     }
@@ -296,6 +610,14 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
     /* Start the port's DMA engines and allow it to start servicing commands. */
     start_cmd(port);
 
+    if (port_disks[port_number])
+    {
+        ahci_probe_features(port_disks[port_number]);
+        dbg(DBG_DISK, "\tdisk on port %d %s TRIM and %s FUA\n", port_number,
+            port_disks[port_number]->trim_sectors ? "supports" : "lacks",
+            port_disks[port_number]->bdev.bd_fua ? "supports" : "lacks");
+    }
+
     /* RWC: Write back to clear errors one more time. FLAG: WHY?! */
     // port->px_serr = port->px_serr;
 }
@@ -304,8 +626,6 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
  */
 void ahci_initialize_hba()
 {
-    kmutex_init(&because_qemu_doesnt_emulate_ahci_ncq_correctly);
-
     /* Get the HBA controller for the SATA device. */
     pcie_device_t *dev =
         pcie_lookup(SATA_PCI_CLASS, SATA_PCI_SUBCLASS, SATA_AHCI_INTERFACE);
@@ -327,28 +647,25 @@ void ahci_initialize_hba()
         cap = (pci_capability_t *)((uintptr_t)dev +
                                    (cap->next_cap & PCI_CAPABILITY_PTR_MASK));
     }
-    msi_capability_t *msi_cap = (msi_capability_t *)cap;
+    ahci_msi = (msi_capability_t *)cap;
 
     /* Set MSI Enable to turn on MSI. */
-    msi_cap->control.msie = 1;
+    ahci_msi->control.msie = 1;
 
     /* For more info on MSI, consult Intel 3A 10.11.1, and also 2.3 of the 1.3.1
      * spec. */
 
-    /* Set up MSI for processor 1, with interrupt vector INTR_DISK_PRIMARY.
-     * TODO: Check MSI setup details to determine if MSI can be handled more
-     * efficiently in SMP.
-     */
-    if (msi_cap->control.c64)
+    /* Set up MSI with interrupt vector INTR_DISK_PRIMARY, delivered to this
+     * core until the first command is issued (see ahci_issue_operation()). */
+    if (ahci_msi->control.c64)
     {
-        msi_cap->address_data.ad64.addr = MSI_ADDRESS_FOR(1);
-        msi_cap->address_data.ad64.data = MSI_DATA_FOR(INTR_DISK_PRIMARY);
+        ahci_msi->address_data.ad64.data = MSI_DATA_FOR(INTR_DISK_PRIMARY);
     }
     else
     {
-        msi_cap->address_data.ad32.addr = MSI_ADDRESS_FOR(1);
-        msi_cap->address_data.ad32.data = MSI_DATA_FOR(INTR_DISK_PRIMARY);
+        ahci_msi->address_data.ad32.data = MSI_DATA_FOR(INTR_DISK_PRIMARY);
     }
+    ahci_msi_target(curcore.kc_id);
 
     KASSERT(dev && "Could not find AHCI Controller");
     dbg(DBG_DISK, "Found AHCI Controller\n");
@@ -382,6 +699,14 @@ void ahci_initialize_hba()
     dbg(DBG_DISK, "ahci ncq supported: %s\n",
         hba->ghc.cap.sncq ? "true" : "false");
 
+    /* Real NCQ hardware can have every command slot in flight; QEMU's
+     * emulation loses completions if more than one is outstanding. */
+    uint32_t quirks = 0;
+    if (dev->standard.subsystem_vendor_id == QEMU_PCI_SUBSYSTEM_VENDOR_ID)
+    {
+        quirks |= AHCI_QUIRK_SERIALIZE;
+    }
+
     /* Initialize each of the available ports. */
     uint32_t ports_implemented = hba->ghc.pi;
     KASSERT(ports_implemented);
@@ -389,7 +714,8 @@ void ahci_initialize_hba()
     {
         unsigned port_number = __builtin_ctz(ports_implemented);
         ports_implemented &= ~(1 << port_number);
-        ahci_initialize_port(hba->ports + port_number, port_number, ahci_base);
+        ahci_initialize_port(hba->ports + port_number, port_number, ahci_base,
+                             quirks);
     }
 
     /* Clear any outstanding interrupts from any ports. */
@@ -399,83 +725,194 @@ void ahci_initialize_hba()
     hba->ghc.ghc.ie = 1;
 }
 
-/* ahci_interrupt_handler - Service an interrupt that was raised by the HBA.
- */
-static long ahci_interrupt_handler(regs_t *regs)
+/* ahci_ack_port - Acknowledges a port's interrupt, if any. Called with the
+ * port locked, at IPL_HIGH. */
+static void ahci_ack_port(unsigned port_index)
 {
-    /* Check interrupt status bitmap for ports to service. */
-    while (hba->ghc.is)
-    {
-        /* Get a port from the global interrupt status bitmap. */
-        unsigned port_index = __builtin_ctz(hba->ghc.is);
+    /* Get the port descriptor from the HBA's ports array. */
+    hba_port_t *port = hba->ports + port_index;
 
-        /* Get the port descriptor from the HBA's ports array. */
-        hba_port_t *port = hba->ports + port_index;
-        spinlock_lock(port_locks + port_index);
+    /* Beware: If a register is marked "RWC" in the spec, you must clear it
+     * by writing 1. This is rather understated in the specification. */
 
-        /* Beware: If a register is marked "RWC" in the spec, you must clear it
-         * by writing 1. This is rather understated in the specification. */
+    /* Clear the cause of the interrupt.
+     * See 5.6.2 and 5.6.4 in the 1.3.1 spec for confirmation of the FIS and
+     * corresponding interrupt that are used depending on the type of
+     * command.
+     */
 
-        /* Clear the cause of the interrupt.
-         * See 5.6.2 and 5.6.4 in the 1.3.1 spec for confirmation of the FIS and
-         * corresponding interrupt that are used depending on the type of
-         * command.
-         */
+    /* NCQ commands complete with a set device bits FIS, and others with
+     * a device-to-host register FIS; both can happen on an NCQ port,
+     * which also takes non-queued commands such as DATA SET MANAGEMENT.
+     * Writing back what was read clears exactly the bits that were set. A
+     * poller may have got here first, in which case there is nothing to
+     * clear, and its commands have been completed already. */
+    px_interrupt_status_t is = port->px_is;
+
+    /* A command failed: the port has stopped, and its commands are failed
+     * and it is restarted once the port is serviced. A device-to-host FIS
+     * carries the device's status into PxTFD, so it is looked at there as
+     * well. */
+    if (is.bits.tfes || (is.bits.dhrs && (port->px_tfd & ATA_STATUS_ERR)))
+    {
+        dbg(DBG_DISK, "task file error on port %u, status 0x%x\n", port_index,
+            port->px_tfd);
+        port_failed[port_index] = 1;
+    }
+    if (is.bits.sdbs || is.bits.dhrs || is.bits.tfes)
+    {
+        port->px_is = is;
+    }
 
-#if ENABLE_NATIVE_COMMAND_QUEUING
-        if (hba->ghc.cap.sncq)
-        {
-            KASSERT(port->px_is.bits.sdbs);
-            port->px_is.bits.sdbs = 1;
-        }
-        else
-        {
-            KASSERT(port->px_is.bits.dhrs);
-            port->px_is.bits.dhrs = 1;
-        }
-#else
-        KASSERT(port->px_is.bits.dhrs);
-        port->px_is.bits.dhrs = 1;
-#endif
+    /* Clear the port's bit on the global interrupt status bitmap, to
+     * indicate we have handled it. */
+    /* Note: Changed from ~ to regular, because this register is RWC. */
+    hba->ghc.is &= (1 << port_index);
+}
+
+/* ahci_release_slot - Takes the request off a command slot of a locked port,
+ * and returns it. */
+static io_request_t *ahci_release_slot(unsigned port_index, uint32_t slot)
+{
+    io_request_t *req = outstanding_reqs[port_index][slot];
+    outstanding_reqs[port_index][slot] = NULL;
+    outstanding_requests[port_index] &= ~(1 << slot);
+    queued_requests[port_index] &= ~(1 << slot);
+
+    KASSERT(req);
+    spinlock_lock(&ahci_msi_lock);
+    ahci_inflight--;
+    spinlock_unlock(&ahci_msi_lock);
+    return req;
+}
+
+/* ahci_restart_port - Restarts a port that stopped at a task file error.
+ * Clearing ST takes back every command still issued, and the errors are
+ * cleared before the port is started again. See 6.2.2.1 in 1.3.1. */
+static void ahci_restart_port(hba_port_t *port)
+{
+    stop_cmd(port);
+    port->px_serr = port->px_serr; /* RWC */
+    port->px_is = px_interrupt_status_clear;
+    start_cmd(port);
+}
 
-        /* Clear the port's bit on the global interrupt status bitmap, to
-         * indicate we have handled it. */
-        /* Note: Changed from ~ to regular, because this register is RWC. */
-        hba->ghc.is &= (1 << port_index);
+/* ahci_service_port - Acknowledges a port's interrupt, if any, and completes
+ * the commands that have finished on it. Called from the interrupt work (see
+ * ahci_interrupt_work()), and by threads polling for their requests (see
+ * sata_poll()), at IPL_HIGH. Returns the number of commands completed.
+ *
+ * After a task file error, the commands that finished before it are
+ * completed as usual. The one that failed, and on an NCQ port every other
+ * queued one, is still set in PxCI or PxSACT, and never will finish, so they
+ * all fail with -EIO and the port is restarted. */
+static size_t ahci_service_port(unsigned port_index)
+{
+    /* Get the port descriptor from the HBA's ports array. */
+    hba_port_t *port = hba->ports + port_index;
+    spinlock_lock(port_locks + port_index);
+    ahci_ack_port(port_index);
 
-        /* Get the list of commands still outstanding. */
+    /* Get the list of commands still outstanding. */
 #if ENABLE_NATIVE_COMMAND_QUEUING
-        /* If NCQ, use SACT register. */
-        uint32_t active = hba->ghc.cap.sncq ? port->px_sact : port->px_ci;
+    /* If NCQ, use SACT register, and CI for non-queued commands. */
+    uint32_t active =
+        hba->ghc.cap.sncq ? port->px_sact | port->px_ci : port->px_ci;
 #else
-        /* If not NCQ, use CI register. */
-        uint32_t active = port->px_ci;
+    /* If not NCQ, use CI register. */
+    uint32_t active = port->px_ci;
 #endif
 
-        /* Compare the active commands against those we actually sent out to get
-         * completed commands. */
-        uint32_t completed = outstanding_requests[port_index] &
-                             ~(outstanding_requests[port_index] & active);
-        /* Handle each completed command: */
-        while (completed)
+    /* Compare the active commands against those we actually sent out to get
+     * completed commands. */
+    uint32_t completed = outstanding_requests[port_index] &
+                         ~(outstanding_requests[port_index] & active);
+    /* Handle each completed command: */
+    io_request_t *done[AHCI_COMMAND_HEADERS_PER_LIST];
+    size_t ndone = 0;
+    while (completed)
+    {
+        uint32_t slot = __builtin_ctz(completed);
+        completed &= ~(1 << slot);
+
+        /* Mark the command as available. */
+        io_request_t *req = ahci_release_slot(port_index, slot);
+        dbg(DBG_DISK, "completed request on slot %u\n", slot);
+        trace(TRACE_DISK_COMPLETE, req->ir_block, req->ir_count, slot);
+        done[ndone++] = req;
+    }
+
+    /* The requests from done[nok] on failed. */
+    size_t nok = ndone;
+    if (port_failed[port_index])
+    {
+        port_failed[port_index] = 0;
+        uint32_t failed = outstanding_requests[port_index];
+        while (failed)
         {
-            uint32_t slot = __builtin_ctz(completed);
+            uint32_t slot = __builtin_ctz(failed);
+            failed &= ~(1 << slot);
+            dbg(DBG_DISK, "failed request on slot %u\n", slot);
+            done[ndone++] = ahci_release_slot(port_index, slot);
+        }
+        ahci_restart_port(port);
+    }
 
-            /* Wake up the thread that was waiting on that command. */
-            kthread_t *thr;
-            sched_wakeup_on(&outstanding_request_queues[port_index][slot],
-                            &thr);
+    /* Let the threads waiting for a slot look again. Which of them may take
+     * one depends on what else is outstanding (see find_cmdslot()), so
+     * waking only one could pick one that has to go back to sleep. */
+    if (ndone)
+    {
+        sched_broadcast_on(command_slot_queues + port_index);
+    }
 
-            /* Mark the command as available. */
-            completed &= ~(1 << slot);
-            outstanding_requests[port_index] &= ~(1 << slot);
+    spinlock_unlock(port_locks + port_index);
 
-            /* TODO: Wake up threads that were waiting for a command slot to
-             * free up on the port. */
-        }
+    /* Complete the requests, which wakes up anyone waiting on them, and
+     * start queued ones in the freed slots. Neither can be done with the
+     * port locked, since submission takes the lock. */
+    for (size_t i = 0; i < ndone; i++)
+    {
+        done[i]->ir_end(done[i], i < nok ? 0 : -EIO);
+    }
+    if (ndone && port_disks[port_index])
+    {
+        iosched_run(&port_disks[port_index]->bdev);
+    }
+    return ndone;
+}
+
+/* ahci_interrupt_work - Completes the commands that have finished on the
+ * ports whose interrupts have been acknowledged since it last ran. */
+static void ahci_interrupt_work(work_t *work)
+{
+    uint32_t pending = __sync_lock_test_and_set(&ahci_ports_pending, 0);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    while (pending)
+    {
+        unsigned port_index = __builtin_ctz(pending);
+        pending &= ~(1 << port_index);
+        ahci_service_port(port_index);
+    }
+    intr_setipl(ipl);
+}
 
+/* ahci_interrupt_handler - Service an interrupt that was raised by the HBA:
+ * acknowledge it, and leave completing the commands to ahci_interrupt_work().
+ */
+static long ahci_interrupt_handler(regs_t *regs)
+{
+    /* Check interrupt status bitmap for ports to service. */
+    while (hba->ghc.is)
+    {
+        /* Get a port from the global interrupt status bitmap. */
+        unsigned port_index = __builtin_ctz(hba->ghc.is);
+        spinlock_lock(port_locks + port_index);
+        ahci_ack_port(port_index);
         spinlock_unlock(port_locks + port_index);
+        __sync_fetch_and_or(&ahci_ports_pending, 1 << port_index);
     }
+    work_queue(&ahci_work);
     return 0;
 }
 
@@ -485,6 +922,29 @@ void sata_init()
     ahci_initialize_hba();
 }
 
+/* sata_do_blocks - Transfers blocks with as few commands as the ATA sector
+ * count allows. */
+static long sata_do_blocks(blockdev_t *bdev, void *buf, blocknum_t block,
+                           size_t block_count, int write)
+{
+    while (block_count)
+    {
+        size_t n = MIN(block_count, (size_t)(AHCI_MAX_SECTORS_PER_COMMAND /
+                                             SATA_SECTORS_PER_BLOCK));
+        long ret = ahci_do_operation(bdev_to_ata_disk(bdev)->port,
+                                     (uint64_t)block * SATA_SECTORS_PER_BLOCK,
+                                     n * SATA_SECTORS_PER_BLOCK, buf, write);
+        if (ret)
+        {
+            return ret;
+        }
+        buf = (char *)buf + n * SATA_BLOCK_SIZE;
+        block += (blocknum_t)n;
+        block_count -= n;
+    }
+    return 0;
+}
+
 /**
  * Read the given number of blocks from a block device starting at
  * a given block number into a buffer.
@@ -505,9 +965,8 @@ long sata_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
 {
     //hba_port_t *port = bdev->bd_private;
    
-    ahci_do_operation(bdev_to_ata_disk(bdev)->port, block * SATA_SECTORS_PER_BLOCK, block_count * SATA_SECTORS_PER_BLOCK, (void *)buf, 0);
+    return sata_do_blocks(bdev, buf, block, block_count, 0);
     //NOT_YET_IMPLEMENTED("DRIVERS: sata_read_block");
-    return 0;
 }
 
 /**
@@ -525,7 +984,124 @@ long sata_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
 long sata_write_block(blockdev_t *bdev, const char *buf, blocknum_t block,
                       size_t block_count)
 {
-    ahci_do_operation(bdev_to_ata_disk(bdev)->port, block * SATA_SECTORS_PER_BLOCK, block_count * SATA_SECTORS_PER_BLOCK, (void *)buf, 1);
+    return sata_do_blocks(bdev, (void *)buf, block, block_count, 1);
     //NOT_YET_IMPLEMENTED("DRIVERS: sata_write_block");
-    return 0;
+}
+
+/**
+ * Starts a request from the I/O scheduler on a SATA device, as a single
+ * command; the interrupt handler completes it.
+ *
+ * @param  bdev block device to transfer to or from
+ * @param  req  the request
+ * @return      0 on success, or -EBUSY if no command slot is free
+ */
+long sata_submit(blockdev_t *bdev, io_request_t *req)
+{
+    return ahci_issue_operation(bdev_to_ata_disk(bdev)->port, req, 1, NULL);
+}
+
+/* sata_trim - Sends n TRIM range entries, at most a page of them, with one
+ * DATA SET MANAGEMENT command. The unused rest of their last 512-byte block
+ * is zeroed, which makes those entries empty. */
+static long sata_trim(ata_disk_t *disk, uint64_t *entries, size_t n)
+{
+    size_t sectors = (n + ATA_DSM_RANGES_PER_SECTOR - 1) /
+                     ATA_DSM_RANGES_PER_SECTOR;
+    memset(entries + n, 0,
+           sectors * ATA_SECTOR_SIZE - n * sizeof(uint64_t));
+    ata_command_t cmd = {.ac_command = ATA_DATA_SET_MANAGEMENT_COMMAND,
+                         .ac_features = ATA_DSM_TRIM,
+                         .ac_lba = 0,
+                         .ac_count = (uint16_t)sectors};
+    dbg(DBG_DISK, "trimming %lu ranges\n", n);
+    return ahci_do_command(disk->port, &cmd, entries, 1);
+}
+
+/**
+ * Discards runs of blocks on a SATA device with TRIM: their sectors are packed
+ * into as few DATA SET MANAGEMENT commands as the disk allows, each range
+ * entry covering at most ATA_DSM_MAX_RANGE_SECTORS sectors.
+ *
+ * @param  bdev    block device to discard blocks of
+ * @param  ranges  the runs of blocks
+ * @param  nranges the number of runs
+ * @return         0 on success, -ENOTSUP if the disk can't TRIM, or -ENOMEM
+ */
+long sata_discard(blockdev_t *bdev, const blockdev_range_t *ranges,
+                  size_t nranges)
+{
+    ata_disk_t *disk = bdev_to_ata_disk(bdev);
+    if (!disk->trim_sectors)
+    {
+        return -ENOTSUP;
+    }
+    uint64_t *entries = page_alloc();
+    if (!entries)
+    {
+        return -ENOMEM;
+    }
+
+    size_t max = MIN((size_t)disk->trim_sectors, SATA_SECTORS_PER_BLOCK) *
+                 ATA_DSM_RANGES_PER_SECTOR;
+    size_t n = 0;
+    long ret = 0;
+    for (size_t i = 0; i < nranges && !ret; i++)
+    {
+        uint64_t lba = (uint64_t)ranges[i].br_block * SATA_SECTORS_PER_BLOCK;
+        uint64_t left = (uint64_t)ranges[i].br_count * SATA_SECTORS_PER_BLOCK;
+        KASSERT(lba + left <= ATA_MAX_LBA);
+        while (left && !ret)
+        {
+            uint64_t len = MIN(left, (uint64_t)ATA_DSM_MAX_RANGE_SECTORS);
+            entries[n++] = lba | (len << 48);
+            lba += len;
+            left -= len;
+            if (n == max)
+            {
+                ret = sata_trim(disk, entries, n);
+                n = 0;
+            }
+        }
+    }
+    if (n && !ret)
+    {
+        ret = sata_trim(disk, entries, n);
+    }
+    page_free(entries);
+    return ret;
+}
+
+/**
+ * Writes a SATA disk's volatile write cache to stable media with FLUSH CACHE
+ * EXT, which completes only once every write the disk has completed before it
+ * is durable.
+ *
+ * @param  bdev block device whose cache to flush
+ * @return      0 on success, or -errno
+ */
+long sata_flush_cache(blockdev_t *bdev)
+{
+    ata_command_t cmd = {.ac_command = ATA_FLUSH_CACHE_EXT_COMMAND,
+                         .ac_features = 0,
+                         .ac_lba = 0,
+                         .ac_count = 0};
+    dbg(DBG_DISK, "flushing write cache\n");
+    return ahci_do_command(bdev_to_ata_disk(bdev)->port, &cmd, NULL, 0);
+}
+
+/**
+ * Completes whatever commands have finished on a SATA disk's port, without
+ * waiting for the HBA's interrupt.
+ *
+ * @param  bdev block device to poll
+ * @return      the number of commands completed
+ */
+long sata_poll(blockdev_t *bdev)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    size_t n =
+        ahci_service_port(PORT_INDEX(hba, bdev_to_ata_disk(bdev)->port));
+    intr_setipl(ipl);
+    return (long)n;
 }
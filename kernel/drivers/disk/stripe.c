@@ -0,0 +1,367 @@
+#include <config.h>
+#include <drivers/bio.h>
+#include <drivers/blockdev.h>
+#include <drivers/dev.h>
+#include <drivers/disk/stripe.h>
+#include <errno.h>
+#include <kernel.h>
+#include <main/interrupt.h>
+#include <mm/kmalloc.h>
+#include <util/debug.h>
+#include <util/string.h>
+
+#define bdev_to_stripe(bd) (CONTAINER_OF((bd), stripe_t, st_bdev))
+
+/* stripe_t - A stripe set; see stripe.h. */
+typedef struct stripe
+{
+    blockdev_t st_bdev;
+    blockdev_t *st_disks[STRIPE_MAX_DISKS];
+    size_t st_ndisks;
+    size_t st_chunk; /* blocks per chunk */
+} stripe_t;
+
+/* stripe_io_t - A bio on the stripe set, split into one child bio per chunk
+ * it touches, which are allocated along with it, followed by the children's
+ * segments if the bio has any. */
+typedef struct stripe_io
+{
+    bio_t *si_parent;
+    spinlock_t si_lock; /* protects si_pending and si_error */
+    size_t si_pending;  /* children not yet completed */
+    long si_error;      /* the first child's error */
+    list_link_t si_link; /* link on stripe_done */
+} stripe_io_t;
+
+long stripe_submit_bio(blockdev_t *bdev, bio_t *bio);
+long stripe_flush(blockdev_t *bdev);
+long stripe_discard(blockdev_t *bdev, const blockdev_range_t *ranges,
+                    size_t nranges);
+long stripe_poll(blockdev_t *bdev);
+
+/* stripe_ops - Block device operations for the stripe set. Transfers go
+ * through submit_bio, so read_block and write_block are never used. */
+static blockdev_ops_t stripe_ops = {
+    .read_block = NULL,
+    .write_block = NULL,
+    .submit = NULL,
+    .submit_bio = stripe_submit_bio,
+    .discard = stripe_discard,
+    .flush = stripe_flush,
+    .poll = stripe_poll,
+};
+
+static stripe_t stripe;
+
+/* Finished stripe_io_t's. Children complete in interrupt context, where the
+ * allocator can't be used, so they are freed by the next submission. */
+static list_t stripe_done = LIST_INITIALIZER(stripe_done);
+static spinlock_t stripe_done_lock = SPINLOCK_INITIALIZER(stripe_done_lock);
+
+/* stripe_map - Returns the disk holding a block of the stripe set, and its
+ * block on that disk in *diskblock. A disk's chunks are consecutive on it. */
+static size_t stripe_map(stripe_t *st, blocknum_t block, blocknum_t *diskblock)
+{
+    size_t chunk = block / st->st_chunk;
+    *diskblock = (blocknum_t)((chunk / st->st_ndisks) * st->st_chunk +
+                              block % st->st_chunk);
+    return chunk % st->st_ndisks;
+}
+
+/* stripe_piece - Returns how many of the n blocks from block on lie in
+ * block's chunk. */
+static size_t stripe_piece(stripe_t *st, blocknum_t block, size_t n)
+{
+    return MIN(n, st->st_chunk - block % st->st_chunk);
+}
+
+/* stripe_reap - Frees the stripe_io_t's of finished bios. */
+static void stripe_reap()
+{
+    list_t done;
+    list_init(&done);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&stripe_done_lock);
+    list_iterate(&stripe_done, io, stripe_io_t, si_link)
+    {
+        list_remove(&io->si_link);
+        list_insert_tail(&done, &io->si_link);
+    }
+    spinlock_unlock(&stripe_done_lock);
+    intr_setipl(ipl);
+
+    list_iterate(&done, io, stripe_io_t, si_link)
+    {
+        list_remove(&io->si_link);
+        kfree(io);
+    }
+}
+
+/* stripe_child_end - Completes a bio on the stripe set once the last of its
+ * children has completed, with the first error any of them had. */
+static void stripe_child_end(bio_t *child)
+{
+    stripe_io_t *io = child->bio_private;
+    spinlock_lock(&io->si_lock);
+    if (child->bio_error && !io->si_error)
+    {
+        io->si_error = child->bio_error;
+    }
+    size_t pending = --io->si_pending;
+    spinlock_unlock(&io->si_lock);
+    if (pending)
+    {
+        return;
+    }
+
+    bio_complete(io->si_parent, io->si_error);
+    spinlock_lock(&stripe_done_lock);
+    list_insert_tail(&stripe_done, &io->si_link);
+    spinlock_unlock(&stripe_done_lock);
+}
+
+/* stripe_child_vecs - Fills vecs with the segments of a vectored bio's next
+ * len bytes, starting at byte *off of segment *seg, and moves those past
+ * them. Returns the number of segments filled in. */
+static size_t stripe_child_vecs(bio_t *bio, size_t *seg, size_t *off,
+                                size_t len, bio_vec_t *vecs)
+{
+    size_t n = 0;
+    while (len)
+    {
+        bio_vec_t *v = &bio->bio_vecs[*seg];
+        size_t take = MIN(len, v->bv_len - *off);
+        vecs[n].bv_phys = v->bv_phys + *off;
+        vecs[n].bv_len = take;
+        n++;
+        len -= take;
+        *off += take;
+        if (*off == v->bv_len)
+        {
+            (*seg)++;
+            *off = 0;
+        }
+    }
+    return n;
+}
+
+/**
+ * Splits a bio on the stripe set into a child bio per chunk it touches, and
+ * submits each to its disk. The children of a large transfer are submitted
+ * with the disks plugged, so that they all start together.
+ *
+ * @param  bdev the stripe set
+ * @param  bio  the bio, which is completed once all of its children are
+ * @return      0 if the bio was queued, or -ENOMEM
+ */
+long stripe_submit_bio(blockdev_t *bdev, bio_t *bio)
+{
+    stripe_t *st = bdev_to_stripe(bdev);
+    stripe_reap();
+
+    size_t nchildren = 0;
+    for (size_t done = 0; done < bio->bio_count; nchildren++)
+    {
+        done += stripe_piece(st, bio->bio_block + (blocknum_t)done,
+                             bio->bio_count - done);
+    }
+    /* each child's segments are pieces of the bio's, of which every child
+     * but the first may split one */
+    size_t nvecs = bio->bio_nvecs ? bio->bio_nvecs + nchildren : 0;
+    stripe_io_t *io = kmalloc(sizeof(stripe_io_t) + nchildren * sizeof(bio_t) +
+                              nvecs * sizeof(bio_vec_t));
+    if (!io)
+    {
+        return -ENOMEM;
+    }
+    io->si_parent = bio;
+    spinlock_init(&io->si_lock);
+    io->si_pending = nchildren;
+    io->si_error = 0;
+    list_link_init(&io->si_link);
+    bio_t *children = (bio_t *)(io + 1);
+    bio_vec_t *vecs = (bio_vec_t *)(children + nchildren);
+
+    size_t seg = 0, off = 0, done = 0;
+    for (size_t i = 0; i < nchildren; i++)
+    {
+        blocknum_t block = bio->bio_block + (blocknum_t)done;
+        size_t count = stripe_piece(st, block, bio->bio_count - done);
+        blocknum_t diskblock;
+        blockdev_t *disk = st->st_disks[stripe_map(st, block, &diskblock)];
+        bio_t *child = &children[i];
+        if (bio->bio_nvecs)
+        {
+            size_t n =
+                stripe_child_vecs(bio, &seg, &off, count * BLOCK_SIZE, vecs);
+            bio_prepare_vec(child, disk, diskblock, vecs, n, bio->bio_write);
+            vecs += n;
+        }
+        else
+        {
+            bio_prepare(child, disk, diskblock, count,
+                        bio->bio_buf + done * BLOCK_SIZE, bio->bio_write);
+        }
+        child->bio_fua = bio->bio_fua;
+        child->bio_end = stripe_child_end;
+        child->bio_private = io;
+        done += count;
+    }
+
+    /* io may be freed as soon as the last child is submitted */
+    for (size_t d = 0; d < st->st_ndisks; d++)
+    {
+        blockdev_plug(st->st_disks[d]);
+    }
+    for (size_t i = 0; i < nchildren; i++)
+    {
+        long ret = bio_submit(&children[i]);
+        if (ret)
+        {
+            bio_complete(&children[i], ret);
+        }
+    }
+    for (size_t d = 0; d < st->st_ndisks; d++)
+    {
+        blockdev_unplug(st->st_disks[d]);
+    }
+    return 0;
+}
+
+/**
+ * Flushes the write caches of every disk of the stripe set.
+ *
+ * @param  bdev the stripe set
+ * @return      0 on success, or the first error
+ */
+long stripe_flush(blockdev_t *bdev)
+{
+    stripe_t *st = bdev_to_stripe(bdev);
+    long ret = 0;
+    for (size_t d = 0; d < st->st_ndisks; d++)
+    {
+        long err = blockdev_flush_cache(st->st_disks[d]);
+        ret = ret ? ret : err;
+    }
+    return ret;
+}
+
+/**
+ * Discards runs of blocks of the stripe set. Each disk's chunks are
+ * consecutive on it, so the part of a run on any one disk is a single run of
+ * that disk's blocks, and each disk gets at most one range per run.
+ *
+ * @param  bdev    the stripe set
+ * @param  ranges  the runs of blocks
+ * @param  nranges the number of runs
+ * @return         0 on success, -ENOTSUP if any disk can't discard, -ENOMEM,
+ *                 or the first error
+ */
+long stripe_discard(blockdev_t *bdev, const blockdev_range_t *ranges,
+                    size_t nranges)
+{
+    stripe_t *st = bdev_to_stripe(bdev);
+    blockdev_range_t *disk_ranges =
+        kmalloc(st->st_ndisks * nranges * sizeof(blockdev_range_t));
+    if (!disk_ranges)
+    {
+        return -ENOMEM;
+    }
+    size_t ndisk_ranges[STRIPE_MAX_DISKS] = {0};
+    for (size_t r = 0; r < nranges; r++)
+    {
+        size_t done = 0;
+        while (done < ranges[r].br_count)
+        {
+            blocknum_t block = ranges[r].br_block + (blocknum_t)done;
+            size_t count = stripe_piece(st, block, ranges[r].br_count - done);
+            blocknum_t diskblock;
+            size_t d = stripe_map(st, block, &diskblock);
+            blockdev_range_t *dr = disk_ranges + d * nranges;
+            size_t *n = &ndisk_ranges[d];
+            if (*n && dr[*n - 1].br_block + dr[*n - 1].br_count == diskblock)
+            {
+                dr[*n - 1].br_count += count;
+            }
+            else
+            {
+                dr[*n].br_block = diskblock;
+                dr[*n].br_count = count;
+                (*n)++;
+            }
+            done += count;
+        }
+    }
+
+    long ret = 0;
+    for (size_t d = 0; d < st->st_ndisks; d++)
+    {
+        long err = blockdev_discard(st->st_disks[d], disk_ranges + d * nranges,
+                                    ndisk_ranges[d]);
+        if (err && (!ret || err == -ENOTSUP))
+        {
+            ret = err;
+        }
+    }
+    kfree(disk_ranges);
+    return ret;
+}
+
+/**
+ * Polls every disk of the stripe set for completed requests.
+ *
+ * @param  bdev the stripe set
+ * @return      the number of requests completed
+ */
+long stripe_poll(blockdev_t *bdev)
+{
+    stripe_t *st = bdev_to_stripe(bdev);
+    long n = 0;
+    for (size_t d = 0; d < st->st_ndisks; d++)
+    {
+        blockdev_t *disk = st->st_disks[d];
+        n += disk->bd_ops->poll ? disk->bd_ops->poll(disk) : 0;
+    }
+    return n;
+}
+
+void stripe_init()
+{
+    if (STRIPE_NDISKS < 2)
+    {
+        return;
+    }
+    KASSERT(STRIPE_NDISKS <= STRIPE_MAX_DISKS);
+
+    stripe_t *st = &stripe;
+    st->st_chunk = STRIPE_CHUNK_BLOCKS;
+    st->st_ndisks = STRIPE_NDISKS;
+    st->st_bdev.bd_fua = 1;
+    for (size_t d = 0; d < st->st_ndisks; d++)
+    {
+        long num = STRIPE_FIRST_DISK + (long)d;
+        blockdev_t *disk = blockdev_lookup(MKDEVID(DISK_MAJOR, num));
+        /* a child, at most a chunk of single-block segments, must be a
+         * request the disk accepts */
+        if (!disk || !disk->bd_ops->submit ||
+            st->st_chunk > disk->bd_queue.iq_max_blocks ||
+            st->st_chunk > disk->bd_queue.iq_max_segments)
+        {
+            dbg(DBG_DISK, "stripe: disk%ld missing or unsuitable, "
+                          "not striping\n",
+                num);
+            return;
+        }
+        st->st_disks[d] = disk;
+        st->st_bdev.bd_fua = st->st_bdev.bd_fua && disk->bd_fua;
+    }
+
+    st->st_bdev.bd_id = MKDEVID(STRIPE_MAJOR, 0);
+    st->st_bdev.bd_ops = &stripe_ops;
+    list_link_init(&st->st_bdev.bd_link);
+    long ret = blockdev_register(&st->st_bdev);
+    KASSERT(!ret);
+    dbg(DBG_DISK, "stripe: disks %d to %d in chunks of %lu blocks\n",
+        STRIPE_FIRST_DISK, STRIPE_FIRST_DISK + STRIPE_NDISKS - 1,
+        st->st_chunk);
+}
@@ -0,0 +1,136 @@
+#include "errno.h"
+#include "kernel.h"
+
+#include "api/syscall.h"
+
+#include "drivers/chardev.h"
+#include "drivers/fbdev.h"
+#include "drivers/screen.h"
+
+#include "fs/vnode.h"
+
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#ifdef __VGABUF___
+
+/*
+ * Every mapping of /dev/fb shares one memory object, which, like the vDSO's
+ * (see vdso.c), is never freed. Its pages are the framebuffer's own rather
+ * than the page allocator's, so instead of a pframe per page it has a single
+ * pframe, pointed at the page being gotten while its mutex is held; nothing
+ * is ever filled, flushed or reclaimed. Being a MOBJ_DEVICE, its pages are
+ * mapped write-combining by the page fault handler, so that a program drawing
+ * a frame has its stores to video memory combined into bursts.
+ *
+ * The console keeps drawing into the framebuffer too; a program that takes
+ * over the screen should leave the terminal alone while it does.
+ */
+
+static char *fbdev_fb;
+static size_t fbdev_size;    /* in bytes, a whole number of pages */
+static size_t fbdev_visible; /* bytes that are on screen */
+
+static mobj_t fbdev_mobj;
+static pframe_t fbdev_pframe;
+
+static long fbdev_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
+                             pframe_t **pfp)
+{
+    if (pagenum >= fbdev_size / PAGE_SIZE)
+    {
+        return -EFAULT;
+    }
+    pframe_lock(&fbdev_pframe);
+    fbdev_pframe.pf_pagenum = pagenum;
+    fbdev_pframe.pf_addr = fbdev_fb + pagenum * PAGE_SIZE;
+    *pfp = &fbdev_pframe;
+    return 0;
+}
+
+static void fbdev_destructor(mobj_t *o) { panic("framebuffer object freed\n"); }
+
+static mobj_ops_t fbdev_mobj_ops = {.get_pframe = fbdev_get_pframe,
+                                    .fill_pframe = NULL,
+                                    .flush_pframe = NULL,
+                                    .destructor = fbdev_destructor};
+
+static ssize_t fbdev_read(chardev_t *dev, size_t pos, void *buf, size_t count)
+{
+    if (pos >= fbdev_visible)
+    {
+        return 0;
+    }
+    count = MIN(count, fbdev_visible - pos);
+    memcpy(buf, fbdev_fb + pos, count);
+    return (ssize_t)count;
+}
+
+static ssize_t fbdev_write(chardev_t *dev, size_t pos, const void *buf,
+                           size_t count)
+{
+    if (pos >= fbdev_visible)
+    {
+        return count ? -ENOSPC : 0;
+    }
+    count = MIN(count, fbdev_visible - pos);
+    memcpy(fbdev_fb + pos, buf, count);
+    return (ssize_t)count;
+}
+
+static long fbdev_mmap(vnode_t *file, mobj_t **ret)
+{
+    mobj_ref(&fbdev_mobj);
+    *ret = &fbdev_mobj;
+    return 0;
+}
+
+static long fbdev_ioctl(chardev_t *dev, unsigned long request, void *arg)
+{
+    if (request != FBIOGET_INFO)
+    {
+        return -ENOTTY;
+    }
+    struct fb_info *info = arg;
+    info->fb_width = (uint32_t)screen_get_width();
+    info->fb_height = (uint32_t)screen_get_height();
+    info->fb_pitch = info->fb_width * sizeof(uint32_t);
+    info->fb_bpp = 32;
+    info->fb_size = fbdev_size;
+    return 0;
+}
+
+static chardev_ops_t fbdev_ops = {.read = fbdev_read,
+                                  .write = fbdev_write,
+                                  .mmap = fbdev_mmap,
+                                  .fill_pframe = NULL,
+                                  .flush_pframe = NULL,
+                                  .poll = NULL,
+                                  .ioctl = fbdev_ioctl};
+
+static chardev_t fbdev = {.cd_id = FB_DEVID, .cd_ops = &fbdev_ops};
+
+void fbdev_init()
+{
+    screen_init();
+    fbdev_fb = screen_get_framebuffer(&fbdev_size);
+    KASSERT(PAGE_ALIGNED(fbdev_fb));
+    fbdev_visible =
+        screen_get_width() * screen_get_height() * sizeof(uint32_t);
+
+    mobj_init(&fbdev_mobj, MOBJ_DEVICE, &fbdev_mobj_ops);
+    list_link_init(&fbdev_pframe.pf_link);
+    list_link_init(&fbdev_pframe.pf_dirty_link);
+    list_link_init(&fbdev_pframe.pf_lru_link);
+    fbdev_pframe.pf_obj = &fbdev_mobj;
+
+    list_link_init(&fbdev.cd_link);
+    long ret = chardev_register(&fbdev);
+    KASSERT(!ret && "failed to register the framebuffer device");
+}
+
+#endif /* __VGABUF___ */
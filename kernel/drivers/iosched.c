@@ -0,0 +1,500 @@
+#include "errno.h"
+#include "kernel.h"
+
+#include "api/syscall.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/iosched.h"
+
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+
+#include "mm/memgroup.h"
+#include "mm/slab.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/time.h"
+
+static slab_allocator_t *io_request_allocator;
+
+/*
+ * noop: requests are dispatched in submission order.
+ */
+static void noop_add(iosched_queue_t *q, io_request_t *req)
+{
+    list_insert_tail(&q->iq_requests, &req->ir_link);
+}
+
+static io_request_t *noop_peek(iosched_queue_t *q)
+{
+    if (list_empty(&q->iq_requests))
+    {
+        return NULL;
+    }
+    return list_head(&q->iq_requests, io_request_t, ir_link);
+}
+
+static void iosched_list_remove(iosched_queue_t *q, io_request_t *req)
+{
+    list_remove(&req->ir_link);
+}
+
+static iosched_ops_t noop_ops = {
+    .iso_name = "noop",
+    .iso_add = noop_add,
+    .iso_peek = noop_peek,
+    .iso_remove = iosched_list_remove,
+};
+
+/*
+ * deadline: iq_requests is sorted by block number and served by sweeping
+ * upward from iq_position, wrapping back to the lowest block at the top; but
+ * once the oldest request's deadline has passed, it is served first.
+ */
+static void deadline_add(iosched_queue_t *q, io_request_t *req)
+{
+    list_iterate(&q->iq_requests, cur, io_request_t, ir_link)
+    {
+        if (cur->ir_block > req->ir_block)
+        {
+            list_insert_before(&cur->ir_link, &req->ir_link);
+            return;
+        }
+    }
+    list_insert_tail(&q->iq_requests, &req->ir_link);
+}
+
+static io_request_t *deadline_peek(iosched_queue_t *q)
+{
+    if (list_empty(&q->iq_requests))
+    {
+        return NULL;
+    }
+
+    io_request_t *oldest = list_head(&q->iq_fifo, io_request_t, ir_fifo_link);
+    if (q->iq_ndispatched >= oldest->ir_deadline)
+    {
+        return oldest;
+    }
+
+    list_iterate(&q->iq_requests, req, io_request_t, ir_link)
+    {
+        if (req->ir_block >= q->iq_position)
+        {
+            return req;
+        }
+    }
+    return list_head(&q->iq_requests, io_request_t, ir_link);
+}
+
+static iosched_ops_t deadline_ops = {
+    .iso_name = "deadline",
+    .iso_add = deadline_add,
+    .iso_peek = deadline_peek,
+    .iso_remove = iosched_list_remove,
+};
+
+/*
+ * fair: iq_requests is kept in submission order, and looked through for the
+ * request to serve next (see iosched.h); the queue is short enough for that.
+ */
+static void fair_add(iosched_queue_t *q, io_request_t *req)
+{
+    /* a group that has been idle starts from now, with no credit saved */
+    long g = req->ir_group;
+    if (!q->iq_group_nqueued[g]++)
+    {
+        q->iq_vtime[g] = MAX(q->iq_vtime[g], q->iq_vtime_now);
+    }
+    list_insert_tail(&q->iq_requests, &req->ir_link);
+}
+
+/* Whether req has been queued for longer than it should wait */
+static long fair_late(io_request_t *req, uint64_t now)
+{
+    unsigned ms = IOPRIO_CLASS(req->ir_ioprio) == IOPRIO_CLASS_IDLE
+                      ? IOSCHED_IDLE_LATENCY_MS
+                      : memgroup_io_latency_ms(req->ir_group);
+    return time_tsc_to_ns(now - req->ir_queued) >= (uint64_t)ms * 1000000;
+}
+
+static io_request_t *fair_peek(iosched_queue_t *q)
+{
+    io_request_t *rt = NULL;
+    io_request_t *late = NULL;
+    io_request_t *best = NULL;
+    io_request_t *idle = NULL;
+    uint64_t now = cpuid_rdtsc();
+    list_iterate(&q->iq_requests, req, io_request_t, ir_link)
+    {
+        long cls = IOPRIO_CLASS(req->ir_ioprio);
+        if (cls == IOPRIO_CLASS_RT)
+        {
+            if (!rt || req->ir_ioprio < rt->ir_ioprio)
+            {
+                rt = req;
+            }
+            continue;
+        }
+        if (!late && fair_late(req, now))
+        {
+            late = req;
+        }
+        if (cls == IOPRIO_CLASS_IDLE)
+        {
+            idle = idle ? idle : req;
+        }
+        else if (!best ||
+                 q->iq_vtime[req->ir_group] < q->iq_vtime[best->ir_group] ||
+                 (req->ir_group == best->ir_group &&
+                  req->ir_ioprio < best->ir_ioprio))
+        {
+            best = req;
+        }
+    }
+    return rt ? rt : late ? late : best ? best : idle;
+}
+
+static void fair_dispatched(iosched_queue_t *q, io_request_t *req)
+{
+    long g = req->ir_group;
+    q->iq_group_nqueued[g]--;
+    q->iq_vtime[g] +=
+        (uint64_t)req->ir_count * IOSCHED_WEIGHT_MAX / memgroup_io_weight(g);
+
+    /* now is as far as the busy group that is furthest behind */
+    uint64_t min = (uint64_t)-1;
+    for (long i = 0; i < MEMGROUP_MAX; i++)
+    {
+        if (q->iq_group_nqueued[i])
+        {
+            min = MIN(min, q->iq_vtime[i]);
+        }
+    }
+    if (min != (uint64_t)-1)
+    {
+        q->iq_vtime_now = MAX(q->iq_vtime_now, min);
+    }
+}
+
+static iosched_ops_t fair_ops = {
+    .iso_name = "fair",
+    .iso_add = fair_add,
+    .iso_peek = fair_peek,
+    .iso_remove = iosched_list_remove,
+    .iso_dispatched = fair_dispatched,
+};
+
+static iosched_ops_t *iosched_policies[] = {&noop_ops, &deadline_ops,
+                                            &fair_ops};
+
+#define IOSCHED_NPOLICIES \
+    (sizeof(iosched_policies) / sizeof(iosched_policies[0]))
+
+static iosched_ops_t *iosched_lookup_policy(const char *name)
+{
+    for (size_t i = 0; i < IOSCHED_NPOLICIES; i++)
+    {
+        if (!strcmp(iosched_policies[i]->iso_name, name))
+        {
+            return iosched_policies[i];
+        }
+    }
+    return NULL;
+}
+
+void iosched_init()
+{
+    io_request_allocator =
+        slab_allocator_create("io_request", sizeof(io_request_t));
+    KASSERT(io_request_allocator);
+}
+
+void iosched_queue_init(iosched_queue_t *q)
+{
+    if (!q->iq_max_blocks)
+    {
+        q->iq_max_blocks = 1;
+    }
+    if (!q->iq_max_segments)
+    {
+        q->iq_max_segments = 1;
+    }
+    q->iq_ops = iosched_lookup_policy(IOSCHED_DEFAULT);
+    KASSERT(q->iq_ops);
+    list_init(&q->iq_requests);
+    list_init(&q->iq_fifo);
+    q->iq_position = 0;
+    q->iq_nqueued = 0;
+    q->iq_plugged = 0;
+    spinlock_init(&q->iq_lock);
+    q->iq_ndispatched = 0;
+    memset(q->iq_vtime, 0, sizeof(q->iq_vtime));
+    memset(q->iq_group_nqueued, 0, sizeof(q->iq_group_nqueued));
+    q->iq_vtime_now = 0;
+    memset(&q->iq_stats, 0, sizeof(q->iq_stats));
+}
+
+long iosched_set_policy(blockdev_t *bd, const char *name)
+{
+    iosched_ops_t *ops = iosched_lookup_policy(name);
+    if (!ops)
+    {
+        return -EINVAL;
+    }
+
+    iosched_queue_t *q = &bd->bd_queue;
+    long ret = 0;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&q->iq_lock);
+    if (q->iq_nqueued)
+    {
+        ret = -EBUSY;
+    }
+    else
+    {
+        q->iq_ops = ops;
+    }
+    spinlock_unlock(&q->iq_lock);
+    intr_setipl(ipl);
+    return ret;
+}
+
+/* The priority a bio is served at; IOPRIO_CLASS_NONE is best effort at the
+ * default level */
+static int iosched_ioprio(bio_t *bio)
+{
+    if (IOPRIO_CLASS(bio->bio_ioprio) == IOPRIO_CLASS_NONE)
+    {
+        return IOPRIO_VALUE(IOPRIO_CLASS_BE, IOPRIO_LEVEL_DEFAULT);
+    }
+    return bio->bio_ioprio;
+}
+
+void io_request_init_single(io_request_t *req, bio_t *bio,
+                            io_request_end_func_t end)
+{
+    req->ir_bdev = bio ? bio->bio_bdev : NULL;
+    req->ir_block = bio ? bio->bio_block : 0;
+    req->ir_count = bio ? bio->bio_count : 0;
+    req->ir_write = bio ? bio->bio_write : 0;
+    req->ir_fua = bio ? bio->bio_fua : 0;
+    req->ir_ioprio = bio ? iosched_ioprio(bio)
+                         : IOPRIO_VALUE(IOPRIO_CLASS_BE, IOPRIO_LEVEL_DEFAULT);
+    req->ir_group = bio ? bio->bio_group : MEMGROUP_ROOT;
+    list_init(&req->ir_bios);
+    req->ir_nbios = 0;
+    req->ir_nsegments = 0;
+    if (bio)
+    {
+        list_insert_tail(&req->ir_bios, &bio->bio_link);
+        req->ir_nbios = 1;
+        req->ir_nsegments = bio_nsegments(bio);
+    }
+    req->ir_end = end;
+    req->ir_private = NULL;
+    req->ir_deadline = 0;
+    req->ir_queued = 0;
+    req->ir_dispatched = 0;
+    list_link_init(&req->ir_link);
+    list_link_init(&req->ir_fifo_link);
+}
+
+void io_request_complete_bios(io_request_t *req, long error)
+{
+    list_iterate(&req->ir_bios, bio, bio_t, bio_link)
+    {
+        list_remove(&bio->bio_link);
+        bio_complete(bio, error);
+    }
+}
+
+/* Count a time in a histogram of IOSTAT_HIST_BUCKETS log2 buckets. */
+static void iosched_hist_add(uint64_t *hist, uint64_t cycles)
+{
+    size_t bucket = cycles ? 63 - (size_t)__builtin_clzl(cycles) : 0;
+    hist[MIN(bucket, (size_t)IOSTAT_HIST_BUCKETS - 1)]++;
+}
+
+/*
+ * Completion of requests built by the scheduler. Taking iq_lock also waits
+ * out an iosched_run() still looking at the request it has just dispatched.
+ */
+static void iosched_request_end(io_request_t *req, long error)
+{
+    iosched_queue_t *q = &req->ir_bdev->bd_queue;
+    uint64_t cycles = cpuid_rdtsc() - req->ir_dispatched;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&q->iq_lock);
+    iosched_stats_t *stats = &q->iq_stats;
+    if (req->ir_write)
+    {
+        stats->is_writes++;
+        stats->is_blocks_written += req->ir_count;
+    }
+    else
+    {
+        stats->is_reads++;
+        stats->is_blocks_read += req->ir_count;
+    }
+    stats->is_errors += error ? 1 : 0;
+    stats->is_inflight--;
+    stats->is_service_cycles += cycles;
+    iosched_hist_add(stats->is_service_hist, cycles);
+    spinlock_unlock(&q->iq_lock);
+    intr_setipl(ipl);
+
+    io_request_complete_bios(req, error);
+    slab_obj_free(io_request_allocator, req);
+}
+
+/*
+ * Try to merge bio into a queued request. iq_lock must be held.
+ */
+static long iosched_try_merge(iosched_queue_t *q, bio_t *bio)
+{
+    list_iterate(&q->iq_requests, req, io_request_t, ir_link)
+    {
+        if (req->ir_write != bio->bio_write || req->ir_fua != bio->bio_fua ||
+            req->ir_group != bio->bio_group ||
+            req->ir_nsegments + bio_nsegments(bio) > q->iq_max_segments ||
+            req->ir_count + bio->bio_count > q->iq_max_blocks)
+        {
+            continue;
+        }
+        if (req->ir_block + req->ir_count == bio->bio_block)
+        {
+            list_insert_tail(&req->ir_bios, &bio->bio_link);
+            q->iq_stats.is_back_merges++;
+        }
+        else if (bio->bio_block + bio->bio_count == req->ir_block)
+        {
+            list_insert_head(&req->ir_bios, &bio->bio_link);
+            req->ir_block = bio->bio_block;
+            q->iq_stats.is_front_merges++;
+        }
+        else
+        {
+            continue;
+        }
+        req->ir_count += bio->bio_count;
+        req->ir_ioprio = MIN(req->ir_ioprio, iosched_ioprio(bio));
+        req->ir_nbios++;
+        req->ir_nsegments += bio_nsegments(bio);
+        dbg(DBG_DISK, "merged blocks [%u, %lu) into request [%u, %lu)\n",
+            bio->bio_block, bio->bio_block + bio->bio_count, req->ir_block,
+            req->ir_block + req->ir_count);
+        return 1;
+    }
+    return 0;
+}
+
+long iosched_submit(bio_t *bio)
+{
+    blockdev_t *bd = bio->bio_bdev;
+    iosched_queue_t *q = &bd->bd_queue;
+    if (bio->bio_count > q->iq_max_blocks ||
+        bio_nsegments(bio) > q->iq_max_segments)
+    {
+        return -EINVAL;
+    }
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&q->iq_lock);
+    q->iq_stats.is_nbios++;
+    if (!iosched_try_merge(q, bio))
+    {
+        io_request_t *req = slab_obj_alloc(io_request_allocator);
+        if (!req)
+        {
+            spinlock_unlock(&q->iq_lock);
+            intr_setipl(ipl);
+            return -ENOMEM;
+        }
+        io_request_init_single(req, bio, iosched_request_end);
+        req->ir_queued = cpuid_rdtsc();
+        req->ir_deadline = q->iq_ndispatched + IOSCHED_DEADLINE_DISPATCHES;
+        q->iq_ops->iso_add(q, req);
+        list_insert_tail(&q->iq_fifo, &req->ir_fifo_link);
+        q->iq_nqueued++;
+    }
+    spinlock_unlock(&q->iq_lock);
+    intr_setipl(ipl);
+
+    iosched_run(bd);
+    return 0;
+}
+
+void iosched_run(blockdev_t *bd)
+{
+    iosched_queue_t *q = &bd->bd_queue;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&q->iq_lock);
+    io_request_t *req;
+    while (!q->iq_plugged && (req = q->iq_ops->iso_peek(q)))
+    {
+        /* Dequeue before handing the request over, since it may complete (and
+         * be freed) at any point once the driver has it. Remember where it
+         * was in case the driver turns it away. */
+        list_link_t *next = req->ir_link.l_next;
+        list_link_t *next_fifo = req->ir_fifo_link.l_next;
+        q->iq_ops->iso_remove(q, req);
+        list_remove(&req->ir_fifo_link);
+
+        /* The driver must not sleep, or complete the request, from within its
+         * submit operation, since iq_lock is held. */
+        req->ir_dispatched = cpuid_rdtsc();
+        long ret = bd->bd_ops->submit(bd, req);
+        if (ret == -EBUSY)
+        {
+            list_insert_before(next, &req->ir_link);
+            list_insert_before(next_fifo, &req->ir_fifo_link);
+            break;
+        }
+        KASSERT(!ret);
+        if (q->iq_ops->iso_dispatched)
+        {
+            q->iq_ops->iso_dispatched(q, req);
+        }
+
+        iosched_stats_t *stats = &q->iq_stats;
+        if (q->iq_ndispatched >= req->ir_deadline)
+        {
+            stats->is_nexpired++;
+        }
+        stats->is_inflight++;
+        stats->is_max_inflight =
+            MAX(stats->is_max_inflight, stats->is_inflight);
+        stats->is_queue_cycles += req->ir_dispatched - req->ir_queued;
+        iosched_hist_add(stats->is_queue_hist,
+                         req->ir_dispatched - req->ir_queued);
+        q->iq_nqueued--;
+        q->iq_ndispatched++;
+        q->iq_position = req->ir_block + (blocknum_t)req->ir_count;
+    }
+    spinlock_unlock(&q->iq_lock);
+    intr_setipl(ipl);
+}
+
+void iosched_stats_get(blockdev_t *bd, iosched_stats_t *stats)
+{
+    iosched_queue_t *q = &bd->bd_queue;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&q->iq_lock);
+    *stats = q->iq_stats;
+    spinlock_unlock(&q->iq_lock);
+    intr_setipl(ipl);
+}
+
+void iosched_stats_reset(blockdev_t *bd)
+{
+    iosched_queue_t *q = &bd->bd_queue;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&q->iq_lock);
+    size_t inflight = q->iq_stats.is_inflight;
+    memset(&q->iq_stats, 0, sizeof(q->iq_stats));
+    q->iq_stats.is_inflight = inflight;
+    spinlock_unlock(&q->iq_lock);
+    intr_setipl(ipl);
+}
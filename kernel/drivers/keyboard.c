@@ -1,3 +1,6 @@
+#include "config.h"
+#include "kernel.h"
+
 #include "drivers/keyboard.h"
 
 #include "drivers/tty/tty.h"
@@ -5,6 +8,15 @@
 #include "main/interrupt.h"
 #include "main/io.h"
 
+#include "proc/spinlock.h"
+#include "proc/workq.h"
+
+#include "util/debug.h"
+
+#if KEYBOARD_RING_SIZE & (KEYBOARD_RING_SIZE - 1)
+#error "KEYBOARD_RING_SIZE must be a power of 2"
+#endif
+
 #define IRQ_KEYBOARD 1
 
 /* Indicates that one of these is "being held down" */
@@ -76,16 +88,34 @@ static const char *shift_scancodes =
 
 static keyboard_char_handler_t keyboard_handler = NULL;
 
-/* This is the function we register with the interrupt handler - it reads the
- * scancode and, if appropriate, call's the tty's receive_char function */
-static long keyboard_intr_handler(regs_t *regs)
+/* Scancodes from the interrupt handler, for keyboard_work to decode. The
+ * handler is the only one to advance the head, and the work, under
+ * keyboard_lock, the only one to advance the tail, so the handler needs no
+ * lock */
+static uint8_t keyboard_ring[KEYBOARD_RING_SIZE];
+static volatile size_t keyboard_ring_head;
+static volatile size_t keyboard_ring_tail;
+
+/* Keeps the work from running on two cores at once, which would hand the
+ * characters to the handler out of order */
+static spinlock_t keyboard_lock = SPINLOCK_INITIALIZER(keyboard_lock);
+
+static void keyboard_drain(work_t *work);
+static work_t keyboard_work = WORK_INITIALIZER(keyboard_work, keyboard_drain);
+
+/* Statistics */
+static size_t keyboard_nlost; /* scancodes dropped with the ring full */
+static size_t keyboard_nbatches;
+static size_t keyboard_nchars;
+
+/* Turns a scancode into a character, updating the modifier keys' state;
+ * returns NO_CHAR if there is nothing to pass to the terminal. Only called
+ * with keyboard_lock held, which thus protects curmask */
+static uint8_t keyboard_decode(uint8_t sc)
 {
-    uint8_t sc;     /* The scancode we receive */
     int break_code; /* Was it a break code */
     /* the resulting character ('\0' -> ignored char) */
     uint8_t c = NO_CHAR;
-    /* Get the scancode */
-    sc = inb(KEYBOARD_IN_PORT);
     /* Separate out the break code */
     break_code = sc & BREAK_MASK;
     sc &= ~BREAK_MASK;
@@ -188,21 +218,66 @@ static long keyboard_intr_handler(regs_t *regs)
         c = (uint8_t)normal_scancodes[sc];
     }
 
-    if (c != NO_CHAR)
+    dbg(DBG_KB, "received scancode 0x%x; resolved to char 0x%x\n", sc, c);
+    return c;
+}
+
+/* The interrupt handler only queues the scancode, and the work to decode it,
+ * which is merged with the work for earlier scancodes if that has not started
+ * yet */
+static long keyboard_intr_handler(regs_t *regs)
+{
+    uint8_t sc = inb(KEYBOARD_IN_PORT);
+    size_t head = keyboard_ring_head;
+    if (head - keyboard_ring_tail == KEYBOARD_RING_SIZE)
+    {
+        keyboard_nlost++;
+        return 0;
+    }
+    keyboard_ring[head & (KEYBOARD_RING_SIZE - 1)] = sc;
+    /* the scancode must be stored before the work can see it */
+    __sync_synchronize();
+    keyboard_ring_head = head + 1;
+    work_queue(&keyboard_work);
+    return 0;
+}
+
+/* Decodes everything in the ring, and hands the characters to the handler in
+ * one call */
+static void keyboard_drain(work_t *work)
+{
+    uint8_t chars[KEYBOARD_RING_SIZE];
+    spinlock_lock(&keyboard_lock);
+    size_t tail = keyboard_ring_tail;
+    size_t head = keyboard_ring_head;
+    __sync_synchronize();
+    size_t n = 0;
+    for (; tail != head; tail++)
     {
-        keyboard_handler(c);
+        uint8_t c =
+            keyboard_decode(keyboard_ring[tail & (KEYBOARD_RING_SIZE - 1)]);
+        if (c != NO_CHAR)
+        {
+            chars[n++] = c;
+        }
     }
-    else
+    /* the scancodes must be read before the interrupt handler can reuse
+     * their slots */
+    __sync_synchronize();
+    keyboard_ring_tail = tail;
+
+    if (n)
     {
-        //        panic("get rid of me: char was: %c (%d) (%x)\n", c, c, c);
+        keyboard_nbatches++;
+        keyboard_nchars += n;
+        keyboard_handler(chars, n);
     }
-    dbg(DBG_KB, "received scancode 0x%x; resolved to char 0x%x\n", sc, c);
-    return 0;
+    spinlock_unlock(&keyboard_lock);
 }
 
 void keyboard_init(keyboard_char_handler_t handler)
 {
+    keyboard_handler = handler;
     intr_map(IRQ_KEYBOARD, INTR_KEYBOARD);
     intr_register(INTR_KEYBOARD, keyboard_intr_handler);
-    keyboard_handler = handler;
 }
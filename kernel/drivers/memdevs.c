@@ -3,11 +3,13 @@
 
 #include "util/debug.h"
 #include "util/string.h"
+#include "util/trace.h"
 
 #include "mm/kmalloc.h"
 #include "mm/mobj.h"
 
 #include "drivers/chardev.h"
+#include "drivers/memdevs.h"
 
 #include "vm/anon.h"
 
@@ -22,6 +24,9 @@ static ssize_t zero_read(chardev_t *dev, size_t pos, void *buf, size_t count);
 
 static long zero_mmap(vnode_t *file, mobj_t **ret);
 
+static ssize_t trace_dev_read(chardev_t *dev, size_t pos, void *buf,
+                              size_t count);
+
 chardev_ops_t null_dev_ops = {.read = null_read,
                               .write = null_write,
                               .mmap = NULL,
@@ -34,6 +39,12 @@ chardev_ops_t zero_dev_ops = {.read = zero_read,
                               .fill_pframe = NULL,
                               .flush_pframe = NULL};
 
+chardev_ops_t trace_dev_ops = {.read = trace_dev_read,
+                               .write = null_write,
+                               .mmap = NULL,
+                               .fill_pframe = NULL,
+                               .flush_pframe = NULL};
+
 /**
  * The char device code needs to know about these mem devices, so create
  * chardev_t's for null and zero, fill them in, and register them.
@@ -53,9 +64,19 @@ void memdevs_init()
     zero_dev->cd_ops = &zero_dev_ops;
     chardev_register(zero_dev);
 
+    chardev_t *trace_dev = kmalloc(sizeof(chardev_t));
+    trace_dev->cd_id = MEM_TRACE_DEVID;
+    trace_dev->cd_ops = &trace_dev_ops;
+    chardev_register(trace_dev);
+
    // NOT_YET_IMPLEMENTED("DRIVERS: memdevs_init");
 }
 
+long memdevs_discards_writes(chardev_t *dev)
+{
+    return dev->cd_ops->write == null_write;
+}
+
 /**
  * Reads a given number of bytes from the null device into a
  * buffer. Any read performed on the null device should read 0 bytes.
@@ -93,6 +114,8 @@ static ssize_t null_write(chardev_t *dev, size_t pos, const void *buf,
 /**
  * Reads a given number of bytes from the zero device into a
  * buffer. Any read from the zero device should be a series of zeros.
+ * From read(2), buf is the pinned user pages themselves (see syscall_rw()),
+ * so they are zeroed in place, with no kernel buffer to copy out of.
  *
  * @param  dev   the zero device
  * @param  pos   the offset to start reading from; should be ignored
@@ -113,6 +136,10 @@ static ssize_t zero_read(chardev_t *dev, size_t pos, void *buf, size_t count)
 /**
  * Unlike in s5fs_mmap(), you can't necessarily use the file's underlying mobj.
  * Instead, you should simply provide an anonymous object to ret.
+ *
+ * A private mapping puts a shadow object over it, so until a page is written
+ * it is the shared zero page that is mapped there (see fault_shared_page()),
+ * and reading the mapping costs no memory.
  */
 static long zero_mmap(vnode_t *file, mobj_t **ret)
 {
@@ -128,3 +155,22 @@ static long zero_mmap(vnode_t *file, mobj_t **ret)
     *ret = mobj;
     return 0; 
 }
+
+/**
+ * Reads trace records (see util/trace.h) out of the per-core rings. Only
+ * whole records are returned, and they are consumed: a second reader sees
+ * only what has been recorded since. Writes are discarded, as with null.
+ *
+ * @param  dev   the trace device
+ * @param  pos   the offset to read from; ignored
+ * @param  buf   the buffer to read into
+ * @param  count the maximum number of bytes to read
+ * @return       the number of bytes read, a multiple of the record size; 0 if
+ *               there are no records, or count cannot hold one
+ */
+static ssize_t trace_dev_read(chardev_t *dev, size_t pos, void *buf,
+                              size_t count)
+{
+    return trace_read(buf, count / sizeof(trace_record_t)) *
+           sizeof(trace_record_t);
+}
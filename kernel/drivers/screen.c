@@ -3,6 +3,7 @@
 #include <drivers/screen.h>
 #include <multiboot.h>
 #include <types.h>
+#include <mm/tlb.h>
 #include <util/debug.h>
 #include <util/string.h>
 
@@ -282,8 +283,9 @@ void screen_init()
 #endif
     pt_map_range(pt_get(), (uintptr_t)fb - PHYS_OFFSET, (uintptr_t)fb,
                  (uintptr_t)PAGE_ALIGN_UP(fb + fb_width * fb_height),
-                 PT_PRESENT | PT_WRITE, PT_PRESENT | PT_WRITE);
-    pt_set(pt_get());
+                 PT_PRESENT | PT_WRITE,
+                 PT_PRESENT | PT_WRITE | PT_WRITE_COMBINING);
+    tlb_flush_all();
     for (uint32_t i = 0; i < fb_width * fb_height; i++)
         fb_buffer[i] = 0x008A2BE2;
     screen_flush();
@@ -291,6 +293,13 @@ void screen_init()
 
 inline size_t screen_get_width() { return fb_width; }
 
+void *screen_get_framebuffer(size_t *sizep)
+{
+    *sizep = (uintptr_t)PAGE_ALIGN_UP(fb + fb_width * fb_height) -
+             (uintptr_t)PAGE_ALIGN_DOWN(fb);
+    return fb;
+}
+
 inline size_t screen_get_height() { return fb_height; }
 
 inline size_t screen_get_character_width() { return SCREEN_CHARACTER_WIDTH; }
@@ -425,14 +434,58 @@ void screen_print_shutdown()
 #define CRT_CONTROL_DATA 0x3d5
 
 /* Addresses we can pass to the CRT_CONTROLL_ADDR port */
+#define START_ADDRESS_HIGH 0x0c
+#define START_ADDRESS_LOW 0x0d
 #define CURSOR_HIGH 0x0e
 #define CURSOR_LOW 0x0f
 
+/* The text buffer is 32KB, room for this many rows */
+#define VGA_TEXTBUFFER_SIZE 0x8000
+#define VGA_TEXTBUFFER_ROWS (VGA_TEXTBUFFER_SIZE / VGA_LINE_SIZE)
+
+/*
+ * Video memory is uncached, so slow to write and slower still to read. The
+ * screen is drawn into vga_shadow instead, which also remembers what video
+ * memory holds, so that vga_flush() only has to copy the spans of cells that
+ * have changed, 8 bytes at a time.
+ *
+ * Scrolling moves the CRT controller's start address down the text buffer
+ * rather than copying the screen up, so that only the rows coming into view
+ * have to be written. When the screen reaches the end of the buffer, it is
+ * copied back to the start in full.
+ */
 static uintptr_t vga_textbuffer_phys = 0xB8000;
 static uint16_t *vga_textbuffer;
-static uint16_t vga_blank_screen[VGA_HEIGHT][VGA_WIDTH];
+static uint16_t vga_shadow[VGA_HEIGHT][VGA_WIDTH];
+static size_t vga_dirty_from[VGA_HEIGHT];
+static size_t vga_dirty_to[VGA_HEIGHT]; /* == from if the row is clean */
+static size_t vga_origin;               /* text buffer row at the screen top */
+static long vga_origin_moved;
+static size_t vga_cursor_row;
+static size_t vga_cursor_col;
+static long vga_cursor_moved;
 uint16_t vga_blank_row[VGA_WIDTH];
 
+static void vga_crt_write(uint8_t reg, uint8_t value)
+{
+    outb(CRT_CONTROL_ADDR, reg);
+    outb(CRT_CONTROL_DATA, value);
+}
+
+static void vga_dirty(size_t row, size_t from, size_t to)
+{
+    if (vga_dirty_from[row] == vga_dirty_to[row])
+    {
+        vga_dirty_from[row] = from;
+        vga_dirty_to[row] = to;
+    }
+    else
+    {
+        vga_dirty_from[row] = MIN(vga_dirty_from[row], from);
+        vga_dirty_to[row] = MAX(vga_dirty_to[row], to);
+    }
+}
+
 void vga_enable_cursor()
 {
     outb(0x3D4, 0x0A);
@@ -451,8 +504,7 @@ void vga_disable_cursor()
 void vga_init()
 {
     /* map the VGA textbuffer (vaddr) to the VGA textbuffer physical address */
-    size_t pages =
-        ADDR_TO_PN(PAGE_ALIGN_UP((uintptr_t)sizeof(vga_blank_screen)));
+    size_t pages = ADDR_TO_PN(VGA_TEXTBUFFER_SIZE);
     vga_textbuffer = page_alloc_n(pages);
     KASSERT(vga_textbuffer);
 
@@ -460,39 +512,126 @@ void vga_init()
                  (uintptr_t)vga_textbuffer,
                  (uintptr_t)vga_textbuffer + ((uintptr_t)PN_TO_ADDR(pages)),
                  PT_PRESENT | PT_WRITE, PT_PRESENT | PT_WRITE);
-    pt_set(pt_get());
+    tlb_flush_all();
 
     for (size_t i = 0; i < VGA_WIDTH; i++)
     {
         vga_blank_row[i] = (VGA_DEFAULT_ATTRIB << 8) | ' ';
     }
-    for (size_t i = 0; i < VGA_HEIGHT; i++)
-    {
-        memcpy(&vga_blank_screen[i], vga_blank_row, VGA_LINE_SIZE);
-    }
 
     vga_enable_cursor();
+    vga_origin = 0;
+    vga_origin_moved = 1;
     vga_clear_screen();
+    vga_flush();
 }
 
 void vga_set_cursor(size_t row, size_t col)
 {
-    uint16_t pos = (row * VGA_WIDTH) + col;
-    outb(0x3D4, 0x0F);
-    outb(0x3D5, (uint8_t)(pos & 0xFF));
-    outb(0x3D4, 0x0E);
-    outb(0x3D5, (uint8_t)((pos >> 8) & 0xFF));
+    vga_cursor_row = row;
+    vga_cursor_col = col;
+    vga_cursor_moved = 1;
 }
 
 void vga_clear_screen()
 {
-    memcpy(vga_textbuffer, vga_blank_screen, sizeof(vga_blank_screen));
+    for (size_t row = 0; row < VGA_HEIGHT; row++)
+    {
+        memcpy(vga_shadow[row], vga_blank_row, VGA_LINE_SIZE);
+        vga_dirty(row, 0, VGA_WIDTH);
+    }
 }
 
 void vga_write_char_at(size_t row, size_t col, uint16_t v)
 {
     KASSERT(row < VGA_HEIGHT && col < VGA_WIDTH);
-    vga_textbuffer[(row * VGA_WIDTH) + col] = v;
+    if (vga_shadow[row][col] != v)
+    {
+        vga_shadow[row][col] = v;
+        vga_dirty(row, col, col + 1);
+    }
+}
+
+void vga_scroll(size_t lines)
+{
+    if (lines > VGA_HEIGHT)
+    {
+        lines = VGA_HEIGHT;
+    }
+    memmove(vga_shadow, vga_shadow[lines], (VGA_HEIGHT - lines) * VGA_LINE_SIZE);
+    memmove(vga_dirty_from, vga_dirty_from + lines,
+            (VGA_HEIGHT - lines) * sizeof(size_t));
+    memmove(vga_dirty_to, vga_dirty_to + lines,
+            (VGA_HEIGHT - lines) * sizeof(size_t));
+
+    vga_origin += lines;
+    vga_origin_moved = 1;
+    if (vga_origin + VGA_HEIGHT > VGA_TEXTBUFFER_ROWS)
+    {
+        /* back to the start of the text buffer, which has to be redrawn */
+        vga_origin = 0;
+        for (size_t row = 0; row < VGA_HEIGHT - lines; row++)
+        {
+            vga_dirty_from[row] = vga_dirty_to[row] = 0;
+            vga_dirty(row, 0, VGA_WIDTH);
+        }
+    }
+    for (size_t row = VGA_HEIGHT - lines; row < VGA_HEIGHT; row++)
+    {
+        memcpy(vga_shadow[row], vga_blank_row, VGA_LINE_SIZE);
+        vga_dirty_from[row] = vga_dirty_to[row] = 0;
+        vga_dirty(row, 0, VGA_WIDTH);
+    }
+}
+
+/* Copies n cells to video memory, 4 at a time once dst is 8-byte aligned */
+static void vga_blit(volatile uint16_t *dst, const uint16_t *src, size_t n)
+{
+    while (n && ((uintptr_t)dst & 7))
+    {
+        *dst++ = *src++;
+        n--;
+    }
+    for (; n >= 4; n -= 4, dst += 4, src += 4)
+    {
+        uint64_t v;
+        memcpy(&v, src, sizeof(v));
+        *(volatile uint64_t *)dst = v;
+    }
+    while (n--)
+    {
+        *dst++ = *src++;
+    }
+}
+
+void vga_flush()
+{
+    for (size_t row = 0; row < VGA_HEIGHT; row++)
+    {
+        size_t from = vga_dirty_from[row];
+        size_t to = vga_dirty_to[row];
+        if (from != to)
+        {
+            vga_blit(vga_textbuffer + (vga_origin + row) * VGA_WIDTH + from,
+                     &vga_shadow[row][from], to - from);
+            vga_dirty_from[row] = vga_dirty_to[row] = 0;
+        }
+    }
+
+    /* the rows are all there before they are shown */
+    size_t origin = vga_origin * VGA_WIDTH;
+    if (vga_origin_moved)
+    {
+        vga_crt_write(START_ADDRESS_HIGH, (uint8_t)((origin >> 8) & 0xFF));
+        vga_crt_write(START_ADDRESS_LOW, (uint8_t)(origin & 0xFF));
+    }
+    if (vga_origin_moved || vga_cursor_moved)
+    {
+        size_t pos = origin + (vga_cursor_row * VGA_WIDTH) + vga_cursor_col;
+        vga_crt_write(CURSOR_LOW, (uint8_t)(pos & 0xFF));
+        vga_crt_write(CURSOR_HIGH, (uint8_t)((pos >> 8) & 0xFF));
+    }
+    vga_origin_moved = vga_cursor_moved = 0;
 }
 
 static char *shutdown_message = "Weenix has halted cleanly!";
@@ -508,6 +647,7 @@ void screen_print_shutdown()
         vga_write_char_at(y, x + i,
                           (VGA_DEFAULT_ATTRIB << 8) | shutdown_message[i]);
     }
+    vga_flush();
 }
 
 #endif
\ No newline at end of file
@@ -1,66 +1,127 @@
 #include "drivers/tty/ldisc.h"
+#include <api/syscall.h>
 #include <drivers/keyboard.h>
 #include <drivers/tty/tty.h>
+#include <globals.h>
 #include <errno.h>
+#include <mm/kmalloc.h>
 #include <util/bits.h>
 #include <util/debug.h>
 #include <util/string.h>
+#include <util/time.h>
 
 #define ldisc_to_tty(ldisc) CONTAINER_OF((ldisc), tty_t, tty_ldisc)
 
+#define LDISC_INDEX(ldisc, i) ((i) & ((ldisc)->ldisc_size - 1))
+
+/* Bytes from index from up to index to */
+#define LDISC_SPAN(ldisc, from, to) LDISC_INDEX((ldisc), (to) - (from))
+
 /**
- * Initialize the line discipline. Don't forget to wipe the buffer associated
- * with the line discipline clean.
+ * Initialize the line discipline, in canonical mode with echo, with an empty
+ * buffer of size bytes.
  *
  * @param ldisc line discipline.
+ * @param size  size of its buffer, a power of 2
  */
-void ldisc_init(ldisc_t *ldisc)
+void ldisc_init(ldisc_t *ldisc, size_t size)
 {
-    ldisc->ldisc_cooked = 0; /// is this all to be done to wipe clean?
+    KASSERT(size >= LDISC_LINE_MAX && !(size & (size - 1)));
+    ldisc->ldisc_cooked = 0;
     ldisc->ldisc_tail = 0;
     ldisc->ldisc_head = 0;
-    ldisc->ldisc_full = 0;
+    ldisc->ldisc_size = size;
+    ldisc->ldisc_lflag = ICANON | ECHO;
+    ldisc->ldisc_vmin = 1;
+    ldisc->ldisc_vtime = 0;
     sched_queue_init(&ldisc->ldisc_read_queue);
-    memset(ldisc->ldisc_buffer, 0, LDISC_BUFFER_SIZE);
-    //ldisc->ldisc_buffer[0] = '\0'; /// correct? should I make a new char buffer?
-    //NOT_YET_IMPLEMENTED("DRIVERS: ldisc_init");
+    pollhead_init(&ldisc->ldisc_pollhead);
+    ldisc->ldisc_buffer = kmalloc(size);
+    KASSERT(ldisc->ldisc_buffer);
+    memset(ldisc->ldisc_buffer, 0, size);
 }
 
 /**
- * While there are no new characters to be read from the line discipline's
- * buffer, you should make the current thread to sleep on the line discipline's
- * read queue. Note that this sleep can be cancelled. What conditions must be met 
- * for there to be no characters to be read?
+ * Waits until a read of count bytes can go ahead: in canonical mode, until
+ * there are cooked characters (a line, or an EOT); in raw mode, until there
+ * are VMIN of them (at most count), or VTIME has run out. The wait can be
+ * cancelled.
  *
  * @param  ldisc the line discipline
- * @param  lock  the lock associated with `ldisc`
- * @return       0 if there are new characters to be read or the ldisc is full.
- *               If the sleep was interrupted, return what
- *               `sched_cancellable_sleep_on` returned (i.e. -EINTR)
+ * @param  lock  the lock associated with `ldisc`, held at IPL_HIGH; it is
+ *               released while sleeping and held again on return
+ * @param  count the number of bytes the reader wants
+ * @return       0 if the read can go ahead (in raw mode, possibly with
+ *               nothing to read), -EAGAIN if it would have to wait and is
+ *               non-blocking, or what the sleep returned if it was
+ *               interrupted
  */
-long ldisc_wait_read(ldisc_t *ldisc, spinlock_t *lock)
+long ldisc_wait_read(ldisc_t *ldisc, spinlock_t *lock, size_t count)
 {
-    long ret;
-    while (ldisc->ldisc_cooked == ldisc->ldisc_tail && ldisc->ldisc_full == 0) { /// is this all? are my conditions right? should I check readq?
-        ret = sched_cancellable_sleep_on(&ldisc->ldisc_read_queue, lock);
-        if (ret != 0){
+    size_t want = 1;
+    uint64_t vtime = 0;
+    uint64_t deadline = 0;
+    if (!(ldisc->ldisc_lflag & ICANON))
+    {
+        vtime = time_ms_to_jiffies(ldisc->ldisc_vtime * 100);
+        if (ldisc->ldisc_vmin)
+        {
+            want = MIN(ldisc->ldisc_vmin, count);
+        }
+        else if (ldisc->ldisc_vtime)
+        {
+            /* a single timer for the whole read */
+            deadline = jiffies + vtime + 1;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    size_t seen = 0;
+    size_t avail;
+    while ((avail = LDISC_SPAN(ldisc, ldisc->ldisc_tail, ldisc->ldisc_cooked)) <
+           want)
+    {
+        if (curthr->kt_nonblock)
+        {
+            return avail ? 0 : -EAGAIN;
+        }
+        if (ldisc->ldisc_vmin && vtime && avail != seen)
+        {
+            /* the timer runs between characters, from the first one */
+            seen = avail;
+            deadline = jiffies + vtime + 1;
+        }
+        if (deadline && jiffies >= deadline)
+        {
+            return 0;
+        }
+        long ret = poll_sleep(&ldisc->ldisc_read_queue, lock, deadline);
+        if (ret)
+        {
             return ret;
         }
     }
-    return ret;
-    //NOT_YET_IMPLEMENTED("DRIVERS: ldisc_wait_read");
-    //return -1;
+    return 0;
+}
+
+/* Copies len bytes out of the buffer from index from, in at most two pieces */
+static void ldisc_copy_out(ldisc_t *ldisc, char *buf, size_t from, size_t len)
+{
+    size_t first = MIN(len, ldisc->ldisc_size - from);
+    memcpy(buf, ldisc->ldisc_buffer + from, first);
+    memcpy(buf + first, ldisc->ldisc_buffer, len - first);
 }
 
 /**
- * Reads `count` bytes (at max) from the line discipline's buffer into the
- * provided buffer. Keep in mind the the ldisc's buffer is circular.
+ * Reads `count` bytes (at max) from the cooked part of the line discipline's
+ * buffer into the provided buffer.
  *
- * If you encounter a new line symbol before you have read `count` bytes, you
- * should stop copying and return the bytes read until now.
- * 
- * If you encounter an `EOT` you should stop reading and you should NOT include 
- * the `EOT` in the count of the number of bytes read
+ * In canonical mode, a read stops after a newline, which is included, and
+ * before an `EOT`, which is consumed but not counted, so that a read that
+ * hits an `EOT` straight away returns 0.
  *
  * @param  ldisc the line discipline
  * @param  buf   the buffer to read into.
@@ -69,110 +130,196 @@ long ldisc_wait_read(ldisc_t *ldisc, spinlock_t *lock)
  */
 size_t ldisc_read(ldisc_t *ldisc, char *buf, size_t count)
 {
-    size_t i = 0;
-    while (i < count && ldisc->ldisc_cooked != ldisc->ldisc_tail) { /// is the while condition correct?
-        if (ldisc->ldisc_buffer[ldisc->ldisc_cooked] == '\n') {
-            break;
+    size_t tail = ldisc->ldisc_tail;
+    size_t n = MIN(count, LDISC_SPAN(ldisc, tail, ldisc->ldisc_cooked));
+    size_t skip = 0;
+    if (ldisc->ldisc_lflag & ICANON)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            char c = ldisc->ldisc_buffer[LDISC_INDEX(ldisc, tail + i)];
+            if (c == '\n' || c == EOT)
+            {
+                skip = c == EOT;
+                n = i + !skip;
+                break;
+            }
         }
-        if (ldisc->ldisc_buffer[ldisc->ldisc_cooked] == EOT) {
-            break;
+    }
+    ldisc_copy_out(ldisc, buf, tail, n);
+    ldisc->ldisc_tail = LDISC_INDEX(ldisc, tail + n + skip);
+    return n;
+}
+
+/* Appends c to the raw part, if there is room for it and, unless it ends the
+ * line, for a character that does */
+static long ldisc_put(ldisc_t *ldisc, char c, long ends_line)
+{
+    size_t used = LDISC_SPAN(ldisc, ldisc->ldisc_tail, ldisc->ldisc_head);
+    size_t room = ldisc->ldisc_size - 1 - used;
+    if ((ldisc->ldisc_lflag & ICANON) && !ends_line &&
+        (room < 2 || LDISC_SPAN(ldisc, ldisc->ldisc_cooked,
+                                ldisc->ldisc_head) >= LDISC_LINE_MAX - 1))
+    {
+        return 0;
+    }
+    if (!room)
+    {
+        return 0;
+    }
+    ldisc->ldisc_buffer[ldisc->ldisc_head] = c;
+    ldisc->ldisc_head = LDISC_INDEX(ldisc, ldisc->ldisc_head + 1);
+    return 1;
+}
+
+/* Wakes up readers, once something has been cooked */
+static void ldisc_wakeup_readers(ldisc_t *ldisc)
+{
+    sched_wakeup_on(&ldisc->ldisc_read_queue, NULL);
+    poll_notify(&ldisc->ldisc_pollhead, POLLIN);
+}
+
+/* Handles a character as described for ldisc_key_pressed(), but leaves waking
+ * up readers to the caller; returns 1 if the raw part was cooked */
+static long ldisc_key(ldisc_t *ldisc, char c)
+{
+    vterminal_t *vt = &ldisc_to_tty(ldisc)->tty_vterminal;
+    if (!(ldisc->ldisc_lflag & ICANON))
+    {
+        if (ldisc_put(ldisc, c, 1))
+        {
+            if (ldisc->ldisc_lflag & ECHO)
+            {
+                vterminal_write(vt, &c, 1);
+            }
+            ldisc->ldisc_cooked = ldisc->ldisc_head;
+            return 1;
         }
-        buf[i] = ldisc->ldisc_buffer[ldisc->ldisc_cooked];
-        ldisc->ldisc_cooked = (ldisc->ldisc_cooked + 1) % LDISC_BUFFER_SIZE; /// do I need these % LDISC_BUFFER_SIZEs?
-        i++; /// might be off by 1 or so
+        return 0;
     }
-    return i;
-    //NOT_YET_IMPLEMENTED("DRIVERS: ldisc_read");
 
+    switch (c)
+    {
+    case '\b':
+        if (ldisc->ldisc_head != ldisc->ldisc_cooked)
+        {
+            /* the vterminal looks at the erased character, to undo a tab */
+            ldisc->ldisc_head = LDISC_INDEX(ldisc, ldisc->ldisc_head - 1);
+            if (ldisc->ldisc_lflag & ECHO)
+            {
+                vterminal_write(vt, "\b", 1);
+            }
+        }
+        break;
+    case ETX:
+        ldisc->ldisc_head = ldisc->ldisc_cooked;
+        /* fall through */
+    case '\n':
+        if (ldisc_put(ldisc, '\n', 1))
+        {
+            if (ldisc->ldisc_lflag & ECHO)
+            {
+                vterminal_write(vt, "\n", 1);
+            }
+            ldisc->ldisc_cooked = ldisc->ldisc_head;
+            return 1;
+        }
+        break;
+    case EOT:
+        if (ldisc_put(ldisc, c, 1))
+        {
+            ldisc->ldisc_cooked = ldisc->ldisc_head;
+            return 1;
+        }
+        break;
+    default:
+        if (ldisc_put(ldisc, c, 0) && (ldisc->ldisc_lflag & ECHO))
+        {
+            vterminal_key_pressed(vt);
+        }
+        break;
+    }
+    return 0;
 }
 
 /**
- * Place the character received into the ldisc's buffer. You should also update
- * relevant fields of the struct.
+ * Place the character received into the ldisc's buffer, and update the
+ * virtual terminal.
  *
- * An easier way of handling new characters is making sure that you always have
- * one byte left in the line discipline. This way, if the new character you
- * received is a new line symbol (user hit enter), you can still place the new
- * line symbol into the buffer; if the new character is not a new line symbol,
- * you shouldn't place it into the buffer so that you can leave the space for
- * a new line symbol in the future. 
- * 
- * If the line discipline is full, all incoming characters should be ignored. 
+ * In raw mode, every character is cooked straight away, and echoed as it is
+ * if ECHO is set.
  *
- * Here are some special cases to consider:
- *      1. If the character is a backspace:
- *          * if there is a character to remove you must also emit a `\b` to
- *            the vterminal.
- *      2. If the character is end of transmission (EOT) character (typing ctrl-d)
- *      3. If the character is end of text (ETX) character (typing ctrl-c)
- *      4. If your buffer is almost full and what you received is not a new line
- *      symbol
+ * In canonical mode, one byte is always kept for the newline that ends the
+ * line being edited, and lines are kept under LDISC_LINE_MAX; characters that
+ * do not fit are ignored. Some characters are special:
+ *      1. A backspace removes the last character of the raw part, if there is
+ *         one, and emits a `\b` to the vterminal.
+ *      2. A newline is added and cooks the line, waking up readers, and emits
+ *         a `\n` to the vterminal.
+ *      3. An end of transmission (EOT) character (typing ctrl-d) is added and
+ *         cooks the line, waking up readers, but does not emit anything.
+ *      4. An end of text (ETX) character (typing ctrl-c) throws away the raw
+ *         part, leaving a cooked blank line in its place.
+ * Other characters are added and shown with `vterminal_key_pressed`.
  *
- * If you did receive a new line symbol, you should wake up the thread that is
- * sleeping on the wait queue of the line discipline. You should also
- * emit a `\n` to the vterminal by using `vterminal_write`.  
- * 
- * If you encounter the `EOT` character, you should add it to the buffer, 
- * cook the buffer, and wake up the reader (but do not emit an `\n` character 
- * to the vterminal)
- * 
- * In case of `ETX` you should cause the input line to be effectively transformed
- * into a cooked blank line. You should clear uncooked portion of the line, by 
- * adjusting ldisc_head. 
+ * @param ldisc the line discipline
+ * @param c     the new character
+ */
+/**
+ * Place the character received into the ldisc's buffer, and update the
+ * virtual terminal.
  *
- * Finally, if the none of the above cases apply you should fallback to
- * `vterminal_key_pressed`.
+ * In raw mode, every character is cooked straight away, and echoed as it is
+ * if ECHO is set.
  *
- * Don't forget to write the corresponding characters to the virtual terminal
- * when it applies!
+ * In canonical mode, one byte is always kept for the newline that ends the
+ * line being edited, and lines are kept under LDISC_LINE_MAX; characters that
+ * do not fit are ignored. Some characters are special:
+ *      1. A backspace removes the last character of the raw part, if there is
+ *         one, and emits a `\b` to the vterminal.
+ *      2. A newline is added and cooks the line, waking up readers, and emits
+ *         a `\n` to the vterminal.
+ *      3. An end of transmission (EOT) character (typing ctrl-d) is added and
+ *         cooks the line, waking up readers, but does not emit anything.
+ *      4. An end of text (ETX) character (typing ctrl-c) throws away the raw
+ *         part, leaving a cooked blank line in its place.
+ * Other characters are added and shown with `vterminal_key_pressed`.
  *
  * @param ldisc the line discipline
  * @param c     the new character
  */
 void ldisc_key_pressed(ldisc_t *ldisc, char c)
 {
-    if (ldisc->ldisc_full == 1) {
-        return;
-    }
-    if (c == '\b') {
-        if (ldisc->ldisc_head != ldisc->ldisc_tail) { /// do I need this if wrapper?
-            ldisc->ldisc_head = (ldisc->ldisc_head - 1) % LDISC_BUFFER_SIZE; /// the %s not needed right
-            //vterminal_key_pressed(c); /// how many calls to this?
-            vterminal_write(&ldisc_to_tty(ldisc)->tty_vterminal, "\v", 1);
-        }
-    }
-    else if (c == EOT) { /// "do not emit an `\n` character* to the vterminal" - handled right?
-        ldisc->ldisc_buffer[ldisc->ldisc_head] = c;
-        ldisc->ldisc_head = (ldisc->ldisc_head + 1) % LDISC_BUFFER_SIZE;
-        ldisc->ldisc_full = 1;
-        ldisc->ldisc_cooked = ldisc->ldisc_tail; /// relationship between cooked and tail?
-        sched_wakeup_on(&ldisc->ldisc_read_queue, NULL); /// second arg correct?
-    }
-    else if (c == ETX) {
-        ldisc->ldisc_head = ldisc->ldisc_tail;
+    if (ldisc_key(ldisc, c))
+    {
+        ldisc_wakeup_readers(ldisc);
     }
-    else if (c == '\n') {
-        ldisc->ldisc_buffer[ldisc->ldisc_head] = c;
-        ldisc->ldisc_head = (ldisc->ldisc_head + 1) % LDISC_BUFFER_SIZE;
-        ldisc->ldisc_cooked = ldisc->ldisc_head;
-        vterminal_write(&ldisc_to_tty(ldisc)->tty_vterminal, "\n", 1); /// what is the terminal?
-        sched_wakeup_on(&ldisc->ldisc_read_queue, NULL);
-    }
-    else if (ldisc->ldisc_head == (ldisc->ldisc_tail - 1) % LDISC_BUFFER_SIZE) {
-        return;
+}
+
+/**
+ * Like ldisc_key_pressed() for each of a run of characters, but wakes up
+ * readers at most once, after the last one.
+ *
+ * @param ldisc the line discipline
+ * @param s     the new characters
+ * @param n     the number of characters
+ */
+void ldisc_keys_pressed(ldisc_t *ldisc, const char *s, size_t n)
+{
+    long cooked = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        cooked |= ldisc_key(ldisc, s[i]);
     }
-    else {
-        ldisc->ldisc_buffer[ldisc->ldisc_head] = c;
-        ldisc->ldisc_head = (ldisc->ldisc_head + 1) % LDISC_BUFFER_SIZE; /// are thesea the only steps?
-        // tail
-        ldisc->ldisc_buffer[ldisc->ldisc_tail] = c;
-        vterminal_key_pressed(&ldisc_to_tty(ldisc)->tty_vterminal); /// what args???
+    if (cooked)
+    {
+        ldisc_wakeup_readers(ldisc);
     }
-    /// NOT_YET_IMPLEMENTED("DRIVERS: ldisc_key_pressed");
 }
 
 /**
- * Copy the raw part of the line discipline buffer into the buffer provided.
+ * Copy the raw part of the line discipline buffer into the buffer provided,
+ * which must have room for LDISC_LINE_MAX bytes.
  *
  * @param  ldisc the line discipline
  * @param  s     the character buffer to write to
@@ -180,30 +327,54 @@ void ldisc_key_pressed(ldisc_t *ldisc, char c)
  */
 size_t ldisc_get_current_line_raw(ldisc_t *ldisc, char *s)
 {
-    size_t i = 0;
-    // while (ldisc->ldisc_tail != ldisc->ldisc_head) { /// what should the check be???
-    //     // s[i] = ldisc->ldisc_buffer[ldisc->ldisc_tail];
-    //     //ldisc->ldisc_tail = (ldisc->ldisc_tail + 1) % LDISC_BUFFER_SIZE;
-    //     i++;
-    // }
-    //NOT_YET_IMPLEMENTED("DRIVERS: ldisc_get_current_line_raw");
-    // memcpy(s, ldisc->ldisc_buffer)
-    // if (ldisc_head < cooked )
-    // return 0;
-    /*
-    if head < cooked:
-    memcopy stuff between it
-    else is less than cooked: 
-    memcopy stuff from cooked to end, and from bgenning to head*/
-    if (ldisc->ldisc_head < ldisc->ldisc_cooked) {
-        memcpy(s, ldisc->ldisc_buffer + ldisc->ldisc_head, ldisc->ldisc_cooked - ldisc->ldisc_head);
-        i = ldisc->ldisc_cooked - ldisc->ldisc_head;
-    }
-    else {
-        memcpy(s, ldisc->ldisc_buffer + ldisc->ldisc_head, LDISC_BUFFER_SIZE - ldisc->ldisc_head);
-        memcpy(s + LDISC_BUFFER_SIZE - ldisc->ldisc_head, ldisc->ldisc_buffer, ldisc->ldisc_cooked);
-        i = LDISC_BUFFER_SIZE - ldisc->ldisc_head + ldisc->ldisc_cooked;
+    size_t len = LDISC_SPAN(ldisc, ldisc->ldisc_cooked, ldisc->ldisc_head);
+    ldisc_copy_out(ldisc, s, ldisc->ldisc_cooked, len);
+    return len;
+}
+
+/**
+ * Reports whether there is input for ldisc_read(), as the vnode poll
+ * operation does (see fs/poll.h): adds pe to the line discipline's pollhead
+ * if it is not NULL, then checks whether anything is cooked. In raw mode, a
+ * single character is enough, whatever VMIN is.
+ *
+ * @param  ldisc the line discipline
+ * @param  pe    poll entry to add, or NULL
+ * @return       POLLIN if there is something to read, or 0
+ */
+int ldisc_poll(ldisc_t *ldisc, poll_entry_t *pe)
+{
+    if (pe)
+    {
+        poll_wait(&ldisc->ldisc_pollhead, pe);
     }
-    return i;
+    return ldisc->ldisc_cooked != ldisc->ldisc_tail ? POLLIN : 0;
+}
+
+/**
+ * Fills in the line discipline's settings.
+ */
+void ldisc_get_termios(ldisc_t *ldisc, struct termios *t)
+{
+    t->c_lflag = ldisc->ldisc_lflag;
+    t->c_cc[VMIN] = ldisc->ldisc_vmin;
+    t->c_cc[VTIME] = ldisc->ldisc_vtime;
 }
 
+/**
+ * Changes the line discipline's settings. Leaving canonical mode cooks the
+ * line being edited, as it is; readers are woken up to check the new
+ * settings.
+ */
+void ldisc_set_termios(ldisc_t *ldisc, const struct termios *t)
+{
+    ldisc->ldisc_lflag = t->c_lflag & (ICANON | ECHO);
+    ldisc->ldisc_vmin = t->c_cc[VMIN];
+    ldisc->ldisc_vtime = t->c_cc[VTIME];
+    if (!(ldisc->ldisc_lflag & ICANON))
+    {
+        ldisc->ldisc_cooked = ldisc->ldisc_head;
+    }
+    sched_broadcast_on(&ldisc->ldisc_read_queue);
+    poll_notify(&ldisc->ldisc_pollhead, POLLIN);
+}
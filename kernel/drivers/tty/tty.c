@@ -1,10 +1,18 @@
 #include "drivers/tty/tty.h"
+#include "api/syscall.h"
+#include "config.h"
 #include "drivers/chardev.h"
 #include "drivers/dev.h"
 #include "drivers/keyboard.h"
+#include "globals.h"
 #include "kernel.h"
+#include "main/interrupt.h"
 #include "mm/kmalloc.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
 #include "util/debug.h"
+#include "util/string.h"
 #include <errno.h>
 
 #ifndef NTERMS
@@ -13,12 +21,16 @@
 
 ssize_t tty_read(chardev_t *cdev, size_t pos, void *buf, size_t count);
 ssize_t tty_write(chardev_t *cdev, size_t pos, const void *buf, size_t count);
+int tty_poll(chardev_t *cdev, poll_entry_t *pe);
+long tty_ioctl(chardev_t *cdev, unsigned long request, void *arg);
 
 chardev_ops_t tty_cdev_ops = {.read = tty_read,
                               .write = tty_write,
                               .mmap = NULL,
                               .fill_pframe = NULL,
-                              .flush_pframe = NULL};
+                              .flush_pframe = NULL,
+                              .poll = tty_poll,
+                              .ioctl = tty_ioctl};
 
 tty_t *ttys[NTERMS] = {NULL};
 
@@ -26,7 +38,14 @@ size_t active_tty;
 
 spinlock_t active_tty_lock = SPINLOCK_INITIALIZER(active_tty_lock);
 
-static void tty_receive_char_multiplexer(uint8_t c);
+/* The thread rendering the ttys' output rings, once started, and whether it
+ * has been asked to look at them since it last started to */
+static kthread_t *tty_thread;
+static ktqueue_t tty_thread_waitq;
+static spinlock_t tty_thread_lock = SPINLOCK_INITIALIZER(tty_thread_lock);
+static long tty_thread_kicked;
+
+static void tty_receive_char_multiplexer(const uint8_t *chars, size_t n);
 
 void tty_init()
 {
@@ -34,7 +53,7 @@ void tty_init()
     {
         tty_t *tty = ttys[i] = kmalloc(sizeof(tty_t));
         vterminal_init(&tty->tty_vterminal);
-        ldisc_init(&tty->tty_ldisc);
+        ldisc_init(&tty->tty_ldisc, LDISC_BUFFER_SIZE);
 
         tty->tty_cdev.cd_id = MKDEVID(TTY_MAJOR, i);
         list_link_init(&tty->tty_cdev.cd_link);
@@ -44,6 +63,10 @@ void tty_init()
         kmutex_init(&tty->tty_read_mutex);
         spinlock_init(&tty->tty_lock);
 
+        spinlock_init(&tty->tty_out_lock);
+        tty->tty_out_head = tty->tty_out_tail = 0;
+        sched_queue_init(&tty->tty_out_waitq);
+
         long ret = chardev_register(&tty->tty_cdev);
         KASSERT(!ret);
     }
@@ -54,6 +77,102 @@ void tty_init()
     keyboard_init(tty_receive_char_multiplexer);
 }
 
+/* Wakes the tty thread, unless it has already been woken; callable with a
+ * tty's tty_out_lock held */
+static void tty_kick()
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&tty_thread_lock);
+    long kicked = tty_thread_kicked;
+    tty_thread_kicked = 1;
+    spinlock_unlock(&tty_thread_lock);
+    if (!kicked)
+    {
+        sched_wakeup_on(&tty_thread_waitq, NULL);
+    }
+    intr_setipl(ipl);
+}
+
+/* Renders a run of characters on a tty's vterminal, under the lock that
+ * keeps it from the line discipline's echoing */
+static void tty_render(tty_t *tty, const char *buf, size_t count)
+{
+    uint8_t ipl = intr_setipl(INTR_KEYBOARD);
+    spinlock_lock(&tty->tty_lock);
+    vterminal_write(&tty->tty_vterminal, buf, count);
+    spinlock_unlock(&tty->tty_lock);
+    intr_setipl(ipl);
+}
+
+/*
+ * Renders everything queued in a tty's output ring. Writers only ever add to
+ * the ring past tty_out_head, so the queued bytes are rendered from the ring
+ * itself, without its lock; each contiguous run is released to the writers,
+ * and to pollers waiting for POLLOUT, as soon as it is rendered.
+ */
+static void tty_drain(tty_t *tty)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&tty->tty_out_lock);
+    size_t head = tty->tty_out_head;
+    size_t tail = tty->tty_out_tail;
+    spinlock_unlock(&tty->tty_out_lock);
+    intr_setipl(ipl);
+
+    while (tail != head)
+    {
+        size_t off = tail & (TTY_OUTPUT_RING - 1);
+        size_t n = MIN(head - tail, TTY_OUTPUT_RING - off);
+        tty_render(tty, tty->tty_out + off, n);
+        tail += n;
+
+        ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&tty->tty_out_lock);
+        tty->tty_out_tail = tail;
+        head = tty->tty_out_head;
+        spinlock_unlock(&tty->tty_out_lock);
+        sched_broadcast_on(&tty->tty_out_waitq);
+        intr_setipl(ipl);
+        poll_notify(&tty->tty_ldisc.ldisc_pollhead, POLLOUT);
+    }
+}
+
+static void *tty_run(long arg1, void *arg2)
+{
+    while (1)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&tty_thread_lock);
+        if (!tty_thread_kicked)
+        {
+            sched_sleep_on(&tty_thread_waitq, &tty_thread_lock);
+            spinlock_lock(&tty_thread_lock);
+        }
+        /* output queued from here on kicks the thread again */
+        tty_thread_kicked = 0;
+        spinlock_unlock(&tty_thread_lock);
+        intr_setipl(ipl);
+
+        for (unsigned i = 0; i < NTERMS; i++)
+        {
+            tty_drain(ttys[i]);
+        }
+    }
+    return NULL;
+}
+
+void tty_start()
+{
+    sched_queue_init(&tty_thread_waitq);
+
+    proc_t *proc = proc_create("tty");
+    KASSERT(proc);
+    kthread_t *thr = kthread_create(proc, tty_run, 0, NULL);
+    KASSERT(thr);
+    tty_thread = thr;
+    sched_make_runnable(thr);
+}
+
 /**
  * Reads from the tty to the buffer.
  *
@@ -75,13 +194,15 @@ ssize_t tty_read(chardev_t *cdev, size_t pos, void *buf, size_t count)
     tty_t *ttys = cd_to_tty(cdev);
     kmutex_lock(&ttys->tty_read_mutex); /// correct mutex and tty? cdv has no lock field + how to fix the type error?
     uint32_t old_ipl = intr_setipl(INTR_KEYBOARD); /// correct call?
-    uint32_t bytes_read = 0;
-    long wait_ret = ldisc_wait_read(&ttys->tty_ldisc, &ttys->tty_lock);
+    spinlock_lock(&ttys->tty_lock);
+    ssize_t bytes_read = 0;
+    long wait_ret = ldisc_wait_read(&ttys->tty_ldisc, &ttys->tty_lock, count);
     if (wait_ret != 0){
         bytes_read = wait_ret;
     } else {
-        ldisc_read(&ttys->tty_ldisc, buf, count);
+        bytes_read = ldisc_read(&ttys->tty_ldisc, buf, count);
     }
+    spinlock_unlock(&ttys->tty_lock);
     intr_setipl(old_ipl);
     kmutex_unlock(&ttys->tty_read_mutex);
     
@@ -94,71 +215,195 @@ ssize_t tty_read(chardev_t *cdev, size_t pos, void *buf, size_t count)
 /**
  * Writes to the tty from the buffer.
  *
- * You should first lock the write mutex of the tty. Then you can use 
- * `vterminal_write` to write to the terminal. Don't forget to use IPL to 
- * guard this from preemption!
+ * Holding the write mutex of the tty, the bytes are copied into the tty's
+ * output ring for the tty thread to render, waiting for it to make room only
+ * when the ring is full. Until the tty thread is started, they are rendered
+ * with `vterminal_write` right away.
  *
  * @param  cdev  the character device that represents tty
  * @param  pos   the position to start reading from; should be ignored
  * @param  buf   the buffer to read from
  * @param  count the maximum number of bytes to write to the terminal
- * @return       the number of bytes actually written
+ * @return       the number of bytes actually written, or -EAGAIN if the
+ *               ring is full and the write is non-blocking, or -EINTR
  */
 ssize_t tty_write(chardev_t *cdev, size_t pos, const void *buf, size_t count)
 {
-    tty_t *ttys = cd_to_tty(cdev);
-    kmutex_lock(&ttys->tty_write_mutex); /// correct mutex and tty? cdv has no lock field + how to fix the type error?
-    uint32_t old_ipl = intr_setipl(INTR_KEYBOARD); /// correct call?
-    ssize_t bytes_written = vterminal_write(&ttys->tty_vterminal, buf, count); /// ok with return type and parameters?
-    intr_setipl(old_ipl);
-    kmutex_lock(&ttys->tty_write_mutex);
+    tty_t *tty = cd_to_tty(cdev);
+    const char *src = buf;
+    if (!tty_thread)
+    {
+        tty_render(tty, src, count);
+        return count;
+    }
 
-    NOT_YET_IMPLEMENTED("DRIVERS: tty_write");
-    return bytes_written;
+    kmutex_lock(&tty->tty_write_mutex);
+    size_t written = 0;
+    long ret = 0;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&tty->tty_out_lock);
+    while (written < count)
+    {
+        size_t used = tty->tty_out_head - tty->tty_out_tail;
+        if (used == TTY_OUTPUT_RING)
+        {
+            if (curthr->kt_nonblock)
+            {
+                ret = -EAGAIN;
+                break;
+            }
+            tty_kick();
+            ret = sched_cancellable_sleep_on(&tty->tty_out_waitq,
+                                             &tty->tty_out_lock);
+            spinlock_lock(&tty->tty_out_lock);
+            if (ret)
+            {
+                break;
+            }
+            continue;
+        }
+        size_t off = tty->tty_out_head & (TTY_OUTPUT_RING - 1);
+        size_t n = MIN(count - written,
+                       MIN(TTY_OUTPUT_RING - used, TTY_OUTPUT_RING - off));
+        memcpy(tty->tty_out + off, src + written, n);
+        tty->tty_out_head += n;
+        written += n;
+    }
+    spinlock_unlock(&tty->tty_out_lock);
+    intr_setipl(ipl);
+    if (written)
+    {
+        tty_kick();
+    }
+    kmutex_unlock(&tty->tty_write_mutex);
+    return written ? (ssize_t)written : ret;
 }
 
-static void tty_receive_char_multiplexer(uint8_t c)
+/**
+ * Reports what the tty is ready for: reading once the line discipline has
+ * a cooked line, and writing while the output ring has room. pe goes on the
+ * line discipline's pollhead, which tty_drain() also notifies as it frees
+ * room in the ring; it is added before the ring is looked at, so room freed
+ * after that is not missed.
+ *
+ * @param  cdev the character device that represents tty
+ * @param  pe   poll entry to add to the line discipline's pollhead, or NULL
+ * @return      POLLIN if a read would not block, POLLOUT if a write would not
+ */
+int tty_poll(chardev_t *cdev, poll_entry_t *pe)
 {
-    tty_t *tty = ttys[active_tty];
+    tty_t *tty = cd_to_tty(cdev);
+    uint8_t old_ipl = intr_setipl(INTR_KEYBOARD);
+    spinlock_lock(&tty->tty_lock);
+    int events = ldisc_poll(&tty->tty_ldisc, pe);
+    spinlock_unlock(&tty->tty_lock);
 
-    if (c >= F1 && c <= F12)
+    intr_setipl(IPL_HIGH);
+    spinlock_lock(&tty->tty_out_lock);
+    if (tty->tty_out_head - tty->tty_out_tail < TTY_OUTPUT_RING)
     {
-        if (c - F1 < NTERMS)
-        {
-            /* TODO: this is totally unsafe... Fix it */ 
-            active_tty = (unsigned)c - F1;
-            tty = ttys[active_tty];
-            spinlock_lock(&tty->tty_lock);
-            vterminal_make_active(&tty->tty_vterminal);
-            spinlock_unlock(&tty->tty_lock);
-        }
-        return;
+        events |= POLLOUT;
     }
-    if (c == CR)
-        c = LF;
-    else if (c == DEL)
-        c = BS;
+    spinlock_unlock(&tty->tty_out_lock);
+    intr_setipl(old_ipl);
+    return events;
+}
 
+/**
+ * Gets (TCGETS) or sets (TCSETS) the settings of the tty's line discipline.
+ *
+ * @param  cdev    the character device that represents tty
+ * @param  request TCGETS or TCSETS
+ * @param  arg     the struct termios to fill in or take the settings from
+ * @return         0, or -ENOTTY for other requests
+ */
+long tty_ioctl(chardev_t *cdev, unsigned long request, void *arg)
+{
+    if (request != TCGETS && request != TCSETS)
+    {
+        return -ENOTTY;
+    }
+    tty_t *tty = cd_to_tty(cdev);
+    uint8_t old_ipl = intr_setipl(INTR_KEYBOARD);
     spinlock_lock(&tty->tty_lock);
-    vterminal_t *vt = &tty->tty_vterminal;
-    switch ((unsigned)c)
+    if (request == TCGETS)
+    {
+        ldisc_get_termios(&tty->tty_ldisc, arg);
+    }
+    else
     {
-    case SCROLL_DOWN:
-    case SCROLL_UP:
-        // vterminal_scroll(vt, c == SCROLL_DOWN ? 1 : -1);
-        break;
-    case SCROLL_DOWN_PAGE:
-    case SCROLL_UP_PAGE:
-        // vterminal_scroll(vt, c == SCROLL_DOWN_PAGE ? vt->vt_height :
-        // -vt->vt_height);
-        break;
-    case ESC:
-        // vterminal_scroll_to_bottom(vt);
-        break;
-    default:
-        ldisc_key_pressed(&tty->tty_ldisc, c);
-        // vterminal_key_pressed(vt);
-        break;
+        ldisc_set_termios(&tty->tty_ldisc, arg);
     }
     spinlock_unlock(&tty->tty_lock);
+    intr_setipl(old_ipl);
+    return 0;
+}
+
+/* Passes a run of characters to a tty's line discipline, under one lock */
+static void tty_receive_run(tty_t *tty, const char *s, size_t n)
+{
+    if (!n)
+    {
+        return;
+    }
+    uint8_t old_ipl = intr_setipl(INTR_KEYBOARD);
+    spinlock_lock(&tty->tty_lock);
+    ldisc_keys_pressed(&tty->tty_ldisc, s, n);
+    spinlock_unlock(&tty->tty_lock);
+    intr_setipl(old_ipl);
+}
+
+/* Called by the keyboard with the characters typed since it last called;
+ * those between terminal switches go to the active tty in one run */
+static void tty_receive_char_multiplexer(const uint8_t *chars, size_t n)
+{
+    char run[KEYBOARD_RING_SIZE];
+    size_t len = 0;
+    KASSERT(n <= KEYBOARD_RING_SIZE);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint8_t c = chars[i];
+        if (c >= F1 && c <= F12)
+        {
+            tty_receive_run(ttys[active_tty], run, len);
+            len = 0;
+            if (c - F1 < NTERMS)
+            {
+                /* TODO: this is totally unsafe... Fix it */ 
+                active_tty = (unsigned)c - F1;
+                tty_t *tty = ttys[active_tty];
+                uint8_t old_ipl = intr_setipl(INTR_KEYBOARD);
+                spinlock_lock(&tty->tty_lock);
+                vterminal_make_active(&tty->tty_vterminal);
+                spinlock_unlock(&tty->tty_lock);
+                intr_setipl(old_ipl);
+            }
+            continue;
+        }
+        if (c == CR)
+            c = LF;
+        else if (c == DEL)
+            c = BS;
+
+        switch ((unsigned)c)
+        {
+        case SCROLL_DOWN:
+        case SCROLL_UP:
+            // vterminal_scroll(vt, c == SCROLL_DOWN ? 1 : -1);
+            break;
+        case SCROLL_DOWN_PAGE:
+        case SCROLL_UP_PAGE:
+            // vterminal_scroll(vt, c == SCROLL_DOWN_PAGE ? vt->vt_height :
+            // -vt->vt_height);
+            break;
+        case ESC:
+            // vterminal_scroll_to_bottom(vt);
+            break;
+        default:
+            run[len++] = (char)c;
+            break;
+        }
+    }
+    tty_receive_run(ttys[active_tty], run, len);
 }
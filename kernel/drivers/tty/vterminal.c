@@ -1,11 +1,15 @@
+#include <config.h>
 #include <drivers/keyboard.h>
 #include <drivers/tty/ldisc.h>
 #include <drivers/tty/tty.h>
 #include <drivers/tty/vterminal.h>
 #include <errno.h>
 #include <mm/kmalloc.h>
+#include <proc/sched.h>
 #include <util/debug.h>
 #include <util/string.h>
+#include <util/time.h>
+#include <util/timer.h>
 
 /*
 
@@ -68,6 +72,8 @@ void vterminal_init(vterminal_t *vt)
     vt->vt_line_widths = vt->vt_line_positions + vt->vt_height;
 
     list_init(&vt->vt_history_chunks);
+    list_init(&vt->vt_free_chunks);
+    vt->vt_nchunks = 0;
     long success = vterminal_add_chunk(vt);
     KASSERT(success && !list_empty(&vt->vt_history_chunks));
 
@@ -413,7 +419,7 @@ void vterminal_clear(vterminal_t *vt)
                                vterminal_history_chunk_t, link))
         {
             list_remove(&chunk->link);
-            page_free_n(chunk, VT_PAGES_PER_HISTORY_CHUNK);
+            list_insert_head(&vt->vt_free_chunks, &chunk->link);
         }
         else
         {
@@ -432,10 +438,27 @@ void vterminal_clear(vterminal_t *vt)
     VT_LINE_POSITION(vt, 0) = 0;
 }
 
+/*
+ * Adds a chunk to the end of the history. Chunks cut off the history are
+ * reused first; new ones are only allocated while the vterminal has fewer
+ * than VT_HISTORY_CHUNKS, after which the oldest chunk of the history is
+ * taken, and its text scrolls out of reach. Output thus never allocates or
+ * frees memory once the scrollback is full.
+ */
 static long vterminal_add_chunk(vterminal_t *vt)
 {
-    vterminal_history_chunk_t *chunk = page_alloc_n(VT_PAGES_PER_HISTORY_CHUNK);
-    if (!chunk)
+    vterminal_history_chunk_t *chunk = NULL;
+    if (!list_empty(&vt->vt_free_chunks))
+    {
+        chunk = list_head(&vt->vt_free_chunks, vterminal_history_chunk_t, link);
+        list_remove(&chunk->link);
+    }
+    else if (vt->vt_nchunks < VT_HISTORY_CHUNKS &&
+             (chunk = page_alloc_n(VT_PAGES_PER_HISTORY_CHUNK)))
+    {
+        vt->vt_nchunks++;
+    }
+    else
     {
         chunk =
             list_head(&vt->vt_history_chunks, vterminal_history_chunk_t, link);
@@ -590,7 +613,7 @@ static void vterminal_free_from_position_to_end(vterminal_t *vt, size_t pos)
         vterminal_history_chunk_t *to_remove =
             list_tail(&vt->vt_history_chunks, vterminal_history_chunk_t, link);
         list_remove(&to_remove->link);
-        page_free_n(to_remove, VT_PAGES_PER_HISTORY_CHUNK);
+        list_insert_head(&vt->vt_free_chunks, &to_remove->link);
     }
     vt->vt_len = pos;
     for (size_t line = 0; line < vt->vt_height; line++)
@@ -607,7 +630,7 @@ void vterminal_key_pressed(vterminal_t *vt)
 {
     KASSERT(active_vt == vt);
     vterminal_scroll_to_bottom(vt);
-    char buf[LDISC_BUFFER_SIZE];
+    char buf[LDISC_LINE_MAX];
     size_t len =
         ldisc_get_current_line_raw(&vterminal_to_tty(vt)->tty_ldisc, buf);
     size_t initial_input_pos = vt->vt_input_pos;
@@ -644,7 +667,8 @@ void vterminal_key_pressed(vterminal_t *vt)
 // vtconsole contructor/init function
 vtconsole_t *vtconsole(vtconsole_t *vtc, int width, int height,
                        vtc_paint_handler_t on_paint,
-                       vtc_cursor_handler_t on_move)
+                       vtc_cursor_handler_t on_move,
+                       vtc_scroll_handler_t on_scroll)
 {
     vtc->width = width;
     vtc->height = height;
@@ -654,13 +678,14 @@ vtconsole_t *vtconsole(vtconsole_t *vtc, int width, int height,
 
     vtc->buffer = kmalloc(width * height * sizeof(vtcell_t));
 
-    vtc->tabs = kmalloc(LDISC_BUFFER_SIZE * sizeof(int));
+    vtc->tabs = kmalloc(LDISC_LINE_MAX * sizeof(int));
     vtc->tab_index = 0;
 
     vtc->cursor = (vtcursor_t){0, 0};
 
     vtc->on_paint = on_paint;
     vtc->on_move = on_move;
+    vtc->on_scroll = on_scroll;
 
     vtconsole_clear(vtc, 0, 0, width, height - 1);
 
@@ -703,26 +728,25 @@ void vtconsole_scroll(vtconsole_t *vtc, int lines)
     lines = lines > vtc->height ? vtc->height : lines;
 
     // Scroll the screen by number of $lines.
-    for (int i = 0; i < ((vtc->width * vtc->height) - (vtc->width * lines));
-         i++)
-    {
-        vtc->buffer[i] = vtc->buffer[i + (vtc->width * lines)];
-
-        if (vtc->on_paint)
-        {
-            vtc->on_paint(vtc, &vtc->buffer[i], i % vtc->width, i / vtc->width);
-        }
-    }
+    int kept = (vtc->width * vtc->height) - (vtc->width * lines);
+    memmove(vtc->buffer, vtc->buffer + (vtc->width * lines),
+            kept * sizeof(vtcell_t));
 
     // Clear the last $lines.
-    for (int i = ((vtc->width * vtc->height) - (vtc->width * lines));
-         i < vtc->width * vtc->height; i++)
+    for (int i = kept; i < vtc->width * vtc->height; i++)
     {
         vtcell_t *cell = &vtc->buffer[i];
         cell->attr = VTC_DEFAULT_ATTR;
         cell->c = ' ';
+    }
 
-        if (vtc->on_paint)
+    if (vtc->on_scroll)
+    {
+        vtc->on_scroll(vtc, lines);
+    }
+    else if (vtc->on_paint)
+    {
+        for (int i = 0; i < vtc->width * vtc->height; i++)
         {
             vtc->on_paint(vtc, &vtc->buffer[i], i % vtc->width, i / vtc->width);
         }
@@ -780,7 +804,7 @@ void vtconsole_append(vtconsole_t *vtc, char c)
     {
         int n = 8 - (vtc->cursor.x % 8);
         // storing all the tabs and their size encountered.
-        vtc->tabs[vtc->tab_index % LDISC_BUFFER_SIZE] = n;
+        vtc->tabs[vtc->tab_index % LDISC_LINE_MAX] = n;
         vtc->tab_index++;
 
         for (int i = 0; i < n; i++)
@@ -1239,7 +1263,7 @@ void vtconsole_write(vtconsole_t *vtc, const char *buffer, uint32_t size)
         {
             // calling vtcomsole_process 'n' number of times.
             // where 'n' is the size of the tab.
-            for (int j = 0; j < vtc->tabs[(vtc->tab_index - 1) % LDISC_BUFFER_SIZE]; j++)
+            for (int j = 0; j < vtc->tabs[(vtc->tab_index - 1) % LDISC_LINE_MAX]; j++)
             {
                 vtconsole_process(vtc, buffer[i]);
             }
@@ -1304,26 +1328,99 @@ static char brightcolors[] = {
 
 static vterminal_t *active_vt = NULL;
 
-// used for initializing the vtconsoles.
-void paint_callback(vtconsole_t *vtc, vtcell_t *cell, int x, int y)
+/*
+ * Updates of the screen are batched. Painting a cell of the active vterminal
+ * only records the damage, as a span of columns of the cell's row, and
+ * scrolling it only records how far the screen has to move. Once a tick,
+ * vterminal_flush() scrolls the screen once, repaints the damaged spans from
+ * the cells, moves the cursor and has the result copied to video memory with
+ * vga_flush(), however many writes there were in between.
+ *
+ * The flush runs from a timer, and timers do not fire while preemption is
+ * disabled, so the vterminal entry points below disable it for as long as
+ * they change the cells.
+ */
+static int vga_damage_from[VGA_SCREEN_HEIGHT];
+static int vga_damage_to[VGA_SCREEN_HEIGHT]; /* == from if the row is clean */
+static int vga_scrolled; /* rows the screen is to be moved up by */
+static long vga_cursor_moved;
+static long vga_flush_armed;
+static timer_t vga_flush_timer;
+
+static void vga_flush_fire(uint64_t data);
+
+static void vga_flush_arm()
 {
-    if (vtc != active_vt)
+    if (!vga_flush_armed)
     {
-        return;
+        vga_flush_armed = 1;
+        timer_init(&vga_flush_timer);
+        vga_flush_timer.function = vga_flush_fire;
+        vga_flush_timer.expires = jiffies + 1;
+        timer_add(&vga_flush_timer);
     }
+}
 
-    if (cell->attr.bright)
+static void vga_damage(int from, int to, int y)
+{
+    if (vga_damage_from[y] == vga_damage_to[y])
     {
-        vga_cell(x, y,
-                 VGA_ENTRY(cell->c, brightcolors[cell->attr.fg],
-                           colors[cell->attr.bg]));
+        vga_damage_from[y] = from;
+        vga_damage_to[y] = to;
     }
     else
     {
-        vga_cell(
-            x, y,
-            VGA_ENTRY(cell->c, colors[cell->attr.fg], colors[cell->attr.bg]));
+        vga_damage_from[y] = MIN(vga_damage_from[y], from);
+        vga_damage_to[y] = MAX(vga_damage_to[y], to);
+    }
+    vga_flush_arm();
+}
+
+static void vterminal_flush()
+{
+    vterminal_t *vt = active_vt;
+    if (!vt)
+    {
+        return;
+    }
+    if (vga_scrolled)
+    {
+        vga_scroll(vga_scrolled);
+        vga_scrolled = 0;
     }
+    for (int y = 0; y < vt->height; y++)
+    {
+        for (int x = vga_damage_from[y]; x < vga_damage_to[y]; x++)
+        {
+            vtcell_t *cell = &vt->buffer[x + y * vt->width];
+            char fg = cell->attr.bright ? brightcolors[cell->attr.fg]
+                                        : colors[cell->attr.fg];
+            vga_cell(x, y, VGA_ENTRY(cell->c, fg, colors[cell->attr.bg]));
+        }
+        vga_damage_from[y] = vga_damage_to[y] = 0;
+    }
+    if (vga_cursor_moved)
+    {
+        vga_cursor_moved = 0;
+        vga_set_cursor(vt->cursor.y, vt->cursor.x);
+    }
+    vga_flush();
+}
+
+static void vga_flush_fire(uint64_t data)
+{
+    vga_flush_armed = 0;
+    vterminal_flush();
+}
+
+// used for initializing the vtconsoles.
+void paint_callback(vtconsole_t *vtc, vtcell_t *cell, int x, int y)
+{
+    if (vtc != active_vt)
+    {
+        return;
+    }
+    vga_damage(x, x + 1, y);
 }
 
 // used for initializing the vtconsoles.
@@ -1333,31 +1430,72 @@ void cursor_move_callback(vtconsole_t *vtc, vtcursor_t *cur)
     {
         return;
     }
-    vga_set_cursor(cur->y, cur->x);
+    vga_cursor_moved = 1;
+    vga_flush_arm();
+}
+
+// used for initializing the vtconsoles: the damage moves up with the rows
+void scroll_callback(vtconsole_t *vtc, int lines)
+{
+    if (vtc != active_vt)
+    {
+        return;
+    }
+    vga_scrolled = MIN(vga_scrolled + lines, vtc->height);
+    for (int y = 0; y < vtc->height; y++)
+    {
+        if (y + lines < vtc->height)
+        {
+            vga_damage_from[y] = vga_damage_from[y + lines];
+            vga_damage_to[y] = vga_damage_to[y + lines];
+        }
+        else
+        {
+            vga_damage_from[y] = vga_damage_to[y] = 0;
+            vga_damage(0, vtc->width, y);
+        }
+    }
 }
 
 // initialization function for vterminal which calls the vtconsole constructor
 void vterminal_init(vtconsole_t *vt)
 {
     vtconsole(vt, VGA_SCREEN_WIDTH, VGA_SCREEN_HEIGHT, paint_callback,
-              cursor_move_callback);
+              cursor_move_callback, scroll_callback);
 }
 
-// Used in tty.c to make a vterminal active and working.
+// Used in tty.c to make a vterminal active and working. The new vterminal is
+// drawn straight away, rather than at the next tick.
 void vterminal_make_active(vterminal_t *vt)
 {
+    preemption_disable();
     active_vt = vt;
+    vga_scrolled = 0;
+    vga_cursor_moved = 1;
     vtconsole_redraw(vt);
-    vga_set_cursor(vt->cursor.y, vt->cursor.x);
+    vterminal_flush();
+    preemption_enable();
+}
+
+// Stops drawing the vterminals, so that the screen can show the shutdown
+// message.
+void vterminal_shutdown()
+{
+    preemption_disable();
+    active_vt = NULL;
+    preemption_enable();
+    timer_del_sync(&vga_flush_timer);
 }
 
 // called by ldisc_key_pressed from ldisc.c
 void vterminal_key_pressed(vterminal_t *vt)
 {
-    char buf[LDISC_BUFFER_SIZE];
+    char buf[LDISC_LINE_MAX];
     size_t len =
         ldisc_get_current_line_raw(&vterminal_to_tty(vt)->tty_ldisc, buf);
+    preemption_disable();
     vtconsole_putchar(vt, buf[len - 1]);
+    preemption_enable();
 }
 
 void vterminal_scroll_to_bottom(vterminal_t *vt) { KASSERT(0); }
@@ -1365,13 +1503,17 @@ void vterminal_scroll_to_bottom(vterminal_t *vt) { KASSERT(0); }
 // ldisc_key_pressed calls this vterminal_write if VGA_BUF is not specified.
 size_t vterminal_write(vterminal_t *vt, const char *buf, size_t len)
 {
+    preemption_disable();
     vtconsole_write(vt, buf, len);
+    preemption_enable();
     return len;
 }
 
 // could be used in ldisc_key_pressed
 size_t vterminal_echo_input(vterminal_t *vt, const char *buf, size_t len)
 {
+    preemption_disable();
     vtconsole_write(vt, buf, len);
+    preemption_enable();
     return len;
 }
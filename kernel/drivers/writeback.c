@@ -0,0 +1,166 @@
+#include "config.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/writeback.h"
+
+#include "fs/vfs.h"
+
+#include "main/interrupt.h"
+
+#include "mm/mobj.h"
+#include "mm/page.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/time.h"
+#include "util/timer.h"
+
+static kthread_t *writeback_thread;
+
+static ktqueue_t writeback_waitq;      /* the writeback thread, between runs */
+static ktqueue_t writeback_stop_waitq; /* writeback_stop(), for the thread */
+static timer_t writeback_timer;
+
+/* Protects the flags below */
+static spinlock_t writeback_lock = SPINLOCK_INITIALIZER(writeback_lock);
+static long writeback_urgent;   /* write back everything on the next run */
+static long writeback_stopping; /* write back everything and exit */
+static long writeback_running;
+
+/* Statistics */
+static size_t writeback_nruns;
+static size_t writeback_nurgent;
+static size_t writeback_npages;
+
+static long writeback_over_limit(size_t ndirty)
+{
+    size_t nfree = page_free_count();
+    return ndirty * 100 > WRITEBACK_DIRTY_RATIO * (ndirty + nfree) ||
+           nfree < WRITEBACK_LOW_FREE_PAGES;
+}
+
+void writeback_kick()
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&writeback_lock);
+    writeback_urgent = 1;
+    spinlock_unlock(&writeback_lock);
+    sched_wakeup_on(&writeback_waitq, NULL);
+    intr_setipl(ipl);
+}
+
+void writeback_dirtied(size_t ndirty)
+{
+    if (writeback_thread && !writeback_urgent && writeback_over_limit(ndirty))
+    {
+        writeback_kick();
+    }
+}
+
+static void writeback_timer_fire(uint64_t data)
+{
+    sched_wakeup_on(&writeback_waitq, NULL);
+}
+
+static void *writeback_run(long arg1, void *arg2)
+{
+    while (1)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&writeback_lock);
+        if (!writeback_urgent && !writeback_stopping)
+        {
+            timer_init(&writeback_timer);
+            writeback_timer.function = writeback_timer_fire;
+            writeback_timer.expires =
+                jiffies + time_ms_to_jiffies(WRITEBACK_INTERVAL_MS);
+            timer_add(&writeback_timer);
+            sched_sleep_on(&writeback_waitq, &writeback_lock);
+            timer_del(&writeback_timer);
+            spinlock_lock(&writeback_lock);
+        }
+        long stopping = writeback_stopping;
+        long urgent = writeback_urgent || stopping ||
+                      writeback_over_limit(mobj_dirty_count());
+        writeback_urgent = 0;
+        spinlock_unlock(&writeback_lock);
+        intr_setipl(ipl);
+
+        uint64_t expire = time_ms_to_jiffies(WRITEBACK_EXPIRE_MS);
+        uint64_t dirtied_before = urgent ? (uint64_t)-1
+                                         : jiffies > expire ? jiffies - expire
+                                                            : 0;
+#ifdef __VFS__
+        vfs_writeback(dirtied_before);
+#endif
+        size_t n = blockdev_writeback_all(dirtied_before);
+        writeback_nruns++;
+        writeback_nurgent += urgent;
+        writeback_npages += n;
+        if (n)
+        {
+            dbg(DBG_DISK, "writeback: wrote %lu pages%s, %lu still dirty\n",
+                n, urgent ? " (urgent)" : "", mobj_dirty_count());
+        }
+
+        if (stopping)
+        {
+            break;
+        }
+    }
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&writeback_lock);
+    writeback_running = 0;
+    spinlock_unlock(&writeback_lock);
+    sched_broadcast_on(&writeback_stop_waitq);
+    intr_setipl(ipl);
+    return NULL;
+}
+
+void writeback_start()
+{
+    sched_queue_init(&writeback_waitq);
+    sched_queue_init(&writeback_stop_waitq);
+
+    proc_t *proc = proc_create("writeback");
+    KASSERT(proc);
+    kthread_t *thr = kthread_create(proc, writeback_run, 0, NULL);
+    KASSERT(thr);
+    if (WRITEBACK_CORE >= 0)
+    {
+        /* off the cores left to latency-sensitive work */
+        long ret = sched_set_affinity(thr, 1UL << WRITEBACK_CORE);
+        KASSERT(!ret);
+    }
+    writeback_running = 1;
+    writeback_thread = thr;
+    sched_make_runnable(thr);
+}
+
+void writeback_stop()
+{
+    if (!writeback_thread)
+    {
+        return;
+    }
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&writeback_lock);
+    writeback_stopping = 1;
+    sched_wakeup_on(&writeback_waitq, NULL);
+    while (writeback_running)
+    {
+        sched_sleep_on(&writeback_stop_waitq, &writeback_lock);
+        spinlock_lock(&writeback_lock);
+    }
+    spinlock_unlock(&writeback_lock);
+    intr_setipl(ipl);
+    writeback_thread = NULL;
+}
@@ -0,0 +1,352 @@
+#include "config.h"
+#include "kernel.h"
+
+#include "fs/dcache.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "mm/slab.h"
+
+#include "proc/rcu.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/percpu.h"
+#include "util/seqcount.h"
+#include "util/string.h"
+
+typedef struct dentry
+{
+    fs_t *d_fs;
+    ino_t d_parent;           /* inode number of the containing directory */
+    ino_t d_ino;              /* inode number of the entry, if positive */
+    long d_negative;          /* set if the name is known not to exist */
+    long d_referenced;        /* hit without the lock since last evicted */
+    size_t d_namelen;
+    char d_name[NAME_LEN];
+    list_link_t d_hash_link;  /* link on dcache_hash bucket */
+    list_link_t d_lru_link;   /* link on dcache_lru, most recent at head */
+    rcu_head_t d_rcu;         /* frees the entry once unhashed */
+} dentry_t;
+
+static slab_allocator_t *dentry_allocator;
+
+static list_t dcache_hash[DCACHE_HASH_NBUCKETS];
+static list_t dcache_lru = LIST_INITIALIZER(dcache_lru);
+static size_t dcache_nentries;
+
+/* Protects all of the above. The hash chains may also be walked without
+ * it, by dcache_lookup_rcu() */
+static spinlock_t dcache_lock = SPINLOCK_INITIALIZER(dcache_lock);
+
+/* Bumped around anything that forgets or changes an entry, so that a walk
+ * without the lock can tell whether what it found still holds */
+static seqcount_t dcache_seq = SEQCOUNT_INITIALIZER;
+
+/* Statistics, for tuning DCACHE_MAX_ENTRIES */
+static size_t dcache_hits;
+static size_t dcache_negative_hits;
+static size_t dcache_misses;
+static size_t dcache_evictions;
+static pcpu_counter_t dcache_rcu_hits;
+
+static size_t dcache_shrink(size_t nr);
+
+static slab_shrinker_t dcache_shrinker = {.ss_name = "dcache",
+                                          .ss_shrink = dcache_shrink};
+
+void dcache_init()
+{
+    dentry_allocator = slab_allocator_create("dentry", sizeof(dentry_t));
+    KASSERT(dentry_allocator);
+    for (size_t i = 0; i < DCACHE_HASH_NBUCKETS; i++)
+    {
+        list_init(&dcache_hash[i]);
+    }
+    slab_shrinker_register(&dcache_shrinker);
+    pcpu_counter_init(&dcache_rcu_hits);
+}
+
+/*
+ * FNV-1a over the name, seeded with the filesystem and parent directory.
+ */
+static list_t *dcache_bucket(fs_t *fs, ino_t parent, const char *name,
+                             size_t namelen)
+{
+    uint64_t hash = 14695981039346656037UL ^ (uintptr_t)fs ^ parent;
+    for (size_t i = 0; i < namelen; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 1099511628211UL;
+    }
+    return &dcache_hash[hash & (DCACHE_HASH_NBUCKETS - 1)];
+}
+
+/*
+ * "." and ".." are resolved by the filesystem directly, and names that don't
+ * fit in a dentry can't exist, so none of them are cached; nor are any names
+ * in a filesystem that asks not to be.
+ */
+static long dcache_cacheable(vnode_t *dir, const char *name, size_t namelen)
+{
+    if (dir->vn_fs->fs_nodcache || namelen == 0 || namelen >= NAME_LEN)
+    {
+        return 0;
+    }
+    if (name[0] == '.' && (namelen == 1 || (namelen == 2 && name[1] == '.')))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Find the entry for name in dir. dcache_lock must be held.
+ */
+static dentry_t *dcache_find(list_t *bucket, vnode_t *dir, const char *name,
+                             size_t namelen)
+{
+    list_iterate(bucket, d, dentry_t, d_hash_link)
+    {
+        if (d->d_fs == dir->vn_fs && d->d_parent == dir->vn_vno &&
+            d->d_namelen == namelen && !strncmp(d->d_name, name, namelen))
+        {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+static void dcache_free_rcu(rcu_head_t *head)
+{
+    slab_obj_free(dentry_allocator, CONTAINER_OF(head, dentry_t, d_rcu));
+}
+
+/*
+ * Unlink and free an entry. dcache_lock must be held.
+ */
+static void dcache_remove(dentry_t *d)
+{
+    seqcount_write_begin(&dcache_seq);
+    list_remove_rcu(&d->d_hash_link);
+    seqcount_write_end(&dcache_seq);
+    list_remove(&d->d_lru_link);
+    dcache_nentries--;
+    rcu_call(&d->d_rcu, dcache_free_rcu);
+}
+
+/*
+ * Evict the least recently used entry. Lookups without the lock cannot move
+ * what they hit to the front of the LRU, so they mark it referenced instead,
+ * and it gets a second chance here. dcache_lock must be held.
+ */
+static void dcache_evict()
+{
+    dentry_t *d = list_tail(&dcache_lru, dentry_t, d_lru_link);
+    for (size_t i = 0; i < dcache_nentries && d->d_referenced; i++)
+    {
+        d->d_referenced = 0;
+        list_remove(&d->d_lru_link);
+        list_insert_head(&dcache_lru, &d->d_lru_link);
+        d = list_tail(&dcache_lru, dentry_t, d_lru_link);
+    }
+    dcache_remove(d);
+    dcache_evictions++;
+}
+
+/*
+ * Drop up to nr of the least recently used entries when memory is short.
+ */
+static size_t dcache_shrink(size_t nr)
+{
+    size_t freed = 0;
+    spinlock_lock(&dcache_lock);
+    while (freed < nr && !list_empty(&dcache_lru))
+    {
+        dcache_evict();
+        freed++;
+    }
+    spinlock_unlock(&dcache_lock);
+    return freed;
+}
+
+dcache_result_t dcache_lookup(vnode_t *dir, const char *name, size_t namelen,
+                              ino_t *ino)
+{
+    if (!dcache_cacheable(dir, name, namelen))
+    {
+        return DCACHE_MISS;
+    }
+
+    dcache_result_t ret = DCACHE_MISS;
+    spinlock_lock(&dcache_lock);
+    dentry_t *d = dcache_find(dcache_bucket(dir->vn_fs, dir->vn_vno, name,
+                                            namelen),
+                              dir, name, namelen);
+    if (d)
+    {
+        /* move to the front of the LRU */
+        list_remove(&d->d_lru_link);
+        list_insert_head(&dcache_lru, &d->d_lru_link);
+        d->d_referenced = 0;
+        if (d->d_negative)
+        {
+            dcache_negative_hits++;
+            ret = DCACHE_NEGATIVE;
+        }
+        else
+        {
+            dcache_hits++;
+            *ino = d->d_ino;
+            ret = DCACHE_POSITIVE;
+        }
+    }
+    else
+    {
+        dcache_misses++;
+    }
+    spinlock_unlock(&dcache_lock);
+    return ret;
+}
+
+dcache_result_t dcache_lookup_rcu(vnode_t *dir, const char *name,
+                                  size_t namelen, ino_t *ino)
+{
+    if (!dcache_cacheable(dir, name, namelen))
+    {
+        return DCACHE_MISS;
+    }
+
+    list_t *bucket = dcache_bucket(dir->vn_fs, dir->vn_vno, name, namelen);
+    list_iterate_rcu(bucket, d, dentry_t, d_hash_link)
+    {
+        if (d->d_fs == dir->vn_fs && d->d_parent == dir->vn_vno &&
+            d->d_namelen == namelen && !strncmp(d->d_name, name, namelen))
+        {
+            if (!d->d_referenced)
+            {
+                d->d_referenced = 1;
+            }
+            pcpu_counter_inc(&dcache_rcu_hits);
+            if (d->d_negative)
+            {
+                return DCACHE_NEGATIVE;
+            }
+            *ino = d->d_ino;
+            return DCACHE_POSITIVE;
+        }
+    }
+    return DCACHE_MISS;
+}
+
+uint64_t dcache_read_begin() { return seqcount_read_begin(&dcache_seq); }
+
+long dcache_read_retry(uint64_t seq)
+{
+    return seqcount_read_retry(&dcache_seq, seq);
+}
+
+static void dcache_insert(vnode_t *dir, const char *name, size_t namelen,
+                          ino_t ino, long negative)
+{
+    if (!dcache_cacheable(dir, name, namelen))
+    {
+        return;
+    }
+
+    spinlock_lock(&dcache_lock);
+    list_t *bucket = dcache_bucket(dir->vn_fs, dir->vn_vno, name, namelen);
+    dentry_t *d = dcache_find(bucket, dir, name, namelen);
+    if (!d)
+    {
+        if (dcache_nentries >= DCACHE_MAX_ENTRIES)
+        {
+            dcache_evict();
+        }
+        d = slab_obj_alloc(dentry_allocator);
+        if (!d)
+        {
+            /* the cache is only an optimization */
+            spinlock_unlock(&dcache_lock);
+            return;
+        }
+        d->d_fs = dir->vn_fs;
+        d->d_parent = dir->vn_vno;
+        d->d_ino = ino;
+        d->d_negative = negative;
+        d->d_referenced = 0;
+        d->d_namelen = namelen;
+        memcpy(d->d_name, name, namelen);
+        d->d_name[namelen] = '\0';
+        list_insert_head_rcu(bucket, &d->d_hash_link);
+        dcache_nentries++;
+    }
+    else
+    {
+        list_remove(&d->d_lru_link);
+        if (d->d_ino != ino || d->d_negative != negative)
+        {
+            seqcount_write_begin(&dcache_seq);
+            d->d_ino = ino;
+            d->d_negative = negative;
+            seqcount_write_end(&dcache_seq);
+        }
+    }
+    list_insert_head(&dcache_lru, &d->d_lru_link);
+    spinlock_unlock(&dcache_lock);
+}
+
+void dcache_enter(vnode_t *dir, const char *name, size_t namelen, ino_t ino)
+{
+    dcache_insert(dir, name, namelen, ino, 0);
+}
+
+void dcache_enter_negative(vnode_t *dir, const char *name, size_t namelen)
+{
+    dcache_insert(dir, name, namelen, 0, 1);
+}
+
+void dcache_invalidate(vnode_t *dir, const char *name, size_t namelen)
+{
+    if (!dcache_cacheable(dir, name, namelen))
+    {
+        return;
+    }
+
+    spinlock_lock(&dcache_lock);
+    dentry_t *d = dcache_find(dcache_bucket(dir->vn_fs, dir->vn_vno, name,
+                                            namelen),
+                              dir, name, namelen);
+    if (d)
+    {
+        dcache_remove(d);
+    }
+    spinlock_unlock(&dcache_lock);
+}
+
+void dcache_purge_dir(vnode_t *dir)
+{
+    spinlock_lock(&dcache_lock);
+    list_iterate(&dcache_lru, d, dentry_t, d_lru_link)
+    {
+        if (d->d_fs == dir->vn_fs && d->d_parent == dir->vn_vno)
+        {
+            dcache_remove(d);
+        }
+    }
+    spinlock_unlock(&dcache_lock);
+}
+
+void dcache_purge_fs(fs_t *fs)
+{
+    spinlock_lock(&dcache_lock);
+    list_iterate(&dcache_lru, d, dentry_t, d_lru_link)
+    {
+        if (d->d_fs == fs)
+        {
+            dcache_remove(d);
+        }
+    }
+    spinlock_unlock(&dcache_lock);
+}
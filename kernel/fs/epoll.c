@@ -0,0 +1,490 @@
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "api/syscall.h"
+
+#include "fs/fcntl.h"
+#include "fs/file.h"
+#include "fs/open.h"
+#include "fs/poll.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "main/interrupt.h"
+
+#include "mm/slab.h"
+
+#include "proc/kmutex.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/time.h"
+
+/*
+ * An epoll instance keeps an epitem for each fd registered with it, and
+ * each epitem keeps a poll entry on the pollhead of the fd's object. The
+ * entry's callback puts the epitem on the instance's ready list, so that
+ * epoll_wait() only looks at fds that became ready since it last ran, and
+ * at level-triggered ones it found ready then.
+ *
+ * Locking: epoll_mutex protects the links between files and epitems, and is
+ * taken before an instance's ep_mutex, which protects its set of epitems and
+ * is held while collecting events. ep_lock, taken at IPL_HIGH as it is from
+ * poll callbacks, protects the ready list and ei_ready.
+ *
+ * Threads in epoll_wait() sleep as exclusive waiters, so that an fd becoming
+ * ready wakes one of them rather than every thread sharing the instance.
+ */
+
+typedef struct epoll
+{
+    list_t ep_items; /* every epitem of the instance */
+    kmutex_t ep_mutex;
+    list_t ep_ready; /* epitems that may be ready */
+    spinlock_t ep_lock;
+    ktqueue_t ep_waitq;      /* threads in epoll_wait() */
+    pollhead_t ep_pollhead; /* for poll() on the instance's fd */
+} epoll_t;
+
+typedef struct epitem
+{
+    epoll_t *ei_ep;
+    file_t *ei_file; /* not referenced: see epoll_file_closed() */
+    int ei_fd;
+    uint32_t ei_events;
+    uint64_t ei_data;
+    poll_entry_t ei_entry;      /* on the pollhead of ei_file's object */
+    long ei_ready;              /* on ep_ready */
+    list_link_t ei_ready_link;
+    list_link_t ei_link;        /* on ep_items */
+    list_link_t ei_file_link;   /* on ei_file->f_epitems */
+} epitem_t;
+
+#define EPOLL_EVENT_MASK (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP)
+
+static void epoll_read_vnode(fs_t *fs, vnode_t *vnode);
+
+static void epoll_delete_vnode(fs_t *fs, vnode_t *vnode);
+
+static fs_ops_t epoll_fsops = {.read_vnode = epoll_read_vnode,
+                               .delete_vnode = epoll_delete_vnode,
+                               .umount = NULL};
+
+static fs_t epoll_fs = {.fs_dev = "epoll",
+                        .fs_type = "epoll",
+                        .fs_ops = &epoll_fsops,
+                        .fs_root = NULL,
+                        .fs_i = NULL};
+
+static ssize_t epoll_read(vnode_t *vnode, size_t pos, void *buf,
+                          size_t count);
+
+static long epoll_stat(vnode_t *vnode, stat_t *ss);
+
+static int epoll_poll(vnode_t *vnode, poll_entry_t *pe);
+
+static vnode_ops_t epoll_vops = {
+    .read = epoll_read,
+    .write = NULL,
+    .mmap = NULL,
+    .mknod = NULL,
+    .lookup = NULL,
+    .link = NULL,
+    .unlink = NULL,
+    .mkdir = NULL,
+    .rmdir = NULL,
+    .readdir = NULL,
+    .stat = epoll_stat,
+    .acquire = NULL,
+    .release = NULL,
+    .get_pframe = NULL,
+    .fill_pframe = NULL,
+    .flush_pframe = NULL,
+    .poll = epoll_poll,
+};
+
+static slab_allocator_t *epoll_allocator;
+static slab_allocator_t *epitem_allocator;
+static int next_eno = 0;
+
+static kmutex_t epoll_mutex;
+
+#define VNODE_TO_EPOLL(vn) ((epoll_t *)((vn)->vn_i))
+
+void epoll_init()
+{
+    epoll_allocator = slab_allocator_create("epoll", sizeof(epoll_t));
+    KASSERT(epoll_allocator);
+    epitem_allocator = slab_allocator_create("epitem", sizeof(epitem_t));
+    KASSERT(epitem_allocator);
+    epoll_fs.fs_vnode_allocator =
+        slab_allocator_create("epoll_vnode", sizeof(vnode_t));
+    KASSERT(epoll_fs.fs_vnode_allocator);
+    vnode_cache_init(&epoll_fs);
+    kmutex_init(&epoll_mutex);
+}
+
+/* Returns the epoll instance behind a file, or NULL if it is not one */
+static epoll_t *file_epoll(file_t *file)
+{
+    return file->f_vnode->vn_fs == &epoll_fs ? VNODE_TO_EPOLL(file->f_vnode)
+                                             : NULL;
+}
+
+/* Puts ei on the ready list and wakes up its waiters, if it is not there */
+static void epitem_make_ready(epitem_t *ei)
+{
+    epoll_t *ep = ei->ei_ep;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&ep->ep_lock);
+    long queued = !ei->ei_ready;
+    if (queued)
+    {
+        ei->ei_ready = 1;
+        list_insert_tail(&ep->ep_ready, &ei->ei_ready_link);
+        sched_broadcast_on(&ep->ep_waitq);
+    }
+    spinlock_unlock(&ep->ep_lock);
+    intr_setipl(ipl);
+    if (queued)
+    {
+        poll_notify(&ep->ep_pollhead, POLLIN);
+    }
+}
+
+static void epitem_notify(poll_entry_t *pe, int events)
+{
+    epitem_t *ei = CONTAINER_OF(pe, epitem_t, ei_entry);
+    if (events & (ei->ei_events | EPOLLERR | EPOLLHUP) & EPOLL_EVENT_MASK)
+    {
+        epitem_make_ready(ei);
+    }
+}
+
+/* Unregisters and frees ei; epoll_mutex and ei's ep_mutex must be held */
+static void epitem_remove(epitem_t *ei)
+{
+    epoll_t *ep = ei->ei_ep;
+    poll_cancel(&ei->ei_entry);
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&ep->ep_lock);
+    if (ei->ei_ready)
+    {
+        list_remove(&ei->ei_ready_link);
+    }
+    spinlock_unlock(&ep->ep_lock);
+    intr_setipl(ipl);
+
+    list_remove(&ei->ei_link);
+    list_remove(&ei->ei_file_link);
+    slab_obj_free(epitem_allocator, ei);
+}
+
+static epitem_t *epoll_find(epoll_t *ep, file_t *file, int fd)
+{
+    list_iterate(&ep->ep_items, ei, epitem_t, ei_link)
+    {
+        if (ei->ei_file == file && ei->ei_fd == fd)
+        {
+            return ei;
+        }
+    }
+    return NULL;
+}
+
+/* epollfs vnode operations */
+static void epoll_read_vnode(fs_t *fs, vnode_t *vnode)
+{
+    vnode->vn_ops = &epoll_vops;
+    vnode->vn_mode = 0;
+    vnode->vn_len = 0;
+    vnode->vn_i = NULL;
+}
+
+/* The instance goes away with the last file referring to it */
+static void epoll_delete_vnode(fs_t *fs, vnode_t *vnode)
+{
+    epoll_t *ep = VNODE_TO_EPOLL(vnode);
+    if (!ep)
+    {
+        return;
+    }
+    kmutex_lock(&epoll_mutex);
+    kmutex_lock(&ep->ep_mutex);
+    list_iterate(&ep->ep_items, ei, epitem_t, ei_link)
+    {
+        epitem_remove(ei);
+    }
+    kmutex_unlock(&ep->ep_mutex);
+    kmutex_unlock(&epoll_mutex);
+    slab_obj_free(epoll_allocator, ep);
+}
+
+/* events are only had through epoll_wait() */
+static ssize_t epoll_read(vnode_t *vnode, size_t pos, void *buf,
+                          size_t count)
+{
+    return -EINVAL;
+}
+
+static long epoll_stat(vnode_t *vnode, stat_t *ss)
+{
+    memset(ss, 0, sizeof(*ss));
+    ss->st_mode = vnode->vn_mode;
+    ss->st_ino = (int)vnode->vn_vno;
+    return 0;
+}
+
+static int epoll_poll(vnode_t *vnode, poll_entry_t *pe)
+{
+    epoll_t *ep = VNODE_TO_EPOLL(vnode);
+    if (pe)
+    {
+        poll_wait(&ep->ep_pollhead, pe);
+    }
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&ep->ep_lock);
+    int events = list_empty(&ep->ep_ready) ? 0 : POLLIN;
+    spinlock_unlock(&ep->ep_lock);
+    intr_setipl(ipl);
+    return events;
+}
+
+long do_epoll_create()
+{
+    vnode_t *vnode = vget(&epoll_fs, __sync_fetch_and_add(&next_eno, 1));
+    if (!vnode)
+    {
+        return -ENOMEM;
+    }
+    epoll_t *ep = slab_obj_alloc(epoll_allocator);
+    if (!ep)
+    {
+        vput(&vnode);
+        return -ENOMEM;
+    }
+    list_init(&ep->ep_items);
+    kmutex_init(&ep->ep_mutex);
+    list_init(&ep->ep_ready);
+    spinlock_init(&ep->ep_lock);
+    sched_queue_init(&ep->ep_waitq);
+    pollhead_init(&ep->ep_pollhead);
+    vnode->vn_i = ep;
+
+    int fd;
+    long locked = proc_files_lock();
+    long ret = get_empty_fd(&fd);
+    if (!ret && !fcreate(fd, vnode, FMODE_READ))
+    {
+        ret = -ENOMEM;
+    }
+    proc_files_unlock(locked);
+    vput(&vnode);
+    return ret ? ret : fd;
+}
+
+long do_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    if (op != EPOLL_CTL_ADD && op != EPOLL_CTL_DEL && op != EPOLL_CTL_MOD)
+    {
+        return -EINVAL;
+    }
+    file_t *epfile = fget(epfd);
+    if (!epfile)
+    {
+        return -EBADF;
+    }
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        fput(&epfile);
+        return -EBADF;
+    }
+    epoll_t *ep = file_epoll(epfile);
+    if (!ep || file_epoll(file))
+    {
+        fput(&file);
+        fput(&epfile);
+        return -EINVAL;
+    }
+
+    long ret = 0;
+    kmutex_lock(&epoll_mutex);
+    kmutex_lock(&ep->ep_mutex);
+    epitem_t *ei = epoll_find(ep, file, fd);
+    if (op == EPOLL_CTL_ADD && ei)
+    {
+        ret = -EEXIST;
+    }
+    else if (op != EPOLL_CTL_ADD && !ei)
+    {
+        ret = -ENOENT;
+    }
+    else if (op == EPOLL_CTL_DEL)
+    {
+        epitem_remove(ei);
+    }
+    else if (op == EPOLL_CTL_MOD)
+    {
+        ei->ei_events = event->events;
+        ei->ei_data = event->data;
+        if (poll_file(file, NULL) & (ei->ei_events | EPOLLERR | EPOLLHUP) &
+            EPOLL_EVENT_MASK)
+        {
+            epitem_make_ready(ei);
+        }
+    }
+    else if (!(ei = slab_obj_alloc(epitem_allocator)))
+    {
+        ret = -ENOMEM;
+    }
+    else
+    {
+        ei->ei_ep = ep;
+        ei->ei_file = file;
+        ei->ei_fd = fd;
+        ei->ei_events = event->events;
+        ei->ei_data = event->data;
+        ei->ei_entry.pe_head = NULL;
+        ei->ei_entry.pe_notify = epitem_notify;
+        ei->ei_ready = 0;
+        list_insert_tail(&ep->ep_items, &ei->ei_link);
+        list_insert_tail(&file->f_epitems, &ei->ei_file_link);
+        int events = poll_file(file, &ei->ei_entry);
+        if (events & (ei->ei_events | EPOLLERR | EPOLLHUP) & EPOLL_EVENT_MASK)
+        {
+            epitem_make_ready(ei);
+        }
+    }
+    kmutex_unlock(&ep->ep_mutex);
+    kmutex_unlock(&epoll_mutex);
+
+    fput(&file);
+    fput(&epfile);
+    return ret;
+}
+
+/*
+ * Takes epitems off the ready list, and fills in events for those whose fd
+ * is ready. Level-triggered ones that are go back on the list, after the
+ * ones not looked at yet. ep_mutex must be held.
+ */
+static long epoll_collect(epoll_t *ep, struct epoll_event *events,
+                          int maxevents)
+{
+    list_t again;
+    list_init(&again);
+    long n = 0;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&ep->ep_lock);
+    while (n < maxevents && !list_empty(&ep->ep_ready))
+    {
+        epitem_t *ei = list_head(&ep->ep_ready, epitem_t, ei_ready_link);
+        list_remove(&ei->ei_ready_link);
+        ei->ei_ready = 0;
+        spinlock_unlock(&ep->ep_lock);
+        intr_setipl(ipl);
+
+        /* a notification from now on queues ei again */
+        uint32_t revents = (uint32_t)poll_file(ei->ei_file, NULL) &
+                           (ei->ei_events | EPOLLERR | EPOLLHUP) &
+                           EPOLL_EVENT_MASK;
+        if (revents)
+        {
+            events[n].events = revents;
+            events[n].data = ei->ei_data;
+            n++;
+        }
+
+        ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&ep->ep_lock);
+        if (revents && !(ei->ei_events & EPOLLET) && !ei->ei_ready)
+        {
+            ei->ei_ready = 1;
+            list_insert_tail(&again, &ei->ei_ready_link);
+        }
+    }
+    while (!list_empty(&again))
+    {
+        epitem_t *ei = list_head(&again, epitem_t, ei_ready_link);
+        list_remove(&ei->ei_ready_link);
+        list_insert_tail(&ep->ep_ready, &ei->ei_ready_link);
+    }
+    spinlock_unlock(&ep->ep_lock);
+    intr_setipl(ipl);
+    return n;
+}
+
+long do_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                   int timeout)
+{
+    if (maxevents <= 0)
+    {
+        return -EINVAL;
+    }
+    file_t *file = fget(epfd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    epoll_t *ep = file_epoll(file);
+    if (!ep)
+    {
+        fput(&file);
+        return -EINVAL;
+    }
+
+    uint64_t deadline = poll_deadline(timeout);
+    long ret;
+    while (1)
+    {
+        kmutex_lock(&ep->ep_mutex);
+        ret = epoll_collect(ep, events, maxevents);
+        kmutex_unlock(&ep->ep_mutex);
+        if (ret || !timeout || (deadline && jiffies >= deadline))
+        {
+            break;
+        }
+
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&ep->ep_lock);
+        if (list_empty(&ep->ep_ready))
+        {
+            ret = poll_sleep_exclusive(&ep->ep_waitq, &ep->ep_lock, deadline);
+        }
+        if (ret && !list_empty(&ep->ep_ready))
+        {
+            /* we may have been the one waiter woken for these */
+            sched_wakeup_on(&ep->ep_waitq, NULL);
+        }
+        spinlock_unlock(&ep->ep_lock);
+        intr_setipl(ipl);
+        if (ret)
+        {
+            break;
+        }
+    }
+
+    fput(&file);
+    return ret;
+}
+
+void epoll_file_closed(file_t *file)
+{
+    kmutex_lock(&epoll_mutex);
+    list_iterate(&file->f_epitems, ei, epitem_t, ei_file_link)
+    {
+        epoll_t *ep = ei->ei_ep;
+        kmutex_lock(&ep->ep_mutex);
+        epitem_remove(ei);
+        kmutex_unlock(&ep->ep_mutex);
+    }
+    kmutex_unlock(&epoll_mutex);
+}
@@ -0,0 +1,247 @@
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "fs/fdtable.h"
+#include "fs/file.h"
+
+#include "mm/kmalloc.h"
+#include "mm/slab.h"
+
+#include "proc/proc.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#if FDTABLE_INIT_FILES % 64 || NFILES % FDTABLE_INIT_FILES
+#error "NFILES must be FDTABLE_INIT_FILES times a power of 2, a multiple of 64"
+#endif
+#if NFILES > 64 * 64
+#error "ft_full can only describe 64 * 64 descriptors"
+#endif
+
+static slab_allocator_t *fdtable_allocator;
+
+void fdtable_init()
+{
+    fdtable_allocator = slab_allocator_create("fdtable", sizeof(fdtable_t));
+    KASSERT(fdtable_allocator);
+}
+
+/*
+ * The files and the ft_open bitmap share one allocation, the bitmap after
+ * the files.
+ */
+static long fdtable_alloc_arrays(int size, file_t ***filesp,
+                                 uint64_t **openp)
+{
+    size_t nbytes = size * sizeof(file_t *) + size / 64 * sizeof(uint64_t);
+    file_t **files = kmalloc(nbytes);
+    if (!files)
+    {
+        return -ENOMEM;
+    }
+    memset(files, 0, nbytes);
+    *filesp = files;
+    *openp = (uint64_t *)(files + size);
+    return 0;
+}
+
+static fdtable_t *fdtable_create(int size)
+{
+    fdtable_t *ft = slab_obj_alloc(fdtable_allocator);
+    if (!ft)
+    {
+        return NULL;
+    }
+    if (fdtable_alloc_arrays(size, &ft->ft_files, &ft->ft_open))
+    {
+        slab_obj_free(fdtable_allocator, ft);
+        return NULL;
+    }
+    ft->ft_refcount = 1;
+    ft->ft_size = size;
+    ft->ft_full = 0;
+    return ft;
+}
+
+/* Grows ft, which must not be shared, to size descriptors */
+static long fdtable_grow(fdtable_t *ft, int size)
+{
+    file_t **files;
+    uint64_t *open;
+    long ret = fdtable_alloc_arrays(size, &files, &open);
+    if (ret)
+    {
+        return ret;
+    }
+    memcpy(files, ft->ft_files, ft->ft_size * sizeof(file_t *));
+    memcpy(open, ft->ft_open, ft->ft_size / 64 * sizeof(uint64_t));
+    kfree(ft->ft_files);
+    ft->ft_files = files;
+    ft->ft_open = open;
+    ft->ft_size = size;
+    return 0;
+}
+
+/* Gives proc a copy of its shared table, with a reference on each file */
+static long fdtable_unshare(proc_t *proc)
+{
+    fdtable_t *old = proc->p_files;
+    fdtable_t *ft = fdtable_create(old->ft_size);
+    if (!ft)
+    {
+        return -ENOMEM;
+    }
+    memcpy(ft->ft_files, old->ft_files, old->ft_size * sizeof(file_t *));
+    memcpy(ft->ft_open, old->ft_open, old->ft_size / 64 * sizeof(uint64_t));
+    ft->ft_full = old->ft_full;
+    for (int fd = 0; fd < ft->ft_size; fd++)
+    {
+        if (ft->ft_files[fd])
+        {
+            fref(ft->ft_files[fd]);
+        }
+    }
+    proc->p_files = ft;
+    fdtable_put(&old);
+    return 0;
+}
+
+file_t *fdtable_get(fdtable_t *ft, int fd)
+{
+    if (!ft || fd < 0 || fd >= ft->ft_size)
+    {
+        return NULL;
+    }
+    return ft->ft_files[fd];
+}
+
+fdtable_t *fdtable_ref(fdtable_t *ft)
+{
+    if (ft)
+    {
+        __sync_fetch_and_add(&ft->ft_refcount, 1);
+    }
+    return ft;
+}
+
+void fdtable_put(fdtable_t **ftp)
+{
+    fdtable_t *ft = *ftp;
+    *ftp = NULL;
+    KASSERT(ft && ft->ft_refcount > 0);
+
+    if (__sync_sub_and_fetch(&ft->ft_refcount, 1))
+    {
+        return;
+    }
+    for (int fd = 0; fd < ft->ft_size; fd++)
+    {
+        if (ft->ft_files[fd])
+        {
+            fput(&ft->ft_files[fd]);
+        }
+    }
+    kfree(ft->ft_files);
+    slab_obj_free(fdtable_allocator, ft);
+}
+
+long fdtable_reserve(proc_t *proc, int fd)
+{
+    if (fd < 0 || fd >= NFILES)
+    {
+        return -EBADF;
+    }
+    if (!proc->p_files)
+    {
+        if (!(proc->p_files = fdtable_create(FDTABLE_INIT_FILES)))
+        {
+            return -ENOMEM;
+        }
+    }
+    else if (proc->p_files->ft_refcount > 1)
+    {
+        long ret = fdtable_unshare(proc);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    fdtable_t *ft = proc->p_files;
+    if (fd >= ft->ft_size)
+    {
+        int size = ft->ft_size;
+        while (fd >= size)
+        {
+            size *= 2;
+        }
+        return fdtable_grow(ft, size);
+    }
+    return 0;
+}
+
+long fdtable_alloc_fd(proc_t *proc, int *fd)
+{
+    fdtable_t *ft = proc->p_files;
+    *fd = 0;
+    if (ft)
+    {
+        /* words past the end of the table read as not full */
+        uint64_t notfull = ~ft->ft_full;
+        if (!notfull)
+        {
+            *fd = -1;
+            return -EMFILE;
+        }
+        int word = __builtin_ctzl(notfull);
+        *fd = word * 64;
+        if (word < ft->ft_size / 64)
+        {
+            *fd += __builtin_ctzl(~ft->ft_open[word]);
+        }
+        if (*fd >= NFILES)
+        {
+            *fd = -1;
+            return -EMFILE;
+        }
+    }
+    long ret = fdtable_reserve(proc, *fd);
+    if (ret)
+    {
+        *fd = -1;
+    }
+    return ret;
+}
+
+file_t *fdtable_install(proc_t *proc, int fd, file_t *file)
+{
+    fdtable_t *ft = proc->p_files;
+    KASSERT(ft && ft->ft_refcount == 1);
+    KASSERT(fd >= 0 && fd < ft->ft_size);
+
+    file_t *old = ft->ft_files[fd];
+    ft->ft_files[fd] = file;
+
+    int word = fd / 64;
+    uint64_t bit = 1UL << (fd % 64);
+    if (file)
+    {
+        ft->ft_open[word] |= bit;
+    }
+    else
+    {
+        ft->ft_open[word] &= ~bit;
+    }
+    if (ft->ft_open[word] == ~0UL)
+    {
+        ft->ft_full |= 1UL << word;
+    }
+    else
+    {
+        ft->ft_full &= ~(1UL << word);
+    }
+    return old;
+}
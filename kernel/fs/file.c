@@ -1,4 +1,6 @@
+#include "fs/fdtable.h"
 #include "fs/file.h"
+#include "fs/poll.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "kernel.h"
@@ -34,27 +36,28 @@ void fref(file_t *f)
 /*
  * Create a file, initialize its members, vref the vnode, call acquire() on the
  * vnode if the function pointer is non-NULL, and set the file descriptor in
- * curproc->p_files.
+ * curproc->p_files, which get_empty_fd() must have reserved fd in.
  *
  * On successful return, the vnode's refcount should be incremented by one,
- * the file's refcount should be 1, and curproc->p_files[fd] should point to
+ * the file's refcount should be 1, and fd in curproc->p_files should refer to
  * the file being returned.
  */
 file_t *fcreate(int fd, vnode_t *vnode, unsigned int mode)
 {
-    KASSERT(!curproc->p_files[fd]);
+    KASSERT(!fdtable_get(curproc->p_files, fd));
     file_t *file = slab_obj_alloc(file_allocator);
     if (!file)
         return NULL;
     memset(file, 0, sizeof(file_t));
     file->f_mode = mode;
+    list_init(&file->f_epitems);
 
     vref(file->f_vnode = vnode);
 
     if (vnode->vn_ops->acquire)
         vnode->vn_ops->acquire(vnode, file);
 
-    curproc->p_files[fd] = file;
+    fdtable_install(curproc, fd, file);
     fref(file);
     return file;
 }
@@ -65,11 +68,11 @@ file_t *fcreate(int fd, vnode_t *vnode, unsigned int mode)
  */
 file_t *fget(int fd)
 {
-    if (fd < 0 || fd >= NFILES)
-        return NULL;
-    file_t *file = curproc->p_files[fd];
+    long locked = proc_files_lock();
+    file_t *file = fdtable_get(curproc->p_files, fd);
     if (file)
         fref(file);
+    proc_files_unlock(locked);
     return file;
 }
 
@@ -105,6 +108,11 @@ void fput(file_t **filep)
 
     if (!file->f_refcount)
     {
+        /* nobody else can register the file with an epoll any more */
+        if (!list_empty(&file->f_epitems))
+        {
+            epoll_file_closed(file);
+        }
         if (file->f_vnode)
         {
             vlock(file->f_vnode);
@@ -3,9 +3,13 @@
 #include "kernel.h"
 #include <fs/dirent.h>
 
+#include "proc/rcu.h"
+
 #include "util/debug.h"
 #include "util/string.h"
+#include "util/trace.h"
 
+#include "fs/dcache.h"
 #include "fs/fcntl.h"
 #include "fs/stat.h"
 #include "fs/vfs.h"
@@ -16,9 +20,9 @@
  */
 long namev_get_parent(vnode_t *dir, vnode_t **out)
 {
-    vlock(dir);
+    vlock_shared(dir);
     long ret = namev_lookup(dir, "..", 2, out);
-    vunlock(dir);
+    vunlock_shared(dir);
     return ret;
 }
 
@@ -33,12 +37,12 @@ long namev_is_descendant(vnode_t *a, vnode_t *b)
     vnode_t *next = NULL;
     while (cur != NULL)
     {
-        if (cur->vn_vno == b->vn_vno)
+        if (cur == b)
         {
             vput(&cur);
             return 1;
         }
-        else if (cur->vn_vno == cur->vn_fs->fs_root->vn_vno)
+        else if (cur == cur->vn_fs->fs_root)
         {
             /* we've reached the root node. */
             vput(&cur);
@@ -84,7 +88,59 @@ long namev_lookup(vnode_t *dir, const char *name, size_t namelen,
         return 0;
     }
 
-    long ret = dir->vn_ops->lookup(dir, name, namelen, res_vnode); 
+#ifdef __MOUNTING__
+    /* ".." out of the root of a mounted filesystem is looked up in the
+     * directory it is mounted on */
+    if (namelen == 2 && name[0] == '.' && name[1] == '.' &&
+        dir == dir->vn_fs->fs_root && dir->vn_fs->fs_mtpt != dir)
+    {
+        vnode_t *mtpt = dir->vn_fs->fs_mtpt;
+        vlock_shared(mtpt);
+        long ret = namev_lookup(mtpt, name, namelen, res_vnode);
+        vunlock_shared(mtpt);
+        return ret;
+    }
+#endif
+
+    /* consult the dentry cache before asking the filesystem */
+    ino_t ino;
+    switch (dcache_lookup(dir, name, namelen, &ino))
+    {
+        case DCACHE_POSITIVE:
+            *res_vnode = vget(dir->vn_fs, ino);
+#ifdef __MOUNTING__
+            vfs_cross_mount(res_vnode);
+#endif
+            return 0;
+        case DCACHE_NEGATIVE:
+            return -ENOENT;
+        case DCACHE_MISS:
+            break;
+    }
+
+    long ret = dir->vn_ops->lookup(dir, name, namelen, res_vnode);
+    if (trace_mask & TRACE_BIT(TRACE_LOOKUP))
+    {
+        /* the name's first bytes, for the timeline to show */
+        uint64_t prefix = 0;
+        memcpy(&prefix, name, MIN(namelen, sizeof(prefix)));
+        trace(TRACE_LOOKUP, dir->vn_vno, prefix, ret);
+    }
+    if (ret == 0)
+    {
+        dcache_enter(dir, name, namelen, (*res_vnode)->vn_vno);
+#ifdef __MOUNTING__
+        /* "." is dir itself, which is returned locked, and stays put */
+        if (*res_vnode != dir)
+        {
+            vfs_cross_mount(res_vnode);
+        }
+#endif
+    }
+    else if (ret == -ENOENT)
+    {
+        dcache_enter_negative(dir, name, namelen);
+    }
     //vnode_ops_t f
     //NOT_YET_IMPLEMENTED("VFS: namev_lookup");
     return ret;
@@ -153,6 +209,89 @@ static const char *namev_tokenize(const char **search, size_t *len)
     return begin;
 }
 
+/*
+ * Look up name in dir in the dentry and vnode caches alone, from within
+ * rcu_read_lock() and dcache_read_begin(). Returns the child, without a
+ * reference, or NULL if the caches cannot tell, or the child is a mount
+ * point, and namev_lookup() is needed.
+ */
+static vnode_t *namev_lookup_rcu(vnode_t *dir, const char *name,
+                                 size_t namelen)
+{
+    ino_t ino;
+    if (dir->vn_ops == NULL || !S_ISDIR(dir->vn_mode) ||
+        dcache_lookup_rcu(dir, name, namelen, &ino) != DCACHE_POSITIVE)
+    {
+        return NULL;
+    }
+    vnode_t *vn = vget_cached_rcu(dir->vn_fs, ino);
+#ifdef __MOUNTING__
+    if (vn && vn->vn_mount != vn)
+    {
+        return NULL;
+    }
+#endif
+    return vn;
+}
+
+/*
+ * Walk the directories at the start of path, from dir, as far as the caches
+ * know them, locking none of them and referencing only the last; walking
+ * them the usual way locks and references each in turn, which, for the root
+ * and the like, every core does. Stops before the basename, and at ".."
+ * or anything not cached. dir must be kept alive by the caller.
+ *
+ * If no dentry was forgotten or changed meanwhile, returns the directory
+ * reached, with a reference, and advances *pathp past the components
+ * walked; otherwise, or if nothing was walked, returns NULL.
+ */
+static vnode_t *namev_walk_rcu(vnode_t *dir, const char **pathp)
+{
+    vnode_t *start = dir;
+    const char *path = *pathp;
+
+    uint64_t seq = dcache_read_begin();
+    rcu_read_lock();
+    while (1)
+    {
+        size_t len, next_len;
+        const char *rest = path;
+        const char *name = namev_tokenize(&rest, &len);
+        const char *after = rest;
+        namev_tokenize(&after, &next_len);
+        if (next_len == 0)
+        {
+            break;
+        }
+        if (len == 1 && name[0] == '.' && S_ISDIR(dir->vn_mode))
+        {
+            path = rest;
+            continue;
+        }
+        vnode_t *child = namev_lookup_rcu(dir, name, len);
+        if (!child)
+        {
+            break;
+        }
+        dir = child;
+        path = rest;
+    }
+    long walked = dir != start && vref_not_zero(dir);
+    rcu_read_unlock();
+
+    if (!walked)
+    {
+        return NULL;
+    }
+    if (dcache_read_retry(seq))
+    {
+        vput(&dir);
+        return NULL;
+    }
+    *pathp = path;
+    return dir;
+}
+
 /*
  * Parse path and return in `res_vnode` the vnode corresponding to the directory
  * containing the basename (last element) of path. `base` must not be locked on
@@ -218,6 +357,9 @@ long namev_dir(vnode_t *base, const char *path, vnode_t **res_vnode,
         basenode = base;
     }
 
+    /* the directories at the start of the path are usually cached */
+    vnode_t *cached = namev_walk_rcu(basenode, &path);
+
     char *curname = (char *)namev_tokenize(&path, &cur_len); /// wrong args!!
     // if (*path == '/'){
     //     basenode = vfs_root_fs.fs_root;
@@ -227,14 +369,22 @@ long namev_dir(vnode_t *base, const char *path, vnode_t **res_vnode,
 
     char *nextname = (char *)namev_tokenize(&path, &next_len);
 
-    vlock(basenode);
-    vref(basenode); 
+    /* walking the path only reads each directory, so other lookups (of the
+     * same directories, too) can go ahead at the same time */
+    if (cached) {
+        basenode = cached;
+        vlock_shared(basenode);
+    } else {
+        vlock_shared(basenode);
+        vref(basenode);
+    }
     while (next_len != 0) {
         vnode_t *revnode; 
         int err = namev_lookup(basenode, curname, cur_len, &revnode);
         //vunlock(basenode);
         if (err != 0) {
-            vput_locked(&basenode);
+            vunlock_shared(basenode);
+            vput(&basenode);
             return err;
         }
         int check = 1;
@@ -246,8 +396,9 @@ long namev_dir(vnode_t *base, const char *path, vnode_t **res_vnode,
             //vput_locked(&basenode);
         } else{
             // vput(&revnode);
-            vput_locked(&basenode);
-            vlock(revnode);
+            vunlock_shared(basenode);
+            vput(&basenode);
+            vlock_shared(revnode);
         }
         if (check == 1){
             basenode = revnode;
@@ -259,7 +410,7 @@ long namev_dir(vnode_t *base, const char *path, vnode_t **res_vnode,
         
     /// set all back to original
     //if (basenode){
-    vunlock(basenode);
+    vunlock_shared(basenode);
     //}
     //vunlock(basenode);
     *res_vnode = basenode;
@@ -291,6 +442,7 @@ long namev_dir(vnode_t *base, const char *path, vnode_t **res_vnode,
  *
  * Return 0 on success, or:
  *  - EINVAL: O_CREAT is specified but path implies a directory
+ *  - EEXIST: O_CREAT and O_EXCL are specified and the file exists
  *  - ENAMETOOLONG: path basename is too long
  *  - ENOTDIR: Attempting to open a regular file as a directory
  *  - Propagate errors from namev_dir() and namev_lookup()
@@ -339,24 +491,46 @@ long namev_open(vnode_t *base, const char *path, int oflags, int mode,
         return -ENAMETOOLONG;
     }
 
-    vlock(dirnode);
-    res = namev_lookup(dirnode, nv_name, nv_namelen, &filenode);
-    if (res == -ENOENT && (oflags & O_CREAT)) {
-        res = dirnode->vn_ops->mknod(dirnode, nv_name, nv_namelen, mode, devid, &filenode);
-        if (res != 0) {
+    if (!(oflags & O_CREAT)) {
+        /* an existing file can usually be found without locking dirnode */
+        uint64_t seq = dcache_read_begin();
+        rcu_read_lock();
+        filenode = namev_lookup_rcu(dirnode, nv_name, nv_namelen);
+        if (filenode && !vref_not_zero(filenode)) {
+            filenode = NULL;
+        }
+        rcu_read_unlock();
+        if (filenode && dcache_read_retry(seq)) {
+            vput(&filenode);
+        }
+    }
+
+    if (!filenode) {
+        vlock(dirnode);
+        res = namev_lookup(dirnode, nv_name, nv_namelen, &filenode);
+        if (res == -ENOENT && (oflags & O_CREAT)) {
+            dcache_invalidate(dirnode, nv_name, nv_namelen);
+            res = dirnode->vn_ops->mknod(dirnode, nv_name, nv_namelen, mode, devid, &filenode);
+            if (res != 0) {
+                vunlock(dirnode);
+                vput(&dirnode);
+                //vput(&filenode);
+                return res;
+            }
+        } else if (res != 0) {
             vunlock(dirnode);
             vput(&dirnode);
+        
             //vput(&filenode);
             return res;
+        } else if ((oflags & O_CREAT) && (oflags & O_EXCL)) {
+            vunlock(dirnode);
+            vput(&dirnode);
+            vput(&filenode);
+            return -EEXIST;
         }
-    } else if (res != 0) {
         vunlock(dirnode);
-        vput(&dirnode);
-        
-        //vput(&filenode);
-        return res;
     }
-    vunlock(dirnode);
 
     if (!S_ISDIR(filenode->vn_mode) && (path[strlen(path) - 1] == '/')) {
         vput(&dirnode);
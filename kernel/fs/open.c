@@ -1,5 +1,6 @@
 #include "errno.h"
 #include "fs/fcntl.h"
+#include "fs/fdtable.h"
 #include "fs/file.h"
 #include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
@@ -8,44 +9,39 @@
 #include "util/debug.h"
 #include <fs/vnode.h>
 
-// NOTE: IF DOING MULTI-THREADED PROCS, NEED TO SYNCHRONIZE ACCESS TO FILE
-// DESCRIPTORS, AND, MORE GENERALLY SPEAKING, p_files, IN PARTICULAR IN THIS
-// FUNCTION AND ITS CALLERS.
 /*
- * Go through curproc->p_files and find the first null entry.
- * If one exists, set fd to that index and return 0.
+ * Find the lowest free file descriptor of curproc and make room for it in
+ * curproc->p_files. The caller must hold the file table (see
+ * proc_files_lock()) until it fills the entry in. If one exists, set fd to
+ * it and return 0.
  *
  * Error cases get_empty_fd is responsible for generating:
  *  - EMFILE: no empty file descriptor
+ *  - ENOMEM: the table could not be grown, or copied from the parent's
  */
 long get_empty_fd(int *fd)
 {
-    for (*fd = 0; *fd < NFILES; (*fd)++)
-    {
-        if (!curproc->p_files[*fd])
-        {
-            return 0;
-        }
-    }
-    *fd = -1;
-    return -EMFILE;
+    return fdtable_alloc_fd(curproc, fd);
 }
 
 /*
- * Open the file at the provided path with the specified flags.
+ * Open the file at the provided path, relative to the directory dirfd (see
+ * at_get_base()), with the specified flags.
  *
  * Returns the file descriptor on success, or error cases:
  *  - EINVAL: Invalid oflags
  *  - EISDIR: Trying to open a directory with write access
  *  - ENXIO: Blockdev or chardev vnode does not have an actual underlying device
  *  - ENOMEM: Not enough kernel memory (if fcreate() fails)
+ *  - Propagate errors from at_get_base()
  *
  * Hints:
  * 1) Use get_empty_fd() to get an available fd.
  * 2) Use namev_open() with oflags, mode S_IFREG, and devid 0.
  * 3) Check for EISDIR and ENXIO errors.
- * 4) Convert oflags (O_RDONLY, O_WRONLY, O_RDWR, O_APPEND) into corresponding
- *    file access flags (FMODE_READ, FMODE_WRITE, FMODE_APPEND). 
+ * 4) Convert oflags (O_RDONLY, O_WRONLY, O_RDWR, O_APPEND, O_NONBLOCK,
+ *    O_DIRECT) into corresponding file access flags (FMODE_READ, FMODE_WRITE,
+ *    FMODE_APPEND, FMODE_NONBLOCK, FMODE_DIRECT).
  * 5) Use fcreate() to create and initialize the corresponding file descriptor
  *    with the vnode from 2) and the mode from 4).
  *
@@ -60,7 +56,7 @@ long get_empty_fd(int *fd)
  * If a vnode represents a chardev or blockdev, then the appropriate field of
  * the vnode->vn_dev union will point to the device. Otherwise, the union will be NULL.
  */
-long do_open(const char *filename, int oflags) 
+long do_openat(int dirfd, const char *filename, int oflags)
 {
     if ((oflags & O_WRONLY) && (oflags & O_RDWR)){
         return -EINVAL;
@@ -68,8 +64,14 @@ long do_open(const char *filename, int oflags)
 
     long state = 0;
 
+    struct vnode *base;
+    state = at_get_base(dirfd, filename, &base);
+    if (state < 0){
+        return state;
+    }
     struct vnode *vnode;
-    state = namev_open(curproc->p_cwd, filename, oflags, S_IFREG, 0, &vnode);
+    state = namev_open(base, filename, oflags, S_IFREG, 0, &vnode);
+    vput(&base);
     if (state < 0){
         return state;
     }
@@ -98,21 +100,33 @@ long do_open(const char *filename, int oflags)
     // }
 
     int mode = 0;
-    if (oflags & O_RDONLY){
+    switch (oflags & O_ACCESSMODE_MASK){
+    case O_RDONLY:
         mode |= FMODE_READ;
-    } else if (oflags & O_WRONLY){
+        break;
+    case O_WRONLY:
         mode |= FMODE_WRITE;
-    } else if (oflags & O_RDWR){
+        break;
+    default:
         mode |= FMODE_READ | FMODE_WRITE;
-    } 
+        break;
+    }
     
     if (oflags & O_APPEND){
         mode |= FMODE_APPEND;
     }
+    if (oflags & O_NONBLOCK){
+        mode |= FMODE_NONBLOCK;
+    }
+    if (oflags & O_DIRECT){
+        mode |= FMODE_DIRECT;
+    }
 
     int fd = NULL;
+    long locked = proc_files_lock();
     state = get_empty_fd(&fd);
     if (state < 0){
+        proc_files_unlock(locked);
         vput(&vnode);
         return state;
     }
@@ -120,6 +134,7 @@ long do_open(const char *filename, int oflags)
 
     file_t* file = NULL;
     file = fcreate(fd, vnode, mode);
+    proc_files_unlock(locked);
     
     if (file == NULL){ /// correct?
         vput(&vnode);
@@ -140,3 +155,8 @@ long do_open(const char *filename, int oflags)
     //NOT_YET_IMPLEMENTED("VFS: do_open");
     //return -1;
 }
+
+long do_open(const char *filename, int oflags)
+{
+    return do_openat(AT_FDCWD, filename, oflags);
+}
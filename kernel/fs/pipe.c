@@ -8,21 +8,31 @@
 #include "errno.h"
 #include "globals.h"
 
+#include "api/syscall.h"
+
+#include "fs/fcntl.h"
+#include "fs/fdtable.h"
 #include "fs/file.h"
+#include "fs/open.h"
 #include "fs/pipe.h"
+#include "fs/poll.h"
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 
 #include "mm/kmalloc.h"
+#include "mm/page.h"
 #include "mm/slab.h"
 
+#include "proc/kmutex.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
 #include "util/debug.h"
 #include "util/string.h"
 
-#define PIPE_BUF_SIZE 4096
-
 static void pipe_read_vnode(fs_t *fs, vnode_t *vnode);
 
 static void pipe_delete_vnode(fs_t *fs, vnode_t *vnode);
@@ -48,6 +58,8 @@ static long pipe_acquire(vnode_t *vnode, file_t *file);
 
 static long pipe_release(vnode_t *vnode, file_t *file);
 
+static int pipe_poll(vnode_t *vnode, poll_entry_t *pe);
+
 static vnode_ops_t pipe_vops = {
     .read = pipe_read,
     .write = pipe_write,
@@ -65,21 +77,46 @@ static vnode_ops_t pipe_vops = {
     .get_pframe = NULL,
     .fill_pframe = NULL,
     .flush_pframe = NULL,
+    .poll = pipe_poll,
 };
 
+/*
+ * The data in a pipe is kept in a ring of up to pv_max_bufs buffers, each a
+ * range of a page: PIPE_DEFAULT_PAGES, unless F_SETPIPE_SZ has made it
+ * anything up to PIPE_MAX_PAGES. Pages are only allocated as the pipe fills,
+ * and writes append to the last buffer for as long as its page has room.
+ *
+ * A page can be referenced by buffers of more than one pipe: splice() moves
+ * buffers from one pipe to another and tee() copies them, without copying
+ * the data. Only a buffer whose page is not shared can be appended to.
+ */
+typedef struct pipe_page
+{
+    void *pp_addr;
+    long pp_refcount; /* buffers referring to the page */
+} pipe_page_t;
+
+typedef struct pipe_buf
+{
+    pipe_page_t *pb_page;
+    size_t pb_off; /* where the data starts in the page */
+    size_t pb_len;
+} pipe_buf_t;
+
 /* struct pipe defines some data specific to pipes. One of these
    should be present in the vn_i field of each pipe vnode. */
 typedef struct pipe
 {
-    /* Buffer for data in the pipe, which has been written but not yet read. */
-    char *pv_buf;
     /*
-     * Position of the head and number of characters in the buffer. You can
-     * write in characters at position head so long as size does not grow beyond
-     * the pipe buffer size.
+     * Buffers holding data which has been written but not yet read, from
+     * pv_bufs[pv_tail] (the oldest) on. The last buffer can be empty, when
+     * its page is kept for the next write.
      */
-    off_t pv_head;
-    size_t pv_size;
+    pipe_buf_t pv_bufs[PIPE_MAX_PAGES];
+    size_t pv_tail;
+    size_t pv_nbufs;
+    size_t pv_max_bufs; /* the pipe is full with this many buffers */
+    size_t pv_size; /* bytes in the pipe */
     /* Number of file descriptors using this pipe for read and write. */
     int pv_readers;
     int pv_writers;
@@ -92,24 +129,68 @@ typedef struct pipe
     kmutex_t pv_rdlock;
     kmutex_t pv_wrlock;
     /*
-     * Waitqueues for threads attempting to read from an empty buffer, or
-     * write to a full buffer. When the pipe becomes non-empty (or non-full)
-     * then the corresponding waitq should be broadcasted on to make sure all
-     * of the threads get a chance to go.
+     * Protects the buffers and counts above, so that the holders of pv_rdlock
+     * and pv_wrlock can work on the pipe at the same time.
+     */
+    spinlock_t pv_lock;
+    /*
+     * Waitqueues for threads attempting to read from an empty pipe, or write
+     * to a full one. Threads are only woken when the other side is about to
+     * wait itself or is done, rather than for every page they could use. Only
+     * the holder of pv_rdlock or pv_wrlock waits, so they wait as exclusive
+     * waiters: a wakeup is only ever for one thread.
      */
     ktqueue_t pv_read_waitq;
     ktqueue_t pv_write_waitq;
+    /*
+     * For poll() and epoll, which, unlike the threads above, hear of every
+     * change in what the pipe is ready for. Notified with pv_lock let go of.
+     */
+    pollhead_t pv_pollhead;
 } pipe_t;
 
 #define VNODE_TO_PIPE(vn) ((pipe_t *)((vn)->vn_i))
 
 static slab_allocator_t *pipe_allocator = NULL;
+static slab_allocator_t *pipe_page_allocator = NULL;
 static int next_pno = 0;
 
 void pipe_init(void)
 {
     pipe_allocator = slab_allocator_create("pipe", sizeof(pipe_t));
     KASSERT(pipe_allocator);
+    pipe_page_allocator =
+        slab_allocator_create("pipe_page", sizeof(pipe_page_t));
+    KASSERT(pipe_page_allocator);
+    pipe_fs.fs_vnode_allocator =
+        slab_allocator_create("pipe_vnode", sizeof(vnode_t));
+    KASSERT(pipe_fs.fs_vnode_allocator);
+    vnode_cache_init(&pipe_fs);
+}
+
+static pipe_page_t *pipe_page_alloc(void)
+{
+    pipe_page_t *pp = slab_obj_alloc(pipe_page_allocator);
+    if (!pp)
+    {
+        return NULL;
+    }
+    if (!(pp->pp_addr = page_alloc()))
+    {
+        slab_obj_free(pipe_page_allocator, pp);
+        return NULL;
+    }
+    pp->pp_refcount = 1;
+    return pp;
+}
+
+static void pipe_page_put(pipe_page_t *pp)
+{
+    if (!__sync_sub_and_fetch(&pp->pp_refcount, 1))
+    {
+        page_free(pp->pp_addr);
+        slab_obj_free(pipe_page_allocator, pp);
+    }
 }
 
 /*
@@ -120,8 +201,45 @@ void pipe_init(void)
  */
 static pipe_t *pipe_create(void)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_create");
-    return NULL;
+    pipe_t *pipe = slab_obj_alloc(pipe_allocator);
+    if (!pipe)
+    {
+        return NULL;
+    }
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->pv_max_bufs = PIPE_DEFAULT_PAGES;
+    kmutex_init(&pipe->pv_rdlock);
+    kmutex_init(&pipe->pv_wrlock);
+    spinlock_init(&pipe->pv_lock);
+    sched_queue_init(&pipe->pv_read_waitq);
+    sched_queue_init(&pipe->pv_write_waitq);
+    pollhead_init(&pipe->pv_pollhead);
+    return pipe;
+}
+
+/* Appends a buffer for len bytes at off in pp, which the pipe takes the
+ * caller's reference to. There must be room for it. */
+static pipe_buf_t *pipe_buf_push(pipe_t *pipe, pipe_page_t *pp, size_t off,
+                                 size_t len)
+{
+    KASSERT(pipe->pv_nbufs < pipe->pv_max_bufs);
+    pipe_buf_t *pb =
+        &pipe->pv_bufs[(pipe->pv_tail + pipe->pv_nbufs++) % PIPE_MAX_PAGES];
+    pb->pb_page = pp;
+    pb->pb_off = off;
+    pb->pb_len = len;
+    pipe->pv_size += len;
+    return pb;
+}
+
+/* Removes the oldest buffer */
+static void pipe_buf_pop(pipe_t *pipe)
+{
+    pipe_buf_t *pb = &pipe->pv_bufs[pipe->pv_tail];
+    KASSERT(pipe->pv_nbufs && !pb->pb_len);
+    pipe_page_put(pb->pb_page);
+    pipe->pv_tail = (pipe->pv_tail + 1) % PIPE_MAX_PAGES;
+    pipe->pv_nbufs--;
 }
 
 /*
@@ -129,7 +247,122 @@ static pipe_t *pipe_create(void)
  */
 static void pipe_destroy(pipe_t *pipe)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_destroy");
+    while (pipe->pv_nbufs)
+    {
+        pipe->pv_bufs[pipe->pv_tail].pb_len = 0;
+        pipe_buf_pop(pipe);
+    }
+    slab_obj_free(pipe_allocator, pipe);
+}
+
+/*
+ * Takes n bytes off the front of the pipe, and gets rid of the buffers that
+ * leaves empty, except for a last one whose page is only ours. With n = 0,
+ * this just drops empty buffers in front of the data. pv_lock must be held.
+ */
+static void pipe_consume(pipe_t *pipe, size_t n)
+{
+    KASSERT(n <= pipe->pv_size);
+    while (pipe->pv_nbufs)
+    {
+        pipe_buf_t *pb = &pipe->pv_bufs[pipe->pv_tail];
+        size_t m = MIN(n, pb->pb_len);
+        pb->pb_off += m;
+        pb->pb_len -= m;
+        pipe->pv_size -= m;
+        n -= m;
+        if (pb->pb_len ||
+            (pipe->pv_nbufs == 1 && pb->pb_page->pp_refcount == 1))
+        {
+            break;
+        }
+        pipe_buf_pop(pipe);
+    }
+    KASSERT(!n);
+}
+
+/*
+ * Returns the last buffer, if bytes can be appended to it, or NULL. pv_lock
+ * must be held, and only the holder of pv_wrlock may append.
+ */
+static pipe_buf_t *pipe_last_room(pipe_t *pipe)
+{
+    if (!pipe->pv_nbufs)
+    {
+        return NULL;
+    }
+    pipe_buf_t *pb =
+        &pipe->pv_bufs[(pipe->pv_tail + pipe->pv_nbufs - 1) % PIPE_MAX_PAGES];
+    if (pb->pb_page->pp_refcount != 1)
+    {
+        return NULL;
+    }
+    if (!pb->pb_len)
+    {
+        pb->pb_off = 0;
+    }
+    return pb->pb_off + pb->pb_len < PAGE_SIZE ? pb : NULL;
+}
+
+/*
+ * Waits, with pv_lock held (it is held again on return), until the pipe has
+ * data. Writers are woken first, as they may be waiting for the room taken
+ * so far.
+ *
+ * Returns 1 if there is data, 0 if the pipe is empty and has no writers left,
+ * -EAGAIN if it would have to wait and the read is non-blocking, or -EINTR.
+ */
+static long pipe_wait_data(pipe_t *pipe)
+{
+    while (!pipe->pv_size)
+    {
+        if (!pipe->pv_writers)
+        {
+            return 0;
+        }
+        if (curthr->kt_nonblock)
+        {
+            return -EAGAIN;
+        }
+        sched_broadcast_on(&pipe->pv_write_waitq);
+        long ret = sched_cancellable_sleep_on_exclusive(&pipe->pv_read_waitq,
+                                                        &pipe->pv_lock);
+        spinlock_lock(&pipe->pv_lock);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Waits, with pv_lock held (it is held again on return), until bytes can be
+ * added to the pipe; with whole_buf, until a buffer can be added. Readers are
+ * woken first.
+ *
+ * Returns 1 once there is room, -EPIPE if the pipe has no readers left,
+ * -EAGAIN if it would have to wait and the write is non-blocking, or -EINTR.
+ */
+static long pipe_wait_room(pipe_t *pipe, long whole_buf)
+{
+    while (pipe->pv_readers && pipe->pv_nbufs >= pipe->pv_max_bufs &&
+           (whole_buf || !pipe_last_room(pipe)))
+    {
+        if (curthr->kt_nonblock)
+        {
+            return -EAGAIN;
+        }
+        sched_broadcast_on(&pipe->pv_read_waitq);
+        long ret = sched_cancellable_sleep_on_exclusive(&pipe->pv_write_waitq,
+                                                        &pipe->pv_lock);
+        spinlock_lock(&pipe->pv_lock);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+    return pipe->pv_readers ? 1 : -EPIPE;
 }
 
 /* pipefs vnode operations */
@@ -162,8 +395,15 @@ static void pipe_delete_vnode(fs_t *fs, vnode_t *vnode)
  */
 static vnode_t *pget(void)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pget");
-    return NULL;
+    vnode_t *vnode = vget(&pipe_fs, __sync_fetch_and_add(&next_pno, 1));
+    pipe_t *pipe = pipe_create();
+    if (!pipe)
+    {
+        vput(&vnode);
+        return NULL;
+    }
+    vnode->vn_i = pipe;
+    return vnode;
 }
 
 /*
@@ -179,8 +419,43 @@ static vnode_t *pget(void)
  */
 int do_pipe(int pipefd[2])
 {
-    NOT_YET_IMPLEMENTED("PIPES: do_pipe");
-    return -ENOTSUP;
+    vnode_t *vnode = pget();
+    if (!vnode)
+    {
+        return -ENOMEM;
+    }
+
+    file_t *rfile = NULL;
+    long locked = proc_files_lock();
+    long ret = get_empty_fd(&pipefd[0]);
+    if (!ret && !(rfile = fcreate(pipefd[0], vnode, FMODE_READ)))
+    {
+        ret = -ENOMEM;
+    }
+    if (!ret)
+    {
+        ret = get_empty_fd(&pipefd[1]);
+        if (!ret && !fcreate(pipefd[1], vnode, FMODE_WRITE))
+        {
+            ret = -ENOMEM;
+        }
+        if (ret)
+        {
+            fdtable_install(curproc, pipefd[0], NULL);
+        }
+        else
+        {
+            rfile = NULL;
+        }
+    }
+    proc_files_unlock(locked);
+
+    if (rfile)
+    {
+        fput(&rfile);
+    }
+    vput(&vnode);
+    return (int)ret;
 }
 
 /*
@@ -196,11 +471,39 @@ int do_pipe(int pipefd[2])
  * for writing again so no more writers will ever put characters in the pipe.
  * The reader should just take as much as it needs (or barring that, as much as
  * it can get) and return with a partial buffer.
+ *
+ * The vnode lock is let go of for the duration: it does not protect anything
+ * of the pipe's, and waiting with it held would keep writers out.
  */
 static long pipe_read(vnode_t *vnode, size_t pos, void *buf, size_t count)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_read");
-    return -EINVAL;
+    pipe_t *pipe = VNODE_TO_PIPE(vnode);
+    vunlock(vnode);
+    kmutex_lock(&pipe->pv_rdlock);
+    spinlock_lock(&pipe->pv_lock);
+
+    size_t nread = 0;
+    long ret = 0;
+    while (nread < count && (ret = pipe_wait_data(pipe)) > 0)
+    {
+        pipe_consume(pipe, 0);
+        pipe_buf_t *pb = &pipe->pv_bufs[pipe->pv_tail];
+        size_t n = MIN(pb->pb_len, count - nread);
+        memcpy((char *)buf + nread, (char *)pb->pb_page->pp_addr + pb->pb_off,
+               n);
+        pipe_consume(pipe, n);
+        nread += n;
+    }
+    sched_broadcast_on(&pipe->pv_write_waitq);
+
+    spinlock_unlock(&pipe->pv_lock);
+    kmutex_unlock(&pipe->pv_rdlock);
+    if (nread)
+    {
+        poll_notify(&pipe->pv_pollhead, POLLOUT);
+    }
+    vlock(vnode);
+    return nread ? (long)nread : ret;
 }
 
 /*
@@ -215,8 +518,46 @@ static long pipe_read(vnode_t *vnode, size_t pos, void *buf, size_t count)
 static long pipe_write(vnode_t *vnode, size_t pos, const void *buf,
                        size_t count)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_write");
-    return -EINVAL;
+    pipe_t *pipe = VNODE_TO_PIPE(vnode);
+    vunlock(vnode);
+    kmutex_lock(&pipe->pv_wrlock);
+    spinlock_lock(&pipe->pv_lock);
+
+    size_t nwritten = 0;
+    long ret = 0;
+    while (nwritten < count && (ret = pipe_wait_room(pipe, 0)) > 0)
+    {
+        pipe_buf_t *pb = pipe_last_room(pipe);
+        if (!pb)
+        {
+            /* buffers can only have been taken away meanwhile */
+            spinlock_unlock(&pipe->pv_lock);
+            pipe_page_t *pp = pipe_page_alloc();
+            spinlock_lock(&pipe->pv_lock);
+            if (!pp)
+            {
+                ret = -ENOMEM;
+                break;
+            }
+            pb = pipe_buf_push(pipe, pp, 0, 0);
+        }
+        size_t n = MIN(PAGE_SIZE - (pb->pb_off + pb->pb_len), count - nwritten);
+        memcpy((char *)pb->pb_page->pp_addr + pb->pb_off + pb->pb_len,
+               (const char *)buf + nwritten, n);
+        pb->pb_len += n;
+        pipe->pv_size += n;
+        nwritten += n;
+    }
+    sched_broadcast_on(&pipe->pv_read_waitq);
+
+    spinlock_unlock(&pipe->pv_lock);
+    kmutex_unlock(&pipe->pv_wrlock);
+    if (nwritten)
+    {
+        poll_notify(&pipe->pv_pollhead, POLLIN);
+    }
+    vlock(vnode);
+    return nwritten ? (long)nwritten : ret;
 }
 
 /*
@@ -227,8 +568,11 @@ static long pipe_write(vnode_t *vnode, size_t pos, const void *buf,
  */
 static long pipe_stat(vnode_t *vnode, stat_t *ss)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_stat");
-    return -EINVAL;
+    memset(ss, 0, sizeof(*ss));
+    ss->st_mode = vnode->vn_mode;
+    ss->st_ino = (int)vnode->vn_vno;
+    ss->st_blksize = PAGE_SIZE;
+    return 0;
 }
 
 /*
@@ -239,7 +583,17 @@ static long pipe_stat(vnode_t *vnode, stat_t *ss)
  */
 static long pipe_acquire(vnode_t *vnode, file_t *file)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_acquire");
+    pipe_t *pipe = VNODE_TO_PIPE(vnode);
+    spinlock_lock(&pipe->pv_lock);
+    if (file->f_mode & FMODE_READ)
+    {
+        pipe->pv_readers++;
+    }
+    if (file->f_mode & FMODE_WRITE)
+    {
+        pipe->pv_writers++;
+    }
+    spinlock_unlock(&pipe->pv_lock);
     return 0;
 }
 
@@ -251,6 +605,422 @@ static long pipe_acquire(vnode_t *vnode, file_t *file)
  */
 static long pipe_release(vnode_t *vnode, file_t *file)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_release");
+    pipe_t *pipe = VNODE_TO_PIPE(vnode);
+    int events = 0;
+    spinlock_lock(&pipe->pv_lock);
+    if ((file->f_mode & FMODE_READ) && !--pipe->pv_readers)
+    {
+        sched_broadcast_on(&pipe->pv_write_waitq);
+        events |= POLLERR;
+    }
+    if ((file->f_mode & FMODE_WRITE) && !--pipe->pv_writers)
+    {
+        sched_broadcast_on(&pipe->pv_read_waitq);
+        events |= POLLHUP;
+    }
+    spinlock_unlock(&pipe->pv_lock);
+    if (events)
+    {
+        poll_notify(&pipe->pv_pollhead, events);
+    }
+    return 0;
+}
+
+/*
+ * A pipe can be written to while it has a free buffer, or room at the end of
+ * its last one, which must not be shared (see pipe_last_room()).
+ */
+static int pipe_poll(vnode_t *vnode, poll_entry_t *pe)
+{
+    pipe_t *pipe = VNODE_TO_PIPE(vnode);
+    if (pe)
+    {
+        poll_wait(&pipe->pv_pollhead, pe);
+    }
+
+    int events = 0;
+    spinlock_lock(&pipe->pv_lock);
+    if (pipe->pv_size)
+    {
+        events |= POLLIN;
+    }
+    if (!pipe->pv_writers)
+    {
+        events |= POLLHUP;
+    }
+    if (!pipe->pv_readers)
+    {
+        events |= POLLERR;
+    }
+    else if (pipe->pv_nbufs < pipe->pv_max_bufs)
+    {
+        events |= POLLOUT;
+    }
+    else
+    {
+        pipe_buf_t *pb = &pipe->pv_bufs[(pipe->pv_tail + pipe->pv_nbufs - 1) %
+                                        PIPE_MAX_PAGES];
+        if (pb->pb_page->pp_refcount == 1 &&
+            (!pb->pb_len || pb->pb_off + pb->pb_len < PAGE_SIZE))
+        {
+            events |= POLLOUT;
+        }
+    }
+    spinlock_unlock(&pipe->pv_lock);
+    return events;
+}
+
+/* Returns the pipe behind a file, or NULL if it is not a pipe */
+static pipe_t *file_pipe(file_t *file)
+{
+    return file->f_vnode->vn_fs == &pipe_fs ? VNODE_TO_PIPE(file->f_vnode)
+                                            : NULL;
+}
+
+/* Takes the pv_locks of two pipes, in an order all threads agree on */
+static void pipe_lock_pair(pipe_t *a, pipe_t *b)
+{
+    if (a > b)
+    {
+        pipe_t *t = a;
+        a = b;
+        b = t;
+    }
+    spinlock_lock(&a->pv_lock);
+    spinlock_lock(&b->pv_lock);
+}
+
+static void pipe_unlock_pair(pipe_t *a, pipe_t *b)
+{
+    spinlock_unlock(&a->pv_lock);
+    spinlock_unlock(&b->pv_lock);
+}
+
+/*
+ * Adds buffers referring to the data at the front of in, up to len bytes, to
+ * out; for a splice (as opposed to a tee), that data is then taken out of in,
+ * which comes down to moving the buffers that fit whole. Waits for in to have
+ * data and out to have room for a buffer, then moves what it can at once.
+ */
+static ssize_t pipe_splice_pipes(pipe_t *in, pipe_t *out, size_t len,
+                                 long tee)
+{
+    kmutex_lock(&in->pv_rdlock);
+    kmutex_lock(&out->pv_wrlock);
+
+    spinlock_lock(&in->pv_lock);
+    long ret = pipe_wait_data(in);
+    spinlock_unlock(&in->pv_lock);
+    if (ret > 0)
+    {
+        spinlock_lock(&out->pv_lock);
+        ret = pipe_wait_room(out, 1);
+        spinlock_unlock(&out->pv_lock);
+    }
+
+    size_t total = 0;
+    if (ret > 0)
+    {
+        pipe_lock_pair(in, out);
+        for (size_t i = 0; i < in->pv_nbufs && total < len &&
+                           out->pv_nbufs < out->pv_max_bufs;
+             i++)
+        {
+            pipe_buf_t *pb = &in->pv_bufs[(in->pv_tail + i) % PIPE_MAX_PAGES];
+            size_t n = MIN(pb->pb_len, len - total);
+            if (n)
+            {
+                __sync_fetch_and_add(&pb->pb_page->pp_refcount, 1);
+                pipe_buf_push(out, pb->pb_page, pb->pb_off, n);
+                total += n;
+            }
+        }
+        sched_broadcast_on(&out->pv_read_waitq);
+        if (!tee)
+        {
+            pipe_consume(in, total);
+            sched_broadcast_on(&in->pv_write_waitq);
+        }
+        pipe_unlock_pair(in, out);
+    }
+
+    kmutex_unlock(&out->pv_wrlock);
+    kmutex_unlock(&in->pv_rdlock);
+    if (total)
+    {
+        poll_notify(&out->pv_pollhead, POLLIN);
+        if (!tee)
+        {
+            poll_notify(&in->pv_pollhead, POLLOUT);
+        }
+    }
+    return total ? (ssize_t)total : ret;
+}
+
+/*
+ * Writes up to len bytes from the front of the pipe to a file, straight from
+ * the pipe's pages, and takes what was written out of the pipe. Waits for
+ * the pipe to have data.
+ */
+static ssize_t pipe_splice_to_file(pipe_t *pipe, file_t *out, size_t len)
+{
+    kmutex_lock(&pipe->pv_rdlock);
+    spinlock_lock(&pipe->pv_lock);
+    long ret = pipe_wait_data(pipe);
+
+    /* the data up to pv_size stays put while we hold pv_rdlock */
+    pipe_buf_t bufs[PIPE_MAX_PAGES];
+    size_t nbufs = 0;
+    for (size_t i = 0, n = 0; ret > 0 && i < pipe->pv_nbufs && n < len; i++)
+    {
+        pipe_buf_t *pb = &pipe->pv_bufs[(pipe->pv_tail + i) % PIPE_MAX_PAGES];
+        if (pb->pb_len)
+        {
+            bufs[nbufs] = *pb;
+            bufs[nbufs].pb_len = MIN(pb->pb_len, len - n);
+            n += bufs[nbufs++].pb_len;
+        }
+    }
+    spinlock_unlock(&pipe->pv_lock);
+
+    size_t total = 0;
+    if (ret > 0)
+    {
+        vnode_t *vn = out->f_vnode;
+        vlock(vn);
+        size_t pos = (out->f_mode & FMODE_APPEND) ? vn->vn_len : out->f_pos;
+        for (size_t i = 0; i < nbufs; i++)
+        {
+            ssize_t n = vn->vn_ops->write(
+                vn, pos, (char *)bufs[i].pb_page->pp_addr + bufs[i].pb_off,
+                bufs[i].pb_len);
+            if (n < 0)
+            {
+                ret = n;
+                break;
+            }
+            total += (size_t)n;
+            pos += (size_t)n;
+            if ((size_t)n < bufs[i].pb_len)
+            {
+                break;
+            }
+        }
+        out->f_pos = pos;
+        vunlock(vn);
+
+        spinlock_lock(&pipe->pv_lock);
+        pipe_consume(pipe, total);
+        sched_broadcast_on(&pipe->pv_write_waitq);
+        spinlock_unlock(&pipe->pv_lock);
+    }
+
+    kmutex_unlock(&pipe->pv_rdlock);
+    if (total)
+    {
+        poll_notify(&pipe->pv_pollhead, POLLOUT);
+    }
+    return total ? (ssize_t)total : ret;
+}
+
+/*
+ * Reads up to len bytes from a file into fresh pages, and adds them to the
+ * pipe. Waits for room for the first page only, and stops at a short read.
+ */
+static ssize_t pipe_splice_from_file(file_t *in, pipe_t *pipe, size_t len)
+{
+    kmutex_lock(&pipe->pv_wrlock);
+    size_t total = 0;
+    long ret = 0;
+    while (total < len)
+    {
+        spinlock_lock(&pipe->pv_lock);
+        if (!total)
+        {
+            ret = pipe_wait_room(pipe, 1);
+        }
+        else if (!pipe->pv_readers)
+        {
+            ret = -EPIPE;
+        }
+        else
+        {
+            ret = pipe->pv_nbufs < pipe->pv_max_bufs;
+        }
+        spinlock_unlock(&pipe->pv_lock);
+        if (ret <= 0)
+        {
+            break;
+        }
+
+        pipe_page_t *pp = pipe_page_alloc();
+        if (!pp)
+        {
+            ret = -ENOMEM;
+            break;
+        }
+        size_t want = MIN(len - total, PAGE_SIZE);
+        vlock(in->f_vnode);
+        ssize_t n = in->f_vnode->vn_ops->read(in->f_vnode, in->f_pos,
+                                              pp->pp_addr, want);
+        if (n > 0)
+        {
+            in->f_pos += (size_t)n;
+        }
+        vunlock(in->f_vnode);
+        if (n <= 0)
+        {
+            pipe_page_put(pp);
+            ret = n;
+            break;
+        }
+
+        spinlock_lock(&pipe->pv_lock);
+        pipe_buf_push(pipe, pp, 0, (size_t)n);
+        sched_broadcast_on(&pipe->pv_read_waitq);
+        spinlock_unlock(&pipe->pv_lock);
+        total += (size_t)n;
+        if ((size_t)n < want)
+        {
+            break;
+        }
+    }
+    kmutex_unlock(&pipe->pv_wrlock);
+    if (total)
+    {
+        poll_notify(&pipe->pv_pollhead, POLLIN);
+    }
+    return total ? (ssize_t)total : ret;
+}
+
+/*
+ * Gets the files for a splice or tee, and the pipes behind them.
+ */
+static long splice_fget(int fd_in, int fd_out, file_t **inp, file_t **outp,
+                        pipe_t **pinp, pipe_t **poutp)
+{
+    file_t *in = fget(fd_in);
+    file_t *out = fget(fd_out);
+    long ret = 0;
+    if (!in || !out || !(in->f_mode & FMODE_READ) ||
+        !(out->f_mode & FMODE_WRITE))
+    {
+        ret = -EBADF;
+    }
+    else if (S_ISDIR(in->f_vnode->vn_mode) || S_ISDIR(out->f_vnode->vn_mode))
+    {
+        ret = -EISDIR;
+    }
+    else
+    {
+        *pinp = file_pipe(in);
+        *poutp = file_pipe(out);
+        if ((!*pinp && !*poutp) || *pinp == *poutp)
+        {
+            ret = -EINVAL;
+        }
+    }
+    if (ret)
+    {
+        if (in)
+        {
+            fput(&in);
+        }
+        if (out)
+        {
+            fput(&out);
+        }
+        return ret;
+    }
+    *inp = in;
+    *outp = out;
     return 0;
 }
+
+ssize_t do_splice(int fd_in, int fd_out, size_t len)
+{
+    file_t *in, *out;
+    pipe_t *pin, *pout;
+    long ret = splice_fget(fd_in, fd_out, &in, &out, &pin, &pout);
+    if (ret)
+    {
+        return ret;
+    }
+
+    ssize_t n;
+    if (pin && pout)
+    {
+        n = pipe_splice_pipes(pin, pout, len, 0);
+    }
+    else if (pin)
+    {
+        n = pipe_splice_to_file(pin, out, len);
+    }
+    else
+    {
+        n = pipe_splice_from_file(in, pout, len);
+    }
+    fput(&in);
+    fput(&out);
+    return n;
+}
+
+ssize_t do_tee(int fd_in, int fd_out, size_t len)
+{
+    file_t *in, *out;
+    pipe_t *pin, *pout;
+    long ret = splice_fget(fd_in, fd_out, &in, &out, &pin, &pout);
+    if (!ret && (!pin || !pout))
+    {
+        fput(&in);
+        fput(&out);
+        ret = -EINVAL;
+    }
+    if (ret)
+    {
+        return ret;
+    }
+
+    ssize_t n = pipe_splice_pipes(pin, pout, len, 1);
+    fput(&in);
+    fput(&out);
+    return n;
+}
+
+long pipe_fcntl(file_t *file, int cmd, int arg)
+{
+    pipe_t *pipe = file_pipe(file);
+    if (!pipe)
+    {
+        return -EBADF;
+    }
+    if (cmd == F_GETPIPE_SZ)
+    {
+        return (long)(pipe->pv_max_bufs * PAGE_SIZE);
+    }
+    if (arg < 0)
+    {
+        return -EINVAL;
+    }
+    size_t pages = ((size_t)arg + PAGE_SIZE - 1) / PAGE_SIZE;
+    pages = MIN(MAX(pages, 1), PIPE_MAX_PAGES);
+
+    spinlock_lock(&pipe->pv_lock);
+    if (pipe->pv_nbufs > pages)
+    {
+        spinlock_unlock(&pipe->pv_lock);
+        return -EBUSY;
+    }
+    long grown = pages > pipe->pv_max_bufs;
+    pipe->pv_max_bufs = pages;
+    if (grown)
+    {
+        sched_broadcast_on(&pipe->pv_write_waitq);
+    }
+    spinlock_unlock(&pipe->pv_lock);
+    if (grown)
+    {
+        poll_notify(&pipe->pv_pollhead, POLLOUT);
+    }
+    return (long)(pages * PAGE_SIZE);
+}
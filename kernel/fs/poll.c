@@ -0,0 +1,278 @@
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "api/syscall.h"
+
+#include "fs/file.h"
+#include "fs/poll.h"
+#include "fs/vnode.h"
+
+#include "main/interrupt.h"
+
+#include "mm/kmalloc.h"
+
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/time.h"
+#include "util/timer.h"
+
+void pollhead_init(pollhead_t *ph)
+{
+    list_init(&ph->ph_entries);
+    spinlock_init(&ph->ph_lock);
+}
+
+void poll_wait(pollhead_t *ph, poll_entry_t *pe)
+{
+    KASSERT(!pe->pe_head);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&ph->ph_lock);
+    list_insert_tail(&ph->ph_entries, &pe->pe_link);
+    pe->pe_head = ph;
+    spinlock_unlock(&ph->ph_lock);
+    intr_setipl(ipl);
+}
+
+void poll_cancel(poll_entry_t *pe)
+{
+    pollhead_t *ph = pe->pe_head;
+    if (!ph)
+    {
+        return;
+    }
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&ph->ph_lock);
+    list_remove(&pe->pe_link);
+    spinlock_unlock(&ph->ph_lock);
+    intr_setipl(ipl);
+    pe->pe_head = NULL;
+}
+
+void poll_notify(pollhead_t *ph, int events)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&ph->ph_lock);
+    list_iterate(&ph->ph_entries, pe, poll_entry_t, pe_link)
+    {
+        pe->pe_notify(pe, events);
+    }
+    spinlock_unlock(&ph->ph_lock);
+    intr_setipl(ipl);
+}
+
+int poll_file(file_t *file, poll_entry_t *pe)
+{
+    vnode_t *vn = file->f_vnode;
+    int events = vn->vn_ops->poll ? vn->vn_ops->poll(vn, pe)
+                                  : (POLLIN | POLLOUT);
+    /* each end of a pipe only hears about its own direction */
+    if (!(file->f_mode & FMODE_READ))
+    {
+        events &= ~(POLLIN | POLLHUP);
+    }
+    if (!(file->f_mode & FMODE_WRITE))
+    {
+        events &= ~(POLLOUT | POLLERR);
+    }
+    return events;
+}
+
+/* rounds up, so as never to stop waiting early */
+uint64_t poll_deadline(int timeout)
+{
+    if (timeout < 0)
+    {
+        return 0;
+    }
+    return jiffies + time_ms_to_jiffies(timeout) + 1;
+}
+
+typedef struct poll_timer_arg
+{
+    ktqueue_t *pta_queue;
+    spinlock_t *pta_lock;
+    kthread_t *pta_thread;
+} poll_timer_arg_t;
+
+/* wakes only the thread whose deadline it is, not the others on the queue */
+static void poll_timer_expired(uint64_t data)
+{
+    poll_timer_arg_t *arg = (poll_timer_arg_t *)data;
+    spinlock_lock(arg->pta_lock);
+    sched_wakeup_thread_on(arg->pta_queue, arg->pta_thread);
+    spinlock_unlock(arg->pta_lock);
+}
+
+static long poll_sleep_on(ktqueue_t *queue, spinlock_t *lock,
+                          uint64_t deadline, long exclusive)
+{
+    poll_timer_arg_t arg = {
+        .pta_queue = queue, .pta_lock = lock, .pta_thread = curthr};
+    timer_t timer;
+    if (deadline)
+    {
+        timer_init(&timer);
+        timer.function = poll_timer_expired;
+        timer.data = (uint64_t)&arg;
+        timer.expires = deadline;
+        timer_add(&timer);
+    }
+    long ret = exclusive ? sched_cancellable_sleep_on_exclusive(queue, lock)
+                         : sched_cancellable_sleep_on(queue, lock);
+    if (deadline)
+    {
+        /* the timer's function may be about to take the lock */
+        timer_del_sync(&timer);
+    }
+    spinlock_lock(lock);
+    return ret;
+}
+
+long poll_sleep(ktqueue_t *queue, spinlock_t *lock, uint64_t deadline)
+{
+    return poll_sleep_on(queue, lock, deadline, 0);
+}
+
+long poll_sleep_exclusive(ktqueue_t *queue, spinlock_t *lock,
+                          uint64_t deadline)
+{
+    return poll_sleep_on(queue, lock, deadline, 1);
+}
+
+/* What poll() waits on: the entries it puts on the fds' pollheads all wake
+ * the same queue */
+typedef struct poll_waiter
+{
+    ktqueue_t pw_queue;
+    spinlock_t pw_lock;
+    long pw_woken;
+} poll_waiter_t;
+
+typedef struct poll_fd
+{
+    poll_entry_t pf_entry;
+    poll_waiter_t *pf_waiter;
+    file_t *pf_file; /* NULL if the fd is ignored or not open */
+    int pf_events;   /* asked for, plus those always reported */
+} poll_fd_t;
+
+static void poll_fd_notify(poll_entry_t *pe, int events)
+{
+    poll_fd_t *pf = CONTAINER_OF(pe, poll_fd_t, pf_entry);
+    if (!(events & pf->pf_events))
+    {
+        return;
+    }
+    poll_waiter_t *pw = pf->pf_waiter;
+    spinlock_lock(&pw->pw_lock);
+    pw->pw_woken = 1;
+    sched_wakeup_on(&pw->pw_queue, NULL);
+    spinlock_unlock(&pw->pw_lock);
+}
+
+/*
+ * Fills in the revents of fds, and returns how many are set. Until one is,
+ * the entries of the fds are put on their pollheads, if waitp is set; once
+ * one is, *waitp is cleared, as there will be no waiting.
+ */
+static long poll_scan(struct pollfd *fds, poll_fd_t *pfs, size_t nfds,
+                      long *waitp)
+{
+    long nready = 0;
+    for (size_t i = 0; i < nfds; i++)
+    {
+        if (!pfs[i].pf_file)
+        {
+            if (fds[i].revents)
+            {
+                nready++;
+            }
+            continue;
+        }
+        poll_entry_t *pe =
+            (*waitp && !pfs[i].pf_entry.pe_head) ? &pfs[i].pf_entry : NULL;
+        fds[i].revents =
+            (short)(poll_file(pfs[i].pf_file, pe) & pfs[i].pf_events);
+        if (fds[i].revents)
+        {
+            nready++;
+            *waitp = 0;
+        }
+    }
+    return nready;
+}
+
+long do_poll(struct pollfd *fds, size_t nfds, int timeout)
+{
+    if (nfds > NFILES)
+    {
+        return -EINVAL;
+    }
+    poll_fd_t *pfs = NULL;
+    if (nfds && !(pfs = kmalloc(nfds * sizeof(*pfs))))
+    {
+        return -ENOMEM;
+    }
+
+    poll_waiter_t pw;
+    sched_queue_init(&pw.pw_queue);
+    spinlock_init(&pw.pw_lock);
+    pw.pw_woken = 0;
+
+    for (size_t i = 0; i < nfds; i++)
+    {
+        poll_fd_t *pf = &pfs[i];
+        pf->pf_entry.pe_head = NULL;
+        pf->pf_entry.pe_notify = poll_fd_notify;
+        pf->pf_waiter = &pw;
+        pf->pf_events = fds[i].events | POLLERR | POLLHUP;
+        pf->pf_file = fds[i].fd < 0 ? NULL : fget(fds[i].fd);
+        fds[i].revents = (fds[i].fd >= 0 && !pf->pf_file) ? POLLNVAL : 0;
+    }
+
+    uint64_t deadline = poll_deadline(timeout);
+    long wait = timeout != 0;
+    long ret = poll_scan(fds, pfs, nfds, &wait);
+    while (!ret && wait)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&pw.pw_lock);
+        long err = 0;
+        while (!pw.pw_woken && !err && !(deadline && jiffies >= deadline))
+        {
+            err = poll_sleep(&pw.pw_queue, &pw.pw_lock, deadline);
+        }
+        pw.pw_woken = 0;
+        spinlock_unlock(&pw.pw_lock);
+        intr_setipl(ipl);
+
+        if (err)
+        {
+            ret = err;
+            break;
+        }
+        if (deadline && jiffies >= deadline)
+        {
+            wait = 0;
+        }
+        ret = poll_scan(fds, pfs, nfds, &wait);
+    }
+
+    for (size_t i = 0; i < nfds; i++)
+    {
+        poll_cancel(&pfs[i].pf_entry);
+        if (pfs[i].pf_file)
+        {
+            fput(&pfs[i].pf_file);
+        }
+    }
+    if (pfs)
+    {
+        kfree(pfs);
+    }
+    return ret;
+}
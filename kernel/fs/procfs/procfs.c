@@ -0,0 +1,537 @@
+/*
+ * The kernel's statistics as files; see fs/procfs/procfs.h.
+ *
+ * Nothing is kept per file: a vnode's inode number says which file it is,
+ * as the index of its entry in one of the tables below (0 for a directory)
+ * and the pid it is about (-1 for the root and the files in it), and each
+ * read() has the entry's fill function write the file out afresh. A
+ * process's files are filled with the process list locked (see
+ * proc_pid_info()), so those functions must not block.
+ *
+ * The names in the root come and go with the processes, so the dentry cache
+ * is kept out of the way (fs_nodcache), and lookups and readdir() ask the
+ * process table every time.
+ */
+
+#include "fs/procfs/procfs.h"
+#include "errno.h"
+#include "fs/dirent.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "globals.h"
+#include "kernel.h"
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/iosched.h"
+#include "main/interrupt.h"
+#include "mm/kmalloc.h"
+#include "mm/memgroup.h"
+#include "mm/page.h"
+#include "mm/reclaim.h"
+#include "mm/slab.h"
+#include "proc/proc.h"
+#include "proc/rwlock.h"
+#include "proc/sched_stats.h"
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+#include "util/time.h"
+#include "vm/swap.h"
+#include "vm/vmmap.h"
+
+/* The pid goes in the low bits, which the vnode cache hashes on */
+#define PROCFS_PID_BITS 20
+#define PROCFS_INO(pid, index) \
+    (((ino_t)(index) << PROCFS_PID_BITS) | (ino_t)((pid) + 1))
+#define PROCFS_INO_PID(ino) \
+    ((pid_t)((ino) & ((1U << PROCFS_PID_BITS) - 1)) - 1)
+#define PROCFS_INO_INDEX(ino) ((size_t)((ino) >> PROCFS_PID_BITS))
+
+#define PROCFS_ROOT_INO PROCFS_INO(-1, 0)
+
+/* The positions of "." and "..", before a directory's entries */
+#define PROCFS_DOT_SLOTS 2
+
+typedef struct procfs_entry
+{
+    const char *pe_name;
+    /* writes the file, NUL-terminated, to buf; proc is NULL in the root */
+    long (*pe_fill)(proc_t *proc, char *buf, size_t size);
+} procfs_entry_t;
+
+/*
+ * Files in the root
+ */
+
+static long procfs_time(proc_t *proc, char *buf, size_t size)
+{
+    time_stats(buf, size);
+    return 0;
+}
+
+static long procfs_meminfo(proc_t *proc, char *buf, size_t size)
+{
+    reclaim_stats_t rs;
+    reclaim_stats_get(&rs);
+    swap_stats_t ss;
+    swap_stats_get(&ss);
+
+    iprintf(&buf, &size, "free_pages %lu\n", rs.rs_free);
+    iprintf(&buf, &size, "failed_allocations %lu\n", rs.rs_failures);
+    iprintf(&buf, &size, "active_pages %lu\n", rs.rs_active);
+    iprintf(&buf, &size, "inactive_pages %lu\n", rs.rs_inactive);
+    iprintf(&buf, &size, "scanned_pages %lu\n", rs.rs_scanned);
+    iprintf(&buf, &size, "evicted_pages %lu\n", rs.rs_evicted);
+    iprintf(&buf, &size, "written_pages %lu\n", rs.rs_written);
+    iprintf(&buf, &size, "slab_shrinks %lu\n", rs.rs_slab_runs);
+    iprintf(&buf, &size, "slab_pages_freed %lu\n", rs.rs_slab_pages);
+    iprintf(&buf, &size, "oom_kills %lu\n", rs.rs_oom_kills);
+    iprintf(&buf, &size, "oom_pages %lu\n", rs.rs_oom_pages);
+    iprintf(&buf, &size, "compactions %lu\n", rs.rs_compact_runs);
+    iprintf(&buf, &size, "compacted_blocks %lu\n", rs.rs_compact_blocks);
+    iprintf(&buf, &size, "migrated_pages %lu\n", rs.rs_migrated);
+    iprintf(&buf, &size, "swap_slots %lu\n", ss.ss_slots);
+    iprintf(&buf, &size, "swap_used %lu\n", ss.ss_used);
+    iprintf(&buf, &size, "swap_out %lu\n", ss.ss_out);
+    iprintf(&buf, &size, "swap_in %lu\n", ss.ss_in);
+    iprintf(&buf, &size, "swap_compressed %lu\n", ss.ss_compressed);
+    iprintf(&buf, &size, "swap_compressed_pages %lu\n",
+            ss.ss_compressed_pages);
+    iprintf(&buf, &size, "swap_rejected %lu\n", ss.ss_rejected);
+    return 0;
+}
+
+static long procfs_slabinfo(proc_t *proc, char *buf, size_t size)
+{
+    slab_info(NULL, buf, size);
+    return 0;
+}
+
+static long procfs_diskstats(proc_t *proc, char *buf, size_t size)
+{
+    for (long i = 0; i < __NDISKS__; i++)
+    {
+        blockdev_t *bd = blockdev_lookup(MKDEVID(DISK_MAJOR, i));
+        if (!bd || !bd->bd_ops->submit)
+        {
+            continue;
+        }
+        iosched_stats_t st;
+        iosched_stats_get(bd, &st);
+        iprintf(&buf, &size,
+                "hda%ld reads=%lu writes=%lu blocks_read=%lu "
+                "blocks_written=%lu merges=%lu inflight=%lu errors=%lu "
+                "queue_cycles=%lu service_cycles=%lu\n",
+                i, st.is_reads, st.is_writes, st.is_blocks_read,
+                st.is_blocks_written, st.is_back_merges + st.is_front_merges,
+                st.is_inflight, st.is_errors, st.is_queue_cycles,
+                st.is_service_cycles);
+    }
+    return 0;
+}
+
+static long procfs_memgroups(proc_t *proc, char *buf, size_t size)
+{
+    memgroup_info(NULL, buf, size);
+    return 0;
+}
+
+static long procfs_schedstat(proc_t *proc, char *buf, size_t size)
+{
+    sched_stats_info(NULL, buf, size);
+    return 0;
+}
+
+static const procfs_entry_t procfs_root_entries[] = {
+    {"time", procfs_time},
+    {"meminfo", procfs_meminfo},
+    {"memgroups", procfs_memgroups},
+    {"slabinfo", procfs_slabinfo},
+    {"diskstats", procfs_diskstats},
+    {"schedstat", procfs_schedstat},
+};
+
+#define PROCFS_NROOT (sizeof(procfs_root_entries) / sizeof(procfs_entry_t))
+
+/*
+ * Files in a process's directory
+ */
+
+static long procfs_stat_file(proc_t *proc, char *buf, size_t size)
+{
+    proc_stat_info(proc, buf, size);
+    return 0;
+}
+
+static long procfs_status(proc_t *proc, char *buf, size_t size)
+{
+    /* it lists the children */
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&proc->p_children_lock);
+    proc_info(proc, buf, size);
+    spinlock_unlock(&proc->p_children_lock);
+    intr_setipl(ipl);
+    return 0;
+}
+
+static long procfs_maps(proc_t *proc, char *buf, size_t size)
+{
+    vmmap_t *map = proc->p_vmmap;
+    if (!map)
+    {
+        return 0;
+    }
+    /* waiting for the lock would block with the process list locked */
+    if (!rwlock_read_trylock(&map->vmm_lock))
+    {
+        return -EAGAIN;
+    }
+    vmmap_mapping_info(map, buf, size);
+    rwlock_read_unlock(&map->vmm_lock);
+    return 0;
+}
+
+static const procfs_entry_t procfs_pid_entries[] = {
+    {"stat", procfs_stat_file},
+    {"status", procfs_status},
+    {"maps", procfs_maps},
+};
+
+#define PROCFS_NPID (sizeof(procfs_pid_entries) / sizeof(procfs_entry_t))
+
+/*
+ * Filesystem operations
+ */
+static void procfs_read_vnode(fs_t *fs, vnode_t *vn);
+
+static fs_ops_t procfs_ops = {.read_vnode = procfs_read_vnode,
+                              .delete_vnode = NULL,
+                              .umount = NULL};
+
+/*
+ * vnode operations
+ */
+static ssize_t procfs_read(vnode_t *file, size_t pos, void *buf,
+                           size_t count);
+
+static ssize_t procfs_write(vnode_t *file, size_t pos, const void *buf,
+                            size_t count);
+
+static long procfs_mmap(vnode_t *file, mobj_t **ret);
+
+static long procfs_mknod(vnode_t *dir, const char *name, size_t namelen,
+                         int mode, devid_t devid, vnode_t **out);
+
+static long procfs_lookup(vnode_t *dir, const char *name, size_t namelen,
+                          vnode_t **out);
+
+static long procfs_link(vnode_t *dir, const char *name, size_t namelen,
+                        vnode_t *child);
+
+static long procfs_unlink(vnode_t *dir, const char *name, size_t namelen);
+
+static long procfs_rename(vnode_t *olddir, const char *oldname,
+                          size_t oldnamelen, vnode_t *newdir,
+                          const char *newname, size_t newnamelen);
+
+static long procfs_mkdir(vnode_t *dir, const char *name, size_t namelen,
+                         vnode_t **out);
+
+static long procfs_rmdir(vnode_t *dir, const char *name, size_t namelen);
+
+static ssize_t procfs_readdir(vnode_t *dir, size_t pos, struct dirent *d);
+
+static long procfs_stat(vnode_t *vn, stat_t *buf);
+
+static void procfs_truncate_file(vnode_t *file);
+
+static vnode_ops_t procfs_dir_vops = {.read = NULL,
+                                      .write = NULL,
+                                      .mmap = NULL,
+                                      .mknod = procfs_mknod,
+                                      .lookup = procfs_lookup,
+                                      .link = procfs_link,
+                                      .unlink = procfs_unlink,
+                                      .rename = procfs_rename,
+                                      .mkdir = procfs_mkdir,
+                                      .rmdir = procfs_rmdir,
+                                      .readdir = procfs_readdir,
+                                      .stat = procfs_stat,
+                                      .acquire = NULL,
+                                      .release = NULL,
+                                      .get_pframe = NULL,
+                                      .fill_pframe = NULL,
+                                      .flush_pframe = NULL,
+                                      .truncate_file = NULL};
+
+static vnode_ops_t procfs_file_vops = {.read = procfs_read,
+                                       .write = procfs_write,
+                                       .mmap = procfs_mmap,
+                                       .mknod = NULL,
+                                       .lookup = NULL,
+                                       .link = NULL,
+                                       .unlink = NULL,
+                                       .mkdir = NULL,
+                                       .rmdir = NULL,
+                                       .readdir = NULL,
+                                       .stat = procfs_stat,
+                                       .acquire = NULL,
+                                       .release = NULL,
+                                       .get_pframe = NULL,
+                                       .fill_pframe = NULL,
+                                       .flush_pframe = NULL,
+                                       .truncate_file = procfs_truncate_file};
+
+/*
+ * Function implementations
+ */
+
+long procfs_mount(fs_t *fs)
+{
+    fs->fs_vnode_allocator = slab_allocator_create("procfs_node",
+                                                   sizeof(vnode_t));
+    if (!fs->fs_vnode_allocator)
+    {
+        return -ENOMEM;
+    }
+    fs->fs_i = NULL;
+    fs->fs_ops = &procfs_ops;
+    fs->fs_nodcache = 1;
+    fs->fs_root = vget(fs, PROCFS_ROOT_INO);
+    return 0;
+}
+
+static void procfs_read_vnode(fs_t *fs, vnode_t *vn)
+{
+    vn->vn_i = NULL;
+    vn->vn_len = 0;
+    if (PROCFS_INO_INDEX(vn->vn_vno))
+    {
+        vn->vn_mode = S_IFREG;
+        vn->vn_ops = &procfs_file_vops;
+    }
+    else
+    {
+        vn->vn_mode = S_IFDIR;
+        vn->vn_ops = &procfs_dir_vops;
+    }
+}
+
+/* Parses a pid written in decimal, as in the root's names, or returns -1 */
+static pid_t procfs_parse_pid(const char *name, size_t namelen)
+{
+    if (!namelen || namelen > 5 || name[0] == '0')
+    {
+        return -1;
+    }
+    long pid = 0;
+    for (size_t i = 0; i < namelen; i++)
+    {
+        if (name[i] < '0' || name[i] > '9')
+        {
+            return -1;
+        }
+        pid = pid * 10 + (name[i] - '0');
+    }
+    return pid < PROC_MAX_COUNT ? (pid_t)pid : -1;
+}
+
+static long procfs_lookup(vnode_t *dir, const char *name, size_t namelen,
+                          vnode_t **out)
+{
+    pid_t pid = PROCFS_INO_PID(dir->vn_vno);
+    ino_t ino;
+    if (name_match(".", name, namelen))
+    {
+        ino = dir->vn_vno;
+    }
+    else if (name_match("..", name, namelen))
+    {
+        ino = PROCFS_ROOT_INO;
+    }
+    else
+    {
+        const procfs_entry_t *entries =
+            pid < 0 ? procfs_root_entries : procfs_pid_entries;
+        size_t nentries = pid < 0 ? PROCFS_NROOT : PROCFS_NPID;
+        size_t i = 0;
+        while (i < nentries && !name_match(entries[i].pe_name, name, namelen))
+        {
+            i++;
+        }
+        if (i < nentries)
+        {
+            ino = PROCFS_INO(pid, i + 1);
+        }
+        else if (pid < 0 && (pid = procfs_parse_pid(name, namelen)) > 0)
+        {
+            ino = PROCFS_INO(pid, 0);
+        }
+        else
+        {
+            return -ENOENT;
+        }
+        if (pid >= 0 && !proc_lookup(pid))
+        {
+            /* gone, or never was */
+            return -ENOENT;
+        }
+    }
+
+    if (ino == dir->vn_vno)
+    {
+        vref(dir);
+        *out = dir;
+    }
+    else
+    {
+        *out = vget(dir->vn_fs, ino);
+    }
+    return 0;
+}
+
+/*
+ * Positions 0 and 1 are "." and "..", then come the directory's entries, and
+ * in the root, after those, the process with pid p is at PROCFS_DOT_SLOTS +
+ * PROCFS_NROOT + p.
+ */
+static ssize_t procfs_readdir(vnode_t *dir, size_t pos, struct dirent *d)
+{
+    pid_t pid = PROCFS_INO_PID(dir->vn_vno);
+    const procfs_entry_t *entries =
+        pid < 0 ? procfs_root_entries : procfs_pid_entries;
+    size_t nentries = pid < 0 ? PROCFS_NROOT : PROCFS_NPID;
+    size_t next = pos + 1;
+    if (pos < PROCFS_DOT_SLOTS)
+    {
+        d->d_ino = pos ? PROCFS_ROOT_INO : dir->vn_vno;
+        strcpy(d->d_name, pos ? ".." : ".");
+    }
+    else if (pos < PROCFS_DOT_SLOTS + nentries)
+    {
+        size_t i = pos - PROCFS_DOT_SLOTS;
+        d->d_ino = PROCFS_INO(pid, i + 1);
+        strcpy(d->d_name, entries[i].pe_name);
+    }
+    else if (pid < 0)
+    {
+        pid_t p = proc_next_pid((pid_t)(pos - PROCFS_DOT_SLOTS - nentries));
+        if (p < 0)
+        {
+            return 0;
+        }
+        d->d_ino = PROCFS_INO(p, 0);
+        snprintf(d->d_name, sizeof(d->d_name), "%d", p);
+        next = PROCFS_DOT_SLOTS + nentries + p + 1;
+    }
+    else
+    {
+        return 0;
+    }
+    d->d_off = next;
+    return next - pos;
+}
+
+static long procfs_fill(ino_t ino, char *buf, size_t size)
+{
+    pid_t pid = PROCFS_INO_PID(ino);
+    size_t i = PROCFS_INO_INDEX(ino) - 1;
+    if (pid < 0)
+    {
+        KASSERT(i < PROCFS_NROOT);
+        return procfs_root_entries[i].pe_fill(NULL, buf, size);
+    }
+
+    KASSERT(i < PROCFS_NPID);
+    long ret;
+    while ((ret = proc_pid_info(pid, procfs_pid_entries[i].pe_fill, buf,
+                                size)) == -EAGAIN)
+    {
+        /* the process is changing its memory map; let it finish */
+        sched_yield();
+    }
+    return ret;
+}
+
+static ssize_t procfs_read(vnode_t *file, size_t pos, void *buf,
+                           size_t count)
+{
+    char *data = kmalloc(PROCFS_FILE_SIZE);
+    if (!data)
+    {
+        return -ENOMEM;
+    }
+    data[0] = '\0';
+    ssize_t ret = procfs_fill(file->vn_vno, data, PROCFS_FILE_SIZE);
+    if (!ret)
+    {
+        size_t len = strlen(data);
+        if (pos < len)
+        {
+            ret = (ssize_t)MIN(count, len - pos);
+            memcpy(buf, data + pos, (size_t)ret);
+        }
+    }
+    kfree(data);
+    return ret;
+}
+
+static long procfs_stat(vnode_t *vn, stat_t *buf)
+{
+    memset(buf, 0, sizeof(stat_t));
+    buf->st_mode = vn->vn_mode;
+    buf->st_ino = (int)vn->vn_vno;
+    buf->st_nlink = S_ISDIR(vn->vn_mode) ? 2 : 1;
+    buf->st_blksize = (int)PAGE_SIZE;
+    return 0;
+}
+
+/*
+ * Nothing can be changed
+ */
+
+static ssize_t procfs_write(vnode_t *file, size_t pos, const void *buf,
+                            size_t count)
+{
+    return -EROFS;
+}
+
+static long procfs_mmap(vnode_t *file, mobj_t **ret) { return -ENODEV; }
+
+static void procfs_truncate_file(vnode_t *file) {}
+
+static long procfs_mknod(vnode_t *dir, const char *name, size_t namelen,
+                         int mode, devid_t devid, vnode_t **out)
+{
+    return -EROFS;
+}
+
+static long procfs_link(vnode_t *dir, const char *name, size_t namelen,
+                        vnode_t *child)
+{
+    return -EROFS;
+}
+
+static long procfs_unlink(vnode_t *dir, const char *name, size_t namelen)
+{
+    return -EROFS;
+}
+
+static long procfs_rename(vnode_t *olddir, const char *oldname,
+                          size_t oldnamelen, vnode_t *newdir,
+                          const char *newname, size_t newnamelen)
+{
+    return -EROFS;
+}
+
+static long procfs_mkdir(vnode_t *dir, const char *name, size_t namelen,
+                         vnode_t **out)
+{
+    return -EROFS;
+}
+
+static long procfs_rmdir(vnode_t *dir, const char *name, size_t namelen)
+{
+    return -EROFS;
+}
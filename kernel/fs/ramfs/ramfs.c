@@ -337,6 +337,7 @@ static ssize_t ramfs_umount(fs_t *fs)
             kfree(rfs->rfs_inodes[i]);
         }
     }
+    kfree(rfs);
 
     return 0;
 }
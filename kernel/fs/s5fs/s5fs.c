@@ -3,6 +3,9 @@
 #include "kernel.h"
 #include <mm/slab.h>
 
+#include "config.h"
+
+#include "util/atomic.h"
 #include "util/debug.h"
 #include "util/printf.h"
 #include "util/string.h"
@@ -12,10 +15,13 @@
 #include "fs/dirent.h"
 #include "fs/file.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/stat.h"
 
 #include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/reclaim.h"
 
 static long s5_check_super(s5_super_t *super);
 
@@ -58,6 +64,9 @@ static long s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen);
 
 static long s5fs_readdir(vnode_t *vnode, size_t pos, struct dirent *d);
 
+static ssize_t s5fs_getdents(vnode_t *vnode, size_t *pos, struct dirent *d,
+                             size_t count);
+
 static long s5fs_stat(vnode_t *vnode, stat_t *ss);
 
 static void s5fs_truncate_file(vnode_t *vnode);
@@ -69,32 +78,169 @@ static long s5fs_get_pframe(vnode_t *vnode, size_t pagenum, long forwrite,
 
 static long s5fs_fill_pframe(vnode_t *vnode, pframe_t *pf);
 
+static long s5fs_flush_pframe(vnode_t *vnode, pframe_t *pf);
+
+static void s5fs_readahead(vnode_t *vnode, size_t pagenum, size_t npages);
+
+static void s5fs_writeback(fs_t *fs, uint64_t dirtied_before);
+
+static long s5fs_fsync(vnode_t *vnode, long datasync);
+
 fs_ops_t s5fs_fsops = {.read_vnode = s5fs_read_vnode,
                        .delete_vnode = s5fs_delete_vnode,
                        .umount = s5fs_umount,
-                       .sync = s5fs_sync};
+                       .sync = s5fs_sync,
+                       .writeback = s5fs_writeback};
+
+/*
+ * Operations that change metadata run as journal handles (see
+ * s5fs_journal.h), so that each one's changes are committed together.
+ */
+static ssize_t s5fs_journaled_write(vnode_t *vnode, size_t pos,
+                                    const void *buf, size_t len)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    s5_journal_begin(s5fs);
+    ssize_t ret = s5fs_write(vnode, pos, buf, len);
+    s5_journal_end(s5fs);
+    return ret;
+}
+
+/* Direct writes may allocate blocks and grow the file, so they are handles
+ * too; direct reads change nothing. */
+static ssize_t s5fs_direct_io(vnode_t *vnode, size_t pos,
+                              const struct iovec *iov, int iovcnt, long write)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    if (write)
+    {
+        s5_journal_begin(s5fs);
+    }
+    ssize_t ret = s5_direct_io(VNODE_TO_S5NODE(vnode), pos, iov, iovcnt, write);
+    if (write)
+    {
+        s5_journal_end(s5fs);
+    }
+    return ret;
+}
+
+static long s5fs_journaled_mknod(struct vnode *dir, const char *name,
+                                 size_t namelen, int mode, devid_t devid,
+                                 struct vnode **out)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(dir);
+    s5_journal_begin(s5fs);
+    long ret = s5fs_mknod(dir, name, namelen, mode, devid, out);
+    s5_journal_end(s5fs);
+    return ret;
+}
+
+static long s5fs_journaled_link(vnode_t *dir, const char *name,
+                                size_t namelen, vnode_t *child)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(dir);
+    s5_journal_begin(s5fs);
+    long ret = s5fs_link(dir, name, namelen, child);
+    s5_journal_end(s5fs);
+    return ret;
+}
+
+static long s5fs_journaled_unlink(vnode_t *dir, const char *name,
+                                  size_t namelen)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(dir);
+    s5_journal_begin(s5fs);
+    long ret = s5fs_unlink(dir, name, namelen);
+    s5_journal_end(s5fs);
+    return ret;
+}
+
+static long s5fs_journaled_rename(vnode_t *olddir, const char *oldname,
+                                  size_t oldnamelen, vnode_t *newdir,
+                                  const char *newname, size_t newnamelen)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(olddir);
+    s5_journal_begin(s5fs);
+    long ret = s5fs_rename(olddir, oldname, oldnamelen, newdir, newname,
+                           newnamelen);
+    s5_journal_end(s5fs);
+    return ret;
+}
+
+static long s5fs_journaled_mkdir(vnode_t *dir, const char *name,
+                                 size_t namelen, struct vnode **out)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(dir);
+    s5_journal_begin(s5fs);
+    long ret = s5fs_mkdir(dir, name, namelen, out);
+    s5_journal_end(s5fs);
+    return ret;
+}
+
+static long s5fs_journaled_rmdir(vnode_t *parent, const char *name,
+                                 size_t namelen)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(parent);
+    s5_journal_begin(s5fs);
+    long ret = s5fs_rmdir(parent, name, namelen);
+    s5_journal_end(s5fs);
+    return ret;
+}
+
+static void s5fs_journaled_truncate_file(vnode_t *vnode)
+{
+    s5_journal_begin(VNODE_TO_S5FS(vnode));
+    s5fs_truncate_file(vnode);
+    s5_journal_end(VNODE_TO_S5FS(vnode));
+}
+
+/* A page gotten for writing may have blocks allocated for it. */
+static long s5fs_journaled_get_pframe(vnode_t *vnode, size_t pagenum,
+                                      long forwrite, pframe_t **pfp)
+{
+    if (!forwrite)
+    {
+        return s5fs_get_pframe(vnode, pagenum, forwrite, pfp);
+    }
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    s5_journal_begin(s5fs);
+    long ret = s5fs_get_pframe(vnode, pagenum, forwrite, pfp);
+    s5_journal_end(s5fs);
+    return ret;
+}
+
+static long s5fs_journaled_flush_pframe(vnode_t *vnode, pframe_t *pf)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    s5_journal_begin(s5fs);
+    long ret = s5fs_flush_pframe(vnode, pf);
+    s5_journal_end(s5fs);
+    return ret;
+}
 
 static vnode_ops_t s5fs_dir_vops = {.read = NULL,
                                     .write = NULL,
                                     .mmap = NULL,
-                                    .mknod = s5fs_mknod,
+                                    .mknod = s5fs_journaled_mknod,
                                     .lookup = s5fs_lookup,
-                                    .link = s5fs_link,
-                                    .unlink = s5fs_unlink,
-                                    .rename = s5fs_rename,
-                                    .mkdir = s5fs_mkdir,
-                                    .rmdir = s5fs_rmdir,
+                                    .link = s5fs_journaled_link,
+                                    .unlink = s5fs_journaled_unlink,
+                                    .rename = s5fs_journaled_rename,
+                                    .mkdir = s5fs_journaled_mkdir,
+                                    .rmdir = s5fs_journaled_rmdir,
                                     .readdir = s5fs_readdir,
+                                    .getdents = s5fs_getdents,
                                     .stat = s5fs_stat,
                                     .acquire = NULL,
                                     .release = NULL,
-                                    .get_pframe = s5fs_get_pframe,
+                                    .get_pframe = s5fs_journaled_get_pframe,
                                     .fill_pframe = s5fs_fill_pframe,
                                     .flush_pframe = NULL,
-                                    .truncate_file = NULL};
+                                    .truncate_file = NULL,
+                                    .fsync = s5fs_fsync};
 
 static vnode_ops_t s5fs_file_vops = {.read = s5fs_read,
-                                     .write = s5fs_write,
+                                     .write = s5fs_journaled_write,
                                      .mmap = s5fs_mmap,
                                      .mknod = NULL,
                                      .lookup = NULL,
@@ -106,10 +252,13 @@ static vnode_ops_t s5fs_file_vops = {.read = s5fs_read,
                                      .stat = s5fs_stat,
                                      .acquire = NULL,
                                      .release = NULL,
-                                     .get_pframe = s5fs_get_pframe,
+                                     .get_pframe = s5fs_journaled_get_pframe,
                                      .fill_pframe = s5fs_fill_pframe,
-                                     .flush_pframe = NULL,
-                                     .truncate_file = s5fs_truncate_file};
+                                     .flush_pframe = s5fs_journaled_flush_pframe,
+                                     .readahead = s5fs_readahead,
+                                     .direct_io = s5fs_direct_io,
+                                     .truncate_file = s5fs_journaled_truncate_file,
+                                     .fsync = s5fs_fsync};
 
 /*
  * Initialize the passed-in fs_t. The only members of fs_t that are initialized
@@ -125,12 +274,24 @@ long s5fs_mount(fs_t *fs)
 
     KASSERT(fs);
 
+    unsigned major = DISK_MAJOR;
     if (sscanf(fs->fs_dev, "disk%d", &num) != 1)
     {
-        return -EINVAL;
+        if (sscanf(fs->fs_dev, "stripe%d", &num) == 1)
+        {
+            major = STRIPE_MAJOR;
+        }
+        else if (sscanf(fs->fs_dev, "ram%d", &num) == 1)
+        {
+            major = RAMDISK_MAJOR;
+        }
+        else
+        {
+            return -EINVAL;
+        }
     }
 
-    blockdev_t *dev = blockdev_lookup(MKDEVID(DISK_MAJOR, num));
+    blockdev_t *dev = blockdev_lookup(MKDEVID(major, num));
     if (!dev)
         return -EINVAL;
 
@@ -163,9 +324,38 @@ long s5fs_mount(fs_t *fs)
     }
 
     kmutex_init(&s5fs->s5f_mutex);
-
+    kmutex_init(&s5fs->s5f_sync_mutex);
+    s5fs->s5f_ndelayed = 0;
+    s5fs->s5f_discard = dev->bd_ops->discard != NULL;
+    s5fs->s5f_ndiscards = 0;
     s5fs->s5f_fs = fs;
 
+    /* replaying the journal brings the super block and the bitmaps to the
+     * last commit */
+    long ret = s5_journal_mount(s5fs);
+    if (ret)
+    {
+        kfree(s5fs);
+        slab_allocator_destroy(fs->fs_vnode_allocator);
+        fs->fs_vnode_allocator = NULL;
+        return ret;
+    }
+    s5_get_disk_block(s5fs, S5_SUPER_BLOCK, 0, &pf);
+    memcpy(&s5fs->s5f_super, pf->pf_addr, sizeof(s5_super_t));
+    s5_release_disk_block(&pf);
+
+    ret = s5_check_super(&s5fs->s5f_super) ? -EINVAL
+                                           : s5_init_groups(s5fs);
+    if (ret)
+    {
+        s5_journal_destroy(s5fs);
+        kfree(s5fs);
+        slab_allocator_destroy(fs->fs_vnode_allocator);
+        fs->fs_vnode_allocator = NULL;
+        return ret;
+    }
+    s5fs->s5f_alloc_rotor = S5_DATA_START(&s5fs->s5f_super);
+
     fs->fs_i = s5fs;
     fs->fs_ops = &s5fs_fsops;
     fs->fs_root = vget(fs, s5fs->s5f_super.s5s_root_inode);
@@ -207,6 +397,10 @@ static void s5fs_read_vnode(fs_t *fs, vnode_t *vn) /// verify
     //s5_node->inode = inode; //// memcopy instead
     memcpy(&s5_node->inode, inode, sizeof(s5_inode_t));
     s5_node->dirtied_inode = 0;
+    s5_node->ra_next = 0;
+    s5_node->ra_window = 0;
+    s5_node->ra_end = 0;
+    s5_node->bmap_len = 0;
     s5_release_disk_block(&pf);/// release here or later?
     
     if (s5_node->inode.s5_type == S5_TYPE_FREE){
@@ -278,6 +472,21 @@ static void s5fs_read_vnode(fs_t *fs, vnode_t *vn) /// verify
     //NOT_YET_IMPLEMENTED("S5FS: s5fs_read_vnode");
 }
 
+/*
+ * Copy a vnode's in-core inode into its inode block, which goes to the disk
+ * with the next writeback of the block.
+ */
+static void s5fs_write_inode(s5fs_t *s5fs, s5_node_t *sn)
+{
+    pframe_t *pf;
+    ino_t ino = sn->vnode.vn_vno;
+    s5_get_disk_block(s5fs, S5_INODE_BLOCK(ino), 1, &pf);
+    memcpy((s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(ino), &sn->inode,
+           sizeof(s5_inode_t));
+    s5_release_disk_block(&pf);
+    sn->dirtied_inode = 0;
+}
+
 /* Clean up the inode corresponding to the given vnode.
  *
  * Hints:
@@ -292,18 +501,18 @@ static void s5fs_read_vnode(fs_t *fs, vnode_t *vn) /// verify
 static void s5fs_delete_vnode(fs_t *fs, vnode_t *vn)
 {
     s5_node_t *s5_node = VNODE_TO_S5NODE(vn);
+    s5_journal_begin(FS_TO_S5FS(fs));
     if (s5_node->inode.s5_linkcount == 0)
     {
         s5_free_inode(FS_TO_S5FS(fs), vn->vn_vno);
+        /* a journal commit must not copy it back over the free inode */
+        s5_node->dirtied_inode = 0;
     }
     else if (s5_node->dirtied_inode)
     {
-        pframe_t *pf;
-        s5fs_t *s5fs = FS_TO_S5FS(fs);
-        s5_get_disk_block(s5fs, S5_INODE_BLOCK(vn->vn_vno), 1, &pf); /// 1 for write, right?
-        memcpy((s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(vn->vn_vno), &s5_node->inode, sizeof(s5_inode_t));
-        s5_release_disk_block(&pf);
+        s5fs_write_inode(FS_TO_S5FS(fs), s5_node);
     }
+    s5_journal_end(FS_TO_S5FS(fs));
     //NOT_YET_IMPLEMENTED("S5FS: s5fs_delete_vnode");
 }
 
@@ -340,24 +549,224 @@ static long s5fs_umount(fs_t *fs)
     vput(&fs->fs_root);
 
     s5fs_sync(fs);
+    s5_journal_destroy(s5fs);
+    kfree(s5fs->s5f_groups);
     kfree(s5fs);
     return 0;
 }
 
-static void s5fs_sync(fs_t *fs)
+/*
+ * Write back the pages of files dirtied before dirtied_before, allocating the
+ * blocks of those that have none yet; see s5_writeback_pages(). Vnodes that
+ * are not loaded yet, or already being torn down (which flushes them anyway),
+ * are skipped. Then commit the journal, so that metadata changes reach the
+ * disk as often as data does, and discard the blocks freed before the commit.
+ */
+static void s5fs_writeback(fs_t *fs, uint64_t dirtied_before)
 {
     s5fs_t *s5fs = FS_TO_S5FS(fs);
-    mobj_t *mobj = S5FS_TO_VMOBJ(s5fs);
+    for (size_t b = 0; b < VNODE_HASH_NBUCKETS; b++)
+    {
+        vnode_bucket_t *bucket = &fs->fs_vnode_hash[b];
+        vnode_t *vns[S5_DELALLOC_MAX_RUN];
+        size_t n = 0;
+        spinlock_lock(&bucket->vb_lock);
+        list_iterate(&bucket->vb_list, vn, vnode_t, vn_link)
+        {
+            if (n == S5_DELALLOC_MAX_RUN)
+            {
+                break;
+            }
+            if (vn->vn_state == VNODE_LOADED && S_ISREG(vn->vn_mode) &&
+                !list_empty(&vn->vn_mobj.mo_dirty) &&
+                atomic_inc_not_zero(&vn->vn_mobj.mo_refcount))
+            {
+                vns[n++] = vn;
+            }
+        }
+        spinlock_unlock(&bucket->vb_lock);
 
-    mobj_lock(mobj);
+        for (size_t i = 0; i < n; i++)
+        {
+            vlock(vns[i]);
+            s5_journal_begin(s5fs);
+            s5_writeback_pages(VNODE_TO_S5NODE(vns[i]), dirtied_before);
+            s5_journal_end(s5fs);
+            vput_locked(&vns[i]);
+        }
+    }
+    size_t ndiscards = 0;
+    blockdev_range_t *discards =
+        s5fs->s5f_journal ? s5_discard_take(s5fs, &ndiscards) : NULL;
+    long ret = s5_journal_commit(s5fs);
+    if (discards)
+    {
+        if (!ret)
+        {
+            s5_discard(s5fs, discards, ndiscards);
+        }
+        kfree(discards);
+    }
+}
+
+/*
+ * Copy the in-core inodes of n referenced vnodes to their blocks, getting
+ * each inode block once for all of its inodes, and put the vnodes. Each inode
+ * is copied out with its vnode locked, and written to its block after the
+ * vnode is unlocked, since a thread holding a vnode lock may be waiting for
+ * an inode block. copies has room for n inodes; if it is NULL, they are
+ * written one at a time instead.
+ */
+static void s5fs_write_inodes(s5fs_t *s5fs, vnode_t **vns, size_t n,
+                              s5_inode_t *copies)
+{
+    for (size_t i = 1; i < n; i++)
+    {
+        vnode_t *vn = vns[i];
+        size_t j = i;
+        for (; j > 0 && vns[j - 1]->vn_vno > vn->vn_vno; j--)
+        {
+            vns[j] = vns[j - 1];
+        }
+        vns[j] = vn;
+    }
 
+    kmutex_lock(&s5fs->s5f_sync_mutex);
+    for (size_t i = 0; i < n; i++)
+    {
+        s5_node_t *sn = VNODE_TO_S5NODE(vns[i]);
+        vlock(vns[i]);
+        if (copies)
+        {
+            copies[i] = sn->inode;
+            sn->dirtied_inode = 0;
+        }
+        else
+        {
+            s5fs_write_inode(s5fs, sn);
+        }
+        vunlock(vns[i]);
+    }
+    for (size_t i = 0; copies && i < n;)
+    {
+        pframe_t *pf;
+        blocknum_t block = S5_INODE_BLOCK(vns[i]->vn_vno);
+        s5_get_disk_block(s5fs, block, 1, &pf);
+        for (; i < n && S5_INODE_BLOCK(vns[i]->vn_vno) == block; i++)
+        {
+            memcpy((s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(vns[i]->vn_vno),
+                   &copies[i], sizeof(s5_inode_t));
+        }
+        s5_release_disk_block(&pf);
+    }
+    kmutex_unlock(&s5fs->s5f_sync_mutex);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        vput(&vns[i]);
+    }
+}
+
+/*
+ * Copy every dirty in-core inode to its block, in batches of
+ * S5_INODE_SYNC_BATCH sorted by inode number, so that inodes sharing a block
+ * are written to it together. Inodes are otherwise only written back when
+ * their vnodes are torn down.
+ */
+static void s5fs_sync_inodes(fs_t *fs)
+{
+    s5fs_t *s5fs = FS_TO_S5FS(fs);
+    vnode_t *vns[S5_INODE_SYNC_BATCH];
+    s5_inode_t *copies = kmalloc(S5_INODE_SYNC_BATCH * sizeof(s5_inode_t));
+    size_t n = 0;
+    for (size_t b = 0; b < VNODE_HASH_NBUCKETS; b++)
+    {
+        vnode_bucket_t *bucket = &fs->fs_vnode_hash[b];
+        /* a full batch is written out before the rest of the bucket is
+         * looked at, picking up after the vnodes already seen */
+        size_t seen = 0;
+        long more = 1;
+        while (more)
+        {
+            more = 0;
+            size_t skip = seen;
+            spinlock_lock(&bucket->vb_lock);
+            list_iterate(&bucket->vb_list, vn, vnode_t, vn_link)
+            {
+                if (skip)
+                {
+                    skip--;
+                    continue;
+                }
+                if (n == S5_INODE_SYNC_BATCH)
+                {
+                    more = 1;
+                    break;
+                }
+                seen++;
+                if (vn->vn_state == VNODE_LOADED &&
+                    VNODE_TO_S5NODE(vn)->dirtied_inode &&
+                    atomic_inc_not_zero(&vn->vn_mobj.mo_refcount))
+                {
+                    vns[n++] = vn;
+                }
+            }
+            spinlock_unlock(&bucket->vb_lock);
+            if (more)
+            {
+                s5fs_write_inodes(s5fs, vns, n, copies);
+                n = 0;
+            }
+        }
+    }
+    s5fs_write_inodes(s5fs, vns, n, copies);
+    if (copies)
+    {
+        kfree(copies);
+    }
+}
+
+/* Copy the in-core super block to its block. */
+static void s5fs_write_super(s5fs_t *s5fs)
+{
     pframe_t *pf;
-    mobj_get_pframe(mobj, S5_SUPER_BLOCK, 1, &pf);
+    s5_get_disk_block(s5fs, S5_SUPER_BLOCK, 1, &pf);
     memcpy(pf->pf_addr, &s5fs->s5f_super, sizeof(s5_super_t));
-    pframe_release(&pf);
+    s5_release_disk_block(&pf);
+}
+
+static void s5fs_sync(fs_t *fs)
+{
+    s5fs_t *s5fs = FS_TO_S5FS(fs);
 
-    mobj_flush(S5FS_TO_VMOBJ(s5fs));
-    mobj_unlock(S5FS_TO_VMOBJ(s5fs));
+    /* file pages first, since writing back those without blocks allocates
+     * blocks and so changes the inodes and the super block; a journal commit
+     * at the end of it takes care of those */
+    s5fs_writeback(fs, (uint64_t)-1);
+    size_t ndiscards = 0;
+    blockdev_range_t *discards = NULL;
+    if (!s5fs->s5f_journal)
+    {
+        /* with no journal, blocks freed so far are discarded once the bitmap
+         * that frees them has been written below */
+        discards = s5_discard_take(s5fs, &ndiscards);
+        s5fs_sync_inodes(fs);
+        s5fs_write_super(s5fs);
+    }
+
+    /* write everything back in clustered runs, then pick up any stragglers
+     * (e.g. pages whose clustered write failed) one at a time */
+    blockdev_writeback(s5fs->s5f_bdev, (uint64_t)-1, (size_t)-1);
+    long ret = blockdev_flush(s5fs->s5f_bdev);
+    ret = ret ? ret : blockdev_flush_cache(s5fs->s5f_bdev);
+    if (discards)
+    {
+        if (!ret)
+        {
+            s5_discard(s5fs, discards, ndiscards);
+        }
+        kfree(discards);
+    }
 }
 
 /* Wrapper around s5_read_file. */
@@ -448,7 +857,10 @@ static long s5fs_mknod(struct vnode *dir, const char *name, size_t namelen,
     s5fs_t *s5fs = FS_TO_S5FS(dir->vn_fs);
     s5_node_t *parent_dir = VNODE_TO_S5NODE(dir);
 
-    long alloc = s5_alloc_inode(s5fs, mode, devid);
+    uint16_t type = S_ISCHR(mode)   ? S5_TYPE_CHR
+                    : S_ISBLK(mode) ? S5_TYPE_BLK
+                                    : S5_TYPE_DATA;
+    long alloc = s5_alloc_inode(s5fs, type, devid, dir->vn_vno);
     if (alloc < 0)
     {
         return alloc;
@@ -494,7 +906,10 @@ long s5fs_lookup(vnode_t *dir, const char *name, size_t namelen,
     //s5fs_t *s5fs = FS_TO_S5FS(dir->vn_fs);
     s5_node_t s5_node;
 
+    /* dir may only be locked shared (see namev_dir()) */
+    long locked = s5_lock_pages(VNODE_TO_S5NODE(dir));
     int inode_num = s5_find_dirent(VNODE_TO_S5NODE(dir), name, namelen, NULL); /// what pos?
+    s5_unlock_pages(VNODE_TO_S5NODE(dir), locked);
     if (inode_num < 0)
     {
         return inode_num;
@@ -617,12 +1032,8 @@ static long s5fs_unlink(vnode_t *dir, const char *name, size_t namelen)
  */
 static long s5fs_rename(vnode_t *olddir, const char *oldname, size_t oldnamelen,
                         vnode_t *newdir, const char *newname,
-                        size_t newnamelen) /// not needed right?
+                        size_t newnamelen)
 {
-
-
-    // NOT_YET_IMPLEMENTED("S5FS: s5fs_rename");
-    // return -1;
     if (!S_ISDIR(newdir->vn_mode)){
         return -ENOTDIR;
     }
@@ -631,38 +1042,39 @@ static long s5fs_rename(vnode_t *olddir, const char *oldname, size_t oldnamelen,
         return -ENAMETOOLONG;
     }
     long old_node_num = s5_find_dirent(VNODE_TO_S5NODE(olddir), oldname, oldnamelen, NULL);
-    if (old_node_num == -ENOENT){
-        return -ENOENT;
+    if (old_node_num < 0){
+        return old_node_num;
     }
-
-    vnode_t *old_vnode = vget_locked(olddir->vn_fs, (ino_t)old_node_num);
     long new_node_num = s5_find_dirent(VNODE_TO_S5NODE(newdir), newname, newnamelen, NULL);
-    if (new_node_num == -ENOENT){
-        if (new_node_num == old_node_num){
-        vput_locked(&old_vnode);
+    if (new_node_num < 0 && new_node_num != -ENOENT){
+        return new_node_num;
+    }
+    if (new_node_num == old_node_num){
+        /* both names are links to the same file */
         return 0;
     }
-    vnode_t *new_vnode = vget_locked(newdir->vn_fs, (ino_t)new_node_num);
-    if (S_ISDIR(new_vnode->vn_mode)){
+
+    vnode_t *old_vnode = vget_locked(olddir->vn_fs, (ino_t)old_node_num);
+    if (S_ISDIR(old_vnode->vn_mode)){
+        /* its ".." would go stale */
         vput_locked(&old_vnode);
+        return -EPERM;
+    }
+    if (new_node_num >= 0){
+        vnode_t *new_vnode = vget_locked(newdir->vn_fs, (ino_t)new_node_num);
+        if (S_ISDIR(new_vnode->vn_mode)){
+            vput_locked(&old_vnode);
+            vput_locked(&new_vnode);
+            return -EISDIR;
+        }
+        s5_remove_dirent(VNODE_TO_S5NODE(newdir), newname, newnamelen, VNODE_TO_S5NODE(new_vnode));
         vput_locked(&new_vnode);
-        return -EISDIR;
     }
-    s5_remove_dirent(VNODE_TO_S5NODE(newdir), newname, newnamelen, VNODE_TO_S5NODE(new_vnode));
-    vput_locked(&new_vnode);
-    long status = s5_link(VNODE_TO_S5NODE(newdir), newname, newnamelen, VNODE_TO_S5NODE(old_vnode));  
+    long status = s5_link(VNODE_TO_S5NODE(newdir), newname, newnamelen, VNODE_TO_S5NODE(old_vnode));
     if (status != 0){
         vput_locked(&old_vnode);
         return status;
     }
-    }
-    else{
-        long status = s5_link(VNODE_TO_S5NODE(newdir), newname, newnamelen, VNODE_TO_S5NODE(old_vnode));  
-        if (status != 0){
-        vput_locked(&old_vnode);
-        return status;
-        }
-    }
 
     s5_remove_dirent(VNODE_TO_S5NODE(olddir), oldname, oldnamelen, VNODE_TO_S5NODE(old_vnode));
     vput_locked(&old_vnode);
@@ -697,7 +1109,8 @@ static long s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen,
                        struct vnode **out) /// verify 
 {
     KASSERT(S_ISDIR((dir)->vn_mode) && "should be handled at the VFS level");
-    long alloc_inode = s5_alloc_inode(VNODE_TO_S5FS(dir), S5_TYPE_DIR, 0); /// devid?
+    long alloc_inode =
+        s5_alloc_inode(VNODE_TO_S5FS(dir), S5_TYPE_DIR, 0, dir->vn_vno);
     if (alloc_inode < 0){
         return alloc_inode;
     }
@@ -843,6 +1256,13 @@ static long s5fs_readdir(vnode_t *vnode, size_t pos, struct dirent *d) /// verif
     return err; 
 }
 
+/* Read many directory entries at once; see s5_read_dirents(). */
+static ssize_t s5fs_getdents(vnode_t *vnode, size_t *pos, struct dirent *d,
+                             size_t count)
+{
+    return s5_read_dirents(VNODE_TO_S5NODE(vnode), pos, d, count);
+}
+
 /* Get file status.
  *
  *  vnode - The vnode of the file in question
@@ -909,20 +1329,168 @@ static void s5fs_truncate_file(vnode_t *file)
     
     // Call subroutine to free the blocks that were used 
     vlock(file); 
+    /* the cached pages are all past the end now; pages whose blocks were
+     * never allocated give their reservations back as they are flushed */
+    mobj_free_pframes(&file->vn_mobj);
     s5_remove_blocks(s5_node);  
     vunlock(file); 
 }
 
+/*
+ * Write back a file's blocks and wait for them: first its data (a regular
+ * file's pages, or a directory's blocks), then the blocks mapping it and its
+ * inode, so that the inode never points at data
+ * that is not on the disk yet; then, unless datasync is set, the free block
+ * and inode bitmaps and the super block, so that nothing the file uses can be
+ * handed out again after a crash. Indexed directories, whose index blocks are
+ * not found here, sync the whole file system instead.
+ *
+ * With a journal, everything after the data is done by a journal commit,
+ * which makes all of the metadata changed so far durable at once.
+ */
+static long s5fs_fsync(vnode_t *vnode, long datasync)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    s5_node_t *sn = VNODE_TO_S5NODE(vnode);
+    if (sn->inode.s5_flags & S5_FLAG_DIR_INDEX)
+    {
+        s5fs_sync(vnode->vn_fs);
+        return 0;
+    }
+    blocknum_t *blocks = page_alloc();
+    if (!blocks)
+    {
+        return -ENOMEM;
+    }
+    const size_t max = PAGE_SIZE / sizeof(blocknum_t);
+    blockdev_t *bd = s5fs->s5f_bdev;
+
+    long ret = 0;
+    kmutex_lock(&s5fs->s5f_sync_mutex);
+    vlock(vnode);
+    s5_journal_begin(s5fs);
+    if (S_ISREG(vnode->vn_mode))
+    {
+        ret = s5_writeback_pages(sn, (uint64_t)-1);
+    }
+    s5fs_write_inode(s5fs, sn);
+    s5_journal_end(s5fs);
+    kmutex_unlock(&s5fs->s5f_sync_mutex);
+
+    size_t n = 0;
+    size_t nfileblocks = S_ISREG(vnode->vn_mode)
+                             ? 0
+                             : S5_DATA_BLOCK(vnode->vn_len + S5_BLOCK_SIZE - 1);
+    for (size_t b = 0; b < nfileblocks && !ret; b++)
+    {
+        long loc = s5_file_block_to_disk_block(sn, b, 0);
+        if (loc < 0)
+        {
+            ret = loc;
+        }
+        else if (loc)
+        {
+            blocks[n++] = (blocknum_t)loc;
+        }
+        if (n == max || (n && b + 1 == nfileblocks))
+        {
+            ret = ret ? ret : blockdev_sync_blocks(bd, blocks, n);
+            n = 0;
+        }
+    }
+    n = 0;
+    if (s5fs->s5f_journal)
+    {
+        vunlock(vnode);
+        ret = ret ? ret : s5_journal_sync(s5fs);
+        page_free(blocks);
+        return ret;
+    }
+
+    if (sn->inode.s5_flags & S5_FLAG_EXTENTS)
+    {
+        for (size_t i = 0; sn->inode.s5_extent_header.s5eh_depth &&
+                           i < sn->inode.s5_extent_header.s5eh_nentries;
+             i++)
+        {
+            blocks[n++] = sn->inode.s5_extents[i].s5e_disk_block;
+        }
+    }
+    else if (!(sn->inode.s5_flags & S5_FLAG_INLINE) &&
+             sn->inode.s5_indirect_block)
+    {
+        blocks[n++] = sn->inode.s5_indirect_block;
+    }
+    blocks[n++] = S5_INODE_BLOCK(vnode->vn_vno);
+    vunlock(vnode);
+    if (!ret)
+    {
+        ret = blockdev_sync_blocks(bd, blocks, n);
+    }
+
+    if (!ret && !datasync)
+    {
+        s5_super_t *super = &s5fs->s5f_super;
+        s5fs_write_super(s5fs);
+        blocks[0] = S5_SUPER_BLOCK;
+        n = 1;
+        for (size_t i = 0; i < super->s5s_bitmap_nblocks && !ret; i++)
+        {
+            blocks[n++] = super->s5s_bitmap_block + i;
+            if (n == max)
+            {
+                ret = blockdev_sync_blocks(bd, blocks, n);
+                n = 0;
+            }
+        }
+        for (size_t i = 0; i < S5_IBITMAP_NBLOCKS(super) && !ret; i++)
+        {
+            blocks[n++] = super->s5s_ibitmap_block + i;
+            if (n == max)
+            {
+                ret = blockdev_sync_blocks(bd, blocks, n);
+                n = 0;
+            }
+        }
+        if (!ret)
+        {
+            ret = blockdev_sync_blocks(bd, blocks, n);
+        }
+    }
+    if (!ret)
+    {
+        ret = blockdev_flush_cache(bd);
+    }
+    page_free(blocks);
+    return ret;
+}
+
 /*
  * Wrapper around mobj_get_pframe. Remember to lock the memory object around
  * the call to mobj_get_pframe. Assert that the get_pframe does not fail.
+ *
+ * This is for metadata blocks: one gotten for writing joins the running
+ * journal transaction, so the caller must be in a journal handle.
  */
 inline void s5_get_disk_block(s5fs_t *s5fs, blocknum_t blocknum, long forwrite,
                               pframe_t **pfp)
 {
-    mobj_lock(S5FS_TO_VMOBJ(s5fs));
-    long ret = mobj_get_pframe(S5FS_TO_VMOBJ(s5fs), blocknum, forwrite, pfp);
-    mobj_unlock(S5FS_TO_VMOBJ(s5fs));
+    s5_get_data_block(s5fs, blocknum, forwrite, pfp);
+    if (forwrite)
+    {
+        s5_journal_dirty(s5fs, *pfp);
+    }
+}
+
+/* s5_get_disk_block() without joining the journal transaction, for a newly
+ * allocated block being zeroed: it is journaled once something is put in it. */
+void s5_get_data_block(s5fs_t *s5fs, blocknum_t blocknum, long forwrite,
+                       pframe_t **pfp)
+{
+    mobj_t *mobj = S5FS_TO_VMOBJ(s5fs, blocknum);
+    mobj_lock(mobj);
+    long ret = mobj_get_pframe(mobj, blocknum, forwrite, pfp);
+    mobj_unlock(mobj);
     KASSERT(!ret && *pfp);
 }
 
@@ -942,61 +1510,159 @@ inline void s5_release_disk_block(pframe_t **pfp) { pframe_release(pfp); }
  * This is where the abstraction of vnode file block/page --> disk block is
  * finally implemented. Check that the requested page lies within vnode->vn_len.
  *
- * Of course, you will want to use s5_file_block_to_disk_block. Pay attention
- * to what the forwrite argument to s5fs_get_pframe means for the alloc argument
- * in s5_file_block_to_disk_block.
- *
- * If the disk block for the corresponding file block is sparse, you should use
- * mobj_default_get_pframe on the vnode's own memory object. This will trickle
- * down to s5fs_fill_pframe if the pframe is not already resident.
- *
- * Otherwise, if the disk block is NOT sparse, you will want to simply use
- * s5_get_disk_block. NOTE: in this case, you also need to make sure you free
- * the pframe that resides in the vnode itself for the requested pagenum. To
- * do so, you will want to use mobj_find_pframe and mobj_free_pframe.
+ * The pages of a regular file live in the vnode's own memory object, at their
+ * page numbers in the file, and nowhere else: s5fs_fill_pframe() reads a page
+ * from its disk block (or zeroes it if it has none, or copies it out of an
+ * inline file's inode), readahead reads runs of pages straight into it, and
+ * s5fs_flush_pframe() writes pages back to their blocks. The buffer cache (the
+ * block device's memory object) only holds metadata, which includes the
+ * blocks of directories: their pages are gotten from there, by disk block.
  *
- * Given the above design, we s5fs itself does not need to implement
- * flush_pframe. Any pframe that will be written to (forwrite = 1) should always
- * have a disk block backing it on successful return. Thus, the page frame will
- * reside in the block device of the filesystem, where the flush_pframe is
- * already implemented. We do, however, need to implement fill_pframe for sparse
- * blocks.
+ * A page of a regular file gotten for writing needs a block to go to. That of
+ * an extent-mapped file is allocated when the page is written back (see
+ * s5_flush_pages()), so that runs of pages get runs of blocks; only a free
+ * block is reserved for it here, once per page dirtied. Other files get their
+ * blocks allocated right away, once the page has been filled (with zeros,
+ * since it had none).
  */
 static long s5fs_get_pframe(vnode_t *vnode, uint64_t pagenum, long forwrite,
                             pframe_t **pfp)
 {
     if (vnode->vn_len <= pagenum * PAGE_SIZE)
         return -EINVAL;
-    long loc =
-        s5_file_block_to_disk_block(VNODE_TO_S5NODE(vnode), pagenum, forwrite);
+    s5_node_t *sn = VNODE_TO_S5NODE(vnode);
+    mobj_t *o = &vnode->vn_mobj;
+    if (!S_ISREG(vnode->vn_mode))
+    {
+        long loc = s5_file_block_to_disk_block(sn, pagenum, forwrite);
+        if (loc < 0)
+            return loc;
+        if (!loc)
+            return mobj_default_get_pframe(o, pagenum, 0, pfp);
+        s5_get_disk_block(VNODE_TO_S5FS(vnode), (blocknum_t)loc, forwrite,
+                          pfp);
+        return 0;
+    }
+    if (!forwrite || (sn->inode.s5_flags & S5_FLAG_INLINE))
+    {
+        /* an inline file's page is flushed into its inode */
+        return mobj_default_get_pframe(o, pagenum, forwrite, pfp);
+    }
+
+    /* a dirty page has its block, or a reservation for one, already */
+    mobj_find_pframe(o, pagenum, pfp);
+    if (*pfp && (*pfp)->pf_dirty)
+    {
+        reclaim_lru_touch(*pfp);
+        return 0;
+    }
+    if (*pfp)
+    {
+        pframe_release(pfp);
+    }
+    long loc = s5_file_block_to_disk_block(sn, pagenum, 0);
     if (loc < 0)
         return loc;
     if (loc)
+        return mobj_default_get_pframe(o, pagenum, 1, pfp);
+
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    long delalloc = sn->inode.s5_flags & S5_FLAG_EXTENTS;
+    if (delalloc)
+    {
+        long ret = s5_delalloc_reserve(s5fs);
+        if (ret < 0)
+            return ret;
+    }
+    long ret = mobj_default_get_pframe(o, pagenum, 1, pfp);
+    if (ret < 0 || delalloc)
     {
-        mobj_find_pframe(&vnode->vn_mobj, pagenum, pfp);
-        if (*pfp)
+        if (ret < 0 && delalloc)
+            s5_delalloc_release(s5fs, 1);
+        return ret;
+    }
+    loc = s5_file_block_to_disk_block(sn, pagenum, 1);
+    if (loc < 0)
+    {
+        /* it is a page of zeros, for a hole */
+        mobj_clean_pframe(o, *pfp);
+        pframe_release(pfp);
+        return loc;
+    }
+    return 0;
+}
+
+/*
+ * Fill a page of a regular file from its disk block, or, for a page that has
+ * none (a hole, or any page of a directory that s5fs_get_pframe() would not
+ * find in the buffer cache), with zeros. An inline file's page is filled from
+ * its inode.
+ */
+static long s5fs_fill_pframe(vnode_t *vnode, pframe_t *pf)
+{
+    s5_node_t *sn = VNODE_TO_S5NODE(vnode);
+    s5_inode_t *inode = &sn->inode;
+    if (S_ISREG(vnode->vn_mode) && !(inode->s5_flags & S5_FLAG_INLINE))
+    {
+        long loc = s5_file_block_to_disk_block(sn, pf->pf_pagenum, 0);
+        if (loc < 0)
+        {
+            return loc;
+        }
+        if (loc)
         {
-            mobj_free_pframe(&vnode->vn_mobj, pfp);
+            return blockdev_rw_pframes(VNODE_TO_S5FS(vnode)->s5f_bdev,
+                                       (blocknum_t)loc, &pf, 1, 0);
         }
-        s5_get_disk_block(VNODE_TO_S5FS(vnode), (blocknum_t)loc, forwrite, pfp);
+    }
+    page_zero(pf->pf_addr);
+    if (inode->s5_flags & S5_FLAG_INLINE)
+    {
+        memcpy(pf->pf_addr, inode->s5_inline,
+               MIN(inode->s5_un.s5_size, S5_INLINE_MAX));
+    }
+    return 0;
+}
+
+/*
+ * Write a dirty page of a regular file to its block, allocating the block if
+ * the page was written before it had one; see s5_flush_pages(). Pages of a
+ * file that has been removed, or that are past its end, are simply dropped,
+ * giving back their blocks' reservations if they had no blocks. The page of
+ * an inline file is copied into its inode.
+ */
+static long s5fs_flush_pframe(vnode_t *vnode, pframe_t *pf)
+{
+    s5_node_t *sn = VNODE_TO_S5NODE(vnode);
+    if (sn->inode.s5_flags & S5_FLAG_INLINE)
+    {
+        size_t size = MIN(sn->inode.s5_un.s5_size, S5_INLINE_MAX);
+        memcpy(sn->inode.s5_inline, pf->pf_addr, size);
+        memset(sn->inode.s5_inline + size, 0, S5_INLINE_MAX - size);
+        sn->dirtied_inode = 1;
         return 0;
     }
-    else
+    if (!sn->inode.s5_linkcount || pf->pf_pagenum * PAGE_SIZE >= vnode->vn_len)
     {
-        KASSERT(!forwrite);
-        return mobj_default_get_pframe(&vnode->vn_mobj, pagenum, forwrite, pfp);
+        if (!s5_file_block_to_disk_block(sn, pf->pf_pagenum, 0))
+        {
+            s5_delalloc_release(VNODE_TO_S5FS(vnode), 1);
+        }
+        return 0;
     }
+    return s5_flush_pages(sn, pf);
 }
 
 /*
- * According the documentation for s5fs_get_pframe, this only gets called when
- * the file block for a given page number is sparse. In other words, pf
- * corresponds to a sparse block.
+ * Pages backed by disk blocks are read into the vnode's own memory object,
+ * where s5fs_get_pframe() looks for them.
  */
-static long s5fs_fill_pframe(vnode_t *vnode, pframe_t *pf)
+static void s5fs_readahead(vnode_t *vnode, size_t pagenum, size_t npages)
 {
-    memset(pf->pf_addr, 0, PAGE_SIZE);
-    return 0;
+    s5_node_t *sn = VNODE_TO_S5NODE(vnode);
+    long locked = s5_lock_pages(sn);
+    s5_readahead_range(sn, pagenum, pagenum + npages);
+    s5_unlock_pages(sn, locked);
 }
 
 /*
@@ -1005,18 +1671,41 @@ static long s5fs_fill_pframe(vnode_t *vnode, pframe_t *pf)
 static long s5_check_super(s5_super_t *super)
 {
     if (!(super->s5s_magic == S5_MAGIC &&
-          (super->s5s_free_inode < super->s5s_num_inodes ||
-           super->s5s_free_inode == (uint32_t)-1) &&
+          super->s5s_nfree_inodes < super->s5s_num_inodes &&
           super->s5s_root_inode < super->s5s_num_inodes))
     {
         return -1;
     }
-    if (super->s5s_version != S5_CURRENT_VERSION)
+    if (super->s5s_version < S5_MIN_VERSION ||
+        super->s5s_version > S5_CURRENT_VERSION)
     {
         dbg(DBG_PRINT,
             "Filesystem is version %d; "
-            "only version %d is supported.\n",
-            super->s5s_version, S5_CURRENT_VERSION);
+            "only versions %d to %d are supported.\n",
+            super->s5s_version, S5_MIN_VERSION, S5_CURRENT_VERSION);
+        return -1;
+    }
+    if ((super->s5s_version < 7 && super->s5s_journal_nblocks) ||
+        (super->s5s_journal_nblocks && super->s5s_journal_nblocks < 4))
+    {
+        dbg(DBG_PRINT, "Filesystem has an invalid journal.\n");
+        return -1;
+    }
+
+    /* the block bitmap follows the inode blocks and covers the whole disk,
+     * and the inode bitmap follows it */
+    uint32_t data_start = S5_DATA_START(super);
+    if (super->s5s_bitmap_block !=
+            S5_INODE_BLOCK(super->s5s_num_inodes - 1) + 1 ||
+        super->s5s_ibitmap_block !=
+            super->s5s_bitmap_block + super->s5s_bitmap_nblocks ||
+        (uint64_t)super->s5s_bitmap_nblocks * S5_BITS_PER_BITMAP_BLOCK <
+            super->s5s_num_blocks ||
+        data_start > super->s5s_num_blocks ||
+        super->s5s_nfree > super->s5s_num_blocks - data_start)
+    {
+        dbg(DBG_PRINT, "Filesystem has an invalid free block or inode "
+                       "bitmap.\n");
         return -1;
     }
     return 0;
@@ -0,0 +1,712 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/writeback.h"
+
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_subr.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+/*
+ * Write-ahead journal of metadata blocks (see s5fs_journal.h for the idea and
+ * s5fs.h for the on-disk format).
+ *
+ * The journal keeps what is on the disk recoverable as follows. A record is
+ * only written over after the record before it has been checkpointed, i.e.
+ * after every block it logged has either reached its place or been logged
+ * again by the record after it. So at any time, each block whose last
+ * committed contents are not in place is logged by the newest intact record,
+ * and replaying that record alone brings the disk to the last commit.
+ *
+ * File data is not journaled, and is not ordered against the metadata
+ * pointing to it, except by fsync(), which writes a file's data before
+ * committing.
+ *
+ * The disk may keep completed writes in a volatile cache and reach stable
+ * media in any order, so the orderings above are kept with cache flushes
+ * rather than by waiting for writes alone. Each record is written after a
+ * flush, which makes the previous checkpoint (and any file data written so
+ * far) durable before the record that lets its own record be written over;
+ * and the record is written with FUA, so that it is durable, and the commit
+ * with it, before its blocks are checkpointed. That is one flush per commit,
+ * however many blocks it logs.
+ */
+
+/* A transaction this full wakes the writeback thread to commit it early */
+#define S5_JOURNAL_FULL(j) ((j)->j_nblocks * 4 >= (j)->j_max_blocks * 3)
+
+#define S5_JOURNAL_CHECKSUM_INIT 2166136261U
+#define S5_JOURNAL_CHECKSUM_PRIME 16777619U
+
+static uint32_t s5_journal_checksum(uint32_t c, const void *block)
+{
+    const uint32_t *w = block;
+    for (size_t i = 0; i < S5_BLOCK_SIZE / sizeof(uint32_t); i++)
+    {
+        c = (c ^ w[i]) * S5_JOURNAL_CHECKSUM_PRIME;
+    }
+    return c;
+}
+
+/* The checksum of a record whose header and n blocks are in pages */
+static uint32_t s5_journal_record_checksum(void **pages, size_t n)
+{
+    s5_journal_header_t *hdr = pages[0];
+    uint32_t saved = hdr->s5jh_checksum;
+    hdr->s5jh_checksum = 0;
+    uint32_t c = s5_journal_checksum(S5_JOURNAL_CHECKSUM_INIT, hdr);
+    hdr->s5jh_checksum = saved;
+    for (size_t i = 1; i <= n; i++)
+    {
+        c = s5_journal_checksum(c, pages[i]);
+    }
+    return c;
+}
+
+/*
+ * Transfer n pages to or from n consecutive blocks of the disk starting at
+ * block, in bios of up to BLOCKDEV_CLUSTER_BLOCKS blocks that are started
+ * together, and wait for them. Writes are forced to stable media, with FUA or
+ * a cache flush after them. Returns 0 or the first error.
+ */
+static long s5_journal_rw(s5_journal_t *j, blocknum_t block, void **pages,
+                          size_t n, long write)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        j->j_vecs[i].bv_phys = pt_virt_to_phys((uintptr_t)pages[i]);
+        j->j_vecs[i].bv_len = BLOCK_SIZE;
+    }
+
+    size_t nbios = 0;
+    blockdev_plug(j->j_bdev);
+    for (size_t i = 0; i < n; i += BLOCKDEV_CLUSTER_BLOCKS)
+    {
+        bio_t *bio = &j->j_bios[nbios++];
+        bio_prepare_vec(bio, j->j_bdev, block + (blocknum_t)i, j->j_vecs + i,
+                        MIN(n - i, (size_t)BLOCKDEV_CLUSTER_BLOCKS), write);
+        bio->bio_fua = write;
+        long ret = bio_submit(bio);
+        if (ret)
+        {
+            bio_complete(bio, ret);
+        }
+    }
+    blockdev_unplug(j->j_bdev);
+
+    long ret = 0;
+    for (size_t b = 0; b < nbios; b++)
+    {
+        long err = bio_wait(&j->j_bios[b]);
+        ret = ret ? ret : err;
+    }
+    if (!ret && write && !j->j_bdev->bd_fua)
+    {
+        ret = blockdev_flush_cache(j->j_bdev);
+    }
+    return ret;
+}
+
+/*
+ * Overwrite the headers of both records, so that neither is replayed, once
+ * the blocks written to their places so far are durable.
+ */
+static long s5_journal_erase(s5_journal_t *j)
+{
+    long ret = blockdev_flush_cache(j->j_bdev);
+    if (ret)
+    {
+        return ret;
+    }
+    memset(j->j_pages[0], 0, S5_BLOCK_SIZE);
+    ret = s5_journal_rw(j, j->j_start, j->j_pages, 1, 1);
+    long ret2 = s5_journal_rw(j, j->j_start + j->j_half, j->j_pages, 1, 1);
+    return ret ? ret : ret2;
+}
+
+/*
+ * Read the record in the given half of the journal into j_pages. Returns 1 if
+ * it is intact, 0 if it is not (or there is none), or an error.
+ */
+static long s5_journal_read_record(s5fs_t *s5fs, s5_journal_t *j, size_t half)
+{
+    blocknum_t start = j->j_start + (blocknum_t)(half * j->j_half);
+    long ret = s5_journal_rw(j, start, j->j_pages, 1, 0);
+    if (ret)
+    {
+        return ret;
+    }
+    s5_journal_header_t *hdr = j->j_pages[0];
+    if (hdr->s5jh_magic != S5_JOURNAL_MAGIC || !hdr->s5jh_nblocks ||
+        hdr->s5jh_nblocks > j->j_max_blocks)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < hdr->s5jh_nblocks; i++)
+    {
+        blocknum_t b = hdr->s5jh_blocks[i];
+        if (b >= s5fs->s5f_super.s5s_num_blocks ||
+            (b >= j->j_start && b < j->j_start + 2 * j->j_half))
+        {
+            return 0;
+        }
+    }
+    ret = s5_journal_rw(j, start + 1, j->j_pages + 1, hdr->s5jh_nblocks, 0);
+    if (ret)
+    {
+        return ret;
+    }
+    return hdr->s5jh_checksum ==
+           s5_journal_record_checksum(j->j_pages, hdr->s5jh_nblocks);
+}
+
+/*
+ * Bring the disk to its last commit by writing the blocks logged by the
+ * newest intact record to their places, then erase both records. The super
+ * block may have been among them, so the caller reads it again.
+ */
+static long s5_journal_replay(s5fs_t *s5fs, s5_journal_t *j)
+{
+    long newest = -1;
+    uint32_t newest_seq = 0;
+    for (size_t half = 0; half < 2; half++)
+    {
+        long ret = s5_journal_read_record(s5fs, j, half);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        uint32_t seq = ((s5_journal_header_t *)j->j_pages[0])->s5jh_seq;
+        if (ret && (newest < 0 || (int32_t)(seq - newest_seq) > 0))
+        {
+            newest = (long)half;
+            newest_seq = seq;
+        }
+    }
+    if (newest < 0)
+    {
+        return s5_journal_erase(j);
+    }
+
+    if (newest == 0)
+    {
+        long ret = s5_journal_read_record(s5fs, j, 0);
+        if (ret <= 0)
+        {
+            return ret ? ret : -EIO;
+        }
+    }
+    s5_journal_header_t *hdr = j->j_pages[0];
+    size_t n = hdr->s5jh_nblocks;
+    for (size_t i = 0; i < n; i++)
+    {
+        pframe_t *pf;
+        j->j_commit_blocks[i] = hdr->s5jh_blocks[i];
+        s5_get_disk_block(s5fs, hdr->s5jh_blocks[i], 1, &pf);
+        memcpy(pf->pf_addr, j->j_pages[i + 1], S5_BLOCK_SIZE);
+        s5_release_disk_block(&pf);
+    }
+    long ret = blockdev_sync_blocks(j->j_bdev, j->j_commit_blocks, n);
+    if (ret)
+    {
+        return ret;
+    }
+    dbg(DBG_PRINT, "s5fs: replayed journal record %u (%lu blocks)\n",
+        newest_seq, n);
+    j->j_seq = newest_seq + 1;
+    return s5_journal_erase(j);
+}
+
+void s5_journal_destroy(s5fs_t *s5fs)
+{
+    s5_journal_t *j = s5fs->s5f_journal;
+    if (!j)
+    {
+        return;
+    }
+    dbg(DBG_S5FS, "journal: %lu commits, %lu blocks logged, %lu overflows\n",
+        j->j_ncommits, j->j_nlogged, j->j_noverflows);
+    for (size_t i = 0; j->j_pages && i <= j->j_max_blocks; i++)
+    {
+        if (j->j_pages[i])
+        {
+            page_free(j->j_pages[i]);
+        }
+    }
+    if (j->j_pages)
+    {
+        kfree(j->j_pages);
+    }
+    if (j->j_blocks)
+    {
+        kfree(j->j_blocks);
+    }
+    if (j->j_commit_blocks)
+    {
+        kfree(j->j_commit_blocks);
+    }
+    if (j->j_vecs)
+    {
+        kfree(j->j_vecs);
+    }
+    if (j->j_bios)
+    {
+        kfree(j->j_bios);
+    }
+    kfree(j);
+    s5fs->s5f_journal = NULL;
+}
+
+/*
+ * Set up the journal of a file system whose super block has been read, if it
+ * has one, and replay it. Returns 0, or an error if the journal could not be
+ * set up or replayed, in which case the file system must not be mounted.
+ */
+long s5_journal_mount(s5fs_t *s5fs)
+{
+    s5_super_t *super = &s5fs->s5f_super;
+    s5fs->s5f_journal = NULL;
+    if (!super->s5s_journal_nblocks)
+    {
+        return 0;
+    }
+
+    s5_journal_t *j = kmalloc(sizeof(s5_journal_t));
+    if (!j)
+    {
+        return -ENOMEM;
+    }
+    memset(j, 0, sizeof(s5_journal_t));
+    s5fs->s5f_journal = j;
+    spinlock_init(&j->j_lock);
+    sched_queue_init(&j->j_thaw_waitq);
+    sched_queue_init(&j->j_commit_waitq);
+    kmutex_init(&j->j_commit_mutex);
+    j->j_bdev = s5fs->s5f_bdev;
+    j->j_start = S5_JOURNAL_START(super);
+    j->j_half = super->s5s_journal_nblocks / 2;
+    j->j_max_blocks = MIN(j->j_half - 1, S5_JOURNAL_MAX_BLOCKS);
+    j->j_seq = 1;
+
+    size_t npages = j->j_max_blocks + 1;
+    j->j_blocks = kmalloc(j->j_max_blocks * sizeof(blocknum_t));
+    j->j_commit_blocks = kmalloc(j->j_max_blocks * sizeof(blocknum_t));
+    j->j_vecs = kmalloc(npages * sizeof(bio_vec_t));
+    j->j_bios = kmalloc(npages * sizeof(bio_t));
+    j->j_pages = kmalloc(npages * sizeof(void *));
+    if (j->j_pages)
+    {
+        memset(j->j_pages, 0, npages * sizeof(void *));
+    }
+    long ret = 0;
+    if (!j->j_blocks || !j->j_commit_blocks || !j->j_vecs || !j->j_bios ||
+        !j->j_pages)
+    {
+        ret = -ENOMEM;
+    }
+    for (size_t i = 0; !ret && i < npages; i++)
+    {
+        j->j_pages[i] = page_alloc();
+        ret = j->j_pages[i] ? 0 : -ENOMEM;
+    }
+
+    /* nothing is pinned while the record is replayed */
+    s5fs->s5f_journal = NULL;
+    if (!ret)
+    {
+        ret = s5_journal_replay(s5fs, j);
+    }
+    s5fs->s5f_journal = j;
+    if (ret)
+    {
+        dbg(DBG_PRINT, "s5fs: could not set up the journal: %ld\n", ret);
+        s5_journal_destroy(s5fs);
+    }
+    return ret;
+}
+
+void s5_journal_begin(s5fs_t *s5fs)
+{
+    s5_journal_t *j = s5fs->s5f_journal;
+    if (!j)
+    {
+        return;
+    }
+    spinlock_lock(&j->j_lock);
+    while (j->j_frozen)
+    {
+        sched_sleep_on(&j->j_thaw_waitq, &j->j_lock);
+        spinlock_lock(&j->j_lock);
+    }
+    j->j_nhandles++;
+    spinlock_unlock(&j->j_lock);
+}
+
+/*
+ * The last operation to end hands the journal over to a commit waiting for
+ * it, frozen, so that no new operation can slip in first.
+ */
+void s5_journal_end(s5fs_t *s5fs)
+{
+    s5_journal_t *j = s5fs->s5f_journal;
+    if (!j)
+    {
+        return;
+    }
+    long full = 0;
+    spinlock_lock(&j->j_lock);
+    KASSERT(j->j_nhandles);
+    if (!--j->j_nhandles && j->j_commit_waiting)
+    {
+        j->j_commit_waiting = 0;
+        j->j_frozen = 1;
+        sched_wakeup_on(&j->j_commit_waitq, NULL);
+    }
+    else
+    {
+        full = S5_JOURNAL_FULL(j);
+    }
+    spinlock_unlock(&j->j_lock);
+    if (full)
+    {
+        writeback_kick();
+    }
+}
+
+/*
+ * Add a metadata block about to be changed to the running transaction, and
+ * pin it there. The pframe must be locked. A block that does not fit is left
+ * unpinned, and the transaction marked as having overflowed.
+ */
+void s5_journal_dirty(s5fs_t *s5fs, pframe_t *pf)
+{
+    s5_journal_t *j = s5fs->s5f_journal;
+    if (!j)
+    {
+        return;
+    }
+    KASSERT(pframe_owned(pf));
+    blocknum_t block = (blocknum_t)pf->pf_pagenum;
+    spinlock_lock(&j->j_lock);
+    size_t i = 0;
+    while (i < j->j_nblocks && j->j_blocks[i] != block)
+    {
+        i++;
+    }
+    if (i == j->j_nblocks)
+    {
+        if (i < j->j_max_blocks)
+        {
+            j->j_blocks[j->j_nblocks++] = block;
+            pf->pf_pinned++;
+        }
+        else
+        {
+            j->j_overflow = 1;
+        }
+    }
+    spinlock_unlock(&j->j_lock);
+}
+
+/*
+ * Take a block that is being freed out of the running transaction, and unpin
+ * it: what it held no longer matters, and must neither be logged nor be
+ * written over whatever goes there next (file data, which reaches the disk
+ * without going through the block's pframe). The pframe must be locked.
+ */
+void s5_journal_forget(s5fs_t *s5fs, pframe_t *pf)
+{
+    s5_journal_t *j = s5fs->s5f_journal;
+    if (!j)
+    {
+        return;
+    }
+    KASSERT(pframe_owned(pf));
+    blocknum_t block = (blocknum_t)pf->pf_pagenum;
+    spinlock_lock(&j->j_lock);
+    for (size_t i = 0; i < j->j_nblocks; i++)
+    {
+        if (j->j_blocks[i] == block)
+        {
+            j->j_blocks[i] = j->j_blocks[--j->j_nblocks];
+            KASSERT(pf->pf_pinned);
+            pf->pf_pinned--;
+            break;
+        }
+    }
+    spinlock_unlock(&j->j_lock);
+}
+
+/* Wait until no operations are in progress, and keep new ones out. */
+static void s5_journal_freeze(s5_journal_t *j)
+{
+    spinlock_lock(&j->j_lock);
+    if (j->j_nhandles)
+    {
+        j->j_commit_waiting = 1;
+        while (!j->j_frozen)
+        {
+            sched_sleep_on(&j->j_commit_waitq, &j->j_lock);
+            spinlock_lock(&j->j_lock);
+        }
+    }
+    else
+    {
+        j->j_frozen = 1;
+    }
+    spinlock_unlock(&j->j_lock);
+}
+
+static void s5_journal_thaw(s5_journal_t *j)
+{
+    spinlock_lock(&j->j_lock);
+    j->j_frozen = 0;
+    spinlock_unlock(&j->j_lock);
+    sched_broadcast_on(&j->j_thaw_waitq);
+}
+
+/*
+ * Copy the in-core inodes changed since the last commit, and the super block,
+ * to their blocks, and so into the running transaction. The journal is
+ * frozen, so none of them is changing; vnodes are only looked at under their
+ * buckets' locks, which keeps them from being freed, and their inodes copied
+ * out there, a page's worth at a time, to be written to their blocks after.
+ */
+static void s5_journal_copy_inodes(s5fs_t *s5fs, s5_inode_t *copies)
+{
+    fs_t *fs = s5fs->s5f_fs;
+    const size_t max = S5_BLOCK_SIZE / sizeof(s5_inode_t);
+    for (size_t b = 0; b < VNODE_HASH_NBUCKETS; b++)
+    {
+        vnode_bucket_t *bucket = &fs->fs_vnode_hash[b];
+        size_t seen = 0;
+        long more = 1;
+        while (more)
+        {
+            more = 0;
+            size_t n = 0;
+            size_t skip = seen;
+            spinlock_lock(&bucket->vb_lock);
+            list_iterate(&bucket->vb_list, vn, vnode_t, vn_link)
+            {
+                if (skip)
+                {
+                    skip--;
+                    continue;
+                }
+                if (n == max)
+                {
+                    more = 1;
+                    break;
+                }
+                seen++;
+                s5_node_t *sn = VNODE_TO_S5NODE(vn);
+                if (vn->vn_state == VNODE_LOADED && sn->dirtied_inode)
+                {
+                    copies[n++] = sn->inode;
+                    sn->dirtied_inode = 0;
+                }
+            }
+            spinlock_unlock(&bucket->vb_lock);
+
+            for (size_t i = 0; i < n; i++)
+            {
+                pframe_t *pf;
+                ino_t ino = copies[i].s5_number;
+                s5_get_disk_block(s5fs, S5_INODE_BLOCK(ino), 1, &pf);
+                memcpy((s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(ino),
+                       &copies[i], sizeof(s5_inode_t));
+                s5_release_disk_block(&pf);
+            }
+        }
+    }
+}
+
+/*
+ * Write a transaction's record, from the copies of its blocks in j_pages,
+ * once everything written before it is durable.
+ */
+static long s5_journal_write(s5_journal_t *j, blocknum_t *blocks, size_t n)
+{
+    s5_journal_header_t *hdr = j->j_pages[0];
+    memset(hdr, 0, S5_BLOCK_SIZE);
+    hdr->s5jh_magic = S5_JOURNAL_MAGIC;
+    hdr->s5jh_seq = j->j_seq;
+    hdr->s5jh_nblocks = (uint32_t)n;
+    for (size_t i = 0; i < n; i++)
+    {
+        hdr->s5jh_blocks[i] = blocks[i];
+    }
+    hdr->s5jh_checksum = s5_journal_record_checksum(j->j_pages, n);
+
+    blocknum_t start = j->j_start + (blocknum_t)((j->j_seq % 2) * j->j_half);
+    long ret = blockdev_flush_cache(j->j_bdev);
+    if (!ret)
+    {
+        ret = s5_journal_rw(j, start, j->j_pages, n + 1, 1);
+    }
+    if (!ret)
+    {
+        j->j_seq++;
+        j->j_ncommits++;
+        j->j_nlogged += n;
+    }
+    return ret;
+}
+
+/*
+ * Unpin the blocks of a committed transaction and write them to their places.
+ * A block the running transaction has pinned again holds its uncommitted
+ * changes by now, so the copy made at the commit is written in its place
+ * instead; the rest are written from the page cache (their contents may have
+ * moved on, but only with changes that are not journaled, e.g. to a block
+ * freed and reused for file data).
+ */
+static long s5_journal_checkpoint(s5fs_t *s5fs, s5_journal_t *j,
+                                  blocknum_t *blocks, size_t n)
+{
+    size_t nbios = 0;
+    blockdev_plug(j->j_bdev);
+    for (size_t i = 0; i < n; i++)
+    {
+        pframe_t *pf;
+        s5_get_disk_block(s5fs, blocks[i], 0, &pf);
+        KASSERT(pf->pf_pinned);
+        if (--pf->pf_pinned)
+        {
+            bio_t *bio = &j->j_bios[nbios++];
+            bio_prepare(bio, j->j_bdev, blocks[i], 1, j->j_pages[i + 1], 1);
+            long ret = bio_submit(bio);
+            if (ret)
+            {
+                bio_complete(bio, ret);
+            }
+        }
+        s5_release_disk_block(&pf);
+    }
+    blockdev_unplug(j->j_bdev);
+
+    long ret = 0;
+    for (size_t b = 0; b < nbios; b++)
+    {
+        long err = bio_wait(&j->j_bios[b]);
+        ret = ret ? ret : err;
+    }
+    long err = blockdev_sync_blocks(j->j_bdev, blocks, n);
+    return ret ? ret : err;
+}
+
+/*
+ * Write a transaction that could not be journaled (it did not fit, or its
+ * record could not be written) straight to its places, as if there were no
+ * journal: erase the records first, since they may log blocks that have been
+ * freed and reused since, then unpin the blocks and write them back.
+ */
+static long s5_journal_bypass(s5fs_t *s5fs, s5_journal_t *j,
+                              blocknum_t *blocks, size_t n)
+{
+    dbg(DBG_S5FS, "journal: writing %lu blocks without the journal\n", n);
+    j->j_noverflows++;
+    long ret = s5_journal_erase(j);
+    for (size_t i = 0; i < n; i++)
+    {
+        pframe_t *pf;
+        s5_get_disk_block(s5fs, blocks[i], 0, &pf);
+        KASSERT(pf->pf_pinned);
+        pf->pf_pinned--;
+        s5_release_disk_block(&pf);
+    }
+    /* blocks past the ones that fit were never pinned, and may be anywhere
+     * among the dirty pages */
+    blockdev_writeback(j->j_bdev, (uint64_t)-1, (size_t)-1);
+    long err = blockdev_sync_blocks(j->j_bdev, blocks, n);
+    ret = ret ? ret : err;
+    return ret ? ret : blockdev_flush_cache(j->j_bdev);
+}
+
+/*
+ * Commit the running transaction, if it has changes, and checkpoint it; with
+ * flush set, flush the disk's cache when there is nothing to commit instead.
+ */
+static long s5_journal_do_commit(s5fs_t *s5fs, long flush)
+{
+    s5_journal_t *j = s5fs->s5f_journal;
+    if (!j)
+    {
+        return flush ? blockdev_flush_cache(s5fs->s5f_bdev) : 0;
+    }
+    kmutex_lock(&j->j_commit_mutex);
+    s5_journal_freeze(j);
+    s5_journal_copy_inodes(s5fs, j->j_pages[0]);
+    if (!j->j_nblocks && !j->j_overflow)
+    {
+        s5_journal_thaw(j);
+        long ret = flush ? blockdev_flush_cache(j->j_bdev) : 0;
+        kmutex_unlock(&j->j_commit_mutex);
+        return ret;
+    }
+    pframe_t *pf;
+    s5_get_disk_block(s5fs, S5_SUPER_BLOCK, 1, &pf);
+    memcpy(pf->pf_addr, &s5fs->s5f_super, sizeof(s5_super_t));
+    s5_release_disk_block(&pf);
+
+    spinlock_lock(&j->j_lock);
+    blocknum_t *blocks = j->j_blocks;
+    size_t n = j->j_nblocks;
+    long overflow = j->j_overflow;
+    j->j_blocks = j->j_commit_blocks;
+    j->j_commit_blocks = blocks;
+    j->j_nblocks = 0;
+    j->j_overflow = 0;
+    spinlock_unlock(&j->j_lock);
+    for (size_t i = 0; !overflow && i < n; i++)
+    {
+        s5_get_disk_block(s5fs, blocks[i], 0, &pf);
+        memcpy(j->j_pages[i + 1], pf->pf_addr, S5_BLOCK_SIZE);
+        s5_release_disk_block(&pf);
+    }
+    s5_journal_thaw(j);
+
+    long ret = overflow ? -ENOSPC : s5_journal_write(j, blocks, n);
+    if (ret)
+    {
+        ret = s5_journal_bypass(s5fs, j, blocks, n);
+    }
+    else
+    {
+        ret = s5_journal_checkpoint(s5fs, j, blocks, n);
+    }
+    kmutex_unlock(&j->j_commit_mutex);
+    return ret;
+}
+
+/*
+ * Commit the running transaction, with all of the in-core inodes and the
+ * super block, and checkpoint it. Returns when it is on the disk. Must not be
+ * called by a thread in the middle of an operation.
+ */
+long s5_journal_commit(s5fs_t *s5fs)
+{
+    return s5_journal_do_commit(s5fs, 0);
+}
+
+/*
+ * Like s5_journal_commit(), but also makes every write outside the journal
+ * that completed before it durable, as fsync() needs for file data. A commit
+ * does that with the flush ahead of its record; with nothing to commit, the
+ * disk's cache is flushed on its own.
+ */
+long s5_journal_sync(s5fs_t *s5fs)
+{
+    return s5_journal_do_commit(s5fs, 1);
+}
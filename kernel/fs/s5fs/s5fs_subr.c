@@ -1,11 +1,17 @@
 #include "fs/s5fs/s5fs_subr.h"
+#include "api/syscall.h"
+#include "config.h"
 #include "drivers/blockdev.h"
 #include "errno.h"
+#include "fs/dirent.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "kernel.h"
+#include "mm/kmalloc.h"
+#include "mm/pagetable.h"
 #include "mm/pframe.h"
 #include "proc/kmutex.h"
 #include "util/debug.h"
@@ -49,7 +55,9 @@ Although this may sound like common sense, it is important that you use a file
 
 static void s5_free_block(s5fs_t *s5fs, blocknum_t block);
 
-static long s5_alloc_block(s5fs_t *s5fs);
+static long s5_alloc_block(s5fs_t *s5fs, blocknum_t goal, long zero);
+
+static blocknum_t s5_inode_data_goal(s5fs_t *s5fs, ino_t ino);
 
 static inline void s5_lock_super(s5fs_t *s5fs)
 {
@@ -127,6 +135,517 @@ static inline void s5_release_file_block(pframe_t **pfp)
     pframe_release(pfp);
 }
 
+/*
+ * Lock the vnode's mobj, unless curthr already holds it (i.e. the vnode is
+ * locked exclusively rather than with vlock_shared()). Returns whether it was
+ * locked here, to be passed to s5_unlock_pages().
+ */
+long s5_lock_pages(s5_node_t *sn)
+{
+    if (kmutex_owns_mutex(&sn->vnode.vn_mobj.mo_mutex))
+    {
+        return 0;
+    }
+    mobj_lock(&sn->vnode.vn_mobj);
+    return 1;
+}
+
+void s5_unlock_pages(s5_node_t *sn, long locked)
+{
+    if (locked)
+    {
+        mobj_unlock(&sn->vnode.vn_mobj);
+    }
+}
+
+/*
+ * Extent-mapped inodes (S5_FLAG_EXTENTS); see s5fs.h for the layout.
+ */
+
+/* Return the largest file size the inode's block map can describe. Inline
+ * files are given an extent tree when they grow. */
+static inline size_t s5_max_file_size(s5_inode_t *inode)
+{
+    return (inode->s5_flags & (S5_FLAG_EXTENTS | S5_FLAG_INLINE))
+               ? S5_EXTENT_MAX_FILE_SIZE
+               : S5_MAX_FILE_SIZE;
+}
+
+/*
+ * Return the index of the last entry of a node that starts at or before file
+ * block fblock, or -1 if every entry starts after it.
+ */
+static long s5_extent_search(s5_extent_header_t *eh, s5_extent_t *ext,
+                             size_t fblock)
+{
+    long lo = 0, hi = eh->s5eh_nentries;
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
+        if (ext[mid].s5e_file_block <= fblock)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+/*
+ * Look up file block fblock among the extents of a leaf node. Return its disk
+ * block, or 0 if it is sparse; if runp is non-NULL and the block is mapped,
+ * also return the number of blocks, starting with it, that follow it
+ * contiguously on disk.
+ */
+static blocknum_t s5_extent_find(s5_extent_header_t *eh, s5_extent_t *ext,
+                                 size_t fblock, size_t *runp)
+{
+    long i = s5_extent_search(eh, ext, fblock);
+    if (i < 0 || fblock >= (size_t)ext[i].s5e_file_block + ext[i].s5e_length)
+    {
+        return 0;
+    }
+    size_t off = fblock - ext[i].s5e_file_block;
+    if (runp)
+    {
+        *runp = ext[i].s5e_length - off;
+    }
+    return ext[i].s5e_disk_block + (blocknum_t)off;
+}
+
+/*
+ * Return where a block newly mapped at fblock should go: where it would be if
+ * the extent before it in the node carried on, so that a file written in
+ * order ends up contiguous on disk. 0 lets the allocator choose.
+ */
+static blocknum_t s5_extent_goal(s5_extent_header_t *eh, s5_extent_t *ext,
+                                 size_t fblock)
+{
+    long i = s5_extent_search(eh, ext, fblock);
+    if (i < 0 || !ext[i].s5e_length)
+    {
+        return 0;
+    }
+    return ext[i].s5e_disk_block +
+           (blocknum_t)(fblock - ext[i].s5e_file_block);
+}
+
+/*
+ * Map the sparse file block fblock to disk block dblock in a leaf node of
+ * capacity cap, growing a neighbouring extent (or merging two) when the block
+ * continues it on disk. Return 0, or -ENOSPC if the block needs an extent of
+ * its own and the node is full.
+ */
+static long s5_extent_insert(s5_extent_header_t *eh, s5_extent_t *ext,
+                             size_t cap, size_t fblock, blocknum_t dblock)
+{
+    long n = eh->s5eh_nentries;
+    long i = s5_extent_search(eh, ext, fblock);
+    s5_extent_t *prev = i >= 0 ? &ext[i] : NULL;
+    s5_extent_t *next = i + 1 < n ? &ext[i + 1] : NULL;
+    KASSERT(!prev || prev->s5e_file_block + prev->s5e_length <= fblock);
+
+    long extends_prev = prev &&
+                        prev->s5e_file_block + prev->s5e_length == fblock &&
+                        prev->s5e_disk_block + prev->s5e_length == dblock;
+    long extends_next = next && next->s5e_file_block == fblock + 1 &&
+                        next->s5e_disk_block == dblock + 1;
+    if (extends_prev && extends_next)
+    {
+        prev->s5e_length += 1 + next->s5e_length;
+        for (long j = i + 1; j < n - 1; j++)
+        {
+            ext[j] = ext[j + 1];
+        }
+        n--;
+    }
+    else if (extends_prev)
+    {
+        prev->s5e_length++;
+    }
+    else if (extends_next)
+    {
+        next->s5e_file_block--;
+        next->s5e_disk_block--;
+        next->s5e_length++;
+    }
+    else
+    {
+        if ((size_t)n == cap)
+        {
+            return -ENOSPC;
+        }
+        for (long j = n; j > i + 1; j--)
+        {
+            ext[j] = ext[j - 1];
+        }
+        ext[i + 1].s5e_file_block = (uint32_t)fblock;
+        ext[i + 1].s5e_disk_block = dblock;
+        ext[i + 1].s5e_length = 1;
+        n++;
+    }
+    eh->s5eh_nentries = (uint16_t)n;
+    return 0;
+}
+
+/*
+ * Return the disk block of file block fblock of an extent-mapped file, or 0 if
+ * it is sparse, along with the rest of its run as in s5_extent_find().
+ */
+static blocknum_t s5_extent_lookup(s5_node_t *sn, size_t fblock, size_t *runp)
+{
+    s5_inode_t *inode = &sn->inode;
+    if (!inode->s5_extent_header.s5eh_depth)
+    {
+        return s5_extent_find(&inode->s5_extent_header, inode->s5_extents,
+                              fblock, runp);
+    }
+
+    long i = s5_extent_search(&inode->s5_extent_header, inode->s5_extents,
+                              fblock);
+    if (i < 0)
+    {
+        return 0;
+    }
+    pframe_t *pf;
+    s5_get_disk_block(VNODE_TO_S5FS(&sn->vnode),
+                      inode->s5_extents[i].s5e_disk_block, 0, &pf);
+    s5_extent_leaf_t *leaf = pf->pf_addr;
+    blocknum_t block = s5_extent_find(&leaf->s5el_header, leaf->s5el_extents,
+                                      fblock, runp);
+    s5_release_disk_block(&pf);
+    return block;
+}
+
+/*
+ * Move the extents held in the inode out into a leaf block, making the inode
+ * an index of one entry. Return 0, or propagate errors from s5_alloc_block.
+ */
+static long s5_extent_grow(s5_node_t *sn)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    s5_inode_t *inode = &sn->inode;
+    KASSERT(!inode->s5_extent_header.s5eh_depth &&
+            inode->s5_extent_header.s5eh_nentries == S5_INODE_NEXTENTS);
+
+    long leafno =
+        s5_alloc_block(s5fs, inode->s5_extents[0].s5e_disk_block, 1);
+    if (leafno < 0)
+    {
+        return leafno;
+    }
+    pframe_t *pf;
+    s5_get_disk_block(s5fs, (blocknum_t)leafno, 1, &pf);
+    s5_extent_leaf_t *leaf = pf->pf_addr;
+    leaf->s5el_header = inode->s5_extent_header;
+    memcpy(leaf->s5el_extents, inode->s5_extents, sizeof(inode->s5_extents));
+    s5_release_disk_block(&pf);
+
+    inode->s5_extent_header.s5eh_depth = 1;
+    inode->s5_extent_header.s5eh_nentries = 1;
+    inode->s5_extents[0].s5e_disk_block = (blocknum_t)leafno;
+    inode->s5_extents[0].s5e_length = 0;
+    memset(&inode->s5_extents[1], 0,
+           sizeof(inode->s5_extents) - sizeof(inode->s5_extents[0]));
+    sn->dirtied_inode = 1;
+    return 0;
+}
+
+/*
+ * Split the full leaf of index entry i in two, moving the upper half of its
+ * extents into a new leaf after it. Return 0, -EFBIG if the index is full, or
+ * propagate errors from s5_alloc_block.
+ */
+static long s5_extent_split(s5_node_t *sn, long i)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    s5_inode_t *inode = &sn->inode;
+    long n = inode->s5_extent_header.s5eh_nentries;
+    if ((size_t)n == S5_INODE_NEXTENTS)
+    {
+        return -EFBIG;
+    }
+
+    blocknum_t lowerno = inode->s5_extents[i].s5e_disk_block;
+    long upperno = s5_alloc_block(s5fs, lowerno + 1, 1);
+    if (upperno < 0)
+    {
+        return upperno;
+    }
+    pframe_t *lowerpf, *upperpf;
+    s5_get_disk_block(s5fs, lowerno, 1, &lowerpf);
+    s5_get_disk_block(s5fs, (blocknum_t)upperno, 1, &upperpf);
+    s5_extent_leaf_t *lower = lowerpf->pf_addr, *upper = upperpf->pf_addr;
+    size_t half = lower->s5el_header.s5eh_nentries / 2;
+    upper->s5el_header.s5eh_depth = 0;
+    upper->s5el_header.s5eh_nentries =
+        (uint16_t)(lower->s5el_header.s5eh_nentries - half);
+    memcpy(upper->s5el_extents, &lower->s5el_extents[half],
+           upper->s5el_header.s5eh_nentries * sizeof(s5_extent_t));
+    lower->s5el_header.s5eh_nentries = (uint16_t)half;
+    uint32_t key = upper->s5el_extents[0].s5e_file_block;
+    s5_release_disk_block(&upperpf);
+    s5_release_disk_block(&lowerpf);
+
+    for (long j = n; j > i + 1; j--)
+    {
+        inode->s5_extents[j] = inode->s5_extents[j - 1];
+    }
+    inode->s5_extents[i + 1].s5e_file_block = key;
+    inode->s5_extents[i + 1].s5e_disk_block = (blocknum_t)upperno;
+    inode->s5_extents[i + 1].s5e_length = 0;
+    inode->s5_extent_header.s5eh_nentries = (uint16_t)(n + 1);
+    sn->dirtied_inode = 1;
+    return 0;
+}
+
+/*
+ * Map the sparse file block fblock to disk block dblock in a file with an
+ * index, splitting the leaf that should hold it if it is full. Return 0, or
+ * propagate errors from s5_extent_split.
+ */
+static long s5_extent_insert_indexed(s5_node_t *sn, size_t fblock,
+                                     blocknum_t dblock)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    s5_inode_t *inode = &sn->inode;
+    long i = MAX(s5_extent_search(&inode->s5_extent_header, inode->s5_extents,
+                                  fblock),
+                 0);
+    while (1)
+    {
+        pframe_t *pf;
+        s5_get_disk_block(s5fs, inode->s5_extents[i].s5e_disk_block, 1, &pf);
+        s5_extent_leaf_t *leaf = pf->pf_addr;
+        long ret = s5_extent_insert(&leaf->s5el_header, leaf->s5el_extents,
+                                    S5_BLOCK_NEXTENTS, fblock, dblock);
+        s5_release_disk_block(&pf);
+        if (!ret)
+        {
+            break;
+        }
+        if ((ret = s5_extent_split(sn, i)) < 0)
+        {
+            return ret;
+        }
+        if (fblock >= inode->s5_extents[i + 1].s5e_file_block)
+        {
+            i++;
+        }
+    }
+    /* the first leaf also takes blocks before the first one mapped */
+    if (fblock < inode->s5_extents[i].s5e_file_block)
+    {
+        inode->s5_extents[i].s5e_file_block = (uint32_t)fblock;
+        sn->dirtied_inode = 1;
+    }
+    return 0;
+}
+
+/*
+ * Return where a block newly mapped at the sparse file block fblock of an
+ * extent-mapped file should go; see s5_extent_goal(). A block with no extent
+ * before it goes to the inode's share of the disk; see s5_inode_data_goal().
+ */
+static blocknum_t s5_extent_alloc_goal(s5_node_t *sn, size_t fblock)
+{
+    s5_inode_t *inode = &sn->inode;
+    blocknum_t goal;
+    if (!inode->s5_extent_header.s5eh_depth)
+    {
+        goal = s5_extent_goal(&inode->s5_extent_header, inode->s5_extents,
+                              fblock);
+        return goal ? goal
+                    : s5_inode_data_goal(VNODE_TO_S5FS(&sn->vnode),
+                                         sn->vnode.vn_vno);
+    }
+
+    long i = MAX(s5_extent_search(&inode->s5_extent_header,
+                                  inode->s5_extents, fblock),
+                 0);
+    pframe_t *pf;
+    s5_get_disk_block(VNODE_TO_S5FS(&sn->vnode),
+                      inode->s5_extents[i].s5e_disk_block, 0, &pf);
+    s5_extent_leaf_t *leaf = pf->pf_addr;
+    goal = s5_extent_goal(&leaf->s5el_header, leaf->s5el_extents, fblock);
+    s5_release_disk_block(&pf);
+    return goal ? goal
+                : s5_inode_data_goal(VNODE_TO_S5FS(&sn->vnode),
+                                     sn->vnode.vn_vno);
+}
+
+/*
+ * Map the sparse file block fblock of an extent-mapped file to disk block
+ * dblock, growing the tree as needed. Return 0, or -EFBIG if the file is too
+ * fragmented for the tree to map, or propagate errors from s5_alloc_block.
+ *
+ * No block of the tree is held while allocating, since the allocator gets
+ * blocks of its own.
+ */
+static long s5_extent_map(s5_node_t *sn, size_t fblock, blocknum_t dblock)
+{
+    s5_inode_t *inode = &sn->inode;
+    if (!inode->s5_extent_header.s5eh_depth)
+    {
+        if (!s5_extent_insert(&inode->s5_extent_header, inode->s5_extents,
+                              S5_INODE_NEXTENTS, fblock, dblock))
+        {
+            sn->dirtied_inode = 1;
+            return 0;
+        }
+        long ret = s5_extent_grow(sn);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return s5_extent_insert_indexed(sn, fblock, dblock);
+}
+
+/*
+ * Allocate a disk block for the sparse file block fblock of an extent-mapped
+ * file and map it. Return the disk block, or propagate errors from
+ * s5_alloc_block and s5_extent_map.
+ */
+static long s5_extent_alloc(s5_node_t *sn, size_t fblock)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    long block = s5_alloc_block(s5fs, s5_extent_alloc_goal(sn, fblock),
+                                !S_ISREG(sn->vnode.vn_mode));
+    if (block < 0)
+    {
+        return block;
+    }
+    long ret = s5_extent_map(sn, fblock, (blocknum_t)block);
+    if (ret < 0)
+    {
+        s5_free_block(s5fs, (blocknum_t)block);
+        return ret;
+    }
+    return block;
+}
+
+/*
+ * Free every block of an extent-mapped file, given a copy of its extent
+ * header and entries, including the leaf blocks.
+ */
+static void s5_extent_free_all(s5fs_t *s5fs, s5_extent_header_t *eh,
+                               s5_extent_t *ext)
+{
+    for (long i = 0; i < eh->s5eh_nentries; i++)
+    {
+        if (eh->s5eh_depth)
+        {
+            s5_extent_leaf_t leaf;
+            pframe_t *pf;
+            s5_get_disk_block(s5fs, ext[i].s5e_disk_block, 0, &pf);
+            memcpy(&leaf, pf->pf_addr, sizeof(leaf));
+            s5_release_disk_block(&pf);
+
+            s5_extent_free_all(s5fs, &leaf.s5el_header, leaf.s5el_extents);
+            s5_free_block(s5fs, ext[i].s5e_disk_block);
+            continue;
+        }
+        for (uint32_t j = 0; j < ext[i].s5e_length; j++)
+        {
+            s5_free_block(s5fs, ext[i].s5e_disk_block + j);
+        }
+    }
+}
+
+/*
+ * Return the number of blocks an extent-mapped file uses, counting leaf
+ * blocks.
+ */
+static long s5_extent_count_blocks(s5fs_t *s5fs, s5_extent_header_t *eh,
+                                   s5_extent_t *ext)
+{
+    long count = 0;
+    for (long i = 0; i < eh->s5eh_nentries; i++)
+    {
+        if (eh->s5eh_depth)
+        {
+            pframe_t *pf;
+            s5_get_disk_block(s5fs, ext[i].s5e_disk_block, 0, &pf);
+            s5_extent_leaf_t *leaf = pf->pf_addr;
+            count += 1 + s5_extent_count_blocks(s5fs, &leaf->s5el_header,
+                                                leaf->s5el_extents);
+            s5_release_disk_block(&pf);
+        }
+        else
+        {
+            count += ext[i].s5e_length;
+        }
+    }
+    return count;
+}
+
+/*
+ * Remember a run of file blocks found mapped to consecutive disk blocks (see
+ * bmap_file_block). Blocks are only ever unmapped by s5_remove_blocks(),
+ * which forgets it; allocating fills holes, which the run never covers.
+ */
+static void s5_bmap_remember(s5_node_t *sn, size_t fblock, blocknum_t dblock,
+                             size_t run)
+{
+    sn->bmap_file_block = fblock;
+    sn->bmap_disk_block = dblock;
+    sn->bmap_len = run;
+}
+
+/* Whether new files may be made inline (S5_FLAG_INLINE): only on disks of a
+ * version that knows about them. */
+static inline long s5_inline_supported(s5fs_t *s5fs)
+{
+    return s5fs->s5f_super.s5s_version >= 8;
+}
+
+/*
+ * Move an inline file's contents into a block of their own, making it an
+ * ordinary extent-mapped file, before it grows past S5_INLINE_MAX. The
+ * contents go into the file's first page, which is then written like any
+ * other page written before its block was allocated (see s5_flush_pages()).
+ * Return 0, or propagate errors from s5_delalloc_reserve() and getting the
+ * page, leaving the file inline.
+ */
+static long s5_inline_expand(s5_node_t *sn)
+{
+    mobj_t *o = &sn->vnode.vn_mobj;
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    s5_inode_t *inode = &sn->inode;
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    pframe_t *pf = NULL;
+    if (inode->s5_un.s5_size)
+    {
+        /* a dirty page of an inline file holds no reservation, since it is
+         * flushed into the inode */
+        long ret = s5_delalloc_reserve(s5fs);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        /* filled from the inode, if not resident, while still inline */
+        ret = mobj_default_get_pframe(o, 0, 1, &pf);
+        if (ret < 0)
+        {
+            s5_delalloc_release(s5fs, 1);
+            return ret;
+        }
+    }
+
+    memset(inode->s5_inline, 0, sizeof(inode->s5_inline));
+    inode->s5_flags = S5_FLAG_EXTENTS;
+    sn->dirtied_inode = 1;
+    if (pf)
+    {
+        pframe_release(&pf);
+    }
+    return 0;
+}
+
 /* Given a file and a file block number, return the disk block number of the
  * desired file block.
  *
@@ -144,6 +663,14 @@ static inline void s5_release_file_block(pframe_t **pfp)
  *            S5_MAX_FILE_BLOCKS
  *  - Propagate errors from s5_alloc_block.
  *
+ * Extent-mapped files are looked up, and grown, through their extent tree
+ * instead; their limit is S5_EXTENT_MAX_FILE_BLOCKS, and allocating a block
+ * may also fail with EFBIG if the file is too fragmented for the tree.
+ *
+ * Blocks found through the indirect block or an extent leaf are looked up
+ * from the run cached in the s5_node when they can be, without getting the
+ * block again. Inline files have no blocks: every block is sparse.
+ *
  * Hints:
  *  - Use the file inode's s5_direct_blocks and s5_indirect_block to perform the
  *    translation.
@@ -163,17 +690,50 @@ static inline void s5_release_file_block(pframe_t **pfp)
 long s5_file_block_to_disk_block(s5_node_t *sn, size_t file_blocknum,
                                  int alloc) 
 { /// any locking or refcounts? /// verify
+    if (sn->inode.s5_flags & S5_FLAG_INLINE) {
+        KASSERT(!alloc && "inline files have no blocks to allocate");
+        return 0;
+    }
+    if (file_blocknum - sn->bmap_file_block < sn->bmap_len) {
+        return sn->bmap_disk_block +
+               (blocknum_t)(file_blocknum - sn->bmap_file_block);
+    }
+
+    if (sn->inode.s5_flags & S5_FLAG_EXTENTS) {
+        if (file_blocknum >= S5_EXTENT_MAX_FILE_BLOCKS) {
+            return -EINVAL;
+        }
+        size_t run;
+        long block = s5_extent_lookup(sn, file_blocknum, &run);
+        if (block && sn->inode.s5_extent_header.s5eh_depth) {
+            s5_bmap_remember(sn, file_blocknum, (blocknum_t)block, run);
+        }
+        if (block || !alloc) {
+            return block;
+        }
+        return s5_extent_alloc(sn, file_blocknum);
+    }
+
     if (file_blocknum >= S5_MAX_FILE_BLOCKS) {
         return -EINVAL;
     }
 
     /// get this s5fs_t from sn
     s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    /* only directory blocks, not file data, are kept in the buffer cache */
+    long zero = !S_ISREG(sn->vnode.vn_mode);
+
+    /* New blocks go right after the file's previous block, if it has one, so
+     * that files are laid out contiguously; 0 lets the allocator choose. */
+    blocknum_t goal = 0;
+    if (file_blocknum > 0 && file_blocknum <= S5_NDIRECT_BLOCKS) {
+        goal = sn->inode.s5_direct_blocks[file_blocknum - 1];
+    }
 
     if (file_blocknum < S5_NDIRECT_BLOCKS) { /// or <=?
         if (sn->inode.s5_direct_blocks[file_blocknum] == 0) { /// compare to NULL instead of 0?
             if (alloc) {
-                long block = s5_alloc_block(s5fs);
+                long block = s5_alloc_block(s5fs, goal ? goal + 1 : 0, zero);
                 if (block < 0) {
                     return block;
                 }
@@ -187,37 +747,173 @@ long s5_file_block_to_disk_block(s5_node_t *sn, size_t file_blocknum,
         return sn->inode.s5_direct_blocks[file_blocknum]; 
     }
 
+    size_t index = file_blocknum - S5_NDIRECT_BLOCKS;
     if (sn->inode.s5_indirect_block == 0) { /// verify
         if (alloc) {
-            long indirect_block = s5_alloc_block(s5fs);
+            /* the indirect block goes inline, just before the blocks it maps */
+            long indirect_block =
+                s5_alloc_block(s5fs, goal ? goal + 1 : 0, 1);
             if (indirect_block < 0) {
                 return indirect_block;
             }
-            sn->dirtied_inode = 1;
-            long actual = s5_alloc_block(s5fs);
+            long actual =
+                s5_alloc_block(s5fs, (blocknum_t)indirect_block + 1, zero);
             if (actual < 0) {
-                s5_free_block(s5fs, indirect_block);
+                s5_free_block(s5fs, (blocknum_t)indirect_block);
                 return actual;
             }
+            sn->dirtied_inode = 1;
             pframe_t *pframe  = NULL;
-            s5_get_disk_block(s5fs, indirect_block, 1, &pframe); /// args?
+            s5_get_disk_block(s5fs, (blocknum_t)indirect_block, 1, &pframe); /// args?
             /// index into pfaddr set to actual block
-            //uint32_t *indirec_block = ADDR_TO_PN(pframe->pf_addr); 
-            ((blocknum_t *) pframe->pf_addr)[file_blocknum - S5_NDIRECT_BLOCKS] = actual;
-            //pframe->pf_addr = actual; 
-            sn->inode.s5_indirect_block = indirect_block;
+            ((blocknum_t *) pframe->pf_addr)[index] = (blocknum_t)actual;
+            sn->inode.s5_indirect_block = (blocknum_t)indirect_block;
             s5_release_disk_block(&pframe);
             return (blocknum_t)actual;
-            }
         } else {
             return 0;
         }
+    }
+
+    pframe_t *pframe = NULL;
+    s5_get_disk_block(s5fs, sn->inode.s5_indirect_block, 0, &pframe);
+    blocknum_t *indirect = (blocknum_t *)pframe->pf_addr;
+    long block = indirect[index];
+    if (index > 0) {
+        goal = indirect[index - 1];
+    }
+    if (block) {
+        size_t run = 1;
+        while (index + run < S5_NIDIRECT_BLOCKS &&
+               indirect[index + run] == (blocknum_t)block + run) {
+            run++;
+        }
+        s5_bmap_remember(sn, file_blocknum, (blocknum_t)block, run);
+    }
+    s5_release_disk_block(&pframe);
+    if (block || !alloc) {
+        return block;
+    }
+
+    /* The indirect block is not held while allocating, since the allocator
+     * gets blocks of its own. */
+    block = s5_alloc_block(s5fs, goal ? goal + 1 : 0, zero);
+    if (block < 0) {
+        return block;
+    }
+    s5_get_disk_block(s5fs, sn->inode.s5_indirect_block, 1, &pframe);
+    indirect = (blocknum_t *)pframe->pf_addr;
+    KASSERT(!indirect[index]);
+    indirect[index] = (blocknum_t)block;
+    s5_release_disk_block(&pframe);
+    return block;
 }
 
-/* Read from a file.
+/* Start asynchronous reads of the file blocks after a read of blocks
+ * [first, last], if the file is being read sequentially.
  *
- *  sn  - The s5_node representing the file to read from
- *  pos - The position to start reading from
+ * A read that picks up where the last one left off doubles the readahead
+ * window, from S5_READAHEAD_MIN up to S5_READAHEAD_MAX blocks; any other read
+ * closes it. Readahead is issued once less than half a window remains ahead of
+ * the reader, so that the disk is kept busy while the reader consumes the
+ * blocks already read. A large non-sequential read still has all of its own
+ * blocks read at once.
+ */
+static void s5_readahead(s5_node_t *sn, size_t first, size_t last)
+{
+    if (first == sn->ra_next)
+    {
+        sn->ra_window = sn->ra_window ? MIN(sn->ra_window * 2,
+                                            (size_t)S5_READAHEAD_MAX)
+                                      : S5_READAHEAD_MIN;
+    }
+    else
+    {
+        sn->ra_window = 0;
+        sn->ra_end = 0;
+    }
+    sn->ra_next = last + 1;
+
+    if (sn->ra_end > last + 1 + sn->ra_window / 2 ||
+        (!sn->ra_window && first == last))
+    {
+        return;
+    }
+
+    size_t file_blocks = S5_DATA_BLOCK(sn->inode.s5_un.s5_size +
+                                       S5_BLOCK_SIZE - 1);
+    size_t end = MIN(last + 1 + sn->ra_window, file_blocks);
+    size_t block = MAX(first, sn->ra_end);
+    sn->ra_end = end;
+    s5_readahead_range(sn, block, end);
+}
+
+/* Start asynchronous reads of the allocated file blocks in [block, end), as
+ * far as the end of the file: into the file's own pages for a regular file,
+ * and into the buffer cache for a directory. The vnode's mobj must be locked.
+ */
+void s5_readahead_range(s5_node_t *sn, size_t block, size_t end)
+{
+    end = MIN(end, S5_DATA_BLOCK(sn->inode.s5_un.s5_size + S5_BLOCK_SIZE - 1));
+    blockdev_t *bd = VNODE_TO_S5FS(&sn->vnode)->s5f_bdev;
+    long reg = S_ISREG(sn->vnode.vn_mode);
+    blocknum_t disk_blocks[S5_READAHEAD_MAX];
+    size_t n = 0;
+    /* the pages of a regular file are read a run mapped to consecutive
+     * blocks at a time: [run_page, run_page + n) from run_block on */
+    size_t run_page = 0;
+    blocknum_t run_block = 0;
+    while (block < end)
+    {
+        /* extent-mapped files are looked up a run of blocks at a time */
+        size_t run = 1;
+        long loc = (sn->inode.s5_flags & S5_FLAG_EXTENTS)
+                       ? s5_extent_lookup(sn, block, &run)
+                       : s5_file_block_to_disk_block(sn, block, 0);
+        run = MIN(run, end - block);
+        if (reg)
+        {
+            if (n && (loc <= 0 || (blocknum_t)loc != run_block + n))
+            {
+                blockdev_readahead_pages(bd, run_block, &sn->vnode.vn_mobj,
+                                         run_page, n);
+                n = 0;
+            }
+            if (loc > 0 && !n)
+            {
+                run_page = block;
+                run_block = (blocknum_t)loc;
+            }
+            n += loc > 0 ? run : 0;
+            block += run;
+            continue;
+        }
+        for (size_t i = 0; loc > 0 && i < run; i++)
+        {
+            disk_blocks[n++] = (blocknum_t)loc + (blocknum_t)i;
+            if (n == sizeof(disk_blocks) / sizeof(disk_blocks[0]))
+            {
+                blockdev_readahead(bd, disk_blocks, n);
+                n = 0;
+            }
+        }
+        block += run;
+    }
+    if (n && reg)
+    {
+        blockdev_readahead_pages(bd, run_block, &sn->vnode.vn_mobj, run_page,
+                                 n);
+    }
+    else if (n)
+    {
+        blockdev_readahead(bd, disk_blocks, n);
+    }
+}
+
+/* Read from a file.
+ *
+ *  sn  - The s5_node representing the file to read from
+ *  pos - The position to start reading from
  *  buf - The buffer to read into
  *  len - The number of bytes to read
  *
@@ -238,29 +934,37 @@ ssize_t s5_read_file(s5_node_t *sn, size_t pos, char *buf, size_t len)
     s5_inode_t *inode = &sn->inode;
     ssize_t read = 0;
     ssize_t to_read = len;
-    size_t blocknum = S5_DATA_BLOCK(pos);
-    size_t offset = S5_DATA_OFFSET(pos);
 
-    while (len > 0){
+    /* a shared holder of the vnode keeps its mobj locked only while looking
+     * up pframes, and copies out of each with just a shared reference, so
+     * that readers of the same page do not wait for each other */
+    long locked = s5_lock_pages(sn);
+    if (len && pos < inode->s5_un.s5_size) {
+        s5_readahead(sn, S5_DATA_BLOCK(pos),
+                     S5_DATA_BLOCK(MIN(pos + len, inode->s5_un.s5_size) - 1));
+    }
+    s5_unlock_pages(sn, locked);
+
+    while (len > 0 && pos < inode->s5_un.s5_size){
+        size_t blocknum = S5_DATA_BLOCK(pos);
+        size_t offset = S5_DATA_OFFSET(pos);
 
         pframe_t *pframe = NULL;
+        locked = s5_lock_pages(sn);
         int res = s5_get_file_block(sn, blocknum, 0, &pframe);
+        if (res >= 0) {
+            pframe_share(pframe);
+        }
+        s5_unlock_pages(sn, locked);
         if (res < 0) {
             return res;
         }
 
-        if (pos > inode->s5_un.s5_size) {
-            break;
-        } 
-        
-        if (pos + len > inode->s5_un.s5_size) {
-            to_read = inode->s5_un.s5_size - pos;
-        } else {
-            to_read = MIN(S5_BLOCK_SIZE - offset, len);
-        }
+        to_read = MIN(S5_BLOCK_SIZE - offset,
+                      MIN(len, inode->s5_un.s5_size - pos));
 
         memcpy(buf, (char*)pframe->pf_addr + offset, to_read);
-        s5_release_file_block(&pframe);
+        pframe_put(&pframe);
         read += to_read;
         len -= to_read;
         pos += to_read;
@@ -323,7 +1027,8 @@ ssize_t s5_read_file(s5_node_t *sn, size_t pos, char *buf, size_t len)
  *  len - The number of bytes to write
  *
  * Return the number of bytes written, or:
- *  - EFBIG: pos was beyond S5_MAX_FILE_SIZE
+ *  - EFBIG: pos was beyond S5_MAX_FILE_SIZE (S5_EXTENT_MAX_FILE_SIZE for
+ *           extent-mapped files)
  *  - Propagate errors from s5_get_file_block (that is, do not return a partial
  *    write)
  *
@@ -347,12 +1052,20 @@ ssize_t s5_read_file(s5_node_t *sn, size_t pos, char *buf, size_t len)
  */
 ssize_t s5_write_file(s5_node_t *sn, size_t pos, const char *buf, size_t len)
 {
-    if (pos >= S5_MAX_FILE_SIZE) {
+    size_t max_size = s5_max_file_size(&sn->inode);
+    if (pos >= max_size) {
         return -EFBIG;
     }
 
-    if (pos + len > S5_MAX_FILE_SIZE) {
-        len = S5_MAX_FILE_SIZE - pos;
+    if (pos + len > max_size) {
+        len = max_size - pos;
+    }
+
+    if ((sn->inode.s5_flags & S5_FLAG_INLINE) && pos + len > S5_INLINE_MAX) {
+        long ret = s5_inline_expand(sn);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     size_t to_write;
@@ -434,165 +1147,1058 @@ ssize_t s5_write_file(s5_node_t *sn, size_t pos, const char *buf, size_t len)
     // // return -1;
 }
 
-/* Allocate one block from the filesystem.
+/*
+ * Direct I/O (O_DIRECT): blocks of a regular file are transferred straight
+ * between the disk and the caller's page-aligned buffers, typically pinned
+ * user pages (see syscall_rw()), with bios of their own, rather than through
+ * the pages of the vnode's memory object.
+ */
+
+/*
+ * Write back the cached, dirty pages of file blocks [block, end), so that a
+ * direct transfer of those blocks sees, and is not later overwritten by,
+ * their contents. Return 0, -ENOTSUP if one of them is pinned by the journal
+ * and can't be written yet, or propagate errors from the flush.
+ */
+static long s5_direct_sync(s5_node_t *sn, size_t block, size_t end)
+{
+    mobj_t *o = &sn->vnode.vn_mobj;
+    long ret = 0;
+    for (; block < end && !ret; block++)
+    {
+        pframe_t *pf;
+        mobj_find_pframe(o, block, &pf);
+        if (!pf)
+        {
+            continue;
+        }
+        pframe_wait_fill(pf);
+        if (pf->pf_dirty)
+        {
+            ret = mobj_flush_pframe(o, pf);
+            ret = ret == -EBUSY ? -ENOTSUP : ret;
+        }
+        pframe_release(&pf);
+    }
+    return ret;
+}
+
+/*
+ * Return the next block of an aligned vector of buffers, advancing *segp and
+ * *offp past it.
+ */
+static char *s5_direct_next(const struct iovec *iov, int *segp, size_t *offp)
+{
+    while (*offp == iov[*segp].iov_len)
+    {
+        (*segp)++;
+        *offp = 0;
+    }
+    char *addr = (char *)iov[*segp].iov_base + *offp;
+    *offp += S5_BLOCK_SIZE;
+    return addr;
+}
+
+/*
+ * Transfer n consecutive disk blocks starting at loc with a single bio, whose
+ * segments are the n buffers, physically contiguous ones merged, and wait
+ * for it.
+ */
+static long s5_direct_run(blockdev_t *bd, blocknum_t loc, char **addrs,
+                          size_t n, long write)
+{
+    bio_vec_t vecs[BLOCKDEV_CLUSTER_BLOCKS];
+    size_t nvecs = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uintptr_t phys = pt_virt_to_phys((uintptr_t)addrs[i]);
+        if (nvecs && vecs[nvecs - 1].bv_phys + vecs[nvecs - 1].bv_len == phys)
+        {
+            vecs[nvecs - 1].bv_len += S5_BLOCK_SIZE;
+            continue;
+        }
+        vecs[nvecs].bv_phys = phys;
+        vecs[nvecs++].bv_len = S5_BLOCK_SIZE;
+    }
+    bio_t bio;
+    bio_prepare_vec(&bio, bd, loc, vecs, nvecs, write);
+    long ret = bio_submit(&bio);
+    if (!ret)
+    {
+        ret = bio_wait(&bio);
+    }
+    return ret;
+}
+
+/*
+ * Read into or write from the iovcnt buffers of iov, starting at pos in sn's
+ * file, straight from or to its disk blocks. Runs of blocks that are
+ * consecutive on disk go with one bio each; holes read as zeros, and are
+ * allocated blocks when written. Cached pages of the blocks are written back
+ * first, and those of blocks written are updated afterwards, so that reads
+ * and mappings of the file through its pages stay coherent. The vnode must be
+ * locked exclusively.
  *
- * Return the block number of the newly allocated block, or:
- *  - ENOSPC: There are no more free blocks
+ * Return the number of bytes transferred (past the end of the file, read
+ * buffers are zeroed up to the end of their block), or:
+ *  - ENOTSUP: pos, or a buffer's address or length, is not a multiple of
+ *    S5_BLOCK_SIZE, or the file is inline; see s5_direct_sync() too
+ *  - EFBIG: writing at or past the largest file size
+ *  - Propagate errors from s5_file_block_to_disk_block and the transfers, if
+ *    nothing was transferred
+ */
+ssize_t s5_direct_io(s5_node_t *sn, size_t pos, const struct iovec *iov,
+                     int iovcnt, long write)
+{
+    vnode_t *vn = &sn->vnode;
+    KASSERT(S_ISREG(vn->vn_mode) && kmutex_owns_mutex(&vn->vn_mobj.mo_mutex));
+    if ((sn->inode.s5_flags & S5_FLAG_INLINE) || S5_DATA_OFFSET(pos))
+    {
+        return -ENOTSUP;
+    }
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len && (PAGE_OFFSET(iov[i].iov_base) ||
+                               S5_DATA_OFFSET(iov[i].iov_len)))
+        {
+            return -ENOTSUP;
+        }
+        len += iov[i].iov_len;
+    }
+    if (write)
+    {
+        size_t max_size = s5_max_file_size(&sn->inode);
+        if (pos >= max_size)
+        {
+            return -EFBIG;
+        }
+        len = MIN(len, max_size - pos);
+    }
+    else
+    {
+        if (pos >= vn->vn_len)
+        {
+            return 0;
+        }
+        len = MIN(len, vn->vn_len - pos);
+    }
+
+    size_t first = S5_DATA_BLOCK(pos);
+    size_t end = S5_DATA_BLOCK(pos + len + S5_BLOCK_SIZE - 1);
+    long ret = s5_direct_sync(sn, first, end);
+    if (ret)
+    {
+        return ret;
+    }
+
+    blockdev_t *bd = VNODE_TO_S5FS(vn)->s5f_bdev;
+    int seg = 0;
+    size_t off = 0;
+    size_t block = first;
+    while (block < end)
+    {
+        long loc = s5_file_block_to_disk_block(sn, block, write);
+        if (loc < 0)
+        {
+            ret = loc;
+            break;
+        }
+        char *addrs[BLOCKDEV_CLUSTER_BLOCKS];
+        addrs[0] = s5_direct_next(iov, &seg, &off);
+        if (!loc)
+        {
+            memset(addrs[0], 0, S5_BLOCK_SIZE);
+            block++;
+            continue;
+        }
+        size_t n = 1;
+        while (n < BLOCKDEV_CLUSTER_BLOCKS && block + n < end &&
+               s5_file_block_to_disk_block(sn, block + n, write) ==
+                   loc + (long)n)
+        {
+            addrs[n++] = s5_direct_next(iov, &seg, &off);
+        }
+        ret = s5_direct_run(bd, (blocknum_t)loc, addrs, n, write);
+        if (ret)
+        {
+            break;
+        }
+        for (size_t i = 0; write && i < n; i++)
+        {
+            pframe_t *pf;
+            mobj_find_pframe(&vn->vn_mobj, block + i, &pf);
+            if (pf && !pframe_wait_fill(pf))
+            {
+                memcpy(pf->pf_addr, addrs[i], S5_BLOCK_SIZE);
+            }
+            if (pf)
+            {
+                pframe_release(&pf);
+            }
+        }
+        if (!write && block + n == end && S5_DATA_OFFSET(len))
+        {
+            /* don't hand out what follows the end of the file on disk */
+            memset(addrs[n - 1] + S5_DATA_OFFSET(len), 0,
+                   S5_BLOCK_SIZE - S5_DATA_OFFSET(len));
+        }
+        block += n;
+    }
+
+    size_t done = MIN(len, (block - first) * S5_BLOCK_SIZE);
+    if (write && pos + done > vn->vn_len)
+    {
+        vn->vn_len = pos + done;
+        sn->inode.s5_un.s5_size = (uint32_t)vn->vn_len;
+        sn->dirtied_inode = 1;
+    }
+    return done ? (ssize_t)done : ret;
+}
+
+/*
+ * Find a clear bit in a bitmap block at or after bit first and before bit
+ * last, skipping whole words that are full. Return the bit, or -1 if there is
+ * none.
+ */
+static long s5_bitmap_find_clear(const uint32_t *bitmap, size_t first,
+                                 size_t last)
+{
+    size_t bit = first;
+    while (bit < last)
+    {
+        uint32_t word = bitmap[bit / 32];
+        if (word == 0xffffffff)
+        {
+            bit = (bit / 32 + 1) * 32;
+            continue;
+        }
+        if (!(word & (1U << (bit % 32))))
+        {
+            return (long)bit;
+        }
+        bit++;
+    }
+    return -1;
+}
+
+/*
+ * Search the bitmap starting at disk block bitmap for a clear bit in
+ * [first, last). Return it, or -1.
+ */
+static long s5_bitmap_find(s5fs_t *s5fs, blocknum_t bitmap, size_t first,
+                           size_t last)
+{
+    size_t n = first;
+    while (n < last)
+    {
+        size_t bit = n % S5_BITS_PER_BITMAP_BLOCK;
+        size_t stop = MIN((size_t)S5_BITS_PER_BITMAP_BLOCK, bit + (last - n));
+        pframe_t *pf;
+        s5_get_disk_block(s5fs,
+                          bitmap + (blocknum_t)(n / S5_BITS_PER_BITMAP_BLOCK),
+                          0, &pf);
+        long found = s5_bitmap_find_clear(pf->pf_addr, bit, stop);
+        s5_release_disk_block(&pf);
+        if (found >= 0)
+        {
+            return (long)n + (found - (long)bit);
+        }
+        n += stop - bit;
+    }
+    return -1;
+}
+
+/*
+ * Set or clear bit n of the bitmap starting at disk block bitmap.
+ */
+static void s5_bitmap_set(s5fs_t *s5fs, blocknum_t bitmap, size_t n,
+                          long used)
+{
+    pframe_t *pf;
+    s5_get_disk_block(s5fs,
+                      bitmap + (blocknum_t)(n / S5_BITS_PER_BITMAP_BLOCK), 1,
+                      &pf);
+    size_t bit = n % S5_BITS_PER_BITMAP_BLOCK;
+    uint32_t *word = (uint32_t *)pf->pf_addr + bit / 32;
+    uint32_t mask = 1U << (bit % 32);
+    KASSERT(!(*word & mask) == !!used && "bit already in that state");
+    if (used)
+    {
+        *word |= mask;
+    }
+    else
+    {
+        *word &= ~mask;
+    }
+    s5_release_disk_block(&pf);
+}
+
+/*
+ * Count the clear bits in [first, last) of the bitmap starting at disk block
+ * bitmap.
+ */
+static size_t s5_bitmap_count_clear(s5fs_t *s5fs, blocknum_t bitmap,
+                                    size_t first, size_t last)
+{
+    size_t count = 0;
+    size_t n = first;
+    while (n < last)
+    {
+        size_t bit = n % S5_BITS_PER_BITMAP_BLOCK;
+        size_t stop = MIN((size_t)S5_BITS_PER_BITMAP_BLOCK, bit + (last - n));
+        pframe_t *pf;
+        s5_get_disk_block(s5fs,
+                          bitmap + (blocknum_t)(n / S5_BITS_PER_BITMAP_BLOCK),
+                          0, &pf);
+        const uint32_t *words = pf->pf_addr;
+        for (size_t i = bit; i < stop;)
+        {
+            /* whole words that are empty or full are common, and quick */
+            uint32_t word = words[i / 32];
+            if (!(i % 32) && stop - i >= 32 && (!word || word == 0xffffffff))
+            {
+                count += word ? 0 : 32;
+                i += 32;
+            }
+            else
+            {
+                count += !(word & (1U << (i % 32)));
+                i++;
+            }
+        }
+        s5_release_disk_block(&pf);
+        n += stop - bit;
+    }
+    return count;
+}
+
+/*
+ * Return the first block of an allocation group's share of the data blocks, or
+ * the end of the disk for group S5_NGROUPS(). The data blocks are divided as
+ * evenly as they can be, rounding each group's start up, so that the group of
+ * a block is simply s5_block_group().
+ */
+static blocknum_t s5_group_first_block(s5_super_t *s, size_t group)
+{
+    blocknum_t start = S5_DATA_START(s);
+    uint64_t ndata = s->s5s_num_blocks - start;
+    uint64_t ngroups = S5_NGROUPS(s);
+    return start + (blocknum_t)((ndata * group + ngroups - 1) / ngroups);
+}
+
+/*
+ * Return the allocation group whose share of the disk a data block is in.
+ */
+static size_t s5_block_group(s5_super_t *s, blocknum_t block)
+{
+    blocknum_t start = S5_DATA_START(s);
+    KASSERT(block >= start && block < s->s5s_num_blocks);
+    uint64_t ndata = s->s5s_num_blocks - start;
+    return (size_t)((uint64_t)(block - start) * S5_NGROUPS(s) / ndata);
+}
+
+/*
+ * Search the block bitmap for a free block in [first, last). Return it, or -1.
+ * The group the blocks are in must be locked.
+ */
+static long s5_find_free_block(s5fs_t *s5fs, blocknum_t first,
+                               blocknum_t last)
+{
+    return s5_bitmap_find(s5fs, s5fs->s5f_super.s5s_bitmap_block, first, last);
+}
+
+/*
+ * Set or clear a block's bit in the bitmap. The block's group must be locked.
+ */
+static void s5_set_block_used(s5fs_t *s5fs, blocknum_t blockno, long used)
+{
+    s5_bitmap_set(s5fs, s5fs->s5f_super.s5s_bitmap_block, blockno, used);
+}
+
+/*
+ * Take up to *countp free blocks in a row, as s5_alloc_block() would choose the
+ * first of them: the first free block of goal's group at or after goal,
+ * wrapping around within the group, or failing that the first free block of
+ * the next group with any; after the rotor if there is no goal. A run does not
+ * cross into the next group. Return the first block, and the number taken in
+ * *countp.
  *
- * Hints:
- *  - Protect access to the super block using s5_lock_super and s5_unlock super.
- *  - Recall that the free block list is a linked list of blocks containing disk
- *    block numbers of free blocks. Each node contains S5_NBLKS_PER_FNODE block
- *    numbers, where the last entry is a pointer to the next node in the linked
- *    list, or -1 if there are no more free blocks remaining. The super block's
- *    s5s_free_blocks is the first node of this linked list.
- *  - The super block's s5s_nfree member is the number of blocks that are free
- *    within s5s_free_blocks. You could use it as an index into the
- *    s5s_free_blocks array. Be sure to update the field appropriately.
- *  - When s5s_free_blocks runs out (i.e. s5s_nfree == 0), refill it by
- *    collapsing the next node of the free list into the super block. Exactly
- *    when you do this is up to you.
- *  - You should initialize the block's contents to 0. Specifically, 
- *    when you use s5_alloc_block to allocate an indirect block,
- *    as your implementation of s5_file_block_to_disk_block probably expects
- *    sparse blocks to be represented by a 0.
- *  - You may find it helpful to take a look at the implementation of
- *    s5_free_block below.
- *  - You may assume/assert that any pframe calls succeed.
- */
-static long s5_alloc_block(s5fs_t *s5fs)
+ * Only the groups searched are locked, one at a time. The caller must already
+ * have claimed *countp blocks by taking them off s5s_nfree, and must give back
+ * those it didn't get; since s5s_nfree never counts more blocks than the
+ * groups hold, a claimed block is always free in some group.
+ */
+static long s5_take_blocks(s5fs_t *s5fs, blocknum_t goal, size_t *countp)
 {
-    s5_lock_super(s5fs);
     s5_super_t *s = &s5fs->s5f_super;
-    pframe_t *pframe;
-    if (s->s5s_nfree == 0) {
+    KASSERT(*countp);
+
+    long rotor = !goal || goal >= s->s5s_num_blocks;
+    if (rotor)
+    {
+        s5_lock_super(s5fs);
+        goal = s5fs->s5f_alloc_rotor;
+        s5_unlock_super(s5fs);
+    }
+    goal = MAX(goal, S5_DATA_START(s));
+    if (goal >= s->s5s_num_blocks)
+    {
+        goal = S5_DATA_START(s);
+    }
+
+    size_t ngroups = S5_NGROUPS(s);
+    size_t first = s5_block_group(s, goal);
+    /* a block freed into a group already passed can only be found by going
+     * round again */
+    for (size_t n = 0;; n++)
+    {
+        size_t group = (first + n) % ngroups;
+        s5_group_t *g = &s5fs->s5f_groups[group];
+        kmutex_lock(&g->sg_mutex);
+        if (!g->sg_nfree)
+        {
+            kmutex_unlock(&g->sg_mutex);
+            continue;
+        }
+
+        blocknum_t start = s5_group_first_block(s, group);
+        blocknum_t end = s5_group_first_block(s, group + 1);
+        blocknum_t from = n ? start : goal;
+        long blockno = s5_find_free_block(s5fs, from, end);
+        if (blockno < 0)
+        {
+            blockno = s5_find_free_block(s5fs, start, from);
+        }
+        KASSERT(blockno > 0 && "sg_nfree disagrees with the bitmap");
 
-        blocknum_t last_blk = s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1];
-        if (last_blk == (uint32_t)(-1)) {
+        size_t count = 0;
+        do
+        {
+            s5_set_block_used(s5fs, (blocknum_t)blockno + (blocknum_t)count,
+                              1);
+            count++;
+        } while (count < *countp && blockno + count < end &&
+                 s5_find_free_block(s5fs, (blocknum_t)(blockno + count),
+                                    (blocknum_t)(blockno + count + 1)) ==
+                     blockno + (long)count);
+        g->sg_nfree -= (uint32_t)count;
+        kmutex_unlock(&g->sg_mutex);
+
+        if (rotor)
+        {
+            s5_lock_super(s5fs);
+            s5fs->s5f_alloc_rotor = (blocknum_t)(blockno + count);
             s5_unlock_super(s5fs);
-            return -ENOSPC;
         }
-        
-        s5_get_disk_block(s5fs, last_blk, 1, &pframe); 
-        memcpy(s->s5s_free_blocks, pframe->pf_addr, sizeof(s->s5s_free_blocks)); /// memcopy into s5 freeblock the pfaddr which I get from get disk block
-        memset(pframe->pf_addr, 0, sizeof(s->s5s_free_blocks));
-        s->s5s_nfree = S5_NBLKS_PER_FNODE - 1;
-        s5_release_disk_block(&pframe);
-        s5_unlock_super(s5fs);
-        return last_blk;
-    } else {
-        s->s5s_nfree--;
-        blocknum_t blockno = s->s5s_free_blocks[s->s5s_nfree - 1];
-        s5_get_disk_block(s5fs, blockno, 1, &pframe); 
-        memset(pframe->pf_addr, 0, S5_BLOCK_SIZE);
-        s5_release_disk_block(&pframe);
-        s5_unlock_super(s5fs);
+        *countp = count;
         return blockno;
     }
-    
-    // NOT_YET_IMPLEMENTED("S5FS: s5_alloc_block");
-    // return -1;
+}
+
+/* Allocate one block from the filesystem, zeroed in the buffer cache if zero
+ * is set, as metadata blocks must be. Blocks of file data are not: their pages
+ * belong to the file (see s5fs_get_pframe()), and a page of zeros for them in
+ * the buffer cache would only be written back over the data.
+ *
+ * The first free block at or after goal is taken, wrapping around within
+ * goal's allocation group and then going on to the next groups, so that a
+ * file whose next block is requested with its previous block + 1 as the goal
+ * is laid out contiguously wherever possible. A goal of 0 continues from the
+ * last block allocated that way, which keeps new files from being interleaved
+ * with the starts of older ones.
+ *
+ * The superblock is only locked to claim the block from s5s_nfree; the bitmap
+ * is searched and updated under the lock of the group the block comes from.
+ *
+ * Return the block number of the newly allocated block, or:
+ *  - ENOSPC: There are no more free blocks
+ */
+static long s5_alloc_block(s5fs_t *s5fs, blocknum_t goal, long zero)
+{
+    s5_lock_super(s5fs);
+    s5_super_t *s = &s5fs->s5f_super;
+    /* blocks reserved for delayed allocation are not up for grabs */
+    if (s->s5s_nfree <= s5fs->s5f_ndelayed)
+    {
+        s5_unlock_super(s5fs);
+        return -ENOSPC;
+    }
+    s->s5s_nfree--;
+    s5_unlock_super(s5fs);
+
+    size_t count = 1;
+    long blockno = s5_take_blocks(s5fs, goal, &count);
+
+    if (zero)
+    {
+        pframe_t *pf;
+        s5_get_data_block(s5fs, (blocknum_t)blockno, 1, &pf);
+        memset(pf->pf_addr, 0, S5_BLOCK_SIZE);
+        s5_release_disk_block(&pf);
+    }
+    dbg(DBG_S5FS, "allocated disk block %ld (goal %u)\n", blockno, goal);
+    return blockno;
 }
 
 /*
- * The exact opposite of s5_alloc_block: add blockno to the free list of the
- * filesystem. This should never fail. You may assert that any pframe calls
- * succeed.
+ * Discards.
  *
- * Don't forget to protect access to the super block, update s5s_nfree, and
- * expand the linked list correctly if the super block can no longer hold any
- * more free blocks in its s5s_free_blocks array according to s5s_nfree.
+ * Freed blocks are remembered in s5f_discards, a run at a time, so that the
+ * device can be told it may forget them (e.g. an SSD's TRIM, which keeps its
+ * writes fast). They are only discarded once the frees are on the disk: after
+ * the journal commit that includes them (see s5fs_writeback()), or with no
+ * journal, after a sync. Discards are advisory, so runs freed while
+ * s5f_discards is full are simply never discarded.
  */
-static void s5_free_block(s5fs_t *s5fs, blocknum_t blockno)
+
+/*
+ * Note that a block has been freed. The superblock must be locked.
+ */
+static void s5_discard_note(s5fs_t *s5fs, blocknum_t block)
 {
+    KASSERT(kmutex_owns_mutex(&s5fs->s5f_mutex));
+    if (!s5fs->s5f_discard)
+    {
+        return;
+    }
+    /* blocks of a file are mostly freed in order */
+    blockdev_range_t *last = s5fs->s5f_ndiscards
+                                 ? &s5fs->s5f_discards[s5fs->s5f_ndiscards - 1]
+                                 : NULL;
+    if (last && last->br_block + last->br_count == block)
+    {
+        last->br_count++;
+    }
+    else if (s5fs->s5f_ndiscards < S5_DISCARD_MAX)
+    {
+        last = &s5fs->s5f_discards[s5fs->s5f_ndiscards++];
+        last->br_block = block;
+        last->br_count = 1;
+    }
+}
+
+/*
+ * Return whether any block of [first, end) has been noted since the last
+ * s5_discard_take(), i.e. freed again.
+ */
+static long s5_discard_noted(s5fs_t *s5fs, blocknum_t first, blocknum_t end)
+{
+    long noted = 0;
+    s5_lock_super(s5fs);
+    for (size_t i = 0; i < s5fs->s5f_ndiscards && !noted; i++)
+    {
+        blockdev_range_t *r = &s5fs->s5f_discards[i];
+        noted = r->br_block < end && first < r->br_block + r->br_count;
+    }
+    s5_unlock_super(s5fs);
+    return noted;
+}
+
+/*
+ * Take the runs of blocks freed so far, to be discarded with s5_discard() once
+ * the frees are on the disk. Return a newly allocated array of them, and their
+ * number in *np, or NULL if there are none (or no memory for them).
+ */
+blockdev_range_t *s5_discard_take(s5fs_t *s5fs, size_t *np)
+{
+    blockdev_range_t *ranges = NULL;
     s5_lock_super(s5fs);
+    size_t n = s5fs->s5f_ndiscards;
+    if (n && (ranges = kmalloc(n * sizeof(blockdev_range_t))))
+    {
+        memcpy(ranges, s5fs->s5f_discards, n * sizeof(blockdev_range_t));
+    }
+    s5fs->s5f_ndiscards = 0;
+    s5_unlock_super(s5fs);
+    *np = ranges ? n : 0;
+    return ranges;
+}
+
+/* Most runs s5_discard_group() hands the device at once */
+#define S5_DISCARD_BATCH 16
+
+/*
+ * Discard those blocks of [first, end), all in one allocation group, that are
+ * still free and have not been freed again since being taken, in runs. The
+ * group must be locked, so that none of them can be allocated, and written,
+ * before the device has forgotten them. Return 0, or propagate errors from
+ * blockdev_discard().
+ */
+static long s5_discard_group(s5fs_t *s5fs, blocknum_t first, blocknum_t end)
+{
+    blockdev_range_t runs[S5_DISCARD_BATCH];
+    size_t n = 0;
+    long ret = 0;
+    blocknum_t block = first;
+    while (block < end && !ret)
+    {
+        long found = s5_find_free_block(s5fs, block, end);
+        if (found < 0)
+        {
+            break;
+        }
+        blocknum_t stop = (blocknum_t)found + 1;
+        while (stop < end &&
+               s5_find_free_block(s5fs, stop, stop + 1) == (long)stop)
+        {
+            stop++;
+        }
+        if (!s5_discard_noted(s5fs, (blocknum_t)found, stop))
+        {
+            runs[n].br_block = (blocknum_t)found;
+            runs[n].br_count = stop - (blocknum_t)found;
+            if (++n == S5_DISCARD_BATCH)
+            {
+                ret = blockdev_discard(s5fs->s5f_bdev, runs, n);
+                n = 0;
+            }
+        }
+        block = stop;
+    }
+    return ret ? ret : blockdev_discard(s5fs->s5f_bdev, runs, n);
+}
+
+/*
+ * Discard runs of freed blocks taken with s5_discard_take(), whose frees are
+ * now on the disk. Each run is checked and discarded a group at a time, with
+ * the group locked. If the device turns out not to support discards, no more
+ * are noted; other errors are ignored, since discards are only advice.
+ */
+void s5_discard(s5fs_t *s5fs, const blockdev_range_t *ranges, size_t n)
+{
+    s5_super_t *s = &s5fs->s5f_super;
+    for (size_t i = 0; i < n; i++)
+    {
+        blocknum_t block = ranges[i].br_block;
+        blocknum_t end = block + (blocknum_t)ranges[i].br_count;
+        while (block < end)
+        {
+            size_t group = s5_block_group(s, block);
+            blocknum_t stop = MIN(end, s5_group_first_block(s, group + 1));
+            s5_group_t *g = &s5fs->s5f_groups[group];
+            kmutex_lock(&g->sg_mutex);
+            long ret = s5_discard_group(s5fs, block, stop);
+            kmutex_unlock(&g->sg_mutex);
+            if (ret == -ENOTSUP)
+            {
+                s5_lock_super(s5fs);
+                s5fs->s5f_discard = 0;
+                s5fs->s5f_ndiscards = 0;
+                s5_unlock_super(s5fs);
+                return;
+            }
+            block = stop;
+        }
+    }
+}
+
+/*
+ * The exact opposite of s5_alloc_block: mark blockno free in the bitmap. This
+ * should never fail.
+ */
+static void s5_free_block(s5fs_t *s5fs, blocknum_t blockno)
+{
     s5_super_t *s = &s5fs->s5f_super;
     dbg(DBG_S5FS, "freeing disk block %d\n", blockno);
-    KASSERT(blockno);
-    KASSERT(s->s5s_nfree < S5_NBLKS_PER_FNODE);
+    KASSERT(blockno >= S5_DATA_START(s) &&
+            blockno < s->s5s_num_blocks);
 
+    /* the block's contents no longer matter, so neither log them nor write
+     * them back; this must be done before the block can be allocated again */
+    mobj_t *mobj = S5FS_TO_VMOBJ(s5fs, (blocknum_t)blockno);
     pframe_t *pf;
-    s5_get_disk_block(s5fs, blockno, 1, &pf);
-
-    if (s->s5s_nfree == S5_NBLKS_PER_FNODE - 1)
+    mobj_lock(mobj);
+    mobj_find_pframe(mobj, blockno, &pf);
+    if (pf)
     {
-        memcpy(pf->pf_addr, s->s5s_free_blocks, sizeof(s->s5s_free_blocks));
+        s5_journal_forget(s5fs, pf);
+        mobj_clean_pframe(mobj, pf);
+        pframe_release(&pf);
+    }
+    mobj_unlock(mobj);
+
+    s5_group_t *g = &s5fs->s5f_groups[s5_block_group(s, blockno)];
+    kmutex_lock(&g->sg_mutex);
+    s5_set_block_used(s5fs, blockno, 0);
+    g->sg_nfree++;
+    kmutex_unlock(&g->sg_mutex);
+
+    s5_lock_super(s5fs);
+    s->s5s_nfree++;
+    s5_discard_note(s5fs, blockno);
+    s5_unlock_super(s5fs);
+}
+
+/*
+ * Delayed allocation.
+ *
+ * A write to an unmapped block of an extent-mapped regular file doesn't
+ * allocate a disk block: the data stays in a dirty page of the vnode's own
+ * memory object, and only a free block is reserved for it (s5f_ndelayed), so
+ * that the write can't later fail for lack of space. The blocks are allocated
+ * when the page is flushed, by which time the pages after it have usually been
+ * written too, so they all get one contiguous run.
+ */
 
-        s->s5s_nfree = 0;
-        s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] = blockno;
+/*
+ * Reserve a free block for a page written before its block is allocated.
+ * Return 0, or -ENOSPC if every free block is taken or promised.
+ */
+long s5_delalloc_reserve(s5fs_t *s5fs)
+{
+    long ret = 0;
+    s5_lock_super(s5fs);
+    if (s5fs->s5f_super.s5s_nfree <= s5fs->s5f_ndelayed)
+    {
+        ret = -ENOSPC;
     }
     else
     {
-        s->s5s_free_blocks[s->s5s_nfree++] = blockno;
-        pf->pf_dirty = 0;
+        s5fs->s5f_ndelayed++;
+    }
+    s5_unlock_super(s5fs);
+    return ret;
+}
+
+/*
+ * Give back n reservations made with s5_delalloc_reserve(), for pages that
+ * were discarded instead of written.
+ */
+void s5_delalloc_release(s5fs_t *s5fs, size_t n)
+{
+    s5_lock_super(s5fs);
+    KASSERT(s5fs->s5f_ndelayed >= n);
+    s5fs->s5f_ndelayed -= n;
+    s5_unlock_super(s5fs);
+}
+
+/*
+ * Write the dirty page pf of sn's vnode to its block, together with as many of
+ * the dirty pages right after it as are mapped to the blocks right after its,
+ * with one bio. If pf has no block yet, blocks are allocated for it and for
+ * the dirty pages after it that have none either, as one run if they can be.
+ * The pages after pf that are written are cleaned; cleaning pf itself is left
+ * to the caller (flush_pframe). The vnode and pf must be locked.
+ *
+ * Pages after pf that are locked by someone else are not waited for, since
+ * their holders may be waiting on us; they end the run instead.
+ *
+ * Return 0, or propagate errors from s5_file_block_to_disk_block,
+ * s5_extent_map and the write.
+ */
+long s5_flush_pages(s5_node_t *sn, pframe_t *pf)
+{
+    vnode_t *vn = &sn->vnode;
+    s5fs_t *s5fs = VNODE_TO_S5FS(vn);
+    KASSERT(kmutex_owns_mutex(&vn->vn_mobj.mo_mutex) &&
+            pframe_owned(pf));
+    long loc = s5_file_block_to_disk_block(sn, pf->pf_pagenum, 0);
+    if (loc < 0)
+    {
+        return loc;
+    }
+
+    pframe_t *pfs[S5_DELALLOC_MAX_RUN];
+    size_t n = 0;
+    pfs[n++] = pf;
+    while (n < MIN(S5_DELALLOC_MAX_RUN, BLOCKDEV_CLUSTER_BLOCKS) &&
+           (pf->pf_pagenum + n) * S5_BLOCK_SIZE < vn->vn_len)
+    {
+        pframe_t *next = radix_tree_lookup(&vn->vn_mobj.mo_pframe_idx,
+                                           pf->pf_pagenum + n);
+        if (!next || pframe_locked(next))
+        {
+            break;
+        }
+        pframe_lock(next);
+        long next_loc =
+            next->pf_addr && next->pf_dirty
+                ? s5_file_block_to_disk_block(sn, pf->pf_pagenum + n, 0)
+                : -1;
+        if (next_loc != (loc ? loc + (long)n : 0))
+        {
+            pframe_release(&next);
+            break;
+        }
+        pfs[n++] = next;
+    }
+
+    long ret = 0;
+    size_t count = n;
+    if (!loc)
+    {
+        /* the reservations become real blocks */
+        KASSERT(sn->inode.s5_flags & S5_FLAG_EXTENTS);
+        blocknum_t goal = s5_extent_alloc_goal(sn, pf->pf_pagenum);
+        s5_lock_super(s5fs);
+        KASSERT(s5fs->s5f_ndelayed >= n && s5fs->s5f_super.s5s_nfree >= n);
+        s5fs->s5f_ndelayed -= n;
+        s5fs->s5f_super.s5s_nfree -= (uint32_t)n;
+        s5_unlock_super(s5fs);
+        loc = s5_take_blocks(s5fs, goal, &count);
+        if (count < n)
+        {
+            s5_lock_super(s5fs);
+            s5fs->s5f_ndelayed += n - count;
+            s5fs->s5f_super.s5s_nfree += (uint32_t)(n - count);
+            s5_unlock_super(s5fs);
+        }
+        dbg(DBG_S5FS,
+            "allocated disk blocks [%ld, %ld) for %lu delayed pages\n", loc,
+            loc + (long)count, n);
+
+        size_t i;
+        for (i = 0; i < count; i++)
+        {
+            ret = s5_extent_map(sn, pfs[i]->pf_pagenum,
+                                (blocknum_t)loc + (blocknum_t)i);
+            if (ret < 0)
+            {
+                break;
+            }
+        }
+
+        /* blocks that could not be mapped go back to being reservations for
+         * the pages that are still dirty */
+        if (i < count)
+        {
+            for (size_t j = i; j < count; j++)
+            {
+                s5_free_block(s5fs, (blocknum_t)loc + (blocknum_t)j);
+            }
+            s5_lock_super(s5fs);
+            s5fs->s5f_ndelayed += count - i;
+            s5_unlock_super(s5fs);
+        }
+        count = i;
+    }
+    if (count)
+    {
+        ret = blockdev_rw_pframes(s5fs->s5f_bdev, (blocknum_t)loc, pfs, count,
+                                  1);
+    }
+
+    for (size_t j = 1; j < n; j++)
+    {
+        if (j < count && !ret)
+        {
+            mobj_clean_pframe(&vn->vn_mobj, pfs[j]);
+        }
+        pframe_release(&pfs[j]);
+    }
+    return ret;
+}
+
+/*
+ * Write back the pages of sn's vnode dirtied before dirtied_before; they stay
+ * cached, clean. Pages locked by someone else are left for the next pass. The
+ * vnode must be locked. Return 0, or the first error from writing a page,
+ * which is left dirty.
+ */
+long s5_writeback_pages(s5_node_t *sn, uint64_t dirtied_before)
+{
+    mobj_t *o = &sn->vnode.vn_mobj;
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    pframe_t *pfs[S5_DELALLOC_MAX_RUN];
+    size_t n;
+    long ret = 0;
+    while (!ret && (n = mobj_collect_dirty(o, dirtied_before, pfs,
+                                           S5_DELALLOC_MAX_RUN)))
+    {
+        size_t flushed = 0;
+        for (size_t i = 0; i < n && !ret; i++)
+        {
+            /* earlier flushes in this batch may have cleaned this one
+             * already */
+            pframe_t *pf = pfs[i];
+            if (pframe_locked(pf))
+            {
+                continue;
+            }
+            pframe_lock(pf);
+            if (pf->pf_dirty)
+            {
+                ret = mobj_flush_pframe(o, pf);
+                flushed++;
+            }
+            pframe_release(&pf);
+        }
+        if (!flushed)
+        {
+            break;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Allocate s5f_groups and count the free inodes and blocks of each allocation
+ * group from the bitmaps. Return 0, or -ENOMEM.
+ */
+long s5_init_groups(s5fs_t *s5fs)
+{
+    s5_super_t *s = &s5fs->s5f_super;
+    size_t ngroups = S5_NGROUPS(s);
+    s5fs->s5f_groups = kmalloc(ngroups * sizeof(s5_group_t));
+    if (!s5fs->s5f_groups)
+    {
+        return -ENOMEM;
+    }
+
+    for (size_t group = 0; group < ngroups; group++)
+    {
+        s5_group_t *g = &s5fs->s5f_groups[group];
+        kmutex_init(&g->sg_mutex);
+        size_t first = group * S5_INODES_PER_GROUP;
+        g->sg_nfree_inodes = (uint32_t)s5_bitmap_count_clear(
+            s5fs, s->s5s_ibitmap_block, first,
+            MIN(first + S5_INODES_PER_GROUP, (size_t)s->s5s_num_inodes));
+        g->sg_nfree = (uint32_t)s5_bitmap_count_clear(
+            s5fs, s->s5s_bitmap_block, s5_group_first_block(s, group),
+            s5_group_first_block(s, group + 1));
+    }
+    return 0;
+}
+
+/*
+ * Return the group a new inode should go in, given the inode of the directory
+ * it is created in: a file's own directory's group, so that the inodes of a
+ * directory's entries share inode blocks, or failing that the next group with
+ * room. A directory instead starts the search in the next group, and takes the
+ * first with at least an average share of free inodes, so that subtrees spread
+ * out over the disk rather than all crowding the root's group.
+ *
+ * The counts are read without locking the groups, so the group returned may be
+ * full by the time it is locked; s5_alloc_inode() then moves on to the next.
+ */
+static size_t s5_inode_group(s5fs_t *s5fs, ino_t parent, long dir)
+{
+    s5_super_t *s = &s5fs->s5f_super;
+    size_t ngroups = S5_NGROUPS(s);
+    size_t first = (S5_INODE_GROUP(parent) + (size_t)dir) % ngroups;
+    uint32_t want = dir ? s->s5s_nfree_inodes / (uint32_t)ngroups : 0;
+    for (size_t n = 0; n < ngroups; n++)
+    {
+        size_t group = (first + n) % ngroups;
+        if (s5fs->s5f_groups[group].sg_nfree_inodes > want)
+        {
+            return group;
+        }
     }
-    s5_release_disk_block(&pf);
-    s5_unlock_super(s5fs);
+    /* no group has more than an average share; any with room will do */
+    return first;
 }
 
 /*
- * Allocate one inode from the filesystem. You will need to use the super block
- * s5s_free_inode member. You must initialize the on-disk contents of the
- * allocated inode according to the arguments type and devid.
- *
- * Recall that the free inode list is a linked list. Each free inode contains a
- * link to the next free inode. The super block s5s_free_inode must always point
- * to the next free inode, or contain -1 to indicate no more inodes are
- * available.
- *
- * Don't forget to protect access to the super block and update s5s_free_inode.
+ * Return where an inode's first data block should go: the start of its group's
+ * share of the data blocks.
+ */
+static blocknum_t s5_inode_data_goal(s5fs_t *s5fs, ino_t ino)
+{
+    return s5_group_first_block(&s5fs->s5f_super, S5_INODE_GROUP(ino));
+}
+
+/*
+ * Allocate one inode from the filesystem, in the allocation group chosen by
+ * s5_inode_group(): the first free inode of the group at or after the parent
+ * directory's (i.e. in the same inode block if possible), wrapping around
+ * within the group. Initialize its on-disk contents according to the arguments
+ * type and devid.
  *
- * You should use s5_get_inode and s5_release_inode.
+ * The superblock is only locked to claim the inode from s5s_nfree_inodes; the
+ * inode bitmap is searched and updated under the group's lock, so inode
+ * allocation in one group contends neither with other groups nor with block
+ * allocation.
  *
  * On success, return the newly allocated inode number.
  * On failure, return -ENOSPC.
  */
-long s5_alloc_inode(s5fs_t *s5fs, uint16_t type, devid_t devid)
+long s5_alloc_inode(s5fs_t *s5fs, uint16_t type, devid_t devid, ino_t parent)
 {
     KASSERT((S5_TYPE_DATA == type) || (S5_TYPE_DIR == type) ||
             (S5_TYPE_CHR == type) || (S5_TYPE_BLK == type));
 
+    s5_super_t *s = &s5fs->s5f_super;
     s5_lock_super(s5fs);
-    uint32_t new_ino = s5fs->s5f_super.s5s_free_inode;
-    if (new_ino == (uint32_t)(-1))
+    if (!s->s5s_nfree_inodes)
     {
         s5_unlock_super(s5fs);
         return -ENOSPC;
     }
+    s->s5s_nfree_inodes--;
+    s5_unlock_super(s5fs);
+
+    /* the claimed inode is free in some group, though maybe only in one
+     * already passed by the time it is freed into it */
+    size_t ngroups = S5_NGROUPS(s);
+    size_t group = s5_inode_group(s5fs, parent, S5_TYPE_DIR == type);
+    s5_group_t *g = &s5fs->s5f_groups[group];
+    kmutex_lock(&g->sg_mutex);
+    while (!g->sg_nfree_inodes)
+    {
+        kmutex_unlock(&g->sg_mutex);
+        group = (group + 1) % ngroups;
+        g = &s5fs->s5f_groups[group];
+        kmutex_lock(&g->sg_mutex);
+    }
+
+    size_t start = group * S5_INODES_PER_GROUP;
+    size_t end = MIN(start + S5_INODES_PER_GROUP, (size_t)s->s5s_num_inodes);
+    size_t from = S5_INODE_GROUP(parent) == group ? parent : start;
+    long found = s5_bitmap_find(s5fs, s->s5s_ibitmap_block, from, end);
+    if (found < 0)
+    {
+        found = s5_bitmap_find(s5fs, s->s5s_ibitmap_block, start, from);
+    }
+    KASSERT(found >= 0 && "sg_nfree_inodes disagrees with the inode bitmap");
+    uint32_t new_ino = (uint32_t)found;
+    s5_bitmap_set(s5fs, s->s5s_ibitmap_block, new_ino, 1);
+    g->sg_nfree_inodes--;
 
     pframe_t *pf;
     s5_inode_t *inode;
     s5_get_inode(s5fs, new_ino, 1, &pf, &inode);
-
-    s5fs->s5f_super.s5s_free_inode = inode->s5_un.s5_next_free;
-    KASSERT(inode->s5_un.s5_next_free != inode->s5_number);
+    KASSERT(inode->s5_type == S5_TYPE_FREE && inode->s5_number == new_ino);
 
     inode->s5_un.s5_size = 0;
-    inode->s5_type = type;
+    inode->s5_type = (uint8_t)type;
     inode->s5_linkcount = 0;
     memset(inode->s5_direct_blocks, 0, sizeof(inode->s5_direct_blocks));
-    inode->s5_indirect_block =
-        (S5_TYPE_CHR == type || S5_TYPE_BLK == type) ? devid : 0;
+    if (S5_TYPE_CHR == type || S5_TYPE_BLK == type)
+    {
+        inode->s5_flags = 0;
+        inode->s5_indirect_block = devid;
+    }
+    else
+    {
+        /* new files are extent-mapped, which leaves an empty tree of depth 0,
+         * or inline if they are regular files */
+        inode->s5_flags = S5_TYPE_DATA == type && s5_inline_supported(s5fs)
+                              ? S5_FLAG_INLINE
+                              : S5_FLAG_EXTENTS;
+        inode->s5_indirect_block = 0;
+    }
 
     s5_release_inode(&pf, &inode);
-    s5_unlock_super(s5fs);
+    kmutex_unlock(&g->sg_mutex);
 
-    dbg(DBG_S5FS, "allocated inode %d\n", new_ino);
+    dbg(DBG_S5FS, "allocated inode %d (group %lu)\n", new_ino, group);
     return new_ino;
 }
 
 /*
  * Free the inode by:
- *  1) adding the inode to the free inode linked list (opposite of
- * s5_alloc_inode), and 2) freeing all blocks being used by the inode.
+ *  1) clearing its bit in the inode bitmap (opposite of s5_alloc_inode), and
+ *  2) freeing all blocks being used by the inode.
  *
  * The suggested order of operations to avoid deadlock, is:
- *  1) lock the super block
+ *  1) lock the inode's allocation group (sg_mutex)
  *  2) get the inode to be freed
- *  3) update the free inode linked list
+ *  3) update the inode bitmap
  *  4) copy the blocks to be freed from the inode onto the stack
  *  5) release the inode
- *  6) unlock the super block
+ *  6) unlock the group, and count the inode as free in the superblock
  *  7) free all direct blocks
  *  8) get the indirect block
  *  9) copy the indirect block array onto the stack
@@ -604,12 +2210,27 @@ void s5_free_inode(s5fs_t *s5fs, ino_t ino)
 {
     pframe_t *pf;
     s5_inode_t *inode;
-    s5_lock_super(s5fs);
+    s5_group_t *g = &s5fs->s5f_groups[S5_INODE_GROUP(ino)];
+    kmutex_lock(&g->sg_mutex);
     s5_get_inode(s5fs, ino, 1, &pf, &inode);
 
     uint32_t direct_blocks_to_free[S5_NDIRECT_BLOCKS];
     uint32_t indirect_block_to_free;
-    if (inode->s5_type == S5_TYPE_DATA || inode->s5_type == S5_TYPE_DIR)
+    s5_extent_header_t extent_header = {0};
+    s5_extent_t extents_to_free[S5_INODE_NEXTENTS];
+    if (inode->s5_flags & S5_FLAG_INLINE)
+    {
+        indirect_block_to_free = 0;
+        memset(direct_blocks_to_free, 0, sizeof(direct_blocks_to_free));
+    }
+    else if (inode->s5_flags & S5_FLAG_EXTENTS)
+    {
+        extent_header = inode->s5_extent_header;
+        memcpy(extents_to_free, inode->s5_extents, sizeof(extents_to_free));
+        indirect_block_to_free = 0;
+        memset(direct_blocks_to_free, 0, sizeof(direct_blocks_to_free));
+    }
+    else if (inode->s5_type == S5_TYPE_DATA || inode->s5_type == S5_TYPE_DIR)
     {
         indirect_block_to_free = inode->s5_indirect_block;
         memcpy(direct_blocks_to_free, inode->s5_direct_blocks,
@@ -622,13 +2243,20 @@ void s5_free_inode(s5fs_t *s5fs, ino_t ino)
         memset(direct_blocks_to_free, 0, sizeof(direct_blocks_to_free));
     }
 
-    inode->s5_un.s5_next_free = s5fs->s5f_super.s5s_free_inode;
     inode->s5_type = S5_TYPE_FREE;
-    s5fs->s5f_super.s5s_free_inode = inode->s5_number;
+    inode->s5_flags = 0;
+    s5_bitmap_set(s5fs, s5fs->s5f_super.s5s_ibitmap_block, ino, 0);
+    g->sg_nfree_inodes++;
 
     s5_release_inode(&pf, &inode);
+    kmutex_unlock(&g->sg_mutex);
+
+    s5_lock_super(s5fs);
+    s5fs->s5f_super.s5s_nfree_inodes++;
     s5_unlock_super(s5fs);
 
+    s5_extent_free_all(s5fs, &extent_header, extents_to_free);
+
     for (unsigned i = 0; i < S5_NDIRECT_BLOCKS; i++)
     {
         if (direct_blocks_to_free[i])
@@ -657,6 +2285,328 @@ void s5_free_inode(s5fs_t *s5fs, ino_t ino)
     dbg(DBG_S5FS, "freed inode %d\n", ino);
 }
 
+/*
+ * Hashed directory indexes (S5_FLAG_DIR_INDEX); see s5fs.h for the layout.
+ * All of these are called with the directory locked.
+ */
+
+/* FNV-1a hash of a name */
+static uint32_t s5_dx_hash(const char *name, size_t namelen)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < namelen && name[i]; i++)
+    {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/* Return the slot of the directory entry at a file position */
+#define S5_DX_SLOT(filepos) ((uint32_t)((filepos) / sizeof(s5_dirent_t)))
+
+/*
+ * Get block n of a directory's index. Return 0, or propagate errors from
+ * s5_file_block_to_disk_block if the block had to be allocated.
+ */
+static long s5_dx_get_block(s5_node_t *sn, uint32_t n, long forwrite,
+                            pframe_t **pfp)
+{
+    long loc = s5_file_block_to_disk_block(sn, S5_DIR_INDEX_BLOCK + n,
+                                           forwrite);
+    if (loc < 0)
+    {
+        return loc;
+    }
+    KASSERT(loc && "hashed directory index block is missing");
+    s5_get_disk_block(VNODE_TO_S5FS(&sn->vnode), (blocknum_t)loc, forwrite,
+                      pfp);
+    return 0;
+}
+
+/*
+ * Return the index of the last entry of a root whose range starts at or
+ * before hash, or, in a bucket, the first entry with a hash at or after it.
+ */
+static uint32_t s5_dx_search(s5_dx_node_t *node, uint32_t hash, long root)
+{
+    uint32_t lo = 0, hi = node->s5dx_count;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (root ? node->s5dx_entries[mid].s5dx_hash <= hash
+                 : node->s5dx_entries[mid].s5dx_hash < hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return root ? lo - 1 : lo;
+}
+
+/*
+ * Return the position in the root of the bucket covering hash, and its
+ * number in bucketp.
+ */
+static uint32_t s5_dx_find_bucket(s5_node_t *sn, uint32_t hash,
+                                  uint32_t *bucketp)
+{
+    pframe_t *pf;
+    long ret = s5_dx_get_block(sn, 0, 0, &pf);
+    KASSERT(!ret);
+    s5_dx_node_t *root = pf->pf_addr;
+    KASSERT(root->s5dx_count && !root->s5dx_entries[0].s5dx_hash);
+    uint32_t i = s5_dx_search(root, hash, 1);
+    *bucketp = root->s5dx_entries[i].s5dx_ptr;
+    s5_release_disk_block(&pf);
+    return i;
+}
+
+/* Insert an entry at position i of a node, which must not be full */
+static void s5_dx_node_insert(s5_dx_node_t *node, uint32_t i, uint32_t hash,
+                              uint32_t ptr)
+{
+    KASSERT(node->s5dx_count < S5_DX_NENTRIES);
+    for (uint32_t j = node->s5dx_count; j > i; j--)
+    {
+        node->s5dx_entries[j] = node->s5dx_entries[j - 1];
+    }
+    node->s5dx_entries[i].s5dx_hash = hash;
+    node->s5dx_entries[i].s5dx_ptr = ptr;
+    node->s5dx_count++;
+}
+
+/*
+ * Split the full bucket at position i of the root in two, at a boundary
+ * between hashes, giving the upper half a new bucket. Return 0, -ENOSPC if the
+ * root is full or every entry of the bucket has the same hash, or propagate
+ * errors from s5_dx_get_block.
+ */
+static long s5_dx_split(s5_node_t *sn, uint32_t i, uint32_t bucket)
+{
+    pframe_t *rootpf, *lowerpf, *upperpf;
+    long ret = s5_dx_get_block(sn, 0, 0, &rootpf);
+    KASSERT(!ret);
+    uint32_t upperno = ((s5_dx_node_t *)rootpf->pf_addr)->s5dx_count + 1;
+    s5_release_disk_block(&rootpf);
+    if (upperno > S5_DX_NENTRIES)
+    {
+        return -ENOSPC;
+    }
+
+    /* blocks are allocated before any is held, since the allocator gets
+     * blocks of its own; an unused new bucket is simply reused next time */
+    if ((ret = s5_dx_get_block(sn, upperno, 1, &upperpf)) < 0)
+    {
+        return ret;
+    }
+    s5_dx_get_block(sn, bucket, 1, &lowerpf);
+    s5_dx_node_t *lower = lowerpf->pf_addr, *upper = upperpf->pf_addr;
+    s5_dx_entry_t *e = lower->s5dx_entries;
+
+    uint32_t split = lower->s5dx_count / 2;
+    while (split < lower->s5dx_count &&
+           e[split].s5dx_hash == e[split - 1].s5dx_hash)
+    {
+        split++;
+    }
+    if (split == lower->s5dx_count)
+    {
+        split = lower->s5dx_count / 2;
+        while (split > 0 && e[split].s5dx_hash == e[split - 1].s5dx_hash)
+        {
+            split--;
+        }
+    }
+    if (!split)
+    {
+        s5_release_disk_block(&lowerpf);
+        s5_release_disk_block(&upperpf);
+        return -ENOSPC;
+    }
+
+    upper->s5dx_count = lower->s5dx_count - split;
+    memcpy(upper->s5dx_entries, &e[split],
+           upper->s5dx_count * sizeof(s5_dx_entry_t));
+    lower->s5dx_count = split;
+    uint32_t key = upper->s5dx_entries[0].s5dx_hash;
+    s5_release_disk_block(&lowerpf);
+    s5_release_disk_block(&upperpf);
+
+    s5_dx_get_block(sn, 0, 1, &rootpf);
+    s5_dx_node_insert(rootpf->pf_addr, i + 1, key, upperno);
+    s5_release_disk_block(&rootpf);
+    return 0;
+}
+
+/*
+ * Add the directory entry at slot, whose name hashes to hash, to the index.
+ * Return 0, or -errno if the index could not hold it.
+ */
+static long s5_dx_insert(s5_node_t *sn, uint32_t hash, uint32_t slot)
+{
+    while (1)
+    {
+        uint32_t bucket;
+        uint32_t i = s5_dx_find_bucket(sn, hash, &bucket);
+
+        pframe_t *pf;
+        s5_dx_get_block(sn, bucket, 1, &pf);
+        s5_dx_node_t *node = pf->pf_addr;
+        long full = node->s5dx_count == S5_DX_NENTRIES;
+        if (!full)
+        {
+            s5_dx_node_insert(node, s5_dx_search(node, hash, 0), hash, slot);
+        }
+        s5_release_disk_block(&pf);
+        if (!full)
+        {
+            return 0;
+        }
+
+        long ret = s5_dx_split(sn, i, bucket);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+}
+
+/*
+ * Find the index entry for the directory entry at slot, whose name hashes to
+ * hash, and either remove it or, if newslot is not -1, move it to newslot.
+ */
+static void s5_dx_update(s5_node_t *sn, uint32_t hash, uint32_t slot,
+                         uint32_t newslot)
+{
+    uint32_t bucket;
+    s5_dx_find_bucket(sn, hash, &bucket);
+    pframe_t *pf;
+    s5_dx_get_block(sn, bucket, 1, &pf);
+    s5_dx_node_t *node = pf->pf_addr;
+    uint32_t i = s5_dx_search(node, hash, 0);
+    while (node->s5dx_entries[i].s5dx_ptr != slot)
+    {
+        i++;
+        KASSERT(i < node->s5dx_count && node->s5dx_entries[i].s5dx_hash == hash);
+    }
+
+    if (newslot != (uint32_t)-1)
+    {
+        node->s5dx_entries[i].s5dx_ptr = newslot;
+    }
+    else
+    {
+        node->s5dx_count--;
+        for (; i < node->s5dx_count; i++)
+        {
+            node->s5dx_entries[i] = node->s5dx_entries[i + 1];
+        }
+    }
+    s5_release_disk_block(&pf);
+}
+
+/*
+ * Look a name up in the index, as s5_find_dirent() does.
+ */
+static long s5_dx_find(s5_node_t *sn, const char *name, size_t namelen,
+                       size_t *filepos)
+{
+    uint32_t hash = s5_dx_hash(name, namelen);
+    uint32_t bucket;
+    s5_dx_find_bucket(sn, hash, &bucket);
+
+    pframe_t *pf;
+    s5_dx_get_block(sn, bucket, 0, &pf);
+    s5_dx_node_t *node = pf->pf_addr;
+    long ino = -ENOENT;
+    for (uint32_t i = s5_dx_search(node, hash, 0);
+         i < node->s5dx_count && node->s5dx_entries[i].s5dx_hash == hash; i++)
+    {
+        size_t pos = node->s5dx_entries[i].s5dx_ptr * sizeof(s5_dirent_t);
+        s5_dirent_t dirent;
+        ssize_t ret = s5_read_file(sn, pos, (char *)&dirent, sizeof(dirent));
+        if (ret < 0)
+        {
+            ino = ret;
+            break;
+        }
+        KASSERT(ret == sizeof(dirent));
+        if (name_match(dirent.s5d_name, name, namelen))
+        {
+            if (filepos)
+            {
+                *filepos = pos;
+            }
+            ino = dirent.s5d_inode;
+            break;
+        }
+    }
+    s5_release_disk_block(&pf);
+    return ino;
+}
+
+/*
+ * Stop using a directory's index, after it could not be updated. Its blocks
+ * stay allocated, and are reused if the index is built again.
+ */
+static void s5_dx_drop(s5_node_t *sn, long err)
+{
+    dbg(DBG_S5FS, "dropping the index of directory %d: %ld\n",
+        sn->inode.s5_number, err);
+    sn->inode.s5_flags &= ~S5_FLAG_DIR_INDEX;
+    sn->dirtied_inode = 1;
+}
+
+/*
+ * Index every entry of an extent-mapped directory. On failure, the directory
+ * is left unindexed.
+ */
+static void s5_dx_build(s5_node_t *sn)
+{
+    KASSERT(sn->inode.s5_flags & S5_FLAG_EXTENTS);
+    pframe_t *pf;
+    long ret = s5_dx_get_block(sn, 1, 1, &pf);
+    if (!ret)
+    {
+        ((s5_dx_node_t *)pf->pf_addr)->s5dx_count = 0;
+        s5_release_disk_block(&pf);
+        ret = s5_dx_get_block(sn, 0, 1, &pf);
+    }
+    if (ret < 0)
+    {
+        dbg(DBG_S5FS, "could not index directory %d: %ld\n",
+            sn->inode.s5_number, ret);
+        return;
+    }
+    s5_dx_node_t *root = pf->pf_addr;
+    root->s5dx_count = 1;
+    root->s5dx_entries[0].s5dx_hash = 0;
+    root->s5dx_entries[0].s5dx_ptr = 1;
+    s5_release_disk_block(&pf);
+    sn->inode.s5_flags |= S5_FLAG_DIR_INDEX;
+    sn->dirtied_inode = 1;
+
+    for (size_t pos = 0; pos < sn->vnode.vn_len; pos += sizeof(s5_dirent_t))
+    {
+        s5_dirent_t dirent;
+        ret = s5_read_file(sn, pos, (char *)&dirent, sizeof(dirent));
+        if (ret >= 0)
+        {
+            ret = s5_dx_insert(sn, s5_dx_hash(dirent.s5d_name, S5_NAME_LEN),
+                               S5_DX_SLOT(pos));
+        }
+        if (ret < 0)
+        {
+            s5_dx_drop(sn, ret);
+            return;
+        }
+    }
+    dbg(DBG_S5FS, "indexed directory %d\n", sn->inode.s5_number);
+}
+
 /* Return the inode number corresponding to the directory entry specified by
  * name and namelen within a given directory.
  *
@@ -669,6 +2619,8 @@ void s5_free_inode(s5fs_t *s5fs, ino_t ino)
  * Return the desired inode number, or:
  *  - ENOENT: Could not find a directory entry with the specified name
  *
+ * Directories with a hashed index are looked up through it instead.
+ *
  * Hints:
  *  - Use s5_read_file in increments of sizeof(s5_dirent_t) to read successive
  *    directory entries and compare them against name and namelen.
@@ -683,6 +2635,10 @@ long s5_find_dirent(s5_node_t *sn, const char *name, size_t namelen,
 {
     KASSERT(S_ISDIR(sn->vnode.vn_mode));
     KASSERT(S5_BLOCK_SIZE == PAGE_SIZE );
+    if (sn->inode.s5_flags & S5_FLAG_DIR_INDEX)
+    {
+        return s5_dx_find(sn, name, namelen, filepos);
+    }
     // / size, p
     // start writing 
 
@@ -725,6 +2681,92 @@ long s5_find_dirent(s5_node_t *sn, const char *name, size_t namelen,
     // return -1;
 }
 
+/* Start reads of the blocks holding the inodes of a run of directory
+ * entries, so that stat()ing them next (as ls -l does) finds them resident.
+ * Entries made together have neighbouring inodes, so consecutive duplicates
+ * are dropped, and runs of blocks are read with one bio each. */
+static void s5_stat_ahead(s5fs_t *s5fs, const struct dirent *d, size_t n)
+{
+    blocknum_t blocks[S5_READAHEAD_MAX];
+    size_t nblocks = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        blocknum_t block = S5_INODE_BLOCK(d[i].d_ino);
+        if (nblocks && blocks[nblocks - 1] == block)
+        {
+            continue;
+        }
+        if (nblocks == sizeof(blocks) / sizeof(blocks[0]))
+        {
+            blockdev_readahead(s5fs->s5f_bdev, blocks, nblocks);
+            nblocks = 0;
+        }
+        blocks[nblocks++] = block;
+    }
+    if (nblocks)
+    {
+        blockdev_readahead(s5fs->s5f_bdev, blocks, nblocks);
+    }
+}
+
+/* Read directory entries from *posp on into d, as many as fit in count,
+ * copying each block's entries straight out of its pframe, and advance *posp
+ * past them. The blocks the entries will be read from are read ahead first,
+ * and reads of their inodes are started afterwards (see s5_stat_ahead()).
+ *
+ * Return the number of entries read, which is 0 at the end of the directory,
+ * or propagate errors from getting the directory's first block. An error on a
+ * later block ends the read early.
+ */
+ssize_t s5_read_dirents(s5_node_t *sn, size_t *posp, struct dirent *d,
+                        size_t count)
+{
+    KASSERT(S_ISDIR(sn->vnode.vn_mode));
+    size_t size = sn->inode.s5_un.s5_size;
+    size_t pos = *posp;
+    if (!count || pos + sizeof(s5_dirent_t) > size)
+    {
+        return 0;
+    }
+    size_t end = MIN(size, pos + count * sizeof(s5_dirent_t));
+
+    long locked = s5_lock_pages(sn);
+    s5_readahead_range(sn, S5_DATA_BLOCK(pos), S5_DATA_BLOCK(end - 1) + 1);
+    s5_unlock_pages(sn, locked);
+
+    size_t n = 0;
+    while (pos + sizeof(s5_dirent_t) <= end)
+    {
+        pframe_t *pf;
+        locked = s5_lock_pages(sn);
+        long ret = s5_get_file_block(sn, S5_DATA_BLOCK(pos), 0, &pf);
+        s5_unlock_pages(sn, locked);
+        if (ret < 0)
+        {
+            if (!n)
+            {
+                return ret;
+            }
+            break;
+        }
+        size_t block_end = MIN(end, (S5_DATA_BLOCK(pos) + 1) * S5_BLOCK_SIZE);
+        for (; pos + sizeof(s5_dirent_t) <= block_end;
+             pos += sizeof(s5_dirent_t), n++)
+        {
+            s5_dirent_t *de =
+                (s5_dirent_t *)((char *)pf->pf_addr + S5_DATA_OFFSET(pos));
+            d[n].d_ino = de->s5d_inode;
+            d[n].d_off = pos + sizeof(s5_dirent_t);
+            strcpy(d[n].d_name, de->s5d_name);
+        }
+        s5_release_file_block(&pf);
+    }
+    *posp = pos;
+
+    s5_stat_ahead(VNODE_TO_S5FS(&sn->vnode), d, n);
+    return n;
+}
+
 /* Remove the directory entry specified by name and namelen from the directory
  * sn.
  *
@@ -762,16 +2804,28 @@ void s5_remove_dirent(s5_node_t *sn, const char *name, size_t namelen,
     // s5_dirent_t dirent;
     // s5_read_file(sn, filepos, dirent, sizeof(s5_dirent_t));
 
-    char buf[sizeof(s5_dirent_t)];
+    s5_dirent_t last;
     size_t last_dirent_pos = sn->inode.s5_un.s5_size - sizeof(s5_dirent_t);
-    s5_read_file(sn, last_dirent_pos, buf, sizeof(s5_dirent_t));
-    s5_write_file(sn, filepos, buf, sizeof(s5_dirent_t));
+    s5_read_file(sn, last_dirent_pos, (char *)&last, sizeof(s5_dirent_t));
+    s5_write_file(sn, filepos, (char *)&last, sizeof(s5_dirent_t));
+
+    if (sn->inode.s5_flags & S5_FLAG_DIR_INDEX)
+    {
+        s5_dx_update(sn, s5_dx_hash(name, namelen), S5_DX_SLOT(filepos),
+                     (uint32_t)-1);
+        if (filepos != last_dirent_pos)
+        {
+            s5_dx_update(sn, s5_dx_hash(last.s5d_name, S5_NAME_LEN),
+                         S5_DX_SLOT(last_dirent_pos), S5_DX_SLOT(filepos));
+        }
+    }
 
 //     //// args are switched probably
 //     s5_write_file(sn, buf, filepos, sizeof(s5_dirent_t));
     
     // truncate by adjusting vn len
     sn->vnode.vn_len -= sizeof(s5_dirent_t);
+    sn->inode.s5_un.s5_size = sn->vnode.vn_len;
     child->inode.s5_linkcount--;
     sn->dirtied_inode = 1;
     child->dirtied_inode = 1;
@@ -857,9 +2911,13 @@ long s5_link(s5_node_t *dir, const char *name, size_t namelen,
     // check if the directory entry already exists
     size_t filepos;
     long ino = s5_find_dirent(dir, name, namelen, &filepos);
-    if (ino != ENOENT)
+    if (ino != -ENOENT)
     {
-        return -EEXIST;
+        return ino < 0 ? ino : -EEXIST;
+    }
+    if (dir->vnode.vn_len + sizeof(s5_dirent_t) > S5_DIR_MAX_SIZE)
+    {
+        return -ENOSPC;
     }
 
     // create a new directory entry
@@ -870,12 +2928,29 @@ long s5_link(s5_node_t *dir, const char *name, size_t namelen,
     
     // write the new directory entry to the file- dir->vnode.vn_len, dirent, sizeof(s5_dirent_t)
     // s5_node_t *sn, size_t pos, const char *buf, size_t len
-    int err = s5_write_file(dir, dir->vnode.vn_len, (char *)&dirent, sizeof(s5_dirent_t));
+    size_t pos = dir->vnode.vn_len;
+    int err = s5_write_file(dir, pos, (char *)&dirent, sizeof(s5_dirent_t));
     if (err < 0)
     {
         return err; /// any cleanup needed?
     }
 
+    if (dir->inode.s5_flags & S5_FLAG_DIR_INDEX)
+    {
+        long ret = s5_dx_insert(dir, s5_dx_hash(name, namelen),
+                                S5_DX_SLOT(pos));
+        if (ret < 0)
+        {
+            s5_dx_drop(dir, ret);
+        }
+    }
+    else if ((dir->inode.s5_flags & S5_FLAG_EXTENTS) &&
+             dir->vnode.vn_len ==
+                 S5_DIR_INDEX_THRESHOLD * sizeof(s5_dirent_t))
+    {
+        s5_dx_build(dir);
+    }
+
     // update linkcounts and mark inodes dirty
     child->inode.s5_linkcount++;
     child->dirtied_inode = 1;
@@ -909,11 +2984,19 @@ long s5_inode_blocks(s5_node_t *sn)
 //  *    have any blocks allocated to them. Remember, the s5_indirect_block for
 //  *    these special files is actually the device id.
 
-    if (S_ISCHR(sn->vnode.vn_mode) || S_ISBLK(sn->vnode.vn_mode))
+    if (S_ISCHR(sn->vnode.vn_mode) || S_ISBLK(sn->vnode.vn_mode) ||
+        (sn->inode.s5_flags & S5_FLAG_INLINE))
     {
         return 0;
     }
 
+    if (sn->inode.s5_flags & S5_FLAG_EXTENTS)
+    {
+        return s5_extent_count_blocks(VNODE_TO_S5FS(&sn->vnode),
+                                      &sn->inode.s5_extent_header,
+                                      sn->inode.s5_extents);
+    }
+
     // count the number of blocks allocated for sn
     int count = 0;
     for (unsigned i = 0; i < S5_NDIRECT_BLOCKS; i++)
@@ -925,6 +3008,12 @@ long s5_inode_blocks(s5_node_t *sn)
         }
     }
 
+    if (!sn->inode.s5_indirect_block)
+    {
+        return count;
+    }
+    count++;
+
     s5fs_t* s5 = VNODE_TO_S5FS(&sn->vnode); ///// idk
     pframe_t* pf;
     s5_get_disk_block(s5, sn->inode.s5_indirect_block, 0, &pf);
@@ -975,6 +3064,29 @@ void s5_remove_blocks(s5_node_t *sn)
     // First, free the the direct blocks
     s5fs_t* s5fs = VNODE_TO_S5FS(&sn->vnode);
     s5_inode_t* s5_inode = &sn->inode; 
+    sn->bmap_len = 0;
+    if (s5_inode->s5_flags & S5_FLAG_INLINE)
+    {
+        memset(s5_inode->s5_inline, 0, sizeof(s5_inode->s5_inline));
+        return;
+    }
+    if (s5_inode->s5_flags & S5_FLAG_EXTENTS)
+    {
+        s5_extent_header_t header = s5_inode->s5_extent_header;
+        s5_extent_t extents[S5_INODE_NEXTENTS];
+        memcpy(extents, s5_inode->s5_extents, sizeof(extents));
+        memset(&s5_inode->s5_extent_header, 0,
+               sizeof(s5_inode->s5_extent_header));
+        memset(s5_inode->s5_extents, 0, sizeof(s5_inode->s5_extents));
+        s5_extent_free_all(s5fs, &header, extents);
+        /* an emptied file starts over inline, as a new one would */
+        if (s5_inode->s5_type == S5_TYPE_DATA && s5_inline_supported(s5fs))
+        {
+            s5_inode->s5_flags = S5_FLAG_INLINE;
+        }
+        return;
+    }
+
     for (unsigned i = 0; i < S5_NDIRECT_BLOCKS; i++) 
     {
         if (s5_inode->s5_direct_blocks[i])
@@ -0,0 +1,977 @@
+/*
+ * An in-memory filesystem for scratch data; see fs/tmpfs/tmpfs.h.
+ *
+ * Inodes live in a radix tree indexed by inode number, which is handed out
+ * from a counter so that numbers are not reused while the dentry cache may
+ * still know them. As in ramfs, an inode's link count includes one for its
+ * vnode while it has one, so an unlinked file that is still open (or mapped)
+ * goes away only with its last vnode reference.
+ *
+ * Regular files keep their contents in an anonymous mobj, page by page: a
+ * page that was never written reads as zeroes without being stored, and the
+ * pages can be evicted to swap. mmap() hands out that same mobj.
+ *
+ * Directories hash their entries into buckets, doubling the number of
+ * buckets as entries are added, so that looking a name up does not depend on
+ * the size of the directory. Each entry also has a slot in an array, whose
+ * index is its position for readdir(); slots of removed entries are reused.
+ * "." and ".." are not stored, but reported by readdir() at positions 0 and
+ * 1 and resolved by lookup() from the directory's parent.
+ */
+
+#include "fs/tmpfs/tmpfs.h"
+#include "errno.h"
+#include "fs/dirent.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "globals.h"
+#include "kernel.h"
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+#include "util/debug.h"
+#include "util/radix.h"
+#include "util/string.h"
+#include "vm/anon.h"
+#include "vm/swap.h"
+
+/* A directory's hash buckets, and how many entries it may have per bucket
+ * before they are doubled */
+#define TMPFS_DIR_MIN_BUCKETS 8
+#define TMPFS_DIR_MAX_BUCKETS (KMALLOC_MAX_SIZE / sizeof(list_t))
+#define TMPFS_DIR_LOAD 2
+
+/* A directory's readdir slots */
+#define TMPFS_DIR_MIN_SLOTS 8
+#define TMPFS_DIR_MAX_SLOTS (KMALLOC_MAX_SIZE / sizeof(void *))
+
+/* The positions of "." and "..", before the entries' slots */
+#define TMPFS_DOT_SLOTS 2
+
+typedef struct tmpfs_dirent
+{
+    ino_t de_ino;
+    uint32_t de_hash;
+    size_t de_slot;      /* index in the directory's td_slots */
+    list_link_t de_link; /* link on the directory's hash bucket */
+    size_t de_namelen;
+    char de_name[NAME_LEN];
+} tmpfs_dirent_t;
+
+typedef struct tmpfs_dir
+{
+    ino_t td_parent;
+    list_t *td_buckets;
+    size_t td_nbuckets; /* a power of two */
+    size_t td_nentries;
+    tmpfs_dirent_t **td_slots; /* entries by position, NULL where free */
+    size_t td_nslots;          /* slots up to the last one in use */
+    size_t td_capacity;
+    size_t td_free; /* no slot below this one is free */
+} tmpfs_dir_t;
+
+typedef struct tmpfs_inode
+{
+    ino_t ti_ino;
+    int ti_mode;
+    long ti_nlink; /* entries naming it, plus one while it has a vnode */
+    size_t ti_size;
+    mobj_t *ti_data;   /* regular files: the contents */
+    devid_t ti_devid;  /* device files */
+    tmpfs_dir_t ti_dir; /* directories */
+} tmpfs_inode_t;
+
+typedef struct tmpfs
+{
+    radix_tree_t tf_inodes; /* inode number -> tmpfs_inode_t */
+    ino_t tf_next_ino;
+    kmutex_t tf_mutex; /* protects the two above */
+    slab_allocator_t *tf_inode_allocator;
+    slab_allocator_t *tf_dirent_allocator;
+} tmpfs_t;
+
+#define VNODE_TO_TMPFSINODE(vn) ((tmpfs_inode_t *)(vn)->vn_i)
+#define VNODE_TO_TMPFS(vn) ((tmpfs_t *)(vn)->vn_fs->fs_i)
+
+/*
+ * Filesystem operations
+ */
+static void tmpfs_read_vnode(fs_t *fs, vnode_t *vn);
+
+static void tmpfs_delete_vnode(fs_t *fs, vnode_t *vn);
+
+static long tmpfs_umount(fs_t *fs);
+
+static fs_ops_t tmpfs_ops = {.read_vnode = tmpfs_read_vnode,
+                             .delete_vnode = tmpfs_delete_vnode,
+                             .umount = tmpfs_umount};
+
+/*
+ * vnode operations
+ */
+static ssize_t tmpfs_read(vnode_t *file, size_t pos, void *buf, size_t count);
+
+static ssize_t tmpfs_write(vnode_t *file, size_t pos, const void *buf,
+                           size_t count);
+
+static long tmpfs_mmap(vnode_t *file, mobj_t **ret);
+
+static long tmpfs_mknod(vnode_t *dir, const char *name, size_t namelen,
+                        int mode, devid_t devid, vnode_t **out);
+
+static long tmpfs_lookup(vnode_t *dir, const char *name, size_t namelen,
+                         vnode_t **out);
+
+static long tmpfs_link(vnode_t *dir, const char *name, size_t namelen,
+                       vnode_t *child);
+
+static long tmpfs_unlink(vnode_t *dir, const char *name, size_t namelen);
+
+static long tmpfs_rename(vnode_t *olddir, const char *oldname,
+                         size_t oldnamelen, vnode_t *newdir,
+                         const char *newname, size_t newnamelen);
+
+static long tmpfs_mkdir(vnode_t *dir, const char *name, size_t namelen,
+                        vnode_t **out);
+
+static long tmpfs_rmdir(vnode_t *dir, const char *name, size_t namelen);
+
+static ssize_t tmpfs_readdir(vnode_t *dir, size_t pos, struct dirent *d);
+
+static long tmpfs_stat(vnode_t *vn, stat_t *buf);
+
+static void tmpfs_truncate_file(vnode_t *file);
+
+static vnode_ops_t tmpfs_dir_vops = {.read = NULL,
+                                     .write = NULL,
+                                     .mmap = NULL,
+                                     .mknod = tmpfs_mknod,
+                                     .lookup = tmpfs_lookup,
+                                     .link = tmpfs_link,
+                                     .unlink = tmpfs_unlink,
+                                     .rename = tmpfs_rename,
+                                     .mkdir = tmpfs_mkdir,
+                                     .rmdir = tmpfs_rmdir,
+                                     .readdir = tmpfs_readdir,
+                                     .stat = tmpfs_stat,
+                                     .acquire = NULL,
+                                     .release = NULL,
+                                     .get_pframe = NULL,
+                                     .fill_pframe = NULL,
+                                     .flush_pframe = NULL,
+                                     .truncate_file = NULL};
+
+static vnode_ops_t tmpfs_file_vops = {.read = tmpfs_read,
+                                      .write = tmpfs_write,
+                                      .mmap = tmpfs_mmap,
+                                      .mknod = NULL,
+                                      .lookup = NULL,
+                                      .link = NULL,
+                                      .unlink = NULL,
+                                      .mkdir = NULL,
+                                      .rmdir = NULL,
+                                      .readdir = NULL,
+                                      .stat = tmpfs_stat,
+                                      .acquire = NULL,
+                                      .release = NULL,
+                                      .get_pframe = NULL,
+                                      .fill_pframe = NULL,
+                                      .flush_pframe = NULL,
+                                      .truncate_file = tmpfs_truncate_file};
+
+/*
+ * Directories
+ */
+
+/* FNV-1a */
+static uint32_t tmpfs_hash(const char *name, size_t namelen)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < namelen; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static long tmpfs_dir_init(tmpfs_dir_t *dir, ino_t parent)
+{
+    dir->td_buckets = kmalloc(TMPFS_DIR_MIN_BUCKETS * sizeof(list_t));
+    if (!dir->td_buckets)
+    {
+        return -ENOSPC;
+    }
+    for (size_t i = 0; i < TMPFS_DIR_MIN_BUCKETS; i++)
+    {
+        list_init(&dir->td_buckets[i]);
+    }
+    dir->td_parent = parent;
+    dir->td_nbuckets = TMPFS_DIR_MIN_BUCKETS;
+    dir->td_nentries = 0;
+    dir->td_slots = NULL;
+    dir->td_nslots = 0;
+    dir->td_capacity = 0;
+    dir->td_free = 0;
+    return 0;
+}
+
+static tmpfs_dirent_t *tmpfs_dir_find(tmpfs_dir_t *dir, const char *name,
+                                      size_t namelen)
+{
+    uint32_t hash = tmpfs_hash(name, namelen);
+    list_t *bucket = &dir->td_buckets[hash & (dir->td_nbuckets - 1)];
+    list_iterate(bucket, de, tmpfs_dirent_t, de_link)
+    {
+        if (de->de_hash == hash && de->de_namelen == namelen &&
+            !strncmp(de->de_name, name, namelen))
+        {
+            return de;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Doubles the number of buckets once there are TMPFS_DIR_LOAD entries per
+ * bucket. Failing to is not an error; lookups just get slower.
+ */
+static void tmpfs_dir_rehash(tmpfs_dir_t *dir)
+{
+    if (dir->td_nentries <= TMPFS_DIR_LOAD * dir->td_nbuckets ||
+        dir->td_nbuckets * 2 > TMPFS_DIR_MAX_BUCKETS)
+    {
+        return;
+    }
+    size_t nbuckets = dir->td_nbuckets * 2;
+    list_t *buckets = kmalloc(nbuckets * sizeof(list_t));
+    if (!buckets)
+    {
+        return;
+    }
+    for (size_t i = 0; i < nbuckets; i++)
+    {
+        list_init(&buckets[i]);
+    }
+    for (size_t i = 0; i < dir->td_nslots; i++)
+    {
+        tmpfs_dirent_t *de = dir->td_slots[i];
+        if (de)
+        {
+            list_remove(&de->de_link);
+            list_insert_tail(&buckets[de->de_hash & (nbuckets - 1)],
+                             &de->de_link);
+        }
+    }
+    kfree(dir->td_buckets);
+    dir->td_buckets = buckets;
+    dir->td_nbuckets = nbuckets;
+}
+
+/*
+ * Finds a free slot for a new entry, growing the slot array if there is
+ * none. Returns the slot's index, or -ENOSPC.
+ */
+static long tmpfs_dir_slot(tmpfs_dir_t *dir)
+{
+    size_t slot = dir->td_free;
+    while (slot < dir->td_nslots && dir->td_slots[slot])
+    {
+        slot++;
+    }
+    if (slot == dir->td_capacity)
+    {
+        size_t capacity = MAX(2 * dir->td_capacity, TMPFS_DIR_MIN_SLOTS);
+        if (capacity > TMPFS_DIR_MAX_SLOTS)
+        {
+            return -ENOSPC;
+        }
+        tmpfs_dirent_t **slots = kmalloc(capacity * sizeof(*slots));
+        if (!slots)
+        {
+            return -ENOSPC;
+        }
+        if (dir->td_slots)
+        {
+            memcpy(slots, dir->td_slots, dir->td_nslots * sizeof(*slots));
+            kfree(dir->td_slots);
+        }
+        dir->td_slots = slots;
+        dir->td_capacity = capacity;
+    }
+    return slot;
+}
+
+/*
+ * Adds an entry for inode ino to directory inode dirinode, which must not
+ * already have one for name.
+ */
+static long tmpfs_dir_add(tmpfs_t *tfs, tmpfs_inode_t *dirinode,
+                          const char *name, size_t namelen, ino_t ino)
+{
+    tmpfs_dir_t *dir = &dirinode->ti_dir;
+    if (namelen >= NAME_LEN)
+    {
+        return -ENAMETOOLONG;
+    }
+    KASSERT(!tmpfs_dir_find(dir, name, namelen));
+
+    long slot = tmpfs_dir_slot(dir);
+    if (slot < 0)
+    {
+        return slot;
+    }
+    tmpfs_dirent_t *de = slab_obj_alloc(tfs->tf_dirent_allocator);
+    if (!de)
+    {
+        return -ENOSPC;
+    }
+    de->de_ino = ino;
+    de->de_hash = tmpfs_hash(name, namelen);
+    de->de_slot = (size_t)slot;
+    de->de_namelen = namelen;
+    memcpy(de->de_name, name, namelen);
+    de->de_name[namelen] = '\0';
+    list_insert_tail(&dir->td_buckets[de->de_hash & (dir->td_nbuckets - 1)],
+                     &de->de_link);
+
+    dir->td_slots[slot] = de;
+    dir->td_nslots = MAX(dir->td_nslots, (size_t)slot + 1);
+    dir->td_free = slot + 1;
+    dir->td_nentries++;
+    dirinode->ti_size = (dir->td_nentries + TMPFS_DOT_SLOTS) * sizeof(dirent_t);
+
+    tmpfs_dir_rehash(dir);
+    return 0;
+}
+
+static void tmpfs_dir_remove(tmpfs_t *tfs, tmpfs_inode_t *dirinode,
+                             tmpfs_dirent_t *de)
+{
+    tmpfs_dir_t *dir = &dirinode->ti_dir;
+    list_remove(&de->de_link);
+    dir->td_slots[de->de_slot] = NULL;
+    dir->td_free = MIN(dir->td_free, de->de_slot);
+    while (dir->td_nslots && !dir->td_slots[dir->td_nslots - 1])
+    {
+        dir->td_nslots--;
+    }
+    dir->td_nentries--;
+    dirinode->ti_size = (dir->td_nentries + TMPFS_DOT_SLOTS) * sizeof(dirent_t);
+    slab_obj_free(tfs->tf_dirent_allocator, de);
+}
+
+/*
+ * Inodes
+ */
+
+/*
+ * Frees an inode and what it holds. Only an inode with no links left is freed
+ * this way, except at unmount.
+ */
+static void tmpfs_free_inode(tmpfs_t *tfs, tmpfs_inode_t *inode)
+{
+    kmutex_lock(&tfs->tf_mutex);
+    radix_tree_remove(&tfs->tf_inodes, inode->ti_ino);
+    kmutex_unlock(&tfs->tf_mutex);
+
+    if (S_ISREG(inode->ti_mode))
+    {
+        mobj_put(&inode->ti_data);
+    }
+    else if (S_ISDIR(inode->ti_mode))
+    {
+        tmpfs_dir_t *dir = &inode->ti_dir;
+        for (size_t i = 0; i < dir->td_nslots; i++)
+        {
+            if (dir->td_slots[i])
+            {
+                slab_obj_free(tfs->tf_dirent_allocator, dir->td_slots[i]);
+            }
+        }
+        if (dir->td_slots)
+        {
+            kfree(dir->td_slots);
+        }
+        kfree(dir->td_buckets);
+    }
+    slab_obj_free(tfs->tf_inode_allocator, inode);
+}
+
+/*
+ * Creates an inode of the given type (S_IFREG, S_IFDIR, S_IFCHR or S_IFBLK),
+ * with a link count of 1 for the entry the caller is about to make for it.
+ * parent is only used for directories.
+ *
+ * Returns the inode number, or -ENOSPC.
+ */
+static long tmpfs_alloc_inode(fs_t *fs, int mode, devid_t devid, ino_t parent,
+                              tmpfs_inode_t **inodep)
+{
+    tmpfs_t *tfs = fs->fs_i;
+    tmpfs_inode_t *inode = slab_obj_alloc(tfs->tf_inode_allocator);
+    if (!inode)
+    {
+        return -ENOSPC;
+    }
+    memset(inode, 0, sizeof(tmpfs_inode_t));
+    inode->ti_mode = mode;
+    inode->ti_nlink = 1;
+
+    long ret = 0;
+    if (S_ISREG(mode))
+    {
+        if ((inode->ti_data = anon_create()))
+        {
+            mobj_unlock(inode->ti_data);
+        }
+        else
+        {
+            ret = -ENOSPC;
+        }
+    }
+    else if (S_ISDIR(mode))
+    {
+        ret = tmpfs_dir_init(&inode->ti_dir, parent);
+    }
+    else
+    {
+        inode->ti_devid = devid;
+    }
+    if (ret)
+    {
+        slab_obj_free(tfs->tf_inode_allocator, inode);
+        return ret;
+    }
+
+    kmutex_lock(&tfs->tf_mutex);
+    while (radix_tree_lookup(&tfs->tf_inodes, tfs->tf_next_ino))
+    {
+        tfs->tf_next_ino++;
+    }
+    inode->ti_ino = tfs->tf_next_ino++;
+    ret = radix_tree_insert(&tfs->tf_inodes, inode->ti_ino, inode);
+    kmutex_unlock(&tfs->tf_mutex);
+    if (ret)
+    {
+        inode->ti_nlink = 0;
+        if (S_ISREG(mode))
+        {
+            mobj_put(&inode->ti_data);
+        }
+        else if (S_ISDIR(mode))
+        {
+            kfree(inode->ti_dir.td_buckets);
+        }
+        slab_obj_free(tfs->tf_inode_allocator, inode);
+        return -ENOSPC;
+    }
+
+    if (S_ISDIR(mode))
+    {
+        inode->ti_size = TMPFS_DOT_SLOTS * sizeof(dirent_t);
+    }
+    *inodep = inode;
+    return inode->ti_ino;
+}
+
+/*
+ * Creates an inode and an entry for it in dir, and returns its vnode.
+ */
+static long tmpfs_create(vnode_t *dir, const char *name, size_t namelen,
+                         int mode, devid_t devid, vnode_t **out)
+{
+    tmpfs_t *tfs = VNODE_TO_TMPFS(dir);
+    tmpfs_inode_t *dirinode = VNODE_TO_TMPFSINODE(dir);
+    if (namelen >= NAME_LEN)
+    {
+        return -ENAMETOOLONG;
+    }
+    if (tmpfs_dir_find(&dirinode->ti_dir, name, namelen))
+    {
+        return -EEXIST;
+    }
+
+    tmpfs_inode_t *inode;
+    long ino = tmpfs_alloc_inode(dir->vn_fs, mode, devid, dir->vn_vno, &inode);
+    if (ino < 0)
+    {
+        return ino;
+    }
+    long ret = tmpfs_dir_add(tfs, dirinode, name, namelen, (ino_t)ino);
+    if (ret)
+    {
+        tmpfs_free_inode(tfs, inode);
+        return ret;
+    }
+    *out = vget(dir->vn_fs, (ino_t)ino);
+    return 0;
+}
+
+/*
+ * Function implementations
+ */
+
+long tmpfs_mount(fs_t *fs)
+{
+    tmpfs_t *tfs = kmalloc(sizeof(tmpfs_t));
+    if (!tfs)
+    {
+        return -ENOMEM;
+    }
+    radix_tree_init(&tfs->tf_inodes);
+    tfs->tf_next_ino = 0;
+    kmutex_init(&tfs->tf_mutex);
+    tfs->tf_inode_allocator =
+        slab_allocator_create("tmpfs_inode", sizeof(tmpfs_inode_t));
+    tfs->tf_dirent_allocator =
+        slab_allocator_create("tmpfs_dirent", sizeof(tmpfs_dirent_t));
+    fs->fs_vnode_allocator = slab_allocator_create("tmpfs_node",
+                                                   sizeof(vnode_t));
+    fs->fs_i = tfs;
+    fs->fs_ops = &tmpfs_ops;
+
+    tmpfs_inode_t *root;
+    long ino = -ENOMEM;
+    if (tfs->tf_inode_allocator && tfs->tf_dirent_allocator &&
+        fs->fs_vnode_allocator)
+    {
+        ino = tmpfs_alloc_inode(fs, S_IFDIR, 0, 0, &root);
+    }
+    if (ino < 0)
+    {
+        if (tfs->tf_inode_allocator)
+        {
+            slab_allocator_destroy(tfs->tf_inode_allocator);
+        }
+        if (tfs->tf_dirent_allocator)
+        {
+            slab_allocator_destroy(tfs->tf_dirent_allocator);
+        }
+        if (fs->fs_vnode_allocator)
+        {
+            slab_allocator_destroy(fs->fs_vnode_allocator);
+            fs->fs_vnode_allocator = NULL;
+        }
+        kfree(tfs);
+        fs->fs_i = NULL;
+        return ino;
+    }
+    /* the root is its own parent */
+    root->ti_dir.td_parent = (ino_t)ino;
+
+    fs->fs_root = vget(fs, (ino_t)ino);
+    return 0;
+}
+
+static void tmpfs_read_vnode(fs_t *fs, vnode_t *vn)
+{
+    tmpfs_t *tfs = fs->fs_i;
+    kmutex_lock(&tfs->tf_mutex);
+    tmpfs_inode_t *inode = radix_tree_lookup(&tfs->tf_inodes, vn->vn_vno);
+    kmutex_unlock(&tfs->tf_mutex);
+    KASSERT(inode && inode->ti_ino == vn->vn_vno);
+
+    inode->ti_nlink++;
+
+    vn->vn_i = inode;
+    vn->vn_len = inode->ti_size;
+    vn->vn_mode = inode->ti_mode;
+    if (S_ISREG(inode->ti_mode))
+    {
+        vn->vn_ops = &tmpfs_file_vops;
+    }
+    else if (S_ISDIR(inode->ti_mode))
+    {
+        vn->vn_ops = &tmpfs_dir_vops;
+    }
+    else
+    {
+        KASSERT(S_ISCHR(inode->ti_mode) || S_ISBLK(inode->ti_mode));
+        vn->vn_ops = NULL;
+        vn->vn_devid = inode->ti_devid;
+    }
+}
+
+static void tmpfs_delete_vnode(fs_t *fs, vnode_t *vn)
+{
+    tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(vn);
+    if (0 == --inode->ti_nlink)
+    {
+        tmpfs_free_inode(fs->fs_i, inode);
+    }
+}
+
+static long tmpfs_umount(fs_t *fs)
+{
+    tmpfs_t *tfs = fs->fs_i;
+
+    vput(&fs->fs_root);
+
+    /* everything is in memory, and all of it is thrown away */
+    uint64_t ino = 0;
+    tmpfs_inode_t *inode;
+    while ((inode = radix_tree_next(&tfs->tf_inodes, &ino)))
+    {
+        tmpfs_free_inode(tfs, inode);
+    }
+
+    slab_allocator_destroy(tfs->tf_inode_allocator);
+    slab_allocator_destroy(tfs->tf_dirent_allocator);
+    kfree(tfs);
+    return 0;
+}
+
+static long tmpfs_mknod(vnode_t *dir, const char *name, size_t namelen,
+                        int mode, devid_t devid, vnode_t **out)
+{
+    if (!S_ISREG(mode) && !S_ISCHR(mode) && !S_ISBLK(mode))
+    {
+        return -EINVAL;
+    }
+    return tmpfs_create(dir, name, namelen, mode, devid, out);
+}
+
+static long tmpfs_mkdir(vnode_t *dir, const char *name, size_t namelen,
+                        vnode_t **out)
+{
+    return tmpfs_create(dir, name, namelen, S_IFDIR, 0, out);
+}
+
+static long tmpfs_lookup(vnode_t *dir, const char *name, size_t namelen,
+                         vnode_t **out)
+{
+    tmpfs_dir_t *tdir = &VNODE_TO_TMPFSINODE(dir)->ti_dir;
+    ino_t ino;
+    if (name_match(".", name, namelen))
+    {
+        ino = dir->vn_vno;
+    }
+    else if (name_match("..", name, namelen))
+    {
+        ino = tdir->td_parent;
+    }
+    else
+    {
+        tmpfs_dirent_t *de = tmpfs_dir_find(tdir, name, namelen);
+        if (!de)
+        {
+            return -ENOENT;
+        }
+        ino = de->de_ino;
+    }
+
+    if (ino == dir->vn_vno)
+    {
+        vref(dir);
+        *out = dir;
+    }
+    else
+    {
+        *out = vget(dir->vn_fs, ino);
+    }
+    return 0;
+}
+
+static long tmpfs_link(vnode_t *dir, const char *name, size_t namelen,
+                       vnode_t *child)
+{
+    KASSERT(child->vn_fs == dir->vn_fs);
+    tmpfs_inode_t *dirinode = VNODE_TO_TMPFSINODE(dir);
+    if (namelen >= NAME_LEN)
+    {
+        return -ENAMETOOLONG;
+    }
+    if (tmpfs_dir_find(&dirinode->ti_dir, name, namelen))
+    {
+        return -EEXIST;
+    }
+    long ret = tmpfs_dir_add(VNODE_TO_TMPFS(dir), dirinode, name, namelen,
+                             child->vn_vno);
+    if (!ret)
+    {
+        VNODE_TO_TMPFSINODE(child)->ti_nlink++;
+    }
+    return ret;
+}
+
+static long tmpfs_unlink(vnode_t *dir, const char *name, size_t namelen)
+{
+    tmpfs_inode_t *dirinode = VNODE_TO_TMPFSINODE(dir);
+    tmpfs_dirent_t *de = tmpfs_dir_find(&dirinode->ti_dir, name, namelen);
+    if (!de)
+    {
+        return -ENOENT;
+    }
+
+    vnode_t *child = vget_locked(dir->vn_fs, de->de_ino);
+    KASSERT(!S_ISDIR(child->vn_mode) && "handled at VFS level");
+    tmpfs_dir_remove(VNODE_TO_TMPFS(dir), dirinode, de);
+    VNODE_TO_TMPFSINODE(child)->ti_nlink--;
+    vput_locked(&child);
+    return 0;
+}
+
+/*
+ * Renames a file, replacing whatever file newname already names. Directories
+ * cannot be renamed (see do_rename()).
+ */
+static long tmpfs_rename(vnode_t *olddir, const char *oldname,
+                         size_t oldnamelen, vnode_t *newdir,
+                         const char *newname, size_t newnamelen)
+{
+    tmpfs_t *tfs = VNODE_TO_TMPFS(olddir);
+    tmpfs_inode_t *olddirinode = VNODE_TO_TMPFSINODE(olddir);
+    tmpfs_inode_t *newdirinode = VNODE_TO_TMPFSINODE(newdir);
+    if (newnamelen >= NAME_LEN)
+    {
+        return -ENAMETOOLONG;
+    }
+    tmpfs_dirent_t *oldde =
+        tmpfs_dir_find(&olddirinode->ti_dir, oldname, oldnamelen);
+    if (!oldde)
+    {
+        return -ENOENT;
+    }
+
+    vnode_t *oldvn = vget_locked(olddir->vn_fs, oldde->de_ino);
+    if (S_ISDIR(oldvn->vn_mode))
+    {
+        vput_locked(&oldvn);
+        return -EPERM;
+    }
+
+    tmpfs_dirent_t *newde =
+        tmpfs_dir_find(&newdirinode->ti_dir, newname, newnamelen);
+    if (newde && newde->de_ino == oldvn->vn_vno)
+    {
+        /* both names are links to the same file */
+        vput_locked(&oldvn);
+        return 0;
+    }
+    if (newde)
+    {
+        vnode_t *newvn = vget_locked(newdir->vn_fs, newde->de_ino);
+        if (S_ISDIR(newvn->vn_mode))
+        {
+            vput_locked(&newvn);
+            vput_locked(&oldvn);
+            return -EISDIR;
+        }
+        /* the entry is reused for the renamed file */
+        newde->de_ino = oldvn->vn_vno;
+        VNODE_TO_TMPFSINODE(newvn)->ti_nlink--;
+        vput_locked(&newvn);
+    }
+    else
+    {
+        long ret = tmpfs_dir_add(tfs, newdirinode, newname, newnamelen,
+                                 oldvn->vn_vno);
+        if (ret)
+        {
+            vput_locked(&oldvn);
+            return ret;
+        }
+    }
+    tmpfs_dir_remove(tfs, olddirinode, oldde);
+    vput_locked(&oldvn);
+    return 0;
+}
+
+static long tmpfs_rmdir(vnode_t *dir, const char *name, size_t namelen)
+{
+    KASSERT(!name_match(".", name, namelen) &&
+            !name_match("..", name, namelen));
+    tmpfs_inode_t *dirinode = VNODE_TO_TMPFSINODE(dir);
+    tmpfs_dirent_t *de = tmpfs_dir_find(&dirinode->ti_dir, name, namelen);
+    if (!de)
+    {
+        return -ENOENT;
+    }
+
+    vnode_t *child = vget_locked(dir->vn_fs, de->de_ino);
+    if (!S_ISDIR(child->vn_mode))
+    {
+        vput_locked(&child);
+        return -ENOTDIR;
+    }
+    if (VNODE_TO_TMPFSINODE(child)->ti_dir.td_nentries)
+    {
+        vput_locked(&child);
+        return -ENOTEMPTY;
+    }
+
+    tmpfs_dir_remove(VNODE_TO_TMPFS(dir), dirinode, de);
+    VNODE_TO_TMPFSINODE(child)->ti_nlink--;
+    vput_locked(&child);
+    return 0;
+}
+
+/*
+ * Positions 0 and 1 are "." and "..", and position TMPFS_DOT_SLOTS + i the
+ * entry in slot i, if there is one.
+ */
+static ssize_t tmpfs_readdir(vnode_t *dir, size_t pos, struct dirent *d)
+{
+    tmpfs_dir_t *tdir = &VNODE_TO_TMPFSINODE(dir)->ti_dir;
+    size_t next = pos + 1;
+    if (pos < TMPFS_DOT_SLOTS)
+    {
+        d->d_ino = pos ? tdir->td_parent : dir->vn_vno;
+        strcpy(d->d_name, pos ? ".." : ".");
+    }
+    else
+    {
+        size_t slot = pos - TMPFS_DOT_SLOTS;
+        while (slot < tdir->td_nslots && !tdir->td_slots[slot])
+        {
+            slot++;
+        }
+        if (slot >= tdir->td_nslots)
+        {
+            return 0;
+        }
+        tmpfs_dirent_t *de = tdir->td_slots[slot];
+        d->d_ino = de->de_ino;
+        memcpy(d->d_name, de->de_name, de->de_namelen + 1);
+        next = slot + TMPFS_DOT_SLOTS + 1;
+    }
+    d->d_off = next;
+    return next - pos;
+}
+
+/*
+ * Gets the locked pframe of a page of a file's contents.
+ */
+static long tmpfs_get_page(tmpfs_inode_t *inode, size_t pagenum, long forwrite,
+                           pframe_t **pfp)
+{
+    mobj_lock(inode->ti_data);
+    long ret = mobj_get_pframe(inode->ti_data, pagenum, forwrite, pfp);
+    mobj_unlock(inode->ti_data);
+    return ret;
+}
+
+static ssize_t tmpfs_read(vnode_t *file, size_t pos, void *buf, size_t count)
+{
+    tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(file);
+    if (pos >= inode->ti_size)
+    {
+        return 0;
+    }
+    count = MIN(count, inode->ti_size - pos);
+
+    size_t done = 0;
+    while (done < count)
+    {
+        size_t off = PAGE_OFFSET(pos + done);
+        size_t n = MIN(PAGE_SIZE - off, count - done);
+        pframe_t *pf;
+        long ret = tmpfs_get_page(inode, ADDR_TO_PN(pos + done), 0, &pf);
+        if (ret)
+        {
+            return done ? (ssize_t)done : ret;
+        }
+        /* the copy may fault, so it is done with the page shared rather
+         * than locked */
+        pframe_share(pf);
+        memcpy((char *)buf + done, (char *)pf->pf_addr + off, n);
+        pframe_put(&pf);
+        done += n;
+    }
+    return done;
+}
+
+static ssize_t tmpfs_write(vnode_t *file, size_t pos, const void *buf,
+                           size_t count)
+{
+    tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(file);
+    if (pos + count < pos)
+    {
+        return -EFBIG;
+    }
+
+    size_t done = 0;
+    while (done < count)
+    {
+        size_t off = PAGE_OFFSET(pos + done);
+        size_t n = MIN(PAGE_SIZE - off, count - done);
+        pframe_t *pf;
+        long ret = tmpfs_get_page(inode, ADDR_TO_PN(pos + done), 1, &pf);
+        if (ret)
+        {
+            if (!done)
+            {
+                return ret == -ENOMEM ? -ENOSPC : ret;
+            }
+            break;
+        }
+        memcpy((char *)pf->pf_addr + off, (const char *)buf + done, n);
+        pframe_release(&pf);
+        done += n;
+    }
+
+    inode->ti_size = MAX(inode->ti_size, pos + done);
+    file->vn_len = inode->ti_size;
+    return done;
+}
+
+static long tmpfs_mmap(vnode_t *file, mobj_t **ret)
+{
+    mobj_t *data = VNODE_TO_TMPFSINODE(file)->ti_data;
+    mobj_ref(data);
+    *ret = data;
+    return 0;
+}
+
+static long tmpfs_stat(vnode_t *vn, stat_t *buf)
+{
+    tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(vn);
+    memset(buf, 0, sizeof(stat_t));
+    buf->st_mode = vn->vn_mode;
+    buf->st_ino = (int)vn->vn_vno;
+    if (S_ISCHR(vn->vn_mode) || S_ISBLK(vn->vn_mode))
+    {
+        buf->st_rdev = (int)inode->ti_devid;
+    }
+    buf->st_nlink = (int)inode->ti_nlink - 1;
+    buf->st_size = (int)inode->ti_size;
+    buf->st_blksize = (int)PAGE_SIZE;
+    buf->st_blocks = (int)((inode->ti_size + 511) / 512);
+    return 0;
+}
+
+/*
+ * The file gets a fresh, empty mobj; mappings of it keep the old one (and its
+ * contents) until they go away, so no page is freed while it may still be
+ * mapped. Only if there is no memory for a new mobj is the old one emptied in
+ * place.
+ */
+static void tmpfs_truncate_file(vnode_t *file)
+{
+    KASSERT(S_ISREG(file->vn_mode) &&
+            "This routine should only be called for regular files");
+    tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(file);
+
+    vlock(file);
+    inode->ti_size = 0;
+    file->vn_len = 0;
+    mobj_t *data = anon_create();
+    if (data)
+    {
+        mobj_unlock(data);
+        mobj_put(&inode->ti_data);
+        inode->ti_data = data;
+    }
+    else
+    {
+        mobj_lock(inode->ti_data);
+        mobj_free_pframes(inode->ti_data);
+        swap_release(inode->ti_data);
+        mobj_unlock(inode->ti_data);
+    }
+    vunlock(file);
+}
@@ -5,11 +5,15 @@
 #include <fs/s5fs/s5fs.h>
 #include <fs/vnode.h>
 
+#include "fs/dcache.h"
 #include "fs/file.h"
 #include "fs/ramfs/ramfs.h"
+#include "fs/procfs/procfs.h"
+#include "fs/tmpfs/tmpfs.h"
 
 #include "mm/kmalloc.h"
 #include "mm/slab.h"
+#include "proc/rcu.h"
 #include "util/debug.h"
 
 #ifdef __S5FS__
@@ -18,59 +22,120 @@
 
 #ifdef __MOUNTING__
 /* The fs listed here are only the non-root file systems */
-list_t mounted_fs_list;
+list_t mounted_fs_list = LIST_INITIALIZER(mounted_fs_list);
+
+/* Serializes mounts and unmounts, and protects mounted_fs_list */
+kmutex_t vfs_mount_mutex = KMUTEX_INITIALIZER(vfs_mount_mutex);
 
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutley sure your Weenix is perfect.
- *
- * The purpose of this function is to set up the pointers between the file
- * system struct and the vnode of the mount point. Remember to watch your
- * reference counts. (The exception here is when the vnode's vn_mount field
- * points to the mounted file system's root we do not increment the reference
- * count on the file system's root vnode. The file system is already keeping
- * a reference to the vnode which will not go away until the file system is
- * unmounted. If we kept a second such reference it would conflict with the
- * behavior of vfs_is_in_use(), make sure you understand why.)
- *
- * Once everything is set up add the file system to the list of mounted file
- * systems.
+ * Protects the vn_mount fields of mount points, so that a lookup crossing into
+ * a mounted file system can take its reference on the root atomically with
+ * respect to vfs_umount() detaching it.
+ */
+static spinlock_t vfs_mount_lock = SPINLOCK_INITIALIZER(vfs_mount_lock);
+
+/*
+ * Set up the pointers between the file system struct and the vnode of the
+ * mount point, and add the file system to the list of mounted file systems.
+ * The fs keeps a reference to mtpt in fs_mtpt; mtpt->vn_mount does not hold
+ * a reference to the fs root, as the fs already has one (a second would make
+ * vfs_is_in_use() see the fs as busy forever).
  *
- * Remember proper error handling.
+ * vfs_mount_mutex must be held, and mtpt must be a directory that is neither
+ * a mount point nor the root of a file system (see do_mount()).
  *
  * This function is not meant to mount the root file system.
  */
 int vfs_mount(struct vnode *mtpt, fs_t *fs)
 {
-    NOT_YET_IMPLEMENTED("MOUNTING: vfs_mount");
-    return -EINVAL;
+    KASSERT(kmutex_owns_mutex(&vfs_mount_mutex));
+    KASSERT(mtpt->vn_mount == mtpt && fs != &vfs_root_fs);
+
+    vref(mtpt);
+    fs->fs_mtpt = mtpt;
+    spinlock_lock(&vfs_mount_lock);
+    mtpt->vn_mount = fs->fs_root;
+    spinlock_unlock(&vfs_mount_lock);
+    list_insert_tail(&mounted_fs_list, &fs->fs_link);
+    return 0;
 }
 
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutley sure your Weenix is perfect.
+ * Undo vfs_mount() and unmount the file system through its umount()
+ * operation, then free the fs struct.
  *
- * The purpose of this function is to undo the setup done in vfs_mount(). Also
- * you should call the underlying file system's umount() function. Make sure
- * to keep track of reference counts. You should also kfree the fs struct at
- * the end of this method.
+ * The fs is detached from its mount point before it is checked for use, so
+ * that no new references to it can be found by path; if it turns out to be
+ * in use, it is reattached and EBUSY returned.
  *
- * Remember proper error handling. You might want to make sure that you do not
- * try to call this function on the root file system (this function is not meant
- * to unmount the root file system).
+ * vfs_mount_mutex must be held.
  */
 int vfs_umount(fs_t *fs)
 {
-    NOT_YET_IMPLEMENTED("MOUNTING: vfs_unmount");
-    return -EINVAL;
+    KASSERT(fs != &vfs_root_fs);
+    vnode_t *mtpt = fs->fs_mtpt;
+
+    spinlock_lock(&vfs_mount_lock);
+    mtpt->vn_mount = mtpt;
+    spinlock_unlock(&vfs_mount_lock);
+
+    long ret = vfs_is_in_use(fs);
+    if (ret)
+    {
+        spinlock_lock(&vfs_mount_lock);
+        mtpt->vn_mount = fs->fs_root;
+        spinlock_unlock(&vfs_mount_lock);
+        return ret;
+    }
+
+    /* the fs struct may be reused by a later mount */
+    dcache_purge_fs(fs);
+
+    if (fs->fs_ops->umount)
+    {
+        ret = fs->fs_ops->umount(fs);
+    }
+    else
+    {
+        vput(&fs->fs_root);
+    }
+    KASSERT(!vfs_count_active_vnodes(fs));
+    /* path walks may still be looking at its vnodes, whose frees wait for
+     * them in callbacks queued before this one */
+    rcu_synchronize();
+    slab_allocator_destroy(fs->fs_vnode_allocator);
+
+    list_remove(&fs->fs_link);
+    vput(&fs->fs_mtpt);
+    kfree(fs);
+    return ret;
+}
+
+/*
+ * If *vnp is a mount point, replace it (and its reference) with the root of
+ * the file system mounted on it.
+ */
+void vfs_cross_mount(vnode_t **vnp)
+{
+    vnode_t *vn = *vnp;
+    spinlock_lock(&vfs_mount_lock);
+    vnode_t *root = vn->vn_mount;
+    if (root != vn)
+    {
+        vref(root);
+    }
+    spinlock_unlock(&vfs_mount_lock);
+    if (root != vn)
+    {
+        vput(vnp);
+        *vnp = root;
+    }
 }
 #endif /* __MOUNTING__ */
 
 fs_t vfs_root_fs = {
     .fs_dev = VFS_ROOTFS_DEV,
     .fs_type = VFS_ROOTFS_TYPE,
-    .vnode_list = LIST_INITIALIZER(vfs_root_fs.vnode_list),
-    .vnode_list_mutex = KMUTEX_INITIALIZER(vfs_root_fs.vnode_list_mutex),
     .fs_vnode_allocator = NULL,
     .fs_i = NULL,
     .fs_ops = NULL,
@@ -82,6 +147,7 @@ fs_t vfs_root_fs = {
  */
 void vfs_init()
 {
+    vnode_cache_init(&vfs_root_fs);
     long err = mountfunc(&vfs_root_fs);
     if (err)
     {
@@ -94,21 +160,54 @@ void vfs_init()
     vlock(vfs_root_fs.fs_root);
     vref(curproc->p_cwd = vfs_root_fs.fs_root);
     vunlock(vfs_root_fs.fs_root);
+    /* every absolute path starts with a reference to it, from every core */
+    mobj_refs_percpu(&vfs_root_fs.fs_root->vn_mobj);
 
 #ifdef __MOUNTING__
-    list_init(&mounted_fs_list);
-    fs->fs_mtpt = vfs_root_fs.fs_root;
+    vfs_root_fs.fs_mtpt = vfs_root_fs.fs_root;
 #endif
 }
 
 /*
- * Wrapper around the sync call() to vfs_root_fs using fs_ops
+ * Wrapper around the sync call() to vfs_root_fs using fs_ops, and to every
+ * mounted file system that has one
  */
 void do_sync()
 {
     vfs_root_fs.fs_ops->sync(&vfs_root_fs);
 #ifdef __MOUNTING__
-    // if implementing mounting, just sync() all the mounted FS's as well
+    kmutex_lock(&vfs_mount_mutex);
+    list_iterate(&mounted_fs_list, mtfs, fs_t, fs_link)
+    {
+        if (mtfs->fs_ops->sync)
+        {
+            mtfs->fs_ops->sync(mtfs);
+        }
+    }
+    kmutex_unlock(&vfs_mount_mutex);
+#endif
+}
+
+/*
+ * Hand the filesystem's own dirty data to its block device, for the writeback
+ * thread; see the writeback fs_op.
+ */
+void vfs_writeback(uint64_t dirtied_before)
+{
+    if (vfs_root_fs.fs_ops && vfs_root_fs.fs_ops->writeback)
+    {
+        vfs_root_fs.fs_ops->writeback(&vfs_root_fs, dirtied_before);
+    }
+#ifdef __MOUNTING__
+    kmutex_lock(&vfs_mount_mutex);
+    list_iterate(&mounted_fs_list, mtfs, fs_t, fs_link)
+    {
+        if (mtfs->fs_ops->writeback)
+        {
+            mtfs->fs_ops->writeback(mtfs, dirtied_before);
+        }
+    }
+    kmutex_unlock(&vfs_mount_mutex);
 #endif
 }
 
@@ -121,13 +220,18 @@ long vfs_shutdown()
     long ret = 0;
 
 #ifdef __MOUNTING__
-    list_iterate(&mounted_fs_list, mtfs, fs_t, fs_link)
+    /* most recent first, so that nested mounts go before what they are on */
+    kmutex_lock(&vfs_mount_mutex);
+    list_iterate_reverse(&mounted_fs_list, mtfs, fs_t, fs_link)
     {
         ret = vfs_umount(mtfs);
         KASSERT(!ret);
     }
+    kmutex_unlock(&vfs_mount_mutex);
 #endif
 
+    /* everyone else is gone, so the root's references can be counted */
+    mobj_refs_atomic(&vfs_root_fs.fs_root->vn_mobj);
     if (vfs_is_in_use(&vfs_root_fs))
     {
         panic("vfs_shutdown: found active vnodes in root filesystem");
@@ -164,6 +268,8 @@ long mountfunc(fs_t *fs)
         {"s5fs", s5fs_mount},
 #endif
         {"ramfs", ramfs_mount},
+        {"tmpfs", tmpfs_mount},
+        {"procfs", procfs_mount},
     };
 
     for (unsigned int i = 0; i < sizeof(types) / sizeof(types[0]); i++)
@@ -187,36 +293,41 @@ long mountfunc(fs_t *fs)
 long vfs_is_in_use(fs_t *fs)
 {
     long ret = 0;
-    // kmutex_lock(&fs->vnode_list_mutex);
-    list_iterate(&fs->vnode_list, vn, vnode_t, vn_link)
-    {
-        vlock(vn);
-        size_t expected_refcount = vn->vn_fs->fs_root == vn ? 1 : 0;
-        size_t refcount = vn->vn_mobj.mo_refcount;
-        vunlock(vn);
-        if (refcount != expected_refcount)
+    for (size_t i = 0; i < VNODE_HASH_NBUCKETS; i++)
+    {
+        list_iterate(&fs->fs_vnode_hash[i].vb_list, vn, vnode_t, vn_link)
         {
-            dbg(DBG_VFS,
-                "vnode %d still in use with %d references and %lu mobj "
-                "references (expected %lu)\n",
-                vn->vn_vno, vn->vn_mobj.mo_refcount, refcount,
-                expected_refcount);
-            ret = -EBUSY;
-            // break;
+            vlock(vn);
+            size_t expected_refcount = vn->vn_fs->fs_root == vn ? 1 : 0;
+            size_t refcount = vn->vn_mobj.mo_refcount;
+            vunlock(vn);
+            if (refcount != expected_refcount)
+            {
+                dbg(DBG_VFS,
+                    "vnode %d still in use with %d references and %lu mobj "
+                    "references (expected %lu)\n",
+                    vn->vn_vno, vn->vn_mobj.mo_refcount, refcount,
+                    expected_refcount);
+                ret = -EBUSY;
+                // break;
+            }
         }
     }
-    // kmutex_unlock(&fs->vnode_list_mutex);
     return ret;
 }
 
 /*
- * Return the size of fs->vnode_list
+ * Return the number of vnodes in fs's vnode cache
  */
 size_t vfs_count_active_vnodes(fs_t *fs)
 {
     size_t count = 0;
-    kmutex_lock(&fs->vnode_list_mutex);
-    list_iterate(&fs->vnode_list, vn, vnode_t, vn_link) { count++; }
-    kmutex_unlock(&fs->vnode_list_mutex);
+    for (size_t i = 0; i < VNODE_HASH_NBUCKETS; i++)
+    {
+        vnode_bucket_t *bucket = &fs->fs_vnode_hash[i];
+        spinlock_lock(&bucket->vb_lock);
+        list_iterate(&bucket->vb_list, vn, vnode_t, vn_link) { count++; }
+        spinlock_unlock(&bucket->vb_lock);
+    }
     return count;
 }
@@ -1,12 +1,21 @@
 #include "fs/vfs_syscall.h"
+#include "api/syscall.h"
+#include "drivers/memdevs.h"
 #include "errno.h"
+#include "fs/dcache.h"
 #include "fs/fcntl.h"
+#include "fs/fdtable.h"
 #include "fs/file.h"
 #include "fs/lseek.h"
+#include "fs/pipe.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "globals.h"
 #include "kernel.h"
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
 #include "util/debug.h"
 #include "util/string.h"
 #include <limits.h>
@@ -36,7 +45,9 @@ ssize_t do_read(int fd, void *buf, size_t len)
         }
     if (file->f_mode & FMODE_READ) {
         vlock(file->f_vnode);
+        curthr->kt_nonblock = (file->f_mode & FMODE_NONBLOCK) != 0;
         int ret = file->f_vnode->vn_ops->read(file->f_vnode, file->f_pos, buf, len);
+        curthr->kt_nonblock = 0;
         if (ret < 0) {
             vunlock(file->f_vnode);
             fput(&file);
@@ -80,7 +91,9 @@ ssize_t do_write(int fd, const void *buf, size_t len)
         if (file->f_mode & FMODE_APPEND) {
             file->f_pos = file->f_vnode->vn_len;
         }
+        curthr->kt_nonblock = (file->f_mode & FMODE_NONBLOCK) != 0;
         int ret = file->f_vnode->vn_ops->write(file->f_vnode, file->f_pos, buf, len);
+        curthr->kt_nonblock = 0;
         if (ret < 0) {
             vunlock(file->f_vnode);
             fput(&file);
@@ -101,11 +114,442 @@ ssize_t do_write(int fd, const void *buf, size_t len)
     //return -1;
 }
 
+/*
+ * Get the fd's file for a read (write = 0) or write (write = 1), as do_read()
+ * and do_write() check it; a transfer at an explicit offset (positional = 1)
+ * also needs a file that can seek.
+ *
+ * Return 0, or:
+ *  - EBADF: fd is invalid or is not open for reading/writing
+ *  - EISDIR: reading, and fd refers to a directory
+ *  - ESPIPE: positional, and fd refers to a pipe or character device
+ */
+static long rw_fget(int fd, long write, long positional, file_t **filep)
+{
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    long ret = 0;
+    if (!(file->f_mode & (write ? FMODE_WRITE : FMODE_READ)))
+    {
+        ret = -EBADF;
+    }
+    else if (!write && S_ISDIR(file->f_vnode->vn_mode))
+    {
+        ret = -EISDIR;
+    }
+    else if (positional && (S_ISFIFO(file->f_vnode->vn_mode) ||
+                            S_ISCHR(file->f_vnode->vn_mode)))
+    {
+        ret = -ESPIPE;
+    }
+    if (ret)
+    {
+        fput(&file);
+        return ret;
+    }
+    *filep = file;
+    return 0;
+}
+
+/*
+ * Check that iov is a valid vector of iovcnt buffers for readv/writev.
+ *
+ * Return 0, or:
+ *  - EINVAL: iovcnt is negative or more than IOV_MAX, or the lengths add up
+ *    to more than an ssize_t can hold
+ */
+static long rw_check_iov(const struct iovec *iov, int iovcnt)
+{
+    if (iovcnt < 0 || iovcnt > IOV_MAX)
+    {
+        return -EINVAL;
+    }
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len > (size_t)LONG_MAX - total)
+        {
+            return -EINVAL;
+        }
+        total += iov[i].iov_len;
+    }
+    return 0;
+}
+
+/*
+ * Read into (write = 0) or write from (write = 1) each buffer of iov in turn,
+ * starting at pos in the file's vnode, until one comes up short. The vnode
+ * must be locked, so the whole vector is transferred atomically with respect
+ * to other file operations. A file opened with O_DIRECT has the vector
+ * transferred with the vnode's direct_io operation instead, if it has one
+ * and it can take these buffers.
+ *
+ * Return the number of bytes transferred, or propagate the error of the
+ * vnode operation if nothing was transferred.
+ */
+static ssize_t rw_vec(file_t *file, size_t pos, const struct iovec *iov,
+                      int iovcnt, long write)
+{
+    vnode_t *vn = file->f_vnode;
+    if ((file->f_mode & FMODE_DIRECT) && vn->vn_ops->direct_io)
+    {
+        ssize_t ret = vn->vn_ops->direct_io(vn, pos, iov, iovcnt, write);
+        if (ret != -ENOTSUP)
+        {
+            return ret;
+        }
+    }
+    ssize_t total = 0;
+    curthr->kt_nonblock = (file->f_mode & FMODE_NONBLOCK) != 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        ssize_t ret =
+            write ? vn->vn_ops->write(vn, pos, iov[i].iov_base, iov[i].iov_len)
+                  : vn->vn_ops->read(vn, pos, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0)
+        {
+            total = total ? total : ret;
+            break;
+        }
+        total += ret;
+        pos += (size_t)ret;
+        if ((size_t)ret < iov[i].iov_len)
+        {
+            break;
+        }
+    }
+    curthr->kt_nonblock = 0;
+    return total;
+}
+
+/*
+ * Read or write at an explicit offset, without using or changing the file
+ * position; see do_pread() and do_pwrite().
+ */
+static ssize_t rw_positional(int fd, void *buf, size_t len, off_t offset,
+                             long write)
+{
+    if (offset < 0)
+    {
+        return -EINVAL;
+    }
+    file_t *file;
+    long ret = rw_fget(fd, write, 1, &file);
+    if (ret)
+    {
+        return ret;
+    }
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    /* with no file position to update, reads of regular files can share the
+     * vnode with each other, unless they bypass its pages (see direct_io) */
+    long shared = !write && S_ISREG(file->f_vnode->vn_mode) &&
+                  !(file->f_mode & FMODE_DIRECT);
+    if (shared)
+    {
+        vlock_shared(file->f_vnode);
+    }
+    else
+    {
+        vlock(file->f_vnode);
+    }
+    ssize_t n = rw_vec(file, (size_t)offset, &iov, 1, write);
+    if (shared)
+    {
+        vunlock_shared(file->f_vnode);
+    }
+    else
+    {
+        vunlock(file->f_vnode);
+    }
+    fput(&file);
+    return n;
+}
+
+/*
+ * Read len bytes into buf from the fd's file, starting at offset rather than
+ * the file position, which is left alone.
+ *
+ * Return the number of bytes read on success, or:
+ *  - EBADF: fd is invalid or is not open for reading
+ *  - EISDIR: fd refers to a directory
+ *  - ESPIPE: fd refers to a pipe or character device
+ *  - EINVAL: offset is negative
+ *  - Propagate errors from the vnode operation read
+ */
+ssize_t do_pread(int fd, void *buf, size_t len, off_t offset)
+{
+    return rw_positional(fd, buf, len, offset, 0);
+}
+
+/*
+ * Write len bytes from buf to the fd's file, starting at offset rather than
+ * the file position, which is left alone. The write goes at offset even if
+ * the file was opened with O_APPEND.
+ *
+ * Return the number of bytes written on success, or:
+ *  - EBADF: fd is invalid or is not open for writing
+ *  - ESPIPE: fd refers to a pipe or character device
+ *  - EINVAL: offset is negative
+ *  - Propagate errors from the vnode operation write
+ */
+ssize_t do_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    return rw_positional(fd, (void *)buf, len, offset, 1);
+}
+
+/*
+ * Read into or write from a vector of buffers at the file position, and
+ * advance it; see do_readv() and do_writev().
+ */
+static ssize_t rw_vectored(int fd, const struct iovec *iov, int iovcnt,
+                           long write)
+{
+    long ret = rw_check_iov(iov, iovcnt);
+    if (ret)
+    {
+        return ret;
+    }
+    file_t *file;
+    ret = rw_fget(fd, write, 0, &file);
+    if (ret)
+    {
+        return ret;
+    }
+    vlock(file->f_vnode);
+    if (write && (file->f_mode & FMODE_APPEND))
+    {
+        file->f_pos = file->f_vnode->vn_len;
+    }
+    ssize_t n = rw_vec(file, file->f_pos, iov, iovcnt, write);
+    if (n > 0)
+    {
+        file->f_pos += (size_t)n;
+    }
+    vunlock(file->f_vnode);
+    fput(&file);
+    return n;
+}
+
+/*
+ * Read into the iovcnt buffers of iov in order, as one read of their total
+ * length would, from the fd's file.
+ *
+ * Return the number of bytes read on success, or:
+ *  - EINVAL: see rw_check_iov()
+ *  - Errors as for do_read()
+ */
+ssize_t do_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    return rw_vectored(fd, iov, iovcnt, 0);
+}
+
+/*
+ * Write the iovcnt buffers of iov in order, as one write of their total
+ * length would, to the fd's file.
+ *
+ * Return the number of bytes written on success, or:
+ *  - EINVAL: see rw_check_iov()
+ *  - Errors as for do_write()
+ */
+ssize_t do_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    return rw_vectored(fd, iov, iovcnt, 1);
+}
+
+/*
+ * Whether a write to fd would be thrown away unread: fd is open for writing
+ * on /dev/null, or another device that ignores what is written to it (see
+ * memdevs_discards_writes()). Such a write can succeed as soon as the file
+ * is found, without touching the buffer; the file position, which those
+ * devices ignore, is left as it is.
+ */
+long do_write_discards(int fd)
+{
+    file_t *file;
+    if (rw_fget(fd, 1, 0, &file))
+    {
+        return 0;
+    }
+    vnode_t *vn = file->f_vnode;
+    long ret = S_ISCHR(vn->vn_mode) && vn->vn_dev.chardev &&
+               memdevs_discards_writes(vn->vn_dev.chardev);
+    fput(&file);
+    return ret;
+}
+
+/*
+ * Lock the vnodes of a sendfile() for writing to out, which has a page cache
+ * of its own: both exclusively, in the order vlock_in_order() uses, or for
+ * vnodes of different filesystems, in address order.
+ */
+static void sendfile_lock(vnode_t *in, vnode_t *out)
+{
+    if (in->vn_fs == out->vn_fs)
+    {
+        vlock_in_order(in, out);
+    }
+    else if (in < out)
+    {
+        vlock(in);
+        vlock(out);
+    }
+    else
+    {
+        vlock(out);
+        vlock(in);
+    }
+}
+
+static void sendfile_unlock(vnode_t *in, vnode_t *out)
+{
+    if (in->vn_fs == out->vn_fs)
+    {
+        vunlock_in_order(in, out);
+    }
+    else
+    {
+        vunlock(in);
+        vunlock(out);
+    }
+}
+
+/*
+ * Write up to count bytes of in_fd's file to out_fd, reading from *offset
+ * (and advancing it) if offset is non-NULL, otherwise from the file position.
+ * Each page is written to out_fd's vnode straight out of the pframe holding
+ * it in in_fd's page cache, with no copy in between.
+ *
+ * in_fd's vnode is only held shared while writing to vnodes without a page
+ * cache of their own (pipes, ttys), so that a writer waiting for a reader
+ * does not keep the file from others. For regular files, both vnodes are
+ * locked in order, because the write takes pframe locks of out's as we hold
+ * one of in's.
+ *
+ * Return the number of bytes written, 0 at the end of the file, or:
+ *  - EBADF: either fd is invalid, or in_fd is not open for reading or out_fd
+ *    for writing
+ *  - EISDIR: in_fd refers to a directory
+ *  - EINVAL: in_fd is not a regular file, both fds refer to the same file, or
+ *    *offset is negative
+ *  - Propagate errors from getting the pframes and from the write
+ */
+ssize_t do_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    file_t *in, *out;
+    long ret = rw_fget(in_fd, 0, 0, &in);
+    if (ret)
+    {
+        return ret;
+    }
+    ret = rw_fget(out_fd, 1, 0, &out);
+    if (ret)
+    {
+        fput(&in);
+        return ret;
+    }
+    vnode_t *ivn = in->f_vnode;
+    vnode_t *ovn = out->f_vnode;
+    if (!S_ISREG(ivn->vn_mode) || ivn == ovn || (offset && *offset < 0))
+    {
+        fput(&in);
+        fput(&out);
+        return -EINVAL;
+    }
+
+    long cached = ovn->vn_ops->get_pframe != NULL;
+    size_t pos = offset ? (size_t)*offset : in->f_pos;
+    size_t total = 0;
+    while (total < count)
+    {
+        if (cached)
+        {
+            sendfile_lock(ivn, ovn);
+        }
+        else
+        {
+            vlock_shared(ivn);
+        }
+
+        ssize_t n = 0;
+        pframe_t *pf = NULL;
+        ret = 0;
+        if (pos < ivn->vn_len)
+        {
+            n = (ssize_t)MIN(count - total, MIN(PAGE_SIZE - PAGE_OFFSET(pos),
+                                                ivn->vn_len - pos));
+            if (!cached)
+            {
+                mobj_lock(&ivn->vn_mobj);
+            }
+            ret = mobj_get_pframe(&ivn->vn_mobj, ADDR_TO_PN(pos), 0, &pf);
+            if (!cached)
+            {
+                mobj_unlock(&ivn->vn_mobj);
+            }
+        }
+        if (pf)
+        {
+            if (!cached)
+            {
+                vlock(ovn);
+            }
+            size_t opos =
+                (out->f_mode & FMODE_APPEND) ? ovn->vn_len : out->f_pos;
+            ret = ovn->vn_ops->write(
+                ovn, opos, (char *)pf->pf_addr + PAGE_OFFSET(pos), (size_t)n);
+            if (ret > 0)
+            {
+                out->f_pos = opos + (size_t)ret;
+            }
+            if (!cached)
+            {
+                vunlock(ovn);
+            }
+            pframe_release(&pf);
+        }
+
+        if (cached)
+        {
+            sendfile_unlock(ivn, ovn);
+        }
+        else
+        {
+            vunlock_shared(ivn);
+        }
+        if (ret <= 0)
+        {
+            break;
+        }
+        total += (size_t)ret;
+        pos += (size_t)ret;
+        if (ret < n)
+        {
+            break;
+        }
+    }
+
+    if (offset)
+    {
+        *offset = (off_t)pos;
+    }
+    else
+    {
+        in->f_pos = pos;
+    }
+    fput(&in);
+    fput(&out);
+    return total ? (ssize_t)total : ret;
+}
+
 /*
  * Close the file descriptor fd.
  *
  * Return 0 on success, or:
  *  - EBADF: fd is invalid or not open
+ *  - ENOMEM: the file table is shared and could not be copied
  * 
  * Hints: 
  * Check `proc.h` to see if there are any helpful fields in the 
@@ -114,15 +558,22 @@ ssize_t do_write(int fd, const void *buf, size_t len)
  */
 long do_close(int fd)
 {
-    if (fd < 0 || fd >= NFILES) {
-        return -EBADF;
-    } else { 
-        if (curproc->p_files[fd] == NULL) {
+    long locked = proc_files_lock();
+    if (!fdtable_get(curproc->p_files, fd))
+    {
+        proc_files_unlock(locked);
         return -EBADF;
-        }
-        fput(&curproc->p_files[fd]); /// is arg type correct?
-        curproc->p_files[fd] = NULL;
     }
+    /* a table shared with the parent is copied before it changes */
+    long ret = fdtable_reserve(curproc, fd);
+    if (ret)
+    {
+        proc_files_unlock(locked);
+        return ret;
+    }
+    file_t *file = fdtable_install(curproc, fd, NULL);
+    proc_files_unlock(locked);
+    fput(&file);
 
     //NOT_YET_IMPLEMENTED("VFS: do_close");
     return 0;
@@ -140,26 +591,24 @@ long do_close(int fd)
 
 long do_dup(int fd)
 {
-    if (fd < 0 || fd >= NFILES) {
-        return -EBADF;
-    } else { 
-        if (curproc->p_files[fd] == NULL) {
+    long locked = proc_files_lock();
+    file_t *file = fdtable_get(curproc->p_files, fd);
+    if (file == NULL) {
+        proc_files_unlock(locked);
         return -EBADF;
-        }
     }
     
     int new_fd;
 
-    file_t *file = fget(fd);
-
     long ret_fd = get_empty_fd(&new_fd); /// right arg?
     if (ret_fd != 0) {
+        proc_files_unlock(locked);
         return ret_fd;
     }
-    //fref(file);
 
-    /// should i do this? :
-    curproc->p_files[new_fd] = file;
+    fref(file);
+    fdtable_install(curproc, new_fd, file);
+    proc_files_unlock(locked);
 
     //NOT_YET_IMPLEMENTED("VFS: do_dup");
     return new_fd;
@@ -171,45 +620,172 @@ long do_dup(int fd)
  *
  * Return nfd on success, or:
  *  - EBADF: ofd is invalid or not open, or nfd is invalid
+ *  - ENOMEM: the file table could not be copied or grown to hold nfd
  *
  * Hint: You don't need to do anything if ofd and nfd are the same.
  * (If supporting MTP, this action must be atomic)
  */
 long do_dup2(int ofd, int nfd) /// this is all right?
 {
-    if (ofd < 0 || ofd >= NFILES || nfd < 0 || nfd >= NFILES) { /// is this ok?
+    if (nfd < 0 || nfd >= NFILES) {
         return -EBADF;
-    } else { 
-        if (curproc->p_files[ofd] == NULL) {
+    }
+    long locked = proc_files_lock();
+    file_t *file = fdtable_get(curproc->p_files, ofd);
+    if (file == NULL) {
+        proc_files_unlock(locked);
         return -EBADF;
-        }
     }
     if (ofd == nfd) {
         /// fput(&file); /// fput needed here?
+        proc_files_unlock(locked);
         return nfd; /// this is all, right?
     }
 
-    if (curproc->p_files[nfd] != NULL){
-        long ret = do_close(nfd);
-        if (ret != 0) {
-            return ret;
-        }
-        //fput(&curproc->p_files[nfd]);
-        // int ret = do_close(nfd);
-        // if (ret != 0) {
-        //     return ret;
-        // }
+    long ret = fdtable_reserve(curproc, nfd);
+    if (ret) {
+        proc_files_unlock(locked);
+        return ret;
     }
 
-    //file_t *file = fget(ofd);
-
-    curproc->p_files[nfd] = curproc->p_files[ofd];
-    fref(curproc->p_files[nfd]);
+    /* swap the new file in before dropping the old one, so that no other
+     * thread sees nfd closed */
+    fref(file);
+    file_t *old = fdtable_install(curproc, nfd, file);
+    proc_files_unlock(locked);
+    if (old != NULL){
+        fput(&old);
+    }
 
     //NOT_YET_IMPLEMENTED("VFS: do_dup2");
     return nfd;
 }
 
+/*
+ * Get (F_GETFL) or set (F_SETFL) the flags of the fd's file, which are
+ * shared by every fd duplicated from it. Only O_APPEND, O_NONBLOCK and
+ * O_DIRECT can be set; F_GETFL also returns the access mode the file was
+ * opened with.
+ *
+ * F_GETPIPE_SZ and F_SETPIPE_SZ get and set the capacity of a pipe; see
+ * pipe_fcntl().
+ *
+ * Return the flags for F_GETFL or 0 for F_SETFL on success, or:
+ *  - EBADF: fd is invalid or not open
+ *  - EINVAL: cmd is not one of the above
+ */
+long do_fcntl(int fd, int cmd, int arg)
+{
+    if (cmd != F_GETFL && cmd != F_SETFL && cmd != F_GETPIPE_SZ &&
+        cmd != F_SETPIPE_SZ)
+    {
+        return -EINVAL;
+    }
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    if (cmd == F_GETPIPE_SZ || cmd == F_SETPIPE_SZ)
+    {
+        long ret = pipe_fcntl(file, cmd, arg);
+        fput(&file);
+        return ret;
+    }
+    long ret = 0;
+    /* read() and write() look at FMODE_APPEND under the vnode lock */
+    vlock(file->f_vnode);
+    if (cmd == F_GETFL)
+    {
+        switch (file->f_mode & (FMODE_READ | FMODE_WRITE))
+        {
+        case FMODE_READ:
+            ret = O_RDONLY;
+            break;
+        case FMODE_WRITE:
+            ret = O_WRONLY;
+            break;
+        default:
+            ret = O_RDWR;
+            break;
+        }
+        ret |= (file->f_mode & FMODE_APPEND) ? O_APPEND : 0;
+        ret |= (file->f_mode & FMODE_NONBLOCK) ? O_NONBLOCK : 0;
+        ret |= (file->f_mode & FMODE_DIRECT) ? O_DIRECT : 0;
+    }
+    else
+    {
+        file->f_mode &= ~(FMODE_APPEND | FMODE_NONBLOCK | FMODE_DIRECT);
+        file->f_mode |= (arg & O_APPEND) ? FMODE_APPEND : 0;
+        file->f_mode |= (arg & O_NONBLOCK) ? FMODE_NONBLOCK : 0;
+        file->f_mode |= (arg & O_DIRECT) ? FMODE_DIRECT : 0;
+    }
+    vunlock(file->f_vnode);
+    fput(&file);
+    return ret;
+}
+
+/*
+ * Carry out a device-specific request on the fd's file with the vnode
+ * operation ioctl. arg is a kernel copy of the request's argument, made by
+ * the caller, which knows its size.
+ *
+ * Return what the operation returns, or:
+ *  - EBADF: fd is invalid or not open
+ *  - ENOTTY: the file takes no requests, or not this one
+ */
+long do_ioctl(int fd, unsigned long request, void *arg)
+{
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    vnode_t *vn = file->f_vnode;
+    long ret = vn->vn_ops->ioctl ? vn->vn_ops->ioctl(vn, request, arg)
+                                 : -ENOTTY;
+    fput(&file);
+    return ret;
+}
+
+/*
+ * Get the directory that the path given to an *at() call is looked up from,
+ * with a reference: the directory open as dirfd, or curproc->p_cwd for
+ * AT_FDCWD and for absolute paths, which ignore dirfd. A tree walker that
+ * holds each directory open looks its entries up with one lookup apiece,
+ * rather than resolving the whole path from its working directory again.
+ *
+ * Return 0, or:
+ *  - EBADF: dirfd is neither AT_FDCWD nor an open file descriptor
+ *  - ENOTDIR: dirfd does not refer to a directory
+ */
+long at_get_base(int dirfd, const char *path, vnode_t **basep)
+{
+    if (dirfd == AT_FDCWD || path[0] == '/')
+    {
+        vref(curproc->p_cwd);
+        *basep = curproc->p_cwd;
+        return 0;
+    }
+    file_t *file = fget(dirfd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    long ret = 0;
+    if (S_ISDIR(file->f_vnode->vn_mode))
+    {
+        vref(file->f_vnode);
+        *basep = file->f_vnode;
+    }
+    else
+    {
+        ret = -ENOTDIR;
+    }
+    fput(&file);
+    return ret;
+}
+
 /*
  * Create a file specified by mode and devid at the location specified by path.
  *
@@ -248,7 +824,8 @@ long do_mknod(const char *path, int mode, devid_t devid)
 }
 
 /*
- * Create a directory at the location specified by path.
+ * Create a directory at the location specified by path, relative to the
+ * directory dirfd (see at_get_base()).
  *
  * Return 0 on success, or:
  *  - ENAMETOOLONG: The last component of path is too long
@@ -267,15 +844,21 @@ long do_mknod(const char *path, int mode, devid_t devid)
  *  - Be careful about locking and refcounts after calling namev_dir() and
  *    namev_lookup().
  */
-long do_mkdir(const char *path)
+long do_mkdirat(int dirfd, const char *path)
 {
     long ret = 0;
+    vnode_t *base = NULL;
     vnode_t *parent_vnode = NULL;
     const char *name = NULL;
     size_t namelen = 0;
     vnode_t *res_vnode = NULL;
 
-    ret = namev_dir(curproc->p_cwd, path, &parent_vnode, &name, &namelen);
+    ret = at_get_base(dirfd, path, &base);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = namev_dir(base, path, &parent_vnode, &name, &namelen);
+    vput(&base);
     if (ret != 0) {
         return ret;
     }
@@ -313,6 +896,7 @@ long do_mkdir(const char *path)
         //     vput_locked(&parent_vnode);
         //     return -ENAMETOOLONG;
         // }
+        dcache_invalidate(parent_vnode, name, namelen);
         long ret = parent_vnode->vn_ops->mkdir(parent_vnode, name, namelen, &res_vnode);
         if (ret < 0) {
             //if (parent_vnode != NULL) { // if statement may not be needed
@@ -355,14 +939,18 @@ long do_mkdir(const char *path)
     //NOT_YET_IMPLEMENTED("VFS: do_mkdir");
 }
 
+long do_mkdir(const char *path) { return do_mkdirat(AT_FDCWD, path); }
+
 /*
- * Delete a directory at path.
+ * Delete a directory at path, relative to the directory dirfd, for
+ * do_unlinkat() with AT_REMOVEDIR.
  *
  * Return 0 on success, or:
  *  - EINVAL: Attempting to rmdir with "." as the final component
  *  - ENOTEMPTY: Attempting to rmdir with ".." as the final component
  *  - ENOTDIR: The parent of the directory to be removed is not a directory
  *  - ENAMETOOLONG: the last component of path is too long
+ *  - EBUSY: the directory is a mount point
  *  - Propagate errors from namev_dir() and the vnode operation rmdir
  *
  * Hints:
@@ -371,15 +959,21 @@ long do_mkdir(const char *path)
  *  - Use the parent directory's rmdir operation to remove the directory.
  *  - Lock/unlock the vnode when calling its rmdir operation.
  */
-long do_rmdir(const char *path)
+static long rmdirat(int dirfd, const char *path)
 {
     // similar work to do_mkdir
+    vnode_t *base = NULL;
     vnode_t *parent_vnode = NULL;
     const char *name = NULL;
     size_t namelen = 0;
     vnode_t *res_vnode = NULL;
 
-    long ret = namev_dir(curproc->p_cwd, path, &parent_vnode, &name, &namelen);
+    long ret = at_get_base(dirfd, path, &base);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = namev_dir(base, path, &parent_vnode, &name, &namelen);
+    vput(&base);
     if (ret != 0) {
         // if (parent_vnode != NULL) {
         //     vput(&parent_vnode);
@@ -417,6 +1011,23 @@ long do_rmdir(const char *path)
         return -ENAMETOOLONG;
     }
     vlock(parent_vnode);
+    /* the removed directory's own entries must not outlive its inode */
+    if (namev_lookup(parent_vnode, name, namelen, &res_vnode) == 0)
+    {
+        /* the lookup crossed into a file system mounted on it */
+        if (res_vnode->vn_fs != parent_vnode->vn_fs)
+        {
+            vput(&res_vnode);
+            vput_locked(&parent_vnode);
+            return -EBUSY;
+        }
+        if (res_vnode != parent_vnode)
+        {
+            dcache_purge_dir(res_vnode);
+        }
+        vput(&res_vnode);
+    }
+    dcache_invalidate(parent_vnode, name, namelen);
     ret = parent_vnode->vn_ops->rmdir(parent_vnode, name, namelen);
     vunlock(parent_vnode);
     vput(&parent_vnode);
@@ -451,9 +1062,12 @@ long do_rmdir(const char *path)
 }
 
 /*
- * Remove the link between path and the file it refers to.
+ * Remove the link between path, relative to the directory dirfd, and the file
+ * it refers to; or, with AT_REMOVEDIR in flags, remove the directory at path
+ * as rmdir() does.
  *
  * Return 0 on success, or:
+ *  - EINVAL: flags has bits other than AT_REMOVEDIR
  *  - ENOTDIR: the parent of the file to be unlinked is not a directory
  *  - EPERM: the file to be unlinked is a directory 
  *  - ENAMETOOLONG: the last component of path is too long
@@ -464,15 +1078,27 @@ long do_rmdir(const char *path)
  *  - Use namev_lookup() to get the vnode for the file to be unlinked. 
  *  - Lock/unlock the parent directory when calling its unlink operation.
  */
-long do_unlink(const char *path)
+long do_unlinkat(int dirfd, const char *path, int flags)
 {
+    if (flags & ~AT_REMOVEDIR) {
+        return -EINVAL;
+    }
+    if (flags & AT_REMOVEDIR) {
+        return rmdirat(dirfd, path);
+    }
     // similar work to do_mkdir
+    vnode_t *base = NULL;
     vnode_t *parent_vnode = NULL;
     const char *name = NULL;
     size_t namelen = 0;
     vnode_t *res_vnode = NULL;
 
-    long ret = namev_dir(curproc->p_cwd, path, &parent_vnode, &name, &namelen);
+    long ret = at_get_base(dirfd, path, &base);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = namev_dir(base, path, &parent_vnode, &name, &namelen);
+    vput(&base);
     if (ret != 0) {
         //if (parent_vnode != NULL) {
             //vput(&parent_vnode); /// namevdir should tc of that
@@ -518,6 +1144,7 @@ long do_unlink(const char *path)
         }
         vput(&res_vnode);
         // in this case, Use the vnode unlink operation 
+        dcache_invalidate(parent_vnode, name, namelen);
         res = parent_vnode->vn_ops->unlink(parent_vnode, name, namelen); /// num of args, parent vnode not needed
         // if (res != 0) {
         //     //if (parent_vnode != NULL) {
@@ -544,6 +1171,13 @@ long do_unlink(const char *path)
     //return -1;
 }
 
+long do_unlink(const char *path) { return do_unlinkat(AT_FDCWD, path, 0); }
+
+long do_rmdir(const char *path)
+{
+    return do_unlinkat(AT_FDCWD, path, AT_REMOVEDIR);
+}
+
 /* 
  * Create a hard link newpath that refers to the same file as oldpath.
  *
@@ -551,6 +1185,7 @@ long do_unlink(const char *path)
  *  - EPERM: oldpath refers to a directory
  *  - ENAMETOOLONG: The last component of newpath is too long
  *  - ENOTDIR: The parent of the file to be linked is not a directory
+ *  - EXDEV: oldpath and newpath are on different file systems
  *
  * Hints:
  * 1) Use namev_resolve() on oldpath to get the target vnode.
@@ -613,7 +1248,14 @@ long do_link(const char *oldpath, const char *newpath)
         return -ENAMETOOLONG;
     }
 
+    if (old_vnode->vn_fs != new_vnode->vn_fs) {
+        vput(&old_vnode);
+        vput(&new_vnode);
+        return -EXDEV;
+    }
+
     vlock_in_order(old_vnode, new_vnode);
+    dcache_invalidate(new_vnode, name, namelen);
     long res = new_vnode->vn_ops->link(new_vnode, name, namelen, old_vnode);
     vunlock_in_order(old_vnode, new_vnode);
   
@@ -633,82 +1275,74 @@ long do_link(const char *oldpath, const char *newpath)
  * Return 0 on success, or:
  *  - ENOTDIR: the parent of either path is not a directory
  *  - ENAMETOOLONG: the last component of either path is too long
+ *  - EXDEV: the paths are on different file systems
  *  - Propagate errors from namev_dir() and the vnode operation rename
  *
  * You DO NOT need to support renaming of directories.
- * Steps:
- * 1. namev_dir oldpath --> olddir vnode
- * 2. namev_dir newpath --> newdir vnode
- * 4. Lock the olddir and newdir in ancestor-first order (see `vlock_in_order`)
- * 5. Use the `rename` vnode operation
- * 6. Unlock the olddir and newdir
- * 8. vput the olddir and newdir vnodes
- *
- * ignore these comment section below
- * Alternatively, you can allow do_rename() to rename directories if
- * __RENAMEDIR__ is set in Config.mk. As with all extra credit
- * projects this is harder and you will get no extra credit (but you
- * will get our admiration). Please make sure the normal version works first.
- * Steps:
- * 1. namev_dir oldpath --> olddir vnode
- * 2. namev_dir newpath --> newdir vnode
- * 3. Lock the global filesystem `vnode_rename_mutex`
- * 4. Lock the olddir and newdir in ancestor-first order (see `vlock_in_order`)
- * 5. Use the `rename` vnode operation
- * 6. Unlock the olddir and newdir
- * 7. Unlock the global filesystem `vnode_rename_mutex`
- * 8. vput the olddir and newdir vnodes
- *
- * P.S. This scheme /probably/ works, but we're not 100% sure.
+ *
+ * A rename within one directory, as in the write-to-a-temporary-file-and-
+ * rename pattern, locks just that directory, so renames in different
+ * directories run in parallel. One between two directories also takes the
+ * file system's vnode_rename_mutex around locking both: vlock_in_order()
+ * locks them ancestor first when one contains the other (namev_is_descendant()),
+ * and otherwise in an order that is only safe while no other such rename is
+ * locking directories.
  */
-
-
-
 long do_rename(const char *oldpath, const char *newpath)
 {
     vnode_t *old_res_vnode = NULL;
     const char *old_name;
     size_t old_namelen;
-    //vnode_t **res_vnode = NULL;
 
     vnode_t *new_res_vnode = NULL;
     const char *new_name;
     size_t new_namelen;
+    kmutex_t *rename_mutex = NULL;
 
-    long old_ret = namev_dir(curproc->p_cwd, oldpath, &old_res_vnode, &old_name, &old_namelen); /// is base right?
-    if (old_ret != 0) {
-        return old_ret;
+    long ret = namev_dir(curproc->p_cwd, oldpath, &old_res_vnode, &old_name,
+                         &old_namelen);
+    if (ret != 0) {
+        return ret;
     }
 
-    long new_ret = namev_dir(curproc->p_cwd, newpath, &new_res_vnode, &new_name, &new_namelen);
-    if (new_ret != 0) {
+    ret = namev_dir(curproc->p_cwd, newpath, &new_res_vnode, &new_name,
+                    &new_namelen);
+    if (ret != 0) {
         vput(&old_res_vnode);
-        return new_ret;
+        return ret;
     }
 
     if (!S_ISDIR(old_res_vnode->vn_mode) || !S_ISDIR(new_res_vnode->vn_mode)) {
-        vput(&old_res_vnode);
-        vput(&new_res_vnode);
-        return -ENOTDIR;
+        ret = -ENOTDIR;
+        goto out;
     }
-    
-    if (old_namelen > NAME_LEN || new_namelen > NAME_LEN) { /// separate if statements
-        vput(&old_res_vnode);
-        vput(&new_res_vnode);
-        return -ENAMETOOLONG;
+    if (old_namelen > NAME_LEN || new_namelen > NAME_LEN) {
+        ret = -ENAMETOOLONG;
+        goto out;
+    }
+    if (old_res_vnode->vn_fs != new_res_vnode->vn_fs) {
+        ret = -EXDEV;
+        goto out;
     }
 
-    vlock_in_order(old_res_vnode, new_res_vnode);
-    //(struct vnode *olddir, const char *oldname, size_t oldnamelen, struct vnode *newdir, const char *newname, size_t newnamelen)
-    int ret = old_res_vnode->vn_ops->rename(old_res_vnode, old_name, old_namelen,  new_res_vnode, new_name, new_namelen);
-    if (ret != 0) {
-        return ret;
+    if (old_res_vnode != new_res_vnode) {
+        rename_mutex = &old_res_vnode->vn_fs->vnode_rename_mutex;
+        kmutex_lock(rename_mutex);
     }
+    vlock_in_order(old_res_vnode, new_res_vnode);
+    dcache_invalidate(old_res_vnode, old_name, old_namelen);
+    dcache_invalidate(new_res_vnode, new_name, new_namelen);
+    ret = old_res_vnode->vn_ops->rename(old_res_vnode, old_name, old_namelen,
+                                        new_res_vnode, new_name, new_namelen);
     vunlock_in_order(old_res_vnode, new_res_vnode);
+    if (rename_mutex) {
+        kmutex_unlock(rename_mutex);
+    }
+
+out:
     vput(&old_res_vnode);
     vput(&new_res_vnode);
-    //NOT_YET_IMPLEMENTED("VFS: do_rename");
-    return 0;
+    return ret;
 }
 
 /* Set the current working directory to the directory represented by path.
@@ -791,6 +1425,69 @@ ssize_t do_getdent(int fd, struct dirent *dirp)
     // return -1;
 }
 
+/*
+ * Read as many directory entries from the file specified by fd into dirp as
+ * fit in count bytes, and advance the file position past them.
+ *
+ * Return the number of bytes read, which is 0 at the end of the directory,
+ * or:
+ *  - EBADF: fd is invalid or is not open
+ *  - ENOTDIR: fd does not refer to a directory
+ *  - EINVAL: count is smaller than a dirent_t
+ *  - Propagate errors from the vnode operation getdents or readdir, if no
+ *    entries were read before them
+ *
+ * File systems with a getdents operation fill in many entries at once;
+ * otherwise readdir is called once per entry, all under one lock of the
+ * vnode.
+ */
+ssize_t do_getdents(int fd, struct dirent *dirp, size_t count)
+{
+    size_t max = count / sizeof(dirent_t);
+    if (!max)
+    {
+        return -EINVAL;
+    }
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    vnode_t *vn = file->f_vnode;
+    if (!S_ISDIR(vn->vn_mode))
+    {
+        fput(&file);
+        return -ENOTDIR;
+    }
+
+    ssize_t ret = 0;
+    size_t n = 0;
+    vlock(vn);
+    if (vn->vn_ops->getdents)
+    {
+        size_t pos = file->f_pos;
+        ret = vn->vn_ops->getdents(vn, &pos, dirp, max);
+        if (ret > 0)
+        {
+            n = (size_t)ret;
+            file->f_pos = pos;
+        }
+    }
+    else
+    {
+        while (n < max &&
+               (ret = vn->vn_ops->readdir(vn, file->f_pos, &dirp[n])) > 0)
+        {
+            file->f_pos += ret;
+            n++;
+        }
+    }
+    vunlock(vn);
+    fput(&file);
+
+    return n || ret >= 0 ? (ssize_t)(n * sizeof(dirent_t)) : ret;
+}
+
 /*
  * Set the position of the file represented by fd according to offset and
  * whence.
@@ -846,71 +1543,227 @@ off_t do_lseek(int fd, off_t offset, int whence)
     return pos;
 }
 
-/* Use buf to return the status of the file represented by path.
+/*
+ * Write the file's dirty data (and unless datasync is set, all of its
+ * metadata) back to its disk, and wait for it. Files of in-memory file
+ * systems and devices have nothing to write back.
  *
  * Return 0 on success, or:
- *  - Propagate errors from namev_resolve() and the vnode operation stat.
+ *  - EBADF: fd is invalid or not open
+ *  - EINVAL: fd is a pipe
+ *  - Propagate errors from the vnode's fsync
  */
-long do_stat(const char *path, stat_t *buf)
+long do_fsync(int fd, long datasync)
+{
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    vnode_t *vn = file->f_vnode;
+    long ret = 0;
+    if (S_ISFIFO(vn->vn_mode))
+    {
+        ret = -EINVAL;
+    }
+    else if (vn->vn_ops && vn->vn_ops->fsync)
+    {
+        ret = vn->vn_ops->fsync(vn, datasync);
+    }
+    fput(&file);
+    return ret;
+}
+
+/*
+ * Sync the file system holding the file open on fd, like do_sync() does for
+ * every file system.
+ *
+ * Return 0 on success, or:
+ *  - EBADF: fd is invalid or not open
+ *  - EINVAL: fd is a pipe
+ */
+long do_syncfs(int fd)
+{
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    vnode_t *vn = file->f_vnode;
+    long ret = 0;
+    if (S_ISFIFO(vn->vn_mode))
+    {
+        ret = -EINVAL;
+    }
+    else if (vn->vn_fs->fs_ops->sync)
+    {
+        /* the open file keeps the file system from being unmounted */
+        vn->vn_fs->fs_ops->sync(vn->vn_fs);
+    }
+    fput(&file);
+    return ret;
+}
+
+/* Use buf to return the status of the file represented by path, relative to
+ * the directory dirfd. No flags are supported, there being no symbolic links
+ * to follow or not.
+ *
+ * Return 0 on success, or:
+ *  - EINVAL: flags is not 0
+ *  - Propagate errors from at_get_base(), namev_resolve() and the vnode
+ *    operation stat.
+ */
+long do_fstatat(int dirfd, const char *path, stat_t *buf, int flags)
 {
+    vnode_t *base = NULL;
     vnode_t *res_vnode = NULL;
 
+    if (flags) {
+        return -EINVAL;
+    }
+    long ret = at_get_base(dirfd, path, &base);
+    if (ret != 0) {
+        return ret;
+    }
     //vlock(&curproc->p_mtx);
-    long ret = namev_resolve(curproc->p_cwd, path, &res_vnode);
+    ret = namev_resolve(base, path, &res_vnode);
+    vput(&base);
     if (ret != 0) {
         //vunlock(&curproc->p_mtx);
         return ret;
     }
-    vlock(res_vnode);
+    vlock_shared(res_vnode);
     ret = res_vnode->vn_ops->stat(res_vnode, buf); //// type?
+    vunlock_shared(res_vnode);
+    vput(&res_vnode);
     if (ret != 0) {
         //vunlock(&curproc->p_mtx);
-        vput_locked(&res_vnode);
-        // vunlock(res_vnode);
-        // vput(&res_vnode);
         return ret;
     }
-    vput_locked(&res_vnode);
 
     //NOT_YET_IMPLEMENTED("VFS: do_stat");
     return 0;
 }
 
+long do_stat(const char *path, stat_t *buf)
+{
+    return do_fstatat(AT_FDCWD, path, buf, 0);
+}
+
 #ifdef __MOUNTING__
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutely sure your Weenix is perfect.
+ * Mount the file system of the given type, on the device named by source, on
+ * the directory target. source is ignored by ramfs, tmpfs and procfs, and may
+ * be NULL for them.
  *
- * This is the syscall entry point into vfs for mounting. You will need to
- * create the fs_t struct and populate its fs_dev and fs_type fields before
- * calling vfs's mountfunc(). mountfunc() will use the fields you populated
- * in order to determine which underlying filesystem's mount function should
- * be run, then it will finish setting up the fs_t struct. At this point you
- * have a fully functioning file system, however it is not mounted on the
- * virtual file system, you will need to call vfs_mount to do this.
- *
- * There are lots of things which can go wrong here. Make sure you have good
- * error handling. Remember the fs_dev and fs_type buffers have limited size
- * so you should not write arbitrary length strings to them.
+ * Return 0 on success, or:
+ *  - EINVAL: type or source is missing or too long, or type is unknown
+ *  - ENOTDIR: target is not a directory
+ *  - EBUSY: target is already a mount point or the root of a file system, or
+ *    source is already mounted
+ *  - ENOMEM: there is no memory for the fs_t
+ *  - Propagate errors from namev_resolve() and the file system's mount
  */
 int do_mount(const char *source, const char *target, const char *type)
 {
-    NOT_YET_IMPLEMENTED("MOUNTING: do_mount");
-    return -EINVAL;
+    if (!type || strnlen(type, STR_MAX) == STR_MAX ||
+        (source && strnlen(source, STR_MAX) == STR_MAX))
+    {
+        return -EINVAL;
+    }
+    long nodev = !strcmp(type, "ramfs") || !strcmp(type, "tmpfs") ||
+                 !strcmp(type, "procfs");
+    if (!source && !nodev)
+    {
+        return -EINVAL;
+    }
+
+    fs_t *fs = kmalloc(sizeof(fs_t));
+    if (!fs)
+    {
+        return -ENOMEM;
+    }
+    memset(fs, 0, sizeof(fs_t));
+    strncpy(fs->fs_dev, source ? source : "none", STR_MAX);
+    strncpy(fs->fs_type, type, STR_MAX);
+    vnode_cache_init(fs);
+
+    kmutex_lock(&vfs_mount_mutex);
+    vnode_t *mtpt;
+    long ret = namev_resolve(curproc->p_cwd, target, &mtpt);
+    if (ret)
+    {
+        goto out;
+    }
+    if (!S_ISDIR(mtpt->vn_mode))
+    {
+        ret = -ENOTDIR;
+        goto put;
+    }
+    if (mtpt == mtpt->vn_fs->fs_root || mtpt->vn_mount != mtpt)
+    {
+        ret = -EBUSY;
+        goto put;
+    }
+    /* two file systems over one disk would corrupt it */
+    if (!nodev)
+    {
+        if (!strcmp(vfs_root_fs.fs_dev, fs->fs_dev))
+        {
+            ret = -EBUSY;
+            goto put;
+        }
+        list_iterate(&mounted_fs_list, mtfs, fs_t, fs_link)
+        {
+            if (!strcmp(mtfs->fs_dev, fs->fs_dev))
+            {
+                ret = -EBUSY;
+                goto put;
+            }
+        }
+    }
+
+    ret = mountfunc(fs);
+    if (!ret)
+    {
+        ret = vfs_mount(mtpt, fs);
+    }
+put:
+    vput(&mtpt);
+out:
+    kmutex_unlock(&vfs_mount_mutex);
+    if (ret)
+    {
+        kfree(fs);
+    }
+    return ret;
 }
 
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutley sure your Weenix is perfect.
+ * Unmount the file system whose root target is, which must not be the root
+ * file system.
  *
- * This function delegates all of the real work to vfs_umount. You should not
- * worry about freeing the fs_t struct here, that is done in vfs_umount. All
- * this function does is figure out which file system to pass to vfs_umount and
- * do good error checking.
+ * Return 0 on success, or:
+ *  - EINVAL: target is not the root of a mounted file system
+ *  - EBUSY: the file system is in use
+ *  - Propagate errors from namev_resolve()
  */
 int do_umount(const char *target)
 {
-    NOT_YET_IMPLEMENTED("MOUNTING: do_unmount");
-    return -EINVAL;
+    kmutex_lock(&vfs_mount_mutex);
+    vnode_t *root;
+    long ret = namev_resolve(curproc->p_cwd, target, &root);
+    if (ret)
+    {
+        kmutex_unlock(&vfs_mount_mutex);
+        return ret;
+    }
+    fs_t *fs = root->vn_fs;
+    long mounted = root == fs->fs_root && fs != &vfs_root_fs;
+    vput(&root);
+
+    ret = mounted ? vfs_umount(fs) : -EINVAL;
+    kmutex_unlock(&vfs_mount_mutex);
+    return ret;
 }
 #endif
@@ -28,6 +28,11 @@ static mobj_ops_t vnode_mobj_ops = {.get_pframe = vnode_get_pframe,
  * this scheme prevents the A->B/B->A locking problem, but it only
  * works only if the `vlock_in_order` function is used in all cases where 2
  * nodes must be locked.
+ *
+ * Directories are locked ancestor first, as lookups lock them. Two unrelated
+ * directories are locked in inode number order, which alone could still form
+ * a cycle with the ancestor-first order; so only cross-directory renames lock
+ * them, one at a time under the fs's vnode_rename_mutex.
  */
 void vlock_in_order(vnode_t *a, vnode_t *b)
 {
@@ -55,13 +60,14 @@ void vlock_in_order(vnode_t *a, vnode_t *b)
             vlock(b);
             return;
         }
+        KASSERT(kmutex_owns_mutex(&a->vn_fs->vnode_rename_mutex));
     }
-    else if (S_ISDIR(a->vn_mode))
+    if (S_ISDIR(a->vn_mode) && !S_ISDIR(b->vn_mode))
     {
         vlock(a);
         vlock(b);
     }
-    else if (S_ISDIR(b->vn_mode))
+    else if (S_ISDIR(b->vn_mode) && !S_ISDIR(a->vn_mode))
     {
         vlock(b);
         vlock(a);
@@ -117,24 +123,47 @@ void vnode_init(vnode_t *vn, fs_t *fs, ino_t ino, int state)
     vn->vn_state = VNODE_LOADING;
     vn->vn_fs = fs;
     vn->vn_vno = ino;
+#ifdef __MOUNTING__
+    vn->vn_mount = vn;
+#endif
     spinlock_init(&vn->vn_state_lock);
     sched_queue_init(&vn->vn_waitq);
+    rwlock_init(&vn->vn_rwlock);
     mobj_init(&vn->vn_mobj, MOBJ_VNODE, &vnode_mobj_ops);
     KASSERT(vn->vn_mobj.mo_refcount);
 }
 
+void vnode_cache_init(fs_t *fs)
+{
+    for (size_t i = 0; i < VNODE_HASH_NBUCKETS; i++)
+    {
+        vnode_bucket_t *bucket = &fs->fs_vnode_hash[i];
+        list_init(&bucket->vb_list);
+        spinlock_init(&bucket->vb_lock);
+        sched_queue_init(&bucket->vb_teardown_waitq);
+    }
+    kmutex_init(&fs->vnode_rename_mutex);
+}
+
 vnode_t *__vget(fs_t *fs, ino_t ino, int get_locked)
 {
+    vnode_bucket_t *bucket = &fs->fs_vnode_hash[VNODE_HASH(ino)];
+    vnode_t *new = NULL;
 find:
-    kmutex_lock(&fs->vnode_list_mutex);
-    list_iterate(&fs->vnode_list, vn, vnode_t, vn_link)
+    spinlock_lock(&bucket->vb_lock);
+    list_iterate(&bucket->vb_list, vn, vnode_t, vn_link)
     {
         if (vn->vn_vno == ino)
         {
             if (atomic_inc_not_zero(&vn->vn_mobj.mo_refcount))
             {
-                /* reference acquired, we can release the per-FS list */
-                kmutex_unlock(&fs->vnode_list_mutex);
+                /* reference acquired, we can release the bucket */
+                spinlock_unlock(&bucket->vb_lock);
+                if (new)
+                {
+                    /* someone else created it while we were allocating */
+                    slab_obj_free(fs->fs_vnode_allocator, new);
+                }
                 await_vnode_loaded(vn);
                 if (get_locked)
                 {
@@ -144,28 +173,37 @@ find:
             }
             else
             {
-                /* count must be 0, wait and try again later */
-                kmutex_unlock(&fs->vnode_list_mutex);
-                sched_yield();
+                /* count must be 0, so the vnode is being destroyed; wait for
+                 * the destructor to unhash it and try again */
+                sched_sleep_on(&bucket->vb_teardown_waitq, &bucket->vb_lock);
                 goto find;
             }
         }
     }
 
-    /* vnode does not exist, must allocate one */
-    dbg(DBG_VFS, "creating vnode %d\n", ino);
-    vnode_t *vn = slab_obj_alloc(fs->fs_vnode_allocator);
-    KASSERT(vn);
-    memset(vn, 0, sizeof(vnode_t));
-
-    /* initialize the vnode state */
-    vnode_init(vn, fs, ino, VNODE_LOADING);
+    if (!new)
+    {
+        /* vnode does not exist, must allocate one; that is not done under
+         * the bucket's spinlock, so look again afterwards */
+        spinlock_unlock(&bucket->vb_lock);
+        dbg(DBG_VFS, "creating vnode %d\n", ino);
+        new = slab_obj_alloc(fs->fs_vnode_allocator);
+        KASSERT(new);
+        memset(new, 0, sizeof(vnode_t));
+
+        /* initialize the vnode state */
+        vnode_init(new, fs, ino, VNODE_LOADING);
+        goto find;
+    }
 
-    /* add the vnode to the per-FS list, lock the vnode, and release the list
-     * (unblocking other `vget` calls) */
-    list_insert_tail(&fs->vnode_list, &vn->vn_link);
+    /* add the vnode to the bucket and release the bucket (unblocking other
+     * `vget` calls). Until it is loaded, lookups finding it wait for it in
+     * await_vnode_loaded() and vget_cached_rcu() skips it, so nobody else
+     * locks it before we do. */
+    vnode_t *vn = new;
+    list_insert_tail_rcu(&bucket->vb_list, &vn->vn_link);
+    spinlock_unlock(&bucket->vb_lock);
     vlock(vn);
-    kmutex_unlock(&fs->vnode_list_mutex);
 
     /* load the vnode */
     vn->vn_fs->fs_ops->read_vnode(vn->vn_fs, vn);
@@ -184,15 +222,51 @@ find:
 }
 
 
+vnode_t *vget_cached_rcu(fs_t *fs, ino_t ino)
+{
+    vnode_bucket_t *bucket = &fs->fs_vnode_hash[VNODE_HASH(ino)];
+    list_iterate_rcu(&bucket->vb_list, vn, vnode_t, vn_link)
+    {
+        if (vn->vn_vno == ino)
+        {
+            if (__atomic_load_n(&vn->vn_state, __ATOMIC_ACQUIRE) !=
+                    VNODE_LOADED ||
+                !atomic_read(&vn->vn_mobj.mo_refcount))
+            {
+                return NULL;
+            }
+            return vn;
+        }
+    }
+    return NULL;
+}
+
 inline vnode_t *vget(fs_t *fs, ino_t ino) { return __vget(fs, ino, 0); }
 
 inline vnode_t *vget_locked(fs_t *fs, ino_t ino) { return __vget(fs, ino, 1); }
 
 inline void vref(vnode_t *vn) { mobj_ref(&vn->vn_mobj); }
 
-inline void vlock(vnode_t *vn) { mobj_lock(&vn->vn_mobj); }
+inline long vref_not_zero(vnode_t *vn)
+{
+    return mobj_ref_not_zero(&vn->vn_mobj);
+}
 
-inline void vunlock(vnode_t *vn) { mobj_unlock(&vn->vn_mobj); }
+inline void vlock(vnode_t *vn)
+{
+    rwlock_write_lock(&vn->vn_rwlock);
+    mobj_lock(&vn->vn_mobj);
+}
+
+inline void vlock_shared(vnode_t *vn) { rwlock_read_lock(&vn->vn_rwlock); }
+
+inline void vunlock(vnode_t *vn)
+{
+    mobj_unlock(&vn->vn_mobj);
+    rwlock_write_unlock(&vn->vn_rwlock);
+}
+
+inline void vunlock_shared(vnode_t *vn) { rwlock_read_unlock(&vn->vn_rwlock); }
 
 inline void vput(struct vnode **vnp)
 {
@@ -231,17 +305,23 @@ static long vnode_flush_pframe(mobj_t *o, pframe_t *pf)
     return vnode->vn_ops->flush_pframe(vnode, pf);
 }
 
+static void vnode_free_rcu(rcu_head_t *head)
+{
+    vnode_t *vn = CONTAINER_OF(head, vnode_t, vn_rcu);
+    slab_obj_free(vn->vn_fs->fs_vnode_allocator, vn);
+}
+
 static void vnode_destructor(mobj_t *o)
 {
     vnode_t *vn = MOBJ_TO_VNODE(o);
     dbg(DBG_VFS, "destroying vnode %d\n", vn->vn_vno);
 
-    /* lock, flush, and delete the vnode */
+    /* lock, flush and free the pframes of, and delete the vnode */
     KASSERT(!o->mo_refcount);
     vlock(vn);
     KASSERT(!o->mo_refcount);
     KASSERT(!kmutex_has_waiters(&o->mo_mutex));
-    mobj_flush(o);
+    mobj_free_pframes(o);
     if (vn->vn_fs->fs_ops->delete_vnode)
     {
         vn->vn_fs->fs_ops->delete_vnode(vn->vn_fs, vn);
@@ -249,10 +329,13 @@ static void vnode_destructor(mobj_t *o)
     KASSERT(!kmutex_has_waiters(&o->mo_mutex));
     vunlock(vn);
 
-    /* remove the vnode from the list and free it*/
-    kmutex_lock(&vn->vn_fs->vnode_list_mutex);
+    /* remove the vnode from its bucket, wake anyone waiting for it to go
+     * away, and free it */
+    vnode_bucket_t *bucket = &vn->vn_fs->fs_vnode_hash[VNODE_HASH(vn->vn_vno)];
+    spinlock_lock(&bucket->vb_lock);
     KASSERT(list_link_is_linked(&vn->vn_link));
-    list_remove(&vn->vn_link);
-    kmutex_unlock(&vn->vn_fs->vnode_list_mutex);
-    slab_obj_free(vn->vn_fs->fs_vnode_allocator, vn);
+    list_remove_rcu(&vn->vn_link);
+    spinlock_unlock(&bucket->vb_lock);
+    sched_broadcast_on(&bucket->vb_teardown_waitq);
+    rcu_call(&vn->vn_rcu, vnode_free_rcu);
 }
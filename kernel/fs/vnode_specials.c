@@ -1,8 +1,11 @@
+#include <api/syscall.h>
 #include <errno.h>
+#include <fs/poll.h>
 #include <fs/stat.h>
 #include <fs/vfs.h>
 #include <fs/vnode.h>
 #include <util/debug.h>
+#include <util/string.h>
 
 static long special_file_stat(vnode_t *file, stat_t *ss);
 
@@ -18,6 +21,11 @@ static long chardev_file_fill_pframe(vnode_t *file, pframe_t *pf);
 
 static long chardev_file_flush_pframe(vnode_t *file, pframe_t *pf);
 
+static int chardev_file_poll(vnode_t *file, poll_entry_t *pe);
+
+static long chardev_file_ioctl(vnode_t *file, unsigned long request,
+                               void *arg);
+
 static vnode_ops_t chardev_spec_vops = {
     .read = chardev_file_read,
     .write = chardev_file_write,
@@ -33,6 +41,8 @@ static vnode_ops_t chardev_spec_vops = {
     .get_pframe = NULL,
     .fill_pframe = chardev_file_fill_pframe,
     .flush_pframe = chardev_file_flush_pframe,
+    .poll = chardev_file_poll,
+    .ioctl = chardev_file_ioctl,
 };
 
 static ssize_t blockdev_file_read(vnode_t *file, size_t pos, void *buf,
@@ -43,10 +53,16 @@ static ssize_t blockdev_file_write(vnode_t *file, size_t pos, const void *buf,
 
 static long blockdev_file_mmap(vnode_t *file, mobj_t **ret);
 
+static long blockdev_file_get_pframe(vnode_t *file, size_t pagenum,
+                                     long forwrite, pframe_t **pfp);
+
 static long blockdev_file_fill_pframe(vnode_t *file, pframe_t *pf);
 
 static long blockdev_file_flush_pframe(vnode_t *file, pframe_t *pf);
 
+static void blockdev_file_readahead(vnode_t *file, size_t pagenum,
+                                    size_t npages);
+
 static vnode_ops_t blockdev_spec_vops = {
     .read = blockdev_file_read,
     .write = blockdev_file_write,
@@ -59,9 +75,10 @@ static vnode_ops_t blockdev_spec_vops = {
     .rmdir = NULL,
     .readdir = NULL,
     .stat = special_file_stat,
-    .get_pframe = NULL,
+    .get_pframe = blockdev_file_get_pframe,
     .fill_pframe = blockdev_file_fill_pframe,
     .flush_pframe = blockdev_file_flush_pframe,
+    .readahead = blockdev_file_readahead,
 };
 
 void init_special_vnode(vnode_t *vn)
@@ -175,6 +192,32 @@ static long chardev_file_flush_pframe(vnode_t *file, pframe_t *pf)
     return 0;
 }
 
+/*
+ * Defer to the chardev's poll operation; devices without one, like
+ * /dev/null and /dev/zero, never block.
+ */
+static int chardev_file_poll(vnode_t *file, poll_entry_t *pe)
+{
+    chardev_t *dev = file->vn_dev.chardev;
+    if (!dev->cd_ops->poll)
+    {
+        return POLLIN | POLLOUT;
+    }
+    return dev->cd_ops->poll(dev, pe);
+}
+
+/* Defer to the chardev's ioctl operation */
+static long chardev_file_ioctl(vnode_t *file, unsigned long request,
+                               void *arg)
+{
+    chardev_t *dev = file->vn_dev.chardev;
+    if (!dev->cd_ops->ioctl)
+    {
+        return -ENOTTY;
+    }
+    return dev->cd_ops->ioctl(dev, request, arg);
+}
+
 static ssize_t blockdev_file_read(vnode_t *file, size_t pos, void *buf,
                                   size_t count)
 {
@@ -187,14 +230,118 @@ static long blockdev_file_write(vnode_t *file, size_t pos, const void *buf,
     return -ENOTSUP;
 }
 
-static long blockdev_file_mmap(vnode_t *file, mobj_t **ret) { return -ENOTSUP; }
+/*
+ * A block device is mapped through the vnode's own memory object, whose page n
+ * holds block n of the device (BLOCK_SIZE is PAGE_SIZE). The device's buffer
+ * cache can't be mapped itself, since it is spread over several memory
+ * objects (see blockdev_mobj()). Mapping past the end of the device faults
+ * with the error of the failed read.
+ *
+ * A page is a copy of its block as of when it was filled: from the buffer
+ * cache if the block is there, from the disk otherwise. It is not kept
+ * coherent with a file system mounted on the device. Later changes to the
+ * block are not seen until the page is evicted. The buffer cache only holds
+ * metadata, so a regular file's data is read as it is on disk, without
+ * writes still cached in the file's vnode. A mapping is meant for scanning
+ * an unmounted disk, as fsck would.
+ *
+ * Nothing maps it until do_mmap() is implemented.
+ */
+static long blockdev_file_mmap(vnode_t *file, mobj_t **ret)
+{
+    mobj_ref(&file->vn_mobj);
+    *ret = &file->vn_mobj;
+    return 0;
+}
+
+static long blockdev_file_get_pframe(vnode_t *file, size_t pagenum,
+                                     long forwrite, pframe_t **pfp)
+{
+    return mobj_default_get_pframe(&file->vn_mobj, pagenum, forwrite, pfp);
+}
+
+/*
+ * Find the pframe of a block in the device's buffer cache, locked, with any
+ * fill of it finished successfully; *pfp is NULL if the block is not cached.
+ */
+static void blockdev_file_find_cached(blockdev_t *bd, blocknum_t block,
+                                      pframe_t **pfp)
+{
+    mobj_t *o = blockdev_mobj(bd, block);
+    mobj_lock(o);
+    mobj_find_pframe(o, block, pfp);
+    mobj_unlock(o);
+    if (*pfp && pframe_wait_fill(*pfp))
+    {
+        pframe_release(pfp);
+    }
+}
 
 static long blockdev_file_fill_pframe(vnode_t *file, pframe_t *pf)
 {
-    return -ENOTSUP;
+    blockdev_t *bd = file->vn_dev.blockdev;
+    pframe_t *cached;
+    blockdev_file_find_cached(bd, (blocknum_t)pf->pf_pagenum, &cached);
+    if (cached)
+    {
+        memcpy(pf->pf_addr, cached->pf_addr, BLOCK_SIZE);
+        pframe_release(&cached);
+        return 0;
+    }
+    return blockdev_rw_pframes(bd, (blocknum_t)pf->pf_pagenum, &pf, 1, 0);
 }
 
+/*
+ * Write a page of a shared, writable mapping to its block, and into the
+ * buffer cache's copy of the block if there is one. A regular file's cached
+ * pages are not updated, and may later write the block over.
+ */
 static long blockdev_file_flush_pframe(vnode_t *file, pframe_t *pf)
 {
-    return -ENOTSUP;
+    blockdev_t *bd = file->vn_dev.blockdev;
+    long ret = blockdev_rw_pframes(bd, (blocknum_t)pf->pf_pagenum, &pf, 1, 1);
+    pframe_t *cached;
+    blockdev_file_find_cached(bd, (blocknum_t)pf->pf_pagenum, &cached);
+    if (cached)
+    {
+        memcpy(cached->pf_addr, pf->pf_addr, BLOCK_SIZE);
+        pframe_release(&cached);
+    }
+    return ret;
+}
+
+/*
+ * Read runs of the blocks under pages [pagenum, pagenum + npages) into the
+ * vnode's memory object in the background, as faults on a mapping of the
+ * device would, but a run at a time. Blocks in the buffer cache are left for
+ * blockdev_file_fill_pframe() to copy, and break the runs.
+ */
+static void blockdev_file_readahead(vnode_t *file, size_t pagenum,
+                                    size_t npages)
+{
+    blockdev_t *bd = file->vn_dev.blockdev;
+    mobj_t *o = &file->vn_mobj;
+    mobj_lock(o);
+    size_t run = pagenum;
+    for (size_t i = pagenum; i <= pagenum + npages; i++)
+    {
+        pframe_t *cached = NULL;
+        if (i < pagenum + npages)
+        {
+            blockdev_file_find_cached(bd, (blocknum_t)i, &cached);
+        }
+        if (i == pagenum + npages || cached)
+        {
+            if (i > run)
+            {
+                blockdev_readahead_pages(bd, (blocknum_t)run, o, run, i - run);
+            }
+            run = i + 1;
+        }
+        if (cached)
+        {
+            pframe_release(&cached);
+        }
+    }
+    mobj_unlock(o);
 }
@@ -5,11 +5,20 @@
 struct proc;
 struct argstr;
 struct argvec;
+struct regs;
 
 long copy_from_user(void *kaddr, const void *uaddr, size_t nbytes);
 
 long copy_to_user(void *uaddr, const void *kaddr, size_t nbytes);
 
+/**
+ * Handles a kernel mode pagefault if it was taken copying to or from user
+ * memory.
+ *
+ * @return whether the fault was handled; if not, it is a kernel bug
+ */
+long user_copy_fault(struct regs *regs, uintptr_t vaddr, uintptr_t cause);
+
 long user_strdup(struct argstr *ustr, char **kstrp);
 
 long user_vecdup(struct argvec *uvec, char ***kvecp);
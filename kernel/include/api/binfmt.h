@@ -10,3 +10,15 @@ long binfmt_add(const char *id, binfmt_load_func_t loadfunc);
 
 long binfmt_load(const char *filename, char *const *argv, char *const *envp,
                  uint64_t *rip, uint64_t *rsp);
+
+/**
+ * Keeps a reference to the vnode of a program that was just loaded in the
+ * exec cache, letting go of the least recently loaded one if it is full.
+ */
+void binfmt_cache_hold(vnode_t *vn);
+
+/**
+ * Lets go of every vnode in the exec cache, e.g. before the file systems are
+ * shut down.
+ */
+void binfmt_cache_purge();
@@ -0,0 +1,30 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+/* Operations of the profile system call */
+#define PROFILE_START 0 /* take a sample every interval timer ticks */
+#define PROFILE_STOP 1
+#define PROFILE_READ 2 /* take up to nbytes of samples into buf */
+
+#define PROFILE_DEPTH 8
+
+/*
+ * A sample: where a core was when the timer interrupted it. In the kernel,
+ * the frame-pointer chain is followed for the callers as well.
+ */
+typedef struct profile_sample
+{
+    int32_t ps_pid;   /* -1 if the core was idle */
+    uint16_t ps_core;
+    uint8_t ps_user;  /* 1 if it was running in user mode */
+    uint8_t ps_depth; /* entries of ps_pcs in use, at least 1 */
+    uint64_t ps_pcs[PROFILE_DEPTH]; /* interrupted rip, then return
+                                     * addresses, innermost first */
+} profile_sample_t;
@@ -13,6 +13,10 @@
 /* Trap number for syscalls */
 #define INTR_SYSCALL 0x2e
 
+/* A syscall that fails returns -errno, from -1 to -SYSCALL_MAX_ERRNO; no
+ * syscall returns a value in that range on success */
+#define SYSCALL_MAX_ERRNO 4095
+
 /* Keep all lists IN ORDER! */
 
 #define SYS_syscall 0
@@ -33,21 +37,21 @@
 #define SYS_nuke 16 /* NYI */
 #define SYS_dup 17
 #define SYS_pipe 18
-#define SYS_ioctl 19 /* NYI */
+#define SYS_ioctl 19
 #define SYS_rmdir 21
 #define SYS_mkdir 22
 #define SYS_getdents 23
 #define SYS_mmap 24
-#define SYS_mprotect 25 /* NYI */
+#define SYS_mprotect 25
 #define SYS_munmap 26
 #define SYS_rename 27 /* NYI */
 #define SYS_uname 28
-#define SYS_thr_create 29 /* NYI */
+#define SYS_thr_create 29
 #define SYS_thr_cancel 30
 #define SYS_thr_exit 31
 #define SYS_sched_yield 32
 #define SYS_thr_join 33 /* NYI */
-#define SYS_gettid 34   /* NYI */
+#define SYS_gettid 34
 #define SYS_getpid 35
 #define SYS_errno 39
 #define SYS_halt 40
@@ -60,6 +64,42 @@
 #define SYS_stat 47
 #define SYS_time 48
 #define SYS_usleep 49
+#define SYS_pread 50
+#define SYS_pwrite 51
+#define SYS_readv 52
+#define SYS_writev 53
+#define SYS_nice 54
+#define SYS_sched_setscheduler 55
+#define SYS_sched_getscheduler 56
+#define SYS_futex 57
+#define SYS_ring_enter 58
+#define SYS_splice 59
+#define SYS_tee 60
+#define SYS_sendfile 61
+#define SYS_poll 62
+#define SYS_epoll_create 63
+#define SYS_epoll_ctl 64
+#define SYS_epoll_wait 65
+#define SYS_fcntl 66
+#define SYS_profile 67
+#define SYS_madvise 68
+#define SYS_msync 69
+#define SYS_fsync 70
+#define SYS_fdatasync 71
+#define SYS_syncfs 72
+#define SYS_openat 73
+#define SYS_fstatat 74
+#define SYS_unlinkat 75
+#define SYS_mkdirat 76
+#define SYS_sched_setaffinity 77
+#define SYS_sched_getaffinity 78
+#define SYS_times 79
+#define SYS_clock_gettime 80
+#define SYS_nanosleep 81
+#define SYS_memgroup 82
+#define SYS_ioprio_set 83
+#define SYS_ioprio_get 84
+#define SYS_set_tls 85
 
 /*
  * ... what does the scouter say about his syscall?
@@ -107,6 +147,13 @@ typedef struct munmap_args
     size_t len;
 } munmap_args_t;
 
+typedef struct mprotect_args
+{
+    void *addr;
+    size_t len;
+    int prot; /* PROT_*; see mm/mman.h */
+} mprotect_args_t;
+
 typedef struct open_args
 {
     argstr_t filename;
@@ -114,6 +161,14 @@ typedef struct open_args
     int mode;
 } open_args_t;
 
+typedef struct openat_args
+{
+    int dirfd;
+    argstr_t filename;
+    int flags;
+    int mode;
+} openat_args_t;
+
 typedef struct read_args
 {
     int fd;
@@ -128,12 +183,185 @@ typedef struct write_args
     size_t nbytes;
 } write_args_t;
 
+typedef struct pread_args
+{
+    int fd;
+    void *buf;
+    size_t nbytes;
+    off_t offset;
+} pread_args_t;
+
+typedef struct pwrite_args
+{
+    int fd;
+    const void *buf;
+    size_t nbytes;
+    off_t offset;
+} pwrite_args_t;
+
+/* One buffer of a readv/writev */
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+
+/* Most buffers a readv/writev may take */
+#define IOV_MAX 64
+
+typedef struct rwv_args
+{
+    int fd;
+    const struct iovec *iov;
+    int iovcnt;
+} rwv_args_t;
+
+/* Arguments of splice and tee */
+typedef struct splice_args
+{
+    int fd_in;
+    int fd_out;
+    size_t len;
+} splice_args_t;
+
+typedef struct sendfile_args
+{
+    int out_fd;
+    int in_fd;
+    off_t *offset; /* or NULL to use and advance in_fd's file position */
+    size_t count;
+} sendfile_args_t;
+
+/* Readiness events of poll() and epoll; POLLERR, POLLHUP and POLLNVAL are
+ * reported whether asked for or not */
+#define POLLIN 0x001   /* there is data to read */
+#define POLLOUT 0x004  /* writing will not block */
+#define POLLERR 0x008  /* writing will fail: no one is left to read */
+#define POLLHUP 0x010  /* no one is left to write */
+#define POLLNVAL 0x020 /* the fd is not open */
+
+typedef unsigned long nfds_t;
+
+struct pollfd
+{
+    int fd; /* ignored if negative */
+    short events;
+    short revents;
+};
+
+typedef struct poll_args
+{
+    struct pollfd *fds;
+    nfds_t nfds;
+    int timeout; /* in milliseconds, or negative to wait for ever */
+} poll_args_t;
+
+#define EPOLLIN POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLERR POLLERR
+#define EPOLLHUP POLLHUP
+/* Report an event only when the fd becomes ready, rather than for as long
+ * as it is */
+#define EPOLLET (1U << 31)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+struct epoll_event
+{
+    uint32_t events;
+    uint64_t data; /* returned with the fd's events */
+};
+
+typedef struct epoll_ctl_args
+{
+    int epfd;
+    int op;
+    int fd;
+    struct epoll_event *event; /* ignored by EPOLL_CTL_DEL */
+} epoll_ctl_args_t;
+
+typedef struct epoll_wait_args
+{
+    int epfd;
+    struct epoll_event *events;
+    int maxevents;
+    int timeout; /* in milliseconds, or negative to wait for ever */
+} epoll_wait_args_t;
+
+/* ioctl() requests for ttys, which take a struct termios */
+#define TCGETS 0x5401
+#define TCSETS 0x5402
+
+/* c_lflag */
+#define ICANON 0x1 /* edit and cook input a line at a time */
+#define ECHO 0x2   /* echo input */
+
+/* c_cc indices, for raw (non-canonical) input */
+#define VMIN 0  /* characters a read waits for */
+#define VTIME 1 /* tenths of a second a read waits for the next character */
+#define NCCS 2
+
+/* ioctl() request for the framebuffer (/dev/fb), which takes a struct
+ * fb_info */
+#define FBIOGET_INFO 0x4600
+
+struct fb_info
+{
+    uint32_t fb_width;  /* in pixels */
+    uint32_t fb_height; /* in pixels */
+    uint32_t fb_pitch;  /* bytes from the start of one row to the next */
+    uint32_t fb_bpp;    /* bits per pixel: 32, as 0x00RRGGBB */
+    uint64_t fb_size;   /* bytes to mmap, a whole number of pages */
+};
+
+typedef unsigned int tcflag_t;
+typedef unsigned char cc_t;
+
+struct termios
+{
+    tcflag_t c_lflag;
+    cc_t c_cc[NCCS];
+};
+
+typedef struct ioctl_args
+{
+    int fd;
+    unsigned long request;
+    void *arg;
+} ioctl_args_t;
+
+typedef struct thr_create_args
+{
+    void *tca_entry; /* called with tca_arg; must not return */
+    void *tca_arg;
+    void *tca_stack; /* top of the new thread's stack */
+    void *tca_tls;   /* FS base of the new thread */
+    int *tca_exit_word; /* cleared, and woken as a futex, once the thread has
+                         * exited; may be NULL */
+} thr_create_args_t;
+
 typedef struct mkdir_args
 {
     argstr_t path;
     int mode;
 } mkdir_args_t;
 
+typedef struct mkdirat_args
+{
+    int dirfd;
+    argstr_t path;
+    int mode;
+} mkdirat_args_t;
+
+typedef struct unlinkat_args
+{
+    int dirfd;
+    argstr_t path;
+    int flags;
+} unlinkat_args_t;
+
 typedef struct link_args
 {
     argstr_t to;
@@ -173,6 +401,35 @@ typedef struct dup2_args
     int nfd;
 } dup2_args_t;
 
+typedef struct fcntl_args
+{
+    int fd;
+    int cmd;
+    int arg;
+} fcntl_args_t;
+
+typedef struct profile_args
+{
+    int op; /* PROFILE_START, PROFILE_STOP or PROFILE_READ; see api/profile.h */
+    int interval;
+    void *buf;
+    size_t nbytes;
+} profile_args_t;
+
+typedef struct madvise_args
+{
+    void *addr;
+    size_t len;
+    int advice; /* MADV_*; see mm/mman.h */
+} madvise_args_t;
+
+typedef struct msync_args
+{
+    void *addr;
+    size_t len;
+    int flags; /* MS_*; see mm/mman.h */
+} msync_args_t;
+
 #ifdef __MOUNTING__
 typedef struct mount_args
 {
@@ -188,9 +445,164 @@ typedef struct stat_args
     struct stat *buf;
 } stat_args_t;
 
+typedef struct fstatat_args
+{
+    int dirfd;
+    argstr_t path;
+    struct stat *buf;
+    int flags;
+} fstatat_args_t;
+
 typedef struct usleep_args
 {
     useconds_t usec;
 } usleep_args_t;
 
+/* CPU time used, in clock ticks, of which there are CLK_TCK a second; times()
+ * returns the ticks since boot */
+#define CLK_TCK 1000
+
+struct tms
+{
+    unsigned long tms_utime;  /* in user mode, by the calling process */
+    unsigned long tms_stime;  /* in the kernel, on its behalf */
+    unsigned long tms_cutime; /* user time of the children waited for */
+    unsigned long tms_cstime; /* system time of the children waited for */
+};
+
+/* Clocks for clock_gettime(): the time since the epoch, or since boot. Both
+ * advance with the TSC, to the nanosecond */
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+
+struct timespec
+{
+    time_t tv_sec;
+    long tv_nsec;
+};
+
+typedef struct clock_gettime_args
+{
+    int cga_clock;
+    struct timespec *cga_tp;
+} clock_gettime_args_t;
+
+typedef struct nanosleep_args
+{
+    const struct timespec *nsa_req;
+    struct timespec *nsa_rem; /* may be NULL */
+} nanosleep_args_t;
+
+/* memgroup() operations (see mm/memgroup.h); limits are in bytes, rounded up
+ * to pages, 0 for none */
+#define MEMGROUP_CREATE 0    /* make a group limited to mga_limit; returns
+                              * its id */
+#define MEMGROUP_DESTROY 1   /* remove group mga_group, once no process is
+                              * in it */
+#define MEMGROUP_SET_LIMIT 2 /* limit group mga_group to mga_limit */
+#define MEMGROUP_JOIN 3      /* move process mga_pid into group mga_group */
+#define MEMGROUP_SET_IO 4    /* set group mga_group's disk share to
+                              * mga_io_weight and its latency target to
+                              * mga_io_latency_ms (0 for the defaults) */
+
+typedef struct memgroup_args
+{
+    int mga_op;
+    int mga_group;    /* 0 is the root group, which has no limit */
+    pid_t mga_pid;    /* 0 for the calling process */
+    size_t mga_limit;
+    unsigned mga_io_weight;     /* 1 to IOSCHED_WEIGHT_MAX */
+    unsigned mga_io_latency_ms;
+} memgroup_args_t;
+
+/* I/O priorities, for ioprio_set(): a class and, for IOPRIO_CLASS_RT and
+ * IOPRIO_CLASS_BE, a level from 0 (highest) to IOPRIO_LEVELS - 1 */
+#define IOPRIO_CLASS_NONE 0 /* IOPRIO_CLASS_BE at IOPRIO_LEVEL_DEFAULT */
+#define IOPRIO_CLASS_RT 1   /* served before anyone else's */
+#define IOPRIO_CLASS_BE 2   /* best effort: the group's share of the disk */
+#define IOPRIO_CLASS_IDLE 3 /* served when the disk has nothing else to do */
+#define IOPRIO_LEVELS 8
+#define IOPRIO_LEVEL_DEFAULT 4
+
+#define IOPRIO_VALUE(class, level) (((class) << 13) | (level))
+#define IOPRIO_CLASS(prio) ((prio) >> 13)
+#define IOPRIO_LEVEL(prio) ((prio) & ((1 << 13) - 1))
+
+typedef struct ioprio_set_args
+{
+    pid_t isa_pid; /* 0 for the calling process */
+    int isa_prio;  /* IOPRIO_VALUE(class, level) */
+} ioprio_set_args_t;
+
+/* Scheduling policies: fair share, with a nice value from -20 (most CPU) to
+ * 19 as the priority, or realtime, with a priority from 1 to 99 (highest),
+ * which always runs before fair share threads */
+#define SCHED_OTHER 0
+#define SCHED_FIFO 1
+
+/* nice() returns the new nice value plus NICE_BIAS, which is never negative */
+#define NICE_BIAS 20
+
+typedef struct sched_setscheduler_args
+{
+    pid_t ssa_pid; /* 0 for the calling process */
+    int ssa_policy;
+    int ssa_priority;
+} sched_setscheduler_args_t;
+
+typedef struct sched_setaffinity_args
+{
+    pid_t saa_pid;          /* 0 for the calling process */
+    unsigned long saa_mask; /* the cores it may run on, bit i for core i */
+} sched_setaffinity_args_t;
+
+/* Futex operations: sleep while the word holds fa_val, or wake up to fa_val
+ * of its waiters */
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+typedef struct futex_args
+{
+    int *fa_uaddr;
+    int fa_op;
+    int fa_val;
+} futex_args_t;
+
+/*
+ * A ring of system calls for ring_enter() to run, all in one entry to the
+ * kernel. It lives in userland memory, and sr_entries must be a power of 2.
+ *
+ * Userland fills in sr_sq[sr_sq_tail % sr_entries] and advances sr_sq_tail.
+ * The kernel runs entries from sr_sq_head on, while there is room for their
+ * results, and puts the result of each (as a syscall would return it, or
+ * -errno) at sr_cq[sr_cq_tail % sr_entries], advancing sr_sq_head and
+ * sr_cq_tail. Userland takes results from sr_cq_head on.
+ *
+ * Only read, write, open, openat, close, stat, fstatat, lseek, pread and
+ * pwrite can be submitted; other entries complete with -EINVAL.
+ */
+typedef struct ring_sqe
+{
+    long sqe_sysnum;
+    void *sqe_args;    /* the argument the system call would be passed */
+    uint64_t sqe_data; /* copied to the entry's cqe_data */
+} ring_sqe_t;
+
+typedef struct ring_cqe
+{
+    uint64_t cqe_data;
+    long cqe_ret;
+} ring_cqe_t;
+
+typedef struct syscall_ring
+{
+    uint32_t sr_entries;
+    volatile uint32_t sr_sq_head; /* advanced by the kernel */
+    volatile uint32_t sr_sq_tail; /* advanced by userland */
+    volatile uint32_t sr_cq_head; /* advanced by userland */
+    volatile uint32_t sr_cq_tail; /* advanced by the kernel */
+    ring_sqe_t *sr_sq;
+    ring_cqe_t *sr_cq;
+} syscall_ring_t;
+
 struct utsname;
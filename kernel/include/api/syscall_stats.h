@@ -0,0 +1,44 @@
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+/*
+ * Always-on system call statistics: how often each system call was made,
+ * and how long it took, from entering syscall_dispatch() to leaving it, in
+ * TSC cycles. Times are also counted in a histogram by their log2.
+ *
+ * The counters are kept per core, so that making a system call touches no
+ * shared cache line, and are summed when read; see the kshell command
+ * "sysstat".
+ */
+typedef struct syscall_stats
+{
+    uint64_t sc_calls;
+    uint64_t sc_cycles;
+    /* calls that took [2^i, 2^(i + 1)) cycles; the last bucket also counts
+     * any that took longer */
+    uint64_t sc_hist[SYSCALL_HIST_BUCKETS];
+} syscall_stats_t;
+
+/**
+ * Returns the number of system calls statistics are kept for; they are
+ * numbered from 0.
+ */
+size_t syscall_stats_count();
+
+/**
+ * Returns the name of system call sysnum, which must be below
+ * syscall_stats_count().
+ */
+const char *syscall_name(size_t sysnum);
+
+/**
+ * Sums the statistics of system call sysnum over every core into stats.
+ */
+void syscall_stats_get(size_t sysnum, syscall_stats_t *stats);
+
+/**
+ * Zeroes the statistics of every system call, on every core.
+ */
+void syscall_stats_reset();
@@ -0,0 +1,45 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+/*
+ * The records read from /dev/trace; see util/trace.h in the kernel.
+ */
+
+typedef enum trace_event
+{
+    TRACE_SYSCALL = 1,   /* sysnum, return value, TSC cycles taken */
+    TRACE_SWITCH,        /* pid and tid of the thread switched to */
+    TRACE_WAKEUP,        /* pid and tid of the thread made runnable */
+    TRACE_PAGEFAULT,     /* faulting address, cause, 0 or -errno */
+    TRACE_PFRAME_MISS,   /* mobj, page number of a page not in memory */
+    TRACE_PFRAME_FILL,   /* mobj, page number, 0 or -errno once filled */
+    TRACE_DISK_SUBMIT,   /* first block, block count, 1 for a write */
+    TRACE_DISK_COMPLETE, /* first block, block count, command slot */
+    TRACE_LOOKUP,        /* directory vno, up to 8 bytes of the name,
+                          * 0 or -errno */
+    TRACE_NEVENTS
+} trace_event_t;
+
+/* Names of the events, indexed by trace_event_t */
+#define TRACE_EVENT_NAMES                                                   \
+    {                                                                       \
+        "none", "syscall", "switch", "wakeup", "pagefault", "pframe_miss",  \
+            "pframe_fill", "disk_submit", "disk_complete", "lookup"         \
+    }
+
+#define TRACE_NARGS 3
+
+typedef struct trace_record
+{
+    uint64_t tr_time; /* TSC at the event */
+    uint32_t tr_core;
+    uint32_t tr_event; /* a trace_event_t */
+    uint64_t tr_args[TRACE_NARGS];
+} trace_record_t;
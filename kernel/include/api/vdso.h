@@ -0,0 +1,51 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "api/utsname.h"
+#include "types.h"
+#else
+#include "sys/types.h"
+#include "sys/utsname.h"
+#endif
+
+/*
+ * The vDSO data page, which the kernel maps read-only at VDSO_ADDR in every
+ * process and keeps up to date, so that libc can answer time(), uname() and
+ * clock_gettime() without a system call.
+ */
+
+#define VDSO_ADDR 0x7ffffffff000UL /* the last page of user memory */
+
+typedef struct vdso_data
+{
+    volatile time_t vd_time; /* seconds since the epoch, as for time() */
+    /* CLOCK_MONOTONIC is (rdtsc - vd_tsc_boot) * vd_tsc_mult >> 32 ns, and
+     * CLOCK_REALTIME that plus vd_boot_time s; the TSC reads the same on every
+     * core */
+    uint64_t vd_tsc_boot;
+    uint64_t vd_tsc_mult;
+    time_t vd_boot_time;
+    struct utsname vd_uname; /* never changes */
+} vdso_data_t;
+
+#ifdef __KERNEL__
+
+struct vmmap;
+
+extern vdso_data_t *vdso_data;
+
+/**
+ * Brings the page up to date; called on every tick of core 0.
+ */
+void vdso_tick();
+
+/**
+ * Maps the page at VDSO_ADDR in map, which must have nothing there.
+ *
+ * @return 0 on success, or -ENOMEM
+ */
+long vdso_map(struct vmmap *map);
+
+#endif
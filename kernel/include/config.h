@@ -13,6 +13,7 @@
  */
 #define DEFAULT_STACK_SIZE_PAGES 16
 #define DEFAULT_STACK_SIZE (DEFAULT_STACK_SIZE_PAGES << PAGE_SHIFT)
+#define KSTACK_CACHE 4 /* freed kernel stacks each core keeps for reuse */
 #define TICK_MSECS 10 /* msecs between clock interrupts */
 
 /*
@@ -37,10 +38,122 @@
 #define MAX_VFS 8       /* max # of vfses */
 #define MAX_VNODES 1024 /* max number of in-core vnodes */
 #define NAME_LEN 28     /* maximum directory entry length */
-#define NFILES 32       /* maximum number of open files */
+#define NFILES 4096     /* maximum number of open files per process */
+#define FDTABLE_INIT_FILES 64 /* descriptors a new file table has room for */
+
+#define DCACHE_MAX_ENTRIES 1024   /* max number of cached directory entries */
+#define DCACHE_HASH_NBUCKETS 256  /* dentry cache hash buckets; power of 2 */
+
+#define PIPE_DEFAULT_PAGES 16 /* pages of data a new pipe holds at once */
+#define PIPE_MAX_PAGES 64     /* most it can be given with F_SETPIPE_SZ */
+
+#define BINFMT_CACHE_SIZE 16 /* programs whose vnodes the exec cache keeps */
+
+#define S5_READAHEAD_MIN 4   /* initial sequential readahead window, in blocks */
+#define S5_READAHEAD_MAX 64  /* largest readahead window, in blocks */
+#define S5_DELALLOC_MAX_RUN 32 /* most file pages written per flush */
+#define S5_INODE_SYNC_BATCH 32 /* most inodes sync() copies out at once */
+#define S5_DISCARD_MAX 256     /* most runs of freed blocks awaiting discard */
+
+#define KEYBOARD_RING_SIZE 256 /* scancodes queued by the keyboard interrupt;
+                                * must be a power of 2 */
+
+#define WORKQ_PRIORITY 50 /* realtime priority of the work queue threads */
+
+#define SCHED_TIMESLICE_TICKS 10 /* ticks a thread runs before threads waiting
+                                  * for its core may preempt it */
+
+#define WRITEBACK_INTERVAL_MS 500   /* how often the writeback thread runs */
+#define WRITEBACK_EXPIRE_MS 3000    /* age at which dirty pages are written */
+#define WRITEBACK_DIRTY_RATIO 10    /* % of memory dirty before writing early */
+#define WRITEBACK_LOW_FREE_PAGES 256 /* free pages before writing early */
+#define WRITEBACK_CORE 0 /* core the writeback thread runs on, or -1 for any */
+
+#define RECLAIM_LOW_PAGES 256  /* free pages at which page reclaim starts */
+#define RECLAIM_HIGH_PAGES 512 /* free pages at which page reclaim stops */
+#define RECLAIM_BATCH 32       /* pages reclaimed per pass */
+#define RECLAIM_OOM_KILL 1     /* kill a process when memory runs out */
+#define RECLAIM_OOM_PAGES 64   /* free pages below which an allocation
+                                * failure, once nothing else can be
+                                * reclaimed, gets a process killed */
+
+#define MEMGROUP_MAX 16 /* memory groups, the root included; at most 256 */
+
+#define SWAP_SLOTS 2048 /* pages of swap on the last disk, with more than
+                         * one; must fit on it */
+#define ZSWAP_ENTRIES 16384 /* pages that can be kept compressed in memory */
+#define ZSWAP_MAX_PAGES 2048 /* memory those may take up, in pages */
+
+#define PAGE_ZEROED_POOL 64 /* zeroed pages idle cores keep ready */
+
+#define TLB_NPCIDS 16 /* address spaces each core keeps tagged in its TLB */
+#define TLB_FLUSH_ALL_PAGES 32 /* pages above which tlb_flush_range() flushes
+                                * the whole address space instead */
+
+#define SPINLOCK_STATS_MAX 32 /* spinlocks whose contention can be counted */
+#define KMUTEX_SPIN_CYCLES 20000 /* TSC cycles a kmutex locker spins while the
+                                  * holder runs on another core */
+#define LOCKPROF_NSITES 512   /* lock sites profiled with LOCKPROF=1 */
+#define LOCKPROF_NHELD 256    /* locks held at once that can be profiled */
+
+#define PROFILE_SAMPLES 512 /* profiler samples each core buffers */
+
+#define TRACE_RING_RECORDS 256 /* trace records each core buffers, a power
+                                * of 2 */
+
+#define FUTEX_BUCKETS 64 /* hash buckets for threads waiting on futexes */
+
+#define TTY_OUTPUT_RING 4096 /* bytes of output a tty queues for rendering, a
+                              * power of 2 */
+
+#define VT_HISTORY_CHUNKS 16 /* scrollback chunks a vterminal keeps at most,
+                              * with VGABUF */
+
+#define SYSCALL_HIST_BUCKETS 32 /* log2 latency buckets kept per syscall */
+
+#define IOSCHED_WEIGHT_DEFAULT 100 /* a memory group's share of each disk */
+#define IOSCHED_WEIGHT_MAX 1000
+#define IOSCHED_LATENCY_MS 50 /* time queued after which a best effort
+                               * request goes ahead of its group's turn */
+#define IOSCHED_IDLE_LATENCY_MS 2000 /* same, for an idle class request */
+
+#define IOSTAT_HIST_BUCKETS 32 /* log2 latency buckets kept per block device */
+
+#define INTR_STATS_VECTORS 32 /* interrupt vectors statistics are kept for */
+#define INTR_HIST_BUCKETS 32  /* log2 duration buckets kept per interrupt
+                               * vector, and for raised IPL */
+
+#define SCHED_HIST_BUCKETS 32 /* log2 run queue wait buckets kept per core */
+#define SCHED_RUNQ_HIST 16    /* run queue lengths told apart, per core */
+
+#define NUMA_MAX_NODES 8   /* NUMA nodes told apart; see main/numa.h */
+#define NUMA_MAX_RANGES 32 /* SRAT memory ranges kept */
+
+#define TIME_IDLE_MAX_MS 1000 /* longest an idle core goes without a tick */
+
+#define VDSO_TIME_REFRESH_MS 100 /* how often the vDSO page's time is reread */
+
+#define FAULT_AROUND_PAGES 16 /* window of resident file pages mapped per
+                               * read fault; a power of 2 */
+#define FAULT_READAHEAD_PAGES 32 /* pages read ahead of faults in areas
+                                  * advised MADV_SEQUENTIAL */
+
+#define BOOTRA_RECORD_MS 30000 /* how long after boot block reads are recorded,
+                                * to be read ahead on the next boot */
+#define BOOTRA_MAX_BLOCKS 2048 /* most blocks recorded and read ahead; a
+                                * power of 2 */
+
+#define STRIPE_FIRST_DISK 1 /* first disk of the stripe set stripe0 */
+#define STRIPE_NDISKS 0     /* disks striped into stripe0; fewer than 2 for
+                             * none. Keep clear of the swap disk, the last */
+#define STRIPE_CHUNK_BLOCKS 16 /* blocks dealt to one disk at a time */
+
+#define RAMDISK_BLOCKS 0 /* blocks of ram0 when not booted with an image for
+                          * it; 0 for none */
 
 /* Note: if rootfs is ramfs, this is completely ignored */
-#define VFS_ROOTFS_DEV "disk0" /* device containing root filesystem */
+#define VFS_ROOTFS_DEV "disk0" /* device containing root filesystem: diskN,
+                                * stripe0, or ram0 */
 
 /* root filesystem type - either "ramfs" or "s5fs" */
 #ifdef __S5FS__
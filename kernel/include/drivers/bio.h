@@ -0,0 +1,153 @@
+#pragma once
+
+#include "types.h"
+
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+#include "util/list.h"
+
+/*
+ * Asynchronous block I/O requests.
+ *
+ * A bio describes one transfer of bio_count consecutive blocks between a
+ * block device and memory: either a page-aligned, physically contiguous buffer
+ * (as any kernel allocation is), or a vector of physical segments, which lets
+ * one transfer scatter into or gather from separate pframes. See bio_prepare()
+ * and bio_prepare_vec(). It is handed to bio_submit(), which
+ * returns as soon as the request has been queued with the driver; the driver
+ * calls bio_complete() when the transfer finishes, typically from its
+ * interrupt handler. The submitter can either sleep in bio_wait() or supply a
+ * completion callback, which lets callers keep many requests in flight at
+ * once.
+ *
+ * Example usage:
+ *    bio_t *bio = bio_alloc();
+ *    bio_prepare(bio, bd, block, 1, buf, 0);
+ *    long ret = bio_submit(bio);
+ *    if (!ret)
+ *        ret = bio_wait(bio);
+ *    bio_free(bio);
+ */
+
+struct blockdev;
+struct bio;
+
+/*
+ * A physically contiguous piece of memory. bv_len is a multiple of BLOCK_SIZE.
+ */
+typedef struct bio_vec
+{
+    uintptr_t bv_phys;
+    size_t bv_len;
+} bio_vec_t;
+
+/*
+ * Completion callback. Called exactly once per submitted bio, possibly from
+ * interrupt context, so it must not sleep or take mutexes.
+ */
+typedef void (*bio_end_func_t)(struct bio *bio);
+
+typedef struct bio
+{
+    /* Fields that should be initialized by submitters (see bio_prepare()): */
+    struct blockdev *bio_bdev;
+    blocknum_t bio_block; /* first block to transfer */
+    size_t bio_count;     /* number of blocks */
+    char *bio_buf;        /* page-aligned buffer of bio_count blocks, or */
+    bio_vec_t *bio_vecs;  /* segments adding up to bio_count blocks */
+    size_t bio_nvecs;     /* (0 if bio_buf is used) */
+    long bio_write;       /* 1 to write to the device, 0 to read */
+    long bio_fua;         /* for writes, 1 if the blocks must be on stable
+                           * media, not just in the device's write cache, by
+                           * the time the bio completes; set after preparing
+                           * it. Devices without bd_fua ignore it, so their
+                           * submitters call blockdev_flush_cache() after */
+
+    bio_end_func_t bio_end; /* optional completion callback */
+    void *bio_private;      /* for use by the completion callback */
+    int bio_ioprio;         /* IOPRIO_VALUE() to queue it with; cleared by
+                             * preparing it, for the submitter's (see
+                             * drivers/iosched.h) */
+
+    /* Fields set by bio_submit(): */
+    uint64_t bio_start; /* cycle count at submission */
+    long bio_group;     /* submitter's memory group, whose disk share the
+                         * bio is served from */
+
+    /* Fields set on completion: */
+    long bio_done;  /* set once the request has finished */
+    long bio_error; /* 0 on success, -errno on failure */
+
+    spinlock_t bio_lock;  /* protects bio_done */
+    ktqueue_t bio_waitq;  /* threads in bio_wait() */
+
+    /* Link for whoever currently owns the request (e.g. a driver queue) */
+    list_link_t bio_link;
+} bio_t;
+
+/**
+ * Initializes the bio subsystem.
+ */
+void bio_init();
+
+/**
+ * Allocates a bio. It must be set up with bio_prepare() before use.
+ *
+ * @return The bio, or NULL if out of memory
+ */
+bio_t *bio_alloc();
+
+/**
+ * Frees a bio allocated with bio_alloc(). The bio must not be in flight.
+ */
+void bio_free(bio_t *bio);
+
+/**
+ * Sets up a bio (allocated or not) for a transfer, clearing any completion
+ * callback and completion state.
+ */
+void bio_prepare(bio_t *bio, struct blockdev *bd, blocknum_t block,
+                 size_t count, char *buf, long write);
+
+/**
+ * Sets up a bio for a transfer to or from a vector of segments. The vector is
+ * not copied, so it must remain valid until the bio has completed.
+ */
+void bio_prepare_vec(bio_t *bio, struct blockdev *bd, blocknum_t block,
+                     bio_vec_t *vecs, size_t nvecs, long write);
+
+/**
+ * Returns the number of physically contiguous segments a bio transfers.
+ */
+static inline size_t bio_nsegments(bio_t *bio)
+{
+    return bio->bio_nvecs ? bio->bio_nvecs : 1;
+}
+
+/**
+ * Queues a bio with its block device. Does not wait for the transfer, but may
+ * sleep waiting for the device to accept the request.
+ *
+ * @return 0 if the request was queued, in which case it will be completed
+ *  with bio_complete(), or -errno if it could not be, in which case it will
+ *  not be
+ */
+long bio_submit(bio_t *bio);
+
+/**
+ * Called by drivers when a request has finished. Runs the completion callback
+ * and wakes any waiters.
+ *
+ * @param error 0 on success, -errno on failure
+ */
+void bio_complete(bio_t *bio, long error);
+
+/**
+ * Sleeps until a submitted bio has completed. On a device with a poll
+ * operation, polls it for a short while first, which catches most completions
+ * of a fast device without an interrupt.
+ *
+ * @return The bio's error: 0 on success, -errno on failure
+ */
+long bio_wait(bio_t *bio);
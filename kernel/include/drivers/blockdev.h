@@ -7,7 +7,9 @@
 
 #include "types.h"
 
+#include "drivers/bio.h"
 #include "drivers/dev.h"
+#include "drivers/iosched.h"
 #include "util/list.h"
 
 #include "mm/mobj.h"
@@ -15,7 +17,31 @@
 
 #define BLOCK_SIZE PAGE_SIZE
 
+/* Longest run of blocks readahead and writeback transfer with one bio */
+#define BLOCKDEV_CLUSTER_BLOCKS 32
+
+/* Most dirty pframes blockdev_writeback() holds at once */
+#define BLOCKDEV_WRITEBACK_BATCH 128
+
+/* Shards of a device's buffer cache; see blockdev_mobj() */
+#define BLOCKDEV_NSHARDS 16
+
+/* Longest a thread in bio_wait() polls a device before sleeping, in cycles */
+#define BLOCKDEV_POLL_MAX_CYCLES 100000
+
 struct blockdev_ops;
+struct pframe;
+struct blockdev;
+
+/*
+ * One shard of a device's buffer cache: a memory object holding the pframes
+ * of some of its blocks, each at its block number.
+ */
+typedef struct blockdev_shard
+{
+    mobj_t bs_mobj;
+    struct blockdev *bs_bdev;
+} blockdev_shard_t;
 
 /*
  * Represents a Weenix block device.
@@ -27,13 +53,35 @@ typedef struct blockdev
 
     struct blockdev_ops *bd_ops;
 
+    /* Request queue, for drivers with a submit operation; drivers set its
+     * limits (iq_max_blocks, iq_max_segments), the rest is initialized by
+     * blockdev_register() */
+    iosched_queue_t bd_queue;
+
+    /* Set by drivers with a submit or submit_bio operation if they honour
+     * bio_fua; set by blockdev_register() for the rest, whose forced writes
+     * bio_submit() follows with a flush */
+    long bd_fua;
+
     /* Fields that should be ignored by drivers: */
-    mobj_t bd_mobj;
+    blockdev_shard_t bd_shards[BLOCKDEV_NSHARDS];
+
+    /* Average cycles from submission to completion of the bios waited on
+     * with bio_wait(), which sets how long it polls; kept without locking,
+     * since it is only a hint */
+    uint64_t bd_poll_avg;
 
     /* Link on the list of block-oriented devices */
     list_link_t bd_link;
 } blockdev_t;
 
+/* A run of blocks whose contents are no longer needed; see blockdev_discard() */
+typedef struct blockdev_range
+{
+    blocknum_t br_block;
+    size_t br_count;
+} blockdev_range_t;
+
 typedef struct blockdev_ops
 {
     /**
@@ -61,8 +109,90 @@ typedef struct blockdev_ops
      */
     long (*write_block)(blockdev_t *bdev, const char *buf, blocknum_t loc,
                         size_t block_count);
+
+    /**
+     * Starts a request from the I/O scheduler (see iosched_run()). This is
+     * called with the device queue locked, so it must neither sleep nor
+     * complete the request itself. The driver must call req->ir_end once the
+     * transfer has finished, and iosched_run() once it has room for more
+     * requests. Optional: if NULL, bios are carried out synchronously with
+     * read_block/write_block.
+     *
+     * @param bdev the block device
+     * @param req the request, of at most bd_queue.iq_max_blocks blocks in at
+     *      most bd_queue.iq_max_segments bios
+     * @return 0 if the request was started, or -EBUSY if the driver has no
+     *      room for it right now
+     */
+    long (*submit)(blockdev_t *bdev, io_request_t *req);
+
+    /**
+     * Carries out a bio with bios on other block devices, for devices made of
+     * others (e.g. a stripe set, see stripe.h), bypassing the I/O scheduler.
+     * Called by bio_submit(), and like it may sleep, but not wait for the
+     * transfer. The driver calls bio_complete() once the transfer has
+     * finished. Optional: takes precedence over submit and
+     * read_block/write_block, which are then unused.
+     *
+     * @param bdev the block device
+     * @param bio the bio
+     * @return 0 if the bio was queued, or -errno if it could not be, in which
+     *      case it is not completed
+     */
+    long (*submit_bio)(blockdev_t *bdev, bio_t *bio);
+
+    /**
+     * Tells the device that the contents of some blocks are no longer needed,
+     * so that it may reclaim them (e.g. an SSD's TRIM). This call will block.
+     * Optional: NULL if the device has no such command.
+     *
+     * @param bdev the block device
+     * @param ranges the runs of blocks, in any order
+     * @param nranges the number of runs
+     * @return 0 on success, -ENOTSUP if the device turns out not to support
+     *      discards after all, or -errno on failure
+     */
+    long (*discard)(blockdev_t *bdev, const blockdev_range_t *ranges,
+                    size_t nranges);
+
+    /**
+     * Writes the device's volatile write cache to stable media, so that every
+     * write completed so far is durable. This call will block. Optional: NULL
+     * if the device has no volatile cache.
+     *
+     * @param bdev the block device
+     * @return 0 on success, -errno on failure
+     */
+    long (*flush)(blockdev_t *bdev);
+
+    /**
+     * Completes the device's requests that have finished, as the driver's
+     * interrupt handler would, without waiting for the interrupt. Called at
+     * any time by threads waiting for a bio (see bio_wait()). Optional: NULL
+     * if the device is never polled.
+     *
+     * @param bdev the block device
+     * @return the number of requests completed
+     */
+    long (*poll)(blockdev_t *bdev);
 } blockdev_ops_t;
 
+/**
+ * Returns the shard of a device's buffer cache that holds a block's pframe.
+ * Blocks are spread over the shards a cluster (BLOCKDEV_CLUSTER_BLOCKS) at a
+ * time, so that getting blocks of unrelated files takes different locks while
+ * a run of neighbouring blocks mostly stays under one.
+ *
+ * @param bd the block device
+ * @param block the block number
+ * @return the shard's memory object
+ */
+static inline mobj_t *blockdev_mobj(blockdev_t *bd, blocknum_t block)
+{
+    return &bd->bd_shards[(block / BLOCKDEV_CLUSTER_BLOCKS) % BLOCKDEV_NSHARDS]
+                .bs_mobj;
+}
+
 /**
  * Initializes the block device subsystem.
  */
@@ -75,6 +205,131 @@ void blockdev_init(void);
  */
 long blockdev_register(blockdev_t *dev);
 
+/**
+ * Plugs a block device's queue: bios submitted while it is plugged are only
+ * queued (and merged), not dispatched, until the matching blockdev_unplug().
+ * Callers submitting a batch of bios use this so that the scheduler sees all
+ * of them at once. Plugs nest.
+ */
+void blockdev_plug(blockdev_t *bd);
+
+/**
+ * Undoes a blockdev_plug(), dispatching queued requests once the last plug is
+ * removed.
+ */
+void blockdev_unplug(blockdev_t *bd);
+
+/**
+ * Starts reading blocks into the device's page cache without waiting for them.
+ * Blocks that are already resident are skipped, and runs of consecutive ones
+ * are read with a single bio. Anyone getting one of the blocks' pframes before
+ * its read is done waits for it.
+ *
+ * @param bd the block device
+ * @param blocks the block numbers, in the order they should be read
+ * @param nblocks the number of blocks
+ */
+void blockdev_readahead(blockdev_t *bd, const blocknum_t *blocks,
+                        size_t nblocks);
+
+/**
+ * Like blockdev_readahead(), but reads a run of consecutive blocks into
+ * consecutive pages of another memory object (a file's own, whose pages are
+ * not kept in the device's page cache) rather than the device's.
+ *
+ * @param bd the block device
+ * @param block the first block
+ * @param o the memory object, which must be locked
+ * @param pagenum the page of o to read the first block into
+ * @param n the number of blocks
+ */
+void blockdev_readahead_pages(blockdev_t *bd, blocknum_t block, mobj_t *o,
+                              uint64_t pagenum, size_t n);
+
+/**
+ * Reads or writes a run of consecutive blocks from or to the pages of locked
+ * pframes of any memory object, with a single bio, and waits for it.
+ *
+ * @param bd the block device
+ * @param block the first block
+ * @param pfs the pframes, one per block
+ * @param n the number of blocks, at most BLOCKDEV_CLUSTER_BLOCKS
+ * @param write 1 to write the blocks, 0 to read them
+ * @return 0 on success, or -errno
+ */
+long blockdev_rw_pframes(blockdev_t *bd, blocknum_t block,
+                         struct pframe **pfs, size_t n, long write);
+
+/**
+ * Writes back the device's dirty pframes that were dirtied before a given
+ * time, a shard at a time and oldest first within each, in batches of BLOCKDEV_WRITEBACK_BATCH. Each batch is
+ * sorted by block number and every run of consecutive blocks is written with
+ * a single bio. Pframes that are locked by another thread, or pinned by a
+ * journal (pf_pinned), are skipped. Stops at the first batch with a failed
+ * write, leaving those pframes dirty.
+ *
+ * @param bd the block device
+ * @param dirtied_before a time in jiffies, or (uint64_t)-1 for all
+ * @param max the most pframes to write
+ * @return the number of pframes written and cleaned
+ */
+size_t blockdev_writeback(blockdev_t *bd, uint64_t dirtied_before, size_t max);
+
+/**
+ * Writes back those of the given blocks whose pframes are dirty, in runs of
+ * consecutive blocks like blockdev_writeback(), and waits for them. Pframes
+ * held by another thread are waited for rather than skipped; pinned ones are
+ * skipped.
+ *
+ * @param bd the block device
+ * @param blocks the block numbers, in any order and possibly repeated; they
+ * are sorted in place
+ * @param nblocks the number of blocks
+ * @return 0 on success, or the first error, leaving the pframe that failed to
+ * be written (and those not yet attempted) dirty
+ */
+long blockdev_sync_blocks(blockdev_t *bd, blocknum_t *blocks, size_t nblocks);
+
+/**
+ * Makes every write to a device that has completed so far durable, with the
+ * driver's flush operation, if it has one. Writes still in flight are not
+ * covered; wait for them first.
+ *
+ * @param bd the block device
+ * @return 0 on success, or -errno
+ */
+long blockdev_flush_cache(blockdev_t *bd);
+
+/**
+ * Discards runs of blocks with the driver's discard operation, if it has one.
+ * Blocks being discarded must not be in use, nor have writes in flight; the
+ * device may return anything for them afterwards. The device's page cache is
+ * not touched.
+ *
+ * @param bd the block device
+ * @param ranges the runs of blocks
+ * @param nranges the number of runs
+ * @return 0 on success, -ENOTSUP if the device can't discard, or -errno
+ */
+long blockdev_discard(blockdev_t *bd, const blockdev_range_t *ranges,
+                      size_t nranges);
+
+/**
+ * Writes back every dirty pframe of a device one at a time, e.g. those left
+ * behind by a failed blockdev_writeback(). Pinned pframes are skipped.
+ *
+ * @param bd the block device
+ * @return 0 on success, or the first error
+ */
+long blockdev_flush(blockdev_t *bd);
+
+/**
+ * Calls blockdev_writeback() with no limit on every block device.
+ *
+ * @return the total number of pframes written and cleaned
+ */
+size_t blockdev_writeback_all(uint64_t dirtied_before);
+
 /**
  * Finds a block device with a given device id.
  *
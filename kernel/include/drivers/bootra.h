@@ -0,0 +1,54 @@
+#pragma once
+
+#include "types.h"
+
+struct blockdev;
+
+/*
+ * Boot readahead.
+ *
+ * For the first BOOTRA_RECORD_MS of a boot, every block read from a block
+ * device is recorded: metadata got through the device's page cache, and file
+ * pages read (or read ahead) into files' own caches. Then the set is sorted
+ * and saved in BOOTRA_FILE, on the root file system. On the next boot, the
+ * thread started by bootra_start() reads it back and starts one readahead of
+ * all those blocks, which blockdev_readahead() merges into runs, so that they
+ * come in with a few long reads instead of many short ones as init, the shell
+ * and the rest fault in their files.
+ *
+ * The blocks are read into the devices' page caches, which is where metadata
+ * is looked up anyway; file pages are not kept there, so a read of a file
+ * page first asks bootra_take() whether its block is one read ahead at boot,
+ * and if so copies it from there. A write of the block in the meantime means
+ * the copy read ahead is out of date, so bios that write blocks call
+ * bootra_forget() for them. The copies are only offered for the recording
+ * period; the device's page cache drops what is left of them in due course.
+ */
+
+#define BOOTRA_FILE "/.bootra"
+
+/**
+ * Starts the boot readahead thread. Called by init once the VFS is up.
+ */
+void bootra_start();
+
+/**
+ * Records that block of bd was read, if the recording period is not over.
+ */
+void bootra_record(struct blockdev *bd, blocknum_t block);
+
+/**
+ * If block of bd was read ahead at boot, has been read in by now, and has
+ * not been written since, copies it to the page dst and returns 1; otherwise
+ * returns 0, and the block must be read from the device. It is only handed
+ * out once. The caller may hold locks on other memory objects, but not on
+ * bd's page cache.
+ */
+long bootra_take(struct blockdev *bd, blocknum_t block, void *dst);
+
+/**
+ * Notes that blocks [block, block + n) of bd are being written, so that
+ * copies read ahead at boot are not handed out anymore. May be called from
+ * interrupt context.
+ */
+void bootra_forget(struct blockdev *bd, blocknum_t block, size_t n);
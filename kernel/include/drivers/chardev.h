@@ -5,6 +5,7 @@
 
 struct vnode;
 struct pframe;
+struct poll_entry;
 
 struct chardev_ops;
 struct mobj;
@@ -27,6 +28,12 @@ typedef struct chardev_ops
     long (*fill_pframe)(struct vnode *file, struct pframe *pf);
 
     long (*flush_pframe)(struct vnode *file, struct pframe *pf);
+
+    /* As the vnode poll operation; NULL for devices that are always ready */
+    int (*poll)(chardev_t *dev, struct poll_entry *pe);
+
+    /* As the vnode ioctl operation; NULL for devices that take none */
+    long (*ioctl)(chardev_t *dev, unsigned long request, void *arg);
 } chardev_ops_t;
 
 /**
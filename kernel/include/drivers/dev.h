@@ -25,6 +25,9 @@
  *         - minor 1:          /dev/tty1       Second TTY device
  *         - and so on...
  *
+ *     - char major 3:         Framebuffer (fb)
+ *         - minor 0:          /dev/fb         The screen, if it has one
+ *
  *     - block major 1:        Disk devices
  *         - minor 0:          first disk device
  *         - minor 1:          second disk device
@@ -41,9 +44,14 @@
 #define NULL_DEVID (MKDEVID(0, 0))
 #define MEM_NULL_DEVID (MKDEVID(1, 0))
 #define MEM_ZERO_DEVID (MKDEVID(1, 1))
+#define MEM_TRACE_DEVID (MKDEVID(1, 2))
+#define FB_DEVID (MKDEVID(3, 0))
 
 #define DISK_MAJOR 1
+#define STRIPE_MAJOR 2
+#define RAMDISK_MAJOR 3
 
 #define MEM_MAJOR 1
 #define MEM_NULL_MINOR 0
 #define MEM_ZERO_MINOR 1
+#define MEM_TRACE_MINOR 2
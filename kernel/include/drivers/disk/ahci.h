@@ -15,11 +15,13 @@
 #define AHCI_PRDT_DBC_WIDTH 22
 #define AHCI_MAX_PRDT_SIZE (1 << AHCI_PRDT_DBC_WIDTH)
 #define ATA_SECTOR_SIZE 512
+#define ATA_MAX_LBA (1UL << 48) /* 48-bit LBA (READ/WRITE DMA EXT, FPDMA) */
 #define AHCI_SECTORS_PER_PRDT (AHCI_MAX_PRDT_SIZE / ATA_SECTOR_SIZE)
 #define AHCI_MAX_SECTORS_PER_COMMAND \
-    (1 << 16) /* FLAG: Where does this come from? */
-#define ACHI_NUM_PRDTS_PER_COMMAND_TABLE \
-    (AHCI_MAX_SECTORS_PER_COMMAND / AHCI_SECTORS_PER_PRDT)
+    (1 << 16) /* the 16-bit ATA sector count, where 0 means 65536 */
+/* Enough PRDs for a command to scatter into 64 separate pages; must be a
+ * multiple of 8 to keep each command_table_t 128-byte aligned. */
+#define ACHI_NUM_PRDTS_PER_COMMAND_TABLE 64
 
 #define AHCI_MAX_NUM_PORTS 32
 #define AHCI_COMMAND_HEADERS_PER_LIST 32
@@ -66,6 +68,36 @@ typedef enum fis_type
 #define ATA_READ_FPDMA_QUEUED_COMMAND 0x60
 #define ATA_WRITE_FPDMA_QUEUED_COMMAND 0x61
 
+/* A write that reaches stable media before it completes, bypassing the
+ * drive's volatile write cache (Forced Unit Access). NCQ writes get the same
+ * with ATA_DEVICE_FUA in their device register. */
+#define ATA_WRITE_DMA_FUA_EXT_COMMAND 0x3d
+#define ATA_DEVICE_FUA 0x80
+
+/* Writes the drive's volatile write cache to stable media; no data */
+#define ATA_FLUSH_CACHE_EXT_COMMAND 0xea
+
+/* Non-queued commands besides reads and writes (see ATA Command Set 4, 7.5 and
+ * 7.12). DATA SET MANAGEMENT with the TRIM bit in its features takes a list of
+ * LBA range entries, each a 48-bit LBA and a 16-bit sector count, 64 to a
+ * 512-byte block of data. */
+#define ATA_DATA_SET_MANAGEMENT_COMMAND 0x06
+#define ATA_IDENTIFY_DEVICE_COMMAND 0xec
+#define ATA_DSM_TRIM 0x1
+#define ATA_DSM_RANGES_PER_SECTOR (ATA_SECTOR_SIZE / sizeof(uint64_t))
+#define ATA_DSM_MAX_RANGE_SECTORS 0xffff
+
+/* Words of the IDENTIFY DEVICE data: the most 512-byte blocks of LBA range
+ * entries a DATA SET MANAGEMENT command takes (0 if unspecified), and whether
+ * TRIM is supported (bit 0) */
+#define ATA_IDENTIFY_DSM_MAX_BLOCKS 105
+#define ATA_IDENTIFY_DSM_SUPPORT 169
+
+/* Word of the IDENTIFY DEVICE data whose bit 6 tells whether WRITE DMA FUA
+ * EXT is supported */
+#define ATA_IDENTIFY_FUA_SUPPORT 84
+#define ATA_IDENTIFY_FUA 0x40
+
 /* 8-bit device setting for host-to-device FIS.
  * Bit 6 is specified as either obsolete or "shall be set to one" for all
  * commands used in Weenix. So, we can safely just default to this value for all
@@ -73,6 +105,10 @@ typedef enum fis_type
  * Set 4. */
 #define ATA_DEVICE_LBA_MODE 0x40
 
+/* Bit of the device's status (in hba_port_t->px_tfd) set if its last command
+ * failed. */
+#define ATA_STATUS_ERR 0x01
+
 /* h2d_register_fis - Register Host to Device FIS.
  * This is the only FIS used in Weenix.
  */
@@ -206,7 +242,10 @@ typedef union px_interrupt_status {
         uint8_t dhrs : 1; /* Interrupt requested by a device-to-host FIS.
                            * Used by normal read/write commands, see 5.6.2
                            * in 1.3.1. */
-        uint8_t : 2;
+        uint8_t pss : 1;  /* Interrupt requested by a PIO setup FIS, once its
+                           * data has been transferred. Used by PIO reads such
+                           * as IDENTIFY DEVICE, see 5.6.3 in 1.3.1. */
+        uint8_t : 1;
         uint8_t
             sdbs : 1; /* Interrupt requested by a set device bits FIS.
                        * Used by NCQ read/write commands, see 5.6.4 in 1.3.1. */
@@ -214,7 +253,11 @@ typedef union px_interrupt_status {
         uint8_t dps : 1; /* Interrupt set upon completing an FIS that requested
                           * an interrupt upon completion.
                           * Currently doesn't seem to be working... */
-        uint32_t : 26;
+        uint32_t : 24;
+        uint8_t tfes : 1; /* Task File Error Status: the device reported an
+                           * error, and the port has stopped processing its
+                           * command list. See 6.2.2 in 1.3.1. */
+        uint8_t : 1;
     } bits;
     uint32_t value;
 } packed px_interrupt_status_t;
@@ -292,13 +335,15 @@ typedef struct hba_port
                            list DMA is running. */
         uint16_t : 16;
     } packed px_cmd; /* Port Command and Status. */
-    uint64_t : 64;
+    uint32_t : 32;
+    uint32_t px_tfd; /* Task File Data: the device's last status in bits 7:0,
+                      * whose bit 0 (ERR) is set if its last command failed. */
     uint32_t px_sig; /* Signature: Contains attached device's signature.
                       * SATA devices should have signature SATA_SIG_ATA, defined
                       * above. */
     uint64_t : 64;
-    uint32_t px_serr; /* SATA Error: Unclear how Weenix is actually making use
-                         of this register. */
+    uint32_t px_serr; /* SATA Error: RWC. Cleared when a port is restarted
+                       * after a task file error. */
     uint32_t px_sact; /* SATA Active: Used for NCQ.
                        * Each bit corresponds to TAG and command slot of an NCQ
                        * command. Must be set by software before issuing a NCQ
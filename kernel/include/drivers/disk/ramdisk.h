@@ -0,0 +1,19 @@
+#pragma once
+
+#include <drivers/blockdev.h>
+
+/*
+ * A block device in memory, ram0, whose reads and writes are copies. Its
+ * contents are those of the first multiboot module the kernel was booted
+ * with (e.g. a file system image made by fsmaker, loaded with GRUB's module2
+ * command), whose pages page_init() leaves reserved for it; without one, it is
+ * RAMDISK_BLOCKS zeroed blocks. Either way its contents are lost at shutdown.
+ * Having no latency, it makes a fast root for throwaway systems, and shows
+ * the file system's own costs apart from the disk's.
+ */
+
+/**
+ * Registers the RAM disk, if there is a multiboot module or RAMDISK_BLOCKS is
+ * not 0.
+ */
+void ramdisk_init();
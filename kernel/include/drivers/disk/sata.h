@@ -11,4 +11,7 @@ typedef struct ata_disk
 {
     hba_port_t *port;
     blockdev_t bdev;
+    uint16_t trim_sectors; /* 512-byte blocks of TRIM ranges a DATA SET
+                            * MANAGEMENT command may carry, or 0 if the disk
+                            * can't TRIM */
 } ata_disk_t;
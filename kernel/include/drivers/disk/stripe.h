@@ -0,0 +1,19 @@
+#pragma once
+
+#include <drivers/blockdev.h>
+
+/*
+ * A stripe set (RAID-0): one block device, stripe0, made of STRIPE_NDISKS
+ * disks starting at disk STRIPE_FIRST_DISK. Its blocks are dealt out to the
+ * disks a chunk of STRIPE_CHUNK_BLOCKS at a time, so that a large transfer
+ * keeps all of them busy at once. Losing any disk loses the set.
+ */
+
+/* Most disks a stripe set may have */
+#define STRIPE_MAX_DISKS 8
+
+/**
+ * Registers the stripe set, if STRIPE_NDISKS is at least 2 and its disks have
+ * been registered (see sata_init()).
+ */
+void stripe_init();
@@ -0,0 +1,13 @@
+#pragma once
+
+/*
+ * The framebuffer device, /dev/fb: the screen's linear framebuffer, as a
+ * character device whose pages can be mapped straight into a process (see
+ * fbdev.c). Only a kernel drawing the console on the framebuffer (see
+ * screen.h) has one.
+ */
+
+/**
+ * Registers the framebuffer device, with the screen set up first.
+ */
+void fbdev_init();
@@ -0,0 +1,218 @@
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+#include "drivers/bio.h"
+
+#include "proc/spinlock.h"
+
+#include "util/list.h"
+
+/*
+ * I/O scheduling.
+ *
+ * Every block device with a submit operation has an iosched_queue_t. Bios
+ * submitted to the device are turned into io_request_t's: runs of consecutive
+ * blocks, in one direction, which the driver carries out as a single command.
+ * A bio that extends a queued request at either end is merged into it instead
+ * of becoming a request of its own, up to the limits the driver sets in
+ * iq_max_blocks and iq_max_segments.
+ *
+ * Requests stay queued while the device is plugged (see blockdev_plug()) or
+ * while the driver has no room for them, and a pluggable scheduling policy
+ * decides which queued request is dispatched next:
+ *  - "noop" dispatches requests in the order they were submitted
+ *  - "deadline" sweeps upward through block numbers (a one-way elevator),
+ *    unless the oldest request has waited for IOSCHED_DEADLINE_DISPATCHES
+ *    other dispatches, in which case it goes next
+ *  - "fair", the default, serves requests by I/O priority and shares the
+ *    disk out between memory groups:
+ *     - IOPRIO_CLASS_RT requests go first, by level
+ *     - then any request queued for longer than its group's latency target
+ *       (see memgroup_set_io()), or IOSCHED_IDLE_LATENCY_MS for the idle
+ *       class, oldest first
+ *     - then best effort ones, from the group that has had the least disk
+ *       time for its weight (blocks served divided by its I/O weight, as a
+ *       virtual time that a group just become busy catches up to), by level
+ *       within the group
+ *     - and only then IOPRIO_CLASS_IDLE ones
+ *    so that a group streaming through the disk in the background gets its
+ *    share, but no more, while others' requests wait little.
+ *
+ * Bios are tagged with their submitter's I/O priority (p_ioprio, set with
+ * ioprio_set()) and memory group, and merged only within a group; a request
+ * takes the highest priority of its bios.
+ */
+
+struct blockdev;
+struct io_request;
+struct iosched_queue;
+
+/*
+ * Called exactly once when a request has finished, possibly from interrupt
+ * context.
+ */
+typedef void (*io_request_end_func_t)(struct io_request *req, long error);
+
+typedef struct io_request
+{
+    struct blockdev *ir_bdev;
+    blocknum_t ir_block; /* first block */
+    size_t ir_count;     /* total number of blocks */
+    long ir_write;       /* 1 for writes, 0 for reads */
+    long ir_fua;         /* the bios' bio_fua, which all of them share */
+    int ir_ioprio;       /* the highest of its bios' bio_ioprio */
+    long ir_group;       /* the bios' bio_group, which all of them share */
+    list_t ir_bios;      /* bios, in block order, linked by bio_link */
+    size_t ir_nbios;
+    size_t ir_nsegments; /* total bio_nsegments() of the bios */
+
+    io_request_end_func_t ir_end;
+    void *ir_private;  /* for the driver */
+
+    size_t ir_deadline;    /* dispatch number by which this must be served */
+    uint64_t ir_queued;     /* cycle count when the request was made */
+    uint64_t ir_dispatched; /* cycle count when it was handed to the driver */
+    list_link_t ir_link;   /* link on the policy's sorted/FIFO list */
+    list_link_t ir_fifo_link; /* link on iq_fifo */
+} io_request_t;
+
+typedef struct iosched_ops
+{
+    const char *iso_name;
+
+    /* Queue a new request. */
+    void (*iso_add)(struct iosched_queue *q, io_request_t *req);
+
+    /* Return the request that should be dispatched next, without removing
+     * it, or NULL if there is none. */
+    io_request_t *(*iso_peek)(struct iosched_queue *q);
+
+    /* Remove a request (returned by iso_peek) that is being dispatched. */
+    void (*iso_remove)(struct iosched_queue *q, io_request_t *req);
+
+    /* Optional: note that a request removed with iso_remove was taken by the
+     * driver (rather than turned away, and put back where it was). */
+    void (*iso_dispatched)(struct iosched_queue *q, io_request_t *req);
+} iosched_ops_t;
+
+/*
+ * A device's I/O statistics, kept by its queue. Times are in TSC cycles: a
+ * request's queue time runs from its first bio's submission until it is
+ * handed to the driver, and its service time from then until it completes.
+ * Both are also counted in histograms by their log2.
+ */
+typedef struct iosched_stats
+{
+    size_t is_nbios;        /* bios submitted */
+    size_t is_back_merges;  /* bios appended to a queued request */
+    size_t is_front_merges; /* bios prepended to a queued request */
+    size_t is_nexpired;     /* requests dispatched out of order by deadline */
+
+    size_t is_reads;          /* read requests completed */
+    size_t is_writes;         /* write requests completed */
+    size_t is_blocks_read;
+    size_t is_blocks_written;
+    size_t is_errors;         /* requests completed with an error */
+    size_t is_inflight;       /* requests handed to the driver, not done */
+    size_t is_max_inflight;
+
+    uint64_t is_queue_cycles;
+    uint64_t is_service_cycles;
+    /* requests that took [2^i, 2^(i + 1)) cycles; the last bucket also
+     * counts any that took longer */
+    uint64_t is_queue_hist[IOSTAT_HIST_BUCKETS];
+    uint64_t is_service_hist[IOSTAT_HIST_BUCKETS];
+} iosched_stats_t;
+
+typedef struct iosched_queue
+{
+    /* Fields that should be initialized by drivers; bios exceeding
+     * either limit are rejected: */
+    size_t iq_max_blocks;   /* largest request the driver accepts */
+    size_t iq_max_segments; /* most segments (see bio_nsegments()) per
+                             * request the driver accepts */
+
+    /* Fields that should be ignored by drivers: */
+    iosched_ops_t *iq_ops;
+    list_t iq_requests;      /* queued requests, ordered by iq_ops */
+    list_t iq_fifo;          /* queued requests, oldest first */
+    blocknum_t iq_position;  /* block after the last dispatched request */
+    size_t iq_nqueued;
+    size_t iq_plugged;       /* plug count; nothing is dispatched if > 0 */
+    spinlock_t iq_lock;
+
+    size_t iq_ndispatched;   /* requests handed to the driver */
+
+    /* fair: each memory group's virtual time and queued requests, and the
+     * virtual time of the group last served */
+    uint64_t iq_vtime[MEMGROUP_MAX];
+    size_t iq_group_nqueued[MEMGROUP_MAX];
+    uint64_t iq_vtime_now;
+
+    iosched_stats_t iq_stats;
+} iosched_queue_t;
+
+#define IOSCHED_DEFAULT "fair"
+#define IOSCHED_DEADLINE_DISPATCHES 16
+
+/**
+ * Initializes the I/O scheduling subsystem.
+ */
+void iosched_init();
+
+/**
+ * Initializes a device queue with the default policy (IOSCHED_DEFAULT).
+ */
+void iosched_queue_init(iosched_queue_t *q);
+
+/**
+ * Switches a device's scheduling policy.
+ *
+ * @return 0 on success, -EINVAL if there is no policy by that name, or -EBUSY
+ *  if requests are queued
+ */
+long iosched_set_policy(struct blockdev *bd, const char *name);
+
+/**
+ * Queues a bio on its device's queue, merging it into a queued request if
+ * possible, and dispatches whatever the driver has room for.
+ *
+ * @return 0 on success, -EINVAL if the bio is larger than the device accepts,
+ *  or -ENOMEM
+ */
+long iosched_submit(bio_t *bio);
+
+/**
+ * Dispatches queued requests until the queue is empty, plugged, or the
+ * driver's submit operation returns -EBUSY. Drivers must call this whenever
+ * they have room for more requests again (e.g. after completing one); may be
+ * called from interrupt context.
+ */
+void iosched_run(struct blockdev *bd);
+
+/**
+ * Copies a device's I/O statistics into stats. The device must have a queue,
+ * i.e. a submit operation.
+ */
+void iosched_stats_get(struct blockdev *bd, iosched_stats_t *stats);
+
+/**
+ * Zeroes a device's I/O statistics, but for the requests in flight.
+ */
+void iosched_stats_reset(struct blockdev *bd);
+
+/**
+ * Sets up a request carrying a single bio, for drivers issuing commands of
+ * their own outside of the scheduler. bio may be NULL for a command that
+ * transfers no data (e.g. a cache flush), in which case the request has no
+ * bios and is a read of no blocks of no device.
+ */
+void io_request_init_single(io_request_t *req, bio_t *bio,
+                            io_request_end_func_t end);
+
+/**
+ * Completes every bio of a request.
+ */
+void io_request_complete_bios(io_request_t *req, long error);
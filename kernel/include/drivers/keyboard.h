@@ -35,7 +35,15 @@
 #define F11 ((uint8_t)(F1 + 10))
 #define F12 ((uint8_t)(F1 + 11))
 
-typedef void (*keyboard_char_handler_t)(uint8_t);
+/*
+ * The keyboard interrupt handler only queues scancodes on a ring of
+ * KEYBOARD_RING_SIZE, and deferred work (see proc/workq.h) to decode them.
+ * The work passes the characters to the handler, as many as have arrived
+ * since it last ran at once, so that a burst of input (e.g. a paste) costs one
+ * trip through the tty rather than one per key.
+ */
+
+typedef void (*keyboard_char_handler_t)(const uint8_t *chars, size_t n);
 
 /**
  * Initializes the keyboard subsystem.
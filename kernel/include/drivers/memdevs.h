@@ -4,3 +4,11 @@
  * Initializes the memdevs subsystem.
  */
 void memdevs_init(void);
+
+struct chardev;
+
+/**
+ * Returns whether dev is one of the memory devices that throw away whatever
+ * is written to them (null, zero and trace), without looking at it.
+ */
+long memdevs_discards_writes(struct chardev *dev);
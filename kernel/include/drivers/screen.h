@@ -24,6 +24,11 @@ size_t screen_get_width();
 
 size_t screen_get_height();
 
+/* Returns the kernel address of the linear framebuffer, 32-bit pixels a row
+ * of screen_get_width() at a time, and sets *sizep to its size in bytes,
+ * rounded up to whole pages */
+void *screen_get_framebuffer(size_t *sizep);
+
 size_t screen_get_character_width();
 
 size_t screen_get_character_height();
@@ -57,8 +62,21 @@ void screen_print_shutdown();
 
 void vga_init();
 
+/*
+ * The functions below draw into a shadow of the screen; nothing reaches
+ * video memory, nor the cursor, until vga_flush() is called.
+ */
+
 void vga_write_char_at(size_t row, size_t col, uint16_t v);
 
+/* Moves the screen's contents up by lines rows, blanking the rows at the
+ * bottom */
+void vga_scroll(size_t lines);
+
+/* Copies what has changed in the shadow to video memory, and moves the
+ * cursor */
+void vga_flush();
+
 void vga_set_cursor(size_t row, size_t col);
 
 void vga_clear_screen();
@@ -1,9 +1,14 @@
 #pragma once
 
 #include "types.h"
+#include <fs/poll.h>
 #include <proc/kmutex.h>
 
-#define LDISC_BUFFER_SIZE 128
+/* Size of a tty's line discipline buffer; must be a power of 2 */
+#define LDISC_BUFFER_SIZE 4096
+
+/* Longest line that can be edited in canonical mode, including its '\n' */
+#define LDISC_LINE_MAX 128
 
 /**
  * The line discipline is implemented as a circular buffer containing two 
@@ -31,38 +36,49 @@
  *                     (cooked) ^^^^^^^
  *             ^^^^                    ^^^^^^^ (raw)
  * 
- * When incrementing the indices, make sure that you take the circularity of
- * the buffer into account! (Hint: using LDISC_BUFFER_SIZE macro will be helpful.) 
- * 
- * The field ldisc_full is used to indicate when the circular buffer has been
- * completely filled. This is necessary because there are two possible states
- * in which cooked == tail == head: 
- * 
- *      1) The buffer is empty, or 
- * 
- *      2) The buffer is full: head has wrapped around and is equal to tail. 
- * 
- * ldisc_full is used to differentiate between these two states.
+ * The buffer is ldisc_size bytes, a power of 2, so the indices wrap with a
+ * mask, and one byte is always left unused, so that head == tail only when
+ * the buffer is empty. Since each section is in at most two pieces, one
+ * before the end of the buffer and one from its start, moving a section in or
+ * out takes at most two memcpy()s.
+ *
+ * In canonical mode (ICANON, the default), input is edited a line at a time,
+ * and only whole lines are cooked. Otherwise, every character is cooked as it
+ * comes in, and a read returns once VMIN characters are there, or VTIME
+ * tenths of a second have passed without a new one (see termios(3)).
  */
 typedef struct ldisc
 {
     size_t ldisc_cooked; // Cooked is the index after the most last or most recent '\n' in the buffer.
     size_t ldisc_tail;   // Tail is the index from which characters are read by processes
     size_t ldisc_head;   // Head is the index from which new characters are placed
-    char ldisc_full;     // Full identifies if the buffer is full
-                         // 1 -> full
-                         // 0 -> not full  
+    size_t ldisc_size;   // Size of ldisc_buffer, a power of 2
+
+    unsigned int ldisc_lflag; // ICANON and ECHO
+    unsigned char ldisc_vmin;  // In raw mode, characters a read waits for
+    unsigned char ldisc_vtime; // In raw mode, tenths of a second a read waits
 
     ktqueue_t ldisc_read_queue; // Queue for threads waiting for data to be read 
-    char ldisc_buffer[LDISC_BUFFER_SIZE];
+    pollhead_t ldisc_pollhead;  // For poll() and epoll, notified along with the queue
+    char *ldisc_buffer;
 } ldisc_t;
 
-void ldisc_init(ldisc_t *ldisc);
+struct termios;
+
+void ldisc_init(ldisc_t *ldisc, size_t size);
 
-long ldisc_wait_read(ldisc_t *ldisc, spinlock_t *lock);
+long ldisc_wait_read(ldisc_t *ldisc, spinlock_t *lock, size_t count);
 
 size_t ldisc_read(ldisc_t *ldisc, char *buf, size_t count);
 
 void ldisc_key_pressed(ldisc_t *ldisc, char c);
 
-size_t ldisc_get_current_line_raw(ldisc_t *ldisc, char *s);
\ No newline at end of file
+void ldisc_keys_pressed(ldisc_t *ldisc, const char *s, size_t n);
+
+size_t ldisc_get_current_line_raw(ldisc_t *ldisc, char *s);
+
+int ldisc_poll(ldisc_t *ldisc, poll_entry_t *pe);
+
+void ldisc_get_termios(ldisc_t *ldisc, struct termios *t);
+
+void ldisc_set_termios(ldisc_t *ldisc, const struct termios *t);
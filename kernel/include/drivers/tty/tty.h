@@ -1,5 +1,6 @@
 #pragma once
 
+#include "config.h"
 #include "drivers/chardev.h"
 #include "ldisc.h"
 #include "vterminal.h"
@@ -8,6 +9,12 @@
 #define cd_to_tty(cd) \
     CONTAINER_OF((cd), tty_t, tty_cdev) 
 
+/*
+ * Output written to a tty is copied into its output ring and rendered on its
+ * vterminal later, in batches, by the tty thread (see tty_start()), so a
+ * writer only waits for rendering when the ring is full. Before the thread
+ * is started, writes are rendered right away.
+ */
 typedef struct tty
 {
     vterminal_t tty_vterminal; // the virtual terminal, where the characters will be displayed
@@ -16,7 +23,19 @@ typedef struct tty
     kmutex_t tty_read_mutex;
     kmutex_t tty_write_mutex;
     spinlock_t tty_lock;
+
+    spinlock_t tty_out_lock;  /* protects the output ring's indices */
+    size_t tty_out_head;      /* bytes ever queued; free-running */
+    size_t tty_out_tail;      /* bytes ever rendered; free-running */
+    ktqueue_t tty_out_waitq;  /* writers, while the ring is full; pollers
+                                 wait on tty_ldisc's pollhead */
+    char tty_out[TTY_OUTPUT_RING];
 } tty_t;
 
 void tty_init(void);
 
+/**
+ * Starts the thread that renders the ttys' queued output. Called by init.
+ */
+void tty_start(void);
+
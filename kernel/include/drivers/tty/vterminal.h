@@ -57,6 +57,8 @@ typedef struct vterminal
 
     size_t vt_len;
     list_t vt_history_chunks;
+    list_t vt_free_chunks; /* chunks cut off the history, to be reused */
+    size_t vt_nchunks;     /* chunks allocated, in either list */
 
     size_t *vt_line_positions;
 
@@ -204,6 +206,9 @@ typedef struct
 typedef void (*vtc_paint_handler_t)(struct vtconsole *vtc, vtcell_t *cell,
                                     int x, int y);
 typedef void (*vtc_cursor_handler_t)(struct vtconsole *vtc, vtcursor_t *cur);
+/* Called once the cells have moved up by lines rows and the last lines rows
+ * have been blanked, in place of painting every cell */
+typedef void (*vtc_scroll_handler_t)(struct vtconsole *vtc, int lines);
 
 typedef struct vtconsole
 {
@@ -220,13 +225,15 @@ typedef struct vtconsole
 
     vtc_paint_handler_t on_paint;
     vtc_cursor_handler_t on_move;
+    vtc_scroll_handler_t on_scroll;
 } vtconsole_t;
 
 typedef vtconsole_t vterminal_t;
 
 vtconsole_t *vtconsole(vtconsole_t *vtc, int width, int height,
                        vtc_paint_handler_t on_paint,
-                       vtc_cursor_handler_t on_move);
+                       vtc_cursor_handler_t on_move,
+                       vtc_scroll_handler_t on_scroll);
 void vtconsole_delete(vtconsole_t *c);
 
 void vtconsole_clear(vtconsole_t *vtc, int fromx, int fromy, int tox, int toy);
@@ -247,3 +254,5 @@ void vterminal_scroll_to_bottom(vterminal_t *vt);
 void vterminal_init(vterminal_t *vt);
 
 void vterminal_make_active(vterminal_t *vt);
+
+void vterminal_shutdown(void);
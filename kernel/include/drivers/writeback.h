@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Background writeback.
+ *
+ * Pframes that become dirty are queued on their mobj's mo_dirty list (see
+ * mm/mobj.c). A kernel thread wakes up every WRITEBACK_INTERVAL_MS and, with
+ * blockdev_writeback_all(), writes back the pages that have been dirty for
+ * longer than WRITEBACK_EXPIRE_MS, in runs of consecutive blocks. It is woken
+ * early, and then writes back every dirty page regardless of age, when dirty
+ * pages make up more than WRITEBACK_DIRTY_RATIO percent of the memory they
+ * could be using (the dirty pages plus the free ones), or when fewer than
+ * WRITEBACK_LOW_FREE_PAGES pages are free. Writers thus rarely find much left
+ * for a sync to write.
+ */
+
+/**
+ * Starts the writeback thread. Called by init once the VFS is up.
+ */
+void writeback_start();
+
+/**
+ * Writes back all dirty pages and stops the writeback thread. Called before
+ * the VFS is shut down.
+ */
+void writeback_stop();
+
+/**
+ * Called when the number of dirty pframes has grown to ndirty; wakes the
+ * writeback thread if that is over the limits above.
+ */
+void writeback_dirtied(size_t ndirty);
+
+/**
+ * Wakes the writeback thread to write back every dirty page. May be called
+ * from interrupt context.
+ */
+void writeback_kick();
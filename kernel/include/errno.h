@@ -4,9 +4,10 @@
 
 #ifndef __KERNEL__
 #ifndef errno
-#define errno _libc_errno
+#define errno (*__errno_location())
 #endif
-extern int _libc_errno;
+/* Each thread's own errno, kept in its struct pthread */
+extern int *__errno_location(void);
 #endif
 
 #define EPERM 1    /* Operation not permitted */
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "types.h"
+
+struct fs;
+struct vnode;
+
+/*
+ * Directory-entry cache.
+ *
+ * Remembers the result of looking up a name in a directory, keyed by
+ * (filesystem, parent inode number, name), so that repeated path resolution
+ * does not have to go through the filesystem's lookup operation (which, for
+ * s5fs, scans every block of the directory). Failed lookups are cached too, as
+ * negative entries.
+ *
+ * Entries store inode numbers rather than vnode pointers so that the cache
+ * never holds vnode references; a positive hit is turned back into a vnode with
+ * vget(). The cache is bounded at DCACHE_MAX_ENTRIES entries and evicts the
+ * least recently used entry when full. "." and ".." are never cached.
+ *
+ * Anything that adds, removes or renames a directory entry must invalidate it
+ * here while holding the directory's vnode lock (see vfs_syscall.c and
+ * namev_open()).
+ *
+ * The cache can also be read without the directory's lock, or its own, by
+ * dcache_lookup_rcu(), for walking paths (see namev_dir()). Such a walk
+ * brackets its lookups with dcache_read_begin() and dcache_read_retry(): an
+ * entry forgotten or changed in between means what was found may no longer
+ * hold, and the walk must be done again the slow way.
+ */
+
+typedef enum
+{
+    DCACHE_MISS,     /* nothing is known about the name */
+    DCACHE_POSITIVE, /* the name exists; its inode number is returned */
+    DCACHE_NEGATIVE, /* the name is known not to exist */
+} dcache_result_t;
+
+/**
+ * Initializes the directory-entry cache.
+ */
+void dcache_init();
+
+/**
+ * Looks up name in dir.
+ *
+ * @param dir The directory to search; must be locked
+ * @param ino Set to the child's inode number on a DCACHE_POSITIVE result
+ * @return Whether the name is known to exist, known not to exist, or unknown
+ */
+dcache_result_t dcache_lookup(struct vnode *dir, const char *name,
+                              size_t namelen, ino_t *ino);
+
+/**
+ * Looks up name in dir like dcache_lookup(), but without any lock, from
+ * within rcu_read_lock() and dcache_read_begin(). dir need not be locked, but
+ * must stay valid until rcu_read_unlock().
+ */
+dcache_result_t dcache_lookup_rcu(struct vnode *dir, const char *name,
+                                  size_t namelen, ino_t *ino);
+
+/**
+ * Returns a token for dcache_read_retry(), which returns whether any entry
+ * may have been forgotten or changed since.
+ */
+uint64_t dcache_read_begin();
+long dcache_read_retry(uint64_t seq);
+
+/**
+ * Records that name in dir refers to inode ino.
+ */
+void dcache_enter(struct vnode *dir, const char *name, size_t namelen,
+                  ino_t ino);
+
+/**
+ * Records that name does not exist in dir.
+ */
+void dcache_enter_negative(struct vnode *dir, const char *name,
+                           size_t namelen);
+
+/**
+ * Forgets anything known about name in dir.
+ */
+void dcache_invalidate(struct vnode *dir, const char *name, size_t namelen);
+
+/**
+ * Forgets every entry whose parent is dir. Must be called before the inode
+ * of a removed directory can be reused.
+ */
+void dcache_purge_dir(struct vnode *dir);
+
+/**
+ * Forgets every entry of fs, when it is unmounted.
+ */
+void dcache_purge_fs(struct fs *fs);
@@ -16,3 +16,17 @@
 #define O_CREAT 0x100  /* Create file if non-existent. */
 #define O_TRUNC 0x200  /* Truncate to zero length. */
 #define O_APPEND 0x400 /* Append to file. */
+#define O_NONBLOCK 0x800 /* Fail with EAGAIN rather than wait. */
+#define O_DIRECT 0x1000  /* Bypass the page cache where possible. */
+#define O_EXCL 0x2000    /* With O_CREAT, fail if the file exists. */
+
+/* The dirfd of openat() and the other *at() calls for paths relative to the
+ * current working directory, and their flags. */
+#define AT_FDCWD (-100)
+#define AT_REMOVEDIR 0x200 /* unlinkat(): remove a directory, as rmdir(). */
+
+/* Commands for fcntl(). */
+#define F_GETFL 3 /* Get the access mode and status flags. */
+#define F_SETFL 4 /* Set O_APPEND, O_NONBLOCK and O_DIRECT. */
+#define F_GETPIPE_SZ 5 /* Get the capacity of a pipe, in bytes. */
+#define F_SETPIPE_SZ 6 /* Set the capacity of a pipe. */
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "types.h"
+
+struct file;
+struct proc;
+
+/*
+ * Per-process file descriptor table.
+ *
+ * The table starts with room for FDTABLE_INIT_FILES descriptors and doubles
+ * when a descriptor beyond its end is needed, up to NFILES. Next to the files
+ * it keeps a bit per descriptor that is set while it is open, and a bit per
+ * 64 of those that is set while they are all open, so the lowest free
+ * descriptor is found with two bit scans instead of a walk of the table.
+ *
+ * A process created by proc_create() shares its parent's table rather than
+ * copying it; whichever process first changes the table (see
+ * fdtable_reserve()) gets a copy of its own at that point.
+ *
+ * A process's table (p_files) is read and changed under proc_files_lock().
+ */
+typedef struct fdtable
+{
+    long ft_refcount;        /* processes sharing the table */
+    int ft_size;             /* descriptors there is room for */
+    struct file **ft_files;  /* ft_size entries, NULL where closed */
+    uint64_t *ft_open;       /* bit per descriptor, set while it is open */
+    uint64_t ft_full;        /* bit per word of ft_open, set while all ones */
+} fdtable_t;
+
+/**
+ * Returns the file open as fd in table ft, without taking a reference.
+ *
+ * @param ft the table, or NULL for a process that has none yet
+ * @param fd the descriptor, which may be out of range
+ * @return the file, or NULL if fd is not open
+ */
+struct file *fdtable_get(fdtable_t *ft, int fd);
+
+/**
+ * Takes a reference on a table for a process that is to share it.
+ *
+ * @param ft the table, or NULL
+ * @return ft
+ */
+fdtable_t *fdtable_ref(fdtable_t *ft);
+
+/**
+ * Drops a reference on a table, and sets *ftp to NULL. The last reference
+ * closes every file left open in the table.
+ *
+ * @param ftp the table to put, not NULL
+ */
+void fdtable_put(fdtable_t **ftp);
+
+/**
+ * Prepares proc's table for changing descriptor fd: creates the table if
+ * the process has none, copies it if it is shared, and grows it until fd
+ * fits.
+ *
+ * @return 0 on success, -EBADF if fd is negative or not below NFILES, or
+ * -ENOMEM
+ */
+long fdtable_reserve(struct proc *proc, int fd);
+
+/**
+ * Finds the lowest free descriptor of proc and reserves it as with
+ * fdtable_reserve(). The descriptor stays free until it is installed.
+ *
+ * @param fd set to the descriptor
+ * @return 0 on success, -EMFILE if all NFILES descriptors are open, or
+ * -ENOMEM
+ */
+long fdtable_alloc_fd(struct proc *proc, int *fd);
+
+/**
+ * Stores file as descriptor fd of proc, whose table must have been
+ * prepared by fdtable_reserve() or fdtable_alloc_fd() under the same hold
+ * of proc_files_lock(). The table takes over the caller's reference on
+ * file.
+ *
+ * @param file the file to install, or NULL to close fd
+ * @return the file that was open as fd before, whose reference passes to
+ * the caller, or NULL
+ */
+struct file *fdtable_install(struct proc *proc, int fd, struct file *file);
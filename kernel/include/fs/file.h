@@ -1,11 +1,15 @@
 #pragma once
 
 #include "types.h"
+#include "util/list.h"
 
 #define FMODE_READ 1
 #define FMODE_WRITE 2
 #define FMODE_APPEND 4
-#define FMODE_MAX_VALUE (FMODE_READ | FMODE_WRITE | FMODE_APPEND)
+#define FMODE_NONBLOCK 8
+#define FMODE_DIRECT 16
+#define FMODE_MAX_VALUE \
+    (FMODE_READ | FMODE_WRITE | FMODE_APPEND | FMODE_NONBLOCK | FMODE_DIRECT)
 
 struct vnode;
 
@@ -20,9 +24,11 @@ typedef struct file
 
     /*
      * The mode in which this file was opened. This is a mask of the flags
-     * FMODE_READ, FMODE_WRITE, and FMODE_APPEND. It is set when the file
-     * is first opened, and use to restrict the operations that can be
-     * performed on the underlying vnode.
+     * FMODE_READ, FMODE_WRITE, FMODE_APPEND, FMODE_NONBLOCK and
+     * FMODE_DIRECT. It is set when the file is first opened, and use to
+     * restrict the operations that can be performed on the underlying vnode;
+     * fcntl(2) can change FMODE_APPEND, FMODE_NONBLOCK and FMODE_DIRECT
+     * afterwards.
      */
     unsigned int f_mode;
 
@@ -35,6 +41,12 @@ typedef struct file
      * The vnode which corresponds to this file.
      */
     struct vnode *f_vnode;
+
+    /*
+     * The registrations of this file with epoll instances (see fs/poll.h),
+     * which go away with the last reference to the file.
+     */
+    list_t f_epitems;
 } file_t;
 
 struct file *fcreate(int fd, struct vnode *vnode, unsigned int mode);
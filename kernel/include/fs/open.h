@@ -2,4 +2,6 @@
 
 long do_open(const char *filename, int flags);
 
+long do_openat(int dirfd, const char *filename, int flags);
+
 long get_empty_fd(int *fd);
@@ -7,4 +7,48 @@
 
 #pragma once
 
+#include "types.h"
+
+struct file;
+
 int do_pipe(int pipefd[2]);
+
+/*
+ * Move up to len bytes from fd_in to fd_out, at least one of which must be a
+ * pipe, without copying them through a buffer of the caller's: between two
+ * pipes, the pages holding the data are moved over; between a pipe and a
+ * file, the file is read into or written from the pipe's pages. Files are
+ * read and written at their file position.
+ *
+ * Blocks until fd_in has data (if it is a pipe) and a pipe fd_out has room,
+ * then moves what it can.
+ *
+ * Return the number of bytes moved, 0 at the end of fd_in, or:
+ *  - EBADF: either fd is invalid, or fd_in is not open for reading or fd_out
+ *    for writing
+ *  - EISDIR: either fd refers to a directory
+ *  - EINVAL: neither fd is a pipe, or both are the same pipe
+ *  - EPIPE: fd_out is a pipe with no readers
+ *  - EINTR, ENOMEM, or errors of the file's read or write
+ */
+ssize_t do_splice(int fd_in, int fd_out, size_t len);
+
+/*
+ * Like do_splice() between two pipes, but leaves the data in fd_in as well:
+ * the pipes then share the pages holding it.
+ *
+ * Return as for do_splice(), or EINVAL if either fd is not a pipe.
+ */
+ssize_t do_tee(int fd_in, int fd_out, size_t len);
+
+/*
+ * fcntl() on a pipe: F_GETPIPE_SZ returns how many bytes the pipe holds when
+ * full, and F_SETPIPE_SZ makes that arg, rounded up to whole pages and kept
+ * between one page and PIPE_MAX_PAGES.
+ *
+ * Return the capacity in bytes, or:
+ *  - EBADF: file is not a pipe
+ *  - EINVAL: arg is negative
+ *  - EBUSY: the pipe holds more than the new capacity
+ */
+long pipe_fcntl(struct file *file, int cmd, int arg);
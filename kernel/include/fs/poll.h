@@ -0,0 +1,143 @@
+#pragma once
+
+#include "types.h"
+
+#include "proc/spinlock.h"
+#include "util/list.h"
+
+struct pollfd;
+struct epoll_event;
+struct file;
+struct ktqueue;
+
+/*
+ * Readiness notification.
+ *
+ * An object whose readiness can change (a pipe, a tty) has a pollhead, and
+ * its vnode's poll operation reports what the object is ready for right now
+ * and, if asked to, adds a poll_entry to the pollhead. Whenever the object
+ * may have become ready for more, it calls poll_notify(), which runs the
+ * callback of every entry on the pollhead.
+ *
+ * poll() puts an entry on the pollhead of each fd it waits for, whose
+ * callback wakes it up. epoll keeps an entry on the pollhead of every fd
+ * registered with it, whose callback queues the fd as ready, so that waiting
+ * only costs as much as the number of fds that are ready.
+ *
+ * pollheads may be notified from interrupt context; their lock is taken at
+ * IPL_HIGH.
+ */
+
+typedef struct pollhead
+{
+    list_t ph_entries; /* poll_entry_t's waiting on the object */
+    spinlock_t ph_lock;
+} pollhead_t;
+
+typedef struct poll_entry
+{
+    pollhead_t *pe_head; /* what the entry is on, or NULL */
+    list_link_t pe_link; /* on pe_head->ph_entries */
+    /*
+     * Called with pe_head's lock held, so it must not block; events are
+     * those the object may now be ready for.
+     */
+    void (*pe_notify)(struct poll_entry *pe, int events);
+} poll_entry_t;
+
+void pollhead_init(pollhead_t *ph);
+
+/**
+ * Adds pe to ph, for the poll operation of the object owning ph to call. pe
+ * must not be on a pollhead yet.
+ */
+void poll_wait(pollhead_t *ph, poll_entry_t *pe);
+
+/**
+ * Takes pe off its pollhead, if it is on one. Once this returns, pe's
+ * callback is not running and will not be called.
+ */
+void poll_cancel(poll_entry_t *pe);
+
+/**
+ * Runs the callbacks of the entries on ph.
+ *
+ * @param events the events the object may now be ready for
+ */
+void poll_notify(pollhead_t *ph, int events);
+
+/**
+ * Returns the jiffy at which a wait of timeout milliseconds (negative for no
+ * limit) ends, or 0 if it never does.
+ */
+uint64_t poll_deadline(int timeout);
+
+/**
+ * Sleeps on queue until woken up, cancelled, or the deadline given by
+ * poll_deadline() has passed. lock protects queue, and is held at IPL_HIGH
+ * on entry and again on return.
+ *
+ * @return 0, or -EINTR if the thread was cancelled
+ */
+long poll_sleep(struct ktqueue *queue, spinlock_t *lock, uint64_t deadline);
+
+/**
+ * As poll_sleep(), but as an exclusive waiter (see
+ * sched_sleep_on_exclusive()).
+ */
+long poll_sleep_exclusive(struct ktqueue *queue, spinlock_t *lock,
+                          uint64_t deadline);
+
+/**
+ * Returns what file is ready for, out of POLLIN | POLLOUT | POLLERR |
+ * POLLHUP, and adds pe to the pollhead of the file's object if pe is not
+ * NULL. Files with no poll operation, such as regular files, are always
+ * ready for reading and writing.
+ */
+int poll_file(struct file *file, poll_entry_t *pe);
+
+/**
+ * Waits until one of nfds fds is ready for one of its events, or timeout
+ * milliseconds have passed (none if timeout is 0, for ever if it is
+ * negative), and fills in their revents.
+ *
+ * @return the number of fds with revents set, or -EINVAL if nfds is larger
+ * than NFILES, -ENOMEM, or -EINTR
+ */
+long do_poll(struct pollfd *fds, size_t nfds, int timeout);
+
+/**
+ * Opens a new, empty epoll instance.
+ *
+ * @return its fd, or -EMFILE / -ENOMEM
+ */
+long do_epoll_create();
+
+/**
+ * Adds fd to, changes its events in, or removes it from the epoll instance
+ * epfd. An fd stays registered until it is removed, or the file it refers
+ * to is closed for good.
+ *
+ * @param op EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+ * @param event the events to wait for and the data to report them with
+ * @return 0 on success, -EBADF if either fd is not open, -EINVAL if epfd is
+ * not an epoll instance or fd is, or op is not valid, -EEXIST if fd is
+ * added twice, -ENOENT if it is not registered, or -ENOMEM
+ */
+long do_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+/**
+ * Waits until a registered fd is ready, or timeout milliseconds have passed
+ * (as with do_poll()), and returns the events of up to maxevents ready fds.
+ *
+ * @return the number of events filled in, or -EBADF, -EINVAL if epfd is not
+ * an epoll instance or maxevents is not positive, or -EINTR
+ */
+long do_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                   int timeout);
+
+/**
+ * Removes a file from every epoll instance it is registered with; called by
+ * fput() as the last reference to it goes away.
+ */
+void epoll_file_closed(struct file *file);
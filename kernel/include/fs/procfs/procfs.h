@@ -0,0 +1,33 @@
+#pragma once
+
+#include "fs/vfs.h"
+#include "mm/page.h"
+
+/*
+ * procfs: the kernel's statistics as files, mounted at boot with
+ *
+ *   mount -t procfs none /proc
+ *
+ * so that monitoring programs can poll them with open() and read() rather
+ * than through kshell and a debug build. Nothing is stored: each read()
+ * generates the whole file anew, up to PROCFS_FILE_SIZE bytes, and returns
+ * the part asked for, so a file is best read in one go.
+ *
+ *   /proc/time          tick counts and idle time (time_stats())
+ *   /proc/meminfo       free pages, page cache, swap and merging counters
+ *   /proc/memgroups     every memory group's limit and usage (memgroup_info())
+ *   /proc/slabinfo      every slab allocator (slab_info())
+ *   /proc/diskstats     every disk's requests, blocks, queue and service time
+ *   /proc/schedstat     every core's run queue, waits, switches and steals
+ *                       (sched_stats_info())
+ *   /proc/<pid>/stat    a process's counters on one line (proc_stat_info())
+ *   /proc/<pid>/status  a process's details (proc_info())
+ *   /proc/<pid>/maps    a process's memory areas (vmmap_mapping_info())
+ *
+ * Lines of counters are "key value" or "key=value" pairs, so that new ones
+ * can be added without breaking whoever parses them.
+ */
+
+#define PROCFS_FILE_SIZE (4 * PAGE_SIZE)
+
+long procfs_mount(struct fs *fs);
@@ -31,6 +31,8 @@
 #define S5_DIRENTS_PER_BLOCK (S5_BLOCK_SIZE / sizeof(s5_dirent_t))
 #define S5_MAX_FILE_BLOCKS (S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS)
 #define S5_MAX_FILE_SIZE (S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE)
+#define S5_EXTENT_MAX_FILE_BLOCKS (0xffffffffU / S5_BLOCK_SIZE)
+#define S5_EXTENT_MAX_FILE_SIZE (S5_EXTENT_MAX_FILE_BLOCKS * S5_BLOCK_SIZE)
 #define S5_NAME_LEN 28
 
 #define S5_TYPE_FREE 0x0
@@ -39,18 +41,91 @@
 #define S5_TYPE_CHR 0x4
 #define S5_TYPE_BLK 0x8
 
+#define S5_FLAG_EXTENTS 0x1   /* blocks are mapped by an extent tree */
+#define S5_FLAG_DIR_INDEX 0x2 /* directory entries are indexed by name hash */
+#define S5_FLAG_INLINE 0x4    /* contents are in the inode (s5_inline) */
+
 #define S5_MAGIC 071177
-#define S5_CURRENT_VERSION 3
+#define S5_CURRENT_VERSION 8 /* 4: free block bitmap replaces the free list
+                              * 5: extent-mapped inodes
+                              * 6: free inode bitmap replaces the free list
+                              * 7: metadata journal
+                              * 8: inline files */
+#define S5_MIN_VERSION 6 /* older versions lack features, and those are not
+                          * used on them */
+
+/* Largest file whose contents are kept in its inode (S5_FLAG_INLINE), in
+ * place of its block map. Regular files start out inline, on disks of
+ * version 8 or later, and move to an extent tree once they grow past this. */
+#define S5_INLINE_MAX ((S5_NDIRECT_BLOCKS + 1) * sizeof(uint32_t))
 
 /* Number of blocks stored in the indirect block */
 #define S5_NIDIRECT_BLOCKS (S5_BLOCK_SIZE / sizeof(uint32_t))
 
+/* Number of extents stored in an inode, and in a leaf block of an extent
+ * tree */
+#define S5_INODE_NEXTENTS \
+    ((S5_NDIRECT_BLOCKS + 1) * sizeof(uint32_t) / sizeof(s5_extent_t))
+#define S5_BLOCK_NEXTENTS \
+    ((S5_BLOCK_SIZE - sizeof(s5_extent_header_t)) / sizeof(s5_extent_t))
+
+/* Number of entries in a block of a hashed directory index */
+#define S5_DX_NENTRIES \
+    ((S5_BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(s5_dx_entry_t))
+
+/* The file block holding the root of a directory's index, and the largest a
+ * directory can grow to below it */
+#define S5_DIR_INDEX_BLOCK 0x80000
+#define S5_DIR_MAX_SIZE ((size_t)S5_DIR_INDEX_BLOCK * S5_BLOCK_SIZE)
+
+/* Number of entries a directory has when it is given an index */
+#define S5_DIR_INDEX_THRESHOLD S5_DIRENTS_PER_BLOCK
+
 /* Given a file offset, returns the block number that it is in */
 #define S5_DATA_BLOCK(seekptr) ((seekptr) / S5_BLOCK_SIZE)
 
 /* Given a file offset, returns the offset into the pointer's block */
 #define S5_DATA_OFFSET(seekptr) ((seekptr) % S5_BLOCK_SIZE)
 
+/* Number of blocks whose state one block of the free block bitmap records */
+#define S5_BITS_PER_BITMAP_BLOCK (S5_BLOCK_SIZE * 8)
+
+/* Given a block number and a superblock, tells the bitmap block recording
+ * whether the block is in use, and the bit within it */
+#define S5_BITMAP_BLOCK(super, blkno) \
+    ((super)->s5s_bitmap_block + (blkno) / S5_BITS_PER_BITMAP_BLOCK)
+#define S5_BITMAP_BIT(blkno) ((blkno) % S5_BITS_PER_BITMAP_BLOCK)
+
+/* Given a superblock, tells the number of blocks of the free inode bitmap */
+#define S5_IBITMAP_NBLOCKS(super) \
+    (((super)->s5s_num_inodes - 1) / S5_BITS_PER_BITMAP_BLOCK + 1)
+
+/* Given a superblock, tells the first block of the journal, if any */
+#define S5_JOURNAL_START(super) \
+    ((super)->s5s_ibitmap_block + S5_IBITMAP_NBLOCKS(super))
+
+/* Given a superblock, tells the first data block */
+#define S5_DATA_START(super) \
+    (S5_JOURNAL_START(super) + (super)->s5s_journal_nblocks)
+
+/* Number of blocks a journal record can log besides its header */
+#define S5_JOURNAL_MAX_BLOCKS \
+    ((S5_BLOCK_SIZE - 4 * sizeof(uint32_t)) / sizeof(uint32_t))
+
+#define S5_JOURNAL_MAGIC 0x6a726e6c
+
+/*
+ * Inodes are allocated in groups of S5_INODES_PER_GROUP consecutive inodes,
+ * each paired with an equal share of the data blocks, in order: a file's inode
+ * goes in its directory's group, and its blocks in the group's share of the
+ * disk (see s5_alloc_inode()). Each group has its own lock and free counts
+ * (s5_group_t), so that files in different groups allocate in parallel.
+ */
+#define S5_INODES_PER_GROUP (4 * S5_INODES_PER_BLOCK)
+#define S5_INODE_GROUP(inum) ((inum) / S5_INODES_PER_GROUP)
+#define S5_NGROUPS(super) \
+    (((super)->s5s_num_inodes - 1) / S5_INODES_PER_GROUP + 1)
+
 /* Given an inode number, tells the block that inode is stored in. */
 #define S5_INODE_BLOCK(inum) ((inum) / S5_INODES_PER_BLOCK + 1)
 
@@ -63,13 +138,16 @@
 /* Given an FS struct, get the S5FS (private data) struct. */
 #define FS_TO_S5FS(fs) ((s5fs_t *)(fs)->fs_i)
 
-/* each node of the free block list looks like this: */
 /*
-typedef struct s5_fbl_node {
-        int free_blocks[S5_NBLKS_PER_FNODE-1];
-        int more;
-} s5_fbl_node_t;
-*/
+ * On-disk layout: the superblock, then the inode blocks, then the free block
+ * bitmap, then the free inode bitmap, then the journal (if there is one),
+ * then data blocks. Bit b of the block
+ * bitmap (bit b % 32 of 32-bit word b / 32, counting from the start of the
+ * bitmap) is set if block b is in use; the bits of the superblock, inode and
+ * bitmap blocks are always set, as are those past the end of the disk. The
+ * inode bitmap likewise has bit i set if inode i is in use, and the bits past
+ * the last inode set.
+ */
 
 /* Note that all on-disk types need to have hard-coded sizes (to ensure
  * inter-machine compatibility of s5 disks) */
@@ -78,29 +156,93 @@ typedef struct s5_fbl_node {
 typedef struct s5_super
 {
     uint32_t s5s_magic;      /* the magic number */
-    uint32_t s5s_free_inode; /* the free inode pointer */
-    uint32_t s5s_nfree;      /* number of blocks currently in
-                              * s5s_free_blocks */
-    /* First "node" of free block list */
-    uint32_t s5s_free_blocks[S5_NBLKS_PER_FNODE];
+    uint32_t s5s_nfree_inodes; /* number of free inodes */
+    uint32_t s5s_nfree;      /* number of free blocks */
+    uint32_t s5s_num_blocks; /* size of the disk, in blocks */
+    uint32_t s5s_bitmap_block;   /* first block of the free block bitmap */
+    uint32_t s5s_bitmap_nblocks; /* number of blocks of the bitmap */
+    uint32_t s5s_ibitmap_block;  /* first block of the free inode bitmap */
+    uint32_t s5s_journal_nblocks; /* blocks of the journal, 0 if none */
+
+    /* Held the free block list in version 3; keeps the fields below where
+     * older versions had them */
+    uint32_t s5s_unused[S5_NBLKS_PER_FNODE - 5];
 
     uint32_t s5s_root_inode; /* root inode */
     uint32_t s5s_num_inodes; /* number of inodes */
     uint32_t s5s_version;    /* version of this disk format */
 } s5_super_t;
 
+/*
+ * Extent-mapped inodes (S5_FLAG_EXTENTS) map runs of file blocks onto runs of
+ * disk blocks, in place of the direct and indirect blocks. The inode holds up
+ * to S5_INODE_NEXTENTS extents itself (depth 0); once those are not enough it
+ * holds as many index entries instead (depth 1), each pointing to a leaf block
+ * of up to S5_BLOCK_NEXTENTS extents, keyed by the first file block the leaf
+ * maps. Entries of a node are sorted by file block and never overlap; file
+ * blocks no extent covers are sparse.
+ */
+typedef struct s5_extent_header
+{
+    uint16_t s5eh_nentries; /* entries in use */
+    uint16_t s5eh_depth;    /* 0 if the entries are extents, 1 if index */
+} s5_extent_header_t;
+
+typedef struct s5_extent
+{
+    uint32_t s5e_file_block; /* first file block mapped */
+    uint32_t s5e_disk_block; /* where it is on disk (for an index entry, the
+                              * leaf block) */
+    uint32_t s5e_length;     /* number of blocks mapped (0 for an index entry) */
+} s5_extent_t;
+
+typedef struct s5_extent_leaf
+{
+    s5_extent_header_t s5el_header;
+    s5_extent_t s5el_extents[S5_BLOCK_NEXTENTS];
+} s5_extent_leaf_t;
+
+/*
+ * The journal is split in two halves, each holding at most one record: a
+ * header block followed by copies of the blocks it logs. Records are written
+ * to the halves in turn, by sequence number, and the one with the highest
+ * sequence number whose magic and checksum are intact is replayed at mount.
+ * The checksum covers the header (with s5jh_checksum zero) and then the
+ * logged blocks, as 32-bit words: c = (c ^ word) * 16777619, from 2166136261.
+ */
+typedef struct s5_journal_header
+{
+    uint32_t s5jh_magic;    /* S5_JOURNAL_MAGIC */
+    uint32_t s5jh_seq;      /* sequence number of the record */
+    uint32_t s5jh_nblocks;  /* number of blocks logged */
+    uint32_t s5jh_checksum;
+    uint32_t s5jh_blocks[S5_JOURNAL_MAX_BLOCKS]; /* where they go */
+} s5_journal_header_t;
+
 /* The contents of an inode, as stored on disk. */
 typedef struct s5_inode
 {
     union {
-        uint32_t s5_next_free; /* inode free list ptr */
+        uint32_t s5_next_free; /* inode free list ptr (before version 6) */
         uint32_t s5_size;      /* file size */
     } s5_un;
     uint32_t s5_number;   /* this inode's number */
-    uint16_t s5_type;     /* one of S5_TYPE_{FREE,DATA,DIR,CHR,BLK} */
+    uint8_t s5_type;      /* one of S5_TYPE_{FREE,DATA,DIR,CHR,BLK} */
+    uint8_t s5_flags;     /* S5_FLAG_* */
     int16_t s5_linkcount; /* link count of this inode */
-    uint32_t s5_direct_blocks[S5_NDIRECT_BLOCKS];
-    uint32_t s5_indirect_block;
+    union {
+        struct
+        {
+            uint32_t s5_direct_blocks[S5_NDIRECT_BLOCKS];
+            uint32_t s5_indirect_block;
+        };
+        struct
+        {
+            s5_extent_header_t s5_extent_header;
+            s5_extent_t s5_extents[S5_INODE_NEXTENTS];
+        };
+        uint8_t s5_inline[S5_INLINE_MAX];
+    };
 } s5_inode_t;
 
 typedef struct s5_node
@@ -108,6 +250,20 @@ typedef struct s5_node
     vnode_t vnode;
     s5_inode_t inode;
     long dirtied_inode;
+
+    /* Sequential readahead state, in file blocks */
+    size_t ra_next;   /* block following the last read */
+    size_t ra_window; /* blocks to read ahead; 0 if access is not sequential */
+    size_t ra_end;    /* block following the last one read ahead */
+
+    /* The last run of file blocks found mapped to consecutive disk blocks
+     * through the indirect block or a leaf of the extent tree, so that
+     * sequential access need not look there again for every block (see
+     * s5_file_block_to_disk_block()). Protected by the vnode's mobj mutex;
+     * bmap_len is 0 if there is none. */
+    size_t bmap_file_block;
+    blocknum_t bmap_disk_block;
+    size_t bmap_len;
 } s5_node_t;
 
 #define VNODE_TO_S5NODE(vn) CONTAINER_OF(vn, s5_node_t, vnode)
@@ -119,13 +275,63 @@ typedef struct s5_dirent
     char s5d_name[S5_NAME_LEN];
 } s5_dirent_t;
 
+/*
+ * Hashed directory indexes (S5_FLAG_DIR_INDEX).
+ *
+ * A directory's entries are always a contiguous array of s5_dirent_t's filling
+ * its first s5_size bytes. Extent-mapped directories of more than
+ * S5_DIR_INDEX_THRESHOLD entries also keep an index of them by name hash, in
+ * file blocks from S5_DIR_INDEX_BLOCK on (past the end of the file, so they are
+ * never read as entries). Index block 0, the root, maps ranges of hashes to
+ * the bucket blocks after it: entry i covers hashes from its s5dx_hash up to
+ * the next entry's, and s5dx_ptr is the bucket's number. A bucket holds a
+ * (hash, slot) entry for each directory entry whose name hashes into its range,
+ * sorted by hash, where the slot is the entry's index in the array. Entries
+ * with equal hashes are always in the same bucket, so a lookup reads one
+ * bucket block, plus the entries whose hashes match.
+ */
+typedef struct s5_dx_entry
+{
+    uint32_t s5dx_hash;
+    uint32_t s5dx_ptr; /* bucket number (in the root), or dirent slot */
+} s5_dx_entry_t;
+
+typedef struct s5_dx_node
+{
+    uint32_t s5dx_count; /* entries in use */
+    uint32_t s5dx_unused;
+    s5_dx_entry_t s5dx_entries[S5_DX_NENTRIES];
+} s5_dx_node_t;
+
 #ifndef __FSMAKER__
+/* In-core state of an allocation group */
+typedef struct s5_group
+{
+    kmutex_t sg_mutex;        /* protects the group's bits in both bitmaps and
+                               * the counts below */
+    uint32_t sg_nfree;        /* free blocks in the group's share of the disk */
+    uint32_t sg_nfree_inodes; /* free inodes in the group */
+} s5_group_t;
+
 /* Our in-memory representation of a s5fs filesytem (fs_i points to this) */
 typedef struct s5fs
 {
     blockdev_t *s5f_bdev;
     s5_super_t s5f_super;
-    kmutex_t s5f_mutex;
+    kmutex_t s5f_mutex;         /* protects s5s_nfree, s5s_nfree_inodes,
+                                 * s5f_alloc_rotor, s5f_ndelayed and the
+                                 * discards; never held across bitmap updates
+                                 * (see s5_group_t) */
+    kmutex_t s5f_sync_mutex;    /* serializes copying in-core inodes to their
+                                 * blocks in sync() and fsync() */
+    s5_group_t *s5f_groups;     /* S5_NGROUPS() allocation groups */
+    blocknum_t s5f_alloc_rotor; /* where to allocate blocks with no goal */
+    size_t s5f_ndelayed;        /* free blocks promised to dirty pages of
+                                 * files whose blocks are not yet allocated */
+    long s5f_discard;           /* whether freed blocks are discarded */
+    size_t s5f_ndiscards;       /* runs of freed blocks awaiting discard */
+    blockdev_range_t s5f_discards[S5_DISCARD_MAX];
+    struct s5_journal *s5f_journal; /* NULL if the disk has no journal */
     fs_t *s5f_fs;
 } s5fs_t;
 
@@ -134,6 +340,9 @@ long s5fs_mount(struct fs *fs);
 void s5_get_disk_block(s5fs_t *s5fs, blocknum_t blocknum, long forwrite,
                        pframe_t **pfp);
 
+void s5_get_data_block(s5fs_t *s5fs, blocknum_t blocknum, long forwrite,
+                       pframe_t **pfp);
+
 void s5_release_disk_block(pframe_t **pfp);
 
 #endif
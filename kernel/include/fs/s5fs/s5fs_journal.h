@@ -0,0 +1,76 @@
+/*
+ *   FILE: s5fs_journal.h
+ *  DESCR: write-ahead journal of s5fs metadata blocks
+ */
+
+#pragma once
+
+#include "types.h"
+
+#include "drivers/bio.h"
+#include "proc/kmutex.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+struct blockdev;
+struct s5fs;
+struct pframe;
+
+/*
+ * Every change to a metadata block (inode, bitmap, directory, indirect and
+ * extent blocks, and the super block) is made by an operation bracketed with
+ * s5_journal_begin() and s5_journal_end(), and joins the running transaction
+ * when its block is gotten for writing. The blocks of a transaction are
+ * pinned in the page cache until it commits, so that none of them reaches its
+ * place on the disk on its own. A commit waits for a moment when no
+ * operations are in progress, copies the transaction's blocks out, and then
+ * lets operations run on into the next transaction while it writes the copies
+ * to the journal with one sequential write, and then writes them to their
+ * places (the checkpoint). Many operations' changes, e.g. the inode bitmap
+ * and inode blocks shared by a burst of creates, are so made durable together
+ * at the cost of one write to the journal.
+ */
+typedef struct s5_journal
+{
+    spinlock_t j_lock;        /* protects the fields down to j_overflow */
+    size_t j_nhandles;        /* operations in progress */
+    long j_frozen;            /* a commit is copying out the transaction */
+    long j_commit_waiting;    /* a commit waits for j_nhandles to reach 0 */
+    ktqueue_t j_thaw_waitq;   /* operations waiting for the copy to finish */
+    ktqueue_t j_commit_waitq; /* the commit waiting for operations */
+    blocknum_t *j_blocks;     /* blocks of the running transaction */
+    size_t j_nblocks;
+    long j_overflow;          /* the running transaction did not fit */
+
+    kmutex_t j_commit_mutex;  /* serializes commits; protects the rest */
+    struct blockdev *j_bdev;
+    blocknum_t j_start;       /* first block of the journal */
+    size_t j_half;            /* blocks in each half of the journal */
+    size_t j_max_blocks;      /* most blocks a transaction can log */
+    uint32_t j_seq;           /* sequence number of the next record */
+    blocknum_t *j_commit_blocks; /* the transaction being committed */
+    void **j_pages;           /* its record: the header, then copies of its
+                               * blocks as of when it was frozen */
+    bio_vec_t *j_vecs;
+    bio_t *j_bios;
+
+    size_t j_ncommits;
+    size_t j_nlogged;    /* blocks written to the journal */
+    size_t j_noverflows; /* transactions written without the journal */
+} s5_journal_t;
+
+long s5_journal_mount(struct s5fs *s5fs);
+
+void s5_journal_destroy(struct s5fs *s5fs);
+
+void s5_journal_begin(struct s5fs *s5fs);
+
+void s5_journal_end(struct s5fs *s5fs);
+
+void s5_journal_dirty(struct s5fs *s5fs, struct pframe *pf);
+
+void s5_journal_forget(struct s5fs *s5fs, struct pframe *pf);
+
+long s5_journal_commit(struct s5fs *s5fs);
+
+long s5_journal_sync(struct s5fs *s5fs);
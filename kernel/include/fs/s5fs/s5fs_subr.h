@@ -10,22 +10,45 @@
 
 struct s5fs;
 struct s5_node;
+struct pframe;
+struct dirent;
+struct iovec;
 
-long s5_alloc_inode(struct s5fs *s5fs, uint16_t type, devid_t devid);
+long s5_init_groups(struct s5fs *s5fs);
+
+struct blockdev_range *s5_discard_take(struct s5fs *s5fs, size_t *np);
+
+void s5_discard(struct s5fs *s5fs, const struct blockdev_range *ranges,
+                size_t n);
+
+long s5_alloc_inode(struct s5fs *s5fs, uint16_t type, devid_t devid,
+                    ino_t parent);
 
 void s5_free_inode(struct s5fs *s5fs, ino_t ino);
 
+long s5_lock_pages(struct s5_node *sn);
+
+void s5_unlock_pages(struct s5_node *sn, long locked);
+
+void s5_readahead_range(struct s5_node *sn, size_t block, size_t end);
+
 ssize_t s5_read_file(struct s5_node *vn, size_t pos, char *buf, size_t len);
 
 ssize_t s5_write_file(struct s5_node *vn, size_t pos, const char *buf,
                       size_t len);
 
+ssize_t s5_direct_io(struct s5_node *sn, size_t pos, const struct iovec *iov,
+                     int iovcnt, long write);
+
 long s5_link(struct s5_node *dir, const char *name, size_t namelen,
              struct s5_node *child);
 
 long s5_find_dirent(struct s5_node *dir, const char *name, size_t namelen,
                     size_t *filepos);
 
+ssize_t s5_read_dirents(struct s5_node *dir, size_t *posp, struct dirent *d,
+                        size_t count);
+
 void s5_remove_dirent(struct s5_node *dir, const char *name, size_t namelen,
                       struct s5_node *ent);
 
@@ -39,8 +62,17 @@ long s5_inode_blocks(struct s5_node *vnode);
 
 void s5_remove_blocks(struct s5_node *vnode);
 
+long s5_delalloc_reserve(struct s5fs *s5fs);
+
+void s5_delalloc_release(struct s5fs *s5fs, size_t n);
+
+long s5_flush_pages(struct s5_node *sn, struct pframe *pf);
+
+long s5_writeback_pages(struct s5_node *sn, uint64_t dirtied_before);
+
 /* Converts a vnode_t* to the s5fs_t* (s5fs file system) struct */
 #define VNODE_TO_S5FS(vn) ((s5fs_t *)((vn)->vn_fs->fs_i))
 
-/* Converts an s5fs_t* to its memory object (the memory object of the block device) */
-#define S5FS_TO_VMOBJ(s5fs) (&(s5fs)->s5f_bdev->bd_mobj)
\ No newline at end of file
+/* Converts an s5fs_t* and a block number to the memory object caching the
+ * block (a shard of the block device's buffer cache) */
+#define S5FS_TO_VMOBJ(s5fs, block) blockdev_mobj((s5fs)->s5f_bdev, (block))
\ No newline at end of file
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "fs/vfs.h"
+
+/*
+ * tmpfs: an in-memory filesystem for scratch data, to be mounted with
+ *
+ *   mount -t tmpfs none <directory>
+ *
+ * Unlike ramfs, which keeps each file in a single page and each directory in
+ * an array that is searched linearly, files hold their contents in an
+ * anonymous mobj, so they can be of any size, are sparse, can be mapped, and
+ * are paged out to swap under memory pressure like any other anonymous
+ * memory. Directories are hash tables of their entries, which grow with the
+ * directory.
+ *
+ * Nothing is ever written to a disk: everything on a tmpfs is gone when it
+ * is unmounted.
+ */
+
+long tmpfs_mount(struct fs *fs);
@@ -4,6 +4,8 @@
 
 #include "fs/open.h"
 #include "proc/kmutex.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
 #include "util/list.h"
 
 struct vnode;
@@ -39,12 +41,39 @@ typedef struct fs_ops
     long (*umount)(struct fs *fs);
 
     void (*sync)(struct fs *fs);
+
+    /*
+     * Optional. Called periodically by the writeback thread: start writing
+     * back whatever the filesystem keeps dirty outside of its block device
+     * (e.g. file pages whose blocks are not allocated yet) and that was
+     * dirtied before dirtied_before (in jiffies).
+     */
+    void (*writeback)(struct fs *fs, uint64_t dirtied_before);
 } fs_ops_t;
 
 #ifndef STR_MAX
 #define STR_MAX 32
 #endif
 
+/*
+ * Number of buckets in each filesystem's vnode cache. Must be a power of 2.
+ * Inode numbers are small and dense, so the low bits are a good hash.
+ */
+#define VNODE_HASH_NBUCKETS 256
+#define VNODE_HASH(ino) ((ino) & (VNODE_HASH_NBUCKETS - 1))
+
+/*
+ * One bucket of a filesystem's vnode cache. vb_lock protects vb_list. Threads
+ * that find a vnode in the middle of being torn down (refcount already 0)
+ * sleep on vb_teardown_waitq until the destructor has unhashed it.
+ */
+typedef struct vnode_bucket
+{
+    list_t vb_list;
+    spinlock_t vb_lock;
+    ktqueue_t vb_teardown_waitq;
+} vnode_bucket_t;
+
 /* similar to Linux's super_block. */
 typedef struct fs
 {
@@ -99,8 +128,17 @@ typedef struct fs
     void *fs_i;
 
     struct slab_allocator *fs_vnode_allocator;
-    list_t vnode_list;
-    kmutex_t vnode_list_mutex;
+
+    /* Set by filesystems whose names come and go by themselves (procfs),
+     * so that the dentry cache does not remember what they looked up. */
+    long fs_nodcache;
+
+    /* Cache of this filesystem's vnodes, hashed by inode number. Used (only)
+     * by the v{get,ref,put} facilities (vfs/vnode.c). */
+    vnode_bucket_t fs_vnode_hash[VNODE_HASH_NBUCKETS];
+
+    /* Held by renames between two directories (only), while they lock the
+     * directories; see do_rename(). */
     kmutex_t vnode_rename_mutex;
 
 } fs_t;
@@ -111,6 +149,8 @@ extern fs_t vfs_root_fs;
 
 void do_sync();
 
+void vfs_writeback(uint64_t dirtied_before);
+
 /* VFS {{{ */
 /*
  * - called by the init process at system shutdown
@@ -160,3 +200,14 @@ long lookup_dirpath(struct vnode *dir, char *buf, size_t size);
 #endif /* __GETCWD__ */
 
 long mountfunc(fs_t *fs);
+
+#ifdef __MOUNTING__
+extern list_t mounted_fs_list;
+extern kmutex_t vfs_mount_mutex;
+
+int vfs_mount(struct vnode *mtpt, fs_t *fs);
+
+int vfs_umount(fs_t *fs);
+
+void vfs_cross_mount(struct vnode **vnp);
+#endif /* __MOUNTING__ */
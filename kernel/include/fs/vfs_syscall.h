@@ -14,18 +14,41 @@ ssize_t do_read(int fd, void *buf, size_t len);
 
 ssize_t do_write(int fd, const void *buf, size_t len);
 
+struct iovec;
+struct vnode;
+
+ssize_t do_pread(int fd, void *buf, size_t len, off_t offset);
+
+ssize_t do_pwrite(int fd, const void *buf, size_t len, off_t offset);
+
+ssize_t do_readv(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t do_writev(int fd, const struct iovec *iov, int iovcnt);
+
+long do_write_discards(int fd);
+
+ssize_t do_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
 long do_dup(int fd);
 
 long do_dup2(int ofd, int nfd);
 
+long do_fcntl(int fd, int cmd, int arg);
+
+long do_ioctl(int fd, unsigned long request, void *arg);
+
 long do_mknod(const char *path, int mode, devid_t devid);
 
 long do_mkdir(const char *path);
 
+long do_mkdirat(int dirfd, const char *path);
+
 long do_rmdir(const char *path);
 
 long do_unlink(const char *path);
 
+long do_unlinkat(int dirfd, const char *path, int flags);
+
 long do_link(const char *oldpath, const char *newpath);
 
 long do_rename(const char *oldpath, const char *newpath);
@@ -34,6 +57,22 @@ long do_chdir(const char *path);
 
 ssize_t do_getdent(int fd, struct dirent *dirp);
 
+ssize_t do_getdents(int fd, struct dirent *dirp, size_t count);
+
 off_t do_lseek(int fd, off_t offset, int whence);
 
+long do_fsync(int fd, long datasync);
+
+long do_syncfs(int fd);
+
 long do_stat(const char *path, struct stat *uf);
+
+long do_fstatat(int dirfd, const char *path, struct stat *uf, int flags);
+
+long at_get_base(int dirfd, const char *path, struct vnode **basep);
+
+#ifdef __MOUNTING__
+int do_mount(const char *source, const char *target, const char *type);
+
+int do_umount(const char *target);
+#endif
@@ -14,6 +14,8 @@
 #include "mm/mobj.h"
 #include "mm/pframe.h"
 #include "proc/kmutex.h"
+#include "proc/rcu.h"
+#include "proc/rwlock.h"
 #include "util/list.h"
 
 struct fs;
@@ -22,6 +24,8 @@ struct stat;
 struct file;
 struct vnode;
 struct kmutex;
+struct poll_entry;
+struct iovec;
 
 #define VNODE_LOADING 0
 #define VNODE_LOADED 1
@@ -128,6 +132,16 @@ typedef struct vnode_ops
      */
     ssize_t (*readdir)(struct vnode *dir, size_t pos, struct dirent *d);
 
+    /*
+     * getdents reads as many directory entries as fit in the count struct
+     * dirents at d, starting at *pos, and advances *pos past them. It
+     * returns the number of entries read, which is 0 at the end of the
+     * directory. Optional: without it, entries are read one readdir at a
+     * time.
+     */
+    ssize_t (*getdents)(struct vnode *dir, size_t *pos, struct dirent *d,
+                        size_t count);
+
     /* Operations that can be performed on any type of "file" (
      * includes normal file, directory, block/byte device */
     /*
@@ -167,11 +181,58 @@ typedef struct vnode_ops
      */
     long (*flush_pframe)(struct vnode *vnode, pframe_t *pf);
 
+    /*
+     * Start reading pages [pagenum, pagenum + npages) of a file in the
+     * background, so that getting them later does not wait. Optional.
+     */
+    void (*readahead)(struct vnode *vnode, size_t pagenum, size_t npages);
+
+    /*
+     * Reads (write = 0) or writes (write = 1) the iovcnt buffers of iov in
+     * order starting at pos, straight between them and the file's disk
+     * rather than through its pages, for files opened with O_DIRECT. Returns
+     * the number of bytes transferred, as read and write would, or -ENOTSUP
+     * if these buffers can't be transferred directly (e.g. they are not
+     * aligned to the file system's blocks), in which case the caller goes
+     * through read or write instead. The vnode must be locked exclusively.
+     * Optional: NULL for files that are always transferred through their
+     * pages.
+     */
+    ssize_t (*direct_io)(struct vnode *vnode, size_t pos,
+                         const struct iovec *iov, int iovcnt, long write);
+
     /*
     * This will truncate the file to have a length of zero
     * Should only be used on regular files, not directories. 
     */
     void (*truncate_file)(struct vnode *vnode);
+
+    /*
+     * Writes the file's dirty data back to its disk, with the metadata needed
+     * to read it back, and waits for it; unless datasync is set, the rest of
+     * the file's metadata too. Called without the vnode locked. NULL for
+     * objects with nothing to write back, such as files of in-memory file
+     * systems.
+     */
+    long (*fsync)(struct vnode *vnode, long datasync);
+
+    /*
+     * Returns what the object behind the vnode is ready for (POLLIN,
+     * POLLOUT, POLLERR, POLLHUP), having first added pe to its pollhead
+     * if pe is not NULL; see fs/poll.h. Unlike the other operations, this
+     * is called without the vnode locked, and must not block. NULL for
+     * objects that are always ready.
+     */
+    int (*poll)(struct vnode *vnode, struct poll_entry *pe);
+
+    /*
+     * Carries out a device-specific request, with arg a kernel copy of its
+     * argument (see do_ioctl()). Called without the vnode locked, like
+     * poll, so that a tty can be reconfigured while a read of it waits.
+     * Returns 0, or -ENOTTY for requests the object does not know. NULL
+     * for objects that take none.
+     */
+    long (*ioctl)(struct vnode *vnode, unsigned long request, void *arg);
 } vnode_ops_t;
 
 typedef struct vnode
@@ -205,6 +266,15 @@ typedef struct vnode
      */
     struct mobj vn_mobj;
 
+    /*
+     * Protects the file's contents, length and (for directories) entries at
+     * the vnode level. vlock() takes it exclusively along with vn_mobj's
+     * mutex; vlock_shared() takes only this lock, shared, for operations
+     * that just read the vnode, which lock vn_mobj themselves whenever they
+     * look up its pframes.
+     */
+    rwlock_t vn_rwlock;
+
     /*
      * A number which uniquely identifies this vnode within its filesystem.
      * (Similar and usually identical to what you might know as the inode
@@ -261,11 +331,18 @@ typedef struct vnode
     } vn_dev;
 
     /* Used (only) by the v{get,ref,put} facilities (vfs/vnode.c): */
-    list_link_t vn_link; /* link on system vnode list */
+    list_link_t vn_link; /* link on the fs's vnode cache bucket */
+    rcu_head_t vn_rcu;   /* frees the vnode once unhashed */
 } vnode_t;
 
 void init_special_vnode(vnode_t *vn);
 
+/*
+ * Initialize the vnode cache of a filesystem. Must be called before the
+ * filesystem is mounted (i.e. before the first vget on it).
+ */
+void vnode_cache_init(struct fs *fs);
+
 /* Core vnode management routines: */
 /*
  *     Obtain a vnode representing the file that filesystem 'fs' identifies
@@ -282,13 +359,29 @@ void init_special_vnode(vnode_t *vn);
 struct vnode *vget(struct fs *fs, ino_t vnum);
 
 /*
- * Lock a vnode (locks vn_mobj). 
+ * Find the loaded vnode for ino in fs's vnode cache without locking or taking
+ * a reference, from within rcu_read_lock(); it stays valid until
+ * rcu_read_unlock(). Returns NULL if there is none, or it is still loading or
+ * going away, and a vget() is needed.
+ */
+vnode_t *vget_cached_rcu(struct fs *fs, ino_t ino);
+
+/*
+ * Lock a vnode (locks vn_rwlock exclusively, and vn_mobj). 
  */
 void vlock(vnode_t *vn);
 
+/*
+ * Lock a vnode shared with other readers (see vn_rwlock). The holder must not
+ * change the vnode, nor lock it again.
+ */
+void vlock_shared(vnode_t *vn);
+
 /*
  * Lock two vnodes in order! This prevents the A/B locking problem when locking
- * two directories or two files.
+ * two directories or two files. Two directories neither of which is an
+ * ancestor of the other may only be locked together under their file system's
+ * vnode_rename_mutex.
  */
 void vlock_in_order(vnode_t *a, vnode_t *b);
 
@@ -307,6 +400,11 @@ void vput_locked(struct vnode **vnp);
  */
 void vunlock(vnode_t *vn);
 
+/**
+ * Unlocks a vnode locked with vlock_shared()
+ */
+void vunlock_shared(vnode_t *vn);
+
 /**
  * Unlocks two vnodes (effectively just 2 unlocks)
  */
@@ -318,6 +416,12 @@ void vunlock_in_order(vnode_t *a, vnode_t *b);
  */
 void vref(vnode_t *vn);
 
+/*
+ * Like vref(), for a vnode found without a reference (see vget_cached_rcu()):
+ * returns 0, taking no reference, if the vnode is going away.
+ */
+long vref_not_zero(vnode_t *vn);
+
 /*
  * This function decrements the reference count on this vnode 
  * (i.e. the refcount of vn_mobj).
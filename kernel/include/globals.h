@@ -7,5 +7,9 @@
 #define CORE_SPECIFIC_DATA __attribute__((section(".csd"))) = {0}
 
 extern core_t curcore;
-extern proc_t *curproc;
-extern kthread_t *curthr;
+#define curcore CSD(curcore)
+
+/* Kept in the core's csd_head_t; set with csd_set_curproc() and
+ * csd_set_curthr() */
+#define curproc csd_curproc()
+#define curthr csd_curthr()
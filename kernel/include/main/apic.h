@@ -29,6 +29,11 @@ long apic_max_id();
 /* Maps the given IRQ to the given interrupt number. */
 void apic_setredir(uint32_t irq, uint8_t intr);
 
+/* Switches this core's local APIC to x2APIC mode, where its registers are
+ * MSRs, if apic_init() found the processor supports it. Must come before
+ * anything else on the core touches the local APIC. */
+void apic_x2apic_enter();
+
 void apic_enable();
 
 // timer interrupts arrive at a rate of (freq / 16) interrupts per millisecond
@@ -39,6 +44,19 @@ void apic_enable_periodic_timer(uint32_t freq);
 /* Stops the APIC timer */
 void apic_disable_periodic_timer();
 
+/* Returns the TSC frequency in Hz, which is measured along with the APIC
+ * timer's the first time either is needed. */
+uint64_t apic_tsc_frequency();
+
+/* Replaces the periodic timer with a single interrupt nticks periods from
+ * now, or as many as the counter can hold. Returns the number of periods
+ * programmed. */
+uint64_t apic_timer_oneshot(uint64_t nticks);
+
+/* Restarts the periodic timer after apic_timer_oneshot() programmed nticks
+ * periods, and returns how many periods have passed since, to the nearest. */
+uint64_t apic_timer_resume_periodic(uint64_t nticks);
+
 /* Sets the interrupt to raise when a spurious
  * interrupt occurs. */
 void apic_setspur(uint8_t intr);
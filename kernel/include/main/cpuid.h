@@ -33,6 +33,7 @@ enum
     CPUID_FEAT_ECX_CX16 = 1 << 13,
     CPUID_FEAT_ECX_ETPRD = 1 << 14,
     CPUID_FEAT_ECX_PDCM = 1 << 15,
+    CPUID_FEAT_ECX_PCID = 1 << 17,
     CPUID_FEAT_ECX_DCA = 1 << 18,
     CPUID_FEAT_ECX_SSE4_1 = 1 << 19,
     CPUID_FEAT_ECX_SSE4_2 = 1 << 20,
@@ -75,6 +76,19 @@ enum
     CPUID_FEAT_EDX_PBE = 1 << 31
 };
 
+/* Leaf 7, subleaf 0: structured extended features */
+#define CPUID_EXTFEATURES 7
+
+enum
+{
+    CPUID_FEAT_EBX_TSC_ADJUST = 1 << 1,
+    CPUID_FEAT_EBX_ERMS = 1 << 9,
+};
+
+/* The TSC, and the adjustment added to it (if CPUID_FEAT_EBX_TSC_ADJUST) */
+#define MSR_TSC 0x10
+#define MSR_TSC_ADJUST 0x3b
+
 enum cpuid_requests
 {
     CPUID_GETVENDORSTRING,
@@ -97,6 +111,15 @@ static inline void cpuid(int request, uint32_t *a, uint32_t *b, uint32_t *c,
                      : "0"(request));
 }
 
+/* For the leaves which have subleaves, selected by %ecx */
+static inline void cpuid_count(int request, int count, uint32_t *a,
+                               uint32_t *b, uint32_t *c, uint32_t *d)
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                     : "0"(request), "2"(count));
+}
+
 static inline void cpuid_get_msr(uint32_t msr, uint32_t *lo, uint32_t *hi)
 {
     __asm__ volatile("rdmsr"
@@ -109,6 +132,13 @@ static inline void cpuid_set_msr(uint32_t msr, uint32_t lo, uint32_t hi)
     __asm__ volatile("wrmsr" ::"a"(lo), "d"(hi), "c"(msr));
 }
 
+static inline uint64_t cpuid_rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 static inline void io_wait(void)
 {
     __asm__ volatile(
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * FPU, SSE and AVX state is switched lazily: a thread that has not touched
+ * the FPU since it last ran on this core runs with CR0.TS set, and the state
+ * of the thread that last used it stays in the registers until then. Its
+ * first FPU instruction traps (#NM) into fpu_trap(), which saves the previous
+ * owner's state and loads the thread's own. Threads that never use the FPU
+ * never have a save area, and switching between them costs nothing. The
+ * kernel itself is built without FPU or SSE instructions.
+ */
+
+struct kthread;
+
+/* Creates the allocator for save areas */
+void fpu_init();
+
+/* Enables the FPU, SSE and, where the processor has them, XSAVE and AVX on
+ * the current core, with CR0.TS set */
+void fpu_core_init();
+
+/* Called by core_switch() for the thread leaving the CPU */
+void fpu_switch_out(struct kthread *thr);
+
+/* Called by core_switch() for the thread about to run */
+void fpu_switch_in(struct kthread *thr);
+
+/* Drops the thread's FPU state; its next FPU instruction starts it afresh */
+void fpu_release(struct kthread *thr);
@@ -7,8 +7,10 @@
 #define GDT_ZERO 0x00
 #define GDT_KERNEL_TEXT 0x08
 #define GDT_KERNEL_DATA 0x10
-#define GDT_USER_TEXT 0x18
-#define GDT_USER_DATA 0x20
+/* sysret loads the user data segment from the entry after the kernel data
+ * segment, and the user text segment from the one after that */
+#define GDT_USER_DATA 0x18
+#define GDT_USER_TEXT 0x20
 #define GDT_TSS 0x28
 
 void gdt_init(void);
@@ -1,15 +1,27 @@
 #pragma once
 
+extern void string_init();
+
 extern void sched_init();
 
 extern void kshell_init();
 
 extern void file_init();
 
+extern void fdtable_init();
+
 extern void pipe_init();
 
+extern void epoll_init();
+
+extern void futex_init();
+
 extern void vfs_init();
 
 extern void syscall_init();
 
+extern void syscall_core_init();
+
 extern void elf64_init(void);
+
+extern void vdso_init();
@@ -17,6 +17,8 @@
 #define INTR_SPURIOUS 0xfe
 #define INTR_APICERR 0xff
 #define INTR_SHUTDOWN 0xfd
+#define INTR_TLB_SHOOTDOWN 0xfc /* above IPL_HIGH; see mm/tlb.c */
+#define INTR_RESCHEDULE 0xfb    /* see proc/sched.c */
 
 /* NOTE: INTR_SYSCALL is not defined here, but is in syscall.h (it must be
  * in a userland-accessible header) */
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+/*
+ * Always-on interrupt statistics: how often each interrupt vector was taken
+ * on each core, and how long its handler ran, in TSC cycles, from
+ * interrupt_handler() calling it to its return. Handlers that switched
+ * threads before returning (a system call that slept, a preempting timer
+ * tick) are counted but not timed, since their time is not the handler's.
+ * Statistics are kept for the first INTR_STATS_VECTORS vectors that get a
+ * handler.
+ *
+ * Also kept, per core, is how long the core's IPL was raised above IPL_LOW
+ * with intr_setipl(), and where the longest such window was opened; those are
+ * what delay the interrupts that would wake or preempt a thread. Sections run
+ * with interrupts disabled by cli are not covered.
+ *
+ * Times are also counted in histograms by their log2. Like system call
+ * statistics (see api/syscall_stats.h), the counters are kept per core and
+ * summed when read; see the kshell command "intrstat".
+ */
+typedef struct intr_stats
+{
+    uint64_t in_count;
+    uint64_t in_timed; /* those of in_count that were timed */
+    uint64_t in_cycles;
+    uint64_t in_max_cycles;
+    /* handlers that took [2^i, 2^(i + 1)) cycles; the last bucket also
+     * counts any that took longer */
+    uint64_t in_hist[INTR_HIST_BUCKETS];
+} intr_stats_t;
+
+typedef struct ipl_stats
+{
+    uint64_t ip_raised; /* times the IPL was raised from IPL_LOW */
+    uint64_t ip_cycles;
+    uint64_t ip_max_cycles;
+    void *ip_max_site; /* caller of the intr_setipl() that raised it */
+    /* as in_hist above, for the times the IPL stayed raised */
+    uint64_t ip_hist[INTR_HIST_BUCKETS];
+} ipl_stats_t;
+
+/**
+ * Returns the number of interrupt vectors statistics are kept for; they are
+ * numbered from 0.
+ */
+size_t intr_stats_count();
+
+/**
+ * Returns the interrupt vector of statistics number i, which must be below
+ * intr_stats_count().
+ */
+uint8_t intr_stats_vector(size_t i);
+
+/**
+ * Gets the statistics of vector number i on a core, or summed over every core
+ * if core is -1.
+ */
+void intr_stats_get(size_t i, long core, intr_stats_t *stats);
+
+/**
+ * Gets the IPL statistics of a core, or summed over every core if core is -1;
+ * the longest window is then the longest on any core.
+ */
+void ipl_stats_get(long core, ipl_stats_t *stats);
+
+/**
+ * Zeroes the interrupt and IPL statistics, on every core.
+ */
+void intr_stats_reset();
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * NUMA topology, from the ACPI SRAT (which memory and which cores belong to
+ * which proximity domain) and SLIT (how far apart the domains are). Domains
+ * are numbered here as nodes from 0, in the order the SRAT names them; at
+ * most NUMA_MAX_NODES are told apart, and the rest are taken as the last.
+ * Without an SRAT, or before numa_init(), everything is node 0.
+ *
+ * The page allocator takes memory from the allocating core's node first,
+ * then from the others, nearest first (see mm/page.c).
+ */
+
+/* A range of physical memory on a node, in page frame numbers */
+typedef struct numa_range
+{
+    uintptr_t nr_start;
+    uintptr_t nr_end; /* exclusive */
+    long nr_node;
+} numa_range_t;
+
+void numa_init();
+
+/**
+ * Returns the number of nodes, 1 without NUMA.
+ */
+long numa_nnodes();
+
+/**
+ * Returns the node of the core with the given local APIC id.
+ */
+long numa_core_node(long apic_id);
+
+/**
+ * Returns the node physical address paddr is on, or -1 if the SRAT does not
+ * say.
+ */
+long numa_paddr_node(uintptr_t paddr);
+
+/**
+ * Returns the SLIT distance between two nodes, 10 from a node to itself.
+ */
+long numa_distance(long from, long to);
+
+/**
+ * Returns the nodes, nearest to node first (node itself), in an array of
+ * numa_nnodes().
+ */
+const long *numa_fallback(long node);
+
+/**
+ * Returns the memory ranges of every node, sorted by address, and sets
+ * *countp to how many there are.
+ */
+const numa_range_t *numa_ranges(size_t *countp);
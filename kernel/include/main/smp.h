@@ -1,4 +1,7 @@
+#pragma once
+
 #include "boot/config.h"
+#include "kernel.h"
 #include "mm/page.h"
 #include "proc/core.h"
 
@@ -8,12 +11,100 @@
 // threads, (mutex or spinlock) (SMP.4) other cores' interrupt handlers
 // (spinlock) mask interrupts + spinlock covers all 4 cases!
 
-#define GET_CSD(core, type, name) \
-    ((type *)(csd_vaddr_table[(core)] + PAGE_OFFSET(&(name))))
+/*
+ * Core-specific data is reached through the GS segment. Each core has its own
+ * copy of the .csd section, allocated by core_init() and recorded in
+ * csd_vaddr_table; as it is in the physmap it is mapped in every address
+ * space, and the core's GS base points at it. Neither switching address
+ * spaces nor moving a thread to another core touches a page table.
+ *
+ * The copy starts with a csd_head_t, which holds the copy's own address, for
+ * turning the link address of a core-specific variable into its address in
+ * the copy (see CSD()), and the values the entry paths and the scheduler need
+ * most, each a single %gs-relative load away.
+ *
+ * While the kernel runs, GS holds its base; userland's is kept in
+ * KERNEL_GS_BASE, and the two are exchanged with swapgs on every entry from
+ * and exit to userland.
+ */
+typedef struct csd_head
+{
+    uintptr_t ch_base;          /* this copy */
+    struct kthread *ch_thr;     /* curthr */
+    struct proc *ch_proc;       /* curproc */
+    uintptr_t ch_kernel_stack;  /* see gdt_set_kernel_stack() */
+    uintptr_t ch_user_rsp;      /* userland's rsp, in syscall_entry */
+} csd_head_t;
+
+/* Offsets of the fields above, for assembly */
+#define CSD_HEAD_BASE 0
+#define CSD_HEAD_THR 8
+#define CSD_HEAD_PROC 16
+#define CSD_HEAD_KERNEL_STACK 24
+#define CSD_HEAD_USER_RSP 32
+
+static inline csd_head_t *csd_head()
+{
+    csd_head_t *head;
+    __asm__ volatile("movq %%gs:" QUOTE_BY_VALUE(CSD_HEAD_BASE) ", %0"
+                     : "=r"(head));
+    return head;
+}
+
+static inline struct kthread *csd_curthr()
+{
+    struct kthread *thr;
+    __asm__ volatile("movq %%gs:" QUOTE_BY_VALUE(CSD_HEAD_THR) ", %0"
+                     : "=r"(thr));
+    return thr;
+}
+
+static inline struct proc *csd_curproc()
+{
+    struct proc *proc;
+    __asm__ volatile("movq %%gs:" QUOTE_BY_VALUE(CSD_HEAD_PROC) ", %0"
+                     : "=r"(proc));
+    return proc;
+}
+
+/* Sets curthr; only the scheduler should */
+static inline void csd_set_curthr(struct kthread *thr)
+{
+    __asm__ volatile("movq %0, %%gs:" QUOTE_BY_VALUE(CSD_HEAD_THR)::"r"(thr)
+                     : "memory");
+}
+
+/* Sets curproc; only the scheduler should */
+static inline void csd_set_curproc(struct proc *proc)
+{
+    __asm__ volatile("movq %0, %%gs:" QUOTE_BY_VALUE(CSD_HEAD_PROC)::"r"(proc)
+                     : "memory");
+}
+
+/*
+ * The current core's copy of the core-specific variable name. Core-specific
+ * variables are #defined to this right after they are declared, so that they
+ * can be used as if they were ordinary variables.
+ */
+#define CSD(name)                                    \
+    (*(__typeof__(&(name)))((uintptr_t)csd_head() + \
+                            ((uintptr_t)&(name) -    \
+                             (uintptr_t)&csd_start)))
+
+// name is the core-specific variable, as used on the current core
+#define GET_CSD(core, type, name)        \
+    ((type *)(csd_vaddr_table[(core)] + \
+              ((uintptr_t)&(name) - (uintptr_t)csd_head())))
 
+extern void *csd_start;
 extern uintptr_t csd_vaddr_table[];
 
-void map_in_core_specific_data(pml4_t *pml4);
+/**
+ * Points the current core's GS base at the kernel image's copy of the
+ * core-specific data, so that it can be used until core_init() gives the core
+ * a copy of its own. Called first thing on every core.
+ */
+void csd_boot_init();
 
 void smp_init();
 
@@ -2,6 +2,9 @@
 
 #include "types.h"
 
+/* The largest size kmalloc() serves; see vmalloc.h for bigger ones */
+#define KMALLOC_MAX_SIZE (1UL << 18)
+
 void *kmalloc(size_t size);
 
 void kfree(void *addr);
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "types.h"
+
+struct pframe;
+struct proc;
+
+/*
+ * Memory groups.
+ *
+ * Every process belongs to a memory group, inheriting its parent's; group 0,
+ * the root, is where everything starts and has no limit. Each pframe's page
+ * is charged to the group of the process that brought it in, when it is
+ * allocated (an anonymous or shadow page on first touch, a file or block page
+ * when it is read in or read ahead), and uncharged when it is freed, evicted
+ * or swapped out. It stays charged to that group wherever else it ends up
+ * mapped, and when its process moves to another group.
+ *
+ * A group with a limit never has more pages than that: a charge that would go
+ * over it first reclaims the group's own least recently used pages (see
+ * reclaim_group_pages()), and fails with -ENOMEM if they cannot be, so that
+ * a group that outgrows its limit pages against itself rather than pushing
+ * everyone else's pages out, and faults fail in it rather than elsewhere.
+ *
+ * Groups also share out each disk's time, in proportion to their I/O weights,
+ * and set how long their requests may wait in its queue; see the "fair"
+ * policy in drivers/iosched.h.
+ *
+ * There are MEMGROUP_MAX groups at most, made and set up with the memgroup()
+ * system call (see memgroup_args_t) and listed in /proc/memgroups.
+ */
+
+#define MEMGROUP_ROOT 0
+
+/**
+ * Charges the page about to be allocated for the locked pframe pf, of mobj
+ * pf->pf_obj, to curproc's group. If that would take the group over its limit
+ * and reclaim is set, the group's pages are reclaimed to make room; the
+ * caller may hold locks on mobjs and pframes, as for reclaim_pages().
+ *
+ * @return 0 on success, or -ENOMEM if the group is at its limit
+ */
+long memgroup_charge(struct pframe *pf, long reclaim);
+
+/**
+ * Uncharges the page of pf, which has been charged, as it is freed (or was
+ * not allocated after all).
+ */
+void memgroup_uncharge(struct pframe *pf);
+
+/**
+ * Makes a new process proc a member of curproc's group.
+ */
+void memgroup_proc_init(struct proc *proc);
+
+/**
+ * Takes a destroyed process out of its group.
+ */
+void memgroup_proc_exit(struct proc *proc);
+
+/**
+ * Makes a group with a limit of limit pages, 0 for none.
+ *
+ * @return the group's id, or -ENOSPC if there are MEMGROUP_MAX already
+ */
+long memgroup_create(size_t limit);
+
+/**
+ * Removes a group that no process belongs to anymore, reclaiming the pages
+ * still charged to it.
+ *
+ * @return 0 on success, -EINVAL if there is no such group (or it is the root),
+ *  or -EBUSY if processes belong to it or its pages cannot all be reclaimed
+ */
+long memgroup_destroy(long id);
+
+/**
+ * Sets the limit of a group, in pages, 0 for none. A limit lower than what
+ * the group holds reclaims pages down to it, as far as it can.
+ *
+ * @return 0 on success, or -EINVAL if there is no such group (or it is the
+ *  root)
+ */
+long memgroup_set_limit(long id, size_t limit);
+
+/**
+ * Moves proc to group id. The pages it has brought in so far stay charged to
+ * its old group.
+ *
+ * @return 0 on success, or -EINVAL if there is no such group
+ */
+long memgroup_move(struct proc *proc, long id);
+
+/**
+ * Sets a group's I/O weight, from 1 to IOSCHED_WEIGHT_MAX, and latency target,
+ * 0 for the defaults (IOSCHED_WEIGHT_DEFAULT and IOSCHED_LATENCY_MS).
+ *
+ * @return 0 on success, or -EINVAL if there is no such group or the weight is
+ *  out of range
+ */
+long memgroup_set_io(long id, unsigned weight, unsigned latency_ms);
+
+/**
+ * Return a group's I/O weight and latency target, for the I/O scheduler; may
+ * be called from interrupt context.
+ */
+unsigned memgroup_io_weight(long id);
+unsigned memgroup_io_latency_ms(long id);
+
+/**
+ * Prints every group's limit, usage and counters, a line per group.
+ */
+size_t memgroup_info(const void *arg, char *buf, size_t size);
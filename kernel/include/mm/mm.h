@@ -6,3 +6,7 @@
 
 #define USER_MEM_LOW 0x00400000   /* inclusive */
 #define USER_MEM_HIGH (1UL << 47) /* exclusive */
+
+/* The vmalloc() area: one PML4 entry, shared by every page table */
+#define VMALLOC_START 0xffffc90000000000UL /* inclusive */
+#define VMALLOC_END (VMALLOC_START + (1UL << 39)) /* exclusive */
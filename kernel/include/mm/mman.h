@@ -23,3 +23,18 @@
  */
 #define MAP_FIXED 4
 #define MAP_ANON 8
+#define MAP_POPULATE 16 /* fault the whole mapping in up front */
+
+/* Advice for madvise().
+ */
+#define MADV_NORMAL 0     /* No special treatment. */
+#define MADV_RANDOM 1     /* Expect random access: no fault-around. */
+#define MADV_SEQUENTIAL 2 /* Expect sequential access: read ahead of faults. */
+#define MADV_WILLNEED 3   /* Will need these pages: start reading them. */
+#define MADV_DONTNEED 4   /* Done with these pages: drop private copies. */
+
+/* Flags for msync().
+ */
+#define MS_ASYNC 1      /* Schedule the writes and return. */
+#define MS_INVALIDATE 2 /* Invalidate other copies (nothing to do here). */
+#define MS_SYNC 4       /* Write and wait for the writes to finish. */
@@ -1,8 +1,11 @@
 #pragma once
 
 #include "proc/kmutex.h"
+#include "proc/spinlock.h"
 #include "util/atomic.h"
+#include "util/percpu.h"
 #include "util/list.h"
+#include "util/radix.h"
 struct pframe;
 
 struct mobj;
@@ -13,6 +16,8 @@ typedef enum
     MOBJ_SHADOW,
     MOBJ_ANON,
     MOBJ_BLOCKDEV,
+    MOBJ_VDSO,
+    MOBJ_DEVICE,
 } mobj_type_t;
 
 typedef struct mobj_ops
@@ -32,8 +37,27 @@ typedef struct mobj
     long mo_type;
     struct mobj_ops mo_ops;
     atomic_t mo_refcount;
-    list_t mo_pframes;
+    pcpu_counter_t mo_pcpu_refs; /* references counted per core, if it has
+                                  * slots; see mobj_refs_percpu() */
+    list_t mo_pframes;          /* resident pframes, for flush/destruction */
+    radix_tree_t mo_pframe_idx; /* pf_pagenum -> pframe, for lookups */
+    radix_tree_t mo_swap_idx;   /* page number -> swap slot, for anonymous
+                                 * and shadow pages (see vm/swap.h) */
     kmutex_t mo_mutex;
+
+    /* Dirty pframes, least recently dirtied first, for writeback. Protected
+     * by mo_dirty_lock rather than mo_mutex so that pframes can be cleaned
+     * without the mobj being locked. May hold pframes that have since been
+     * cleaned some other way. */
+    list_t mo_dirty;
+    spinlock_t mo_dirty_lock;
+
+    /* The reverse map: the areas whose shadow chains end at this object
+     * (see shadow_bottom()), which are all those that can map its pages or
+     * those of the shadow objects above it. Protected by mo_vmas_lock; see
+     * vmmap_unmap_pframe(). */
+    list_t mo_vmas;
+    spinlock_t mo_vmas_lock;
 } mobj_t;
 
 void mobj_init(mobj_t *o, long type, mobj_ops_t *ops);
@@ -44,10 +68,36 @@ void mobj_unlock(mobj_t *o);
 
 void mobj_ref(mobj_t *o);
 
+/**
+ * Takes a reference to an object unless it has none left, and is going
+ * away; returns whether it did. For finding objects that may be being torn
+ * down, without a lock keeping them alive.
+ */
+long mobj_ref_not_zero(mobj_t *o);
+
 void mobj_put(mobj_t **op);
 
 void mobj_put_locked(mobj_t **op);
 
+/**
+ * Has an object's references counted per core (util/percpu.h) from now on,
+ * for an object that lives long and is referred to from every core, such as
+ * the root directory. Its mo_refcount keeps a reference of its own
+ * meanwhile, and holds only part of the count, so it never drops to 0, and
+ * is not to be compared with anything else.
+ *
+ * @return 0 on success, or -ENOMEM if there are no per-core slots left, in
+ *  which case the references go on being counted in mo_refcount
+ */
+long mobj_refs_percpu(mobj_t *o);
+
+/**
+ * Counts an object's references in mo_refcount again, which then holds all
+ * of them. Nobody else may take or drop references to it meanwhile; the
+ * caller must hold one.
+ */
+void mobj_refs_atomic(mobj_t *o);
+
 long mobj_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
                      struct pframe **pfp);
 
@@ -59,7 +109,18 @@ long mobj_flush(mobj_t *o);
 
 long mobj_free_pframe(mobj_t *o, struct pframe **pfp);
 
+long mobj_free_pframes(mobj_t *o);
+
 long mobj_default_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
                              struct pframe **pfp);
 
+long mobj_start_fill_pframe(mobj_t *o, uint64_t pagenum, struct pframe **pfp);
+
+void mobj_clean_pframe(mobj_t *o, struct pframe *pf);
+
+size_t mobj_collect_dirty(mobj_t *o, uint64_t dirtied_before,
+                          struct pframe **pfs, size_t max);
+
+size_t mobj_dirty_count();
+
 void mobj_default_destructor(mobj_t *o);
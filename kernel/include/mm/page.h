@@ -112,12 +112,77 @@ void *page_alloc_n_bounded(size_t npages, void *max_paddr);
 
 void page_free_n(void *start, size_t npages);
 
+/* Allocate npages from the memory of a NUMA node (see main/numa.h), or the
+ * nearest one with room, for structures a core other than the caller will
+ * use, or that the caller sets up before page_pcp_init(). Other allocations
+ * are taken from the allocating core's node, or the nearest one, already.
+ * Free them with page_free_n(). */
+void *page_alloc_n_node(size_t npages, long node);
+
+/* Allocate and free a page whose contents can be moved elsewhere, i.e. the
+ * page of a pframe (see reclaim_migrate_page()). Movable pages are taken from
+ * the top of memory and everything else from the bottom, so that pages that
+ * can never move stay out of the way of page_compact(). */
+void *page_alloc_movable();
+
+void page_free_movable(void *addr);
+
+/* Tries to make a free block of npages (up to 512) pages by moving the
+ * pframes out of one, so that page_alloc_n(npages) can succeed again once
+ * memory has fragmented. Returns 1 if such a block was freed. Locks mobjs and
+ * pframes, and flushes the TLBs, so it must be called from a thread with
+ * interrupts enabled and no spinlocks held; allocations that fail elsewhere
+ * leave it to the reclaim thread (see reclaim_compact_kick()). */
+long page_compact(size_t npages);
+
 void page_add_range(void *start, void *end);
 
+/* A batch of single pages to be freed together, chained through their first
+ * words, for tearing down whole address spaces: page_batch_flush() returns
+ * them to the allocator in one trip, rather than one page_free() at a time.
+ * Pages added to a batch must no longer be in use; they are not counted as
+ * free until the batch is flushed. */
+typedef struct page_batch
+{
+    void *pb_head;
+    size_t pb_count;
+} page_batch_t;
+
+#define PAGE_BATCH_INITIALIZER \
+    {                          \
+        .pb_head = NULL,       \
+        .pb_count = 0,         \
+    }
+
+void page_batch_add(page_batch_t *batch, void *page);
+
+void page_batch_flush(page_batch_t *batch);
+
+/* Zero the page at page, or copy the page at src to dest, all of which
+ * must be page-aligned. Faster than memset() and memcpy(), as they know the
+ * size and alignment. */
+void page_zero(void *page);
+
+void page_copy(void *dest, const void *src);
+
+/* Allocates a zeroed page, from the pool that idle cores fill with
+ * page_zero_idle() if it has one. Free it with page_free(). */
+void *page_alloc_zeroed();
+
+/* Called by an idle core with interrupts disabled: zeroes one page for the
+ * pool, if it is not full and memory is not short. Returns 1 if it did, in
+ * which case the core should look for work again before sleeping. */
+long page_zero_idle();
+
 void page_mark_reserved(void *paddr);
 
 void page_init_finish();
 
+/* Enables the calling core's page magazines, which cache small free blocks
+ * in front of the global allocator. Called from core_init() once the core's
+ * core-specific data has been mapped in. */
+void page_pcp_init();
+
 /* Returns the number of free pages remaining in the
  * system. Note that calls to page_alloc_n(npages) may
  * fail even if page_free_count() >= npages. */
@@ -13,6 +13,10 @@
 #define PT_SIZE 0x080
 #define PT_GLOBAL 0x100
 
+/* Once pt_pat_init() has run, PT_WRITE_THROUGH alone selects write-combining
+ * rather than write-through caching; for framebuffers (see fbdev.h) */
+#define PT_WRITE_COMBINING PT_WRITE_THROUGH
+
 #define PT_ENTRY_COUNT (PAGE_SIZE / sizeof(uintptr_t))
 
 typedef struct page
@@ -75,6 +79,16 @@ pml4_t *pt_get();
 
 void pt_set(pml4_t *pml4);
 
+void pt_pcid_init();
+
+/* Makes this core's page attribute table entry 1 write-combining; see
+ * PT_WRITE_COMBINING. */
+void pt_pat_init();
+
+/* Drops the PCID this core has tagged the page table at physical address
+ * phys_addr with, if any, so that loading it next flushes its TLB entries. */
+void pt_pcid_forget(uintptr_t phys_addr);
+
 pml4_t *clone_pml4(pml4_t *pml4, long include_user_mappings);
 
 pml4_t *pt_create();
@@ -89,6 +103,45 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
 
 void pt_unmap(pml4_t *pml4, uintptr_t vaddr);
 
-void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax);
+/*
+ * Unmaps [vaddr, vmax). If reclaim is given, the range must be in the user
+ * half, and the page-table pages it leaves empty are taken out of the page
+ * table as well and added to the batch. Cores may still walk them through
+ * their paging-structure caches until the range has been shot down, so
+ * flush the batch only after the tlb_shootdown() for it.
+ */
+void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax,
+                    page_batch_t *reclaim);
+
+/*
+ * Copies the present user mappings of [vaddr, vmax) from src into dst,
+ * pointing at the same pages. If cow is set, they are made read-only in both,
+ * so that the next write through either faults and gets its own copy; the
+ * caller must flush src's TLB. Returns 0, or -ENOMEM, in which case some
+ * mappings may have been copied.
+ */
+long pt_copy_range(pml4_t *dst, pml4_t *src, uintptr_t vaddr, uintptr_t vmax,
+                   long cow);
+
+/*
+ * Returns the number of pages mapped in [vaddr, vmax) of a user address
+ * space, i.e. its resident set size there.
+ */
+size_t pt_count_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax);
+
+#ifdef __VM__
+/*
+ * Unmaps the user page at vaddr if it maps the physical page paddr. Returns 1
+ * if it did, 0 otherwise; the caller must flush the TLB.
+ */
+long pt_unmap_phys(pml4_t *pml4, uintptr_t vaddr, uintptr_t paddr);
+#endif
+
+/*
+ * Clears the dirty bit of the user page mapped at vaddr. Returns the entry as
+ * it was, or 0 if nothing is mapped there; the caller must flush the TLB, or
+ * writes through cached entries will not set the bit again.
+ */
+uintptr_t pt_test_and_clear_dirty(pml4_t *pml4, uintptr_t vaddr);
 
 void check_invalid_mappings(pml4_t *pml4, vmmap_t *vmmap, char *prompt);
@@ -1,22 +1,114 @@
 #pragma once
 
 #include "mm/mobj.h"
-#include "proc/kmutex.h"
 #include "types.h"
 
+struct kthread;
+
+/*
+ * There is one pframe per cached page, so it is kept small: the flags are
+ * bytes, and rather than a kmutex_t of its own, a pframe is locked by
+ * recording its holder in pf_holder, with threads waiting for it sleeping on
+ * one of a few wait queues shared by all pframes (see pframe_lock()).
+ */
 typedef struct pframe
 {
     size_t pf_pagenum;
-    void *pf_addr;
-    long pf_dirty;
-    kmutex_t pf_mutex;
+    void *pf_addr; /* set with pframe_set_page() */
+    struct kthread *pf_holder; /* thread that has it locked, or NULL */
     list_link_t pf_link;
+
+    /* Writeback: link on the mobj's mo_dirty, and when the pframe was put
+     * there (in jiffies) */
+    list_link_t pf_dirty_link;
+    uint64_t pf_dirtied;
+
+    /* Number of uncommitted journal transactions (see s5fs_journal.c) that
+     * hold the page's changes back from the disk; a pinned dirty page is not
+     * written back or evicted. Protected by the pframe's lock. */
+    int pf_pinned;
+
+    int pf_fill_error; /* error of the last asynchronous fill, if it failed */
+
+    /* Shared references held by readers; see pframe_share() */
+    int pf_refs;
+
+    /* Reclaim: the owning mobj, and link on the global active or inactive
+     * list while resident (see mm/reclaim.c) */
+    mobj_t *pf_obj;
+    list_link_t pf_lru_link;
+
+    uint8_t pf_dirty;
+    uint8_t pf_filling;    /* set while an asynchronous fill is in flight */
+    uint8_t pf_active;     /* on the active rather than the inactive list */
+    uint8_t pf_referenced; /* used since reclaim last scanned it */
+    uint8_t pf_waiters;    /* threads are waiting for the lock */
+    uint8_t pf_group;      /* memory group the page is charged to */
 } pframe_t;
 
 void pframe_init();
 
+/*
+ * Lock and unlock a pframe. Like a kmutex, the lock is held across sleeps and
+ * not recursive, but it lends no priority to its holder.
+ */
+void pframe_lock(pframe_t *pf);
+
+void pframe_unlock(pframe_t *pf);
+
+/* Whether the current thread holds the pframe's lock */
+long pframe_owned(pframe_t *pf);
+
+/* Whether anyone holds the pframe's lock; only a hint, unless the caller
+ * holds something that keeps it from being taken */
+#define pframe_locked(pf) ((pf)->pf_holder != NULL)
+
+/*
+ * Shared references, for readers. pframe_share() turns a locked pframe into
+ * a referenced one, and unlocks it; pframe_put() drops the reference and sets
+ * *pfp = NULL. While it is referenced, a pframe is neither evicted nor freed
+ * (mobj_free_pframe() fails with -EBUSY), so its page stays put with the
+ * same contents, and any number of threads can read it at once. Filling,
+ * flushing, dirtying or freeing it still takes the lock.
+ *
+ * A pframe's contents may only be written while no one reads them, so
+ * readers must hold whatever keeps writers out, such as the vnode shared
+ * (see vlock_shared()).
+ */
+void pframe_share(pframe_t *pf);
+
+void pframe_put(pframe_t **pfp);
+
+/*
+ * Sets the page holding a locked pframe's contents, which must come from the
+ * page allocator, or NULL once it has been given back. The frame's page
+ * descriptor then leads back to the pframe; see pframe_of_page().
+ */
+void pframe_set_page(pframe_t *pf, void *addr);
+
+/*
+ * Returns the pframe whose contents are in the page at addr, a page from the
+ * page allocator, or NULL if the page holds no pframe's contents. Looking it
+ * up is a single array access, by frame number.
+ */
+pframe_t *pframe_of_page(void *addr);
+
 pframe_t *pframe_create();
 
 void pframe_release(pframe_t **pfp);
 
 void pframe_free(pframe_t **pfp);
+
+/*
+ * Asynchronous fills, for readahead: a pframe is marked as filling, has I/O
+ * started into pf_addr, and is released. Whoever gets it next must first wait
+ * for pframe_fill_done() with pframe_wait_fill().
+ */
+
+void pframe_fill_start(pframe_t *pf);
+
+/* May be called from interrupt context. */
+void pframe_fill_done(pframe_t *pf, long error);
+
+/* Returns the fill's error (pf_fill_error). The pframe must be locked. */
+long pframe_wait_fill(pframe_t *pf);
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "types.h"
+
+#include "mm/pframe.h"
+
+/*
+ * Page reclaim.
+ *
+ * Every resident pframe whose contents can be read back again (those of vnode
+ * and block device mobjs, and with swap those of anonymous and shadow mobjs;
+ * see vm/swap.h) is on one of two global lists, approximating LRU across all
+ * mobjs:
+ *  - inactive: pages brought in but used only once since, e.g. by a
+ *    sequential read or readahead; evicted from the tail
+ *  - active: pages used again while inactive; demoted back to the inactive
+ *    list when it becomes the smaller of the two
+ * Getting a pframe only sets pf_referenced; pages are moved between the lists
+ * by the reclaim scan, which gives referenced pages a second chance.
+ *
+ * When page_alloc() leaves fewer than RECLAIM_LOW_PAGES pages free, it wakes
+ * the reclaim thread, which evicts pages until RECLAIM_HIGH_PAGES are free.
+ * Clean pages are evicted first; dirty ones are left to the writeback thread
+ * unless nothing else can be reclaimed, in which case they are written back
+ * and evicted. If the page cache cannot give back enough, the thread then
+ * reclaims from the slab allocators (see slab_allocators_reclaim()), whose
+ * shrinkers drop cached objects. Finally, if a page allocation has failed and
+ * fewer than RECLAIM_OOM_PAGES pages are still free, it kills the process
+ * with the most resident pages (with RECLAIM_OOM_KILL), one at a time.
+ * Allocating a pframe's page also reclaims directly if memory has run out
+ * entirely.
+ *
+ * When a multi-page allocation fails, the thread also compacts memory (see
+ * page_compact()), moving pframes out of the way to make a free block of the
+ * size that was wanted.
+ */
+
+/**
+ * Puts a locked pframe, whose page has just been allocated, on the inactive
+ * list. Does nothing for pframes of mobjs that cannot be reclaimed.
+ */
+void reclaim_lru_add(pframe_t *pf);
+
+/**
+ * Takes a locked pframe off the lists before its page is freed.
+ */
+void reclaim_lru_remove(pframe_t *pf);
+
+/**
+ * Marks a pframe as used.
+ */
+static inline void reclaim_lru_touch(pframe_t *pf) { pf->pf_referenced = 1; }
+
+/**
+ * Evicts up to target resident pages. Busy mobjs and pframes are skipped
+ * rather than waited for, so this may be called with mobjs and pframes
+ * locked.
+ *
+ * @return the number of pages freed
+ */
+size_t reclaim_pages(size_t target);
+
+/**
+ * Evicts up to target resident pages charged to memory group id (see
+ * mm/memgroup.h), least recently used first, leaving every other page where
+ * it is. Called like reclaim_pages().
+ *
+ * @return the number of pages freed
+ */
+size_t reclaim_group_pages(long id, size_t target);
+
+/**
+ * Called by page_alloc() when few pages are free; wakes the reclaim thread.
+ * May be called from interrupt context.
+ */
+void reclaim_kick();
+
+/**
+ * Called by page_alloc() when it fails; wakes the reclaim thread, which may
+ * then kill a process. May be called from interrupt context.
+ */
+void reclaim_alloc_failed();
+
+/**
+ * Called by page_alloc_n() when an allocation of npages pages fails; has the
+ * reclaim thread compact memory. May be called from interrupt context.
+ */
+void reclaim_compact_kick(size_t npages);
+
+/**
+ * Compacts memory directly, for callers that can (see page_compact()).
+ *
+ * @return 1 if a free block of npages pages was made
+ */
+long reclaim_compact(size_t npages);
+
+/**
+ * Moves the contents of the pframe holding page, which must be on the lists,
+ * to a new movable page, unmapping it from every process so that the next
+ * fault maps the new page. Busy mobjs and pframes are skipped, as by
+ * reclaim_pages(). On success, page is the caller's, rather than freed.
+ *
+ * @return 0 on success, -EBUSY if the pframe is busy or cannot be moved, or
+ *  -ENOMEM
+ */
+long reclaim_migrate_page(void *page);
+
+/* What each stage of reclaim has done since boot */
+typedef struct reclaim_stats
+{
+    size_t rs_free;       /* free pages now */
+    size_t rs_active;     /* pages on the active list now */
+    size_t rs_inactive;   /* pages on the inactive list now */
+    size_t rs_scanned;    /* page cache: pages looked at */
+    size_t rs_evicted;    /* page cache: pages evicted */
+    size_t rs_written;    /* page cache: dirty pages written to be evicted */
+    size_t rs_failures;   /* page allocations that failed */
+    size_t rs_slab_runs;  /* slab: times the caches were shrunk */
+    size_t rs_slab_pages; /* slab: pages given back */
+    size_t rs_oom_kills;  /* processes killed */
+    size_t rs_oom_pages;  /* resident pages of the processes killed */
+    size_t rs_compact_runs;   /* compaction: times it was tried */
+    size_t rs_compact_blocks; /* compaction: free blocks made */
+    size_t rs_migrated;       /* compaction: pages moved */
+} reclaim_stats_t;
+
+void reclaim_stats_get(reclaim_stats_t *stats);
+
+/**
+ * Starts the reclaim thread.
+ */
+void reclaim_start();
+
+/**
+ * Stops the reclaim thread, before the filesystems it evicts from go away.
+ */
+void reclaim_stop();
@@ -2,6 +2,8 @@
 
 #include <types.h>
 
+#include "util/list.h"
+
 /* Define SLAB_REDZONE to add top and bottom redzones to every object. */
 #define SLAB_REDZONE 0xdeadbeefdeadbeef
 
@@ -9,6 +11,11 @@
  * are no double frees. */
 #define SLAB_CHECK_FREE
 
+#define SLAB_CACHE_LINE_SIZE 64
+
+/* Flags for slab_allocator_create_flags() */
+#define SLAB_CACHE_ALIGN 0x1 /* objects start on, and fill, whole cache lines */
+
 /*
  * The slab allocator. A "cache" is a store of objects; you create one by
  * specifying a constructor, destructor, and the size of an object. The
@@ -58,6 +65,20 @@ void slab_init();
  * @return slab_allocator_t* An allocator, or NULL on failure
  */
 slab_allocator_t *slab_allocator_create(const char *name, size_t size);
+
+/**
+ * Creates a slab allocator as slab_allocator_create() does, with flags.
+ * SLAB_CACHE_ALIGN gives every object cache lines of its own, for objects
+ * written to by different cores that must not share lines (at the cost of
+ * padding); the objects are also SLAB_CACHE_LINE_SIZE-aligned.
+ *
+ * @param name The name of the allocator (for debugging)
+ * @param size The size (bytes) of objects that will be allocated from this allocator
+ * @param flags SLAB_* flags, or 0
+ * @return slab_allocator_t* An allocator, or NULL on failure
+ */
+slab_allocator_t *slab_allocator_create_flags(const char *name, size_t size,
+                                              long flags);
 /**
  * Destroys a slab allocator.
  * 
@@ -84,12 +105,46 @@ void *slab_obj_alloc(slab_allocator_t *allocator);
 void slab_obj_free(slab_allocator_t *allocator, void *obj);
 
 /**
- * Reclaims memory from unused slabs. 
- * 
- * NOTE: This is not currently implemented.
+ * Reclaims memory from unused slabs: first by freeing slabs with no objects
+ * in use, then, if that is not enough, by asking the registered shrinkers to
+ * drop cached objects and freeing the slabs that leaves empty. Objects held
+ * in the per-core magazines keep their slabs in use. Must not be called with
+ * any slab or shrinker locks held.
  * 
  * @param target Target number of pages to reclaim. If negative, reclaim as many
  *  as possible
  * @return long Number of pages freed
  */
-long slab_allocators_reclaim(long target);
\ No newline at end of file
+long slab_allocators_reclaim(long target);
+
+/**
+ * Provides a line per allocator: its object size, the objects its slabs have
+ * handed out (including those sitting in magazines) and can hold, the pages
+ * the slabs take up, and the allocations the magazines served and missed.
+ *
+ * @param arg must be NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t slab_info(const void *arg, char *buf, size_t osize);
+/*
+ * A cache built on slab objects (e.g. the dentry cache) that can drop unused
+ * objects when memory is short. ss_shrink frees up to nr objects and returns
+ * how many it freed; it is called without any locks held, from the reclaim
+ * thread, and may not block.
+ */
+typedef struct slab_shrinker
+{
+    const char *ss_name;
+    size_t (*ss_shrink)(size_t nr);
+    list_link_t ss_link;
+} slab_shrinker_t;
+
+/**
+ * Registers a shrinker, which must stay valid forever. Should be called
+ * during initialization.
+ *
+ * @param shrinker The shrinker to register
+ */
+void slab_shrinker_register(slab_shrinker_t *shrinker);
@@ -1,10 +1,22 @@
 #pragma once
 
+#include "config.h"
 #include "kernel.h"
 #include "types.h"
 
 #include "mm/page.h"
 
+#define CR4_PGE 0x00000080
+#define CR4_PCIDE 0x00020000
+
+static inline uintptr_t tlb_read_cr4()
+{
+    uintptr_t cr4;
+    __asm__ volatile("movq %%cr4, %0"
+                     : "=r"(cr4));
+    return cr4;
+}
+
 /* Invalidates any entries from the TLB which contain
  * mappings for the given virtual address. */
 static inline void tlb_flush(uintptr_t vaddr)
@@ -13,23 +25,63 @@ static inline void tlb_flush(uintptr_t vaddr)
 }
 
 /* Invalidates any entries for count pages starting at
- * vaddr from the TLB. If this range is very large it may
- * be more efficient to call tlb_flush_all to invalidate
- * the entire TLB. */
+ * vaddr from the TLB. Past TLB_FLUSH_ALL_PAGES pages, one
+ * CR3 reload is cheaper than an invlpg per page; it drops
+ * every entry of the current address space (only), and
+ * none of the kernel's global ones, so it is only for
+ * user addresses. */
 static inline void tlb_flush_range(uintptr_t vaddr, size_t count)
 {
+    if (count > TLB_FLUSH_ALL_PAGES)
+    {
+        uintptr_t pdir;
+        __asm__ volatile("movq %%cr3, %0"
+                         : "=r"(pdir));
+        __asm__ volatile("movq %0, %%cr3" ::"r"(pdir)
+                         : "memory");
+        return;
+    }
     for (size_t i = 0; i < count; i++, vaddr += PAGE_SIZE)
     {
         tlb_flush(vaddr);
     }
 }
 
-/* Invalidates the entire TLB. */
+/* Invalidates the entire TLB. Reloading CR3 would only invalidate the
+ * current address space's entries (see pt_pcid_init()), and not the kernel's
+ * global ones, so toggle CR4.PGE instead, which invalidates everything, for
+ * every PCID. */
 static inline void tlb_flush_all()
 {
-    uintptr_t pdir;
-    __asm__ volatile("movq %%cr3, %0"
-                     : "=r"(pdir));
-    __asm__ volatile("movq %0, %%cr3" ::"r"(pdir)
+    uintptr_t cr4 = tlb_read_cr4();
+    __asm__ volatile("movq %0, %%cr4" ::"r"(cr4 ^ CR4_PGE)
+                     : "memory");
+    __asm__ volatile("movq %0, %%cr4" ::"r"(cr4)
                      : "memory");
 }
+
+struct pt;
+
+/* Registers the TLB shootdown interrupt handler. */
+void tlb_init();
+
+/* Invalidates the TLB entries for npages pages starting at vaddr in the given
+ * page table, on every core that may have them cached; call it after removing
+ * those mappings or making them less permissive. Returns once no core can use
+ * the old mappings any more. Must not be called with interrupts disabled. */
+void tlb_shootdown(struct pt *pml4, uintptr_t vaddr, size_t npages);
+
+/* Flushes the whole TLB, under every PCID, on every core; for kernel mappings
+ * that every page table shares (see vmalloc.h), which may be cached whichever
+ * page table a core is running. Must not be called with interrupts disabled. */
+void tlb_shootdown_kernel();
+
+/* Called by context switching before loading a page table, so that
+ * tlb_shootdown() knows which cores are running it. */
+void tlb_set_loaded(struct pt *pml4);
+
+/* Returns (and clears) the page table whose PCID this core must give up
+ * before its next pt_set(), TLB_STALE_ALL if it must give up all of them, or
+ * 0. */
+#define TLB_STALE_ALL ((uintptr_t)-1)
+uintptr_t tlb_take_stale();
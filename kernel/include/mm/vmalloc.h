@@ -0,0 +1,42 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Large kernel allocations that need not be physically contiguous. vmalloc()
+ * maps individually allocated pages at consecutive addresses in the area
+ * [VMALLOC_START, VMALLOC_END), whose page tables every address space shares,
+ * so the memory is usable from any process and from interrupt context. Each
+ * allocation is followed by an unmapped guard page.
+ *
+ * Allocating and freeing cost page table updates, and vfree() a flush of
+ * every core's TLB, so this is for big, long-lived buffers (tables, trace
+ * buffers) rather than for anything kmalloc() can serve.
+ */
+
+/* Creates the allocator for area descriptors */
+void vmalloc_init();
+
+/**
+ * Allocates size bytes of page-aligned, mapped memory.
+ *
+ * @return the memory, or NULL if there is not enough memory or address space
+ */
+void *vmalloc(size_t size);
+
+/**
+ * Frees memory returned by vmalloc(). Does nothing if addr is NULL. Must not
+ * be called with interrupts disabled.
+ */
+void vfree(void *addr);
+
+/**
+ * Allocates size bytes with kmalloc() if it can, falling back to vmalloc()
+ * for sizes kmalloc() does not serve or when no contiguous block is free.
+ */
+void *kvmalloc(size_t size);
+
+/**
+ * Frees memory returned by kvmalloc().
+ */
+void kvfree(void *addr);
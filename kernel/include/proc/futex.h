@@ -0,0 +1,36 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Futexes let userland block on, and wake up, a 32-bit word of its own
+ * memory, so that locks built on atomic instructions only need to enter the
+ * kernel when they are contended.
+ *
+ * A futex is named by what the word is backed by: the memory object and
+ * offset for a MAP_SHARED mapping, so that every process mapping the object
+ * agrees on it, or the address space and address for a private one.
+ */
+
+/**
+ * Sleeps until woken by futex_wake() on the same futex, provided the word at
+ * uaddr still holds val. The check and going to sleep are atomic with respect
+ * to futex_wake().
+ *
+ * @param uaddr 4-byte aligned userland address of the futex word
+ * @param val value the word is expected to hold
+ * @return 0 once woken, -EAGAIN if the word did not hold val, -EINTR if the
+ * thread was cancelled, -EINVAL if uaddr is misaligned, or -EFAULT if it is
+ * not mapped readable
+ */
+long futex_wait(int *uaddr, int val);
+
+/**
+ * Wakes up to nwake threads waiting on the futex at uaddr, oldest first.
+ *
+ * @param uaddr 4-byte aligned userland address of the futex word
+ * @param nwake most threads to wake
+ * @return the number of threads woken, or -EINVAL / -EFAULT as for
+ * futex_wait()
+ */
+long futex_wake(int *uaddr, int nwake);
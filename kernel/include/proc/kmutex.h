@@ -60,3 +60,9 @@ long kmutex_has_waiters(kmutex_t *mtx);
  * Indicates if curthr owns a mutex.
  */
 long kmutex_owns_mutex(kmutex_t *mtx);
+
+#ifdef __LOCKPROF__
+#include "proc/lockprof.h"
+#define kmutex_lock(mtx) lockprof_kmutex_lock(mtx, __FILE__, __LINE__)
+#define kmutex_unlock(mtx) lockprof_kmutex_unlock(mtx)
+#endif
@@ -51,7 +51,35 @@ typedef struct kthread
     list_t kt_mutexes;   /* List of owned mutexes, for use in debugging */
     long kt_recent_core; /* For SMP */
 
+    sched_class_t kt_sched_class; /* see proc/sched.h */
+    long kt_priority;             /* nice value, or realtime priority */
+    long kt_vruntime;             /* weighted ticks run, for SCHED_CLASS_FAIR */
+    uint64_t kt_run_start;        /* timer_tickcount when put on a CPU */
+    uint64_t kt_affinity; /* cores it may run on, bit i for core i; see
+                             sched_set_affinity() */
+
     uint64_t kt_preemption_count;
+
+    long kt_tid;         /* thread id, unique across the system */
+    uintptr_t kt_fsbase; /* userland FS base, for thread-local storage */
+    int *kt_exit_word;   /* userland word cleared on thr_exit(), or NULL */
+    uint64_t kt_pages_read; /* pages read in from files or disks for us */
+    long kt_nonblock; /* set while doing I/O on an FMODE_NONBLOCK file */
+    void *kt_fpu;     /* FPU state, once the thread has used it; see fpu.h */
+    uint64_t kt_utime; /* ticks it has run in user mode */
+    uint64_t kt_stime; /* ticks it has run in the kernel */
+    long kt_slice;     /* ticks left of its timeslice; see sched_tick() */
+    uint64_t kt_runnable_since; /* TSC when put on a run queue, or 0 */
+    uint64_t kt_wait_cycles;    /* TSC cycles waited on run queues */
+    uint64_t kt_nvcsw;          /* switches away when it slept or yielded */
+    uint64_t kt_nivcsw;         /* switches away when it was preempted */
+    long kt_exclusive; /* set while it sleeps as an exclusive waiter */
+
+    /* kt_sched_class and kt_priority are these, unless raised by priority
+     * inheritance while it holds a kmutex; see sched_set_class() */
+    sched_class_t kt_base_class;
+    long kt_base_priority;
+    struct kmutex *kt_blocked_on; /* the kmutex it is waiting for, if any */
 } kthread_t;
 
 /*==========
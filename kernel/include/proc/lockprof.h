@@ -0,0 +1,57 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Lock contention profiling, built in with LOCKPROF=1 in Config.mk.
+ *
+ * spinlock_lock() and kmutex_lock() then become macros that record, for
+ * each place in the code that takes a lock, how often it did and how long
+ * (in TSC cycles) it waited for and held the lock. See the kshell command
+ * "lockprof".
+ */
+
+#define LOCKPROF_SPINLOCK 0
+#define LOCKPROF_KMUTEX 1
+
+typedef struct lockprof_site
+{
+    const char *ls_file; /* NULL if the slot is free */
+    long ls_line;
+    long ls_type; /* LOCKPROF_SPINLOCK or LOCKPROF_KMUTEX */
+    uint64_t ls_acquisitions;
+    uint64_t ls_contended; /* acquisitions of a lock that was already held */
+    uint64_t ls_wait_total;
+    uint64_t ls_wait_max;
+    uint64_t ls_hold_total;
+    uint64_t ls_hold_max;
+} lockprof_site_t;
+
+struct spinlock;
+struct kmutex;
+
+void lockprof_spinlock_lock(struct spinlock *lock, const char *file,
+                            long line);
+
+void lockprof_spinlock_unlock(struct spinlock *lock);
+
+void lockprof_kmutex_lock(struct kmutex *mtx, const char *file, long line);
+
+void lockprof_kmutex_unlock(struct kmutex *mtx);
+
+/**
+ * Copies the (up to) max sites that have waited longest in total into sites,
+ * longest first, and returns how many there were.
+ */
+size_t lockprof_top(lockprof_site_t *sites, size_t max);
+
+/**
+ * Returns the number of acquisitions that could not be recorded because the
+ * tables were full.
+ */
+size_t lockprof_lost();
+
+/**
+ * Zeroes the counters of every site.
+ */
+void lockprof_reset();
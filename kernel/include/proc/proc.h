@@ -2,8 +2,11 @@
 
 #include "config.h"
 #include "mm/pagetable.h"
+#include "proc/kmutex.h"
 #include "proc/kthread.h"
+#include "proc/rcu.h"
 #include "types.h"
+#include "util/htable.h"
 #include "vm/vmmap.h"
 
 /*===========
@@ -15,6 +18,7 @@
  */
 #define PROC_MAX_COUNT 65536
 #define PROC_NAME_LEN 256
+#define PROC_HASH_NBUCKETS 256 /* pid hash buckets to start with */
 
 /* Process states */
 typedef enum
@@ -30,12 +34,18 @@ typedef struct proc
     char p_name[PROC_NAME_LEN]; /* Process name */
 
     list_t p_threads;  /* Threads list */
+    spinlock_t p_threads_lock;
+    long p_nthreads;   /* Threads that have not exited */
     list_t p_children; /* Children list */
-    spinlock_t p_children_lock;
+    list_t p_zombies;  /* Exited children not yet waited for */
+    spinlock_t p_children_lock; /* Protects p_children, p_zombies, p_waitpid */
     struct proc *p_pproc; /* Parent process */
 
     list_link_t p_list_link;  /* Link of list of all processes */
+    htable_link_t p_hash_link; /* Link in the pid hash */
+    rcu_head_t p_rcu;          /* Frees the proc_t once unhashed */
     list_link_t p_child_link; /* Link on parent's list of children */
+    list_link_t p_zombie_link; /* Link on parent's p_zombies once exited */
 
     long p_status;        /* Exit status */
     proc_state_t p_state; /* Process state */
@@ -44,14 +54,17 @@ typedef struct proc
 
     /*
      * If a parent is waiting on a child, the parent puts itself on its own
-     * p_wait queue. When a child terminates, it broadcasts on its parent's
-     * p_wait to wake it up.
+     * p_wait queue, with the pid it waits for (-1 for any child) in
+     * p_waitpid. When a child terminates, it queues itself on its parent's
+     * p_zombies and broadcasts on p_wait only if the parent waits for it.
      */
     ktqueue_t p_wait;
+    pid_t p_waitpid; /* Pid waited for, -1 for any child, 0 if not waiting */
 
     /* VFS related */
-    struct file *p_files[NFILES]; /* Open files */
-    struct vnode *p_cwd;          /* Current working directory */
+    struct fdtable *p_files; /* Open files, or NULL if none were opened */
+    kmutex_t p_files_mutex;  /* See proc_files_lock() */
+    struct vnode *p_cwd;     /* Current working directory */
 
     /* VM related */
     /*
@@ -71,6 +84,33 @@ typedef struct proc
     void *p_start_brk;     /* Initial value of process break */
     struct vmmap *p_vmmap; /* List of areas mapped into process's
                               user address space. */
+
+    /* Page faults served since the last exec, and the pages that had to be
+     * read in from files or disks to serve them; see pagefault_report() */
+    uint64_t p_faults;
+    uint64_t p_fault_reads;
+
+    /* Memory group its pages are charged to (see mm/memgroup.h), inherited
+     * from its parent; protected by the groups' lock */
+    long p_memgroup;
+
+    /* I/O priority its block requests are tagged with (IOPRIO_VALUE(), see
+     * drivers/iosched.h), inherited from its parent */
+    int p_ioprio;
+
+    /* Ticks of CPU time, in user mode and in the kernel, of its threads that
+     * have been destroyed (see proc_cpu_times() for the total), and of its
+     * children that have been waited for, with their own children's */
+    uint64_t p_utime;
+    uint64_t p_stime;
+    uint64_t p_cutime;
+    uint64_t p_cstime;
+
+    /* TSC cycles its destroyed threads waited on run queues, and their
+     * voluntary and involuntary switches (see proc_sched_stats()) */
+    uint64_t p_wait_cycles;
+    uint64_t p_nvcsw;
+    uint64_t p_nivcsw;
 } proc_t;
 
 /*==========
@@ -100,6 +140,61 @@ void initproc_finish();
  */
 proc_t *proc_create(const char *name);
 
+/**
+ * Finds a process by pid.
+ *
+ * @param pid the pid to look up; 0 is the idle process
+ * @return the process, or NULL if there is none
+ */
+proc_t *proc_lookup(pid_t pid);
+
+/**
+ * Calls fill(proc, buf, size) on the process with the given pid, with the
+ * process list locked so that the process cannot be destroyed meanwhile;
+ * fill must not block.
+ *
+ * @return what fill returned, or -ESRCH if there is no such process
+ */
+long proc_pid_info(pid_t pid, long (*fill)(proc_t *proc, char *buf, size_t size),
+                   char *buf, size_t size);
+
+/**
+ * Finds the lowest pid in use at or above pid (and above 0), for walking
+ * through every process without holding a lock.
+ *
+ * @return the pid, or -1 if there is none
+ */
+pid_t proc_next_pid(pid_t pid);
+
+/**
+ * Kills the process with the most resident pages (see vmmap_rss()), other
+ * than init and processes that are already exiting, to free memory once
+ * nothing else can be reclaimed.
+ *
+ * @param rssp set to the number of resident pages of the victim
+ * @return the pid of the victim, or 0 if no process could be killed
+ */
+pid_t proc_oom_kill(size_t *rssp);
+
+/**
+ * Gets the CPU time a process has used, in ticks, adding up its live threads'
+ * times and those of its threads that are gone.
+ *
+ * @param proc the process
+ * @param utime set to the time spent in user mode
+ * @param stime set to the time spent in the kernel
+ */
+void proc_cpu_times(proc_t *proc, uint64_t *utime, uint64_t *stime);
+
+/**
+ * Gets the TSC cycles a process's threads have waited on run queues,
+ * runnable but not running, and how many times they were switched away from
+ * voluntarily (they slept or yielded) and involuntarily (they were
+ * preempted); for its live threads and those that are gone.
+ */
+void proc_sched_stats(proc_t *proc, uint64_t *wait_cycles, uint64_t *nvcsw,
+                      uint64_t *nivcsw);
+
 /**
  * Frees all the resources associated with a process.
  *
@@ -114,6 +209,22 @@ void proc_destroy(proc_t *proc);
  */
 void proc_thread_exiting(void *retval);
 
+/**
+ * Locks curproc's file table (p_files) for the caller, unless curthr is the
+ * process's only thread, in which case nobody else can touch the table and
+ * no lock is needed.
+ *
+ * @return whether the table was locked, to be passed to proc_files_unlock()
+ */
+long proc_files_lock();
+
+/**
+ * Undoes proc_files_lock().
+ *
+ * @param locked the return value of proc_files_lock()
+ */
+void proc_files_unlock(long locked);
+
 /**
  * Stops another process from running again by cancelling all its
  * threads.
@@ -161,6 +272,20 @@ pid_t do_waitpid(pid_t pid, int *status, int options);
 struct regs;
 long do_fork(struct regs *regs);
 
+/**
+ * Implements the thr_create(2) system call: starts a new thread in curproc,
+ * sharing its address space and file table, that enters userland at entry
+ * with arg as its first argument, on the given stack, and with its FS base
+ * set to tls. If exit_word is not NULL, the word there is set to 0, and
+ * woken as a futex, once the thread calls thr_exit(), when it no longer uses
+ * its stack; that is what pthread_join() waits for.
+ *
+ * @param regs the register state at the time of the system call
+ * @return the thread id of the new thread, or -ENOMEM
+ */
+long do_thr_create(struct regs *regs, void *entry, void *arg, void *stack,
+                   void *tls, int *exit_word);
+
 /*===========
  * Miscellany
  *==========*/
@@ -175,6 +300,7 @@ long do_fork(struct regs *regs);
  * Enable global use of idleproc
  */
 extern proc_t idleproc;
+#define idleproc CSD(idleproc)
 
 /*=====================
  * Functions: Debugging
@@ -190,6 +316,19 @@ extern proc_t idleproc;
  */
 size_t proc_info(const void *arg, char *buf, size_t osize);
 
+/**
+ * Provides a process's counters on one line, as "key=value" pairs: pid, name,
+ * state, parent, threads, resident pages, page faults (and how many of them
+ * read a page in), and user and system ticks of its own and of its children.
+ * The process list must be locked (see proc_pid_info()).
+ *
+ * @param arg a pointer to the process
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t proc_stat_info(const void *arg, char *buf, size_t osize);
+
 /**
  * Provides debug information overview of all processes.
  *
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "proc/sched.h"
+
+/*
+ * Read-copy-update: lookups without locks in structures that are mostly read.
+ *
+ * A reader brackets its traversal with rcu_read_lock() and rcu_read_unlock(),
+ * which only disable preemption; in between it may not sleep, and it loads
+ * the pointers it follows with rcu_dereference(). A writer still serializes
+ * with other writers (by a lock), publishes new items with
+ * rcu_assign_pointer() once they are initialized, and, once it has unlinked
+ * an item, hands it to rcu_call() rather than freeing it, as readers may
+ * still be looking at it.
+ *
+ * The callback runs after a grace period, by which time every core has been
+ * through a quiescent state, in which it cannot be in the middle of a read:
+ * a context switch in core_switch(), a timer tick taken in user mode, or
+ * idling. So no reader that could have found the item is left. Callbacks are
+ * run in batches, one grace period per batch, by the "rcu" kernel thread.
+ *
+ * An idle core does not report anything, it is just skipped over, so
+ * interrupt handlers and timers, which may run on an idle core, must not be
+ * readers.
+ *
+ * Until rcu_start() and after rcu_stop(), when nothing else is running,
+ * rcu_call() runs the callback at once.
+ */
+
+typedef struct rcu_head
+{
+    struct rcu_head *rh_next;
+    void (*rh_func)(struct rcu_head *head);
+} rcu_head_t;
+
+typedef void (*rcu_func_t)(rcu_head_t *head);
+
+static inline void rcu_read_lock() { preemption_disable(); }
+
+static inline void rcu_read_unlock() { preemption_enable(); }
+
+/* Loads a pointer a reader is going to follow */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/* Stores a pointer to an item, making what was written to it visible first */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/**
+ * Run func(head) once a grace period has passed. May be called from any
+ * context, with spinlocks held.
+ */
+void rcu_call(rcu_head_t *head, rcu_func_t func);
+
+/**
+ * Wait (sleeping) for a grace period to pass, after which no reader can see
+ * anything unlinked before the call.
+ */
+void rcu_synchronize();
+
+/**
+ * Note a quiescent state of the current core; called by core_switch() and on
+ * timer ticks taken in user mode.
+ */
+void rcu_quiescent();
+
+/**
+ * Note that the current core stops, or resumes, running threads.
+ */
+void rcu_idle_enter();
+void rcu_idle_exit();
+
+void rcu_start();
+void rcu_stop();
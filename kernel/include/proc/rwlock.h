@@ -0,0 +1,105 @@
+#pragma once
+
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+/*===========
+ * Structures
+ *==========*/
+
+/*
+ * A sleeping reader-writer lock: any number of readers may hold it at once,
+ * or a single writer. Waiting writers are preferred, so a steady stream of
+ * readers cannot keep a writer out; as a result, a reader must not take the
+ * same lock again while holding it.
+ */
+typedef struct rwlock
+{
+    ktqueue_t rw_readq;        /* readers waiting for the writer to leave */
+    ktqueue_t rw_writeq;       /* writers waiting for the lock to be free */
+    struct kthread *rw_writer; /* current writer, if any */
+    size_t rw_readers;         /* number of readers holding the lock */
+    size_t rw_writers_waiting; /* number of threads on rw_writeq */
+    spinlock_t rw_lock;
+} rwlock_t;
+
+#define RWLOCK_INITIALIZER(rw)                                        \
+    {                                                                 \
+        .rw_readq = KTQUEUE_INITIALIZER((rw).rw_readq),               \
+        .rw_writeq = KTQUEUE_INITIALIZER((rw).rw_writeq),             \
+        .rw_writer = NULL, .rw_readers = 0, .rw_writers_waiting = 0,  \
+        .rw_lock = SPINLOCK_INITIALIZER((rw).rw_lock),                \
+    }
+
+/*==========
+ * Functions
+ *=========*/
+
+/**
+ * Initializes a reader-writer lock.
+ *
+ * @param rw the lock
+ */
+void rwlock_init(rwlock_t *rw);
+
+/**
+ * Locks the specified lock shared, alongside any other readers.
+ *
+ * Note: This function may block.
+ *
+ * @param rw the lock to take
+ */
+void rwlock_read_lock(rwlock_t *rw);
+
+/**
+ * Locks the specified lock shared if there is no writer holding it or
+ * waiting for it. Does not block.
+ *
+ * @param rw the lock to take
+ * @return 1 if the lock was taken, 0 otherwise
+ */
+long rwlock_read_trylock(rwlock_t *rw);
+
+/**
+ * Releases a shared hold on the specified lock.
+ *
+ * @param rw the lock to release
+ */
+void rwlock_read_unlock(rwlock_t *rw);
+
+/**
+ * Locks the specified lock exclusively.
+ *
+ * Note: This function may block.
+ *
+ * Note: These locks are not re-entrant
+ *
+ * @param rw the lock to take
+ */
+void rwlock_write_lock(rwlock_t *rw);
+
+/**
+ * Locks the specified lock exclusively if no one holds it or is waiting for
+ * it. Does not block.
+ *
+ * @param rw the lock to take
+ * @return 1 if the lock was taken, 0 otherwise
+ */
+long rwlock_write_trylock(rwlock_t *rw);
+
+/**
+ * Releases an exclusive hold on the specified lock.
+ *
+ * @param rw the lock to release
+ */
+void rwlock_write_unlock(rwlock_t *rw);
+
+/**
+ * Indicates if curthr holds a lock exclusively.
+ */
+long rwlock_owns_write(rwlock_t *rw);
+
+/**
+ * Indicates if a lock is held shared by anyone.
+ */
+long rwlock_read_held(rwlock_t *rw);
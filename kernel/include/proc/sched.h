@@ -17,8 +17,30 @@ typedef struct ktqueue
     list_t tq_list;
     size_t tq_size;
     spinlock_t tq_lock;
+    /* set for run queues, kept in scheduling order; it fits in the padding
+     * after tq_lock, since kmutex.S was built for a 32-byte ktqueue_t */
+    uint8_t tq_ordered;
 } ktqueue_t;
 
+/*
+ * Scheduling classes. Runnable realtime threads always run before fair ones:
+ * those with the highest kt_priority first, and in FIFO order among equals.
+ * Fair threads run in order of virtual run time, which advances more slowly
+ * the lower their nice value (kt_priority) is; threads waking up from sleep
+ * are placed slightly ahead of those already waiting, so interactive threads
+ * get to run before CPU-bound ones.
+ */
+typedef enum
+{
+    SCHED_CLASS_FAIR,
+    SCHED_CLASS_REALTIME
+} sched_class_t;
+
+#define SCHED_NICE_MIN -20
+#define SCHED_NICE_MAX 19
+#define SCHED_RT_PRIO_MIN 1
+#define SCHED_RT_PRIO_MAX 99
+
 /*
  * Macro to initialize a ktqueue. See sched_queue_init for how the 
  * queue should be initialized in your code. 
@@ -34,6 +56,14 @@ typedef struct ktqueue
  */
 struct kthread;
 
+/*
+ * The number of times a thread has been switched away from on this core. Code
+ * that must know whether the current thread has slept or been preempted
+ * across some call compares it, and curcore.kc_id, before and after.
+ */
+extern uint64_t sched_nswitches;
+#define sched_nswitches CSD(sched_nswitches)
+
 /*==========
  * Functions
  *=========*/
@@ -82,6 +112,16 @@ void sched_sleep_on(ktqueue_t *q, spinlock_t *lock);
  */
 long sched_cancellable_sleep_on(ktqueue_t *queue, spinlock_t *lock);
 
+/**
+ * Like sched_sleep_on() and sched_cancellable_sleep_on(), but as an
+ * exclusive waiter, of which sched_broadcast_on() wakes only one. Meant for
+ * waiters of which only one can make progress per wakeup, such as consumers
+ * of the same data; one that is woken but leaves the work to others must wake
+ * the next itself.
+ */
+void sched_sleep_on_exclusive(ktqueue_t *q, spinlock_t *lock);
+long sched_cancellable_sleep_on_exclusive(ktqueue_t *queue, spinlock_t *lock);
+
 /**
  * Wakes up a thread from q.
  *
@@ -92,12 +132,22 @@ long sched_cancellable_sleep_on(ktqueue_t *queue, spinlock_t *lock);
 void sched_wakeup_on(ktqueue_t *q, struct kthread **thrp);
 
 /**
- * Wake up all threads running on the queue.
+ * Wakes up every thread sleeping on the queue, except that of the exclusive
+ * waiters (see sched_sleep_on_exclusive()), only the one that has waited
+ * longest is woken.
  *
  * @param q the queue to wake up threads from
  */
 void sched_broadcast_on(ktqueue_t *q);
 
+/**
+ * Wakes up thr if it is sleeping on q, such as when a timeout it set expires.
+ *
+ * @param q the queue
+ * @param thr the thread
+ */
+void sched_wakeup_thread_on(ktqueue_t *q, struct kthread *thr);
+
 /**
  * Cancel the given thread from the queue it sleeps on.
  *
@@ -105,6 +155,77 @@ void sched_broadcast_on(ktqueue_t *q);
  */
 void sched_cancel(struct kthread *thr);
 
+/**
+ * Changes a thread's scheduling class and priority (its nice value for
+ * SCHED_CLASS_FAIR). While it holds a kmutex a higher priority realtime
+ * thread is waiting for, it keeps running at that thread's priority.
+ *
+ * @param thr the thread
+ * @param cls the new class
+ * @param priority the new priority
+ * @return 0 on success, or -EINVAL if priority is out of range for cls
+ */
+long sched_set_class(struct kthread *thr, sched_class_t cls, long priority);
+
+struct kmutex;
+
+/**
+ * Sleeps on a kmutex's wait queue like sched_sleep_on(), first lending
+ * curthr's priority to the mutex's holder, and to whatever holder that one
+ * is waiting for in turn, where it is higher. Called by kmutex_lock().
+ *
+ * While the holder runs on another core, spins for a while first, and takes
+ * the mutex itself if the holder lets go of it with nobody asleep on it.
+ *
+ * @param mtx the mutex
+ * @param lock the mutex's km_lock, held
+ */
+void sched_mutex_sleep_on(struct kmutex *mtx, spinlock_t *lock);
+
+/**
+ * Called by kmutex_unlock(), with km_lock still held, after it has handed
+ * mtx on: drops any priority curthr inherited for it, and has the new holder
+ * inherit from the threads still waiting.
+ *
+ * @param mtx the mutex
+ */
+void sched_mutex_released(struct kmutex *mtx);
+
+/**
+ * Link a kmutex into, or unlink it from, the kt_mutexes of its holder, under
+ * the lock that priority inheritance reads them with. Called by kmutex_lock()
+ * and kmutex_unlock().
+ */
+void sched_mutex_link(list_t *mutexes, list_link_t *link);
+void sched_mutex_unlink(list_link_t *link);
+
+/* A thread's affinity mask when it may run on any core */
+#define SCHED_AFFINITY_ALL (~0UL)
+
+/**
+ * Restricts a thread to the cores in mask, bit i standing for core i; it is
+ * moved off the core it is on, or the run queue it waits on, if that core is
+ * not among them. Neither the scheduler nor load balancing will run it
+ * anywhere else. Threads start out with SCHED_AFFINITY_ALL, or with their
+ * creator's mask if they are created by thr_create().
+ *
+ * @param thr the thread
+ * @param mask the cores it may run on
+ * @return 0 on success, or -EINVAL if mask has none of the cores that are up
+ */
+long sched_set_affinity(struct kthread *thr, uint64_t mask);
+
+/**
+ * Sets curthr's userland FS base, for thread-local storage. base must be a
+ * userland address.
+ */
+void sched_set_fsbase(uintptr_t base);
+
+/**
+ * Returns the mask of the cores that are up.
+ */
+uint64_t sched_online_cores();
+
 /**
  * Initializes a queue.
  *
@@ -126,4 +247,26 @@ long sched_queue_empty(ktqueue_t *queue);
 void preemption_disable();
 void preemption_enable();
 void preemption_reset();
-long preemption_enabled();
\ No newline at end of file
+long preemption_enabled();
+
+/**
+ * Called by the timer on every tick. Charges the tick to curthr, as user or
+ * system time, and once its timeslice is used up, asks for it to be preempted
+ * on the way out of the interrupt if another thread is waiting on this core's
+ * run queue and curthr may be preempted (see sched_preempt()).
+ *
+ * @param user whether the tick interrupted user mode
+ * @return 1 if curthr is to be preempted, 0 if not
+ */
+long sched_tick(long user);
+
+/**
+ * The preemption point, called by interrupt_handler() after the interrupt has
+ * been acknowledged: if a reschedule is pending and the interrupted thread
+ * may be preempted (it was in user mode, or with KPREEMPT, its preemption
+ * count is zero and it was running at IPL_LOW), yields the CPU on its behalf.
+ * Returns with interrupts disabled.
+ *
+ * @param user whether the interrupt came from user mode
+ */
+void sched_preempt(long user);
\ No newline at end of file
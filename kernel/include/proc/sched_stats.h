@@ -0,0 +1,68 @@
+#pragma once
+
+#include "config.h"
+#include "types.h"
+
+/*
+ * Always-on scheduler statistics, kept per core by sched.c:
+ *
+ * - How long the run queue was, sampled at every tick that finds a thread
+ *   running; an idle core's run queue is empty, and its time is counted
+ *   apart, in TSC cycles spent waiting for an interrupt in core_switch().
+ * - How long threads waited on a run queue, runnable but not running, from
+ *   being queued to being picked, in TSC cycles. A thread moved to another
+ *   core's run queue keeps waiting from when it was first queued.
+ * - Why threads were switched away from: they went to sleep or yielded
+ *   (voluntary), were preempted (involuntary), or exited.
+ * - How often load_balance() stole threads from another core, and how many.
+ *
+ * Each core only updates its own counters, with interrupts masked, and
+ * sched_stats_get() sums them when read; see /proc/schedstat and the kshell
+ * command "schedstat". Each thread also counts its own waiting and switches,
+ * which /proc/<pid>/stat reports for the process.
+ */
+typedef struct sched_stats
+{
+    uint64_t ss_sleeps;      /* switches away from threads that blocked */
+    uint64_t ss_yields;      /* ... that gave the core up, still runnable */
+    uint64_t ss_preemptions; /* ... that were preempted */
+    uint64_t ss_exits;       /* ... that exited */
+
+    uint64_t ss_ticks;      /* ticks the run queue was sampled at */
+    uint64_t ss_runq_total; /* the run queue lengths sampled, summed */
+    uint64_t ss_runq_max;
+    /* ticks the run queue held i threads; the last bucket also counts any
+     * longer */
+    uint64_t ss_runq_hist[SCHED_RUNQ_HIST];
+
+    uint64_t ss_waits; /* threads picked off the run queue */
+    uint64_t ss_wait_cycles;
+    uint64_t ss_max_wait_cycles;
+    /* waits of [2^i, 2^(i + 1)) cycles; the last bucket also counts any
+     * longer */
+    uint64_t ss_wait_hist[SCHED_HIST_BUCKETS];
+
+    uint64_t ss_idle_cycles; /* waiting for an interrupt with nothing to run */
+    uint64_t ss_idle_waits;
+
+    uint64_t ss_balances;    /* load_balance() calls that stole threads */
+    uint64_t ss_idle_steals; /* those of ss_balances made while idle */
+    uint64_t ss_stolen;      /* threads stolen */
+} sched_stats_t;
+
+/**
+ * Gets the scheduler statistics of a core, or summed over every core if core
+ * is -1; the longest run queue and wait are then the longest on any core.
+ */
+void sched_stats_get(long core, sched_stats_t *stats);
+
+/**
+ * Zeroes the scheduler statistics, on every core. Threads' own counters are
+ * kept.
+ */
+void sched_stats_reset();
+
+/**
+ * Writes a line of counters per online core, for /proc/schedstat.
+ */
+size_t sched_stats_info(const void *arg, char *buf, size_t osize);
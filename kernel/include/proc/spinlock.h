@@ -1,15 +1,41 @@
 #pragma once
 
+#include "types.h"
+
+/*
+ * A ticket lock: each locker takes the next ticket and spins until it is
+ * served, so the lock is handed over in arrival order, and waiters only read
+ * the lock's cache line until their turn comes.
+ *
+ * The lock has to stay within 4 bytes, as it is embedded in kmutex_t,
+ * ktqueue_t and kthread_t (after a 4-byte field), whose layout is fixed by
+ * the prebuilt proc/kmutex.S. 8-bit tickets are plenty, since at most
+ * MAX_LAPICS cores can wait for a lock at once.
+ */
 typedef struct spinlock
 {
-    volatile char s_locked;
+    volatile uint8_t s_next;     /* next ticket to hand out */
+    volatile uint8_t s_serving;  /* ticket allowed to hold the lock */
+    volatile char s_locked;      /* holder's core id + 1, or 0 if free */
+    uint8_t s_stats;             /* statistics slot + 1, or 0 if none; see
+                                  * spinlock_stats_register() */
 } spinlock_t;
 
-#define SPINLOCK_INITIALIZER(lock) \
-    {                              \
-        .s_locked = 0              \
+#define SPINLOCK_INITIALIZER(lock)                                         \
+    {                                                                      \
+        .s_next = 0, .s_serving = 0, .s_locked = 0, .s_stats = 0           \
     }
 
+/* Contention statistics of a lock, from the time it was registered */
+typedef struct spinlock_stats
+{
+    const char *ss_name;
+    spinlock_t *ss_lock;
+    uint64_t ss_acquisitions;
+    uint64_t ss_contended;   /* acquisitions that had to wait */
+    uint64_t ss_spin_cycles; /* TSC cycles spent waiting */
+} spinlock_stats_t;
+
 /**
  * Initializes the fields of the specified spinlock_t
  * @param lock the spinlock to initialize
@@ -35,3 +61,29 @@ void spinlock_lock(spinlock_t *lock);
 void spinlock_unlock(spinlock_t *lock);
 
 long spinlock_ownslock(spinlock_t *lock);
+
+/**
+ * Starts keeping statistics for a lock (there are SPINLOCK_STATS_MAX slots;
+ * further locks are not counted). The lock must not be held.
+ *
+ * @param lock the spinlock to count
+ * @param name name under which the statistics are reported
+ */
+void spinlock_stats_register(spinlock_t *lock, const char *name);
+
+/**
+ * Copies the statistics of up to max registered locks into stats, and
+ * returns how many there were.
+ */
+size_t spinlock_stats_get(spinlock_stats_t *stats, size_t max);
+
+/**
+ * Zeroes the statistics of every registered lock.
+ */
+void spinlock_stats_reset();
+
+#ifdef __LOCKPROF__
+#include "proc/lockprof.h"
+#define spinlock_lock(lock) lockprof_spinlock_lock(lock, __FILE__, __LINE__)
+#define spinlock_unlock(lock) lockprof_spinlock_unlock(lock)
+#endif
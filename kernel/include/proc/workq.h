@@ -0,0 +1,65 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/*
+ * Deferred work.
+ *
+ * Interrupt handlers should only acknowledge their device and queue whatever
+ * else there is to do as a work item, with work_queue(). Each core has a
+ * queue of pending work and a realtime kernel thread (priority WORKQ_PRIORITY),
+ * bound to the core, that runs it, in the order it was queued, with
+ * interrupts enabled. Work is queued on the core that queues it, which is
+ * usually the one that took the interrupt, so it runs there while the
+ * device's data is still in its caches.
+ *
+ * Queueing work that is already pending does nothing, so an interrupt that
+ * fires again before its work has run does not add to it: the work is
+ * expected to handle everything that has happened by the time it runs. Once
+ * the work has started, it may be queued again. Work queued on two cores may
+ * run on both at once, so work that must not should take a lock.
+ */
+
+struct work;
+
+typedef void (*work_func_t)(struct work *work);
+
+typedef struct work
+{
+    work_func_t w_func;
+    list_link_t w_link; /* on a core's queue, while pending */
+    long w_pending;     /* queued and not yet started */
+} work_t;
+
+#define WORK_INITIALIZER(work, func)                        \
+    {                                                       \
+        .w_func = (func),                                   \
+        .w_link = LIST_LINK_INITIALIZER((work).w_link),     \
+        .w_pending = 0,                                     \
+    }
+
+/**
+ * Initializes a work item.
+ *
+ * @param work the work item
+ * @param func the function that does the work, which is passed the item
+ */
+void work_init(work_t *work, work_func_t func);
+
+/**
+ * Queues work to be run by the current core's work queue thread, unless it is
+ * already pending. May be called from interrupt context. Until the core's
+ * thread has been started (see workq_start()), the work is run right away
+ * instead.
+ *
+ * @param work the work item
+ * @return 1 if the work was queued, 0 if it was already pending
+ */
+long work_queue(work_t *work);
+
+/**
+ * Starts a work queue thread on every core. Called by init.
+ */
+void workq_start();
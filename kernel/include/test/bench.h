@@ -0,0 +1,26 @@
+#pragma once
+
+#include "test/kshell/kshell.h"
+
+/*
+ * Kernel microbenchmarks, timed with the TSC. Each benchmark prints one line
+ * of space-separated key=value pairs:
+ *
+ *   bench name=<name> iters=<n> cycles=<total> per_op=<cycles per iteration>
+ *
+ * followed, for some benchmarks, by extra keys (the cores that the threads of
+ * a cross-thread benchmark ran on, bytes transferred). A first line,
+ *
+ *   bench name=tsc khz=<TSC frequency>
+ *
+ * gives the scale needed to turn cycles into time. Output can be redirected
+ * to a file from kshell, e.g. "bench > /bench.out".
+ */
+
+/**
+ * Runs the benchmarks whose names start with prefix, or all of them if
+ * prefix is NULL, printing their results to ksh.
+ *
+ * @return the number of benchmarks run
+ */
+long bench_main(kshell_t *ksh, const char *prefix);
@@ -0,0 +1,3 @@
+#pragma once
+
+long utiltest_main(long, void *);
@@ -1,31 +1,101 @@
 #ifndef ATOMIC_H
 #define ATOMIC_H
 
+/*
+ * Atomic integers, 32-bit (atomic_t) and 64-bit (atomic64_t), with the
+ * memory ordering each operation needs spelled out rather than a full barrier
+ * everywhere:
+ *  - relaxed: atomic, but orders nothing around it; enough for statistics,
+ *    and for taking a reference from one already held
+ *  - acquire/release: later accesses stay after an acquire, earlier ones
+ *    before a release, as for a flag handing data over
+ *  - the operations returning a value are fully ordered, except
+ *    *_dec_and_test(), which releases, and acquires only when it hits zero,
+ *    so that whoever frees the object sees every earlier access to it
+ *
+ * On x86 every read-modify-write is a locked instruction anyway, so the
+ * weaker orders only free the compiler to move accesses around them.
+ */
+
 typedef int atomic_t;
+typedef long atomic64_t;
 
 #define ATOMIC_INIT(i) (i)
+#define ATOMIC64_INIT(i) (i)
 
-static inline int __atomic_add_unless(atomic_t *a, int v, int u)
-{
-    int c, old;
-    c = __sync_fetch_and_add(a, 0);
-    while (c != u && (old = __sync_val_compare_and_swap(a, c, c + v)) != c)
-        c = old;
-    return c;
-}
-
-static inline void atomic_set(atomic_t *a, int i) { *a = i; }
-
-static inline void atomic_inc(atomic_t *a) { __sync_add_and_fetch(a, 1); }
+#define ATOMIC_OPS(prefix, atype, type)                                     \
+    static inline type prefix##_read(const atype *a)                        \
+    {                                                                       \
+        return __atomic_load_n(a, __ATOMIC_RELAXED);                        \
+    }                                                                       \
+    static inline type prefix##_read_acquire(const atype *a)                \
+    {                                                                       \
+        return __atomic_load_n(a, __ATOMIC_ACQUIRE);                        \
+    }                                                                       \
+    static inline void prefix##_set(atype *a, type i)                       \
+    {                                                                       \
+        __atomic_store_n(a, i, __ATOMIC_RELAXED);                           \
+    }                                                                       \
+    static inline void prefix##_set_release(atype *a, type i)               \
+    {                                                                       \
+        __atomic_store_n(a, i, __ATOMIC_RELEASE);                           \
+    }                                                                       \
+    static inline void prefix##_add(atype *a, type v)                       \
+    {                                                                       \
+        __atomic_fetch_add(a, v, __ATOMIC_RELAXED);                         \
+    }                                                                       \
+    static inline void prefix##_sub(atype *a, type v)                       \
+    {                                                                       \
+        __atomic_fetch_sub(a, v, __ATOMIC_RELAXED);                         \
+    }                                                                       \
+    static inline void prefix##_inc(atype *a) { prefix##_add(a, 1); }       \
+    static inline void prefix##_dec(atype *a) { prefix##_sub(a, 1); }       \
+    static inline type prefix##_add_return(atype *a, type v)                \
+    {                                                                       \
+        return __atomic_add_fetch(a, v, __ATOMIC_SEQ_CST);                  \
+    }                                                                       \
+    static inline type prefix##_sub_return(atype *a, type v)                \
+    {                                                                       \
+        return __atomic_sub_fetch(a, v, __ATOMIC_SEQ_CST);                  \
+    }                                                                       \
+    static inline type prefix##_xchg(atype *a, type i)                      \
+    {                                                                       \
+        return __atomic_exchange_n(a, i, __ATOMIC_SEQ_CST);                 \
+    }                                                                       \
+    /* Sets *a to new if it was old, and returns what it was */             \
+    static inline type prefix##_cmpxchg(atype *a, type old, type new)       \
+    {                                                                       \
+        __atomic_compare_exchange_n(a, &old, new, 0, __ATOMIC_SEQ_CST,      \
+                                    __ATOMIC_RELAXED);                      \
+        return old;                                                         \
+    }                                                                       \
+    static inline int prefix##_dec_and_test(atype *a)                      \
+    {                                                                       \
+        if (__atomic_sub_fetch(a, 1, __ATOMIC_RELEASE))                     \
+        {                                                                   \
+            return 0;                                                       \
+        }                                                                   \
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);                            \
+        return 1;                                                           \
+    }                                                                       \
+    /* Adds v to *a unless it is u, and returns what it was */              \
+    static inline type prefix##_fetch_add_unless(atype *a, type v, type u)  \
+    {                                                                       \
+        type c = __atomic_load_n(a, __ATOMIC_RELAXED);                      \
+        while (c != u && !__atomic_compare_exchange_n(a, &c, c + v, 0,      \
+                                                      __ATOMIC_SEQ_CST,     \
+                                                      __ATOMIC_RELAXED))    \
+            ;                                                               \
+        return c;                                                           \
+    }                                                                       \
+    static inline int prefix##_inc_not_zero(atype *a)                       \
+    {                                                                       \
+        return prefix##_fetch_add_unless(a, 1, 0) != 0;                     \
+    }
 
-static inline int atomic_dec_and_test(atomic_t *a)
-{
-    return __sync_sub_and_fetch(a, 1) == 0;
-}
+ATOMIC_OPS(atomic, atomic_t, int)
+ATOMIC_OPS(atomic64, atomic64_t, long)
 
-static inline int atomic_inc_not_zero(atomic_t *a)
-{
-    return __atomic_add_unless(a, 1, 0);
-}
+#undef ATOMIC_OPS
 
-#endif
\ No newline at end of file
+#endif
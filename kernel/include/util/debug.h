@@ -88,6 +88,20 @@
 #define DBG_USER DBG_MODE(38)   /* user land                    */
 #define DBG_DEFAULT DBG_ERROR   /* default modes, 0 for none    */
 
+/*
+ * The modes that are compiled in at all. A dbg() of a mode outside this mask
+ * is known false at compile time, so the compiler drops it, arguments and
+ * all, and it costs nothing even in the hottest paths; the modes inside it
+ * are turned on and off at runtime as usual (see INIT_DBG_MODES in
+ * kernel/util/debug.c), but those outside it cannot be. To build without
+ * the syscall and memory management chatter, for instance:
+ *
+ *   #define DBG_COMPILED_MODES (DBG_ALL & ~(DBG_SYSCALL | DBG_MM))
+ */
+#ifndef DBG_COMPILED_MODES
+#define DBG_COMPILED_MODES DBG_ALL
+#endif
+
 /* This defines the name that is used in the
  * environment variable to turn on the given
  * debugging type, along with the color of the debug type */
@@ -236,7 +250,8 @@ extern spinlock_t debug_lock;
         }                                              \
     } while (0)
 
-#define dbg_active(mode) (dbg_modes & (mode))
+#define dbg_active(mode) \
+    (((mode)&DBG_COMPILED_MODES) && (dbg_modes & (mode) & DBG_COMPILED_MODES))
 
 void dbg_add_mode(const char *mode);
 
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "kernel.h"
+
+#include "proc/spinlock.h"
+
+/*
+ * Intrusive hash table with a lock per bucket, growing as it fills.
+ *
+ * htable_link_t should be included in structures which want to be kept in an
+ * htable_t; it holds the 64-bit key the item is filed under (a pid, an inode
+ * number, a hash of a name...). Items with the same key may coexist.
+ *
+ * To look up, insert or remove items, htable_lock() the bucket for a key,
+ * then go through the items in it with htable_bucket_iterate(), all of whose
+ * keys hash alike but not all of which have the key, so compare them, and
+ * htable_insert() or htable_remove() items of that key, before
+ * htable_unlock(). Only one bucket may be locked at a time, and lookups in
+ * different buckets do not contend with each other.
+ *
+ * Lookups may also take no lock at all, with htable_lookup_rcu() under
+ * rcu_read_lock() (see proc/rcu.h), as long as removed items are only freed
+ * through rcu_call(). For them, a bucket's chain does not end in NULL but in
+ * a marker naming the bucket, and a removed item keeps pointing on into the
+ * chain, so a reader standing on it still gets to the end. A reader that
+ * ends up at another bucket's marker was on an item moved by the table
+ * growing, and looks again.
+ *
+ * The table doubles in size once it holds more than HTABLE_LOAD items per
+ * bucket. To grow, it locks every bucket, moves the items into a new bucket
+ * array, and marks the old one as moved, so that anyone who was waiting for
+ * one of its buckets looks again in the new one. Old bucket arrays are kept
+ * until the table is destroyed, as there is no telling when nobody is
+ * looking at them any more; as each is half the size of the next, they take
+ * up less memory than the current one.
+ *
+ * Example usage:
+ *    htable_bucket_t *bucket = htable_lock(&table, pid);
+ *    htable_bucket_iterate(bucket, p, proc_t, p_hash_link)
+ *    {
+ *        if (p->p_pid == pid)
+ *            ... found ...
+ *    }
+ *    htable_unlock(&table, bucket);
+ */
+
+#define HTABLE_LOAD 2 /* items per bucket beyond which a table grows */
+
+typedef struct htable_link
+{
+    struct htable_link *hl_next;   /* the next item, or the bucket's marker */
+    struct htable_link **hl_pprev; /* what points here; NULL if not linked */
+    uint64_t hl_key;
+} htable_link_t;
+
+typedef struct htable_bucket
+{
+    htable_link_t *hb_first; /* the first item, or the bucket's marker */
+    spinlock_t hb_lock;
+    long hb_grow; /* an insertion filled the table up; see htable_unlock() */
+} htable_bucket_t;
+
+typedef struct htable_array
+{
+    size_t ha_nbuckets;           /* a power of 2 */
+    volatile long ha_moved;       /* items have moved to a newer array */
+    struct htable_array *ha_prev; /* the array this one replaced */
+    htable_bucket_t ha_buckets[];
+} htable_array_t;
+
+typedef struct htable
+{
+    htable_array_t *volatile ht_array;
+    size_t ht_count; /* number of items */
+    long ht_growing; /* set while a thread is growing the table */
+} htable_t;
+
+/**
+ * Initialize an empty table with at least the given number of buckets.
+ *
+ * @return 0 on success, or -ENOMEM
+ */
+long htable_init(htable_t *table, size_t nbuckets);
+
+/**
+ * Free the memory of an empty table.
+ */
+void htable_destroy(htable_t *table);
+
+/**
+ * Lock and return the bucket items with the given key are filed in.
+ */
+htable_bucket_t *htable_lock(htable_t *table, uint64_t key);
+
+/**
+ * Unlock a bucket. If the table has filled up, this grows it, and so may
+ * block; with an insertion between htable_lock() and htable_unlock(), no
+ * spinlocks may be held.
+ */
+void htable_unlock(htable_t *table, htable_bucket_t *bucket);
+
+/**
+ * File an item under a key in its bucket, which must be locked.
+ */
+void htable_insert(htable_t *table, htable_bucket_t *bucket,
+                   htable_link_t *link, uint64_t key);
+
+/**
+ * Take an item out of its bucket, which must be locked.
+ */
+void htable_remove(htable_t *table, htable_bucket_t *bucket,
+                   htable_link_t *link);
+
+/* Returns whether a lockless lookup's item is the one it is after */
+typedef long (*htable_match_t)(htable_link_t *link, void *arg);
+
+/**
+ * Find an item filed under a key without locking, from within
+ * rcu_read_lock(). The item stays valid until rcu_read_unlock().
+ *
+ * @param match if not NULL, called on each item with the key, and the first
+ *  it returns nonzero for is the one found
+ * @return the item found, or NULL
+ */
+htable_link_t *htable_lookup_rcu(htable_t *table, uint64_t key,
+                                 htable_match_t match, void *arg);
+
+/* The end of a bucket's chain, tagged in its low bit */
+#define HTABLE_END(bucket) ((htable_link_t *)((uintptr_t)(bucket) | 1))
+#define htable_is_end(link) ((uintptr_t)(link)&1)
+
+/**
+ * Returns whether an item is in a table.
+ */
+static inline long htable_link_is_linked(htable_link_t *link)
+{
+    return link->hl_pprev != NULL;
+}
+
+/**
+ * Initialize an item's link.
+ */
+static inline void htable_link_init(htable_link_t *link)
+{
+    link->hl_next = NULL;
+    link->hl_pprev = NULL;
+    link->hl_key = 0;
+}
+
+/**
+ * Get a pointer to the item that contains the given link, or NULL for the
+ * end of a chain.
+ */
+#define htable_item(link, type, member) \
+    (htable_is_end(link) ? (type *)NULL : CONTAINER_OF(link, type, member))
+
+/**
+ * Iterate over the items in a locked bucket, where member is the item's
+ * htable_link_t. Like list_iterate(), this works even if the current item is
+ * htable_remove()d.
+ */
+#define htable_bucket_iterate(bucket, var, type, member)                   \
+    for (type *var = htable_item((bucket)->hb_first, type, member),        \
+              *__next_##var =                                              \
+                  var ? htable_item(var->member.hl_next, type, member)     \
+                      : NULL;                                              \
+         var; var = __next_##var,                                          \
+              __next_##var =                                               \
+                  var ? htable_item(var->member.hl_next, type, member)     \
+                      : NULL)
@@ -1,9 +1,17 @@
 #pragma once
 
+#include "types.h"
+
+/*
+ * Initializers outside of kmain()'s table register themselves with
+ * init_func(), each followed by an init_depends() for every function that must
+ * have run before it, whether that is another init_func() or one of kmain()'s;
+ * init_call_all() runs them.
+ */
 #define init_func(func)          \
     __asm__(                     \
         ".pushsection .init\n\t" \
-        ".long " #func           \
+        ".quad " #func           \
         "\n\t"                   \
         ".string \"" #func       \
         "\"\n\t"                 \
@@ -11,11 +19,37 @@
 #define init_depends(name)       \
     __asm__(                     \
         ".pushsection .init\n\t" \
-        ".long 0\n\t"            \
+        ".quad 0\n\t"            \
         ".string \"" #name       \
         "\"\n\t"                 \
         ".popsection\n\t");
 
 typedef void (*init_func_t)();
 
+/* How long an initializer took at boot */
+typedef struct init_time
+{
+    const char *it_name;
+    uint64_t it_cycles; /* TSC cycles */
+} init_time_t;
+
+/* Boot times are kept for this many initializers, in the order they ran */
+#define INIT_MAX_TIMES 64
+
+/**
+ * Calls func, recording how long it took under name.
+ */
+void init_call(const char *name, init_func_t func);
+
+/**
+ * Returns the boot times recorded by init_call(), and sets *countp to their
+ * number.
+ */
+const init_time_t *init_times(size_t *countp);
+
+/**
+ * Runs every init_func(), each after those it depends on. Panics if one
+ * depends on a function that is neither an init_func() nor has been run with
+ * init_call(), or if their dependencies are circular.
+ */
 void init_call_all(void);
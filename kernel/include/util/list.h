@@ -162,6 +162,18 @@ void list_insert_tail(list_t *list, list_link_t *link);
  */
 void list_remove(list_link_t *link);
 
+/*
+ * Variants for lists that readers walk without the lock, with
+ * list_iterate_rcu() under rcu_read_lock() (see proc/rcu.h), while writers
+ * still hold it. Insertion publishes a link only once it points into the
+ * list. Removal leaves the link's l_next alone, so that a reader standing on
+ * it carries on along the list; the link may not be reused or freed until a
+ * grace period has passed.
+ */
+void list_insert_head_rcu(list_t *list, list_link_t *link);
+void list_insert_tail_rcu(list_t *list, list_link_t *link);
+void list_remove_rcu(list_link_t *link);
+
 /**
  * Get a pointer to the item that contains the given link. 
  * 
@@ -213,6 +225,20 @@ void list_remove(list_link_t *link);
          &var->member != (list);                            \
          var = __next_##var, __next_##var = list_next(var, type, member))
 
+/**
+ * Iterate over elements in a list without the lock, from within
+ * rcu_read_lock(). Unlike list_iterate(), the loop may not remove the current
+ * item.
+ */
+#define list_iterate_rcu(list, var, type, member)                          \
+    for (type *var = list_item(                                           \
+             __atomic_load_n(&(list)->l_next, __ATOMIC_ACQUIRE), type,    \
+             member);                                                     \
+         &var->member != (list);                                          \
+         var = list_item(                                                 \
+             __atomic_load_n(&var->member.l_next, __ATOMIC_ACQUIRE), type, \
+             member))
+
 /**
  * Iterate over the elements of a list in reverse. See comment at top of list.h for 
  * detailed description.
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A fast LZ77 codec producing the LZ4 block format: sequences of a token
+ * (4 bits of literal length, 4 of match length), the literals, and a 16-bit
+ * offset back to the match. It trades ratio for speed, finding matches with
+ * a single-entry hash table and no search, so that a page can be compressed
+ * in a few microseconds.
+ */
+
+/* Bytes of scratch space lz4_compress() needs */
+#define LZ4_HASH_BITS 12
+#define LZ4_WORK_SIZE (sizeof(uint16_t) << LZ4_HASH_BITS)
+
+/* Most input lz4_compress() takes at once, so that offsets fit in 16 bits */
+#define LZ4_MAX_INPUT 0xffff
+
+/**
+ * Compresses len bytes at src into at most cap bytes at dst.
+ *
+ * @param work LZ4_WORK_SIZE bytes of scratch space
+ * @return the size of the compressed data, or 0 if it does not fit in cap
+ */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t cap,
+                    void *work);
+
+/**
+ * Decompresses len bytes of compressed data at src into at most cap bytes at
+ * dst. Corrupt data is caught rather than read or written out of bounds.
+ *
+ * @return the size of the decompressed data, or -1 if the data is corrupt or
+ *  does not fit in cap
+ */
+ssize_t lz4_decompress(const void *src, size_t len, void *dst, size_t cap);
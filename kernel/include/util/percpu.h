@@ -0,0 +1,62 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Per-core split counters.
+ *
+ * A counter that every core updates, kept in one word, has its cache line
+ * bounce from core to core on every update. A split counter has a slot per
+ * core instead, each core adding to its own, and its value is the sum of the
+ * slots; updates stay in the updating core's cache, at the cost of reads,
+ * which go through every core's slot. They suit statistics, and references
+ * to long-lived objects that are taken and dropped far more often than
+ * counted (see mobj_refs_percpu()).
+ *
+ * The slots of every counter are laid out core by core, so that a core's
+ * slots share cache lines only with each other. A counter is the index of
+ * its slots. Slot 0 is never handed out, so that adds to a counter that was
+ * never initialized (one of zeroed memory) go nowhere that matters.
+ */
+
+#define PCPU_SLOTS 512
+
+typedef struct pcpu_counter
+{
+    size_t pc_slot; /* 0 if the counter has no slots */
+} pcpu_counter_t;
+
+/**
+ * Gives a counter slots of its own, starting at 0.
+ *
+ * @return 0 on success, or -ENOMEM if every slot is taken
+ */
+long pcpu_counter_init(pcpu_counter_t *c);
+
+/**
+ * Gives a counter's slots back. Nothing may be adding to it any more.
+ */
+void pcpu_counter_destroy(pcpu_counter_t *c);
+
+/**
+ * Adds n to a counter, from whichever core this runs on. A thread moving to
+ * another core halfway through adds to the first core's slot, which is still
+ * right, since the add is atomic.
+ */
+void pcpu_counter_add(pcpu_counter_t *c, long n);
+
+static inline void pcpu_counter_inc(pcpu_counter_t *c)
+{
+    pcpu_counter_add(c, 1);
+}
+
+static inline void pcpu_counter_dec(pcpu_counter_t *c)
+{
+    pcpu_counter_add(c, -1);
+}
+
+/**
+ * Returns the value of a counter: the sum of its slots, which is exact only
+ * if nothing is adding to it meanwhile.
+ */
+long pcpu_counter_read(pcpu_counter_t *c);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "types.h"
+
+#include "api/profile.h"
+
+/*
+ * Sampling profiler.
+ *
+ * Once started, the timer interrupt records a profile_sample_t every
+ * interval ticks, on each core, into a ring of PROFILE_SAMPLES samples owned
+ * by that core; readers take them out with profile_read(), as with the trace
+ * rings (see util/trace.h), and a full ring drops new samples.
+ *
+ * profile_dump() prints the samples to the debug port, for
+ * tools/profile-fold.py to resolve against symbols.dbg and fold into the
+ * input of a flame graph.
+ */
+
+struct regs;
+
+/* Called from the timer interrupt */
+void profile_tick(struct regs *regs);
+
+/**
+ * Starts sampling every interval ticks; the rings are allocated the first
+ * time.
+ *
+ * @return 0, -EINVAL if interval is not positive, or -ENOMEM
+ */
+long profile_start(long interval);
+
+void profile_stop();
+
+/**
+ * Takes up to count samples out of the rings. Must be called from a thread.
+ *
+ * @return the number of samples copied to buf
+ */
+size_t profile_read(profile_sample_t *buf, size_t count);
+
+/**
+ * Drains the rings to the debug port, one "profile:" line per sample.
+ */
+void profile_dump();
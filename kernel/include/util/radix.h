@@ -0,0 +1,95 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Radix tree mapping 64-bit integer keys (e.g. page numbers) to non-NULL
+ * pointers.
+ *
+ * Each interior node has RADIX_FANOUT slots and consumes RADIX_SHIFT bits of
+ * the key, so a tree of height h can hold any key < 2^(RADIX_SHIFT * h). The
+ * tree grows upward on demand when a larger key is inserted, and empty nodes
+ * are freed as soon as their last item is removed, so lookups, insertions and
+ * removals are O(log n) in the largest key rather than O(n) in the number of
+ * items.
+ *
+ * The tree does no locking of its own; callers must serialize access (e.g.
+ * mobj_t protects its page index with mo_mutex).
+ *
+ * Example usage:
+ *    radix_tree_t tree;
+ *    radix_tree_init(&tree);
+ *
+ *    if (radix_tree_insert(&tree, pagenum, pf))
+ *        ... out of memory ...
+ *    KASSERT(radix_tree_lookup(&tree, pagenum) == pf);
+ *    radix_tree_remove(&tree, pagenum);
+ */
+
+#define RADIX_SHIFT 6
+#define RADIX_FANOUT (1UL << RADIX_SHIFT)
+#define RADIX_MASK (RADIX_FANOUT - 1)
+
+/* Enough levels to cover every bit of a 64-bit key. */
+#define RADIX_MAX_HEIGHT ((64 + RADIX_SHIFT - 1) / RADIX_SHIFT)
+
+struct radix_node;
+
+typedef struct radix_tree
+{
+    struct radix_node *rt_root; /* root node, NULL if the tree is empty */
+    size_t rt_height;           /* number of levels below (and incl.) root */
+    size_t rt_count;            /* number of items stored */
+} radix_tree_t;
+
+#define RADIX_TREE_INITIALIZER                         \
+    {                                                  \
+        .rt_root = NULL, .rt_height = 0, .rt_count = 0 \
+    }
+
+/**
+ * Initializes the allocator backing radix tree nodes. Must be called after
+ * slab_init() and before any tree is inserted into.
+ */
+void radix_init();
+
+/**
+ * Initialize an empty radix tree.
+ */
+void radix_tree_init(radix_tree_t *tree);
+
+/**
+ * Look up the item stored under key.
+ *
+ * @return The item, or NULL if nothing is stored under key.
+ */
+void *radix_tree_lookup(radix_tree_t *tree, uint64_t key);
+
+/**
+ * Store item under key. There must not already be an item under key.
+ *
+ * @param item The item to store; must not be NULL.
+ * @return 0 on success, or -ENOMEM if a node could not be allocated, in which
+ *  case the tree is left unchanged.
+ */
+long radix_tree_insert(radix_tree_t *tree, uint64_t key, void *item);
+
+/**
+ * Remove the item stored under key, freeing any nodes left empty.
+ *
+ * @return The removed item, or NULL if nothing was stored under key.
+ */
+void *radix_tree_remove(radix_tree_t *tree, uint64_t key);
+
+/**
+ * Find the item with the smallest key that is at least *keyp, for walking a
+ * tree in key order.
+ *
+ * @return The item, with its key stored in *keyp, or NULL if there is none.
+ */
+void *radix_tree_next(radix_tree_t *tree, uint64_t *keyp);
+
+/**
+ * Returns the number of items in the tree.
+ */
+size_t radix_tree_count(radix_tree_t *tree);
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "kernel.h"
+
+/*
+ * Intrusive red-black tree, optionally augmented.
+ *
+ * rb_node_t should be included in structures which want to be kept in an
+ * rb_tree_t. The tree does not know about keys: to insert, the caller walks
+ * down from rt_root to the empty link where the new node belongs, and hands
+ * it and its parent to rb_insert(), which links the node in and rebalances.
+ * Lookups are plain walks down the tree in the same way. Every operation is
+ * O(log n).
+ *
+ * An augmented tree keeps in each node something computed from the node and
+ * its subtree (e.g. the largest end of the intervals below it, making an
+ * interval tree). The augment function given to rb_tree_init() recomputes it
+ * for one node from the node and its children, and the tree calls it on
+ * every node whose subtree changes. If what a node contributes changes while
+ * it is in the tree, the caller calls rb_update() on it.
+ *
+ * The tree does no locking of its own; callers must serialize access.
+ *
+ * Example usage, for a tree of struct my_struct keyed by ms_key:
+ *    rb_node_t **link = &tree->rt_root, *parent = NULL;
+ *    while (*link)
+ *    {
+ *        parent = *link;
+ *        link = item->ms_key < rb_item(parent, struct my_struct, ms_node)->ms_key
+ *                   ? &parent->rb_left : &parent->rb_right;
+ *    }
+ *    rb_insert(tree, &item->ms_node, parent, link);
+ *
+ *    rb_iterate(tree, ms, struct my_struct, ms_node)
+ *    {
+ *        ... visits the items in key order ...
+ *    }
+ */
+
+typedef struct rb_node
+{
+    struct rb_node *rb_parent;
+    struct rb_node *rb_left;
+    struct rb_node *rb_right;
+    long rb_red;
+} rb_node_t;
+
+/* Recomputes what an augmented tree keeps in node from it and its children */
+typedef void (*rb_augment_t)(rb_node_t *node);
+
+typedef struct rb_tree
+{
+    rb_node_t *rt_root;
+    rb_augment_t rt_augment; /* NULL if the tree is not augmented */
+    size_t rt_count;         /* number of nodes */
+} rb_tree_t;
+
+#define RB_TREE_INITIALIZER(augment)                            \
+    {                                                           \
+        .rt_root = NULL, .rt_augment = (augment), .rt_count = 0 \
+    }
+
+/**
+ * Initialize an empty tree.
+ *
+ * @param augment function keeping an augmented tree's nodes up to date, or
+ *  NULL
+ */
+void rb_tree_init(rb_tree_t *tree, rb_augment_t augment);
+
+/**
+ * Link a node in at *link, an empty child link of parent (or rt_root, with a
+ * NULL parent), and rebalance the tree.
+ */
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent,
+               rb_node_t **link);
+
+/**
+ * Remove a node from the tree and rebalance it.
+ */
+void rb_remove(rb_tree_t *tree, rb_node_t *node);
+
+/**
+ * Recompute what an augmented tree keeps in a node and in its ancestors, once
+ * what the node contributes has changed.
+ */
+void rb_update(rb_tree_t *tree, rb_node_t *node);
+
+/**
+ * The first (leftmost) and last (rightmost) nodes, or NULL if the tree is
+ * empty.
+ */
+rb_node_t *rb_first(rb_tree_t *tree);
+rb_node_t *rb_last(rb_tree_t *tree);
+
+/**
+ * The node following or preceding a node in order, or NULL if there is none.
+ */
+rb_node_t *rb_next(rb_node_t *node);
+rb_node_t *rb_prev(rb_node_t *node);
+
+/**
+ * Get a pointer to the item that contains the given node, or NULL for a NULL
+ * node. See list_item() in util/list.h.
+ */
+#define rb_item(node, type, member) \
+    ((node) ? CONTAINER_OF(node, type, member) : (type *)NULL)
+
+/**
+ * Iterate over the items of a tree in order. Like list_iterate(), this works
+ * even if the current item is rb_remove()d.
+ */
+#define rb_iterate(tree, var, type, member)                             \
+    for (type *var = rb_item(rb_first(tree), type, member),             \
+              *__next_##var =                                           \
+                  var ? rb_item(rb_next(&var->member), type, member)    \
+                      : NULL;                                           \
+         var; var = __next_##var,                                       \
+              __next_##var =                                            \
+                  var ? rb_item(rb_next(&var->member), type, member)    \
+                      : NULL)
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "kernel.h"
+
+/*
+ * Sequence counters, for readers that would rather retry than lock.
+ *
+ * Writers, serialized among themselves by some lock, bracket each change with
+ * seqcount_write_begin() and seqcount_write_end(), which leave the count odd
+ * while the change is under way. A reader notes the count with
+ * seqcount_read_begin(), reads what it protects without any lock, and then
+ * asks seqcount_read_retry() whether a writer came by in the meantime, in
+ * which case what it read may be inconsistent and must be thrown away.
+ * What the reader reads must stay safe to read throughout (see proc/rcu.h).
+ *
+ * Example usage:
+ *    uint64_t seq;
+ *    do
+ *    {
+ *        seq = seqcount_read_begin(&sc);
+ *        ... copy out what sc protects ...
+ *    } while (seqcount_read_retry(&sc, seq));
+ */
+
+typedef struct seqcount
+{
+    uint64_t sc_seq;
+} seqcount_t;
+
+#define SEQCOUNT_INITIALIZER \
+    {                        \
+        .sc_seq = 0          \
+    }
+
+static inline void seqcount_write_begin(seqcount_t *sc)
+{
+    __atomic_store_n(&sc->sc_seq, sc->sc_seq + 1, __ATOMIC_RELAXED);
+    /* the change must not be seen before the count is */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqcount_write_end(seqcount_t *sc)
+{
+    __atomic_store_n(&sc->sc_seq, sc->sc_seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the count, for seqcount_read_retry(); if it is odd, a change is
+ * under way, and the read is bound to be retried.
+ */
+static inline uint64_t seqcount_read_begin(seqcount_t *sc)
+{
+    return __atomic_load_n(&sc->sc_seq, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Returns whether what was read since seqcount_read_begin() returned seq may
+ * have been changed under the reader.
+ */
+static inline long seqcount_read_retry(seqcount_t *sc, uint64_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) || __atomic_load_n(&sc->sc_seq, __ATOMIC_RELAXED) != seq;
+}
@@ -63,6 +63,8 @@ int memcmp(const void *cs, const void *ct, size_t count);
 
 void *memcpy(void *dest, const void *src, size_t count);
 
+void *memmove(void *dest, const void *src, size_t count);
+
 int strncmp(const char *cs, const char *ct, size_t count);
 
 int strcmp(const char *cs, const char *ct);
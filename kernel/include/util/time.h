@@ -8,18 +8,53 @@ extern uint64_t kernel_preempted_count;
 extern uint64_t user_preempted_count;
 extern uint64_t not_preempted_count;
 extern uint64_t idle_count;
+#define timer_tickcount CSD(timer_tickcount)
+#define kernel_preempted_count CSD(kernel_preempted_count)
+#define user_preempted_count CSD(user_preempted_count)
+#define not_preempted_count CSD(not_preempted_count)
+#define idle_count CSD(idle_count)
 extern volatile uint64_t jiffies;
 
+#define NS_PER_SEC 1000000000UL
+
+/* See time_ns() */
+extern uint64_t time_tsc_boot;
+extern uint64_t time_tsc_mult;
+extern time_t time_boot_epoch; /* do_time() when time_tsc_boot was read */
+
 void time_init();
 
+void time_idle_enter();
+
+void time_idle_exit();
+
 void time_spin(time_t ms);
 
 void time_sleep(time_t ms);
 
 long do_usleep(useconds_t usec);
 
+/* Sleeps for ns nanoseconds, or until cancelled, in which case it returns
+ * -EINTR; *remp is set to the time that was left. */
+long do_nanosleep(uint64_t ns, uint64_t *remp);
+
+/* Returns the nanoseconds since boot, from the TSC */
+uint64_t time_ns();
+
+/* Converts a number of TSC cycles to nanoseconds */
+uint64_t time_tsc_to_ns(uint64_t cycles);
+
+/* Synchronize a starting AP's TSC with core 0's: the AP calls
+ * time_tsc_sync_target(), with interrupts disabled, while core 0 calls
+ * time_tsc_sync_source(). */
+void time_tsc_sync_source();
+void time_tsc_sync_target();
+
+/* The milliseconds since boot */
 time_t core_uptime();
 
+uint64_t time_ms_to_jiffies(time_t ms);
+
 time_t do_time();
 
 size_t time_stats(char *buf, size_t len);
@@ -9,20 +9,28 @@ typedef struct timer
     uint64_t data;
     uint64_t expires;
     list_link_t link;
+    struct timer_base *base; /* wheel the timer was last added to */
 } timer_t;
 
+/* Sets up the current core's timers; called by time_init(). */
+void timers_init();
+
 void timer_init(timer_t *timer);
 
 void timer_add(timer_t *timer);
 
 int timer_del(timer_t *timer);
 
-int timer_mod(timer_t *timer, int expires);
+int timer_mod(timer_t *timer, uint64_t expires);
 
 int timer_pending(timer_t *timer);
 
 int timer_del_sync(timer_t *timer);
 
+/* Returns the earliest expiry time of a pending timer (in jiffies), or
+ * (uint64_t)-1 if there is none. */
+uint64_t timers_next_expiry();
+
 void __timers_fire();
 
 #endif
\ No newline at end of file
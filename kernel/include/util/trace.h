@@ -0,0 +1,63 @@
+#pragma once
+
+#include "types.h"
+
+#include "api/trace.h"
+
+/*
+ * Binary event tracing.
+ *
+ * trace() appends a fixed-size record to a ring owned by the calling core.
+ * Only that core writes to its ring, with interrupts masked, so recording
+ * takes no lock and never waits on the serial port; when a ring is full the
+ * new record is dropped and counted as lost. Readers drain the rings with
+ * trace_read(), which /dev/trace returns records from, or have them printed
+ * to the debug port by trace_dump().
+ *
+ * Records come out one core at a time, in order within a core; sort them by
+ * tr_time for a single timeline, as /usr/bin/trace does. The events and the
+ * record format are in api/trace.h.
+ *
+ * Each event can be turned off on its own, in trace_mask; a tracepoint that
+ * is off costs a load and a branch.
+ */
+
+#define TRACE_BIT(event) (1UL << (event))
+#define TRACE_ALL (TRACE_BIT(TRACE_NEVENTS) - 2)
+
+/* The events trace() records, as TRACE_BIT()s; all of them by default */
+extern uint64_t trace_mask;
+
+void trace_record(uint32_t event, uint64_t a0, uint64_t a1, uint64_t a2);
+
+#define trace(event, a0, a1, a2)                                             \
+    do                                                                       \
+    {                                                                        \
+        if (trace_mask & TRACE_BIT(event))                                   \
+        {                                                                    \
+            trace_record((event), (uint64_t)(a0), (uint64_t)(a1),            \
+                         (uint64_t)(a2));                                    \
+        }                                                                    \
+    } while (0)
+
+/**
+ * Takes up to count records out of the rings. Must be called from a thread.
+ *
+ * @return the number of records copied to buf
+ */
+size_t trace_read(trace_record_t *buf, size_t count);
+
+/**
+ * Drains the rings to the debug port, one line per record.
+ */
+void trace_dump();
+
+/**
+ * Returns the number of records dropped because a ring was full.
+ */
+uint64_t trace_lost();
+
+/**
+ * Returns the event with the given name, or 0 if there is none.
+ */
+long trace_event_lookup(const char *name);
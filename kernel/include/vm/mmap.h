@@ -6,3 +6,11 @@ long do_munmap(void *addr, size_t len);
 
 long do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
              void **ret);
+
+void do_mmap_populate(void *addr, size_t len, int prot);
+
+long do_mprotect(void *addr, size_t len, int prot);
+
+long do_madvise(void *addr, size_t len, int advice);
+
+long do_msync(void *addr, size_t len, int flags);
@@ -9,3 +9,20 @@
 #define FAULT_EXEC 0x10
 
 void handle_pagefault(uintptr_t vaddr, uintptr_t cause);
+
+/**
+ * Does the work of handle_pagefault(), but returns -EFAULT rather than
+ * killing the process if the access is not allowed. Used for the kernel's
+ * own accesses to user memory; see user_copy_fault().
+ */
+long pagefault_resolve(uintptr_t vaddr, uintptr_t cause);
+
+struct proc;
+
+/**
+ * Logs how many page faults the process took since its last exec, and how
+ * many pages had to be read in from files or disks (rather than found
+ * resident) to serve them, then starts counting afresh. Called on exec and
+ * on exit, so the numbers cover one program image.
+ */
+void pagefault_report(struct proc *p);
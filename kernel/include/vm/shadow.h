@@ -6,6 +6,10 @@ void shadow_init();
 
 mobj_t *shadow_create(mobj_t *shadowed);
 
+mobj_t *shadow_bottom(mobj_t *o);
+
+long shadow_chain_has_pframe(mobj_t *o, uint64_t pagenum);
+
 void shadow_collapse(mobj_t *o);
 
 extern int shadow_count;
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "types.h"
+
+#include "mm/mobj.h"
+#include "mm/pframe.h"
+
+/*
+ * Swap space for anonymous and shadow pages.
+ *
+ * With more than one disk, the last one is used raw as swap: its first
+ * SWAP_SLOTS blocks are page-sized slots, handed out from a bitmap. Each
+ * anonymous or shadow mobj records the slots holding its pages in
+ * mo_swap_idx, by page number.
+ *
+ * Page reclaim evicts these pages like any other once swap is enabled: the
+ * page is first unmapped from every process (vmmap_unmap_pframe()), then, if
+ * dirty, flushed, which writes it to its slot (swap_out()). Filling a pframe
+ * reads the page back from its slot if it has one (swap_in()). A page keeps
+ * its slot after being read back, so the slot acts as a swap cache: a page
+ * that has not been written to since can be evicted again without any I/O.
+ * The slots are freed with the mobj.
+ *
+ * Before going to disk, a page is compressed into memory (util/lz4.h), if it
+ * compresses to 3/4 of a page or less and the ZSWAP_MAX_PAGES pages of memory
+ * set aside for this are not used up. The compressed copy is kept in objects
+ * of slab allocators of 256-byte size classes, and takes the place of a slot
+ * of its own, numbered past SWAP_SLOTS. Unlike a slot on disk, it is freed
+ * when the page is dirtied, as it is only worth its memory while it saves
+ * the page from being written again. Without a disk to spare, this is all
+ * the swap there is.
+ *
+ * Swap is only set up in kernels built with VM: until mmap(), vmmap and
+ * shadow objects exist, the only anonymous memory is that of tmpfs files,
+ * and no page is mapped into a process to be unmapped first. Without it
+ * swap_enabled() is false, and the functions below find nothing in swap.
+ */
+
+/* What swap has done since boot */
+typedef struct swap_stats
+{
+    size_t ss_slots; /* on disk, 0 if there is no disk for swap */
+    size_t ss_used;
+    size_t ss_out; /* pages written to swap */
+    size_t ss_in;  /* pages read back */
+    size_t ss_compressed;       /* pages kept compressed in memory */
+    size_t ss_compressed_pages; /* memory those take up */
+    size_t ss_rejected;         /* pages that did not compress well enough */
+} swap_stats_t;
+
+/* With VM, sets up compressed swap, and swap on the last disk if there is
+ * more than one */
+void swap_init();
+
+/**
+ * Returns whether there is swap space, i.e. whether anonymous and shadow
+ * pages can be reclaimed.
+ */
+long swap_enabled();
+
+/**
+ * Returns whether a page of a locked mobj is in swap.
+ */
+static inline long swap_has_page(mobj_t *o, uint64_t pagenum)
+{
+    return radix_tree_lookup(&o->mo_swap_idx, pagenum) != NULL;
+}
+
+/**
+ * Reads a page back from swap into a locked pframe of a locked mobj.
+ *
+ * @return 1 if it was read, 0 if the page is not in swap, or -errno
+ */
+long swap_in(mobj_t *o, pframe_t *pf);
+
+/**
+ * Writes a locked pframe of a locked mobj to swap, compressing it into memory
+ * if it can, or else giving the page a slot on disk if it has none. Does
+ * nothing for mobjs being destroyed, or without swap.
+ *
+ * @return 0 on success, -ENOSPC if swap is full, or -errno
+ */
+long swap_out(mobj_t *o, pframe_t *pf);
+
+/**
+ * Frees the swap slot, if any, of a page of a locked mobj whose contents are
+ * being thrown away.
+ */
+void swap_discard(mobj_t *o, uint64_t pagenum);
+
+/**
+ * Called when a pframe of a locked mobj is dirtied. A slot on disk for the
+ * page is kept to be written over, but a compressed page no longer matches
+ * it, and is dropped.
+ */
+void swap_dirtied(mobj_t *o, uint64_t pagenum);
+
+/**
+ * Frees the swap slots of a locked mobj that is being destroyed.
+ */
+void swap_release(mobj_t *o);
+
+/**
+ * Copies out swap statistics.
+ */
+void swap_stats_get(swap_stats_t *stats);
@@ -2,21 +2,30 @@
 
 #include "types.h"
 
+#include "proc/rwlock.h"
 #include "util/list.h"
+#include "util/rbtree.h"
 
 #define VMMAP_DIR_LOHI 1
 #define VMMAP_DIR_HILO 2
 
 struct mobj;
+struct pframe;
 struct proc;
 struct vnode;
 
 
 
+struct vmarea;
+
 typedef struct vmmap
 {
-    list_t vmm_list;       /* list of virtual memory areas */
+    list_t vmm_list;          /* list of virtual memory areas, sorted */
+    rb_tree_t vmm_tree;       /* the same areas as a balanced search tree */
+    struct vmarea *vmm_last;  /* area last found by vmmap_lookup(), or NULL */
     struct proc *vmm_proc; /* the process that corresponds to this vmmap */
+    rwlock_t vmm_lock;     /* held shared to look up areas (as page faults
+                            * do), exclusively to change them */
 } vmmap_t;
 
 /* Make sure you understand why mapping boundaries are in terms of frame
@@ -37,11 +46,20 @@ typedef struct vmarea
 
     struct vmmap *vma_vmmap; /* address space that this area belongs to */
     struct mobj *vma_obj;    /* the memory object that corresponds to this address region */
+    int vma_advice;          /* MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL */
+    size_t vma_ra_end;       /* vfn following the last page read ahead */
     list_link_t vma_plink;   /* link on process vmmap maps list */
+    list_link_t vma_olink;   /* link on the reverse map (mo_vmas) of the
+                              * bottom of vma_obj's shadow chain */
+
+    rb_node_t vma_node; /* node in vmm_tree, keyed by vma_start; see vmmap.c */
+    size_t vma_max_gap; /* largest vmarea_gap() in this subtree */
 } vmarea_t;
 
 void vmmap_init(void);
 
+vmarea_t *vmarea_alloc(void);
+
 vmmap_t *vmmap_create(void);
 
 void vmmap_destroy(vmmap_t **mapp);
@@ -55,6 +73,8 @@ long vmmap_map(vmmap_t *map, struct vnode *file, size_t lopage, size_t npages,
 
 long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages);
 
+long vmmap_protect(vmmap_t *map, size_t lopage, size_t npages, int prot);
+
 long vmmap_is_range_empty(vmmap_t *map, size_t startvfn, size_t npages);
 
 void vmmap_insert(vmmap_t *map, vmarea_t *new_vma); 
@@ -67,6 +87,25 @@ long vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count);
 
 vmmap_t *vmmap_clone(vmmap_t *map);
 
+/*
+ * Starts reading pages [vfn, vfn + npages) of a file-backed area in the
+ * background, as far as the end of the area. Does nothing for other areas.
+ */
+void vmarea_readahead(vmarea_t *vma, size_t vfn, size_t npages);
+
+size_t vmmap_rss(vmmap_t *map);
+
+/*
+ * Unmaps a locked pframe of a locked mobj wherever it is mapped, and flushes
+ * the TLBs, so that it can be evicted or moved. The areas that may map it are
+ * found through the reverse map of the bottom of the mobj's shadow chain,
+ * rather than by searching every address space. Must not be called with
+ * interrupts disabled. Returns 0, or -EBUSY if an address space that may map
+ * the page is in use (e.g. by a page fault), in which case some mappings may
+ * remain. Without VM, no area maps a mobj's pages, and this does nothing.
+ */
+long vmmap_unmap_pframe(struct mobj *o, struct pframe *pf);
+
 size_t vmmap_mapping_info_helper(const void *map, char *buf, size_t size,
                                  char *prompt);
 
@@ -82,25 +82,13 @@
 #define LOCAL_APIC_TMR_BASEDIV (1 << 20)
 
 #define APIC_ADDR (apic->at_addr + PHYS_OFFSET)
-#define APIC_REG(x) (*(uint32_t *)(APIC_ADDR + (x)))
-#define LAPICID APIC_REG(LOCAL_APIC_ID)
-#define LAPICVER APIC_REG(LOCAL_APIC_VERSION)
-#define LAPICTPR APIC_REG(LOCAL_APIC_TASKPRIOR)
-#define LAPICSPUR APIC_REG(LOCAL_APIC_SPURIOUS)
-#define LAPICEOI APIC_REG(LOCAL_APIC_EOI)
-#define LAPICDFR APIC_REG(LOCAL_APIC_DFR)
-#define LAPICLDR APIC_REG(LOCAL_APIC_LDR)
-#define LAPICLVTTMR APIC_REG(LOCAL_APIC_LVT_TMR)
-#define LAPICLVTPERF APIC_REG(LOCAL_APIC_LVT_PERF)
-#define LAPICLVTLINT0 APIC_REG(LOCAL_APIC_LVT_LINT0)
-#define LAPICLVTLINT1 APIC_REG(LOCAL_APIC_LVT_LINT1)
-#define LAPICLVTERR APIC_REG(LOCAL_APIC_LVT_ERR)
-#define LAPICTIC APIC_REG(LOCAL_APIC_TMRINITCNT)
-#define LAPICTCC APIC_REG(LOCAL_APIC_TMRCURRCNT)
-#define LAPICTMRDIV APIC_REG(LOCAL_APIC_TMRDIV)
-#define LAPICICRH APIC_REG(LOCAL_APIC_ICRH)
-#define LAPICICRL APIC_REG(LOCAL_APIC_ICRL)
-#define LAPICESR APIC_REG(LOCAL_APIC_ESR)
+#define APIC_REG(x) (*(volatile uint32_t *)(APIC_ADDR + (x)))
+
+/* In x2APIC mode, the registers are MSRs, at this base plus their MMIO
+ * offset / 16; the ICR is one 64-bit MSR */
+#define IA32_APIC_BASE_MSR_X2APIC 0x400
+#define X2APIC_MSR_BASE 0x800
+#define X2APIC_MSR(x) (X2APIC_MSR_BASE + ((x) >> 4))
 
 /* IO APIC */
 #define IOAPIC_IOWIN 0x10
@@ -162,30 +150,93 @@ static ioapic_table_t *ioapic = NULL;
 static lapic_table_t *lapics[MAX_LAPICS + 1] = {NULL};
 static long max_apicid;
 
+/* Initial count and divide configuration of the periodic tick, as set up by
+ * apic_enable_periodic_timer() */
+static uint32_t apic_tick_count;
+static uint32_t apic_tick_div;
+
 static long initialized = 0;
 
+/* Set by apic_init() if the local APICs are driven through MSRs (x2APIC
+ * mode), which is cheaper than MMIO: EOI and TPR writes and IPIs are not
+ * serializing, and need no trip through the APIC page, which a hypervisor
+ * has to trap. Every core switches over in apic_x2apic_enter(). */
+static long apic_x2;
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    if (apic_x2)
+    {
+        uint32_t lo, hi;
+        cpuid_get_msr(X2APIC_MSR(reg), &lo, &hi);
+        return lo;
+    }
+    return APIC_REG(reg);
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+    if (apic_x2)
+    {
+        cpuid_set_msr(X2APIC_MSR(reg), value, 0);
+    }
+    else
+    {
+        APIC_REG(reg) = value;
+    }
+}
+
+/*
+ * Sends an IPI: icr_low's delivery mode, vector and shorthand, to the
+ * physical APIC id dest if there is no shorthand. In xAPIC mode, logical
+ * destinations are also used, as set up in apic_enable().
+ */
+static void lapic_write_icr(uint32_t icr_low, uint32_t dest)
+{
+    if (apic_x2)
+    {
+        /* unlike a store to the xAPIC page, the ICR MSR write is not
+         * serializing, so without the fence an IPI can overtake the stores it
+         * is meant to publish */
+        __asm__ volatile("mfence; lfence" ::: "memory");
+        cpuid_set_msr(X2APIC_MSR(LOCAL_APIC_ICRL), icr_low, dest);
+    }
+    else
+    {
+        APIC_REG(LOCAL_APIC_ICRH) = dest << 24;
+        APIC_REG(LOCAL_APIC_ICRL) = icr_low;
+    }
+}
+
 // Returns the maximum APIC ID
 inline long apic_max_id() { return max_apicid; }
 
-/* [APIC  ID------------------------] */
-inline static long __lapic_getid(void) { return (LAPICID >> 24) & 0xff; }
+/* [APIC  ID------------------------], or all 32 bits in x2APIC mode */
+inline static long __lapic_getid(void)
+{
+    uint32_t id = lapic_read(LOCAL_APIC_ID);
+    return apic_x2 ? id : (id >> 24) & 0xff;
+}
 
 // Returns the APIC ID of the current processor/core
 inline long apic_current_id() { return __lapic_getid(); }
 
-inline static uint32_t __lapic_getver(void) { return LAPICVER & 0xff; }
+inline static uint32_t __lapic_getver(void)
+{
+    return lapic_read(LOCAL_APIC_VERSION) & 0xff;
+}
 
 inline static void __lapic_setspur(uint8_t intr)
 {
-    uint32_t data = LAPICSPUR | LOCAL_APIC_SW_ENABLE;
+    uint32_t data = lapic_read(LOCAL_APIC_SPURIOUS) | LOCAL_APIC_SW_ENABLE;
     *((uint8_t *)&data) = intr;
-    LAPICSPUR = data;
+    lapic_write(LOCAL_APIC_SPURIOUS, data);
 }
 
 /* [LOGICID-------------------------] */
 inline static void __lapic_setlogicalid(uint8_t id)
 {
-    LAPICLDR = ((uint32_t)id) << 24;
+    lapic_write(LOCAL_APIC_LDR, ((uint32_t)id) << 24);
 }
 
 inline static uint32_t ioapic_read(uint8_t reg_offset)
@@ -267,7 +318,9 @@ static uint32_t apic_exists(void)
 static void apic_set_base(uint32_t apic)
 {
     uint32_t edx = 0;
-    uint32_t eax = (apic & 0xfffff000) | IA32_APIC_BASE_MSR_ENABLE;
+    /* once in x2APIC mode, a core may only leave it by disabling the APIC */
+    uint32_t eax = (apic & 0xfffff000) | IA32_APIC_BASE_MSR_ENABLE |
+                   (apic_x2 ? IA32_APIC_BASE_MSR_X2APIC : 0);
     edx = 0;
     cpuid_set_msr(IA32_APIC_BASE_MSR, eax, edx);
 }
@@ -281,25 +334,31 @@ static uint32_t apic_get_base(void)
 
 static long __apic_err()
 {
-    dbg(DBG_PRINT, "[+] APIC Error: 0x%d", LAPICESR);
+    /* the ESR latches the errors when written */
+    lapic_write(LOCAL_APIC_ESR, 0);
+    dbg(DBG_PRINT, "[+] APIC Error: 0x%x", lapic_read(LOCAL_APIC_ESR));
     __asm__("cli; hlt");
     return 0;
 }
 
 void apic_enable()
 {
-    // [MODE---------------------------]
-    //     L
-    LAPICDFR = 0xffffffff;
-
     KASSERT(apic_current_id() < 8);
-    __lapic_setlogicalid((uint8_t)(1 << apic_current_id()));
-    LAPICLVTTMR = LOCAL_APIC_DISABLE;
-    LAPICLVTPERF = LOCAL_APIC_NMI;
-    LAPICLVTLINT0 = LOCAL_APIC_DISABLE;
-    LAPICLVTLINT1 = LOCAL_APIC_DISABLE;
-    LAPICLVTERR = INTR_APICERR;
-    LAPICTPR = 0;
+    /* in x2APIC mode, the logical id is fixed, and made from the APIC id:
+     * 1 << id in cluster 0 for the ids here, as the flat model's below */
+    if (!apic_x2)
+    {
+        // [MODE---------------------------]
+        //     L
+        lapic_write(LOCAL_APIC_DFR, 0xffffffff);
+        __lapic_setlogicalid((uint8_t)(1 << apic_current_id()));
+    }
+    lapic_write(LOCAL_APIC_LVT_TMR, LOCAL_APIC_DISABLE);
+    lapic_write(LOCAL_APIC_LVT_PERF, LOCAL_APIC_NMI);
+    lapic_write(LOCAL_APIC_LVT_LINT0, LOCAL_APIC_DISABLE);
+    lapic_write(LOCAL_APIC_LVT_LINT1, LOCAL_APIC_DISABLE);
+    lapic_write(LOCAL_APIC_LVT_ERR, INTR_APICERR);
+    lapic_write(LOCAL_APIC_TASKPRIOR, 0);
     apic_set_base(apic_get_base());
     apic_setspur(INTR_SPURIOUS);
     intr_register(INTR_APICERR, __apic_err);
@@ -307,16 +366,19 @@ void apic_enable()
 
 void apic_disable_periodic_timer()
 {
-    LAPICLVTTMR = LOCAL_APIC_DISABLE;
-    LAPICLVTPERF = LOCAL_APIC_NMI;
-    LAPICLVTLINT0 = LOCAL_APIC_DISABLE;
-    LAPICLVTLINT1 = LOCAL_APIC_DISABLE;
-    LAPICTPR = 0;
+    lapic_write(LOCAL_APIC_LVT_TMR, LOCAL_APIC_DISABLE);
+    lapic_write(LOCAL_APIC_LVT_PERF, LOCAL_APIC_NMI);
+    lapic_write(LOCAL_APIC_LVT_LINT0, LOCAL_APIC_DISABLE);
+    lapic_write(LOCAL_APIC_LVT_LINT1, LOCAL_APIC_DISABLE);
+    lapic_write(LOCAL_APIC_TASKPRIOR, 0);
 }
 
+/* The TSC frequency in Hz, measured over the same PIT window as the bus's */
+static uint64_t tsc_freq;
+
 /* get_cpu_bus_frequency - Uses PIT to determine APIC frequency in Hz (ticks per
- * second). NOTE: NOT SMP FRIENDLY! Note: For more info, visit the osdev wiki
- * page on the Programmable Interval Timer. */
+ * second), and the TSC frequency along with it. NOTE: NOT SMP FRIENDLY! Note:
+ * For more info, visit the osdev wiki page on the Programmable Interval Timer. */
 static uint32_t get_cpu_bus_frequency()
 {
     static uint32_t freq = 0;
@@ -324,7 +386,7 @@ static uint32_t get_cpu_bus_frequency()
     {
         /* Division rate: 0b1011 corresponds to division by 1, which does
          * nothing. */
-        LAPICTMRDIV = 0b1011;
+        lapic_write(LOCAL_APIC_TMRDIV, 0b1011);
 
         /* 0x61 controls the PC speaker.
          * Clearing bit 1 prevents any sound.
@@ -347,20 +409,32 @@ static uint32_t get_cpu_bus_frequency()
         outb(0x61, (uint8_t)tmp);
         outb(0x61, (uint8_t)(tmp | 1));
         /* Reset APIC's initial countdown value. */
-        LAPICTIC = 0xffffffff;
+        lapic_write(LOCAL_APIC_TMRINITCNT, 0xffffffff);
+        uint64_t tsc_start = cpuid_rdtsc();
         /* PC speaker sets bit 5 when it hits 0. */
         while (!(inb(0x61) & 0x20))
             ;
+        uint64_t tsc_end = cpuid_rdtsc();
         /* Stop the APIC timer */
-        LAPICLVTTMR = LOCAL_APIC_DISABLE;
+        lapic_write(LOCAL_APIC_LVT_TMR, LOCAL_APIC_DISABLE);
         /* Subtract current count from the initial count to get total ticks per
          * second. */
-        freq = (LAPICTIC - LAPICTCC) * 100;
-        dbgq(DBG_CORE, "CPU Bus Freq: %u ticks per second\n", freq);
+        freq = (lapic_read(LOCAL_APIC_TMRINITCNT) -
+                lapic_read(LOCAL_APIC_TMRCURRCNT)) *
+               100;
+        tsc_freq = (tsc_end - tsc_start) * 100;
+        dbgq(DBG_CORE, "CPU Bus Freq: %u ticks per second, TSC: %lu Hz\n", freq,
+             tsc_freq);
     }
     return freq;
 }
 
+uint64_t apic_tsc_frequency()
+{
+    get_cpu_bus_frequency();
+    return tsc_freq;
+}
+
 /* apic_enable_periodic_timer - Starts the periodic timer (continuously send
  * interrupts) at a given frequency. For more information, refer to: Intel
  * System Programming Guide, Vol 3A Part 1, 10.5.4. */
@@ -421,12 +495,35 @@ void apic_enable_periodic_timer(uint32_t freq)
     /* Set up three registers to configure timer:
      * 1) Initial count: count down from this value, send interrupt upon hitting
      * 0. */
-    LAPICTIC = tmp / freq;
+    apic_tick_count = tmp / freq;
+    lapic_write(LOCAL_APIC_TMRINITCNT, apic_tick_count);
     /* 3) Divide config: calculated above to cut bus clock. */
-    LAPICTMRDIV = div;
+    apic_tick_div = div;
+    lapic_write(LOCAL_APIC_TMRDIV, div);
     /* 2) LVT timer: use a periodic timer and raise the provided interrupt
      * vector. */
-    LAPICLVTTMR = LOCAL_APIC_TMR_PERIODIC | INTR_APICTIMER;
+    lapic_write(LOCAL_APIC_LVT_TMR, LOCAL_APIC_TMR_PERIODIC | INTR_APICTIMER);
+}
+
+uint64_t apic_timer_oneshot(uint64_t nticks)
+{
+    KASSERT(apic_tick_count && nticks);
+    nticks = MIN(nticks, 0xffffffff / apic_tick_count);
+    lapic_write(LOCAL_APIC_LVT_TMR, INTR_APICTIMER); /* one-shot mode */
+    lapic_write(LOCAL_APIC_TMRDIV, apic_tick_div);
+    lapic_write(LOCAL_APIC_TMRINITCNT, (uint32_t)(nticks * apic_tick_count));
+    return nticks;
+}
+
+uint64_t apic_timer_resume_periodic(uint64_t nticks)
+{
+    /* the current count stays at 0 once a one-shot count has run out */
+    uint64_t left = lapic_read(LOCAL_APIC_TMRCURRCNT);
+    uint64_t elapsed = nticks * apic_tick_count - left;
+    lapic_write(LOCAL_APIC_LVT_TMR, LOCAL_APIC_TMR_PERIODIC | INTR_APICTIMER);
+    lapic_write(LOCAL_APIC_TMRINITCNT, apic_tick_count);
+    /* the period that was under way is lost to the restart, so round */
+    return (elapsed + apic_tick_count / 2) / apic_tick_count;
 }
 
 static void apic_disable_8259()
@@ -479,6 +576,16 @@ void apic_init()
 
     map_apic_addr(apic->at_addr);
 
+    /* x2APIC if the processor has it, or if firmware already switched to it
+     * (which cannot be undone) */
+    uint32_t eax, ebx, ecx, edx, base_lo, base_hi;
+    cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+    cpuid_get_msr(IA32_APIC_BASE_MSR, &base_lo, &base_hi);
+    apic_x2 = (ecx & CPUID_FEAT_ECX_x2APIC) ||
+              (base_lo & IA32_APIC_BASE_MSR_X2APIC);
+    apic_x2apic_enter();
+    dbgq(DBG_CORE, "local APIC mode:     %s\n", apic_x2 ? "x2APIC" : "xAPIC");
+
     /* Get the tables for the local APIC and IO APICS */
     uint8_t off = sizeof(*apic);
     while (off < apic->at_header.ah_size)
@@ -537,9 +644,12 @@ void apic_init()
 
 inline long apic_initialized() { return initialized; }
 
-inline uint8_t apic_getipl() { return (uint8_t)LAPICTPR; }
+inline uint8_t apic_getipl()
+{
+    return (uint8_t)lapic_read(LOCAL_APIC_TASKPRIOR);
+}
 
-inline void apic_setipl(uint8_t ipl) { LAPICTPR = ipl; }
+inline void apic_setipl(uint8_t ipl) { lapic_write(LOCAL_APIC_TASKPRIOR, ipl); }
 
 inline void apic_setspur(uint8_t intr)
 {
@@ -547,7 +657,7 @@ inline void apic_setspur(uint8_t intr)
     __lapic_setspur(intr);
 }
 
-inline void apic_eoi() { LAPICEOI = 0x0; }
+inline void apic_eoi() { lapic_write(LOCAL_APIC_EOI, 0x0); }
 
 void apic_setredir(uint32_t irq, uint8_t intr)
 {
@@ -570,8 +680,7 @@ void apic_start_processor(uint8_t processor, uint8_t execution_page)
 
     dbg(DBG_CORE, "Sending IPI: ICR_LOW = 0x%.8x, ICR_HIGH = 0x%.8x\n", icr_low,
         processor << 24);
-    LAPICICRH = processor << 24;
-    LAPICICRL = icr_low;
+    lapic_write_icr(icr_low, processor);
 
     apic_wait_ipi();
 
@@ -585,8 +694,7 @@ void apic_start_processor(uint8_t processor, uint8_t execution_page)
     dbg(DBG_CORE, "Sending IPI: ICR_LOW = 0x%.8x, ICR_HIGH = 0x%.8x\n", icr_low,
         processor << 24);
 
-    LAPICICRH = processor << 24;
-    LAPICICRL = icr_low;
+    lapic_write_icr(icr_low, processor);
 
     apic_wait_ipi();
 }
@@ -603,18 +711,23 @@ void apic_send_ipi(uint8_t target, ipi_destination_mode mode, uint8_t vector)
     uint32_t icr_low = 0;
     icr_low |= vector;    // bits 0-7 are the vector number
     icr_low |= mode << 8; // bits 8-10 are the destination mode
-    BIT_SET(icr_low, 11); // logical destination
-
     BIT_SET(icr_low, 14);
 
+    if (apic_x2)
+    {
+        // physical destination, the APIC ID in the upper half of the ICR,
+        // written in one go
+        lapic_write_icr(icr_low, target);
+        return;
+    }
+    BIT_SET(icr_low, 11); // logical destination
+
     dbgq(DBG_CORE, "Sending IPI: ICR_LOW = 0x%.8x, ICR_HIGH = 0x%.8x\n",
          icr_low, (1U << target) << 24);
 
     // Bits 24-27 of ICR_HIGH are the target logical APIC ID. Setting ICR_LOW
     // sends the interrupt, so we have to set this first
-    LAPICICRH = (1U << target) << 24;
-    // send the IPI
-    LAPICICRL = icr_low;
+    lapic_write_icr(icr_low, 1U << target);
 }
 
 void apic_broadcast_ipi(ipi_destination_mode mode, uint8_t vector,
@@ -630,8 +743,7 @@ void apic_broadcast_ipi(ipi_destination_mode mode, uint8_t vector,
         BIT_SET(icr_low, 18);
     BIT_SET(icr_low, 19);
 
-    LAPICICRH = 0;
-    LAPICICRL = icr_low;
+    lapic_write_icr(icr_low, 0);
 }
 
 /**
@@ -642,7 +754,31 @@ void apic_broadcast_ipi(ipi_destination_mode mode, uint8_t vector,
  */
 void apic_wait_ipi()
 {
+    // x2APIC has no delivery status: an IPI is on its way once the ICR is
+    // written
+    if (apic_x2)
+    {
+        return;
+    }
     // Bit 12 of ICR_LOW is the delivery status flag.
-    while (LAPICICRL & (1 << 12))
+    while (APIC_REG(LOCAL_APIC_ICRL) & (1 << 12))
         ;
 }
+
+void apic_x2apic_enter()
+{
+    if (!apic_x2)
+    {
+        return;
+    }
+    uint32_t lo, hi;
+    cpuid_get_msr(IA32_APIC_BASE_MSR, &lo, &hi);
+    if (!(lo & IA32_APIC_BASE_MSR_X2APIC))
+    {
+        /* xAPIC to x2APIC is allowed directly, with the APIC enabled */
+        cpuid_set_msr(IA32_APIC_BASE_MSR,
+                      lo | IA32_APIC_BASE_MSR_ENABLE |
+                          IA32_APIC_BASE_MSR_X2APIC,
+                      hi);
+    }
+}
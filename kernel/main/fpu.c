@@ -0,0 +1,266 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+#include "types.h"
+
+#include "main/cpuid.h"
+#include "main/fpu.h"
+#include "main/interrupt.h"
+
+#include "mm/slab.h"
+#include "mm/tlb.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#define INTR_DEVICE_NOT_AVAILABLE 0x07
+
+#define CR0_MP 0x00000002
+#define CR0_EM 0x00000004
+#define CR0_TS 0x00000008
+#define CR4_OSFXSR 0x00000200
+#define CR4_OSXMMEXCPT 0x00000400
+#define CR4_OSXSAVE 0x00040000
+
+#define XCR0_X87 0x1
+#define XCR0_SSE 0x2
+#define XCR0_AVX 0x4
+
+#define CPUID_XSAVE 0xd
+#define CPUID_XSAVE_EAX_XSAVEOPT 0x1
+
+/* Offsets into the legacy (fxsave) region, shared by the xsave layout */
+#define FPU_FCW_OFFSET 0
+#define FPU_MXCSR_OFFSET 24
+#define FPU_FCW_INIT 0x037f
+#define FPU_MXCSR_INIT 0x1f80
+
+#define FPU_ALIGN 64
+
+static slab_allocator_t *fpu_allocator = NULL;
+
+/* Size of a save area for the features enabled in XCR0; 512 for fxsave */
+static size_t fpu_size = 512;
+static long fpu_xsave = 0;
+static long fpu_xsaveopt = 0;
+
+/* The thread whose state is in this core's registers, or NULL */
+static kthread_t *fpu_owner CORE_SPECIFIC_DATA;
+#define fpu_owner CSD(fpu_owner)
+
+/* Whether CR0.TS is clear on this core */
+static long fpu_enabled CORE_SPECIFIC_DATA;
+#define fpu_enabled CSD(fpu_enabled)
+
+static inline uintptr_t fpu_read_cr0()
+{
+    uintptr_t cr0;
+    __asm__ volatile("movq %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void fpu_enable()
+{
+    if (!fpu_enabled)
+    {
+        __asm__ volatile("clts");
+        fpu_enabled = 1;
+    }
+}
+
+static inline void fpu_disable()
+{
+    if (fpu_enabled)
+    {
+        __asm__ volatile("movq %0, %%cr0" ::"r"(fpu_read_cr0() | CR0_TS));
+        fpu_enabled = 0;
+    }
+}
+
+static void fpu_save(kthread_t *thr)
+{
+    void *area = thr->kt_fpu;
+    if (fpu_xsaveopt)
+    {
+        __asm__ volatile("xsaveopt64 (%0)" ::"r"(area), "a"(-1), "d"(-1)
+                         : "memory");
+    }
+    else if (fpu_xsave)
+    {
+        __asm__ volatile("xsave64 (%0)" ::"r"(area), "a"(-1), "d"(-1)
+                         : "memory");
+    }
+    else
+    {
+        __asm__ volatile("fxsave64 (%0)" ::"r"(area) : "memory");
+    }
+}
+
+static void fpu_restore(kthread_t *thr)
+{
+    void *area = thr->kt_fpu;
+    if (fpu_xsave)
+    {
+        __asm__ volatile("xrstor64 (%0)" ::"r"(area), "a"(-1), "d"(-1)
+                         : "memory");
+    }
+    else
+    {
+        __asm__ volatile("fxrstor64 (%0)" ::"r"(area) : "memory");
+    }
+}
+
+/*
+ * Allocates thr's save area, holding the state a thread starts with: every
+ * exception masked and, for xsave, all components in their initial state.
+ * Returns whether there was the memory for it.
+ */
+static long fpu_alloc(kthread_t *thr)
+{
+    thr->kt_fpu = slab_obj_alloc(fpu_allocator);
+    if (!thr->kt_fpu)
+    {
+        return 0;
+    }
+    char *area = thr->kt_fpu;
+    memset(area, 0, fpu_size);
+    *(uint16_t *)(area + FPU_FCW_OFFSET) = FPU_FCW_INIT;
+    *(uint32_t *)(area + FPU_MXCSR_OFFSET) = FPU_MXCSR_INIT;
+    return 1;
+}
+
+/*
+ * The current thread used the FPU with CR0.TS set: hand it the registers.
+ */
+static long fpu_trap(regs_t *regs)
+{
+    if (!curthr || !(regs->r_cs & 0x3))
+    {
+        dump_registers(regs);
+        panic("\n\nThe kernel used the FPU\n");
+    }
+
+    fpu_enable();
+    if (fpu_owner == curthr)
+    {
+        return 0;
+    }
+    if (fpu_owner)
+    {
+        fpu_save(fpu_owner);
+        fpu_owner = NULL;
+    }
+    if (!curthr->kt_fpu && !fpu_alloc(curthr))
+    {
+        fpu_disable();
+        do_exit(ENOMEM);
+    }
+    fpu_restore(curthr);
+    fpu_owner = curthr;
+    return 0;
+}
+
+void fpu_init()
+{
+    /* save areas must be 64-byte aligned, which cache-line alignment gives */
+    KASSERT(SLAB_CACHE_LINE_SIZE % FPU_ALIGN == 0);
+    fpu_allocator =
+        slab_allocator_create_flags("fpu", fpu_size, SLAB_CACHE_ALIGN);
+    KASSERT(fpu_allocator);
+}
+
+void fpu_core_init()
+{
+    uint32_t a, b, c, d;
+    cpuid(CPUID_GETFEATURES, &a, &b, &c, &d);
+
+    uintptr_t cr0 = (fpu_read_cr0() | CR0_MP | CR0_TS) & ~CR0_EM;
+    __asm__ volatile("movq %0, %%cr0" ::"r"(cr0));
+    fpu_enabled = 0;
+    fpu_owner = NULL;
+
+    uintptr_t cr4 = tlb_read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (c & CPUID_FEAT_ECX_XSAVE)
+    {
+        cr4 |= CR4_OSXSAVE;
+    }
+    __asm__ volatile("movq %0, %%cr4" ::"r"(cr4));
+
+    if (c & CPUID_FEAT_ECX_XSAVE)
+    {
+        uint64_t xcr0 = XCR0_X87 | XCR0_SSE;
+        if (c & CPUID_FEAT_ECX_AVX)
+        {
+            xcr0 |= XCR0_AVX;
+        }
+        __asm__ volatile("xsetbv" ::"c"(0), "a"((uint32_t)xcr0),
+                         "d"((uint32_t)(xcr0 >> 32)));
+
+        /* all cores are alike, and the allocator is not created yet when
+         * the first one gets here */
+        uint32_t size;
+        cpuid_count(CPUID_XSAVE, 0, &a, &size, &c, &d);
+        cpuid_count(CPUID_XSAVE, 1, &a, &b, &c, &d);
+        KASSERT(!fpu_allocator || size == fpu_size);
+        fpu_size = size;
+        fpu_xsave = 1;
+        fpu_xsaveopt = (a & CPUID_XSAVE_EAX_XSAVEOPT) != 0;
+    }
+
+    intr_register(INTR_DEVICE_NOT_AVAILABLE, fpu_trap);
+    dbg(DBG_CORE, "saving FPU state with %s, %lu bytes\n",
+        fpu_xsaveopt ? "xsaveopt" : fpu_xsave ? "xsave" : "fxsave",
+        fpu_size);
+}
+
+/*
+ * Without SMP, the state stays in the registers until another thread uses
+ * the FPU. With SMP, the thread may next run on another core, so its state
+ * is saved as it leaves.
+ */
+void fpu_switch_out(kthread_t *thr)
+{
+#ifdef __SMP__
+    if (fpu_owner == thr)
+    {
+        fpu_enable();
+        fpu_save(thr);
+        fpu_owner = NULL;
+    }
+#endif
+}
+
+void fpu_switch_in(kthread_t *thr)
+{
+    if (fpu_owner == thr)
+    {
+        fpu_enable();
+    }
+    else
+    {
+        fpu_disable();
+    }
+}
+
+/*
+ * Either thr is curthr, or it is not running anywhere and, with SMP, owns no
+ * core's registers.
+ */
+void fpu_release(kthread_t *thr)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    if (fpu_owner == thr)
+    {
+        fpu_owner = NULL;
+        if (thr == curthr)
+        {
+            fpu_disable();
+        }
+    }
+    intr_setipl(ipl);
+    if (thr->kt_fpu)
+    {
+        slab_obj_free(fpu_allocator, thr->kt_fpu);
+        thr->kt_fpu = NULL;
+    }
+}
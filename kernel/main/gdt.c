@@ -16,6 +16,7 @@ typedef struct gdt_entry
 } packed gdt_entry_t;
 
 static gdt_entry_t gdt[GDT_COUNT] CORE_SPECIFIC_DATA;
+#define gdt CSD(gdt)
 
 typedef struct tss_entry
 {
@@ -42,18 +43,16 @@ typedef struct gdt_location
     uint64_t gl_offset;
 } packed gdt_location_t;
 
-static gdt_location_t gdtl = {.gl_size = GDT_COUNT * sizeof(gdt_entry_t),
-                              .gl_offset = (uint64_t)&gdt};
-
 static tss_entry_t tss CORE_SPECIFIC_DATA;
+#define tss CSD(tss)
 
 void gdt_init(void)
 {
     memset(gdt, 0, sizeof(gdt));
     gdt_set_entry(GDT_KERNEL_TEXT, 0x0, 0xFFFFF, 0, 1, 0, 1);
     gdt_set_entry(GDT_KERNEL_DATA, 0x0, 0xFFFFF, 0, 0, 0, 1);
-    gdt_set_entry(GDT_USER_TEXT, 0x0, 0xFFFFF, 3, 1, 0, 1);
     gdt_set_entry(GDT_USER_DATA, 0x0, 0xFFFFF, 3, 0, 0, 1);
+    gdt_set_entry(GDT_USER_TEXT, 0x0, 0xFFFFF, 3, 1, 0, 1);
 
     uintptr_t tss_pointer = (uintptr_t)&tss;
     gdt_set_entry(GDT_TSS, (uint32_t)tss_pointer, sizeof(tss), 0, 1, 0, 0);
@@ -67,6 +66,10 @@ void gdt_init(void)
     memset(&tss, 0, sizeof(tss));
     tss.ts_iopb = sizeof(tss);
 
+    /* both by their address in this core's copy of the core-specific data,
+     * which every address space maps */
+    gdt_location_t gdtl = {.gl_size = GDT_COUNT * sizeof(gdt_entry_t),
+                           .gl_offset = (uint64_t)&gdt};
     gdt_location_t *data = &gdtl;
     int segment = GDT_TSS;
 
@@ -74,7 +77,16 @@ void gdt_init(void)
     __asm__ volatile("lgdt (%0); ltr %1" ::"p"(data), "m"(segment));
 }
 
-void gdt_set_kernel_stack(void *addr) { tss.ts_rsp0 = (uint64_t)addr; }
+/*
+ * Interrupts from userland switch to the stack in the TSS; the syscall
+ * instruction does not, so its entry path loads the one in the core's
+ * csd_head_t itself.
+ */
+void gdt_set_kernel_stack(void *addr)
+{
+    tss.ts_rsp0 = (uint64_t)addr;
+    csd_head()->ch_kernel_stack = (uintptr_t)addr;
+}
 
 void gdt_set_entry(uint32_t segment, uint32_t base, uint32_t limit,
                    uint8_t ring, int exec, int dir, int rw)
@@ -7,7 +7,11 @@
 #include "util/string.h"
 
 #include "main/apic.h"
+#include "main/cpuid.h"
 #include "main/gdt.h"
+#include "main/intr_stats.h"
+
+#include "proc/sched.h"
 
 #define MAX_INTERRUPTS 256
 
@@ -24,6 +28,17 @@
 
 #define INTR(isr) (__intr_handler##isr)
 
+/*
+ * Interrupts from userland swap in the kernel's GS base (see main/smp.h), and
+ * swap userland's back before returning to it; cs is at the given offset on
+ * the stack. Nothing is swapped for interrupts taken in the kernel.
+ */
+#define INTR_SWAPGS(cs)           \
+    "testb $3, " #cs "(%rsp)\n\t" \
+    "jz 1f\n\t"                    \
+    "swapgs\n"                     \
+    "1:\n\t"
+
 #define INTR_ERRCODE(isr)                      \
     extern intr_handler_t __intr_handler##isr; \
     __asm__(".global __intr_handler" #isr      \
@@ -32,6 +47,7 @@
             ":\n\t"                            \
             "pushq $" #isr                     \
             "\n\t"                             \
+            INTR_SWAPGS(24)                    \
             "pushq %rdi\n\t"                   \
             "pushq %rsi\n\t"                   \
             "pushq %rdx\n\t"                   \
@@ -64,6 +80,7 @@
             "popq %rsi\n\t"                    \
             "popq %rdi\n\t"                    \
             "add $16, %rsp\n\t"                \
+            INTR_SWAPGS(8)                     \
             "iretq\n");
 
 #define INTR_NOERRCODE(isr)                    \
@@ -75,6 +92,7 @@
             "pushq $0x0\n\t"                   \
             "pushq $" #isr                     \
             "\n\t"                             \
+            INTR_SWAPGS(24)                    \
             "pushq %rdi\n\t"                   \
             "pushq %rsi\n\t"                   \
             "pushq %rdx\n\t"                   \
@@ -107,6 +125,7 @@
             "popq %rsi\n\t"                    \
             "popq %rdi\n\t"                    \
             "add $16, %rsp\n\t"                \
+            INTR_SWAPGS(8)                     \
             "iretq\n\t");
 
 INTR_NOERRCODE(0)
@@ -396,11 +415,66 @@ intr_info_t intr_data;
  * This variable is maintained for easy reference by
  * debuggers. */
 static regs_t *_intr_regs CORE_SPECIFIC_DATA;
+#define _intr_regs CSD(_intr_regs)
+
+/* Interrupt statistics (see main/intr_stats.h), indexed by core id; each core
+ * only updates its own. Vectors are given a slot of intr_stats when they get
+ * a handler; intr_stats_slots holds the slot plus one, or 0 for vectors
+ * without one. */
+static intr_stats_t intr_stats[MAX_LAPICS][INTR_STATS_VECTORS];
+static ipl_stats_t ipl_stats[MAX_LAPICS];
+static uint8_t intr_stats_slots[MAX_INTERRUPTS];
+static uint8_t intr_stats_vectors[INTR_STATS_VECTORS];
+static size_t intr_stats_nslots;
+
+/* When, and by whom, this core's IPL was last raised from IPL_LOW, or 0 */
+static uint64_t ipl_raised_at CORE_SPECIFIC_DATA;
+#define ipl_raised_at CSD(ipl_raised_at)
+static void *ipl_raised_site CORE_SPECIFIC_DATA;
+#define ipl_raised_site CSD(ipl_raised_site)
+
+static size_t intr_stats_bucket(uint64_t cycles)
+{
+    size_t bucket = cycles ? 63 - (size_t)__builtin_clzl(cycles) : 0;
+    return MIN(bucket, (size_t)INTR_HIST_BUCKETS - 1);
+}
+
+/* Ends the window opened when the IPL was raised; called with the IPL
+ * lowered again, so an interrupt may come in between, and start and end a
+ * window of its own, which is then the one counted */
+static void ipl_stats_lowered()
+{
+    uint64_t start = ipl_raised_at;
+    if (!start)
+    {
+        return;
+    }
+    ipl_raised_at = 0;
+    uint64_t cycles = cpuid_rdtsc() - start;
+    ipl_stats_t *stats = &ipl_stats[curcore.kc_id];
+    stats->ip_raised++;
+    stats->ip_cycles += cycles;
+    if (cycles > stats->ip_max_cycles)
+    {
+        stats->ip_max_cycles = cycles;
+        stats->ip_max_site = ipl_raised_site;
+    }
+    stats->ip_hist[intr_stats_bucket(cycles)]++;
+}
 
 inline uint8_t intr_setipl(uint8_t ipl)
 {
     uint8_t oldipl = apic_getipl();
+    if (oldipl == IPL_LOW && ipl != IPL_LOW)
+    {
+        ipl_raised_at = cpuid_rdtsc();
+        ipl_raised_site = __builtin_return_address(0);
+    }
     apic_setipl(ipl);
+    if (oldipl != IPL_LOW && ipl == IPL_LOW)
+    {
+        ipl_stats_lowered();
+    }
     return oldipl;
 }
 
@@ -417,14 +491,36 @@ static __attribute__((used)) void interrupt_handler(regs_t regs)
             //            KASSERT(preemption_enabled()); TODO figure out why
             //            this sometimes fails!!
         }
+        /* counted on the core that took it, since the handler may return on
+         * another */
+        long core = curcore.kc_id;
+        uint8_t slot = intr_stats_slots[regs.r_intr];
+        if (slot)
+        {
+            intr_stats[core][slot - 1].in_count++;
+        }
+        uint64_t nswitches = sched_nswitches;
+        uint64_t start = cpuid_rdtsc();
         if (!handler(&regs))
             apic_eoi();
+        if (slot && core == curcore.kc_id && nswitches == sched_nswitches)
+        {
+            uint64_t cycles = cpuid_rdtsc() - start;
+            intr_stats_t *stats = &intr_stats[core][slot - 1];
+            stats->in_timed++;
+            stats->in_cycles += cycles;
+            stats->in_max_cycles = MAX(stats->in_max_cycles, cycles);
+            stats->in_hist[intr_stats_bucket(cycles)]++;
+        }
     }
     else
     {
         panic("Unhandled interrupt 0x%x\n", (int)regs.r_intr);
     }
     _intr_regs = NULL;
+#if defined(__KPREEMPT__) || defined(__UPREEMPT__)
+    sched_preempt((regs.r_cs & 0x3) == 0x3);
+#endif
 }
 
 int32_t intr_map(uint16_t irq, uint8_t intr)
@@ -441,9 +537,71 @@ intr_handler_t intr_register(uint8_t intr, intr_handler_t handler)
 {
     intr_handler_t old = intr_handlers[intr];
     intr_handlers[intr] = handler;
+    if (handler && !intr_stats_slots[intr] &&
+        intr_stats_nslots < INTR_STATS_VECTORS)
+    {
+        intr_stats_vectors[intr_stats_nslots] = intr;
+        intr_stats_slots[intr] = (uint8_t)++intr_stats_nslots;
+    }
     return old;
 }
 
+size_t intr_stats_count() { return intr_stats_nslots; }
+
+uint8_t intr_stats_vector(size_t i)
+{
+    KASSERT(i < intr_stats_nslots);
+    return intr_stats_vectors[i];
+}
+
+void intr_stats_get(size_t i, long core, intr_stats_t *stats)
+{
+    KASSERT(i < intr_stats_nslots);
+    memset(stats, 0, sizeof(*stats));
+    long first = core < 0 ? 0 : core;
+    long last = core < 0 ? MAX_LAPICS - 1 : core;
+    for (long c = first; c <= last; c++)
+    {
+        intr_stats_t *s = &intr_stats[c][i];
+        stats->in_count += s->in_count;
+        stats->in_timed += s->in_timed;
+        stats->in_cycles += s->in_cycles;
+        stats->in_max_cycles = MAX(stats->in_max_cycles, s->in_max_cycles);
+        for (size_t b = 0; b < INTR_HIST_BUCKETS; b++)
+        {
+            stats->in_hist[b] += s->in_hist[b];
+        }
+    }
+}
+
+void ipl_stats_get(long core, ipl_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    long first = core < 0 ? 0 : core;
+    long last = core < 0 ? MAX_LAPICS - 1 : core;
+    for (long c = first; c <= last; c++)
+    {
+        ipl_stats_t *s = &ipl_stats[c];
+        stats->ip_raised += s->ip_raised;
+        stats->ip_cycles += s->ip_cycles;
+        if (s->ip_max_cycles > stats->ip_max_cycles)
+        {
+            stats->ip_max_cycles = s->ip_max_cycles;
+            stats->ip_max_site = s->ip_max_site;
+        }
+        for (size_t b = 0; b < INTR_HIST_BUCKETS; b++)
+        {
+            stats->ip_hist[b] += s->ip_hist[b];
+        }
+    }
+}
+
+void intr_stats_reset()
+{
+    memset(intr_stats, 0, sizeof(intr_stats));
+    memset(ipl_stats, 0, sizeof(ipl_stats));
+}
+
 // lol
 void dump_registers(regs_t *regs)
 {
@@ -7,26 +7,43 @@
 #include <drivers/tty/vterminal.h>
 #include <main/io.h>
 #include <mm/mm.h>
+#include <mm/reclaim.h>
 #include <mm/slab.h>
+#include <mm/tlb.h>
+#include <mm/vmalloc.h>
 #include <test/kshell/kshell.h>
+#include <util/radix.h>
 #include <util/time.h>
 #include <vm/anon.h>
 #include <vm/shadow.h>
+#include <vm/swap.h>
 
 #include "util/debug.h"
 #include "util/gdb.h"
+#include "util/init.h"
 #include "util/printf.h"
 #include "util/string.h"
 
 #include "main/acpi.h"
 #include "main/apic.h"
+#include "main/fpu.h"
 #include "main/inits.h"
+#include "main/numa.h"
 
+#include "drivers/blockdev.h"
+#include "drivers/bootra.h"
+#include "drivers/chardev.h"
 #include "drivers/dev.h"
 #include "drivers/pcie.h"
+#include "drivers/writeback.h"
 
+#include "proc/rcu.h"
+#include "proc/workq.h"
+
+#include "api/binfmt.h"
 #include "api/syscall.h"
 
+#include "fs/dcache.h"
 #include "fs/fcntl.h"
 #include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
@@ -47,45 +64,66 @@ GDB_DEFINE_HOOK(shutdown)
 int vfstest_main(int argc, char **argv);
 static void initproc_start();
 
-typedef void (*init_func_t)();
-static init_func_t init_funcs[] = {
-    dbg_init,
-    intr_init,
-    page_init,
-    pt_init,
-    acpi_init,
-    apic_init,
-    core_init,
-    slab_init,
-    pframe_init,
-    pci_init,
-    vga_init,
+typedef struct
+{
+    init_func_t func;
+    const char *name;
+} kmain_init_t;
+
+#define INIT(func) {(func), #func}
+
+static const kmain_init_t init_funcs[] = {
+    INIT(csd_boot_init),
+    INIT(string_init),
+    INIT(dbg_init),
+    INIT(intr_init),
+    INIT(page_init),
+    INIT(pt_init),
+    INIT(acpi_init),
+    INIT(numa_init),
+    INIT(apic_init),
+    INIT(core_init),
+    INIT(tlb_init),
+    INIT(slab_init),
+    INIT(vmalloc_init),
+    INIT(radix_init),
+    INIT(pframe_init),
+    INIT(pci_init),
+    INIT(vga_init),
+    INIT(anon_init),
 #ifdef __VM__
-    anon_init,
-    shadow_init,
+    INIT(shadow_init),
 #endif
-    vmmap_init,
-    proc_init,
-    kthread_init,
+    INIT(vmmap_init),
+    INIT(proc_init),
+    INIT(kthread_init),
+    INIT(fpu_init),
 #ifdef __DRIVERS__
-    chardev_init,
-    blockdev_init,
+    INIT(chardev_init),
+    INIT(blockdev_init),
+    INIT(swap_init),
 #endif
-    kshell_init,
-    file_init,
-    pipe_init,
-    syscall_init,
-    elf64_init,
+    INIT(kshell_init),
+    INIT(file_init),
+    INIT(fdtable_init),
+    INIT(dcache_init),
+    INIT(pipe_init),
+    INIT(epoll_init),
+    INIT(futex_init),
+    INIT(syscall_init),
+    INIT(elf64_init),
+    INIT(vdso_init),
 
 #ifdef __SMP__
-    smp_init,
+    INIT(smp_init),
 #endif
 
-    proc_idleproc_init,
+    INIT(proc_idleproc_init),
 };
 
 /*
- * Call the init functions (in order!), then run the init process
+ * Call the init functions (in order!), and then those registered with
+ * init_func() (see util/init.h), timing each, then run the init process
  * (initproc_start)
  */
 void kmain()
@@ -93,7 +131,8 @@ void kmain()
     GDB_CALL_HOOK(boot);
 
     for (size_t i = 0; i < sizeof(init_funcs) / sizeof(init_funcs[0]); i++)
-        init_funcs[i]();
+        init_call(init_funcs[i].name, init_funcs[i].func);
+    init_call_all();
 
     initproc_start();
     panic("\nReturned to kmain()\n");
@@ -102,9 +141,10 @@ void kmain()
 /*
  * Make:
  * 1) /dev/null
- * 2) /dev/zero
+ * 2) /dev/zero, and /dev/trace
  * 3) /dev/ttyX for 0 <= X < __NTERMS__
  * 4) /dev/hdaX for 0 <= X < __NDISKS__
+ * 5) /dev/stripe0, /dev/ram0 and /dev/fb, if there are such devices
  */
 static void make_devices()
 {
@@ -115,6 +155,8 @@ static void make_devices()
     KASSERT(!status || status == -EEXIST);
     status = do_mknod("/dev/zero", S_IFCHR, MEM_ZERO_DEVID);
     KASSERT(!status || status == -EEXIST);
+    status = do_mknod("/dev/trace", S_IFCHR, MEM_TRACE_DEVID);
+    KASSERT(!status || status == -EEXIST);
 
     char path[32] = {0};
     for (long i = 0; i < __NTERMS__; i++)
@@ -132,8 +174,47 @@ static void make_devices()
         status = do_mknod(path, S_IFBLK, MKDEVID(DISK_MAJOR, i));
         KASSERT(!status || status == -EEXIST);
     }
+
+    if (STRIPE_NDISKS >= 2)
+    {
+        dbg(DBG_INIT, "Creating stripe mknod with path /dev/stripe0\n");
+        status = do_mknod("/dev/stripe0", S_IFBLK, MKDEVID(STRIPE_MAJOR, 0));
+        KASSERT(!status || status == -EEXIST);
+    }
+    if (blockdev_lookup(MKDEVID(RAMDISK_MAJOR, 0)))
+    {
+        dbg(DBG_INIT, "Creating ramdisk mknod with path /dev/ram0\n");
+        status = do_mknod("/dev/ram0", S_IFBLK, MKDEVID(RAMDISK_MAJOR, 0));
+        KASSERT(!status || status == -EEXIST);
+    }
+    if (chardev_lookup(FB_DEVID))
+    {
+        dbg(DBG_INIT, "Creating framebuffer mknod with path /dev/fb\n");
+        status = do_mknod("/dev/fb", S_IFCHR, FB_DEVID);
+        KASSERT(!status || status == -EEXIST);
+    }
 }
 
+#ifdef __MOUNTING__
+/*
+ * Mount the filesystems that hold no files of their own:
+ * 1) /dev/shm, a tmpfs, in which shm_open() names shared memory objects
+ * 2) /proc, the kernel's statistics
+ */
+static void mount_virtual_filesystems()
+{
+    long status = do_mkdir("/dev/shm");
+    KASSERT(!status || status == -EEXIST);
+    status = do_mount(NULL, "/dev/shm", "tmpfs");
+    KASSERT(!status);
+
+    status = do_mkdir("/proc");
+    KASSERT(!status || status == -EEXIST);
+    status = do_mount(NULL, "/proc", "procfs");
+    KASSERT(!status);
+}
+#endif
+
 /*
  * The function executed by the init process. Finish up all initialization now 
  * that we have a proper thread context.
@@ -159,11 +240,20 @@ static void make_devices()
  */
 static void *initproc_run(long arg1, void *arg2)
 {
-    
+    workq_start();
+    rcu_start();
+    tty_start();
+
 #ifdef __VFS__
     dbg(DBG_INIT, "Initializing VFS...\n");
     vfs_init();
     make_devices();
+#ifdef __MOUNTING__
+    mount_virtual_filesystems();
+#endif
+    writeback_start();
+    bootra_start();
+    reclaim_start();
 #endif
     proctest_main(0, NULL);
     driverstest_main(0, NULL);
@@ -214,12 +304,17 @@ void initproc_start()
 void initproc_finish()
 {
 #ifdef __VFS__
+    reclaim_stop();
+    writeback_stop();
+    binfmt_cache_purge();
     if (vfs_shutdown())
         panic("vfs shutdown FAILED!!\n");
 
 #endif
+    rcu_stop();
 
 #ifdef __DRIVERS__
+    vterminal_shutdown();
     screen_print_shutdown();
 #endif
 
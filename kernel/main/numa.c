@@ -0,0 +1,304 @@
+#include "main/numa.h"
+
+#include "config.h"
+#include "main/acpi.h"
+#include "main/apic.h"
+#include "mm/page.h"
+#include "types.h"
+#include "util/debug.h"
+
+#define SRAT_SIGNATURE (*(uint32_t *)"SRAT")
+#define SLIT_SIGNATURE (*(uint32_t *)"SLIT")
+
+#define SRAT_TYPE_LAPIC 0
+#define SRAT_TYPE_MEMORY 1
+#define SRAT_TYPE_X2APIC 2
+
+#define SRAT_ENABLED 0x1
+
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+typedef struct srat_table
+{
+    acpi_header_t st_header;
+    uint32_t st_reserved1;
+    uint64_t st_reserved2;
+} packed srat_table_t;
+
+typedef struct srat_lapic
+{
+    uint8_t sl_type;
+    uint8_t sl_size;
+    uint8_t sl_domain_lo;
+    uint8_t sl_apicid;
+    uint32_t sl_flags;
+    uint8_t sl_sapic_eid;
+    uint8_t sl_domain_hi[3];
+    uint32_t sl_clock_domain;
+} packed srat_lapic_t;
+
+typedef struct srat_memory
+{
+    uint8_t sm_type;
+    uint8_t sm_size;
+    uint32_t sm_domain;
+    uint16_t sm_reserved1;
+    uint64_t sm_base;
+    uint64_t sm_length;
+    uint32_t sm_reserved2;
+    uint32_t sm_flags;
+    uint64_t sm_reserved3;
+} packed srat_memory_t;
+
+typedef struct srat_x2apic
+{
+    uint8_t sx_type;
+    uint8_t sx_size;
+    uint16_t sx_reserved1;
+    uint32_t sx_domain;
+    uint32_t sx_apicid;
+    uint32_t sx_flags;
+    uint32_t sx_clock_domain;
+    uint32_t sx_reserved2;
+} packed srat_x2apic_t;
+
+typedef struct slit_table
+{
+    acpi_header_t st_header;
+    uint64_t st_nlocalities;
+    uint8_t st_distances[]; /* st_nlocalities squared, by domain */
+} packed slit_table_t;
+
+/* The proximity domain of each node */
+static uint32_t numa_domains[NUMA_MAX_NODES];
+static long numa_count = 1;
+
+static long numa_core_nodes[MAX_LAPICS];
+
+static numa_range_t numa_range_table[NUMA_MAX_RANGES];
+static size_t numa_nranges;
+
+static uint8_t numa_distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static long numa_fallbacks[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+/*
+ * Returns the node of a proximity domain, numbering it if it is new.
+ */
+static long numa_domain_node(uint32_t domain, long *nnodes)
+{
+    for (long node = 0; node < *nnodes; node++)
+    {
+        if (numa_domains[node] == domain)
+        {
+            return node;
+        }
+    }
+    if (*nnodes == NUMA_MAX_NODES)
+    {
+        return NUMA_MAX_NODES - 1;
+    }
+    numa_domains[*nnodes] = domain;
+    return (*nnodes)++;
+}
+
+/*
+ * Adds the memory [base, base + length) to node, keeping the table sorted.
+ */
+static void numa_add_range(uint64_t base, uint64_t length, long node)
+{
+    uintptr_t start = (uintptr_t)PAGE_ALIGN_UP(base) >> PAGE_SHIFT;
+    uintptr_t end = (uintptr_t)PAGE_ALIGN_DOWN(base + length) >> PAGE_SHIFT;
+    if (start >= end)
+    {
+        return;
+    }
+    if (numa_nranges == NUMA_MAX_RANGES)
+    {
+        dbg(DBG_CORE, "NUMA: too many memory ranges, ignoring [0x%p, 0x%p)\n",
+            (void *)base, (void *)(base + length));
+        return;
+    }
+    size_t i = numa_nranges++;
+    while (i && numa_range_table[i - 1].nr_start > start)
+    {
+        numa_range_table[i] = numa_range_table[i - 1];
+        i--;
+    }
+    numa_range_table[i].nr_start = start;
+    numa_range_table[i].nr_end = end;
+    numa_range_table[i].nr_node = node;
+}
+
+/*
+ * Sets numa_distances from the SLIT, or to local and remote defaults without
+ * one, then each node's fallback order from them.
+ */
+static void numa_init_distances()
+{
+    slit_table_t *slit = acpi_table(SLIT_SIGNATURE, 0);
+    for (long from = 0; from < numa_count; from++)
+    {
+        for (long to = 0; to < numa_count; to++)
+        {
+            uint64_t n = slit ? slit->st_nlocalities : 0;
+            if (numa_domains[from] < n && numa_domains[to] < n)
+            {
+                numa_distances[from][to] =
+                    slit->st_distances[numa_domains[from] * n +
+                                       numa_domains[to]];
+            }
+            else
+            {
+                numa_distances[from][to] = from == to ? NUMA_LOCAL_DISTANCE
+                                                      : NUMA_REMOTE_DISTANCE;
+            }
+        }
+    }
+
+    for (long from = 0; from < numa_count; from++)
+    {
+        long *order = numa_fallbacks[from];
+        order[0] = from;
+        long count = 1;
+        for (long to = 0; to < numa_count; to++)
+        {
+            if (to == from)
+            {
+                continue;
+            }
+            long i = count++;
+            while (i > 1 && numa_distances[from][order[i - 1]] >
+                                numa_distances[from][to])
+            {
+                order[i] = order[i - 1];
+                i--;
+            }
+            order[i] = to;
+        }
+    }
+}
+
+void numa_init()
+{
+    srat_table_t *srat = acpi_table(SRAT_SIGNATURE, 0);
+    if (!srat)
+    {
+        numa_init_distances();
+        dbgq(DBG_CORE, "NUMA: no SRAT, one node\n");
+        return;
+    }
+
+    long nnodes = 0;
+    uint8_t *ptr = (uint8_t *)srat;
+    for (uint32_t off = sizeof(*srat); off + 2 <= srat->st_header.ah_size;)
+    {
+        uint8_t type = ptr[off];
+        uint8_t size = ptr[off + 1];
+        if (!size)
+        {
+            break;
+        }
+        if (type == SRAT_TYPE_LAPIC && size >= sizeof(srat_lapic_t))
+        {
+            srat_lapic_t *lapic = (srat_lapic_t *)(ptr + off);
+            uint32_t domain = lapic->sl_domain_lo |
+                              (uint32_t)lapic->sl_domain_hi[0] << 8 |
+                              (uint32_t)lapic->sl_domain_hi[1] << 16 |
+                              (uint32_t)lapic->sl_domain_hi[2] << 24;
+            if ((lapic->sl_flags & SRAT_ENABLED) &&
+                lapic->sl_apicid < MAX_LAPICS)
+            {
+                numa_core_nodes[lapic->sl_apicid] =
+                    numa_domain_node(domain, &nnodes);
+            }
+        }
+        else if (type == SRAT_TYPE_X2APIC && size >= sizeof(srat_x2apic_t))
+        {
+            srat_x2apic_t *x2apic = (srat_x2apic_t *)(ptr + off);
+            if ((x2apic->sx_flags & SRAT_ENABLED) &&
+                x2apic->sx_apicid < MAX_LAPICS)
+            {
+                numa_core_nodes[x2apic->sx_apicid] =
+                    numa_domain_node(x2apic->sx_domain, &nnodes);
+            }
+        }
+        else if (type == SRAT_TYPE_MEMORY && size >= sizeof(srat_memory_t))
+        {
+            srat_memory_t *mem = (srat_memory_t *)(ptr + off);
+            if (mem->sm_flags & SRAT_ENABLED)
+            {
+                numa_add_range(mem->sm_base, mem->sm_length,
+                               numa_domain_node(mem->sm_domain, &nnodes));
+            }
+        }
+        off += size;
+    }
+    numa_count = nnodes ? nnodes : 1;
+    numa_init_distances();
+
+    dbgq(DBG_CORE, "--- NUMA INIT ---\n");
+    for (size_t i = 0; i < numa_nranges; i++)
+    {
+        numa_range_t *range = &numa_range_table[i];
+        dbgq(DBG_CORE, "node %ld (domain %u): [0x%p, 0x%p)\n", range->nr_node,
+             numa_domains[range->nr_node], PN_TO_ADDR(range->nr_start),
+             PN_TO_ADDR(range->nr_end));
+    }
+    for (long core = 0; core < MAX_LAPICS; core++)
+    {
+        if (numa_core_nodes[core])
+        {
+            dbgq(DBG_CORE, "C%ld: node %ld\n", core, numa_core_nodes[core]);
+        }
+    }
+}
+
+long numa_nnodes() { return numa_count; }
+
+long numa_core_node(long apic_id)
+{
+    KASSERT(apic_id >= 0 && apic_id < MAX_LAPICS);
+    return numa_core_nodes[apic_id];
+}
+
+long numa_paddr_node(uintptr_t paddr)
+{
+    uintptr_t pn = paddr >> PAGE_SHIFT;
+    size_t lo = 0, hi = numa_nranges;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (pn < numa_range_table[mid].nr_start)
+        {
+            hi = mid;
+        }
+        else if (pn >= numa_range_table[mid].nr_end)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            return numa_range_table[mid].nr_node;
+        }
+    }
+    return -1;
+}
+
+long numa_distance(long from, long to)
+{
+    KASSERT(from >= 0 && from < numa_count && to >= 0 && to < numa_count);
+    return numa_distances[from][to];
+}
+
+const long *numa_fallback(long node)
+{
+    KASSERT(node >= 0 && node < numa_count);
+    return numa_fallbacks[node];
+}
+
+const numa_range_t *numa_ranges(size_t *countp)
+{
+    *countp = numa_nranges;
+    return numa_range_table;
+}
@@ -3,7 +3,10 @@
 #include <main/gdt.h>
 
 #include "main/apic.h"
+#include "main/cpuid.h"
+#include "main/fpu.h"
 #include "main/inits.h"
+#include "main/numa.h"
 
 #include "mm/tlb.h"
 
@@ -24,64 +27,78 @@ extern uintptr_t smp_initialization_end;
 static void smp_start_processor(uint8_t apic_id);
 static long smp_stop_processor(regs_t *regs);
 
-extern void *csd_start;
 extern void *csd_end;
 #define CSD_START ((uintptr_t)&csd_start)
 #define CSD_END ((uintptr_t)&csd_end)
 #define CSD_PAGES (uintptr_t)((CSD_END - CSD_START) >> PAGE_SHIFT)
 
+#define MSR_GS_BASE 0xc0000101
+#define MSR_KERNEL_GS_BASE 0xc0000102
+
+/* placed first in the section by link.ld */
+static csd_head_t csd_head_data __attribute__((section(".csd.head")));
+
+#undef curcore
 core_t curcore CORE_SPECIFIC_DATA;
+#define curcore CSD(curcore)
+
 uintptr_t csd_vaddr_table[MAX_LAPICS] = {NULL};
 
-void map_in_core_specific_data(pml4_t *pml4)
+/* Makes the copy of the core-specific data at base the current core's */
+static void csd_set_base(uintptr_t base)
 {
-    pt_map_range(pml4, curcore.kc_csdpaddr, CSD_START, CSD_END,
-                 PT_PRESENT | PT_WRITE, PT_PRESENT | PT_WRITE);
-    uintptr_t mapped_paddr = pt_virt_to_phys_helper(pml4, (uintptr_t)&curcore);
-    uintptr_t expected_paddr =
-        (uintptr_t)GET_CSD(curcore.kc_id, core_t, curcore) - PHYS_OFFSET;
-    uintptr_t expected_paddr2 =
-        pt_virt_to_phys_helper(pt_get(), (uintptr_t)&curcore);
-    KASSERT(mapped_paddr == expected_paddr);
-    KASSERT(expected_paddr == expected_paddr2);
+    ((csd_head_t *)base)->ch_base = base;
+    cpuid_set_msr(MSR_GS_BASE, (uint32_t)base, (uint32_t)(base >> 32));
+    /* userland's, swapped in on the way out */
+    cpuid_set_msr(MSR_KERNEL_GS_BASE, 0, 0);
+}
+
+void csd_boot_init()
+{
+    csd_set_base(CSD_START);
+    KASSERT((uintptr_t)&csd_head_data == CSD_START);
 }
 
 long is_core_specific_data(void *addr)
 {
-    return (uintptr_t)addr >= CSD_START && (uintptr_t)addr < CSD_END;
+    uintptr_t base = (uintptr_t)csd_head();
+    return (uintptr_t)addr >= base &&
+           (uintptr_t)addr < base + (CSD_END - CSD_START);
 }
 
 void core_init()
 {
     // order of operations are pretty important here
+    apic_x2apic_enter();
     pt_init();
     pt_set(pt_create());
 
-    uintptr_t csd_paddr = (uintptr_t)page_alloc_n(CSD_PAGES);
-    if (!csd_paddr)
+    uintptr_t csd_vaddr = (uintptr_t)page_alloc_n_node(
+        CSD_PAGES, numa_core_node(apic_current_id()));
+    if (!csd_vaddr)
         panic("not enough memory for core-specific data!");
-    csd_vaddr_table[apic_current_id()] =
-        csd_paddr; // still in PHYSMAP region; still a VMA
-    csd_paddr -= PHYS_OFFSET;
-
-    dbg(DBG_CORE, "mapping in core specific data to 0x%p\n", (void *)csd_paddr);
-    pt_map_range(pt_get(), csd_paddr, CSD_START, CSD_END, PT_PRESENT | PT_WRITE,
-                 PT_PRESENT | PT_WRITE);
-    tlb_flush_all();
+    memset((void *)csd_vaddr, 0, CSD_END - CSD_START);
+    csd_vaddr_table[apic_current_id()] = csd_vaddr;
 
-    memset((void *)CSD_START, 0, CSD_END - CSD_START);
+    dbg(DBG_CORE, "core specific data at 0x%p\n", (void *)csd_vaddr);
+    csd_set_base(csd_vaddr);
 
     curcore.kc_id = apic_current_id();
     curcore.kc_queue = NULL;
     curcore.kc_lock = NULL;
-    curcore.kc_csdpaddr = csd_paddr;
+    curcore.kc_csdpaddr = csd_vaddr - PHYS_OFFSET;
 
     intr_init();
     gdt_init();
+    syscall_core_init();
+    fpu_core_init();
 
     apic_enable();
     time_init();
     sched_init();
+    page_pcp_init();
+    pt_pcid_init();
+    pt_pat_init();
 
     void *stack = page_alloc();
     KASSERT(stack != NULL);
@@ -91,10 +108,12 @@ void core_init()
 
 void __attribute__((used)) smp_processor_entry()
 {
+    csd_boot_init();
     core_init();
     spinlock_lock(&smp_startup_spinlock);
     dbg_force(DBG_CORE, "started C%ld!\n", curcore.kc_id);
     smp_processor_count++;
+    time_tsc_sync_target();
 
     KASSERT(!intr_enabled());
     preemption_disable();
@@ -128,6 +147,7 @@ static void smp_start_processor(uint8_t apic_id)
 
     while (smp_processor_count == prev_count)
         ;
+    time_tsc_sync_source();
 
     // by the time we get the spinlock, we are guaranteed that the core we are
     // starting now has its own proper context and is no longer using the temp
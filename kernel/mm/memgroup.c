@@ -0,0 +1,284 @@
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "mm/memgroup.h"
+#include "mm/mobj.h"
+#include "mm/pframe.h"
+#include "mm/reclaim.h"
+
+#include "proc/proc.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+
+typedef struct memgroup
+{
+    long mg_created;  /* the slot is in use */
+    size_t mg_nprocs; /* processes that belong to it */
+    size_t mg_limit;  /* pages, 0 for none */
+
+    /* Pages charged: all of them, then anonymous (and shadow) ones and page
+     * cache ones. Only mg_usage is kept to the limit, with compare-and-swap;
+     * the others are counted after. */
+    size_t mg_usage;
+    size_t mg_anon;
+    size_t mg_cache;
+
+    size_t mg_max_usage; /* the most charged at once */
+    size_t mg_reclaimed; /* pages reclaimed to keep to the limit */
+    size_t mg_failures;  /* charges that failed */
+
+    unsigned mg_io_weight;     /* 0 for IOSCHED_WEIGHT_DEFAULT */
+    unsigned mg_io_latency_ms; /* 0 for IOSCHED_LATENCY_MS */
+} memgroup_t;
+
+static memgroup_t memgroups[MEMGROUP_MAX] = {[MEMGROUP_ROOT] = {
+                                                 .mg_created = 1}};
+
+/* Protects mg_created, mg_nprocs, mg_limit and every process's p_memgroup */
+static spinlock_t memgroup_lock = SPINLOCK_INITIALIZER(memgroup_lock);
+
+static long memgroup_anon(pframe_t *pf)
+{
+    return pf->pf_obj->mo_type == MOBJ_ANON ||
+           pf->pf_obj->mo_type == MOBJ_SHADOW;
+}
+
+long memgroup_charge(pframe_t *pf, long reclaim)
+{
+    KASSERT(pframe_owned(pf) && !pf->pf_addr && pf->pf_obj);
+    long id = curproc ? curproc->p_memgroup : MEMGROUP_ROOT;
+    memgroup_t *mg = &memgroups[id];
+    size_t usage = __atomic_load_n(&mg->mg_usage, __ATOMIC_RELAXED);
+    while (1)
+    {
+        size_t limit = __atomic_load_n(&mg->mg_limit, __ATOMIC_RELAXED);
+        if (!limit || usage < limit)
+        {
+            if (__atomic_compare_exchange_n(&mg->mg_usage, &usage, usage + 1,
+                                            0, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                break;
+            }
+            continue;
+        }
+        size_t freed = reclaim ? reclaim_group_pages(id, RECLAIM_BATCH) : 0;
+        if (!freed)
+        {
+            __atomic_add_fetch(&mg->mg_failures, 1, __ATOMIC_RELAXED);
+            dbg(DBG_MM, "memgroup: group %ld is at its limit of %lu pages\n",
+                id, limit);
+            return -ENOMEM;
+        }
+        __atomic_add_fetch(&mg->mg_reclaimed, freed, __ATOMIC_RELAXED);
+        usage = __atomic_load_n(&mg->mg_usage, __ATOMIC_RELAXED);
+    }
+
+    pf->pf_group = (uint8_t)id;
+    __atomic_add_fetch(memgroup_anon(pf) ? &mg->mg_anon : &mg->mg_cache, 1,
+                       __ATOMIC_RELAXED);
+    size_t max = __atomic_load_n(&mg->mg_max_usage, __ATOMIC_RELAXED);
+    while (max <= usage && !__atomic_compare_exchange_n(
+                               &mg->mg_max_usage, &max, usage + 1, 0,
+                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    return 0;
+}
+
+void memgroup_uncharge(pframe_t *pf)
+{
+    memgroup_t *mg = &memgroups[pf->pf_group];
+    __atomic_sub_fetch(memgroup_anon(pf) ? &mg->mg_anon : &mg->mg_cache, 1,
+                       __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mg->mg_usage, 1, __ATOMIC_RELAXED);
+}
+
+void memgroup_proc_init(proc_t *proc)
+{
+    spinlock_lock(&memgroup_lock);
+    proc->p_memgroup = curproc->p_memgroup;
+    memgroups[proc->p_memgroup].mg_nprocs++;
+    spinlock_unlock(&memgroup_lock);
+}
+
+void memgroup_proc_exit(proc_t *proc)
+{
+    spinlock_lock(&memgroup_lock);
+    memgroups[proc->p_memgroup].mg_nprocs--;
+    spinlock_unlock(&memgroup_lock);
+}
+
+/* Whether id names a group other than the root; memgroup_lock must be held */
+static long memgroup_valid(long id)
+{
+    return id > MEMGROUP_ROOT && id < MEMGROUP_MAX && memgroups[id].mg_created;
+}
+
+/*
+ * Reclaim the pages of group id until it holds no more than target.
+ */
+static void memgroup_shrink(long id, size_t target)
+{
+    memgroup_t *mg = &memgroups[id];
+    size_t usage;
+    while ((usage = __atomic_load_n(&mg->mg_usage, __ATOMIC_RELAXED)) >
+           target)
+    {
+        size_t freed = reclaim_group_pages(id, usage - target);
+        if (!freed)
+        {
+            break;
+        }
+        __atomic_add_fetch(&mg->mg_reclaimed, freed, __ATOMIC_RELAXED);
+    }
+}
+
+long memgroup_create(size_t limit)
+{
+    spinlock_lock(&memgroup_lock);
+    for (long id = MEMGROUP_ROOT + 1; id < MEMGROUP_MAX; id++)
+    {
+        memgroup_t *mg = &memgroups[id];
+        if (!mg->mg_created)
+        {
+            KASSERT(!mg->mg_usage && !mg->mg_nprocs);
+            mg->mg_created = 1;
+            mg->mg_limit = limit;
+            mg->mg_max_usage = 0;
+            mg->mg_reclaimed = 0;
+            mg->mg_failures = 0;
+            mg->mg_io_weight = 0;
+            mg->mg_io_latency_ms = 0;
+            spinlock_unlock(&memgroup_lock);
+            dbg(DBG_MM, "memgroup: created group %ld, limit %lu pages\n", id,
+                limit);
+            return id;
+        }
+    }
+    spinlock_unlock(&memgroup_lock);
+    return -ENOSPC;
+}
+
+long memgroup_destroy(long id)
+{
+    spinlock_lock(&memgroup_lock);
+    long valid = memgroup_valid(id);
+    long busy = valid && memgroups[id].mg_nprocs;
+    spinlock_unlock(&memgroup_lock);
+    if (!valid)
+    {
+        return -EINVAL;
+    }
+    if (busy)
+    {
+        return -EBUSY;
+    }
+
+    /* with no processes left in it, nothing more is charged to it */
+    memgroup_shrink(id, 0);
+    spinlock_lock(&memgroup_lock);
+    long ret = -EBUSY;
+    if (memgroup_valid(id) && !memgroups[id].mg_nprocs &&
+        !__atomic_load_n(&memgroups[id].mg_usage, __ATOMIC_RELAXED))
+    {
+        memgroups[id].mg_created = 0;
+        ret = 0;
+    }
+    spinlock_unlock(&memgroup_lock);
+    return ret;
+}
+
+long memgroup_set_limit(long id, size_t limit)
+{
+    spinlock_lock(&memgroup_lock);
+    long valid = memgroup_valid(id);
+    if (valid)
+    {
+        __atomic_store_n(&memgroups[id].mg_limit, limit, __ATOMIC_RELAXED);
+    }
+    spinlock_unlock(&memgroup_lock);
+    if (!valid)
+    {
+        return -EINVAL;
+    }
+    if (limit)
+    {
+        memgroup_shrink(id, limit);
+    }
+    return 0;
+}
+
+long memgroup_move(proc_t *proc, long id)
+{
+    spinlock_lock(&memgroup_lock);
+    long ret = -EINVAL;
+    if (id == MEMGROUP_ROOT || memgroup_valid(id))
+    {
+        memgroups[proc->p_memgroup].mg_nprocs--;
+        memgroups[id].mg_nprocs++;
+        proc->p_memgroup = id;
+        ret = 0;
+    }
+    spinlock_unlock(&memgroup_lock);
+    return ret;
+}
+
+long memgroup_set_io(long id, unsigned weight, unsigned latency_ms)
+{
+    if (weight > IOSCHED_WEIGHT_MAX)
+    {
+        return -EINVAL;
+    }
+    spinlock_lock(&memgroup_lock);
+    long valid = id == MEMGROUP_ROOT || memgroup_valid(id);
+    if (valid)
+    {
+        __atomic_store_n(&memgroups[id].mg_io_weight, weight,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&memgroups[id].mg_io_latency_ms, latency_ms,
+                         __ATOMIC_RELAXED);
+    }
+    spinlock_unlock(&memgroup_lock);
+    return valid ? 0 : -EINVAL;
+}
+
+unsigned memgroup_io_weight(long id)
+{
+    unsigned weight =
+        __atomic_load_n(&memgroups[id].mg_io_weight, __ATOMIC_RELAXED);
+    return weight ? weight : IOSCHED_WEIGHT_DEFAULT;
+}
+
+unsigned memgroup_io_latency_ms(long id)
+{
+    unsigned ms =
+        __atomic_load_n(&memgroups[id].mg_io_latency_ms, __ATOMIC_RELAXED);
+    return ms ? ms : IOSCHED_LATENCY_MS;
+}
+
+size_t memgroup_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    for (long id = 0; id < MEMGROUP_MAX; id++)
+    {
+        memgroup_t *mg = &memgroups[id];
+        if (!mg->mg_created)
+        {
+            continue;
+        }
+        iprintf(&buf, &size,
+                "%ld limit=%lu usage=%lu anon=%lu cache=%lu max_usage=%lu "
+                "reclaimed=%lu failures=%lu procs=%lu io_weight=%u "
+                "io_latency_ms=%u\n",
+                id, mg->mg_limit, mg->mg_usage, mg->mg_anon, mg->mg_cache,
+                mg->mg_max_usage, mg->mg_reclaimed, mg->mg_failures,
+                mg->mg_nprocs, memgroup_io_weight(id),
+                memgroup_io_latency_ms(id));
+    }
+    return size;
+}
@@ -1,10 +1,22 @@
+#include "config.h"
 #include "errno.h"
 
+#include "drivers/writeback.h"
+
+#include "mm/memgroup.h"
 #include "mm/mobj.h"
+#include "mm/page.h"
 #include "mm/pframe.h"
+#include "mm/reclaim.h"
 
 #include "util/debug.h"
+#include "util/time.h"
+#include "vm/swap.h"
 #include <util/string.h>
+#include <util/trace.h>
+
+/* Number of pframes on all mobjs' mo_dirty lists */
+static size_t mobj_ndirty;
 
 /*
  * Initialize o according to type and ops. If ops do not specify a
@@ -32,7 +44,14 @@ void mobj_init(mobj_t *o, long type, mobj_ops_t *ops)
     kmutex_init(&o->mo_mutex);
 
     o->mo_refcount = ATOMIC_INIT(1);
+    o->mo_pcpu_refs.pc_slot = 0;
     list_init(&o->mo_pframes);
+    radix_tree_init(&o->mo_pframe_idx);
+    radix_tree_init(&o->mo_swap_idx);
+    list_init(&o->mo_dirty);
+    spinlock_init(&o->mo_dirty_lock);
+    list_init(&o->mo_vmas);
+    spinlock_init(&o->mo_vmas_lock);
 }
 
 /*
@@ -50,9 +69,61 @@ inline void mobj_unlock(mobj_t *o) { kmutex_unlock(&o->mo_mutex); }
  */
 void mobj_ref(mobj_t *o)
 {
+    if (o->mo_pcpu_refs.pc_slot)
+    {
+        pcpu_counter_inc(&o->mo_pcpu_refs);
+        return;
+    }
     atomic_inc(&o->mo_refcount);
 }
 
+long mobj_ref_not_zero(mobj_t *o)
+{
+    if (o->mo_pcpu_refs.pc_slot)
+    {
+        /* its own reference in mo_refcount keeps it alive */
+        pcpu_counter_inc(&o->mo_pcpu_refs);
+        return 1;
+    }
+    return atomic_inc_not_zero(&o->mo_refcount);
+}
+
+long mobj_refs_percpu(mobj_t *o)
+{
+    KASSERT(atomic_read(&o->mo_refcount));
+    if (o->mo_pcpu_refs.pc_slot)
+    {
+        return 0;
+    }
+    pcpu_counter_t refs;
+    long ret = pcpu_counter_init(&refs);
+    if (ret)
+    {
+        return ret;
+    }
+    /* references dropped before the switch is seen go on coming off
+     * mo_refcount, which this one keeps from reaching 0 */
+    atomic_inc(&o->mo_refcount);
+    __atomic_store_n(&o->mo_pcpu_refs.pc_slot, refs.pc_slot,
+                     __ATOMIC_RELEASE);
+    return 0;
+}
+
+void mobj_refs_atomic(mobj_t *o)
+{
+    pcpu_counter_t refs = o->mo_pcpu_refs;
+    if (!refs.pc_slot)
+    {
+        return;
+    }
+    o->mo_pcpu_refs.pc_slot = 0;
+    /* per core, references dropped may outnumber those taken */
+    long count = pcpu_counter_read(&refs);
+    pcpu_counter_destroy(&refs);
+    atomic_add(&o->mo_refcount, (int)count - 1);
+    KASSERT(atomic_read(&o->mo_refcount) > 0);
+}
+
 void mobj_put_locked(mobj_t **op)
 {
     mobj_unlock(*op);
@@ -68,6 +139,11 @@ void mobj_put(mobj_t **op)
     mobj_t *o = *op;
     KASSERT(o->mo_refcount);
     *op = NULL;
+    if (o->mo_pcpu_refs.pc_slot)
+    {
+        pcpu_counter_dec(&o->mo_pcpu_refs);
+        return;
+    }
 
     dbg(DBG_ERROR, "count: %d\n", o->mo_refcount);
     if (atomic_dec_and_test(&o->mo_refcount))
@@ -84,23 +160,20 @@ void mobj_put(mobj_t **op)
 }
 
 /*
- * Find a pframe that already exists in the memory object's mo_pframes list.
- * If a pframe is found, it must be locked upon return from this function using
- * pf_mutex.
+ * Find a pframe that already exists in the memory object, using the page
+ * index rather than walking mo_pframes. If a pframe is found, it must be
+ * locked upon return from this function using pframe_lock().
  */
 void mobj_find_pframe(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
 {
     KASSERT(kmutex_owns_mutex(&o->mo_mutex));
-    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+    pframe_t *pf = radix_tree_lookup(&o->mo_pframe_idx, pagenum);
+    if (pf)
     {
-        if (pf->pf_pagenum == pagenum)
-        {
-            kmutex_lock(&pf->pf_mutex);
-            *pfp = pf;
-            return;
-        }
+        KASSERT(pf->pf_pagenum == pagenum);
+        pframe_lock(pf);
     }
-    *pfp = NULL;
+    *pfp = pf;
 }
 
 /*
@@ -113,13 +186,13 @@ long mobj_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
     KASSERT(kmutex_owns_mutex(&o->mo_mutex));
     *pfp = NULL;
     long ret = o->mo_ops.get_pframe(o, pagenum, forwrite, pfp);
-    KASSERT((!*pfp && ret) || kmutex_owns_mutex(&(*pfp)->pf_mutex));
+    KASSERT((!*pfp && ret) || pframe_owned((*pfp)));
     return ret;
 }
 
 /*
- * Create and initialize a pframe and add it to the mobj's mo_pframes list.
- * Upon successful return, the pframe's pf_mutex is locked.
+ * Create and initialize a pframe and add it to the mobj's mo_pframes list and
+ * page index. Upon successful return, the pframe is locked.
  */
 static void mobj_create_pframe(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
 {
@@ -127,15 +200,127 @@ static void mobj_create_pframe(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
     pframe_t *pf = pframe_create();
     if (pf)
     {
-        kmutex_lock(&pf->pf_mutex);
+        pframe_lock(pf);
 
         pf->pf_pagenum = pagenum;
-        list_insert_tail(&o->mo_pframes, &pf->pf_link);
+        pf->pf_obj = o;
+        if (radix_tree_insert(&o->mo_pframe_idx, pagenum, pf))
+        {
+            pframe_free(&pf);
+        }
+        else
+        {
+            list_insert_tail(&o->mo_pframes, &pf->pf_link);
+        }
     }
-    KASSERT(!pf || kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(!pf || pframe_owned(pf));
     *pfp = pf;
 }
 
+/*
+ * Mark a locked pframe dirty and queue it for writeback.
+ */
+static void mobj_dirty_pframe(mobj_t *o, pframe_t *pf)
+{
+    KASSERT(pframe_owned(pf));
+    pf->pf_dirty = 1;
+    swap_dirtied(o, pf->pf_pagenum);
+    spinlock_lock(&o->mo_dirty_lock);
+    if (!list_link_is_linked(&pf->pf_dirty_link))
+    {
+        pf->pf_dirtied = jiffies;
+        list_insert_tail(&o->mo_dirty, &pf->pf_dirty_link);
+        __sync_fetch_and_add(&mobj_ndirty, 1);
+    }
+    spinlock_unlock(&o->mo_dirty_lock);
+    writeback_dirtied(mobj_ndirty);
+}
+
+/*
+ * Mark a locked pframe clean (its contents having been written back), and
+ * take it off the mobj's dirty list.
+ */
+void mobj_clean_pframe(mobj_t *o, pframe_t *pf)
+{
+    KASSERT(pframe_owned(pf));
+    pf->pf_dirty = 0;
+    spinlock_lock(&o->mo_dirty_lock);
+    if (list_link_is_linked(&pf->pf_dirty_link))
+    {
+        list_remove(&pf->pf_dirty_link);
+        __sync_fetch_and_sub(&mobj_ndirty, 1);
+    }
+    spinlock_unlock(&o->mo_dirty_lock);
+}
+
+/*
+ * Store in pfs up to max of the mobj's least recently dirtied pframes that
+ * were dirtied before the given time (in jiffies), and return how many there
+ * were. Pinned pframes are passed over. The pframes are not locked, the mobj
+ * must be until they are (and pf_pinned is checked again then).
+ */
+size_t mobj_collect_dirty(mobj_t *o, uint64_t dirtied_before, pframe_t **pfs,
+                          size_t max)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    size_t n = 0;
+    spinlock_lock(&o->mo_dirty_lock);
+    list_iterate(&o->mo_dirty, pf, pframe_t, pf_dirty_link)
+    {
+        if (n == max || pf->pf_dirtied >= dirtied_before)
+        {
+            break;
+        }
+        if (!pf->pf_pinned)
+        {
+            pfs[n++] = pf;
+        }
+    }
+    spinlock_unlock(&o->mo_dirty_lock);
+    return n;
+}
+
+/*
+ * Return the number of pframes, over all mobjs, waiting for writeback.
+ */
+size_t mobj_dirty_count() { return mobj_ndirty; }
+
+/*
+ * Charge a page being read in from a file or disk to the current thread (see
+ * kt_pages_read); other objects fill pages without any I/O.
+ */
+static void mobj_count_page_read(mobj_t *o)
+{
+    if (curthr && (o->mo_type == MOBJ_VNODE || o->mo_type == MOBJ_BLOCKDEV))
+    {
+        curthr->kt_pages_read++;
+    }
+}
+
+/*
+ * Allocate the contents of pframe pf, zeroed if zeroed is set, and charge them
+ * to curproc's memory group. Pages are reclaimed from the group's other
+ * pframes if it is at its limit, and then from anyone's if there are none
+ * left.
+ */
+static void *mobj_alloc_page(pframe_t *pf, long zeroed)
+{
+    if (memgroup_charge(pf, 1))
+    {
+        return NULL;
+    }
+    void *addr = zeroed ? page_alloc_zeroed() : page_alloc_movable();
+    if (!addr && reclaim_pages(RECLAIM_BATCH))
+    {
+        addr = zeroed ? page_alloc_zeroed() : page_alloc_movable();
+    }
+    if (!addr)
+    {
+        memgroup_uncharge(pf);
+    }
+    return addr;
+}
+
 /*
  * The default get pframe that is at the center of the mobj/pframe subsystem.
  * This is the routine that is used when the memory object does not have a 
@@ -172,30 +357,104 @@ long mobj_default_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
     {
         return -ENOMEM;
     }
-    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(pframe_owned(pf));
+    if (pf->pf_addr && pframe_wait_fill(pf))
+    {
+        /* An asynchronous fill (readahead) failed; retry it synchronously. */
+        long ret = o->mo_ops.fill_pframe(o, pf);
+        if (ret)
+        {
+            pframe_unlock(pf);
+            return ret;
+        }
+        pf->pf_fill_error = 0;
+    }
     if (!pf->pf_addr)
     {
         KASSERT(!pf->pf_dirty &&
                 "dirtied page doesn't have a physical address");
-        pf->pf_addr = page_alloc();
-        if (!pf->pf_addr)
+        /* zeroing is all an anonymous object's fill does for a page that is
+         * not in swap, and a page from the zeroed pool needs none */
+        long anon = o->mo_type == MOBJ_ANON && !swap_has_page(o, pagenum);
+        trace(TRACE_PFRAME_MISS, o, pf->pf_pagenum, 0);
+        void *page = mobj_alloc_page(pf, anon);
+        if (!page)
         {
+            pframe_unlock(pf);
             return -ENOMEM;
         }
+        pframe_set_page(pf, page);
 
         dbg(DBG_PFRAME, "filling pframe 0x%p (mobj 0x%p page %lu)\n", pf, o,
             pf->pf_pagenum);
         KASSERT(o->mo_ops.fill_pframe);
-        long ret = o->mo_ops.fill_pframe(o, pf);
+        long ret = anon ? 0 : o->mo_ops.fill_pframe(o, pf);
+        trace(TRACE_PFRAME_FILL, o, pf->pf_pagenum, ret);
         if (ret)
         {
-            page_free(pf->pf_addr);
-            pf->pf_addr = NULL;
-            kmutex_unlock(&pf->pf_mutex);
+            void *page = pf->pf_addr;
+            pframe_set_page(pf, NULL);
+            page_free_movable(page);
+            memgroup_uncharge(pf);
+            pframe_unlock(pf);
             return ret;
         }
+        reclaim_lru_add(pf);
+        mobj_count_page_read(o);
+    }
+    else
+    {
+        reclaim_lru_touch(pf);
+    }
+    if (forwrite && !pf->pf_dirty)
+    {
+        mobj_dirty_pframe(o, pf);
     }
-    pf->pf_dirty |= forwrite;
+    *pfp = pf;
+    return 0;
+}
+
+/*
+ * Begin an asynchronous fill of a page that is not resident: create its pframe
+ * and allocate its contents as mobj_default_get_pframe would, but mark it
+ * filling (see pframe_fill_start()) instead of calling fill_pframe. The caller
+ * starts the I/O into pf->pf_addr, releases the pframe, and calls
+ * pframe_fill_done() when the I/O finishes.
+ *
+ * Upon successful return, *pfp is locked. Returns -EEXIST, with *pfp NULL, if
+ * the page already has a pframe, or -ENOMEM.
+ */
+long mobj_start_fill_pframe(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    *pfp = NULL;
+    if (radix_tree_lookup(&o->mo_pframe_idx, pagenum))
+    {
+        return -EEXIST;
+    }
+    pframe_t *pf = NULL;
+    mobj_create_pframe(o, pagenum, &pf);
+    if (!pf)
+    {
+        return -ENOMEM;
+    }
+    /* readahead is not worth reclaiming for */
+    long ret = memgroup_charge(pf, 0);
+    void *page = ret ? NULL : page_alloc_movable();
+    if (!page)
+    {
+        if (!ret)
+        {
+            memgroup_uncharge(pf);
+        }
+        /* leave the empty pframe; get_pframe fills it in the usual way */
+        pframe_unlock(pf);
+        return -ENOMEM;
+    }
+    pframe_set_page(pf, page);
+    pframe_fill_start(pf);
+    reclaim_lru_add(pf);
+    mobj_count_page_read(o);
     *pfp = pf;
     return 0;
 }
@@ -203,31 +462,37 @@ long mobj_default_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
 /*
  * If the pframe is dirty, call the mobj's flush_pframe; if flush_pframe returns
  * successfully, clear pf_dirty flag and return 0. Otherwise, return what
- * flush_pframe returned.
+ * flush_pframe returned, or -EBUSY if the pframe is pinned (pf_pinned) and so
+ * may not be written yet.
  *
  * Both o and pf must be locked when calling this function
  */
 long mobj_flush_pframe(mobj_t *o, pframe_t *pf)
 {
     KASSERT(kmutex_owns_mutex(&o->mo_mutex));
-    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(pframe_owned(pf));
     KASSERT(pf->pf_addr && "cannot flush a frame not in memory!");
     dbg(DBG_PFRAME, "pf 0x%p, mobj 0x%p, page %lu\n", pf, o, pf->pf_pagenum);
+    if (pf->pf_dirty && pf->pf_pinned)
+    {
+        return -EBUSY;
+    }
     if (pf->pf_dirty)
     {
         KASSERT(o->mo_ops.flush_pframe);
         long ret = o->mo_ops.flush_pframe(o, pf);
         if (ret)
             return ret;
-        pf->pf_dirty = 0;
     }
+    mobj_clean_pframe(o, pf);
     KASSERT(!pf->pf_dirty);
     return 0;
 }
 
 /*
  * Iterate through the pframes of the mobj and try to flush each one.
- * If any of them fail, let that reflect in the return value.
+ * If any of them fail, let that reflect in the return value. Pinned pframes
+ * are left to whoever pinned them.
  *
  * The mobj o must be locked when calling this function
  */
@@ -237,8 +502,8 @@ long mobj_flush(mobj_t *o)
     KASSERT(kmutex_owns_mutex(&o->mo_mutex));
     list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
     {
-        kmutex_lock(&pf->pf_mutex); // get the pframe (lock it)
-        if (pf->pf_addr)
+        pframe_lock(pf); // get the pframe (lock it)
+        if (pf->pf_addr && !pf->pf_pinned)
         {
             ret |= mobj_flush_pframe(o, pf);
         }
@@ -250,17 +515,29 @@ long mobj_flush(mobj_t *o)
 /*
  * Attempt to flush the pframe. If the flush succeeds, then free the pframe's
  * contents (pf->pf_addr) using page_free, remove the pframe from the mobj's
- * list and call pframe_free.
+ * list and page index and call pframe_free.
  *
  * Upon successful return, *pfp MUST be null. If the function returns an error
- * code, *pfp must be unchanged.
+ * code, *pfp must be unchanged. Fails with -EBUSY if the pframe has shared
+ * references (see pframe_share()).
+ *
+ * If batch is given, the page is added to it rather than freed right away.
  */
-long mobj_free_pframe(mobj_t *o, pframe_t **pfp)
+static long _mobj_free_pframe(mobj_t *o, pframe_t **pfp, page_batch_t *batch)
 {
     pframe_t *pf = *pfp;
 
+    /* a reader refers to it without the lock; references are only taken
+     * while holding it, so there will be no new ones */
+    if (pf->pf_refs)
+    {
+        return -EBUSY;
+    }
+    reclaim_lru_remove(pf);
     if (pf->pf_addr)
     {
+        /* don't free the page out from under the device */
+        pframe_wait_fill(pf);
         long ret = mobj_flush_pframe(o, pf);
         if (ret)
             return ret;
@@ -270,30 +547,65 @@ long mobj_free_pframe(mobj_t *o, pframe_t **pfp)
         // TABLES THAT USE THEM)
         if (pf->pf_addr)
         {
-            page_free(pf->pf_addr);
-            pf->pf_addr = NULL;
+            void *page = pf->pf_addr;
+            pframe_set_page(pf, NULL);
+            memgroup_uncharge(pf);
+            if (batch)
+            {
+                page_batch_add(batch, page);
+            }
+            else
+            {
+                page_free_movable(page);
+            }
         }
     }
     *pfp = NULL;
     list_remove(&pf->pf_link);
+    radix_tree_remove(&o->mo_pframe_idx, pf->pf_pagenum);
     pframe_free(&pf);
     return 0;
 }
 
+/* See _mobj_free_pframe() */
+long mobj_free_pframe(mobj_t *o, pframe_t **pfp)
+{
+    return _mobj_free_pframe(o, pfp, NULL);
+}
+
 /*
- * Simply flush the memory object
+ * Flush and free every pframe of the memory object, which must be locked.
+ * Pframes that fail to flush are left in place. Their pages are returned to
+ * the allocator together, in one batch, once they are all off the object.
  */
-void mobj_default_destructor(mobj_t *o)
+long mobj_free_pframes(mobj_t *o)
 {
-    mobj_lock(o);
     KASSERT(kmutex_owns_mutex(&o->mo_mutex));
-
+    page_batch_t batch = PAGE_BATCH_INITIALIZER;
     long ret = 0;
     list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
     {
-        kmutex_lock(&pf->pf_mutex); // get the pframe (lock it)
-        ret |= mobj_free_pframe(o, &pf);
+        pframe_lock(pf); // get the pframe (lock it)
+        long err = _mobj_free_pframe(o, &pf, &batch);
+        if (err)
+        {
+            pframe_release(&pf);
+        }
+        ret |= err;
     }
+    page_batch_flush(&batch);
+    return ret;
+}
+
+/*
+ * Simply flush the memory object
+ */
+void mobj_default_destructor(mobj_t *o)
+{
+    mobj_lock(o);
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+
+    long ret = mobj_free_pframes(o);
 
     if (ret)
     {
@@ -302,6 +614,7 @@ void mobj_default_destructor(mobj_t *o)
             "more frames\n"
             "This means the memory for the pframe will be leaked!");
     }
+    swap_release(o);
 
     KASSERT(!kmutex_has_waiters(&o->mo_mutex));
     mobj_unlock(o);
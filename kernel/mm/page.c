@@ -1,5 +1,7 @@
 // SMP.1 + SMP.3
 // spinlocks + mask interrupts
+#include "config.h"
+#include "errno.h"
 #include "kernel.h"
 #include "types.h"
 #include <boot/multiboot_macros.h>
@@ -8,11 +10,18 @@
 
 #include "mm/mm.h"
 #include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/reclaim.h"
+
+#include "main/interrupt.h"
+#include "main/numa.h"
 
 #include "util/debug.h"
 #include "util/gdb.h"
 #include "util/string.h"
 
+#include "globals.h"
+
 #include "multiboot.h"
 
 // BTREE === Binary Tree (not an actual B-Tree)
@@ -106,6 +115,79 @@ static size_t max_order; // max depth of binary tree
 static btree_word *btree;
 static uintptr_t *min_available_idx_by_order;
 static size_t *count_available_by_order;
+/* the last available index of each order, or the row's first index if there
+ * is none; see page_alloc_movable() */
+static uintptr_t *max_available_idx_by_order;
+
+/* Set while page_init() adds the free ranges: blocks are only marked in the
+ * tree, and _btree_build() merges buddies and sets up the metadata once all of
+ * them are in */
+static long page_bulk_init;
+
+/*
+ * Per-core page magazines.
+ *
+ * Small allocations (1, 2 or 4 pages) are served from a per-core stack of free
+ * blocks of that size instead of walking the btree under page_spinlock. An
+ * empty magazine is refilled with PAGE_MAGAZINE_BATCH blocks in one trip to
+ * the btree, and a magazine that reaches PAGE_MAGAZINE_HIGH blocks drains its
+ * PAGE_MAGAZINE_BATCH oldest blocks back, so the global allocator is only
+ * touched once per batch. Blocks are handed out last-freed-first so that they
+ * are likely to still be in the core's cache.
+ *
+ * A magazine is only touched by its own core, with interrupts masked.
+ */
+#define PAGE_MAGAZINE_MAX_ORDER 2 /* largest block size cached: 2^order pages */
+#define PAGE_MAGAZINE_HIGH 32     /* blocks per magazine before draining */
+#define PAGE_MAGAZINE_BATCH 8     /* blocks moved per refill/drain */
+
+typedef struct page_magazine
+{
+    size_t pm_count;
+    void *pm_blocks[PAGE_MAGAZINE_HIGH]; /* oldest at index 0 */
+} page_magazine_t;
+
+static page_magazine_t page_magazines[PAGE_MAGAZINE_MAX_ORDER + 1]
+    CORE_SPECIFIC_DATA;
+#define page_magazines CSD(page_magazines)
+
+/* Single movable pages, which are kept apart so that they stay at the top of
+ * memory; see page_alloc_movable() */
+static page_magazine_t page_movable_magazine CORE_SPECIFIC_DATA;
+#define page_movable_magazine CSD(page_movable_magazine)
+
+/* Set once this core's core-specific data is in place; see page_pcp_init() */
+static long page_magazines_enabled CORE_SPECIFIC_DATA;
+#define page_magazines_enabled CSD(page_magazines_enabled)
+
+/* The NUMA node this core's allocations are taken from first; see
+ * page_pcp_init() */
+static long page_node CORE_SPECIFIC_DATA;
+#define page_node CSD(page_node)
+
+/*
+ * For each NUMA node, one more than the smallest order of block it was last
+ * found to have none of (nor larger), or 0; cleared whenever a page of the
+ * node is freed. It spares a node that has run out of memory a search of its
+ * part of the tree on every allocation. Protected by page_spinlock.
+ */
+static size_t page_node_short[NUMA_MAX_NODES];
+
+/* Free pages sitting in magazines, across all cores */
+static size_t page_cachedcount;
+
+/*
+ * Pre-zeroed pages.
+ *
+ * Idle cores take free pages, zero them with non-temporal stores, which do
+ * not pull the page into the cache only to evict something useful, and keep
+ * up to PAGE_ZEROED_POOL of them here for page_alloc_zeroed(). They count as
+ * cached free pages, and are given back when an allocation fails. They are
+ * movable pages, as most of them go to anonymous memory.
+ */
+static void *page_zeroed[PAGE_ZEROED_POOL];
+static size_t page_zeroed_count;
+static spinlock_t page_zeroed_lock;
 
 static char *type_strings[] = {"ERROR: type = 0", "Available", "Reserved",
                                "ACPI Reclaimable", "ACPI NVS", "GRUB Bad Ram"};
@@ -129,6 +211,7 @@ static inline void _btree_expensive_sanity_check()
         long checked_first = 0;
         unsigned order_count = 0;
         uintptr_t max = BTREE_ROW_END_INDEX(order);
+        uintptr_t last = BTREE_ROW_START_INDEX(order);
 
         for (uintptr_t idx = BTREE_ROW_START_INDEX(order); idx < max; idx++)
         {
@@ -139,6 +222,7 @@ static inline void _btree_expensive_sanity_check()
                     KASSERT(min_available_idx_by_order[order] == idx);
                     checked_first = 1;
                 }
+                last = idx;
                 available += (1 << order);
                 order_count++;
                 KASSERT(BTREE_INDEX_TO_ADDR(idx + 1, order) <= physmap_end());
@@ -148,15 +232,164 @@ static inline void _btree_expensive_sanity_check()
         {
             KASSERT(min_available_idx_by_order[order] == max);
         }
+        KASSERT(max_available_idx_by_order[order] == last);
         KASSERT(count_available_by_order[order] == order_count);
     }
     KASSERT(available == page_freecount);
 #endif
 }
 
+/*
+ * Returns the first available index in [idx, end), or end if there is none,
+ * skipping a word of the tree at a time.
+ */
+static uintptr_t _btree_next_available(uintptr_t idx, uintptr_t end)
+{
+    while (idx < end)
+    {
+        btree_word word =
+            btree[BTREE_WORD_POS(idx)] & (~(btree_word)0 >> BTREE_BIT_POS(idx));
+        if (word)
+        {
+            idx = BTREE_WORD_POS(idx) * BTREE_NUM_BITS +
+                  (uintptr_t)__builtin_clzl(word);
+            return MIN(idx, end);
+        }
+        idx = (BTREE_WORD_POS(idx) + 1) * BTREE_NUM_BITS;
+    }
+    return end;
+}
+
+/*
+ * Returns the last available index in [start, idx], of which there must be
+ * one, skipping a word of the tree at a time.
+ */
+static uintptr_t _btree_prev_available(uintptr_t idx, uintptr_t start)
+{
+    while (1)
+    {
+        btree_word word =
+            btree[BTREE_WORD_POS(idx)] &
+            (~(btree_word)0 << (BTREE_NUM_BITS - 1 - BTREE_BIT_POS(idx)));
+        if (word)
+        {
+            idx = BTREE_WORD_POS(idx) * BTREE_NUM_BITS + BTREE_NUM_BITS - 1 -
+                  (uintptr_t)__builtin_ctzl(word);
+            KASSERT(idx >= start);
+            return idx;
+        }
+        KASSERT(BTREE_WORD_POS(idx) > BTREE_WORD_POS(start));
+        idx = BTREE_WORD_POS(idx) * BTREE_NUM_BITS - 1;
+    }
+}
+
+/*
+ * Returns the last available index in [start, end), or end if there is none,
+ * skipping a word of the tree at a time.
+ */
+static uintptr_t _btree_last_available(uintptr_t start, uintptr_t end)
+{
+    if (start >= end)
+    {
+        return end;
+    }
+    uintptr_t idx = end - 1;
+    while (1)
+    {
+        btree_word word =
+            btree[BTREE_WORD_POS(idx)] &
+            (~(btree_word)0 << (BTREE_NUM_BITS - 1 - BTREE_BIT_POS(idx)));
+        if (word)
+        {
+            idx = BTREE_WORD_POS(idx) * BTREE_NUM_BITS + BTREE_NUM_BITS - 1 -
+                  (uintptr_t)__builtin_ctzl(word);
+            return idx >= start ? idx : end;
+        }
+        if (BTREE_WORD_POS(idx) <= BTREE_WORD_POS(start))
+        {
+            return end;
+        }
+        idx = BTREE_WORD_POS(idx) * BTREE_NUM_BITS - 1;
+    }
+}
+
+/*
+ * Builds the tree from the blocks page_init() marked, bottom-up: a row at a
+ * time, every pair of available buddies is merged into their parent, and what
+ * is left in the row is final, so the row's count and first available index
+ * are taken on the way. Rows are scanned a word at a time, and only the
+ * blocks the ranges were split into are visited, so this takes time in
+ * proportion to the tree's size in words (a word per 32 pages of RAM), rather
+ * than merging and rescanning for the minimum block by block.
+ */
+static void _btree_build()
+{
+    for (size_t order = 0; order <= max_order; order++)
+    {
+        uintptr_t end = BTREE_ROW_END_INDEX(order);
+        uintptr_t min = end;
+        uintptr_t max = BTREE_ROW_START_INDEX(order);
+        size_t count = 0;
+        uintptr_t idx =
+            _btree_next_available(BTREE_ROW_START_INDEX(order), end);
+        for (; idx < end; idx = _btree_next_available(idx + 1, end))
+        {
+            if (BTREE_IS_LEFT_CHILD(idx) && BTREE_IS_AVAILABLE(idx + 1))
+            {
+                BTREE_MARK_UNAVAILABLE(idx);
+                BTREE_MARK_UNAVAILABLE(idx + 1);
+                BTREE_MARK_AVAILABLE(BTREE_PARENT(idx));
+                idx++;
+                continue;
+            }
+            min = MIN(min, idx);
+            max = idx;
+            count++;
+        }
+        min_available_idx_by_order[order] = min;
+        max_available_idx_by_order[order] = max;
+        count_available_by_order[order] = count;
+    }
+    _btree_expensive_sanity_check();
+}
+
+/*
+ * Add the free range [addr, end) but for the pages of any multiboot modules
+ * in it, which are left reserved for their users (see ramdisk.h).
+ */
+static void page_add_range_but_modules(uintptr_t addr, uintptr_t end)
+{
+    for (struct multiboot_tag *tag = mb_tag + 1;
+         tag->type != MULTIBOOT_TAG_TYPE_END; tag += TAG_SIZE(tag->size))
+    {
+        if (tag->type != MULTIBOOT_TAG_TYPE_MODULE)
+        {
+            continue;
+        }
+        struct multiboot_tag_module *module =
+            (struct multiboot_tag_module *)tag;
+        uintptr_t start = (uintptr_t)PAGE_ALIGN_DOWN(module->mod_start);
+        uintptr_t stop = (uintptr_t)PAGE_ALIGN_UP(module->mod_end);
+        if (start < end && stop > addr)
+        {
+            if (start > addr)
+            {
+                page_add_range_but_modules(addr, start);
+            }
+            if (stop < end)
+            {
+                page_add_range_but_modules(stop, end);
+            }
+            return;
+        }
+    }
+    page_add_range((void *)addr, (void *)end);
+}
+
 void page_init()
 {
     spinlock_init(&page_spinlock);
+    spinlock_init(&page_zeroed_lock);
     uintptr_t ram = 0;
     uintptr_t memory_available_for_use = 0;
 
@@ -224,7 +457,7 @@ void page_init()
         // we need 2^(max_order+1) pages, and one byte maps 8 pages, so we need
         // 2^(max_order-2) bytes for the binary tree
         btree_size = 1UL << (max_order - 2);
-        metadata_size = sizeof(uintptr_t) * (max_order + 1) +
+        metadata_size = 2 * sizeof(uintptr_t) * (max_order + 1) +
                         sizeof(size_t) * (max_order + 1);
 
         if (memory_available_for_use >= btree_size + metadata_size)
@@ -262,10 +495,18 @@ void page_init()
     }
 
     count_available_by_order =
-        min_available_idx_by_order + sizeof(uintptr_t) * (max_order + 1);
+        (size_t *)(min_available_idx_by_order + (max_order + 1));
     memset(count_available_by_order, 0, sizeof(size_t) * (max_order + 1));
 
+    max_available_idx_by_order =
+        (uintptr_t *)(count_available_by_order + (max_order + 1));
+    for (unsigned order = 0; order <= max_order; order++)
+    {
+        max_available_idx_by_order[order] = BTREE_ROW_START_INDEX(order);
+    }
+
     page_freecount = 0;
+    page_bulk_init = 1;
 
     uintptr_t reserved_ram_start = KERNEL_PHYS_BASE;
     uintptr_t reserved_ram_end =
@@ -309,9 +550,11 @@ void page_init()
                 continue;
             }
 
-            page_add_range((void *)addr, (void *)(addr + len));
+            page_add_range_but_modules(addr, addr + len);
         }
     }
+    page_bulk_init = 0;
+    _btree_build();
 
     page_mark_reserved(0); // don't allocate the first page of memory
 
@@ -338,10 +581,24 @@ void page_init_finish()
         (uintptr_t *)((uintptr_t)min_available_idx_by_order + PHYS_OFFSET);
     count_available_by_order =
         (uintptr_t *)((uintptr_t)count_available_by_order + PHYS_OFFSET);
+    max_available_idx_by_order =
+        (uintptr_t *)((uintptr_t)max_available_idx_by_order + PHYS_OFFSET);
 }
 
 static void _btree_update_metadata_after_removal(size_t order, size_t idx)
 {
+    /* everything past the last available index is unavailable, so if it has
+     * gone, the new one is the first available one before it */
+    uintptr_t *max = &max_available_idx_by_order[order];
+    if (!count_available_by_order[order])
+    {
+        *max = BTREE_ROW_START_INDEX(order);
+    }
+    else if (!BTREE_IS_AVAILABLE(*max))
+    {
+        *max = _btree_prev_available(*max, BTREE_ROW_START_INDEX(order));
+    }
+
     // [+] TODO Intel-specific optimizations, see BSF, BSR, REPE CMPS/SCAS
     if (count_available_by_order[order])
     {
@@ -397,6 +654,23 @@ static void _btree_update_metadata_after_removal(size_t order, size_t idx)
     }
 }
 
+/*
+ * Count a block that has just been marked available, and update the order's
+ * first and last available indices.
+ */
+static inline void _btree_note_available(uintptr_t idx, size_t order)
+{
+    count_available_by_order[order]++;
+    if (idx < min_available_idx_by_order[order])
+    {
+        min_available_idx_by_order[order] = idx;
+    }
+    if (idx > max_available_idx_by_order[order])
+    {
+        max_available_idx_by_order[order] = idx;
+    }
+}
+
 static void _btree_mark_available(uintptr_t idx, size_t order)
 {
     KASSERT(!BTREE_IS_AVAILABLE(idx));
@@ -407,11 +681,7 @@ static void _btree_mark_available(uintptr_t idx, size_t order)
     dbg(DBG_MM, "marking available (0x%p, 0x%p)\n", (void *)start, (void *)end);
     KASSERT(!(0xb1000 >= start && 0xb1000 < end));
 
-    count_available_by_order[order]++;
-    if (idx < min_available_idx_by_order[order])
-    {
-        min_available_idx_by_order[order] = idx;
-    }
+    _btree_note_available(idx, order);
 
     while (idx > 0 && BTREE_IS_AVAILABLE(BTREE_SIBLING(idx)))
     {
@@ -424,11 +694,29 @@ static void _btree_mark_available(uintptr_t idx, size_t order)
         idx = BTREE_PARENT(idx);
         order++;
         BTREE_MARK_AVAILABLE(idx);
-        count_available_by_order[order]++;
-        if (idx < min_available_idx_by_order[order])
+        _btree_note_available(idx, order);
+    }
+}
+
+/*
+ * Marks [leaf_idx, leaf_idx + npages) available as the largest aligned blocks
+ * it can be split into, for _btree_build() to merge with their buddies.
+ */
+static void _btree_mark_range_bulk(uintptr_t leaf_idx, size_t npages)
+{
+    while (npages)
+    {
+        uintptr_t idx = leaf_idx;
+        size_t order = 0;
+        while (BTREE_IS_LEFT_CHILD(idx) && (2UL << order) <= npages)
         {
-            min_available_idx_by_order[order] = idx;
+            idx = BTREE_PARENT(idx);
+            order++;
         }
+        KASSERT(!BTREE_IS_AVAILABLE(idx));
+        BTREE_MARK_AVAILABLE(idx);
+        npages -= 1 << order;
+        leaf_idx += 1 << order;
     }
 }
 
@@ -469,6 +757,12 @@ void page_add_range(void *start, void *end)
     start = PAGE_ALIGN_UP(start);
     end = PAGE_ALIGN_DOWN(end);
     size_t npages = ((uintptr_t)end - (uintptr_t)start) >> PAGE_SHIFT;
+    if (page_bulk_init)
+    {
+        _btree_mark_range_bulk(BTREE_ADDR_TO_LEAF_INDEX(start), npages);
+        page_freecount += npages;
+        return;
+    }
     _btree_mark_range_available(BTREE_ADDR_TO_LEAF_INDEX(start), npages);
     page_freecount += npages;
     _btree_expensive_sanity_check();
@@ -476,6 +770,32 @@ void page_add_range(void *start, void *end)
 
 void *page_alloc() { return page_alloc_n(1); }
 
+void page_zero(void *page)
+{
+    KASSERT(PAGE_ALIGNED(page));
+    size_t words = PAGE_SIZE / sizeof(uint64_t);
+    __asm__ volatile(
+        "cld\n\t"
+        "rep\n\t"
+        "stosq"
+        : "+D"(page), "+c"(words)
+        : "a"(0UL)
+        : "cc", "memory");
+}
+
+void page_copy(void *dest, const void *src)
+{
+    KASSERT(PAGE_ALIGNED(dest) && PAGE_ALIGNED(src));
+    size_t words = PAGE_SIZE / sizeof(uint64_t);
+    __asm__ volatile(
+        "cld\n\t"
+        "rep\n\t"
+        "movsq"
+        : "+D"(dest), "+S"(src), "+c"(words)
+        :
+        : "cc", "memory");
+}
+
 void *page_alloc_bounded(void *max_paddr)
 {
     return page_alloc_n_bounded(1, max_paddr);
@@ -483,8 +803,13 @@ void *page_alloc_bounded(void *max_paddr)
 
 void page_free(void *addr) { page_free_n(addr, 1); }
 
+/*
+ * Allocate npages from the available block idx, splitting it down to
+ * smallest_order and keeping the lower half of each split, or the upper half
+ * if high is set.
+ */
 static void *_btree_alloc(size_t npages, uintptr_t idx, size_t smallest_order,
-                          size_t actual_order)
+                          size_t actual_order, long high)
 {
     while (actual_order != smallest_order)
     {
@@ -497,10 +822,11 @@ static void *_btree_alloc(size_t npages, uintptr_t idx, size_t smallest_order,
         BTREE_MARK_AVAILABLE(BTREE_SIBLING(idx));
         actual_order--;
 
-        count_available_by_order[actual_order] += 2;
-        if (idx < min_available_idx_by_order[actual_order])
+        _btree_note_available(idx, actual_order);
+        _btree_note_available(BTREE_SIBLING(idx), actual_order);
+        if (high)
         {
-            min_available_idx_by_order[actual_order] = idx;
+            idx = BTREE_SIBLING(idx);
         }
         _btree_expensive_sanity_check();
     }
@@ -546,16 +872,12 @@ static void *_btree_alloc(size_t npages, uintptr_t idx, size_t smallest_order,
     return (void *)(addr + PHYS_OFFSET);
 }
 
-void *page_alloc_n(size_t npages)
-{
-    return page_alloc_n_bounded(npages, (void *)~0UL);
-}
-
-// this is really only used for setting up initial page tables
-// this memory will be immediately overriden, so no need to poison the memory
-void *page_alloc_n_bounded(size_t npages, void *max_paddr)
+/*
+ * Allocate npages from the btree, from the bottom of memory, or from the top
+ * if movable is set. page_spinlock must be held.
+ */
+static void *_page_alloc_n_locked(size_t npages, void *max_paddr, long movable)
 {
-    spinlock_lock(&page_spinlock);
     KASSERT(npages > 0 && npages <= (1UL << max_order));
     if (npages > page_freecount)
     {
@@ -574,6 +896,30 @@ void *page_alloc_n_bounded(size_t npages, void *max_paddr)
     while ((1UL << smallest_order) < npages)
         smallest_order++;
 
+    if (movable)
+    {
+        /* the block that reaches highest, whatever its order */
+        KASSERT(max_paddr == (void *)~0UL);
+        size_t best_order = 0;
+        uintptr_t best_end = 0;
+        for (size_t order = smallest_order; order <= max_order; order++)
+        {
+            uintptr_t idx = max_available_idx_by_order[order];
+            if (count_available_by_order[order] &&
+                BTREE_INDEX_TO_ADDR(idx + 1, order) > best_end)
+            {
+                best_end = BTREE_INDEX_TO_ADDR(idx + 1, order);
+                best_order = order;
+            }
+        }
+        if (!best_end)
+        {
+            return 0;
+        }
+        return _btree_alloc(npages, max_available_idx_by_order[best_order],
+                            smallest_order, best_order, 1);
+    }
+
     for (size_t actual_order = smallest_order; actual_order <= max_order;
          actual_order++)
     {
@@ -591,33 +937,501 @@ void *page_alloc_n_bounded(size_t npages, void *max_paddr)
                         (1 << actual_order) <
                     max_pages);
 
-            void *ret = _btree_alloc(npages, idx, smallest_order, actual_order);
+            void *ret =
+                _btree_alloc(npages, idx, smallest_order, actual_order, 0);
             KASSERT(((uintptr_t)ret + (npages << PAGE_SHIFT)) <=
                     (uintptr_t)physmap_end());
-            spinlock_unlock(&page_spinlock);
             return ret;
         }
     }
-    spinlock_unlock(&page_spinlock);
     return 0;
 }
 
-void page_free_n(void *addr, size_t npages)
+/*
+ * Allocate npages from a block lying within the frames [start, end): the
+ * first that fits, or the one reaching highest if movable is set, as
+ * _page_alloc_n_locked() does for the whole tree. page_spinlock must be held.
+ */
+static void *_page_alloc_range_locked(size_t npages, uintptr_t start,
+                                      uintptr_t end, long movable)
+{
+    end = MIN(end, max_pages);
+    size_t smallest_order = 0;
+    while ((1UL << smallest_order) < npages)
+        smallest_order++;
+
+    size_t best_order = 0;
+    uintptr_t best_idx = 0;
+    uintptr_t best_end = 0;
+    for (size_t order = smallest_order; order <= max_order; order++)
+    {
+        uintptr_t row = BTREE_ROW_START_INDEX(order);
+        uintptr_t first = row + ((start + (1UL << order) - 1) >> order);
+        uintptr_t last = row + (end >> order);
+        if (first >= last)
+        {
+            break;
+        }
+        if (!count_available_by_order[order] ||
+            min_available_idx_by_order[order] >= last ||
+            max_available_idx_by_order[order] < first)
+        {
+            continue;
+        }
+        if (!movable)
+        {
+            uintptr_t idx = _btree_next_available(
+                MAX(first, min_available_idx_by_order[order]), last);
+            if (idx < last)
+            {
+                return _btree_alloc(npages, idx, smallest_order, order, 0);
+            }
+            continue;
+        }
+        uintptr_t stop = MIN(last, max_available_idx_by_order[order] + 1);
+        uintptr_t idx = _btree_last_available(first, stop);
+        if (idx < stop && BTREE_INDEX_TO_ADDR(idx + 1, order) > best_end)
+        {
+            best_end = BTREE_INDEX_TO_ADDR(idx + 1, order);
+            best_idx = idx;
+            best_order = order;
+        }
+    }
+    if (!best_end)
+    {
+        return 0;
+    }
+    return _btree_alloc(npages, best_idx, smallest_order, best_order, 1);
+}
+
+/*
+ * Allocate npages from node's memory, or failing that from the other nodes,
+ * nearest first, and then from anywhere, as from a machine without NUMA if
+ * node is -1. page_spinlock must be held.
+ */
+static void *_page_alloc_near_locked(size_t npages, long node, long movable)
+{
+    if (node >= 0 && numa_nnodes() > 1 && npages <= page_freecount)
+    {
+        size_t order = 0;
+        while ((1UL << order) < npages)
+            order++;
+        size_t nranges;
+        const numa_range_t *ranges = numa_ranges(&nranges);
+        const long *fallback = numa_fallback(node);
+        for (long i = 0; i < numa_nnodes(); i++)
+        {
+            long n = fallback[i];
+            if (page_node_short[n] && order + 1 >= page_node_short[n])
+            {
+                continue;
+            }
+            for (size_t r = 0; r < nranges; r++)
+            {
+                if (ranges[r].nr_node != n)
+                {
+                    continue;
+                }
+                void *ret = _page_alloc_range_locked(
+                    npages, ranges[r].nr_start, ranges[r].nr_end, movable);
+                if (ret)
+                {
+                    return ret;
+                }
+            }
+            page_node_short[n] = order + 1;
+        }
+    }
+    return _page_alloc_n_locked(npages, (void *)~0UL, movable);
+}
+
+/*
+ * Returns the NUMA node whose memory this core allocates from first, or -1
+ * before page_pcp_init().
+ */
+static inline long _page_local_node()
+{
+    return page_magazines_enabled ? page_node : -1;
+}
+
+/*
+ * Return npages at addr to the btree. page_spinlock must be held.
+ */
+static void _page_free_n_locked(void *addr, size_t npages)
 {
-    spinlock_lock(&page_spinlock);
     dbgq(DBG_MM, "page_free_n(%lu): [0x%p, 0x%p)\t\t%lu pages remain\n", npages,
          addr, (void *)((uintptr_t)addr + (npages << PAGE_SHIFT)),
          page_freecount);
-    GDB_CALL_HOOK(page_free, addr, npages);
     KASSERT(npages > 0 && npages <= (1UL << max_order) && PAGE_ALIGNED(addr));
     uintptr_t idx = BTREE_ADDR_TO_LEAF_INDEX((uintptr_t)addr - PHYS_OFFSET);
     KASSERT(idx + npages - BTREE_LEAF_START_INDEX <= max_pages);
     _btree_mark_range_available(idx, npages);
     page_freecount += npages;
+    if (numa_nnodes() > 1)
+    {
+        long node = numa_paddr_node((uintptr_t)addr - PHYS_OFFSET);
+        if (node >= 0)
+        {
+            page_node_short[node] = 0;
+        }
+    }
     _btree_expensive_sanity_check();
+}
+
+/*
+ * Returns the magazine order for an npages request, or -1 if requests of that
+ * size bypass the magazines.
+ */
+static inline long _page_magazine_order(size_t npages)
+{
+    if (!page_magazines_enabled)
+    {
+        return -1;
+    }
+    for (long order = 0; order <= PAGE_MAGAZINE_MAX_ORDER; order++)
+    {
+        if (npages == (1UL << order))
+        {
+            return order;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Move up to PAGE_MAGAZINE_BATCH blocks from the btree into an empty
+ * magazine. Interrupts must be masked.
+ */
+static void _page_magazine_refill(page_magazine_t *mag, size_t order,
+                                  long movable)
+{
+    KASSERT(!mag->pm_count);
+    spinlock_lock(&page_spinlock);
+    while (mag->pm_count < PAGE_MAGAZINE_BATCH)
+    {
+        void *block =
+            _page_alloc_near_locked(1UL << order, page_node, movable);
+        if (!block)
+        {
+            break;
+        }
+        mag->pm_blocks[mag->pm_count++] = block;
+    }
+    spinlock_unlock(&page_spinlock);
+    __sync_add_and_fetch(&page_cachedcount, mag->pm_count << order);
+}
+
+/*
+ * Return the oldest nblocks blocks of a magazine to the btree. Interrupts must
+ * be masked.
+ */
+static void _page_magazine_drain(page_magazine_t *mag, size_t order,
+                                 size_t nblocks)
+{
+    KASSERT(nblocks <= mag->pm_count);
+    spinlock_lock(&page_spinlock);
+    for (size_t i = 0; i < nblocks; i++)
+    {
+        _page_free_n_locked(mag->pm_blocks[i], 1UL << order);
+    }
+    spinlock_unlock(&page_spinlock);
+    mag->pm_count -= nblocks;
+    for (size_t i = 0; i < mag->pm_count; i++)
+    {
+        mag->pm_blocks[i] = mag->pm_blocks[i + nblocks];
+    }
+    __sync_sub_and_fetch(&page_cachedcount, nblocks << order);
+}
+
+/*
+ * Give every block cached on this core back to the btree, so that a request
+ * the btree couldn't satisfy can be retried. Returns 1 if anything was freed.
+ */
+static long _page_magazines_drain_all()
+{
+    if (!page_magazines_enabled)
+    {
+        return 0;
+    }
+    long drained = 0;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    for (size_t order = 0; order <= PAGE_MAGAZINE_MAX_ORDER; order++)
+    {
+        page_magazine_t *mag = &page_magazines[order];
+        if (mag->pm_count)
+        {
+            _page_magazine_drain(mag, order, mag->pm_count);
+            drained = 1;
+        }
+    }
+    if (page_movable_magazine.pm_count)
+    {
+        _page_magazine_drain(&page_movable_magazine, 0,
+                             page_movable_magazine.pm_count);
+        drained = 1;
+    }
+    intr_setipl(ipl);
+    return drained;
+}
+
+void page_pcp_init()
+{
+    for (size_t order = 0; order <= PAGE_MAGAZINE_MAX_ORDER; order++)
+    {
+        page_magazines[order].pm_count = 0;
+    }
+    page_movable_magazine.pm_count = 0;
+    page_node = numa_core_node(curcore.kc_id);
+    page_magazines_enabled = 1;
+}
+
+/*
+ * Start reclaiming cached pages once memory runs low.
+ */
+static inline void _page_check_low()
+{
+    if (page_free_count() < RECLAIM_LOW_PAGES)
+    {
+        reclaim_kick();
+    }
+}
+
+/* As page_zero(), without going through the cache */
+static void _page_zero_nt(void *page)
+{
+    size_t words = PAGE_SIZE / sizeof(uint64_t);
+    __asm__ volatile(
+        "1:\n\t"
+        "movnti %2, (%0)\n\t"
+        "addq $8, %0\n\t"
+        "decq %1\n\t"
+        "jnz 1b\n\t"
+        "sfence"
+        : "+r"(page), "+r"(words)
+        : "r"(0UL)
+        : "cc", "memory");
+}
+
+/*
+ * Give the zeroed pool back to the allocator. Returns 1 if anything was freed.
+ */
+static long _page_zeroed_drain()
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&page_zeroed_lock);
+    size_t count = page_zeroed_count;
+    page_zeroed_count = 0;
+    spinlock_unlock(&page_zeroed_lock);
+    intr_setipl(ipl);
+
+    __sync_sub_and_fetch(&page_cachedcount, count);
+    for (size_t i = 0; i < count; i++)
+    {
+        page_free_movable(page_zeroed[i]);
+    }
+    return count != 0;
+}
+
+void *page_alloc_n(size_t npages)
+{
+    return page_alloc_n_bounded(npages, (void *)~0UL);
+}
+
+static void *_page_alloc(size_t npages, void *max_paddr, long movable)
+{
+    long order = _page_magazine_order(npages);
+    KASSERT(!movable || npages == 1);
+    if (order >= 0 && max_paddr == (void *)~0UL)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        page_magazine_t *mag =
+            movable ? &page_movable_magazine : &page_magazines[order];
+        if (!mag->pm_count)
+        {
+            _page_magazine_refill(mag, order, movable);
+        }
+        void *ret = NULL;
+        if (mag->pm_count)
+        {
+            ret = mag->pm_blocks[--mag->pm_count];
+            __sync_sub_and_fetch(&page_cachedcount, npages);
+        }
+        intr_setipl(ipl);
+        if (ret)
+        {
+            _page_check_low();
+            return ret;
+        }
+    }
+
+    long node = max_paddr == (void *)~0UL ? _page_local_node() : -1;
+    spinlock_lock(&page_spinlock);
+    void *ret = node >= 0 ? _page_alloc_near_locked(npages, node, movable)
+                          : _page_alloc_n_locked(npages, max_paddr, movable);
+    spinlock_unlock(&page_spinlock);
+    if (!ret && (_page_magazines_drain_all() | _page_zeroed_drain()))
+    {
+        spinlock_lock(&page_spinlock);
+        ret = _page_alloc_n_locked(npages, max_paddr, movable);
+        spinlock_unlock(&page_spinlock);
+    }
+    if (!ret)
+    {
+        reclaim_alloc_failed();
+        if (npages > 1)
+        {
+            reclaim_compact_kick(npages);
+        }
+    }
+    _page_check_low();
+    return ret;
+}
+
+// this is really only used for setting up initial page tables
+// this memory will be immediately overriden, so no need to poison the memory
+void *page_alloc_n_bounded(size_t npages, void *max_paddr)
+{
+    return _page_alloc(npages, max_paddr, 0);
+}
+
+void *page_alloc_movable() { return _page_alloc(1, (void *)~0UL, 1); }
+
+void *page_alloc_n_node(size_t npages, long node)
+{
+    spinlock_lock(&page_spinlock);
+    void *ret = _page_alloc_near_locked(npages, node, 0);
+    spinlock_unlock(&page_spinlock);
+    return ret ? ret : page_alloc_n(npages);
+}
+
+static void _page_free(void *addr, size_t npages, long movable)
+{
+    GDB_CALL_HOOK(page_free, addr, npages);
+    long order = _page_magazine_order(npages);
+    /* a magazine only holds its own node's pages, for it to hand out */
+    if (order >= 0 && numa_nnodes() > 1)
+    {
+        long node = numa_paddr_node((uintptr_t)addr - PHYS_OFFSET);
+        if (node >= 0 && node != page_node)
+        {
+            order = -1;
+        }
+    }
+    if (order >= 0)
+    {
+        KASSERT(PAGE_ALIGNED(addr));
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        page_magazine_t *mag =
+            movable ? &page_movable_magazine : &page_magazines[order];
+        if (mag->pm_count == PAGE_MAGAZINE_HIGH)
+        {
+            _page_magazine_drain(mag, order, PAGE_MAGAZINE_BATCH);
+        }
+        mag->pm_blocks[mag->pm_count++] = addr;
+        __sync_add_and_fetch(&page_cachedcount, npages);
+        intr_setipl(ipl);
+        return;
+    }
+
+    spinlock_lock(&page_spinlock);
+    _page_free_n_locked(addr, npages);
     spinlock_unlock(&page_spinlock);
 }
 
+void page_free_n(void *addr, size_t npages) { _page_free(addr, npages, 0); }
+
+void page_free_movable(void *addr) { _page_free(addr, 1, 1); }
+
+void page_batch_add(page_batch_t *batch, void *page)
+{
+    KASSERT(PAGE_ALIGNED(page));
+    *(void **)page = batch->pb_head;
+    batch->pb_head = page;
+    batch->pb_count++;
+}
+
+/* Pages page_batch_flush() frees per hold of page_spinlock */
+#define PAGE_BATCH_LOCK_HOLD 64
+
+void page_batch_flush(page_batch_t *batch)
+{
+    void *page = batch->pb_head;
+    while (page)
+    {
+        spinlock_lock(&page_spinlock);
+        for (size_t i = 0; page && i < PAGE_BATCH_LOCK_HOLD; i++)
+        {
+            void *next = *(void **)page;
+            GDB_CALL_HOOK(page_free, page, 1);
+            _page_free_n_locked(page, 1);
+            page = next;
+        }
+        spinlock_unlock(&page_spinlock);
+    }
+    batch->pb_head = NULL;
+    batch->pb_count = 0;
+}
+
+void *page_alloc_zeroed()
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&page_zeroed_lock);
+    void *page = NULL;
+    /* the pool is shared, and a page from another node is not worth having */
+    if (page_zeroed_count &&
+        (numa_nnodes() == 1 ||
+         numa_paddr_node((uintptr_t)page_zeroed[page_zeroed_count - 1] -
+                         PHYS_OFFSET) == _page_local_node()))
+    {
+        page = page_zeroed[--page_zeroed_count];
+        __sync_sub_and_fetch(&page_cachedcount, 1);
+    }
+    spinlock_unlock(&page_zeroed_lock);
+    intr_setipl(ipl);
+    if (page)
+    {
+        _page_check_low();
+        return page;
+    }
+
+    if ((page = page_alloc()))
+    {
+        page_zero(page);
+    }
+    return page;
+}
+
+long page_zero_idle()
+{
+    KASSERT(!intr_enabled());
+    /* page_zeroed_count is checked again under the lock */
+    if (page_zeroed_count == PAGE_ZEROED_POOL ||
+        page_free_count() < RECLAIM_HIGH_PAGES)
+    {
+        return 0;
+    }
+    void *page = page_alloc_movable();
+    if (!page)
+    {
+        return 0;
+    }
+    _page_zero_nt(page);
+
+    spinlock_lock(&page_zeroed_lock);
+    long kept = page_zeroed_count < PAGE_ZEROED_POOL;
+    if (kept)
+    {
+        page_zeroed[page_zeroed_count++] = page;
+        __sync_add_and_fetch(&page_cachedcount, 1);
+    }
+    spinlock_unlock(&page_zeroed_lock);
+    if (!kept)
+    {
+        page_free_movable(page);
+    }
+    return kept;
+}
+
 void page_mark_reserved(void *paddr)
 {
     if ((uintptr_t)paddr > (max_pages << PAGE_SHIFT))
@@ -666,4 +1480,162 @@ void page_mark_reserved(void *paddr)
     spinlock_unlock(&page_spinlock);
 }
 
-size_t page_free_count() { return page_freecount; }
+size_t page_free_count() { return page_freecount + page_cachedcount; }
+
+/*
+ * Compaction.
+ *
+ * Movable pages are allocated from the top of memory and everything else
+ * from the bottom, so that the kernel's own pages, which can never move, do
+ * not end up scattered between them. Free space among the movable pages is
+ * then recovered by moving the pages in the way: an aligned block of the
+ * wanted size, scanned for from the top, qualifies if every page in it is
+ * either free or holds a pframe. Its free parts are taken out of the tree
+ * first, so that nothing is allocated into it meanwhile, then each pframe is
+ * moved elsewhere (see reclaim_migrate_page()), and the emptied block is
+ * freed whole. If a pframe cannot be moved, the pages taken so far are given
+ * back and the next block is tried.
+ */
+#define PAGE_COMPACT_MAX_ORDER 9 /* the largest block made: 2MB */
+#define PAGE_COMPACT_TRIES 16    /* blocks tried per call */
+
+#define PAGE_COMPACT_TAKEN(taken, i) ((taken)[(i) / 64] & (1UL << ((i) % 64)))
+#define PAGE_COMPACT_TAKE(taken, i) ((taken)[(i) / 64] |= 1UL << ((i) % 64))
+
+/*
+ * Give back the pages of the block starting at frame pn that are marked in
+ * taken. page_spinlock must be held.
+ */
+static void _page_compact_release(uintptr_t pn, size_t order,
+                                  const uint64_t *taken)
+{
+    for (size_t i = 0; i < (1UL << order); i++)
+    {
+        if (PAGE_COMPACT_TAKEN(taken, i))
+        {
+            _page_free_n_locked((char *)PN_TO_ADDR(pn + i) + PHYS_OFFSET, 1);
+        }
+    }
+}
+
+/*
+ * Take the free parts of the block of the given order starting at frame pn
+ * out of the tree, marking their pages in taken. Returns 0 if the rest of the
+ * block holds pframes, -EBUSY (having given them back) if it does not, or 1
+ * if the whole block is free already.
+ */
+static long _page_compact_isolate(uintptr_t pn, size_t order, uint64_t *taken)
+{
+    spinlock_lock(&page_spinlock);
+    for (size_t i = 0; i < (1UL << order);)
+    {
+        uintptr_t idx = BTREE_LEAF_START_INDEX + pn + i;
+        size_t o = 0;
+        while (idx && !BTREE_IS_AVAILABLE(idx))
+        {
+            idx = BTREE_PARENT(idx);
+            o++;
+        }
+        if (!BTREE_IS_AVAILABLE(idx))
+        {
+            if (!pframe_of_page((char *)PN_TO_ADDR(pn + i) + PHYS_OFFSET))
+            {
+                _page_compact_release(pn, order, taken);
+                spinlock_unlock(&page_spinlock);
+                return -EBUSY;
+            }
+            i++;
+            continue;
+        }
+        if (o >= order)
+        {
+            KASSERT(!i);
+            spinlock_unlock(&page_spinlock);
+            return 1;
+        }
+        /* free blocks are aligned, so this one starts at page i */
+        KASSERT(BTREE_ADDR_TO_LEAF_INDEX(BTREE_INDEX_TO_ADDR(idx, o)) ==
+                BTREE_LEAF_START_INDEX + pn + i);
+        BTREE_MARK_UNAVAILABLE(idx);
+        count_available_by_order[o]--;
+        _btree_update_metadata_after_removal(o, idx);
+        page_freecount -= 1UL << o;
+        for (size_t j = 0; j < (1UL << o); j++, i++)
+        {
+            PAGE_COMPACT_TAKE(taken, i);
+        }
+    }
+    _btree_expensive_sanity_check();
+    spinlock_unlock(&page_spinlock);
+    return 0;
+}
+
+/*
+ * Try to empty the block of the given order starting at frame pn. Returns 1
+ * if it is free now, 0 if a pframe in it could not be moved, or -EBUSY if it
+ * holds pages that are not pframes'.
+ */
+static long _page_compact_block(uintptr_t pn, size_t order)
+{
+    uint64_t taken[(1UL << PAGE_COMPACT_MAX_ORDER) / 64];
+    memset(taken, 0, sizeof(taken));
+    long ret = _page_compact_isolate(pn, order, taken);
+    if (ret)
+    {
+        return ret;
+    }
+
+    for (size_t i = 0; i < (1UL << order); i++)
+    {
+        if (PAGE_COMPACT_TAKEN(taken, i))
+        {
+            continue;
+        }
+        void *page = (char *)PN_TO_ADDR(pn + i) + PHYS_OFFSET;
+        if (reclaim_migrate_page(page))
+        {
+            spinlock_lock(&page_spinlock);
+            _page_compact_release(pn, order, taken);
+            spinlock_unlock(&page_spinlock);
+            return 0;
+        }
+        GDB_CALL_HOOK(page_free, page, 1);
+        PAGE_COMPACT_TAKE(taken, i);
+    }
+
+    spinlock_lock(&page_spinlock);
+    _page_free_n_locked((char *)PN_TO_ADDR(pn) + PHYS_OFFSET, 1UL << order);
+    spinlock_unlock(&page_spinlock);
+    return 1;
+}
+
+long page_compact(size_t npages)
+{
+    size_t order = 0;
+    while ((1UL << order) < npages)
+        order++;
+    if (order > PAGE_COMPACT_MAX_ORDER || order > max_order)
+    {
+        return 0;
+    }
+    /* cached pages look allocated, and would be in the way */
+    _page_magazines_drain_all();
+    _page_zeroed_drain();
+
+    size_t tries = 0;
+    /* the first block holds the first page of memory, which is reserved */
+    for (uintptr_t block = max_pages >> order;
+         block-- > 1 && tries < PAGE_COMPACT_TRIES;)
+    {
+        long ret = _page_compact_block(block << order, order);
+        if (ret > 0)
+        {
+            dbg(DBG_MM, "compacted [0x%p, 0x%p)\n",
+                (char *)PN_TO_ADDR(block << order) + PHYS_OFFSET,
+                (char *)PN_TO_ADDR((block + 1) << order) + PHYS_OFFSET);
+            return 1;
+        }
+        tries += !ret;
+    }
+    return 0;
+}
@@ -1,10 +1,17 @@
+#include "config.h"
 #include "errno.h"
 #include "globals.h"
 #include "kernel.h"
 #include "types.h"
 
+#include "api/access.h"
+
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+
 #include "mm/mm.h"
 #include "mm/pframe.h"
+#include "mm/tlb.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -21,12 +28,137 @@ typedef enum
 
 static pml4_t *global_kernel_only_pml4;
 
+/*
+ * Once PCIDs are enabled, each core tags the TLB entries of the last
+ * TLB_NPCIDS page tables it has loaded, so switching back to one of them does
+ * not flush its entries. pt_pcid_owner[i] is the physical address of the page
+ * table holding PCID i on this core, or 0. Entries of a page table that is
+ * not loaded are never invalidated by invlpg, so only the current page table
+ * may have mappings removed (or made less permissive) without a
+ * tlb_flush_all() or a tlb_shootdown(), which has every core holding its PCID
+ * give it up; pt_destroy() gives up a page table's PCID.
+ */
+#define CR3_NOFLUSH (1UL << 63)
+
+static uintptr_t pt_pcid_owner[TLB_NPCIDS] CORE_SPECIFIC_DATA;
+#define pt_pcid_owner CSD(pt_pcid_owner)
+static size_t pt_pcid_next CORE_SPECIFIC_DATA;
+#define pt_pcid_next CSD(pt_pcid_next)
+
+void pt_pcid_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & CPUID_FEAT_ECX_PCID))
+    {
+        dbg(DBG_CORE, "PCIDs not supported\n");
+        return;
+    }
+
+    /* the current page table becomes the owner of PCID 0, which it has been
+     * using all along */
+    uintptr_t cr3;
+    __asm__ volatile("movq %%cr3, %0"
+                     : "=r"(cr3));
+    KASSERT(!(cr3 & ~PAGE_MASK));
+    pt_pcid_owner[0] = cr3;
+    pt_pcid_next = 1 % TLB_NPCIDS;
+
+    uintptr_t cr4 = tlb_read_cr4() | CR4_PCIDE;
+    __asm__ volatile("movq %0, %%cr4" ::"r"(cr4)
+                     : "memory");
+    dbg(DBG_CORE, "using %d PCIDs\n", TLB_NPCIDS);
+}
+
+/*
+ * PAT entry 1, which PT_WRITE_THROUGH alone selects, is write-through by
+ * default. Nothing needs write-through, so it becomes write-combining, for
+ * mappings of framebuffers; every core's PAT must agree. It is set before
+ * anything is mapped with the entry, so there is nothing cached to flush.
+ */
+#define IA32_PAT_MSR 0x277
+#define PAT_TYPE_WC 0x01
+
+void pt_pat_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_FEAT_EDX_PAT))
+    {
+        dbg(DBG_CORE, "PAT not supported; write-combining is write-through\n");
+        return;
+    }
+    uint32_t lo, hi;
+    cpuid_get_msr(IA32_PAT_MSR, &lo, &hi);
+    lo = (lo & ~0xff00U) | (PAT_TYPE_WC << 8);
+    cpuid_set_msr(IA32_PAT_MSR, lo, hi);
+}
+
+void pt_pcid_forget(uintptr_t phys_addr)
+{
+    if (!(tlb_read_cr4() & CR4_PCIDE))
+    {
+        return;
+    }
+    for (size_t pcid = 0; pcid < TLB_NPCIDS; pcid++)
+    {
+        if (pt_pcid_owner[pcid] == phys_addr)
+        {
+            pt_pcid_owner[pcid] = 0;
+        }
+    }
+}
+
 void pt_set(pml4_t *pml4)
 {
     KASSERT((void *)pml4 >= physmap_start());
     uintptr_t phys_addr = pt_virt_to_phys((uintptr_t)pml4);
+    long intr = 0;
+    if (tlb_read_cr4() & CR4_PCIDE)
+    {
+        /* a TLB shootdown must not land between choosing the PCID and
+         * loading it */
+        intr = intr_enabled() != 0;
+        intr_disable();
+
+        uintptr_t stale = tlb_take_stale();
+        if (stale == TLB_STALE_ALL)
+        {
+            memset(pt_pcid_owner, 0, sizeof(pt_pcid_owner));
+        }
+        else if (stale)
+        {
+            pt_pcid_forget(stale);
+        }
+
+        size_t pcid;
+        for (pcid = 0; pcid < TLB_NPCIDS; pcid++)
+        {
+            if (pt_pcid_owner[pcid] == phys_addr)
+            {
+                break;
+            }
+        }
+        if (pcid < TLB_NPCIDS)
+        {
+            phys_addr |= pcid | CR3_NOFLUSH;
+        }
+        else
+        {
+            /* take the PCID round-robin; loading CR3 without CR3_NOFLUSH
+             * drops whatever its previous owner left in the TLB */
+            pcid = pt_pcid_next;
+            pt_pcid_next = (pt_pcid_next + 1) % TLB_NPCIDS;
+            pt_pcid_owner[pcid] = phys_addr;
+            phys_addr |= pcid;
+        }
+    }
     __asm__ volatile("movq %0, %%cr3" ::"r"(phys_addr)
                      : "memory");
+    if (intr)
+    {
+        intr_enable();
+    }
 }
 
 /*
@@ -40,7 +172,7 @@ inline pml4_t *pt_get()
     uintptr_t pml4;
     __asm__ volatile("movq %%cr3, %0"
                      : "=r"(pml4));
-    return (pml4_t *)(pml4 + PHYS_OFFSET);
+    return (pml4_t *)((pml4 & PAGE_MASK) + PHYS_OFFSET); /* drop the PCID */
 }
 
 vaddr_map_status _vaddr_status(pml4_t *pml4, uintptr_t vaddr)
@@ -147,7 +279,7 @@ void _fill_pt(pt_t *pt, uintptr_t paddr, uintptr_t vaddr, uintptr_t vmax)
     for (uintptr_t idx = PTE(vaddr); idx < PT_ENTRY_COUNT && vaddr < vmax;
          idx++, paddr += PAGE_SIZE, vaddr += PAGE_SIZE)
     {
-        pt->phys[idx] = (uintptr_t)paddr | PT_PRESENT | PT_WRITE;
+        pt->phys[idx] = (uintptr_t)paddr | PT_PRESENT | PT_WRITE | PT_GLOBAL;
     }
 }
 
@@ -161,7 +293,8 @@ long _fill_pd(pd_t *pd, uintptr_t paddr, uintptr_t vaddr, uintptr_t vmax,
 #if USE_2MB_PAGES
         if (vmax - vaddr >= PT_VADDR_SIZE)
         {
-            pd->phys[idx] = paddr | PT_PRESENT | PT_WRITE | PT_SIZE;
+            pd->phys[idx] =
+                paddr | PT_PRESENT | PT_WRITE | PT_SIZE | PT_GLOBAL;
             continue;
         }
 #endif
@@ -190,7 +323,8 @@ long _fill_pdp(pdp_t *pdp, uintptr_t paddr, uintptr_t vaddr, uintptr_t vmax,
 #if USE_1GB_PAGES
         if (vmax - vaddr >= PD_VADDR_SIZE)
         {
-            pdp->phys[idx] = paddr | PT_PRESENT | PT_WRITE | PT_SIZE;
+            pdp->phys[idx] =
+                paddr | PT_PRESENT | PT_WRITE | PT_SIZE | PT_GLOBAL;
             continue;
         }
 #endif
@@ -264,12 +398,11 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
 
         if (!IS_PRESENT(table->phys[idx]))
         {
-            uintptr_t page = (uintptr_t)page_alloc();
+            uintptr_t page = (uintptr_t)page_alloc_zeroed();
             if (!page)
             {
                 return -ENOMEM;
             }
-            memset((void *)page, 0, PAGE_SIZE);
             KASSERT(pt_virt_to_phys(page) == page - PHYS_OFFSET);
             KASSERT(*(uintptr_t *)page == 0);
             table->phys[idx] = (page - PHYS_OFFSET) | pdflags;
@@ -287,7 +420,8 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
         if (!IS_PRESENT(table->phys[idx]))
         {
 #if USE_1GB_PAGES
-            if (PAGE_ALIGNED_1GB(vaddr) && size > PAGE_SIZE_1GB)
+            if (PAGE_ALIGNED_1GB(vaddr) && PAGE_ALIGNED_1GB(paddr) &&
+                size >= PAGE_SIZE_1GB)
             {
                 table->phys[idx] = (uintptr_t)paddr | ptflags | PT_SIZE;
                 paddr += PAGE_SIZE_1GB;
@@ -295,12 +429,11 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
                 continue;
             }
 #endif
-            uintptr_t page = (uintptr_t)page_alloc();
+            uintptr_t page = (uintptr_t)page_alloc_zeroed();
             if (!page)
             {
                 return -ENOMEM;
             }
-            memset((void *)page, 0, PAGE_SIZE);
             table->phys[idx] = (page - PHYS_OFFSET) | pdflags;
         }
         else if (IS_1GB_PAGE(table->phys[idx]))
@@ -338,7 +471,8 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
         if (!IS_PRESENT(table->phys[idx]))
         {
 #if USE_2MB_PAGES
-            if (PAGE_ALIGNED_2MB(vaddr) && size > PAGE_SIZE_2MB)
+            if (PAGE_ALIGNED_2MB(vaddr) && PAGE_ALIGNED_2MB(paddr) &&
+                size >= PAGE_SIZE_2MB)
             {
                 table->phys[idx] = (uintptr_t)paddr | ptflags | PT_SIZE;
                 paddr += PAGE_SIZE_2MB;
@@ -346,12 +480,11 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
                 continue;
             }
 #endif
-            uintptr_t page = (uintptr_t)page_alloc();
+            uintptr_t page = (uintptr_t)page_alloc_zeroed();
             if (!page)
             {
                 return -ENOMEM;
             }
-            memset((void *)page, 0, PAGE_SIZE);
             table->phys[idx] = (page - PHYS_OFFSET) | pdflags;
         }
         else if (IS_2MB_PAGE(table->phys[idx]))
@@ -396,6 +529,140 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
     return 0;
 }
 
+/*
+ * Walks pml4 down to the page table mapping vaddr a page at a time, and
+ * returns a pointer to vaddr's entry in it, present or not. If there is no
+ * such page table, returns NULL and sets *next (if given) to the first
+ * address past the hole. User memory is only ever mapped a page at a time, so
+ * a 1GB or 2MB page counts as a hole.
+ */
+static uintptr_t *pt_leaf(pml4_t *pml4, uintptr_t vaddr, uintptr_t *next)
+{
+    pml4_t *table = pml4;
+    uint64_t idx = PML4E(vaddr);
+    if (!IS_PRESENT(table->phys[idx]))
+    {
+        if (next)
+        {
+            *next = PAGE_ALIGN_UP_512GB(vaddr + 1);
+        }
+        return NULL;
+    }
+    table = (pdp_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    // PDP (1GB pages)
+    idx = PDPE(vaddr);
+    if (!IS_PRESENT(table->phys[idx]) || IS_1GB_PAGE(table->phys[idx]))
+    {
+        if (next)
+        {
+            *next = PAGE_ALIGN_UP_1GB(vaddr + 1);
+        }
+        return NULL;
+    }
+    table = (pd_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    // PD (2MB pages)
+    idx = PDE(vaddr);
+    if (!IS_PRESENT(table->phys[idx]) || IS_2MB_PAGE(table->phys[idx]))
+    {
+        if (next)
+        {
+            *next = PAGE_ALIGN_UP_2MB(vaddr + 1);
+        }
+        return NULL;
+    }
+    table = (pt_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    // PT (4KB pages)
+    return &table->phys[PTE(vaddr)];
+}
+
+long pt_copy_range(pml4_t *dst, pml4_t *src, uintptr_t vaddr, uintptr_t vmax,
+                   long cow)
+{
+    dbg(DBG_PGTBL, "virt[0x%p, 0x%p); pml4: 0x%p -> 0x%p%s\n", (void *)vaddr,
+        (void *)vmax, src, dst, cow ? " (copy-on-write)" : "");
+    KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(vmax) && vmax > vaddr);
+
+    while (vaddr < vmax)
+    {
+        uintptr_t *pte = pt_leaf(src, vaddr, &vaddr);
+        if (!pte)
+        {
+            continue;
+        }
+        uintptr_t end = MIN(vmax, PAGE_ALIGN_UP_2MB(vaddr + 1));
+        for (; vaddr < end; vaddr += PAGE_SIZE, pte++)
+        {
+            uintptr_t entry = *pte;
+            if (!IS_PRESENT(entry))
+            {
+                continue;
+            }
+            if (cow)
+            {
+                entry &= ~(uintptr_t)PT_WRITE;
+                *pte = entry;
+            }
+            long ret = pt_map(dst, entry & PAGE_MASK, vaddr,
+                              PT_PRESENT | PT_WRITE | PT_USER,
+                              entry & (PT_PRESENT | PT_WRITE | PT_USER));
+            if (ret)
+            {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+size_t pt_count_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
+{
+    KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(vmax) && vmax > vaddr);
+    size_t count = 0;
+    while (vaddr < vmax)
+    {
+        uintptr_t *pte = pt_leaf(pml4, vaddr, &vaddr);
+        if (!pte)
+        {
+            continue;
+        }
+        uintptr_t end = MIN(vmax, PAGE_ALIGN_UP_2MB(vaddr + 1));
+        for (; vaddr < end; vaddr += PAGE_SIZE, pte++)
+        {
+            count += IS_PRESENT(*pte) != 0;
+        }
+    }
+    return count;
+}
+
+#ifdef __VM__
+long pt_unmap_phys(pml4_t *pml4, uintptr_t vaddr, uintptr_t paddr)
+{
+    KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(paddr));
+    uintptr_t *pte = pt_leaf(pml4, vaddr, NULL);
+    if (!pte || !IS_PRESENT(*pte) || (*pte & PAGE_MASK) != paddr)
+    {
+        return 0;
+    }
+    *pte = 0;
+    return 1;
+}
+#endif
+
+uintptr_t pt_test_and_clear_dirty(pml4_t *pml4, uintptr_t vaddr)
+{
+    KASSERT(PAGE_ALIGNED(vaddr));
+    // the processor may be setting bits of the entry as we go
+    uintptr_t *pte = pt_leaf(pml4, vaddr, NULL);
+    if (!pte || !IS_PRESENT(*pte))
+    {
+        return 0;
+    }
+    return __sync_fetch_and_and(pte, ~(uintptr_t)PT_DIRTY);
+}
+
 static long _pt_fault_handler(regs_t *regs)
 {
     uintptr_t vaddr;
@@ -409,7 +676,7 @@ static long _pt_fault_handler(regs_t *regs)
     {
         handle_pagefault(vaddr, cause);
     }
-    else
+    else if (!user_copy_fault(regs, vaddr, cause))
     {
         dump_registers(regs);
         panic("\nKernel page fault at vaddr 0x%p\n", (void *)vaddr);
@@ -417,6 +684,8 @@ static long _pt_fault_handler(regs_t *regs)
     return 0;
 }
 
+#define CR0_WP 0x10000
+
 void pt_init()
 {
     static long inited = 0;
@@ -453,10 +722,45 @@ void pt_init()
         // identity map for pml4 make the MMU use the new pml4
         pt_set((pml4_t *)((uintptr_t)pml4 + PHYS_OFFSET));
         global_kernel_only_pml4 = (pml4_t *)((uintptr_t)pml4 + PHYS_OFFSET);
-        // pt_unmap_range(global_kernel_only_pml4, USER_MEM_LOW, USER_MEM_HIGH);
+
+        // every PDP of the upper half is shared by all page tables, which
+        // copy this one's entries (see clone_pml4()), so that kernel mappings
+        // made later, such as vmalloc()'s, show up in all of them; they are
+        // all allocated now, so that those entries never change
+        for (uintptr_t i = PT_ENTRY_COUNT / 2; i < PT_ENTRY_COUNT; i++)
+        {
+            if (global_kernel_only_pml4->phys[i])
+            {
+                continue;
+            }
+            uintptr_t pdp = (uintptr_t)page_alloc_zeroed();
+            if (!pdp)
+                panic("ran out of memory in pt_init");
+            global_kernel_only_pml4->phys[i] =
+                (pdp - PHYS_OFFSET) | PT_PRESENT | PT_WRITE;
+        }
+        // pt_unmap_range(global_kernel_only_pml4, USER_MEM_LOW, USER_MEM_HIGH, NULL);
         intr_register(INTR_PAGE_FAULT, _pt_fault_handler);
     }
     pt_set(global_kernel_only_pml4);
+
+    /* Have the kernel's writes honour read-only pages too, so that
+     * copy_to_user() faults on a copy-on-write page rather than writing to
+     * the shared copy. */
+    uintptr_t cr0;
+    __asm__ volatile("movq %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("movq %0, %%cr0" ::"r"(cr0 | CR0_WP));
+
+    /* The kernel's own mappings are global (PT_GLOBAL), so that switching
+     * page tables does not flush them. */
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+    if (edx & CPUID_FEAT_EDX_PGE)
+    {
+        uintptr_t cr4 = tlb_read_cr4() | CR4_PGE;
+        __asm__ volatile("movq %0, %%cr4" ::"r"(cr4)
+                         : "memory");
+    }
 }
 
 pt_t *clone_pt(pt_t *pt)
@@ -465,21 +769,20 @@ pt_t *clone_pt(pt_t *pt)
     dbg(DBG_PRINT, "cloning pt at 0x%p to 0x%p\n", pt, clone);
     if (clone)
     {
-        memcpy(clone, pt, PAGE_SIZE);
+        page_copy(clone, pt);
     }
     return clone;
 }
 
 pd_t *clone_pd(pd_t *pd)
 {
-    pd_t *clone = page_alloc();
+    /* zeroed, in case the clone fails: need to know what we have allocated */
+    pd_t *clone = page_alloc_zeroed();
     dbg(DBG_PRINT, "cloning pd at 0x%p to 0x%p\n", pd, clone);
     if (!clone)
     {
         return NULL;
     }
-    memset(clone, 0, PAGE_SIZE); // in case the clone fails, need to know what
-                                 // we have allocated
     for (unsigned i = 0; i < PT_ENTRY_COUNT; i++)
     {
         // dbg(DBG_PRINT, "checking pd i = %u\n", i);
@@ -509,14 +812,13 @@ pd_t *clone_pd(pd_t *pd)
 
 pdp_t *clone_pdp(pdp_t *pdp)
 {
-    pdp_t *clone = page_alloc();
+    /* zeroed, in case the clone fails: need to know what we have allocated */
+    pdp_t *clone = page_alloc_zeroed();
     dbg(DBG_PRINT, "cloning pdp at 0x%p to 0x%p\n", pdp, clone);
     if (!clone)
     {
         return NULL;
     }
-    memset(clone, 0, PAGE_SIZE); // in case the clone fails, need to know what
-                                 // we have allocated
     for (unsigned i = 0; i < PT_ENTRY_COUNT; i++)
     {
         // dbg(DBG_PRINT, "checking pdp i = %u\n", i);
@@ -546,16 +848,17 @@ pdp_t *clone_pdp(pdp_t *pdp)
 
 pml4_t *clone_pml4(pml4_t *pml4, long include_user_mappings)
 {
-    pml4_t *clone = page_alloc();
+    /* zeroed, in case the clone fails: need to know what we have allocated */
+    pml4_t *clone = page_alloc_zeroed();
     dbg(DBG_PRINT, "cloning pml4 at 0x%p to 0x%p\n", pml4, clone);
     if (!clone)
     {
         return NULL;
     }
-    memset(clone, 0, PAGE_SIZE); // in case the clone fails, need to know what
-                                 // we have allocated
-    for (uintptr_t i = include_user_mappings ? 0 : PT_ENTRY_COUNT / 2;
-         i < PT_ENTRY_COUNT; i++)
+    /* the upper half's PDPs are shared, see pt_init() */
+    memcpy(&clone->phys[PT_ENTRY_COUNT / 2], &pml4->phys[PT_ENTRY_COUNT / 2],
+           sizeof(uintptr_t) * PT_ENTRY_COUNT / 2);
+    for (uintptr_t i = 0; include_user_mappings && i < PT_ENTRY_COUNT / 2; i++)
     {
         // dbg(DBG_PRINT, "checking pml4 i = %u\n", i);
         if (pml4->phys[i])
@@ -580,37 +883,88 @@ pml4_t *clone_pml4(pml4_t *pml4, long include_user_mappings)
 
 pml4_t *pt_create() { return clone_pml4(pt_get(), 0); }
 
-void pt_destroy_helper(pt_t *pt, long depth)
+static void pt_destroy_helper(pt_t *pt, long depth, page_batch_t *batch)
 {
     // 4 = pml4, 3 = pdp, 2 = pd, 1 = pt
     if (depth != 1)
     {
         for (uintptr_t i = 0; i < PT_ENTRY_COUNT; i++)
         {
-            if (!pt->phys[i] || (PT_SIZE & pt->phys[i]))
+            if (!pt->phys[i] || (PT_SIZE & pt->phys[i]) ||
+                (depth == 4 && i >= PT_ENTRY_COUNT / 2))
             {
                 continue;
             }
             KASSERT(IS_PRESENT(pt->phys[i]) && (pt->phys[i] & PAGE_MASK));
             pt_destroy_helper((pt_t *)((pt->phys[i] & PAGE_MASK) + PHYS_OFFSET),
-                              depth - 1);
+                              depth - 1, batch);
             pt->phys[i] = 0;
         }
     }
-    page_free(pt);
+    page_batch_add(batch, pt);
 }
 
-void pt_destroy(pml4_t *pml4) { pt_destroy_helper(pml4, 4); }
+void pt_destroy(pml4_t *pml4)
+{
+    KASSERT(pml4 != pt_get());
+    /* a page table allocated at the same address later must not find this
+     * one's TLB entries */
+    pt_pcid_forget(pt_virt_to_phys((uintptr_t)pml4));
+    page_batch_t batch = PAGE_BATCH_INITIALIZER;
+    pt_destroy_helper(pml4, 4, &batch);
+    page_batch_flush(&batch);
+}
 
 void pt_unmap(pml4_t *pml4, uintptr_t vaddr)
 {
-    pt_unmap_range(pml4, vaddr, vaddr + PAGE_SIZE);
+    pt_unmap_range(pml4, vaddr, vaddr + PAGE_SIZE, NULL);
 }
 
-void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
+/*
+ * Takes the tables below table (at depth, as in pt_destroy_helper()) that
+ * [vaddr, vmax) touches and that are now empty out of it, adding them to
+ * reclaim. The batch chains them through their first entry, and a page-aligned
+ * kernel address is not present, so a core walking a table through a stale
+ * cached entry finds nothing there. Returns 1 if table itself is now empty.
+ */
+static long _pt_reclaim(pt_t *table, long depth, uintptr_t vaddr,
+                        uintptr_t vmax, page_batch_t *reclaim)
 {
-    // TODO reclaim pages on-the-fly?
+    if (depth > 1)
+    {
+        long shift = PAGE_SHIFT + 9 * (depth - 1);
+        uintptr_t entry_size = 1UL << shift;
+        while (vaddr < vmax)
+        {
+            uintptr_t next = (vaddr & ~(entry_size - 1)) + entry_size;
+            uintptr_t i = (vaddr >> shift) & INDEX_MASK;
+            uintptr_t entry = table->phys[i];
+            if (IS_PRESENT(entry) && !(entry & PT_SIZE))
+            {
+                pt_t *child = (pt_t *)((entry & PAGE_MASK) + PHYS_OFFSET);
+                if (_pt_reclaim(child, depth - 1, vaddr, MIN(next, vmax),
+                                reclaim))
+                {
+                    table->phys[i] = 0;
+                    page_batch_add(reclaim, child);
+                }
+            }
+            vaddr = next;
+        }
+    }
+    for (uintptr_t i = 0; i < PT_ENTRY_COUNT; i++)
+    {
+        if (table->phys[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
 
+void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax,
+                    page_batch_t *reclaim)
+{
     dbg(DBG_PGTBL, "virt[0x%p, 0x%p); pml4: 0x%p\n", (void *)vaddr,
         (void *)vmax, pml4);
     KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(vmax) && vmax > vaddr);
@@ -739,6 +1093,14 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
         vaddr += PAGE_SIZE;
     }
     KASSERT(_vaddr_status(pml4, vaddr_start) == UNMAPPED);
+
+    if (reclaim)
+    {
+        /* the upper half's PDPs are shared by every page table (see
+         * pt_init()), so only the user half's tables are ever reclaimed */
+        KASSERT(vmax <= USER_MEM_HIGH);
+        _pt_reclaim(pml4, 4, vaddr_start, vmax, reclaim);
+    }
 }
 
 static char *entry_strings[] = {
@@ -1,5 +1,8 @@
 #include "globals.h"
 
+#include "main/interrupt.h"
+
+#include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/slab.h"
 
@@ -8,10 +11,117 @@
 
 static slab_allocator_t *pframe_allocator;
 
+/* Threads waiting for any asynchronous fill; fills are rare enough to share */
+static ktqueue_t pframe_fill_waitq;
+static spinlock_t pframe_fill_lock = SPINLOCK_INITIALIZER(pframe_fill_lock);
+
+/*
+ * Threads waiting for a pframe's lock sleep on the wait queue its address
+ * hashes to, and its lock is handed over under that queue's spinlock. Since
+ * a queue is shared, unlocking a pframe with waiters wakes all of the queue's
+ * threads, and those waiting for another pframe go back to sleep.
+ */
+#define PFRAME_LOCK_QUEUES 64
+
+static struct pframe_lock_queue
+{
+    ktqueue_t plq_waitq;
+    spinlock_t plq_lock;
+} pframe_lock_queues[PFRAME_LOCK_QUEUES];
+
+#define PFRAME_LOCK_QUEUE(pf) \
+    (&pframe_lock_queues[((uintptr_t)(pf) / sizeof(pframe_t)) % \
+                         PFRAME_LOCK_QUEUES])
+
+/*
+ * Page descriptors: for every physical frame, the pframe whose contents it
+ * holds, if any, indexed by frame number.
+ */
+static pframe_t **pframe_descs;
+static size_t pframe_ndescs;
+
 void pframe_init()
 {
     pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
     KASSERT(pframe_allocator);
+    sched_queue_init(&pframe_fill_waitq);
+    for (size_t i = 0; i < PFRAME_LOCK_QUEUES; i++)
+    {
+        sched_queue_init(&pframe_lock_queues[i].plq_waitq);
+        spinlock_init(&pframe_lock_queues[i].plq_lock);
+    }
+
+    pframe_ndescs =
+        ((uintptr_t)physmap_end() - (uintptr_t)physmap_start()) >> PAGE_SHIFT;
+    size_t npages =
+        ADDR_TO_PN(PAGE_ALIGN_UP(pframe_ndescs * sizeof(pframe_t *)));
+    pframe_descs = page_alloc_n(npages);
+    KASSERT(pframe_descs && "not enough memory for the page descriptors");
+    memset(pframe_descs, 0, npages << PAGE_SHIFT);
+}
+
+void pframe_lock(pframe_t *pf)
+{
+    struct pframe_lock_queue *q = PFRAME_LOCK_QUEUE(pf);
+    spinlock_lock(&q->plq_lock);
+    KASSERT(pf->pf_holder != curthr && "pframe already locked by this thread");
+    while (pf->pf_holder)
+    {
+        pf->pf_waiters = 1;
+        sched_sleep_on(&q->plq_waitq, &q->plq_lock);
+        spinlock_lock(&q->plq_lock);
+    }
+    pf->pf_holder = curthr;
+    spinlock_unlock(&q->plq_lock);
+}
+
+void pframe_unlock(pframe_t *pf)
+{
+    struct pframe_lock_queue *q = PFRAME_LOCK_QUEUE(pf);
+    spinlock_lock(&q->plq_lock);
+    KASSERT(pf->pf_holder == curthr);
+    pf->pf_holder = NULL;
+    if (pf->pf_waiters)
+    {
+        pf->pf_waiters = 0;
+        sched_broadcast_on(&q->plq_waitq);
+    }
+    spinlock_unlock(&q->plq_lock);
+}
+
+long pframe_owned(pframe_t *pf) { return pf->pf_holder == curthr; }
+
+void pframe_share(pframe_t *pf)
+{
+    KASSERT(pframe_owned(pf) && pf->pf_addr && !pf->pf_filling);
+    __sync_add_and_fetch(&pf->pf_refs, 1);
+    pframe_unlock(pf);
+}
+
+void pframe_put(pframe_t **pfp)
+{
+    pframe_t *pf = *pfp;
+    *pfp = NULL;
+    long refs = __sync_sub_and_fetch(&pf->pf_refs, 1);
+    KASSERT(refs >= 0);
+}
+
+void pframe_set_page(pframe_t *pf, void *addr)
+{
+    KASSERT(pframe_owned(pf));
+    void *old = addr ? addr : pf->pf_addr;
+    size_t pfn = ((uintptr_t)old - (uintptr_t)physmap_start()) >> PAGE_SHIFT;
+    KASSERT(PAGE_ALIGNED(old) && pfn < pframe_ndescs);
+    KASSERT(pframe_descs[pfn] == (addr ? NULL : pf));
+    pframe_descs[pfn] = addr ? pf : NULL;
+    pf->pf_addr = addr;
+}
+
+pframe_t *pframe_of_page(void *addr)
+{
+    size_t pfn = ((uintptr_t)addr - (uintptr_t)physmap_start()) >> PAGE_SHIFT;
+    KASSERT(PAGE_ALIGNED(addr) && pfn < pframe_ndescs);
+    return pframe_descs[pfn];
 }
 
 /*
@@ -25,24 +135,27 @@ pframe_t *pframe_create()
         return NULL;
     }
     memset(pf, 0, sizeof(pframe_t));
-    kmutex_init(&pf->pf_mutex);
     list_link_init(&pf->pf_link);
+    list_link_init(&pf->pf_dirty_link);
+    list_link_init(&pf->pf_lru_link);
     return pf;
 }
 
 /*
- * Free the pframe (don't forget to unlock the mutex) and set *pfp = NULL
+ * Free the pframe (don't forget to unlock it) and set *pfp = NULL
  *
  * The pframe must be locked, its contents not in memory (pf->pf_addr == NULL),
  * have a pincount of 0, and not be linked into a memory object's list.
  */
 void pframe_free(pframe_t **pfp)
 {
-    KASSERT(kmutex_owns_mutex(&(*pfp)->pf_mutex));
+    KASSERT(pframe_owned((*pfp)));
     KASSERT(!(*pfp)->pf_addr);
-    KASSERT(!(*pfp)->pf_dirty);
+    KASSERT(!(*pfp)->pf_dirty && !(*pfp)->pf_refs);
     KASSERT(!list_link_is_linked(&(*pfp)->pf_link));
-    kmutex_unlock(&(*pfp)->pf_mutex);
+    KASSERT(!list_link_is_linked(&(*pfp)->pf_dirty_link));
+    KASSERT(!list_link_is_linked(&(*pfp)->pf_lru_link));
+    pframe_unlock((*pfp));
     slab_obj_free(pframe_allocator, *pfp);
     *pfp = NULL;
 }
@@ -53,7 +166,51 @@ void pframe_free(pframe_t **pfp)
 void pframe_release(pframe_t **pfp)
 {
     pframe_t *pf = *pfp;
-    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(pframe_owned(pf));
     *pfp = NULL;
-    kmutex_unlock(&pf->pf_mutex);
+    pframe_unlock(pf);
+}
+
+/*
+ * Mark a locked pframe, whose page is allocated, as having a fill in flight.
+ */
+void pframe_fill_start(pframe_t *pf)
+{
+    KASSERT(pframe_owned(pf));
+    KASSERT(pf->pf_addr && !pf->pf_filling && !pf->pf_dirty);
+    pf->pf_filling = 1;
+    pf->pf_fill_error = 0;
+}
+
+/*
+ * Finish an asynchronous fill and wake up anyone waiting for it.
+ */
+void pframe_fill_done(pframe_t *pf, long error)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&pframe_fill_lock);
+    KASSERT(pf->pf_filling);
+    pf->pf_fill_error = error;
+    pf->pf_filling = 0;
+    spinlock_unlock(&pframe_fill_lock);
+    sched_broadcast_on(&pframe_fill_waitq);
+    intr_setipl(ipl);
+}
+
+/*
+ * Sleep until the pframe has no fill in flight.
+ */
+long pframe_wait_fill(pframe_t *pf)
+{
+    KASSERT(pframe_owned(pf));
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&pframe_fill_lock);
+    while (pf->pf_filling)
+    {
+        sched_sleep_on(&pframe_fill_waitq, &pframe_fill_lock);
+        spinlock_lock(&pframe_fill_lock);
+    }
+    spinlock_unlock(&pframe_fill_lock);
+    intr_setipl(ipl);
+    return pf->pf_fill_error;
 }
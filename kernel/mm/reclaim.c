@@ -0,0 +1,568 @@
+#include "config.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "drivers/writeback.h"
+
+#include "errno.h"
+
+#include "main/interrupt.h"
+
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/reclaim.h"
+#include "mm/slab.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+
+#include "vm/swap.h"
+#include "vm/vmmap.h"
+
+static list_t reclaim_active = LIST_INITIALIZER(reclaim_active);
+static list_t reclaim_inactive = LIST_INITIALIZER(reclaim_inactive);
+static size_t reclaim_nactive;
+static size_t reclaim_ninactive;
+
+/* Protects all of the above, and every pframe's pf_lru_link and pf_active */
+static spinlock_t reclaim_lru_lock = SPINLOCK_INITIALIZER(reclaim_lru_lock);
+
+static kthread_t *reclaim_thread;
+static ktqueue_t reclaim_waitq;      /* the reclaim thread, between runs */
+static ktqueue_t reclaim_stop_waitq; /* reclaim_stop(), for the thread */
+
+/* Protects the flags below */
+static spinlock_t reclaim_lock = SPINLOCK_INITIALIZER(reclaim_lock);
+static long reclaim_kicked;
+static long reclaim_stopping;
+static long reclaim_running;
+
+/* Set by page allocation failures, cleared by the reclaim thread */
+static long reclaim_failed;
+
+/* The largest multi-page allocation that has failed since the reclaim thread
+ * last compacted memory */
+static size_t reclaim_compact_npages;
+
+/* The last process killed for memory, which is left to exit before another
+ * is chosen */
+static pid_t reclaim_oom_victim;
+
+/* Statistics */
+static size_t reclaim_nscanned;
+static size_t reclaim_nevicted;
+static size_t reclaim_nwritten;  /* dirty pages written back to be evicted */
+static size_t reclaim_npromoted; /* pages moved to the active list */
+static size_t reclaim_ndemoted;  /* pages moved back to the inactive list */
+static size_t reclaim_nfailures; /* page allocations that failed */
+static size_t reclaim_nslab_runs;
+static size_t reclaim_nslab_pages; /* pages given back by the slab caches */
+static size_t reclaim_noom_kills;
+static size_t reclaim_noom_pages;  /* resident pages of the processes killed */
+static size_t reclaim_ncompact_runs;
+static size_t reclaim_ncompact_blocks;
+static size_t reclaim_nmigrated;
+
+static long reclaim_evictable(mobj_t *o)
+{
+    if (o->mo_type == MOBJ_ANON || o->mo_type == MOBJ_SHADOW)
+    {
+        return swap_enabled();
+    }
+    return o->mo_type == MOBJ_VNODE || o->mo_type == MOBJ_BLOCKDEV;
+}
+
+void reclaim_lru_add(pframe_t *pf)
+{
+    KASSERT(pframe_owned(pf) && pf->pf_addr && pf->pf_obj);
+    if (!reclaim_evictable(pf->pf_obj))
+    {
+        return;
+    }
+    spinlock_lock(&reclaim_lru_lock);
+    KASSERT(!list_link_is_linked(&pf->pf_lru_link));
+    pf->pf_active = 0;
+    pf->pf_referenced = 0;
+    list_insert_head(&reclaim_inactive, &pf->pf_lru_link);
+    reclaim_ninactive++;
+    spinlock_unlock(&reclaim_lru_lock);
+}
+
+/*
+ * Unlink a pframe from whichever list it is on. reclaim_lru_lock must be held.
+ */
+static void reclaim_lru_unlink(pframe_t *pf)
+{
+    list_remove(&pf->pf_lru_link);
+    if (pf->pf_active)
+    {
+        reclaim_nactive--;
+    }
+    else
+    {
+        reclaim_ninactive--;
+    }
+}
+
+void reclaim_lru_remove(pframe_t *pf)
+{
+    KASSERT(pframe_owned(pf));
+    spinlock_lock(&reclaim_lru_lock);
+    if (list_link_is_linked(&pf->pf_lru_link))
+    {
+        reclaim_lru_unlink(pf);
+    }
+    spinlock_unlock(&reclaim_lru_lock);
+}
+
+/*
+ * Move a pframe to the head of the active or inactive list.
+ * reclaim_lru_lock must be held.
+ */
+static void reclaim_lru_move(pframe_t *pf, long active)
+{
+    reclaim_lru_unlink(pf);
+    pf->pf_active = active;
+    if (active)
+    {
+        list_insert_head(&reclaim_active, &pf->pf_lru_link);
+        reclaim_nactive++;
+    }
+    else
+    {
+        list_insert_head(&reclaim_inactive, &pf->pf_lru_link);
+        reclaim_ninactive++;
+    }
+}
+
+/*
+ * Keep the active list no larger than the inactive one, so that pages used
+ * more than once cannot crowd out everything else: demote the least recently
+ * promoted active page, or give it another round if it has been used since.
+ * reclaim_lru_lock must be held.
+ */
+static void reclaim_balance()
+{
+    if (reclaim_nactive <= reclaim_ninactive)
+    {
+        return;
+    }
+    pframe_t *pf = list_tail(&reclaim_active, pframe_t, pf_lru_link);
+    long referenced = pf->pf_referenced;
+    pf->pf_referenced = 0;
+    reclaim_lru_move(pf, referenced);
+    if (!referenced)
+    {
+        reclaim_ndemoted++;
+    }
+}
+
+/*
+ * Try to evict the pframe at the tail of the inactive list. Returns 1 if its
+ * page was freed, 0 if it was moved elsewhere on the lists instead.
+ *
+ * The pframe's mobj and the pframe itself are only locked if no one holds
+ * them, since their holders may well be waiting on us (e.g. a thread
+ * allocating a page in mobj_default_get_pframe()); there is no preemption, so
+ * the locks are then taken without blocking. reclaim_lru_lock must be held;
+ * it is dropped and retaken if the page is evicted.
+ */
+static long reclaim_evict_tail(long write_dirty)
+{
+    pframe_t *pf = list_tail(&reclaim_inactive, pframe_t, pf_lru_link);
+    mobj_t *o = pf->pf_obj;
+    reclaim_nscanned++;
+
+    if (pf->pf_referenced)
+    {
+        pf->pf_referenced = 0;
+        reclaim_lru_move(pf, 1);
+        reclaim_npromoted++;
+        return 0;
+    }
+    /* a mobj with no references is being destroyed, and will free the
+     * pframe itself; pinned pages wait for their journal commit */
+    if (o->mo_mutex.km_holder || pframe_locked(pf) || pf->pf_filling ||
+        pf->pf_pinned || pf->pf_refs || !o->mo_refcount)
+    {
+        reclaim_lru_move(pf, 0);
+        return 0;
+    }
+    /* Dirty file pages may have no block yet, and flushing them would mean
+     * allocating one, which needs the pages we are trying to free; leave them
+     * to the writeback thread. */
+    if (pf->pf_dirty && (!write_dirty || o->mo_type == MOBJ_VNODE))
+    {
+        reclaim_lru_move(pf, 0);
+        writeback_kick();
+        return 0;
+    }
+
+    kmutex_lock(&o->mo_mutex);
+    pframe_lock(pf);
+    reclaim_lru_unlink(pf);
+    spinlock_unlock(&reclaim_lru_lock);
+
+    /* a page must be mapped nowhere before it is written out and freed */
+    long ret = vmmap_unmap_pframe(o, pf);
+    long dirty = pf->pf_dirty;
+    if (!ret)
+    {
+        ret = mobj_free_pframe(o, &pf);
+    }
+    if (ret)
+    {
+        dbg(DBG_MM, "reclaim: evicting pframe 0x%p (mobj 0x%p) failed: "
+                    "%ld\n",
+            pf, o, ret);
+        reclaim_lru_add(pf);
+        pframe_release(&pf);
+    }
+    mobj_unlock(o);
+
+    spinlock_lock(&reclaim_lru_lock);
+    if (ret)
+    {
+        return 0;
+    }
+    reclaim_nevicted++;
+    reclaim_nwritten += dirty;
+    return 1;
+}
+
+long reclaim_migrate_page(void *page)
+{
+    spinlock_lock(&reclaim_lru_lock);
+    /* a pframe leaves the lists before it gives up its page, so one that is
+     * on them still holding this page is not going anywhere */
+    pframe_t *pf = pframe_of_page(page);
+    if (!pf || !list_link_is_linked(&pf->pf_lru_link) || pf->pf_addr != page)
+    {
+        spinlock_unlock(&reclaim_lru_lock);
+        return -EBUSY;
+    }
+    /* as in reclaim_evict_tail() */
+    mobj_t *o = pf->pf_obj;
+    if (o->mo_mutex.km_holder || pframe_locked(pf) || pf->pf_filling ||
+        pf->pf_pinned || pf->pf_refs || !o->mo_refcount)
+    {
+        spinlock_unlock(&reclaim_lru_lock);
+        return -EBUSY;
+    }
+    kmutex_lock(&o->mo_mutex);
+    pframe_lock(pf);
+    spinlock_unlock(&reclaim_lru_lock);
+
+    /* no one can write to the page once it is mapped nowhere */
+    long ret = vmmap_unmap_pframe(o, pf);
+    void *new = NULL;
+    if (!ret && !(new = page_alloc_movable()))
+    {
+        ret = -ENOMEM;
+    }
+    if (!ret)
+    {
+        page_copy(new, page);
+        pframe_set_page(pf, NULL);
+        pframe_set_page(pf, new);
+        __sync_add_and_fetch(&reclaim_nmigrated, 1);
+    }
+    pframe_release(&pf);
+    mobj_unlock(o);
+    return ret;
+}
+
+size_t reclaim_pages(size_t target)
+{
+    size_t freed = 0;
+    spinlock_lock(&reclaim_lru_lock);
+    /* first only clean pages, then dirty ones too if that wasn't enough */
+    for (long write_dirty = 0; write_dirty < 2 && freed < target;
+         write_dirty++)
+    {
+        /* look at each page about once (promoted pages may come back round
+         * once through reclaim_balance()) */
+        size_t nscan = reclaim_nactive + reclaim_ninactive;
+        while (freed < target && nscan--)
+        {
+            reclaim_balance();
+            if (list_empty(&reclaim_inactive))
+            {
+                break;
+            }
+            freed += reclaim_evict_tail(write_dirty);
+        }
+    }
+    spinlock_unlock(&reclaim_lru_lock);
+    if (freed)
+    {
+        dbg(DBG_MM, "reclaim: freed %lu pages, %lu free\n", freed,
+            page_free_count());
+    }
+    return freed;
+}
+
+/*
+ * Bring the pages of group id to the tail of the inactive list, in the order
+ * they are in, so that reclaim_evict_tail() gets to them first; the active
+ * ones not used since the last scan are demoted first, as reclaim_balance()
+ * would once it got to them. reclaim_lru_lock must be held.
+ */
+static void reclaim_group_gather(long id)
+{
+    list_iterate_reverse(&reclaim_active, pf, pframe_t, pf_lru_link)
+    {
+        if (pf->pf_group != id)
+        {
+            continue;
+        }
+        long referenced = pf->pf_referenced;
+        pf->pf_referenced = 0;
+        if (!referenced)
+        {
+            reclaim_lru_move(pf, 0);
+            reclaim_ndemoted++;
+        }
+    }
+    list_t group = LIST_INITIALIZER(group);
+    list_iterate_reverse(&reclaim_inactive, pf, pframe_t, pf_lru_link)
+    {
+        if (pf->pf_group == id)
+        {
+            list_remove(&pf->pf_lru_link);
+            list_insert_head(&group, &pf->pf_lru_link);
+        }
+    }
+    /* the least recently used, at the tail of group, goes in last */
+    while (!list_empty(&group))
+    {
+        pframe_t *pf = list_head(&group, pframe_t, pf_lru_link);
+        list_remove(&pf->pf_lru_link);
+        list_insert_tail(&reclaim_inactive, &pf->pf_lru_link);
+    }
+}
+
+size_t reclaim_group_pages(long id, size_t target)
+{
+    size_t freed = 0;
+    spinlock_lock(&reclaim_lru_lock);
+    for (long write_dirty = 0; write_dirty < 2 && freed < target;
+         write_dirty++)
+    {
+        reclaim_group_gather(id);
+        /* pages that are not evicted go to the head of a list, so this stops
+         * once the group's have each been looked at */
+        while (freed < target && !list_empty(&reclaim_inactive) &&
+               (list_tail(&reclaim_inactive, pframe_t, pf_lru_link))
+                       ->pf_group == id)
+        {
+            freed += reclaim_evict_tail(write_dirty);
+        }
+    }
+    spinlock_unlock(&reclaim_lru_lock);
+    if (freed)
+    {
+        dbg(DBG_MM, "reclaim: freed %lu pages of memory group %ld\n", freed,
+            id);
+    }
+    return freed;
+}
+
+void reclaim_kick()
+{
+    if (!reclaim_thread || reclaim_kicked)
+    {
+        return;
+    }
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&reclaim_lock);
+    reclaim_kicked = 1;
+    spinlock_unlock(&reclaim_lock);
+    sched_wakeup_on(&reclaim_waitq, NULL);
+    intr_setipl(ipl);
+}
+
+void reclaim_alloc_failed()
+{
+    __sync_add_and_fetch(&reclaim_nfailures, 1);
+    reclaim_failed = 1;
+    reclaim_kick();
+}
+
+void reclaim_compact_kick(size_t npages)
+{
+    size_t old = reclaim_compact_npages;
+    while (old < npages &&
+           !__sync_bool_compare_and_swap(&reclaim_compact_npages, old, npages))
+    {
+        old = reclaim_compact_npages;
+    }
+    reclaim_kick();
+}
+
+long reclaim_compact(size_t npages)
+{
+    __sync_add_and_fetch(&reclaim_ncompact_runs, 1);
+    long ret = page_compact(npages);
+    if (ret)
+    {
+        __sync_add_and_fetch(&reclaim_ncompact_blocks, 1);
+    }
+    return ret;
+}
+
+/*
+ * Kill the process with the most resident pages, unless the last one killed
+ * has yet to exit.
+ */
+static void reclaim_oom_kill()
+{
+    proc_t *last = reclaim_oom_victim ? proc_lookup(reclaim_oom_victim) : NULL;
+    if (last && last->p_state != PROC_DEAD)
+    {
+        return;
+    }
+    size_t rss;
+    pid_t pid = proc_oom_kill(&rss);
+    if (!pid)
+    {
+        dbg(DBG_MM, "reclaim: out of memory, and no process to kill\n");
+        return;
+    }
+    reclaim_oom_victim = pid;
+    reclaim_noom_kills++;
+    reclaim_noom_pages += rss;
+    dbg(DBG_MM, "reclaim: out of memory, killed pid %d (%lu pages)\n", pid,
+        rss);
+}
+
+/*
+ * Free memory in stages, each only if the ones before did not free enough:
+ * evict from the page cache, shrink the slab caches and, if an allocation
+ * has failed in the meantime, kill a process. Then, if a multi-page
+ * allocation has failed, make a free block for it.
+ */
+static void reclaim_pressure()
+{
+    while (page_free_count() < RECLAIM_HIGH_PAGES &&
+           reclaim_pages(RECLAIM_BATCH))
+        ;
+
+    size_t nfree = page_free_count();
+    if (nfree < RECLAIM_HIGH_PAGES)
+    {
+        reclaim_nslab_runs++;
+        reclaim_nslab_pages +=
+            slab_allocators_reclaim((long)(RECLAIM_HIGH_PAGES - nfree));
+    }
+
+    long failed = __sync_lock_test_and_set(&reclaim_failed, 0);
+#if RECLAIM_OOM_KILL
+    if (failed && page_free_count() < RECLAIM_OOM_PAGES)
+    {
+        reclaim_oom_kill();
+    }
+#else
+    (void)failed;
+#endif
+
+    size_t npages = __sync_lock_test_and_set(&reclaim_compact_npages, 0);
+    if (npages)
+    {
+        reclaim_compact(npages);
+    }
+}
+
+void reclaim_stats_get(reclaim_stats_t *stats)
+{
+    stats->rs_free = page_free_count();
+    stats->rs_active = reclaim_nactive;
+    stats->rs_inactive = reclaim_ninactive;
+    stats->rs_scanned = reclaim_nscanned;
+    stats->rs_evicted = reclaim_nevicted;
+    stats->rs_written = reclaim_nwritten;
+    stats->rs_failures = reclaim_nfailures;
+    stats->rs_slab_runs = reclaim_nslab_runs;
+    stats->rs_slab_pages = reclaim_nslab_pages;
+    stats->rs_oom_kills = reclaim_noom_kills;
+    stats->rs_oom_pages = reclaim_noom_pages;
+    stats->rs_compact_runs = reclaim_ncompact_runs;
+    stats->rs_compact_blocks = reclaim_ncompact_blocks;
+    stats->rs_migrated = reclaim_nmigrated;
+}
+
+static void *reclaim_run(long arg1, void *arg2)
+{
+    while (1)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&reclaim_lock);
+        while (!reclaim_kicked && !reclaim_stopping)
+        {
+            sched_sleep_on(&reclaim_waitq, &reclaim_lock);
+            spinlock_lock(&reclaim_lock);
+        }
+        long stopping = reclaim_stopping;
+        spinlock_unlock(&reclaim_lock);
+        intr_setipl(ipl);
+        if (stopping)
+        {
+            break;
+        }
+
+        reclaim_pressure();
+
+        /* clear the flag only now, so that allocations made while we were
+         * reclaiming don't wake us again for nothing */
+        reclaim_kicked = 0;
+    }
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&reclaim_lock);
+    reclaim_running = 0;
+    spinlock_unlock(&reclaim_lock);
+    sched_broadcast_on(&reclaim_stop_waitq);
+    intr_setipl(ipl);
+    return NULL;
+}
+
+void reclaim_start()
+{
+    sched_queue_init(&reclaim_waitq);
+    sched_queue_init(&reclaim_stop_waitq);
+
+    proc_t *proc = proc_create("reclaim");
+    KASSERT(proc);
+    kthread_t *thr = kthread_create(proc, reclaim_run, 0, NULL);
+    KASSERT(thr);
+    reclaim_running = 1;
+    reclaim_thread = thr;
+    sched_make_runnable(thr);
+}
+
+void reclaim_stop()
+{
+    if (!reclaim_thread)
+    {
+        return;
+    }
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&reclaim_lock);
+    reclaim_stopping = 1;
+    sched_wakeup_on(&reclaim_waitq, NULL);
+    while (reclaim_running)
+    {
+        sched_sleep_on(&reclaim_stop_waitq, &reclaim_lock);
+        spinlock_lock(&reclaim_lock);
+    }
+    spinlock_unlock(&reclaim_lock);
+    intr_setipl(ipl);
+    reclaim_thread = NULL;
+}
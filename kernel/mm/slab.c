@@ -15,8 +15,13 @@
  * darmanio: ^ lol, look at me now :D
  */
 
+#include "globals.h"
 #include "types.h"
 
+#include "main/apic.h"
+#include "main/interrupt.h"
+
+#include "mm/kmalloc.h"
 #include "mm/mm.h"
 #include "mm/page.h"
 #include "mm/slab.h"
@@ -25,6 +30,8 @@
 
 #include "util/debug.h"
 #include "util/gdb.h"
+#include "util/list.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 #ifdef SLAB_REDZONE
@@ -54,6 +61,40 @@ struct slab
     void *s_addr;        /* start address */
 };
 
+/*
+ * Per-core magazines (Bonwick & Adams, "Magazines and Vmem").
+ *
+ * Each core keeps two magazines per allocator: stacks of up to
+ * SLAB_MAGAZINE_ROUNDS free objects which it allocates from and frees into
+ * without taking sa_lock. When both are exhausted (on alloc) or full (on free),
+ * the core trades a magazine with the allocator's depot, which holds full and
+ * empty magazines under sa_lock. Only when the depot can't help does the
+ * request fall through to the slab lists.
+ *
+ * Objects larger than SLAB_MAGAZINE_MAX_OBJSIZE are not cached, so that big
+ * kmalloc buckets don't pin memory in magazines.
+ */
+#define SLAB_MAGAZINE_ROUNDS 14
+#define SLAB_MAGAZINE_MAX_OBJSIZE PAGE_SIZE
+#define SLAB_DEPOT_MAX_FULL 8 /* full magazines kept per allocator */
+
+typedef struct slab_magazine
+{
+    struct slab_magazine *sm_next; /* link on depot list */
+    size_t sm_rounds;              /* number of objects held */
+    void *sm_objs[SLAB_MAGAZINE_ROUNDS];
+} slab_magazine_t;
+
+typedef struct slab_cpu_cache
+{
+    slab_magazine_t *cc_loaded;   /* magazine allocated from / freed into */
+    slab_magazine_t *cc_previous; /* full or empty, swapped with cc_loaded */
+    size_t cc_alloc_hits;         /* allocs served by a magazine */
+    size_t cc_alloc_misses;       /* allocs that fell through to the slabs */
+    size_t cc_free_hits;
+    size_t cc_free_misses;
+} slab_cpu_cache_t;
+
 typedef struct slab_allocator
 {
     const char *sa_name;            /* user-provided name */
@@ -63,6 +104,19 @@ typedef struct slab_allocator
     size_t sa_slab_nobjs;           /* number of objs per slab */
     struct slab_allocator *sa_next; /* link on global list of allocators */
     spinlock_t sa_lock;
+
+    uint8_t sa_kmalloc_class;       /* 1 + index of its kmalloc size class,
+                                       or 0 if it is not one */
+
+    size_t sa_offset;    /* offset of the first object before coloring */
+    size_t sa_color;     /* color (extra offset) of the next slab */
+    size_t sa_color_max; /* largest color the slab's waste leaves room for */
+
+    long sa_use_magazines;          /* whether sa_cpu/depot are in use */
+    slab_magazine_t *sa_depot_full; /* depot; protected by sa_lock */
+    slab_magazine_t *sa_depot_empty;
+    size_t sa_depot_nfull;
+    slab_cpu_cache_t sa_cpu[MAX_LAPICS]; /* indexed by core id */
 } slab_allocator_t;
 
 /* Stored at the end of every object to keep track of the 
@@ -98,9 +152,39 @@ GDB_DEFINE_HOOK(slab_obj_free, void *addr, slab_allocator_t *allocator)
 /* Head of global list of slab allocators. This is used in the python gdb script */
 static slab_allocator_t *slab_allocators = NULL;
 
+/* Protects slab_allocators. Taken before any allocator's sa_lock. */
+static spinlock_t slab_allocators_lock =
+    SPINLOCK_INITIALIZER(slab_allocators_lock);
+
+/* Registered shrinkers. Shrinkers are only ever added, at initialization, so
+ * the list is walked without the lock. */
+static list_t slab_shrinkers = LIST_INITIALIZER(slab_shrinkers);
+static spinlock_t slab_shrinkers_lock =
+    SPINLOCK_INITIALIZER(slab_shrinkers_lock);
+
 /* Special case - allocator for allocation of slab_allocator objects. */
 static slab_allocator_t slab_allocator_allocator;
 
+/* Special case - allocator for magazines; never uses magazines itself. */
+static slab_allocator_t slab_magazine_allocator;
+
+/* For each physical page, the sa_kmalloc_class of the allocator whose slab
+ * the page is part of, so that kfree() can find the allocator of an object
+ * without a header in front of it. Pages of other slabs, and non-slab pages,
+ * are 0. Entries go back to 0 when slab_allocators_reclaim() frees a slab. */
+static uint8_t *slab_page_classes;
+
+#define slab_page_class(addr) \
+    slab_page_classes[ADDR_TO_PN((uintptr_t)(addr) - (uintptr_t)physmap_start())]
+
+/*
+ * Slab coloring: each new slab starts its objects SLAB_COLOR_STEP bytes
+ * further in than the last, using the space the slab would waste anyway, so
+ * that objects at the same index in different slabs fall in different cache
+ * sets. The color wraps around to 0 when the waste runs out.
+ */
+#define SLAB_COLOR_STEP SLAB_CACHE_LINE_SIZE
+
 /*
  * This constant defines how many orders of magnitude (in page block
  * sizes) we'll search for an optimal slab size (past the smallest
@@ -111,11 +195,13 @@ static slab_allocator_t slab_allocator_allocator;
 /**
  * Given the object size and the number of objects, calculates
  * the size of the slab. Each object includes a slab_bufctl_t, 
- * and each slab includes a slab struct. 
+ * and each slab includes a slab struct and offset bytes before
+ * the first object. 
 */
-static size_t _slab_size(size_t objsize, size_t nobjs)
+static size_t _slab_size(size_t objsize, size_t nobjs, size_t offset)
 {
-    return (nobjs * (objsize + sizeof(slab_bufctl_t)) + sizeof(struct slab));
+    return (offset + nobjs * (objsize + sizeof(slab_bufctl_t)) +
+            sizeof(struct slab));
 }
 
 /**
@@ -124,20 +210,20 @@ static size_t _slab_size(size_t objsize, size_t nobjs)
  * 
  * PAGE_SIZE << order effectively is just PAGE_SIZE * 2^order. 
 */
-static size_t _slab_nobjs(size_t objsize, size_t order)
+static size_t _slab_nobjs(size_t objsize, size_t order, size_t offset)
 {
-    return (((PAGE_SIZE << order) - sizeof(struct slab)) /
+    return (((PAGE_SIZE << order) - sizeof(struct slab) - offset) /
             (objsize + sizeof(slab_bufctl_t)));
 }
 
-static size_t _slab_waste(size_t objsize, size_t order)
+static size_t _slab_waste(size_t objsize, size_t order, size_t offset)
 {
     /* Waste is defined as the amount of unused space in the page
      * block, that is the number of bytes in the page block minus
      * the optimal slab size for that particular block size.
      */
     return ((PAGE_SIZE << order) -
-            _slab_size(objsize, _slab_nobjs(objsize, order)));
+            _slab_size(objsize, _slab_nobjs(objsize, order, offset), offset));
 }
 
 static void _calc_slab_size(slab_allocator_t *allocator)
@@ -148,9 +234,10 @@ static void _calc_slab_size(slab_allocator_t *allocator)
     size_t minorder;
     size_t minsize;
     size_t waste;
+    size_t offset = allocator->sa_offset;
 
     /* Find the minimum page block size that this slab requires. */
-    minsize = _slab_size(allocator->sa_objsize, 1);
+    minsize = _slab_size(allocator->sa_objsize, 1, offset);
     for (minorder = 0; minorder < PAGE_NSIZES; minorder++)
     {
         if ((PAGE_SIZE << minorder) >= minsize)
@@ -163,7 +250,7 @@ static void _calc_slab_size(slab_allocator_t *allocator)
 
     /* Start the search with the minimum block size for this slab. */
     best_order = minorder;
-    best_waste = _slab_waste(allocator->sa_objsize, minorder);
+    best_waste = _slab_waste(allocator->sa_objsize, minorder, offset);
 
     dbg(DBG_MM, "calc_slab_size: minorder %lu, waste %lu\n", minorder,
         best_waste);
@@ -174,7 +261,8 @@ static void _calc_slab_size(slab_allocator_t *allocator)
      */
     for (order = minorder + 1; order < SLAB_MAX_ORDER; order++)
     {
-        if ((waste = _slab_waste(allocator->sa_objsize, order)) < best_waste)
+        if ((waste = _slab_waste(allocator->sa_objsize, order, offset)) <
+            best_waste)
         {
             best_waste = waste;
             best_order = order;
@@ -186,15 +274,18 @@ static void _calc_slab_size(slab_allocator_t *allocator)
     /* Finally, the best page block size wins.
      */
     allocator->sa_order = best_order;
-    allocator->sa_slab_nobjs = _slab_nobjs(allocator->sa_objsize, best_order);
+    allocator->sa_slab_nobjs =
+        _slab_nobjs(allocator->sa_objsize, best_order, offset);
     KASSERT(allocator->sa_slab_nobjs);
+    allocator->sa_color = 0;
+    allocator->sa_color_max = best_waste - best_waste % SLAB_COLOR_STEP;
 }
 
 /*
  * Initializes a given allocator using the name and size passed in. 
 */
 static void _allocator_init(slab_allocator_t *allocator, const char *name,
-                            size_t size)
+                            size_t size, long flags)
 {
 #ifdef SLAB_REDZONE
     /*
@@ -203,6 +294,20 @@ static void _allocator_init(slab_allocator_t *allocator, const char *name,
     size += 2 * sizeof(uintptr_t);
 #endif
 
+    allocator->sa_offset = 0;
+    if (flags & SLAB_CACHE_ALIGN)
+    {
+        /* Pad each object and its bufctl out to whole cache lines, and
+         * start the objects where the first one the caller sees (past the
+         * front red-zone) begins a line. */
+        size = ((size + sizeof(slab_bufctl_t) + SLAB_CACHE_LINE_SIZE - 1) &
+                ~(size_t)(SLAB_CACHE_LINE_SIZE - 1)) -
+               sizeof(slab_bufctl_t);
+#ifdef SLAB_REDZONE
+        allocator->sa_offset = SLAB_CACHE_LINE_SIZE - sizeof(uintptr_t);
+#endif
+    }
+
     if (!name)
     {
         name = "<unnamed>";
@@ -211,13 +316,23 @@ static void _allocator_init(slab_allocator_t *allocator, const char *name,
     allocator->sa_name = name;
     allocator->sa_objsize = size;
     allocator->sa_slabs = NULL;
+    allocator->sa_kmalloc_class = 0;
     spinlock_init(&allocator->sa_lock);
+
+    allocator->sa_use_magazines = size <= SLAB_MAGAZINE_MAX_OBJSIZE &&
+                                  allocator != &slab_magazine_allocator;
+    allocator->sa_depot_full = NULL;
+    allocator->sa_depot_empty = NULL;
+    allocator->sa_depot_nfull = 0;
+    memset(allocator->sa_cpu, 0, sizeof(allocator->sa_cpu));
     // this will set the fields sa_order and the number of objects per slab
     _calc_slab_size(allocator);
 
     /* Add cache to global cache list. */
+    spinlock_lock(&slab_allocators_lock);
     allocator->sa_next = slab_allocators;
     slab_allocators = allocator;
+    spinlock_unlock(&slab_allocators_lock);
 
     dbg(DBG_MM, "Initialized new slab allocator:\n");
     dbgq(DBG_MM, "  Name:          \"%s\" (0x%p)\n", allocator->sa_name,
@@ -225,6 +340,8 @@ static void _allocator_init(slab_allocator_t *allocator, const char *name,
     dbgq(DBG_MM, "  Object Size:   %lu\n", allocator->sa_objsize);
     dbgq(DBG_MM, "  Order:         %lu\n", allocator->sa_order);
     dbgq(DBG_MM, "  Slab Capacity: %lu\n", allocator->sa_slab_nobjs);
+    dbgq(DBG_MM, "  Colors:        %lu\n",
+         allocator->sa_color_max / SLAB_COLOR_STEP + 1);
 }
 
 /*
@@ -233,6 +350,12 @@ static void _allocator_init(slab_allocator_t *allocator, const char *name,
  * some metadata. 
 */
 slab_allocator_t *slab_allocator_create(const char *name, size_t size)
+{
+    return slab_allocator_create_flags(name, size, 0);
+}
+
+slab_allocator_t *slab_allocator_create_flags(const char *name, size_t size,
+                                              long flags)
 {
     slab_allocator_t *allocator;
 
@@ -242,15 +365,70 @@ slab_allocator_t *slab_allocator_create(const char *name, size_t size)
         return NULL;
     }
 
-    _allocator_init(allocator, name, size);
+    _allocator_init(allocator, name, size, flags);
     return allocator;
 }
 
+static void _slab_obj_free_locked(slab_allocator_t *allocator, void *obj);
+static inline void _slab_magazine_check(slab_allocator_t *allocator,
+                                        void *obj, long freeing);
+
+/*
+ * Return a magazine's objects to the slabs and free the magazine.
+ * allocator->sa_lock must be held.
+ */
+static void _slab_magazine_destroy(slab_allocator_t *allocator,
+                                   slab_magazine_t *mag)
+{
+    for (size_t i = 0; i < mag->sm_rounds; i++)
+    {
+        _slab_magazine_check(allocator, mag->sm_objs[i], 0);
+        _slab_obj_free_locked(allocator, mag->sm_objs[i]);
+    }
+    slab_obj_free(&slab_magazine_allocator, mag);
+}
+
 /*
  * Free a given allocator. 
 */
 void slab_allocator_destroy(slab_allocator_t *allocator)
 {
+    spinlock_lock(&slab_allocators_lock);
+    slab_allocator_t **prev = &slab_allocators;
+    while (*prev != allocator)
+    {
+        prev = &(*prev)->sa_next;
+    }
+    *prev = allocator->sa_next;
+    spinlock_unlock(&slab_allocators_lock);
+
+    /* nobody may be using the allocator anymore, so every core's magazines
+     * can be torn down from here */
+    spinlock_lock(&allocator->sa_lock);
+    for (size_t core = 0; core < MAX_LAPICS; core++)
+    {
+        slab_cpu_cache_t *cc = &allocator->sa_cpu[core];
+        if (cc->cc_loaded)
+        {
+            _slab_magazine_destroy(allocator, cc->cc_loaded);
+        }
+        if (cc->cc_previous)
+        {
+            _slab_magazine_destroy(allocator, cc->cc_previous);
+        }
+    }
+    slab_magazine_t *lists[] = {allocator->sa_depot_full,
+                                allocator->sa_depot_empty};
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+    {
+        while (lists[i])
+        {
+            slab_magazine_t *mag = lists[i];
+            lists[i] = mag->sm_next;
+            _slab_magazine_destroy(allocator, mag);
+        }
+    }
+    spinlock_unlock(&allocator->sa_lock);
     slab_obj_free(&slab_allocator_allocator, allocator);
 }
 
@@ -263,6 +441,7 @@ static long _slab_allocator_grow(slab_allocator_t *allocator)
     void *addr;
     void *obj;
     struct slab *slab;
+    void *first;
 
     addr = page_alloc_n(1UL << allocator->sa_order);
     if (!addr)
@@ -270,8 +449,16 @@ static long _slab_allocator_grow(slab_allocator_t *allocator)
         return 0;
     }
 
+    first = (void *)((uintptr_t)addr + allocator->sa_offset +
+                     allocator->sa_color);
+    allocator->sa_color += SLAB_COLOR_STEP;
+    if (allocator->sa_color > allocator->sa_color_max)
+    {
+        allocator->sa_color = 0;
+    }
+
     /* Initialize each bufctl to be free and point to the next object. */
-    obj = addr;
+    obj = first;
     for (size_t i = 0; i < (allocator->sa_slab_nobjs - 1); i++)
     {
 #ifdef SLAB_CHECK_FREE
@@ -291,14 +478,20 @@ static long _slab_allocator_grow(slab_allocator_t *allocator)
 
     /*
      * The first object in the slab will be the head of the free
-     * list and the start address of the slab.
+     * list; the start address of the slab is that of its pages.
      */
-    slab->s_free = addr;
+    slab->s_free = first;
     slab->s_addr = addr;
     slab->s_inuse = 0;
 
+    if (allocator->sa_kmalloc_class)
+    {
+        memset(&slab_page_class(addr), allocator->sa_kmalloc_class,
+               1UL << allocator->sa_order);
+    }
+
     /* Initialize objects. */
-    obj = addr;
+    obj = first;
     for (size_t i = 0; i < allocator->sa_slab_nobjs; i++)
     {
 #ifdef SLAB_REDZONE
@@ -319,11 +512,10 @@ static long _slab_allocator_grow(slab_allocator_t *allocator)
 }
 
 /*
- * Given an allocator, will allocate an object.  
-*/
-void *slab_obj_alloc(slab_allocator_t *allocator)
+ * Allocate an object from the slab lists. allocator->sa_lock must be held.
+ */
+static void *_slab_obj_alloc_locked(slab_allocator_t *allocator)
 {
-    spinlock_lock(&allocator->sa_lock);
     struct slab *slab;
     void *obj;
 
@@ -339,7 +531,6 @@ void *slab_obj_alloc(slab_allocator_t *allocator)
         }
         if (!_slab_allocator_grow(allocator))
         {
-            spinlock_unlock(&allocator->sa_lock);
             return NULL;
         }
     }
@@ -372,16 +563,15 @@ void *slab_obj_alloc(slab_allocator_t *allocator)
     obj = (void *)((uintptr_t)obj + sizeof(uintptr_t));
 #endif
 
-    GDB_CALL_HOOK(slab_obj_alloc, obj, allocator);
-    spinlock_unlock(&allocator->sa_lock);
     return obj;
 }
 
-void slab_obj_free(slab_allocator_t *allocator, void *obj)
+/*
+ * Return an object to its slab. allocator->sa_lock must be held.
+ */
+static void _slab_obj_free_locked(slab_allocator_t *allocator, void *obj)
 {
-    spinlock_lock(&allocator->sa_lock);
     struct slab *slab;
-    GDB_CALL_HOOK(slab_obj_free, obj, allocator);
 
 #ifdef SLAB_REDZONE
     /* Move pointer back to verify that the REDZONE is unchanged. */
@@ -405,95 +595,431 @@ void slab_obj_free(slab_allocator_t *allocator, void *obj)
 
     dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %lu\n",
         obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+}
+
+/*
+ * The debugging checks normally done by the slab layer, for objects moving
+ * into (freeing) or out of a magazine.
+ */
+static inline void _slab_magazine_check(slab_allocator_t *allocator,
+                                        void *obj, long freeing)
+{
+#ifdef SLAB_REDZONE
+    obj = (void *)((uintptr_t)obj - sizeof(uintptr_t));
+    VERIFY_REDZONES(allocator, obj);
+#endif
+
+#ifdef SLAB_CHECK_FREE
+    if (freeing)
+    {
+        KASSERT(!obj_bufctl(allocator, obj)->sb_free && "INVALID FREE!");
+        obj_bufctl(allocator, obj)->sb_free = 1;
+    }
+    else
+    {
+        KASSERT(obj_bufctl(allocator, obj)->sb_free);
+        obj_bufctl(allocator, obj)->sb_free = 0;
+    }
+#endif
+}
+
+static inline slab_cpu_cache_t *_slab_cpu_cache(slab_allocator_t *allocator)
+{
+    KASSERT(curcore.kc_id >= 0 && curcore.kc_id < MAX_LAPICS);
+    return &allocator->sa_cpu[curcore.kc_id];
+}
+
+static inline void _slab_cpu_cache_swap(slab_cpu_cache_t *cc)
+{
+    slab_magazine_t *tmp = cc->cc_loaded;
+    cc->cc_loaded = cc->cc_previous;
+    cc->cc_previous = tmp;
+}
+
+/*
+ * Try to allocate from this core's magazines, trading an empty magazine for a
+ * full one from the depot if necessary. Interrupts must be masked. Returns
+ * NULL if the depot has no full magazines.
+ */
+static void *_slab_magazine_alloc(slab_allocator_t *allocator,
+                                  slab_cpu_cache_t *cc)
+{
+    for (;;)
+    {
+        if (cc->cc_loaded && cc->cc_loaded->sm_rounds)
+        {
+            return cc->cc_loaded->sm_objs[--cc->cc_loaded->sm_rounds];
+        }
+        if (cc->cc_previous && cc->cc_previous->sm_rounds)
+        {
+            _slab_cpu_cache_swap(cc);
+            continue;
+        }
+
+        /* both magazines are empty (or missing) */
+        spinlock_lock(&allocator->sa_lock);
+        slab_magazine_t *full = allocator->sa_depot_full;
+        if (!full)
+        {
+            spinlock_unlock(&allocator->sa_lock);
+            return NULL;
+        }
+        allocator->sa_depot_full = full->sm_next;
+        allocator->sa_depot_nfull--;
+        if (cc->cc_previous)
+        {
+            cc->cc_previous->sm_next = allocator->sa_depot_empty;
+            allocator->sa_depot_empty = cc->cc_previous;
+        }
+        spinlock_unlock(&allocator->sa_lock);
+        cc->cc_previous = cc->cc_loaded;
+        cc->cc_loaded = full;
+    }
+}
+
+/*
+ * Try to free obj into this core's magazines, trading a full magazine for an
+ * empty one from the depot (or a new one) if necessary. Interrupts must be
+ * masked. Returns 0 if the depot is already holding as many full magazines as
+ * it is allowed to.
+ */
+static long _slab_magazine_free(slab_allocator_t *allocator,
+                                slab_cpu_cache_t *cc, void *obj)
+{
+    for (;;)
+    {
+        if (cc->cc_loaded && cc->cc_loaded->sm_rounds < SLAB_MAGAZINE_ROUNDS)
+        {
+            cc->cc_loaded->sm_objs[cc->cc_loaded->sm_rounds++] = obj;
+            return 1;
+        }
+        if (cc->cc_previous &&
+            cc->cc_previous->sm_rounds < SLAB_MAGAZINE_ROUNDS)
+        {
+            _slab_cpu_cache_swap(cc);
+            continue;
+        }
+
+        /* both magazines are full (or missing) */
+        spinlock_lock(&allocator->sa_lock);
+        if (cc->cc_previous && allocator->sa_depot_nfull >= SLAB_DEPOT_MAX_FULL)
+        {
+            spinlock_unlock(&allocator->sa_lock);
+            return 0;
+        }
+        slab_magazine_t *empty = allocator->sa_depot_empty;
+        if (empty)
+        {
+            allocator->sa_depot_empty = empty->sm_next;
+        }
+        else
+        {
+            spinlock_unlock(&allocator->sa_lock);
+            if (!(empty = slab_obj_alloc(&slab_magazine_allocator)))
+            {
+                return 0;
+            }
+            empty->sm_rounds = 0;
+            spinlock_lock(&allocator->sa_lock);
+        }
+        if (cc->cc_previous)
+        {
+            cc->cc_previous->sm_next = allocator->sa_depot_full;
+            allocator->sa_depot_full = cc->cc_previous;
+            allocator->sa_depot_nfull++;
+        }
+        spinlock_unlock(&allocator->sa_lock);
+        cc->cc_previous = cc->cc_loaded;
+        cc->cc_loaded = empty;
+    }
+}
+
+/*
+ * Given an allocator, will allocate an object.  
+*/
+void *slab_obj_alloc(slab_allocator_t *allocator)
+{
+    void *obj = NULL;
+    if (allocator->sa_use_magazines)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        slab_cpu_cache_t *cc = _slab_cpu_cache(allocator);
+        if ((obj = _slab_magazine_alloc(allocator, cc)))
+        {
+            cc->cc_alloc_hits++;
+            _slab_magazine_check(allocator, obj, 0);
+        }
+        else
+        {
+            cc->cc_alloc_misses++;
+        }
+        intr_setipl(ipl);
+    }
+
+    if (!obj)
+    {
+        spinlock_lock(&allocator->sa_lock);
+        obj = _slab_obj_alloc_locked(allocator);
+        spinlock_unlock(&allocator->sa_lock);
+        if (!obj)
+        {
+            return NULL;
+        }
+    }
+
+    GDB_CALL_HOOK(slab_obj_alloc, obj, allocator);
+    return obj;
+}
+
+void slab_obj_free(slab_allocator_t *allocator, void *obj)
+{
+    GDB_CALL_HOOK(slab_obj_free, obj, allocator);
+    if (allocator->sa_use_magazines)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        slab_cpu_cache_t *cc = _slab_cpu_cache(allocator);
+        _slab_magazine_check(allocator, obj, 1);
+        long cached = _slab_magazine_free(allocator, cc, obj);
+        if (cached)
+        {
+            cc->cc_free_hits++;
+        }
+        else
+        {
+            /* undo the free marking; the slab layer does its own checks */
+            _slab_magazine_check(allocator, obj, 0);
+            cc->cc_free_misses++;
+        }
+        intr_setipl(ipl);
+        if (cached)
+        {
+            return;
+        }
+    }
+
+    spinlock_lock(&allocator->sa_lock);
+    _slab_obj_free_locked(allocator, obj);
     spinlock_unlock(&allocator->sa_lock);
 }
 
+/* Objects each shrinker is asked to drop per slab_allocators_reclaim() */
+#define SLAB_SHRINK_BATCH 64
+
+/*
+ * Give back the full magazines in the allocator's depot, and the empty ones
+ * with them, so that the objects they hold no longer keep slabs in use. The
+ * magazines loaded on each core are left alone; only their own core may touch
+ * them. allocator->sa_lock must be held.
+ */
+static void _slab_depot_drain(slab_allocator_t *allocator)
+{
+    slab_magazine_t *lists[] = {allocator->sa_depot_full,
+                                allocator->sa_depot_empty};
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+    {
+        while (lists[i])
+        {
+            slab_magazine_t *mag = lists[i];
+            lists[i] = mag->sm_next;
+            _slab_magazine_destroy(allocator, mag);
+        }
+    }
+    allocator->sa_depot_full = NULL;
+    allocator->sa_depot_empty = NULL;
+    allocator->sa_depot_nfull = 0;
+}
+
+/*
+ * Free the allocator's empty slabs, stopping once *npages_freed reaches
+ * target (if positive). allocator->sa_lock must be held.
+ */
+static void _slab_allocator_shrink(slab_allocator_t *allocator, long target,
+                                   long *npages_freed)
+{
+    long npages = 1L << allocator->sa_order;
+    struct slab **prev = &allocator->sa_slabs;
+    while (*prev && (target <= 0 || *npages_freed < target))
+    {
+        struct slab *s = *prev;
+        if (s->s_inuse)
+        {
+            prev = &s->s_next;
+            continue;
+        }
+        *prev = s->s_next;
+        if (allocator->sa_kmalloc_class)
+        {
+            memset(&slab_page_class(s->s_addr), 0, (size_t)npages);
+        }
+        dbg(DBG_MM, "Shrinking cache \"%s\" (0x%p), freeing slab 0x%p\n",
+            allocator->sa_name, allocator, s);
+        page_free_n(s->s_addr, (size_t)npages);
+        *npages_freed += npages;
+    }
+}
+
+/*
+ * Free empty slabs from every allocator until target pages are freed (or
+ * all of them, if target is negative). slab_allocators_lock must be held.
+ */
+static void _slab_allocators_shrink(long target, long *npages_freed)
+{
+    for (slab_allocator_t *a = slab_allocators;
+         a && (target <= 0 || *npages_freed < target); a = a->sa_next)
+    {
+        spinlock_lock(&a->sa_lock);
+        _slab_depot_drain(a);
+        _slab_allocator_shrink(a, target, npages_freed);
+        spinlock_unlock(&a->sa_lock);
+    }
+}
+
+size_t slab_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+
+    KASSERT(NULL == arg);
+    KASSERT(NULL != buf);
+
+    iprintf(&buf, &size, "%-20s %8s %10s %10s %8s %12s %12s\n", "name",
+            "objsize", "inuse", "total", "pages", "mag hits", "mag misses");
+    spinlock_lock(&slab_allocators_lock);
+    for (slab_allocator_t *a = slab_allocators; a; a = a->sa_next)
+    {
+        size_t nslabs = 0, inuse = 0, hits = 0, misses = 0;
+        spinlock_lock(&a->sa_lock);
+        for (struct slab *s = a->sa_slabs; s; s = s->s_next)
+        {
+            nslabs++;
+            inuse += s->s_inuse;
+        }
+        spinlock_unlock(&a->sa_lock);
+        for (long core = 0; core < MAX_LAPICS; core++)
+        {
+            hits += a->sa_cpu[core].cc_alloc_hits;
+            misses += a->sa_cpu[core].cc_alloc_misses;
+        }
+        iprintf(&buf, &size, "%-20s %8lu %10lu %10lu %8lu %12lu %12lu\n",
+                a->sa_name, a->sa_objsize, inuse, nslabs * a->sa_slab_nobjs,
+                nslabs << a->sa_order, hits, misses);
+    }
+    spinlock_unlock(&slab_allocators_lock);
+    return size;
+}
+
 /*
  * Reclaims as much memory (up to a target) from
- * unused slabs as possible
+ * unused slabs as possible. Empty slabs are given back first; only if that
+ * falls short are the shrinkers asked to drop cached objects, after which
+ * the slabs they emptied are given back too.
  * @param target - target number of pages to reclaim. If negative,
  * try to reclaim as many pages as possible
  * @return number of pages freed
  */
 long slab_allocators_reclaim(long target)
 {
-    panic("slab_allocators_reclaim NYI for SMP");
-    // spinlock_lock(&allocator->sa_lock);
-    //     int npages_freed = 0, npages;
-
-    //     slab_allocator_t *a;
-    //     struct slab *s, **prev;
-
-    //     /* Go through all caches */
-    //     for (a = slab_allocators; NULL != a; a = a->sa_next) {
-    //             prev = &(a->sa_slabs);
-    //             s = a->sa_slabs;
-    //             while (NULL != s) {
-    //                     struct slab *next = s->s_next;
-    //                     if (0 == s->s_inuse) {
-    //                             /* Free Slab */
-    //                             (*prev) = next;
-    //                             npages = 1 << a->sa_order;
-
-    //                             page_free_n(s->s_addr, npages);
-    //                             npages_freed += npages;
-    //                     } else {
-    //                             prev = &(s->s_next);
-    //                     }
-    //                     /* Check if target was met */
-    //                     if ((target > 0) && (npages_freed >= target)) {
-    //                             return npages_freed;
-    //                     }
-    //                     s = next;
-    //             }
-    //     }
-    // spinlock_unlock(&allocator->sa_lock);
-    //     return npages_freed;
+    long npages_freed = 0;
+
+    spinlock_lock(&slab_allocators_lock);
+    _slab_allocators_shrink(target, &npages_freed);
+    spinlock_unlock(&slab_allocators_lock);
+    if (target > 0 && npages_freed >= target)
+    {
+        return npages_freed;
+    }
+
+    /* Shrinkers take their own locks, so none of ours may be held. */
+    size_t nshrunk = 0;
+    list_iterate(&slab_shrinkers, shrinker, slab_shrinker_t, ss_link)
+    {
+        nshrunk += shrinker->ss_shrink(SLAB_SHRINK_BATCH);
+    }
+    if (nshrunk)
+    {
+        spinlock_lock(&slab_allocators_lock);
+        _slab_allocators_shrink(target, &npages_freed);
+        spinlock_unlock(&slab_allocators_lock);
+    }
+
+    dbg(DBG_MM, "Reclaimed %ld pages from slabs (%lu objects shrunk)\n",
+        npages_freed, nshrunk);
+    return npages_freed;
 }
 
+void slab_shrinker_register(slab_shrinker_t *shrinker)
+{
+    spinlock_lock(&slab_shrinkers_lock);
+    list_insert_tail(&slab_shrinkers, &shrinker->ss_link);
+    spinlock_unlock(&slab_shrinkers_lock);
+}
+
+/*
+ * kmalloc size classes: powers of two, with one halfway (1.5x) class between
+ * each pair up to 4096, where most allocations are. Objects carry no header,
+ * so an exact power of two fits its own class.
+ */
 #define KMALLOC_SIZE_MIN_ORDER (6)
 #define KMALLOC_SIZE_MAX_ORDER (18)
+#define KMALLOC_HALF_MAX_ORDER (12) /* no halfway classes above 1 << this */
+#define KMALLOC_NCLASSES \
+    (2 * (KMALLOC_HALF_MAX_ORDER - KMALLOC_SIZE_MIN_ORDER) + 1 + \
+     KMALLOC_SIZE_MAX_ORDER - KMALLOC_HALF_MAX_ORDER)
 
-static slab_allocator_t
-    *kmalloc_allocators[KMALLOC_SIZE_MAX_ORDER - KMALLOC_SIZE_MIN_ORDER + 1];
+static slab_allocator_t *kmalloc_allocators[KMALLOC_NCLASSES];
 
-/* Note that kmalloc_allocator_names should be modified to remain consistent
- * with KMALLOC_SIZE_MIN_ORDER ... KMALLOC_SIZE_MAX_ORDER.
+/* Note that kmalloc_sizes and kmalloc_allocator_names should be modified to
+ * remain consistent with the orders above and kmalloc_class().
  */
+static const size_t kmalloc_sizes[] = {
+    64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096,
+    8192, 16384, 32768, 65536, 131072, 262144};
 static const char *kmalloc_allocator_names[] = {
-    "size-64", "size-128", "size-256", "size-512", "size-1024",
-    "size-2048", "size-4096", "size-8192", "size-16384", "size-32768",
+    "size-64", "size-96", "size-128", "size-192", "size-256", "size-384",
+    "size-512", "size-768", "size-1024", "size-1536", "size-2048",
+    "size-3072", "size-4096", "size-8192", "size-16384", "size-32768",
     "size-65536", "size-131072", "size-262144"};
 
+/*
+ * Returns the index of the smallest size class that fits size, which must be
+ * at most 1 << KMALLOC_SIZE_MAX_ORDER.
+ */
+static inline size_t kmalloc_class(size_t size)
+{
+    if (size <= (1UL << KMALLOC_SIZE_MIN_ORDER))
+    {
+        return 0;
+    }
+    /* 1 << (order - 1) < size <= 1 << order */
+    size_t order = 64 - __builtin_clzl(size - 1);
+    if (order > KMALLOC_HALF_MAX_ORDER)
+    {
+        return order - KMALLOC_HALF_MAX_ORDER +
+               2 * (KMALLOC_HALF_MAX_ORDER - KMALLOC_SIZE_MIN_ORDER);
+    }
+    return 2 * (order - KMALLOC_SIZE_MIN_ORDER) -
+           (size <= (3UL << (order - 2)));
+}
+
 void *kmalloc(size_t size)
 {
-    size += sizeof(slab_allocator_t *);
+    if (size > KMALLOC_MAX_SIZE)
+    {
+        panic("size bigger than maxorder %ld\n", size);
+    }
 
-    /*
-     * Find the first power of two bucket bigger than the
-     * requested size, and allocate from it.
-     */
-    slab_allocator_t **cs = kmalloc_allocators;
-    for (size_t order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER;
-         order++, cs++)
+    size_t class = kmalloc_class(size);
+    KASSERT(kmalloc_sizes[class] >= size &&
+            (!class || kmalloc_sizes[class - 1] < size));
+    void *addr = slab_obj_alloc(kmalloc_allocators[class]);
+    if (!addr)
     {
-        if ((1UL << order) >= size)
-        {
-            void *addr = slab_obj_alloc(*cs);
-            if (!addr)
-            {
-                dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
-                return NULL;
-            }
+        dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
+        return NULL;
+    }
 #ifdef MM_POISON
-            memset(addr, MM_POISON_ALLOC, size);
+    memset(addr, MM_POISON_ALLOC, size);
 #endif /* MM_POISON */
-            *((slab_allocator_t **)addr) = *cs;
-            return (void *)(((slab_allocator_t **)addr) + 1);
-        }
-    }
-
-    panic("size bigger than maxorder %ld\n", size);
+    return addr;
 }
 
 __attribute__((used)) static void *malloc(size_t size)
@@ -506,8 +1032,9 @@ __attribute__((used)) static void *malloc(size_t size)
 
 void kfree(void *addr)
 {
-    addr = (void *)(((slab_allocator_t **)addr) - 1);
-    slab_allocator_t *sa = *(slab_allocator_t **)addr;
+    uint8_t class = slab_page_class(addr);
+    KASSERT(class && "kfree() of memory not from kmalloc()");
+    slab_allocator_t *sa = kmalloc_allocators[class - 1];
 
 #ifdef MM_POISON
     /* If poisoning is enabled, wipe the memory given in
@@ -536,22 +1063,39 @@ void slab_init()
     /* Special case initialization of the allocator for `slab_allocator_t`s */
     /* In other words, initializes a slab allocator for other slab allocators. */
     _allocator_init(&slab_allocator_allocator, "slab_allocators",
-                    sizeof(slab_allocator_t));
+                    sizeof(slab_allocator_t), 0);
+    _allocator_init(&slab_magazine_allocator, "slab_magazines",
+                    sizeof(slab_magazine_t), 0);
+
+    size_t npages = ADDR_TO_PN(
+        PAGE_ALIGN_UP(ADDR_TO_PN((uintptr_t)physmap_end() -
+                                 (uintptr_t)physmap_start())));
+    slab_page_classes = page_alloc_n(npages);
+    if (!slab_page_classes)
+    {
+        panic("Couldn't allocate the slab page table!\n");
+    }
+    memset(slab_page_classes, 0, npages << PAGE_SHIFT);
 
     /*
-     * Allocate the power of two buckets for generic
+     * Allocate the size class buckets for generic
      * kmalloc/kfree.
      */
-    slab_allocator_t **cs = kmalloc_allocators;
-    for (size_t order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER;
-         order++, cs++)
-    {
-        if (NULL ==
-            (*cs = slab_allocator_create(
-                 kmalloc_allocator_names[order - KMALLOC_SIZE_MIN_ORDER],
-                 (1UL << order))))
+    KASSERT(KMALLOC_MAX_SIZE == 1UL << KMALLOC_SIZE_MAX_ORDER);
+    KASSERT(sizeof(kmalloc_sizes) / sizeof(kmalloc_sizes[0]) ==
+                KMALLOC_NCLASSES &&
+            sizeof(kmalloc_allocator_names) /
+                    sizeof(kmalloc_allocator_names[0]) ==
+                KMALLOC_NCLASSES);
+    for (size_t class = 0; class < KMALLOC_NCLASSES; class++)
+    {
+        slab_allocator_t *sa = slab_allocator_create(
+            kmalloc_allocator_names[class], kmalloc_sizes[class]);
+        if (NULL == sa)
         {
             panic("Couldn't create kmalloc allocators!\n");
         }
+        sa->sa_kmalloc_class = (uint8_t)(class + 1);
+        kmalloc_allocators[class] = sa;
     }
 }
@@ -0,0 +1,201 @@
+#include "globals.h"
+#include "kernel.h"
+#include "types.h"
+
+#include "main/apic.h"
+#include "main/interrupt.h"
+#include "main/smp.h"
+
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
+
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+
+/*
+ * TLB shootdown.
+ *
+ * A core caches translations of the page table it has loaded and, with
+ * PCIDs, of the other page tables it has tagged (see pt_set()). Once mappings
+ * are removed from a page table, tlb_shootdown() makes sure no core can still
+ * use them, with a single interrupt per core for the whole range:
+ *  - a core running the page table gets an INTR_TLB_SHOOTDOWN IPI, and the
+ *    sender waits until it has flushed the range
+ *  - every other core is left a note in tlb_stale, and gives up the page
+ *    table's PCID at its next pt_set() rather than switching back to the stale
+ *    entries
+ *
+ * A core switching page tables records the new one in tlb_loaded before
+ * reading its tlb_stale slot, and a sender fills in the slot before reading
+ * tlb_loaded, so every core either gets the IPI or sees the note.
+ *
+ * tlb_shootdown_kernel() has no page table to go by, so it interrupts every
+ * core and has each flush everything.
+ *
+ * Only one shootdown is in flight at a time. INTR_TLB_SHOOTDOWN lies above
+ * IPL_HIGH, so a core waiting for tlb_shootdown_lock (or for any other
+ * spinlock, at any IPL) still takes the IPI, unless it has disabled interrupts
+ * altogether; that is why callers must not.
+ */
+
+#ifdef __SMP__
+static uintptr_t tlb_loaded[MAX_LAPICS]; /* physical address of each core's
+                                          * page table */
+static uintptr_t tlb_stale[MAX_LAPICS];  /* see tlb_take_stale() */
+
+/* Protects the request below */
+static spinlock_t tlb_shootdown_lock = SPINLOCK_INITIALIZER(tlb_shootdown_lock);
+static uintptr_t tlb_request_pml4; /* physical address, or 0 for all */
+static uintptr_t tlb_request_vaddr;
+static size_t tlb_request_npages;
+static long tlb_request_pending; /* cores yet to flush */
+#endif
+
+/*
+ * Invalidates a range of the page table at physical address phys on this core.
+ * Returns 1 if it is the current page table.
+ */
+static long tlb_invalidate_local(uintptr_t phys, uintptr_t vaddr,
+                                 size_t npages)
+{
+    if (pt_virt_to_phys((uintptr_t)pt_get()) == phys)
+    {
+        tlb_flush_range(vaddr, npages);
+        return 1;
+    }
+    pt_pcid_forget(phys);
+    return 0;
+}
+
+#ifdef __SMP__
+static long tlb_shootdown_handler(regs_t *regs)
+{
+    uintptr_t phys = tlb_request_pml4;
+    if (!phys)
+    {
+        tlb_flush_all();
+    }
+    else if (tlb_invalidate_local(phys, tlb_request_vaddr, tlb_request_npages))
+    {
+        /* the current PCID has just been flushed, so there is no need to
+         * give it up as well */
+        __sync_bool_compare_and_swap(&tlb_stale[curcore.kc_id], phys, 0);
+    }
+    __sync_sub_and_fetch(&tlb_request_pending, 1);
+    return 0;
+}
+
+/*
+ * Leaves a core a note to give up the page table's PCID, merging it with
+ * whatever note the core has not picked up yet.
+ */
+static void tlb_mark_stale(long core, uintptr_t phys)
+{
+    while (1)
+    {
+        uintptr_t old = tlb_stale[core];
+        if (old == phys || old == TLB_STALE_ALL)
+        {
+            return;
+        }
+        uintptr_t new = old ? TLB_STALE_ALL : phys;
+        if (__sync_bool_compare_and_swap(&tlb_stale[core], old, new))
+        {
+            return;
+        }
+    }
+}
+#endif
+
+void tlb_init()
+{
+#ifdef __SMP__
+    intr_register(INTR_TLB_SHOOTDOWN, tlb_shootdown_handler);
+#endif
+}
+
+void tlb_shootdown(pml4_t *pml4, uintptr_t vaddr, size_t npages)
+{
+    uintptr_t phys = pt_virt_to_phys((uintptr_t)pml4);
+    tlb_invalidate_local(phys, vaddr, npages);
+
+#ifdef __SMP__
+    spinlock_lock(&tlb_shootdown_lock);
+    tlb_request_pml4 = phys;
+    tlb_request_vaddr = vaddr;
+    tlb_request_npages = npages;
+    tlb_request_pending = 0;
+    __sync_synchronize();
+
+    for (long core = 0; core < MAX_LAPICS; core++)
+    {
+        if (core == curcore.kc_id || !csd_vaddr_table[core])
+        {
+            continue;
+        }
+        tlb_mark_stale(core, phys);
+        __sync_synchronize();
+        if (tlb_loaded[core] == phys)
+        {
+            KASSERT(intr_enabled() && "tlb_shootdown() would deadlock");
+            __sync_add_and_fetch(&tlb_request_pending, 1);
+            apic_send_ipi((uint8_t)core, DESTINATION_MODE_FIXED,
+                          INTR_TLB_SHOOTDOWN);
+            apic_wait_ipi();
+        }
+    }
+    while (*(volatile long *)&tlb_request_pending)
+    {
+        __asm__ volatile("pause");
+    }
+    spinlock_unlock(&tlb_shootdown_lock);
+#endif
+}
+
+void tlb_shootdown_kernel()
+{
+    tlb_flush_all();
+
+#ifdef __SMP__
+    spinlock_lock(&tlb_shootdown_lock);
+    tlb_request_pml4 = 0;
+    tlb_request_pending = 0;
+    __sync_synchronize();
+
+    for (long core = 0; core < MAX_LAPICS; core++)
+    {
+        if (core == curcore.kc_id || !csd_vaddr_table[core])
+        {
+            continue;
+        }
+        KASSERT(intr_enabled() && "tlb_shootdown_kernel() would deadlock");
+        __sync_add_and_fetch(&tlb_request_pending, 1);
+        apic_send_ipi((uint8_t)core, DESTINATION_MODE_FIXED,
+                      INTR_TLB_SHOOTDOWN);
+        apic_wait_ipi();
+    }
+    while (*(volatile long *)&tlb_request_pending)
+    {
+        __asm__ volatile("pause");
+    }
+    spinlock_unlock(&tlb_shootdown_lock);
+#endif
+}
+
+void tlb_set_loaded(pml4_t *pml4)
+{
+#ifdef __SMP__
+    tlb_loaded[curcore.kc_id] = pt_virt_to_phys((uintptr_t)pml4);
+    __sync_synchronize();
+#endif
+}
+
+uintptr_t tlb_take_stale()
+{
+#ifdef __SMP__
+    return __sync_lock_test_and_set(&tlb_stale[curcore.kc_id], 0);
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,207 @@
+#include "globals.h"
+#include "kernel.h"
+#include "types.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mm.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/slab.h"
+#include "mm/tlb.h"
+#include "mm/vmalloc.h"
+
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+
+typedef struct vmalloc_area
+{
+    uintptr_t va_start;
+    size_t va_npages;    /* mapped pages, not counting the guard page */
+    list_link_t va_link; /* link on vmalloc_areas, by address */
+} vmalloc_area_t;
+
+static slab_allocator_t *vmalloc_area_allocator;
+
+static list_t vmalloc_areas = LIST_INITIALIZER(vmalloc_areas);
+
+/* Protects vmalloc_areas, and the page tables of the vmalloc area, which
+ * pt_map() fills in as it goes */
+static spinlock_t vmalloc_lock = SPINLOCK_INITIALIZER(vmalloc_lock);
+
+void vmalloc_init()
+{
+    vmalloc_area_allocator =
+        slab_allocator_create("vmalloc_area", sizeof(vmalloc_area_t));
+    KASSERT(vmalloc_area_allocator);
+}
+
+/*
+ * Find room for npages and a guard page, first fit, and claim it for area.
+ * vmalloc_lock must be held.
+ */
+static long vmalloc_area_insert(vmalloc_area_t *area, size_t npages)
+{
+    size_t len = (npages + 1) << PAGE_SHIFT;
+    uintptr_t start = VMALLOC_START;
+    list_iterate(&vmalloc_areas, a, vmalloc_area_t, va_link)
+    {
+        if (a->va_start - start >= len)
+        {
+            area->va_start = start;
+            area->va_npages = npages;
+            list_insert_before(&a->va_link, &area->va_link);
+            return 1;
+        }
+        start = a->va_start + ((a->va_npages + 1) << PAGE_SHIFT);
+    }
+    if (VMALLOC_END - start < len)
+    {
+        return 0;
+    }
+    area->va_start = start;
+    area->va_npages = npages;
+    list_insert_tail(&vmalloc_areas, &area->va_link);
+    return 1;
+}
+
+/*
+ * Unmap the first npages pages of area and free them. The pages are chained
+ * through their first words while their addresses can still be looked up, as
+ * they may only be freed once no core can reach them through its TLB.
+ */
+static void vmalloc_area_unmap(vmalloc_area_t *area, size_t npages)
+{
+    if (!npages)
+    {
+        return;
+    }
+    void *pages = NULL;
+    spinlock_lock(&vmalloc_lock);
+    for (size_t i = 0; i < npages; i++)
+    {
+        uintptr_t vaddr = area->va_start + (i << PAGE_SHIFT);
+        void **page =
+            (void **)(pt_virt_to_phys(vaddr) + (uintptr_t)physmap_start());
+        *page = pages;
+        pages = page;
+    }
+    pt_unmap_range(pt_get(), area->va_start,
+                   area->va_start + (npages << PAGE_SHIFT), NULL);
+    spinlock_unlock(&vmalloc_lock);
+
+    tlb_shootdown_kernel();
+    while (pages)
+    {
+        void *next = *(void **)pages;
+        page_free(pages);
+        pages = next;
+    }
+}
+
+void *vmalloc(size_t size)
+{
+    size_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(size));
+    if (!npages)
+    {
+        return NULL;
+    }
+    vmalloc_area_t *area = slab_obj_alloc(vmalloc_area_allocator);
+    if (!area)
+    {
+        return NULL;
+    }
+
+    spinlock_lock(&vmalloc_lock);
+    if (!vmalloc_area_insert(area, npages))
+    {
+        spinlock_unlock(&vmalloc_lock);
+        slab_obj_free(vmalloc_area_allocator, area);
+        dbg(DBG_MM, "vmalloc: no room for %lu pages\n", npages);
+        return NULL;
+    }
+    size_t mapped;
+    for (mapped = 0; mapped < npages; mapped++)
+    {
+        void *page = page_alloc();
+        if (!page)
+        {
+            break;
+        }
+        if (pt_map(pt_get(), pt_virt_to_phys((uintptr_t)page),
+                   area->va_start + (mapped << PAGE_SHIFT),
+                   PT_PRESENT | PT_WRITE, PT_PRESENT | PT_WRITE))
+        {
+            page_free(page);
+            break;
+        }
+    }
+    spinlock_unlock(&vmalloc_lock);
+
+    if (mapped < npages)
+    {
+        dbg(DBG_MM, "vmalloc: out of memory after %lu of %lu pages\n", mapped,
+            npages);
+        vmalloc_area_unmap(area, mapped);
+        spinlock_lock(&vmalloc_lock);
+        list_remove(&area->va_link);
+        spinlock_unlock(&vmalloc_lock);
+        slab_obj_free(vmalloc_area_allocator, area);
+        return NULL;
+    }
+    return (void *)area->va_start;
+}
+
+void vfree(void *addr)
+{
+    if (!addr)
+    {
+        return;
+    }
+    vmalloc_area_t *area = NULL;
+    spinlock_lock(&vmalloc_lock);
+    list_iterate(&vmalloc_areas, a, vmalloc_area_t, va_link)
+    {
+        if (a->va_start == (uintptr_t)addr)
+        {
+            area = a;
+            break;
+        }
+    }
+    spinlock_unlock(&vmalloc_lock);
+    KASSERT(area && "vfree() of an address vmalloc() did not return");
+
+    /* the area keeps its addresses until its pages are unmapped and gone */
+    vmalloc_area_unmap(area, area->va_npages);
+    spinlock_lock(&vmalloc_lock);
+    list_remove(&area->va_link);
+    spinlock_unlock(&vmalloc_lock);
+    slab_obj_free(vmalloc_area_allocator, area);
+}
+
+void *kvmalloc(size_t size)
+{
+    void *addr;
+    if (size <= KMALLOC_MAX_SIZE && (addr = kmalloc(size)))
+    {
+        return addr;
+    }
+    return vmalloc(size);
+}
+
+void kvfree(void *addr)
+{
+    if (!addr)
+    {
+        return;
+    }
+    if ((uintptr_t)addr >= VMALLOC_START && (uintptr_t)addr < VMALLOC_END)
+    {
+        vfree(addr);
+    }
+    else
+    {
+        kfree(addr);
+    }
+}
@@ -6,6 +6,8 @@
 #include "main/apic.h"
 #include "main/gdt.h"
 
+#include "mm/tlb.h"
+
 typedef struct context_initial_func_args
 {
     context_func_t func;
@@ -83,6 +85,7 @@ void context_setup(context_t *c, context_func_t func, long arg1, void *arg2,
 void context_make_active(context_t *c)
 {
     // gdt_set_kernel_stack((void *)((uintptr_t)c->c_kstack + c->c_kstacksz));
+    tlb_set_loaded(c->c_pml4);
     pt_set(c->c_pml4);
 
     /* Switch stacks and run the thread */
@@ -100,19 +103,14 @@ void context_switch(context_t *oldc, context_t *newc)
     gdt_set_kernel_stack(
         (void *)((uintptr_t)newc->c_kstack + newc->c_kstacksz));
 
-    // sanity check that core-specific data is being managed (paged in)
-    // correctly
+    // core-specific data is reached through GS, so changing address spaces
+    // must not change it
     KASSERT(oldc->c_pml4 == pt_get());
-    uintptr_t curthr_paddr =
-        pt_virt_to_phys_helper(oldc->c_pml4, (uintptr_t)&curthr);
-    uintptr_t new_curthr_paddr =
-        pt_virt_to_phys_helper(newc->c_pml4, (uintptr_t)&curthr);
-
     kthread_t *prev_curthr = curthr;
+    tlb_set_loaded(newc->c_pml4);
     pt_set(newc->c_pml4);
     KASSERT(pt_get() == newc->c_pml4);
 
-    KASSERT(curthr_paddr == new_curthr_paddr);
     KASSERT(prev_curthr == curthr);
 
     /*
@@ -50,8 +50,10 @@ static uintptr_t fork_setup_stack(const regs_t *regs, void *kstack)
  *    c) Before the process begins execution in userland_entry, 
  *       we need to push all registers onto the kernel stack of the kthread. 
  *       Use fork_setup_stack to do this, and set RSP accordingly. 
- *    d) Use pt_unmap_range and tlb_flush_all on the parent in advance of
- *       copy-on-write.
+ *    d) Rather than unmapping the parent's user memory, share its mappings
+ *       with the child: pt_copy_range() each vmarea into the child's page
+ *       table, copy-on-write unless the area is MAP_SHARED, then
+ *       tlb_flush_all() on the parent. The child then only faults on writes.
  * 5) Prepare the child process to be run on the CPU.
  * 6) Return the child's process id to the parent.
  */
@@ -60,3 +62,40 @@ long do_fork(struct regs *regs)
     NOT_YET_IMPLEMENTED("VM: do_fork");
     return -1;
 }
+
+/*
+ * Like a forked thread, the new thread starts out in userland_entry with a
+ * copy of the caller's registers, but in the caller's own process, and at
+ * entry, on the stack it was given. The stack pointer is set up as if entry
+ * had just been called.
+ */
+long do_thr_create(struct regs *regs, void *entry, void *arg, void *stack,
+                   void *tls, int *exit_word)
+{
+    kthread_t *thr = kthread_create(curproc, NULL, 0, NULL);
+    if (!thr)
+    {
+        return -ENOMEM;
+    }
+    /* not any priority curthr has inherited for the kmutexes it holds */
+    thr->kt_sched_class = thr->kt_base_class = curthr->kt_base_class;
+    thr->kt_priority = thr->kt_base_priority = curthr->kt_base_priority;
+    thr->kt_vruntime = curthr->kt_vruntime;
+    thr->kt_affinity = curthr->kt_affinity;
+    thr->kt_fsbase = (uintptr_t)tls;
+    thr->kt_exit_word = exit_word;
+
+    regs_t uregs = *regs;
+    uregs.r_rip = (uintptr_t)entry;
+    uregs.r_rsp = ((uintptr_t)stack & ~0xfUL) - sizeof(uintptr_t);
+    uregs.r_rdi = (uintptr_t)arg;
+    uregs.r_rax = 0;
+
+    thr->kt_ctx.c_rip = (uintptr_t)userland_entry;
+    thr->kt_ctx.c_rsp = fork_setup_stack(&uregs, thr->kt_kstack);
+    thr->kt_ctx.c_rbp = thr->kt_ctx.c_rsp;
+
+    long tid = thr->kt_tid;
+    sched_make_runnable(thr);
+    return tid;
+}
@@ -0,0 +1,200 @@
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/inits.h"
+#include "main/interrupt.h"
+
+#include "mm/mman.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "proc/futex.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+
+#include "vm/vmmap.h"
+
+/*
+ * Waiters are kept on one of FUTEX_BUCKETS lists, chosen by hashing the
+ * futex they wait on. Each waiter sleeps on a queue of its own, so that
+ * futex_wake() can pick exactly the threads waiting on its futex out of a
+ * bucket shared with others.
+ *
+ * The bucket's spinlock is held from the moment a waiter reads the futex
+ * word until it is asleep, and by futex_wake() while it looks for waiters,
+ * so a wake that follows a change to the word cannot be missed.
+ */
+
+typedef struct futex_key
+{
+    void *fk_obj;    /* the mobj for shared mappings, otherwise the vmmap */
+    uint64_t fk_off; /* offset in the mobj, or the address */
+} futex_key_t;
+
+typedef struct futex_waiter
+{
+    futex_key_t fw_key;
+    ktqueue_t fw_queue;  /* holds only the waiting thread */
+    long fw_woken;       /* set by futex_wake() when it dequeues us */
+    list_link_t fw_link; /* on the bucket's fb_waiters */
+} futex_waiter_t;
+
+typedef struct futex_bucket
+{
+    list_t fb_waiters;
+    spinlock_t fb_lock;
+} futex_bucket_t;
+
+static futex_bucket_t futex_buckets[FUTEX_BUCKETS];
+
+void futex_init()
+{
+    for (size_t i = 0; i < FUTEX_BUCKETS; i++)
+    {
+        list_init(&futex_buckets[i].fb_waiters);
+        spinlock_init(&futex_buckets[i].fb_lock);
+    }
+}
+
+static futex_bucket_t *futex_bucket(futex_key_t *key)
+{
+    uint64_t hash = ((uintptr_t)key->fk_obj >> 4) ^ (key->fk_off >> 2);
+    hash ^= hash >> 17;
+    return &futex_buckets[hash % FUTEX_BUCKETS];
+}
+
+/*
+ * Finds the futex backing uaddr in the current address space, together with
+ * the area it lies in and its page in the area's object. The caller must
+ * hold the vmmap's vmm_lock.
+ */
+static long futex_get_key(int *uaddr, futex_key_t *key, vmarea_t **vmap,
+                          uint64_t *pagenump)
+{
+    if ((uintptr_t)uaddr & (sizeof(int) - 1))
+    {
+        return -EINVAL;
+    }
+    vmmap_t *map = curproc->p_vmmap;
+    vmarea_t *vma = vmmap_lookup(map, ADDR_TO_PN(uaddr));
+    if (!vma || !(vma->vma_prot & PROT_READ))
+    {
+        return -EFAULT;
+    }
+
+    uint64_t pagenum = vma->vma_off + (ADDR_TO_PN(uaddr) - vma->vma_start);
+    if (vma->vma_flags & MAP_SHARED)
+    {
+        key->fk_obj = vma->vma_obj;
+        key->fk_off = pagenum * PAGE_SIZE + PAGE_OFFSET(uaddr);
+    }
+    else
+    {
+        key->fk_obj = map;
+        key->fk_off = (uintptr_t)uaddr;
+    }
+    *vmap = vma;
+    *pagenump = pagenum;
+    return 0;
+}
+
+long futex_wait(int *uaddr, int val)
+{
+    vmmap_t *map = curproc->p_vmmap;
+    futex_waiter_t waiter;
+    vmarea_t *vma;
+    uint64_t pagenum;
+    pframe_t *pf;
+
+    rwlock_read_lock(&map->vmm_lock);
+    long ret = futex_get_key(uaddr, &waiter.fw_key, &vma, &pagenum);
+    if (!ret)
+    {
+        mobj_lock(vma->vma_obj);
+        ret = mobj_get_pframe(vma->vma_obj, pagenum, 0, &pf);
+        mobj_unlock(vma->vma_obj);
+    }
+    if (ret)
+    {
+        rwlock_read_unlock(&map->vmm_lock);
+        return ret == -EINVAL ? ret : -EFAULT;
+    }
+
+    sched_queue_init(&waiter.fw_queue);
+    waiter.fw_woken = 0;
+    futex_bucket_t *b = futex_bucket(&waiter.fw_key);
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&b->fb_lock);
+    int cur = *(volatile int *)((uintptr_t)pf->pf_addr + PAGE_OFFSET(uaddr));
+    pframe_release(&pf);
+    rwlock_read_unlock(&map->vmm_lock);
+    if (cur != val || curthr->kt_cancelled)
+    {
+        spinlock_unlock(&b->fb_lock);
+        intr_setipl(ipl);
+        return cur != val ? -EAGAIN : -EINTR;
+    }
+
+    list_insert_tail(&b->fb_waiters, &waiter.fw_link);
+    sched_cancellable_sleep_on(&waiter.fw_queue, &b->fb_lock);
+
+    /* if we were cancelled rather than woken, we are still on the bucket */
+    spinlock_lock(&b->fb_lock);
+    long woken = waiter.fw_woken;
+    if (!woken)
+    {
+        list_remove(&waiter.fw_link);
+    }
+    spinlock_unlock(&b->fb_lock);
+    intr_setipl(ipl);
+    return woken ? 0 : -EINTR;
+}
+
+long futex_wake(int *uaddr, int nwake)
+{
+    vmmap_t *map = curproc->p_vmmap;
+    futex_key_t key;
+    vmarea_t *vma;
+    uint64_t pagenum;
+
+    rwlock_read_lock(&map->vmm_lock);
+    long ret = futex_get_key(uaddr, &key, &vma, &pagenum);
+    rwlock_read_unlock(&map->vmm_lock);
+    if (ret)
+    {
+        return ret;
+    }
+
+    futex_bucket_t *b = futex_bucket(&key);
+    long woken = 0;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&b->fb_lock);
+    list_iterate(&b->fb_waiters, w, futex_waiter_t, fw_link)
+    {
+        if (woken >= nwake)
+        {
+            break;
+        }
+        if (w->fw_key.fk_obj == key.fk_obj && w->fw_key.fk_off == key.fk_off)
+        {
+            /* the waiter cannot return, and take its waiter_t off the stack,
+             * until we let go of the bucket */
+            list_remove(&w->fw_link);
+            w->fw_woken = 1;
+            sched_wakeup_on(&w->fw_queue, NULL);
+            woken++;
+        }
+    }
+    spinlock_unlock(&b->fb_lock);
+    intr_setipl(ipl);
+    return woken;
+}
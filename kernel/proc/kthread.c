@@ -1,6 +1,10 @@
 // SMP.1 for non-curthr actions; none for curthr
 #include "config.h"
 #include "globals.h"
+#include "main/fpu.h"
+#include "main/interrupt.h"
+#include "mm/page.h"
+#include "mm/reclaim.h"
 #include "mm/slab.h"
 #include "util/debug.h"
 #include "util/string.h"
@@ -10,30 +14,69 @@
  *=========*/
 
 /*
- * Global variable maintaining the current thread on the cpu
+ * Private slab for kthread structs
  */
-kthread_t *curthr CORE_SPECIFIC_DATA;
+static slab_allocator_t *kthread_allocator = NULL;
 
 /*
- * Private slab for kthread structs
+ * Source of thread ids; the first thread gets 1
  */
-static slab_allocator_t *kthread_allocator = NULL;
+static long kthread_next_tid = 0;
+
+/*
+ * Stacks of threads destroyed on this core, most recently freed last, which
+ * are likely to still be in the cache. A stack is a multi-page block, so
+ * reusing one also saves the page allocator a search for contiguous pages.
+ * Only touched by its own core, with interrupts masked.
+ */
+static char *kstack_cache[KSTACK_CACHE] CORE_SPECIFIC_DATA;
+#define kstack_cache CSD(kstack_cache)
+static size_t kstack_cache_count CORE_SPECIFIC_DATA;
+#define kstack_cache_count CSD(kstack_cache_count)
 
 /*=================
  * Helper functions
  *================*/
 
 /*
- * Allocates a new kernel stack. Returns null when not enough memory.
+ * Allocates a new kernel stack, from this core's cache if it has one, and
+ * compacting memory if there is no free block for it. Returns null when not
+ * enough memory.
  */
-static char *alloc_stack() { return page_alloc_n(DEFAULT_STACK_SIZE_PAGES); }
+static char *alloc_stack()
+{
+    char *stack = NULL;
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    if (kstack_cache_count)
+    {
+        stack = kstack_cache[--kstack_cache_count];
+    }
+    intr_setipl(ipl);
+    if (!stack && !(stack = page_alloc_n(DEFAULT_STACK_SIZE_PAGES)) &&
+        reclaim_compact(DEFAULT_STACK_SIZE_PAGES))
+    {
+        stack = page_alloc_n(DEFAULT_STACK_SIZE_PAGES);
+    }
+    return stack;
+}
 
 /*
- * Frees an existing kernel stack.
+ * Frees an existing kernel stack, keeping it in this core's cache unless the
+ * cache is full.
  */
 static void free_stack(char *stack)
 {
-    page_free_n(stack, DEFAULT_STACK_SIZE_PAGES);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    if (kstack_cache_count < KSTACK_CACHE)
+    {
+        kstack_cache[kstack_cache_count++] = stack;
+        stack = NULL;
+    }
+    intr_setipl(ipl);
+    if (stack)
+    {
+        page_free_n(stack, DEFAULT_STACK_SIZE_PAGES);
+    }
 }
 
 /*==========
@@ -47,7 +90,10 @@ void kthread_init()
 {
     KASSERT(__builtin_popcount(DEFAULT_STACK_SIZE_PAGES) == 1 &&
             "stack size should me a power of 2 pages to reduce fragmentation");
-    kthread_allocator = slab_allocator_create("kthread", sizeof(kthread_t));
+    /* threads on different cores are switched at once; keep their
+     * kthread_t's off each other's cache lines */
+    kthread_allocator = slab_allocator_create_flags(
+        "kthread", sizeof(kthread_t), SLAB_CACHE_ALIGN);
     KASSERT(kthread_allocator);
 }
 
@@ -95,6 +141,35 @@ kthread_t *kthread_create(proc_t *proc, kthread_func_t func, long arg1, /// what
     kthread->kt_recent_core=~0UL; /* For SMP */
     kthread->kt_preemption_count = 0;
 
+    kthread->kt_sched_class = SCHED_CLASS_FAIR;
+    kthread->kt_priority = 0;
+    kthread->kt_vruntime = 0;
+    kthread->kt_run_start = 0;
+    kthread->kt_affinity = SCHED_AFFINITY_ALL;
+
+    kthread->kt_tid = __sync_add_and_fetch(&kthread_next_tid, 1);
+    kthread->kt_fsbase = 0;
+    kthread->kt_exit_word = NULL;
+    kthread->kt_pages_read = 0;
+    kthread->kt_nonblock = 0;
+    kthread->kt_fpu = NULL;
+    kthread->kt_utime = 0;
+    kthread->kt_stime = 0;
+    kthread->kt_slice = SCHED_TIMESLICE_TICKS;
+    kthread->kt_runnable_since = 0;
+    kthread->kt_wait_cycles = 0;
+    kthread->kt_nvcsw = 0;
+    kthread->kt_nivcsw = 0;
+    kthread->kt_exclusive = 0;
+    kthread->kt_base_class = SCHED_CLASS_FAIR;
+    kthread->kt_base_priority = 0;
+    kthread->kt_blocked_on = NULL;
+
+    spinlock_lock(&proc->p_threads_lock);
+    list_insert_tail(&proc->p_threads, &kthread->kt_plink);
+    proc->p_nthreads++;
+    spinlock_unlock(&proc->p_threads_lock);
+
     return kthread;
 }
 
@@ -109,7 +184,8 @@ kthread_t *kthread_create(proc_t *proc, kthread_func_t func, long arg1, /// what
  * c_kstacksz. The thread's process should be set outside of this function. Copy
  * over thr's retval, errno, and cancelled; other fields should be freshly
  * initialized. Remember to protect access to thr via its spinlock. See
- * kthread_create() for more hints.
+ * kthread_create() for more hints. The clone inherits thr's scheduling class
+ * and priority, and its virtual run time.
  */
 kthread_t *kthread_clone(kthread_t *thr)
 {
@@ -133,8 +209,19 @@ void kthread_destroy(kthread_t *thr)
     if (thr->kt_state != KT_EXITED)
         panic("destroying thread in state %d\n", thr->kt_state);
     free_stack(thr->kt_kstack);
+    fpu_release(thr);
     if (list_link_is_linked(&thr->kt_plink))
+    {
+        proc_t *proc = thr->kt_proc;
+        spinlock_lock(&proc->p_threads_lock);
+        proc->p_utime += thr->kt_utime;
+        proc->p_stime += thr->kt_stime;
+        proc->p_wait_cycles += thr->kt_wait_cycles;
+        proc->p_nvcsw += thr->kt_nvcsw;
+        proc->p_nivcsw += thr->kt_nivcsw;
         list_remove(&thr->kt_plink);
+        spinlock_unlock(&proc->p_threads_lock);
+    }
 
     spinlock_unlock(&thr->kt_lock);
     slab_obj_free(kthread_allocator, thr);
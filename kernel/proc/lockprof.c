@@ -0,0 +1,240 @@
+#ifdef __LOCKPROF__
+
+#include "config.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+
+#include "proc/kmutex.h"
+#include "proc/lockprof.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+/*
+ * The profiler keeps two tables: the sites at which locks are taken, and the
+ * locks that are held right now (a lock has only one holder at a time, so it
+ * is keyed by address, and released locks are found no matter which thread
+ * or core lets them go). Both are open-addressed and protected by
+ * lockprof_lock, which is only ever held briefly, innermost, and with
+ * interrupts off, since interrupt handlers take locks too.
+ */
+
+/* the functions themselves, not their profiling wrappers */
+#undef spinlock_lock
+#undef spinlock_unlock
+#undef kmutex_lock
+#undef kmutex_unlock
+
+typedef struct lockprof_held
+{
+    void *lh_lock; /* NULL if the slot is free */
+    lockprof_site_t *lh_site;
+    uint64_t lh_since; /* when the lock was acquired */
+} lockprof_held_t;
+
+static lockprof_site_t lockprof_sites[LOCKPROF_NSITES];
+static lockprof_held_t lockprof_held[LOCKPROF_NHELD];
+static size_t lockprof_nlost;
+
+static spinlock_t lockprof_lock = SPINLOCK_INITIALIZER(lockprof_lock);
+
+static long lockprof_enter()
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&lockprof_lock);
+    return enabled;
+}
+
+static void lockprof_leave(long enabled)
+{
+    spinlock_unlock(&lockprof_lock);
+    if (enabled)
+    {
+        intr_enable();
+    }
+}
+
+/*
+ * Find or add the entry of a site, or return NULL if the table is full.
+ */
+static lockprof_site_t *lockprof_find_site(const char *file, long line,
+                                           long type)
+{
+    size_t h = (((uintptr_t)file >> 3) ^ ((size_t)line * 2654435761UL)) %
+               LOCKPROF_NSITES;
+    for (size_t i = 0; i < LOCKPROF_NSITES; i++)
+    {
+        lockprof_site_t *site = &lockprof_sites[(h + i) % LOCKPROF_NSITES];
+        if (!site->ls_file)
+        {
+            memset(site, 0, sizeof(*site));
+            site->ls_file = file;
+            site->ls_line = line;
+            site->ls_type = type;
+            return site;
+        }
+        if (site->ls_file == file && site->ls_line == line &&
+            site->ls_type == type)
+        {
+            return site;
+        }
+    }
+    return NULL;
+}
+
+static size_t lockprof_held_hash(void *lock)
+{
+    return ((uintptr_t)lock >> 3) % LOCKPROF_NHELD;
+}
+
+/*
+ * Record that a lock was acquired at a site, after waiting for the given
+ * number of cycles.
+ */
+static void lockprof_acquired(void *lock, const char *file, long line,
+                              long type, long contended, uint64_t wait,
+                              uint64_t now)
+{
+    long enabled = lockprof_enter();
+    lockprof_site_t *site = lockprof_find_site(file, line, type);
+    lockprof_held_t *held = NULL;
+    size_t h = lockprof_held_hash(lock);
+    for (size_t i = 0; site && i < LOCKPROF_NHELD; i++)
+    {
+        if (!lockprof_held[(h + i) % LOCKPROF_NHELD].lh_lock)
+        {
+            held = &lockprof_held[(h + i) % LOCKPROF_NHELD];
+            break;
+        }
+    }
+    if (!held)
+    {
+        lockprof_nlost++;
+        lockprof_leave(enabled);
+        return;
+    }
+
+    site->ls_acquisitions++;
+    site->ls_contended += contended;
+    site->ls_wait_total += wait;
+    site->ls_wait_max = MAX(site->ls_wait_max, wait);
+    held->lh_lock = lock;
+    held->lh_site = site;
+    held->lh_since = now;
+    lockprof_leave(enabled);
+}
+
+/*
+ * Charge the time a lock was held to the site that acquired it.
+ */
+static void lockprof_released(void *lock)
+{
+    uint64_t now = cpuid_rdtsc();
+    long enabled = lockprof_enter();
+    size_t h = lockprof_held_hash(lock);
+    for (size_t i = 0; i < LOCKPROF_NHELD; i++)
+    {
+        lockprof_held_t *held = &lockprof_held[(h + i) % LOCKPROF_NHELD];
+        if (held->lh_lock == lock)
+        {
+            uint64_t hold = now - held->lh_since;
+            held->lh_site->ls_hold_total += hold;
+            held->lh_site->ls_hold_max = MAX(held->lh_site->ls_hold_max, hold);
+            held->lh_lock = NULL;
+            break;
+        }
+    }
+    lockprof_leave(enabled);
+}
+
+void lockprof_spinlock_lock(spinlock_t *lock, const char *file, long line)
+{
+#ifdef __SMP__
+    long contended = lock->s_next != lock->s_serving;
+#else
+    long contended = 0;
+#endif
+    uint64_t start = cpuid_rdtsc();
+    spinlock_lock(lock);
+    uint64_t now = cpuid_rdtsc();
+    lockprof_acquired(lock, file, line, LOCKPROF_SPINLOCK, contended,
+                      now - start, now);
+}
+
+void lockprof_spinlock_unlock(spinlock_t *lock)
+{
+    lockprof_released(lock);
+    spinlock_unlock(lock);
+}
+
+void lockprof_kmutex_lock(kmutex_t *mtx, const char *file, long line)
+{
+    long contended = mtx->km_holder != NULL;
+    uint64_t start = cpuid_rdtsc();
+    kmutex_lock(mtx);
+    uint64_t now = cpuid_rdtsc();
+    lockprof_acquired(mtx, file, line, LOCKPROF_KMUTEX, contended,
+                      now - start, now);
+}
+
+void lockprof_kmutex_unlock(kmutex_t *mtx)
+{
+    lockprof_released(mtx);
+    kmutex_unlock(mtx);
+}
+
+size_t lockprof_top(lockprof_site_t *sites, size_t max)
+{
+    size_t n = 0;
+    long enabled = lockprof_enter();
+    for (size_t i = 0; i < LOCKPROF_NSITES; i++)
+    {
+        lockprof_site_t *site = &lockprof_sites[i];
+        if (!site->ls_file || !site->ls_acquisitions)
+        {
+            continue;
+        }
+        /* insertion into the sorted prefix, dropping the smallest */
+        size_t j = n < max ? n++ : max;
+        while (j && sites[j - 1].ls_wait_total < site->ls_wait_total)
+        {
+            if (j < max)
+            {
+                sites[j] = sites[j - 1];
+            }
+            j--;
+        }
+        if (j < max)
+        {
+            sites[j] = *site;
+        }
+    }
+    lockprof_leave(enabled);
+    return n;
+}
+
+size_t lockprof_lost() { return lockprof_nlost; }
+
+void lockprof_reset()
+{
+    long enabled = lockprof_enter();
+    for (size_t i = 0; i < LOCKPROF_NSITES; i++)
+    {
+        lockprof_site_t *site = &lockprof_sites[i];
+        site->ls_acquisitions = 0;
+        site->ls_contended = 0;
+        site->ls_wait_total = 0;
+        site->ls_wait_max = 0;
+        site->ls_hold_total = 0;
+        site->ls_hold_max = 0;
+    }
+    lockprof_nlost = 0;
+    lockprof_leave(enabled);
+}
+
+#endif /* __LOCKPROF__ */
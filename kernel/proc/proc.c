@@ -1,17 +1,23 @@
 // SMP.1 + SMP.3
 // spinlock + mask interrupts
+#include "api/syscall.h"
 #include "config.h"
 #include "errno.h"
+#include "fs/fdtable.h"
 #include "fs/file.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "globals.h"
 #include "kernel.h"
+#include "mm/memgroup.h"
 #include "mm/slab.h"
+#include "proc/rcu.h"
 #include "util/debug.h"
 #include "util/printf.h"
 #include "util/string.h"
 #include "util/time.h"
+#include "vm/pagefault.h"
+#include "vm/vmmap.h"
 #include <drivers/screen.h>
 #include <fs/vfs_syscall.h>
 #include <main/apic.h>
@@ -20,17 +26,24 @@
  * Variables
  *=========*/
 
-/*
- * Global variable that maintains the current process
- */
-proc_t *curproc CORE_SPECIFIC_DATA;
-
 /*
  * Global list of all processes (except for the idle process) and its lock
  */
 static list_t proc_list = LIST_INITIALIZER(proc_list);
 static spinlock_t proc_list_lock = SPINLOCK_INITIALIZER(proc_list_lock);
 
+/*
+ * The processes on proc_list by pid, and a bitmap of the pids in use; a pid
+ * is taken until its process is destroyed, so exited processes that have not
+ * been waited for keep theirs. Bit 0 belongs to the idle processes, which are
+ * not in the hash. The bitmap is protected by proc_list_lock, the hash by its
+ * bucket locks, so that lookups do not contend with fork and exit.
+ */
+#define PROC_PID_WORDS (PROC_MAX_COUNT / 64)
+
+static htable_t proc_hash;
+static uint64_t proc_pids[PROC_PID_WORDS] = {1};
+
 /*
  * Allocator for process descriptors
  */
@@ -41,7 +54,9 @@ static slab_allocator_t *proc_allocator = NULL;
  * Each core has its own idleproc, so the idleproc is stored in static memory
  * rather than in the global process list
  */
+#undef idleproc
 proc_t idleproc CORE_SPECIFIC_DATA;
+#define idleproc CSD(idleproc)
 
 /*
  * Pointer to the init process
@@ -59,6 +74,9 @@ void proc_init()
 {
     proc_allocator = slab_allocator_create("proc", sizeof(proc_t));
     KASSERT(proc_allocator);
+    long ret = htable_init(&proc_hash, PROC_HASH_NBUCKETS);
+    KASSERT(!ret);
+    spinlock_stats_register(&proc_list_lock, "proc_list");
 }
 
 /*
@@ -71,11 +89,16 @@ void proc_idleproc_init()
 
     proc->p_pid = 0;
     list_init(&proc->p_threads);
+    spinlock_init(&proc->p_threads_lock);
+    proc->p_nthreads = 0;
     list_init(&proc->p_children);
+    list_init(&proc->p_zombies);
     proc->p_pproc = NULL;
 
     list_link_init(&proc->p_child_link);
+    list_link_init(&proc->p_zombie_link);
     list_link_init(&proc->p_list_link);
+    htable_link_init(&proc->p_hash_link);
 
     spinlock_init(&proc->p_children_lock);
 
@@ -83,6 +106,7 @@ void proc_idleproc_init()
     proc->p_state = PROC_RUNNING;
 
     memset(&proc->p_wait, 0, sizeof(ktqueue_t)); // should not be used
+    proc->p_waitpid = 0;
 
     proc->p_pml4 = pt_get();
     #ifdef __VM__
@@ -91,7 +115,20 @@ void proc_idleproc_init()
 
     proc->p_cwd = NULL;
 
-    memset(proc->p_files, 0, sizeof(proc->p_files));
+    proc->p_files = NULL;
+    kmutex_init(&proc->p_files_mutex);
+
+    proc->p_faults = 0;
+    proc->p_fault_reads = 0;
+    proc->p_memgroup = MEMGROUP_ROOT;
+    proc->p_ioprio = IOPRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+    proc->p_utime = 0;
+    proc->p_stime = 0;
+    proc->p_cutime = 0;
+    proc->p_cstime = 0;
+    proc->p_wait_cycles = 0;
+    proc->p_nvcsw = 0;
+    proc->p_nivcsw = 0;
 
     char name[8];
     snprintf(name, sizeof(name), "idle%ld", curcore.kc_id);
@@ -99,8 +136,8 @@ void proc_idleproc_init()
     proc->p_name[PROC_NAME_LEN - 1] = '\0';
 
     dbg(DBG_PROC, "created %s\n", proc->p_name);
-    curproc = &idleproc;
-    curthr = NULL;
+    csd_set_curproc(&idleproc);
+    csd_set_curthr(NULL);
 }
 
 /*=================
@@ -108,39 +145,57 @@ void proc_idleproc_init()
  *================*/
 
 /*
- * Gets the next available process ID (pid).
+ * Gets the next available process ID (pid), the first free one from next_pid
+ * on, wrapping around, and marks it in use. Pids are searched for a word of
+ * the bitmap at a time. Returns -1 if all of them are in use.
  */
 static pid_t next_pid = 1;
 static pid_t _proc_getid()
 {
     spinlock_lock(&proc_list_lock);
-    pid_t pid = next_pid;
-restart:
-    list_iterate(&proc_list, p, proc_t, p_list_link)
+    pid_t pid = -1;
+    size_t word = next_pid / 64;
+    /* the pids before next_pid in its word are taken last, on wrapping */
+    uint64_t used = proc_pids[word] | ((1UL << (next_pid % 64)) - 1);
+    for (size_t i = 0; i <= PROC_PID_WORDS; i++)
     {
-        if (p->p_pid == pid)
+        if (~used)
         {
-            pid = pid + 1 == PROC_MAX_COUNT ? 1 : pid + 1;
-            if (pid == next_pid)
-            {
-                spinlock_unlock(&proc_list_lock);
-                return -1;
-            }
-            else
-            {
-                goto restart;
-            }
+            pid = (pid_t)(word * 64 + __builtin_ctzl(~used));
+            break;
         }
+        word = (word + 1) % PROC_PID_WORDS;
+        used = proc_pids[word];
+    }
+    if (pid != -1)
+    {
+        KASSERT(pid);
+        proc_pids[pid / 64] |= 1UL << (pid % 64);
+        next_pid = pid + 1 == PROC_MAX_COUNT ? 1 : pid + 1;
     }
-    next_pid = pid + 1 == PROC_MAX_COUNT ? 1 : pid + 1;
-    KASSERT(pid);
     spinlock_unlock(&proc_list_lock);
     return pid;
 }
 
 /*
- * Searches the global process list for the process descriptor corresponding to
- * a pid.
+ * Gives back a pid from _proc_getid(). proc_list_lock must be held.
+ */
+static void _proc_putid_locked(pid_t pid)
+{
+    KASSERT(pid > 0 && pid < PROC_MAX_COUNT);
+    KASSERT(proc_pids[pid / 64] & (1UL << (pid % 64)));
+    proc_pids[pid / 64] &= ~(1UL << (pid % 64));
+}
+
+static void _proc_putid(pid_t pid)
+{
+    spinlock_lock(&proc_list_lock);
+    _proc_putid_locked(pid);
+    spinlock_unlock(&proc_list_lock);
+}
+
+/*
+ * Looks up the process descriptor corresponding to a pid.
  */
 proc_t *proc_lookup(pid_t pid)
 {
@@ -148,17 +203,106 @@ proc_t *proc_lookup(pid_t pid)
     {
         return &idleproc;
     }
+    /* a proc_t is only freed a grace period after it leaves the hash */
+    rcu_read_lock();
+    htable_link_t *link =
+        htable_lookup_rcu(&proc_hash, (uint64_t)pid, NULL, NULL);
+    rcu_read_unlock();
+    return link ? CONTAINER_OF(link, proc_t, p_hash_link) : NULL;
+}
+
+long proc_pid_info(pid_t pid, long (*fill)(proc_t *proc, char *buf, size_t size),
+                   char *buf, size_t size)
+{
+    long ret = -ESRCH;
+    /* proc_destroy() takes proc_list_lock before tearing the process down,
+     * so one still found here stays */
+    spinlock_lock(&proc_list_lock);
+    proc_t *proc = proc_lookup(pid);
+    if (proc)
+    {
+        ret = fill(proc, buf, size);
+    }
+    spinlock_unlock(&proc_list_lock);
+    return ret;
+}
+
+pid_t proc_next_pid(pid_t pid)
+{
+    pid = MAX(pid, 1);
+    spinlock_lock(&proc_list_lock);
+    while (pid < PROC_MAX_COUNT)
+    {
+        uint64_t used = proc_pids[pid / 64] >> (pid % 64);
+        if (used)
+        {
+            pid += __builtin_ctzl(used);
+            break;
+        }
+        pid = (pid / 64 + 1) * 64;
+    }
+    spinlock_unlock(&proc_list_lock);
+    return pid < PROC_MAX_COUNT ? pid : -1;
+}
+
+pid_t proc_oom_kill(size_t *rssp)
+{
+    proc_t *victim = NULL;
+    size_t victim_rss = 0;
     spinlock_lock(&proc_list_lock);
     list_iterate(&proc_list, p, proc_t, p_list_link)
     {
-        if (p->p_pid == pid)
+        if (p == curproc || p->p_pid == PID_IDLE || p->p_pid == PID_INIT ||
+            p->p_state == PROC_DEAD || !p->p_vmmap)
         {
-            spinlock_unlock(&proc_list_lock);
-            return p;
+            continue;
+        }
+        size_t rss = vmmap_rss(p->p_vmmap);
+        if (rss > victim_rss)
+        {
+            victim = p;
+            victim_rss = rss;
         }
     }
+    /* proc_destroy() takes proc_list_lock first, so the victim stays */
+    pid_t pid = 0;
+    if (victim)
+    {
+        pid = victim->p_pid;
+        proc_kill(victim, -1);
+    }
     spinlock_unlock(&proc_list_lock);
-    return NULL;
+    *rssp = victim_rss;
+    return pid;
+}
+
+void proc_cpu_times(proc_t *proc, uint64_t *utime, uint64_t *stime)
+{
+    spinlock_lock(&proc->p_threads_lock);
+    *utime = proc->p_utime;
+    *stime = proc->p_stime;
+    list_iterate(&proc->p_threads, thr, kthread_t, kt_plink)
+    {
+        *utime += thr->kt_utime;
+        *stime += thr->kt_stime;
+    }
+    spinlock_unlock(&proc->p_threads_lock);
+}
+
+void proc_sched_stats(proc_t *proc, uint64_t *wait_cycles, uint64_t *nvcsw,
+                      uint64_t *nivcsw)
+{
+    spinlock_lock(&proc->p_threads_lock);
+    *wait_cycles = proc->p_wait_cycles;
+    *nvcsw = proc->p_nvcsw;
+    *nivcsw = proc->p_nivcsw;
+    list_iterate(&proc->p_threads, thr, kthread_t, kt_plink)
+    {
+        *wait_cycles += thr->kt_wait_cycles;
+        *nvcsw += thr->kt_nvcsw;
+        *nivcsw += thr->kt_nivcsw;
+    }
+    spinlock_unlock(&proc->p_threads_lock);
 }
 
 /*==========
@@ -195,49 +339,71 @@ proc_t *proc_create(const char *name)
     proc = (proc_t *)slab_obj_alloc(proc_allocator);
     if (proc == NULL) /// do I need this?
     {
+        _proc_putid(pid);
         return NULL;
     }
     pml4_t *pt = pt_create();
     if (pt == NULL)
     {
         slab_obj_free(proc_allocator, proc);
+        _proc_putid(pid);
         return NULL;
     }
 
     proc->p_pid = pid;
-    list_init(&proc->p_threads);           
+    list_init(&proc->p_threads);
+    spinlock_init(&proc->p_threads_lock);
+    proc->p_nthreads = 0;
     list_init(&proc->p_children);
+    list_init(&proc->p_zombies);
     proc->p_pproc = curproc;
     list_link_init(&proc->p_child_link);
+    list_link_init(&proc->p_zombie_link);
     list_link_init(&proc->p_list_link);
+    htable_link_init(&proc->p_hash_link);
     spinlock_init(&proc->p_children_lock);
     proc->p_status = 0;
     proc->p_state = PROC_RUNNING; /// what to set this to?
     proc->p_pml4 = pt;
     sched_queue_init(&proc->p_wait);
-
+    proc->p_waitpid = 0;
 
     if (pid == PID_INIT) /// place this earlier? yes
     {
         proc_initproc = proc;
     }
+    spinlock_lock(&proc_list_lock);
     list_insert_tail(&proc_list, &proc->p_list_link);
-    list_insert_tail(&proc->p_pproc->p_children, &proc->p_child_link);
+    spinlock_unlock(&proc_list_lock);
+    /* outside proc_list_lock, as adding to the hash may grow it */
+    htable_bucket_t *bucket = htable_lock(&proc_hash, (uint64_t)pid);
+    htable_insert(&proc_hash, bucket, &proc->p_hash_link, (uint64_t)pid);
+    htable_unlock(&proc_hash, bucket);
+    spinlock_lock(&curproc->p_children_lock);
+    list_insert_tail(&curproc->p_children, &proc->p_child_link);
+    spinlock_unlock(&curproc->p_children_lock);
 
     // for VFS:
+    proc->p_files = NULL;
+    kmutex_init(&proc->p_files_mutex);
+
+    proc->p_faults = 0;
+    proc->p_fault_reads = 0;
+    memgroup_proc_init(proc);
+    proc->p_ioprio = curproc->p_ioprio;
+    proc->p_utime = 0;
+    proc->p_stime = 0;
+    proc->p_cutime = 0;
+    proc->p_cstime = 0;
+    proc->p_wait_cycles = 0;
+    proc->p_nvcsw = 0;
+    proc->p_nivcsw = 0;
+
 #ifdef __VFS__
-    
-    for (int i = 0; i < NFILES; i++)
-    {
-        // const void *filler = NULL
-        //fget(i);
-        //dbginfo(DBG_PROC, proc_info, curproc->p_vmmap);
-        proc->p_files[i] = curproc->p_files[i];
-        if (proc->p_files[i] != NULL)
-        {
-            fref(proc->p_files[i]);
-        } 
-    }
+    /* the table is copied once either process changes it */
+    long locked = proc_files_lock();
+    proc->p_files = fdtable_ref(curproc->p_files);
+    proc_files_unlock(locked);
     if (curproc->p_cwd != NULL)
     {
         proc->p_cwd = curproc->p_cwd;
@@ -288,12 +454,12 @@ void proc_cleanup(long status)
     // KASSERT(NULL != proc->p_files);
     proc->p_state = PROC_DEAD; 
     proc->p_status = status;
+    pagefault_report(proc);
 
 #ifdef __VFS__
-    for (int fd = 0; fd < NFILES; fd++)
+    if (proc->p_files)
     {
-        //if (proc->p_files[fd])
-        do_close(fd);
+        fdtable_put(&proc->p_files);
     }
     if (proc->p_cwd)
     {
@@ -307,15 +473,31 @@ void proc_cleanup(long status)
     }
     else
     {
+        /* children that already exited stay zombies, now init's; init only
+         * needs waking for them if it waits on any child */
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&proc->p_children_lock);
+        spinlock_lock(&proc_initproc->p_children_lock);
         list_iterate(&proc->p_children, p, proc_t, p_child_link)
         {
             p->p_pproc = proc_initproc;
-            // remove from whatever que it was on
-            //list_insert_tail(&proc_initproc->p_children, &p->p_child_link); /// is this call correct?
             list_remove(&p->p_child_link);
             list_insert_head(&proc_initproc->p_children, &p->p_child_link);
-
         }
+        long wake = !list_empty(&proc->p_zombies) &&
+                    proc_initproc->p_waitpid == -1;
+        list_iterate(&proc->p_zombies, p, proc_t, p_zombie_link)
+        {
+            list_remove(&p->p_zombie_link);
+            list_insert_tail(&proc_initproc->p_zombies, &p->p_zombie_link);
+        }
+        spinlock_unlock(&proc_initproc->p_children_lock);
+        spinlock_unlock(&proc->p_children_lock);
+        if (wake)
+        {
+            sched_broadcast_on(&proc_initproc->p_wait);
+        }
+        intr_setipl(ipl);
     }
     
 
@@ -324,8 +506,38 @@ void proc_cleanup(long status)
 }
 
 /*
- * Cleans up the current process and the current thread, broadcasts on its
- * parent's p_wait, then forces a context switch. After this, the process is
+ * Queues curproc, which has exited, on its parent's p_zombies, and wakes the
+ * parent if it is waiting for this process or for any child. The parent is
+ * checked again once locked, as it may have exited and handed its children
+ * to init in the meantime.
+ */
+static void proc_zombify()
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    proc_t *parent;
+    while (1)
+    {
+        parent = curproc->p_pproc;
+        spinlock_lock(&parent->p_children_lock);
+        if (parent == curproc->p_pproc)
+        {
+            break;
+        }
+        spinlock_unlock(&parent->p_children_lock);
+    }
+    list_insert_tail(&parent->p_zombies, &curproc->p_zombie_link);
+    long wake = parent->p_waitpid == -1 || parent->p_waitpid == curproc->p_pid;
+    spinlock_unlock(&parent->p_children_lock);
+    if (wake)
+    {
+        sched_broadcast_on(&parent->p_wait);
+    }
+    intr_setipl(ipl);
+}
+
+/*
+ * Cleans up the current process and the current thread, queues it on its
+ * parent's p_zombies, then forces a context switch. After this, the process is
  * essentially dead -- this function does not return. The parent must eventually
  * finish destroying the process.
  *
@@ -340,13 +552,48 @@ void proc_thread_exiting(void *retval)
 {
     NOT_YET_IMPLEMENTED("PROCS: proc_thread_exiting");
     /// IS THIS ALL?
+
+    /* Only the last thread out cleans up the process; the others stay on
+     * p_threads until the process is destroyed. */
+    spinlock_lock(&curproc->p_threads_lock);
+    long last = !--curproc->p_nthreads;
+    spinlock_unlock(&curproc->p_threads_lock);
+    if (!last)
+    {
+        curthr->kt_state = KT_EXITED;
+        curthr->kt_retval = retval;
+        sched_switch(NULL, NULL);
+    }
+
     proc_cleanup((long)retval);
     curthr->kt_state = KT_EXITED;
     curthr->kt_retval = retval;
-    sched_broadcast_on(&curproc->p_pproc->p_wait); // on parent's pwait
+    proc_zombify();
     sched_switch(NULL, NULL); /// arguments?
 }
 
+/*
+ * The file table of a process is only locked once it has several threads:
+ * until then, the only thread is also the only one that could start another.
+ */
+long proc_files_lock()
+{
+    if (curproc->p_nthreads <= 1)
+    {
+        return 0;
+    }
+    kmutex_lock(&curproc->p_files_mutex);
+    return 1;
+}
+
+void proc_files_unlock(long locked)
+{
+    if (locked)
+    {
+        kmutex_unlock(&curproc->p_files_mutex);
+    }
+}
+
 /*
  * Cancels all the threads of proc. This should never be called on curproc.
  * 
@@ -384,6 +631,11 @@ void proc_kill_all()
     NOT_YET_IMPLEMENTED("PROCS: proc_kill_all");
 }
 
+static void proc_free_rcu(rcu_head_t *head)
+{
+    slab_obj_free(proc_allocator, CONTAINER_OF(head, proc_t, p_rcu));
+}
+
 /*
  * Destroy / free everything from proc. Be sure to remember reference counting
  * when working on VFS.
@@ -394,8 +646,13 @@ void proc_kill_all()
  */
 void proc_destroy(proc_t *proc)
 {
+    htable_bucket_t *bucket = htable_lock(&proc_hash, (uint64_t)proc->p_pid);
+    htable_remove(&proc_hash, bucket, &proc->p_hash_link);
+    htable_unlock(&proc_hash, bucket);
+
     spinlock_lock(&proc_list_lock);
     list_remove(&proc->p_list_link);
+    _proc_putid_locked(proc->p_pid);
     spinlock_unlock(&proc_list_lock);
 
     list_iterate(&proc->p_threads, thr, kthread_t, kt_plink)
@@ -403,11 +660,17 @@ void proc_destroy(proc_t *proc)
         kthread_destroy(thr);
     }
 
+    /* its threads' times are all in p_utime and p_stime now */
+    if (proc->p_pproc)
+    {
+        proc->p_pproc->p_cutime += proc->p_utime + proc->p_cutime;
+        proc->p_pproc->p_cstime += proc->p_stime + proc->p_cstime;
+    }
+
 #ifdef __VFS__
-    for (int fd = 0; fd < NFILES; fd++)
+    if (proc->p_files)
     {
-        if (proc->p_files[fd])
-            fput(proc->p_files + fd);
+        fdtable_put(&proc->p_files);
     }
     if (proc->p_cwd)
     {
@@ -420,12 +683,14 @@ void proc_destroy(proc_t *proc)
         vmmap_destroy(&proc->p_vmmap);
 #endif
 
+    memgroup_proc_exit(proc);
+
     dbg(DBG_THR, "destroying P%d\n", proc->p_pid);
 
     KASSERT(proc->p_pml4);
     pt_destroy(proc->p_pml4);
 
-    slab_obj_free(proc_allocator, proc);
+    rcu_call(&proc->p_rcu, proc_free_rcu);
 }
 
 /*=============
@@ -454,98 +719,79 @@ void proc_destroy(proc_t *proc)
  * processes should be ignored.
  * If waiting on any child (-1), do_waitpid can return when *any* child has exited,
  * it does not have to return the one that exited earliest.
+ *
+ * Exited children are found on curproc's p_zombies, and a specific pid by
+ * proc_lookup(), so reaping does not scan p_children. Children only wake
+ * curproc when p_waitpid says it is waiting for them.
  */
-pid_t do_waitpid(pid_t pid, int *status, int options) /// is the parent process the current process?
+pid_t do_waitpid(pid_t pid, int *status, int options)
 {
-    NOT_YET_IMPLEMENTED("PROCS: do_waitpid"); 
     if (pid == 0 || (pid < 0 && pid != -1) || options != 0)
     {
         return -ENOTSUP;
     }
+
+    /* only curproc's own exit could hand a child of curproc to init */
+    proc_t *target = NULL;
     if (pid > 0)
     {
-        list_iterate(&curproc->p_children, child, proc_t, p_child_link)
+        target = proc_lookup(pid);
+        if (target == NULL || target->p_pproc != curproc)
         {
-            if (child->p_pid == pid) 
-            {
-                if (child->p_state == PROC_DEAD)
-                {
-                    if (status != NULL)
-                    {
-                        *status = child->p_status;
-                    }
-                    list_remove(&child->p_child_link);
-                    proc_destroy(child);
-                    return pid;
-                }
-                else
-                {
-                    sched_sleep_on(&curproc->p_wait, NULL); /// what lock to pass in?
-                    if (status != NULL)
-                    {
-                        *status = child->p_status;
-                    }
-                    list_remove(&child->p_child_link);
-                    proc_destroy(child);
-                    return pid;
-                }
-            }
-            else {
-                return -ECHILD;
-                }
+            return -ECHILD;
         }
     }
-    else if (pid == -1)
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&curproc->p_children_lock);
+    proc_t *child = NULL;
+    while (1)
     {
-        if (list_empty(&curproc->p_children))
+        if (target != NULL)
         {
-            return -ECHILD;
+            if (list_link_is_linked(&target->p_zombie_link))
+            {
+                child = target;
+            }
         }
-        else
+        else if (!list_empty(&curproc->p_zombies))
         {
-            while(1){
-                list_iterate(&curproc->p_children, child, proc_t, p_child_link)
-                {
-                    if (child->p_state == PROC_DEAD)
-                    {
-                        if (status != NULL)
-                        {
-                            *status = child->p_status;
-                        }
-                        list_remove(&child->p_child_link);
-                        proc_destroy(child);
-                        return child->p_pid;
-                    }
-                }
-                sched_sleep_on(&curproc->p_wait, NULL);
-            }
-            
+            child = list_head(&curproc->p_zombies, proc_t, p_zombie_link);
+        }
+        else if (list_empty(&curproc->p_children))
+        {
+            break;
+        }
+        if (child != NULL)
+        {
+            break;
         }
+        curproc->p_waitpid = pid;
+        sched_sleep_on(&curproc->p_wait, &curproc->p_children_lock);
+        spinlock_lock(&curproc->p_children_lock);
+    }
+    curproc->p_waitpid = 0;
+    if (child != NULL)
+    {
+        list_remove(&child->p_zombie_link);
+        list_remove(&child->p_child_link);
+    }
+    spinlock_unlock(&curproc->p_children_lock);
+    intr_setipl(ipl);
 
-    return 0;
+    if (child == NULL)
+    {
+        return -ECHILD;
     }
-    return 0;
+    pid = child->p_pid;
+    if (status != NULL)
+    {
+        *status = (int)child->p_status;
+    }
+    proc_destroy(child);
+    return pid;
 }
 
-            // rest not needed
-            
-         
-        //     sched_sleep_on(&curproc->p_wait);
-        //     list_iterate(&curproc->p_children, child, proc_t, p_child_link)
-        //     {
-        //         if (child->p_state == PROC_DEAD)
-        //         {
-        //             if (status != NULL)
-        //             {
-        //                 *status = child->p_status;
-        //             }
-        //             list_remove(&child->p_child_link);
-        //             proc_destroy(child);
-        //             return child->p_pid;
-        //         }
-        //     }
-        // }
-
 /*
  * Wrapper around kthread_exit.
  */
@@ -553,6 +799,18 @@ void do_exit(long status)
 {
     NOT_YET_IMPLEMENTED("PROCS: do_exit");
 
+    /* The other threads exit with the same status as they next leave the
+     * kernel, the last of them cleaning up the process. */
+    spinlock_lock(&curproc->p_threads_lock);
+    list_iterate(&curproc->p_threads, thr, kthread_t, kt_plink)
+    {
+        if (thr != curthr && thr->kt_state != KT_EXITED)
+        {
+            kthread_cancel(thr, (void *)status);
+        }
+    }
+    spinlock_unlock(&curproc->p_threads_lock);
+
     kthread_exit((void *)status); /// just this?
 }
 
@@ -615,8 +873,50 @@ size_t proc_info(const void *arg, char *buf, size_t osize)
 #ifdef __VM__
     iprintf(&buf, &size, "start brk:    0x%p\n", p->p_start_brk);
     iprintf(&buf, &size, "brk:          0x%p\n", p->p_brk);
+    iprintf(&buf, &size, "page faults:  %lu (%lu pages read in)\n",
+            p->p_faults, p->p_fault_reads);
 #endif
+    iprintf(&buf, &size, "memory group: %ld\n", p->p_memgroup);
+    iprintf(&buf, &size, "io priority:  class %d level %d\n",
+            IOPRIO_CLASS(p->p_ioprio), IOPRIO_LEVEL(p->p_ioprio));
+
+    uint64_t utime, stime;
+    proc_cpu_times((proc_t *)p, &utime, &stime);
+    iprintf(&buf, &size, "cpu time:     %lu user, %lu system ticks\n", utime,
+            stime);
+    iprintf(&buf, &size, "child time:   %lu user, %lu system ticks\n",
+            p->p_cutime, p->p_cstime);
+
+    return size;
+}
+
+size_t proc_stat_info(const void *arg, char *buf, size_t osize)
+{
+    proc_t *p = (proc_t *)arg;
+    size_t size = osize;
+
+    KASSERT(NULL != p);
+    KASSERT(NULL != buf);
 
+    uint64_t utime, stime;
+    proc_cpu_times(p, &utime, &stime);
+    uint64_t wait_cycles, nvcsw, nivcsw;
+    proc_sched_stats(p, &wait_cycles, &nvcsw, &nivcsw);
+    size_t rss = 0;
+#ifdef __VM__
+    if (p->p_vmmap)
+    {
+        rss = vmmap_rss(p->p_vmmap);
+    }
+#endif
+    iprintf(&buf, &size,
+            "pid=%i name=%s state=%s ppid=%i threads=%ld rss=%lu faults=%lu "
+            "fault_reads=%lu utime=%lu stime=%lu cutime=%lu cstime=%lu "
+            "wait_cycles=%lu nvcsw=%lu nivcsw=%lu\n",
+            p->p_pid, p->p_name, p->p_state == PROC_DEAD ? "dead" : "running",
+            p->p_pproc ? p->p_pproc->p_pid : 0, p->p_nthreads, rss, p->p_faults,
+            p->p_fault_reads, utime, stime, p->p_cutime, p->p_cstime,
+            wait_cycles, nvcsw, nivcsw);
     return size;
 }
 
@@ -0,0 +1,253 @@
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/apic.h"
+#include "main/interrupt.h"
+#include "main/smp.h"
+
+#include "mm/slab.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/rcu.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/time.h"
+#include "util/timer.h"
+
+/*
+ * Grace periods are numbered. Starting one bumps rcu_gp_seq; each core copies
+ * it into its rc_seq at its quiescent states, so the grace period numbered
+ * seq has passed once every core that is up has rc_seq >= seq, or is idle.
+ * Each core writes only its own cache line, and only when rcu_gp_seq has
+ * moved on, so that context switches do not bounce anything between cores.
+ */
+typedef struct rcu_core
+{
+    volatile uint64_t rc_seq;
+    volatile long rc_idle;
+} __attribute__((aligned(SLAB_CACHE_LINE_SIZE))) rcu_core_t;
+
+static volatile uint64_t rcu_gp_seq;
+static rcu_core_t rcu_cores[MAX_LAPICS];
+
+/* protects everything below; taken at IPL_HIGH, as rcu_call() may be called
+ * from interrupt context */
+static spinlock_t rcu_lock = SPINLOCK_INITIALIZER(rcu_lock);
+static rcu_head_t *rcu_pending; /* callbacks waiting for the next batch */
+static rcu_head_t **rcu_pending_tail = &rcu_pending;
+static long rcu_stopping;
+static long rcu_running;
+static kthread_t *rcu_thread;
+static ktqueue_t rcu_waitq;      /* the thread, for callbacks or a tick */
+static ktqueue_t rcu_stop_waitq; /* rcu_stop(), for the thread to finish */
+static ktqueue_t rcu_sync_waitq; /* rcu_synchronize(), for its callback */
+static timer_t rcu_timer;
+
+static uint64_t rcu_ngps;
+static uint64_t rcu_ncallbacks;
+
+void rcu_quiescent()
+{
+    rcu_core_t *rc = &rcu_cores[curcore.kc_id];
+    uint64_t seq = __atomic_load_n(&rcu_gp_seq, __ATOMIC_ACQUIRE);
+    if (rc->rc_seq != seq)
+    {
+        /* whatever this core read before is done with */
+        __atomic_store_n(&rc->rc_seq, seq, __ATOMIC_RELEASE);
+    }
+}
+
+void rcu_idle_enter()
+{
+    rcu_quiescent();
+    __atomic_store_n(&rcu_cores[curcore.kc_id].rc_idle, 1, __ATOMIC_RELEASE);
+}
+
+void rcu_idle_exit()
+{
+    rcu_cores[curcore.kc_id].rc_idle = 0;
+    /* a grace period that sees this core idle must not miss what it reads
+     * next, so the store has to be visible before any of those loads */
+    __sync_synchronize();
+}
+
+static long rcu_gp_passed(uint64_t seq)
+{
+    for (long core = 0; core < MAX_LAPICS; core++)
+    {
+        rcu_core_t *rc = &rcu_cores[core];
+        if (csd_vaddr_table[core] && !rc->rc_idle && rc->rc_seq < seq)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void rcu_timer_fire(uint64_t data)
+{
+    sched_wakeup_on(&rcu_waitq, NULL);
+}
+
+/*
+ * Wait for a grace period to pass, checking every tick. Cores that are busy
+ * switch, or take a tick in user mode, at least once a timeslice.
+ */
+static void rcu_wait_gp()
+{
+    uint64_t seq = __sync_add_and_fetch(&rcu_gp_seq, 1);
+    /* order the updates that come before the grace period (and the store
+     * above) before looking at the cores; see rcu_idle_exit() */
+    __sync_synchronize();
+
+    while (!rcu_gp_passed(seq))
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&rcu_lock);
+        timer_init(&rcu_timer);
+        rcu_timer.function = rcu_timer_fire;
+        rcu_timer.expires = jiffies + 1;
+        timer_add(&rcu_timer);
+        sched_sleep_on(&rcu_waitq, &rcu_lock);
+        timer_del(&rcu_timer);
+        intr_setipl(ipl);
+    }
+    rcu_ngps++;
+}
+
+static void *rcu_run(long arg1, void *arg2)
+{
+    while (1)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&rcu_lock);
+        while (!rcu_pending && !rcu_stopping)
+        {
+            sched_sleep_on(&rcu_waitq, &rcu_lock);
+            spinlock_lock(&rcu_lock);
+        }
+        rcu_head_t *batch = rcu_pending;
+        if (!batch)
+        {
+            /* stopping, and nothing left to do; from here on rcu_call()
+             * runs callbacks itself */
+            rcu_running = 0;
+            spinlock_unlock(&rcu_lock);
+            sched_broadcast_on(&rcu_stop_waitq);
+            intr_setipl(ipl);
+            return NULL;
+        }
+        rcu_pending = NULL;
+        rcu_pending_tail = &rcu_pending;
+        spinlock_unlock(&rcu_lock);
+        intr_setipl(ipl);
+
+        rcu_wait_gp();
+        while (batch)
+        {
+            rcu_head_t *head = batch;
+            batch = head->rh_next;
+            head->rh_func(head);
+            rcu_ncallbacks++;
+        }
+    }
+}
+
+void rcu_call(rcu_head_t *head, rcu_func_t func)
+{
+    head->rh_func = func;
+    head->rh_next = NULL;
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&rcu_lock);
+    if (!rcu_running)
+    {
+        spinlock_unlock(&rcu_lock);
+        intr_setipl(ipl);
+        func(head);
+        return;
+    }
+    if (!rcu_pending)
+    {
+        sched_wakeup_on(&rcu_waitq, NULL);
+    }
+    *rcu_pending_tail = head;
+    rcu_pending_tail = &head->rh_next;
+    spinlock_unlock(&rcu_lock);
+    intr_setipl(ipl);
+}
+
+typedef struct rcu_sync
+{
+    rcu_head_t rs_head;
+    long rs_done;
+} rcu_sync_t;
+
+static void rcu_sync_done(rcu_head_t *head)
+{
+    rcu_sync_t *sync = CONTAINER_OF(head, rcu_sync_t, rs_head);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&rcu_lock);
+    sync->rs_done = 1;
+    spinlock_unlock(&rcu_lock);
+    sched_broadcast_on(&rcu_sync_waitq);
+    intr_setipl(ipl);
+}
+
+void rcu_synchronize()
+{
+    rcu_sync_t sync = {.rs_done = 0};
+    rcu_call(&sync.rs_head, rcu_sync_done);
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&rcu_lock);
+    while (!sync.rs_done)
+    {
+        sched_sleep_on(&rcu_sync_waitq, &rcu_lock);
+        spinlock_lock(&rcu_lock);
+    }
+    spinlock_unlock(&rcu_lock);
+    intr_setipl(ipl);
+}
+
+void rcu_start()
+{
+    sched_queue_init(&rcu_waitq);
+    sched_queue_init(&rcu_stop_waitq);
+    sched_queue_init(&rcu_sync_waitq);
+
+    proc_t *proc = proc_create("rcu");
+    KASSERT(proc);
+    kthread_t *thr = kthread_create(proc, rcu_run, 0, NULL);
+    KASSERT(thr);
+    rcu_running = 1;
+    rcu_thread = thr;
+    sched_make_runnable(thr);
+}
+
+void rcu_stop()
+{
+    if (!rcu_thread)
+    {
+        return;
+    }
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&rcu_lock);
+    rcu_stopping = 1;
+    sched_wakeup_on(&rcu_waitq, NULL);
+    while (rcu_running)
+    {
+        sched_sleep_on(&rcu_stop_waitq, &rcu_lock);
+        spinlock_lock(&rcu_lock);
+    }
+    spinlock_unlock(&rcu_lock);
+    intr_setipl(ipl);
+    rcu_thread = NULL;
+
+    dbg(DBG_INIT, "rcu: %lu grace periods, %lu callbacks\n", rcu_ngps,
+        rcu_ncallbacks);
+}
@@ -0,0 +1,128 @@
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/interrupt.h"
+
+#include "proc/kthread.h"
+#include "proc/rwlock.h"
+
+#include "util/debug.h"
+
+/*
+ * Reader-writer locks are built the same way as the other sleeping
+ * primitives: the state is protected by rw_lock, taken at IPL_HIGH, and
+ * waiters sleep on a queue with sched_sleep_on(), which drops the spinlock,
+ * then check the state again once they are woken.
+ */
+
+void rwlock_init(rwlock_t *rw)
+{
+    sched_queue_init(&rw->rw_readq);
+    sched_queue_init(&rw->rw_writeq);
+    rw->rw_writer = NULL;
+    rw->rw_readers = 0;
+    rw->rw_writers_waiting = 0;
+    spinlock_init(&rw->rw_lock);
+}
+
+void rwlock_read_lock(rwlock_t *rw)
+{
+    KASSERT(curthr && rw->rw_writer != curthr && "rwlock already held");
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&rw->rw_lock);
+    while (rw->rw_writer || rw->rw_writers_waiting)
+    {
+        sched_sleep_on(&rw->rw_readq, &rw->rw_lock);
+        spinlock_lock(&rw->rw_lock);
+    }
+    rw->rw_readers++;
+    spinlock_unlock(&rw->rw_lock);
+    intr_setipl(ipl);
+}
+
+long rwlock_read_trylock(rwlock_t *rw)
+{
+    KASSERT(curthr && rw->rw_writer != curthr && "rwlock already held");
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&rw->rw_lock);
+    long free = !rw->rw_writer && !rw->rw_writers_waiting;
+    if (free)
+    {
+        rw->rw_readers++;
+    }
+    spinlock_unlock(&rw->rw_lock);
+    intr_setipl(ipl);
+    return free;
+}
+
+void rwlock_read_unlock(rwlock_t *rw)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&rw->rw_lock);
+    KASSERT(rw->rw_readers && !rw->rw_writer);
+    long wake = !--rw->rw_readers && rw->rw_writers_waiting;
+    spinlock_unlock(&rw->rw_lock);
+    if (wake)
+    {
+        sched_wakeup_on(&rw->rw_writeq, NULL);
+    }
+    intr_setipl(ipl);
+}
+
+void rwlock_write_lock(rwlock_t *rw)
+{
+    KASSERT(curthr && rw->rw_writer != curthr && "rwlock already held");
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&rw->rw_lock);
+    while (rw->rw_writer || rw->rw_readers)
+    {
+        rw->rw_writers_waiting++;
+        sched_sleep_on(&rw->rw_writeq, &rw->rw_lock);
+        spinlock_lock(&rw->rw_lock);
+        rw->rw_writers_waiting--;
+    }
+    rw->rw_writer = curthr;
+    spinlock_unlock(&rw->rw_lock);
+    intr_setipl(ipl);
+}
+
+long rwlock_write_trylock(rwlock_t *rw)
+{
+    KASSERT(curthr && rw->rw_writer != curthr && "rwlock already held");
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&rw->rw_lock);
+    long free = !rw->rw_writer && !rw->rw_readers && !rw->rw_writers_waiting;
+    if (free)
+    {
+        rw->rw_writer = curthr;
+    }
+    spinlock_unlock(&rw->rw_lock);
+    intr_setipl(ipl);
+    return free;
+}
+
+void rwlock_write_unlock(rwlock_t *rw)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&rw->rw_lock);
+    KASSERT(rw->rw_writer == curthr && "unlocking an rwlock we do not hold");
+    rw->rw_writer = NULL;
+    long writers = rw->rw_writers_waiting;
+    spinlock_unlock(&rw->rw_lock);
+
+    /* hand the lock to the next writer if there is one, otherwise let in
+     * every reader that queued up behind us */
+    if (writers)
+    {
+        sched_wakeup_on(&rw->rw_writeq, NULL);
+    }
+    else
+    {
+        sched_broadcast_on(&rw->rw_readq);
+    }
+    intr_setipl(ipl);
+}
+
+long rwlock_owns_write(rwlock_t *rw) { return curthr && rw->rw_writer == curthr; }
+
+long rwlock_read_held(rwlock_t *rw) { return rw->rw_readers != 0; }
@@ -5,9 +5,19 @@
 #include "fs/vfs.h"
 #include "globals.h"
 #include "main/apic.h"
+#include "main/cpuid.h"
+#include "main/fpu.h"
 #include "main/inits.h"
+#include "mm/mm.h"
+#include "mm/slab.h"
+#include "proc/kmutex.h"
+#include "proc/rcu.h"
+#include "proc/sched_stats.h"
 #include "types.h"
 #include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+#include "util/trace.h"
 #include <util/time.h>
 
 /*==========
@@ -18,11 +28,308 @@
  * The run queue of threads waiting to be run.
  */
 static ktqueue_t kt_runq CORE_SPECIFIC_DATA;
+#define kt_runq CSD(kt_runq)
 
 /*
  * Helper tracking most recent thread context before a context_switch().
  */
 static context_t *last_thread_context CORE_SPECIFIC_DATA;
+#define last_thread_context CSD(last_thread_context)
+
+/*
+ * Threads switched away from on this core; see sched.h.
+ */
+#undef sched_nswitches
+uint64_t sched_nswitches CORE_SPECIFIC_DATA;
+#define sched_nswitches CSD(sched_nswitches)
+
+/*
+ * The virtual run time of the last fair thread this core picked to run, kept
+ * from ever decreasing: about the least virtual run time of those waiting.
+ * Threads waking up, or moving here from another core, are placed relative
+ * to it.
+ */
+static long min_vruntime CORE_SPECIFIC_DATA;
+#define min_vruntime CSD(min_vruntime)
+
+/*
+ * Set when the thread running on this core should give way to one on its run
+ * queue: by the timer tick, and by wakeups of threads that should run before
+ * it. Acted on at the preemption point, sched_preempt(), and cleared by
+ * core_switch() whenever it picks a thread.
+ */
+static long need_resched CORE_SPECIFIC_DATA;
+#define need_resched CSD(need_resched)
+
+/*
+ * Scheduler statistics (see proc/sched_stats.h), indexed by core id; each core
+ * only updates its own, with interrupts masked.
+ */
+static sched_stats_t sched_stats[MAX_LAPICS];
+
+/*
+ * Set by sched_preempt() for the sched_switch() it makes, which is then
+ * counted as involuntary.
+ */
+static long sched_preempting CORE_SPECIFIC_DATA;
+#define sched_preempting CSD(sched_preempting)
+
+#ifdef __MTP__
+/*
+ * The FS base last loaded on this core, so that switching between threads
+ * that do not use thread-local storage costs no MSR write.
+ */
+#define IA32_FS_BASE_MSR 0xc0000100
+static uintptr_t core_fsbase CORE_SPECIFIC_DATA;
+#define core_fsbase CSD(core_fsbase)
+#endif
+
+/*==================
+ * Scheduling classes
+ *=================*/
+
+/*
+ * Weights of fair threads by nice value, from SCHED_NICE_MIN to
+ * SCHED_NICE_MAX: each step is worth about 10% of CPU time relative to its
+ * neighbours. A thread's virtual run time advances by the ticks it runs,
+ * scaled by SCHED_NICE_0_WEIGHT / its weight.
+ */
+static const long nice_weights[SCHED_NICE_MAX - SCHED_NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,   335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,    36,    29,    23,    18,    15};
+#define SCHED_NICE_0_WEIGHT 1024
+
+/* Virtual run time by which a thread waking up may be ahead of min_vruntime */
+#define SCHED_SLEEPER_CREDIT 64
+
+/*
+ * Returns 1 if thread a should run before thread b.
+ */
+static long sched_before(kthread_t *a, kthread_t *b)
+{
+    if (a->kt_sched_class != b->kt_sched_class)
+    {
+        return a->kt_sched_class == SCHED_CLASS_REALTIME;
+    }
+    if (a->kt_sched_class == SCHED_CLASS_REALTIME)
+    {
+        return a->kt_priority > b->kt_priority;
+    }
+    return a->kt_vruntime < b->kt_vruntime;
+}
+
+/*
+ * Charges a thread coming off the CPU for the ticks it ran.
+ */
+static void sched_charge(kthread_t *thr)
+{
+    if (thr->kt_sched_class == SCHED_CLASS_FAIR)
+    {
+        long ticks = (long)(timer_tickcount - thr->kt_run_start);
+        thr->kt_vruntime += ticks * SCHED_NICE_0_WEIGHT /
+                            nice_weights[thr->kt_priority - SCHED_NICE_MIN];
+    }
+}
+
+/*
+ * Places a fair thread that has been asleep at most SCHED_SLEEPER_CREDIT ahead
+ * of the threads that kept running on the core it is woken onto, so that it
+ * neither starves them with the run time it saved up nor waits behind them.
+ */
+static void sched_place_woken(kthread_t *thr, long core)
+{
+    long floor = *GET_CSD(core, long, min_vruntime) - SCHED_SLEEPER_CREDIT;
+    if (thr->kt_sched_class == SCHED_CLASS_FAIR && thr->kt_vruntime < floor)
+    {
+        thr->kt_vruntime = floor;
+    }
+}
+
+/*
+ * Idle cores.
+ *
+ * A core with nothing to run waits in core_switch() for an interrupt, which
+ * used to mean its next timer tick even if another core had just woken a
+ * thread onto its run queue. Now each core says how it is waiting, and
+ * whoever makes a thread runnable on an idle core wakes it: a core that
+ * waits with MONITOR/MWAIT, where the CPU has them, watches its own
+ * si_state, so writing it is enough; one that halts is sent an
+ * INTR_RESCHEDULE IPI. Each core's state is on its own cache line, so
+ * waking one does not disturb the others.
+ *
+ * The idle core publishes its state before checking its run queue one last
+ * time, and the waker enqueues before exchanging the state, so either the
+ * core sees the thread or the waker sees the core waiting.
+ */
+#define SCHED_IDLE_RUNNING 0
+#define SCHED_IDLE_HALT 1
+#define SCHED_IDLE_MWAIT 2
+
+typedef struct sched_idle
+{
+    volatile long si_state;
+} __attribute__((aligned(SLAB_CACHE_LINE_SIZE))) sched_idle_t;
+
+static sched_idle_t sched_idle[MAX_LAPICS];
+
+/* Whether the CPU has MONITOR/MWAIT */
+static long sched_mwait;
+
+/*
+ * Returns 1 if the thread next on this core's run queue should run before
+ * curthr.
+ */
+static long sched_runq_preempts()
+{
+    long ret = 0;
+    spinlock_lock(&kt_runq.tq_lock);
+    if (curthr && !sched_queue_empty(&kt_runq))
+    {
+        kthread_t *next =
+            list_item(kt_runq.tq_list.l_prev, kthread_t, kt_qlink);
+        ret = sched_before(next, curthr);
+    }
+    spinlock_unlock(&kt_runq.tq_lock);
+    return ret;
+}
+
+static long sched_reschedule_handler(regs_t *regs)
+{
+    /* waking an idle core was the point, and core_switch() does the rest; a
+     * busy one was sent a thread that may have to preempt its current one */
+    if (sched_runq_preempts())
+    {
+        need_resched = 1;
+    }
+    return 0;
+}
+
+/*
+ * Waits for an interrupt, or with MWAIT for a wakeup, unless the run queue
+ * has been given a thread since the core last looked. Called with interrupts
+ * disabled; returns with them enabled, like intr_wait().
+ */
+static void sched_idle_wait()
+{
+    sched_idle_t *idle = &sched_idle[curcore.kc_id];
+    if (sched_mwait)
+    {
+        idle->si_state = SCHED_IDLE_MWAIT;
+        __asm__ volatile("monitor" ::"a"(&idle->si_state), "c"(0), "d"(0));
+        __sync_synchronize();
+        if (sched_queue_empty(&kt_runq) &&
+            idle->si_state == SCHED_IDLE_MWAIT)
+        {
+            /* as with sti; hlt, an interrupt arriving right after the sti is
+             * only taken once mwait has started, and ends it */
+            __asm__ volatile("sti; mwait" ::"a"(0), "c"(0));
+        }
+        else
+        {
+            intr_enable();
+        }
+    }
+    else
+    {
+        idle->si_state = SCHED_IDLE_HALT;
+        __sync_synchronize();
+        if (sched_queue_empty(&kt_runq))
+        {
+            intr_wait();
+        }
+        else
+        {
+            intr_enable();
+        }
+    }
+    idle->si_state = SCHED_IDLE_RUNNING;
+}
+
+/*
+ * Returns 1 if core is waiting in sched_idle_wait().
+ */
+static long sched_core_idle(long core)
+{
+    return sched_idle[core].si_state != SCHED_IDLE_RUNNING;
+}
+
+/*
+ * Wakes another core that may be waiting for a thread just put on its run
+ * queue.
+ */
+static void sched_kick(long core)
+{
+    long state = __sync_lock_test_and_set(&sched_idle[core].si_state,
+                                          SCHED_IDLE_RUNNING);
+    if (state == SCHED_IDLE_HALT)
+    {
+        apic_send_ipi((uint8_t)core, DESTINATION_MODE_FIXED, INTR_RESCHEDULE);
+    }
+}
+
+/*
+ * Returns 1 if thr's affinity mask lets it run on core.
+ */
+static long sched_allowed(kthread_t *thr, long core)
+{
+    return !!(thr->kt_affinity & (1UL << core));
+}
+
+/*
+ * Returns 1 if core is up and thr may run on it.
+ */
+static long sched_usable(kthread_t *thr, long core)
+{
+    return core >= 0 && core < MAX_LAPICS && csd_vaddr_table[core] &&
+           sched_allowed(thr, core);
+}
+
+/*
+ * Chooses the core to make a thread runnable on, among those it may run on:
+ * the one it last ran on if that core is idle, as its caches may still hold
+ * the thread's data; this one, if it is idle (an interrupt woke the thread);
+ * else any idle core, rather than have the thread wait here behind the
+ * current one; else this one, the one it last ran on, or any.
+ */
+static long sched_select_core(kthread_t *thr)
+{
+#ifdef __SMP__
+    long recent = thr->kt_recent_core;
+    if (sched_usable(thr, recent) && sched_core_idle(recent))
+    {
+        return recent;
+    }
+    if (sched_allowed(thr, curcore.kc_id) && sched_core_idle(curcore.kc_id))
+    {
+        return curcore.kc_id;
+    }
+    long any = -1;
+    for (long core = 0; core <= apic_max_id() && core < MAX_LAPICS; core++)
+    {
+        if (sched_usable(thr, core))
+        {
+            if (sched_core_idle(core))
+            {
+                return core;
+            }
+            any = any < 0 ? core : any;
+        }
+    }
+    if (sched_allowed(thr, curcore.kc_id))
+    {
+        return curcore.kc_id;
+    }
+    if (sched_usable(thr, recent))
+    {
+        return recent;
+    }
+    KASSERT(any >= 0 && "thread may not run on any core that is up");
+    return any;
+#endif
+    return curcore.kc_id;
+}
 
 /*===================
  * Preemption helpers
@@ -54,6 +361,90 @@ inline long preemption_enabled()
     return curthr && !curthr->kt_preemption_count;
 }
 
+/*
+ * Preemption.
+ *
+ * Without it, a thread runs until it blocks or yields, however long a thread
+ * that should run before it has been waiting. With it, the timer tick and
+ * wakeups set need_resched, and interrupt_handler() calls sched_preempt()
+ * before returning, which yields on the interrupted thread's behalf unless
+ * it had preemption disabled (it holds a spinlock) or had raised its IPL
+ * (what protects the scheduler's and drivers' data on one core). A thread
+ * woken here, or a realtime thread woken by another core, then runs as soon
+ * as this core next returns from an interrupt at IPL_LOW; any other runs
+ * once the current thread's timeslice, SCHED_TIMESLICE_TICKS, is up.
+ *
+ * User preemption (UPREEMPT) only preempts threads interrupted in user mode,
+ * which hold no locks; kernel preemption (KPREEMPT) also preempts them in the
+ * kernel.
+ */
+#if defined(__KPREEMPT__) || defined(__UPREEMPT__)
+#define SCHED_PREEMPT
+#endif
+
+long sched_tick(long user)
+{
+    if (!curthr)
+    {
+        return 0;
+    }
+    user ? curthr->kt_utime++ : curthr->kt_stime++;
+
+    sched_stats_t *stats = &sched_stats[curcore.kc_id];
+    size_t runq = kt_runq.tq_size;
+    stats->ss_ticks++;
+    stats->ss_runq_total += runq;
+    stats->ss_runq_max = MAX(stats->ss_runq_max, runq);
+    stats->ss_runq_hist[MIN(runq, (size_t)SCHED_RUNQ_HIST - 1)]++;
+
+    if (curthr->kt_slice > 0 && --curthr->kt_slice)
+    {
+        return 0;
+    }
+#ifdef SCHED_PREEMPT
+#ifndef __KPREEMPT__
+    if (!user)
+    {
+        return 0;
+    }
+#endif
+    /* the slice stays used up until another thread is waiting */
+    if (preemption_enabled() && intr_getipl() == IPL_LOW &&
+        !sched_queue_empty(&kt_runq))
+    {
+        need_resched = 1;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+void sched_preempt(long user)
+{
+#ifndef __KPREEMPT__
+    if (!user)
+    {
+        return;
+    }
+#endif
+    if (!need_resched || !curthr || curthr->kt_state != KT_ON_CPU ||
+        !preemption_enabled() || intr_getipl() != IPL_LOW)
+    {
+        return;
+    }
+    need_resched = 0;
+    if (user && curthr->kt_cancelled)
+    {
+        kthread_exit((void *)-1);
+    }
+    sched_preempting = 1;
+    sched_yield();
+    /* sched_switch() returns with the IPL raised and interrupts enabled;
+     * return to the interrupt the way it was taken */
+    intr_setipl(IPL_LOW);
+    intr_disable();
+}
+
 /*==================
  * ktqueue functions
  *=================*/
@@ -66,6 +457,7 @@ void sched_queue_init(ktqueue_t *queue)
     list_init(&queue->tq_list);
     queue->tq_size = 0;
     spinlock_init(&queue->tq_lock);
+    queue->tq_ordered = 0;
 }
 
 /*
@@ -79,10 +471,33 @@ static void ktqueue_enqueue(ktqueue_t *queue, kthread_t *thr)
 
     list_assert_sanity(&queue->tq_list);
     /* Because of the way core-specific data is handled, we add to the front
-     *  of the queue (and remove from the back). */
-    list_insert_head(&queue->tq_list, &thr->kt_qlink);
+     *  of the queue (and remove from the back). Run queues are therefore
+     *  sorted with the next thread to run at the back, and a thread goes in
+     *  front of the ones it ties with. */
+    if (queue->tq_ordered)
+    {
+        list_link_t *link = &queue->tq_list;
+        list_iterate(&queue->tq_list, cur, kthread_t, kt_qlink)
+        {
+            if (!sched_before(thr, cur))
+            {
+                link = &cur->kt_qlink;
+                break;
+            }
+        }
+        list_insert_before(link, &thr->kt_qlink);
+    }
+    else
+    {
+        list_insert_head(&queue->tq_list, &thr->kt_qlink);
+    }
     list_assert_sanity(&queue->tq_list);
 
+    /* a thread moved between run queues has been waiting all along */
+    if (queue->tq_ordered && !thr->kt_runnable_since)
+    {
+        thr->kt_runnable_since = cpuid_rdtsc();
+    }
     thr->kt_wchan = queue;
     queue->tq_size++;
 }
@@ -145,7 +560,347 @@ inline long sched_queue_empty(ktqueue_t *queue) { return queue->tq_size == 0; }
  */
 void sched_init(void)
 {
-    sched_queue_init(GET_CSD(curcore.kc_id, ktqueue_t, kt_runq));
+    ktqueue_t *runq = GET_CSD(curcore.kc_id, ktqueue_t, kt_runq);
+    sched_queue_init(runq);
+    runq->tq_ordered = 1;
+    spinlock_stats_register(&runq->tq_lock, "runq");
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+    sched_mwait = !!(ecx & CPUID_FEAT_ECX_MONITOR);
+    intr_register(INTR_RESCHEDULE, sched_reschedule_handler);
+}
+
+/*
+ * Puts a runnable thread on core's run queue, and wakes that core if it is
+ * another, idle one.
+ */
+static void sched_enqueue(kthread_t *thr, long core)
+{
+    ktqueue_t *runq = GET_CSD(core, ktqueue_t, kt_runq);
+    spinlock_lock(&runq->tq_lock);
+    ktqueue_enqueue(runq, thr);
+    spinlock_unlock(&runq->tq_lock);
+    if (core == curcore.kc_id)
+    {
+        if (curthr && sched_before(thr, curthr))
+        {
+            need_resched = 1;
+        }
+    }
+    else if (sched_core_idle(core))
+    {
+        sched_kick(core);
+    }
+#ifdef SCHED_PREEMPT
+    else if (thr->kt_sched_class == SCHED_CLASS_REALTIME)
+    {
+        /* a fair thread waits for the core's next tick, a realtime one need
+         * not; the core decides whether it preempts its current thread */
+        apic_send_ipi((uint8_t)core, DESTINATION_MODE_FIXED, INTR_RESCHEDULE);
+    }
+#endif
+}
+
+/*
+ * Moves a runnable thread that may not run on this core, and is on no queue,
+ * to the run queue of a core it may run on, keeping its place relative to
+ * that core's threads as load balancing does.
+ */
+static void sched_migrate(kthread_t *thr)
+{
+    long core = sched_select_core(thr);
+    thr->kt_vruntime += *GET_CSD(core, long, min_vruntime) - min_vruntime;
+    sched_enqueue(thr, core);
+}
+
+uint64_t sched_online_cores()
+{
+    uint64_t mask = 0;
+    for (long core = 0; core <= apic_max_id() && core < MAX_LAPICS; core++)
+    {
+        if (csd_vaddr_table[core])
+        {
+            mask |= 1UL << core;
+        }
+    }
+    return mask;
+}
+
+#ifdef __MTP__
+void sched_set_fsbase(uintptr_t base)
+{
+    KASSERT(base < USER_MEM_HIGH);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    curthr->kt_fsbase = base;
+    core_fsbase = base;
+    cpuid_set_msr(IA32_FS_BASE_MSR, (uint32_t)base, (uint32_t)(base >> 32));
+    intr_setipl(ipl);
+}
+#endif
+
+/*
+ * Sets a thread's affinity mask. A thread waiting on the run queue of a core
+ * it may no longer run on is moved right away; one running on such a core is
+ * moved by core_switch() once it stops running, which curthr does at once.
+ */
+long sched_set_affinity(kthread_t *thr, uint64_t mask)
+{
+    if (!(mask & sched_online_cores()))
+    {
+        return -EINVAL;
+    }
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&thr->kt_lock);
+    thr->kt_affinity = mask;
+    ktqueue_t *queue = thr->kt_wchan;
+    if (thr->kt_state == KT_RUNNABLE && queue && queue->tq_ordered)
+    {
+        long allowed = 0;
+        for (long core = 0; core < MAX_LAPICS; core++)
+        {
+            if (sched_usable(thr, core) &&
+                queue == GET_CSD(core, ktqueue_t, kt_runq))
+            {
+                allowed = 1;
+            }
+        }
+        if (!allowed)
+        {
+            spinlock_lock(&queue->tq_lock);
+            ktqueue_remove(queue, thr);
+            spinlock_unlock(&queue->tq_lock);
+            sched_migrate(thr);
+        }
+    }
+    spinlock_unlock(&thr->kt_lock);
+    intr_setipl(ipl);
+
+    if (thr == curthr && !sched_allowed(thr, curcore.kc_id))
+    {
+        sched_yield();
+    }
+    return 0;
+}
+
+/*
+ * Changes a thread's effective scheduling class and priority, moving it to its
+ * new place if it is on a run queue.
+ */
+static void sched_change_class(kthread_t *thr, sched_class_t cls,
+                               long priority)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&thr->kt_lock);
+    ktqueue_t *queue = thr->kt_wchan;
+    long requeue = thr->kt_state == KT_RUNNABLE && queue && queue->tq_ordered;
+    if (requeue)
+    {
+        spinlock_lock(&queue->tq_lock);
+        ktqueue_remove(queue, thr);
+    }
+    if (cls == SCHED_CLASS_FAIR && thr->kt_sched_class != SCHED_CLASS_FAIR)
+    {
+        /* it has not been charged for the time it ran as a realtime thread */
+        thr->kt_vruntime = min_vruntime;
+    }
+    thr->kt_sched_class = cls;
+    thr->kt_priority = priority;
+    if (requeue)
+    {
+        ktqueue_enqueue(queue, thr);
+        spinlock_unlock(&queue->tq_lock);
+    }
+    spinlock_unlock(&thr->kt_lock);
+    if (thr == curthr && sched_runq_preempts())
+    {
+        need_resched = 1;
+    }
+    intr_setipl(ipl);
+}
+
+/*
+ * Priority inheritance.
+ *
+ * A thread holding a kmutex that a realtime thread waits for runs at that
+ * thread's priority, if it is higher than its own, until it lets go of the
+ * mutex. Otherwise threads of medium priority could keep a fair or low
+ * priority holder off the CPU, and with it the waiter, for as long as they
+ * run. kmutex_lock() waits with sched_mutex_sleep_on(), which boosts the
+ * holder, and whichever holder that one is in turn waiting for;
+ * kmutex_unlock() calls sched_mutex_released(), which works out again the
+ * priorities of the old holder and the new one. kt_base_class and
+ * kt_base_priority are what sched_set_class() set.
+ *
+ * All of it is done under sched_pi_lock, which also covers every thread's
+ * kt_blocked_on and kt_mutexes; kmutex.S links mutexes into kt_mutexes with
+ * sched_mutex_link() and sched_mutex_unlink() for that. With it held, the
+ * threads along a chain of holders cannot go away: a waiter only stops
+ * waiting once it has cleared kt_blocked_on, and a holder only lets go of
+ * its mutex in sched_mutex_released(), both of which need the lock. It is
+ * taken after km_lock, and before thread and queue locks.
+ */
+
+static spinlock_t sched_pi_lock = SPINLOCK_INITIALIZER(sched_pi_lock);
+
+void sched_mutex_link(list_t *mutexes, list_link_t *link)
+{
+    spinlock_lock(&sched_pi_lock);
+    list_insert_tail(mutexes, link);
+    spinlock_unlock(&sched_pi_lock);
+}
+
+void sched_mutex_unlink(list_link_t *link)
+{
+    spinlock_lock(&sched_pi_lock);
+    list_remove(link);
+    spinlock_unlock(&sched_pi_lock);
+}
+
+/*
+ * Raises *cls and *priority to those of thr, if it is a realtime thread that
+ * would run first.
+ */
+static void sched_pi_raise(kthread_t *thr, sched_class_t *cls, long *priority)
+{
+    if (thr->kt_sched_class == SCHED_CLASS_REALTIME &&
+        (*cls != SCHED_CLASS_REALTIME || thr->kt_priority > *priority))
+    {
+        *cls = SCHED_CLASS_REALTIME;
+        *priority = thr->kt_priority;
+    }
+}
+
+/*
+ * Sets thr's effective class and priority to its own, raised to those of the
+ * threads waiting for the kmutexes it holds. sched_pi_lock must be held.
+ */
+static void sched_pi_update(kthread_t *thr)
+{
+    sched_class_t cls = thr->kt_base_class;
+    long priority = thr->kt_base_priority;
+    list_iterate(&thr->kt_mutexes, mtx, kmutex_t, km_link)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&mtx->km_waitq.tq_lock);
+        list_iterate(&mtx->km_waitq.tq_list, waiter, kthread_t, kt_qlink)
+        {
+            sched_pi_raise(waiter, &cls, &priority);
+        }
+        spinlock_unlock(&mtx->km_waitq.tq_lock);
+        intr_setipl(ipl);
+    }
+    if (cls != thr->kt_sched_class || priority != thr->kt_priority)
+    {
+        sched_change_class(thr, cls, priority);
+    }
+}
+
+/*
+ * Adaptive spinning. A holder running on another core is likely to let go
+ * of the mutex soon, so kmutex_lock() first waits for it without sleeping,
+ * for up to KMUTEX_SPIN_CYCLES and only while the holder stays on its CPU.
+ * The holder is only looked at with lock held, which it needs to let go of
+ * the mutex, so it cannot exit meanwhile. Between looks lock is dropped, and
+ * the spinner watches km_holder for a while.
+ *
+ * kmutex_unlock() hands the mutex straight to the first sleeping waiter, so
+ * a spinner only gets it when nobody was asleep; it then takes it as
+ * kmutex_lock() does an unheld one. Returns 1 if curthr took the mutex, with
+ * lock released, and 0 if it must sleep, with lock held.
+ */
+static long sched_mutex_spin(kmutex_t *mtx, spinlock_t *lock)
+{
+    uint64_t deadline = cpuid_rdtsc() + KMUTEX_SPIN_CYCLES;
+    kthread_t *holder;
+    while ((holder = mtx->km_holder) && holder->kt_state == KT_ON_CPU &&
+           cpuid_rdtsc() < deadline)
+    {
+        spinlock_unlock(lock);
+        for (int i = 0;
+             i < 64 && __atomic_load_n(&mtx->km_holder, __ATOMIC_RELAXED) ==
+                           holder;
+             i++)
+        {
+            __asm__("pause;");
+        }
+        spinlock_lock(lock);
+    }
+    if (holder)
+    {
+        return 0;
+    }
+    mtx->km_holder = curthr;
+    sched_mutex_link(&curthr->kt_mutexes, &mtx->km_link);
+    spinlock_unlock(lock);
+    return 1;
+}
+
+void sched_mutex_sleep_on(kmutex_t *mtx, spinlock_t *lock)
+{
+    if (sched_mutex_spin(mtx, lock))
+    {
+        return;
+    }
+
+    /* curthr only goes on the wait queue once it is off the CPU, so boost
+     * the chain of holders from curthr itself; it stops at a holder that
+     * already runs at least as high, which ends any deadlock cycle */
+    spinlock_lock(&sched_pi_lock);
+    curthr->kt_blocked_on = mtx;
+    kthread_t *holder = mtx->km_holder;
+    while (holder)
+    {
+        sched_class_t cls = holder->kt_sched_class;
+        long priority = holder->kt_priority;
+        sched_pi_raise(curthr, &cls, &priority);
+        if (cls == holder->kt_sched_class && priority == holder->kt_priority)
+        {
+            break;
+        }
+        sched_change_class(holder, cls, priority);
+        holder = holder->kt_blocked_on ? holder->kt_blocked_on->km_holder
+                                       : NULL;
+    }
+    spinlock_unlock(&sched_pi_lock);
+    sched_sleep_on(&mtx->km_waitq, lock);
+
+    spinlock_lock(&sched_pi_lock);
+    curthr->kt_blocked_on = NULL;
+    spinlock_unlock(&sched_pi_lock);
+}
+
+void sched_mutex_released(kmutex_t *mtx)
+{
+    spinlock_lock(&sched_pi_lock);
+    sched_pi_update(curthr);
+    if (mtx->km_holder)
+    {
+        sched_pi_update(mtx->km_holder);
+    }
+    spinlock_unlock(&sched_pi_lock);
+}
+
+/*
+ * Changes a thread's own scheduling class and priority. It keeps any higher
+ * priority it has inherited until it lets go of the kmutexes it got it for.
+ */
+long sched_set_class(kthread_t *thr, sched_class_t cls, long priority)
+{
+    if (cls == SCHED_CLASS_FAIR
+            ? priority < SCHED_NICE_MIN || priority > SCHED_NICE_MAX
+            : priority < SCHED_RT_PRIO_MIN || priority > SCHED_RT_PRIO_MAX)
+    {
+        return -EINVAL;
+    }
+
+    spinlock_lock(&sched_pi_lock);
+    thr->kt_base_class = cls;
+    thr->kt_base_priority = priority;
+    sched_pi_update(thr);
+    spinlock_unlock(&sched_pi_lock);
+    return 0;
 }
 
 /*
@@ -230,6 +985,25 @@ void sched_switch(ktqueue_t *queue, spinlock_t *lock)
     intr_disable();
     intr_setipl(IPL_LOW);
     curcore.kc_queue = queue;
+    curcore.kc_lock = lock;
+    sched_nswitches++;
+    sched_stats_t *stats = &sched_stats[curcore.kc_id];
+    if (sched_preempting)
+    {
+        sched_preempting = 0;
+        stats->ss_preemptions++;
+        curthr->kt_nivcsw++;
+    }
+    else if (curthr->kt_state == KT_EXITED)
+    {
+        stats->ss_exits++;
+    }
+    else
+    {
+        curthr->kt_state == KT_RUNNABLE ? stats->ss_yields++
+                                        : stats->ss_sleeps++;
+        curthr->kt_nvcsw++;
+    }
     last_thread_context = &curthr->kt_ctx;
     context_switch(&curthr->kt_ctx, &curcore.kc_ctx); /// review this?
     intr_setipl(IPL_HIGH);
@@ -247,7 +1021,6 @@ void sched_yield()
     spinlock_lock(&curthr->kt_lock);
     KASSERT(curthr->kt_state == KT_ON_CPU);
     curthr->kt_state = KT_RUNNABLE;
-    spinlock_lock(&kt_runq.tq_lock);
     sched_switch(&kt_runq, &curthr->kt_lock);
 }
 
@@ -268,9 +1041,10 @@ void sched_make_runnable(kthread_t *thr)
     int old_ipl = intr_setipl(IPL_HIGH);
     // spinlock_lock(&thr->kt_lock); /// locks not needed right? they're used in yield?...
     thr->kt_state = KT_RUNNABLE;
-    // spinlock_lock(&kt_runq.tq_lock);
-    ktqueue_enqueue(&kt_runq, thr);
-    // spinlock_release(&kt_runq.tq_lock);
+    trace(TRACE_WAKEUP, thr->kt_proc->p_pid, thr->kt_tid, 0);
+    long core = sched_select_core(thr);
+    sched_place_woken(thr, core);
+    sched_enqueue(thr, core);
     // spinlock_release(&thr->kt_lock);
     intr_setipl(old_ipl);
     NOT_YET_IMPLEMENTED("PROCS: sched_make_runnable");
@@ -301,6 +1075,25 @@ void sched_sleep_on(ktqueue_t *q, spinlock_t *lock)
     NOT_YET_IMPLEMENTED("PROCS: sched_sleep_on");
 }
 
+/*
+ * Exclusive waits are ordinary ones with kt_exclusive set for
+ * sched_broadcast_on() to see.
+ */
+void sched_sleep_on_exclusive(ktqueue_t *q, spinlock_t *lock)
+{
+    curthr->kt_exclusive = 1;
+    sched_sleep_on(q, lock);
+    curthr->kt_exclusive = 0;
+}
+
+long sched_cancellable_sleep_on_exclusive(ktqueue_t *queue, spinlock_t *lock)
+{
+    curthr->kt_exclusive = 1;
+    long ret = sched_cancellable_sleep_on(queue, lock);
+    curthr->kt_exclusive = 0;
+    return ret;
+}
+
 /*
  * Wakes up a thread on the given queue by taking it off the queue and 
  * making it runnable. If given an empty queue, do nothing.
@@ -363,41 +1156,250 @@ void sched_wakeup_on(ktqueue_t *q, kthread_t **ktp)
  */
 void sched_broadcast_on(ktqueue_t *q)
 {
-    while (q->tq_size > 0)
+    /* oldest first, from the tail, where sched_wakeup_on() takes them */
+    long woke_exclusive = 0;
+    list_link_t *link = q->tq_list.l_prev;
+    while (link != &q->tq_list)
     {
-        sched_wakeup_on(q, NULL);
+        kthread_t *thr = list_item(link, kthread_t, kt_qlink);
+        link = link->l_prev;
+        if (thr->kt_exclusive)
+        {
+            if (woke_exclusive)
+            {
+                continue;
+            }
+            woke_exclusive = 1;
+        }
+        ktqueue_remove(q, thr);
+        sched_make_runnable(thr);
     }
     //NOT_YET_IMPLEMENTED("PROCS: sched_broadcast_on");
 }
 
+void sched_wakeup_thread_on(ktqueue_t *q, kthread_t *thr)
+{
+    if (thr->kt_wchan == q &&
+        (thr->kt_state == KT_SLEEP || thr->kt_state == KT_SLEEP_CANCELLABLE))
+    {
+        ktqueue_remove(q, thr);
+        sched_make_runnable(thr);
+    }
+}
+
 /*===============
  * Functions: SMP
  *==============*/
 
 /*
- * A sad, but functional, attempt at load balancing when a core is idle
+ * Load balancing.
+ *
+ * Each core's kt_runq works as a deque: the core runs its own threads from the
+ * tail (oldest first), while other cores steal from the head. A core whose
+ * queue is empty steals as soon as some other core has threads waiting, and
+ * every LOAD_BALANCING_INTERVAL ms a busy core also compares its queue with
+ * the longest one, and evens them out if they differ by more than
+ * LOAD_BALANCING_IMBALANCE. Either way it takes half of the difference from
+ * the busiest core at once, preferring threads that last ran on the stealing
+ * core (see kt_recent_core), as its caches may still hold their data.
+ *
+ * Other cores' queue sizes are read without their locks, which is good enough
+ * for choosing whom to steal from; the victim's size is checked again under
+ * its lock. Only one run queue lock is held at a time.
  */
-#define LOAD_BALANCING_IDLE_THRESHOLD 4096
-static inline kthread_t *load_balance()
-{
+#define LOAD_BALANCING_INTERVAL 64 /* ms */
+#define LOAD_BALANCING_IMBALANCE 2
+
+static time_t last_load_balance CORE_SPECIFIC_DATA;
+#define last_load_balance CSD(last_load_balance)
+
 #ifdef __SMP__
-    dbg(DBG_CORE, "been idle for a while; attempting to steal thread\n");
-    for (long i = 0; i < apic_max_id(); i++)
+/*
+ * Returns the other core with the longest run queue, or -1 if every other
+ * core's run queue is empty.
+ */
+static long busiest_core(size_t *sizep)
+{
+    long busiest = -1;
+    *sizep = 0;
+    for (long i = 0; i <= apic_max_id(); i++)
     {
-        if (i == curcore.kc_id)
+        if (i == curcore.kc_id || !csd_vaddr_table[i])
         {
             continue;
         }
-        spinlock_lock(&GET_CSD(i, ktqueue_t, kt_runq)->tq_lock);
-        kthread_t *thr = ktqueue_dequeue(GET_CSD(i, ktqueue_t, kt_runq));
-        spinlock_unlock(&GET_CSD(i, ktqueue_t, kt_runq)->tq_lock);
-        if (thr)
-            return thr;
+        size_t size = GET_CSD(i, ktqueue_t, kt_runq)->tq_size;
+        if (size > *sizep)
+        {
+            *sizep = size;
+            busiest = i;
+        }
     }
-    return NULL;
+    return busiest;
+}
+
+/*
+ * Moves half of the difference between victim's run queue and ours (rounded
+ * up) from the head of victim's run queue onto stolen.
+ */
+static size_t steal_threads(long victim, list_t *stolen)
+{
+    ktqueue_t *queue = GET_CSD(victim, ktqueue_t, kt_runq);
+    long victim_min_vruntime = *GET_CSD(victim, long, min_vruntime);
+    spinlock_lock(&queue->tq_lock);
+    size_t nsteal = queue->tq_size > kt_runq.tq_size
+                        ? (queue->tq_size - kt_runq.tq_size + 1) / 2
+                        : 0;
+    size_t nstolen = 0;
+    for (long affine = 1; affine >= 0 && nstolen < nsteal; affine--)
+    {
+        list_iterate(&queue->tq_list, thr, kthread_t, kt_qlink)
+        {
+            if (nstolen == nsteal)
+            {
+                break;
+            }
+            if (!sched_allowed(thr, curcore.kc_id) ||
+                (affine && thr->kt_recent_core != curcore.kc_id))
+            {
+                continue;
+            }
+            ktqueue_remove(queue, thr);
+            thr->kt_vruntime += min_vruntime - victim_min_vruntime;
+            list_insert_tail(stolen, &thr->kt_qlink);
+            nstolen++;
+        }
+    }
+    spinlock_unlock(&queue->tq_lock);
+    return nstolen;
+}
 #endif
 
-    return NULL;
+/*
+ * Steals threads from the busiest other core onto our run queue: any threads
+ * if we are idle, or only past LOAD_BALANCING_IMBALANCE otherwise. Returns
+ * the number of threads stolen.
+ */
+static size_t load_balance(long idle)
+{
+#ifdef __SMP__
+    size_t size;
+    long victim = busiest_core(&size);
+    if (victim < 0 || size <= kt_runq.tq_size ||
+        (!idle && size - kt_runq.tq_size <= LOAD_BALANCING_IMBALANCE))
+    {
+        return 0;
+    }
+
+    list_t stolen;
+    list_init(&stolen);
+    size_t nstolen = steal_threads(victim, &stolen);
+    if (!nstolen)
+    {
+        return 0;
+    }
+    dbg(DBG_CORE, "stole %lu threads from C%ld\n", nstolen, victim);
+
+    spinlock_lock(&kt_runq.tq_lock);
+    list_iterate(&stolen, thr, kthread_t, kt_qlink)
+    {
+        list_remove(&thr->kt_qlink);
+        ktqueue_enqueue(&kt_runq, thr);
+    }
+    spinlock_unlock(&kt_runq.tq_lock);
+
+    sched_stats_t *stats = &sched_stats[curcore.kc_id];
+    stats->ss_balances++;
+    stats->ss_idle_steals += idle ? 1 : 0;
+    stats->ss_stolen += nstolen;
+    return nstolen;
+#endif
+
+    return 0;
+}
+
+/*
+ * Counts the time thr waited on run queues, now that it has been picked to
+ * run on this core.
+ */
+static void sched_stats_waited(kthread_t *thr)
+{
+    uint64_t now = cpuid_rdtsc();
+    uint64_t cycles = now > thr->kt_runnable_since
+                          ? now - thr->kt_runnable_since
+                          : 0;
+    thr->kt_runnable_since = 0;
+    thr->kt_wait_cycles += cycles;
+
+    sched_stats_t *stats = &sched_stats[curcore.kc_id];
+    size_t bucket = cycles ? 63 - (size_t)__builtin_clzl(cycles) : 0;
+    stats->ss_waits++;
+    stats->ss_wait_cycles += cycles;
+    stats->ss_max_wait_cycles = MAX(stats->ss_max_wait_cycles, cycles);
+    stats->ss_wait_hist[MIN(bucket, (size_t)SCHED_HIST_BUCKETS - 1)]++;
+}
+
+void sched_stats_get(long core, sched_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    long first = core < 0 ? 0 : core;
+    long last = core < 0 ? MAX_LAPICS - 1 : core;
+    for (long c = first; c <= last; c++)
+    {
+        sched_stats_t *s = &sched_stats[c];
+        stats->ss_sleeps += s->ss_sleeps;
+        stats->ss_yields += s->ss_yields;
+        stats->ss_preemptions += s->ss_preemptions;
+        stats->ss_exits += s->ss_exits;
+        stats->ss_ticks += s->ss_ticks;
+        stats->ss_runq_total += s->ss_runq_total;
+        stats->ss_runq_max = MAX(stats->ss_runq_max, s->ss_runq_max);
+        for (size_t i = 0; i < SCHED_RUNQ_HIST; i++)
+        {
+            stats->ss_runq_hist[i] += s->ss_runq_hist[i];
+        }
+        stats->ss_waits += s->ss_waits;
+        stats->ss_wait_cycles += s->ss_wait_cycles;
+        stats->ss_max_wait_cycles =
+            MAX(stats->ss_max_wait_cycles, s->ss_max_wait_cycles);
+        for (size_t i = 0; i < SCHED_HIST_BUCKETS; i++)
+        {
+            stats->ss_wait_hist[i] += s->ss_wait_hist[i];
+        }
+        stats->ss_idle_cycles += s->ss_idle_cycles;
+        stats->ss_idle_waits += s->ss_idle_waits;
+        stats->ss_balances += s->ss_balances;
+        stats->ss_idle_steals += s->ss_idle_steals;
+        stats->ss_stolen += s->ss_stolen;
+    }
+}
+
+void sched_stats_reset() { memset(sched_stats, 0, sizeof(sched_stats)); }
+
+size_t sched_stats_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    for (long core = 0; core <= apic_max_id(); core++)
+    {
+        if (!csd_vaddr_table[core])
+        {
+            continue;
+        }
+        sched_stats_t st;
+        sched_stats_get(core, &st);
+        iprintf(&buf, &size,
+                "C%ld runq=%lu sleeps=%lu yields=%lu preemptions=%lu "
+                "exits=%lu ticks=%lu runq_total=%lu runq_max=%lu waits=%lu "
+                "wait_cycles=%lu max_wait_cycles=%lu idle_cycles=%lu "
+                "idle_waits=%lu balances=%lu idle_steals=%lu stolen=%lu\n",
+                core, GET_CSD(core, ktqueue_t, kt_runq)->tq_size, st.ss_sleeps,
+                st.ss_yields, st.ss_preemptions, st.ss_exits, st.ss_ticks,
+                st.ss_runq_total, st.ss_runq_max, st.ss_waits,
+                st.ss_wait_cycles, st.ss_max_wait_cycles, st.ss_idle_cycles,
+                st.ss_idle_waits, st.ss_balances, st.ss_idle_steals,
+                st.ss_stolen);
+    }
+    return size;
 }
 
 /*
@@ -408,13 +1410,14 @@ static inline kthread_t *load_balance()
  *  2) set curproc to idleproc, and curthr to NULL
  *  3) try to get the next thread to run
  *     a) try to use your oqn runq (kt_runq), which is core-specific data
- *     b) if, using core_uptime(), at least LOAD_BALANCING_IDLE_THRESHOLD have
- * passed, then call load_balance() to try to get the next thread to run c) if
- * neither (a) nor (b) work, the core is idle. Wait for an interrupt using
- * intr_wait(). Note that you will need to re-disable interrupts after returning
- * from intr_wait(). 4) ensure the context's PML4 for the selected thread is
- * correctly setup with curcore's core-specific data. Use kt_recent_core and
- * map_in_core_specific_data. 5) set curthr and curproc 6) context_switch out
+ *     b) if it is empty, call load_balance() to steal threads from the
+ * busiest core, and try again c) if neither (a) nor (b) work, the core is
+ * idle. Wait for an interrupt using intr_wait(). Note that you will need to
+ * re-disable interrupts after returning from intr_wait(). Every
+ * LOAD_BALANCING_INTERVAL ms, also call load_balance() before (a). 4) ensure the context's PML4 for the selected thread is
+ * correctly setup with curcore's core-specific data. (Core-specific data is
+ * reached through GS, so no page tables need changing; just note the core in
+ * kt_recent_core.) 5) set curthr and curproc 6) context_switch out
  */
 void core_switch()
 {
@@ -423,8 +1426,20 @@ void core_switch()
         KASSERT(!intr_enabled());
         KASSERT(!curthr || curthr->kt_state != KT_ON_CPU);
 
+        /* the thread that was running is off this core, so nothing it read
+         * under rcu_read_lock() is still in use here */
+        rcu_quiescent();
+
+        if (curthr)
+        {
+            sched_charge(curthr);
+            fpu_switch_out(curthr);
+        }
         if (curcore.kc_queue)
         {
+            /* its lock is taken here, so that every lock held across
+             * sched_switch() is one the caller took and passed as kc_lock */
+            spinlock_lock(&curcore.kc_queue->tq_lock);
             ktqueue_enqueue(curcore.kc_queue, curthr);
             spinlock_unlock(&curcore.kc_queue->tq_lock);
         }
@@ -433,37 +1448,53 @@ void core_switch()
             spinlock_unlock(curcore.kc_lock);
         }
 
-        curproc = &idleproc;
-        curthr = NULL;
+        csd_set_curproc(&idleproc);
+        csd_set_curthr(NULL);
 
         kthread_t *next_thread = NULL;
 
-        size_t idle_start = core_uptime();
+        if (core_uptime() - last_load_balance >= LOAD_BALANCING_INTERVAL)
+        {
+            last_load_balance = core_uptime();
+            load_balance(0);
+        }
+
         while (1)
         {
             spinlock_lock(&kt_runq.tq_lock);
             next_thread = ktqueue_dequeue(&kt_runq);
             spinlock_unlock(&kt_runq.tq_lock);
 
-            if (!next_thread &&
-                core_uptime() - idle_start >= LOAD_BALANCING_IDLE_THRESHOLD)
-                next_thread = load_balance();
-
+            if (next_thread && !sched_allowed(next_thread, curcore.kc_id))
+            {
+                /* its affinity changed while it ran or waited here */
+                sched_migrate(next_thread);
+                continue;
+            }
             if (next_thread)
                 break;
+            if (load_balance(1))
+                continue;
+            if (page_zero_idle())
+                continue;
 
-            intr_wait();
+            uint64_t idle_start = cpuid_rdtsc();
+            time_idle_enter();
+            rcu_idle_enter();
+            sched_idle_wait();
             intr_disable();
+            rcu_idle_exit();
+            time_idle_exit();
+            sched_stats[curcore.kc_id].ss_idle_cycles +=
+                cpuid_rdtsc() - idle_start;
+            sched_stats[curcore.kc_id].ss_idle_waits++;
         }
 
         KASSERT(next_thread->kt_state == KT_RUNNABLE);
         KASSERT(next_thread->kt_proc);
 
-        if (curcore.kc_id != next_thread->kt_recent_core)
-        {
-            map_in_core_specific_data(next_thread->kt_ctx.c_pml4);
-            next_thread->kt_recent_core = curcore.kc_id;
-        }
+        next_thread->kt_recent_core = curcore.kc_id;
+        sched_stats_waited(next_thread);
 
         uintptr_t mapped_paddr = pt_virt_to_phys_helper(
             next_thread->kt_ctx.c_pml4, (uintptr_t)&next_thread);
@@ -471,9 +1502,28 @@ void core_switch()
             pt_virt_to_phys_helper(pt_get(), (uintptr_t)&next_thread);
         KASSERT(mapped_paddr == expected_paddr);
 
-        curthr = next_thread;
+        if (next_thread->kt_sched_class == SCHED_CLASS_FAIR &&
+            next_thread->kt_vruntime > min_vruntime)
+        {
+            min_vruntime = next_thread->kt_vruntime;
+        }
+        next_thread->kt_run_start = timer_tickcount;
+        next_thread->kt_slice = SCHED_TIMESLICE_TICKS;
+        need_resched = 0;
+
+        csd_set_curthr(next_thread);
         curthr->kt_state = KT_ON_CPU;
-        curproc = curthr->kt_proc;
+        csd_set_curproc(curthr->kt_proc);
+        trace(TRACE_SWITCH, curproc->p_pid, curthr->kt_tid, 0);
+#ifdef __MTP__
+        if (curthr->kt_fsbase != core_fsbase)
+        {
+            core_fsbase = curthr->kt_fsbase;
+            cpuid_set_msr(IA32_FS_BASE_MSR, (uint32_t)core_fsbase,
+                          (uint32_t)(core_fsbase >> 32));
+        }
+#endif
+        fpu_switch_in(curthr);
         context_switch(&curcore.kc_ctx, &curthr->kt_ctx);
     }
 }
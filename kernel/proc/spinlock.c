@@ -1,28 +1,68 @@
+#include "config.h"
 #include "globals.h"
+#include "kernel.h"
 #include "main/apic.h"
+#include "main/cpuid.h"
+#include "util/debug.h"
+#include "util/string.h"
 
-void spinlock_init(spinlock_t *lock) { lock->s_locked = 0; }
+static spinlock_stats_t spinlock_stats[SPINLOCK_STATS_MAX];
+static size_t spinlock_nstats;
+
+/* the functions themselves, not their profiling wrappers */
+#ifdef __LOCKPROF__
+#undef spinlock_lock
+#undef spinlock_unlock
+#endif
+
+void spinlock_init(spinlock_t *lock)
+{
+    lock->s_next = 0;
+    lock->s_serving = 0;
+    lock->s_locked = 0;
+    lock->s_stats = 0;
+}
 
 inline void spinlock_lock(spinlock_t *lock)
 {
-// __sync_bool_compare_and_swap is a GCC intrinsic for atomic compare-and-swap
-// If lock->locked is 0, then it is set to 1 and __sync_bool_compare_and_swap
-// returns true Otherwise, lock->locked is left at 1 and
-// __sync_bool_compare_and_swap returns false
-#ifdef __SMP__
+    /* with kernel preemption, a spinlock also keeps its holder on the CPU, so
+     * that on one core, where the lock itself is a no-op, nothing else runs
+     * while it is held */
+#if defined(__SMP__) || defined(__KPREEMPT__)
     preemption_disable();
+#endif
+#ifdef __SMP__
     KASSERT(lock->s_locked <= MAX_LAPICS && "using invalid spinlock");
     KASSERT(lock->s_locked != curcore.kc_id + 1 && "double-locking spinlock");
-    while (
-        !__sync_bool_compare_and_swap(&lock->s_locked, 0, curcore.kc_id + 1))
+    // __sync_fetch_and_add is a GCC intrinsic for an atomic add that returns
+    // the old value, which is our ticket
+    uint8_t ticket = __sync_fetch_and_add(&lock->s_next, 1);
+    uint64_t spin = 0;
+    if (lock->s_serving != ticket)
     {
-        // As an optimization, do a read-only loop and pause
+        uint64_t start = cpuid_rdtsc();
+        // As an optimization, pause while spinning
         // See
         // https://stackoverflow.com/questions/12894078/what-is-the-purpose-of-the-pause-instruction-in-x86
-        while (lock->s_locked)
+        while (lock->s_serving != ticket)
         {
             __asm__("pause;");
         }
+        spin = cpuid_rdtsc() - start;
+    }
+    __sync_synchronize();
+    lock->s_locked = (char)(curcore.kc_id + 1);
+
+    /* the counters of a lock are only updated by its holder */
+    if (lock->s_stats)
+    {
+        spinlock_stats_t *stats = &spinlock_stats[lock->s_stats - 1];
+        stats->ss_acquisitions++;
+        if (spin)
+        {
+            stats->ss_contended++;
+            stats->ss_spin_cycles += spin;
+        }
     }
 #endif
 }
@@ -30,9 +70,12 @@ inline void spinlock_lock(spinlock_t *lock)
 inline void spinlock_unlock(spinlock_t *lock)
 {
 #ifdef __SMP__
-    __sync_synchronize(); // Put a memory barrier before setting the locked
-                          // flag
+    __sync_synchronize(); // Put a memory barrier before handing the lock
+                          // to the next ticket
     lock->s_locked = 0;
+    lock->s_serving++;
+#endif
+#if defined(__SMP__) || defined(__KPREEMPT__)
     preemption_enable();
 #endif
 }
@@ -44,3 +87,37 @@ inline long spinlock_ownslock(spinlock_t *lock)
 #endif
     return 1;
 }
+
+void spinlock_stats_register(spinlock_t *lock, const char *name)
+{
+    size_t slot = __sync_fetch_and_add(&spinlock_nstats, 1);
+    if (slot >= SPINLOCK_STATS_MAX)
+    {
+        dbg(DBG_CORE, "no statistics slot left for spinlock %s\n", name);
+        return;
+    }
+    spinlock_stats_t *stats = &spinlock_stats[slot];
+    memset(stats, 0, sizeof(*stats));
+    stats->ss_name = name;
+    stats->ss_lock = lock;
+    __sync_synchronize();
+    lock->s_stats = (uint8_t)(slot + 1);
+}
+
+size_t spinlock_stats_get(spinlock_stats_t *stats, size_t max)
+{
+    size_t n = MIN(MIN(spinlock_nstats, (size_t)SPINLOCK_STATS_MAX), max);
+    memcpy(stats, spinlock_stats, n * sizeof(*stats));
+    return n;
+}
+
+void spinlock_stats_reset()
+{
+    size_t n = MIN(spinlock_nstats, (size_t)SPINLOCK_STATS_MAX);
+    for (size_t i = 0; i < n; i++)
+    {
+        spinlock_stats[i].ss_acquisitions = 0;
+        spinlock_stats[i].ss_contended = 0;
+        spinlock_stats[i].ss_spin_cycles = 0;
+    }
+}
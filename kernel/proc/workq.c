@@ -0,0 +1,124 @@
+#include "config.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/apic.h"
+#include "main/interrupt.h"
+#include "main/smp.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+#include "proc/workq.h"
+
+#include "util/debug.h"
+
+/*
+ * A core's work queue. Its thread is bound to the core, but is told which
+ * queue is its own anyway, as it starts out on the core that created it.
+ */
+typedef struct workq
+{
+    spinlock_t wq_lock;
+    list_t wq_list;     /* pending work, oldest first */
+    ktqueue_t wq_waitq; /* the thread, while there is no work */
+    kthread_t *wq_thread;
+
+    /* Statistics */
+    size_t wq_nqueued;
+    size_t wq_nmerged; /* work queued while already pending */
+    size_t wq_nwakeups;
+} workq_t;
+
+static workq_t workqs[MAX_LAPICS];
+
+void work_init(work_t *work, work_func_t func)
+{
+    work->w_func = func;
+    list_link_init(&work->w_link);
+    work->w_pending = 0;
+}
+
+long work_queue(work_t *work)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    workq_t *wq = &workqs[curcore.kc_id];
+    if (!wq->wq_thread)
+    {
+        intr_setipl(ipl);
+        work->w_func(work);
+        return 1;
+    }
+
+    spinlock_lock(&wq->wq_lock);
+    if (__sync_lock_test_and_set(&work->w_pending, 1))
+    {
+        wq->wq_nmerged++;
+        spinlock_unlock(&wq->wq_lock);
+        intr_setipl(ipl);
+        return 0;
+    }
+    wq->wq_nqueued++;
+    if (list_empty(&wq->wq_list))
+    {
+        wq->wq_nwakeups++;
+        sched_wakeup_on(&wq->wq_waitq, NULL);
+    }
+    list_insert_tail(&wq->wq_list, &work->w_link);
+    spinlock_unlock(&wq->wq_lock);
+    intr_setipl(ipl);
+    return 1;
+}
+
+static void *workq_run(long core, void *arg2)
+{
+    workq_t *wq = &workqs[core];
+    while (1)
+    {
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&wq->wq_lock);
+        while (list_empty(&wq->wq_list))
+        {
+            sched_sleep_on(&wq->wq_waitq, &wq->wq_lock);
+            spinlock_lock(&wq->wq_lock);
+        }
+        work_t *work = list_head(&wq->wq_list, work_t, w_link);
+        list_remove(&work->w_link);
+        /* from here on, it may be queued again, and will be run again */
+        work->w_pending = 0;
+        spinlock_unlock(&wq->wq_lock);
+        intr_setipl(ipl);
+
+        work->w_func(work);
+    }
+    return NULL;
+}
+
+void workq_start()
+{
+    proc_t *proc = proc_create("workq");
+    KASSERT(proc);
+    for (long core = 0; core <= apic_max_id() && core < MAX_LAPICS; core++)
+    {
+        if (!csd_vaddr_table[core])
+        {
+            continue;
+        }
+        workq_t *wq = &workqs[core];
+        spinlock_init(&wq->wq_lock);
+        list_init(&wq->wq_list);
+        sched_queue_init(&wq->wq_waitq);
+
+        kthread_t *thr = kthread_create(proc, workq_run, core, NULL);
+        KASSERT(thr);
+        long ret = sched_set_class(thr, SCHED_CLASS_REALTIME, WORKQ_PRIORITY);
+        KASSERT(!ret);
+        ret = sched_set_affinity(thr, 1UL << core);
+        KASSERT(!ret);
+        /* the queue must be ready before work_queue() can see the thread */
+        __sync_synchronize();
+        wq->wq_thread = thr;
+        sched_make_runnable(thr);
+    }
+}
@@ -0,0 +1,474 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "test/bench.h"
+#include "test/kshell/io.h"
+
+#include "main/cpuid.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "proc/kmutex.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#include "vm/swap.h"
+
+#ifdef __VFS__
+#include "fs/vfs.h"
+#include "fs/vfs_syscall.h"
+#include "fs/vnode.h"
+#endif
+
+#ifdef __DRIVERS__
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#endif
+
+#define BENCH_ITERS 10000
+#define BENCH_CALIBRATE_MS 100
+#define BENCH_NAME_LEN 32
+
+#define BENCH_MOBJ_PAGES 256
+
+#define BENCH_PATH_DEPTH 16
+#define BENCH_PATH_ROOT "/bench"
+#define BENCH_PATH_ITERS 1000
+
+#define BENCH_DISK_BLOCKS 1024
+#define BENCH_DISK_CHUNK 16
+
+typedef struct bench
+{
+    const char *b_name;
+    void (*b_run)(kshell_t *ksh);
+} bench_t;
+
+/*
+ * The state shared by the two threads of a cross-thread benchmark. Each
+ * thread records when it started and finished and the core it ran on last,
+ * so the time taken is from the first start to the last finish.
+ */
+typedef struct bench_pair
+{
+    size_t bp_iters;
+    uint64_t bp_start[2];
+    uint64_t bp_end[2];
+    long bp_core[2];
+
+    kmutex_t bp_mutex;
+
+    spinlock_t bp_lock;
+    ktqueue_t bp_queue[2];
+    long bp_turn;
+} bench_pair_t;
+
+static void bench_report(kshell_t *ksh, const char *name, size_t iters,
+                         uint64_t cycles, const char *extra)
+{
+    kprintf(ksh, "bench name=%s iters=%lu cycles=%lu per_op=%lu%s%s\n", name,
+            iters, cycles, iters ? cycles / iters : 0, extra ? " " : "",
+            extra ? extra : "");
+}
+
+static void bench_report_pair(kshell_t *ksh, const char *name, size_t iters,
+                              bench_pair_t *bp)
+{
+    uint64_t start = MIN(bp->bp_start[0], bp->bp_start[1]);
+    uint64_t end = MAX(bp->bp_end[0], bp->bp_end[1]);
+    char extra[BENCH_NAME_LEN];
+    snprintf(extra, sizeof(extra), "cores=%ld,%ld", bp->bp_core[0],
+             bp->bp_core[1]);
+    bench_report(ksh, name, iters, end - start, extra);
+}
+
+/*
+ * Runs func(i, bp) for i = 0 and 1 in two new processes and waits for both
+ * to exit. Returns 0, or -ENOMEM if they could not both be created; a first
+ * thread that was is then run with nothing to do, so that it can be reaped.
+ */
+static long bench_pair_run(bench_pair_t *bp, kthread_func_t func)
+{
+    pid_t pids[2];
+    kthread_t *thrs[2];
+    long n;
+    for (n = 0; n < 2; n++)
+    {
+        proc_t *proc = proc_create("bench");
+        thrs[n] = proc ? kthread_create(proc, func, n, bp) : NULL;
+        if (!thrs[n])
+        {
+            bp->bp_iters = 0;
+            break;
+        }
+        pids[n] = proc->p_pid;
+    }
+    for (long i = 0; i < n; i++)
+    {
+        sched_make_runnable(thrs[i]);
+    }
+    for (long i = 0; i < n; i++)
+    {
+        int status;
+        do_waitpid(pids[i], &status, 0);
+    }
+    return n < 2 ? -ENOMEM : 0;
+}
+
+/*
+ * Estimates the TSC frequency against the APIC timer, which runs at a known
+ * rate.
+ */
+static void bench_tsc(kshell_t *ksh)
+{
+    uint64_t start = cpuid_rdtsc();
+    time_spin(BENCH_CALIBRATE_MS);
+    uint64_t cycles = cpuid_rdtsc() - start;
+    kprintf(ksh, "bench name=tsc khz=%lu\n", cycles / BENCH_CALIBRATE_MS);
+}
+
+static void bench_page_alloc(kshell_t *ksh)
+{
+    uint64_t start = cpuid_rdtsc();
+    for (size_t i = 0; i < BENCH_ITERS; i++)
+    {
+        void *page = page_alloc();
+        if (!page)
+        {
+            kprintf(ksh, "bench name=page_alloc error=%d\n", -ENOMEM);
+            return;
+        }
+        page_free(page);
+    }
+    bench_report(ksh, "page_alloc", BENCH_ITERS, cpuid_rdtsc() - start, NULL);
+}
+
+/*
+ * One line per kmalloc size class up to a page, each of which is its own
+ * slab allocator, and one for an allocator of our own that nothing else
+ * allocates from.
+ */
+static void bench_slab(kshell_t *ksh)
+{
+    static const size_t sizes[] = {64,  96,  128,  192,  256,  384, 512,
+                                   768, 1024, 1536, 2048, 3072, 4096};
+    char name[BENCH_NAME_LEN];
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        uint64_t start = cpuid_rdtsc();
+        for (size_t i = 0; i < BENCH_ITERS; i++)
+        {
+            kfree(kmalloc(sizes[s]));
+        }
+        snprintf(name, sizeof(name), "kmalloc_%lu", sizes[s]);
+        bench_report(ksh, name, BENCH_ITERS, cpuid_rdtsc() - start, NULL);
+    }
+
+    slab_allocator_t *allocator = slab_allocator_create("bench", 64);
+    if (!allocator)
+    {
+        kprintf(ksh, "bench name=slab_obj_alloc error=%d\n", -ENOMEM);
+        return;
+    }
+    uint64_t start = cpuid_rdtsc();
+    for (size_t i = 0; i < BENCH_ITERS; i++)
+    {
+        slab_obj_free(allocator, slab_obj_alloc(allocator));
+    }
+    bench_report(ksh, "slab_obj_alloc", BENCH_ITERS, cpuid_rdtsc() - start,
+                 NULL);
+    slab_allocator_destroy(allocator);
+}
+
+/*
+ * Each thread yields while it holds the mutex, so that the other finds it
+ * held and has to sleep on it: every lock after the first is a handoff from
+ * the unlocking thread to a sleeper.
+ */
+static void *bench_kmutex_thread(long i, void *arg)
+{
+    bench_pair_t *bp = arg;
+    bp->bp_start[i] = cpuid_rdtsc();
+    for (size_t n = 0; n < bp->bp_iters; n++)
+    {
+        kmutex_lock(&bp->bp_mutex);
+        sched_yield();
+        kmutex_unlock(&bp->bp_mutex);
+    }
+    bp->bp_end[i] = cpuid_rdtsc();
+    bp->bp_core[i] = curcore.kc_id;
+    return NULL;
+}
+
+static void bench_kmutex(kshell_t *ksh)
+{
+    kmutex_t mtx;
+    kmutex_init(&mtx);
+    uint64_t start = cpuid_rdtsc();
+    for (size_t i = 0; i < BENCH_ITERS; i++)
+    {
+        kmutex_lock(&mtx);
+        kmutex_unlock(&mtx);
+    }
+    bench_report(ksh, "kmutex_uncontended", BENCH_ITERS,
+                 cpuid_rdtsc() - start, NULL);
+
+    bench_pair_t bp = {.bp_iters = BENCH_ITERS / 10};
+    kmutex_init(&bp.bp_mutex);
+    if (bench_pair_run(&bp, bench_kmutex_thread))
+    {
+        kprintf(ksh, "bench name=kmutex_contended error=%d\n", -ENOMEM);
+        return;
+    }
+    bench_report_pair(ksh, "kmutex_contended", 2 * bp.bp_iters, &bp);
+}
+
+/*
+ * The threads take turns: each waits for bp_turn to be its own, then hands
+ * the turn to the other and wakes it. Every handoff is a switch from one
+ * thread to the other, through the run queue (or, with SMP, possibly a
+ * wakeup of the other core).
+ */
+static void *bench_switch_thread(long i, void *arg)
+{
+    bench_pair_t *bp = arg;
+    bp->bp_start[i] = cpuid_rdtsc();
+    for (size_t n = 0; n < bp->bp_iters; n++)
+    {
+        spinlock_lock(&bp->bp_lock);
+        while (bp->bp_turn != i)
+        {
+            sched_sleep_on(&bp->bp_queue[i], &bp->bp_lock);
+            spinlock_lock(&bp->bp_lock);
+        }
+        bp->bp_turn = !i;
+        sched_wakeup_on(&bp->bp_queue[!i], NULL);
+        spinlock_unlock(&bp->bp_lock);
+    }
+    bp->bp_end[i] = cpuid_rdtsc();
+    bp->bp_core[i] = curcore.kc_id;
+    return NULL;
+}
+
+static void bench_switch(kshell_t *ksh)
+{
+    bench_pair_t bp = {.bp_iters = BENCH_ITERS, .bp_turn = 0};
+    spinlock_init(&bp.bp_lock);
+    sched_queue_init(&bp.bp_queue[0]);
+    sched_queue_init(&bp.bp_queue[1]);
+    if (bench_pair_run(&bp, bench_switch_thread))
+    {
+        kprintf(ksh, "bench name=context_switch error=%d\n", -ENOMEM);
+        return;
+    }
+    bench_report_pair(ksh, "context_switch", 2 * bp.bp_iters, &bp);
+}
+
+/*
+ * An anonymous object, as anon.c would make, for mobj_get_pframe(): the
+ * first lookup of each page misses and takes a zeroed page, the next ones
+ * hit.
+ */
+static long bench_mobj_fill_pframe(mobj_t *o, pframe_t *pf)
+{
+    long ret = swap_in(o, pf);
+    if (ret)
+    {
+        return ret < 0 ? ret : 0;
+    }
+    page_zero(pf->pf_addr);
+    return 0;
+}
+
+static long bench_mobj_flush_pframe(mobj_t *o, pframe_t *pf)
+{
+    return swap_out(o, pf);
+}
+
+static mobj_ops_t bench_mobj_ops = {.get_pframe = NULL,
+                                    .fill_pframe = bench_mobj_fill_pframe,
+                                    .flush_pframe = bench_mobj_flush_pframe,
+                                    .destructor = NULL};
+
+/* Looks up every page of o once, returning the cycles taken or 0 */
+static uint64_t bench_mobj_pass(mobj_t *o)
+{
+    uint64_t start = cpuid_rdtsc();
+    for (uint64_t pagenum = 0; pagenum < BENCH_MOBJ_PAGES; pagenum++)
+    {
+        pframe_t *pf;
+        if (mobj_get_pframe(o, pagenum, 0, &pf))
+        {
+            return 0;
+        }
+        pframe_release(&pf);
+    }
+    return cpuid_rdtsc() - start;
+}
+
+static void bench_mobj(kshell_t *ksh)
+{
+    mobj_t obj;
+    mobj_t *o = &obj;
+    mobj_init(o, MOBJ_ANON, &bench_mobj_ops);
+    mobj_lock(o);
+    uint64_t miss = bench_mobj_pass(o);
+    uint64_t hit = miss ? bench_mobj_pass(o) : 0;
+    mobj_unlock(o);
+    mobj_put(&o);
+
+    if (!hit)
+    {
+        kprintf(ksh, "bench name=mobj_get_pframe error=%d\n", -ENOMEM);
+        return;
+    }
+    bench_report(ksh, "mobj_get_pframe_miss", BENCH_MOBJ_PAGES, miss, NULL);
+    bench_report(ksh, "mobj_get_pframe_hit", BENCH_MOBJ_PAGES, hit, NULL);
+}
+
+#ifdef __VFS__
+/*
+ * Resolves a path BENCH_PATH_DEPTH directories deep, which the benchmark
+ * makes under BENCH_PATH_ROOT and removes afterwards.
+ */
+static void bench_namev(kshell_t *ksh)
+{
+    char path[BENCH_PATH_DEPTH * 2 + sizeof(BENCH_PATH_ROOT)];
+    size_t len = strlen(BENCH_PATH_ROOT);
+    memcpy(path, BENCH_PATH_ROOT, len + 1);
+
+    /* made counts the directories made, BENCH_PATH_ROOT included */
+    long ret = 0;
+    size_t made;
+    for (made = 0; made <= BENCH_PATH_DEPTH; made++)
+    {
+        if (made)
+        {
+            memcpy(path + len, "/d", 3);
+            len += 2;
+        }
+        if ((ret = do_mkdir(path)))
+        {
+            break;
+        }
+    }
+
+    uint64_t cycles = 0;
+    for (size_t i = 0; !ret && i < BENCH_PATH_ITERS; i++)
+    {
+        vnode_t *vn;
+        uint64_t start = cpuid_rdtsc();
+        ret = namev_resolve(vfs_root_fs.fs_root, path, &vn);
+        cycles += cpuid_rdtsc() - start;
+        if (!ret)
+        {
+            vput(&vn);
+        }
+    }
+
+    /* remove what was made, deepest first */
+    if (made <= BENCH_PATH_DEPTH && made)
+    {
+        len -= 2;
+        path[len] = '\0';
+    }
+    while (made--)
+    {
+        do_rmdir(path);
+        if (made)
+        {
+            len -= 2;
+            path[len] = '\0';
+        }
+    }
+
+    if (ret)
+    {
+        kprintf(ksh, "bench name=namev_resolve error=%ld\n", ret);
+        return;
+    }
+    char extra[BENCH_NAME_LEN];
+    snprintf(extra, sizeof(extra), "depth=%d", BENCH_PATH_DEPTH + 1);
+    bench_report(ksh, "namev_resolve", BENCH_PATH_ITERS, cycles, extra);
+}
+#endif
+
+#ifdef __DRIVERS__
+/*
+ * Reads the start of the first disk in BENCH_DISK_CHUNK-block requests,
+ * straight through the driver's read_block (sata_read_block()).
+ */
+static void bench_disk(kshell_t *ksh)
+{
+    blockdev_t *bd = blockdev_lookup(MKDEVID(DISK_MAJOR, 0));
+    char *buf = bd ? page_alloc_n(BENCH_DISK_CHUNK) : NULL;
+    if (!buf)
+    {
+        kprintf(ksh, "bench name=sata_read_block error=%d\n",
+                bd ? -ENOMEM : -ENODEV);
+        return;
+    }
+    long ret = 0;
+    uint64_t start = cpuid_rdtsc();
+    for (blocknum_t block = 0; !ret && block < BENCH_DISK_BLOCKS;
+         block += BENCH_DISK_CHUNK)
+    {
+        ret = bd->bd_ops->read_block(bd, buf, block, BENCH_DISK_CHUNK);
+    }
+    uint64_t cycles = cpuid_rdtsc() - start;
+    page_free_n(buf, BENCH_DISK_CHUNK);
+
+    if (ret)
+    {
+        kprintf(ksh, "bench name=sata_read_block error=%ld\n", ret);
+        return;
+    }
+    char extra[BENCH_NAME_LEN];
+    snprintf(extra, sizeof(extra), "bytes=%lu",
+             (size_t)BENCH_DISK_BLOCKS * BLOCK_SIZE);
+    bench_report(ksh, "sata_read_block", BENCH_DISK_BLOCKS / BENCH_DISK_CHUNK,
+                 cycles, extra);
+}
+#endif
+
+static bench_t benches[] = {
+    {"page_alloc", bench_page_alloc},
+    {"slab", bench_slab},
+    {"kmutex", bench_kmutex},
+    {"context_switch", bench_switch},
+    {"mobj_get_pframe", bench_mobj},
+#ifdef __VFS__
+    {"namev_resolve", bench_namev},
+#endif
+#ifdef __DRIVERS__
+    {"sata_read_block", bench_disk},
+#endif
+};
+
+long bench_main(kshell_t *ksh, const char *prefix)
+{
+    long count = 0;
+    bench_tsc(ksh);
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        if (prefix && strncmp(benches[i].b_name, prefix, strlen(prefix)))
+        {
+            continue;
+        }
+        dbg(DBG_TEST, "running benchmark %s\n", benches[i].b_name);
+        benches[i].b_run(ksh);
+        count++;
+    }
+    return count;
+}
@@ -1,7 +1,23 @@
 #include "commands.h"
+#include "config.h"
 #include "errno.h"
 
 #include "command.h"
+#include "api/syscall.h"
+#include "api/syscall_stats.h"
+
+#include "drivers/blockdev.h"
+
+#include "main/apic.h"
+#include "main/interrupt.h"
+#include "main/intr_stats.h"
+#include "main/smp.h"
+
+#include "mm/reclaim.h"
+
+#include "proc/lockprof.h"
+#include "proc/sched_stats.h"
+#include "proc/spinlock.h"
 
 #ifdef __VFS__
 
@@ -11,10 +27,19 @@
 
 #endif
 
+#include "test/bench.h"
 #include "test/kshell/io.h"
+#include "test/utiltest.h"
 
 #include "util/debug.h"
+#include "util/init.h"
+#include "util/printf.h"
+#include "util/profile.h"
 #include "util/string.h"
+#include "util/time.h"
+#include "util/trace.h"
+
+#include "vm/swap.h"
 
 list_t kshell_commands_list = LIST_INITIALIZER(kshell_commands_list);
 
@@ -75,8 +100,634 @@ long kshell_echo(kshell_t *ksh, size_t argc, char **argv)
     return 0;
 }
 
+long kshell_lockstat(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc == 2 && !strcmp(argv[1], "reset"))
+    {
+        spinlock_stats_reset();
+        return 0;
+    }
+    else if (argc != 1)
+    {
+        kprintf(ksh, "Usage: lockstat [reset]\n");
+        return 1;
+    }
+
+    spinlock_stats_t stats[SPINLOCK_STATS_MAX];
+    size_t n = spinlock_stats_get(stats, SPINLOCK_STATS_MAX);
+    kprintf(ksh, "%-16s %12s %12s %16s\n", "lock", "acquired", "contended",
+            "spin cycles");
+    for (size_t i = 0; i < n; i++)
+    {
+        kprintf(ksh, "%-16s %12lu %12lu %16lu\n", stats[i].ss_name,
+                stats[i].ss_acquisitions, stats[i].ss_contended,
+                stats[i].ss_spin_cycles);
+    }
+    return 0;
+}
+
+/*
+ * Without arguments, lists every system call that has been made, with how
+ * often and how long it took (in TSC cycles); given the name of one, shows
+ * the histogram of its times.
+ */
+long kshell_sysstat(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc == 2 && !strcmp(argv[1], "reset"))
+    {
+        syscall_stats_reset();
+        return 0;
+    }
+    else if (argc > 2)
+    {
+        kprintf(ksh, "Usage: sysstat [reset | <syscall>]\n");
+        return 1;
+    }
+
+    syscall_stats_t stats;
+    if (argc == 2)
+    {
+        size_t sysnum = 0;
+        while (sysnum < syscall_stats_count() &&
+               strcmp(argv[1], syscall_name(sysnum)))
+        {
+            sysnum++;
+        }
+        if (sysnum == syscall_stats_count())
+        {
+            kprintf(ksh, "sysstat: no system call %s\n", argv[1]);
+            return 1;
+        }
+        syscall_stats_get(sysnum, &stats);
+        kprintf(ksh, "%-16s %12s\n", "cycles", "calls");
+        for (size_t i = 0; i < SYSCALL_HIST_BUCKETS; i++)
+        {
+            if (stats.sc_hist[i])
+            {
+                char range[24];
+                snprintf(range, sizeof(range), "%s2^%lu",
+                         i == SYSCALL_HIST_BUCKETS - 1 ? ">= " : "< ", i + 1);
+                kprintf(ksh, "%-16s %12lu\n", range, stats.sc_hist[i]);
+            }
+        }
+        return 0;
+    }
+
+    kprintf(ksh, "%-20s %12s %16s %12s\n", "syscall", "calls", "cycles",
+            "mean");
+    for (size_t sysnum = 0; sysnum < syscall_stats_count(); sysnum++)
+    {
+        syscall_stats_get(sysnum, &stats);
+        if (stats.sc_calls)
+        {
+            kprintf(ksh, "%-20s %12lu %16lu %12lu\n", syscall_name(sysnum),
+                    stats.sc_calls, stats.sc_cycles,
+                    stats.sc_cycles / stats.sc_calls);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Shows the free memory, and what each stage of reclaim (page cache, slab
+ * caches, killing processes, compaction) has done so far.
+ */
+long kshell_memstat(kshell_t *ksh, size_t argc, char **argv)
+{
+    reclaim_stats_t stats;
+    reclaim_stats_get(&stats);
+    kprintf(ksh, "free pages:          %12lu\n", stats.rs_free);
+    kprintf(ksh, "failed allocations:  %12lu\n", stats.rs_failures);
+    kprintf(ksh, "page cache: active %lu, inactive %lu, scanned %lu, "
+                 "evicted %lu (%lu written)\n",
+            stats.rs_active, stats.rs_inactive, stats.rs_scanned,
+            stats.rs_evicted, stats.rs_written);
+    kprintf(ksh, "slab caches: shrunk %lu times, %lu pages freed\n",
+            stats.rs_slab_runs, stats.rs_slab_pages);
+    kprintf(ksh, "out of memory: %lu processes killed, %lu pages resident\n",
+            stats.rs_oom_kills, stats.rs_oom_pages);
+    kprintf(ksh, "compaction: %lu runs, %lu blocks freed, %lu pages moved\n",
+            stats.rs_compact_runs, stats.rs_compact_blocks, stats.rs_migrated);
+
+    swap_stats_t swap;
+    swap_stats_get(&swap);
+    if (swap.ss_slots)
+    {
+        kprintf(ksh, "swap: %lu of %lu slots used, %lu pages out, %lu in\n",
+                swap.ss_used, swap.ss_slots, swap.ss_out, swap.ss_in);
+    }
+    else
+    {
+        kprintf(ksh, "swap: no disk\n");
+    }
+    kprintf(ksh,
+            "compressed swap: %lu pages in %lu pages of memory, %lu "
+            "incompressible\n",
+            swap.ss_compressed, swap.ss_compressed_pages, swap.ss_rejected);
+    return 0;
+}
+
+/* Prints a histogram of IOSTAT_HIST_BUCKETS log2 buckets of cycles. */
+static void kshell_iostat_hist(kshell_t *ksh, const char *what,
+                               const uint64_t *hist)
+{
+    kprintf(ksh, "%-16s %12s\n", what, "requests");
+    for (size_t i = 0; i < IOSTAT_HIST_BUCKETS; i++)
+    {
+        if (hist[i])
+        {
+            char range[24];
+            snprintf(range, sizeof(range), "%s2^%lu",
+                     i == IOSTAT_HIST_BUCKETS - 1 ? ">= " : "< ", i + 1);
+            kprintf(ksh, "%-16s %12lu\n", range, hist[i]);
+        }
+    }
+}
+
+/*
+ * Without arguments, lists every disk's request counts, merges, queue depth,
+ * and mean queue and service times (in TSC cycles); given the name of one
+ * (e.g. hda0), shows the histograms of those times. Telling the two times
+ * apart tells a busy disk from a slow one.
+ */
+long kshell_iostat(kshell_t *ksh, size_t argc, char **argv)
+{
+    long reset = argc == 2 && !strcmp(argv[1], "reset");
+    if (argc > 2)
+    {
+        kprintf(ksh, "Usage: iostat [reset | <disk>]\n");
+        return 1;
+    }
+
+    if (!reset && argc == 1)
+    {
+        kprintf(ksh, "%-8s %10s %10s %12s %12s %10s %9s %12s %12s\n", "disk",
+                "reads", "writes", "blocks read", "blocks wrtn", "merges",
+                "inflight", "queue mean", "svc mean");
+    }
+    long found = 0;
+    for (long i = 0; i < __NDISKS__; i++)
+    {
+        blockdev_t *bd = blockdev_lookup(MKDEVID(DISK_MAJOR, i));
+        char name[16];
+        snprintf(name, sizeof(name), "hda%ld", i);
+        if (!bd || !bd->bd_ops->submit ||
+            (argc == 2 && !reset && strcmp(argv[1], name)))
+        {
+            continue;
+        }
+        found = 1;
+        if (reset)
+        {
+            iosched_stats_reset(bd);
+            continue;
+        }
+
+        iosched_stats_t stats;
+        iosched_stats_get(bd, &stats);
+        if (argc == 2)
+        {
+            kprintf(ksh, "%s: %lu errors, at most %lu requests in flight, "
+                         "%lu requests dispatched late\n",
+                    name, stats.is_errors, stats.is_max_inflight,
+                    stats.is_nexpired);
+            kshell_iostat_hist(ksh, "queue cycles", stats.is_queue_hist);
+            kshell_iostat_hist(ksh, "service cycles", stats.is_service_hist);
+            continue;
+        }
+        size_t ndone = stats.is_reads + stats.is_writes;
+        size_t ndispatched = ndone + stats.is_inflight;
+        kprintf(ksh, "%-8s %10lu %10lu %12lu %12lu %10lu %9lu %12lu %12lu\n",
+                name, stats.is_reads, stats.is_writes, stats.is_blocks_read,
+                stats.is_blocks_written,
+                stats.is_back_merges + stats.is_front_merges,
+                stats.is_inflight,
+                ndispatched ? stats.is_queue_cycles / ndispatched : 0,
+                ndone ? stats.is_service_cycles / ndone : 0);
+    }
+    if (argc == 2 && !reset && !found)
+    {
+        kprintf(ksh, "iostat: no disk %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
+
+/* Names an interrupt vector, as intrstat shows and takes it. */
+static void kshell_intr_name(uint8_t intr, char *buf, size_t size)
+{
+    static const struct
+    {
+        uint8_t vector;
+        const char *name;
+    } names[] = {
+        {INTR_DIVIDE_BY_ZERO, "divide"},  {INTR_INVALID_OPCODE, "opcode"},
+        {INTR_GPF, "gpf"},                {INTR_PAGE_FAULT, "pagefault"},
+        {INTR_SYSCALL, "syscall"},        {INTR_DISK_PRIMARY, "disk"},
+        {INTR_KEYBOARD, "keyboard"},      {INTR_APICTIMER, "timer"},
+        {INTR_TLB_SHOOTDOWN, "tlb"},      {INTR_SHUTDOWN, "shutdown"},
+        {INTR_SPURIOUS, "spurious"},      {INTR_APICERR, "apicerr"},
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (names[i].vector == intr)
+        {
+            snprintf(buf, size, "%s", names[i].name);
+            return;
+        }
+    }
+    snprintf(buf, size, "0x%02x", intr);
+}
+
+/* Prints a histogram of INTR_HIST_BUCKETS log2 buckets of cycles. */
+static void kshell_intrstat_hist(kshell_t *ksh, const char *what,
+                                 const uint64_t *hist)
+{
+    kprintf(ksh, "%-16s %12s\n", "cycles", what);
+    for (size_t i = 0; i < INTR_HIST_BUCKETS; i++)
+    {
+        if (hist[i])
+        {
+            char range[24];
+            snprintf(range, sizeof(range), "%s2^%lu",
+                     i == INTR_HIST_BUCKETS - 1 ? ">= " : "< ", i + 1);
+            kprintf(ksh, "%-16s %12lu\n", range, hist[i]);
+        }
+    }
+}
+
+/*
+ * Without arguments, lists every interrupt vector that has been taken, with
+ * how often on each core and how long its handler ran (in TSC cycles), then
+ * how long each core's IPL was raised and where the longest such window was
+ * opened. Given the name of a vector (or "ipl"), shows the histogram of those
+ * times. Storms show up as counts, and long IPL_HIGH sections as the sites
+ * to look at (see symbols.dbg).
+ */
+long kshell_intrstat(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc == 2 && !strcmp(argv[1], "reset"))
+    {
+        intr_stats_reset();
+        return 0;
+    }
+    else if (argc > 2)
+    {
+        kprintf(ksh, "Usage: intrstat [reset | ipl | <vector>]\n");
+        return 1;
+    }
+
+    char name[16];
+    intr_stats_t stats;
+    ipl_stats_t ipl;
+    if (argc == 2 && !strcmp(argv[1], "ipl"))
+    {
+        ipl_stats_get(-1, &ipl);
+        kshell_intrstat_hist(ksh, "windows", ipl.ip_hist);
+        return 0;
+    }
+    if (argc == 2)
+    {
+        for (size_t i = 0; i < intr_stats_count(); i++)
+        {
+            kshell_intr_name(intr_stats_vector(i), name, sizeof(name));
+            if (!strcmp(argv[1], name))
+            {
+                intr_stats_get(i, -1, &stats);
+                kshell_intrstat_hist(ksh, "interrupts", stats.in_hist);
+                return 0;
+            }
+        }
+        kprintf(ksh, "intrstat: no interrupt %s\n", argv[1]);
+        return 1;
+    }
+
+    kprintf(ksh, "%-10s %12s %12s %10s %12s", "vector", "count", "timed",
+            "mean", "max");
+    for (long core = 0; core <= apic_max_id(); core++)
+    {
+        if (csd_vaddr_table[core])
+        {
+            snprintf(name, sizeof(name), "C%ld", core);
+            kprintf(ksh, " %10s", name);
+        }
+    }
+    kprintf(ksh, "\n");
+    for (size_t i = 0; i < intr_stats_count(); i++)
+    {
+        intr_stats_get(i, -1, &stats);
+        if (!stats.in_count)
+        {
+            continue;
+        }
+        kshell_intr_name(intr_stats_vector(i), name, sizeof(name));
+        kprintf(ksh, "%-10s %12lu %12lu %10lu %12lu", name, stats.in_count,
+                stats.in_timed,
+                stats.in_timed ? stats.in_cycles / stats.in_timed : 0,
+                stats.in_max_cycles);
+        for (long core = 0; core <= apic_max_id(); core++)
+        {
+            if (csd_vaddr_table[core])
+            {
+                intr_stats_t s;
+                intr_stats_get(i, core, &s);
+                kprintf(ksh, " %10lu", s.in_count);
+            }
+        }
+        kprintf(ksh, "\n");
+    }
+
+    kprintf(ksh, "\n%-10s %12s %16s %10s %12s  %s\n", "core", "ipl raised",
+            "cycles", "mean", "max", "longest from");
+    for (long core = 0; core <= apic_max_id(); core++)
+    {
+        if (!csd_vaddr_table[core])
+        {
+            continue;
+        }
+        ipl_stats_get(core, &ipl);
+        snprintf(name, sizeof(name), "C%ld", core);
+        kprintf(ksh, "%-10s %12lu %16lu %10lu %12lu  %p\n", name,
+                ipl.ip_raised, ipl.ip_cycles,
+                ipl.ip_raised ? ipl.ip_cycles / ipl.ip_raised : 0,
+                ipl.ip_max_cycles, ipl.ip_max_site);
+    }
+    return 0;
+}
+
+/*
+ * Without arguments, shows each core's switches by reason, mean and longest
+ * run queue, waits on the run queue (in TSC cycles), idle time and threads
+ * stolen by load balancing. Given a core ("C1"), or "all", shows the
+ * histograms of its run queue lengths and waits. A long mean wait on one
+ * core and steals on another say the load is not spread.
+ */
+long kshell_schedstat(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc == 2 && !strcmp(argv[1], "reset"))
+    {
+        sched_stats_reset();
+        return 0;
+    }
+    else if (argc > 2)
+    {
+        kprintf(ksh, "Usage: schedstat [reset | all | <core>]\n");
+        return 1;
+    }
+
+    char name[16];
+    sched_stats_t stats;
+    if (argc == 2)
+    {
+        long core = -1;
+        if (strcmp(argv[1], "all"))
+        {
+            for (long c = 0; c <= apic_max_id(); c++)
+            {
+                snprintf(name, sizeof(name), "C%ld", c);
+                if (csd_vaddr_table[c] && !strcmp(argv[1], name))
+                {
+                    core = c;
+                }
+            }
+            if (core < 0)
+            {
+                kprintf(ksh, "schedstat: no core %s\n", argv[1]);
+                return 1;
+            }
+        }
+        sched_stats_get(core, &stats);
+        kprintf(ksh, "%-16s %12s\n", "run queue", "ticks");
+        for (size_t i = 0; i < SCHED_RUNQ_HIST; i++)
+        {
+            if (stats.ss_runq_hist[i])
+            {
+                kprintf(ksh, "%-16lu %12lu%s\n", i, stats.ss_runq_hist[i],
+                        i == SCHED_RUNQ_HIST - 1 ? " (or more)" : "");
+            }
+        }
+        kprintf(ksh, "\n%-16s %12s\n", "cycles", "waits");
+        for (size_t i = 0; i < SCHED_HIST_BUCKETS; i++)
+        {
+            if (stats.ss_wait_hist[i])
+            {
+                char range[24];
+                snprintf(range, sizeof(range), "%s2^%lu",
+                         i == SCHED_HIST_BUCKETS - 1 ? ">= " : "< ", i + 1);
+                kprintf(ksh, "%-16s %12lu\n", range, stats.ss_wait_hist[i]);
+            }
+        }
+        return 0;
+    }
+
+    kprintf(ksh, "%-6s %10s %10s %10s %8s %6s %12s %14s %16s %8s %8s\n",
+            "core", "sleeps", "yields", "preempts", "runq", "max",
+            "waits", "mean wait", "idle cycles", "steals", "stolen");
+    for (long core = -1; core <= apic_max_id(); core++)
+    {
+        if (core >= 0 && !csd_vaddr_table[core])
+        {
+            continue;
+        }
+        sched_stats_get(core, &stats);
+        snprintf(name, sizeof(name), core < 0 ? "all" : "C%ld", core);
+        char runq[16];
+        snprintf(runq, sizeof(runq), "%lu.%02lu",
+                 stats.ss_ticks ? stats.ss_runq_total / stats.ss_ticks : 0,
+                 stats.ss_ticks
+                     ? stats.ss_runq_total * 100 / stats.ss_ticks % 100
+                     : 0);
+        kprintf(ksh,
+                "%-6s %10lu %10lu %10lu %8s %6lu %12lu %14lu %16lu %8lu "
+                "%8lu\n",
+                name, stats.ss_sleeps, stats.ss_yields, stats.ss_preemptions,
+                runq, stats.ss_runq_max, stats.ss_waits,
+                stats.ss_waits ? stats.ss_wait_cycles / stats.ss_waits : 0,
+                stats.ss_idle_cycles, stats.ss_balances, stats.ss_stolen);
+    }
+    return 0;
+}
+
+/*
+ * Runs the kernel microbenchmarks, or those whose names start with the
+ * argument. See test/bench.h for the output format.
+ */
+long kshell_bench(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc > 2)
+    {
+        kprintf(ksh, "Usage: bench [<name>]\n");
+        return 1;
+    }
+    if (!bench_main(ksh, argc == 2 ? argv[1] : NULL))
+    {
+        kprintf(ksh, "bench: no benchmark %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Without arguments, drains the trace rings to the debug port; "on" and "off"
+ * turn recording of every event, or of the one named, on and off.
+ */
+long kshell_trace(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc == 1)
+    {
+        trace_dump();
+        return 0;
+    }
+
+    const char *onoff = argv[argc - 1];
+    uint64_t bits = TRACE_ALL;
+    if (argc == 3)
+    {
+        long event = trace_event_lookup(argv[1]);
+        if (!event)
+        {
+            kprintf(ksh, "trace: no event %s\n", argv[1]);
+            return 1;
+        }
+        bits = TRACE_BIT(event);
+    }
+    if (argc > 3 || (strcmp(onoff, "on") && strcmp(onoff, "off")))
+    {
+        kprintf(ksh, "Usage: trace [[<event>] on | off]\n");
+        return 1;
+    }
+    if (!strcmp(onoff, "on"))
+    {
+        trace_mask |= bits;
+    }
+    else
+    {
+        trace_mask &= ~bits;
+    }
+    return 0;
+}
+
+/*
+ * Lists how long each initializer took at boot, in the order they ran, with
+ * its share of the total, so the slow ones stand out.
+ */
+long kshell_boottime(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc != 1)
+    {
+        kprintf(ksh, "Usage: boottime\n");
+        return 1;
+    }
+
+    size_t count;
+    const init_time_t *times = init_times(&count);
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        total += times[i].it_cycles;
+    }
+
+    kprintf(ksh, "%-24s %14s %10s %7s\n", "initializer", "cycles", "us",
+            "share");
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t cycles = times[i].it_cycles;
+        uint64_t permille = total ? cycles * 1000 / total : 0;
+        kprintf(ksh, "%-24s %14lu %10lu %5lu.%lu%%\n", times[i].it_name, cycles,
+                time_tsc_to_ns(cycles) / 1000, permille / 10, permille % 10);
+    }
+    kprintf(ksh, "%-24s %14lu %10lu\n", "total", total,
+            time_tsc_to_ns(total) / 1000);
+    return 0;
+}
+
+/*
+ * Starts the sampling profiler, taking a sample every interval ticks (1 by
+ * default), stops it, or drains its samples to the debug port.
+ */
+long kshell_profile(kshell_t *ksh, size_t argc, char **argv)
+{
+    if ((argc == 2 || argc == 3) && !strcmp(argv[1], "start"))
+    {
+        long interval = argc == 3 ? 0 : 1;
+        for (char *c = argc == 3 ? argv[2] : ""; *c; c++)
+        {
+            interval = *c >= '0' && *c <= '9' ? interval * 10 + *c - '0' : -1;
+            if (interval < 0)
+            {
+                break;
+            }
+        }
+        long ret = profile_start(interval);
+        if (ret)
+        {
+            kprintf(ksh, "profile: %s\n", strerror(-ret));
+            return 1;
+        }
+        return 0;
+    }
+    else if (argc == 2 && !strcmp(argv[1], "stop"))
+    {
+        profile_stop();
+        return 0;
+    }
+    else if (argc == 2 && !strcmp(argv[1], "dump"))
+    {
+        profile_dump();
+        return 0;
+    }
+    kprintf(ksh, "Usage: profile start [<interval>] | stop | dump\n");
+    return 1;
+}
+
+#ifdef __LOCKPROF__
+
+#define KSHELL_LOCKPROF_TOP 16
+
+long kshell_lockprof(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc == 2 && !strcmp(argv[1], "reset"))
+    {
+        lockprof_reset();
+        return 0;
+    }
+    else if (argc != 1)
+    {
+        kprintf(ksh, "Usage: lockprof [reset]\n");
+        return 1;
+    }
+
+    /* the sites that waited longest; times are in TSC cycles */
+    lockprof_site_t sites[KSHELL_LOCKPROF_TOP];
+    size_t n = lockprof_top(sites, KSHELL_LOCKPROF_TOP);
+    kprintf(ksh, "%-28s %-5s %9s %9s %12s %10s %12s %10s\n", "site", "type",
+            "acquired", "contended", "wait", "max wait", "hold", "max hold");
+    for (size_t i = 0; i < n; i++)
+    {
+        lockprof_site_t *s = &sites[i];
+        const char *file = strrchr(s->ls_file, '/');
+        char where[32];
+        snprintf(where, sizeof(where), "%s:%ld", file ? file + 1 : s->ls_file,
+                 s->ls_line);
+        kprintf(ksh, "%-28s %-5s %9lu %9lu %12lu %10lu %12lu %10lu\n", where,
+                s->ls_type == LOCKPROF_KMUTEX ? "mutex" : "spin",
+                s->ls_acquisitions, s->ls_contended, s->ls_wait_total,
+                s->ls_wait_max, s->ls_hold_total, s->ls_hold_max);
+    }
+    if (lockprof_lost())
+    {
+        kprintf(ksh, "%lu acquisitions not recorded (tables full)\n",
+                lockprof_lost());
+    }
+    return 0;
+}
+
+#endif
+
 #ifdef __VFS__
 
+#define KSH_CAT_CHUNK 65536 /* bytes cat sends to the shell's output at once */
+
 long kshell_cat(kshell_t *ksh, size_t argc, char **argv)
 {
     if (argc < 2)
@@ -95,12 +746,20 @@ long kshell_cat(kshell_t *ksh, size_t argc, char **argv)
             continue;
         }
 
+        /* regular files go straight from the page cache; sendfile()
+         * refuses anything else */
         long retval;
-        while ((retval = do_read(fd, buf, KSH_BUF_SIZE)) > 0)
+        while ((retval = do_sendfile(ksh->ksh_out_fd, fd, NULL,
+                                     KSH_CAT_CHUNK)) > 0)
+            ;
+        if (retval == -EINVAL)
         {
-            retval = kshell_write_all(ksh, buf, (size_t)retval);
-            if (retval < 0)
-                break;
+            while ((retval = do_read(fd, buf, KSH_BUF_SIZE)) > 0)
+            {
+                retval = kshell_write_all(ksh, buf, (size_t)retval);
+                if (retval < 0)
+                    break;
+            }
         }
         if (retval < 0)
         {
@@ -386,6 +1045,17 @@ long kshell_vfs_test(kshell_t *ksh, size_t argc, char **argv)
 
 #endif
 
+long kshell_utiltest(kshell_t *ksh, size_t argc, char **argv)
+{
+    kprintf(ksh, "TEST UTIL: Testing... Please wait.\n");
+
+    long ret = utiltest_main(0, NULL);
+
+    kprintf(ksh, "TEST UTIL: testing complete, check console for results\n");
+
+    return ret;
+}
+
 #ifdef __S5FS__
 
 long s5fstest_main(int, void *);
@@ -15,6 +15,30 @@ KSHELL_CMD(echo);
 
 KSHELL_CMD(clear);
 
+KSHELL_CMD(lockstat);
+
+KSHELL_CMD(sysstat);
+
+KSHELL_CMD(memstat);
+
+KSHELL_CMD(iostat);
+
+KSHELL_CMD(intrstat);
+
+KSHELL_CMD(schedstat);
+
+KSHELL_CMD(boottime);
+
+KSHELL_CMD(trace);
+
+KSHELL_CMD(profile);
+
+KSHELL_CMD(bench);
+
+#ifdef __LOCKPROF__
+KSHELL_CMD(lockprof);
+#endif
+
 #ifdef __VFS__
 KSHELL_CMD(cat);
 KSHELL_CMD(ls);
@@ -27,6 +51,8 @@ KSHELL_CMD(stat);
 KSHELL_CMD(vfs_test);
 #endif
 
+KSHELL_CMD(utiltest);
+
 #ifdef __S5FS__
 KSHELL_CMD(s5fstest);
 #endif
@@ -52,6 +52,29 @@ void kshell_init()
                        "prints a list of available commands");
     kshell_add_command("echo", kshell_echo, "display a line of text");
     kshell_add_command("clear", kshell_clear, "clears the screen");
+    kshell_add_command("lockstat", kshell_lockstat,
+                       "display spinlock contention statistics");
+    kshell_add_command("sysstat", kshell_sysstat,
+                       "display system call counts and latencies");
+    kshell_add_command("memstat", kshell_memstat,
+                       "display what memory reclaim has done");
+    kshell_add_command("iostat", kshell_iostat,
+                       "display block device request counts and latencies");
+    kshell_add_command("intrstat", kshell_intrstat,
+                       "display interrupt counts, handler times and raised IPL");
+    kshell_add_command("schedstat", kshell_schedstat,
+                       "display run queue lengths, waits and switch reasons");
+    kshell_add_command("boottime", kshell_boottime,
+                       "display how long each initializer took at boot");
+    kshell_add_command("trace", kshell_trace,
+                       "print trace records to the debug port");
+    kshell_add_command("profile", kshell_profile,
+                       "sample where the cores spend their time");
+    kshell_add_command("bench", kshell_bench, "run kernel microbenchmarks");
+#ifdef __LOCKPROF__
+    kshell_add_command("lockprof", kshell_lockprof,
+                       "display the most contended lock sites");
+#endif
 #ifdef __VFS__
     kshell_add_command("cat", kshell_cat,
                        "concatenate files and print on the standard output");
@@ -66,6 +89,9 @@ void kshell_init()
     kshell_add_command("vfstest", kshell_vfs_test, "runs VFS tests");
 #endif
 
+    kshell_add_command("utiltest", kshell_utiltest,
+                       "runs red-black tree and hash table tests");
+
 #ifdef __S5FS__
     kshell_add_command("s5fstest", kshell_s5fstest, "runs S5FS tests");
 #endif
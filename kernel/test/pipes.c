@@ -8,6 +8,8 @@
 #include "test/kshell/io.h"
 #include "test/kshell/kshell.h"
 
+#include "util/init.h"
+
 #define IMAX 256
 #define JMAX 16
 #define KMAX 16
@@ -21,16 +23,6 @@ static kthread_t *make_proc_and_thread(char *name, kthread_func_t func,
     {
         return NULL;
     }
-
-    int i;
-    for (i = 0; i < NFILES; ++i)
-    {
-        proc->p_files[i] = curproc->p_files[i];
-        if (proc->p_files[i])
-        {
-            fref(proc->p_files[i]);
-        }
-    }
     return kthread_create(proc, func, arg1, arg2);
 }
 
@@ -100,7 +92,7 @@ out:
     return NULL;
 }
 
-static int test_pipes(kshell_t *ksh, int argc, char **argv)
+static long test_pipes(kshell_t *ksh, size_t argc, char **argv)
 {
     int pfds[2];
     int err = do_pipe(pfds);
@@ -124,7 +116,7 @@ static int test_pipes(kshell_t *ksh, int argc, char **argv)
 }
 
 #ifdef __PIPES__
-static __attribute__((unused)) void test_pipes_init()
+static __attribute__((used)) void test_pipes_init()
 {
     kshell_add_command("test_pipes", test_pipes, "run pipe tests");
 }
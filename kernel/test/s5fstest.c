@@ -24,12 +24,14 @@ static void get_file_name(char *buf, size_t sz, long fileno)
     snprintf(buf, sz, "file%ld", fileno);
 }
 
-// Write to a fail forever until it is either filled up or we get an error.
-static long write_until_fail(int fd)
+// Write to a fail forever, starting at pos, until it is either filled up or we
+// get an error.
+static long write_until_fail(int fd, size_t pos)
 {
-    size_t total_written = 0;
+    size_t total_written = pos;
     char buf[BIG_BUFSIZE] = {42};
-    while (total_written < S5_MAX_FILE_SIZE)
+    KASSERT(do_lseek(fd, (off_t)pos, SEEK_SET) == (off_t)pos);
+    while (total_written < S5_EXTENT_MAX_FILE_SIZE)
     {
         long res = do_write(fd, buf, BIG_BUFSIZE);
         if (res < 0)
@@ -38,8 +40,8 @@ static long write_until_fail(int fd)
         }
         total_written += res;
     }
-    KASSERT(total_written == S5_MAX_FILE_SIZE);
-    KASSERT(do_lseek(fd, 0, SEEK_END) == S5_MAX_FILE_SIZE);
+    KASSERT(total_written == S5_EXTENT_MAX_FILE_SIZE);
+    KASSERT(do_lseek(fd, 0, SEEK_END) == S5_EXTENT_MAX_FILE_SIZE);
 
     return 0;
 }
@@ -132,7 +134,9 @@ static void test_filling_file()
     int fd = (int)do_open("hugefile", O_RDWR | O_CREAT);
     KASSERT(fd >= 0);
 
-    res = write_until_fail(fd);
+    // new files are extent-mapped, and far larger than the disk, so only the
+    // last few blocks are written
+    res = write_until_fail(fd, S5_EXTENT_MAX_FILE_SIZE - 4 * BIG_BUFSIZE);
     test_assert(res == 0, "Did not write to entire file");
 
     // make sure all other writes are unsuccessful/dont complete
@@ -145,21 +149,21 @@ static void test_filling_file()
     test_assert(do_unlink("hugefile") == 0, "couldnt unlink hugefile");
 }
 
-// Fill up the disk. Apparently to do this, we should need to fill up one
-// entire file, then start to fill up another. We should eventually get
-// the ENOSPC error
+// Fill up the disk. A single file can now outgrow it, so filling up one file
+// should eventually get the ENOSPC error, after which another file can't be
+// written either
 static void test_running_out_of_blocks()
 {
     long res = 0;
 
     int fd1 = (int)do_open("fullfile", O_RDWR | O_CREAT);
 
-    res = write_until_fail(fd1);
-    test_assert(res == 0, "Ran out of space quicker than we expected");
+    res = write_until_fail(fd1, 0);
+    test_assert(res == -ENOSPC, "Did not get nospc error");
     test_assert(do_close(fd1) == 0, "could not close");
 
     int fd2 = (int)do_open("partiallyfullfile", O_RDWR | O_CREAT);
-    res = write_until_fail(fd2);
+    res = write_until_fail(fd2, 0);
     test_assert(res == -ENOSPC, "Did not get nospc error");
 
     test_assert(do_close(fd2) == 0, "could not close");
@@ -0,0 +1,341 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "test/usertest.h"
+#include "test/utiltest.h"
+
+#include "mm/kmalloc.h"
+
+#include "proc/rcu.h"
+
+#include "util/debug.h"
+#include "util/htable.h"
+#include "util/rbtree.h"
+#include "util/string.h"
+
+/*
+ * Tests for the red-black tree and the hash table, driven by a fixed random
+ * sequence so that a failure happens again on the next run.
+ */
+
+#define UTILTEST_RB_NODES 256
+#define UTILTEST_RB_OPS 4096
+#define UTILTEST_RB_KEYS 64 /* few enough that keys repeat */
+
+#define UTILTEST_HT_ITEMS 1024
+
+static uint64_t utiltest_seed;
+
+static uint64_t utiltest_rand(void)
+{
+    utiltest_seed =
+        utiltest_seed * 6364136223846793005UL + 1442695040888963407UL;
+    return utiltest_seed >> 33;
+}
+
+/*
+ * A tree of keys, augmented with the largest weight in each subtree, the way
+ * an interval tree keeps the largest end.
+ */
+typedef struct rbtest_node
+{
+    rb_node_t rn_node;
+    long rn_key;
+    long rn_weight;
+    long rn_max; /* largest rn_weight in the subtree */
+    long rn_in;  /* in the tree */
+} rbtest_node_t;
+
+static void rbtest_augment(rb_node_t *node)
+{
+    rbtest_node_t *n = rb_item(node, rbtest_node_t, rn_node);
+    n->rn_max = n->rn_weight;
+    rbtest_node_t *l = rb_item(node->rb_left, rbtest_node_t, rn_node);
+    rbtest_node_t *r = rb_item(node->rb_right, rbtest_node_t, rn_node);
+    if (l && l->rn_max > n->rn_max)
+    {
+        n->rn_max = l->rn_max;
+    }
+    if (r && r->rn_max > n->rn_max)
+    {
+        n->rn_max = r->rn_max;
+    }
+}
+
+static void rbtest_insert(rb_tree_t *tree, rbtest_node_t *n)
+{
+    rb_node_t **link = &tree->rt_root, *parent = NULL;
+    while (*link)
+    {
+        parent = *link;
+        link = n->rn_key < rb_item(parent, rbtest_node_t, rn_node)->rn_key
+                   ? &parent->rb_left
+                   : &parent->rb_right;
+    }
+    rb_insert(tree, &n->rn_node, parent, link);
+    n->rn_in = 1;
+}
+
+/*
+ * Checks the subtree at node: parent links, no red node with a red child, the
+ * same number of black nodes on every path down, keys in order and augmented
+ * values up to date. Returns the subtree's black height, or -1 if it is
+ * broken, and counts its nodes in *count.
+ */
+static long rbtest_check(rb_node_t *node, rb_node_t *parent, size_t *count)
+{
+    if (!node)
+    {
+        return 1;
+    }
+    rbtest_node_t *n = rb_item(node, rbtest_node_t, rn_node);
+    rbtest_node_t *l = rb_item(node->rb_left, rbtest_node_t, rn_node);
+    rbtest_node_t *r = rb_item(node->rb_right, rbtest_node_t, rn_node);
+    if (node->rb_parent != parent || !n->rn_in)
+    {
+        return -1;
+    }
+    if (node->rb_red &&
+        ((l && l->rn_node.rb_red) || (r && r->rn_node.rb_red)))
+    {
+        return -1;
+    }
+    if ((l && l->rn_key > n->rn_key) || (r && r->rn_key < n->rn_key))
+    {
+        return -1;
+    }
+    long max = n->rn_weight;
+    max = l && l->rn_max > max ? l->rn_max : max;
+    max = r && r->rn_max > max ? r->rn_max : max;
+    if (n->rn_max != max)
+    {
+        return -1;
+    }
+
+    long lh = rbtest_check(node->rb_left, node, count);
+    long rh = rbtest_check(node->rb_right, node, count);
+    if (lh < 0 || lh != rh)
+    {
+        return -1;
+    }
+    (*count)++;
+    return lh + !node->rb_red;
+}
+
+/* Checks the whole tree, and that walking it in order visits every node */
+static long rbtest_valid(rb_tree_t *tree, size_t expected)
+{
+    size_t count = 0;
+    if ((tree->rt_root && tree->rt_root->rb_red) ||
+        rbtest_check(tree->rt_root, NULL, &count) < 0)
+    {
+        return 0;
+    }
+    if (count != expected || tree->rt_count != expected)
+    {
+        return 0;
+    }
+
+    size_t walked = 0;
+    long prev = -1;
+    for (rb_node_t *node = rb_first(tree); node; node = rb_next(node))
+    {
+        long key = rb_item(node, rbtest_node_t, rn_node)->rn_key;
+        if (key < prev)
+        {
+            return 0;
+        }
+        prev = key;
+        walked++;
+    }
+    for (rb_node_t *node = rb_last(tree); node; node = rb_prev(node))
+    {
+        walked--;
+    }
+    return walked == 0;
+}
+
+static void test_rbtree()
+{
+    rbtest_node_t *nodes = kmalloc(UTILTEST_RB_NODES * sizeof(rbtest_node_t));
+    KASSERT(nodes && "Unable to alloc the tree nodes");
+    memset(nodes, 0, UTILTEST_RB_NODES * sizeof(rbtest_node_t));
+
+    rb_tree_t tree;
+    rb_tree_init(&tree, rbtest_augment);
+    test_assert(rbtest_valid(&tree, 0) && !rb_first(&tree),
+                "An empty tree should have no nodes");
+
+    /* insert and remove nodes at random, reweighting some in place */
+    size_t in = 0;
+    long ok = 1;
+    for (long i = 0; i < UTILTEST_RB_OPS && ok; i++)
+    {
+        rbtest_node_t *n = &nodes[utiltest_rand() % UTILTEST_RB_NODES];
+        if (n->rn_in && utiltest_rand() % 4 == 0)
+        {
+            n->rn_weight = (long)(utiltest_rand() % 1000);
+            rb_update(&tree, &n->rn_node);
+        }
+        else if (n->rn_in)
+        {
+            rb_remove(&tree, &n->rn_node);
+            n->rn_in = 0;
+            in--;
+        }
+        else
+        {
+            n->rn_key = (long)(utiltest_rand() % UTILTEST_RB_KEYS);
+            n->rn_weight = (long)(utiltest_rand() % 1000);
+            rbtest_insert(&tree, n);
+            in++;
+        }
+        ok = rbtest_valid(&tree, in);
+        test_assert(ok, "Tree broken after operation %ld", i);
+    }
+
+    /* the root's augmented value covers every node */
+    long max = -1;
+    for (long i = 0; i < UTILTEST_RB_NODES; i++)
+    {
+        if (nodes[i].rn_in && nodes[i].rn_weight > max)
+        {
+            max = nodes[i].rn_weight;
+        }
+    }
+    rbtest_node_t *root = rb_item(tree.rt_root, rbtest_node_t, rn_node);
+    test_assert(!root || root->rn_max == max,
+                "The root should hold the largest weight");
+
+    /* empty it while iterating, which must survive removal */
+    rb_iterate(&tree, n, rbtest_node_t, rn_node)
+    {
+        rb_remove(&tree, &n->rn_node);
+        n->rn_in = 0;
+        in--;
+    }
+    test_assert(in == 0 && rbtest_valid(&tree, 0),
+                "Tree should be empty after removing every node");
+
+    kfree(nodes);
+}
+
+typedef struct httest_item
+{
+    htable_link_t hi_link;
+    long hi_id;
+} httest_item_t;
+
+/* Items i and i + UTILTEST_HT_ITEMS / 2 share a key, which has bits set high
+ * as well as low */
+static uint64_t httest_key(long i)
+{
+    uint64_t k = (uint64_t)(i % (UTILTEST_HT_ITEMS / 2));
+    return (k << 40) | (k * 3);
+}
+
+static long httest_match(htable_link_t *link, void *arg)
+{
+    return CONTAINER_OF(link, httest_item_t, hi_link)->hi_id == (long)arg;
+}
+
+/* Looks item i up both with the bucket locked and without a lock */
+static long httest_find(htable_t *table, long i)
+{
+    uint64_t key = httest_key(i);
+    long found = 0;
+    htable_bucket_t *bucket = htable_lock(table, key);
+    htable_bucket_iterate(bucket, it, httest_item_t, hi_link)
+    {
+        if (it->hi_link.hl_key == key && it->hi_id == i)
+        {
+            found++;
+        }
+    }
+    htable_unlock(table, bucket);
+
+    rcu_read_lock();
+    htable_link_t *link =
+        htable_lookup_rcu(table, key, httest_match, (void *)i);
+    rcu_read_unlock();
+    if (link && CONTAINER_OF(link, httest_item_t, hi_link)->hi_id != i)
+    {
+        return -1;
+    }
+    return found == 1 && link ? 1 : (!found && !link ? 0 : -1);
+}
+
+static void test_htable()
+{
+    httest_item_t *items = kmalloc(UTILTEST_HT_ITEMS * sizeof(httest_item_t));
+    KASSERT(items && "Unable to alloc the table items");
+
+    htable_t table;
+    test_assert(!htable_init(&table, 1), "htable_init() failed");
+    size_t nbuckets = table.ht_array->ha_nbuckets;
+    test_assert(nbuckets == 1, "One bucket asked for, %lu made", nbuckets);
+
+    for (long i = 0; i < UTILTEST_HT_ITEMS; i++)
+    {
+        httest_item_t *it = &items[i];
+        htable_link_init(&it->hi_link);
+        it->hi_id = i;
+        htable_bucket_t *bucket = htable_lock(&table, httest_key(i));
+        htable_insert(&table, bucket, &it->hi_link, httest_key(i));
+        htable_unlock(&table, bucket);
+    }
+    nbuckets = table.ht_array->ha_nbuckets;
+    test_assert(table.ht_count == UTILTEST_HT_ITEMS,
+                "Table should count %d items, has %lu", UTILTEST_HT_ITEMS,
+                table.ht_count);
+    test_assert(nbuckets * HTABLE_LOAD >= UTILTEST_HT_ITEMS,
+                "Table should have grown, has %lu buckets", nbuckets);
+
+    long bad = 0;
+    for (long i = 0; i < UTILTEST_HT_ITEMS; i++)
+    {
+        bad += httest_find(&table, i) != 1;
+    }
+    test_assert(!bad, "%ld items not found once after growing", bad);
+
+    /* take out the even items: both items of the even keys, so that those
+     * keys are gone, while the odd keys keep both */
+    for (long i = 0; i < UTILTEST_HT_ITEMS; i += 2)
+    {
+        httest_item_t *it = &items[i];
+        htable_bucket_t *bucket = htable_lock(&table, httest_key(i));
+        htable_remove(&table, bucket, &it->hi_link);
+        htable_unlock(&table, bucket);
+        bad += htable_link_is_linked(&it->hi_link);
+    }
+    test_assert(!bad, "%ld removed items still linked", bad);
+    test_assert(table.ht_count == UTILTEST_HT_ITEMS / 2,
+                "Table should count %d items, has %lu",
+                UTILTEST_HT_ITEMS / 2, table.ht_count);
+    for (long i = 0; i < UTILTEST_HT_ITEMS; i++)
+    {
+        bad += httest_find(&table, i) != (i & 1);
+    }
+    test_assert(!bad, "%ld items found wrongly after removals", bad);
+
+    for (long i = 1; i < UTILTEST_HT_ITEMS; i += 2)
+    {
+        htable_bucket_t *bucket = htable_lock(&table, httest_key(i));
+        htable_remove(&table, bucket, &items[i].hi_link);
+        htable_unlock(&table, bucket);
+    }
+    test_assert(!table.ht_count, "Table should be empty");
+    htable_destroy(&table);
+
+    kfree(items);
+}
+
+long utiltest_main(long arg1, void *arg2)
+{
+    test_init();
+    utiltest_seed = 0x5eed;
+    test_rbtree();
+    test_htable();
+    test_fini();
+    return 0;
+}
@@ -17,7 +17,8 @@
  *
  * Note that due to the way this is interpreted either 'all' or '-all' should
  * always be the first thing in this variable. Note that this setting can be
- * changed at runtime by modifying the dbg_modes global variable.
+ * changed at runtime by modifying the dbg_modes global variable, though only
+ * for the modes in DBG_COMPILED_MODES (see 'kernel/include/util/debug.h').
  */
 #define INIT_DBG_MODES "-all,test,print,vfs"
 
@@ -150,7 +151,7 @@ void dbg_add_mode(const char *name)
     }
     else
     {
-        dbg_modes |= mode->d_mode;
+        dbg_modes |= mode->d_mode & DBG_COMPILED_MODES;
     }
 }
 
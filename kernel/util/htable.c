@@ -0,0 +1,217 @@
+#include "errno.h"
+#include "kernel.h"
+
+#include "mm/vmalloc.h"
+
+#include "util/debug.h"
+#include "util/htable.h"
+
+/*
+ * Spread keys that differ only in their high bits, or by multiples of the
+ * number of buckets, over the buckets.
+ */
+static inline size_t htable_index(uint64_t key, size_t nbuckets)
+{
+    key *= 0x9e3779b97f4a7c15UL;
+    return (size_t)(key ^ (key >> 32)) & (nbuckets - 1);
+}
+
+/*
+ * Link an item in at the head of a bucket, publishing it to lockless
+ * readers only once it points on into the chain.
+ */
+static void htable_link_add(htable_bucket_t *bucket, htable_link_t *link)
+{
+    htable_link_t *first = bucket->hb_first;
+    link->hl_next = first;
+    link->hl_pprev = &bucket->hb_first;
+    if (!htable_is_end(first))
+    {
+        first->hl_pprev = &link->hl_next;
+    }
+    __atomic_store_n(&bucket->hb_first, link, __ATOMIC_RELEASE);
+}
+
+static htable_array_t *htable_array_create(size_t nbuckets)
+{
+    htable_array_t *array =
+        kvmalloc(sizeof(htable_array_t) + nbuckets * sizeof(htable_bucket_t));
+    if (!array)
+    {
+        return NULL;
+    }
+    array->ha_nbuckets = nbuckets;
+    array->ha_moved = 0;
+    array->ha_prev = NULL;
+    for (size_t i = 0; i < nbuckets; i++)
+    {
+        array->ha_buckets[i].hb_first = HTABLE_END(&array->ha_buckets[i]);
+        spinlock_init(&array->ha_buckets[i].hb_lock);
+        array->ha_buckets[i].hb_grow = 0;
+    }
+    return array;
+}
+
+long htable_init(htable_t *table, size_t nbuckets)
+{
+    size_t n = 1;
+    while (n < nbuckets)
+    {
+        n <<= 1;
+    }
+    table->ht_array = htable_array_create(n);
+    table->ht_count = 0;
+    table->ht_growing = 0;
+    return table->ht_array ? 0 : -ENOMEM;
+}
+
+void htable_destroy(htable_t *table)
+{
+    KASSERT(!table->ht_count);
+    htable_array_t *array = table->ht_array;
+    while (array)
+    {
+        htable_array_t *prev = array->ha_prev;
+        kvfree(array);
+        array = prev;
+    }
+    table->ht_array = NULL;
+}
+
+htable_bucket_t *htable_lock(htable_t *table, uint64_t key)
+{
+    while (1)
+    {
+        htable_array_t *array = table->ht_array;
+        htable_bucket_t *bucket =
+            &array->ha_buckets[htable_index(key, array->ha_nbuckets)];
+        spinlock_lock(&bucket->hb_lock);
+        if (!array->ha_moved)
+        {
+            return bucket;
+        }
+        /* the table grew while we were waiting */
+        spinlock_unlock(&bucket->hb_lock);
+    }
+}
+
+/*
+ * Double the number of buckets, unless another thread is already at it or
+ * there is not the memory, in which case the buckets just get longer.
+ */
+static void htable_grow(htable_t *table)
+{
+    if (__sync_lock_test_and_set(&table->ht_growing, 1))
+    {
+        return;
+    }
+    htable_array_t *old = table->ht_array;
+    htable_array_t *new;
+    if (table->ht_count <= HTABLE_LOAD * old->ha_nbuckets ||
+        !(new = htable_array_create(old->ha_nbuckets * 2)))
+    {
+        __sync_lock_release(&table->ht_growing);
+        return;
+    }
+
+    /* buckets are only ever locked one at a time, or all in order, here */
+    for (size_t i = 0; i < old->ha_nbuckets; i++)
+    {
+        spinlock_lock(&old->ha_buckets[i].hb_lock);
+    }
+    /* the old buckets are left pointing at what were their first items, so
+     * that a lockless reader who still starts there follows them into the
+     * new chains, reaches a marker that is not its bucket's, and looks
+     * again */
+    for (size_t i = 0; i < old->ha_nbuckets; i++)
+    {
+        htable_link_t *link = old->ha_buckets[i].hb_first;
+        while (!htable_is_end(link))
+        {
+            htable_link_t *next = link->hl_next;
+            htable_link_add(
+                &new->ha_buckets[htable_index(link->hl_key, new->ha_nbuckets)],
+                link);
+            link = next;
+        }
+    }
+    new->ha_prev = old;
+    old->ha_moved = 1;
+    __sync_synchronize();
+    table->ht_array = new;
+    for (size_t i = 0; i < old->ha_nbuckets; i++)
+    {
+        spinlock_unlock(&old->ha_buckets[i].hb_lock);
+    }
+    dbg(DBG_MM, "htable 0x%p: grew to %lu buckets for %lu items\n", table,
+        new->ha_nbuckets, table->ht_count);
+    __sync_lock_release(&table->ht_growing);
+}
+
+void htable_unlock(htable_t *table, htable_bucket_t *bucket)
+{
+    long grow = bucket->hb_grow;
+    bucket->hb_grow = 0;
+    spinlock_unlock(&bucket->hb_lock);
+    if (grow)
+    {
+        htable_grow(table);
+    }
+}
+
+void htable_insert(htable_t *table, htable_bucket_t *bucket,
+                   htable_link_t *link, uint64_t key)
+{
+    KASSERT(spinlock_ownslock(&bucket->hb_lock));
+    KASSERT(!htable_link_is_linked(link));
+    link->hl_key = key;
+    htable_link_add(bucket, link);
+    size_t count = __sync_add_and_fetch(&table->ht_count, 1);
+    if (count > HTABLE_LOAD * table->ht_array->ha_nbuckets)
+    {
+        bucket->hb_grow = 1;
+    }
+}
+
+void htable_remove(htable_t *table, htable_bucket_t *bucket,
+                   htable_link_t *link)
+{
+    KASSERT(spinlock_ownslock(&bucket->hb_lock));
+    KASSERT(htable_link_is_linked(link));
+    /* hl_next is left as it is, for any reader standing on the item */
+    htable_link_t *next = link->hl_next;
+    __atomic_store_n(link->hl_pprev, next, __ATOMIC_RELAXED);
+    if (!htable_is_end(next))
+    {
+        next->hl_pprev = link->hl_pprev;
+    }
+    link->hl_pprev = NULL;
+    __sync_sub_and_fetch(&table->ht_count, 1);
+}
+
+htable_link_t *htable_lookup_rcu(htable_t *table, uint64_t key,
+                                 htable_match_t match, void *arg)
+{
+    while (1)
+    {
+        htable_array_t *array =
+            __atomic_load_n(&table->ht_array, __ATOMIC_ACQUIRE);
+        htable_bucket_t *bucket =
+            &array->ha_buckets[htable_index(key, array->ha_nbuckets)];
+        htable_link_t *link =
+            __atomic_load_n(&bucket->hb_first, __ATOMIC_ACQUIRE);
+        for (; !htable_is_end(link);
+             link = __atomic_load_n(&link->hl_next, __ATOMIC_ACQUIRE))
+        {
+            if (link->hl_key == key && (!match || match(link, arg)))
+            {
+                return link;
+            }
+        }
+        if (link == HTABLE_END(bucket))
+        {
+            return NULL;
+        }
+        /* the table grew under us */
+    }
+}
@@ -1,5 +1,7 @@
 #include "kernel.h"
 
+#include "main/cpuid.h"
+
 #include "mm/kmalloc.h"
 
 #include "util/debug.h"
@@ -7,136 +9,176 @@
 #include "util/list.h"
 #include "util/string.h"
 
-static int _init_search_count = 0;
+static init_time_t init_time_table[INIT_MAX_TIMES];
+static size_t init_ntimes;
 
+/*
+ * An init_func(). The dependency graph is built once, with each dependency
+ * resolved to the function it names, and then run in topological order: a
+ * function is ready once if_pending, the number of its dependencies that have
+ * not run yet, drops to 0, and ready functions run in the order they became
+ * ready, which for those that depend on nothing is the order of the section.
+ */
 struct init_function
 {
     init_func_t if_func;
     const char *if_name;
-    list_link_t if_link;
+    list_link_t if_link; /* on the waiting or the ready list */
 
-    int if_search;
-    int if_called;
-    list_t if_deps;
+    int if_pending;
+    list_t if_dependents;
 };
 
+/* An edge of the graph, on the if_dependents of the function depended on */
 struct init_depends
 {
-    const char *id_name;
+    struct init_function *id_func; /* the function that depends on it */
     list_link_t id_link;
 };
 
-static void _init_call(list_t *funcs, struct init_function *func)
+void init_call(const char *name, init_func_t func)
 {
-    list_iterate(&func->if_deps, dep, struct init_depends, id_link)
-    {
-        struct init_function *found = NULL;
-        list_iterate(funcs, f, struct init_function, if_link)
-        {
-            if (strcmp(dep->id_name, f->if_name) == 0)
-            {
-                found = f;
-                break;
-            }
-        }
-
-        if (!found)
-        {
-            panic("'%s' dependency for '%s' does not exist", dep->id_name,
-                  func->if_name);
-        }
+    KASSERT(init_ntimes < INIT_MAX_TIMES && "raise INIT_MAX_TIMES");
+    uint64_t start = cpuid_rdtsc();
+    func();
+    init_time_table[init_ntimes].it_name = name;
+    init_time_table[init_ntimes].it_cycles = cpuid_rdtsc() - start;
+    init_ntimes++;
+}
 
-        if (func->if_search == found->if_search)
-        {
-            panic("circular dependency between '%s' and '%s'", func->if_name,
-                  found->if_name);
-        }
+const init_time_t *init_times(size_t *countp)
+{
+    *countp = init_ntimes;
+    return init_time_table;
+}
 
-        dbg(DBG_INIT, "'%s' depends on '%s': ", func->if_name, found->if_name);
-        if (!found->if_called)
-        {
-            dbgq(DBG_INIT, "calling\n");
-            found->if_search = func->if_search;
-            _init_call(funcs, found);
-        }
-        else
+static long init_called(const char *name)
+{
+    for (size_t i = 0; i < init_ntimes; i++)
+    {
+        if (!strcmp(init_time_table[i].it_name, name))
         {
-            dbgq(DBG_INIT, "already called\n");
+            return 1;
         }
     }
+    return 0;
+}
 
-    KASSERT(!func->if_called);
-
-    dbg(DBG_INIT, "Calling %s (0x%p)\n", func->if_name, func->if_func);
-    func->if_func();
-    func->if_called = 1;
+/* The length of a .init record: a function pointer, or 0, and a name */
+static size_t init_record_len(char *buf)
+{
+    return sizeof(init_func_t) + strlen(buf + sizeof(init_func_t)) + 1;
 }
 
 void init_call_all()
 {
-    list_t funcs;
+    list_t waiting, ready;
     char *buf, *end;
 
-    list_init(&funcs);
+    list_init(&waiting);
+    list_init(&ready);
     buf = (char *)&kernel_start_init;
     end = (char *)&kernel_end_init;
 
-    while (buf < end)
+    /* First the nodes, so that dependencies may name functions further on */
+    for (; buf < end; buf += init_record_len(buf))
     {
-        struct init_function *curr = kmalloc(sizeof(*curr));
-        KASSERT(NULL != curr);
-
-        list_insert_tail(&funcs, &curr->if_link);
-        list_init(&curr->if_deps);
-
-        KASSERT(NULL != *(uintptr_t *)buf);
-        curr->if_func = (init_func_t) * (uintptr_t *)buf;
-        curr->if_name = buf + sizeof(curr->if_func);
-        curr->if_search = 0;
-        curr->if_called = 0;
-
-        buf += sizeof(curr->if_func) + strlen(curr->if_name) + 1;
-
-        while ((NULL == *(uintptr_t *)buf) && (buf < end))
+        init_func_t func = *(init_func_t *)buf;
+        if (!func)
         {
-            struct init_depends *dep = kmalloc(sizeof(*dep));
-            KASSERT(NULL != dep);
-
-            list_insert_tail(&curr->if_deps, &dep->id_link);
-
-            dep->id_name = buf + sizeof(curr->if_func);
-            buf += sizeof(curr->if_func) + strlen(dep->id_name) + 1;
+            continue;
         }
+        struct init_function *curr = kmalloc(sizeof(*curr));
+        KASSERT(NULL != curr);
+        curr->if_func = func;
+        curr->if_name = buf + sizeof(func);
+        curr->if_pending = 0;
+        list_init(&curr->if_dependents);
+        list_insert_tail(&waiting, &curr->if_link);
     }
-
     KASSERT(buf == end);
 
-    dbg(DBG_INIT, "Initialization functions and dependencies:\n");
-    list_iterate(&funcs, func, struct init_function, if_link)
+    /* Then the edges */
+    struct init_function *curr = NULL;
+    for (buf = (char *)&kernel_start_init; buf < end;
+         buf += init_record_len(buf))
     {
-        dbgq(DBG_INIT, "%s (0x%p): ", func->if_name, func->if_func);
-        list_iterate(&func->if_deps, dep, struct init_depends, id_link)
+        const char *name = buf + sizeof(init_func_t);
+        if (*(init_func_t *)buf)
         {
-            dbgq(DBG_INIT, "%s ", dep->id_name);
+            curr = curr ? list_next(curr, struct init_function, if_link)
+                        : list_head(&waiting, struct init_function, if_link);
+            KASSERT(!strcmp(curr->if_name, name));
+            continue;
+        }
+        KASSERT(curr);
+
+        struct init_function *found = NULL;
+        list_iterate(&waiting, f, struct init_function, if_link)
+        {
+            if (!strcmp(name, f->if_name))
+            {
+                found = f;
+                break;
+            }
         }
-        dbgq(DBG_INIT, "\n");
+        if (!found)
+        {
+            if (!init_called(name))
+            {
+                panic("'%s' dependency for '%s' does not exist", name,
+                      curr->if_name);
+            }
+            dbg(DBG_INIT, "'%s' depends on '%s': already called\n",
+                curr->if_name, name);
+            continue;
+        }
+        if (found == curr)
+        {
+            panic("'%s' depends on itself", name);
+        }
+
+        dbg(DBG_INIT, "'%s' depends on '%s'\n", curr->if_name, name);
+        struct init_depends *dep = kmalloc(sizeof(*dep));
+        KASSERT(NULL != dep);
+        dep->id_func = curr;
+        list_insert_tail(&found->if_dependents, &dep->id_link);
+        curr->if_pending++;
     }
 
-    list_iterate(&funcs, func, struct init_function, if_link)
+    list_iterate(&waiting, func, struct init_function, if_link)
     {
-        if (!func->if_called)
+        if (!func->if_pending)
         {
-            func->if_search = ++_init_search_count;
-            _init_call(&funcs, func);
+            list_remove(&func->if_link);
+            list_insert_tail(&ready, &func->if_link);
         }
     }
 
-    list_iterate(&funcs, func, struct init_function, if_link)
+    while (!list_empty(&ready))
     {
-        list_iterate(&func->if_deps, dep, struct init_depends, id_link)
+        struct init_function *func =
+            list_head(&ready, struct init_function, if_link);
+        list_remove(&func->if_link);
+        dbg(DBG_INIT, "Calling %s (0x%p)\n", func->if_name, func->if_func);
+        init_call(func->if_name, func->if_func);
+
+        list_iterate(&func->if_dependents, dep, struct init_depends, id_link)
         {
+            if (!--dep->id_func->if_pending)
+            {
+                list_remove(&dep->id_func->if_link);
+                list_insert_tail(&ready, &dep->id_func->if_link);
+            }
             kfree(dep);
         }
         kfree(func);
     }
+
+    if (!list_empty(&waiting))
+    {
+        struct init_function *func =
+            list_head(&waiting, struct init_function, if_link);
+        panic("circular dependency involving '%s'", func->if_name);
+    }
 }
@@ -51,3 +51,37 @@ inline void list_remove(list_link_t *link)
     next->l_prev = prev;
     ll->l_next = ll->l_prev = NULL;
 }
+
+/*
+ * The new link is filled in before the store that makes it reachable, which
+ * is a release, so a reader who gets to it finds it pointing on into the
+ * list.
+ */
+static void list_insert_before_rcu(list_link_t *link, list_link_t *to_insert)
+{
+    list_link_t *prev = link->l_prev;
+    to_insert->l_next = link;
+    to_insert->l_prev = prev;
+    __atomic_store_n(&prev->l_next, to_insert, __ATOMIC_RELEASE);
+    link->l_prev = to_insert;
+}
+
+void list_insert_head_rcu(list_t *list, list_link_t *link)
+{
+    list_insert_before_rcu(list->l_next, link);
+}
+
+void list_insert_tail_rcu(list_t *list, list_link_t *link)
+{
+    list_insert_before_rcu(list, link);
+}
+
+void list_remove_rcu(list_link_t *link)
+{
+    list_link_t *prev = link->l_prev;
+    list_link_t *next = link->l_next;
+    __atomic_store_n(&prev->l_next, next, __ATOMIC_RELAXED);
+    next->l_prev = prev;
+    /* not linked, as far as list_link_is_linked() goes */
+    link->l_prev = NULL;
+}
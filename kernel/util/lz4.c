@@ -0,0 +1,223 @@
+#include "kernel.h"
+
+#include "util/debug.h"
+#include "util/lz4.h"
+#include "util/string.h"
+
+#define LZ4_MIN_MATCH 4
+/* The last match must start this far from the end of the input... */
+#define LZ4_MF_LIMIT 12
+/* ...and the input must end with this many literals */
+#define LZ4_LAST_LITERALS 5
+/* After this many bytes without a match, look at every other byte, and so on,
+ * so that incompressible data goes by quickly */
+#define LZ4_SKIP_SHIFT 6
+
+typedef uint16_t __attribute__((aligned(1), may_alias)) lz4_u16_t;
+typedef uint32_t __attribute__((aligned(1), may_alias)) lz4_u32_t;
+typedef uint64_t __attribute__((aligned(1), may_alias)) lz4_u64_t;
+
+static inline uint32_t lz4_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/*
+ * Write a length's extension bytes, for the part of it past the 15 that fits
+ * in the token.
+ */
+static uint8_t *lz4_put_length(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+ * Write a sequence of nlit literals followed, if mlen is not 0, by a match of
+ * mlen bytes offset bytes back. Returns where the output goes on, or NULL if
+ * it would go past oend.
+ */
+static uint8_t *lz4_put_sequence(uint8_t *op, uint8_t *oend,
+                                 const uint8_t *lit, size_t nlit,
+                                 size_t offset, size_t mlen)
+{
+    size_t need = 1 + nlit / 255 + 1 + nlit + (mlen ? 2 + mlen / 255 + 1 : 0);
+    if (need > (size_t)(oend - op))
+    {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t)(MIN(nlit, 15) << 4);
+    if (nlit >= 15)
+    {
+        op = lz4_put_length(op, nlit - 15);
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen)
+    {
+        return op;
+    }
+    *(lz4_u16_t *)op = (uint16_t)offset;
+    op += 2;
+    mlen -= LZ4_MIN_MATCH;
+    *token |= (uint8_t)MIN(mlen, 15);
+    if (mlen >= 15)
+    {
+        op = lz4_put_length(op, mlen - 15);
+    }
+    return op;
+}
+
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t cap,
+                    void *work)
+{
+    KASSERT(len <= LZ4_MAX_INPUT);
+    const uint8_t *in = src;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+    uint16_t *table = work;
+    memset(table, 0, LZ4_WORK_SIZE);
+
+    size_t anchor = 0;
+    if (len > LZ4_MF_LIMIT)
+    {
+        size_t limit = len - LZ4_MF_LIMIT;
+        size_t mlimit = len - LZ4_LAST_LITERALS;
+        size_t ip = 1;
+        while (ip < limit)
+        {
+            uint32_t seq = *(const lz4_u32_t *)(in + ip);
+            uint32_t h = lz4_hash(seq);
+            size_t ref = table[h];
+            table[h] = (uint16_t)ip;
+            if (*(const lz4_u32_t *)(in + ref) != seq || ref >= ip)
+            {
+                ip += 1 + ((ip - anchor) >> LZ4_SKIP_SHIFT);
+                continue;
+            }
+
+            while (ip > anchor && ref && in[ip - 1] == in[ref - 1])
+            {
+                ip--;
+                ref--;
+            }
+            size_t mlen = LZ4_MIN_MATCH;
+            while (ip + mlen + sizeof(uint64_t) <= mlimit)
+            {
+                uint64_t diff = *(const lz4_u64_t *)(in + ip + mlen) ^
+                                *(const lz4_u64_t *)(in + ref + mlen);
+                if (diff)
+                {
+                    mlen += __builtin_ctzl(diff) / 8;
+                    goto found;
+                }
+                mlen += sizeof(uint64_t);
+            }
+            while (ip + mlen < mlimit && in[ip + mlen] == in[ref + mlen])
+            {
+                mlen++;
+            }
+        found:
+            op = lz4_put_sequence(op, oend, in + anchor, ip - anchor, ip - ref,
+                                  mlen);
+            if (!op)
+            {
+                return 0;
+            }
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    op = lz4_put_sequence(op, oend, in + anchor, len - anchor, 0, 0);
+    return op ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+/*
+ * Read a length's extension bytes, adding them to *lenp. Returns where the
+ * input goes on, or NULL if it runs out first.
+ */
+static const uint8_t *lz4_get_length(const uint8_t *ip, const uint8_t *iend,
+                                     size_t *lenp)
+{
+    uint8_t b;
+    do
+    {
+        if (ip == iend)
+        {
+            return NULL;
+        }
+        b = *ip++;
+        *lenp += b;
+    } while (b == 255);
+    return ip;
+}
+
+ssize_t lz4_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !(ip = lz4_get_length(ip, iend, &nlit)))
+        {
+            return -1;
+        }
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        /* the last sequence has literals only */
+        if (ip == iend)
+        {
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        size_t offset = *(const lz4_u16_t *)ip;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !(ip = lz4_get_length(ip, iend, &mlen)))
+        {
+            return -1;
+        }
+        mlen += LZ4_MIN_MATCH;
+        if (!offset || offset > (size_t)(op - (uint8_t *)dst) ||
+            mlen > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        /* the match may overlap the bytes it produces, a word at a time only
+         * if it lies a word or more back */
+        const uint8_t *ref = op - offset;
+        size_t i = 0;
+        if (offset >= sizeof(uint64_t))
+        {
+            for (; i + sizeof(uint64_t) <= mlen; i += sizeof(uint64_t))
+            {
+                *(lz4_u64_t *)(op + i) = *(const lz4_u64_t *)(ref + i);
+            }
+        }
+        for (; i < mlen; i++)
+        {
+            op[i] = ref[i];
+        }
+        op += mlen;
+    }
+    return op - (uint8_t *)dst;
+}
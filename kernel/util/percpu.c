@@ -0,0 +1,71 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/apic.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/percpu.h"
+
+/* By core, then by counter */
+static long pcpu_slots[MAX_LAPICS][PCPU_SLOTS] __attribute__((aligned(64)));
+
+/* One bit per slot, set if it is in use; slot 0 is always taken */
+static uint64_t pcpu_map[PCPU_SLOTS / 64] = {1};
+static spinlock_t pcpu_lock = SPINLOCK_INITIALIZER(pcpu_lock);
+
+long pcpu_counter_init(pcpu_counter_t *c)
+{
+    spinlock_lock(&pcpu_lock);
+    for (size_t word = 0; word < PCPU_SLOTS / 64; word++)
+    {
+        if (!~pcpu_map[word])
+        {
+            continue;
+        }
+        size_t slot = word * 64 + __builtin_ctzl(~pcpu_map[word]);
+        pcpu_map[word] |= 1UL << (slot % 64);
+        spinlock_unlock(&pcpu_lock);
+        /* cleared when it was given back */
+        c->pc_slot = slot;
+        return 0;
+    }
+    spinlock_unlock(&pcpu_lock);
+    c->pc_slot = 0;
+    return -ENOMEM;
+}
+
+void pcpu_counter_destroy(pcpu_counter_t *c)
+{
+    size_t slot = c->pc_slot;
+    if (!slot)
+    {
+        return;
+    }
+    c->pc_slot = 0;
+    for (long core = 0; core < MAX_LAPICS; core++)
+    {
+        pcpu_slots[core][slot] = 0;
+    }
+    spinlock_lock(&pcpu_lock);
+    KASSERT(pcpu_map[slot / 64] & (1UL << (slot % 64)));
+    pcpu_map[slot / 64] &= ~(1UL << (slot % 64));
+    spinlock_unlock(&pcpu_lock);
+}
+
+void pcpu_counter_add(pcpu_counter_t *c, long n)
+{
+    __atomic_fetch_add(&pcpu_slots[curcore.kc_id][c->pc_slot], n,
+                       __ATOMIC_RELAXED);
+}
+
+long pcpu_counter_read(pcpu_counter_t *c)
+{
+    long sum = 0;
+    for (long core = 0; core < MAX_LAPICS; core++)
+    {
+        sum += __atomic_load_n(&pcpu_slots[core][c->pc_slot], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
@@ -0,0 +1,180 @@
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/apic.h"
+#include "main/interrupt.h"
+
+#include "mm/vmalloc.h"
+
+#include "proc/kmutex.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/profile.h"
+#include "util/string.h"
+
+/*
+ * A core's ring; it works as the trace rings do. Only the core writes to
+ * pr_head, from its timer interrupt, and only the reader holding
+ * profile_read_mutex writes to pr_tail.
+ */
+typedef struct profile_ring
+{
+    volatile uint64_t pr_head;
+    volatile uint64_t pr_tail;
+    uint64_t pr_lost;
+    profile_sample_t *pr_samples; /* PROFILE_SAMPLES of them */
+} profile_ring_t;
+
+static profile_ring_t profile_rings[MAX_LAPICS];
+
+static kmutex_t profile_read_mutex = KMUTEX_INITIALIZER(profile_read_mutex);
+
+/* Ticks between samples, or 0 if the profiler is stopped */
+static volatile long profile_interval;
+
+/* Ticks until this core's next sample */
+static long profile_countdown CORE_SPECIFIC_DATA;
+#define profile_countdown CSD(profile_countdown)
+
+/*
+ * Follows the frame pointers from rbp up the current thread's kernel stack,
+ * filling in the return addresses after the first entry of sample. A frame
+ * is only trusted if it is on the stack and above the one before it, so a
+ * function that does not keep a frame just ends the chain.
+ */
+static void profile_backtrace(profile_sample_t *sample, uintptr_t rbp)
+{
+    if (!curthr)
+    {
+        return;
+    }
+    uintptr_t lo = (uintptr_t)curthr->kt_kstack;
+    uintptr_t hi = lo + DEFAULT_STACK_SIZE;
+    while (sample->ps_depth < PROFILE_DEPTH && rbp >= lo &&
+           rbp <= hi - 2 * sizeof(uintptr_t) && !(rbp % sizeof(uintptr_t)))
+    {
+        uintptr_t *frame = (uintptr_t *)rbp;
+        if (!frame[1])
+        {
+            break;
+        }
+        sample->ps_pcs[sample->ps_depth++] = frame[1];
+        if (frame[0] <= rbp)
+        {
+            break;
+        }
+        rbp = frame[0];
+    }
+}
+
+void profile_tick(regs_t *regs)
+{
+    long interval = profile_interval;
+    if (!interval || --profile_countdown > 0)
+    {
+        return;
+    }
+    profile_countdown = interval;
+
+    profile_ring_t *ring = &profile_rings[curcore.kc_id];
+    uint64_t head = ring->pr_head;
+    if (head - ring->pr_tail == PROFILE_SAMPLES)
+    {
+        ring->pr_lost++;
+        return;
+    }
+    profile_sample_t *sample = &ring->pr_samples[head % PROFILE_SAMPLES];
+    sample->ps_pid = curproc && curthr ? (int32_t)curproc->p_pid : -1;
+    sample->ps_core = (uint16_t)curcore.kc_id;
+    sample->ps_user = (regs->r_cs & 0x3) != 0;
+    sample->ps_depth = 1;
+    sample->ps_pcs[0] = regs->r_rip;
+    if (!sample->ps_user)
+    {
+        profile_backtrace(sample, regs->r_rbp);
+    }
+    __sync_synchronize();
+    ring->pr_head = head + 1;
+}
+
+long profile_start(long interval)
+{
+    if (interval <= 0)
+    {
+        return -EINVAL;
+    }
+    kmutex_lock(&profile_read_mutex);
+    for (size_t core = 0; core < MAX_LAPICS; core++)
+    {
+        profile_ring_t *ring = &profile_rings[core];
+        if (!ring->pr_samples &&
+            !(ring->pr_samples =
+                  vmalloc(PROFILE_SAMPLES * sizeof(profile_sample_t))))
+        {
+            kmutex_unlock(&profile_read_mutex);
+            return -ENOMEM;
+        }
+    }
+    kmutex_unlock(&profile_read_mutex);
+    profile_interval = interval;
+    return 0;
+}
+
+void profile_stop() { profile_interval = 0; }
+
+size_t profile_read(profile_sample_t *buf, size_t count)
+{
+    size_t n = 0;
+    kmutex_lock(&profile_read_mutex);
+    for (size_t core = 0; core < MAX_LAPICS && n < count; core++)
+    {
+        profile_ring_t *ring = &profile_rings[core];
+        uint64_t tail = ring->pr_tail;
+        uint64_t head = ring->pr_head;
+        __sync_synchronize();
+        for (; tail != head && n < count; tail++)
+        {
+            buf[n++] = ring->pr_samples[tail % PROFILE_SAMPLES];
+        }
+        __sync_synchronize();
+        ring->pr_tail = tail;
+    }
+    kmutex_unlock(&profile_read_mutex);
+    return n;
+}
+
+#define PROFILE_DUMP_BATCH 16
+
+void profile_dump()
+{
+    profile_sample_t samples[PROFILE_DUMP_BATCH];
+    size_t n;
+    while ((n = profile_read(samples, PROFILE_DUMP_BATCH)))
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            profile_sample_t *sample = &samples[i];
+            char line[32 + PROFILE_DEPTH * 20];
+            size_t len = snprintf(line, sizeof(line), "profile: %d %c",
+                                  sample->ps_pid, sample->ps_user ? 'u' : 'k');
+            for (size_t d = 0; d < sample->ps_depth; d++)
+            {
+                len += snprintf(line + len, sizeof(line) - len, " %#lx",
+                                sample->ps_pcs[d]);
+            }
+            dbg_print("%s\n", line);
+        }
+    }
+
+    uint64_t lost = 0;
+    for (size_t core = 0; core < MAX_LAPICS; core++)
+    {
+        lost += profile_rings[core].pr_lost;
+    }
+    dbg_print("profile: %lu samples lost\n", lost);
+}
@@ -0,0 +1,262 @@
+#include "errno.h"
+#include "kernel.h"
+
+#include "mm/slab.h"
+
+#include "util/debug.h"
+#include "util/radix.h"
+#include "util/string.h"
+
+typedef struct radix_node
+{
+    void *rn_slots[RADIX_FANOUT]; /* children, or items at the bottom level */
+    size_t rn_count;              /* number of non-NULL slots */
+} radix_node_t;
+
+static slab_allocator_t *radix_node_allocator;
+
+/* Index into a node at the given level (level 1 is the bottom level). */
+#define RADIX_INDEX(key, level) \
+    (((key) >> (RADIX_SHIFT * ((level)-1))) & RADIX_MASK)
+
+void radix_init()
+{
+    radix_node_allocator =
+        slab_allocator_create("radix_node", sizeof(radix_node_t));
+    KASSERT(radix_node_allocator);
+}
+
+static radix_node_t *radix_node_create()
+{
+    radix_node_t *node = slab_obj_alloc(radix_node_allocator);
+    if (node)
+    {
+        memset(node, 0, sizeof(radix_node_t));
+    }
+    return node;
+}
+
+/*
+ * Returns 1 if a tree of the given height can hold key.
+ */
+static inline long radix_height_fits(size_t height, uint64_t key)
+{
+    if (height >= RADIX_MAX_HEIGHT)
+    {
+        return 1;
+    }
+    return key < (1UL << (RADIX_SHIFT * height));
+}
+
+void radix_tree_init(radix_tree_t *tree)
+{
+    tree->rt_root = NULL;
+    tree->rt_height = 0;
+    tree->rt_count = 0;
+}
+
+void *radix_tree_lookup(radix_tree_t *tree, uint64_t key)
+{
+    if (!tree->rt_root || !radix_height_fits(tree->rt_height, key))
+    {
+        return NULL;
+    }
+
+    radix_node_t *node = tree->rt_root;
+    for (size_t level = tree->rt_height; level > 1; level--)
+    {
+        node = node->rn_slots[RADIX_INDEX(key, level)];
+        if (!node)
+        {
+            return NULL;
+        }
+    }
+    return node->rn_slots[RADIX_INDEX(key, 1)];
+}
+
+/*
+ * Add levels on top of the root until the tree can hold key. An empty tree
+ * simply has its height raised, since there is nothing to push down.
+ */
+static long radix_tree_grow(radix_tree_t *tree, uint64_t key)
+{
+    while (!radix_height_fits(tree->rt_height, key))
+    {
+        if (!tree->rt_root)
+        {
+            tree->rt_height++;
+            continue;
+        }
+        radix_node_t *node = radix_node_create();
+        if (!node)
+        {
+            return -ENOMEM;
+        }
+        node->rn_slots[0] = tree->rt_root;
+        node->rn_count = 1;
+        tree->rt_root = node;
+        tree->rt_height++;
+    }
+    return 0;
+}
+
+/*
+ * Free the nodes on the path to key that have become empty, bottom-up,
+ * starting at the given level. path[i] is the node at level i + 1.
+ */
+static void radix_tree_prune(radix_tree_t *tree, radix_node_t **path,
+                             uint64_t key, size_t level)
+{
+    for (; level <= tree->rt_height; level++)
+    {
+        radix_node_t *node = path[level - 1];
+        if (node->rn_count)
+        {
+            return;
+        }
+        slab_obj_free(radix_node_allocator, node);
+        if (level == tree->rt_height)
+        {
+            tree->rt_root = NULL;
+            tree->rt_height = 0;
+            return;
+        }
+        radix_node_t *parent = path[level];
+        parent->rn_slots[RADIX_INDEX(key, level + 1)] = NULL;
+        parent->rn_count--;
+    }
+}
+
+long radix_tree_insert(radix_tree_t *tree, uint64_t key, void *item)
+{
+    KASSERT(item);
+    size_t old_height = tree->rt_height;
+    long ret = radix_tree_grow(tree, key);
+    if (ret)
+    {
+        /* only empty trees or fresh roots with a single child were added */
+        while (tree->rt_height > old_height)
+        {
+            radix_node_t *root = tree->rt_root;
+            if (root)
+            {
+                tree->rt_root = root->rn_slots[0];
+                slab_obj_free(radix_node_allocator, root);
+            }
+            tree->rt_height--;
+        }
+        return ret;
+    }
+    if (!tree->rt_height)
+    {
+        tree->rt_height = 1;
+    }
+    if (!tree->rt_root && !(tree->rt_root = radix_node_create()))
+    {
+        tree->rt_height = old_height;
+        return -ENOMEM;
+    }
+
+    radix_node_t *path[RADIX_MAX_HEIGHT];
+    radix_node_t *node = tree->rt_root;
+    for (size_t level = tree->rt_height; level > 1; level--)
+    {
+        path[level - 1] = node;
+        void **slot = &node->rn_slots[RADIX_INDEX(key, level)];
+        if (!*slot)
+        {
+            if (!(*slot = radix_node_create()))
+            {
+                /* undo the partially built path */
+                radix_tree_prune(tree, path, key, level);
+                return -ENOMEM;
+            }
+            node->rn_count++;
+        }
+        node = *slot;
+    }
+    path[0] = node;
+
+    void **slot = &node->rn_slots[RADIX_INDEX(key, 1)];
+    KASSERT(!*slot && "radix tree key already present");
+    *slot = item;
+    node->rn_count++;
+    tree->rt_count++;
+    return 0;
+}
+
+void *radix_tree_remove(radix_tree_t *tree, uint64_t key)
+{
+    if (!tree->rt_root || !radix_height_fits(tree->rt_height, key))
+    {
+        return NULL;
+    }
+
+    radix_node_t *path[RADIX_MAX_HEIGHT];
+    radix_node_t *node = tree->rt_root;
+    for (size_t level = tree->rt_height; level > 1; level--)
+    {
+        path[level - 1] = node;
+        node = node->rn_slots[RADIX_INDEX(key, level)];
+        if (!node)
+        {
+            return NULL;
+        }
+    }
+    path[0] = node;
+
+    void **slot = &node->rn_slots[RADIX_INDEX(key, 1)];
+    void *item = *slot;
+    if (!item)
+    {
+        return NULL;
+    }
+    *slot = NULL;
+    node->rn_count--;
+    tree->rt_count--;
+    radix_tree_prune(tree, path, key, 1);
+    return item;
+}
+
+/*
+ * Find the item with the smallest key >= min below node, which is at the given
+ * level and holds the keys starting at base. The depth is bounded by the tree
+ * height.
+ */
+static void *radix_node_next(radix_node_t *node, size_t level, uint64_t base,
+                             uint64_t min, uint64_t *keyp)
+{
+    size_t shift = RADIX_SHIFT * (level - 1);
+    for (size_t i = min > base ? RADIX_INDEX(min, level) : 0; i < RADIX_FANOUT;
+         i++)
+    {
+        void *slot = node->rn_slots[i];
+        if (!slot)
+        {
+            continue;
+        }
+        uint64_t key = base | ((uint64_t)i << shift);
+        if (level == 1)
+        {
+            *keyp = key;
+            return slot;
+        }
+        void *item = radix_node_next(slot, level - 1, key, min, keyp);
+        if (item)
+        {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+void *radix_tree_next(radix_tree_t *tree, uint64_t *keyp)
+{
+    if (!tree->rt_root || !radix_height_fits(tree->rt_height, *keyp))
+    {
+        return NULL;
+    }
+    return radix_node_next(tree->rt_root, tree->rt_height, 0, *keyp, keyp);
+}
+
+size_t radix_tree_count(radix_tree_t *tree) { return tree->rt_count; }
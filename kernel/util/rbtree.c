@@ -0,0 +1,334 @@
+#include "kernel.h"
+
+#include "util/debug.h"
+#include "util/rbtree.h"
+
+void rb_tree_init(rb_tree_t *tree, rb_augment_t augment)
+{
+    tree->rt_root = NULL;
+    tree->rt_augment = augment;
+    tree->rt_count = 0;
+}
+
+static inline long rb_is_red(rb_node_t *node) { return node && node->rb_red; }
+
+/*
+ * Put new in old's place under old's parent (new may be NULL).
+ */
+static void rb_replace(rb_tree_t *tree, rb_node_t *old, rb_node_t *new)
+{
+    rb_node_t *parent = old->rb_parent;
+    if (!parent)
+    {
+        tree->rt_root = new;
+    }
+    else if (parent->rb_left == old)
+    {
+        parent->rb_left = new;
+    }
+    else
+    {
+        parent->rb_right = new;
+    }
+    if (new)
+    {
+        new->rb_parent = parent;
+    }
+}
+
+/*
+ * Rotations keep the set of nodes below the subtree's root, so only the two
+ * nodes that move need to be augmented again, the lower one first.
+ */
+static void rb_rotate_left(rb_tree_t *tree, rb_node_t *node)
+{
+    rb_node_t *right = node->rb_right;
+    node->rb_right = right->rb_left;
+    if (right->rb_left)
+    {
+        right->rb_left->rb_parent = node;
+    }
+    rb_replace(tree, node, right);
+    right->rb_left = node;
+    node->rb_parent = right;
+    if (tree->rt_augment)
+    {
+        tree->rt_augment(node);
+        tree->rt_augment(right);
+    }
+}
+
+static void rb_rotate_right(rb_tree_t *tree, rb_node_t *node)
+{
+    rb_node_t *left = node->rb_left;
+    node->rb_left = left->rb_right;
+    if (left->rb_right)
+    {
+        left->rb_right->rb_parent = node;
+    }
+    rb_replace(tree, node, left);
+    left->rb_right = node;
+    node->rb_parent = left;
+    if (tree->rt_augment)
+    {
+        tree->rt_augment(node);
+        tree->rt_augment(left);
+    }
+}
+
+void rb_update(rb_tree_t *tree, rb_node_t *node)
+{
+    if (!tree->rt_augment)
+    {
+        return;
+    }
+    for (; node; node = node->rb_parent)
+    {
+        tree->rt_augment(node);
+    }
+}
+
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent,
+               rb_node_t **link)
+{
+    KASSERT(!*link);
+    node->rb_parent = parent;
+    node->rb_left = node->rb_right = NULL;
+    node->rb_red = 1;
+    *link = node;
+    tree->rt_count++;
+    rb_update(tree, node);
+
+    rb_node_t *grandparent;
+    while (rb_is_red(parent = node->rb_parent))
+    {
+        /* a red node is never the root, so there is a grandparent */
+        grandparent = parent->rb_parent;
+        if (parent == grandparent->rb_left)
+        {
+            rb_node_t *uncle = grandparent->rb_right;
+            if (rb_is_red(uncle))
+            {
+                parent->rb_red = uncle->rb_red = 0;
+                grandparent->rb_red = 1;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->rb_right)
+            {
+                rb_rotate_left(tree, parent);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_red = 0;
+            grandparent->rb_red = 1;
+            rb_rotate_right(tree, grandparent);
+        }
+        else
+        {
+            rb_node_t *uncle = grandparent->rb_left;
+            if (rb_is_red(uncle))
+            {
+                parent->rb_red = uncle->rb_red = 0;
+                grandparent->rb_red = 1;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->rb_left)
+            {
+                rb_rotate_right(tree, parent);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_red = 0;
+            grandparent->rb_red = 1;
+            rb_rotate_left(tree, grandparent);
+        }
+    }
+    tree->rt_root->rb_red = 0;
+}
+
+/*
+ * Restore the black heights after a black node was removed from above node
+ * (which may be NULL), a child of parent.
+ */
+static void rb_remove_fixup(rb_tree_t *tree, rb_node_t *node,
+                            rb_node_t *parent)
+{
+    while (node != tree->rt_root && !rb_is_red(node))
+    {
+        /* node is short a black node, so its sibling cannot be NULL */
+        if (node == parent->rb_left)
+        {
+            rb_node_t *sibling = parent->rb_right;
+            if (sibling->rb_red)
+            {
+                sibling->rb_red = 0;
+                parent->rb_red = 1;
+                rb_rotate_left(tree, parent);
+                sibling = parent->rb_right;
+            }
+            if (!rb_is_red(sibling->rb_left) && !rb_is_red(sibling->rb_right))
+            {
+                sibling->rb_red = 1;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (!rb_is_red(sibling->rb_right))
+            {
+                sibling->rb_left->rb_red = 0;
+                sibling->rb_red = 1;
+                rb_rotate_right(tree, sibling);
+                sibling = parent->rb_right;
+            }
+            sibling->rb_red = parent->rb_red;
+            parent->rb_red = 0;
+            sibling->rb_right->rb_red = 0;
+            rb_rotate_left(tree, parent);
+        }
+        else
+        {
+            rb_node_t *sibling = parent->rb_left;
+            if (sibling->rb_red)
+            {
+                sibling->rb_red = 0;
+                parent->rb_red = 1;
+                rb_rotate_right(tree, parent);
+                sibling = parent->rb_left;
+            }
+            if (!rb_is_red(sibling->rb_left) && !rb_is_red(sibling->rb_right))
+            {
+                sibling->rb_red = 1;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (!rb_is_red(sibling->rb_left))
+            {
+                sibling->rb_right->rb_red = 0;
+                sibling->rb_red = 1;
+                rb_rotate_left(tree, sibling);
+                sibling = parent->rb_left;
+            }
+            sibling->rb_red = parent->rb_red;
+            parent->rb_red = 0;
+            sibling->rb_left->rb_red = 0;
+            rb_rotate_right(tree, parent);
+        }
+        node = tree->rt_root;
+    }
+    if (node)
+    {
+        node->rb_red = 0;
+    }
+}
+
+void rb_remove(rb_tree_t *tree, rb_node_t *node)
+{
+    KASSERT(tree->rt_count);
+    rb_node_t *child, *parent;
+    long red;
+    if (!node->rb_left || !node->rb_right)
+    {
+        child = node->rb_left ? node->rb_left : node->rb_right;
+        parent = node->rb_parent;
+        red = node->rb_red;
+        rb_replace(tree, node, child);
+    }
+    else
+    {
+        /* the successor, which has no left child, takes node's place */
+        rb_node_t *succ = node->rb_right;
+        while (succ->rb_left)
+        {
+            succ = succ->rb_left;
+        }
+        child = succ->rb_right;
+        red = succ->rb_red;
+        if (succ->rb_parent == node)
+        {
+            parent = succ;
+        }
+        else
+        {
+            parent = succ->rb_parent;
+            parent->rb_left = child;
+            if (child)
+            {
+                child->rb_parent = parent;
+            }
+            succ->rb_right = node->rb_right;
+            succ->rb_right->rb_parent = succ;
+        }
+        rb_replace(tree, node, succ);
+        succ->rb_left = node->rb_left;
+        succ->rb_left->rb_parent = succ;
+        succ->rb_red = node->rb_red;
+    }
+    tree->rt_count--;
+    node->rb_parent = node->rb_left = node->rb_right = NULL;
+
+    /* every node whose subtree lost node lies on the path from parent up */
+    rb_update(tree, parent);
+    if (!red)
+    {
+        rb_remove_fixup(tree, child, parent);
+    }
+}
+
+rb_node_t *rb_first(rb_tree_t *tree)
+{
+    rb_node_t *node = tree->rt_root;
+    while (node && node->rb_left)
+    {
+        node = node->rb_left;
+    }
+    return node;
+}
+
+rb_node_t *rb_last(rb_tree_t *tree)
+{
+    rb_node_t *node = tree->rt_root;
+    while (node && node->rb_right)
+    {
+        node = node->rb_right;
+    }
+    return node;
+}
+
+rb_node_t *rb_next(rb_node_t *node)
+{
+    if (node->rb_right)
+    {
+        node = node->rb_right;
+        while (node->rb_left)
+        {
+            node = node->rb_left;
+        }
+        return node;
+    }
+    while (node->rb_parent && node == node->rb_parent->rb_right)
+    {
+        node = node->rb_parent;
+    }
+    return node->rb_parent;
+}
+
+rb_node_t *rb_prev(rb_node_t *node)
+{
+    if (node->rb_left)
+    {
+        node = node->rb_left;
+        while (node->rb_right)
+        {
+            node = node->rb_right;
+        }
+        return node;
+    }
+    while (node->rb_parent && node == node->rb_parent->rb_left)
+    {
+        node = node->rb_parent;
+    }
+    return node->rb_parent;
+}
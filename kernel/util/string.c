@@ -1,53 +1,184 @@
 #include "ctype.h"
 #include "errno.h"
 
+#include "main/cpuid.h"
+#include "types.h"
+
+/*
+ * memcpy() and memset() move whole quadwords, and only the few bytes past
+ * the last one on their own. On processors with enhanced rep movsb/stosb
+ * (ERMS), which the microcode runs a cache line at a time, they hand large
+ * blocks to rep movsb/stosb, as that is the fastest way to move them; below
+ * STRING_ERMS_MIN bytes its startup cost is not worth it.
+ *
+ * string_erms is only set by string_init(), so the early boot code gets the
+ * quadword versions, which work everywhere.
+ */
+#define STRING_ERMS_MIN 512
+
+static long string_erms;
+
+void string_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_GETVENDORSTRING, &eax, &ebx, &ecx, &edx);
+    if (eax >= CPUID_EXTFEATURES)
+    {
+        cpuid_count(CPUID_EXTFEATURES, 0, &eax, &ebx, &ecx, &edx);
+        string_erms = !!(ebx & CPUID_FEAT_EBX_ERMS);
+    }
+}
+
+/* A quadword that need not be aligned */
+typedef uint64_t __attribute__((may_alias, aligned(1))) string_word_t;
+
 int memcmp(const void *cs, const void *ct, size_t count)
 {
-    int ret;
-    /* Compare bytes at %esi and %edi up to %ecx bytes OR until
-     * the bytes are not equal */
-    /* If not equal, set zf = 0 and stop */
-    /* Find out zf and sf and use them to return 0,1, or -1 */
-    __asm__ volatile(
-        "xor %%eax, %%eax\n\t" /* Zero output */
-        "cld\n\t"              /* Make sure direction is forwards */
-        "repe\n\t"
-        "cmpsb\n\t"
-        "setnz %%al\n\t" /* If it is not zero, put 1 in low part */
-        "sets %%ah"      /* If sign set (means 2nd arg larger),
-                          * put 1 in high part */
-        : "=a"(ret)
-        : "S"(cs), "D"(ct), "c"(count)
-        : "cc" /* Overwrite flags */
-    );
-    return ((ret & 1) ? ((ret >> 8) ? -1 : 1) : 0);
+    const unsigned char *a = cs;
+    const unsigned char *b = ct;
+    size_t words = count / sizeof(uint64_t);
+    if (words)
+    {
+        /* Compare quadwords until two differ; if they do, %rsi and %rdi end
+         * up just past them, and the bytes are compared from there */
+        char differ;
+        __asm__ volatile(
+            "cld\n\t"
+            "repe\n\t"
+            "cmpsq\n\t"
+            "setnz %0"
+            : "=r"(differ), "+S"(a), "+D"(b), "+c"(words)
+            :
+            : "cc", "memory");
+        if (differ)
+        {
+            a -= sizeof(uint64_t);
+            b -= sizeof(uint64_t);
+            count = sizeof(uint64_t);
+        }
+        else
+        {
+            count %= sizeof(uint64_t);
+        }
+    }
+    for (; count; count--, a++, b++)
+    {
+        if (*a != *b)
+        {
+            return *a < *b ? -1 : 1;
+        }
+    }
+    return 0;
 }
 
 void *memcpy(void *dest, const void *src, size_t count)
 {
-    /* Move %ecx bytes from %esi to %edi */
+    char *d = dest;
+    const char *s = src;
+    if (count < sizeof(uint64_t))
+    {
+        while (count--)
+        {
+            *d++ = *s++;
+        }
+    }
+    else if (count <= 2 * sizeof(uint64_t))
+    {
+        /* The first and last quadwords cover it all, overlapping if need be */
+        uint64_t first = *(const string_word_t *)s;
+        uint64_t last = *(const string_word_t *)(s + count - 8);
+        *(string_word_t *)d = first;
+        *(string_word_t *)(d + count - 8) = last;
+    }
+    else if (string_erms && count >= STRING_ERMS_MIN)
+    {
+        __asm__ volatile(
+            "cld\n\t"
+            "rep\n\t"
+            "movsb"
+            : "+S"(s), "+D"(d), "+c"(count)
+            :
+            : "cc", "memory");
+    }
+    else
+    {
+        /* Move count / 8 quadwords, then the count % 8 bytes left */
+        size_t words = count / 8;
+        __asm__ volatile(
+            "cld\n\t"
+            "rep\n\t"
+            "movsq\n\t"
+            "movq %3, %%rcx\n\t"
+            "rep\n\t"
+            "movsb"
+            : "+S"(s), "+D"(d), "+c"(words)
+            : "r"(count % 8)
+            : "cc", "memory");
+    }
+    return dest;
+}
+
+void *memmove(void *dest, const void *src, size_t count)
+{
+    if (dest <= src || (const char *)src + count <= (char *)dest)
+    {
+        return memcpy(dest, src, count);
+    }
+    /* Overlapping with dest above src: move backwards from the last byte */
     __asm__ volatile(
-        "cld\n\t" /* Make sure direction is forwards */
+        "std\n\t"
         "rep\n\t"
-        "movsb"
+        "movsb\n\t"
+        "cld"
         : /* No output */
-        : "S"(src), "D"(dest), "c"(count)
-        : "cc" /* We overwrite condition codes - i.e., flags */
-    );
+        : "S"((const char *)src + count - 1), "D"((char *)dest + count - 1),
+          "c"(count)
+        : "cc", "memory");
     return dest;
 }
 
 void *memset(void *s, int c, size_t count)
 {
-    /* Fill %ecx bytes at %edi with %eax (actually %al) */
-    __asm__ volatile(
-        "cld\n\t" /* Make sure direction is forwards */
-        "rep\n\t"
-        "stosb"
-        : /* No output */
-        : "a"(c), "D"(s), "c"(count)
-        : "cc" /* Overwrite flags */
-    );
+    char *d = s;
+    /* c in every byte of a quadword */
+    uint64_t pattern = (uint8_t)c * 0x0101010101010101UL;
+    if (count < sizeof(uint64_t))
+    {
+        while (count--)
+        {
+            *d++ = (char)c;
+        }
+    }
+    else if (count <= 2 * sizeof(uint64_t))
+    {
+        *(string_word_t *)d = pattern;
+        *(string_word_t *)(d + count - 8) = pattern;
+    }
+    else if (string_erms && count >= STRING_ERMS_MIN)
+    {
+        __asm__ volatile(
+            "cld\n\t"
+            "rep\n\t"
+            "stosb"
+            : "+D"(d), "+c"(count)
+            : "a"(pattern)
+            : "cc", "memory");
+    }
+    else
+    {
+        /* Fill count / 8 quadwords, then the count % 8 bytes left */
+        size_t words = count / 8;
+        __asm__ volatile(
+            "cld\n\t"
+            "rep\n\t"
+            "stosq\n\t"
+            "movq %2, %%rcx\n\t"
+            "rep\n\t"
+            "stosb"
+            : "+D"(d), "+c"(words)
+            : "r"(count % 8), "a"(pattern)
+            : "cc", "memory");
+    }
     return s;
 }
 
@@ -129,14 +260,31 @@ char *strcat(char *dest, const char *src)
     return tmp;
 }
 
+/* Whether any byte of w is 0 */
+#define STRING_HAS_ZERO(w) \
+    (((w) - 0x0101010101010101UL) & ~(w) & 0x8080808080808080UL)
+
 size_t strlen(const char *s)
 {
-    const char *sc;
-
-    for (sc = s; *sc != '\0'; ++sc)
+    /* Up to a quadword boundary, then a quadword at a time: aligned reads
+     * never cross into a page past the end of the string */
+    const char *sc = s;
+    for (; (uintptr_t)sc % sizeof(uint64_t); sc++)
     {
-        /* nothing */}
-        return sc - s;
+        if (!*sc)
+        {
+            return sc - s;
+        }
+    }
+    while (!STRING_HAS_ZERO(*(const string_word_t *)sc))
+    {
+        sc += sizeof(uint64_t);
+    }
+    while (*sc)
+    {
+        sc++;
+    }
+    return sc - s;
 }
 
 char *strchr(const char *s, int c)
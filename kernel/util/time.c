@@ -1,8 +1,16 @@
+#include "config.h"
+#include "errno.h"
 #include "util/time.h"
+#include "api/vdso.h"
 #include "drivers/cmos.h"
 #include "main/apic.h"
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+#include "proc/rcu.h"
 #include "proc/sched.h"
+#include "proc/workq.h"
 #include "util/printf.h"
+#include "util/profile.h"
 #include "util/timer.h"
 #include <drivers/screen.h>
 
@@ -10,53 +18,144 @@
 // this is pretty wrong...
 #define MICROSECONDS_PER_APIC_TICK (16 * 1000 / TIME_APIC_TICK_FREQUENCY)
 
+#define NS_PER_TICK (MICROSECONDS_PER_APIC_TICK * 1000UL)
+
 volatile uint64_t jiffies;
+
+/*
+ * The nanosecond clock. It counts TSC cycles from time_tsc_boot, converted
+ * with the frequency measured along with the APIC timer's at boot (see
+ * apic_tsc_frequency()): ns = cycles * time_tsc_mult >> 32. Each core's TSC
+ * is synchronized with core 0's as the core comes up, so it reads the same
+ * on every core; the vDSO page carries the same values for userland.
+ */
+uint64_t time_tsc_boot;
+uint64_t time_tsc_mult;
+time_t time_boot_epoch;
+
+/* util/time.h makes these names this core's copies (see CSD()) */
+#undef timer_tickcount
+#undef kernel_preempted_count
+#undef user_preempted_count
+#undef not_preempted_count
+#undef idle_count
 uint64_t timer_tickcount CORE_SPECIFIC_DATA;
 uint64_t kernel_preempted_count CORE_SPECIFIC_DATA;
 uint64_t user_preempted_count CORE_SPECIFIC_DATA;
 uint64_t not_preempted_count CORE_SPECIFIC_DATA;
 uint64_t idle_count CORE_SPECIFIC_DATA;
+#define timer_tickcount CSD(timer_tickcount)
+#define kernel_preempted_count CSD(kernel_preempted_count)
+#define user_preempted_count CSD(user_preempted_count)
+#define not_preempted_count CSD(not_preempted_count)
+#define idle_count CSD(idle_count)
+
+/* Ticks programmed by time_idle_enter() while the tick is stopped, or 0 */
+static uint64_t idle_oneshot_ticks CORE_SPECIFIC_DATA;
+#define idle_oneshot_ticks CSD(idle_oneshot_ticks)
+
+#ifdef __VGABUF__
+/* Copying the whole back buffer is too long a job for the tick itself */
+static void time_screen_flush(work_t *work) { screen_flush(); }
+static work_t screen_flush_work =
+    WORK_INITIALIZER(screen_flush_work, time_screen_flush);
+#endif
 
 // (freq / 16) interrupts per millisecond
 static long timer_tick_handler(regs_t *regs)
 {
+    if (idle_oneshot_ticks)
+    {
+        /* the idle wakeup; time_idle_exit() accounts for the ticks */
+        return 0;
+    }
     timer_tickcount++;
+    profile_tick(regs);
 
 #ifdef __VGABUF__
     if (timer_tickcount % 128 == 0)
-        screen_flush();
+        work_queue(&screen_flush_work);
 #endif
 
     if (curcore.kc_id == 0)
     {
         jiffies = timer_tickcount;
-        __timers_fire();
+        vdso_tick();
     }
+    __timers_fire();
 
-#ifdef __KPREEMPT__ // if (preemption_enabled()) {
-    (regs->r_cs & 0x3) ? user_preempted_count++ : kernel_preempted_count++;
-    apic_eoi();
-    if (regs->r_cs & 0x3 && curthr->kt_cancelled)
-        kthread_exit((void *)-1);
-    sched_yield();
-    return 1;
-
-#endif
-#ifndef __KPREEMPT__ //} else {
-    curthr ? not_preempted_count++ : idle_count++;
-    return 0;
-#endif //}
-
+    /* the thread is preempted by interrupt_handler(), once it has sent the
+     * EOI, so that each tick is counted here exactly once */
+    if (curthr && (regs->r_cs & 0x3))
+        rcu_quiescent();
+    if (!curthr)
+        idle_count++;
+    else if (!sched_tick(regs->r_cs & 0x3))
+        not_preempted_count++;
+    else if (regs->r_cs & 0x3)
+        user_preempted_count++;
+    else
+        kernel_preempted_count++;
     return 0;
 }
 
 void time_init()
 {
+    if (!time_tsc_mult)
+    {
+        uint64_t hz = apic_tsc_frequency();
+        KASSERT(hz && "TSC frequency not measured");
+        time_tsc_mult = (NS_PER_SEC << 32) / hz;
+        time_boot_epoch = do_time();
+        time_tsc_boot = cpuid_rdtsc();
+    }
     timer_tickcount = 0;
+    timers_init();
     intr_register(INTR_APICTIMER, timer_tick_handler);
     apic_enable_periodic_timer(TIME_APIC_TICK_FREQUENCY);
 }
 
+/*
+ * Stops the periodic tick on an idle core: rather than waking up every tick,
+ * it is woken once, when the earliest of its pending timers expires or after
+ * TIME_IDLE_MAX_MS, unless some other interrupt comes first. Busy cores keep their tick, which is also their timeslice.
+ * Must be called with interrupts disabled, before waiting for an interrupt.
+ */
+void time_idle_enter()
+{
+    KASSERT(!intr_enabled() && !idle_oneshot_ticks);
+    uint64_t nticks = time_ms_to_jiffies(TIME_IDLE_MAX_MS);
+    uint64_t next = timers_next_expiry();
+    nticks = next > jiffies ? MIN(nticks, next - jiffies) : 0;
+    if (nticks > 1)
+    {
+        idle_oneshot_ticks = apic_timer_oneshot(nticks);
+    }
+}
+
+/*
+ * Restarts the periodic tick after time_idle_enter(), catching up on the ticks
+ * that passed in the meantime. Must be called with interrupts disabled.
+ */
+void time_idle_exit()
+{
+    KASSERT(!intr_enabled());
+    if (!idle_oneshot_ticks)
+    {
+        return;
+    }
+    uint64_t nticks = apic_timer_resume_periodic(idle_oneshot_ticks);
+    idle_oneshot_ticks = 0;
+    timer_tickcount += nticks;
+    idle_count += nticks;
+    if (curcore.kc_id == 0)
+    {
+        jiffies = timer_tickcount;
+        vdso_tick();
+    }
+    __timers_fire();
+}
+
 void time_spin(uint64_t ms)
 {
     uint64_t ticks_to_wait = ms * TIME_APIC_TICK_FREQUENCY / 16;
@@ -72,9 +171,92 @@ void time_sleep(uint64_t ms)
     time_spin(ms);
 }
 
-inline time_t core_uptime()
+uint64_t time_tsc_to_ns(uint64_t cycles)
+{
+    return (uint64_t)(((unsigned __int128)cycles * time_tsc_mult) >> 32);
+}
+
+uint64_t time_ns() { return time_tsc_to_ns(cpuid_rdtsc() - time_tsc_boot); }
+
+/*
+ * Synchronizing an AP's TSC with core 0's: the AP (the target) asks for core
+ * 0's TSC TSC_SYNC_ROUNDS times, reading its own before asking and after the
+ * answer arrives, and takes core 0's reading to have been made halfway in
+ * between. The round with the shortest round trip is trusted, and the
+ * difference is added to the AP's TSC, unless it is smaller than that round
+ * trip. tsc_sync_req and tsc_sync_ack are the number of the round asked for
+ * and answered; the target sets tsc_sync_req back to 0 when it is done.
+ */
+#define TSC_SYNC_ROUNDS 16
+
+static volatile long tsc_sync_req;
+static volatile long tsc_sync_ack;
+static volatile uint64_t tsc_sync_value;
+
+void time_tsc_sync_source()
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    for (long round = 1; round <= TSC_SYNC_ROUNDS; round++)
+    {
+        while (tsc_sync_req != round)
+            ;
+        tsc_sync_value = cpuid_rdtsc();
+        __sync_synchronize();
+        tsc_sync_ack = round;
+    }
+    while (tsc_sync_req)
+        ;
+    tsc_sync_ack = 0;
+    intr_setipl(ipl);
+}
+
+void time_tsc_sync_target()
 {
-    return (MICROSECONDS_PER_APIC_TICK * timer_tickcount) / 1000;
+    KASSERT(!intr_enabled());
+    uint64_t best_rtt = (uint64_t)-1;
+    int64_t offset = 0;
+    for (long round = 1; round <= TSC_SYNC_ROUNDS; round++)
+    {
+        uint64_t before = cpuid_rdtsc();
+        tsc_sync_req = round;
+        while (tsc_sync_ack != round)
+            ;
+        uint64_t after = cpuid_rdtsc();
+        if (after - before < best_rtt)
+        {
+            best_rtt = after - before;
+            offset = (int64_t)(tsc_sync_value - (before + best_rtt / 2));
+        }
+    }
+    tsc_sync_req = 0;
+
+    if ((uint64_t)(offset < 0 ? -offset : offset) <= best_rtt)
+    {
+        return;
+    }
+    uint32_t eax, ebx, ecx, edx, lo, hi;
+    cpuid_count(CPUID_EXTFEATURES, 0, &eax, &ebx, &ecx, &edx);
+    if (ebx & CPUID_FEAT_EBX_TSC_ADJUST)
+    {
+        cpuid_get_msr(MSR_TSC_ADJUST, &lo, &hi);
+        uint64_t adjust = (((uint64_t)hi << 32) | lo) + (uint64_t)offset;
+        cpuid_set_msr(MSR_TSC_ADJUST, (uint32_t)adjust, (uint32_t)(adjust >> 32));
+    }
+    else
+    {
+        uint64_t tsc = cpuid_rdtsc() + (uint64_t)offset;
+        cpuid_set_msr(MSR_TSC, (uint32_t)tsc, (uint32_t)(tsc >> 32));
+    }
+    dbg(DBG_CORE, "TSC of C%ld off by %ld cycles (+/- %lu), adjusted\n",
+        curcore.kc_id, offset, best_rtt / 2);
+}
+
+inline time_t core_uptime() { return time_ns() / 1000000; }
+
+/* Convert a duration to timer ticks, e.g. for timer_t expiry times. */
+uint64_t time_ms_to_jiffies(time_t ms)
+{
+    return ms * 1000 / MICROSECONDS_PER_APIC_TICK;
 }
 
 static int mdays[] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
@@ -178,7 +360,8 @@ static void do_wakeup(uint64_t arg)
     spinlock_unlock(&thr->kt_lock);
 }
 
-long do_usleep(useconds_t usec)
+/* Sleeps until nticks ticks from now, or until cancelled (-EINTR) */
+static long time_sleep_ticks(uint64_t nticks)
 {
     ktqueue_t waitq;
     sched_queue_init(&waitq);
@@ -187,7 +370,7 @@ long do_usleep(useconds_t usec)
     timer_init(&timer);
     timer.function = do_wakeup;
     timer.data = (uint64_t)curthr;
-    timer.expires = jiffies + (usec / MICROSECONDS_PER_APIC_TICK);
+    timer.expires = jiffies + nticks;
 
     spinlock_lock(&curthr->kt_lock);
     timer_add(&timer);
@@ -196,4 +379,43 @@ long do_usleep(useconds_t usec)
     spinlock_lock(&curthr->kt_lock);
     spinlock_unlock(&curthr->kt_lock);
     return ret;
-}
\ No newline at end of file
+}
+
+long do_usleep(useconds_t usec)
+{
+    /* round up, so as never to wake up early */
+    return time_sleep_ticks((usec + MICROSECONDS_PER_APIC_TICK - 1) /
+                            MICROSECONDS_PER_APIC_TICK);
+}
+
+/*
+ * The timer wheel only fires on ticks, and a timer set n ticks ahead fires
+ * somewhere between n - 1 and n tick periods from now, depending on how far
+ * into the current period we are. So the thread sleeps on timers for as long
+ * as a whole period is left, and spends the last fraction of a period
+ * yielding to whatever else is runnable until the TSC says it is time.
+ */
+long do_nanosleep(uint64_t ns, uint64_t *remp)
+{
+    uint64_t deadline = time_ns() + ns;
+    uint64_t now;
+    while ((now = time_ns()) < deadline)
+    {
+        uint64_t left = deadline - now;
+        if (left >= NS_PER_TICK)
+        {
+            if (time_sleep_ticks(left / NS_PER_TICK))
+            {
+                now = time_ns();
+                *remp = deadline > now ? deadline - now : 0;
+                return -EINTR;
+            }
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    *remp = 0;
+    return 0;
+}
@@ -1,21 +1,121 @@
 #include "util/timer.h"
+#include "globals.h"
 #include "proc/spinlock.h"
 #include "util/time.h"
 
-static timer_t *timer_running = NULL;
-static uint64_t timer_next_expiry = -1;
-static list_t timers_primary = LIST_INITIALIZER(timers_primary);
-static list_t timers_secondary = LIST_INITIALIZER(timers_secondary);
-static spinlock_t timers_spinlock = SPINLOCK_INITIALIZER(timers_spinlock);
-static int timers_firing = 0;
+/*
+ * Each core keeps its timers in a hierarchical timing wheel, and fires them
+ * from its own tick. Level 0 has a bucket for each of the next
+ * TIMER_L0_SIZE jiffies, and each level above has TIMER_LN_SIZE buckets,
+ * each covering as many jiffies as all of the level below. A timer goes into
+ * the lowest level whose range covers its expiry time, so adding or removing
+ * one is O(1). Whenever level 0 wraps around, the next bucket of level 1 is
+ * cascaded (redistributed) into level 0, and so on up the levels.
+ *
+ * Wheels live in core-specific data, but every reference to a wheel (such as
+ * timer->base) is through its physmap alias, which names the same wheel from
+ * any core.
+ */
+#define TIMER_L0_BITS 8
+#define TIMER_LN_BITS 6
+#define TIMER_L0_SIZE (1 << TIMER_L0_BITS)
+#define TIMER_LN_SIZE (1 << TIMER_LN_BITS)
+#define TIMER_L0_MASK (TIMER_L0_SIZE - 1)
+#define TIMER_LN_MASK (TIMER_LN_SIZE - 1)
+#define TIMER_LEVELS 4 /* above level 0 */
+
+/* The bucket of level n + 1 (n < TIMER_LEVELS) that time falls into */
+#define TIMER_LN_INDEX(time, n) \
+    (((time) >> (TIMER_L0_BITS + (n)*TIMER_LN_BITS)) & TIMER_LN_MASK)
+
+typedef struct timer_base
+{
+    spinlock_t tb_lock;
+    uint64_t tb_jiffies; /* the next jiffy whose timers are to be fired */
+    size_t tb_count;     /* pending timers */
+    timer_t *tb_running; /* timer whose function is being called */
+    list_t tb_l0[TIMER_L0_SIZE];
+    list_t tb_ln[TIMER_LEVELS][TIMER_LN_SIZE];
+} timer_base_t;
+
+static timer_base_t timer_base CORE_SPECIFIC_DATA;
+#define timer_base CSD(timer_base)
+
+static timer_base_t *timer_local_base()
+{
+    return GET_CSD(curcore.kc_id, timer_base_t, timer_base);
+}
+
+void timers_init()
+{
+    timer_base_t *base = timer_local_base();
+    spinlock_init(&base->tb_lock);
+    spinlock_stats_register(&base->tb_lock, "timers");
+    base->tb_jiffies = jiffies;
+    base->tb_count = 0;
+    base->tb_running = NULL;
+    for (size_t i = 0; i < TIMER_L0_SIZE; i++)
+    {
+        list_init(&base->tb_l0[i]);
+    }
+    for (size_t n = 0; n < TIMER_LEVELS; n++)
+    {
+        for (size_t i = 0; i < TIMER_LN_SIZE; i++)
+        {
+            list_init(&base->tb_ln[n][i]);
+        }
+    }
+}
 
 void timer_init(timer_t *timer)
 {
     timer->expires = -1;
+    timer->base = NULL;
     list_link_init(&timer->link);
 }
 
-void timer_add(timer_t *timer) { timer_mod(timer, timer->expires); }
+/*
+ * Puts a timer in the bucket for its expiry time. The base must be locked.
+ */
+static void __timer_enqueue(timer_base_t *base, timer_t *timer)
+{
+    uint64_t expires = timer->expires;
+    list_t *bucket;
+    if ((int64_t)(expires - base->tb_jiffies) < 0)
+    {
+        /* already due: fire it at the next tick */
+        bucket = &base->tb_l0[base->tb_jiffies & TIMER_L0_MASK];
+    }
+    else
+    {
+        uint64_t delta = expires - base->tb_jiffies;
+        size_t n;
+        if (delta < TIMER_L0_SIZE)
+        {
+            bucket = &base->tb_l0[expires & TIMER_L0_MASK];
+            goto insert;
+        }
+        for (n = 0; n < TIMER_LEVELS - 1; n++)
+        {
+            if (delta < 1UL << (TIMER_L0_BITS + (n + 1) * TIMER_LN_BITS))
+            {
+                break;
+            }
+        }
+        if (n == TIMER_LEVELS - 1 &&
+            delta >= 1UL << (TIMER_L0_BITS + TIMER_LEVELS * TIMER_LN_BITS))
+        {
+            /* beyond the wheel: park it at the far end, it will be cascaded
+             * back in as time passes */
+            expires = base->tb_jiffies +
+                      (1UL << (TIMER_L0_BITS + TIMER_LEVELS * TIMER_LN_BITS)) -
+                      1;
+        }
+        bucket = &base->tb_ln[n][TIMER_LN_INDEX(expires, n)];
+    }
+insert:
+    list_insert_tail(bucket, &timer->link);
+}
 
 int __timer_del(timer_t *timer)
 {
@@ -23,6 +123,7 @@ int __timer_del(timer_t *timer)
     if (list_link_is_linked(&timer->link))
     {
         list_remove(&timer->link);
+        timer->base->tb_count--;
         ret = 1;
     }
     return ret;
@@ -30,108 +131,151 @@ int __timer_del(timer_t *timer)
 
 int timer_del(timer_t *timer)
 {
-    spinlock_lock(&timers_spinlock);
+    timer_base_t *base = timer->base;
+    if (!base)
+    {
+        return 0;
+    }
+    spinlock_lock(&base->tb_lock);
     int ret = __timer_del(timer);
-    spinlock_unlock(&timers_spinlock);
+    spinlock_unlock(&base->tb_lock);
 
     return ret;
 }
 
-void __timer_add(timer_t *timer)
-{
-    KASSERT(!list_link_is_linked(&timer->link));
-    list_t *list = timers_firing ? &timers_secondary : &timers_primary;
-    list_insert_head(list, &timer->link);
-}
+void timer_add(timer_t *timer) { timer_mod(timer, timer->expires); }
 
-int timer_mod(timer_t *timer, int expires)
+int timer_mod(timer_t *timer, uint64_t expires)
 {
-    spinlock_lock(&timers_spinlock);
+    int ret = timer_del(timer);
 
+    timer_base_t *base = timer_local_base();
+    spinlock_lock(&base->tb_lock);
     timer->expires = expires;
-    int ret = __timer_del(timer);
-    __timer_add(timer);
-    timer_next_expiry = MIN(timer_next_expiry, timer->expires);
-
-    spinlock_unlock(&timers_spinlock);
+    timer->base = base;
+    __timer_enqueue(base, timer);
+    base->tb_count++;
+    spinlock_unlock(&base->tb_lock);
     return ret;
 }
 
 int timer_pending(timer_t *timer)
 {
-    spinlock_lock(&timers_spinlock);
+    timer_base_t *base = timer->base;
+    if (!base)
+    {
+        return 0;
+    }
+    spinlock_lock(&base->tb_lock);
     int ret = list_link_is_linked(&timer->link);
-    spinlock_unlock(&timers_spinlock);
+    spinlock_unlock(&base->tb_lock);
+    return ret;
+}
+
+uint64_t timers_next_expiry()
+{
+    timer_base_t *base = timer_local_base();
+    spinlock_lock(&base->tb_lock);
+    uint64_t ret = -1;
+    if (base->tb_count)
+    {
+        /* Level 0 holds each jiffy's timers exactly up to where it wraps; by
+         * then, timers may have to be cascaded down from higher levels. */
+        uint64_t time = base->tb_jiffies;
+        while ((time & TIMER_L0_MASK) &&
+               list_empty(&base->tb_l0[time & TIMER_L0_MASK]))
+        {
+            time++;
+        }
+        ret = time;
+    }
+    spinlock_unlock(&base->tb_lock);
     return ret;
 }
 
 int timer_del_sync(timer_t *timer)
 {
+    timer_base_t *base = timer->base;
+    if (!base)
+    {
+        return 0;
+    }
     /* Not great performance wise... */
-    spinlock_lock(&timers_spinlock);
-    while (timer_running == timer)
+    spinlock_lock(&base->tb_lock);
+    while (base->tb_running == timer)
     {
-        spinlock_unlock(&timers_spinlock);
+        spinlock_unlock(&base->tb_lock);
         sched_yield();
-        spinlock_lock(&timers_spinlock);
+        spinlock_lock(&base->tb_lock);
     }
 
     int ret = __timer_del(timer);
-    spinlock_unlock(&timers_spinlock);
+    spinlock_unlock(&base->tb_lock);
 
     return ret;
 }
 
-/* Note: using a linked-list rather than some priority is terribly inefficient
- * Also this implementation is just bad. Sorry.
+/*
+ * Redistributes the timers of one bucket of level n + 1 into the levels
+ * below. Returns the bucket's index, which is 0 once the level has wrapped
+ * around too. The base must be locked.
  */
-int ready = 0;
-void __timers_fire()
+static size_t __timers_cascade(timer_base_t *base, size_t n)
 {
-    if (curthr && !preemption_enabled())
+    size_t index = TIMER_LN_INDEX(base->tb_jiffies, n);
+    list_t *bucket = &base->tb_ln[n][index];
+    list_iterate(bucket, timer, timer_t, link)
     {
-        return;
+        list_remove(&timer->link);
+        __timer_enqueue(base, timer);
     }
+    return index;
+}
 
-    spinlock_lock(&timers_spinlock);
-    timers_firing = 1;
-
-    //dbg(DBG_PRINT, "next expiry: %d\n", timer_next_expiry);
-    if (jiffies < timer_next_expiry)
+void __timers_fire()
+{
+    if (curthr && !preemption_enabled())
     {
-        timers_firing = 0;
-        spinlock_unlock(&timers_spinlock);
         return;
     }
 
-    uint64_t min_expiry = 0;
-
-    list_iterate(&timers_primary, timer, timer_t, link)
+    timer_base_t *base = timer_local_base();
+    spinlock_lock(&base->tb_lock);
+    while ((int64_t)(jiffies - base->tb_jiffies) >= 0)
     {
-        if (jiffies >= timer->expires)
+        size_t index = base->tb_jiffies & TIMER_L0_MASK;
+        if (!index)
         {
-            list_remove(&timer->link);
-            timer_running = timer;
-            spinlock_unlock(&timers_spinlock);
-            timer->function(timer->data);
-            spinlock_lock(&timers_spinlock);
-            timer_running = NULL;
+            for (size_t n = 0; n < TIMER_LEVELS; n++)
+            {
+                if (__timers_cascade(base, n))
+                {
+                    break;
+                }
+            }
         }
-        else
+
+        list_t due;
+        list_init(&due);
+        list_iterate(&base->tb_l0[index], timer, timer_t, link)
         {
-            min_expiry = MIN(min_expiry, timer->expires);
+            list_remove(&timer->link);
+            list_insert_tail(&due, &timer->link);
         }
-    }
+        base->tb_jiffies++;
 
-    /* migrate from the backup list to the primary list */
-    list_iterate(&timers_secondary, timer, timer_t, link)
-    {
-        min_expiry = MIN(min_expiry, timer->expires);
-        list_remove(&timer->link);
-        list_insert_head(&timers_primary, &timer->link);
+        /* anything added while these run lands in a later bucket */
+        while (!list_empty(&due))
+        {
+            timer_t *timer = list_head(&due, timer_t, link);
+            list_remove(&timer->link);
+            base->tb_count--;
+            base->tb_running = timer;
+            spinlock_unlock(&base->tb_lock);
+            timer->function(timer->data);
+            spinlock_lock(&base->tb_lock);
+            base->tb_running = NULL;
+        }
     }
-
-    timer_next_expiry = min_expiry;
-    timers_firing = 0;
-    spinlock_unlock(&timers_spinlock);
+    spinlock_unlock(&base->tb_lock);
 }
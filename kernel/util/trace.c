@@ -0,0 +1,131 @@
+#include "config.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "main/apic.h"
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+
+#include "proc/kmutex.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/trace.h"
+
+#if TRACE_RING_RECORDS & (TRACE_RING_RECORDS - 1)
+#error "TRACE_RING_RECORDS must be a power of 2"
+#endif
+
+/*
+ * A core's ring. tr_head is only written by the core itself, and tr_tail
+ * only by the reader holding trace_read_mutex; each side reads the other's
+ * index to know how far it may go. Both only ever grow, and are reduced
+ * modulo TRACE_RING_RECORDS to index tr_records.
+ */
+typedef struct trace_ring
+{
+    volatile uint64_t tr_head; /* next record to write */
+    volatile uint64_t tr_tail; /* next record to read */
+    uint64_t tr_lost;
+    trace_record_t tr_records[TRACE_RING_RECORDS];
+} trace_ring_t;
+
+static trace_ring_t trace_rings[MAX_LAPICS];
+
+static kmutex_t trace_read_mutex = KMUTEX_INITIALIZER(trace_read_mutex);
+
+uint64_t trace_mask = TRACE_ALL;
+
+static const char *trace_event_names[] = TRACE_EVENT_NAMES;
+
+void trace_record(uint32_t event, uint64_t a0, uint64_t a1, uint64_t a2)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    trace_ring_t *ring = &trace_rings[curcore.kc_id];
+    uint64_t head = ring->tr_head;
+    if (head - ring->tr_tail == TRACE_RING_RECORDS)
+    {
+        ring->tr_lost++;
+    }
+    else
+    {
+        trace_record_t *rec =
+            &ring->tr_records[head & (TRACE_RING_RECORDS - 1)];
+        rec->tr_time = cpuid_rdtsc();
+        rec->tr_core = (uint32_t)curcore.kc_id;
+        rec->tr_event = event;
+        rec->tr_args[0] = a0;
+        rec->tr_args[1] = a1;
+        rec->tr_args[2] = a2;
+        /* the record must be complete before the reader can see it */
+        __sync_synchronize();
+        ring->tr_head = head + 1;
+    }
+    intr_setipl(ipl);
+}
+
+size_t trace_read(trace_record_t *buf, size_t count)
+{
+    size_t n = 0;
+    kmutex_lock(&trace_read_mutex);
+    for (size_t core = 0; core < MAX_LAPICS && n < count; core++)
+    {
+        trace_ring_t *ring = &trace_rings[core];
+        uint64_t tail = ring->tr_tail;
+        uint64_t head = ring->tr_head;
+        __sync_synchronize();
+        for (; tail != head && n < count; tail++)
+        {
+            buf[n++] = ring->tr_records[tail & (TRACE_RING_RECORDS - 1)];
+        }
+        /* the records must be copied before the writer can reuse them */
+        __sync_synchronize();
+        ring->tr_tail = tail;
+    }
+    kmutex_unlock(&trace_read_mutex);
+    return n;
+}
+
+#define TRACE_DUMP_BATCH 16
+
+void trace_dump()
+{
+    trace_record_t recs[TRACE_DUMP_BATCH];
+    size_t n;
+    while ((n = trace_read(recs, TRACE_DUMP_BATCH)))
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            trace_record_t *rec = &recs[i];
+            const char *name = rec->tr_event < TRACE_NEVENTS
+                                   ? trace_event_names[rec->tr_event]
+                                   : "unknown";
+            dbg_print("%016lx C%u %-13s %#lx %#lx %#lx\n", rec->tr_time,
+                      rec->tr_core, name, rec->tr_args[0], rec->tr_args[1],
+                      rec->tr_args[2]);
+        }
+    }
+    dbg_print("trace: %lu records lost\n", trace_lost());
+}
+
+uint64_t trace_lost()
+{
+    uint64_t lost = 0;
+    for (size_t core = 0; core < MAX_LAPICS; core++)
+    {
+        lost += trace_rings[core].tr_lost;
+    }
+    return lost;
+}
+
+long trace_event_lookup(const char *name)
+{
+    for (long event = 1; event < TRACE_NEVENTS; event++)
+    {
+        if (!strcmp(name, trace_event_names[event]))
+        {
+            return event;
+        }
+    }
+    return 0;
+}
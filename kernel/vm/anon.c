@@ -6,6 +6,8 @@
 #include "util/debug.h"
 #include "util/string.h"
 
+#include "vm/swap.h"
+
 /* for debugging/verification purposes */
 int anon_count = 0; 
 
@@ -27,7 +29,8 @@ static mobj_ops_t anon_mobj_ops = {.get_pframe = NULL,
  */
 void anon_init()
 {
-    NOT_YET_IMPLEMENTED("VM: anon_init");
+    anon_allocator = slab_allocator_create("anon", sizeof(mobj_t));
+    KASSERT(anon_allocator);
 }
 
 /*
@@ -36,21 +39,42 @@ void anon_init()
  */
 mobj_t *anon_create()
 {
-    NOT_YET_IMPLEMENTED("VM: anon_create");
-    return NULL;
+    mobj_t *o = slab_obj_alloc(anon_allocator);
+    if (!o)
+    {
+        return NULL;
+    }
+    mobj_init(o, MOBJ_ANON, &anon_mobj_ops);
+    mobj_lock(o);
+    anon_count++;
+    return o;
 }
 
 /* 
  * This function is not complicated -- think about what the pframe should look
  * like for an anonymous object 
+ *
+ * Pages that have been swapped out are read back from swap instead.
  */
 static long anon_fill_pframe(mobj_t *o, pframe_t *pf)
 {
-    NOT_YET_IMPLEMENTED("VM: annon_fill_pframe");
+    long ret = swap_in(o, pf);
+    if (ret)
+    {
+        return ret < 0 ? ret : 0;
+    }
+    page_zero(pf->pf_addr);
     return 0;
 }
 
-static long anon_flush_pframe(mobj_t *o, pframe_t *pf) { return 0; }
+/*
+ * Anonymous pages have no backing store other than swap, which they are only
+ * written to when reclaim evicts them.
+ */
+static long anon_flush_pframe(mobj_t *o, pframe_t *pf)
+{
+    return swap_out(o, pf);
+}
 
 /*
  * Release all resources associated with an anonymous object.
@@ -61,5 +85,7 @@ static long anon_flush_pframe(mobj_t *o, pframe_t *pf) { return 0; }
  */
 static void anon_destructor(mobj_t *o)
 {
-    NOT_YET_IMPLEMENTED("VM: anon_destructor");
+    mobj_default_destructor(o);
+    anon_count--;
+    slab_obj_free(anon_allocator, o);
 }
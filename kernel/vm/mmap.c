@@ -1,18 +1,27 @@
 #include "vm/mmap.h"
 #include "errno.h"
+#include "drivers/writeback.h"
 #include "fs/file.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "globals.h"
 #include "mm/mm.h"
 #include "mm/mman.h"
+#include "mm/mobj.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
 #include "mm/tlb.h"
 #include "util/debug.h"
+#include "vm/pagefault.h"
+#include "vm/swap.h"
+#include "vm/vmmap.h"
 
 /*
  * This function implements the mmap(2) syscall: Add a mapping to the current
  * process's address space. Supports the following flags: MAP_SHARED,
- * MAP_PRIVATE, MAP_FIXED, and MAP_ANON.
+ * MAP_PRIVATE, MAP_FIXED, and MAP_ANON. MAP_POPULATE is accepted too; the
+ * syscall handler populates the new mapping afterwards (see
+ * do_mmap_populate()).
  *
  *  ret - If provided, on success, *ret must point to the start of the mapped area
  *
@@ -44,6 +53,8 @@
  *  2) Call vmmap_map() to create the mapping.
  *     a) Use VMMAP_DIR_HILO as default, which will make other stencil code in
  *        Weenix happy.
+ *     b) Hold the vmmap's vmm_lock exclusively around it, as do_munmap()
+ *        does around vmmap_remove().
  *  3) Call tlb_flush_range() on the newly-mapped region. This is because the
  *     newly-mapped region could have been used by someone else, and you don't
  *     want to get stale mappings.
@@ -156,7 +167,9 @@ long do_munmap(void *addr, size_t len)
     if (addr < (void *)USER_MEM_LOW || addr > (void *)USER_MEM_HIGH) {
         return -EINVAL;
     }
+    rwlock_write_lock(&curproc->p_vmmap->vmm_lock);
     long err = vmmap_remove(curproc->p_vmmap, ADDR_TO_PN(addr), ADDR_TO_PN(len));
+    rwlock_write_unlock(&curproc->p_vmmap->vmm_lock);
     // if (err != 0) {
     //     return err;
     // }
@@ -164,4 +177,348 @@ long do_munmap(void *addr, size_t len)
 
     // NOT_YET_IMPLEMENTED("VM: do_munmap");
     // return -1;
-}
\ No newline at end of file
+}
+
+/*
+ * This function implements the mprotect(2) syscall: set the protection of
+ * pages [addr, addr + len) of the current process to prot (see
+ * vmmap_protect()). Where any access is taken away, the range's mappings are
+ * dropped, and faults map the pages again as now allowed; granting access
+ * needs no such care, since faults on the old mappings are resolved as the
+ * area now allows.
+ *
+ * Return 0 on success, or:
+ *  - EINVAL: addr is not page aligned, or prot has unknown bits
+ *  - ENOMEM: part of the range is not mapped
+ *  - EACCES: see vmmap_protect()
+ */
+long do_mprotect(void *addr, size_t len, int prot)
+{
+    if (!PAGE_ALIGNED(addr) || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)))
+    {
+        return -EINVAL;
+    }
+    if (!len)
+    {
+        return 0;
+    }
+    if ((uintptr_t)addr < USER_MEM_LOW ||
+        len > USER_MEM_HIGH - (uintptr_t)addr)
+    {
+        return -ENOMEM;
+    }
+    size_t lo = ADDR_TO_PN(addr);
+    size_t hi = ADDR_TO_PN(PAGE_ALIGN_UP((uintptr_t)addr + len));
+
+    vmmap_t *map = curproc->p_vmmap;
+    rwlock_write_lock(&map->vmm_lock);
+    long reduced = 0;
+    for (size_t vfn = lo; vfn < hi;)
+    {
+        vmarea_t *vma = vmmap_lookup(map, vfn);
+        if (!vma)
+        {
+            break;
+        }
+        reduced |= vma->vma_prot & ~prot;
+        vfn = vma->vma_end;
+    }
+    long ret = vmmap_protect(map, lo, hi - lo, prot);
+    if (reduced)
+    {
+        page_batch_t reclaim = PAGE_BATCH_INITIALIZER;
+        pt_unmap_range(curproc->p_pml4, (uintptr_t)PN_TO_ADDR(lo),
+                       (uintptr_t)PN_TO_ADDR(hi), &reclaim);
+        tlb_shootdown(curproc->p_pml4, (uintptr_t)PN_TO_ADDR(lo), hi - lo);
+        page_batch_flush(&reclaim);
+    }
+    rwlock_write_unlock(&map->vmm_lock);
+    return ret;
+}
+
+/*
+ * Fault in every page of [addr, addr + len) of the current process, as
+ * MAP_POPULATE asks. The file pages of the range are read ahead together
+ * first, so that the faults that follow find them in memory or in flight
+ * instead of each waiting for its own read. Pages are faulted in for writing
+ * if prot allows it, so that a private mapping gets its own copies now too.
+ * Failures are ignored; the pages are then faulted in when they are used.
+ */
+void do_mmap_populate(void *addr, size_t len, int prot)
+{
+    if (!(prot & (PROT_READ | PROT_WRITE)) ||
+        do_madvise(addr, len, MADV_WILLNEED))
+    {
+        return;
+    }
+    uintptr_t cause = FAULT_USER | ((prot & PROT_WRITE) ? FAULT_WRITE : 0);
+    size_t hi = ADDR_TO_PN(PAGE_ALIGN_UP((uintptr_t)addr + len));
+    for (size_t vfn = ADDR_TO_PN(addr); vfn < hi; vfn++)
+    {
+        if (pagefault_resolve((uintptr_t)PN_TO_ADDR(vfn), cause))
+        {
+            break;
+        }
+    }
+}
+
+/*
+ * Unmap vfns [lo, hi) of an area of the current process and, if the area is
+ * private, throw away the copies of the pages its top object holds, resident
+ * or in swap. The next access then finds whatever is below: the file, the
+ * contents at the last fork, or zeroes. The vmmap must be locked exclusively.
+ */
+static void madvise_dontneed(vmarea_t *vma, size_t lo, size_t hi)
+{
+    page_batch_t reclaim = PAGE_BATCH_INITIALIZER;
+    pt_unmap_range(curproc->p_pml4, (uintptr_t)PN_TO_ADDR(lo),
+                   (uintptr_t)PN_TO_ADDR(hi), &reclaim);
+    tlb_shootdown(curproc->p_pml4, (uintptr_t)PN_TO_ADDR(lo), hi - lo);
+    page_batch_flush(&reclaim);
+
+    mobj_t *o = vma->vma_obj;
+    if (!(vma->vma_flags & MAP_PRIVATE) ||
+        (o->mo_type != MOBJ_SHADOW && o->mo_type != MOBJ_ANON))
+    {
+        return;
+    }
+    uint64_t first = vma->vma_off + (lo - vma->vma_start);
+    uint64_t end = first + (hi - lo);
+    mobj_lock(o);
+    uint64_t pagenum = first;
+    pframe_t *pf;
+    while ((pf = radix_tree_next(&o->mo_pframe_idx, &pagenum)) &&
+           pagenum < end)
+    {
+        pframe_lock(pf);
+        mobj_clean_pframe(o, pf);
+        long ret = mobj_free_pframe(o, &pf);
+        KASSERT(!ret && "freeing a clean pframe cannot fail");
+        pagenum++;
+    }
+    pagenum = first;
+    while (radix_tree_next(&o->mo_swap_idx, &pagenum) && pagenum < end)
+    {
+        swap_discard(o, pagenum++);
+    }
+    mobj_unlock(o);
+}
+
+/*
+ * This function implements the madvise(2) syscall for pages [addr, addr + len)
+ * of the current process:
+ *  - MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL: set the expected access
+ *    pattern, which decides what faults read ahead and map around (see
+ *    pagefault.c). Areas are not split, so this applies to the whole of each
+ *    area the range touches.
+ *  - MADV_WILLNEED: start reading the file pages of the range.
+ *  - MADV_DONTNEED: unmap the range and drop the private copies of its pages
+ *    (see madvise_dontneed()).
+ *
+ * Return 0 on success, or:
+ *  - EINVAL: addr is not page aligned, or advice is unknown
+ *  - ENOMEM: part of the range is not mapped, in which case the advice has
+ *    been applied to the mapped part before it
+ */
+long do_madvise(void *addr, size_t len, int advice)
+{
+    if (!PAGE_ALIGNED(addr) || advice < MADV_NORMAL || advice > MADV_DONTNEED)
+    {
+        return -EINVAL;
+    }
+    if (!len)
+    {
+        return 0;
+    }
+    if ((uintptr_t)addr < USER_MEM_LOW ||
+        len > USER_MEM_HIGH - (uintptr_t)addr)
+    {
+        return -ENOMEM;
+    }
+    size_t lo = ADDR_TO_PN(addr);
+    size_t hi = ADDR_TO_PN(PAGE_ALIGN_UP((uintptr_t)addr + len));
+
+    /* readahead only reads the areas; everything else changes them or what
+     * faults may map */
+    vmmap_t *map = curproc->p_vmmap;
+    long shared = advice == MADV_WILLNEED;
+    if (shared)
+    {
+        rwlock_read_lock(&map->vmm_lock);
+    }
+    else
+    {
+        rwlock_write_lock(&map->vmm_lock);
+    }
+    long ret = 0;
+    for (size_t vfn = lo; vfn < hi;)
+    {
+        vmarea_t *vma = vmmap_lookup(map, vfn);
+        if (!vma)
+        {
+            ret = -ENOMEM;
+            break;
+        }
+        size_t end = MIN(hi, vma->vma_end);
+        if (advice == MADV_WILLNEED)
+        {
+            vmarea_readahead(vma, vfn, end - vfn);
+        }
+        else if (advice == MADV_DONTNEED)
+        {
+            madvise_dontneed(vma, vfn, end);
+        }
+        else
+        {
+            vma->vma_advice = advice;
+            vma->vma_ra_end = 0;
+        }
+        vfn = end;
+    }
+    if (shared)
+    {
+        rwlock_read_unlock(&map->vmm_lock);
+    }
+    else
+    {
+        rwlock_write_unlock(&map->vmm_lock);
+    }
+    return ret;
+}
+
+/* Pages whose dirty bits msync() harvests per TLB shootdown; at most 64 */
+#define MSYNC_BATCH 64
+
+/*
+ * Write back, if dirty, the page of file o behind a mapped page, marking it
+ * dirty first if the mapping's dirty bit says it was written to. The page
+ * may live in another mobj (e.g. an s5fs file's blocks are pages of the
+ * block device), which is locked on its own to flush it, after the pframe is
+ * released.
+ */
+static long msync_page(mobj_t *o, uint64_t pagenum, long written, long sync)
+{
+    pframe_t *pf;
+    mobj_lock(o);
+    long ret = mobj_get_pframe(o, pagenum, written, &pf);
+    mobj_unlock(o);
+    if (ret)
+    {
+        return ret;
+    }
+    mobj_t *owner = pf->pf_obj;
+    uint64_t ownpage = pf->pf_pagenum;
+    long dirty = pf->pf_dirty;
+    pframe_release(&pf);
+    if (!sync || !dirty)
+    {
+        return 0;
+    }
+
+    /* if the page is gone by now, evicting it wrote it back */
+    mobj_lock(owner);
+    mobj_find_pframe(owner, ownpage, &pf);
+    if (pf)
+    {
+        ret = mobj_flush_pframe(owner, pf);
+        pframe_release(&pf);
+    }
+    mobj_unlock(owner);
+    return ret;
+}
+
+/*
+ * This function implements the msync(2) syscall for pages [addr, addr + len)
+ * of the current process.
+ *
+ * A write fault dirties a page of a shared file mapping only once: after the
+ * page is written back it stays mapped writable, and further writes go
+ * unseen. So the dirty bits of the mappings in the range are harvested (and
+ * cleared, so that the next msync() sees only newer writes), and only the
+ * pages written to since are marked dirty. With MS_SYNC the dirty pages of
+ * the range are then written back before returning; with MS_ASYNC the
+ * writeback thread is woken to do it. Private and anonymous mappings have
+ * nothing to write back.
+ *
+ * Return 0 on success, or:
+ *  - EINVAL: addr is not page aligned, flags has unknown bits, or both
+ *    MS_ASYNC and MS_SYNC
+ *  - ENOMEM: part of the range is not mapped
+ *  - Propagate errors from writing pages back
+ */
+long do_msync(void *addr, size_t len, int flags)
+{
+    if (!PAGE_ALIGNED(addr) ||
+        (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) ||
+        ((flags & MS_ASYNC) && (flags & MS_SYNC)))
+    {
+        return -EINVAL;
+    }
+    if ((uintptr_t)addr < USER_MEM_LOW ||
+        len > USER_MEM_HIGH - (uintptr_t)addr)
+    {
+        return -ENOMEM;
+    }
+    size_t lo = ADDR_TO_PN(addr);
+    size_t hi = ADDR_TO_PN(PAGE_ALIGN_UP((uintptr_t)addr + len));
+    long sync = (flags & MS_SYNC) != 0;
+
+    vmmap_t *map = curproc->p_vmmap;
+    pml4_t *pml4 = curproc->p_pml4;
+    rwlock_read_lock(&map->vmm_lock);
+    long ret = 0;
+    for (size_t vfn = lo; vfn < hi && !ret;)
+    {
+        vmarea_t *vma = vmmap_lookup(map, vfn);
+        if (!vma)
+        {
+            ret = -ENOMEM;
+            break;
+        }
+        size_t end = MIN(hi, vma->vma_end);
+        if (!(vma->vma_flags & MAP_SHARED) ||
+            vma->vma_obj->mo_type != MOBJ_VNODE)
+        {
+            vfn = end;
+            continue;
+        }
+
+        /* harvest the dirty bits a batch at a time; they must be out of
+         * every TLB before the pages are written, so that writes made from
+         * then on set them again */
+        while (vfn < end && !ret)
+        {
+            size_t n = MIN(end - vfn, (size_t)MSYNC_BATCH);
+            uint64_t mapped = 0;
+            uint64_t written = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                uintptr_t pte =
+                    pt_test_and_clear_dirty(pml4, (uintptr_t)PN_TO_ADDR(vfn + i));
+                mapped |= (uint64_t)((pte & PT_PRESENT) != 0) << i;
+                written |= (uint64_t)((pte & PT_DIRTY) != 0) << i;
+            }
+            if (written)
+            {
+                tlb_shootdown(pml4, (uintptr_t)PN_TO_ADDR(vfn), n);
+            }
+            for (size_t i = 0; i < n && !ret; i++)
+            {
+                long dirty = (written >> i) & 1;
+                if (((mapped >> i) & 1) && (sync || dirty))
+                {
+                    ret = msync_page(vma->vma_obj,
+                                     vma->vma_off + (vfn + i - vma->vma_start),
+                                     dirty, sync);
+                }
+            }
+            vfn += n;
+        }
+    }
+    rwlock_read_unlock(&map->vmm_lock);
+    if (!ret && !sync)
+    {
+        writeback_kick();
+    }
+    return ret;
+}
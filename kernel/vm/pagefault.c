@@ -1,13 +1,214 @@
 #include "vm/pagefault.h"
+#include "config.h"
 #include "errno.h"
 #include "globals.h"
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/mobj.h"
+#include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/tlb.h"
 #include "types.h"
 #include "util/debug.h"
+#include "util/string.h"
+#include "util/trace.h"
+#include "vm/shadow.h"
+#include "vm/vmmap.h"
+
+/*
+ * A page of zeroes, mapped read-only in place of every untouched page of
+ * private anonymous memory that is only read; the first write to such a page
+ * faults again and gets a page of its own from the anonymous object.
+ * Allocated on first use.
+ */
+static void *zero_page;
+
+static uintptr_t zero_page_phys()
+{
+    if (!zero_page)
+    {
+        zero_page = page_alloc_zeroed();
+        if (!zero_page)
+        {
+            return 0;
+        }
+    }
+    return pt_virt_to_phys((uintptr_t)zero_page);
+}
+
+/*
+ * Returns whether a read fault on the given page of vma can be served with the
+ * zero page: the area is private, backed by an anonymous object, and nothing
+ * in its shadow chain holds the page yet. Shared anonymous areas are left out,
+ * since a write through another mapping would not reach ours.
+ */
+static long fault_zero_page(vmarea_t *vma, uint64_t pagenum)
+{
+    mobj_t *o = vma->vma_obj;
+    if (o->mo_type != MOBJ_SHADOW || shadow_bottom(o)->mo_type != MOBJ_ANON)
+    {
+        return 0;
+    }
+    mobj_lock(o);
+    long untouched = !shadow_chain_has_pframe(o, pagenum);
+    mobj_unlock(o);
+    return untouched;
+}
+
+/*
+ * Map whichever pages of the FAULT_AROUND_PAGES-aligned window around vfn are
+ * already resident, so that faulting in a program's text, or scanning a
+ * mapped file, does not trap once per page. Nothing is read from disk and
+ * pages with a fill in flight are skipped.
+ *
+ * Only areas that can never be written are eligible: then no shadow object
+ * above the file ever holds a copy of a page (copies are only made on write),
+ * so the file's own pframes are exactly what a fault would find.
+ */
+static void fault_around(vmarea_t *vma, size_t vfn)
+{
+    if (vma->vma_prot & PROT_WRITE)
+    {
+        return;
+    }
+    mobj_t *o = shadow_bottom(vma->vma_obj);
+    if (o->mo_type != MOBJ_VNODE)
+    {
+        return;
+    }
+
+    size_t lo = MAX(vma->vma_start, vfn & ~(size_t)(FAULT_AROUND_PAGES - 1));
+    size_t hi = MIN(vma->vma_end, lo + FAULT_AROUND_PAGES);
+    mobj_lock(o);
+    for (size_t v = lo; v < hi; v++)
+    {
+        pframe_t *pf;
+        if (v == vfn)
+        {
+            continue;
+        }
+        mobj_find_pframe(o, vma->vma_off + (v - vma->vma_start), &pf);
+        if (!pf)
+        {
+            continue;
+        }
+        long ret = 0;
+        if (!pf->pf_filling)
+        {
+            uintptr_t paddr = pt_virt_to_phys((uintptr_t)pf->pf_addr);
+            ret = pt_map(curproc->p_pml4, paddr, (uintptr_t)PN_TO_ADDR(v),
+                         PT_PRESENT | PT_WRITE | PT_USER, PT_PRESENT | PT_USER);
+        }
+        pframe_release(&pf);
+        if (ret)
+        {
+            break;
+        }
+    }
+    mobj_unlock(o);
+    tlb_flush_range((uintptr_t)PN_TO_ADDR(lo), hi - lo);
+}
+
+/*
+ * In an area advised MADV_SEQUENTIAL, keep FAULT_READAHEAD_PAGES pages read
+ * ahead of the faults, issuing the next batch once fewer than half of them
+ * remain, so that the disk is kept busy while the process works through the
+ * pages already read. Concurrent faults may race on vma_ra_end, which costs
+ * at most a redundant readahead.
+ */
+static void fault_readahead(vmarea_t *vma, size_t vfn)
+{
+    if (vma->vma_ra_end > vfn + FAULT_READAHEAD_PAGES / 2)
+    {
+        return;
+    }
+    size_t start = MAX(vfn, vma->vma_ra_end);
+    vma->vma_ra_end = vfn + FAULT_READAHEAD_PAGES;
+    vmarea_readahead(vma, start, vma->vma_ra_end - start);
+}
+
+/*
+ * The body of handle_pagefault(), run with the vmmap's vmm_lock held shared,
+ * so that faults of a process's threads are served concurrently, while the
+ * areas cannot be changed under them. Returns 0, or -EFAULT if the process
+ * must be killed.
+ */
+static long handle_pagefault_locked(vmmap_t *map, uintptr_t vaddr,
+                                    uintptr_t cause)
+{
+    size_t vfn = ADDR_TO_PN(vaddr);
+    vmarea_t *vma = vmmap_lookup(map, vfn);
+    if (!vma)
+    {
+        return -EFAULT;
+    }
+
+    int prot = PROT_READ;
+    if (cause & FAULT_WRITE)
+    {
+        prot = PROT_WRITE;
+    }
+    else if (cause & FAULT_EXEC)
+    {
+        prot = PROT_EXEC;
+    }
+    if (!(vma->vma_prot & prot))
+    {
+        return -EFAULT;
+    }
+
+    long forwrite = (cause & FAULT_WRITE) != 0;
+    uint64_t pagenum = vma->vma_off + (vfn - vma->vma_start);
+    uintptr_t page = (uintptr_t)PAGE_ALIGN_DOWN(vaddr);
+    long ret;
+    if (!forwrite && fault_zero_page(vma, pagenum))
+    {
+        uintptr_t paddr = zero_page_phys();
+        ret = paddr ? pt_map(curproc->p_pml4, paddr, page,
+                             PT_PRESENT | PT_WRITE | PT_USER,
+                             PT_PRESENT | PT_USER)
+                    : -ENOMEM;
+        if (ret)
+        {
+            return -EFAULT;
+        }
+        tlb_flush(page);
+        return 0;
+    }
+
+    if (vma->vma_advice == MADV_SEQUENTIAL)
+    {
+        fault_readahead(vma, vfn);
+    }
+
+    pframe_t *pf;
+    mobj_lock(vma->vma_obj);
+    ret = mobj_get_pframe(vma->vma_obj, pagenum, forwrite, &pf);
+    mobj_unlock(vma->vma_obj);
+    if (ret)
+    {
+        return -EFAULT;
+    }
+
+    /* device memory, i.e. a framebuffer, is written far faster combined */
+    uint32_t cache =
+        vma->vma_obj->mo_type == MOBJ_DEVICE ? PT_WRITE_COMBINING : 0;
+    ret = pt_map(curproc->p_pml4, pt_virt_to_phys((uintptr_t)pf->pf_addr), page,
+                 PT_PRESENT | PT_WRITE | PT_USER,
+                 PT_PRESENT | PT_USER | (forwrite ? PT_WRITE : 0) | cache);
+    pframe_release(&pf);
+    if (ret)
+    {
+        return -EFAULT;
+    }
+    tlb_flush(page);
+
+    if (!forwrite && vma->vma_advice != MADV_RANDOM)
+    {
+        fault_around(vma, vfn);
+    }
+    return 0;
+}
 
 /*
  * Respond to a user mode pagefault by setting up the desired page.
@@ -46,8 +247,35 @@
  *    do_exit(EFAULT).
  */
 void handle_pagefault(uintptr_t vaddr, uintptr_t cause)
+{
+    if (pagefault_resolve(vaddr, cause))
+    {
+        do_exit(EFAULT);
+    }
+}
+
+long pagefault_resolve(uintptr_t vaddr, uintptr_t cause)
 {
     dbg(DBG_VM, "vaddr = 0x%p (0x%p), cause = %lu\n", (void *)vaddr,
         PAGE_ALIGN_DOWN(vaddr), cause);
-    NOT_YET_IMPLEMENTED("VM: handle_pagefault");
+    vmmap_t *map = curproc->p_vmmap;
+    uint64_t reads = curthr->kt_pages_read;
+    rwlock_read_lock(&map->vmm_lock);
+    long ret = handle_pagefault_locked(map, vaddr, cause);
+    rwlock_read_unlock(&map->vmm_lock);
+
+    /* the process's threads may fault at the same time */
+    __sync_fetch_and_add(&curproc->p_faults, 1);
+    __sync_fetch_and_add(&curproc->p_fault_reads,
+                         curthr->kt_pages_read - reads);
+    trace(TRACE_PAGEFAULT, vaddr, cause, ret);
+    return ret;
+}
+
+void pagefault_report(proc_t *p)
+{
+    dbg(DBG_VM, "P%d (%s): %lu page faults, %lu pages read in for them\n",
+        p->p_pid, p->p_name, p->p_faults, p->p_fault_reads);
+    p->p_faults = 0;
+    p->p_fault_reads = 0;
 }
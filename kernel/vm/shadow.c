@@ -4,6 +4,7 @@
 #include "mm/slab.h"
 #include "util/debug.h"
 #include "util/string.h"
+#include "vm/swap.h"
 
 #define SHADOW_SINGLETON_THRESHOLD 5
 
@@ -64,6 +65,52 @@ mobj_t *shadow_create(mobj_t *shadowed)
     return NULL;
 }
 
+/*
+ * Return the object at the bottom of o's shadow chain, or o itself if it is
+ * not a shadow object.
+ */
+mobj_t *shadow_bottom(mobj_t *o)
+{
+    return o->mo_type == MOBJ_SHADOW ? MOBJ_TO_SO(o)->bottom_mobj : o;
+}
+
+/*
+ * Return whether any object in the shadow chain of o, which must be a locked
+ * shadow object, has a pframe for pagenum, resident or in swap, without
+ * creating or filling one.
+ */
+long shadow_chain_has_pframe(mobj_t *o, uint64_t pagenum)
+{
+    KASSERT(o->mo_type == MOBJ_SHADOW && kmutex_owns_mutex(&o->mo_mutex));
+    for (mobj_t *cur = o;; cur = MOBJ_TO_SO(cur)->shadowed)
+    {
+        pframe_t *pf;
+        if (cur != o)
+        {
+            mobj_lock(cur);
+        }
+        mobj_find_pframe(cur, pagenum, &pf);
+        long swapped = !pf && swap_has_page(cur, pagenum);
+        if (cur != o)
+        {
+            mobj_unlock(cur);
+        }
+        if (pf)
+        {
+            pframe_release(&pf);
+            return 1;
+        }
+        if (swapped)
+        {
+            return 1;
+        }
+        if (cur->mo_type != MOBJ_SHADOW)
+        {
+            return 0;
+        }
+    }
+}
+
 /*
  * Given a shadow object o, collapse its shadow chain as far as you can.
  *
@@ -101,7 +148,8 @@ void shadow_collapse(mobj_t *o)
  *  1) If forwrite is set, use mobj_default_get_pframe().
  *  2) If forwrite is clear, check if o already contains the desired frame.
  *     a) If not, iterate through the shadow chain to find the nearest shadow
- *        mobj that has the frame. Do not recurse! If the shadow chain is long,
+ *        mobj that has the frame, resident or in swap (swap_has_page()), and
+ *        get it with mobj_default_get_pframe(). Do not recurse! If the shadow chain is long,
  *        you will cause a kernel buffer overflow (e.g. from forkbomb).
  *     b) If no shadow objects have the page, call mobj_get_pframe() to get the
  *        page from the bottom object and return what it returns.
@@ -129,7 +177,9 @@ static long shadow_get_pframe(mobj_t *o, size_t pagenum, long forwrite,
  *     mobj_default_get_pframe (when the forwrite is set), which would 
  *     create and then fill the pframe (shadow_fill_pframe is called).
  *  3) Traverse the shadow chain for a copy of the frame, starting at the given
- *     mobj's shadowed object. You can use mobj_find_pframe to look for the 
+ *     mobj's shadowed object. A page that o itself swapped out is read back
+ *     with swap_in() instead, as done below; one that a shadowed object
+ *     swapped out is found with swap_has_page(). You can use mobj_find_pframe to look for the 
  *     page frame. pay attention to locking/unlocking, and be sure not to 
  *     recurse when traversing.
  *  4) If none of the shadow objects have a copy of the frame, use
@@ -138,6 +188,11 @@ static long shadow_get_pframe(mobj_t *o, size_t pagenum, long forwrite,
  */
 static long shadow_fill_pframe(mobj_t *o, pframe_t *pf)
 {
+    long ret = swap_in(o, pf);
+    if (ret)
+    {
+        return ret < 0 ? ret : 0;
+    }
     NOT_YET_IMPLEMENTED("VM: shadow_fill_pframe");
     return -1;
 }
@@ -147,14 +202,12 @@ static long shadow_fill_pframe(mobj_t *o, pframe_t *pf)
  *
  * Return 0 on success.
  *
- * Hint:
- *  - Are shadow objects backed to disk? Do you actually need to do anything
- *    here?
+ * Shadow objects are only backed by swap, which their pages are written to
+ * when reclaim evicts them.
  */
 static long shadow_flush_pframe(mobj_t *o, pframe_t *pf)
 {
-    NOT_YET_IMPLEMENTED("VM: shadow_flush_pframe");
-    return -1;
+    return swap_out(o, pf);
 }
 
 /*
@@ -0,0 +1,404 @@
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "drivers/bio.h"
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+
+#include "mm/mobj.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+#include "mm/vmalloc.h"
+
+#include "proc/kmutex.h"
+#include "proc/spinlock.h"
+
+#include "util/debug.h"
+#include "util/lz4.h"
+#include "util/percpu.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+#include "vm/swap.h"
+
+#define SWAP_MAP_BITS 64
+
+/* A set of slots, one bit per slot, set if it is in use */
+typedef struct swap_map
+{
+    uint64_t *sm_bits;
+    size_t sm_nslots;
+    size_t sm_nused;
+    size_t sm_hint; /* word of sm_bits to start searching at */
+} swap_map_t;
+
+static blockdev_t *swap_bd;
+static swap_map_t swap_disk_map;
+
+/* Protects the slot maps */
+static spinlock_t swap_lock = SPINLOCK_INITIALIZER(swap_lock);
+
+/*
+ * Compressed swap. Pages are compressed into objects of slab allocators of
+ * ZSWAP_CLASS_SIZE-byte size classes; a page that does not compress to
+ * ZSWAP_MAX_SIZE bytes or less is not worth keeping in memory.
+ */
+#define ZSWAP_CLASS_SIZE 256
+#define ZSWAP_MAX_SIZE (PAGE_SIZE * 3 / 4)
+#define ZSWAP_NCLASSES (ZSWAP_MAX_SIZE / ZSWAP_CLASS_SIZE)
+#define ZSWAP_CLASS(len) (((len)-1) / ZSWAP_CLASS_SIZE)
+
+typedef struct zswap_entry
+{
+    void *ze_data;
+    size_t ze_len;
+} zswap_entry_t;
+
+static swap_map_t zswap_map;
+static zswap_entry_t *zswap_entries; /* by slot, less SWAP_SLOTS */
+static slab_allocator_t *zswap_classes[ZSWAP_NCLASSES];
+static char zswap_class_names[ZSWAP_NCLASSES][16];
+static size_t zswap_nbytes; /* in size classes, including their waste */
+
+/* Protects the compressor's buffers */
+static kmutex_t zswap_mutex;
+static uint8_t zswap_buf[ZSWAP_MAX_SIZE];
+static uint8_t zswap_work[LZ4_WORK_SIZE];
+
+/* Statistics, per core as every core swaps */
+static pcpu_counter_t swap_nout;
+static pcpu_counter_t swap_nin;
+static pcpu_counter_t zswap_nrejected;
+
+/*
+ * Slots are stored in mo_swap_idx off by one, as it cannot hold NULL. The
+ * compressed ones are numbered from SWAP_SLOTS on, past those on disk.
+ */
+#define SWAP_SLOT_ITEM(slot) ((void *)((slot) + 1))
+#define SWAP_ITEM_SLOT(item) ((size_t)(item)-1)
+#define SWAP_SLOT_COMPRESSED(slot) ((slot) >= SWAP_SLOTS)
+
+static void swap_map_init(swap_map_t *map, size_t nslots)
+{
+    size_t words = (nslots + SWAP_MAP_BITS - 1) / SWAP_MAP_BITS;
+    map->sm_bits = kvmalloc(words * sizeof(uint64_t));
+    KASSERT(map->sm_bits);
+    memset(map->sm_bits, 0, words * sizeof(uint64_t));
+    map->sm_nslots = nslots;
+}
+
+#ifdef __VM__
+static void zswap_init()
+{
+    for (size_t i = 0; i < ZSWAP_NCLASSES; i++)
+    {
+        snprintf(zswap_class_names[i], sizeof(zswap_class_names[i]),
+                 "zswap%lu", (i + 1) * ZSWAP_CLASS_SIZE);
+        zswap_classes[i] = slab_allocator_create(zswap_class_names[i],
+                                                 (i + 1) * ZSWAP_CLASS_SIZE);
+        KASSERT(zswap_classes[i]);
+    }
+    zswap_entries = kvmalloc(ZSWAP_ENTRIES * sizeof(zswap_entry_t));
+    KASSERT(zswap_entries);
+    swap_map_init(&zswap_map, ZSWAP_ENTRIES);
+    kmutex_init(&zswap_mutex);
+    dbg(DBG_MM, "swap: %d pages compressed in up to %d pages of memory\n",
+        ZSWAP_ENTRIES, ZSWAP_MAX_PAGES);
+}
+#endif
+
+void swap_init()
+{
+    pcpu_counter_init(&swap_nout);
+    pcpu_counter_init(&swap_nin);
+    pcpu_counter_init(&zswap_nrejected);
+#ifdef __VM__
+    if (ZSWAP_ENTRIES)
+    {
+        zswap_init();
+    }
+    if (__NDISKS__ < 2)
+    {
+        dbg(DBG_MM, "swap: no disk to spare\n");
+        return;
+    }
+    blockdev_t *bd = blockdev_lookup(MKDEVID(DISK_MAJOR, __NDISKS__ - 1));
+    if (!bd)
+    {
+        dbg(DBG_MM, "swap: disk%d not found\n", __NDISKS__ - 1);
+        return;
+    }
+    swap_map_init(&swap_disk_map, SWAP_SLOTS);
+    swap_bd = bd;
+    dbg(DBG_MM, "swap: %d slots on disk%d\n", SWAP_SLOTS, __NDISKS__ - 1);
+#endif
+}
+
+long swap_enabled() { return swap_bd || zswap_entries; }
+
+/*
+ * Allocate a free slot of a map, looking from where the last one was found.
+ * Returns the slot, or -1 if the map is full.
+ */
+static ssize_t swap_slot_alloc(swap_map_t *map)
+{
+    size_t words = (map->sm_nslots + SWAP_MAP_BITS - 1) / SWAP_MAP_BITS;
+    spinlock_lock(&swap_lock);
+    for (size_t n = 0; n < words && map->sm_nused < map->sm_nslots; n++)
+    {
+        size_t word = (map->sm_hint + n) % words;
+        uint64_t free = ~map->sm_bits[word];
+        if (!free)
+        {
+            continue;
+        }
+        size_t slot = word * SWAP_MAP_BITS + __builtin_ctzl(free);
+        if (slot >= map->sm_nslots)
+        {
+            continue;
+        }
+        map->sm_bits[word] |= 1UL << (slot % SWAP_MAP_BITS);
+        map->sm_nused++;
+        map->sm_hint = word;
+        spinlock_unlock(&swap_lock);
+        return (ssize_t)slot;
+    }
+    spinlock_unlock(&swap_lock);
+    return -1;
+}
+
+static void swap_slot_free(swap_map_t *map, size_t slot)
+{
+    KASSERT(slot < map->sm_nslots);
+    spinlock_lock(&swap_lock);
+    KASSERT(map->sm_bits[slot / SWAP_MAP_BITS] &
+            (1UL << (slot % SWAP_MAP_BITS)));
+    map->sm_bits[slot / SWAP_MAP_BITS] &= ~(1UL << (slot % SWAP_MAP_BITS));
+    map->sm_nused--;
+    spinlock_unlock(&swap_lock);
+}
+
+static long swap_io(size_t slot, void *page, long write)
+{
+    bio_t bio;
+    bio_prepare(&bio, swap_bd, (blocknum_t)slot, 1, page, write);
+    long ret = bio_submit(&bio);
+    if (!ret)
+    {
+        ret = bio_wait(&bio);
+    }
+    return ret;
+}
+
+/* Free a slot, and with a compressed one, the page it holds */
+static void swap_item_free(void *item)
+{
+    size_t slot = SWAP_ITEM_SLOT(item);
+    if (!SWAP_SLOT_COMPRESSED(slot))
+    {
+        swap_slot_free(&swap_disk_map, slot);
+        return;
+    }
+    zswap_entry_t *ze = &zswap_entries[slot - SWAP_SLOTS];
+    size_t class = ZSWAP_CLASS(ze->ze_len);
+    slab_obj_free(zswap_classes[class], ze->ze_data);
+    ze->ze_data = NULL;
+    __sync_sub_and_fetch(&zswap_nbytes, (class + 1) * ZSWAP_CLASS_SIZE);
+    swap_slot_free(&zswap_map, slot - SWAP_SLOTS);
+}
+
+/*
+ * Compress a locked pframe of a locked mobj into memory, in place of the
+ * disk slot it may have. Returns 0 on success, or -ENOSPC if the page does
+ * not compress well enough or the memory set aside is used up.
+ */
+static long zswap_store(mobj_t *o, pframe_t *pf)
+{
+    if (!zswap_entries)
+    {
+        return -ENOSPC;
+    }
+    kmutex_lock(&zswap_mutex);
+    size_t len = lz4_compress(pf->pf_addr, PAGE_SIZE, zswap_buf,
+                              ZSWAP_MAX_SIZE, zswap_work);
+    if (!len)
+    {
+        kmutex_unlock(&zswap_mutex);
+        pcpu_counter_inc(&zswap_nrejected);
+        return -ENOSPC;
+    }
+    size_t class = ZSWAP_CLASS(len);
+    size_t size = (class + 1) * ZSWAP_CLASS_SIZE;
+    ssize_t slot = -1;
+    void *data = NULL;
+    if (zswap_nbytes + size <= (size_t)ZSWAP_MAX_PAGES * PAGE_SIZE &&
+        (slot = swap_slot_alloc(&zswap_map)) >= 0)
+    {
+        data = slab_obj_alloc(zswap_classes[class]);
+    }
+    if (!data)
+    {
+        kmutex_unlock(&zswap_mutex);
+        if (slot >= 0)
+        {
+            swap_slot_free(&zswap_map, (size_t)slot);
+        }
+        return -ENOSPC;
+    }
+    memcpy(data, zswap_buf, len);
+    __sync_add_and_fetch(&zswap_nbytes, size);
+    kmutex_unlock(&zswap_mutex);
+
+    /* a slot the page had on disk holds an older copy */
+    void *old = radix_tree_remove(&o->mo_swap_idx, pf->pf_pagenum);
+    if (old)
+    {
+        swap_item_free(old);
+    }
+    long ret = radix_tree_insert(&o->mo_swap_idx, pf->pf_pagenum,
+                                 SWAP_SLOT_ITEM(SWAP_SLOTS + (size_t)slot));
+    if (ret)
+    {
+        slab_obj_free(zswap_classes[class], data);
+        __sync_sub_and_fetch(&zswap_nbytes, size);
+        swap_slot_free(&zswap_map, (size_t)slot);
+        return ret;
+    }
+    zswap_entries[slot].ze_data = data;
+    zswap_entries[slot].ze_len = len;
+    return 0;
+}
+
+long swap_in(mobj_t *o, pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    KASSERT(pframe_owned(pf) && pf->pf_addr);
+    void *item = radix_tree_lookup(&o->mo_swap_idx, pf->pf_pagenum);
+    if (!item)
+    {
+        return 0;
+    }
+    size_t slot = SWAP_ITEM_SLOT(item);
+    long ret = 0;
+    if (SWAP_SLOT_COMPRESSED(slot))
+    {
+        zswap_entry_t *ze = &zswap_entries[slot - SWAP_SLOTS];
+        if (lz4_decompress(ze->ze_data, ze->ze_len, pf->pf_addr, PAGE_SIZE) !=
+            PAGE_SIZE)
+        {
+            ret = -EIO;
+        }
+    }
+    else
+    {
+        ret = swap_io(slot, pf->pf_addr, 0);
+    }
+    if (ret)
+    {
+        dbg(DBG_MM, "swap: reading page %lu of mobj 0x%p failed: %ld\n",
+            pf->pf_pagenum, o, ret);
+        return ret;
+    }
+    pcpu_counter_inc(&swap_nin);
+    return 1;
+}
+
+long swap_out(mobj_t *o, pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    KASSERT(pframe_owned(pf) && pf->pf_addr);
+    /* the pages of a mobj being destroyed are simply thrown away */
+    if (!swap_enabled() || !o->mo_refcount)
+    {
+        return 0;
+    }
+    void *item = radix_tree_lookup(&o->mo_swap_idx, pf->pf_pagenum);
+    if (item && SWAP_SLOT_COMPRESSED(SWAP_ITEM_SLOT(item)))
+    {
+        /* compressed pages are dropped when they are dirtied, so this one is
+         * clean, and already held */
+        return 0;
+    }
+    if (!zswap_store(o, pf))
+    {
+        pcpu_counter_inc(&swap_nout);
+        return 0;
+    }
+    if (!swap_bd)
+    {
+        return -ENOSPC;
+    }
+    if (!item)
+    {
+        ssize_t slot = swap_slot_alloc(&swap_disk_map);
+        if (slot < 0)
+        {
+            return -ENOSPC;
+        }
+        item = SWAP_SLOT_ITEM((size_t)slot);
+        long ret = radix_tree_insert(&o->mo_swap_idx, pf->pf_pagenum, item);
+        if (ret)
+        {
+            swap_slot_free(&swap_disk_map, (size_t)slot);
+            return ret;
+        }
+    }
+    /* on failure the page stays resident and dirty, and keeps the slot for
+     * the next attempt */
+    long ret = swap_io(SWAP_ITEM_SLOT(item), pf->pf_addr, 1);
+    if (ret)
+    {
+        dbg(DBG_MM, "swap: writing page %lu of mobj 0x%p failed: %ld\n",
+            pf->pf_pagenum, o, ret);
+        return ret;
+    }
+    pcpu_counter_inc(&swap_nout);
+    return 0;
+}
+
+void swap_discard(mobj_t *o, uint64_t pagenum)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    void *item = radix_tree_remove(&o->mo_swap_idx, pagenum);
+    if (item)
+    {
+        swap_item_free(item);
+    }
+}
+
+void swap_dirtied(mobj_t *o, uint64_t pagenum)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    void *item = radix_tree_lookup(&o->mo_swap_idx, pagenum);
+    if (item && SWAP_SLOT_COMPRESSED(SWAP_ITEM_SLOT(item)))
+    {
+        radix_tree_remove(&o->mo_swap_idx, pagenum);
+        swap_item_free(item);
+    }
+}
+
+void swap_release(mobj_t *o)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    uint64_t pagenum = 0;
+    void *item;
+    while ((item = radix_tree_next(&o->mo_swap_idx, &pagenum)))
+    {
+        radix_tree_remove(&o->mo_swap_idx, pagenum);
+        swap_item_free(item);
+    }
+}
+
+void swap_stats_get(swap_stats_t *stats)
+{
+    stats->ss_slots = swap_disk_map.sm_nslots;
+    stats->ss_used = swap_disk_map.sm_nused;
+    stats->ss_out = (size_t)pcpu_counter_read(&swap_nout);
+    stats->ss_in = (size_t)pcpu_counter_read(&swap_nin);
+    stats->ss_compressed = zswap_map.sm_nused;
+    stats->ss_compressed_pages =
+        (zswap_nbytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    stats->ss_rejected = (size_t)pcpu_counter_read(&zswap_nrejected);
+}
@@ -7,6 +7,7 @@
 
 #include "util/debug.h"
 #include "util/printf.h"
+#include "util/rbtree.h"
 #include "util/string.h"
 
 #include "fs/file.h"
@@ -15,6 +16,8 @@
 
 #include "mm/mm.h"
 #include "mm/mman.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
 #include "mm/slab.h"
 #include "mm/tlb.h"
 
@@ -43,6 +46,161 @@ require splitting an area or truncating the beginning or end of an area.
 
 */
 
+/*
+ * Besides vmm_list, a vmmap keeps its areas in a red-black tree, vmm_tree,
+ * keyed by vma_start, so that page faults and mmap() need not walk every
+ * area. Each node also records the largest gap (run of unmapped pages just
+ * below an area, see vmarea_gap()) anywhere in its subtree, which lets
+ * vmmap_find_range() skip subtrees with no room. A gap depends on the area's
+ * predecessor in vmm_list, so the list is always updated first; the only
+ * other area whose gap changes when an area comes or goes is its successor,
+ * an ancestor of it or the node taking its place, so recomputing the nodes
+ * on the path back up to the root keeps every maximum correct.
+ */
+
+#define VMMAP_LOW_VFN ADDR_TO_PN(USER_MEM_LOW)
+#define VMMAP_HIGH_VFN ADDR_TO_PN(USER_MEM_HIGH)
+
+/*
+ * Returns the number of unmapped pages between vma and the area below it (or
+ * the bottom of user memory).
+ */
+static size_t vmarea_gap(vmarea_t *vma)
+{
+    list_link_t *prev = vma->vma_plink.l_prev;
+    size_t lo = prev == &vma->vma_vmmap->vmm_list
+                    ? VMMAP_LOW_VFN
+                    : (list_item(prev, vmarea_t, vma_plink))->vma_end;
+    return vma->vma_start - lo;
+}
+
+#define vmarea_node_item(node) rb_item(node, vmarea_t, vma_node)
+
+static void vmarea_augment(rb_node_t *node)
+{
+    vmarea_t *vma = vmarea_node_item(node);
+    vma->vma_max_gap = vmarea_gap(vma);
+    if (node->rb_left)
+    {
+        vma->vma_max_gap =
+            MAX(vma->vma_max_gap, vmarea_node_item(node->rb_left)->vma_max_gap);
+    }
+    if (node->rb_right)
+    {
+        vma->vma_max_gap = MAX(vma->vma_max_gap,
+                               vmarea_node_item(node->rb_right)->vma_max_gap);
+    }
+}
+
+/*
+ * Returns the area with the greatest vma_start <= vfn, or NULL.
+ */
+static vmarea_t *vmarea_tree_floor(vmmap_t *map, size_t vfn)
+{
+    vmarea_t *found = NULL;
+    for (rb_node_t *node = map->vmm_tree.rt_root; node;)
+    {
+        vmarea_t *vma = vmarea_node_item(node);
+        if (vma->vma_start <= vfn)
+        {
+            found = vma;
+            node = node->rb_right;
+        }
+        else
+        {
+            node = node->rb_left;
+        }
+    }
+    return found;
+}
+
+/*
+ * Returns the lowest (or with hilo, highest) area with a gap of at least
+ * npages below it, or NULL.
+ */
+static vmarea_t *vmarea_tree_fit(vmmap_t *map, size_t npages, long hilo)
+{
+    rb_node_t *node = map->vmm_tree.rt_root;
+    if (!node || vmarea_node_item(node)->vma_max_gap < npages)
+    {
+        return NULL;
+    }
+    while (1)
+    {
+        vmarea_t *first =
+            vmarea_node_item(hilo ? node->rb_right : node->rb_left);
+        vmarea_t *second =
+            vmarea_node_item(hilo ? node->rb_left : node->rb_right);
+        if (first && first->vma_max_gap >= npages)
+        {
+            node = &first->vma_node;
+        }
+        else if (vmarea_gap(vmarea_node_item(node)) >= npages)
+        {
+            return vmarea_node_item(node);
+        }
+        else
+        {
+            KASSERT(second && second->vma_max_gap >= npages);
+            node = &second->vma_node;
+        }
+    }
+}
+
+/*
+ * Unlink a vmarea from its vmmap's list and tree.
+ */
+/*
+ * Whether page pagenum of vma's object lies in vma.
+ */
+static inline long vmarea_maps_page(vmarea_t *vma, uint64_t pagenum)
+{
+    return pagenum >= vma->vma_off &&
+           pagenum - vma->vma_off < vma->vma_end - vma->vma_start;
+}
+
+/*
+ * Put an area that is being linked into its map on the reverse map of the
+ * bottom of its object's shadow chain, or take one that is being unlinked off
+ * it. The bottom stays the same for as long as the area is linked: shadowing
+ * the area's object, on fork, only puts more objects above it.
+ */
+static void vmarea_rmap_add(vmarea_t *vma)
+{
+    if (!vma->vma_obj)
+    {
+        return;
+    }
+    mobj_t *bottom = shadow_bottom(vma->vma_obj);
+    spinlock_lock(&bottom->mo_vmas_lock);
+    list_insert_tail(&bottom->mo_vmas, &vma->vma_olink);
+    spinlock_unlock(&bottom->mo_vmas_lock);
+}
+
+static void vmarea_rmap_remove(vmarea_t *vma)
+{
+    if (!list_link_is_linked(&vma->vma_olink))
+    {
+        return;
+    }
+    mobj_t *bottom = shadow_bottom(vma->vma_obj);
+    spinlock_lock(&bottom->mo_vmas_lock);
+    list_remove(&vma->vma_olink);
+    spinlock_unlock(&bottom->mo_vmas_lock);
+}
+
+static void vmarea_unlink(vmarea_t *vma)
+{
+    vmmap_t *map = vma->vma_vmmap;
+    if (map->vmm_last == vma)
+    {
+        map->vmm_last = NULL;
+    }
+    list_remove(&vma->vma_plink);
+    rb_remove(&map->vmm_tree, &vma->vma_node);
+    vmarea_rmap_remove(vma);
+}
+
 /// any locking or counts in these functions?
 
 /*
@@ -71,6 +229,7 @@ vmarea_t *vmarea_alloc(void)
     {
         memset(vma, 0, sizeof(vmarea_t));
         list_link_init(&vma->vma_plink);
+        list_link_init(&vma->vma_olink);
         // vma->vma_obj = NULL;
         // vma->vma_vmmap = NULL; 
     }
@@ -87,7 +246,7 @@ vmarea_t *vmarea_alloc(void)
 void vmarea_free(vmarea_t *vma)
 {
     if (list_link_is_linked(&vma->vma_plink)){
-        list_remove(&vma->vma_plink);
+        vmarea_unlink(vma);
     }
     //list_remove(&vma->vma_plink);
     mobj_lock(vma->vma_obj); /// locked?
@@ -112,7 +271,9 @@ vmmap_t *vmmap_create(void)
     {
         memset(map, 0, sizeof(vmmap_t));
         list_init(&map->vmm_list);
+        rb_tree_init(&map->vmm_tree, vmarea_augment);
         map->vmm_proc = NULL;
+        rwlock_init(&map->vmm_lock);
     }
     return map;
     // NOT_YET_IMPLEMENTED("VM: vmmap_create"); /// make else case
@@ -140,25 +301,131 @@ void vmmap_destroy(vmmap_t **mapp)
 }
 
 /*
- * Add a vmarea to an address space. Assumes (i.e. asserts to some extent) the
- * vmarea is valid. Iterate through the list of vmareas, and add it 
- * accordingly. 
+ * Links an area into map's sorted list and tree, without merging it.
  */
-void vmmap_insert(vmmap_t *map, vmarea_t *new_vma)
+static void vmarea_link(vmmap_t *map, vmarea_t *new_vma)
 {
-    // asserts that new vma is valid
-    vmarea_t *vma;
-    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+    KASSERT(new_vma->vma_start < new_vma->vma_end);
+    KASSERT(!list_link_is_linked(&new_vma->vma_plink));
+    new_vma->vma_vmmap = map;
+
+    /* the area to insert before is the first one above new_vma's start */
+    vmarea_t *prev = vmarea_tree_floor(map, new_vma->vma_start);
+    KASSERT(!prev || prev->vma_end <= new_vma->vma_start);
+    list_link_t *next = prev ? prev->vma_plink.l_next : map->vmm_list.l_next;
+    KASSERT(next == &map->vmm_list ||
+            (list_item(next, vmarea_t, vma_plink))->vma_start >=
+                new_vma->vma_end);
+    list_insert_before(next, &new_vma->vma_plink);
+    rb_node_t **link = &map->vmm_tree.rt_root, *parent = NULL;
+    while (*link)
     {
-        if (new_vma->vma_start < vma->vma_start)
-        {
-            list_insert_before(&vma->vma_plink, &new_vma->vma_plink);
-            return;
-        }
+        parent = *link;
+        link = new_vma->vma_start < vmarea_node_item(parent)->vma_start
+                   ? &parent->rb_left
+                   : &parent->rb_right;
     }
-    list_insert_tail(&map->vmm_list, &new_vma->vma_plink);
+    rb_insert(&map->vmm_tree, &new_vma->vma_node, parent, link);
+    vmarea_rmap_add(new_vma);
+}
 
-    //NOT_YET_IMPLEMENTED("VM: vmmap_insert");
+/*
+ * Returns whether hi, which lies right above lo, maps the pages of the same
+ * object that follow lo's in the same way, so that one area could map both.
+ */
+static long vmarea_mergeable(vmarea_t *lo, vmarea_t *hi)
+{
+    return lo->vma_end == hi->vma_start && lo->vma_obj &&
+           lo->vma_obj == hi->vma_obj &&
+           lo->vma_off + (lo->vma_end - lo->vma_start) == hi->vma_off &&
+           lo->vma_prot == hi->vma_prot && lo->vma_flags == hi->vma_flags &&
+           lo->vma_advice == hi->vma_advice;
+}
+
+/*
+ * Has vma take over the areas on either side of it that it can be merged
+ * with, freeing them; vma itself stays, so callers holding it may go on
+ * using it.
+ */
+static void vmarea_merge(vmarea_t *vma)
+{
+    vmmap_t *map = vma->vma_vmmap;
+    list_link_t *prev_link = vma->vma_plink.l_prev;
+    list_link_t *next_link = vma->vma_plink.l_next;
+    vmarea_t *prev = prev_link == &map->vmm_list
+                         ? NULL
+                         : list_item(prev_link, vmarea_t, vma_plink);
+    vmarea_t *next = next_link == &map->vmm_list
+                         ? NULL
+                         : list_item(next_link, vmarea_t, vma_plink);
+    if (prev && !vmarea_mergeable(prev, vma))
+    {
+        prev = NULL;
+    }
+    if (next && !vmarea_mergeable(vma, next))
+    {
+        next = NULL;
+    }
+    if (!prev && !next)
+    {
+        return;
+    }
+
+    /* vma_start is the tree's key, so relink vma rather than patch it */
+    vmarea_unlink(vma);
+    if (prev)
+    {
+        vma->vma_start = prev->vma_start;
+        vma->vma_off = prev->vma_off;
+        vmarea_free(prev);
+    }
+    if (next)
+    {
+        vma->vma_end = next->vma_end;
+        vmarea_free(next);
+    }
+    vmarea_link(map, vma);
+}
+
+/*
+ * Splits vma at vfn, which must lie inside it, into two areas mapping the same
+ * object, and returns the new upper one, or NULL if it cannot be allocated.
+ */
+static vmarea_t *vmarea_split(vmarea_t *vma, size_t vfn)
+{
+    KASSERT(vma->vma_start < vfn && vfn < vma->vma_end);
+    vmarea_t *upper = vmarea_alloc();
+    if (!upper)
+    {
+        return NULL;
+    }
+    upper->vma_start = vfn;
+    upper->vma_end = vma->vma_end;
+    upper->vma_off = vma->vma_off + (vfn - vma->vma_start);
+    upper->vma_prot = vma->vma_prot;
+    upper->vma_flags = vma->vma_flags;
+    upper->vma_advice = vma->vma_advice;
+    upper->vma_ra_end = vma->vma_ra_end;
+    upper->vma_obj = vma->vma_obj;
+    mobj_ref(upper->vma_obj);
+
+    /* shrinking vma changes no gap: the pages it gives up go to upper */
+    vma->vma_end = vfn;
+    vmarea_link(vma->vma_vmmap, upper);
+    return upper;
+}
+
+/*
+ * Add a vmarea to an address space. Assumes (i.e. asserts to some extent) the
+ * vmarea is valid, and that it does not overlap any area already in the map.
+ * The area is inserted into both the sorted list and the tree, and takes
+ * over the neighbors it can be merged with (see vmarea_mergeable()), so that
+ * maps stay compact; new_vma itself is never freed, but may have grown.
+ */
+void vmmap_insert(vmmap_t *map, vmarea_t *new_vma)
+{
+    vmarea_link(map, new_vma);
+    vmarea_merge(new_vma);
 }
 
 /*
@@ -173,8 +440,7 @@ void vmmap_insert(vmmap_t *map, vmarea_t *new_vma)
  *                      from USER_MEM_LOW. 
  * 
  * Make sure you are converting between page numbers and addresses correctly! 
- * Think about using the list iterate macro to iterate through the vmareas in the vmmap. 
- * Also, when looking at the lower and upper page boundaries, make sure to convert USER_MEM_LOW 
+ * The tree's gap maximums lead straight to the first fitting gap. Also, when looking at the lower and upper page boundaries, make sure to convert USER_MEM_LOW 
  * and USER_MEM_HIGH to be in terms of page numbers!
  * 
  * If it is being called to get n pages, it should find a sequence of n pages that ends at USER_MEM_HIGH 
@@ -182,80 +448,46 @@ void vmmap_insert(vmmap_t *map, vmarea_t *new_vma)
  */
 ssize_t vmmap_find_range(vmmap_t *map, size_t npages, int dir)
 {
-    if (npages > (USER_MEM_HIGH - USER_MEM_LOW)/PAGE_SIZE)
+    KASSERT(dir == VMMAP_DIR_LOHI || dir == VMMAP_DIR_HILO);
+    if (!npages || npages > VMMAP_HIGH_VFN - VMMAP_LOW_VFN)
     {
         return -1;
     }
-    if (dir == VMMAP_DIR_HILO)
+
+    /* the gap above the highest area is not below any area, so it is not in
+     * the tree */
+    size_t top = list_empty(&map->vmm_list)
+                     ? VMMAP_LOW_VFN
+                     : (list_tail(&map->vmm_list, vmarea_t, vma_plink))->vma_end;
+    long top_fits = VMMAP_HIGH_VFN - top >= npages;
+
+    if (dir == VMMAP_DIR_HILO && top_fits)
     {
-        size_t vfn = ADDR_TO_PN(USER_MEM_HIGH) - npages;
-        vmarea_t *vma;
-        list_iterate_reverse(&map->vmm_list, vma, vmarea_t, vma_plink)
-        {
-            if (vma->vma_start > vfn)
-            {
-                return vfn;
-            }
-            else
-            {
-                vfn = vma->vma_end + 1;
-            }
-        }
-        return vfn;
+        return (ssize_t)(VMMAP_HIGH_VFN - npages);
     }
-    else if (dir == VMMAP_DIR_LOHI)
+    vmarea_t *vma = vmarea_tree_fit(map, npages, dir == VMMAP_DIR_HILO);
+    if (vma)
     {
-        size_t vfn = ADDR_TO_PN(USER_MEM_LOW);
-        vmarea_t *vma;
-        list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
-        {
-            if (vma->vma_start- vfn >= npages)
-            {
-                return vfn;
-            }
-            else
-            {
-                vfn = vma->vma_end;
-            }
-        }
-        return vfn;
+        return (ssize_t)(dir == VMMAP_DIR_HILO ? vma->vma_start - npages
+                                               : vma->vma_start - vmarea_gap(vma));
     }
-    else
+    if (dir == VMMAP_DIR_LOHI && top_fits)
     {
-        return -1;
+        return (ssize_t)top;
     }
-
     return -1;
-
-    // vmarea_t *vma;
-    // size_t start, end;
-    // if (dir == VMMAP_DIR_HILO)
-    // {
-    //     start = USER_MEM_HIGH - npages;
-    //     end = USER_MEM_LOW;
-    // }
-    // else
-    // {
-    //     start = USER_MEM_LOW;
-    //     end = USER_MEM_HIGH - npages;
-    // }
-    
-    // list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
-    // {
-    //     if (vma->vma_start > start && vma->vma_end < end)
-    //     {
-    //         return vma->vma_start;
-    //     }
-    // }
-
-
-    //NOT_YET_IMPLEMENTED("VM: vmmap_find_range");
-   // return -1;
 }
 
 /*
- * Return the vm_area that vfn (a page number) lies in. Scan the address space looking
- * for a vma whose range covers vfn. If the page is unmapped, return NULL.
+ * Return the vm_area that vfn (a page number) lies in: the last area starting
+ * at or below vfn, if it covers vfn. If the page is unmapped, return NULL.
+ *
+ * Successive faults tend to land in the same area (a growing stack, a heap
+ * being filled in), so the area found last is tried before the tree. Its
+ * bounds are checked as they are now, so only unlinking an area has to clear
+ * vmm_last; shrinking or splitting one in place needs no care. Lookups under
+ * vmm_lock held shared may race to set vmm_last, which is harmless: whichever
+ * area is left there is a live one.
  */
 vmarea_t *vmmap_lookup(vmmap_t *map, size_t vfn)
 {
@@ -263,17 +495,18 @@ vmarea_t *vmmap_lookup(vmmap_t *map, size_t vfn)
     {
         return NULL;
     }
-    vmarea_t *vma;
-    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+    vmarea_t *vma = map->vmm_last;
+    if (vma && vma->vma_start <= vfn && vma->vma_end > vfn)
     {
-        if (vma->vma_start <= vfn && vma->vma_end > vfn)
-        {
-            return vma;
-        }
+        return vma;
     }
-    return NULL;
-    // NOT_YET_IMPLEMENTED("VM: vmmap_lookup");
-    // return NULL;
+    vma = vmarea_tree_floor(map, vfn);
+    if (!vma || vma->vma_end <= vfn)
+    {
+        return NULL;
+    }
+    map->vmm_last = vma;
+    return vma;
 }
 
 /*
@@ -331,6 +564,7 @@ vmmap_t *vmmap_clone(vmmap_t *map) /// need help with this function
         new_vma->vma_off = vma->vma_off;
         new_vma->vma_prot = vma->vma_prot;
         new_vma->vma_flags = vma->vma_flags;
+        new_vma->vma_advice = vma->vma_advice;
         new_vma->vma_obj = vma->vma_obj;
         new_vma->vma_vmmap = new_map;
         mobj_ref(new_vma->vma_obj); /// location?
@@ -360,9 +594,7 @@ vmmap_t *vmmap_clone(vmmap_t *map) /// need help with this function
             mobj_unlock(vma->vma_obj);
 
         }
-        //vmmmap_insert(new_map, new_vma); /// need this?
-        list_insert_tail(&new_map->vmm_list, &new_vma->vma_plink);
-        list_insert_tail(&map->vmm_list, &vma->vma_plink);
+        vmmap_insert(new_map, new_vma);
 
     }
     return new_map;
@@ -480,7 +712,7 @@ long vmmap_map(vmmap_t *map, vnode_t *file, size_t lopage, size_t npages,
         mobj_ref(vma->vma_obj); /// needed
     }
 
-    list_insert_tail(&map->vmm_list, &vma->vma_plink);
+    vmmap_insert(map, vma);
 
     if (new_vma != NULL)
     {
@@ -492,6 +724,67 @@ long vmmap_map(vmmap_t *map, vnode_t *file, size_t lopage, size_t npages,
     // return -1;
 }
 
+/*
+ * Sets the protection of pages [lopage, lopage + npages) to prot, splitting
+ * the areas the range starts or ends inside of, and merging the changed ones
+ * with their neighbors where they now match. The caller must then drop the
+ * range's page table entries if the protection was reduced; faults map the
+ * pages again as the areas now allow.
+ *
+ * Return 0 on success, or:
+ *  - ENOMEM: part of the range is not mapped, in which case nothing has been
+ *    changed, or an area could not be split, in which case the areas below
+ *    it have been changed
+ *  - EACCES: prot adds PROT_WRITE to a shared file mapping that was not
+ *    mapped writable, whose file may not have been opened for writing
+ */
+long vmmap_protect(vmmap_t *map, size_t lopage, size_t npages, int prot)
+{
+    size_t hi = lopage + npages;
+    for (size_t vfn = lopage; vfn < hi;)
+    {
+        vmarea_t *vma = vmmap_lookup(map, vfn);
+        if (!vma)
+        {
+            return -ENOMEM;
+        }
+        if ((prot & PROT_WRITE) && !(vma->vma_prot & PROT_WRITE) &&
+            (vma->vma_flags & MAP_SHARED) &&
+            vma->vma_obj->mo_type == MOBJ_VNODE)
+        {
+            return -EACCES;
+        }
+        vfn = vma->vma_end;
+    }
+
+    for (size_t vfn = lopage; vfn < hi;)
+    {
+        vmarea_t *vma = vmmap_lookup(map, vfn);
+        KASSERT(vma);
+        if (vma->vma_prot == prot)
+        {
+            vfn = vma->vma_end;
+            continue;
+        }
+        if (vma->vma_start < vfn)
+        {
+            vma = vmarea_split(vma, vfn);
+            if (!vma)
+            {
+                return -ENOMEM;
+            }
+        }
+        if (vma->vma_end > hi && !vmarea_split(vma, hi))
+        {
+            return -ENOMEM;
+        }
+        vma->vma_prot = prot;
+        vfn = vma->vma_end;
+        vmarea_merge(vma);
+    }
+    return 0;
+}
+
 /*
  * Iterate over the mapping's vmm_list and make sure that the specified range
  * is completely empty. You will have to handle the following cases:
@@ -521,7 +814,8 @@ long vmmap_map(vmmap_t *map, vnode_t *file, size_t lopage, size_t npages,
  * 
  * Hints:
  *  - Whenever you shorten/remove any mappings, be sure to call pt_unmap_range()
- *    tlb_flush_range() to clean your pagetables and TLB.
+ *    and tlb_shootdown() to clean your pagetables and every core's TLB, then
+ *    flush the batch of page-table pages pt_unmap_range() emptied.
  */
 long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages)
 {
@@ -631,20 +925,91 @@ long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages)
  */
 long vmmap_is_range_empty(vmmap_t *map, size_t startvfn, size_t npages) /// verify
 {
+    KASSERT(npages);
+    /* only the last area starting inside the range can reach into it */
+    vmarea_t *vma = vmarea_tree_floor(map, startvfn + npages - 1);
+    return !vma || vma->vma_end <= startvfn;
+}
 
-    vmarea_t *vma; /// 
-    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+/*
+ * Returns the number of pages of the map's process that are resident, i.e.
+ * mapped in its page table. It is counted from the page table rather than
+ * kept up to date, so it is only as current as the moment it is taken.
+ */
+void vmarea_readahead(vmarea_t *vma, size_t vfn, size_t npages)
+{
+    mobj_t *o = shadow_bottom(vma->vma_obj);
+    size_t end = MIN(vma->vma_end, vfn + npages);
+    if (o->mo_type != MOBJ_VNODE || vfn >= end)
+    {
+        return;
+    }
+    vnode_t *vn = CONTAINER_OF(o, vnode_t, vn_mobj);
+    if (vn->vn_ops->readahead)
     {
-        // check for the 3 cases of overlap where 0 should be returned 
-        if (vma->vma_start < startvfn + npages && vma->vma_end > startvfn)
+        vn->vn_ops->readahead(vn, vma->vma_off + (vfn - vma->vma_start),
+                              end - vfn);
+    }
+}
+
+long vmmap_unmap_pframe(mobj_t *o, pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    KASSERT(pframe_owned(pf) && pf->pf_addr);
+#ifdef __VM__
+    uint64_t pagenum = pf->pf_pagenum;
+    uintptr_t paddr = pt_virt_to_phys((uintptr_t)pf->pf_addr);
+    mobj_t *bottom = shadow_bottom(o);
+    long ret = 0;
+    long unmapped = 0;
+
+    spinlock_lock(&bottom->mo_vmas_lock);
+    list_iterate(&bottom->mo_vmas, vma, vmarea_t, vma_olink)
+    {
+        vmmap_t *map = vma->vma_vmmap;
+        proc_t *proc = map->vmm_proc;
+        if (!proc || !proc->p_pml4 || !vmarea_maps_page(vma, pagenum))
         {
-            return 0;
+            continue;
         }
+        /* taken exclusively so that no fault is about to map the page; the
+         * area is looked at again under it, as it may have just changed */
+        if (!rwlock_write_trylock(&map->vmm_lock))
+        {
+            ret = -EBUSY;
+            break;
+        }
+        if (vmarea_maps_page(vma, pagenum))
+        {
+            uintptr_t vaddr =
+                (uintptr_t)PN_TO_ADDR(vma->vma_start + pagenum - vma->vma_off);
+            unmapped += pt_unmap_phys(proc->p_pml4, vaddr, paddr);
+        }
+        rwlock_write_unlock(&map->vmm_lock);
     }
-    return 1;
+    spinlock_unlock(&bottom->mo_vmas_lock);
 
-    // NOT_YET_IMPLEMENTED("VM: vmmap_is_range_empty");
-    // return 0;
+    /* whatever was unmapped must be out of every TLB before the page is
+     * written out, freed or copied, or writes through stale entries could
+     * be lost */
+    if (unmapped)
+    {
+        tlb_shootdown_kernel();
+    }
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+size_t vmmap_rss(vmmap_t *map)
+{
+    proc_t *proc = map->vmm_proc;
+    if (!proc || !proc->p_pml4)
+    {
+        return 0;
+    }
+    return pt_count_range(proc->p_pml4, USER_MEM_LOW, USER_MEM_HIGH);
 }
 
 /*
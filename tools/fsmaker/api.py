@@ -1,10 +1,15 @@
 import os
 import math
+import mmap
+import stat
 import struct
+import multiprocessing
 
 S5_MAGIC = 0x727f
-S5_CURRENT_VERSION = 3
+S5_CURRENT_VERSION = 8
+S5_MIN_VERSION = 6
 S5_BLOCK_SIZE = 4096
+S5_BITS_PER_BITMAP_BLOCK = S5_BLOCK_SIZE * 8
 
 S5_NBLKS_PER_FNODE = 30
 S5_NDIRECT_BLOCKS = 28
@@ -17,6 +22,24 @@ S5_DIRENT_SIZE = S5_NAME_LEN + 4
 S5_INODE_SIZE = 16 + S5_NDIRECT_BLOCKS * 4
 S5_INODES_PER_BLOCK = S5_BLOCK_SIZE / S5_INODE_SIZE
 
+# blocks reserved for the metadata journal, when the disk has room for them
+S5_JOURNAL_NBLOCKS = 128
+
+S5_FLAG_EXTENTS = 0x1
+S5_FLAG_DIR_INDEX = 0x2
+S5_FLAG_INLINE = 0x4
+
+# data files this small keep their contents in the inode, where the block map
+# would otherwise be
+S5_INLINE_SIZE = S5_INODE_SIZE - 12
+
+# extent-mapped inodes: a header (number of entries, depth) followed by
+# (file block, disk block, length) entries, in the inode and in leaf blocks
+S5_EXTENT_HEADER_SIZE = 4
+S5_EXTENT_SIZE = 12
+S5_EXTENT_MAX_FILE_BLOCKS = 0xffffffff // S5_BLOCK_SIZE
+S5_EXTENT_MAX_FILE_SIZE = S5_EXTENT_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
+
 S5_TYPE_FREE = 0x0
 S5_TYPE_DATA = 0x1
 S5_TYPE_DIR = 0x2
@@ -68,15 +91,10 @@ class Block:
             self._simdisk._simfile.write('\0')
 
     def free(self):
-        if (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
-            self._simdisk.set_free_block(self._simdisk.get_nfree(), self._blockno)
-            self._simdisk.set_nfree(self._simdisk.get_nfree() + 1)
-        else:
-            for i in xrange(S5_NBLKS_PER_FNODE - 1):
-                self.write(i * 4, struct.pack("I", self._simdisk.get_free_block(i)))
-            self.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self._simdisk.get_last_free_block()))
-            self._simdisk.set_last_free_block(self._blockno)
-            self._simdisk.set_nfree(0)
+        if (not self._simdisk.get_block_used(self._blockno)):
+            raise S5fsException("cannot free block {0}, it is already free".format(self._blockno))
+        self._simdisk.set_block_used(self._blockno, False)
+        self._simdisk.set_nfree(self._simdisk.get_nfree() + 1)
 
 class Dirent:
     
@@ -121,11 +139,54 @@ class Inode:
 
     def get_type(self):
         self._simfile.seek(int(self._offset + 8))
-        return struct.unpack("H", self._simfile.read(2))[0]
+        return struct.unpack("B", self._simfile.read(1))[0]
 
     def set_type(self, val):
         self._simfile.seek(int(self._offset + 8))
-        self._simfile.write(struct.pack("H", val))
+        self._simfile.write(struct.pack("B", val))
+
+    def get_flags(self):
+        self._simfile.seek(int(self._offset + 9))
+        return struct.unpack("B", self._simfile.read(1))[0]
+
+    def set_flags(self, val):
+        self._simfile.seek(int(self._offset + 9))
+        self._simfile.write(struct.pack("B", val))
+
+    def is_extent_mapped(self):
+        return self.get_type() in set([ S5_TYPE_DATA, S5_TYPE_DIR ]) and self.get_flags() & S5_FLAG_EXTENTS
+
+    def is_inline(self):
+        return self.get_type() == S5_TYPE_DATA and self.get_flags() & S5_FLAG_INLINE
+
+    def get_max_file_size(self):
+        return S5_EXTENT_MAX_FILE_SIZE if self.is_extent_mapped() or self.is_inline() else S5_MAX_FILE_SIZE
+
+    # Returns the (depth, [(file block, disk block, length)]) of the extent
+    # node stored at a given offset of the disk
+    def _read_extent_node(self, offset):
+        self._simfile.seek(int(offset))
+        nentries, depth = struct.unpack("HH", self._simfile.read(S5_EXTENT_HEADER_SIZE))
+        entries = []
+        for i in xrange(nentries):
+            entries.append(struct.unpack("III", self._simfile.read(S5_EXTENT_SIZE)))
+        return depth, entries
+
+    def get_extents(self):
+        return self._read_extent_node(self._offset + 12)
+
+    # Returns every extent of an extent-mapped inode, followed by its leaf
+    # blocks
+    def _get_leaf_extents(self):
+        depth, entries = self.get_extents()
+        if (depth == 0):
+            return entries, []
+        extents = []
+        leaves = []
+        for key, leaf, length in entries:
+            extents += self._read_extent_node(leaf * S5_BLOCK_SIZE)[1]
+            leaves.append(leaf)
+        return extents, leaves
 
     def get_link_count(self):
         self._simfile.seek(int(self._offset + 10))
@@ -180,13 +241,27 @@ class Inode:
             res += "links: {0}\n".format(self.get_link_count())
         if (self.get_type() in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             res += "size:  {0} bytes".format(self.get_size())
-            if (self.get_size() > S5_MAX_FILE_SIZE):
-                res += " (INVALID, max file size is {0})".format(S5_MAX_FILE_SIZE)
+            if (self.get_size() > self.get_max_file_size()):
+                res += " (INVALID, max file size is {0})".format(self.get_max_file_size())
             elif (self.get_type() == S5_TYPE_DIR and self.get_size() % S5_DIRENT_SIZE != 0):
                 res += " (INVALID, directory size must be multiple of dirent size ({0}))".format(S5_DIRENT_SIZE)
             elif (self.get_type() == S5_TYPE_DIR):
                 res += " ({0} dirents)".format(self.get_size() / S5_DIRENT_SIZE)
             res += "\n"
+            if (self.is_inline()):
+                res += "inline data\n"
+                return res[:-1]
+            if (self.is_extent_mapped()):
+                depth, entries = self.get_extents()
+                if (self.get_flags() & S5_FLAG_DIR_INDEX):
+                    res += "hashed directory index\n"
+                res += "extents (depth {0}):\n".format(depth)
+                for fblock, dblock, length in entries:
+                    if (depth == 0):
+                        res += " [{0}, {1}) at {2}\n".format(fblock, fblock + length, dblock)
+                    else:
+                        res += " from {0}: leaf {1}\n".format(fblock, dblock)
+                return res[:-1]
             res += "direct blocks ({0}):\n".format(S5_NDIRECT_BLOCKS)
             for i in xrange(S5_NDIRECT_BLOCKS):
                 res += " {0:5}".format(self.get_direct_blockno(i))
@@ -196,7 +271,7 @@ class Inode:
                 res += "\n"
             res += "indirect block: {0}\n".format(self.get_indirect_blockno())
         elif (self.get_type() == S5_TYPE_FREE):
-            res += "next free: {0}\n".format(self.get_next_free())
+            res += "in use:    {0}\n".format("yes (INVALID)" if self._simdisk.get_inode_used(self._number) else "no")
         res = res[:-1]
         return res
 
@@ -205,21 +280,16 @@ class Inode:
             size = self.get_size()
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot read from inode of type " + self.get_type_str())
-        size = min(size, min(S5_MAX_FILE_SIZE, self.get_size()) - offset)
+        size = min(size, min(self.get_max_file_size(), self.get_size()) - offset)
+        if (self.is_inline()):
+            size = max(0, min(size, S5_INLINE_SIZE - offset))
+            self._simfile.seek(int(self._offset + 12 + offset))
+            return self._simfile.read(size)
         res = ""
         while (size > 0):
-            blockno = math.floor(offset / S5_BLOCK_SIZE)
+            blockno = self._get_blockno(math.floor(offset / S5_BLOCK_SIZE))
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, size)
-            if (blockno < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockno)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno -= S5_NDIRECT_BLOCKS
-                    blockno = struct.unpack("I", indirect.read(blockno * 4, 4))[0]
             if (blockno == 0):
                 for i in xrange(ammount):
                     res += '\0'
@@ -232,6 +302,16 @@ class Inode:
     def write(self, offset, data):
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot write to inode of type " + self.get_type_str())
+        if (self.is_extent_mapped()):
+            raise S5fsException("cannot write to extent-mapped inodes")
+        if (self.is_inline()):
+            if (offset + len(data) > S5_INLINE_SIZE):
+                raise S5fsException("cannot write up to byte {0} of an inline inode, max is {1}".format(offset + len(data), S5_INLINE_SIZE))
+            self._simfile.seek(int(self._offset + 12 + offset))
+            self._simfile.write(data)
+            if (offset + len(data) > self.get_size()):
+                self.set_size(offset + len(data))
+            return
         if (offset + len(data) > S5_MAX_FILE_SIZE):
             raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), S5_MAX_FILE_SIZE))
         remaining = len(data)
@@ -239,19 +319,21 @@ class Inode:
             blockloc = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, remaining)
+            goal = self._get_blockno(blockloc - 1) + 1 if blockloc > 0 else None
             if (blockloc < S5_NDIRECT_BLOCKS):
                 blockno = self.get_direct_blockno(blockloc)
             else:
                 if (self.get_indirect_blockno() == 0):
-                    indirect = self._simdisk.alloc_block()
+                    indirect = self._simdisk.alloc_block(goal)
                     indirect.zero()
+                    goal = indirect.get_blockno() + 1
                     self.set_indirect_blockno(indirect.get_blockno())
                     blockno = 0
                 else:
                     indirect = self._simdisk.get_block(self.get_indirect_blockno())
                     blockno = struct.unpack("I", indirect.read((blockloc - S5_NDIRECT_BLOCKS) * 4, 4))[0]
             if (blockno == 0):
-                block = self._simdisk.alloc_block()
+                block = self._simdisk.alloc_block(goal)
                 block.zero()
                 if (blockloc < S5_NDIRECT_BLOCKS):
                     self.set_direct_blockno(blockloc, block.get_blockno())
@@ -269,7 +351,40 @@ class Inode:
         if (offset > self.get_size()):
             self.set_size(offset)
 
+    def _get_blockno(self, blockloc):
+        if (self.is_extent_mapped()):
+            for fblock, dblock, length in self._get_leaf_extents()[0]:
+                if (fblock <= blockloc < fblock + length):
+                    return dblock + blockloc - fblock
+            return 0
+        if (blockloc < S5_NDIRECT_BLOCKS):
+            return self.get_direct_blockno(blockloc)
+        if (self.get_indirect_blockno() == 0):
+            return 0
+        indirect = self._simdisk.get_block(self.get_indirect_blockno())
+        return struct.unpack("I", indirect.read((blockloc - S5_NDIRECT_BLOCKS) * 4, 4))[0]
+
     def truncate(self, size=0):
+        if (self.is_inline()):
+            if (size > S5_INLINE_SIZE):
+                raise S5fsException("cannot grow an inline inode past {0} bytes".format(S5_INLINE_SIZE))
+            self._simfile.seek(int(self._offset + 12 + size))
+            self._simfile.write('\0' * (S5_INLINE_SIZE - size))
+            self.set_size(size)
+            return
+        if (self.is_extent_mapped()):
+            if (size != 0):
+                raise S5fsException("can only truncate extent-mapped inodes to 0 bytes")
+            extents, leaves = self._get_leaf_extents()
+            for fblock, dblock, length in extents:
+                for i in xrange(length):
+                    self._simdisk.get_block(dblock + i).free()
+            for leaf in leaves:
+                self._simdisk.get_block(leaf).free()
+            self._simfile.seek(int(self._offset + 12))
+            self._simfile.write('\0' * (4 * (S5_NDIRECT_BLOCKS + 1)))
+            self.set_size(0)
+            return
         target = math.floor((size - 1) / S5_BLOCK_SIZE)
         curr = math.floor(self.get_size() / S5_BLOCK_SIZE)
         while (curr > target):
@@ -380,6 +495,7 @@ class Inode:
         inode = self._simdisk.alloc_inode()
         try:
             inode.set_type(S5_TYPE_DATA)
+            inode.set_flags(0)
             inode.set_size(0)
             inode.set_link_count(1)
             for i in xrange(S5_NDIRECT_BLOCKS):
@@ -395,6 +511,7 @@ class Inode:
         inode = self._simdisk.alloc_inode()
         try:
             inode.set_type(S5_TYPE_DIR)
+            inode.set_flags(0)
             inode.set_size(0)
             inode.set_link_count(2)
             for i in xrange(S5_NDIRECT_BLOCKS):
@@ -465,8 +582,9 @@ class Inode:
         if (self.get_size() != 0):
             self.truncate()
         self.set_type(S5_TYPE_FREE)
-        self.set_next_free(self._simdisk.get_free_inode())
-        self._simdisk.set_free_inode(self._number)
+        self.set_flags(0)
+        self._simdisk.set_inode_used(self._number, False)
+        self._simdisk.set_nfree_inodes(self._simdisk.get_nfree_inodes() + 1)
 
 class Simdisk:
 
@@ -481,11 +599,11 @@ class Simdisk:
         self._simfile.seek(0)
         self._simfile.write(struct.pack("I", val))
 
-    def get_free_inode(self):
+    def get_nfree_inodes(self):
         self._simfile.seek(4)
         return struct.unpack("I", self._simfile.read(4))[0]
 
-    def set_free_inode(self, val):
+    def set_nfree_inodes(self, val):
         self._simfile.seek(4)
         self._simfile.write(struct.pack("I", val))
 
@@ -497,28 +615,84 @@ class Simdisk:
         self._simfile.seek(8)
         self._simfile.write(struct.pack("I", val))
 
-    def get_free_block(self, index):
-        if (index < S5_NBLKS_PER_FNODE - 1):
-            self._simfile.seek(12 + 4 * index)
-            return struct.unpack("I", self._simfile.read(4))[0]
-        else:
-            raise S5fsException("free block index {0} greater than max {1}".format(index, S5_NBLKS_PER_FNODE - 2))
+    def get_num_blocks(self):
+        self._simfile.seek(12)
+        return struct.unpack("I", self._simfile.read(4))[0]
 
-    def set_free_block(self, index, val):
-        if (index < S5_NBLKS_PER_FNODE - 1):
-            self._simfile.seek(12 + 4 * index)
-            self._simfile.write(struct.pack("I", val))
-        else:
-            raise S5fsException("free block index {0} greater than max {1}".format(index, S5_NBLKS_PER_FNODE - 2))
+    def set_num_blocks(self, val):
+        self._simfile.seek(12)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_block(self):
+        self._simfile.seek(16)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_block(self, val):
+        self._simfile.seek(16)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_nblocks(self):
+        self._simfile.seek(20)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_nblocks(self, val):
+        self._simfile.seek(20)
+        self._simfile.write(struct.pack("I", val))
 
-    def get_last_free_block(self):
-        self._simfile.seek(12 + 4 * (S5_NBLKS_PER_FNODE - 1))
+    def get_ibitmap_block(self):
+        self._simfile.seek(24)
         return struct.unpack("I", self._simfile.read(4))[0]
 
-    def set_last_free_block(self, val):
-        self._simfile.seek(12 + 4 * (S5_NBLKS_PER_FNODE - 1))
+    def set_ibitmap_block(self, val):
+        self._simfile.seek(24)
         self._simfile.write(struct.pack("I", val))
 
+    def get_ibitmap_nblocks(self):
+        return (self.get_num_inodes() - 1) // S5_BITS_PER_BITMAP_BLOCK + 1
+
+    def get_journal_nblocks(self):
+        self._simfile.seek(28)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_nblocks(self, val):
+        self._simfile.seek(28)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_journal_start(self):
+        return self.get_ibitmap_block() + self.get_ibitmap_nblocks()
+
+    def get_data_start(self):
+        return self.get_journal_start() + self.get_journal_nblocks()
+
+    def _bitmap_word_offset(self, blockno, bitmap=None):
+        if (bitmap == None):
+            bitmap = self.get_bitmap_block()
+        return S5_BLOCK_SIZE * bitmap + 4 * (blockno // 32)
+
+    def get_block_used(self, blockno):
+        self._simfile.seek(self._bitmap_word_offset(blockno))
+        word = struct.unpack("I", self._simfile.read(4))[0]
+        return bool(word & (1 << (blockno % 32)))
+
+    def get_inode_used(self, ino):
+        self._simfile.seek(self._bitmap_word_offset(ino, self.get_ibitmap_block()))
+        word = struct.unpack("I", self._simfile.read(4))[0]
+        return bool(word & (1 << (ino % 32)))
+
+    def set_inode_used(self, ino, used):
+        self.set_block_used(ino, used, self.get_ibitmap_block())
+
+    def set_block_used(self, blockno, used, bitmap=None):
+        offset = self._bitmap_word_offset(blockno, bitmap)
+        self._simfile.seek(offset)
+        word = struct.unpack("I", self._simfile.read(4))[0]
+        if (used):
+            word |= 1 << (blockno % 32)
+        else:
+            word &= ~(1 << (blockno % 32)) & 0xffffffff
+        self._simfile.seek(offset)
+        self._simfile.write(struct.pack("I", word))
+
     def get_root_inode(self):
         self._simfile.seek(12 + 4 * S5_NBLKS_PER_FNODE)
         return struct.unpack("I", self._simfile.read(4))[0]
@@ -542,29 +716,37 @@ class Simdisk:
     def get_super_block_summary(self):
         res = ""
         res += "magic:      0x{0:04x} ({1})\n".format(self.get_magic(), "VALID" if self.get_magic() == S5_MAGIC else "INVALID")
-        res += "version:    0x{0:04x}{1}\n".format(self.get_version(), "" if self.get_version() == S5_CURRENT_VERSION else " (INVALID)")
+        res += "version:    0x{0:04x}{1}\n".format(self.get_version(), "" if S5_MIN_VERSION <= self.get_version() <= S5_CURRENT_VERSION else " (INVALID)")
         res += "num inodes: {0}\n".format(self.get_num_inodes())
-        res += "free inode: {0}{1}\n".format(self.get_free_inode(), "" if self.get_free_inode() < self.get_num_inodes() else " (INVALID)")
+        res += "free inodes: {0}{1}\n".format(self.get_nfree_inodes(), "" if self.get_nfree_inodes() < self.get_num_inodes() else " (INVALID)")
         res += "root inode: {0}{1}\n".format(self.get_root_inode(), "" if self.get_root_inode() < self.get_num_inodes() else " (INVALID)")
-        res += "free blocks ({0}{1}):\n".format(self.get_nfree(), "" if self.get_nfree() <= S5_NBLKS_PER_FNODE else (", too large shouldn't exceed " + str(S5_NBLKS_PER_FNODE)))
-        for i in xrange(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
-            res += "  {0}".format(self.get_free_block(i))
-            if ((i + 1) % 10 == 0):
-                res += "\n"
-        if (res[-1] != "\n"):
-            res += "\n"
-        res += "  last free block: {0}\n".format(self.get_last_free_block())
+        res += "blocks:     {0}\n".format(self.get_num_blocks())
+        res += "bitmap:     blocks {0}-{1}\n".format(self.get_bitmap_block(), self.get_bitmap_block() + self.get_bitmap_nblocks() - 1)
+        res += "ibitmap:    blocks {0}-{1}\n".format(self.get_ibitmap_block(), self.get_journal_start() - 1)
+        if (self.get_journal_nblocks()):
+            res += "journal:    blocks {0}-{1}\n".format(self.get_journal_start(), self.get_data_start() - 1)
+        else:
+            res += "journal:    none\n"
+        res += "free blocks: {0}\n".format(self.get_nfree())
         return res
 
-    def format(self, inodes, size):
+    # The journal is left out (journal=0) if the disk is too small to give it
+    # no more than an eighth of its blocks.
+    def format(self, inodes, size, journal=S5_JOURNAL_NBLOCKS):
         if (inodes < 1):
             raise S5fsException("cannot format disk with {0} inodes, must have at least one".format(inodes))
         if (size % S5_BLOCK_SIZE != 0):
             raise S5fsException("cannot format disk to size {0} which is not a multiple of the block size {1}".format(size, S5_BLOCK_SIZE))
         blocks = int(size / S5_BLOCK_SIZE)
         iblocks = int(math.floor((inodes - 1) / S5_INODES_PER_BLOCK) + 1)
-        if (iblocks + 1 >= blocks):
-            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks) * S5_BLOCK_SIZE))
+        bblocks = int((blocks - 1) / S5_BITS_PER_BITMAP_BLOCK + 1)
+        ibblocks = int((inodes - 1) / S5_BITS_PER_BITMAP_BLOCK + 1)
+        if (iblocks + bblocks + ibblocks + 1 >= blocks):
+            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes and bitmaps require at least {2} bytes of space".format(size, inodes, (1 + iblocks + bblocks + ibblocks) * S5_BLOCK_SIZE))
+        if (journal != 0 and journal < 4):
+            raise S5fsException("cannot make a journal of {0} blocks, it must have at least 4".format(journal))
+        if (journal * 8 > blocks - (iblocks + bblocks + ibblocks + 1)):
+            journal = 0
         self._simfile.truncate()
         self._simfile.seek(size)
         self._simfile.write("")
@@ -576,24 +758,21 @@ class Simdisk:
             inode = self.get_inode(i)
             inode.set_number(i)
             inode.set_type(S5_TYPE_FREE)
-            inode.set_next_free(i + 1)
-        inode.set_next_free(0xffffffff)
-        self.set_free_inode(0)
-
-        self.set_last_free_block(0xffffffff)
-        i = 0
-        for num in xrange(iblocks+1, blocks):
-            if (i == S5_NBLKS_PER_FNODE - 1):
-                block = self.get_block(num)
-                for j in xrange(S5_NBLKS_PER_FNODE - 1):
-                    block.write(j * 4, struct.pack("I", self.get_free_block(j)))
-                block.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self.get_last_free_block()))
-                self.set_last_free_block(num)
-                i = 0
-            else:
-                self.set_free_block(i, num)
-                i += 1
-        self.set_nfree(i)
+            inode.set_next_free(0)
+        self.set_nfree_inodes(inodes)
+
+        # the superblock, inode blocks, bitmaps, and everything past the end
+        # of the disk are marked in use, as are the bits past the last inode
+        self.set_num_blocks(blocks)
+        self.set_bitmap_block(iblocks + 1)
+        self.set_bitmap_nblocks(bblocks)
+        self.set_ibitmap_block(iblocks + bblocks + 1)
+        self.set_journal_nblocks(journal)
+        used = iblocks + bblocks + ibblocks + 1 + journal
+        self._write_bitmap(iblocks + 1, bblocks, used, blocks)
+        self._write_bitmap(iblocks + bblocks + 1, ibblocks, 0, inodes)
+        self.set_nfree(blocks - used)
+        self._alloc_rotor = used
 
         root = self.alloc_inode()
         for i in xrange(S5_NDIRECT_BLOCKS):
@@ -605,15 +784,24 @@ class Simdisk:
         root._make_dirent(root.get_number(), ".")
         root._make_dirent(root.get_number(), "..")
 
+    # Writes nblocks of bitmap starting at block first, with the bits below
+    # used and at or after end set.
+    def _write_bitmap(self, first, nblocks, used, end):
+        for b in xrange(nblocks):
+            bits = ""
+            for word in xrange(S5_BLOCK_SIZE / 4):
+                start = b * S5_BITS_PER_BITMAP_BLOCK + word * 32
+                val = 0
+                for bit in xrange(32):
+                    if (start + bit < used or start + bit >= end):
+                        val |= 1 << bit
+                bits += struct.pack("I", val)
+            self.get_block(first + b).write(0, bits)
+
     def free_inodes(self):
-        inext = self.get_free_inode()
-        while (inext != 0xffffffff):
-            try:
-                curr = self.get_inode(inext)
-                yield inext
-                inext = curr.get_free_inode()
-            except S5fsException as e:
-                raise S5fsException("error encountered while iterating free inodes: {0}".format(str(e)))
+        for i in xrange(self.get_num_inodes()):
+            if (not self.get_inode_used(i)):
+                yield i
 
     def get_inode(self, index):
         offset = S5_BLOCK_SIZE * (1 + math.floor(index / S5_INODES_PER_BLOCK)) + S5_INODE_SIZE * (index % S5_INODES_PER_BLOCK)
@@ -621,33 +809,281 @@ class Simdisk:
             raise S5fsException("cannot get inode {0}, there are only {1} inodes on disk".format(index, self.get_num_inodes()))
         return Inode(self, index, offset)
 
+    # Allocates the lowest free inode.
     def alloc_inode(self):
-        if (self.get_free_inode() == 0xffffffff):
+        if (self.get_nfree_inodes() == 0):
             raise S5fsException("disk is out of inodes")
-        inode = self.get_inode(self.get_free_inode())
-        self.set_free_inode(inode.get_next_free())
-        return inode
+        for i in self.free_inodes():
+            self.set_inode_used(i, True)
+            self.set_nfree_inodes(self.get_nfree_inodes() - 1)
+            return self.get_inode(i)
+        raise S5fsException("nfree_inodes is {0} but the inode bitmap has no free inodes".format(self.get_nfree_inodes()))
 
     def get_block(self, index):
         offset = S5_BLOCK_SIZE * index
         return Block(self, offset, index)
 
-    def alloc_block(self):
-        if (self.get_nfree() > S5_NBLKS_PER_FNODE - 1):
-            raise S5fsException("nfree {0} is invalid, maximum value is {1}".format(self.get_nfree(), S5_NBLKS_PER_FNODE - 1))
+    def _find_free_block(self, first, last):
+        blockno = first
+        while (blockno < last):
+            self._simfile.seek(self._bitmap_word_offset(blockno))
+            word = struct.unpack("I", self._simfile.read(4))[0]
+            if (word == 0xffffffff):
+                blockno = (blockno // 32 + 1) * 32
+                continue
+            if (not word & (1 << (blockno % 32))):
+                return blockno
+            blockno += 1
+        return None
+
+    # Allocates the first free block at or after goal, wrapping around, so
+    # that files are laid out contiguously; with no goal, continues from the
+    # last block allocated that way.
+    def alloc_block(self, goal=None):
         if (self.get_nfree() == 0):
-            if (self.get_last_free_block() == 0xffffffff):
-                raise S5fsDiskSpaceException()
-            else:
-                block = self.get_block(self.get_last_free_block())
-                for i in xrange(S5_NBLKS_PER_FNODE - 1):
-                    self.set_free_block(i, struct.unpack("I", block.read(i * 4, 4))[0])
-                self.set_last_free_block(struct.unpack("I", block.read((S5_NBLKS_PER_FNODE - 1) * 4, 4))[0])
-                self.set_nfree(S5_NBLKS_PER_FNODE - 1)
-            return block
-        else:
-            self.set_nfree(self.get_nfree() - 1)
-            return self.get_block(self.get_free_block(self.get_nfree()))
+            raise S5fsDiskSpaceException()
+        rotor = goal == None or goal >= self.get_num_blocks()
+        if (rotor):
+            goal = getattr(self, "_alloc_rotor", self.get_data_start())
+        blockno = self._find_free_block(goal, self.get_num_blocks())
+        if (blockno == None):
+            blockno = self._find_free_block(0, goal)
+        if (blockno == None):
+            raise S5fsException("nfree is {0} but the bitmap has no free blocks".format(self.get_nfree()))
+        self.set_block_used(blockno, True)
+        self.set_nfree(self.get_nfree() - 1)
+        if (rotor):
+            self._alloc_rotor = blockno + 1
+        return self.get_block(blockno)
 
     def open(self, path, create=False):
         return self.get_inode(self.get_root_inode()).open(path, create=create)
+
+    # Lays out the tree under a host directory as the contents of the root
+    # directory of a freshly formatted disk; see BulkImporter.
+    def bulk_import(self, directory, jobs=1, extents=False):
+        BulkImporter(self, extents).run(directory, jobs)
+
+# Bytes of a host file copied at once by the bulk importer
+BULK_COPY_CHUNK = 1 << 20
+
+_bulk_image = None
+
+def _bulk_copy_init(path):
+    global _bulk_image
+    f = open(path, "r+b")
+    _bulk_image = mmap.mmap(f.fileno(), 0)
+
+# Copies (source path, source offset, disk offset, length) into the image
+# mapped by _bulk_copy_init(), a chunk at a time.
+def _bulk_copy(task):
+    _bulk_copy_into(_bulk_image, task)
+
+def _bulk_copy_into(image, task):
+    path, srcoff, diskoff, length = task
+    with open(path, "rb") as source:
+        source.seek(srcoff)
+        while (length > 0):
+            data = source.read(min(length, BULK_COPY_CHUNK))
+            if (len(data) == 0):
+                raise S5fsException("{0} shrank while it was being imported".format(path))
+            image[diskoff:diskoff + len(data)] = data
+            diskoff += len(data)
+            length -= len(data)
+
+class BulkImporter:
+    """
+    Builds a whole tree at once on a disk that has just been formatted,
+    instead of creating files one by one through Inode and Block. The tree is
+    walked once, giving every file and directory the next inode and a
+    contiguous run of blocks, laid out in the order the tree is walked: a
+    directory's entries, then the data of its files. Block-mapped files
+    longer than S5_NDIRECT_BLOCKS keep their indirect block inline, right
+    after the direct blocks, as the kernel places it; with extents, every
+    file and directory is a single extent. Files of up to S5_INLINE_SIZE
+    bytes take no blocks, their contents going into their inodes.
+
+    Inodes, directory entries, indirect blocks and the bitmaps are then
+    written straight into a memory mapping of the image, and the file data
+    is streamed into it by jobs worker processes, each with its own mapping.
+    """
+
+    class Node:
+
+        def __init__(self, path, number, isdir, size=0):
+            self.path = path
+            self.number = number
+            self.isdir = isdir
+            self.size = size
+            self.entries = []
+            self.links = 2 if isdir else 1
+            self.start = 0
+            self.nblocks = 0
+            self.inline = not isdir and size <= S5_INLINE_SIZE
+
+    def __init__(self, simdisk, extents=False):
+        self._simdisk = simdisk
+        self._extents = extents
+
+    def _blocks_needed(self, size):
+        nblocks = (size + S5_BLOCK_SIZE - 1) // S5_BLOCK_SIZE
+        if (self._extents):
+            if (nblocks > S5_EXTENT_MAX_FILE_BLOCKS):
+                raise S5fsException("cannot import {0} bytes, max file size is {1}".format(size, S5_EXTENT_MAX_FILE_SIZE))
+            return nblocks
+        if (nblocks > S5_MAX_FILE_BLOCKS):
+            raise S5fsException("cannot import {0} bytes, max file size is {1} (try extents)".format(size, S5_MAX_FILE_SIZE))
+        return nblocks + (1 if nblocks > S5_NDIRECT_BLOCKS else 0)
+
+    # Walks the host tree breadth first, numbering inodes and placing block
+    # runs as it goes; returns every node, the root first.
+    def _plan(self, directory, root_number, first_inode, first_block):
+        root = BulkImporter.Node(directory, root_number, True)
+        nodes = [ root ]
+        next_inode = first_inode
+        next_block = first_block
+        i = 0
+        while (i < len(nodes)):
+            node = nodes[i]
+            i += 1
+            if (node.isdir):
+                parent = node.entries[0][1] if node.entries else node
+                node.entries = [ (".", node), ("..", parent) ]
+                for name in sorted(os.listdir(node.path)):
+                    if (len(name) >= S5_NAME_LEN):
+                        raise S5fsException("directroy entry name '{0}' too long, limit is {1} characters".format(name, S5_NAME_LEN - 1))
+                    path = os.path.join(node.path, name)
+                    st = os.stat(path)
+                    isdir = stat.S_ISDIR(st.st_mode)
+                    child = BulkImporter.Node(path, next_inode, isdir, 0 if isdir else st.st_size)
+                    next_inode += 1
+                    if (isdir):
+                        child.entries = [ (None, node) ]
+                        node.links += 1
+                    node.entries.append((name, child))
+                    nodes.append(child)
+                node.size = len(node.entries) * S5_DIRENT_SIZE
+            node.start = next_block
+            node.nblocks = 0 if node.inline else self._blocks_needed(node.size)
+            next_block += node.nblocks
+        return nodes, next_inode, next_block
+
+    # Where file block fblock of node is on disk
+    def _disk_block(self, node, fblock):
+        if (self._extents or fblock < S5_NDIRECT_BLOCKS):
+            return node.start + fblock
+        return node.start + fblock + 1
+
+    # The (disk offset, file offset, length) pieces of a node's data, which
+    # are contiguous on disk apart from an inline indirect block
+    def _pieces(self, node):
+        if (node.inline):
+            return []
+        split = node.size if self._extents else min(node.size, S5_NDIRECT_BLOCKS * S5_BLOCK_SIZE)
+        pieces = []
+        if (split > 0):
+            pieces.append((node.start * S5_BLOCK_SIZE, 0, split))
+        if (node.size > split):
+            pieces.append((self._disk_block(node, S5_NDIRECT_BLOCKS) * S5_BLOCK_SIZE, split, node.size - split))
+        return pieces
+
+    def _write_inode(self, image, node):
+        inode = self._simdisk.get_inode(node.number)
+        offset = int(inode._offset)
+        flags = S5_FLAG_INLINE if node.inline else S5_FLAG_EXTENTS if self._extents else 0
+        stype = S5_TYPE_DIR if node.isdir else S5_TYPE_DATA
+        struct.pack_into("IIBBh", image, offset, node.size, node.number, stype, flags, node.links)
+        blockmap = offset + 12
+        image[blockmap:blockmap + 4 * (S5_NDIRECT_BLOCKS + 1)] = "\0" * (4 * (S5_NDIRECT_BLOCKS + 1))
+        if (node.inline):
+            with open(node.path, "rb") as f:
+                data = f.read(node.size)
+            image[blockmap:blockmap + len(data)] = data
+            return
+        nfile = (node.size + S5_BLOCK_SIZE - 1) // S5_BLOCK_SIZE
+        if (self._extents):
+            if (nfile > 0):
+                struct.pack_into("HHIII", image, blockmap, 1, 0, 0, node.start, nfile)
+            return
+        ndirect = min(nfile, S5_NDIRECT_BLOCKS)
+        struct.pack_into("{0}I".format(ndirect), image, blockmap, *xrange(node.start, node.start + ndirect))
+        if (nfile > S5_NDIRECT_BLOCKS):
+            indirect = node.start + S5_NDIRECT_BLOCKS
+            struct.pack_into("I", image, blockmap + 4 * S5_NDIRECT_BLOCKS, indirect)
+            struct.pack_into("{0}I".format(nfile - S5_NDIRECT_BLOCKS), image, indirect * S5_BLOCK_SIZE,
+                             *xrange(indirect + 1, indirect + 1 + nfile - S5_NDIRECT_BLOCKS))
+
+    def _write_dir(self, image, node):
+        data = "".join(struct.pack("I", child.number) + name.ljust(S5_NAME_LEN, "\0") for name, child in node.entries)
+        for diskoff, fileoff, length in self._pieces(node):
+            image[diskoff:diskoff + length] = data[fileoff:fileoff + length]
+
+    # Marks bits [first, end) of the bitmap at block bitmap as in use
+    def _set_bits(self, image, bitmap, first, end):
+        base = bitmap * S5_BLOCK_SIZE
+        while (first < end and (first % 8 != 0 or end - first < 8)):
+            image[base + first // 8] = chr(ord(image[base + first // 8]) | (1 << (first % 8)))
+            first += 1
+        full = (end - first) // 8
+        image[base + first // 8:base + first // 8 + full] = "\xff" * full
+        first += full * 8
+        while (first < end):
+            image[base + first // 8] = chr(ord(image[base + first // 8]) | (1 << (first % 8)))
+            first += 1
+
+    def run(self, directory, jobs=1):
+        disk = self._simdisk
+        root = disk.get_inode(disk.get_root_inode())
+        if (disk.get_nfree_inodes() != disk.get_num_inodes() - 1 or not root.is_empty()):
+            raise S5fsException("can only bulk import into a freshly formatted disk")
+        # the root's entries are rewritten along with everything else
+        root.truncate()
+        first_block = disk._find_free_block(disk.get_data_start(), disk.get_num_blocks())
+        if (first_block == None or disk.get_nfree() != disk.get_num_blocks() - first_block):
+            raise S5fsException("can only bulk import into a freshly formatted disk")
+        first_inode = root.get_number() + 1
+
+        nodes, end_inode, end_block = self._plan(directory, root.get_number(), first_inode, first_block)
+        if (end_inode > disk.get_num_inodes()):
+            raise S5fsException("disk is out of inodes, {0} are needed".format(end_inode))
+        if (end_block > disk.get_num_blocks()):
+            raise S5fsDiskSpaceException()
+
+        simfile = disk._simfile
+        simfile.seek(0, os.SEEK_END)
+        if (simfile.tell() < disk.get_num_blocks() * S5_BLOCK_SIZE):
+            simfile.truncate(disk.get_num_blocks() * S5_BLOCK_SIZE)
+        simfile.flush()
+        image = mmap.mmap(simfile.fileno(), 0)
+        try:
+            tasks = []
+            for node in nodes:
+                self._write_inode(image, node)
+                if (node.isdir):
+                    self._write_dir(image, node)
+                else:
+                    tasks += [ (node.path, fileoff, diskoff, length) for diskoff, fileoff, length in self._pieces(node) ]
+            self._set_bits(image, disk.get_bitmap_block(), first_block, end_block)
+            self._set_bits(image, disk.get_ibitmap_block(), first_inode, end_inode)
+            struct.pack_into("II", image, 4, disk.get_num_inodes() - end_inode, disk.get_num_blocks() - end_block)
+
+            # worker processes need a file of their own to map
+            name = getattr(simfile, "name", None)
+            if (jobs > 1 and len(tasks) > 1 and isinstance(name, str) and os.path.exists(name)):
+                image.flush()
+                pool = multiprocessing.Pool(jobs, _bulk_copy_init, (name,))
+                try:
+                    for _ in pool.imap_unordered(_bulk_copy, tasks):
+                        pass
+                    pool.close()
+                except:
+                    pool.terminate()
+                    raise
+                finally:
+                    pool.join()
+            else:
+                for task in tasks:
+                    _bulk_copy_into(image, task)
+            image.flush()
+        finally:
+            image.close()
@@ -7,10 +7,10 @@ import math
 import stat
 import errno
 import shlex
-import Queue
 import struct
 import string
 import optparse
+import multiprocessing
 import tempfile
 
 import curses.ascii
@@ -70,6 +70,12 @@ class FsmakerShell(cmd.Cmd):
                                       help="number of inodes to put on the disk, this must be specified and be compatible with the size of the disk (there must be enough space for the inodes)")
         self._parse_format.add_option("-d", "--directory", action="store", type="str", default=None,
                                       help="initializes the disk with the contents of the specified directory")
+        self._parse_format.add_option("-j", "--jobs", action="store", type="int", default=multiprocessing.cpu_count(),
+                                      help="number of processes copying file data for -d (defaults to %default)")
+        self._parse_format.add_option("-l", "--journal", action="store", type="int", default=api.S5_JOURNAL_NBLOCKS,
+                                      help="blocks to reserve for the metadata journal, 0 for none (defaults to %default; left out on disks too small for it)")
+        self._parse_format.add_option("-x", "--extents", action="store_true", default=False,
+                                      help="map the files and directories added by -d with extents rather than direct and indirect blocks")
 
     def open(self, path, create=False):
         if (path.startswith("/")):
@@ -648,25 +654,15 @@ class FsmakerShell(cmd.Cmd):
                 size = options.size
             else:
                 size = options.blocks * api.S5_BLOCK_SIZE
-            self._simdisk.format(options.inodes, size)
+            self._simdisk.format(options.inodes, size, journal=options.journal)
 
         if (options.directory):
-            q = Queue.Queue()
-            q.put(".")
-            while(not q.empty()):
-                curr = q.get()
-                real = os.path.join(options.directory, curr)
-                mode = os.stat(real).st_mode
-                if (stat.S_ISDIR(mode)):
-                    for path in os.listdir(real):
-                        q.put(os.path.join(curr, path))
-                    parent, name = self.get_parentdir(os.path.join("/", curr))
-                    if ("." != name):
-                        parent.mkdir(name)
-                else:
-                    source = open(real, 'r')
-                    dest = self.open(os.path.join("/", curr), create=True)
-                    self.getfile(source, dest)
+            try:
+                self._simdisk.bulk_import(options.directory, jobs=options.jobs, extents=options.extents)
+            except api.S5fsException as e:
+                self._parse_format.error(str(e))
+            except (IOError, OSError) as e:
+                self._parse_format.error(str(e))
 
     def default(self, line):
         if (line.strip() == "EOF"):
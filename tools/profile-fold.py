@@ -0,0 +1,73 @@
+#!/usr/bin/env python
+"""
+Turns the samples the kernel's profiler prints to the serial log ("profile
+dump" in the kshell) into folded stacks, one "frame;frame;... count" line per
+distinct stack, for flamegraph.pl.
+
+    profile-fold.py [-s kernel/symbols.dbg] serial.log > profile.folded
+
+Kernel program counters are resolved against the symbols list the kernel
+build leaves in kernel/symbols.dbg; user mode samples only carry the pc they
+were taken at, and are counted as a "[user]" frame under their process.
+"""
+
+import bisect
+import optparse
+import sys
+
+
+def load_symbols(path):
+    syms = []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) != 2:
+                continue
+            try:
+                syms.append((int(fields[0], 16), fields[1]))
+            except ValueError:
+                continue
+    syms.sort()
+    return [addr for addr, _ in syms], [name for _, name in syms]
+
+
+def symbolize(addrs, names, pc):
+    i = bisect.bisect_right(addrs, pc) - 1
+    if i < 0:
+        return "0x%x" % pc
+    return names[i]
+
+
+def main():
+    parser = optparse.OptionParser(usage="%prog [-s symbols.dbg] [log]")
+    parser.add_option("-s", "--symbols", default="kernel/symbols.dbg",
+                      help="kernel symbols list (default: %default)")
+    opts, args = parser.parse_args()
+    if len(args) > 1:
+        parser.error("too many arguments")
+
+    addrs, names = load_symbols(opts.symbols)
+    log = open(args[0]) if args else sys.stdin
+    stacks = {}
+    for line in log:
+        fields = line.split()
+        if len(fields) < 4 or fields[0] != "profile:" or \
+                fields[2] not in ("u", "k"):
+            continue
+        pid = fields[1]
+        frames = ["pid %s" % pid if pid != "-1" else "idle"]
+        if fields[2] == "u":
+            frames.append("[user]")
+        else:
+            pcs = [int(pc, 16) for pc in fields[3:]]
+            # samples hold the innermost frame first
+            frames.extend(symbolize(addrs, names, pc) for pc in reversed(pcs))
+        stack = ";".join(frames)
+        stacks[stack] = stacks.get(stack, 0) + 1
+
+    for stack in sorted(stacks):
+        sys.stdout.write("%s %d\n" % (stack, stacks[stack]))
+
+
+if __name__ == "__main__":
+    main()
@@ -113,6 +113,8 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 /*
@@ -140,8 +142,27 @@
 #define STAR 01
 
 #define error errfunc()
-#define READ 0
-#define WRITE 1
+
+/*
+ * The buffer is an array of ints, one per line, from zero to dol, each saying
+ * where the line's text is: in the append buffer, where lines typed in or
+ * changed are stored, or in one of the files read in, which are mapped rather
+ * than copied (if they can be). Bit 0 marks the line for g and k, the next
+ * bits name its source (0 for the append buffer) and the rest are the offset
+ * of its text there, which runs to the next newline or the end of the source.
+ * Reading a file is then a matter of finding its newlines; changing a line
+ * adds its new text to the append buffer and points the line at it.
+ */
+#define LINEMAX (1 << 22)    /* lines in the buffer */
+#define NSRC 8               /* the append buffer and up to 7 files */
+#define SRCSHIFT 1
+#define OFFSHIFT 4
+#define SRCSIZE (1 << 27)    /* bytes in a source */
+#define APPCHUNK (64 * 1024) /* the append buffer's first size */
+
+#define LINE(s, off) (((off) << OFFSHIFT) | ((s) << SRCSHIFT))
+#define LSRC(tl) (((tl) >> SRCSHIFT) & (NSRC - 1))
+#define LOFF(tl) ((tl) >> OFFSHIFT)
 
 char peekc;
 char lastc;
@@ -155,14 +176,12 @@ int *zero;
 int *dot;
 int *dol;
 int *endcore;
-int *fendcore;
+int *linetab;
 int *addr1;
 int *addr2;
 char genbuf[LBSIZE];
 int count[2];
-char *nextip;
 char *linebp;
-int ninbuf;
 int io;
 int pflag;
 int onhup;
@@ -171,18 +190,14 @@ int vflag = 1;
 int listf;
 int col;
 char *globp;
-int tfile = -1;
-int tline;
-char tfname[] = "/tmp/exxxxx";
+char *srcbase[NSRC]; /* srcbase[0] is the append buffer */
+int srcsize[NSRC];
+int srcdev[NSRC];
+int srcino[NSRC];
+int appsize; /* allocated for the append buffer */
 char *loc1;
 char *loc2;
 char *locs;
-char ibuff[512];
-int iblock = -1;
-char obuff[512];
-int oblock = -1;
-int ichanged;
-int nleft;
 
 void errfunc();
 
@@ -220,6 +235,10 @@ void move(int cflag);
 
 char *getline(int tl);
 
+void readfile(int *a);
+
+int unmapfile(char *name);
+
 void setall();
 
 void exfile();
@@ -238,11 +257,9 @@ int execute(int gf, int *addr);
 
 int putline();
 
-char *getblock(int atl, int iof);
-
-int getchar();
+int appgrow(int n);
 
-void blkio(int b, char *buf, void *);
+int ed_getchar();
 
 int compsub();
 
@@ -256,18 +273,14 @@ int advance(char *alp, char *aep);
 
 int cclass(char *aset, int ac, int af);
 
-void puts(char *as);
+void ed_puts(char *as);
 
-void putchar(char ac);
+void ed_putchar(char ac);
 
 void reset();
 
 void setexit();
 
-extern int strlen(const char *s);
-
-int creat(const char *fname, mode_t mode) { return open(fname, O_CREAT, mode); }
-
 int signal(int a1, ...) { return 0; }
 
 int main(int argc, char **argv)
@@ -297,16 +310,18 @@ int main(int argc, char **argv)
             ;
         globp = "r";
     }
-    fendcore = sbrk(0);
+    linetab = mmap(NULL, LINEMAX * sizeof(int), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (linetab == MAP_FAILED)
+    {
+        return 1;
+    }
     init();
     /* setexit(); */
     commands();
-    unlink(tfname);
     return 0;
 }
 
-int getfile();
-
 void commands()
 {
     register int *a1, c;
@@ -326,11 +341,11 @@ void commands()
             addr1 = addr2;
             if ((a1 = address()) == 0)
             {
-                c = getchar();
+                c = ed_getchar();
                 break;
             }
             addr2 = a1;
-            if ((c = getchar()) == ';')
+            if ((c = ed_getchar()) == ';')
             {
                 c = ',';
                 dot = a1;
@@ -359,7 +374,7 @@ void commands()
 
         case 'e':
             setnoaddr();
-            if ((peekc = getchar()) != ' ')
+            if ((peekc = ed_getchar()) != ' ')
                 error;
             savedfile[0] = 0;
             init();
@@ -368,13 +383,13 @@ void commands()
 
         case 'f':
             setnoaddr();
-            if ((c = getchar()) != '\n')
+            if ((c = ed_getchar()) != '\n')
             {
                 peekc = c;
                 savedfile[0] = 0;
                 filename();
             }
-            puts(savedfile);
+            ed_puts(savedfile);
             continue;
 
         case 'g':
@@ -389,7 +404,7 @@ void commands()
             continue;
 
         case 'k':
-            if ((c = getchar()) < 'a' || c > 'z')
+            if ((c = ed_getchar()) < 'a' || c > 'z')
                 error;
             newline();
             setdot();
@@ -420,7 +435,7 @@ void commands()
             nonzero();
             a1 = addr1;
             do
-                puts(getline(*a1++));
+                ed_puts(getline(*a1++));
             while (a1 <= addr2);
             dot = addr2;
             listf = 0;
@@ -429,7 +444,6 @@ void commands()
         case 'q':
             setnoaddr();
             newline();
-            unlink(tfname);
             exit(0);
 
         case 'r':
@@ -441,8 +455,7 @@ void commands()
                 error;
             }
             setall();
-            ninbuf = 0;
-            append(getfile, addr2);
+            readfile(addr2);
             exfile();
             continue;
 
@@ -464,6 +477,8 @@ void commands()
             setall();
             nonzero();
             filename();
+            if (unmapfile(file) < 0)
+                continue;
             if ((io = open(file, O_CREAT | O_RDWR | O_TRUNC, 0666)) < 0)
                 error;
             putfile();
@@ -475,7 +490,7 @@ void commands()
             newline();
             count[1] = (addr2 - zero) & 077777;
             putd();
-            putchar('\n');
+            ed_putchar('\n');
             continue;
 
         case '!':
@@ -498,7 +513,7 @@ int *address()
     a1 = 0;
     for (;;)
     {
-        c = getchar();
+        c = ed_getchar();
         if ('0' <= c && c <= '9')
         {
             n = 0;
@@ -506,7 +521,7 @@ int *address()
             {
                 n *= 10;
                 n += c - '0';
-            } while ((c = getchar()) >= '0' && c <= '9');
+            } while ((c = ed_getchar()) >= '0' && c <= '9');
             peekc = c;
             if (a1 == 0)
             {
@@ -588,7 +603,7 @@ int *address()
             break;
 
         case '\'':
-            if ((c = getchar()) < 'a' || c > 'z')
+            if ((c = ed_getchar()) < 'a' || c > 'z')
                 error;
             for (a1 = zero; a1 <= dol; a1++)
             {
@@ -655,7 +670,7 @@ void newline()
 {
     register int c;
 
-    if ((c = getchar()) == '\n')
+    if ((c = ed_getchar()) == '\n')
     {
         return;
     }
@@ -666,7 +681,7 @@ void newline()
         {
             listf++;
         }
-        if (getchar() == '\n')
+        if (ed_getchar() == '\n')
         {
             return;
         }
@@ -680,7 +695,7 @@ void filename()
     register int c;
 
     count[1] = 0;
-    c = getchar();
+    c = ed_getchar();
     if (c == '\n' || c == EOF)
     {
         p1 = savedfile;
@@ -693,7 +708,7 @@ void filename()
     }
     if (c != ' ')
         error;
-    while ((c = getchar()) == ' ')
+    while ((c = ed_getchar()) == ' ')
         ;
     if (c == '\n')
         error;
@@ -701,7 +716,7 @@ void filename()
     do
     {
         *p1++ = c;
-    } while ((c = getchar()) != '\n');
+    } while ((c = ed_getchar()) != '\n');
     *p1++ = 0;
     if (savedfile[0] == 0)
     {
@@ -719,7 +734,7 @@ void exfile()
     if (vflag)
     {
         putd();
-        putchar('\n');
+        ed_putchar('\n');
     }
 }
 
@@ -728,7 +743,7 @@ void errfunc(void)
     register int c;
 
     listf = 0;
-    puts("?");
+    ed_puts("?");
     count[0] = 0;
     lseek(0, 0, 2);
     pflag = 0;
@@ -738,7 +753,7 @@ void errfunc(void)
     }
     globp = 0;
     peekc = lastc;
-    while ((c = getchar()) != '\n' && c != EOF)
+    while ((c = ed_getchar()) != '\n' && c != EOF)
         ;
     if (io > 0)
     {
@@ -748,7 +763,7 @@ void errfunc(void)
     /* reset(); */
 }
 
-int getchar()
+int ed_getchar()
 {
     if ((lastc = peekc))
     {
@@ -779,7 +794,7 @@ int gettty()
 
     p = linebuf;
     gf = (long)globp;
-    while ((c = getchar()) != '\n')
+    while ((c = ed_getchar()) != '\n')
     {
         if (c == EOF)
         {
@@ -805,40 +820,6 @@ int gettty()
     return (0);
 }
 
-int getfile()
-{
-    register int c;
-    register char *lp, *fp;
-
-    lp = linebuf;
-    fp = nextip;
-    do
-    {
-        if (--ninbuf < 0)
-        {
-            if ((ninbuf = read(io, genbuf, LBSIZE) - 1) < 0)
-            {
-                return (EOF);
-            }
-            fp = genbuf;
-        }
-        if (lp >= &linebuf[LBSIZE])
-            error;
-        if ((*lp++ = c = *fp++ & 0177) == 0)
-        {
-            lp--;
-            continue;
-        }
-        if (++count[1] == 0)
-        {
-            ++count[0];
-        }
-    } while (c != '\n');
-    *--lp = 0;
-    nextip = fp;
-    return (0);
-}
-
 void putfile()
 {
     int *a1;
@@ -878,11 +859,6 @@ int *a;
 {
     register int *a1, *a2, *rdot;
     int nline, tl;
-    int *corep = (int *)endcore;
-    struct core
-    {
-        int integer;
-    };
 
     nline = 0;
     dot = a;
@@ -890,11 +866,14 @@ int *a;
     {
         if (dol >= endcore)
         {
-            if (sbrk(1024) == (char *)-1)
-                error;
-            *corep += 1024;
+            ed_puts(TMPERR);
+            error;
+            break;
+        }
+        if ((tl = putline()) < 0)
+        {
+            break;
         }
-        tl = putline();
         nline++;
         a1 = ++dol;
         a2 = a1 + 1;
@@ -926,7 +905,7 @@ void dounix()
     while ((rpid = wait(&retcode)) != pid && rpid != -1)
         ;
     signal(SIGINTR, savint);
-    puts("!");
+    ed_puts("!");
 }
 
 void delete ()
@@ -953,125 +932,238 @@ void delete ()
 
 char *getline(int tl)
 {
-    register char *bp, *lp;
-    register int nl;
+    register char *bp, *ep, *lp;
 
+    bp = srcbase[LSRC(tl)] + LOFF(tl);
+    ep = srcbase[LSRC(tl)] + srcsize[LSRC(tl)];
     lp = linebuf;
-    bp = getblock(tl, READ);
-    nl = nleft;
-    tl &= ~0377;
-    while ((*lp++ = *bp++))
-        if (--nl == 0)
+    while (bp < ep && *bp != '\n')
+        if ((*lp = *bp++ & 0177))
         {
-            bp = getblock(tl += 0400, READ);
-            nl = nleft;
+            lp++;
         }
+    *lp = 0;
     return (linebuf);
 }
 
+/*
+ * Adds the line in linebuf to the append buffer, up to a newline if there is
+ * one (leaving linebp at what follows it), and returns its int, or -1 if the
+ * append buffer is full.
+ */
 int putline()
 {
-    register char *bp, *lp;
-    register int nl;
-    int tl;
+    register char *lp;
+    register int off;
 
-    lp = linebuf;
-    tl = tline;
-    bp = getblock(tl, WRITE);
-    nl = nleft;
-    tl &= ~0377;
-    while ((*bp = *lp++))
+    for (lp = linebuf; *lp && *lp != '\n'; lp++)
+        ;
+    if (*lp)
     {
-        if (*bp++ == '\n')
-        {
-            *--bp = 0;
-            linebp = lp;
-            break;
-        }
-        if (--nl == 0)
-        {
-            bp = getblock(tl += 0400, WRITE);
-            nl = nleft;
-        }
+        linebp = lp + 1;
     }
-    nl = tline;
-    tline += (((lp - linebuf) + 03) >> 1) & 077776;
-    return (nl);
+    if (appgrow(lp - linebuf + 1) < 0)
+    {
+        return (-1);
+    }
+    off = srcsize[0];
+    memcpy(srcbase[0] + off, linebuf, lp - linebuf);
+    srcbase[0][off + (lp - linebuf)] = '\n';
+    srcsize[0] += lp - linebuf + 1;
+    return (LINE(0, off));
 }
 
-char *getblock(int atl, int iof)
+/*
+ * Makes room for n more bytes in the append buffer.
+ */
+int appgrow(int n)
 {
-    register int bno, off;
+    register char *p;
+    register int size;
 
-    bno = (atl >> 8) & 0377;
-    off = (atl << 1) & 0774;
-    if (bno >= 255)
+    if (srcsize[0] + n <= appsize)
+    {
+        return (0);
+    }
+    size = appsize ? appsize : APPCHUNK;
+    while (size < srcsize[0] + n && size < SRCSIZE)
+        size *= 2;
+    if (size > SRCSIZE)
     {
-        puts(TMPERR);
+        size = SRCSIZE;
+    }
+    if (srcsize[0] + n > size || (p = realloc(srcbase[0], size)) == 0)
+    {
+        ed_puts(TMPERR);
         error;
+        return (-1);
     }
-    nleft = 512 - off;
-    if (bno == iblock)
+    srcbase[0] = p;
+    appsize = size;
+    return (0);
+}
+
+/*
+ * Reads the file open on io in after line a. A regular file is mapped, and
+ * anything else read into the append buffer; either way its lines are then
+ * found, and the lines after a moved out of their way all at once.
+ */
+void readfile(int *a)
+{
+    struct stat st;
+    register char *p, *lp, *ep;
+    int s, n, nread, nline, *a1;
+    char *base;
+
+    dot = a;
+    if (stat(file, &st) < 0)
+    {
+        error;
+        return;
+    }
+    for (s = 1; s < NSRC && srcbase[s]; s++)
+        ;
+    base = MAP_FAILED;
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size < SRCSIZE &&
+        s < NSRC)
+    {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, io, 0);
+    }
+    if (base != MAP_FAILED)
+    {
+        srcbase[s] = base;
+        srcsize[s] = st.st_size;
+        srcdev[s] = st.st_dev;
+        srcino[s] = st.st_ino;
+        n = st.st_size;
+    }
+    else
     {
-        ichanged |= iof;
-        return (ibuff + off);
+        s = 0;
+        n = 0;
+        for (;;)
+        {
+            if (appgrow(n + LBSIZE) < 0)
+            {
+                return;
+            }
+            base = srcbase[0] + srcsize[0];
+            if ((nread = read(io, base + n, LBSIZE)) <= 0)
+            {
+                break;
+            }
+            n += nread;
+        }
+        /* whatever is appended next follows it */
+        if (n && base[n - 1] != '\n')
+        {
+            base[n++] = '\n';
+        }
     }
-    if (bno == oblock)
+
+    ep = base + n;
+    nline = 0;
+    for (p = base; p < ep; p = lp + 1)
     {
-        return (obuff + off);
+        if ((lp = memchr(p, '\n', ep - p)) == 0)
+        {
+            lp = ep;
+        }
+        if (lp - p >= LBSIZE - 1)
+        {
+            break;
+        }
+        nline++;
     }
-    if (iof == READ)
+    if (p < ep || dol + nline > endcore)
     {
-        if (ichanged)
+        if (s)
         {
-            blkio(iblock, ibuff, (void *)write);
+            munmap(srcbase[s], srcsize[s]);
+            srcbase[s] = 0;
         }
-        ichanged = 0;
-        iblock = bno;
-        blkio(bno, ibuff, (void *)read);
-        return (ibuff + off);
+        error;
+        return;
     }
-    if (oblock >= 0)
+    if (s == 0)
     {
-        blkio(oblock, obuff, (void *)write);
+        srcsize[0] += n;
     }
-    oblock = bno;
-    return (obuff + off);
+
+    memmove(a + 1 + nline, a + 1, (dol - a) * sizeof(int));
+    a1 = a + 1;
+    for (p = base; p < ep; p = lp + 1)
+    {
+        if ((lp = memchr(p, '\n', ep - p)) == 0)
+        {
+            lp = ep;
+        }
+        *a1++ = LINE(s, p - srcbase[s]);
+    }
+    dol += nline;
+    dot = a + nline;
+    count[1] = n;
 }
 
-void blkio(int b, char *buf, void *iofcn)
+/*
+ * Moves the lines of the file name, if it is mapped, into the append buffer,
+ * as it is about to be truncated and written over.
+ */
+int unmapfile(char *name)
 {
-    int (*iof)(int f, char *b, int len) =
-        (int (*)(int f, char *b, int len))iofcn;
-    lseek(tfile, b, SEEK_SET);
-    if ((*iof)(tfile, buf, 512) != 512)
+    struct stat st;
+    register int *a1, s, off;
+
+    if (stat(name, &st) < 0)
     {
-        puts(TMPERR);
-        error;
+        return (0);
+    }
+    for (s = 1; s < NSRC; s++)
+    {
+        if (!srcbase[s] || srcdev[s] != st.st_dev || srcino[s] != st.st_ino)
+        {
+            continue;
+        }
+        if (appgrow(srcsize[s] + 1) < 0)
+        {
+            return (-1);
+        }
+        off = srcsize[0];
+        memcpy(srcbase[0] + off, srcbase[s], srcsize[s]);
+        srcsize[0] += srcsize[s];
+        if (srcbase[s][srcsize[s] - 1] != '\n')
+        {
+            srcbase[0][srcsize[0]++] = '\n';
+        }
+        for (a1 = zero + 1; a1 <= dol; a1++)
+            if (LSRC(*a1) == s)
+            {
+                *a1 = LINE(0, off + LOFF(*a1)) | (*a1 & 01);
+            }
+        for (a1 = names; a1 < &names[26]; a1++)
+            if (*a1 && LSRC(*a1) == s)
+            {
+                *a1 = LINE(0, off + LOFF(*a1)) | 01;
+            }
+        munmap(srcbase[s], srcsize[s]);
+        srcbase[s] = 0;
     }
+    return (0);
 }
 
 void init()
 {
-    register char *p;
-    register int pid;
-
-    close(tfile);
-    tline = 0;
-    iblock = -1;
-    oblock = -1;
-    ichanged = 0;
-    pid = getpid();
-    for (p = &tfname[11]; p > &tfname[6];)
-    {
-        *--p = (pid & 07) + '0';
-        pid >>= 3;
-    }
-    close(creat(tfname, 0600));
-    tfile = open(tfname, O_RDWR, 0);
-    brk(fendcore);
-    dot = zero = dol = fendcore;
-    endcore = fendcore - 2;
+    register int s;
+
+    for (s = 1; s < NSRC; s++)
+        if (srcbase[s])
+        {
+            munmap(srcbase[s], srcsize[s]);
+            srcbase[s] = 0;
+        }
+    srcsize[0] = 0;
+    dot = zero = dol = linetab;
+    endcore = linetab + LINEMAX - 1;
 }
 
 void global(int k)
@@ -1085,17 +1177,17 @@ void global(int k)
         error;
     setall();
     nonzero();
-    if ((c = getchar()) == '\n')
+    if ((c = ed_getchar()) == '\n')
         error;
     compile(c);
     gp = globuf;
-    while ((c = getchar()) != '\n')
+    while ((c = ed_getchar()) != '\n')
     {
         if (c == EOF)
             error;
         if (c == '\\')
         {
-            c = getchar();
+            c = ed_getchar();
             if (c != '\n')
             {
                 *gp++ = '\\';
@@ -1154,7 +1246,11 @@ void substitute(long inglob)
                 dosub();
             }
         }
-        *a1 = putline();
+        if ((nl = putline()) < 0)
+        {
+            return;
+        }
+        *a1 = nl;
         nl = append(getsub, a1);
         a1 += nl;
         addr2 += nl;
@@ -1168,16 +1264,16 @@ int compsub()
     register int seof, c;
     register char *p;
 
-    if ((seof = getchar()) == '\n')
+    if ((seof = ed_getchar()) == '\n')
         error;
     compile(seof);
     p = rhsbuf;
     for (;;)
     {
-        c = getchar();
+        c = ed_getchar();
         if (c == '\\')
         {
-            c = getchar() | 0200;
+            c = ed_getchar() | 0200;
         }
         if (c == '\n')
             error;
@@ -1190,7 +1286,7 @@ int compsub()
             error;
     }
     *p++ = 0;
-    if ((peekc = getchar()) == 'g')
+    if ((peekc = ed_getchar()) == 'g')
     {
         peekc = 0;
         newline();
@@ -1351,7 +1447,7 @@ void compile(int aeof)
     eof = aeof;
     bracketp = bracket;
     nbra = 0;
-    if ((c = getchar()) == eof)
+    if ((c = ed_getchar()) == eof)
     {
         if (*ep == 0)
             error;
@@ -1360,7 +1456,7 @@ void compile(int aeof)
     circfl = 0;
     if (c == '^')
     {
-        c = getchar();
+        c = ed_getchar();
         circfl++;
     }
     if (c == '*')
@@ -1374,7 +1470,7 @@ void compile(int aeof)
         {
             goto cerror;
         }
-        c = getchar();
+        c = ed_getchar();
         if (c == eof)
         {
             *ep++ = CEOF;
@@ -1387,7 +1483,7 @@ void compile(int aeof)
         switch (c)
         {
         case '\\':
-            if ((c = getchar()) == '(')
+            if ((c = ed_getchar()) == '(')
             {
                 if (nbra >= NBRA)
                 {
@@ -1430,7 +1526,7 @@ void compile(int aeof)
             continue;
 
         case '$':
-            if ((peekc = getchar()) != eof)
+            if ((peekc = ed_getchar()) != eof)
             {
                 goto defchar;
             }
@@ -1441,9 +1537,9 @@ void compile(int aeof)
             *ep++ = CCL;
             *ep++ = 0;
             cclcnt = 1;
-            if ((c = getchar()) == '^')
+            if ((c = ed_getchar()) == '^')
             {
-                c = getchar();
+                c = ed_getchar();
                 ep[-2] = NCCL;
             }
             do
@@ -1458,7 +1554,7 @@ void compile(int aeof)
                 {
                     goto cerror;
                 }
-            } while ((c = getchar()) != ']');
+            } while ((c = ed_getchar()) != ']');
             lastep[1] = cclcnt;
             continue;
 
@@ -1666,27 +1762,27 @@ void putd()
     r = ldivr;
     if (count[1])
             putd();
-    putchar(r + '0');
+    ed_putchar(r + '0');
 #else
     printf("%d", count[1]);
 #endif
 }
 
-void puts(char *as)
+void ed_puts(char *as)
 {
     register char *sp;
 
     sp = as;
     col = 0;
     while (*sp)
-        putchar(*sp++);
-    putchar('\n');
+        ed_putchar(*sp++);
+    ed_putchar('\n');
 }
 
 char line[80];
 char *linp = line;
 
-void putchar(char ac)
+void ed_putchar(char ac)
 {
     register char *lp;
     register int c;
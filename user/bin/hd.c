@@ -9,11 +9,11 @@
 
 int main(int argc, char **argv)
 {
-    int readfd = 0;
+    FILE *in = stdin;
     if (argc == 2)
     {
-        readfd = open(argv[1], O_RDONLY, 0666);
-        if (readfd < 0)
+        in = fopen(argv[1], "r");
+        if (!in)
         {
             fprintf(stderr, "open: %s\n", strerror(errno));
             return 1;
@@ -32,7 +32,7 @@ int main(int argc, char **argv)
     int bytes;
 
     int i;
-    while ((bytes = read(readfd, curbuf, LINE_LEN)) > 0)
+    while ((bytes = fread(curbuf, 1, LINE_LEN, in)) > 0)
     {
         if (off > 0 && !memcmp(lastbuf, curbuf, LINE_LEN))
         {
@@ -82,9 +82,9 @@ int main(int argc, char **argv)
     }
     printf("%08x\n", off);
 
-    if (readfd > 0)
+    if (in != stdin)
     {
-        close(readfd);
+        fclose(in);
     }
     return 0;
 }
@@ -10,7 +10,6 @@ static int do_ls(const char *dir)
     int fd;
     struct dirent *dirent;
     int nbytes;
-    char tmpbuf[256];
     stat_t sbuf;
 
     union {
@@ -42,8 +41,9 @@ static int do_ls(const char *dir)
             int reclen;
             int size;
 
-            snprintf(tmpbuf, sizeof(tmpbuf), "%s/%s", dir, dirent->d_name);
-            if (0 == stat(tmpbuf, &sbuf))
+            /* relative to the open directory, not looked up from the
+             * working directory again */
+            if (0 == fstatat(fd, dirent->d_name, &sbuf, 0))
             {
                 size = sbuf.st_size;
             }
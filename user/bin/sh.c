@@ -22,6 +22,10 @@
 
 #define ARGV_MAX 256
 #define REDIR_MAX 10
+#define PIPELINE_MAX 16
+
+/* What the pipes between the commands of a pipeline are asked to hold */
+#define SH_PIPE_SIZE (256 * 1024)
 
 typedef struct redirect
 {
@@ -87,6 +91,20 @@ DECL_CMD(parallel);
 
 DECL_CMD(time);
 
+DECL_CMD(test);
+
+DECL_CMD(true);
+
+DECL_CMD(false);
+
+DECL_CMD(hash);
+
+#ifdef __MOUNTING__
+DECL_CMD(mount);
+
+DECL_CMD(umount);
+#endif
+
 typedef struct
 {
     const char *cmd_name;
@@ -98,6 +116,7 @@ typedef struct
 
 static cmd_t builtin_cmds[] = {
     {"?", cmd_help, "list shell commands"},
+    {"[", cmd_test, "evaluate an expression"},
     {"cat", cmd_cat, "display file"},
     {"env", cmd_env, "display environment"},
     {"cd", cmd_cd, "change directory"},
@@ -106,14 +125,24 @@ static cmd_t builtin_cmds[] = {
     {"cp", cmd_cp, "copy file"},
     {"echo", cmd_echo, "print arguments"},
     {"exit", cmd_exit, "exit shell"},
+    {"false", cmd_false, "fail"},
+    {"hash", cmd_hash, "list or forget (-r) command locations"},
     {"help", cmd_help, "list shell commands"},
     {"ln", cmd_ln, "link file"},
     {"mkdir", cmd_mkdir, "create a directory"},
+#ifdef __MOUNTING__
+    {"mount", cmd_mount, "mount a file system"},
+#endif
     {"mv", cmd_mv, "move file"},
     {"quit", cmd_exit, "exit shell"},
     {"rm", cmd_rm, "remove file(s)"},
     {"rmdir", cmd_rmdir, "remove a directory"},
     {"sync", cmd_sync, "sync filesystems"},
+    {"test", cmd_test, "evaluate an expression"},
+    {"true", cmd_true, "succeed"},
+#ifdef __MOUNTING__
+    {"umount", cmd_umount, "unmount a file system"},
+#endif
     {"repeat", cmd_repeat, "repeat a command"},
     {"parallel", cmd_parallel, "run multiple commands in parallel"},
     {"time", cmd_time, "time a command"},
@@ -193,6 +222,141 @@ static void free_args(int argc, char *argv[])
     free(argv);
 }
 
+/*
+ * Where commands named without a '/' were found: in the current directory,
+ * which execve() of the bare name looks in, or in a directory of PATH. Each
+ * name is looked for with stat() once and from then on run straight from
+ * here, so running a command costs no failed execve()s along PATH. Where a
+ * name resolves changes with the current directory, so cd empties the cache,
+ * as does "hash -r" for programs added or removed behind the shell's back.
+ * The shell cannot change its PATH, which is read from its environment.
+ */
+#define PATH_DEFAULT "/usr/bin:/bin:/sbin"
+#define PATH_HASH_SIZE 64
+
+typedef struct path_entry
+{
+    struct path_entry *pe_next;
+    char *pe_name;
+    char *pe_path;
+    unsigned long pe_hits;
+} path_entry_t;
+
+static path_entry_t *path_hash[PATH_HASH_SIZE];
+
+static path_entry_t **path_hash_bucket(const char *name)
+{
+    /* FNV-1a */
+    unsigned long h = 14695981039346656037UL;
+    for (; *name; name++)
+    {
+        h = (h ^ (unsigned char)*name) * 1099511628211UL;
+    }
+    return &path_hash[h % PATH_HASH_SIZE];
+}
+
+static void path_hash_remove(const char *name)
+{
+    path_entry_t **pp = path_hash_bucket(name);
+    for (; *pp; pp = &(*pp)->pe_next)
+    {
+        path_entry_t *pe = *pp;
+        if (!strcmp(pe->pe_name, name))
+        {
+            *pp = pe->pe_next;
+            free(pe->pe_name);
+            free(pe->pe_path);
+            free(pe);
+            return;
+        }
+    }
+}
+
+static void path_hash_clear()
+{
+    for (int i = 0; i < PATH_HASH_SIZE; i++)
+    {
+        while (path_hash[i])
+        {
+            path_hash_remove(path_hash[i]->pe_name);
+        }
+    }
+}
+
+static int path_is_file(const char *path)
+{
+    struct stat st;
+    return !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+/* Copies where name is found into buf, or returns 0 if it is nowhere */
+static int path_search(const char *name, char *buf, size_t size)
+{
+    const char *path = PATH_DEFAULT;
+    for (char **env = my_envp; env && *env; env++)
+    {
+        if (!strncmp(*env, "PATH=", 5))
+        {
+            path = *env + 5;
+            break;
+        }
+    }
+
+    if (path_is_file(name))
+    {
+        snprintf(buf, size, "%s", name);
+        return 1;
+    }
+    while (*path)
+    {
+        const char *end = strchr(path, ':');
+        size_t len = end ? (size_t)(end - path) : strlen(path);
+        if (len && (size_t)snprintf(buf, size, "%.*s/%s", (int)len, path,
+                                    name) < size &&
+            path_is_file(buf))
+        {
+            return 1;
+        }
+        path += len + !!end;
+    }
+    return 0;
+}
+
+/* Where to run name from, or NULL if it cannot be found */
+static const char *path_lookup(const char *name)
+{
+    if (strchr(name, '/'))
+    {
+        return name;
+    }
+    path_entry_t **bucket = path_hash_bucket(name);
+    for (path_entry_t *pe = *bucket; pe; pe = pe->pe_next)
+    {
+        if (!strcmp(pe->pe_name, name))
+        {
+            pe->pe_hits++;
+            return pe->pe_path;
+        }
+    }
+
+    char buf[256];
+    if (!path_search(name, buf, sizeof(buf)))
+    {
+        return NULL;
+    }
+    path_entry_t *pe = malloc(sizeof(*pe));
+    if (!pe)
+    {
+        return name;
+    }
+    pe->pe_name = strdup(name);
+    pe->pe_path = strdup(buf);
+    pe->pe_hits = 1;
+    pe->pe_next = *bucket;
+    *bucket = pe;
+    return pe->pe_path;
+}
+
 DECL_CMD(chk_priv)
 {
     const char *test = argv[0];
@@ -1195,6 +1359,45 @@ DECL_CMD(rmdir)
     return 0;
 }
 
+#ifdef __MOUNTING__
+DECL_CMD(mount)
+{
+    if (argc != 5 || strcmp(argv[1], "-t"))
+    {
+        fprintf(stderr, "usage: mount -t <type> <device|none> <directory>\n");
+        return 1;
+    }
+
+    if (mount(argv[3], argv[4], argv[2]) < 0)
+    {
+        fprintf(stderr, "mount: couldn't mount %s on %s: %s\n", argv[3],
+                argv[4], strerror(errno));
+        return 1;
+    }
+    /* commands may be found in different places now */
+    path_hash_clear();
+    return 0;
+}
+
+DECL_CMD(umount)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: umount <directory>\n");
+        return 1;
+    }
+
+    if (umount(argv[1]) < 0)
+    {
+        fprintf(stderr, "umount: couldn't unmount %s: %s\n", argv[1],
+                strerror(errno));
+        return 1;
+    }
+    path_hash_clear();
+    return 0;
+}
+#endif
+
 DECL_CMD(exit)
 {
     exit(0);
@@ -1239,6 +1442,147 @@ DECL_CMD(cd)
         fprintf(stderr, "sh: couldn't cd to %s: %s\n", dir, strerror(errno));
         return 1;
     }
+    path_hash_clear();
+    return 0;
+}
+
+/* The file tests of test: -e exists, -f regular file, -d directory, -s
+ * non-empty */
+static int test_file(char op, const char *file)
+{
+    struct stat st;
+    if (stat(file, &st) < 0)
+    {
+        return 0;
+    }
+    switch (op)
+    {
+        case 'f':
+            return S_ISREG(st.st_mode);
+        case 'd':
+            return S_ISDIR(st.st_mode);
+        case 's':
+            return st.st_size > 0;
+        default:
+            return 1;
+    }
+}
+
+/* Evaluates "a op b", or returns -1 if op is not a binary operator */
+static int test_binary(const char *a, const char *op, const char *b)
+{
+    if (!strcmp(op, "="))
+    {
+        return !strcmp(a, b);
+    }
+    if (!strcmp(op, "!="))
+    {
+        return strcmp(a, b) != 0;
+    }
+    static const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (int i = 0; i < 6; i++)
+    {
+        if (strcmp(op, ops[i]))
+        {
+            continue;
+        }
+        long x = strtol(a, NULL, 10);
+        long y = strtol(b, NULL, 10);
+        int results[] = {x == y, x != y, x < y, x <= y, x > y, x >= y};
+        return results[i];
+    }
+    return -1;
+}
+
+/*
+ * test <expr>, or [ <expr> ]: exits 0 if expr is true, 1 if it is false, and
+ * 2 if it cannot be parsed. expr is an optional "!" followed by a string
+ * (true if non-empty), -z/-n <string>, -e/-f/-d/-s <file>, or two strings or
+ * numbers with =, !=, -eq, -ne, -lt, -le, -gt or -ge between them.
+ */
+DECL_CMD(test)
+{
+    if (!strcmp(argv[0], "["))
+    {
+        if (strcmp(argv[argc - 1], "]"))
+        {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        argc--;
+    }
+    argv++;
+    argc--;
+
+    int negate = argc && !strcmp(argv[0], "!");
+    if (negate)
+    {
+        argv++;
+        argc--;
+    }
+
+    int result;
+    if (argc == 0)
+    {
+        result = 0;
+    }
+    else if (argc == 1)
+    {
+        result = argv[0][0] != '\0';
+    }
+    else if (argc == 2 && !strcmp(argv[0], "-z"))
+    {
+        result = argv[1][0] == '\0';
+    }
+    else if (argc == 2 && !strcmp(argv[0], "-n"))
+    {
+        result = argv[1][0] != '\0';
+    }
+    else if (argc == 2 && argv[0][0] == '-' && argv[0][1] && !argv[0][2] &&
+             strchr("efds", argv[0][1]))
+    {
+        result = test_file(argv[0][1], argv[1]);
+    }
+    else if (argc == 3)
+    {
+        result = test_binary(argv[0], argv[1], argv[2]);
+    }
+    else
+    {
+        result = -1;
+    }
+    if (result < 0)
+    {
+        fprintf(stderr, "test: bad expression\n");
+        return 2;
+    }
+    return result == negate;
+}
+
+DECL_CMD(true) { return 0; }
+
+DECL_CMD(false) { return 1; }
+
+DECL_CMD(hash)
+{
+    if (argc == 2 && !strcmp(argv[1], "-r"))
+    {
+        path_hash_clear();
+        return 0;
+    }
+    if (argc != 1)
+    {
+        fprintf(stderr, "usage: hash [-r]\n");
+        return 1;
+    }
+    fprintf(stdout, "%6s %s\n", "hits", "command");
+    for (int i = 0; i < PATH_HASH_SIZE; i++)
+    {
+        for (path_entry_t *pe = path_hash[i]; pe; pe = pe->pe_next)
+        {
+            fprintf(stdout, "%6lu %s\n", pe->pe_hits, pe->pe_path);
+        }
+    }
     return 0;
 }
 
@@ -1494,6 +1838,14 @@ static int execute(int argc, char *argv[], redirect_map_t *map)
         return 0;
     }
 
+    const char *path = path_lookup(argv[0]);
+    if (!path)
+    {
+        fprintf(stderr, "sh: command not found: %s\n", argv[0]);
+        cleanup_redirects(map);
+        return 0;
+    }
+
     if (!(pid = fork()))
     {
         if (do_redirect(map) < 0)
@@ -1501,27 +1853,10 @@ static int execute(int argc, char *argv[], redirect_map_t *map)
             exit(1);
         }
 
-        execve(argv[0], argv, my_envp);
-
-        char *search_directories[] = {"/usr/bin/", "/bin/", "/sbin/"};
-        char buf[256];
+        execve(path, argv, my_envp);
 
-        for (unsigned i = 0;
-             errno == ENOENT && i < sizeof(search_directories) / sizeof(char *);
-             i++)
-        {
-            snprintf(buf, sizeof(buf), "%s/%s", search_directories[i], argv[0]);
-            execve(buf, argv, my_envp);
-        }
-        if (errno == ENOENT)
-        {
-            fprintf(stderr, "sh: command not found: %s\n", argv[0]);
-        }
-        else
-        {
-            fprintf(stderr, "sh: exec failed for %s: %s\n", argv[0],
-                    strerror(errno));
-        }
+        fprintf(stderr, "sh: exec failed for %s: %s\n", argv[0],
+                strerror(errno));
         exit(errno);
     }
     else
@@ -1538,6 +1873,11 @@ static int execute(int argc, char *argv[], redirect_map_t *map)
     {
         fprintf(stderr, "sh: child process accessed invalid memory\n");
     }
+    else if (status == ENOENT)
+    {
+        /* Perhaps the program went away; look for it again next time */
+        path_hash_remove(argv[0]);
+    }
     //    free_args(argc, argv);
 
     return ret;
@@ -1803,26 +2143,19 @@ static int parse_redirects(char *line, redirect_map_t *map)
     return 0;
 }
 
-static void parse(char *line)
+/*
+ * Splits a command into its arguments, after taking its redirections out
+ * and opening them into map. Returns the number of arguments, or -1 if the
+ * redirections could not be parsed.
+ */
+static int parse_command(char *line, char *argv[], redirect_map_t *map)
 {
-    char *argv[ARGV_MAX];
-    int argc;
-    char *tmp;
-    size_t len;
-    redirect_map_t map;
+    int argc = 0;
+    char *tmp = line;
 
-    argc = 0;
-    tmp = line;
-
-    len = strlen(line);
-    if (line[len - 1] == '\n')
-    {
-        line[len - 1] = 0;
-    }
-
-    if (parse_redirects(line, &map) < 0)
+    if (parse_redirects(line, map) < 0)
     {
-        return;
+        return -1;
     }
 
     for (;;)
@@ -1836,6 +2169,12 @@ static void parse(char *line)
             break;
         }
 
+        if (argc == ARGV_MAX - 1)
+        {
+            fprintf(stderr, "sh: too many arguments\n");
+            cleanup_redirects(map);
+            return -1;
+        }
         argv[argc++] = tmp;
 
         /* Token is everything up to trailing whitespace.
@@ -1853,9 +2192,174 @@ static void parse(char *line)
     }
 
     argv[argc] = NULL;
+    return argc;
+}
+
+/*
+ * Runs the commands of a pipeline at the same time, each with its stdout
+ * going into a pipe that the next one has as its stdin, and waits for them
+ * all. The pipes are made as large as the kernel allows, so that stages
+ * which produce data in bursts do not wait on the next one so often. Each
+ * command is parsed just before it is started, so that its redirections
+ * (which are opened as they are parsed) override the pipes; builtins run in
+ * a child of their own, like any other stage.
+ */
+static void execute_pipeline(int nstages, char *stages[])
+{
+    int pids[PIPELINE_MAX];
+    int npids = 0;
+    int in_fd = -1;
+
+    fflush(NULL);
+    for (int i = 0; i < nstages; i++)
+    {
+        char *argv[ARGV_MAX];
+        redirect_map_t map;
+        int argc = parse_command(stages[i], argv, &map);
+        if (argc <= 0)
+        {
+            if (!argc)
+            {
+                fprintf(stderr, "sh: missing command in pipeline\n");
+                cleanup_redirects(&map);
+            }
+            break;
+        }
+
+        int pipefd[2] = {-1, -1};
+        if (i < nstages - 1)
+        {
+            if (pipe(pipefd) < 0)
+            {
+                fprintf(stderr, "sh: pipe failed: %s\n", strerror(errno));
+                cleanup_redirects(&map);
+                break;
+            }
+            fcntl(pipefd[1], F_SETPIPE_SZ, SH_PIPE_SIZE);
+        }
+
+        cmd_t *cmd;
+        for (cmd = builtin_cmds; cmd->cmd_name; cmd++)
+        {
+            if (!strcmp(cmd->cmd_name, argv[0]))
+            {
+                break;
+            }
+        }
+        const char *path = cmd->cmd_name ? NULL : path_lookup(argv[0]);
 
+        int pid = fork();
+        if (!pid)
+        {
+            if (in_fd >= 0)
+            {
+                dup2(in_fd, STDIN_FILENO);
+                close(in_fd);
+            }
+            if (pipefd[1] >= 0)
+            {
+                dup2(pipefd[1], STDOUT_FILENO);
+                close(pipefd[0]);
+                close(pipefd[1]);
+            }
+            if (do_redirect(&map) < 0)
+            {
+                exit(1);
+            }
+            if (cmd->cmd_name)
+            {
+                ioenv_t io;
+                map.rm_nfds = 0;
+                build_ioenv(&map, &io);
+                exit(builtin_exec(cmd, argc, argv, &io));
+            }
+            if (!path)
+            {
+                fprintf(stderr, "sh: command not found: %s\n", argv[0]);
+                exit(ENOENT);
+            }
+            execve(path, argv, my_envp);
+            fprintf(stderr, "sh: exec failed for %s: %s\n", argv[0],
+                    strerror(errno));
+            exit(errno);
+        }
+
+        cleanup_redirects(&map);
+        if (in_fd >= 0)
+        {
+            close(in_fd);
+        }
+        if (pipefd[1] >= 0)
+        {
+            close(pipefd[1]);
+        }
+        in_fd = pipefd[0];
+        if (pid < 0)
+        {
+            fprintf(stderr, "sh: fork failed: %s\n", strerror(errno));
+            break;
+        }
+        pids[npids++] = pid;
+    }
+    if (in_fd >= 0)
+    {
+        close(in_fd);
+    }
+
+    for (int i = 0; i < npids; i++)
+    {
+        int status;
+        if (waitpid(pids[i], &status, 0) >= 0 && status == EFAULT)
+        {
+            fprintf(stderr, "sh: child process accessed invalid memory\n");
+        }
+    }
+}
+
+static void parse(char *line)
+{
+    char *argv[ARGV_MAX];
+    char *stages[PIPELINE_MAX];
+    int nstages = 0;
+    int argc;
+    size_t len;
+    redirect_map_t map;
+
+    len = strlen(line);
+    if (len && line[len - 1] == '\n')
+    {
+        line[len - 1] = 0;
+    }
+
+    /* Split the line into the commands of a pipeline, at each '|' */
+    for (char *tmp = line;;)
+    {
+        if (nstages == PIPELINE_MAX)
+        {
+            fprintf(stderr, "sh: too many commands in pipeline\n");
+            return;
+        }
+        stages[nstages++] = tmp;
+        if (!(tmp = strchr(tmp, '|')))
+        {
+            break;
+        }
+        *tmp++ = 0;
+    }
+    if (nstages > 1)
+    {
+        execute_pipeline(nstages, stages);
+        return;
+    }
+
+    argc = parse_command(line, argv, &map);
+    if (argc < 0)
+    {
+        return;
+    }
     if (!argc)
     {
+        cleanup_redirects(&map);
         return;
     }
 
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "weenix/syscall.h" /* FUTEX_WAIT, FUTEX_WAKE */
+
+/* Sleeps while *uaddr == val (FUTEX_WAIT), or wakes up to val threads
+ * sleeping on uaddr and returns how many it woke (FUTEX_WAKE) */
+int futex(int *uaddr, int op, int val);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "sys/types.h"
+#include "weenix/config.h"  /* IOSCHED_WEIGHT_MAX */
+#include "weenix/syscall.h" /* MEMGROUP_* */
+
+/*
+ * Memory groups: op is one of MEMGROUP_CREATE, MEMGROUP_DESTROY,
+ * MEMGROUP_SET_LIMIT and MEMGROUP_JOIN, with the arguments each uses (limits
+ * in bytes, 0 for none; pid 0 for the caller). Returns the new group's id for
+ * MEMGROUP_CREATE, 0 otherwise, or -1. The groups are listed in
+ * /proc/memgroups.
+ */
+int memgroup(int op, int group, pid_t pid, size_t limit);
+
+/* Sets a group's share of each disk, from 1 to IOSCHED_WEIGHT_MAX, and how
+ * long its requests may be queued, 0 for the defaults */
+int memgroup_set_io(int group, unsigned weight, unsigned latency_ms);
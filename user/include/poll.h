@@ -0,0 +1,7 @@
+#pragma once
+
+#include "weenix/syscall.h" /* struct pollfd, nfds_t, POLLIN, ... */
+
+/* Waits up to timeout milliseconds (for ever if negative) for one of the nfds
+ * fds to be ready, and returns how many are, with their revents set */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
@@ -1,21 +1,100 @@
 #pragma once
 
+#include "stddef.h"
+#include "sys/types.h"
+
+/*
+ * POSIX threads, in libc (lib/libc/pthread.c), on thr_create() and futexes.
+ *
+ * Mutexes, condition variables, read-write locks and pthread_once() are a
+ * word or a few in the caller's memory, taken and released with an atomic
+ * instruction while uncontended; only a thread that has to wait, or one that
+ * releases a lock someone is waiting for, enters the kernel. They may be
+ * initialized statically with the _INITIALIZER macros, or zeroed.
+ *
+ * Each thread's pthread_t is found through its FS base, and holds its
+ * thread-specific data (pthread_key_create()). The pthread functions that
+ * need them (pthread_self(), pthread_exit() and the thread-specific data
+ * ones) only work in the main thread and in threads made by
+ * pthread_create(), not in those made by thr_create() directly.
+ */
+
 struct pthread;
-struct pthread_cond;
-struct pthread_mutex;
 
 typedef struct pthread *pthread_t;
-typedef struct pthread_mutex *pthread_mutex_t;
-typedef struct pthread_cond *pthread_cond_t;
 
-/* Attributes NYI */
-typedef int pthread_attr_t;
+typedef struct pthread_mutex
+{
+    int m_state; /* 0 unlocked, 1 locked, 2 locked with waiters */
+} pthread_mutex_t;
+
+typedef struct pthread_cond
+{
+    int c_seq;          /* bumped by every signal and broadcast */
+    unsigned c_waiters; /* threads waiting */
+} pthread_cond_t;
+
+typedef struct pthread_rwlock
+{
+    int rw_state;        /* readers holding it, or -1 if a writer does */
+    unsigned rw_waiters; /* threads waiting for it */
+    unsigned rw_writers; /* writers waiting for it; readers let them go
+                          * first */
+} pthread_rwlock_t;
+
+typedef struct pthread_once
+{
+    int o_state; /* 0 not run, 1 running, 2 done */
+} pthread_once_t;
+
+typedef unsigned pthread_key_t;
+
+typedef struct pthread_attr
+{
+    size_t a_stacksize;
+    int a_detachstate;
+} pthread_attr_t;
+
+/* Mutex, condition variable and read-write lock attributes NYI */
 typedef int pthread_mutexattr_t;
 typedef int pthread_condattr_t;
+typedef int pthread_rwlockattr_t;
+
+#define PTHREAD_MUTEX_INITIALIZER {0}
+#define PTHREAD_COND_INITIALIZER {0, 0}
+#define PTHREAD_RWLOCK_INITIALIZER {0, 0, 0}
+#define PTHREAD_ONCE_INIT {0}
+
+#define PTHREAD_CREATE_JOINABLE 0
+#define PTHREAD_CREATE_DETACHED 1
+
+#define PTHREAD_STACK_MIN 16384
+#define PTHREAD_STACK_DEFAULT (256 * 1024)
+
+#define PTHREAD_KEYS_MAX 64
+#define PTHREAD_DESTRUCTOR_ITERATIONS 4
+
+#define PTHREAD_CANCELED ((void *)-1)
+
+/* Cleanup handlers run when a thread exits (or is cancelled) before popping
+ * them; at most PTHREAD_CLEANUP_MAX per thread */
+#define PTHREAD_CLEANUP_MAX 8
 
-void pthread_cleanup_pop(int);
+void pthread_cleanup_pop(int execute);
 
-void pthread_cleanup_push(void (*)(void *), void *routine_arg);
+void pthread_cleanup_push(void (*routine)(void *), void *routine_arg);
+
+int pthread_attr_init(pthread_attr_t *attr);
+
+int pthread_attr_destroy(pthread_attr_t *attr);
+
+int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize);
+
+int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize);
+
+int pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate);
+
+int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *detachstate);
 
 int pthread_cond_broadcast(pthread_cond_t *cond);
 
@@ -27,8 +106,8 @@ int pthread_cond_signal(pthread_cond_t *cond);
 
 int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mtx);
 
-int pthread_create(pthread_t *thr, const pthread_attr_t *, void *(*)(void *),
-                   void *);
+int pthread_create(pthread_t *thr, const pthread_attr_t *attr,
+                   void *(*start)(void *), void *arg);
 
 int pthread_detach(pthread_t thr);
 
@@ -38,71 +117,80 @@ void pthread_exit(void *retval);
 
 int pthread_join(pthread_t thr, void **retval);
 
+pthread_t pthread_self(void);
+
 int pthread_mutex_init(pthread_mutex_t *mtx, const pthread_mutexattr_t *);
 
+int pthread_mutex_destroy(pthread_mutex_t *mtx);
+
 int pthread_mutex_lock(pthread_mutex_t *mtx);
 
 int pthread_mutex_trylock(pthread_mutex_t *mtx);
 
 int pthread_mutex_unlock(pthread_mutex_t *mtx);
 
+int pthread_rwlock_init(pthread_rwlock_t *rw, const pthread_rwlockattr_t *);
+
+int pthread_rwlock_destroy(pthread_rwlock_t *rw);
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *rw);
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rw);
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rw);
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rw);
+
+int pthread_rwlock_unlock(pthread_rwlock_t *rw);
+
+int pthread_once(pthread_once_t *once, void (*init)(void));
+
+int pthread_key_create(pthread_key_t *key, void (*destructor)(void *));
+
+int pthread_key_delete(pthread_key_t key);
+
+void *pthread_getspecific(pthread_key_t key);
+
+int pthread_setspecific(pthread_key_t key, const void *value);
+
 void pthread_yield(void);
 
+/* Cancellation is deferred: a cancelled thread exits with PTHREAD_CANCELED
+ * at its next pthread_testcancel(), pthread_join() or pthread_cond_wait() */
 int pthread_cancel(pthread_t thr);
 
+void pthread_testcancel(void);
+
 /* Everything below NYI */
 #if 0
 int             pthread_kill(pthread_t thr, int);
 int             pthread_setcancelstate(int, int *);
 int             pthread_setcanceltype(int, int *);
-void            pthread_testcancel(void);
-int             pthread_once(pthread_once_t *, void ( *)(void));
 int             pthread_cond_timedwait(pthread_cond_t *,
                                        pthread_mutex_t *, const struct timespec *);
-void            *pthread_getspecific(pthread_key_t);
-int             pthread_key_create(pthread_key_t *,
-                                   void ( *)(void *));
-int             pthread_key_delete(pthread_key_t);
 int             pthread_atfork(void ( *)(void), void ( *)(void), void ( *)(void));
-int             pthread_attr_destroy(pthread_attr_t *);
 int             pthread_attr_getstack(const pthread_attr_t *,
                                       void **, size_t *);
 int             pthread_mutexattr_init(pthread_mutexattr_t *);
 int             pthread_mutexattr_destroy(pthread_mutexattr_t *);
 int             pthread_mutexattr_gettype(pthread_mutexattr_t *, int *);
 int             pthread_mutexattr_settype(pthread_mutexattr_t *, int);
-int             pthread_mutex_destroy(pthread_mutex_t *);
-int             pthread_attr_getstacksize(const pthread_attr_t *, size_t *);
 int             pthread_attr_getstackaddr(const pthread_attr_t *, void **);
 int             pthread_attr_getguardsize(const pthread_attr_t *, size_t *);
-int             pthread_attr_getdetachstate(const pthread_attr_t *, int *);
-int             pthread_attr_init(pthread_attr_t *);
-int             pthread_attr_setstacksize(pthread_attr_t *, size_t);
 int             pthread_attr_setstack(pthread_attr_t *, void *, size_t);
 int             pthread_attr_setstackaddr(pthread_attr_t *, void *);
 int             pthread_attr_setguardsize(pthread_attr_t *, size_t);
-int             pthread_attr_setdetachstate(pthread_attr_t *, int);
 int             pthread_condattr_destroy(pthread_condattr_t *);
 int             pthread_condattr_init(pthread_condattr_t *);
-int             pthread_rwlock_destroy(pthread_rwlock_t *);
-int             pthread_rwlock_init(pthread_rwlock_t *,
-                                    const pthread_rwlockattr_t *);
-int             pthread_rwlock_rdlock(pthread_rwlock_t *);
 int             pthread_rwlock_timedrdlock(pthread_rwlock_t *,
                 const struct timespec *);
 int             pthread_rwlock_timedwrlock(pthread_rwlock_t *,
                 const struct timespec *);
-int             pthread_rwlock_tryrdlock(pthread_rwlock_t *);
-int             pthread_rwlock_trywrlock(pthread_rwlock_t *);
-int             pthread_rwlock_unlock(pthread_rwlock_t *);
-int             pthread_rwlock_wrlock(pthread_rwlock_t *);
 int             pthread_rwlockattr_init(pthread_rwlockattr_t *);
 int             pthread_rwlockattr_getpshared(const pthread_rwlockattr_t *,
                 int *);
 int             pthread_rwlockattr_setpshared(pthread_rwlockattr_t *, int);
 int             pthread_rwlockattr_destroy(pthread_rwlockattr_t *);
-pthread_t       pthread_self(void);
-int             pthread_setspecific(pthread_key_t, const void *);
 int             pthread_sigmask(int, const sigset_t *, sigset_t *);
 
 int             pthread_getprio(pthread_t);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "weenix/syscall.h" /* syscall_ring_t */
+
+/* Runs the system calls submitted to ring, and returns how many it ran */
+int ring_enter(syscall_ring_t *ring);
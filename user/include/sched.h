@@ -0,0 +1,21 @@
+#pragma once
+
+#include "sys/types.h"
+#include "weenix/syscall.h" /* SCHED_OTHER, SCHED_FIFO, IOPRIO_* */
+
+int sched_setscheduler(pid_t pid, int policy, int priority);
+
+int sched_getscheduler(pid_t pid);
+
+/* Restricts a process to the cores in mask, bit i standing for core i */
+int sched_setaffinity(pid_t pid, unsigned long mask);
+
+/* Returns the mask of cores a process may run on, or -1 */
+long sched_getaffinity(pid_t pid);
+
+/* Sets the I/O priority of a process's disk requests, IOPRIO_VALUE(class,
+ * level) */
+int ioprio_set(pid_t pid, int prio);
+
+/* Returns a process's I/O priority, or -1 */
+int ioprio_get(pid_t pid);
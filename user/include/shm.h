@@ -0,0 +1,64 @@
+#pragma once
+
+#include "sys/types.h"
+
+/*
+ * Named shared memory, and message queues in it.
+ *
+ * A shared memory object "/name" is the file SHM_DIR/name. SHM_DIR is a tmpfs,
+ * so the file's pages are anonymous memory that never goes near a disk, and
+ * every process that mmap()s it MAP_SHARED maps the very same pages. There is
+ * nothing to size: pages appear as they are first touched. An object lasts
+ * until it is shm_unlink()ed and unmapped everywhere.
+ */
+#define SHM_DIR "/dev/shm"
+
+/* Opens the shared memory object name, of the form "/name", with open()'s
+ * oflag and mode; returns an fd to mmap() it by, or -1 */
+int shm_open(const char *name, int oflag, int mode);
+
+/* Removes the shared memory object name; mappings of it stay valid */
+int shm_unlink(const char *name);
+
+/*
+ * A queue of messages of up to msgsize bytes, nmsgs (a power of 2) of them at
+ * most, in a shared memory object, which any number of processes may send to
+ * and receive from at once. Messages are never copied: a sender reserves a
+ * slot and writes its message in place, and a receiver reads it where it is
+ * and then releases the slot. Senders wait while the queue is full, and
+ * receivers while it is empty, on futexes in the queue, which are only woken
+ * when somebody is actually waiting.
+ *
+ * Example usage:
+ *    shmq_t *q = shmq_open("/jobs", O_CREAT, 256, 64);
+ *
+ *    char *msg = shmq_reserve(q);            (in a sender)
+ *    ... write up to 256 bytes to msg ...
+ *    shmq_send(q, msg, len);
+ *
+ *    char *msg = shmq_receive(q, &len);      (in a receiver)
+ *    ... read len bytes from msg ...
+ *    shmq_release(q, msg);
+ */
+typedef struct shmq shmq_t;
+
+/* Opens the queue in shared memory object name, creating it if oflag has
+ * O_CREAT and it does not exist; everyone must agree on msgsize and nmsgs.
+ * Returns NULL on error, with errno set */
+shmq_t *shmq_open(const char *name, int oflag, size_t msgsize, size_t nmsgs);
+
+/* Unmaps the queue; it lives on in its shared memory object */
+void shmq_close(shmq_t *q);
+
+/* Reserves a slot to send a message in, waiting if the queue is full */
+void *shmq_reserve(shmq_t *q);
+
+/* Sends the len-byte message written to the slot from shmq_reserve() */
+void shmq_send(shmq_t *q, void *msg, size_t len);
+
+/* Receives a message, waiting if the queue is empty, and returns it, its
+ * length in len; it stays valid until shmq_release() */
+void *shmq_receive(shmq_t *q, size_t *len);
+
+/* Hands the slot of a message from shmq_receive() back to senders */
+void shmq_release(shmq_t *q, void *msg);
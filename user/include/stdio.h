@@ -5,8 +5,12 @@
 #include "stddef.h"
 #include "sys/types.h"
 
-/* Output not buffered */
-#define __IONBF 1
+/* Buffering modes, for setvbuf() */
+#define _IOFBF 0 /* fully buffered */
+#define _IOLBF 1 /* line buffered: output is written at each newline */
+#define _IONBF 2 /* unbuffered */
+
+#define BUFSIZ 8192
 
 #ifndef EOF
 #define EOF (-1)
@@ -16,12 +20,23 @@
 #define NULL 0
 #endif
 
-/* For now, just store a file descriptor */
-typedef struct
+/*
+ * A stream buffers either output waiting to be written or input read ahead,
+ * never both: switching from one to the other flushes the buffer. Streams
+ * are fully buffered unless they are ttys, which are line buffered; stderr
+ * is unbuffered.
+ */
+typedef struct __file
 {
     int fd;
-    int offset;
-    char buffer[8192];
+    int mode;      /* _IOFBF, _IOLBF or _IONBF, or -1 until first used */
+    int flags;     /* __SRD, __SWR, __SEOF, __SERR, __SFREE; see stream.c */
+    size_t offset; /* output: bytes buffered; input: next byte to return */
+    size_t len;    /* input: bytes in the buffer */
+    size_t size;   /* size of buf */
+    char *buf;     /* buffer, or the caller's from setvbuf() */
+    struct __file *next; /* on the list of open streams, for fflush(NULL) */
+    char buffer[BUFSIZ];
 } FILE;
 typedef off_t fpos_t;
 extern FILE *stdin;
@@ -40,6 +55,36 @@ int sprintf(char *buf, const char *fmt, ...)
 
 int fflush(FILE *stream);
 
+FILE *fopen(const char *path, const char *mode);
+FILE *fdopen(int fd, const char *mode);
+int fclose(FILE *stream);
+
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
+
+int fgetc(FILE *stream);
+int getc(FILE *stream);
+int getchar(void);
+char *fgets(char *s, int size, FILE *stream);
+
+int fputc(int c, FILE *stream);
+int putc(int c, FILE *stream);
+int putchar(int c);
+int fputs(const char *s, FILE *stream);
+int puts(const char *s);
+
+int fseek(FILE *stream, long offset, int whence);
+long ftell(FILE *stream);
+void rewind(FILE *stream);
+
+int setvbuf(FILE *stream, char *buf, int mode, size_t size);
+void setbuf(FILE *stream, char *buf);
+
+int feof(FILE *stream);
+int ferror(FILE *stream);
+void clearerr(FILE *stream);
+int fileno(FILE *stream);
+
 int vprintf(const char *fmt, va_list args)
     __attribute__((__format__(printf, 1, 0))) __attribute__((__nonnull__(1)));
 
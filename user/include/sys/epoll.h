@@ -0,0 +1,15 @@
+#pragma once
+
+#include "weenix/syscall.h" /* struct epoll_event, EPOLLIN, EPOLL_CTL_ADD, ... */
+
+/* Opens a new epoll instance, and returns its fd */
+int epoll_create(void);
+
+/* Adds (EPOLL_CTL_ADD), changes (EPOLL_CTL_MOD) or removes (EPOLL_CTL_DEL)
+ * the registration of fd with the epoll instance epfd */
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+/* Waits up to timeout milliseconds (for ever if negative) for registered fds
+ * to be ready, and returns the events of up to maxevents of them */
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "weenix/syscall.h" /* TCGETS, TCSETS, FBIOGET_INFO */
+
+/* Carries out a device-specific request on fd; arg is the request's
+ * argument, or where its result goes */
+int ioctl(int fd, unsigned long request, void *arg);
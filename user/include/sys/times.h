@@ -0,0 +1,7 @@
+#pragma once
+
+#include "weenix/syscall.h" /* struct tms, CLK_TCK */
+
+/* Fills in buf with the CPU time used, in ticks, and returns the ticks since
+ * boot */
+long times(struct tms *buf);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "sys/types.h"
+#include "weenix/syscall.h" /* struct iovec, IOV_MAX */
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
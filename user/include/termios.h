@@ -0,0 +1,12 @@
+#pragma once
+
+#include "weenix/syscall.h" /* struct termios, ICANON, ECHO, VMIN, VTIME */
+
+/* tcsetattr() actions; settings always take effect straight away */
+#define TCSANOW 0
+
+/* Gets the settings of the tty open as fd */
+int tcgetattr(int fd, struct termios *t);
+
+/* Changes the settings of the tty open as fd */
+int tcsetattr(int fd, int optional_actions, const struct termios *t);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "sys/types.h"
+#include "weenix/syscall.h" /* struct timespec, CLOCK_REALTIME, CLOCK_MONOTONIC */
+
+/* Reads a clock, to the nanosecond, from the vDSO page without a system
+ * call. Returns 0, or -1 if clock is unknown */
+int clock_gettime(int clock, struct timespec *tp);
+
+/* Sleeps for *req. Returns 0, or -1 with errno EINTR if cancelled, with the
+ * time that was left in *rem unless rem is NULL */
+int nanosleep(const struct timespec *req, struct timespec *rem);
@@ -30,41 +30,67 @@ pid_t waitpid(pid_t pid, int *status, int options);
 
 void thr_exit(int status);
 
+/* Runs func(arg) in a new thread of this process, on the stack
+ * [stack, stack + stacksz), and returns the new thread's id. The thread
+ * exits with func's return value. */
+int thr_create(void *(*func)(void *), void *arg, void *stack, size_t stacksz);
+
+pid_t gettid(void);
+
 int thr_errno(void);
 
 void thr_set_errno(int n);
 
 int sched_yield(void);
 
+int nice(int inc);
+
 pid_t getpid(void);
 
 int halt(void);
 
 void sync(void);
 
+int fsync(int fd);
+
+int fdatasync(int fd);
+
+int syncfs(int fd);
+
 size_t get_free_mem(void);
 
 /* VFS-related */
 int open(const char *filename, int flags, int mode);
 
+int openat(int dirfd, const char *filename, int flags, int mode);
+
 int close(int fd);
 
 ssize_t read(int fd, void *buf, size_t count);
 
 ssize_t write(int fd, const void *buf, size_t count);
 
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
+
 off_t lseek(int fd, off_t offset, int whence);
 
 int dup(int fd);
 
 int dup2(int ofd, int nfd);
+int fcntl(int fd, int cmd, int arg);
 
 int mkdir(const char *path, int mode);
 
+int mkdirat(int dirfd, const char *path, int mode);
+
 int rmdir(const char *path);
 
 int unlink(const char *path);
 
+int unlinkat(int dirfd, const char *path, int flags);
+
 int link(const char *oldpath, const char *newpath);
 
 int rename(const char *oldpath, const char *newpath);
@@ -75,20 +101,46 @@ int getdents(int fd, struct dirent *dir, size_t size);
 
 int stat(const char *path, struct stat *buf);
 
+int fstatat(int dirfd, const char *path, struct stat *buf, int flags);
+
+/* Whether fd is open on a tty, i.e. answers tcgetattr() */
+int isatty(int fd);
+
 int pipe(int pipefd[2]);
 
+/* Move (splice) or copy (tee) up to len bytes between fds, at least one of
+ * them a pipe (both for tee), without a trip through userland */
+ssize_t splice(int fd_in, int fd_out, size_t len);
+
+ssize_t tee(int fd_in, int fd_out, size_t len);
+
+/* Write up to count bytes of the file in_fd to out_fd from the kernel's
+ * page cache; from *offset (which is advanced) unless offset is NULL */
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
 /* VM-related */
 void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
 
 int munmap(void *addr, size_t len);
 
+/* Set the protection of [addr, addr + len) to prot, PROT_NONE or an OR of
+ * the PROT_ values in sys/mman.h */
+int mprotect(void *addr, size_t len, int prot);
+
+/* Advise the kernel how [addr, addr + len) will be used; advice is one of
+ * the MADV_ values in sys/mman.h */
+int madvise(void *addr, size_t len, int advice);
+
+/* Write back the modified pages of shared file mappings in [addr, addr + len);
+ * flags is MS_SYNC to wait for the writes, or MS_ASYNC */
+int msync(void *addr, size_t len, int flags);
+
 int brk(void *addr);
 
 void *sbrk(intptr_t incr);
 
 /* Mounting */
-int mount(const char *source, const char *target, const char *filesystemtype,
-          unsigned long mountflags, const void *data);
+int mount(const char *source, const char *target, const char *filesystemtype);
 
 int umount(const char *target);
 
@@ -96,6 +148,10 @@ time_t time(time_t *tloc);
 
 long usleep(useconds_t usec);
 
+/* Start (sampling every interval ticks), stop or read the kernel's profiler;
+ * see weenix/profile.h. A read returns the bytes of samples put in buf */
+ssize_t profile(int op, int interval, void *buf, size_t nbytes);
+
 #define STDIN_FILENO 0
 #define STDOUT_FILENO 1
 #define STDERR_FILENO 2
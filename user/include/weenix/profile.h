@@ -0,0 +1 @@
+../../../kernel/include/api/profile.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../kernel/include/api/trace.h
\ No newline at end of file
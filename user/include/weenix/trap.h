@@ -9,18 +9,25 @@
 
 /* ssize_t will be 32 bits or 64 bits wide as appropriate.
    args are passed via %(r/e)ax and %(r/e)dx, so they need
-   to be the size of a register.  */
+   to be the size of a register.
+
+   The syscall instruction is much cheaper than an interrupt; the kernel
+   still accepts int $INTR_SYSCALL too. syscall clobbers %rcx and %r11.
+
+   A failing syscall returns -errno, which we turn into -1 and errno. */
 
 static inline ssize_t trap(ssize_t num, ssize_t arg)
 {
     ssize_t ret;
-    __asm__ volatile("int $" TRAP_INTR_STRING
+    __asm__ volatile("syscall"
                      : "=a"(ret)
-                     : "a"(num), "d"(arg));
+                     : "a"(num), "d"(arg)
+                     : "rcx", "r11", "memory");
 
-    /* Copy in errno */
-    __asm__ volatile("int $" TRAP_INTR_STRING
-                     : "=a"(errno)
-                     : "a"(SYS_errno));
+    if (ret < 0 && ret >= -SYSCALL_MAX_ERRNO)
+    {
+        errno = (int)-ret;
+        return -1;
+    }
     return ret;
 }
@@ -700,6 +700,7 @@ the following DT_* entry.  */
    If any adjustment is made to the ELF object after it has been
    built these entries will need to be adjusted.  */
 #define DT_ADDRRNGLO 0x6ffffe00
+#define DT_GNU_HASH 0x6ffffef5    /* GNU-style hash table.  */
 #define DT_GNU_CONFLICT 0x6ffffef8 /* Start of conflict section */
 #define DT_GNU_LIBLIST 0x6ffffef9  /* Library list */
 #define DT_CONFIG 0x6ffffefa       /* Configuration information.  */
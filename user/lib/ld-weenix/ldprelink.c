@@ -0,0 +1,200 @@
+/*
+ *  File: ldprelink.c
+ *  Desc: Cache of relocated library data
+ */
+
+/* Relocating a library gives the same result every time it is loaded at
+ * the same address alongside the same other modules, and the kernel
+ * places the libraries of a given program at the same addresses from
+ * one exec to the next. So once a library has been relocated, its
+ * writable segments (the GOT and the data) are written out to a file in
+ * the prelink cache directory, and later loads of the same link map
+ * map that file copy-on-write over the segments rather than relocating
+ * them again. Every process running the program then shares the
+ * relocated pages until it writes to them.
+ *
+ * A cache file is named after the library's inode and a hash of the
+ * executable's dynamic symbols, since the executable can define symbols
+ * the library refers to. Its header records the file identity (device,
+ * inode, size and mtime) and base address of every module in the link
+ * map, and where the segments go; the file is only used if all of it
+ * matches. */
+
+#include "fcntl.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/mman.h"
+#include "sys/types.h"
+#include "unistd.h"
+
+#include "ldprelink.h"
+#include "ldutil.h"
+
+#define LDPRELINK_MAGIC 0x4b4e4c50 /* "PLNK" */
+#define LDPRELINK_MAXMODS 32
+
+#define H_nchain 1
+
+static const char *err_mapping =
+    "ld.so.1: panic - failure to map prelinked segment from \"%s\"\n";
+
+typedef struct ldprelink_mod
+{
+    int dev, ino, fsize, mtime;
+    unsigned long base;
+} ldprelink_mod_t;
+
+/* The first page of a cache file; the segments follow, each starting
+ * on a page boundary */
+typedef struct ldprelink_hdr
+{
+    uint32_t magic;
+    uint32_t execsig;
+    uint32_t nmods;
+    uint32_t nsegs;
+    ldprelink_mod_t mods[LDPRELINK_MAXMODS];
+    ldseg_t segs[LD_MAXWSEGS];
+} ldprelink_hdr_t;
+
+static module_t *_ldprelink_first;
+static unsigned long _ldprelink_pagesize;
+static uint32_t _ldprelink_execsig;
+static int _ldprelink_enabled;
+
+/* Hashes the symbols the executable defines and refers to */
+
+static uint32_t _ldprelink_sig(module_t *exec)
+{
+    uint32_t sig = 5381;
+    for (Elf64_Word y = 1; y < exec->hash[H_nchain]; y++)
+    {
+        Elf64_Sym *sym = &exec->dynsym[y];
+        sig = sig * 33 ^ _ldgnuhash(exec->dynstr + sym->st_name);
+        sig = sig * 33 ^ (uint32_t)sym->st_value;
+        sig = sig * 33 ^ ((uint32_t)sym->st_info << 16 | sym->st_shndx);
+    }
+    return sig;
+}
+
+void _ldprelink_init(module_t *first, unsigned long pagesize)
+{
+    _ldprelink_first = first;
+    _ldprelink_pagesize = pagesize;
+    _ldprelink_enabled = _ldenv.ld_prelink_cache && first->hash;
+
+    size_t nmods = 0;
+    for (module_t *m = first; m; m = m->next)
+        nmods++;
+    if (nmods > LDPRELINK_MAXMODS)
+        _ldprelink_enabled = 0;
+
+    if (_ldprelink_enabled)
+        _ldprelink_execsig = _ldprelink_sig(first);
+}
+
+static int _ldprelink_path(module_t *module, char *buf, size_t size)
+{
+    if (!_ldprelink_enabled || module->nwsegs <= 0 || !module->ino)
+        return 0;
+    int len = snprintf(buf, size, "%s/%x.%x", _ldenv.ld_prelink_cache,
+                       module->ino, _ldprelink_execsig);
+    return len > 0 && (size_t)len < size;
+}
+
+static void _ldprelink_header(module_t *module, ldprelink_hdr_t *hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = LDPRELINK_MAGIC;
+    hdr->execsig = _ldprelink_execsig;
+    for (module_t *m = _ldprelink_first; m; m = m->next)
+    {
+        ldprelink_mod_t *pm = &hdr->mods[hdr->nmods++];
+        pm->dev = m->dev;
+        pm->ino = m->ino;
+        pm->fsize = m->fsize;
+        pm->mtime = m->mtime;
+        pm->base = m->base;
+    }
+    hdr->nsegs = module->nwsegs;
+    memcpy(hdr->segs, module->wsegs, module->nwsegs * sizeof(ldseg_t));
+}
+
+/* Maps the module's relocated segments in from its cache file, if there
+ * is one for this link map. Returns 1 if it did, in which case the
+ * module needs no relocating. */
+
+int _ldprelink_load(module_t *module)
+{
+    char path[256];
+    ldprelink_hdr_t want, have;
+    int fd;
+
+    if (!_ldprelink_path(module, path, sizeof(path)))
+        return 0;
+    if ((fd = open(path, O_RDONLY, 0)) < 0)
+        return 0;
+
+    _ldprelink_header(module, &want);
+    if (read(fd, &have, sizeof(have)) != sizeof(have) ||
+        memcmp(&want, &have, sizeof(have)))
+    {
+        close(fd);
+        return 0;
+    }
+
+    off_t off = _ldprelink_pagesize;
+    for (int i = 0; i < module->nwsegs; i++)
+    {
+        ldseg_t *seg = &module->wsegs[i];
+        /* the segments already replaced cannot be relocated again
+         * (PLT slots are relocated by adding to them) */
+        if (mmap((void *)seg->addr, seg->len, seg->prot,
+                 MAP_PRIVATE | MAP_FIXED, fd, off) == MAP_FAILED)
+        {
+            printf(err_mapping, path);
+            exit(1);
+        }
+        off += seg->len;
+    }
+    close(fd);
+
+    /* the cached GOT points at the link map of the run that wrote it */
+    if (module->pltgot)
+        _ldpltgot_init(module);
+    return 1;
+}
+
+/* Writes the relocated segments of the module out to its cache file.
+ * The header goes in last, so that a file that was not completely
+ * written is never used. */
+
+void _ldprelink_save(module_t *module)
+{
+    char path[256];
+    ldprelink_hdr_t hdr;
+    int fd;
+
+    if (!_ldprelink_path(module, path, sizeof(path)))
+        return;
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return;
+
+    memset(&hdr, 0, sizeof(hdr));
+    off_t off = _ldprelink_pagesize;
+    int ok = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+    for (int i = 0; ok && i < module->nwsegs; i++)
+    {
+        ldseg_t *seg = &module->wsegs[i];
+        ok = pwrite(fd, (void *)seg->addr, seg->len, off) ==
+             (ssize_t)seg->len;
+        off += seg->len;
+    }
+
+    _ldprelink_header(module, &hdr);
+    if (ok)
+        ok = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+    close(fd);
+    if (!ok)
+        unlink(path);
+}
@@ -0,0 +1,24 @@
+/*
+ *  File: ldprelink.h
+ *  Desc: Cache of relocated library data
+ */
+
+#ifndef _ldprelink_h_
+#define _ldprelink_h_
+
+#include "ldtypes.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    void _ldprelink_init(module_t *first, unsigned long pagesize);
+    int _ldprelink_load(module_t *module);
+    void _ldprelink_save(module_t *module);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ldprelink_h_ */
@@ -19,22 +19,78 @@
 #define H_nchain 1
 #define H_bucket 2
 
-/* This function looks up the specified symbol in the specified
- * module.  If the symbol is present, it returns the symbol's index in
- * the dynamic symbol table, otherwise STN_UNDEF is returned. */
+/* GNU hash table header words */
+#define GH_nbucket 0
+#define GH_symoffset 1
+#define GH_bloomsize 2
+#define GH_bloomshift 3
+#define GH_bloom 4
 
-int _ldlookup(module_t *module, const char *name)
+/* A name to look up, with its hashes computed once for all the modules
+ * searched */
+
+typedef struct ldname
+{
+    const char *name;
+    uint32_t gnuhash;
+    unsigned long elfhash;
+} ldname_t;
+
+static void _ldname_init(ldname_t *n, const char *name)
+{
+    n->name = name;
+    n->gnuhash = _ldgnuhash(name);
+    n->elfhash = _ldelfhash(name);
+}
+
+/* Looks a name up in a module's GNU hash table. The bloom filter rules
+ * most absent names out without touching the buckets; the chain of a
+ * bucket holds the hashes of its symbols (with the low bit marking the
+ * last), so only symbols whose hash matches have their names compared. */
+
+static int _ldgnulookup(module_t *module, const ldname_t *n)
+{
+    const Elf64_Word *gh = module->gnuhash;
+    const Elf64_Xword *bloom = (const Elf64_Xword *)&gh[GH_bloom];
+    const Elf64_Word *buckets = (const Elf64_Word *)&bloom[gh[GH_bloomsize]];
+    const Elf64_Word *chain = &buckets[gh[GH_nbucket]];
+    uint32_t h = n->gnuhash;
+
+    Elf64_Xword word = bloom[(h / 64) % gh[GH_bloomsize]];
+    Elf64_Xword mask = ((Elf64_Xword)1 << (h % 64)) |
+                       ((Elf64_Xword)1 << ((h >> gh[GH_bloomshift]) % 64));
+    if ((word & mask) != mask)
+        return STN_UNDEF;
+
+    Elf64_Word y = buckets[h % gh[GH_nbucket]];
+    if (y < gh[GH_symoffset])
+        return STN_UNDEF;
+
+    for (;; y++)
+    {
+        Elf64_Word h2 = chain[y - gh[GH_symoffset]];
+        if ((h | 1) == (h2 | 1) &&
+            !strcmp(module->dynstr + module->dynsym[y].st_name, n->name))
+            return y;
+        if (h2 & 1)
+            return STN_UNDEF;
+    }
+}
+
+static int _ldlookupname(module_t *module, const ldname_t *n)
 {
     unsigned long hashval;
     unsigned long y;
 
-    hashval = _ldelfhash(name);
-    hashval %= module->hash[H_nbucket];
+    if (module->gnuhash)
+        return _ldgnulookup(module, n);
+
+    hashval = n->elfhash % module->hash[H_nbucket];
 
     y = module->hash[H_bucket + hashval];
 
     while ((y != STN_UNDEF) &&
-           strcmp(module->dynstr + module->dynsym[y].st_name, name))
+           strcmp(module->dynstr + module->dynsym[y].st_name, n->name))
     {
         y = module->hash[H_bucket + module->hash[H_nbucket] + y];
     }
@@ -42,20 +98,25 @@ int _ldlookup(module_t *module, const char *name)
     return y;
 }
 
-/* This looks up the specified symbol in the given module, subject to
- * the provided binding and type restrictions (a value of -1 will
- * function as a wildcard for both the 'binding' and 'type'
- * parameters).  The symbol's size will be placed in the memory
- * location pointed to by 'size', if it is non-null.  0 is returned if
- * a symbol matching all the requirements is not found. */
+/* This function looks up the specified symbol in the specified
+ * module.  If the symbol is present, it returns the symbol's index in
+ * the dynamic symbol table, otherwise STN_UNDEF is returned. */
 
-ldsym_t _ldsymbol(module_t *module, const char *name, int binding, int type,
-                  Elf64_Word *size)
+int _ldlookup(module_t *module, const char *name)
+{
+    ldname_t n;
+
+    _ldname_init(&n, name);
+    return _ldlookupname(module, &n);
+}
+
+static ldsym_t _ldsymbolname(module_t *module, const ldname_t *n, int binding,
+                             int type, Elf64_Word *size)
 {
     int result;
 
     /* LINTED */
-    if (((result = _ldlookup(module, name)) != STN_UNDEF) &&
+    if (((result = _ldlookupname(module, n)) != STN_UNDEF) &&
         ((binding < 0) ||
          (ELF64_ST_BIND(module->dynsym[result].st_info) == binding)) &&
         ((type < 0) ||
@@ -71,6 +132,46 @@ ldsym_t _ldsymbol(module_t *module, const char *name, int binding, int type,
     return 0;
 }
 
+/* This looks up the specified symbol in the given module, subject to
+ * the provided binding and type restrictions (a value of -1 will
+ * function as a wildcard for both the 'binding' and 'type'
+ * parameters).  The symbol's size will be placed in the memory
+ * location pointed to by 'size', if it is non-null.  0 is returned if
+ * a symbol matching all the requirements is not found. */
+
+ldsym_t _ldsymbol(module_t *module, const char *name, int binding, int type,
+                  Elf64_Word *size)
+{
+    ldname_t n;
+
+    _ldname_init(&n, name);
+    return _ldsymbolname(module, &n, binding, type, size);
+}
+
+/* The lookup cache remembers the global and weak definitions found by
+ * _ldresolve(), which are the same whichever module asks, so that the
+ * symbols every module refers to (malloc, errno, ...) are only searched
+ * for once. It is a direct-mapped table indexed by the GNU hash; a
+ * colliding name simply replaces the entry. */
+
+#define LDCACHE_SIZE 256 /* a power of 2 */
+
+typedef struct ldcache_entry
+{
+    const char *name; /* NULL if the entry is unused */
+    uint32_t hash;
+    int type;
+    ldsym_t sym;
+    Elf64_Word size;
+} ldcache_entry_t;
+
+static ldcache_entry_t _ldcache[LDCACHE_SIZE];
+
+static ldcache_entry_t *_ldcache_entry(const ldname_t *n)
+{
+    return &_ldcache[n->gnuhash & (LDCACHE_SIZE - 1)];
+}
+
 /* Given a module and a symbol name, this function attempts to find the
  * symbol through the process' link chain.  It first checks for its
  * presence as a global symbol, then as a weak symbol, and finally as a
@@ -84,6 +185,20 @@ ldsym_t _ldresolve(module_t *module, const char *name, int type,
 {
     module_t *curmod;
     ldsym_t sym;
+    Elf64_Word symsize;
+    ldname_t n;
+
+    _ldname_init(&n, name);
+
+    /* excluding the module makes the answer depend on it */
+    ldcache_entry_t *ent = exclude ? NULL : _ldcache_entry(&n);
+    if (ent && ent->name && ent->hash == n.gnuhash && ent->type == type &&
+        !strcmp(ent->name, name))
+    {
+        if (size)
+            *size = ent->size;
+        return ent->sym;
+    }
 
     curmod = module->first;
 
@@ -91,8 +206,8 @@ ldsym_t _ldresolve(module_t *module, const char *name, int type,
     {
         if (!exclude || curmod != module)
         {
-            if ((sym = _ldsymbol(curmod, name, STB_GLOBAL, type, size)))
-                return sym;
+            if ((sym = _ldsymbolname(curmod, &n, STB_GLOBAL, type, &symsize)))
+                goto found;
         }
         curmod = curmod->next;
     }
@@ -100,12 +215,25 @@ ldsym_t _ldresolve(module_t *module, const char *name, int type,
     curmod = module->first;
     while (curmod)
     {
-        if ((sym = _ldsymbol(curmod, name, STB_WEAK, type, size)))
-            return sym;
+        if ((sym = _ldsymbolname(curmod, &n, STB_WEAK, type, &symsize)))
+            goto found;
         curmod = curmod->next;
     }
 
-    return _ldsymbol(module, name, STB_LOCAL, type, size);
+    return _ldsymbolname(module, &n, STB_LOCAL, type, size);
+
+found:
+    if (ent)
+    {
+        ent->name = name;
+        ent->hash = n.gnuhash;
+        ent->type = type;
+        ent->sym = sym;
+        ent->size = symsize;
+    }
+    if (size)
+        *size = symsize;
+    return sym;
 }
 
 Elf64_Addr _rtresolve(module_t *mod, Elf64_Word reloff)
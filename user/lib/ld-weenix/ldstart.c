@@ -19,6 +19,7 @@
 #include "stdlib.h"
 #include "string.h"
 #include "sys/mman.h"
+#include "sys/stat.h"
 #include "sys/types.h"
 #include "unistd.h"
 
@@ -26,6 +27,7 @@
 
 #include "ldalloc.h"
 #include "ldnames.h"
+#include "ldprelink.h"
 #include "ldutil.h"
 
 #ifndef DEFAULT_RUNPATH
@@ -34,7 +36,12 @@
 
 extern int _ldbindnow(module_t *curmod);
 
+#ifndef DEFAULT_PRELINK_CACHE
+#define DEFAULT_PRELINK_CACHE "/lib/prelink"
+#endif
+
 static const char *default_runpath = DEFAULT_RUNPATH;
+static const char *default_prelink_cache = DEFAULT_PRELINK_CACHE;
 
 static const char *err_cantfind =
     "ld.so.1: panic - unable to find library \"%s\"\n";
@@ -55,17 +62,16 @@ ldenv_t _ldenv;
 
 static const char *_ldgetenv(const char *var)
 {
-    char **e = env;
-    while (*e)
+    for (char **e = env; *e; e++)
     {
         const char *p = *e;
-        while (*p == *var)
-            p++, var++;
-        if (*p == '=' && *var == 0)
+        const char *v = var;
+        while (*v && *p == *v)
+            p++, v++;
+        if (*p == '=' && *v == 0)
         {
-            return p++;
+            return p + 1;
         }
-        e++;
     }
     return 0;
 }
@@ -83,6 +89,13 @@ static void _ldenv_init(char **environ)
     }
     _ldenv.ld_preload = _ldgetenv("LD_PRELOAD");
     _ldenv.ld_library_path = _ldgetenv("LD_LIBRARY_PATH");
+
+    /* an empty LD_PRELINK_CACHE turns the prelink cache off */
+    _ldenv.ld_prelink_cache = _ldgetenv("LD_PRELINK_CACHE");
+    if (!_ldenv.ld_prelink_cache)
+        _ldenv.ld_prelink_cache = default_prelink_cache;
+    else if (!*_ldenv.ld_prelink_cache)
+        _ldenv.ld_prelink_cache = NULL;
 }
 
 static module_t *_ldlinkobj(module_t *info, const char *baseaddr,
@@ -114,6 +127,7 @@ static module_t *_ldlinkobj(module_t *info, const char *baseaddr,
     }
 
     info->base = (unsigned long)baseaddr;
+    info->gnuhash = NULL; /* objects linked without one use DT_HASH */
 
     for (curdyn = dyn; curdyn->d_tag != DT_NULL; curdyn++)
     {
@@ -122,6 +136,9 @@ static module_t *_ldlinkobj(module_t *info, const char *baseaddr,
         case DT_HASH:
             info->hash = (void *)(info->base + curdyn->d_un.d_ptr);
             break;
+        case DT_GNU_HASH:
+            info->gnuhash = (void *)(info->base + curdyn->d_un.d_ptr);
+            break;
         case DT_SYMTAB:
             info->dynsym = (void *)(info->base + curdyn->d_un.d_ptr);
             break;
@@ -224,9 +241,16 @@ static module_t *_ldlinkobj(module_t *info, const char *baseaddr,
 /* Given a filename and a colon-delimited path, this function attempts
  * to open the named file using each element of the path as a prefix
  * for the file.  The result of the first successful open is returned,
- * otherwise -1 is returned */
+ * otherwise -1 is returned.  The opened file is stat()ed into 'st'. */
+
+static int _ldopened(int fd, const char *filename, struct stat *st)
+{
+    if (stat(filename, st) < 0)
+        memset(st, 0, sizeof(*st));
+    return fd;
+}
 
-int _ldtryopen(const char *filename, const char *path)
+int _ldtryopen(const char *filename, const char *path, struct stat *st)
 {
     char buffer[2048]; /* shouldn't be overflown */
     const char *pos, *oldpos;
@@ -245,7 +269,7 @@ int _ldtryopen(const char *filename, const char *path)
     fd = open(buffer, O_RDONLY, 0);
     if (fd >= 0)
     {
-        return fd;
+        return _ldopened(fd, buffer, st);
     }
     /* END ADDED */
 
@@ -262,7 +286,7 @@ int _ldtryopen(const char *filename, const char *path)
         fd = open(buffer, O_RDONLY, 0);
         if (fd >= 0)
         {
-            return fd;
+            return _ldopened(fd, buffer, st);
         }
 
         oldpos = ++pos;
@@ -379,14 +403,15 @@ void _ldloadobj(module_t *module)
     Elf64_Phdr *phdr;
     Elf64_Dyn *dyn = 0;
     char *loc;
+    struct stat st;
     int fd;
 
     /* attempt to open library */
-    fd = _ldtryopen(module->name, _ldenv.ld_library_path);
+    fd = _ldtryopen(module->name, _ldenv.ld_library_path, &st);
     if (fd == -1)
-        fd = _ldtryopen(module->name, module->runpath);
+        fd = _ldtryopen(module->name, module->runpath, &st);
     if (fd == -1)
-        fd = _ldtryopen(module->name, default_runpath);
+        fd = _ldtryopen(module->name, default_runpath, &st);
     if (fd == -1)
     {
         printf(err_cantfind, module->name);
@@ -446,10 +471,34 @@ void _ldloadobj(module_t *module)
         }
     } while (curdyn.d_tag != DT_NULL);
 
+    module->dev = st.st_dev;
+    module->ino = st.st_ino;
+    module->fsize = st.st_size;
+    module->mtime = st.st_mtime;
+    /* relocated text cannot come from the cache */
+    module->nwsegs = textrel ? -1 : 0;
+
     for (size_t i = 0; i < hdr->e_phnum; i++)
     {
         if (phdr[i].p_type == PT_LOAD)
+        {
             _ldmapsect(fd, (unsigned long)loc - bottom, phdr + i, textrel);
+            if ((phdr[i].p_flags & PF_W) && module->nwsegs >= 0)
+            {
+                unsigned long vaddr =
+                    (unsigned long)loc - bottom + phdr[i].p_vaddr;
+                if (module->nwsegs == LD_MAXWSEGS)
+                {
+                    module->nwsegs = -1;
+                    continue;
+                }
+                ldseg_t *seg = &module->wsegs[module->nwsegs++];
+                seg->addr = trunc_page(vaddr);
+                seg->len = round_page(vaddr + phdr[i].p_memsz) - seg->addr;
+                seg->prot = PROT_READ | PROT_WRITE |
+                            ((phdr[i].p_flags & PF_X) ? PROT_EXEC : 0);
+            }
+        }
         else if (phdr[i].p_type == PT_DYNAMIC)
             dyn = (Elf64_Dyn *)(loc + phdr[i].p_vaddr);
     }
@@ -531,10 +580,15 @@ ldinit_t _ldstart(char **environ, auxv_t *auxv)
      * that will contain R_386_COPY entries, and we need to make sure the things
      * being copied are correctly relocated (they are probably R_386_RELATIVE)
      * prior to copying */
+    /* Libraries whose relocated data is in the prelink cache get it
+     * mapped in, in place of relocating them. */
+    _ldprelink_init(_ldfirst, pagesize);
     curmod = _ldfirst->next; /* Assume at least one module... */
     while (curmod)
     {
-        _ldrelocobj(curmod);
+        curmod->prelinked = _ldprelink_load(curmod);
+        if (!curmod->prelinked)
+            _ldrelocobj(curmod);
         curmod = curmod->next;
     }
     _ldrelocobj(_ldfirst);
@@ -542,7 +596,12 @@ ldinit_t _ldstart(char **environ, auxv_t *auxv)
     curmod = _ldfirst;
     while (curmod)
     {
-        _ldrelocplt(curmod);
+        if (!curmod->prelinked)
+        {
+            _ldrelocplt(curmod);
+            if (curmod != _ldfirst)
+                _ldprelink_save(curmod);
+        }
         curmod = curmod->next;
     }
 
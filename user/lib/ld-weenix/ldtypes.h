@@ -29,10 +29,22 @@ typedef struct ldenv_t
     int ld_debug;
     const char *ld_preload;
     const char *ld_library_path;
+    const char *ld_prelink_cache; /* directory of prelink images, or NULL */
 } ldenv_t;
 
 extern ldenv_t _ldenv;
 
+/* The most writable segments of a module the prelink cache deals with */
+#define LD_MAXWSEGS 4
+
+/* A writable segment of a module, page-aligned */
+typedef struct ldseg
+{
+    unsigned long addr;
+    unsigned long len;
+    int prot;
+} ldseg_t;
+
 typedef struct module
 {
     char *name;    /* the filename                 */
@@ -55,6 +67,14 @@ typedef struct module
     struct module *next;  /* the next module in the chain */
     struct module *first; /* the first module             */
     Elf64_Addr *pltgot;   /* base of plt                  */
+    Elf64_Word *gnuhash;  /* GNU hash table, if any       */
+
+    /* identity of the file and layout of the writable segments, which
+     * is what the prelink cache needs (see ldprelink.c) */
+    int dev, ino, fsize, mtime;
+    ldseg_t wsegs[LD_MAXWSEGS];
+    int nwsegs;    /* -1 if the module cannot be prelinked */
+    int prelinked; /* relocated data came from the prelink cache */
 } module_t;
 
 #endif /* _ldtypes.h_ */
@@ -70,3 +70,16 @@ unsigned long _ldelfhash(const char *name)
 
     return h;
 }
+
+/* This is the hash used by GNU hash tables (DT_GNU_HASH): Bernstein's
+ * h * 33 + c */
+
+uint32_t _ldgnuhash(const char *name)
+{
+    uint32_t h = 5381;
+
+    while (*name)
+        h = h * 33 + (unsigned char)*name++;
+
+    return h;
+}
@@ -13,6 +13,9 @@
 #ifndef _ldutil_h_
 #define _ldutil_h_
 #include "ldtypes.h"
+
+struct stat;
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -22,7 +25,9 @@ extern "C"
     int _ldzero();
 
     unsigned long _ldelfhash(const char *name);
-    int _ldtryopen(const char *filename, const char *path);
+    uint32_t _ldgnuhash(const char *name);
+    int _ldtryopen(const char *filename, const char *path,
+                   struct stat *st);
     void _ldmapsect(int fd, unsigned long baseaddr, Elf64_Phdr *phdr, int textrel);
     void _ldloadobj(module_t *module);
     void _ldrelocobj(module_t *module);
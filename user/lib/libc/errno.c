@@ -1,3 +0,0 @@
-#include <errno.h>
-
-int _libc_errno;
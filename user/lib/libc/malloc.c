@@ -1,13 +1,30 @@
 /*
- * ----------------------------------------------------------------------------
- * "THE BEER-WARE LICENSE" (Revision 42):
- * <phk@FreeBSD.ORG> wrote this file.  As long as you retain this notice you
- * can do whatever you want with this stuff. If we meet some day, and you think
- * this stuff is worth it, you can buy me a beer in return.   Poul-Henning Kamp
- * ----------------------------------------------------------------------------
+ * A size-class allocator with per-thread caches.
  *
+ * Requests of up to MALLOC_SMALL_MAX bytes are rounded up to one of
+ * MALLOC_NCLASSES size classes, four to each doubling of size above 128
+ * bytes, and carved out of MALLOC_SPAN_SIZE-byte spans, each holding objects
+ * of one class behind a span_t header. Spans come from the brk heap, which
+ * is grown MALLOC_BRK_GROW bytes at a time and aligned to the span size, so
+ * that an object's span is found by masking its address. Larger requests
+ * are mmap()ed on their own, behind a large_t header, and munmap()ed when
+ * freed.
+ *
+ * Each thread keeps, for each class, a short list of free objects which
+ * malloc() and free() use without locking. Only when a list runs dry or
+ * overflows is half a list's worth moved from or to the spans, under the
+ * heap lock. Spans whose objects are all free are kept for reuse; past
+ * MALLOC_SPANS_KEEP of them, those at the top of the heap are given back by
+ * lowering the break, and the rest have their pages dropped with madvise().
+ *
+ * There is no thread-local storage, so a thread's cache is found by its
+ * stack: thr_create() registers the stack of each new thread, and a thread
+ * whose stack pointer is in none of them is the main thread. Until the first
+ * thread is created, nothing is locked at all.
  */
-#include "fcntl.h"
+
+#include "errno.h"
+#include "futex.h"
 #include "stddef.h"
 #include "stdlib.h"
 #include "string.h"
@@ -15,1312 +32,613 @@
 #include "sys/types.h"
 #include "unistd.h"
 
-#define __inline__ inline
-
-/* Necessary BSD types and functions */
-typedef unsigned short u_short;
-typedef unsigned char u_char;
-typedef unsigned int u_int;
-typedef unsigned long u_long;
-#define _open open
-#define _write write
-
-/*
- * Defining EXTRA_SANITY will enable extra checks which are related
- * to internal conditions and consistency in malloc.c. This has a
- * noticeable runtime performance hit, and generally will not do you
- * any good unless you fiddle with the internals of malloc or want
- * to catch random pointer corruption as early as possible.
- */
-#ifndef MALLOC_EXTRA_SANITY
-#undef MALLOC_EXTRA_SANITY
-#endif
+#define MALLOC_PAGE_SIZE 4096UL
+#define MALLOC_ALIGN 16UL
 
-/*
- * What to use for Junk.  This is the byte value we use to fill with
- * when the 'J' option is enabled.
- */
-#define SOME_JUNK 0xd0 /* as in "Duh" :-) */
+#define MALLOC_SPAN_SHIFT 16
+#define MALLOC_SPAN_SIZE (1UL << MALLOC_SPAN_SHIFT)
+#define MALLOC_BRK_GROW (4 * MALLOC_SPAN_SIZE)
+#define MALLOC_SPANS_KEEP 4
 
-/*
- * The basic parameters you can tweak.
- *
- * malloc_pageshift     pagesize = 1 << malloc_pageshift
- *                      It's probably best if this is the native
- *                      page size, but it doesn't have to be.
- *
- * malloc_minsize       minimum size of an allocation in bytes.
- *                      If this is too small it's too much work
- *                      to manage them.  This is also the smallest
- *                      unit of alignment used for the storage
- *                      returned by malloc/realloc.
- *
- */
-#define malloc_pageshift 12U
-#define malloc_minsize 16U
+#define MALLOC_SMALL_MAX 16384UL
+#define MALLOC_NCLASSES 36
 
-static int fdzero;
-#define MMAP_FD fdzero
-#define INIT_MMAP()                                            \
-    {                                                          \
-        if ((fdzero = _open("/dev/zero", O_RDWR, 0000)) == -1) \
-            wrterror("open of /dev/zero");                     \
-    }
-#define MADV_FREE MADV_DONTNEED
+#define MALLOC_CACHE_BYTES 32768UL
+#define MALLOC_CACHE_MIN 4
+#define MALLOC_CACHE_MAX 64
 
-/*
- * No user serviceable parts behind this point.
- */
+#define MALLOC_THREADS 32
 
-/*
- * This structure describes a page worth of chunks.
- */
+#define SPAN_OF(p) ((span_t *)((uintptr_t)(p) & ~(MALLOC_SPAN_SIZE - 1)))
 
-struct pginfo
+typedef struct span
 {
-    struct pginfo *next; /* next on the free list */
-    void *page;          /* Pointer to the page */
-    u_short size;        /* size of this page's chunks */
-    u_short shift;       /* How far to shift for this size chunks */
-    u_short free;        /* How many free chunks */
-    u_short total;       /* How many chunk */
-    u_int bits[1];       /* Which chunks are free */
-};
-
-/*
- * This structure describes a number of free pages.
- */
-
-struct pgfree
+    size_t sp_class;       /* index of the size class of the objects */
+    size_t sp_inuse;       /* objects handed out, thread caches included */
+    size_t sp_total;       /* objects the span holds */
+    void *sp_free;         /* freed objects, linked through their first word */
+    char *sp_bump;         /* first object never handed out */
+    struct span *sp_next;  /* on its class's partial list or the free list */
+    struct span *sp_prev;
+    int sp_listed;         /* whether it is on one of those lists */
+    int sp_released;       /* whether its pages were dropped with madvise() */
+} span_t;
+
+/* Objects start after the header, at a multiple of MALLOC_ALIGN */
+#define SPAN_HEADER ((sizeof(span_t) + MALLOC_ALIGN - 1) & ~(MALLOC_ALIGN - 1))
+
+typedef struct large
 {
-    struct pgfree *next; /* next run of free pages */
-    struct pgfree *prev; /* prev run of free pages */
-    void *page;          /* pointer to free pages */
-    void *end;           /* pointer to end of free pages */
-    size_t size;         /* number of bytes free */
-};
-
-/*
- * How many bits per u_int in the bitmap.
- * Change only if not 8 bits/byte
- */
-#define MALLOC_BITS (8 * sizeof(u_int))
-
-/*
- * Magic values to put in the page_directory
- */
-#define MALLOC_NOT_MINE ((struct pginfo *)0)
-#define MALLOC_FREE ((struct pginfo *)1)
-#define MALLOC_FIRST ((struct pginfo *)2)
-#define MALLOC_FOLLOW ((struct pginfo *)3)
-#define MALLOC_MAGIC ((struct pginfo *)4)
-
-#ifndef malloc_pageshift
-#define malloc_pageshift 12U
-#endif
-
-#ifndef malloc_minsize
-#define malloc_minsize 16U
-#endif
-
-#if !defined(malloc_pagesize)
-#define malloc_pagesize (1UL << malloc_pageshift)
-#endif
-
-#if ((1 << malloc_pageshift) != malloc_pagesize)
-#error "(1<<malloc_pageshift) != malloc_pagesize"
-#endif
-
-#ifndef malloc_maxsize
-#define malloc_maxsize ((malloc_pagesize) >> 1)
-#endif
-
-/* A mask for the offset inside a page.  */
-#define malloc_pagemask ((malloc_pagesize)-1)
-
-#define pageround(foo) (((foo) + (malloc_pagemask)) & (~(malloc_pagemask)))
-#define ptr2index(foo) (((u_long)(foo) >> malloc_pageshift) - malloc_origo)
-
-#ifndef THREAD_LOCK
-#define THREAD_LOCK()
-#endif
-
-#ifndef THREAD_UNLOCK
-#define THREAD_UNLOCK()
-#endif
-
-#ifndef MMAP_FD
-#define MMAP_FD (-1)
-#endif
-
-#ifndef INIT_MMAP
-#define INIT_MMAP()
-#endif
-
-/* Set when initialization has been done */
-static unsigned malloc_started;
-
-/* Recusion flag for public interface. */
-static int malloc_active;
-
-/* Number of free pages we cache */
-static unsigned malloc_cache = 16;
-
-/* The offset from pagenumber to index into the page directory */
-static u_long malloc_origo;
-
-/* The last index in the page directory we care about */
-static u_long last_index;
-
-/* Pointer to page directory. Allocated "as if with" malloc */
-static struct pginfo **page_dir;
-
-/* How many slots in the page directory */
-static unsigned malloc_ninfo;
+    size_t lg_len; /* length of the mapping */
+    size_t lg_pad;
+} large_t;
 
-/* Free pages line up here */
-static struct pgfree free_list;
-
-/* Abort(), user doesn't handle problems.  */
-static int malloc_abort;
-
-/* Are we trying to die ?  */
-static int suicide;
-
-/* always realloc ?  */
-static int malloc_realloc;
-
-/* pass the kernel a hint on free pages ?  */
-static int malloc_hint = 0;
-
-/* xmalloc behaviour ?  */
-static int malloc_xmalloc;
-
-/* sysv behaviour for malloc(0) ?  */
-static int malloc_sysv;
-
-/* zero fill ?  */
-static int malloc_zero;
-
-/* junk fill ?  */
-static int malloc_junk;
-
-#ifdef HAS_UTRACE
-
-/* utrace ?  */
-static int malloc_utrace;
-
-struct ut
+typedef struct malloc_cache
 {
-    void *p;
-    size_t s;
-    void *r;
-};
-
-void utrace __P((struct ut *, int));
-
-#define UTRACE(a, b, c)       \
-    if (malloc_utrace)        \
-    {                         \
-        struct ut u;          \
-        u.p = a;              \
-        u.s = b;              \
-        u.r = c;              \
-        utrace(&u, sizeof u); \
-    }
-#else /* !HAS_UTRACE */
-#define UTRACE(a, b, c)
-#endif /* HAS_UTRACE */
-
-/* my last break. */
-static void *malloc_brk;
-
-/* one location cache for free-list holders */
-static struct pgfree *px;
-
-/* compile-time options */
-char *malloc_options;
-typedef char *caddr_t;
-/* Name of the current public function */
-static char *malloc_func;
-
-/* Macro for mmap */
-#define MMAP(size) \
-    mmap(0, (size), PROT_READ | PROT_WRITE, MAP_PRIVATE, MMAP_FD, 0);
-
-/*
- * Necessary function declarations
- */
-static int extend_pgdir(u_long index);
-
-static void *imalloc(size_t size);
-
-static void ifree(void *ptr);
-
-static void *irealloc(void *ptr, size_t size);
+    void *mc_objs[MALLOC_NCLASSES]; /* linked through their first word */
+    size_t mc_count[MALLOC_NCLASSES];
+    char *mc_stack_lo; /* the owning thread's stack, or NULL if unused */
+    char *mc_stack_hi;
+} malloc_cache_t;
 
-#ifdef HAS_PROGNAME
-extern char *__progname;
-#else
-static char *__progname = "";
-#endif
-
-#ifndef HAS_ABORT
-#define abort() exit(1)
-#endif
-
-static void wrterror(char *p)
+typedef struct span_list
 {
-    char *q = " error: ";
-    _write(STDERR_FILENO, __progname, strlen(__progname));
-    _write(STDERR_FILENO, malloc_func, strlen(malloc_func));
-    _write(STDERR_FILENO, q, strlen(q));
-    _write(STDERR_FILENO, p, strlen(p));
-    suicide = 1;
-    abort();
-}
+    span_t *sl_head;
+    size_t sl_count;
+} span_list_t;
 
-static void wrtwarning(char *p)
-{
-    char *q = " warning: ";
-    if (malloc_abort)
-    {
-        wrterror(p);
-    }
-    _write(STDERR_FILENO, __progname, strlen(__progname));
-    _write(STDERR_FILENO, malloc_func, strlen(malloc_func));
-    _write(STDERR_FILENO, q, strlen(q));
-    _write(STDERR_FILENO, p, strlen(p));
-}
+static size_t class_sizes[MALLOC_NCLASSES];
 
-/*
- * Allocate a number of pages from the OS
- */
-static void *map_pages(int pages)
-{
-    caddr_t result, tail;
+/* Spans of each class with some objects free */
+static span_list_t spans_partial[MALLOC_NCLASSES];
 
-    result = (caddr_t)pageround((u_long)sbrk(0));
-    tail = result + (pages << malloc_pageshift);
+/* Spans with every object free */
+static span_list_t spans_free;
 
-    if (brk(tail))
-    {
-#ifdef EXTRA_SANITY
-        wrterror("(ES): map_pages fails\n");
-#endif /* EXTRA_SANITY */
-        return 0;
-    }
+static char *heap_base;
+static char *heap_top;
+/* Start of the part of the heap the break has moved through contiguously,
+ * which is all that heap_trim() may give back */
+static char *heap_floor;
 
-    last_index = ptr2index(tail) - 1;
-    malloc_brk = tail;
+/* Protects the spans, the heap and the thread caches' stacks */
+static int heap_lock;
 
-    if ((last_index + 1) >= malloc_ninfo && !extend_pgdir(last_index))
-    {
-        return 0;
-    };
+static int malloc_threaded;
 
-    return result;
-}
+/* Set once a thread was created without a cache of its own, after which it
+ * shares main_cache with the main thread */
+static int main_cache_shared;
+
+static malloc_cache_t main_cache;
+static malloc_cache_t thread_caches[MALLOC_THREADS];
 
 /*
- * Extend page directory
+ * A futex mutex: 0 is unlocked, 1 locked, 2 locked with (possible) waiters.
  */
-static int extend_pgdir(u_long index)
+static void malloc_lock(int *lock)
 {
-    struct pginfo **new, **old;
-    int i, oldlen;
-
-    /* Make it this many pages */
-    i = index * sizeof *page_dir;
-    i /= malloc_pagesize;
-    i += 2;
-
-    /* remember the old mapping size */
-    oldlen = malloc_ninfo * sizeof *page_dir;
-
-    /*
-     * NOTE: we allocate new pages and copy the directory rather than tempt
-     * fate by trying to "grow" the region.. There is nothing to prevent
-     * us from accidently re-mapping space that's been allocated by our caller
-     * via dlopen() or other mmap().
-     *
-     * The copy problem is not too bad, as there is 4K of page index per
-     * 4MB of malloc arena.
-     *
-     * We can totally avoid the copy if we open a file descriptor to associate
-     * the anon mappings with.  Then, when we remap the pages at the new
-     * address, the old pages will be "magically" remapped..  But this means
-     * keeping open a "secret" file descriptor.....
-     */
-
-    /* Get new pages */
-    new = (struct pginfo **)MMAP(i * malloc_pagesize);
-    if (new == (struct pginfo **)-1)
+    if (!malloc_threaded)
     {
-        return 0;
+        return;
     }
-
-    /* Copy the old stuff */
-    memcpy(new, page_dir, malloc_ninfo * sizeof *page_dir);
-
-    /* register the new size */
-    malloc_ninfo = i * malloc_pagesize / sizeof *page_dir;
-
-    /* swap the pointers */
-    old = page_dir;
-    page_dir = new;
-
-    /* Now free the old stuff */
-    munmap((char *)old, oldlen);
-    return 1;
-}
-
-/*
- * Initialize the world
- */
-static void malloc_init()
-{
-    char *p;
-    int i, j;
-
-    INIT_MMAP();
-
-#ifdef EXTRA_SANITY
-    malloc_junk = 1;
-#endif /* EXTRA_SANITY */
-
-    for (i = 0; i < 3; i++)
+    int c = __sync_val_compare_and_swap(lock, 0, 1);
+    if (c)
     {
-        if (i == 0)
-        {
-#ifdef HAS_READLINK
-            errnosave = errno;
-            j = readlink("/etc/malloc.conf", b, sizeof b - 1);
-            errno = errnosave;
-            if (j <= 0)
-                continue;
-            b[j] = '\0';
-            p = b;
-#else
-            p = NULL;
-#endif
-        }
-        else if (i == 1)
-        {
-#ifdef HAS_GETENV
-            p = getenv("MALLOC_OPTIONS");
-#else
-            p = NULL;
-#endif
-        }
-        else
+        if (c != 2)
         {
-            p = malloc_options;
+            c = __sync_lock_test_and_set(lock, 2);
         }
-        for (; p && *p; p++)
+        while (c)
         {
-            switch (*p)
-            {
-            case '>':
-                malloc_cache <<= 1;
-                break;
-            case '<':
-                malloc_cache >>= 1;
-                break;
-            case 'a':
-                malloc_abort = 0;
-                break;
-            case 'A':
-                malloc_abort = 1;
-                break;
-            case 'h':
-                malloc_hint = 0;
-                break;
-            case 'H':
-                malloc_hint = 1;
-                break;
-            case 'r':
-                malloc_realloc = 0;
-                break;
-            case 'R':
-                malloc_realloc = 1;
-                break;
-            case 'j':
-                malloc_junk = 0;
-                break;
-            case 'J':
-                malloc_junk = 1;
-                break;
-#ifdef HAS_UTRACE
-            case 'u':
-                malloc_utrace = 0;
-                break;
-            case 'U':
-                malloc_utrace = 1;
-                break;
-#endif
-            case 'v':
-                malloc_sysv = 0;
-                break;
-            case 'V':
-                malloc_sysv = 1;
-                break;
-            case 'x':
-                malloc_xmalloc = 0;
-                break;
-            case 'X':
-                malloc_xmalloc = 1;
-                break;
-            case 'z':
-                malloc_zero = 0;
-                break;
-            case 'Z':
-                malloc_zero = 1;
-                break;
-            default:
-                j = malloc_abort;
-                malloc_abort = 0;
-                wrtwarning("unknown char in MALLOC_OPTIONS\n");
-                malloc_abort = j;
-                break;
-            }
+            futex(lock, FUTEX_WAIT, 2);
+            c = __sync_lock_test_and_set(lock, 2);
         }
     }
-
-    UTRACE(0, 0, 0);
-
-    /*
-     * We want junk in the entire allocation, and zero only in the part
-     * the user asked for.
-     */
-    if (malloc_zero)
-    {
-        malloc_junk = 1;
-    }
-
-    /*
-     * If we run with junk (or implicitly from above: zero), we want to
-     * force realloc() to get new storage, so we can DTRT with it.
-     */
-    if (malloc_junk)
-    {
-        malloc_realloc = 1;
-    }
-
-    /* Allocate one page for the page directory */
-    page_dir = (struct pginfo **)MMAP(malloc_pagesize);
-
-    if (page_dir == (struct pginfo **)-1)
-    {
-        wrterror("mmap(2) failed, check limits\n");
-    }
-
-    /*
-     * We need a maximum of malloc_pageshift buckets, steal these from the
-     * front of the page_directory;
-     */
-    malloc_origo = ((u_long)pageround((u_long)sbrk(0))) >> malloc_pageshift;
-    malloc_origo -= malloc_pageshift;
-
-    malloc_ninfo = malloc_pagesize / sizeof *page_dir;
-
-    /* Recalculate the cache size in bytes, and make sure it's nonzero */
-
-    if (!malloc_cache)
-    {
-        malloc_cache++;
-    }
-
-    malloc_cache <<= malloc_pageshift;
-
-    /*
-     * This is a nice hack from Kaleb Keithly (kaleb@x.org).
-     * We can sbrk(2) further back when we keep this on a low address.
-     */
-    px = (struct pgfree *)imalloc(sizeof *px);
-
-    /* Been here, done that */
-    malloc_started++;
 }
 
-/*
- * Allocate a number of complete pages
- */
-static void *malloc_pages(size_t size)
+static void malloc_unlock(int *lock)
 {
-    void *p, *delay_free = 0;
-    unsigned int i;
-    struct pgfree *pf;
-    u_long index;
-
-    size = pageround(size);
-
-    p = 0;
-
-    /* Look for free pages before asking for more */
-    for (pf = free_list.next; pf; pf = pf->next)
-    {
-#ifdef EXTRA_SANITY
-        if (pf->size & malloc_pagemask)
-            wrterror("(ES): junk length entry on free_list\n");
-        if (!pf->size)
-            wrterror("(ES): zero length entry on free_list\n");
-        if (pf->page == pf->end)
-            wrterror("(ES): zero entry on free_list\n");
-        if (pf->page > pf->end)
-            wrterror("(ES): sick entry on free_list\n");
-        if ((void *)pf->page >= (void *)sbrk(0))
-            wrterror("(ES): entry on free_list past brk\n");
-        if (page_dir[ptr2index(pf->page)] != MALLOC_FREE)
-            wrterror("(ES): non-free first page on free-list\n");
-        if (page_dir[ptr2index(pf->end) - 1] != MALLOC_FREE)
-            wrterror("(ES): non-free last page on free-list\n");
-#endif /* EXTRA_SANITY */
-
-        if (pf->size < size)
-        {
-            continue;
-        }
-
-        if (pf->size == size)
-        {
-            p = pf->page;
-            if (pf->next)
-            {
-                pf->next->prev = pf->prev;
-            }
-            pf->prev->next = pf->next;
-            delay_free = pf;
-            break;
-        }
-
-        p = pf->page;
-        pf->page = (char *)pf->page + size;
-        pf->size -= size;
-        break;
-    }
-
-#ifdef EXTRA_SANITY
-    if (p && page_dir[ptr2index(p)] != MALLOC_FREE)
-        wrterror("(ES): allocated non-free page on free-list\n");
-#endif /* EXTRA_SANITY */
-
-    size >>= malloc_pageshift;
-
-    /* Map new pages */
-    if (!p)
-    {
-        p = map_pages(size);
-    }
-
-    if (p)
+    if (!malloc_threaded)
     {
-        index = ptr2index(p);
-        page_dir[index] = MALLOC_FIRST;
-        for (i = 1; i < size; i++)
-        {
-            page_dir[index + i] = MALLOC_FOLLOW;
-        }
-
-        if (malloc_junk)
-        {
-            memset(p, SOME_JUNK, size << malloc_pageshift);
-        }
+        return;
     }
-
-    if (delay_free)
+    if (__sync_fetch_and_sub(lock, 1) != 1)
     {
-        if (!px)
-        {
-            px = delay_free;
-        }
-        else
-        {
-            ifree(delay_free);
-        }
+        *lock = 0;
+        futex(lock, FUTEX_WAKE, 1);
     }
-
-    return p;
 }
 
-/*
- * Allocate a page of fragments
- */
-
-static __inline__ int malloc_make_chunks(int bits)
+/* 16, 32, ..., 128, then four classes to each doubling: 160, 192, ... */
+static void malloc_init_classes()
 {
-    struct pginfo *bp;
-    void *pp;
-    int i, k, l;
-
-    /* Allocate a new bucket */
-    pp = malloc_pages(malloc_pagesize);
-    if (!pp)
-    {
-        return 0;
-    }
-
-    /* Find length of admin structure */
-    l = offsetof(struct pginfo, bits[0]);
-    l += sizeof bp->bits[0] *
-         (((malloc_pagesize >> bits) + MALLOC_BITS - 1) / MALLOC_BITS);
-
-    /* Don't waste more than two chunks on this */
-    if ((1 << bits) <= l + l)
+    size_t c = 0;
+    for (size_t size = MALLOC_ALIGN; size <= 128; size += MALLOC_ALIGN)
     {
-        bp = (struct pginfo *)pp;
+        class_sizes[c++] = size;
     }
-    else
+    for (size_t base = 128; c < MALLOC_NCLASSES; base *= 2)
     {
-        bp = (struct pginfo *)imalloc(l);
-        if (!bp)
+        for (size_t i = 1; i <= 4; i++)
         {
-            ifree(pp);
-            return 0;
+            class_sizes[c++] = base + i * (base / 4);
         }
     }
+}
 
-    bp->size = (1 << bits);
-    bp->shift = bits;
-    bp->total = bp->free = malloc_pagesize >> bits;
-    bp->page = pp;
-
-    /* set all valid bits in the bitmap */
-    k = bp->total;
-    i = 0;
-
-    /* Do a bunch at a time */
-    for (; k - i >= (int)MALLOC_BITS; i += MALLOC_BITS)
-    {
-        bp->bits[i / MALLOC_BITS] = ~0;
-    }
-
-    for (; i < k; i++)
+static size_t size_class(size_t size)
+{
+    if (!class_sizes[0])
     {
-        bp->bits[i / MALLOC_BITS] |= 1 << (i % MALLOC_BITS);
+        malloc_init_classes();
     }
-
-    if (bp == bp->page)
+    if (size <= 128)
     {
-        /* Mark the ones we stole for ourselves */
-        for (i = 0; l > 0; i++)
-        {
-            bp->bits[i / MALLOC_BITS] &= ~(1 << (i % MALLOC_BITS));
-            bp->free--;
-            bp->total--;
-            l -= (1 << bits);
-        }
+        return size ? (size - 1) / MALLOC_ALIGN : 0;
     }
-
-    /* MALLOC_LOCK */
-
-    page_dir[ptr2index(pp)] = bp;
-
-    bp->next = page_dir[bits];
-    page_dir[bits] = bp;
-
-    /* MALLOC_UNLOCK */
-
-    return 1;
+    /* 128 << (order - 1) < size <= 128 << order */
+    size_t order = 64 - __builtin_clzl((size - 1) >> 7);
+    size_t base = 64UL << order;
+    size_t step = base / 4;
+    return 8 + (order - 1) * 4 + (size - base - 1) / step;
 }
 
-/*
- * Allocate a fragment
- */
-static void *malloc_bytes(size_t size)
+static size_t cache_limit(size_t class)
 {
-    int i, j;
-    u_int u;
-    struct pginfo *bp;
-    int k;
-    u_int *lp;
-
-    /* Don't bother with anything less than this */
-    if (size < malloc_minsize)
+    size_t limit = MALLOC_CACHE_BYTES / class_sizes[class];
+    if (limit < MALLOC_CACHE_MIN)
     {
-        size = malloc_minsize;
+        return MALLOC_CACHE_MIN;
     }
+    return limit > MALLOC_CACHE_MAX ? MALLOC_CACHE_MAX : limit;
+}
 
-    /* Find the right bucket */
-    j = 1;
-    i = size - 1;
-    while (i >>= 1)
-        j++;
-
-    /* If it's empty, make a page more of that size chunks */
-    if (!page_dir[j] && !malloc_make_chunks(j))
+static void span_list_insert(span_list_t *list, span_t *sp)
+{
+    sp->sp_prev = NULL;
+    sp->sp_next = list->sl_head;
+    if (list->sl_head)
     {
-        return 0;
+        list->sl_head->sp_prev = sp;
     }
+    list->sl_head = sp;
+    list->sl_count++;
+    sp->sp_listed = 1;
+}
 
-    bp = page_dir[j];
-
-    /* Find first word of bitmap which isn't empty */
-    for (lp = bp->bits; !*lp; lp++)
-        ;
-
-    /* Find that bit, and tweak it */
-    u = 1;
-    k = 0;
-    while (!(*lp & u))
+static void span_list_remove(span_list_t *list, span_t *sp)
+{
+    if (sp->sp_prev)
     {
-        u += u;
-        k++;
+        sp->sp_prev->sp_next = sp->sp_next;
     }
-    *lp ^= u;
-
-    /* If there are no more free, remove from free-list */
-    if (!--bp->free)
+    else
     {
-        page_dir[j] = bp->next;
-        bp->next = 0;
+        list->sl_head = sp->sp_next;
     }
-
-    /* Adjust to the real offset of that chunk */
-    k += (lp - bp->bits) * MALLOC_BITS;
-    k <<= bp->shift;
-
-    if (malloc_junk)
+    if (sp->sp_next)
     {
-        memset((u_char *)bp->page + k, SOME_JUNK, bp->size);
+        sp->sp_next->sp_prev = sp->sp_prev;
     }
-
-    return (u_char *)bp->page + k;
+    list->sl_count--;
+    sp->sp_listed = 0;
 }
 
 /*
- * Allocate a piece of memory
+ * Moves the break up by MALLOC_BRK_GROW bytes (more the first time, to align
+ * the heap to the span size) and puts the new spans on the free list. Called
+ * with heap_lock held. Returns 0, or -1 if there is no memory.
  */
-static void *imalloc(size_t size)
+static int heap_grow()
 {
-    void *result;
-
-    if (suicide)
-        abort();
-
-    if ((size + malloc_pagesize) < size)
-    { /* Check for overflow */
-        result = 0;
+    char *brk_now = sbrk(0);
+    if (brk_now == (char *)-1)
+    {
+        return -1;
     }
-    else if (size <= malloc_maxsize)
+    /* the break is not on a span boundary the first time, nor if someone
+     * else has moved it since */
+    char *start = (char *)(((uintptr_t)brk_now + MALLOC_SPAN_SIZE - 1) &
+                           ~(MALLOC_SPAN_SIZE - 1));
+    if (sbrk((start - brk_now) + MALLOC_BRK_GROW) == (void *)-1)
     {
-        result = malloc_bytes(size);
+        return -1;
     }
-    else
+    if (!heap_base)
     {
-        result = malloc_pages(size);
+        heap_base = start;
     }
-
-    if (malloc_abort && !result)
+    if (start != heap_top)
     {
-        wrterror("allocation failed.\n");
+        heap_floor = start;
     }
-
-    if (malloc_zero && result)
+    heap_top = start + MALLOC_BRK_GROW;
+    for (char *s = start; s < heap_top; s += MALLOC_SPAN_SIZE)
     {
-        memset(result, 0, size);
+        span_t *sp = (span_t *)s;
+        sp->sp_released = 0;
+        span_list_insert(&spans_free, sp);
     }
-
-    return result;
+    return 0;
 }
 
 /*
- * Change the size of an allocation.
+ * Gives back all but MALLOC_SPANS_KEEP free spans: those at the top of the
+ * heap by lowering the break, the rest by dropping their pages, which read
+ * as zeroes if the span is used again. Called with heap_lock held.
  */
-static void *irealloc(void *ptr, size_t size)
+static void heap_trim()
 {
-    void *p;
-    u_long osize, index;
-    struct pginfo **mp;
-    int i;
-
-    if (suicide)
-        abort();
-
-    index = ptr2index(ptr);
-
-    if (index < malloc_pageshift)
+    if (spans_free.sl_count <= 2 * MALLOC_SPANS_KEEP)
     {
-        wrtwarning("junk pointer, too low to make sense.\n");
-        return 0;
+        return;
     }
-
-    if (index > last_index)
+    while (spans_free.sl_count > MALLOC_SPANS_KEEP && heap_top > heap_floor &&
+           sbrk(0) == heap_top)
     {
-        wrtwarning("junk pointer, too high to make sense.\n");
-        return 0;
-    }
-
-    mp = &page_dir[index];
-
-    if (*mp == MALLOC_FIRST)
-    { /* Page allocation */
-
-        /* Check the pointer */
-        if ((u_long)ptr & malloc_pagemask)
-        {
-            wrtwarning("modified (page-) pointer.\n");
-            return 0;
-        }
-
-        /* Find the size in bytes */
-        for (osize = malloc_pagesize; *++mp == MALLOC_FOLLOW;)
+        span_t *top = (span_t *)(heap_top - MALLOC_SPAN_SIZE);
+        if (!top->sp_listed || top->sp_inuse)
         {
-            osize += malloc_pagesize;
-        }
-
-        if (!malloc_realloc && /* unless we have to, */
-            size <= osize &&   /* .. or are too small, */
-            size > (osize - malloc_pagesize))
-        {               /* .. or can free a page, */
-            return ptr; /* don't do anything. */
+            break;
         }
+        span_list_remove(&spans_free, top);
+        sbrk(-(intptr_t)MALLOC_SPAN_SIZE);
+        heap_top -= MALLOC_SPAN_SIZE;
     }
-    else if (*mp >= MALLOC_MAGIC)
-    { /* Chunk allocation */
-
-        /* Check the pointer for sane values */
-        if (((u_long)ptr & ((*mp)->size - 1)))
+    size_t keep = MALLOC_SPANS_KEEP;
+    for (span_t *sp = spans_free.sl_head; sp; sp = sp->sp_next)
+    {
+        if (keep)
         {
-            wrtwarning("modified (chunk-) pointer.\n");
-            return 0;
+            keep--;
         }
-
-        /* Find the chunk index in the page */
-        i = ((u_long)ptr & malloc_pagemask) >> (*mp)->shift;
-
-        /* Verify that it isn't a free chunk already */
-        if ((*mp)->bits[i / MALLOC_BITS] & (1 << (i % MALLOC_BITS)))
+        else if (!sp->sp_released)
         {
-            wrtwarning("chunk is already free.\n");
-            return 0;
-        }
-
-        osize = (*mp)->size;
-
-        if (!malloc_realloc &&   /* Unless we have to, */
-            size < osize &&      /* ..or are too small, */
-            (size > osize / 2 || /* ..or could use a smaller size, */
-             osize == malloc_minsize))
-        {               /* ..(if there is one) */
-            return ptr; /* ..Don't do anything */
+            madvise((char *)sp + MALLOC_PAGE_SIZE,
+                    MALLOC_SPAN_SIZE - MALLOC_PAGE_SIZE, MADV_DONTNEED);
+            sp->sp_released = 1;
         }
     }
-    else
+}
+
+/* Takes a free span for class, or returns NULL. Called with heap_lock held. */
+static span_t *span_alloc(size_t class)
+{
+    if (!spans_free.sl_head && heap_grow())
     {
-        wrtwarning("pointer to wrong page.\n");
-        return 0;
+        return NULL;
     }
+    span_t *sp = spans_free.sl_head;
+    span_list_remove(&spans_free, sp);
+    sp->sp_class = class;
+    sp->sp_inuse = 0;
+    sp->sp_total = (MALLOC_SPAN_SIZE - SPAN_HEADER) / class_sizes[class];
+    sp->sp_free = NULL;
+    sp->sp_bump = (char *)sp + SPAN_HEADER;
+    sp->sp_released = 0;
+    span_list_insert(&spans_partial[class], sp);
+    return sp;
+}
 
-    p = imalloc(size);
-
-    if (p)
+/*
+ * Takes up to n objects of class from the spans, linked through their first
+ * words into *objs. Returns how many it took. Called with heap_lock held.
+ */
+static size_t spans_take(size_t class, size_t n, void **objs)
+{
+    size_t size = class_sizes[class];
+    size_t got = 0;
+    while (got < n)
     {
-        /* copy the lesser of the two sizes, and free the old one */
-        if (!size || !osize)
+        span_t *sp = spans_partial[class].sl_head;
+        if (!sp && !(sp = span_alloc(class)))
         {
+            break;
         }
-        else if (osize < size)
+        while (got < n && sp->sp_inuse < sp->sp_total)
         {
-            memcpy(p, ptr, osize);
+            void *obj = sp->sp_free;
+            if (obj)
+            {
+                sp->sp_free = *(void **)obj;
+            }
+            else
+            {
+                obj = sp->sp_bump;
+                sp->sp_bump += size;
+            }
+            *(void **)obj = *objs;
+            *objs = obj;
+            sp->sp_inuse++;
+            got++;
         }
-        else
+        if (sp->sp_inuse == sp->sp_total)
         {
-            memcpy(p, ptr, size);
+            span_list_remove(&spans_partial[class], sp);
         }
-        ifree(ptr);
     }
-    return p;
+    return got;
 }
 
-/*
- * Free a sequence of pages
- */
-
-static __inline__ void free_pages(void *ptr, int index, struct pginfo *info)
+/* Returns obj to its span. Called with heap_lock held. */
+static void spans_put(void *obj)
 {
-    unsigned int i;
-    struct pgfree *pf, *pt = 0;
-    u_long l;
-    void *tail;
-
-    if (info == MALLOC_FREE)
-    {
-        wrtwarning("page is already free.\n");
-        return;
-    }
-
-    if (info != MALLOC_FIRST)
+    span_t *sp = SPAN_OF(obj);
+    size_t class = sp->sp_class;
+    *(void **)obj = sp->sp_free;
+    sp->sp_free = obj;
+    if (sp->sp_inuse-- == sp->sp_total)
     {
-        wrtwarning("pointer to wrong page.\n");
-        return;
+        span_list_insert(&spans_partial[class], sp);
     }
-
-    if ((u_long)ptr & malloc_pagemask)
+    if (!sp->sp_inuse)
     {
-        wrtwarning("modified (page-) pointer.\n");
-        return;
+        span_list_remove(&spans_partial[class], sp);
+        span_list_insert(&spans_free, sp);
     }
+}
 
-    /* Count how many pages and mark them free at the same time */
-    page_dir[index] = MALLOC_FREE;
-    for (i = 1; page_dir[index + i] == MALLOC_FOLLOW; i++)
+/* Returns n objects of class from the head of mc's list to the spans. Called
+ * with heap_lock held. */
+static void cache_drain(malloc_cache_t *mc, size_t class, size_t n)
+{
+    while (n-- && mc->mc_objs[class])
     {
-        page_dir[index + i] = MALLOC_FREE;
+        void *obj = mc->mc_objs[class];
+        mc->mc_objs[class] = *(void **)obj;
+        mc->mc_count[class]--;
+        spans_put(obj);
     }
+}
 
-    l = i << malloc_pageshift;
-
-    if (malloc_junk)
+static void cache_drain_all(malloc_cache_t *mc)
+{
+    for (size_t class = 0; class < MALLOC_NCLASSES; class++)
     {
-        memset(ptr, SOME_JUNK, l);
+        cache_drain(mc, class, mc->mc_count[class]);
     }
+}
 
-#ifdef HAS_MADVISE
-    if (malloc_hint)
-        madvise(ptr, l, MADV_FREE);
-#endif
-
-    tail = (char *)ptr + l;
-
-    /* add to free-list */
-    if (!px)
-    {
-        px = imalloc(sizeof *pt);
-    } /* This cannot fail... */
-    px->page = ptr;
-    px->end = tail;
-    px->size = l;
-    if (!free_list.next)
+/*
+ * The calling thread's cache, found by its stack pointer. *shared is set if
+ * other threads may be using it too, so it must be locked.
+ */
+static malloc_cache_t *cache_get(int *shared)
+{
+    *shared = 0;
+    if (!malloc_threaded)
     {
-        /* Nothing on free list, put this at head */
-        px->next = free_list.next;
-        px->prev = &free_list;
-        free_list.next = px;
-        pf = px;
-        px = 0;
+        return &main_cache;
     }
-    else
+    char *sp = (char *)&shared;
+    for (size_t i = 0; i < MALLOC_THREADS; i++)
     {
-        /* Find the right spot, leave pf pointing to the modified entry. */
-        tail = (char *)ptr + l;
-
-        for (pf = free_list.next; pf->end < ptr && pf->next; pf = pf->next)
-            ; /* Race ahead here */
-
-        if (pf->page > tail)
-        {
-            /* Insert before entry */
-            px->next = pf;
-            px->prev = pf->prev;
-            pf->prev = px;
-            px->prev->next = px;
-            pf = px;
-            px = 0;
-        }
-        else if (pf->end == ptr)
+        malloc_cache_t *mc = &thread_caches[i];
+        if (mc->mc_stack_lo && sp >= mc->mc_stack_lo && sp < mc->mc_stack_hi)
         {
-            /* Append to the previous entry */
-            pf->end = (char *)pf->end + l;
-            pf->size += l;
-            if (pf->next && pf->end == pf->next->page)
-            {
-                /* And collapse the next too. */
-                pt = pf->next;
-                pf->end = pt->end;
-                pf->size += pt->size;
-                pf->next = pt->next;
-                if (pf->next)
-                    pf->next->prev = pf;
-            }
+            return mc;
         }
-        else if (pf->page == tail)
-        {
-            /* Prepend to entry */
-            pf->size += l;
-            pf->page = ptr;
-        }
-        else if (!pf->next)
-        {
-            /* Append at tail of chain */
-            px->next = 0;
-            px->prev = pf;
-            pf->next = px;
-            pf = px;
-            px = 0;
-        }
-        else
-        {
-            wrterror("freelist is destroyed.\n");
-        }
-    }
-
-    /* Return something to OS ? */
-    if (!pf->next &&               /* If we're the last one, */
-        pf->size > malloc_cache && /* ..and the cache is full, */
-        pf->end == malloc_brk &&   /* ..and none behind us, */
-        malloc_brk == sbrk(0))
-    { /* ..and it's OK to do... */
-
-        /*
-         * Keep the cache intact.  Notice that the '>' above guarantees that
-         * the pf will always have at least one page afterwards.
-         */
-        pf->end = (char *)pf->page + malloc_cache;
-        pf->size = malloc_cache;
-
-        brk(pf->end);
-        malloc_brk = pf->end;
-
-        index = ptr2index(pf->end);
-        last_index = index - 1;
-
-        for (i = index; i <= last_index;)
-            page_dir[i++] = MALLOC_NOT_MINE;
-
-        /* XXX: We could realloc/shrink the pagedir here I guess. */
     }
-    if (pt)
-        ifree(pt);
+    *shared = main_cache_shared;
+    return &main_cache;
 }
 
 /*
- * Free a chunk, and possibly the page it's on, if the page becomes empty.
+ * Gives the new thread about to run on [stack, stack + stacksz) a cache.
+ * Caches whose stacks overlap it belonged to threads that have exited, and
+ * are emptied for reuse.
  */
-
-static __inline__ void free_bytes(void *ptr, int index, struct pginfo *info)
+void __malloc_thread_create(void *stack, size_t stacksz)
 {
-    int i;
-    struct pginfo **mp;
-    void *vp;
-
-    /* Find the chunk number on the page */
-    i = ((u_long)ptr & malloc_pagemask) >> info->shift;
-
-    if (((u_long)ptr & (info->size - 1)))
-    {
-        wrtwarning("modified (chunk-) pointer.\n");
-        return;
+    char *lo = stack;
+    char *hi = lo + stacksz;
+    malloc_threaded = 1;
+    malloc_lock(&heap_lock);
+    malloc_cache_t *slot = NULL;
+    for (size_t i = 0; i < MALLOC_THREADS; i++)
+    {
+        malloc_cache_t *mc = &thread_caches[i];
+        if (mc->mc_stack_lo && lo < mc->mc_stack_hi && mc->mc_stack_lo < hi)
+        {
+            cache_drain_all(mc);
+            mc->mc_stack_lo = mc->mc_stack_hi = NULL;
+        }
+        if (!mc->mc_stack_lo && !slot)
+        {
+            slot = mc;
+        }
     }
-
-    if (info->bits[i / MALLOC_BITS] & (1 << (i % MALLOC_BITS)))
+    if (slot)
     {
-        wrtwarning("chunk is already free.\n");
-        return;
+        slot->mc_stack_hi = hi;
+        __sync_synchronize();
+        slot->mc_stack_lo = lo;
     }
-
-    if (malloc_junk)
+    else
     {
-        memset(ptr, SOME_JUNK, info->size);
+        main_cache_shared = 1;
     }
+    malloc_unlock(&heap_lock);
+}
 
-    info->bits[i / MALLOC_BITS] |= 1 << (i % MALLOC_BITS);
-    info->free++;
-
-    mp = page_dir + info->shift;
-
-    if (info->free == 1)
+/* Returns the exiting thread's cached objects to the spans */
+void __malloc_thread_exit()
+{
+    int shared;
+    malloc_cache_t *mc = cache_get(&shared);
+    if (mc == &main_cache)
     {
-        /* Page became non-full */
-
-        mp = page_dir + info->shift;
-        /* Insert in address order */
-        while (*mp && (*mp)->next && (*mp)->next->page < info->page)
-            mp = &(*mp)->next;
-        info->next = *mp;
-        *mp = info;
         return;
     }
+    malloc_lock(&heap_lock);
+    cache_drain_all(mc);
+    mc->mc_stack_lo = mc->mc_stack_hi = NULL;
+    malloc_unlock(&heap_lock);
+}
 
-    if (info->free != info->total)
+static void *small_alloc(size_t class)
+{
+    int shared;
+    malloc_cache_t *mc = cache_get(&shared);
+    if (shared)
     {
-        return;
+        malloc_lock(&heap_lock);
     }
-
-    /* Find & remove this page in the queue */
-    while (*mp != info)
+    void *obj = mc->mc_objs[class];
+    if (!obj)
     {
-        mp = &((*mp)->next);
-#ifdef EXTRA_SANITY
-        if (!*mp)
-            wrterror("(ES): Not on queue\n");
-#endif /* EXTRA_SANITY */
+        if (!shared)
+        {
+            malloc_lock(&heap_lock);
+        }
+        mc->mc_count[class] +=
+            spans_take(class, cache_limit(class) / 2, &mc->mc_objs[class]);
+        if (!shared)
+        {
+            malloc_unlock(&heap_lock);
+        }
+        obj = mc->mc_objs[class];
     }
-    *mp = info->next;
-
-    /* Free the page & the info structure if need be */
-    page_dir[ptr2index(info->page)] = MALLOC_FIRST;
-    vp = info->page; /* Order is important ! */
-    if (vp != (void *)info)
+    if (obj)
     {
-        ifree(info);
+        mc->mc_objs[class] = *(void **)obj;
+        mc->mc_count[class]--;
     }
-    ifree(vp);
-}
-
-static void ifree(void *ptr)
-{
-    struct pginfo *info;
-    unsigned int index;
-
-    /* This is legal */
-    if (!ptr)
+    if (shared)
     {
-        return;
+        malloc_unlock(&heap_lock);
     }
+    return obj;
+}
 
-    if (!malloc_started)
+static void small_free(void *obj)
+{
+    size_t class = SPAN_OF(obj)->sp_class;
+    int shared;
+    malloc_cache_t *mc = cache_get(&shared);
+    if (shared)
     {
-        wrtwarning("malloc() has never been called.\n");
-        return;
+        malloc_lock(&heap_lock);
     }
-
-    /* If we're already sinking, don't make matters any worse. */
-    if (suicide)
+    *(void **)obj = mc->mc_objs[class];
+    mc->mc_objs[class] = obj;
+    if (++mc->mc_count[class] > cache_limit(class))
     {
-        return;
+        if (!shared)
+        {
+            malloc_lock(&heap_lock);
+        }
+        cache_drain(mc, class, cache_limit(class) / 2);
+        heap_trim();
+        if (!shared)
+        {
+            malloc_unlock(&heap_lock);
+        }
     }
-
-    index = ptr2index(ptr);
-
-    if (index < malloc_pageshift)
+    if (shared)
     {
-        wrtwarning("junk pointer, too low to make sense.\n");
-        return;
+        malloc_unlock(&heap_lock);
     }
+}
 
-    if (index > last_index)
+static void *large_alloc(size_t size)
+{
+    size_t len = (size + sizeof(large_t) + MALLOC_PAGE_SIZE - 1) &
+                 ~(MALLOC_PAGE_SIZE - 1);
+    large_t *lg = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (lg == MAP_FAILED)
     {
-        wrtwarning("junk pointer, too high to make sense.\n");
-        return;
+        return NULL;
     }
+    lg->lg_len = len;
+    return lg + 1;
+}
 
-    info = page_dir[index];
+static int is_small(void *ptr)
+{
+    return (char *)ptr >= heap_base && (char *)ptr < heap_top;
+}
 
-    if (info < MALLOC_MAGIC)
-    {
-        free_pages(ptr, index, info);
-    }
-    else
+/* How many bytes the allocation at ptr can hold */
+static size_t alloc_size(void *ptr)
+{
+    if (is_small(ptr))
     {
-        free_bytes(ptr, index, info);
+        return class_sizes[SPAN_OF(ptr)->sp_class];
     }
-    return;
+    return ((large_t *)ptr - 1)->lg_len - sizeof(large_t);
 }
 
-/*
- * These are the public exported interface routines.
- */
-
 void *malloc(size_t size)
 {
-    register void *r;
-
-    THREAD_LOCK();
-    malloc_func = " in malloc():";
-    if (malloc_active++)
-    {
-        wrtwarning("recursive call.\n");
-        malloc_active--;
-        return (0);
-    }
-    if (!malloc_started)
-    {
-        malloc_init();
-    }
-    if (malloc_sysv && !size)
-    {
-        r = 0;
-    }
-    else
-    {
-        r = imalloc(size);
-    }
-    UTRACE(0, size, r);
-    malloc_active--;
-    THREAD_UNLOCK();
-    if (malloc_xmalloc && !r)
+    void *ptr = size <= MALLOC_SMALL_MAX ? small_alloc(size_class(size))
+                                         : large_alloc(size);
+    if (!ptr)
     {
-        wrterror("out of memory.\n");
+        errno = ENOMEM;
     }
-    return (r);
+    return ptr;
 }
 
 void free(void *ptr)
 {
-    THREAD_LOCK();
-    malloc_func = " in free():";
-    if (malloc_active++)
+    if (!ptr)
     {
-        wrtwarning("recursive call.\n");
-        malloc_active--;
         return;
     }
+    if (is_small(ptr))
+    {
+        small_free(ptr);
+    }
     else
     {
-        ifree(ptr);
-        UTRACE(ptr, 0, 0);
+        large_t *lg = (large_t *)ptr - 1;
+        munmap(lg, lg->lg_len);
     }
-    malloc_active--;
-    THREAD_UNLOCK();
-    return;
 }
 
 void *realloc(void *ptr, size_t size)
 {
-    register void *r;
-
-    THREAD_LOCK();
-    malloc_func = " in realloc():";
-    if (malloc_active++)
-    {
-        wrtwarning("recursive call.\n");
-        malloc_active--;
-        return (0);
-    }
-    if (ptr && !malloc_started)
-    {
-        wrtwarning("malloc() has never been called.\n");
-        ptr = 0;
-    }
-    if (!malloc_started)
-    {
-        malloc_init();
-    }
-    if (malloc_sysv && !size)
+    if (!ptr)
     {
-        ifree(ptr);
-        r = 0;
+        return malloc(size);
     }
-    else if (!ptr)
+    if (!size)
     {
-        r = imalloc(size);
+        free(ptr);
+        return NULL;
     }
-    else
+    size_t old = alloc_size(ptr);
+    /* stay put unless growing, or shrinking a lot */
+    if (size <= old && (size > old / 2 || old <= MALLOC_ALIGN))
     {
-        r = irealloc(ptr, size);
+        return ptr;
     }
-    UTRACE(ptr, size, r);
-    malloc_active--;
-    THREAD_UNLOCK();
-    if (malloc_xmalloc && !r)
+    void *new = malloc(size);
+    if (!new)
     {
-        wrterror("out of memory.\n");
+        return NULL;
     }
-    return (r);
+    memcpy(new, ptr, size < old ? size : old);
+    free(ptr);
+    return new;
 }
 
-/* Added */
 void *calloc(size_t nelem, size_t elsize)
 {
-    void *tmp;
-    if (NULL == (tmp = malloc(nelem * elsize)))
+    size_t size = nelem * elsize;
+    if (elsize && size / elsize != nelem)
     {
+        errno = ENOMEM;
         return NULL;
     }
-    else
+    void *ptr = malloc(size);
+    /* fresh mappings are zeroed already */
+    if (ptr && (size <= MALLOC_SMALL_MAX))
     {
-        memset(tmp, 0, nelem * elsize);
-        return tmp;
+        memset(ptr, 0, size);
     }
+    return ptr;
 }
@@ -0,0 +1,679 @@
+#include "errno.h"
+#include "futex.h"
+#include "limits.h"
+#include "pthread/pthread.h"
+#include "stddef.h"
+#include "sys/mman.h"
+#include "unistd.h"
+
+/* In syscall.c */
+int __thr_create(void *(*func)(void *), void *arg, void *stack, size_t stacksz,
+                 void *tls, int *exit_word);
+int __set_tls(void *base);
+
+/* In malloc.c */
+void __malloc_thread_exit();
+
+#define PTHREAD_PAGE_SIZE 4096UL
+#define PTHREAD_SPIN 100 /* tries at a held mutex before sleeping on it */
+
+#define PT_JOINABLE 0
+#define PT_DETACHED 1
+#define PT_EXITED 2 /* exited while joinable; waiting to be joined */
+
+typedef struct pthread_specific
+{
+    unsigned ps_seq; /* of the key the value was set for */
+    void *ps_value;
+} pthread_specific_t;
+
+typedef struct pthread_cleanup
+{
+    void (*pc_routine)(void *);
+    void *pc_arg;
+} pthread_cleanup_t;
+
+/*
+ * A thread made by pthread_create() lives in one mapping: a guard page, its
+ * stack, and this at the top, which its FS base points to.
+ */
+struct pthread
+{
+    struct pthread *pt_self; /* first, so that pthread_self() reads %fs:0 */
+    int pt_errno;
+    void *(*pt_start)(void *);
+    void *pt_arg;
+    void *pt_retval;
+
+    int pt_running; /* 1, until the kernel clears it as the thread exits */
+    int pt_state;   /* PT_JOINABLE, PT_DETACHED or PT_EXITED */
+    int pt_cancelled;
+
+    void *pt_map; /* NULL for the main thread */
+    size_t pt_mapsize;
+    struct pthread *pt_next; /* on pthread_dead */
+
+    unsigned pt_ncleanups; /* pushed, even those past PTHREAD_CLEANUP_MAX */
+    pthread_cleanup_t pt_cleanups[PTHREAD_CLEANUP_MAX];
+    pthread_specific_t pt_specific[PTHREAD_KEYS_MAX];
+};
+
+/* The main thread cannot be joined, as nothing would tell when it is gone */
+static struct pthread pthread_main = {.pt_self = &pthread_main,
+                                      .pt_running = 1,
+                                      .pt_state = PT_DETACHED};
+
+/* Set once the main thread's FS base points to pthread_main, which is done
+ * before the first thread is made; until then there is only the main thread */
+static int pthread_tls;
+
+/* Detached threads that have exited, to be unmapped once the kernel is done
+ * with their stacks */
+static pthread_mutex_t pthread_dead_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pthread *pthread_dead;
+
+/*
+ * Keys, each with a sequence number bumped whenever its slot is given out,
+ * which pthread_key_t carries too (as seq * PTHREAD_KEYS_MAX + slot); a value
+ * is only the key's if it was set with the same sequence number, so that a
+ * new key starts out NULL in every thread without visiting them all.
+ */
+typedef struct pthread_keyslot
+{
+    unsigned k_seq;
+    int k_used;
+    void (*k_destructor)(void *);
+} pthread_keyslot_t;
+
+static pthread_mutex_t pthread_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_keyslot_t pthread_keys[PTHREAD_KEYS_MAX];
+
+pthread_t pthread_self(void)
+{
+    if (!__atomic_load_n(&pthread_tls, __ATOMIC_ACQUIRE))
+    {
+        return &pthread_main;
+    }
+    struct pthread *self;
+    __asm__("movq %%fs:0, %0" : "=r"(self));
+    return self;
+}
+
+int *__errno_location(void) { return &pthread_self()->pt_errno; }
+
+int pthread_equal(pthread_t t1, pthread_t t2) { return t1 == t2; }
+
+void pthread_yield(void) { sched_yield(); }
+
+int pthread_attr_init(pthread_attr_t *attr)
+{
+    attr->a_stacksize = PTHREAD_STACK_DEFAULT;
+    attr->a_detachstate = PTHREAD_CREATE_JOINABLE;
+    return 0;
+}
+
+int pthread_attr_destroy(pthread_attr_t *attr) { return 0; }
+
+int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize)
+{
+    if (stacksize < PTHREAD_STACK_MIN)
+    {
+        return EINVAL;
+    }
+    attr->a_stacksize = stacksize;
+    return 0;
+}
+
+int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize)
+{
+    *stacksize = attr->a_stacksize;
+    return 0;
+}
+
+int pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate)
+{
+    if (detachstate != PTHREAD_CREATE_JOINABLE &&
+        detachstate != PTHREAD_CREATE_DETACHED)
+    {
+        return EINVAL;
+    }
+    attr->a_detachstate = detachstate;
+    return 0;
+}
+
+int pthread_attr_getdetachstate(const pthread_attr_t *attr, int *detachstate)
+{
+    *detachstate = attr->a_detachstate;
+    return 0;
+}
+
+/* Unmaps the detached threads that are gone */
+static void pthread_reap(void)
+{
+    pthread_mutex_lock(&pthread_dead_lock);
+    struct pthread **link = &pthread_dead;
+    while (*link)
+    {
+        struct pthread *t = *link;
+        if (__atomic_load_n(&t->pt_running, __ATOMIC_ACQUIRE))
+        {
+            link = &t->pt_next;
+            continue;
+        }
+        *link = t->pt_next;
+        munmap(t->pt_map, t->pt_mapsize);
+    }
+    pthread_mutex_unlock(&pthread_dead_lock);
+}
+
+static void *pthread_start(void *arg)
+{
+    struct pthread *self = arg;
+    pthread_exit(self->pt_start(self->pt_arg));
+    return NULL;
+}
+
+int pthread_create(pthread_t *thr, const pthread_attr_t *attr,
+                   void *(*start)(void *), void *arg)
+{
+    pthread_attr_t defaults;
+    if (!attr)
+    {
+        pthread_attr_init(&defaults);
+        attr = &defaults;
+    }
+    if (!__atomic_load_n(&pthread_tls, __ATOMIC_RELAXED))
+    {
+        if (__set_tls(&pthread_main) < 0)
+        {
+            return errno;
+        }
+        __atomic_store_n(&pthread_tls, 1, __ATOMIC_RELEASE);
+    }
+    pthread_reap();
+
+    size_t stacksize = (attr->a_stacksize + PTHREAD_PAGE_SIZE - 1) &
+                       ~(PTHREAD_PAGE_SIZE - 1);
+    size_t tsize = (sizeof(struct pthread) + PTHREAD_PAGE_SIZE - 1) &
+                   ~(PTHREAD_PAGE_SIZE - 1);
+    size_t len = PTHREAD_PAGE_SIZE + stacksize + tsize;
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+                     -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return errno;
+    }
+    /* an overflow faults rather than running into whatever is below */
+    mprotect(map, PTHREAD_PAGE_SIZE, PROT_NONE);
+
+    struct pthread *t = (struct pthread *)(map + len - tsize);
+    t->pt_self = t;
+    t->pt_start = start;
+    t->pt_arg = arg;
+    t->pt_running = 1;
+    t->pt_state = attr->a_detachstate == PTHREAD_CREATE_DETACHED
+                      ? PT_DETACHED
+                      : PT_JOINABLE;
+    t->pt_map = map;
+    t->pt_mapsize = len;
+
+    if (__thr_create(pthread_start, t, map + PTHREAD_PAGE_SIZE, stacksize, t,
+                     &t->pt_running) < 0)
+    {
+        int err = errno;
+        munmap(map, len);
+        return err;
+    }
+    *thr = t;
+    return 0;
+}
+
+/* Runs the destructors of the keys self has values for */
+static void pthread_run_destructors(struct pthread *self)
+{
+    for (int round = 0; round < PTHREAD_DESTRUCTOR_ITERATIONS; round++)
+    {
+        int again = 0;
+        for (unsigned slot = 0; slot < PTHREAD_KEYS_MAX; slot++)
+        {
+            pthread_specific_t *ps = &self->pt_specific[slot];
+            pthread_keyslot_t *k = &pthread_keys[slot];
+            void (*destructor)(void *) = k->k_destructor;
+            if (!ps->ps_value || !destructor || !k->k_used ||
+                ps->ps_seq != k->k_seq)
+            {
+                continue;
+            }
+            void *value = ps->ps_value;
+            ps->ps_value = NULL;
+            destructor(value);
+            again = 1;
+        }
+        if (!again)
+        {
+            break;
+        }
+    }
+}
+
+void pthread_exit(void *retval)
+{
+    struct pthread *self = pthread_self();
+    while (self->pt_ncleanups)
+    {
+        pthread_cleanup_pop(1);
+    }
+    pthread_run_destructors(self);
+    self->pt_retval = retval;
+
+    int state = PT_JOINABLE;
+    if (!__atomic_compare_exchange_n(&self->pt_state, &state, PT_EXITED, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        self != &pthread_main)
+    {
+        /* no one will join it, so the next pthread_create() unmaps it */
+        pthread_mutex_lock(&pthread_dead_lock);
+        self->pt_next = pthread_dead;
+        pthread_dead = self;
+        pthread_mutex_unlock(&pthread_dead_lock);
+    }
+    __malloc_thread_exit();
+    thr_exit(0);
+}
+
+/* Waits for t to be gone, then unmaps it */
+static void pthread_release(struct pthread *t, void **retval)
+{
+    int running;
+    while ((running = __atomic_load_n(&t->pt_running, __ATOMIC_ACQUIRE)))
+    {
+        futex(&t->pt_running, FUTEX_WAIT, running);
+    }
+    if (retval)
+    {
+        *retval = t->pt_retval;
+    }
+    munmap(t->pt_map, t->pt_mapsize);
+}
+
+int pthread_join(pthread_t thr, void **retval)
+{
+    if (thr == pthread_self())
+    {
+        return EDEADLK;
+    }
+    if (__atomic_load_n(&thr->pt_state, __ATOMIC_ACQUIRE) == PT_DETACHED)
+    {
+        return EINVAL;
+    }
+    pthread_testcancel();
+    pthread_release(thr, retval);
+    return 0;
+}
+
+int pthread_detach(pthread_t thr)
+{
+    int state = PT_JOINABLE;
+    if (__atomic_compare_exchange_n(&thr->pt_state, &state, PT_DETACHED, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    if (state == PT_DETACHED)
+    {
+        return EINVAL;
+    }
+    /* it has already exited, and would otherwise wait to be joined */
+    pthread_release(thr, NULL);
+    return 0;
+}
+
+int pthread_cancel(pthread_t thr)
+{
+    __atomic_store_n(&thr->pt_cancelled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void pthread_testcancel(void)
+{
+    struct pthread *self = pthread_self();
+    if (__atomic_load_n(&self->pt_cancelled, __ATOMIC_ACQUIRE))
+    {
+        self->pt_cancelled = 0;
+        pthread_exit(PTHREAD_CANCELED);
+    }
+}
+
+void pthread_cleanup_push(void (*routine)(void *), void *routine_arg)
+{
+    struct pthread *self = pthread_self();
+    if (self->pt_ncleanups < PTHREAD_CLEANUP_MAX)
+    {
+        self->pt_cleanups[self->pt_ncleanups].pc_routine = routine;
+        self->pt_cleanups[self->pt_ncleanups].pc_arg = routine_arg;
+    }
+    self->pt_ncleanups++;
+}
+
+void pthread_cleanup_pop(int execute)
+{
+    struct pthread *self = pthread_self();
+    if (!self->pt_ncleanups)
+    {
+        return;
+    }
+    unsigned i = --self->pt_ncleanups;
+    if (execute && i < PTHREAD_CLEANUP_MAX)
+    {
+        self->pt_cleanups[i].pc_routine(self->pt_cleanups[i].pc_arg);
+    }
+}
+
+/*
+ * Mutexes, as in Drepper's "Futexes Are Tricky": 0 unlocked, 1 locked, 2
+ * locked with (perhaps) threads asleep on it, so that unlock only wakes
+ * someone when the state says there may be someone.
+ */
+int pthread_mutex_init(pthread_mutex_t *mtx, const pthread_mutexattr_t *attr)
+{
+    mtx->m_state = 0;
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mtx)
+{
+    return __atomic_load_n(&mtx->m_state, __ATOMIC_RELAXED) ? EBUSY : 0;
+}
+
+/* Takes mtx as contended, for a thread that may have had others wait behind
+ * it */
+static void pthread_mutex_lock_slow(pthread_mutex_t *mtx, int c)
+{
+    if (c != 2)
+    {
+        c = __atomic_exchange_n(&mtx->m_state, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c)
+    {
+        futex(&mtx->m_state, FUTEX_WAIT, 2);
+        c = __atomic_exchange_n(&mtx->m_state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mtx)
+{
+    int c = 0;
+    if (__atomic_compare_exchange_n(&mtx->m_state, &c, 1, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    /* a lock held for a moment is cheaper to wait out than to sleep on */
+    for (int spin = 0; spin < PTHREAD_SPIN && c != 2; spin++)
+    {
+        __asm__ volatile("pause");
+        c = 0;
+        if (__atomic_compare_exchange_n(&mtx->m_state, &c, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return 0;
+        }
+    }
+    pthread_mutex_lock_slow(mtx, c);
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mtx)
+{
+    int c = 0;
+    return __atomic_compare_exchange_n(&mtx->m_state, &c, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+               ? 0
+               : EBUSY;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mtx)
+{
+    if (__atomic_fetch_sub(&mtx->m_state, 1, __ATOMIC_RELEASE) != 1)
+    {
+        __atomic_store_n(&mtx->m_state, 0, __ATOMIC_RELEASE);
+        futex(&mtx->m_state, FUTEX_WAKE, 1);
+    }
+    return 0;
+}
+
+/*
+ * Condition variables: a waiter sleeps on c_seq as it was before it let the
+ * mutex go, so that a signal that comes in between changes it and the wait
+ * returns at once. Signals only enter the kernel when c_waiters says someone
+ * is waiting.
+ */
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    cond->c_seq = 0;
+    cond->c_waiters = 0;
+    return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    return __atomic_load_n(&cond->c_waiters, __ATOMIC_RELAXED) ? EBUSY : 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mtx)
+{
+    pthread_testcancel();
+    int seq = __atomic_load_n(&cond->c_seq, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cond->c_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(mtx);
+    futex(&cond->c_seq, FUTEX_WAIT, seq);
+    __atomic_sub_fetch(&cond->c_waiters, 1, __ATOMIC_RELAXED);
+    /* others woken with it (by a broadcast) may be asleep on the mutex by
+     * the time it is let go, so it is taken as contended */
+    pthread_mutex_lock_slow(mtx, 1);
+    return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    __atomic_add_fetch(&cond->c_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cond->c_waiters, __ATOMIC_SEQ_CST))
+    {
+        futex(&cond->c_seq, FUTEX_WAKE, 1);
+    }
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    __atomic_add_fetch(&cond->c_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cond->c_waiters, __ATOMIC_SEQ_CST))
+    {
+        futex(&cond->c_seq, FUTEX_WAKE, INT_MAX);
+    }
+    return 0;
+}
+
+/*
+ * Read-write locks: rw_state counts the readers holding it, or is -1 while a
+ * writer does, and is what waiters sleep on. A reader does not take it while
+ * a writer is waiting, so that a stream of readers cannot starve writers.
+ */
+int pthread_rwlock_init(pthread_rwlock_t *rw, const pthread_rwlockattr_t *attr)
+{
+    rw->rw_state = 0;
+    rw->rw_waiters = 0;
+    rw->rw_writers = 0;
+    return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t *rw)
+{
+    return __atomic_load_n(&rw->rw_state, __ATOMIC_RELAXED) ? EBUSY : 0;
+}
+
+static void pthread_rwlock_wait(pthread_rwlock_t *rw, int state)
+{
+    __atomic_add_fetch(&rw->rw_waiters, 1, __ATOMIC_SEQ_CST);
+    futex(&rw->rw_state, FUTEX_WAIT, state);
+    __atomic_sub_fetch(&rw->rw_waiters, 1, __ATOMIC_RELAXED);
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rw)
+{
+    int s = __atomic_load_n(&rw->rw_state, __ATOMIC_RELAXED);
+    while (s >= 0 && !__atomic_load_n(&rw->rw_writers, __ATOMIC_RELAXED))
+    {
+        if (__atomic_compare_exchange_n(&rw->rw_state, &s, s + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return 0;
+        }
+    }
+    return EBUSY;
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *rw)
+{
+    while (pthread_rwlock_tryrdlock(rw))
+    {
+        int s = __atomic_load_n(&rw->rw_state, __ATOMIC_RELAXED);
+        if (s < 0 || __atomic_load_n(&rw->rw_writers, __ATOMIC_RELAXED))
+        {
+            pthread_rwlock_wait(rw, s);
+        }
+    }
+    return 0;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rw)
+{
+    int s = 0;
+    return __atomic_compare_exchange_n(&rw->rw_state, &s, -1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+               ? 0
+               : EBUSY;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *rw)
+{
+    if (!pthread_rwlock_trywrlock(rw))
+    {
+        return 0;
+    }
+    __atomic_add_fetch(&rw->rw_writers, 1, __ATOMIC_SEQ_CST);
+    int s = 0;
+    while (!__atomic_compare_exchange_n(&rw->rw_state, &s, -1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        pthread_rwlock_wait(rw, s);
+        s = 0;
+    }
+    __atomic_sub_fetch(&rw->rw_writers, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t *rw)
+{
+    if (__atomic_load_n(&rw->rw_state, __ATOMIC_RELAXED) < 0)
+    {
+        __atomic_store_n(&rw->rw_state, 0, __ATOMIC_SEQ_CST);
+    }
+    else if (__atomic_sub_fetch(&rw->rw_state, 1, __ATOMIC_SEQ_CST))
+    {
+        return 0;
+    }
+    if (__atomic_load_n(&rw->rw_waiters, __ATOMIC_SEQ_CST))
+    {
+        /* readers and writers alike; those that lose out sleep again */
+        futex(&rw->rw_state, FUTEX_WAKE, INT_MAX);
+    }
+    return 0;
+}
+
+int pthread_once(pthread_once_t *once, void (*init)(void))
+{
+    int s = 0;
+    if (__atomic_load_n(&once->o_state, __ATOMIC_ACQUIRE) == 2)
+    {
+        return 0;
+    }
+    if (__atomic_compare_exchange_n(&once->o_state, &s, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        init();
+        __atomic_store_n(&once->o_state, 2, __ATOMIC_RELEASE);
+        futex(&once->o_state, FUTEX_WAKE, INT_MAX);
+        return 0;
+    }
+    while ((s = __atomic_load_n(&once->o_state, __ATOMIC_ACQUIRE)) == 1)
+    {
+        futex(&once->o_state, FUTEX_WAIT, 1);
+    }
+    return 0;
+}
+
+int pthread_key_create(pthread_key_t *key, void (*destructor)(void *))
+{
+    pthread_mutex_lock(&pthread_keys_lock);
+    for (unsigned slot = 0; slot < PTHREAD_KEYS_MAX; slot++)
+    {
+        pthread_keyslot_t *k = &pthread_keys[slot];
+        if (!k->k_used)
+        {
+            /* never 0, which unset values have, nor so big that the key
+             * overflows */
+            if (++k->k_seq > UINT_MAX / PTHREAD_KEYS_MAX)
+            {
+                k->k_seq = 1;
+            }
+            k->k_destructor = destructor;
+            __atomic_store_n(&k->k_used, 1, __ATOMIC_RELEASE);
+            *key = k->k_seq * PTHREAD_KEYS_MAX + slot;
+            pthread_mutex_unlock(&pthread_keys_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&pthread_keys_lock);
+    return EAGAIN;
+}
+
+/* Whether key is one made and not deleted yet */
+static int pthread_key_valid(pthread_key_t key)
+{
+    pthread_keyslot_t *k = &pthread_keys[key % PTHREAD_KEYS_MAX];
+    return __atomic_load_n(&k->k_used, __ATOMIC_ACQUIRE) &&
+           k->k_seq == key / PTHREAD_KEYS_MAX;
+}
+
+int pthread_key_delete(pthread_key_t key)
+{
+    pthread_mutex_lock(&pthread_keys_lock);
+    int valid = pthread_key_valid(key);
+    if (valid)
+    {
+        pthread_keys[key % PTHREAD_KEYS_MAX].k_used = 0;
+    }
+    pthread_mutex_unlock(&pthread_keys_lock);
+    return valid ? 0 : EINVAL;
+}
+
+void *pthread_getspecific(pthread_key_t key)
+{
+    pthread_specific_t *ps =
+        &pthread_self()->pt_specific[key % PTHREAD_KEYS_MAX];
+    return ps->ps_seq == key / PTHREAD_KEYS_MAX ? ps->ps_value : NULL;
+}
+
+int pthread_setspecific(pthread_key_t key, const void *value)
+{
+    if (!pthread_key_valid(key))
+    {
+        return EINVAL;
+    }
+    pthread_specific_t *ps =
+        &pthread_self()->pt_specific[key % PTHREAD_KEYS_MAX];
+    ps->ps_seq = key / PTHREAD_KEYS_MAX;
+    ps->ps_value = (void *)value;
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include "errno.h"
+#include "fcntl.h"
+#include "futex.h"
+#include "limits.h"
+#include "shm.h"
+#include "stddef.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "sys/mman.h"
+#include "unistd.h"
+#include "weenix/config.h" /* MAXPATHLEN */
+
+static int shm_path(const char *name, char *path, size_t size)
+{
+    if (name[0] != '/' || !name[1] || strchr(name + 1, '/'))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (snprintf(path, size, "%s%s", SHM_DIR, name) >= (int)size)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+int shm_open(const char *name, int oflag, int mode)
+{
+    char path[MAXPATHLEN];
+    if (shm_path(name, path, sizeof(path)) < 0)
+    {
+        return -1;
+    }
+    return open(path, oflag, mode);
+}
+
+int shm_unlink(const char *name)
+{
+    char path[MAXPATHLEN];
+    if (shm_path(name, path, sizeof(path)) < 0)
+    {
+        return -1;
+    }
+    return unlink(path);
+}
+
+/*
+ * The queue is a ring of slots, used as in Vyukov's bounded MPMC queue. Each
+ * slot's sequence number says what it is ready for: slot i, for the messages
+ * sent at positions i, i + nmsgs, i + 2 * nmsgs..., is free for the message
+ * at position pos when its sequence number is pos, and holds it when it is
+ * pos + 1. Senders claim positions by advancing sh_tail, and receivers by
+ * advancing sh_head, each side on a cache line of its own, so that a sender
+ * and a receiver only meet in the slot they hand over.
+ *
+ * A side that finds the queue full (or empty) waits on the other side's
+ * futex word, which is bumped on every release (or send); it is only woken
+ * when the waiter count says someone is waiting, so neither side enters the
+ * kernel while the queue keeps flowing. The word is read before the slot is
+ * looked at, so a release (or send) that comes in between changes it, and
+ * the wait returns at once rather than missing the wakeup.
+ */
+#define SHMQ_MAGIC 0x71686d73 /* "shmq" */
+#define SHMQ_LINE 64          /* cache line size */
+
+typedef struct shmq_header
+{
+    int sh_magic; /* set by the creator once the rest is initialized */
+    unsigned sh_msgsize;
+    unsigned sh_nmsgs;
+    unsigned sh_stride; /* bytes from one slot to the next */
+
+    unsigned sh_tail __attribute__((aligned(SHMQ_LINE)));
+    int sh_sent;      /* bumped by every send, for receivers to wait on */
+    int sh_receivers; /* receivers waiting */
+
+    unsigned sh_head __attribute__((aligned(SHMQ_LINE)));
+    int sh_released;  /* bumped by every release, for senders to wait on */
+    int sh_senders;   /* senders waiting */
+} __attribute__((aligned(SHMQ_LINE))) shmq_header_t;
+
+typedef struct shmq_slot
+{
+    unsigned ss_seq;
+    unsigned ss_len;
+    char ss_data[] __attribute__((aligned(16)));
+} shmq_slot_t;
+
+struct shmq
+{
+    shmq_header_t *q_header;
+    size_t q_size; /* of the mapping */
+};
+
+static shmq_slot_t *shmq_slot(shmq_header_t *h, unsigned pos)
+{
+    return (shmq_slot_t *)((char *)(h + 1) +
+                           (size_t)(pos & (h->sh_nmsgs - 1)) * h->sh_stride);
+}
+
+static void shmq_wait(int *word, int val, int *waiters)
+{
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    futex(word, FUTEX_WAIT, val);
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_RELAXED);
+}
+
+static void shmq_wake(int *word, int *waiters)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+    {
+        /* all of them: with several on one side, the one woken might not be
+         * the one whose slot is ready */
+        futex(word, FUTEX_WAKE, INT_MAX);
+    }
+}
+
+shmq_t *shmq_open(const char *name, int oflag, size_t msgsize, size_t nmsgs)
+{
+    if (!msgsize || !nmsgs || (nmsgs & (nmsgs - 1)) || msgsize > UINT_MAX ||
+        nmsgs > UINT_MAX / 2)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t stride = offsetof(shmq_slot_t, ss_data) + msgsize;
+    stride = (stride + SHMQ_LINE - 1) & ~(size_t)(SHMQ_LINE - 1);
+    size_t size = sizeof(shmq_header_t) + stride * nmsgs;
+
+    shmq_t *q = malloc(sizeof(shmq_t));
+    if (!q)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    int created = 0;
+    int fd = -1;
+    if (oflag & O_CREAT)
+    {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0);
+        created = fd >= 0;
+    }
+    if (fd < 0 && (!(oflag & O_CREAT) || errno == EEXIST))
+    {
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0)
+    {
+        free(q);
+        return NULL;
+    }
+    shmq_header_t *h =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+    {
+        free(q);
+        return NULL;
+    }
+
+    if (created)
+    {
+        h->sh_msgsize = msgsize;
+        h->sh_nmsgs = nmsgs;
+        h->sh_stride = stride;
+        for (unsigned i = 0; i < nmsgs; i++)
+        {
+            shmq_slot(h, i)->ss_seq = i;
+        }
+        __atomic_store_n(&h->sh_magic, SHMQ_MAGIC, __ATOMIC_RELEASE);
+        futex(&h->sh_magic, FUTEX_WAKE, INT_MAX);
+    }
+    else
+    {
+        /* the creator may not be done yet */
+        int magic;
+        while (!(magic = __atomic_load_n(&h->sh_magic, __ATOMIC_ACQUIRE)))
+        {
+            futex(&h->sh_magic, FUTEX_WAIT, 0);
+        }
+        if (magic != SHMQ_MAGIC || h->sh_msgsize != msgsize ||
+            h->sh_nmsgs != nmsgs)
+        {
+            munmap(h, size);
+            free(q);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    q->q_header = h;
+    q->q_size = size;
+    return q;
+}
+
+void shmq_close(shmq_t *q)
+{
+    munmap(q->q_header, q->q_size);
+    free(q);
+}
+
+void *shmq_reserve(shmq_t *q)
+{
+    shmq_header_t *h = q->q_header;
+    while (1)
+    {
+        int released = __atomic_load_n(&h->sh_released, __ATOMIC_ACQUIRE);
+        unsigned pos = __atomic_load_n(&h->sh_tail, __ATOMIC_RELAXED);
+        shmq_slot_t *slot = shmq_slot(h, pos);
+        int diff = (int)(__atomic_load_n(&slot->ss_seq, __ATOMIC_ACQUIRE) - pos);
+        if (!diff)
+        {
+            if (__atomic_compare_exchange_n(&h->sh_tail, &pos, pos + 1, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                return slot->ss_data;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* still holding the message from a lap ago: full */
+            shmq_wait(&h->sh_released, released, &h->sh_senders);
+        }
+        /* otherwise another sender took pos; try the next */
+    }
+}
+
+void shmq_send(shmq_t *q, void *msg, size_t len)
+{
+    shmq_header_t *h = q->q_header;
+    shmq_slot_t *slot = CONTAINER_OF(msg, shmq_slot_t, ss_data);
+    slot->ss_len = len;
+    __atomic_store_n(&slot->ss_seq, slot->ss_seq + 1, __ATOMIC_RELEASE);
+    shmq_wake(&h->sh_sent, &h->sh_receivers);
+}
+
+void *shmq_receive(shmq_t *q, size_t *len)
+{
+    shmq_header_t *h = q->q_header;
+    while (1)
+    {
+        int sent = __atomic_load_n(&h->sh_sent, __ATOMIC_ACQUIRE);
+        unsigned pos = __atomic_load_n(&h->sh_head, __ATOMIC_RELAXED);
+        shmq_slot_t *slot = shmq_slot(h, pos);
+        int diff =
+            (int)(__atomic_load_n(&slot->ss_seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (!diff)
+        {
+            if (__atomic_compare_exchange_n(&h->sh_head, &pos, pos + 1, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                *len = slot->ss_len;
+                return slot->ss_data;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* not sent yet: empty */
+            shmq_wait(&h->sh_sent, sent, &h->sh_receivers);
+        }
+    }
+}
+
+void shmq_release(shmq_t *q, void *msg)
+{
+    shmq_header_t *h = q->q_header;
+    shmq_slot_t *slot = CONTAINER_OF(msg, shmq_slot_t, ss_data);
+    /* free for the message a lap after the one it held */
+    __atomic_store_n(&slot->ss_seq, slot->ss_seq - 1 + h->sh_nmsgs,
+                     __ATOMIC_RELEASE);
+    shmq_wake(&h->sh_released, &h->sh_senders);
+}
@@ -1,11 +1,440 @@
+#include "errno.h"
+#include "fcntl.h"
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+
+/* FILE flags */
+#define __SRD 0x01   /* the buffer holds input */
+#define __SWR 0x02   /* the buffer holds output */
+#define __SEOF 0x04  /* end of file was reached */
+#define __SERR 0x08  /* an error occurred */
+#define __SFREE 0x10 /* made by fopen() or fdopen(), freed by fclose() */
 
 static FILE stdstreams[3] = {
-    {.fd = 0, .offset = 0},
-    {.fd = 1, .offset = 0},
-    {.fd = 2, .offset = 0},
+    {.fd = 0, .mode = -1, .next = &stdstreams[1]},
+    {.fd = 1, .mode = -1, .next = &stdstreams[2]},
+    {.fd = 2, .mode = _IONBF, .next = NULL},
 };
 
 FILE *stdin = &stdstreams[0];
 FILE *stdout = &stdstreams[1];
 FILE *stderr = &stdstreams[2];
+
+/* Every open stream, for fflush(NULL) */
+static FILE *streams = &stdstreams[0];
+
+/*
+ * Settles how a stream is buffered when it is first used, unless setvbuf()
+ * already has: ttys are line buffered, anything else fully buffered.
+ */
+static void stream_setup(FILE *f)
+{
+    if (f->mode < 0)
+    {
+        f->mode = isatty(f->fd) ? _IOLBF : _IOFBF;
+    }
+    if (!f->buf)
+    {
+        f->buf = f->buffer;
+        f->size = sizeof(f->buffer);
+    }
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t ret = write(fd, buf, len);
+        if (ret <= 0)
+        {
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/*
+ * Empties the buffer: buffered output is written, and input read ahead is
+ * handed back by moving the fd's offset back to where the stream is (which
+ * fails harmlessly for pipes and ttys).
+ */
+static int stream_flush(FILE *f)
+{
+    if (f->flags & __SWR)
+    {
+        int ret = write_all(f->fd, f->buf, f->offset);
+        f->offset = 0;
+        f->flags &= ~__SWR;
+        if (ret)
+        {
+            f->flags |= __SERR;
+            return EOF;
+        }
+    }
+    else if (f->flags & __SRD)
+    {
+        if (f->len > f->offset)
+        {
+            lseek(f->fd, -(off_t)(f->len - f->offset), SEEK_CUR);
+        }
+        f->offset = f->len = 0;
+        f->flags &= ~__SRD;
+    }
+    return 0;
+}
+
+int fflush(FILE *stream)
+{
+    if (stream)
+    {
+        return stream_flush(stream);
+    }
+    int ret = 0;
+    for (FILE *f = streams; f; f = f->next)
+    {
+        if (stream_flush(f))
+        {
+            ret = EOF;
+        }
+    }
+    return ret;
+}
+
+/* Parses an fopen() mode into open() flags, or returns -1 */
+static int stream_oflags(const char *mode)
+{
+    int oflags;
+    switch (mode[0])
+    {
+        case 'r':
+            oflags = O_RDONLY;
+            break;
+        case 'w':
+            oflags = O_WRONLY | O_CREAT | O_TRUNC;
+            break;
+        case 'a':
+            oflags = O_WRONLY | O_CREAT | O_APPEND;
+            break;
+        default:
+            return -1;
+    }
+    if (strchr(mode + 1, '+'))
+    {
+        oflags = (oflags & ~O_ACCESSMODE_MASK) | O_RDWR;
+    }
+    return oflags;
+}
+
+FILE *fdopen(int fd, const char *mode)
+{
+    if (stream_oflags(mode) < 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    FILE *f = malloc(sizeof(FILE));
+    if (!f)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(f, 0, sizeof(FILE) - sizeof(f->buffer));
+    f->fd = fd;
+    f->mode = -1;
+    f->flags = __SFREE;
+    f->next = streams;
+    streams = f;
+    return f;
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+    int oflags = stream_oflags(mode);
+    if (oflags < 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    int fd = open(path, oflags, 0666);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    FILE *f = fdopen(fd, mode);
+    if (!f)
+    {
+        close(fd);
+    }
+    return f;
+}
+
+int fclose(FILE *stream)
+{
+    int ret = stream_flush(stream);
+    if (close(stream->fd) < 0)
+    {
+        ret = EOF;
+    }
+    for (FILE **fp = &streams; *fp; fp = &(*fp)->next)
+    {
+        if (*fp == stream)
+        {
+            *fp = stream->next;
+            break;
+        }
+    }
+    if (stream->flags & __SFREE)
+    {
+        free(stream);
+    }
+    return ret;
+}
+
+/*
+ * Output that does not fit in the buffer's free space flushes it, and then
+ * goes straight to the fd if it would fill the buffer on its own; anything
+ * smaller is copied in. Line buffered streams are flushed when a newline
+ * is written to them.
+ */
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    size_t total = size * nmemb;
+    if (!total)
+    {
+        return 0;
+    }
+    stream_setup(stream);
+    if (stream->flags & __SRD)
+    {
+        stream_flush(stream);
+    }
+
+    if (stream->mode == _IONBF)
+    {
+        if (write_all(stream->fd, ptr, total))
+        {
+            stream->flags |= __SERR;
+            return 0;
+        }
+        return nmemb;
+    }
+
+    if (total > stream->size - stream->offset && stream_flush(stream))
+    {
+        return 0;
+    }
+    if (total >= stream->size)
+    {
+        if (write_all(stream->fd, ptr, total))
+        {
+            stream->flags |= __SERR;
+            return 0;
+        }
+        return nmemb;
+    }
+    memcpy(stream->buf + stream->offset, ptr, total);
+    stream->offset += total;
+    stream->flags |= __SWR;
+    if (stream->mode == _IOLBF && memchr(ptr, '\n', total) &&
+        stream_flush(stream))
+    {
+        return 0;
+    }
+    return nmemb;
+}
+
+/*
+ * Input is taken from the buffer while it lasts. Requests at least as big as
+ * the buffer are read straight into the caller's memory, smaller ones refill
+ * the buffer first. Reading from a stream that is not fully buffered flushes
+ * stdout, so that a prompt is seen before its answer is waited for.
+ */
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    size_t total = size * nmemb;
+    if (!total)
+    {
+        return 0;
+    }
+    stream_setup(stream);
+    if ((stream->flags & __SWR) && stream_flush(stream))
+    {
+        return 0;
+    }
+    if (stream->mode != _IOFBF && stream != stdout)
+    {
+        stream_flush(stdout);
+    }
+
+    char *dst = ptr;
+    size_t done = 0;
+    while (done < total)
+    {
+        if (stream->offset < stream->len)
+        {
+            size_t n = stream->len - stream->offset;
+            n = n < total - done ? n : total - done;
+            memcpy(dst + done, stream->buf + stream->offset, n);
+            stream->offset += n;
+            done += n;
+            continue;
+        }
+
+        size_t want = total - done;
+        int direct = stream->mode == _IONBF || want >= stream->size;
+        ssize_t ret = direct ? read(stream->fd, dst + done, want)
+                             : read(stream->fd, stream->buf, stream->size);
+        if (ret <= 0)
+        {
+            stream->flags |= ret ? __SERR : __SEOF;
+            break;
+        }
+        if (direct)
+        {
+            done += ret;
+        }
+        else
+        {
+            stream->offset = 0;
+            stream->len = ret;
+            stream->flags |= __SRD;
+        }
+    }
+    return done / size;
+}
+
+int fgetc(FILE *stream)
+{
+    if ((stream->flags & __SRD) && stream->offset < stream->len)
+    {
+        return (unsigned char)stream->buf[stream->offset++];
+    }
+    unsigned char c;
+    return fread(&c, 1, 1, stream) == 1 ? c : EOF;
+}
+
+int getc(FILE *stream) { return fgetc(stream); }
+
+int getchar(void) { return fgetc(stdin); }
+
+char *fgets(char *s, int size, FILE *stream)
+{
+    int i = 0;
+    while (i < size - 1)
+    {
+        int c = fgetc(stream);
+        if (c == EOF)
+        {
+            break;
+        }
+        s[i++] = (char)c;
+        if (c == '\n')
+        {
+            break;
+        }
+    }
+    if (!i || (stream->flags & __SERR))
+    {
+        return NULL;
+    }
+    s[i] = '\0';
+    return s;
+}
+
+int fputc(int c, FILE *stream)
+{
+    unsigned char ch = (unsigned char)c;
+    return fwrite(&ch, 1, 1, stream) == 1 ? ch : EOF;
+}
+
+int putc(int c, FILE *stream) { return fputc(c, stream); }
+
+int putchar(int c) { return fputc(c, stdout); }
+
+int fputs(const char *s, FILE *stream)
+{
+    size_t len = strlen(s);
+    return !len || fwrite(s, len, 1, stream) == 1 ? 0 : EOF;
+}
+
+int puts(const char *s)
+{
+    return fputs(s, stdout) == EOF || fputc('\n', stdout) == EOF ? EOF : 0;
+}
+
+int fseek(FILE *stream, long offset, int whence)
+{
+    if (stream_flush(stream) || lseek(stream->fd, offset, whence) < 0)
+    {
+        return -1;
+    }
+    stream->flags &= ~__SEOF;
+    return 0;
+}
+
+long ftell(FILE *stream)
+{
+    off_t pos = lseek(stream->fd, 0, SEEK_CUR);
+    if (pos < 0)
+    {
+        return -1;
+    }
+    if (stream->flags & __SWR)
+    {
+        return pos + stream->offset;
+    }
+    if (stream->flags & __SRD)
+    {
+        return pos - (long)(stream->len - stream->offset);
+    }
+    return pos;
+}
+
+void rewind(FILE *stream)
+{
+    fseek(stream, 0, SEEK_SET);
+    clearerr(stream);
+}
+
+/*
+ * Changes how a stream is buffered, and with buf and size, the buffer it
+ * uses, which must outlive the stream. Anything already buffered is flushed
+ * first.
+ */
+int setvbuf(FILE *stream, char *buf, int mode, size_t size)
+{
+    if ((mode != _IOFBF && mode != _IOLBF && mode != _IONBF) ||
+        stream_flush(stream))
+    {
+        return -1;
+    }
+    stream->mode = mode;
+    if (buf && size)
+    {
+        stream->buf = buf;
+        stream->size = size;
+    }
+    else
+    {
+        stream->buf = stream->buffer;
+        stream->size = sizeof(stream->buffer);
+    }
+    return 0;
+}
+
+void setbuf(FILE *stream, char *buf)
+{
+    setvbuf(stream, buf, buf ? _IOFBF : _IONBF, BUFSIZ);
+}
+
+int feof(FILE *stream) { return (stream->flags & __SEOF) != 0; }
+
+int ferror(FILE *stream) { return (stream->flags & __SERR) != 0; }
+
+void clearerr(FILE *stream) { stream->flags &= ~(__SEOF | __SERR); }
+
+int fileno(FILE *stream) { return stream->fd; }
@@ -3,6 +3,42 @@
 #include "sys/types.h"
 #include <stdlib.h>
 
+/*
+ * memcpy(), memset(), strlen() and strcmp() work a quadword at a time, or,
+ * when the compiler may use SSE2 (always, on x86-64, unless built with
+ * -mno-sse2), sixteen bytes at a time. The quadword versions are the
+ * fallback and are kept building and working on their own.
+ *
+ * The string functions cannot know where a string ends before reading it, so
+ * they only ever load whole aligned blocks of it (or, for the second string
+ * of strcmp(), blocks that do not cross a page), which cannot fault when any
+ * byte of the block is part of the string.
+ */
+
+/* A quadword that need not be aligned */
+typedef uint64_t __attribute__((may_alias, aligned(1))) string_word_t;
+
+#define STRING_ONES 0x0101010101010101UL
+#define STRING_HIGHS 0x8080808080808080UL
+#define STRING_PAGE 4096
+
+/* Nonzero if any byte of w is zero; the lowest set high bit marks the first */
+#define STRING_HASZERO(w) (((w) - STRING_ONES) & ~(w) & STRING_HIGHS)
+
+#ifdef __SSE2__
+/* Sixteen bytes, aligned (string_vec_t) or not (string_uvec_t) */
+typedef char string_vec_t __attribute__((vector_size(16), may_alias));
+typedef char string_uvec_t
+    __attribute__((vector_size(16), may_alias, aligned(1)));
+
+/* A bit for each byte of v that is zero */
+static inline unsigned string_vec_zeros(string_vec_t v)
+{
+    string_vec_t zero = {0};
+    return (unsigned)__builtin_ia32_pmovmskb128(v == zero);
+}
+#endif
+
 int memcmp(const void *cs, const void *ct, size_t count)
 {
     const unsigned char *su1, *su2;
@@ -18,14 +54,89 @@ int memcmp(const void *cs, const void *ct, size_t count)
     return res;
 }
 
+void *memchr(const void *s, int c, size_t count)
+{
+    const unsigned char *p = s;
+    for (; count; p++, count--)
+    {
+        if (*p == (unsigned char)c)
+        {
+            return (void *)p;
+        }
+    }
+    return NULL;
+}
+
 void *memcpy(void *dest, const void *src, size_t count)
 {
-    char *tmp = (char *)dest;
+    char *d = dest;
     const char *s = src;
+    if (count < sizeof(uint64_t))
+    {
+        while (count--)
+        {
+            *d++ = *s++;
+        }
+        return dest;
+    }
+    if (count <= 2 * sizeof(uint64_t))
+    {
+        /* The first and last quadwords cover it all, overlapping if need be */
+        uint64_t first = *(const string_word_t *)s;
+        uint64_t last = *(const string_word_t *)(s + count - 8);
+        *(string_word_t *)d = first;
+        *(string_word_t *)(d + count - 8) = last;
+        return dest;
+    }
+#ifdef __SSE2__
+    /* Blocks of sixteen, then a last one ending at the last byte, which may
+     * overlap the one before it */
+    string_vec_t last = *(const string_uvec_t *)(s + count - 16);
+    char *end = d + count - 16;
+    while (d < end)
+    {
+        *(string_uvec_t *)d = *(const string_uvec_t *)s;
+        d += 16;
+        s += 16;
+    }
+    *(string_uvec_t *)end = last;
+#else
+    uint64_t last = *(const string_word_t *)(s + count - 8);
+    char *end = d + count - 8;
+    while (d < end)
+    {
+        *(string_word_t *)d = *(const string_word_t *)s;
+        d += 8;
+        s += 8;
+    }
+    *(string_word_t *)end = last;
+#endif
+    return dest;
+}
 
+void *memmove(void *dest, const void *src, size_t count)
+{
+    char *d = dest;
+    const char *s = src;
+    if (d <= s || d >= s + count)
+    {
+        /* memcpy() copies forwards */
+        return memcpy(dest, src, count);
+    }
+    while (count && ((uintptr_t)(d + count) & 7))
+    {
+        count--;
+        d[count] = s[count];
+    }
+    while (count >= 8)
+    {
+        count -= 8;
+        *(string_word_t *)(d + count) = *(const string_word_t *)(s + count);
+    }
     while (count--)
-        *tmp++ = *s++;
-
+    {
+        d[count] = s[count];
+    }
     return dest;
 }
 
@@ -47,17 +158,68 @@ int strncmp(const char *cs, const char *ct, size_t count)
 
 int strcmp(const char *cs, const char *ct)
 {
-    register signed char __res;
-
-    while (1)
+    const unsigned char *a = (const unsigned char *)cs;
+    const unsigned char *b = (const unsigned char *)ct;
+#ifdef __SSE2__
+    /* Sixteen bytes at a time, for as long as neither load would cross a
+     * page; the block at a page boundary is compared a byte at a time */
+    for (;;)
     {
-        if ((__res = *cs - *ct++) != 0 || !*cs++)
+        if ((uintptr_t)a % STRING_PAGE <= STRING_PAGE - 16 &&
+            (uintptr_t)b % STRING_PAGE <= STRING_PAGE - 16)
         {
-            break;
+            string_vec_t va = *(const string_uvec_t *)a;
+            string_vec_t vb = *(const string_uvec_t *)b;
+            unsigned stop = string_vec_zeros(va) |
+                            (unsigned)__builtin_ia32_pmovmskb128(va != vb);
+            if (stop)
+            {
+                size_t i = __builtin_ctz(stop);
+                return (a[i] > b[i]) - (a[i] < b[i]);
+            }
+            a += 16;
+            b += 16;
+            continue;
+        }
+        for (size_t i = 0; i < 16; i++, a++, b++)
+        {
+            if (*a != *b || !*a)
+            {
+                return (*a > *b) - (*a < *b);
+            }
         }
     }
-
-    return __res;
+#else
+    /* A quadword at a time once both strings are aligned, if they can be */
+    for (; (uintptr_t)a % sizeof(uint64_t); a++, b++)
+    {
+        if (*a != *b || !*a)
+        {
+            return (*a > *b) - (*a < *b);
+        }
+    }
+    if (!((uintptr_t)b % sizeof(uint64_t)))
+    {
+        for (;;)
+        {
+            uint64_t wa = *(const string_word_t *)a;
+            uint64_t wb = *(const string_word_t *)b;
+            if (wa != wb || STRING_HASZERO(wa))
+            {
+                break;
+            }
+            a += sizeof(uint64_t);
+            b += sizeof(uint64_t);
+        }
+    }
+    for (;; a++, b++)
+    {
+        if (*a != *b || !*a)
+        {
+            return (*a > *b) - (*a < *b);
+        }
+    }
+#endif
 }
 
 char *strcpy(char *dest, const char *src)
@@ -86,11 +248,42 @@ char *strncpy(char *dest, const char *src, size_t count)
 
 void *memset(void *s, int c, size_t count)
 {
-    char *xs = (char *)s;
-
-    while (count--)
-        *xs++ = c;
-
+    char *d = s;
+    /* c in every byte of a quadword */
+    uint64_t pattern = (uint8_t)c * STRING_ONES;
+    if (count < sizeof(uint64_t))
+    {
+        while (count--)
+        {
+            *d++ = (char)c;
+        }
+        return s;
+    }
+    if (count <= 2 * sizeof(uint64_t))
+    {
+        *(string_word_t *)d = pattern;
+        *(string_word_t *)(d + count - 8) = pattern;
+        return s;
+    }
+#ifdef __SSE2__
+    string_vec_t vpattern = {0};
+    vpattern += (char)c;
+    char *end = d + count - 16;
+    while (d < end)
+    {
+        *(string_uvec_t *)d = vpattern;
+        d += 16;
+    }
+    *(string_uvec_t *)end = vpattern;
+#else
+    char *end = d + count - 8;
+    while (d < end)
+    {
+        *(string_word_t *)d = pattern;
+        d += 8;
+    }
+    *(string_word_t *)end = pattern;
+#endif
     return s;
 }
 
@@ -119,12 +312,40 @@ char *strcat(char *dest, const char *src)
 
 size_t strlen(const char *s)
 {
-    const char *sc;
-
-    for (sc = s; *sc != '\0'; ++sc)
+#ifdef __SSE2__
+    /* The aligned block holding s, with the bytes before s ignored */
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)15);
+    unsigned zeros = string_vec_zeros(*(const string_vec_t *)p) >>
+                     (s - p);
+    if (zeros)
     {
-        /* nothing */}
-        return sc - s;
+        return __builtin_ctz(zeros);
+    }
+    do
+    {
+        p += 16;
+        zeros = string_vec_zeros(*(const string_vec_t *)p);
+    } while (!zeros);
+    return p + __builtin_ctz(zeros) - s;
+#else
+    const char *p = s;
+    for (; (uintptr_t)p % sizeof(uint64_t); p++)
+    {
+        if (!*p)
+        {
+            return p - s;
+        }
+    }
+    for (;; p += sizeof(uint64_t))
+    {
+        uint64_t w = *(const string_word_t *)p;
+        uint64_t zeros = STRING_HASZERO(w);
+        if (zeros)
+        {
+            return p + __builtin_ctzl(zeros) / 8 - s;
+        }
+    }
+#endif
 }
 
 char *strchr(const char *s, int c)
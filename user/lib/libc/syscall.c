@@ -3,9 +3,20 @@
 #include "stdlib.h"
 #include "string.h"
 #include "unistd.h"
+#include "sched.h"
+#include "futex.h"
+#include "memgroup.h"
+#include "poll.h"
+#include "ring.h"
+#include "sys/epoll.h"
+#include "sys/ioctl.h"
+#include "sys/times.h"
+#include "termios.h"
+#include "time.h"
 
 #include "stdio.h"
 #include "weenix/trap.h"
+#include "weenix/vdso.h"
 
 #include "dirent.h"
 
@@ -102,6 +113,99 @@ void _Exit(int status)
 
 int sched_yield(void) { return (int)trap(SYS_sched_yield, NULL); }
 
+int nice(int inc)
+{
+    int ret = (int)trap(SYS_nice, (ssize_t)inc);
+    return ret == -1 ? -1 : ret - NICE_BIAS;
+}
+
+int sched_setscheduler(pid_t pid, int policy, int priority)
+{
+    sched_setscheduler_args_t args;
+
+    args.ssa_pid = pid;
+    args.ssa_policy = policy;
+    args.ssa_priority = priority;
+
+    return (int)trap(SYS_sched_setscheduler, (uintptr_t)&args);
+}
+
+int sched_getscheduler(pid_t pid)
+{
+    return (int)trap(SYS_sched_getscheduler, (ssize_t)pid);
+}
+
+int sched_setaffinity(pid_t pid, unsigned long mask)
+{
+    sched_setaffinity_args_t args;
+
+    args.saa_pid = pid;
+    args.saa_mask = mask;
+
+    return (int)trap(SYS_sched_setaffinity, (uintptr_t)&args);
+}
+
+long sched_getaffinity(pid_t pid)
+{
+    return trap(SYS_sched_getaffinity, (ssize_t)pid);
+}
+
+int futex(int *uaddr, int op, int val)
+{
+    futex_args_t args;
+
+    args.fa_uaddr = uaddr;
+    args.fa_op = op;
+    args.fa_val = val;
+
+    return (int)trap(SYS_futex, (uintptr_t)&args);
+}
+
+int memgroup(int op, int group, pid_t pid, size_t limit)
+{
+    memgroup_args_t args;
+
+    args.mga_op = op;
+    args.mga_group = group;
+    args.mga_pid = pid;
+    args.mga_limit = limit;
+    args.mga_io_weight = 0;
+    args.mga_io_latency_ms = 0;
+
+    return (int)trap(SYS_memgroup, (uintptr_t)&args);
+}
+
+int memgroup_set_io(int group, unsigned weight, unsigned latency_ms)
+{
+    memgroup_args_t args;
+
+    args.mga_op = MEMGROUP_SET_IO;
+    args.mga_group = group;
+    args.mga_pid = 0;
+    args.mga_limit = 0;
+    args.mga_io_weight = weight;
+    args.mga_io_latency_ms = latency_ms;
+
+    return (int)trap(SYS_memgroup, (uintptr_t)&args);
+}
+
+int ioprio_set(pid_t pid, int prio)
+{
+    ioprio_set_args_t args;
+
+    args.isa_pid = pid;
+    args.isa_prio = prio;
+
+    return (int)trap(SYS_ioprio_set, (uintptr_t)&args);
+}
+
+int ioprio_get(pid_t pid) { return (int)trap(SYS_ioprio_get, (ssize_t)pid); }
+
+int ring_enter(syscall_ring_t *ring)
+{
+    return (int)trap(SYS_ring_enter, (uintptr_t)ring);
+}
+
 pid_t wait(int *status)
 {
     waitpid_args_t args;
@@ -126,6 +230,53 @@ pid_t waitpid(pid_t pid, int *status, int options)
 
 void thr_exit(int status) { trap(SYS_thr_exit, (ssize_t)status); }
 
+/* What a new thread is to run, kept at the top of its stack */
+typedef struct thr_start
+{
+    void *(*ts_func)(void *);
+    void *ts_arg;
+} thr_start_t;
+
+/* Per-thread allocator caches, in malloc.c */
+void __malloc_thread_create(void *stack, size_t stacksz);
+void __malloc_thread_exit();
+
+static void thr_start(thr_start_t *ts)
+{
+    int status = (int)(intptr_t)ts->ts_func(ts->ts_arg);
+    __malloc_thread_exit();
+    thr_exit(status);
+}
+
+/* thr_create(), with an FS base and exit word for pthread_create() */
+int __thr_create(void *(*func)(void *), void *arg, void *stack, size_t stacksz,
+                 void *tls, int *exit_word)
+{
+    thr_start_t *ts = (thr_start_t *)((char *)stack + stacksz) - 1;
+    ts->ts_func = func;
+    ts->ts_arg = arg;
+
+    thr_create_args_t args;
+
+    args.tca_entry = (void *)thr_start;
+    args.tca_arg = ts;
+    args.tca_stack = ts;
+    args.tca_tls = tls;
+    args.tca_exit_word = exit_word;
+
+    __malloc_thread_create(stack, stacksz);
+    return (int)trap(SYS_thr_create, (uintptr_t)&args);
+}
+
+int thr_create(void *(*func)(void *), void *arg, void *stack, size_t stacksz)
+{
+    return __thr_create(func, arg, stack, stacksz, NULL, NULL);
+}
+
+int __set_tls(void *base) { return (int)trap(SYS_set_tls, (uintptr_t)base); }
+
+pid_t gettid(void) { return (int)trap(SYS_gettid, 0); }
+
 pid_t getpid(void) { return (int)trap(SYS_getpid, 0); }
 
 int halt(void) { return (int)trap(SYS_halt, 0); }
@@ -154,6 +305,39 @@ int munmap(void *addr, size_t len)
     return (int)trap(SYS_munmap, (uintptr_t)&args);
 }
 
+int mprotect(void *addr, size_t len, int prot)
+{
+    mprotect_args_t args;
+
+    args.addr = addr;
+    args.len = len;
+    args.prot = prot;
+
+    return (int)trap(SYS_mprotect, (uintptr_t)&args);
+}
+
+int madvise(void *addr, size_t len, int advice)
+{
+    madvise_args_t args;
+
+    args.addr = addr;
+    args.len = len;
+    args.advice = advice;
+
+    return (int)trap(SYS_madvise, (uintptr_t)&args);
+}
+
+int msync(void *addr, size_t len, int flags)
+{
+    msync_args_t args;
+
+    args.addr = addr;
+    args.len = len;
+    args.flags = flags;
+
+    return (int)trap(SYS_msync, (uintptr_t)&args);
+}
+
 int debug(const char *str)
 {
     argstr_t argstr;
@@ -164,6 +348,12 @@ int debug(const char *str)
 
 void sync(void) { trap(SYS_sync, NULL); }
 
+int fsync(int fd) { return (int)trap(SYS_fsync, (ssize_t)fd); }
+
+int fdatasync(int fd) { return (int)trap(SYS_fdatasync, (ssize_t)fd); }
+
+int syncfs(int fd) { return (int)trap(SYS_syncfs, (ssize_t)fd); }
+
 int open(const char *filename, int flags, int mode)
 {
     open_args_t args;
@@ -176,6 +366,19 @@ int open(const char *filename, int flags, int mode)
     return (int)trap(SYS_open, (uintptr_t)&args);
 }
 
+int openat(int dirfd, const char *filename, int flags, int mode)
+{
+    openat_args_t args;
+
+    args.dirfd = dirfd;
+    args.filename.as_len = strlen(filename);
+    args.filename.as_str = filename;
+    args.flags = flags;
+    args.mode = mode;
+
+    return (int)trap(SYS_openat, (uintptr_t)&args);
+}
+
 off_t lseek(int fd, off_t offset, int whence)
 {
     lseek_args_t args;
@@ -207,7 +410,125 @@ ssize_t write(int fd, const void *buf, size_t nbytes)
     args.nbytes = nbytes;
 
     return trap(SYS_write, (uintptr_t)&args);
-}test_filling_file
+}
+
+ssize_t pread(int fd, void *buf, size_t nbytes, off_t offset)
+{
+    pread_args_t args;
+
+    args.fd = fd;
+    args.buf = buf;
+    args.nbytes = nbytes;
+    args.offset = offset;
+
+    return trap(SYS_pread, (uintptr_t)&args);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+    pwrite_args_t args;
+
+    args.fd = fd;
+    args.buf = buf;
+    args.nbytes = nbytes;
+    args.offset = offset;
+
+    return trap(SYS_pwrite, (uintptr_t)&args);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    rwv_args_t args;
+
+    args.fd = fd;
+    args.iov = iov;
+    args.iovcnt = iovcnt;
+
+    return trap(SYS_readv, (uintptr_t)&args);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    rwv_args_t args;
+
+    args.fd = fd;
+    args.iov = iov;
+    args.iovcnt = iovcnt;
+
+    return trap(SYS_writev, (uintptr_t)&args);
+}
+
+ssize_t splice(int fd_in, int fd_out, size_t len)
+{
+    splice_args_t args;
+
+    args.fd_in = fd_in;
+    args.fd_out = fd_out;
+    args.len = len;
+
+    return trap(SYS_splice, (uintptr_t)&args);
+}
+
+ssize_t tee(int fd_in, int fd_out, size_t len)
+{
+    splice_args_t args;
+
+    args.fd_in = fd_in;
+    args.fd_out = fd_out;
+    args.len = len;
+
+    return trap(SYS_tee, (uintptr_t)&args);
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    sendfile_args_t args;
+
+    args.out_fd = out_fd;
+    args.in_fd = in_fd;
+    args.offset = offset;
+    args.count = count;
+
+    return trap(SYS_sendfile, (uintptr_t)&args);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    poll_args_t args;
+
+    args.fds = fds;
+    args.nfds = nfds;
+    args.timeout = timeout;
+
+    return (int)trap(SYS_poll, (uintptr_t)&args);
+}
+
+int epoll_create(void) { return (int)trap(SYS_epoll_create, 0); }
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    epoll_ctl_args_t args;
+
+    args.epfd = epfd;
+    args.op = op;
+    args.fd = fd;
+    args.event = event;
+
+    return (int)trap(SYS_epoll_ctl, (uintptr_t)&args);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout)
+{
+    epoll_wait_args_t args;
+
+    args.epfd = epfd;
+    args.events = events;
+    args.maxevents = maxevents;
+    args.timeout = timeout;
+
+    return (int)trap(SYS_epoll_wait, (uintptr_t)&args);
+}
 
 int close(int fd) { return (int)trap(SYS_close, (ssize_t)fd); }
 
@@ -223,6 +544,53 @@ int dup2(int ofd, int nfd)
     return (int)trap(SYS_dup2, (uintptr_t)&args);
 }
 
+int fcntl(int fd, int cmd, int arg)
+{
+    fcntl_args_t args;
+
+    args.fd = fd;
+    args.cmd = cmd;
+    args.arg = arg;
+
+    return (int)trap(SYS_fcntl, (uintptr_t)&args);
+}
+
+ssize_t profile(int op, int interval, void *buf, size_t nbytes)
+{
+    profile_args_t args;
+
+    args.op = op;
+    args.interval = interval;
+    args.buf = buf;
+    args.nbytes = nbytes;
+
+    return trap(SYS_profile, (uintptr_t)&args);
+}
+
+int ioctl(int fd, unsigned long request, void *arg)
+{
+    ioctl_args_t args;
+
+    args.fd = fd;
+    args.request = request;
+    args.arg = arg;
+
+    return (int)trap(SYS_ioctl, (uintptr_t)&args);
+}
+
+int tcgetattr(int fd, struct termios *t) { return ioctl(fd, TCGETS, t); }
+
+int tcsetattr(int fd, int optional_actions, const struct termios *t)
+{
+    return ioctl(fd, TCSETS, (void *)t);
+}
+
+int isatty(int fd)
+{
+    struct termios t;
+    return tcgetattr(fd, &t) == 0;
+}
+
 int mkdir(const char *path, int mode)
 {
     mkdir_args_t args;
@@ -234,6 +602,18 @@ int mkdir(const char *path, int mode)
     return (int)trap(SYS_mkdir, (uintptr_t)&args);
 }
 
+int mkdirat(int dirfd, const char *path, int mode)
+{
+    mkdirat_args_t args;
+
+    args.dirfd = dirfd;
+    args.path.as_len = strlen(path);
+    args.path.as_str = path;
+    args.mode = mode;
+
+    return (int)trap(SYS_mkdirat, (uintptr_t)&args);
+}
+
 int rmdir(const char *path)
 {
     argstr_t args;
@@ -250,6 +630,18 @@ int unlink(const char *path)
     return (int)trap(SYS_unlink, (uintptr_t)&args);
 }
 
+int unlinkat(int dirfd, const char *path, int flags)
+{
+    unlinkat_args_t args;
+
+    args.dirfd = dirfd;
+    args.path.as_len = strlen(path);
+    args.path.as_str = path;
+    args.flags = flags;
+
+    return (int)trap(SYS_unlinkat, (uintptr_t)&args);
+}
+
 int link(const char *from, const char *to)
 {
     link_args_t args;
@@ -345,7 +737,7 @@ int mount(const char *spec, const char *dir, const char *fstype)
 {
     mount_args_t args;
 
-    args.spec.as_len = strlen(spec);
+    args.spec.as_len = spec ? strlen(spec) : 0;
     args.spec.as_str = spec;
     args.dir.as_len = strlen(dir);
     args.dir.as_str = dir;
@@ -377,11 +769,71 @@ int stat(const char *path, stat_t *buf)
     return (int)trap(SYS_stat, (uintptr_t)&args);
 }
 
+int fstatat(int dirfd, const char *path, stat_t *buf, int flags)
+{
+    fstatat_args_t args;
+
+    args.dirfd = dirfd;
+    args.path.as_len = strlen(path);
+    args.path.as_str = path;
+    args.buf = buf;
+    args.flags = flags;
+
+    return (int)trap(SYS_fstatat, (uintptr_t)&args);
+}
+
 int pipe(int pipefd[2]) { return (int)trap(SYS_pipe, (uintptr_t)pipefd); }
 
-int uname(struct utsname *buf) { return (int)trap(SYS_uname, (uintptr_t)buf); }
+/* uname(), time() and clock_gettime() read the vDSO page the kernel maps into
+ * every process, rather than trapping */
+#define VDSO ((const vdso_data_t *)VDSO_ADDR)
+
+int uname(struct utsname *buf)
+{
+    memcpy(buf, &VDSO->vd_uname, sizeof(*buf));
+    return 0;
+}
+
+time_t time(time_t *tloc)
+{
+    time_t t = VDSO->vd_time;
+    if (tloc)
+    {
+        *tloc = t;
+    }
+    return t;
+}
+
+int clock_gettime(int clock, struct timespec *tp)
+{
+    if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    uint64_t cycles = (((uint64_t)hi << 32) | lo) - VDSO->vd_tsc_boot;
+    uint64_t ns =
+        (uint64_t)(((unsigned __int128)cycles * VDSO->vd_tsc_mult) >> 32);
+    tp->tv_sec = ns / 1000000000;
+    tp->tv_nsec = (long)(ns % 1000000000);
+    if (clock == CLOCK_REALTIME)
+    {
+        tp->tv_sec += VDSO->vd_boot_time;
+    }
+    return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    nanosleep_args_t args;
+    args.nsa_req = req;
+    args.nsa_rem = rem;
+    return (int)trap(SYS_nanosleep, (uintptr_t)&args);
+}
 
-time_t time(time_t *tloc) { return (time_t)trap(SYS_time, (uintptr_t)tloc); }
+long times(struct tms *buf) { return trap(SYS_times, (uintptr_t)buf); }
 
 long usleep(useconds_t usec)
 {
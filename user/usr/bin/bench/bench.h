@@ -0,0 +1,151 @@
+#pragma once
+
+/*
+ * Helpers shared by the benchmark programs. Operations are timed one by one
+ * with the TSC, and each set of samples is printed as one line of key=value
+ * pairs, in the same form as the kernel's "bench" kshell command:
+ *
+ *   bench name=<name> n=<samples> min=<c> p50=<c> p90=<c> p99=<c> max=<c>
+ *       ops_per_s=<n> [kb_per_s=<n>]
+ *
+ * with the times in TSC cycles. Every program first prints
+ *
+ *   bench name=tsc khz=<TSC frequency>
+ *
+ * measured against CLOCK_MONOTONIC, which the rates are worked out from.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_CALIBRATE_US 100000
+
+typedef struct bench_samples
+{
+    const char *bs_name;
+    size_t bs_n;
+    size_t bs_max;
+    uint64_t *bs_samples;
+} bench_samples_t;
+
+static uint64_t bench_khz;
+
+static inline uint64_t bench_rdtsc()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t bench_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Measures and prints the TSC frequency */
+static inline void bench_start()
+{
+    uint64_t start_ns = bench_ns();
+    uint64_t start = bench_rdtsc();
+    usleep(BENCH_CALIBRATE_US);
+    uint64_t cycles = bench_rdtsc() - start;
+    bench_khz = cycles * 1000000 / (bench_ns() - start_ns);
+    printf("bench name=tsc khz=%lu\n", bench_khz);
+}
+
+/* Exits if there is no memory for max samples */
+static inline void bench_init(bench_samples_t *bs, const char *name,
+                              size_t max)
+{
+    bs->bs_name = name;
+    bs->bs_n = 0;
+    bs->bs_max = max;
+    bs->bs_samples = malloc(max * sizeof(uint64_t));
+    if (!bs->bs_samples)
+    {
+        fprintf(stderr, "%s: no memory for %lu samples\n", name, max);
+        exit(1);
+    }
+}
+
+static inline void bench_add(bench_samples_t *bs, uint64_t cycles)
+{
+    if (bs->bs_n < bs->bs_max)
+    {
+        bs->bs_samples[bs->bs_n++] = cycles;
+    }
+}
+
+static inline void bench_sort(uint64_t *samples, size_t n)
+{
+    /* Shell sort, with gaps 1, 4, 13, 40, ... */
+    size_t gap = 1;
+    while (gap < n / 3)
+    {
+        gap = gap * 3 + 1;
+    }
+    for (; gap; gap /= 3)
+    {
+        for (size_t i = gap; i < n; i++)
+        {
+            uint64_t s = samples[i];
+            size_t j = i;
+            for (; j >= gap && samples[j - gap] > s; j -= gap)
+            {
+                samples[j] = samples[j - gap];
+            }
+            samples[j] = s;
+        }
+    }
+}
+
+/* The pct'th percentile of sorted samples, nearest rank */
+static inline uint64_t bench_percentile(uint64_t *samples, size_t n,
+                                        size_t pct)
+{
+    size_t rank = (n * pct + 99) / 100;
+    return samples[rank ? rank - 1 : 0];
+}
+
+/*
+ * Prints the samples and frees them. bytes is how much each operation moved,
+ * or 0 if a rate in bytes means nothing for it.
+ */
+static inline void bench_report(bench_samples_t *bs, size_t bytes)
+{
+    uint64_t *s = bs->bs_samples;
+    size_t n = bs->bs_n;
+    if (!n)
+    {
+        printf("bench name=%s n=0\n", bs->bs_name);
+        free(s);
+        return;
+    }
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        total += s[i];
+    }
+    bench_sort(s, n);
+    uint64_t us = total * 1000 / bench_khz;
+    us = us ? us : 1;
+    printf("bench name=%s n=%lu min=%lu p50=%lu p90=%lu p99=%lu max=%lu "
+           "ops_per_s=%lu",
+           bs->bs_name, n, s[0], bench_percentile(s, n, 50),
+           bench_percentile(s, n, 90), bench_percentile(s, n, 99), s[n - 1],
+           n * 1000000 / us);
+    if (bytes)
+    {
+        printf(" kb_per_s=%lu", n * bytes * 1000000 / us / 1024);
+    }
+    printf("\n");
+    free(s);
+    bs->bs_samples = NULL;
+}
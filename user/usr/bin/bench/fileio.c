@@ -0,0 +1,87 @@
+/*
+ * Measures file bandwidth on the root file system (s5fs): a FILEIO_SIZE-byte
+ * file in /tmp is written and then read FILEIO_CHUNK bytes at a time, first
+ * in order and then at random chunk-aligned offsets. Each read() or write()
+ * is timed on its own. The file is written first, so reads come from the
+ * page cache unless it has been evicted; sync() is timed after the writes.
+ */
+
+#include <fcntl.h>
+
+#include "bench.h"
+
+#define FILEIO_PATH "/tmp/bench.fileio"
+#define FILEIO_CHUNK 4096
+#define FILEIO_SIZE (2 * 1024 * 1024)
+#define FILEIO_CHUNKS (FILEIO_SIZE / FILEIO_CHUNK)
+
+static char buf[FILEIO_CHUNK];
+
+/*
+ * Reads or writes every chunk of the file once, in order or at random, and
+ * reports it as name. Returns 0, or -1 if an operation failed.
+ */
+static int fileio_pass(int fd, const char *name, int forwrite, int random)
+{
+    bench_samples_t bs;
+    bench_init(&bs, name, FILEIO_CHUNKS);
+    if (!random && lseek(fd, 0, SEEK_SET) < 0)
+    {
+        fprintf(stderr, "lseek: %s\n", strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < FILEIO_CHUNKS; i++)
+    {
+        uint64_t start = bench_rdtsc();
+        if (random &&
+            lseek(fd, (off_t)(rand() % FILEIO_CHUNKS) * FILEIO_CHUNK,
+                  SEEK_SET) < 0)
+        {
+            fprintf(stderr, "lseek: %s\n", strerror(errno));
+            return -1;
+        }
+        ssize_t ret = forwrite ? write(fd, buf, FILEIO_CHUNK)
+                               : read(fd, buf, FILEIO_CHUNK);
+        if (ret != FILEIO_CHUNK)
+        {
+            fprintf(stderr, "%s: %s\n", name,
+                    ret < 0 ? strerror(errno) : "short transfer");
+            return -1;
+        }
+        bench_add(&bs, bench_rdtsc() - start);
+    }
+    bench_report(&bs, FILEIO_CHUNK);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_start();
+
+    int fd = open(FILEIO_PATH, O_RDWR | O_CREAT | O_TRUNC, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "open %s: %s\n", FILEIO_PATH, strerror(errno));
+        return 1;
+    }
+    memset(buf, 'x', sizeof(buf));
+    srand(1);
+
+    int ret = fileio_pass(fd, "file_seq_write", 1, 0);
+    if (!ret)
+    {
+        bench_samples_t bs;
+        bench_init(&bs, "file_sync", 1);
+        uint64_t start = bench_rdtsc();
+        sync();
+        bench_add(&bs, bench_rdtsc() - start);
+        bench_report(&bs, FILEIO_SIZE);
+    }
+    ret = ret ? ret : fileio_pass(fd, "file_seq_read", 0, 0);
+    ret = ret ? ret : fileio_pass(fd, "file_rand_read", 0, 1);
+    ret = ret ? ret : fileio_pass(fd, "file_rand_write", 1, 1);
+
+    close(fd);
+    unlink(FILEIO_PATH);
+    return ret ? 1 : 0;
+}
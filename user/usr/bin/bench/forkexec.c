@@ -0,0 +1,71 @@
+/*
+ * Times fork() followed by waitpid() for a child that exits at once, and
+ * fork(), execve() and waitpid() for a child that runs this program again
+ * with "-c", which makes it exit as soon as it starts.
+ */
+
+#include "bench.h"
+
+#define FORKEXEC_ITERS 100
+#define FORKEXEC_PATH "/usr/bin/bench/forkexec"
+
+static char *const child_argv[] = {FORKEXEC_PATH, "-c", NULL};
+static char *const child_envp[] = {NULL};
+
+/* Returns the cycles from fork() to the child having been reaped, or 0 */
+static uint64_t fork_wait(int exec)
+{
+    uint64_t start = bench_rdtsc();
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "fork: %s\n", strerror(errno));
+        return 0;
+    }
+    if (!pid)
+    {
+        if (exec)
+        {
+            execve(FORKEXEC_PATH, child_argv, child_envp);
+        }
+        exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return bench_rdtsc() - start;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 2 && !strcmp(argv[1], "-c"))
+    {
+        return 0;
+    }
+    bench_start();
+
+    bench_samples_t bs;
+    bench_init(&bs, "fork_wait", FORKEXEC_ITERS);
+    for (size_t i = 0; i < FORKEXEC_ITERS; i++)
+    {
+        uint64_t cycles = fork_wait(0);
+        if (!cycles)
+        {
+            return 1;
+        }
+        bench_add(&bs, cycles);
+    }
+    bench_report(&bs, 0);
+
+    bench_init(&bs, "fork_exec_wait", FORKEXEC_ITERS);
+    for (size_t i = 0; i < FORKEXEC_ITERS; i++)
+    {
+        uint64_t cycles = fork_wait(1);
+        if (!cycles)
+        {
+            return 1;
+        }
+        bench_add(&bs, cycles);
+    }
+    bench_report(&bs, 0);
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Measures metadata operations: METADATA_FILES empty files are created in a
+ * fresh directory and then unlinked, each open(O_CREAT) and close(), and
+ * each unlink(), timed on its own.
+ */
+
+#include <fcntl.h>
+
+#include "bench.h"
+
+#define METADATA_DIR "/tmp/bench.metadata"
+#define METADATA_FILES 500
+#define METADATA_NAME_LEN 64
+
+static void metadata_name(char *name, size_t i)
+{
+    snprintf(name, METADATA_NAME_LEN, "%s/f%lu", METADATA_DIR, i);
+}
+
+int main(int argc, char **argv)
+{
+    bench_start();
+
+    if (mkdir(METADATA_DIR, 0) < 0)
+    {
+        fprintf(stderr, "mkdir %s: %s\n", METADATA_DIR, strerror(errno));
+        return 1;
+    }
+
+    char name[METADATA_NAME_LEN];
+    bench_samples_t bs;
+    size_t made;
+    bench_init(&bs, "file_create", METADATA_FILES);
+    for (made = 0; made < METADATA_FILES; made++)
+    {
+        metadata_name(name, made);
+        uint64_t start = bench_rdtsc();
+        int fd = open(name, O_WRONLY | O_CREAT, 0);
+        if (fd < 0)
+        {
+            fprintf(stderr, "open %s: %s\n", name, strerror(errno));
+            break;
+        }
+        close(fd);
+        bench_add(&bs, bench_rdtsc() - start);
+    }
+    bench_report(&bs, 0);
+
+    bench_init(&bs, "file_unlink", METADATA_FILES);
+    for (size_t i = 0; i < made; i++)
+    {
+        metadata_name(name, i);
+        uint64_t start = bench_rdtsc();
+        if (unlink(name) < 0)
+        {
+            fprintf(stderr, "unlink %s: %s\n", name, strerror(errno));
+            continue;
+        }
+        bench_add(&bs, bench_rdtsc() - start);
+    }
+    bench_report(&bs, 0);
+
+    rmdir(METADATA_DIR);
+    return made < METADATA_FILES;
+}
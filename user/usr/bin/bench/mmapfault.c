@@ -0,0 +1,92 @@
+/*
+ * Measures page fault handling from userland: each page of a fresh
+ * MAP_PRIVATE | MAP_ANON mapping is written once, and each page of a
+ * private mapping of /hamlet is read once. Every first touch is a fault,
+ * timed on its own.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "bench.h"
+
+#define MMAP_PAGE_SIZE 4096
+#define MMAP_ANON_PAGES 1024
+#define MMAP_FILE_PATH "/hamlet"
+#define MMAP_FILE_ROUNDS 16
+
+static int mmap_anon()
+{
+    size_t len = MMAP_ANON_PAGES * MMAP_PAGE_SIZE;
+    char *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        return -1;
+    }
+    bench_samples_t bs;
+    bench_init(&bs, "mmap_anon_write_fault", MMAP_ANON_PAGES);
+    for (size_t i = 0; i < MMAP_ANON_PAGES; i++)
+    {
+        uint64_t start = bench_rdtsc();
+        addr[i * MMAP_PAGE_SIZE] = 1;
+        bench_add(&bs, bench_rdtsc() - start);
+    }
+    bench_report(&bs, 0);
+    munmap(addr, len);
+    return 0;
+}
+
+/* The file stays in the page cache after the first round, so these are
+ * minor faults */
+static int mmap_file()
+{
+    int fd = open(MMAP_FILE_PATH, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "open %s: %s\n", MMAP_FILE_PATH, strerror(errno));
+        return -1;
+    }
+    size_t npages = lseek(fd, 0, SEEK_END) / MMAP_PAGE_SIZE;
+    size_t len = npages * MMAP_PAGE_SIZE;
+    if (!npages)
+    {
+        fprintf(stderr, "%s is smaller than a page\n", MMAP_FILE_PATH);
+        close(fd);
+        return -1;
+    }
+
+    bench_samples_t bs;
+    bench_init(&bs, "mmap_file_read_fault", npages * MMAP_FILE_ROUNDS);
+    for (size_t round = 0; round < MMAP_FILE_ROUNDS; round++)
+    {
+        volatile char *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            fprintf(stderr, "mmap: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        for (size_t i = 0; i < npages; i++)
+        {
+            uint64_t start = bench_rdtsc();
+            (void)addr[i * MMAP_PAGE_SIZE];
+            bench_add(&bs, bench_rdtsc() - start);
+        }
+        munmap((void *)addr, len);
+    }
+    bench_report(&bs, 0);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_start();
+    if (mmap_anon() || mmap_file())
+    {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Measures pipe bandwidth: a child writes PIPE_TOTAL bytes into a pipe in
+ * PIPE_CHUNK-byte writes, and the parent times how long each PIPE_CHUNK
+ * bytes take to read.
+ */
+
+#include "bench.h"
+
+#define PIPE_CHUNK 4096
+#define PIPE_TOTAL (8 * 1024 * 1024)
+
+static char buf[PIPE_CHUNK];
+
+int main(int argc, char **argv)
+{
+    bench_start();
+
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        fprintf(stderr, "pipe: %s\n", strerror(errno));
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "fork: %s\n", strerror(errno));
+        return 1;
+    }
+    if (!pid)
+    {
+        close(fds[0]);
+        memset(buf, 'x', sizeof(buf));
+        for (size_t done = 0; done < PIPE_TOTAL; done += PIPE_CHUNK)
+        {
+            if (write(fds[1], buf, PIPE_CHUNK) != PIPE_CHUNK)
+            {
+                exit(1);
+            }
+        }
+        exit(0);
+    }
+    close(fds[1]);
+
+    bench_samples_t bs;
+    bench_init(&bs, "pipe_read", PIPE_TOTAL / PIPE_CHUNK);
+    for (size_t done = 0; done < PIPE_TOTAL; done += PIPE_CHUNK)
+    {
+        uint64_t start = bench_rdtsc();
+        size_t got = 0;
+        while (got < PIPE_CHUNK)
+        {
+            ssize_t ret = read(fds[0], buf + got, PIPE_CHUNK - got);
+            if (ret <= 0)
+            {
+                fprintf(stderr, "read: %s\n", ret ? strerror(errno) : "EOF");
+                return 1;
+            }
+            got += ret;
+        }
+        bench_add(&bs, bench_rdtsc() - start);
+    }
+    bench_report(&bs, PIPE_CHUNK);
+
+    int status;
+    waitpid(pid, &status, 0);
+    close(fds[0]);
+    return status;
+}
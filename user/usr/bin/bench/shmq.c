@@ -0,0 +1,68 @@
+/*
+ * Measures shared memory message queue bandwidth, for comparison with
+ * bench/pipe: a child sends SHMQ_TOTAL bytes through a queue in
+ * SHMQ_CHUNK-byte messages, and the parent times how long each message takes
+ * to receive.
+ */
+
+#include <fcntl.h>
+#include <shm.h>
+
+#include "bench.h"
+
+#define SHMQ_NAME "/bench_shmq"
+#define SHMQ_CHUNK 4096
+#define SHMQ_NMSGS 16
+#define SHMQ_TOTAL (8 * 1024 * 1024)
+
+int main(int argc, char **argv)
+{
+    bench_start();
+
+    shm_unlink(SHMQ_NAME);
+    shmq_t *q = shmq_open(SHMQ_NAME, O_CREAT, SHMQ_CHUNK, SHMQ_NMSGS);
+    if (!q)
+    {
+        fprintf(stderr, "shmq_open: %s\n", strerror(errno));
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "fork: %s\n", strerror(errno));
+        return 1;
+    }
+    if (!pid)
+    {
+        for (size_t done = 0; done < SHMQ_TOTAL; done += SHMQ_CHUNK)
+        {
+            char *msg = shmq_reserve(q);
+            memset(msg, 'x', SHMQ_CHUNK);
+            shmq_send(q, msg, SHMQ_CHUNK);
+        }
+        exit(0);
+    }
+
+    bench_samples_t bs;
+    bench_init(&bs, "shmq_receive", SHMQ_TOTAL / SHMQ_CHUNK);
+    for (size_t done = 0; done < SHMQ_TOTAL; done += SHMQ_CHUNK)
+    {
+        uint64_t start = bench_rdtsc();
+        size_t len;
+        char *msg = shmq_receive(q, &len);
+        shmq_release(q, msg);
+        bench_add(&bs, bench_rdtsc() - start);
+        if (len != SHMQ_CHUNK)
+        {
+            fprintf(stderr, "shmq_receive: %lu bytes\n", (unsigned long)len);
+            return 1;
+        }
+    }
+    bench_report(&bs, SHMQ_CHUNK);
+
+    int status;
+    waitpid(pid, &status, 0);
+    shmq_close(q);
+    shm_unlink(SHMQ_NAME);
+    return status;
+}
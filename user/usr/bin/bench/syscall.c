@@ -0,0 +1,43 @@
+/*
+ * Times the round trip into the kernel and back for getpid(), which does
+ * next to nothing once there, and for a write() to /dev/null.
+ */
+
+#include <fcntl.h>
+
+#include "bench.h"
+
+#define SYSCALL_ITERS 10000
+
+int main(int argc, char **argv)
+{
+    bench_start();
+
+    bench_samples_t bs;
+    bench_init(&bs, "syscall_getpid", SYSCALL_ITERS);
+    for (size_t i = 0; i < SYSCALL_ITERS; i++)
+    {
+        uint64_t start = bench_rdtsc();
+        getpid();
+        bench_add(&bs, bench_rdtsc() - start);
+    }
+    bench_report(&bs, 0);
+
+    int fd = open("/dev/null", O_WRONLY, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "open /dev/null: %s\n", strerror(errno));
+        return 1;
+    }
+    char c = 0;
+    bench_init(&bs, "syscall_write_null", SYSCALL_ITERS);
+    for (size_t i = 0; i < SYSCALL_ITERS; i++)
+    {
+        uint64_t start = bench_rdtsc();
+        write(fd, &c, 1);
+        bench_add(&bs, bench_rdtsc() - start);
+    }
+    bench_report(&bs, 0);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Reads the kernel's trace records from /dev/trace (or the file given, which
+ * holds records saved from it) and prints them as one timeline, in TSC
+ * cycles since the first record, with the time since the previous one.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <weenix/trace.h>
+
+#define TRACE_MAX_RECORDS 4096
+
+static trace_record_t records[TRACE_MAX_RECORDS];
+
+static const char *event_names[] = TRACE_EVENT_NAMES;
+
+/*
+ * Each core's records arrive in order, but the cores' runs are interleaved;
+ * insertion sort is quick on such nearly sorted input.
+ */
+static void sort_records(trace_record_t *recs, size_t n)
+{
+    for (size_t i = 1; i < n; i++)
+    {
+        trace_record_t rec = recs[i];
+        size_t j = i;
+        for (; j && recs[j - 1].tr_time > rec.tr_time; j--)
+        {
+            recs[j] = recs[j - 1];
+        }
+        recs[j] = rec;
+    }
+}
+
+static void print_record(trace_record_t *rec)
+{
+    const char *name =
+        rec->tr_event < TRACE_NEVENTS ? event_names[rec->tr_event] : "unknown";
+    uint64_t *args = rec->tr_args;
+    printf("C%u %-13s ", rec->tr_core, name);
+    switch (rec->tr_event)
+    {
+    case TRACE_SYSCALL:
+        printf("sysnum %lu ret %ld cycles %lu\n", args[0], (long)args[1],
+               args[2]);
+        break;
+    case TRACE_SWITCH:
+    case TRACE_WAKEUP:
+        printf("pid %lu tid %lu\n", args[0], args[1]);
+        break;
+    case TRACE_PAGEFAULT:
+        printf("vaddr 0x%lx cause %lu ret %ld\n", args[0], args[1],
+               (long)args[2]);
+        break;
+    case TRACE_PFRAME_MISS:
+        printf("mobj 0x%lx page %lu\n", args[0], args[1]);
+        break;
+    case TRACE_PFRAME_FILL:
+        printf("mobj 0x%lx page %lu ret %ld\n", args[0], args[1],
+               (long)args[2]);
+        break;
+    case TRACE_DISK_SUBMIT:
+        printf("block %lu count %lu %s\n", args[0], args[1],
+               args[2] ? "write" : "read");
+        break;
+    case TRACE_DISK_COMPLETE:
+        printf("block %lu count %lu slot %lu\n", args[0], args[1], args[2]);
+        break;
+    case TRACE_LOOKUP:
+    {
+        char prefix[sizeof(uint64_t) + 1] = {0};
+        memcpy(prefix, &args[1], sizeof(uint64_t));
+        printf("dir %lu name %s ret %ld\n", args[0], prefix, (long)args[2]);
+        break;
+    }
+    default:
+        printf("0x%lx 0x%lx 0x%lx\n", args[0], args[1], args[2]);
+        break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2)
+    {
+        printf("usage: trace [file]\n");
+        return 1;
+    }
+    const char *path = argc == 2 ? argv[1] : "/dev/trace";
+    int fd = open(path, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        printf("trace: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    size_t n = 0;
+    ssize_t len;
+    while (n < TRACE_MAX_RECORDS &&
+           (len = read(fd, &records[n],
+                       (TRACE_MAX_RECORDS - n) * sizeof(trace_record_t))) > 0)
+    {
+        n += len / sizeof(trace_record_t);
+    }
+    close(fd);
+
+    sort_records(records, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        printf("%12lu %10lu ", records[i].tr_time - records[0].tr_time,
+               i ? records[i].tr_time - records[i - 1].tr_time : 0UL);
+        print_record(&records[i]);
+    }
+    return 0;
+}